@@ -29,17 +29,26 @@
 #define LIBRPC_LIBRPC_HH
 
 #include <functional>
+#include <future>
 #include <string>
 #include <vector>
 #include <map>
+#if __cplusplus >= 201703L
+#include <string_view>
+#endif
+#if __cplusplus >= 202002L
+#include <span>
+#endif
 #include <rpc/object.h>
 #include <rpc/connection.h>
 #include <rpc/client.h>
 #include <rpc/service.h>
+#include "librpc_marshal.hh"
 
 namespace librpc
 {
 	class Call;
+	class BatchRange;
 	class RemoteInterface;
 
 	class Exception: public std::runtime_error
@@ -100,13 +109,42 @@ namespace librpc
 		Object(const char *value);
 		Object(void *data, size_t len, rpc_binary_destructor_t dtor);
 		Object(const string_type &value);
+#if __cplusplus >= 201703L
+		Object(std::string_view value);
+#endif
 		Object(const map_type &dict);
+		Object(map_type &&dict);
 		Object(const vector_type &array);
+		Object(vector_type &&array);
+
+		/**
+		 * Builds an array, sized for all of @p list up front.
+		 */
 		Object(std::initializer_list<Object> list);
+
+		/**
+		 * Builds a dictionary, sized for all of @p list up front.
+		 */
 		Object(std::initializer_list<std::pair<string_type, Object>> list);
-		virtual ~Object();
+		~Object();
 
+		Object &operator=(const Object &other);
+		Object &operator=(Object &&other) noexcept;
+
+		/**
+		 * Takes a new reference on @p other.
+		 */
 		static Object wrap(rpc_object_t other);
+
+		/**
+		 * Takes over the reference the caller holds on @p other.
+		 */
+		static Object steal(rpc_object_t other);
+
+		/**
+		 * Gives up the wrapped object, reference included.
+		 */
+		rpc_object_t release_ownership();
 		rpc_type_t type();
 	    	Object copy();
 		void retain();
@@ -116,7 +154,9 @@ namespace librpc
 	    	Object get(const std::string &key, const Object &def = Object());
 		Object get(size_t index, const Object &def = Object());
 		void push(const Object &value);
+		void push(Object &&value);
 		void set(const std::string &key, const Object &value);
+		void set(const std::string &key, Object &&value);
 		int get_error_code();
 		std::string get_error_message();
 		vector_type as_vec() { return (vector_type)*this; }
@@ -132,7 +172,24 @@ namespace librpc
 	    	Object operator[](const std::string &key);
 	    	Object operator[](size_t index);
 
+#if __cplusplus >= 201703L
+		/**
+		 * Borrows the string, valid for as long as the object is.
+		 */
+		std::string_view as_string_view() const;
+#endif
+#if __cplusplus >= 202002L
+		/**
+		 * Borrows the binary buffer, valid for as long as the
+		 * object is.
+		 */
+		std::span<const uint8_t> as_bytes() const;
+#endif
+
 	private:
+		struct adopt_tag {};
+		Object(rpc_object_t value, adopt_tag) noexcept;
+
 	    	rpc_object_t m_value;
 	};
 
@@ -151,6 +208,43 @@ namespace librpc
 		bool m_ended;
 	};
 
+	/**
+	 * Walks a streaming call a batch at a time: each step hands out
+	 * every fragment that has already arrived, up to the batch size,
+	 * and only blocks when none has.
+	 */
+	class BatchIterator
+	{
+	public:
+		friend BatchRange;
+
+		bool operator!=(const BatchIterator &other);
+		const std::vector<Object> &operator*() const;
+		const BatchIterator &operator++();
+
+	private:
+		BatchIterator(Call *call, size_t size, bool ended);
+		void fill();
+		Call *m_call;
+		size_t m_size;
+		bool m_ended;
+		std::vector<Object> m_batch;
+	};
+
+	class BatchRange
+	{
+	public:
+		friend Call;
+
+		BatchIterator begin();
+		BatchIterator end();
+
+	private:
+		BatchRange(Call *call, size_t size);
+		Call *m_call;
+		size_t m_size;
+	};
+
 	class Call
 	{
 	public:
@@ -160,14 +254,36 @@ namespace librpc
 	    	void resume(bool sync = false);
 		void wait();
 	    	void abort();
+
+		/**
+		 * Sets the streaming window, see rpc_call_set_prefetch().
+		 * Iterating without setting one picks a window on its own.
+		 */
+		void set_prefetch(size_t nitems);
 	    	CallIterator begin();
 	    	CallIterator end();
 
+		/**
+		 * Iterates over a streaming result in batches of up to
+		 * @p size fragments:
+		 *
+		 *	for (auto &batch : call.batches(1024))
+		 *		for (auto &item : batch)
+		 *			...
+		 *
+		 * Unless set_prefetch() was called, the window is set to
+		 * @p size so a whole batch can arrive without waiting
+		 * for more credit.
+		 */
+		BatchRange batches(size_t size);
+
 		static Call wrap(rpc_call_t other);
 
 	private:
 		Call() = default;
+		void start_stream(size_t prefetch);
 	    	rpc_call_t m_call;
+		bool m_prefetch_set = false;
 	};
 
 	class Connection
@@ -189,6 +305,37 @@ namespace librpc
 		    const std::string &interface,
 		    std::function<bool (Call)> &callback);
 
+		/**
+		 * Calls a method and returns a future for its result.
+		 *
+		 * The future is fulfilled on the thread that receives
+		 * the response; errors are delivered as Exception.
+		 */
+		std::future<Object> call_future(const std::string &name,
+		    const std::vector<Object> &args,
+		    const std::string &path = "/",
+		    const std::string &interface = RPC_DEFAULT_INTERFACE);
+
+		/**
+		 * Calls a method with arguments marshalled by
+		 * librpc::serialize(), without building Object trees.
+		 */
+		template <typename... Args>
+		Call call_typed(const std::string &path,
+		    const std::string &interface, const std::string &name,
+		    const Args &...args);
+
+		/**
+		 * Same as call_typed(), but waits for the call to finish
+		 * and decodes its result into R.
+		 */
+		template <typename R, typename... Args>
+		R call_sync_typed(const std::string &path,
+		    const std::string &interface, const std::string &name,
+		    const Args &...args);
+
+		rpc_connection_t unwrap() const;
+
 	private:
 		rpc_connection_t m_connection;
 	};
@@ -203,6 +350,35 @@ namespace librpc
 		rpc_client_t m_client;
 	};
 
+	/**
+	 * Set of connections to replicas of one service, see
+	 * rpc_client_pool_create().
+	 */
+	class ClientPool
+	{
+	public:
+		ClientPool(const std::vector<std::string> &uris,
+		    size_t size = 0,
+		    rpc_client_pool_policy_t policy =
+		    RPC_CLIENT_POOL_LEAST_OUTSTANDING,
+		    const Object &params = Object());
+		ClientPool(const ClientPool &other) = delete;
+		~ClientPool();
+
+		Object call_sync(const std::string &name,
+		    const std::vector<Object> &args,
+		    const std::string &path = "/",
+		    const std::string &interface = RPC_DEFAULT_INTERFACE);
+
+		void set_hedged(const std::string &name, bool hedged = true,
+		    const std::string &interface = RPC_DEFAULT_INTERFACE);
+
+		rpc_client_pool_t unwrap() const;
+
+	private:
+		rpc_client_pool_t m_pool;
+	};
+
 	class RemoteInstance
 	{
 	public:
@@ -215,6 +391,10 @@ namespace librpc
 	    std::string m_path;
 	};
 
+	/**
+	 * Properties of a remote interface are cached on the connection
+	 * and kept up to date through Observable.changed events.
+	 */
 	class RemoteInterface
 	{
 	public:
@@ -228,6 +408,63 @@ namespace librpc
 		RemoteInstance *m_instance;
 		std::string m_name;
 	};
+
+	template <typename... Args>
+	Call
+	Connection::call_typed(const std::string &path,
+	    const std::string &interface, const std::string &name,
+	    const Args &...args)
+	{
+		rpc_object_t wrapped = serialize_args(args...);
+		rpc_call_t call;
+
+		call = rpc_connection_call(m_connection, path.c_str(),
+		    interface.c_str(), name.c_str(), wrapped, nullptr);
+		rpc_release(wrapped);
+
+		if (call == nullptr)
+			throw (Exception::last_error());
+
+		return (Call::wrap(call));
+	}
+
+	template <typename R, typename... Args>
+	R
+	Connection::call_sync_typed(const std::string &path,
+	    const std::string &interface, const std::string &name,
+	    const Args &...args)
+	{
+		rpc_object_t wrapped = serialize_args(args...);
+		rpc_object_t result;
+		rpc_call_t call;
+		R ret;
+
+		call = rpc_connection_call(m_connection, path.c_str(),
+		    interface.c_str(), name.c_str(), wrapped, nullptr);
+		rpc_release(wrapped);
+
+		if (call == nullptr)
+			throw (Exception::last_error());
+
+		rpc_call_wait(call);
+		result = rpc_call_result(call);
+
+		if (result != nullptr && rpc_is_error(result)) {
+			Exception e(rpc_error_get_code(result),
+			    rpc_error_get_message(result));
+
+			rpc_call_free(call);
+			throw (e);
+		}
+
+		if (result == nullptr || !deserialize(result, ret)) {
+			rpc_call_free(call);
+			throw (Exception(EINVAL, "Unexpected result type"));
+		}
+
+		rpc_call_free(call);
+		return (ret);
+	}
 };
 
 #endif /* LIBRPC_LIBRPC_HH */
\ No newline at end of file
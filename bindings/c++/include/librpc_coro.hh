@@ -0,0 +1,259 @@
+/*
+ * Copyright 2015-2017 Two Pore Guys, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef LIBRPC_CORO_HH
+#define LIBRPC_CORO_HH
+
+#if __cplusplus >= 202002L
+
+#include <cerrno>
+#include <coroutine>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+#include <rpc/connection.h>
+#include "librpc.hh"
+
+/**
+ * co_await support for calls, built on rpc_call_await(). Coroutines
+ * suspend instead of blocking a thread, so one thread can keep any
+ * number of calls in flight:
+ *
+ *	librpc::AsyncCall call = librpc::async_call(conn, "ping", {});
+ *	librpc::Object result = co_await call;
+ *
+ * Without an executor, coroutines resume on the thread that delivers
+ * the response. Pass rpc_executor_main_context() to resume them on a
+ * GLib main loop instead.
+ *
+ * Needs C++20; the rest of the binding builds as C++14.
+ */
+namespace librpc
+{
+	namespace detail
+	{
+		inline void
+		await_update(rpc_call_t call, rpc_executor_t executor,
+		    std::coroutine_handle<> handle)
+		{
+			int ret;
+
+			ret = rpc_call_await(call, executor, ^(rpc_call_t c) {
+				/* Stream setup is not worth a wakeup */
+				if (rpc_call_status(c) == RPC_CALL_STREAM_START) {
+					rpc_call_continue(c, false);
+					await_update(c, executor, handle);
+					return;
+				}
+
+				handle.resume();
+			});
+
+			if (ret != 0)
+				throw (Exception::last_error());
+		}
+
+		inline Object
+		take_result(rpc_call_t call)
+		{
+			Object result = Object::wrap(rpc_call_result(call));
+
+			switch (rpc_call_status(call)) {
+			case RPC_CALL_ERROR:
+				throw (Exception(result.get_error_code(),
+				    result.get_error_message()));
+
+			case RPC_CALL_ABORTED:
+				throw (Exception(ECANCELED, "Call aborted"));
+
+			default:
+				return (result);
+			}
+		}
+	}
+
+	/**
+	 * Owning handle of an outbound call that can be awaited for its
+	 * result, or iterated with next() if it streams.
+	 */
+	class AsyncCall
+	{
+	public:
+		explicit AsyncCall(rpc_call_t call,
+		    rpc_executor_t executor = nullptr):
+		    m_call(call), m_executor(executor)
+		{
+		}
+
+		AsyncCall(AsyncCall &&other) noexcept:
+		    m_call(std::exchange(other.m_call, nullptr)),
+		    m_executor(other.m_executor),
+		    m_consumed(other.m_consumed),
+		    m_done(other.m_done)
+		{
+		}
+
+		AsyncCall(const AsyncCall &) = delete;
+		AsyncCall &operator=(const AsyncCall &) = delete;
+
+		~AsyncCall()
+		{
+			if (m_call != nullptr)
+				rpc_call_free(m_call);
+		}
+
+		bool
+		await_ready() const
+		{
+			return (rpc_call_status(m_call) != RPC_CALL_IN_PROGRESS &&
+			    rpc_call_status(m_call) != RPC_CALL_STREAM_START);
+		}
+
+		void
+		await_suspend(std::coroutine_handle<> handle)
+		{
+			detail::await_update(m_call, m_executor, handle);
+		}
+
+		Object
+		await_resume()
+		{
+			return (detail::take_result(m_call));
+		}
+
+		/**
+		 * Awaitable for the next fragment of a streaming call,
+		 * yielding std::nullopt once the stream ends.
+		 */
+		class Next
+		{
+		public:
+			explicit Next(AsyncCall *call): m_parent(call)
+			{
+			}
+
+			bool
+			await_ready()
+			{
+				rpc_call_t call = m_parent->m_call;
+
+				/* Hand the previous fragment back first */
+				if (m_parent->m_consumed) {
+					m_parent->m_consumed = false;
+					rpc_call_continue(call, false);
+				}
+
+				while (rpc_call_status(call) ==
+				    RPC_CALL_STREAM_START)
+					rpc_call_continue(call, false);
+
+				return (rpc_call_status(call) !=
+				    RPC_CALL_IN_PROGRESS);
+			}
+
+			void
+			await_suspend(std::coroutine_handle<> handle)
+			{
+				detail::await_update(m_parent->m_call,
+				    m_parent->m_executor, handle);
+			}
+
+			std::optional<Object>
+			await_resume()
+			{
+				rpc_call_t call = m_parent->m_call;
+
+				switch (rpc_call_status(call)) {
+				case RPC_CALL_MORE_AVAILABLE:
+					m_parent->m_consumed = true;
+					return (Object::wrap(
+					    rpc_call_result(call)));
+
+				case RPC_CALL_DONE:
+					if (m_parent->m_done)
+						return (std::nullopt);
+
+					m_parent->m_done = true;
+					return (Object::wrap(
+					    rpc_call_result(call)));
+
+				case RPC_CALL_ENDED:
+					return (std::nullopt);
+
+				default:
+					return (detail::take_result(call));
+				}
+			}
+
+		private:
+			AsyncCall *m_parent;
+		};
+
+		Next
+		next()
+		{
+			return (Next(this));
+		}
+
+		rpc_call_t
+		unwrap() const
+		{
+			return (m_call);
+		}
+
+	private:
+		rpc_call_t m_call;
+		rpc_executor_t m_executor;
+		bool m_consumed = false;
+		bool m_done = false;
+	};
+
+	/**
+	 * Starts a call without waiting for it; co_await the returned
+	 * handle for its result.
+	 */
+	inline AsyncCall
+	async_call(Connection &conn, const std::string &name,
+	    const std::vector<Object> &args, const std::string &path = "/",
+	    const std::string &interface = RPC_DEFAULT_INTERFACE,
+	    rpc_executor_t executor = nullptr)
+	{
+		Object wrapped(args);
+		rpc_call_t call;
+
+		call = rpc_connection_call(conn.unwrap(), path.c_str(),
+		    interface.c_str(), name.c_str(), wrapped.unwrap(), nullptr);
+		if (call == nullptr)
+			throw (Exception::last_error());
+
+		return (AsyncCall(call, executor));
+	}
+}
+
+#endif /* __cplusplus >= 202002L */
+#endif /* LIBRPC_CORO_HH */
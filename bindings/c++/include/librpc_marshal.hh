@@ -0,0 +1,349 @@
+/*
+ * Copyright 2015-2017 Two Pore Guys, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef LIBRPC_MARSHAL_HH
+#define LIBRPC_MARSHAL_HH
+
+#include <cerrno>
+#include <map>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <rpc/object.h>
+
+/**
+ * Declares the fields of a user struct for librpc::serialize() and
+ * librpc::deserialize(). Must be used at global scope:
+ *
+ *	struct point { int64_t x; int64_t y; };
+ *	LIBRPC_REFLECT(point, LIBRPC_FIELD(point, x), LIBRPC_FIELD(point, y));
+ *
+ * The key table is built at compile time; marshalling a struct is one
+ * C object per field with no librpc::Object wrappers in between.
+ */
+#define	LIBRPC_REFLECT(_type, ...)					\
+	namespace librpc {						\
+	template <> struct reflect<_type> {				\
+		static constexpr bool defined = true;			\
+		static constexpr auto fields()				\
+		{ return (std::make_tuple(__VA_ARGS__)); }		\
+	};								\
+	}
+
+#define	LIBRPC_FIELD(_type, _member)					\
+	::librpc::make_field(#_member, &_type::_member)
+
+namespace librpc
+{
+	template <typename C, typename M>
+	struct field
+	{
+		const char *name;
+		M C::*ptr;
+	};
+
+	template <typename C, typename M>
+	constexpr field<C, M> make_field(const char *name, M C::*ptr)
+	{
+		return (field<C, M>{name, ptr});
+	}
+
+	template <typename T>
+	struct reflect
+	{
+		static constexpr bool defined = false;
+	};
+
+	/**
+	 * Converts between T and rpc_object_t. Specialized below for
+	 * scalars, strings, vectors, string-keyed maps and reflected
+	 * structs.
+	 */
+	template <typename T, typename Enable = void>
+	struct marshal;
+
+	template <>
+	struct marshal<bool>
+	{
+		static rpc_object_t encode(bool v)
+		{
+			return (rpc_bool_create(v));
+		}
+
+		static bool decode(rpc_object_t obj, bool &v)
+		{
+			if (rpc_get_type(obj) != RPC_TYPE_BOOL)
+				return (false);
+
+			v = rpc_bool_get_value(obj);
+			return (true);
+		}
+	};
+
+	template <typename T>
+	struct marshal<T, typename std::enable_if<std::is_integral<T>::value &&
+	    !std::is_same<T, bool>::value>::type>
+	{
+		static rpc_object_t encode(T v)
+		{
+			if (std::is_signed<T>::value)
+				return (rpc_int64_create((int64_t)v));
+
+			return (rpc_uint64_create((uint64_t)v));
+		}
+
+		static bool decode(rpc_object_t obj, T &v)
+		{
+			switch (rpc_get_type(obj)) {
+			case RPC_TYPE_INT64:
+				v = (T)rpc_int64_get_value(obj);
+				return (true);
+
+			case RPC_TYPE_UINT64:
+				v = (T)rpc_uint64_get_value(obj);
+				return (true);
+
+			default:
+				return (false);
+			}
+		}
+	};
+
+	template <typename T>
+	struct marshal<T, typename std::enable_if<
+	    std::is_floating_point<T>::value>::type>
+	{
+		static rpc_object_t encode(T v)
+		{
+			return (rpc_double_create((double)v));
+		}
+
+		static bool decode(rpc_object_t obj, T &v)
+		{
+			if (rpc_get_type(obj) != RPC_TYPE_DOUBLE)
+				return (false);
+
+			v = (T)rpc_double_get_value(obj);
+			return (true);
+		}
+	};
+
+	template <>
+	struct marshal<std::string>
+	{
+		static rpc_object_t encode(const std::string &v)
+		{
+			return (rpc_string_create_len(v.data(), v.size()));
+		}
+
+		static bool decode(rpc_object_t obj, std::string &v)
+		{
+			if (rpc_get_type(obj) != RPC_TYPE_STRING)
+				return (false);
+
+			v.assign(rpc_string_get_string_ptr(obj),
+			    rpc_string_get_length(obj));
+			return (true);
+		}
+	};
+
+	template <typename T>
+	struct marshal<std::vector<T>>
+	{
+		static rpc_object_t encode(const std::vector<T> &v)
+		{
+			rpc_object_t result = rpc_array_create();
+
+			for (const auto &i : v)
+				rpc_array_append_stolen_value(result,
+				    marshal<T>::encode(i));
+
+			return (result);
+		}
+
+		static bool decode(rpc_object_t obj, std::vector<T> &v)
+		{
+			size_t count;
+
+			if (rpc_get_type(obj) != RPC_TYPE_ARRAY)
+				return (false);
+
+			count = rpc_array_get_count(obj);
+			v.clear();
+			v.resize(count);
+
+			for (size_t i = 0; i < count; i++) {
+				if (!marshal<T>::decode(
+				    rpc_array_get_value(obj, i), v[i]))
+					return (false);
+			}
+
+			return (true);
+		}
+	};
+
+	template <typename T>
+	struct marshal<std::map<std::string, T>>
+	{
+		static rpc_object_t encode(const std::map<std::string, T> &v)
+		{
+			rpc_object_t result = rpc_dictionary_create();
+
+			for (const auto &i : v)
+				rpc_dictionary_steal_value(result,
+				    i.first.c_str(), marshal<T>::encode(i.second));
+
+			return (result);
+		}
+
+		static bool decode(rpc_object_t obj,
+		    std::map<std::string, T> &v)
+		{
+			std::map<std::string, T> *out = &v;
+
+			if (rpc_get_type(obj) != RPC_TYPE_DICTIONARY)
+				return (false);
+
+			v.clear();
+			return (!rpc_dictionary_apply(obj,
+			    ^(const char *key, rpc_object_t value) {
+				return ((bool)marshal<T>::decode(value,
+				    (*out)[key]));
+			}));
+		}
+	};
+
+	template <typename T>
+	struct marshal<T, typename std::enable_if<reflect<T>::defined>::type>
+	{
+		template <typename Tuple, size_t... I>
+		static void encode_fields(rpc_object_t dict, const T &v,
+		    const Tuple &fields, std::index_sequence<I...>)
+		{
+			(void)std::initializer_list<int>{
+			    (rpc_dictionary_steal_value(dict,
+			        std::get<I>(fields).name,
+			        marshal<typename std::decay<decltype(
+			            v.*(std::get<I>(fields).ptr))>::type>::encode(
+			            v.*(std::get<I>(fields).ptr))), 0)...
+			};
+		}
+
+		template <typename Tuple, size_t... I>
+		static bool decode_fields(rpc_object_t dict, T &v,
+		    const Tuple &fields, std::index_sequence<I...>)
+		{
+			bool ok = true;
+
+			(void)std::initializer_list<int>{
+			    (ok = ok && decode_field(dict,
+			        std::get<I>(fields).name,
+			        v.*(std::get<I>(fields).ptr)), 0)...
+			};
+
+			return (ok);
+		}
+
+		template <typename M>
+		static bool decode_field(rpc_object_t dict, const char *name,
+		    M &member)
+		{
+			rpc_object_t value;
+
+			/* Missing fields keep their default value */
+			value = rpc_dictionary_get_value(dict, name);
+			if (value == nullptr)
+				return (true);
+
+			return (marshal<M>::decode(value, member));
+		}
+
+		static rpc_object_t encode(const T &v)
+		{
+			constexpr auto fields = reflect<T>::fields();
+			rpc_object_t result = rpc_dictionary_create();
+
+			encode_fields(result, v, fields, std::make_index_sequence<
+			    std::tuple_size<decltype(fields)>::value>{});
+			return (result);
+		}
+
+		static bool decode(rpc_object_t obj, T &v)
+		{
+			constexpr auto fields = reflect<T>::fields();
+
+			if (rpc_get_type(obj) != RPC_TYPE_DICTIONARY)
+				return (false);
+
+			return (decode_fields(obj, v, fields,
+			    std::make_index_sequence<
+			    std::tuple_size<decltype(fields)>::value>{}));
+		}
+	};
+
+	/**
+	 * Encodes a value into a new librpc object.
+	 *
+	 * @return Object reference owned by the caller
+	 */
+	template <typename T>
+	rpc_object_t serialize(const T &value)
+	{
+		return (marshal<T>::encode(value));
+	}
+
+	/**
+	 * Decodes a librpc object into an existing value.
+	 *
+	 * @return false if the object doesn't have the expected shape
+	 */
+	template <typename T>
+	bool deserialize(rpc_object_t obj, T &value)
+	{
+		return (marshal<T>::decode(obj, value));
+	}
+
+	/**
+	 * Builds a call argument array from typed values.
+	 */
+	template <typename... Args>
+	rpc_object_t serialize_args(const Args &...args)
+	{
+		rpc_object_t result = rpc_array_create();
+
+		(void)std::initializer_list<int>{
+		    (rpc_array_append_stolen_value(result,
+		        serialize(args)), 0)...
+		};
+
+		return (result);
+	}
+};
+
+#endif /* LIBRPC_MARSHAL_HH */
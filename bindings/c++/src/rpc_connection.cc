@@ -35,6 +35,8 @@
 
 using namespace librpc;
 
+static bool call_async_trampoline(void *, rpc_call_t);
+
 Exception::Exception(int code, const std::string &message):
     std::runtime_error(message)
 {
@@ -84,10 +86,88 @@ const CallIterator&
 CallIterator::operator++()
 {
 	m_call->resume(true);
-	m_ended = m_call->status() == RPC_CALL_ENDED;
+	m_ended = m_call->status() != RPC_CALL_MORE_AVAILABLE;
+	return (*this);
+}
+
+BatchIterator::BatchIterator(librpc::Call *call, size_t size, bool ended)
+{
+	m_call = call;
+	m_size = std::max(size, (size_t)1);
+	m_ended = ended;
+	m_batch.reserve(m_size);
+
+	if (!m_ended)
+		fill();
+}
+
+bool
+BatchIterator::operator!=(const librpc::BatchIterator &other)
+{
+	return (!(m_call == other.m_call && m_ended == other.m_ended));
+}
+
+const std::vector<Object> &
+BatchIterator::operator*() const
+{
+	return (m_batch);
+}
+
+const BatchIterator &
+BatchIterator::operator++()
+{
+	fill();
 	return (*this);
 }
 
+void
+BatchIterator::fill()
+{
+	enum rpc_call_status status;
+
+	m_batch.clear();
+	status = m_call->status();
+
+	/* Block for the first fragment only, take the rest as queued */
+	if (status == RPC_CALL_IN_PROGRESS) {
+		m_call->wait();
+		status = m_call->status();
+	}
+
+	while (m_batch.size() < m_size && status == RPC_CALL_MORE_AVAILABLE) {
+		m_batch.push_back(m_call->result());
+		m_call->resume(false);
+		status = m_call->status();
+	}
+
+	if (status == RPC_CALL_ERROR) {
+		Object error = m_call->result();
+
+		throw (Exception(error.get_error_code(),
+		    error.get_error_message()));
+	}
+
+	m_ended = m_batch.empty();
+}
+
+BatchRange::BatchRange(librpc::Call *call, size_t size)
+{
+	m_call = call;
+	m_size = size;
+}
+
+BatchIterator
+BatchRange::begin()
+{
+	return (BatchIterator(m_call, m_size, false));
+}
+
+BatchIterator
+BatchRange::end()
+{
+	return (BatchIterator(m_call, m_size, true));
+}
+
 Call::~Call()
 {
 	rpc_call_free(m_call);
@@ -123,10 +203,34 @@ Call::abort()
 	rpc_call_abort(m_call);
 }
 
+void
+Call::set_prefetch(size_t nitems)
+{
+	if (rpc_call_set_prefetch(m_call, nitems) != 0)
+		throw (Exception::last_error());
+
+	m_prefetch_set = true;
+}
+
+void
+Call::start_stream(size_t prefetch)
+{
+	if (!m_prefetch_set) {
+		rpc_call_set_prefetch(m_call, prefetch);
+		m_prefetch_set = true;
+	}
+
+	wait();
+	if (status() == RPC_CALL_STREAM_START)
+		resume(true);
+}
+
 CallIterator
 Call::begin()
 {
-	return (CallIterator(this, false));
+	/* Zero lets librpc size the window from the measured rate */
+	start_stream(0);
+	return (CallIterator(this, status() != RPC_CALL_MORE_AVAILABLE));
 }
 
 CallIterator
@@ -135,6 +239,13 @@ Call::end()
 	return (CallIterator(this, true));
 }
 
+BatchRange
+Call::batches(size_t size)
+{
+	start_stream(size);
+	return (BatchRange(this, size));
+}
+
 Call
 Call::wrap(rpc_call_t other)
 {
@@ -177,16 +288,73 @@ Connection::call_async(const std::string &name, const std::vector<Object> &args,
 {
 	Object wrapped(args);
 
-	rpc_call_t call = rpc_connection_call(m_connection, path.c_str(),
+	/* The caller keeps the callback alive, so it is our context as is */
+	rpc_call_t call = rpc_connection_call_f(m_connection, path.c_str(),
 	    interface.c_str(), name.c_str(), wrapped.unwrap(),
-	    ^bool(rpc_call_t c) {
-		return (callback(Call::wrap(c)));
-	});
+	    call_async_trampoline, &callback);
 
 	if (call == nullptr)
 		throw (Exception::last_error());
 }
 
+static bool
+call_async_trampoline(void *ctx, rpc_call_t c)
+{
+	auto *callback = static_cast<std::function<bool (Call)> *>(ctx);
+
+	return ((*callback)(Call::wrap(c)));
+}
+
+rpc_connection_t
+Connection::unwrap() const
+{
+	return (m_connection);
+}
+
+std::future<Object>
+Connection::call_future(const std::string &name,
+    const std::vector<Object> &args, const std::string &path,
+    const std::string &interface)
+{
+	Object wrapped(args);
+	auto promise = new std::promise<Object>();
+	std::future<Object> future = promise->get_future();
+
+	rpc_call_t call = rpc_connection_call(m_connection, path.c_str(),
+	    interface.c_str(), name.c_str(), wrapped.unwrap(), nullptr);
+
+	if (call == nullptr) {
+		delete promise;
+		throw (Exception::last_error());
+	}
+
+	rpc_call_then(call, nullptr, ^(rpc_call_t c) {
+		Object result = Object::wrap(rpc_call_result(c));
+
+		switch (rpc_call_status(c)) {
+		case RPC_CALL_ERROR:
+			promise->set_exception(std::make_exception_ptr(
+			    Exception(result.get_error_code(),
+			    result.get_error_message())));
+			break;
+
+		case RPC_CALL_ABORTED:
+			promise->set_exception(std::make_exception_ptr(
+			    Exception(ECANCELED, "Call aborted")));
+			break;
+
+		default:
+			promise->set_value(result);
+			break;
+		}
+
+		rpc_call_free(c);
+		delete promise;
+	});
+
+	return (future);
+}
+
 void
 Client::connect(const std::string &uri, const librpc::Object &params)
 {
@@ -205,6 +373,54 @@ Client::disconnect()
 	m_client = nullptr;
 }
 
+ClientPool::ClientPool(const std::vector<std::string> &uris, size_t size,
+    rpc_client_pool_policy_t policy, const librpc::Object &params)
+{
+	std::vector<const char *> c_uris;
+
+	for (const auto &uri: uris)
+		c_uris.push_back(uri.c_str());
+
+	m_pool = rpc_client_pool_create(c_uris.data(), c_uris.size(), size,
+	    policy, params.unwrap());
+	if (m_pool == nullptr)
+		throw (Exception::last_error());
+}
+
+ClientPool::~ClientPool()
+{
+	rpc_client_pool_free(m_pool);
+}
+
+Object
+ClientPool::call_sync(const std::string &name, const std::vector<Object> &args,
+    const std::string &path, const std::string &interface)
+{
+	Object wrapped(args);
+	rpc_object_t result;
+
+	result = rpc_client_pool_call_sync(m_pool, path.c_str(),
+	    interface.c_str(), name.c_str(), rpc_retain(wrapped.unwrap()));
+	if (result == nullptr)
+		throw (Exception::last_error());
+
+	return (Object::steal(result));
+}
+
+void
+ClientPool::set_hedged(const std::string &name, bool hedged,
+    const std::string &interface)
+{
+	rpc_client_pool_set_hedged(m_pool, interface.c_str(), name.c_str(),
+	    hedged);
+}
+
+rpc_client_pool_t
+ClientPool::unwrap() const
+{
+	return (m_pool);
+}
+
 std::vector<RemoteInterface>
 RemoteInstance::interfaces()
 {
@@ -237,19 +453,36 @@ RemoteInstance::connection()
 RemoteInterface::RemoteInterface(librpc::RemoteInstance *instance,
     const std::string &name): m_instance(instance), m_name(name)
 {
+	/* Without the cache, reads just go to the server */
+	rpc_connection_cache_properties(m_instance->connection().unwrap(),
+	    m_instance->path().c_str(), m_name.c_str());
 }
 
 Object
 RemoteInterface::get(const std::string &prop)
 {
-	return (m_instance->connection().call_sync("get", {prop},
-	    m_instance->path(), RPC_OBSERVABLE_INTERFACE));
+	rpc_object_t result;
+
+	result = rpc_connection_get_property(m_instance->connection().unwrap(),
+	    m_instance->path().c_str(), m_name.c_str(), prop.c_str());
+	if (result == nullptr)
+		throw (Exception::last_error());
+
+	return (Object::steal(result));
 }
 
 void
 RemoteInterface::set(const std::string &prop, const Object &value)
 {
+	rpc_object_t result;
+
+	result = rpc_connection_set_property(m_instance->connection().unwrap(),
+	    m_instance->path().c_str(), m_name.c_str(), prop.c_str(),
+	    rpc_retain(value.unwrap()));
+	if (result == nullptr)
+		throw (Exception::last_error());
 
+	rpc_release(result);
 }
 
 Object
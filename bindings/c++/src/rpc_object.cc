@@ -25,10 +25,40 @@
  *
  */
 
+#include <memory>
 #include "../include/librpc.hh"
 
 using namespace librpc;
 
+namespace
+{
+	/*
+	 * Scratch array for the *_create_ex() calls; lists of the size
+	 * usually spelled out in code stay on the stack.
+	 */
+	template <typename T, size_t N = 16>
+	class scratch
+	{
+	public:
+		explicit scratch(size_t count)
+		{
+			m_ptr = m_inline;
+			if (count > N) {
+				m_heap.reset(new T[count]);
+				m_ptr = m_heap.get();
+			}
+		}
+
+		T &operator[](size_t index) { return (m_ptr[index]); }
+		T *get() { return (m_ptr); }
+
+	private:
+		T m_inline[N];
+		std::unique_ptr<T[]> m_heap;
+		T *m_ptr;
+	};
+}
+
 Object::Object()
 {
 	m_value = rpc_null_create();
@@ -50,6 +80,11 @@ Object::Object(Object &&other) noexcept
 	other.m_value = nullptr;
 }
 
+Object::Object(rpc_object_t value, adopt_tag) noexcept
+{
+	m_value = value;
+}
+
 Object::Object(bool value)
 {
 	m_value = rpc_bool_create(value);
@@ -77,8 +112,15 @@ Object::Object(const char *value)
 
 Object::Object(const std::string &value)
 {
-	m_value = rpc_string_create(value.c_str());
+	m_value = rpc_string_create_len(value.data(), value.size());
+}
+
+#if __cplusplus >= 201703L
+Object::Object(std::string_view value)
+{
+	m_value = rpc_string_create_len(value.data(), value.size());
 }
+#endif
 
 Object::Object(void *data, size_t len, rpc_binary_destructor_t dtor)
 {
@@ -87,40 +129,77 @@ Object::Object(void *data, size_t len, rpc_binary_destructor_t dtor)
 
 Object::Object(const std::map<std::string, Object> &dict)
 {
-	m_value = rpc_dictionary_create();
+	scratch<const char *> keys(dict.size());
+	scratch<rpc_object_t> values(dict.size());
+	size_t i = 0;
 
 	for (auto &kv: dict) {
-		rpc_dictionary_set_value(m_value, kv.first.c_str(),
-		    kv.second.m_value);
+		keys[i] = kv.first.c_str();
+		values[i++] = kv.second.m_value;
 	}
+
+	m_value = rpc_dictionary_create_ex(keys.get(), values.get(), i, false);
 }
 
-Object::Object(const std::vector<Object> &array)
+Object::Object(std::map<std::string, Object> &&dict)
 {
-	m_value = rpc_array_create();
+	scratch<const char *> keys(dict.size());
+	scratch<rpc_object_t> values(dict.size());
+	size_t i = 0;
 
-	for (auto &v: array) {
-		rpc_array_append_value(m_value, v.m_value);
+	for (auto &kv: dict) {
+		keys[i] = kv.first.c_str();
+		values[i++] = kv.second.release_ownership();
 	}
+
+	m_value = rpc_dictionary_create_ex(keys.get(), values.get(), i, true);
+}
+
+Object::Object(const std::vector<Object> &array)
+{
+	scratch<rpc_object_t> values(array.size());
+	size_t i = 0;
+
+	for (auto &v: array)
+		values[i++] = v.m_value;
+
+	m_value = rpc_array_create_ex(values.get(), i, false);
+}
+
+Object::Object(std::vector<Object> &&array)
+{
+	scratch<rpc_object_t> values(array.size());
+	size_t i = 0;
+
+	for (auto &v: array)
+		values[i++] = v.release_ownership();
+
+	m_value = rpc_array_create_ex(values.get(), i, true);
 }
 
 Object::Object(std::initializer_list<Object> list)
 {
-	m_value = rpc_array_create();
+	scratch<rpc_object_t> values(list.size());
+	size_t i = 0;
 
-	for (auto &v: list) {
-		rpc_array_append_value(m_value, v.m_value);
-	}
+	for (auto &v: list)
+		values[i++] = v.m_value;
+
+	m_value = rpc_array_create_ex(values.get(), i, false);
 }
 
 Object::Object(std::initializer_list<std::pair<std::string, Object>> list)
 {
-	m_value = rpc_dictionary_create();
+	scratch<const char *> keys(list.size());
+	scratch<rpc_object_t> values(list.size());
+	size_t i = 0;
 
 	for (auto &kv : list) {
-		rpc_dictionary_set_value(m_value, kv.first.c_str(),
-		    kv.second.m_value);
+		keys[i] = kv.first.c_str();
+		values[i++] = kv.second.m_value;
 	}
+
+	m_value = rpc_dictionary_create_ex(keys.get(), values.get(), i, false);
 }
 
 Object::~Object()
@@ -128,12 +207,48 @@ Object::~Object()
 	rpc_release(m_value);
 }
 
+Object &
+Object::operator=(const Object &other)
+{
+	rpc_object_t old = m_value;
+
+	m_value = rpc_retain(other.m_value);
+	rpc_release(old);
+	return (*this);
+}
+
+Object &
+Object::operator=(Object &&other) noexcept
+{
+	if (this != &other) {
+		rpc_release(m_value);
+		m_value = other.m_value;
+		other.m_value = nullptr;
+	}
+
+	return (*this);
+}
+
 Object
 Object::wrap(rpc_object_t other)
 {
-	Object result;
 
-	result.m_value = rpc_retain(other);
+	return (Object(rpc_retain(other), adopt_tag()));
+}
+
+Object
+Object::steal(rpc_object_t other)
+{
+
+	return (Object(other, adopt_tag()));
+}
+
+rpc_object_t
+Object::release_ownership()
+{
+	rpc_object_t result = m_value;
+
+	m_value = nullptr;
 	return (result);
 }
 
@@ -146,7 +261,7 @@ Object::type()
 Object
 Object::copy()
 {
-	return (Object::wrap(rpc_copy(m_value)));
+	return (Object::steal(rpc_copy(m_value)));
 }
 
 void
@@ -210,12 +325,25 @@ Object::push(const librpc::Object &value)
 	rpc_array_append_value(m_value, value.unwrap());
 }
 
+void
+Object::push(librpc::Object &&value)
+{
+	rpc_array_append_stolen_value(m_value, value.release_ownership());
+}
+
 void
 Object::set(const std::string &key, const librpc::Object &value)
 {
 	rpc_dictionary_set_value(m_value, key.c_str(), value.unwrap());
 }
 
+void
+Object::set(const std::string &key, librpc::Object &&value)
+{
+	rpc_dictionary_steal_value(m_value, key.c_str(),
+	    value.release_ownership());
+}
+
 int
 Object::get_error_code()
 {
@@ -252,6 +380,7 @@ Object::operator vector_type() const
 {
 	__block vector_type ret;
 
+	ret.reserve(rpc_array_get_count(m_value));
 	rpc_array_apply(m_value, ^(size_t idx, rpc_object_t value) {
 		ret.push_back(Object::wrap(value));
 		return ((bool)true);
@@ -274,8 +403,28 @@ Object::operator map_type() const
 
 Object::operator string_type() const
 {
-	return (string_type(rpc_string_get_string_ptr(m_value)));
+	return (string_type(rpc_string_get_string_ptr(m_value),
+	    rpc_string_get_length(m_value)));
+}
+
+#if __cplusplus >= 201703L
+std::string_view
+Object::as_string_view() const
+{
+	return (std::string_view(rpc_string_get_string_ptr(m_value),
+	    rpc_string_get_length(m_value)));
+}
+#endif
+
+#if __cplusplus >= 202002L
+std::span<const uint8_t>
+Object::as_bytes() const
+{
+	return (std::span<const uint8_t>(
+	    (const uint8_t *)rpc_data_get_bytes_ptr(m_value),
+	    rpc_data_get_length(m_value)));
 }
+#endif
 
 Object
 Object::operator[](const std::string &key)
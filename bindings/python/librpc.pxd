@@ -25,6 +25,7 @@
 #
 
 from libc.stdint cimport *
+from cpython.pythread cimport PyThread_type_lock
 
 
 ctypedef bint (*rpc_dictionary_applier_f)(void *arg, const char *key, rpc_object_t value)
@@ -35,6 +36,7 @@ ctypedef void (*rpc_binary_destructor_arg_f)(void *arg, void *buffer)
 ctypedef void (*rpc_handler_f)(void *arg, const char *path, const char *interface, const char *name, rpc_object_t args)
 ctypedef void (*rpc_error_handler_f)(void *arg, rpc_error_code_t code, rpc_object_t args)
 ctypedef bint (*rpc_callback_f)(void *arg, rpc_call_t call, rpc_call_status_t status)
+ctypedef void (*rpc_then_f)(void *arg, rpc_call_t call)
 ctypedef void (*rpc_bus_event_handler_f)(void *arg, rpc_bus_event_t, rpc_bus_node *)
 ctypedef bint (*rpct_type_applier_f)(void *arg, rpct_type_t type)
 ctypedef bint (*rpct_interface_applier_f)(void *arg, rpct_interface_t iface)
@@ -129,22 +131,42 @@ cdef extern from "rpc/object.h" nogil:
     void rpc_array_set_value(rpc_object_t array, size_t index, rpc_object_t value)
     bint rpc_array_apply(rpc_object_t array, void *applier)
     void rpc_array_append_value(rpc_object_t array, rpc_object_t value)
+    void rpc_array_append_stolen_value(rpc_object_t array, rpc_object_t value)
     rpc_object_t rpc_array_get_value(rpc_object_t array, size_t index)
     size_t rpc_array_get_count(rpc_object_t array)
     void rpc_array_remove_index(rpc_object_t array, size_t index)
     void rpc_array_remove_all(rpc_object_t array)
+    rpc_object_t rpc_array_create_typed(rpc_type_t type, const void *values,
+        size_t count)
+    rpc_type_t rpc_array_get_packed_type(rpc_object_t array)
+    int64_t *rpc_array_get_int64_ptr(rpc_object_t array)
+    uint64_t *rpc_array_get_uint64_ptr(rpc_object_t array)
+    double *rpc_array_get_double_ptr(rpc_object_t array)
 
     rpc_object_t rpc_dictionary_create()
     rpc_object_t rpc_dictionary_get_value(rpc_object_t dictionary,
         const char *key)
     void rpc_dictionary_set_value(rpc_object_t dictionary, const char *key,
         rpc_object_t value)
+    void rpc_dictionary_steal_value(rpc_object_t dictionary, const char *key,
+        rpc_object_t value)
     bint rpc_dictionary_apply(rpc_object_t dictionary, void *applier)
     size_t rpc_dictionary_get_count(rpc_object_t dictionary)
     void rpc_dictionary_remove_key(rpc_object_t dictionary, const char *key)
     void rpc_dictionary_remove_all(rpc_object_t dictionary)
 
 
+IF UNAME_SYSNAME == "Linux":
+    cdef extern from "rpc/object.h" nogil:
+        enum:
+            RPC_TYPE_SHMEM
+
+        rpc_object_t rpc_shmem_create(size_t size)
+        void *rpc_shmem_map(rpc_object_t shmem)
+        void rpc_shmem_unmap(rpc_object_t shmem, void *addr)
+        size_t rpc_shmem_get_size(rpc_object_t shmem)
+
+
 cdef extern from "rpc/connection.h" nogil:
     ctypedef enum rpc_call_status_t:
         RPC_CALL_IN_PROGRESS
@@ -164,6 +186,7 @@ cdef extern from "rpc/connection.h" nogil:
     void *RPC_HANDLER(rpc_handler_f fn, void *arg)
     void *RPC_ERROR_HANDLER(rpc_error_handler_f fn, void *arg)
     void *RPC_CALLBACK(rpc_callback_f fn, void *arg)
+    void *RPC_THEN(rpc_then_f fn, void *arg)
     void *RPC_PROPERTY_HANDLER(rpc_property_handler_f fn, void *arg)
 
     rpc_connection_t rpc_connection_create(void *cookie, rpc_object_t params)
@@ -184,6 +207,7 @@ cdef extern from "rpc/connection.h" nogil:
     int rpc_call_wait(rpc_call_t call)
     int rpc_call_continue(rpc_call_t call, bint sync)
     int rpc_call_abort(rpc_call_t call)
+    int rpc_call_await(rpc_call_t call, void *executor, void *fn)
     int rpc_call_success(rpc_call_t call)
     rpc_object_t rpc_call_result(rpc_call_t call)
     void rpc_call_free(rpc_call_t call)
@@ -193,12 +217,19 @@ cdef extern from "rpc/connection.h" nogil:
     void *rpc_connection_watch_property(rpc_connection_t conn,
         const char *path, const char *interface, const char *property,
         void *handler)
+    rpc_object_t rpc_connection_get_property(rpc_connection_t conn,
+        const char *path, const char *interface, const char *name)
+    int rpc_connection_cache_properties(rpc_connection_t conn,
+        const char *path, const char *interface)
+    int rpc_connection_uncache_properties(rpc_connection_t conn,
+        const char *path, const char *interface)
     void rpc_connection_unregister_event_handler(rpc_connection_t conn,
         void *cookie)
 
 
 cdef extern from "rpc/service.h" nogil:
     ctypedef rpc_object_t (*rpc_function_f)(void *cookie, rpc_object_t args)
+    rpc_object_t RPC_FUNCTION_STILL_RUNNING
 
     void *RPC_PROPERTY_GETTER(rpc_property_getter_f getter)
     void *RPC_PROPERTY_SETTER(rpc_property_setter_f setter)
@@ -232,6 +263,8 @@ cdef extern from "rpc/service.h" nogil:
     int rpc_function_yield(void *cookie, rpc_object_t fragment)
     void rpc_function_produce(void *cookie, rpc_object_t fragment)
     void rpc_function_end(void *cookie)
+    int rpc_function_retain(void *cookie)
+    int rpc_function_release(void *cookie)
 
     void *rpc_property_get_arg(void *cookie)
     void rpc_property_error(void *cookie, int code, const char *fmt)
@@ -259,10 +292,25 @@ cdef extern from "rpc/client.h" nogil:
     ctypedef struct rpc_client_t:
         pass
 
+    ctypedef struct rpc_client_pool_t:
+        pass
+
+    ctypedef enum rpc_client_pool_policy_t:
+        RPC_CLIENT_POOL_LEAST_OUTSTANDING
+        RPC_CLIENT_POOL_TWO_CHOICES
+
     rpc_client_t rpc_client_create(const char *uri, rpc_object_t params)
     rpc_connection_t rpc_client_get_connection(rpc_client_t client)
     void rpc_client_close(rpc_client_t client)
 
+    rpc_client_pool_t rpc_client_pool_create(const char **uris, size_t nuris,
+        size_t size, rpc_client_pool_policy_t policy, rpc_object_t params)
+    rpc_connection_t rpc_client_pool_acquire(rpc_client_pool_t pool)
+    void rpc_client_pool_release(rpc_client_pool_t pool, rpc_connection_t conn)
+    void rpc_client_pool_set_hedged(rpc_client_pool_t pool,
+        const char *interface, const char *method, bint hedged)
+    void rpc_client_pool_free(rpc_client_pool_t pool)
+
 
 cdef extern from "rpc/server.h" nogil:
     ctypedef struct rpc_server:
@@ -327,6 +375,8 @@ cdef extern from "rpc/query.h" nogil:
     void rpc_query_delete(rpc_object_t object, const char *path)
     bint rpc_query_contains(rpc_object_t object, const char *path)
     rpc_query_iter_t rpc_query(rpc_object_t object, rpc_query_params_t params, rpc_object_t rules)
+    rpc_object_t rpc_query_request_create(rpc_object_t rules, rpc_query_params_t params)
+    rpc_query_iter_t rpc_query_request_run(rpc_object_t object, rpc_object_t request)
     bint rpc_query_next(rpc_query_iter_t iter, rpc_object_t *chunk)
     void rpc_query_iter_free(rpc_query_iter_t iter)
 
@@ -435,6 +485,10 @@ cdef extern from "rpc/rpcd.h" nogil:
 cdef class Object(object):
     cdef rpc_object_t obj
     cdef object ref
+    cdef void *mapping
+    cdef bint writable
+    cdef Py_ssize_t view_shape
+    cdef Py_ssize_t view_stride
 
     @staticmethod
     cdef wrap(rpc_object_t ptr, bint retain=*)
@@ -474,6 +528,43 @@ cdef class Service(object):
     cdef object interfaces
 
 
+cdef struct dispatch_call:
+    void *cookie
+    void *fn
+    rpc_object_t args
+    dispatch_call *next
+
+
+cdef struct dispatch_queue:
+    PyThread_type_lock lock
+    PyThread_type_lock wakeup
+    dispatch_call *head
+    dispatch_call *tail
+    bint waiting
+    bint closed
+
+
+cdef struct dispatch_target:
+    dispatch_queue *queue
+    void *fn
+
+
+cdef class DispatchTarget(object):
+    cdef dispatch_target target
+    cdef object fn
+
+
+cdef class Dispatcher(object):
+    cdef dispatch_queue queue
+    cdef readonly object loop
+    cdef readonly size_t batch_size
+    cdef object targets
+    cdef object thread
+
+    cdef void *target(self, fn)
+    cdef run_call(self, dispatch_call *call)
+
+
 cdef class RemoteObject(object):
     cdef readonly object client
     cdef readonly object path
@@ -577,6 +668,10 @@ cdef class Client(Connection):
     cdef Client wrap(rpc_client_t ptr)
 
 
+cdef class ClientPool(object):
+    cdef rpc_client_pool_t pool
+
+
 cdef class Bus(object):
     cdef object event_fn
 
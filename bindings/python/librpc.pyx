@@ -34,12 +34,17 @@ import functools
 import traceback
 import datetime
 import uuid
+import asyncio
+import threading
 cimport cython
 from cpython.ref cimport Py_INCREF, Py_DECREF
+from cpython.buffer cimport *
 from librpc cimport *
 from libc.string cimport strdup
 from libc.stdint cimport *
 from libc.stdlib cimport malloc, free
+from libc.errno cimport ENOMEM, ESHUTDOWN
+from cpython.pythread cimport *
 
 
 cdef extern from "Python.h" nogil:
@@ -49,6 +54,7 @@ cdef extern from "Python.h" nogil:
 include "src/object.pxi"
 include "src/connection.pxi"
 include "src/service.pxi"
+include "src/dispatcher.pxi"
 include "src/client.pxi"
 include "src/server.pxi"
 include "src/bus.pxi"
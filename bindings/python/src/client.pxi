@@ -67,3 +67,81 @@ cdef class Client(Connection):
 
         rpc_client_close(self.client)
         self.client = <rpc_client_t>NULL
+
+
+class ClientPoolPolicy(enum.IntEnum):
+    """
+    Load balancing policies of a client pool.
+    """
+    LEAST_OUTSTANDING = RPC_CLIENT_POOL_LEAST_OUTSTANDING
+    TWO_CHOICES = RPC_CLIENT_POOL_TWO_CHOICES
+
+
+cdef class ClientPool(object):
+    """
+    A fixed set of connections to replicas of one service. Each call
+    goes to the least loaded connection; dropped ones are reconnected
+    in the background.
+    """
+    def __init__(self, uris, size=0,
+                 policy=ClientPoolPolicy.LEAST_OUTSTANDING, params=None):
+        cdef const char **c_uris
+        cdef rpc_object_t c_params
+        cdef size_t nuris = len(uris)
+
+        b_uris = [u.encode('utf-8') for u in uris]
+        c_uris = <const char **>malloc(sizeof(char *) * max(nuris, 1))
+        for i, u in enumerate(b_uris):
+            c_uris[i] = u
+
+        c_params = Object(params).unwrap() if params else <rpc_object_t>NULL
+
+        with nogil:
+            self.pool = rpc_client_pool_create(c_uris, nuris, size,
+                                               policy, c_params)
+
+        free(c_uris)
+        if self.pool == <rpc_client_pool_t>NULL:
+            raise_internal_exc(rpc=False)
+
+    def __dealloc__(self):
+        if self.pool != <rpc_client_pool_t>NULL:
+            rpc_client_pool_free(self.pool)
+
+    def call_sync(self, method, *args, path='/', interface=None):
+        cdef rpc_connection_t conn
+
+        if self.pool == <rpc_client_pool_t>NULL:
+            raise RuntimeError("Pool is closed")
+
+        with nogil:
+            conn = rpc_client_pool_acquire(self.pool)
+
+        if conn == <rpc_connection_t>NULL:
+            raise_internal_exc(rpc=False)
+
+        try:
+            return Connection.wrap(conn).call_sync(
+                method, *args, path=path, interface=interface)
+        finally:
+            rpc_client_pool_release(self.pool, conn)
+
+    def set_hedged(self, method, hedged=True, interface=None):
+        """
+        Hedge calls to an idempotent method, see rpc_client_pool_set_hedged().
+        """
+        cdef const char *c_interface = NULL
+
+        b_method = method.encode('utf-8')
+        if interface:
+            b_interface = interface.encode('utf-8')
+            c_interface = b_interface
+
+        rpc_client_pool_set_hedged(self.pool, c_interface, b_method, hedged)
+
+    def close(self):
+        if self.pool == <rpc_client_pool_t>NULL:
+            raise RuntimeError("Pool is closed")
+
+        rpc_client_pool_free(self.pool)
+        self.pool = <rpc_client_pool_t>NULL
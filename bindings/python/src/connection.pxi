@@ -100,6 +100,147 @@ cdef class Call(object):
             rpc_call_continue(self.call, True)
 
 
+cdef class AsyncCall(object):
+    """
+    An outbound call driven from an asyncio event loop.
+
+    librpc threads only hand status updates over to the loop with
+    call_soon_threadsafe(); results are read and unpacked on the loop.
+    """
+    cdef readonly Connection connection
+    cdef rpc_call_t call
+    cdef object loop
+    cdef object future
+
+    @staticmethod
+    cdef void c_then(void *arg, rpc_call_t call) with gil:
+        cdef AsyncCall self = <AsyncCall>arg
+
+        try:
+            self.loop.call_soon_threadsafe(self.resolve)
+        except RuntimeError:
+            # The loop is closed, so nobody is waiting any more
+            pass
+
+        Py_DECREF(self)
+
+    def resolve(self):
+        if self.future is not None and not self.future.done():
+            self.future.set_result(None)
+
+    async def wait(self):
+        """
+        Wait for the next status update of the call.
+
+        :return: CallStatus
+        """
+        cdef void *arg = <void *>self
+        cdef int ret
+
+        self.future = self.loop.create_future()
+        Py_INCREF(self)
+
+        with nogil:
+            ret = rpc_call_await(
+                self.call,
+                NULL,
+                RPC_THEN(<rpc_then_f>AsyncCall.c_then, arg)
+            )
+
+        if ret != 0:
+            Py_DECREF(self)
+            raise_internal_exc()
+
+        try:
+            await self.future
+        except asyncio.CancelledError:
+            with nogil:
+                rpc_call_abort(self.call)
+
+            raise
+        finally:
+            self.future = None
+
+        return CallStatus(rpc_call_status(self.call))
+
+    def chunk(self):
+        return Object.wrap(rpc_call_result(self.call)).unpack()
+
+    async def stream(self, status):
+        """
+        Asynchronously iterate over the results of a streaming call.
+        """
+        cdef int ret
+
+        try:
+            if status == CallStatus.STREAM_START:
+                with nogil:
+                    ret = rpc_call_continue(self.call, False)
+
+                if ret < 0:
+                    raise_internal_exc()
+
+                status = await self.wait()
+
+            while status == CallStatus.MORE_AVAILABLE:
+                yield self.chunk()
+                with nogil:
+                    ret = rpc_call_continue(self.call, False)
+
+                if ret < 0:
+                    raise_internal_exc()
+
+                status = await self.wait()
+
+            if status == CallStatus.ERROR:
+                raise self.chunk()
+        finally:
+            with nogil:
+                rpc_call_abort(self.call)
+
+    def __dealloc__(self):
+        if self.call != <rpc_call_t>NULL:
+            rpc_call_free(self.call)
+
+
+cdef class EventBatch(object):
+    """
+    Delivers events to a handler on an asyncio event loop. Events that
+    arrive while a delivery is already scheduled join it, so a burst
+    costs a single wakeup of the loop.
+    """
+    cdef object fn
+    cdef object loop
+    cdef object queue
+    cdef bint scheduled
+
+    @staticmethod
+    cdef void c_ev_handler(
+        void *arg, const char *path, const char *interface,
+        const char *name, rpc_object_t args
+    ) with gil:
+        cdef EventBatch self = <EventBatch>arg
+
+        self.queue.append(Object.wrap(args))
+        if self.scheduled:
+            return
+
+        self.scheduled = True
+        try:
+            self.loop.call_soon_threadsafe(self.drain)
+        except RuntimeError:
+            self.scheduled = False
+            self.queue.clear()
+
+    def drain(self):
+        queue = self.queue
+        self.queue = collections.deque()
+        self.scheduled = False
+
+        for args in queue:
+            self.fn(args.unpack())
+
+
 cdef class ListenHandle(object):
     cdef readonly Connection connection
     cdef void *c_cookie
@@ -339,6 +480,64 @@ cdef class Connection(object):
     def call_async(self, method, callback, *args):
         pass
 
+    async def call_aio(self, method, *args, path='/', interface=None):
+        """
+        Asyncio counterpart of call_sync().
+
+        The call doesn't block the event loop. Awaiting it gives the
+        result, or for streaming calls an async iterator over the
+        results.
+        """
+        cdef Array rpc_args
+        cdef AsyncCall acall
+        cdef rpc_call_t call
+        cdef const char *c_path
+        cdef const char *c_interface = NULL
+        cdef const char *c_method
+
+        if self.connection == <rpc_connection_t>NULL:
+            raise RuntimeError("Not connected")
+
+        rpc_args = Array(list(args))
+        b_path = path.encode('utf-8')
+        c_path = b_path
+        b_method = method.encode('utf-8')
+        c_method = b_method
+
+        if interface:
+            b_interface = interface.encode('utf-8')
+            c_interface = b_interface
+
+        with nogil:
+            call = rpc_connection_call(
+                self.connection,
+                c_path,
+                c_interface,
+                c_method,
+                rpc_retain(rpc_args.obj),
+                NULL
+            )
+
+        if call == <rpc_call_t>NULL:
+            raise_internal_exc(rpc=True)
+
+        acall = AsyncCall.__new__(AsyncCall)
+        acall.connection = self
+        acall.call = call
+        acall.loop = asyncio.get_event_loop()
+        status = await acall.wait()
+
+        if status == CallStatus.ERROR:
+            raise acall.chunk()
+
+        if status == CallStatus.DONE:
+            return acall.chunk()
+
+        if status in (CallStatus.STREAM_START, CallStatus.MORE_AVAILABLE, CallStatus.ENDED):
+            return acall.stream(status)
+
+        raise AssertionError('Impossible call status {0}'.format(status))
+
     def emit_event(self, name, Object data, path='/', interface=None):
         cdef const char *c_path
         cdef const char *c_name
@@ -356,8 +555,16 @@ cdef class Connection(object):
         with nogil:
             rpc_connection_send_event(self.connection, c_path, c_interface, c_name, data.obj)
 
-    def register_event_handler(self, name, fn, path='/', interface='com.twoporeguys.librpc.Default'):
+    def register_event_handler(self, name, fn, path='/', interface='com.twoporeguys.librpc.Default', loop=None):
+        """
+        Register a handler for an event.
+
+        With an asyncio event loop given, ``fn`` runs on that loop
+        rather than on a librpc thread, with bursts of events delivered
+        in one go.
+        """
         cdef void *cookie
+        cdef EventBatch batch
 
         if self.connection == <rpc_connection_t>NULL:
             raise RuntimeError("Not connected")
@@ -366,23 +573,119 @@ cdef class Connection(object):
         b_interface = interface.encode('utf-8')
         b_name = name.encode('utf-8')
 
-        self.ev_handlers.append(fn)
-        cookie = rpc_connection_register_event_handler(
-            self.connection,
-            b_path,
-            b_interface,
-            b_name,
-            RPC_HANDLER(
-                <rpc_handler_f>Connection.c_ev_handler,
-                <void *>fn
+        if loop is not None:
+            batch = EventBatch.__new__(EventBatch)
+            batch.fn = fn
+            batch.loop = loop
+            batch.queue = collections.deque()
+            self.ev_handlers.append(batch)
+            cookie = rpc_connection_register_event_handler(
+                self.connection,
+                b_path,
+                b_interface,
+                b_name,
+                RPC_HANDLER(
+                    <rpc_handler_f>EventBatch.c_ev_handler,
+                    <void *>batch
+                )
+            )
+        else:
+            self.ev_handlers.append(fn)
+            cookie = rpc_connection_register_event_handler(
+                self.connection,
+                b_path,
+                b_interface,
+                b_name,
+                RPC_HANDLER(
+                    <rpc_handler_f>Connection.c_ev_handler,
+                    <void *>fn
+                )
             )
-        )
 
         if cookie == NULL:
             raise_internal_exc()
 
         return ListenHandle.init(self, cookie)
 
+    def get_property(self, path, interface, name):
+        cdef rpc_object_t result
+        cdef const char *c_path
+        cdef const char *c_interface
+        cdef const char *c_name
+
+        if self.connection == <rpc_connection_t>NULL:
+            raise RuntimeError("Not connected")
+
+        b_path = path.encode('utf-8')
+        b_interface = interface.encode('utf-8')
+        b_name = name.encode('utf-8')
+        c_path = b_path
+        c_interface = b_interface
+        c_name = b_name
+
+        with nogil:
+            result = rpc_connection_get_property(
+                self.connection,
+                c_path,
+                c_interface,
+                c_name
+            )
+
+        if result == <rpc_object_t>NULL:
+            raise_internal_exc()
+
+        value = Object.wrap(result, False).unpack()
+        if isinstance(value, Exception):
+            raise value
+
+        return value
+
+    def cache_properties(self, path, interface):
+        cdef const char *c_path
+        cdef const char *c_interface
+        cdef int ret
+
+        if self.connection == <rpc_connection_t>NULL:
+            raise RuntimeError("Not connected")
+
+        b_path = path.encode('utf-8')
+        b_interface = interface.encode('utf-8')
+        c_path = b_path
+        c_interface = b_interface
+
+        with nogil:
+            ret = rpc_connection_cache_properties(
+                self.connection,
+                c_path,
+                c_interface
+            )
+
+        if ret != 0:
+            raise_internal_exc()
+
+    def uncache_properties(self, path, interface):
+        cdef const char *c_path
+        cdef const char *c_interface
+        cdef int ret
+
+        if self.connection == <rpc_connection_t>NULL:
+            raise RuntimeError("Not connected")
+
+        b_path = path.encode('utf-8')
+        b_interface = interface.encode('utf-8')
+        c_path = b_path
+        c_interface = b_interface
+
+        with nogil:
+            ret = rpc_connection_uncache_properties(
+                self.connection,
+                c_path,
+                c_interface
+            )
+
+        if ret != 0:
+            raise_internal_exc()
+
     def watch_property(self, path, interface, property, fn):
         cdef void *cookie
 
@@ -480,12 +783,10 @@ cdef class RemoteObject(object):
 
 cdef class RemoteProperty(object):
     def getter(self, parent):
-        return parent.client.call_sync(
-            'get',
+        return parent.client.get_property(
+            parent.path,
             self.interface,
-            self.name,
-            path=parent.path,
-            interface='com.twoporeguys.librpc.Observable'
+            self.name
          )
 
     def setter(self, parent, value):
@@ -603,6 +904,13 @@ cdef class RemoteInterface(object):
         result.client = client
         result.instance = instance
         result.path = path
+
+        # Property reads are served locally from here on
+        try:
+            client.cache_properties(path, interface)
+        except:
+            pass
+
         return result
 
     @staticmethod
@@ -0,0 +1,280 @@
+#
+# Copyright 2017 Two Pore Guys, Inc.
+# All rights reserved
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted providing that the following conditions
+# are met:
+# 1. Redistributions of source code must retain the above copyright
+#    notice, this list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright
+#    notice, this list of conditions and the following disclaimer in the
+#    documentation and/or other materials provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+# IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+# WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+# ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+# DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+# DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+# OR SERVICES LOSS OF USE, DATA, OR PROFITS OR BUSINESS INTERRUPTION)
+# HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+# STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+# IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+# POSSIBILITY OF SUCH DAMAGE.
+#
+
+
+#
+# Methods registered with a Dispatcher don't take the GIL on librpc
+# worker threads: the call is queued as-is and a single Python thread
+# picks up whole batches of them, converting arguments and running
+# handlers under one GIL acquisition.
+#
+cdef rpc_object_t c_cb_dispatch(void *cookie, rpc_object_t args) nogil:
+    cdef dispatch_target *target = <dispatch_target *>rpc_function_get_arg(cookie)
+    cdef dispatch_queue *queue = target.queue
+    cdef dispatch_call *call
+
+    call = <dispatch_call *>malloc(sizeof(dispatch_call))
+    if call == NULL:
+        rpc_function_error(cookie, ENOMEM, "Out of memory")
+        return <rpc_object_t>NULL
+
+    call.cookie = cookie
+    call.fn = target.fn
+    call.args = rpc_retain(args) if args != NULL else <rpc_object_t>NULL
+    call.next = NULL
+    rpc_function_retain(cookie)
+
+    PyThread_acquire_lock(queue.lock, WAIT_LOCK)
+    if queue.closed:
+        PyThread_release_lock(queue.lock)
+        if call.args != NULL:
+            rpc_release(call.args)
+
+        free(call)
+        rpc_function_error(cookie, ESHUTDOWN, "Dispatcher stopped")
+        rpc_function_release(cookie)
+        return <rpc_object_t>NULL
+
+    if queue.tail == NULL:
+        queue.head = call
+    else:
+        queue.tail.next = call
+
+    queue.tail = call
+    if queue.waiting:
+        queue.waiting = False
+        PyThread_release_lock(queue.wakeup)
+
+    PyThread_release_lock(queue.lock)
+    return RPC_FUNCTION_STILL_RUNNING
+
+
+cdef dispatch_call *dispatch_take(dispatch_queue *queue, size_t limit) nogil:
+    cdef dispatch_call *head
+    cdef dispatch_call *last
+    cdef size_t count = 1
+
+    PyThread_acquire_lock(queue.lock, WAIT_LOCK)
+    while queue.head == NULL and not queue.closed:
+        queue.waiting = True
+        PyThread_release_lock(queue.lock)
+        PyThread_acquire_lock(queue.wakeup, WAIT_LOCK)
+        PyThread_acquire_lock(queue.lock, WAIT_LOCK)
+
+    head = queue.head
+    if head == NULL:
+        PyThread_release_lock(queue.lock)
+        return NULL
+
+    last = head
+    while last.next != NULL and count < limit:
+        last = last.next
+        count += 1
+
+    queue.head = last.next
+    if queue.head == NULL:
+        queue.tail = NULL
+
+    last.next = NULL
+    PyThread_release_lock(queue.lock)
+    return head
+
+
+cdef dispatch_respond(void *cookie, output):
+    cdef Object rpc_obj
+
+    try:
+        rpc_obj = Object(output)
+    except Exception as e:
+        dispatch_error(cookie, e)
+        return
+
+    with nogil:
+        rpc_function_respond(cookie, rpc_retain(rpc_obj.unwrap()))
+        rpc_function_release(cookie)
+
+
+cdef dispatch_error(void *cookie, e):
+    cdef Object rpc_obj
+
+    if not isinstance(e, RpcException):
+        e = RpcException(errno.EFAULT, str(e))
+
+    rpc_obj = Object(e)
+    with nogil:
+        rpc_function_error_ex(cookie, rpc_retain(rpc_obj.unwrap()))
+        rpc_function_release(cookie)
+
+
+def dispatch_done(uintptr_t cookie, future):
+    try:
+        output = future.result()
+    except Exception as e:
+        dispatch_error(<void *>cookie, e)
+        return
+
+    dispatch_respond(<void *>cookie, output)
+
+
+def dispatch_stream(uintptr_t cookie, output):
+    cdef void *c_cookie = <void *>cookie
+    cdef Object rpc_obj
+    cdef int ret
+
+    try:
+        with nogil:
+            ret = rpc_function_start_stream(c_cookie)
+
+        if ret == 0:
+            for chunk in output:
+                rpc_obj = Object(chunk)
+                with nogil:
+                    ret = rpc_function_yield(c_cookie, rpc_retain(rpc_obj.unwrap()))
+
+                if ret:
+                    break
+
+            with nogil:
+                rpc_function_end(c_cookie)
+    except Exception as e:
+        dispatch_error(c_cookie, e)
+        return
+
+    with nogil:
+        rpc_function_release(c_cookie)
+
+
+cdef class DispatchTarget(object):
+    def __init__(self, Dispatcher dispatcher, fn):
+        self.fn = fn
+        self.target.queue = &dispatcher.queue
+        self.target.fn = <void *>fn
+
+
+cdef class Dispatcher(object):
+    """
+    Runs Python method handlers on a single thread, in batches.
+
+    Handlers returning a coroutine are scheduled on ``loop`` and answered
+    when done. Generators stream from a thread of their own, since
+    yielding may block waiting for the consumer.
+    """
+    def __init__(self, batch_size=64, loop=None):
+        PyEval_InitThreads()
+        self.batch_size = max(batch_size, 1)
+        self.loop = loop
+        self.targets = []
+        self.thread = None
+        self.queue.lock = PyThread_allocate_lock()
+        self.queue.wakeup = PyThread_allocate_lock()
+        if self.queue.lock == NULL or self.queue.wakeup == NULL:
+            raise MemoryError()
+
+        PyThread_acquire_lock(self.queue.wakeup, WAIT_LOCK)
+        self.queue.head = NULL
+        self.queue.tail = NULL
+        self.queue.waiting = False
+        self.queue.closed = False
+
+    cdef void *target(self, fn):
+        cdef DispatchTarget target
+
+        target = DispatchTarget(self, fn)
+        self.targets.append(target)
+        return <void *>&target.target
+
+    cdef run_call(self, dispatch_call *call):
+        cdef void *cookie = call.cookie
+        cdef object cb = <object>call.fn
+        cdef Object args
+
+        args = Object.wrap(call.args, False)
+        try:
+            output = cb(*[a for a in args]) if call.args != NULL else cb()
+        except Exception as e:
+            dispatch_error(cookie, e)
+            return
+
+        if asyncio.iscoroutine(output):
+            if self.loop is None:
+                output.close()
+                dispatch_error(cookie, RpcException(errno.EINVAL, 'No event loop to run coroutine'))
+                return
+
+            future = asyncio.run_coroutine_threadsafe(output, self.loop)
+            future.add_done_callback(functools.partial(dispatch_done, <uintptr_t>cookie))
+            return
+
+        if isinstance(output, types.GeneratorType):
+            threading.Thread(target=dispatch_stream, args=(<uintptr_t>cookie, output), daemon=True).start()
+            return
+
+        dispatch_respond(cookie, output)
+
+    def run(self):
+        cdef dispatch_call *batch
+        cdef dispatch_call *next
+
+        while True:
+            with nogil:
+                batch = dispatch_take(&self.queue, self.batch_size)
+
+            if batch == NULL:
+                break
+
+            while batch != NULL:
+                next = batch.next
+                self.run_call(batch)
+                free(batch)
+                batch = next
+
+    def start(self):
+        if self.thread:
+            return
+
+        self.thread = threading.Thread(target=self.run, daemon=True)
+        self.thread.start()
+
+    def stop(self):
+        with nogil:
+            PyThread_acquire_lock(self.queue.lock, WAIT_LOCK)
+            self.queue.closed = True
+            if self.queue.waiting:
+                self.queue.waiting = False
+                PyThread_release_lock(self.queue.wakeup)
+
+            PyThread_release_lock(self.queue.lock)
+
+        if self.thread:
+            self.thread.join()
+            self.thread = None
+
+    def __dealloc__(self):
+        if self.queue.lock != NULL:
+            PyThread_free_lock(self.queue.lock)
+
+        if self.queue.wakeup != NULL:
+            PyThread_free_lock(self.queue.wakeup)
@@ -28,6 +28,10 @@ import collections
 cimport cpython.object
 
 
+# Same threshold the msgpack reader uses for packed arrays
+DEF PACK_MIN = 16
+
+
 class ObjectType(enum.IntEnum):
     """
     Enumeration of possible object types.
@@ -44,6 +48,8 @@ class ObjectType(enum.IntEnum):
     ERROR = RPC_TYPE_ERROR
     DICTIONARY = RPC_TYPE_DICTIONARY
     ARRAY = RPC_TYPE_ARRAY
+    IF UNAME_SYSNAME == "Linux":
+        SHMEM = RPC_TYPE_SHMEM
 
 
 class LibException(Exception):
@@ -91,6 +97,14 @@ class RpcException(LibException):
 cdef class Object(object):
     """
     A boxed librpc object.
+
+    Binary, shared memory and packed numeric array objects support the
+    buffer protocol, so ``memoryview(obj)`` or ``numpy.frombuffer(obj,
+    dtype)`` give access to their contents without copying. Binary
+    data and received shared memory are read-only. Views of packed
+    arrays are writable and have the element type as their format;
+    they must not outlive changes to the array that resize it or
+    store a value of another type.
     """
     def __init__(self, value, typei=None):
         """
@@ -99,6 +113,7 @@ cdef class Object(object):
         :param value: Value to box
         :param typei: Type instance to annotate the object
         """
+        cdef Py_buffer *view
 
         if value is None:
             self.obj = rpc_null_create()
@@ -138,20 +153,8 @@ cdef class Object(object):
             stack = Object(value.stacktrace)
             self.obj = rpc_error_create_with_stack(value.code, value.message.encode('utf-8'), extra.obj, stack.obj)
 
-        elif isinstance(value, (list, tuple)):
-            self.obj = rpc_array_create()
-
-            for v in value:
-                child = Object(v)
-                rpc_array_append_value(self.obj, child.obj)
-
-        elif isinstance(value, dict):
-            self.obj = rpc_dictionary_create()
-
-            for k, v in value.items():
-                bkey = k.encode('utf-8')
-                child = Object(v)
-                rpc_dictionary_set_value(self.obj, bkey, child.obj)
+        elif isinstance(value, (list, tuple, dict)):
+            self.obj = py_to_rpc(value)
 
         elif isinstance(value, uuid.UUID):
             bstr = str(value).encode('utf-8')
@@ -165,6 +168,21 @@ cdef class Object(object):
             self.obj = (<BaseTypingObject>value).__object__.unwrap()
             rpc_retain(self.obj)
 
+        elif PyObject_CheckBuffer(value):
+            # memoryview, numpy arrays, mmap... borrowed, not copied
+            view = <Py_buffer *>malloc(sizeof(Py_buffer))
+            try:
+                PyObject_GetBuffer(value, view, PyBUF_CONTIG_RO)
+            except:
+                free(view)
+                raise
+
+            self.obj = rpc_data_create(
+                view.buf,
+                <size_t>view.len,
+                RPC_BINARY_DESTRUCTOR_ARG(destruct_buffer, <void *>view)
+            )
+
         elif hasattr(value, '__getstate__'):
             try:
                 child = Object(value.__getstate__())
@@ -227,10 +245,100 @@ cdef class Object(object):
     def __hash__(self):
         return rpc_hash(self.unwrap())
 
+    def __getbuffer__(self, Py_buffer *buffer, int flags):
+        cdef rpc_type_t objtype
+        cdef rpc_type_t packed
+        cdef void *buf = NULL
+        cdef Py_ssize_t length = 0
+        cdef Py_ssize_t itemsize = 1
+        cdef bint writable = False
+        cdef char *fmt = 'B'
+
+        objtype = rpc_get_type(self.obj)
+
+        if objtype == RPC_TYPE_BINARY:
+            buf = <void *>rpc_data_get_bytes_ptr(self.obj)
+            length = rpc_data_get_length(self.obj)
+
+        elif objtype == RPC_TYPE_ARRAY:
+            packed = rpc_array_get_packed_type(self.obj)
+            itemsize = 8
+            length = rpc_array_get_count(self.obj) * 8
+            writable = True
+
+            if packed == RPC_TYPE_INT64:
+                buf = <void *>rpc_array_get_int64_ptr(self.obj)
+                fmt = 'q'
+            elif packed == RPC_TYPE_UINT64:
+                buf = <void *>rpc_array_get_uint64_ptr(self.obj)
+                fmt = 'Q'
+            elif packed == RPC_TYPE_DOUBLE:
+                buf = <void *>rpc_array_get_double_ptr(self.obj)
+                fmt = 'd'
+            else:
+                raise BufferError('Array is not a packed array of numbers')
+
+        else:
+            IF UNAME_SYSNAME == "Linux":
+                if objtype == RPC_TYPE_SHMEM:
+                    if self.mapping == NULL:
+                        self.mapping = rpc_shmem_map(self.obj)
+
+                    buf = self.mapping
+                    length = rpc_shmem_get_size(self.obj)
+                    writable = self.writable
+                else:
+                    raise BufferError('Object does not expose a buffer')
+            ELSE:
+                raise BufferError('Object does not expose a buffer')
+
+        if flags & PyBUF_WRITABLE and not writable:
+            raise BufferError('Object is read-only')
+
+        self.view_shape = length // itemsize
+        self.view_stride = itemsize
+        buffer.buf = buf
+        buffer.obj = self
+        buffer.len = length
+        buffer.readonly = not writable
+        buffer.itemsize = itemsize
+        buffer.format = fmt if flags & PyBUF_FORMAT else NULL
+        buffer.ndim = 1
+        buffer.shape = &self.view_shape if flags & PyBUF_ND else NULL
+        buffer.strides = &self.view_stride if flags & PyBUF_STRIDES else NULL
+        buffer.suboffsets = NULL
+        buffer.internal = NULL
+
+    def __releasebuffer__(self, Py_buffer *buffer):
+        pass
+
     def __dealloc__(self):
+        IF UNAME_SYSNAME == "Linux":
+            if self.mapping != NULL:
+                rpc_shmem_unmap(self.obj, self.mapping)
+
         if self.obj != <rpc_object_t>NULL:
             rpc_release(self.obj)
 
+    IF UNAME_SYSNAME == "Linux":
+        @staticmethod
+        def shmem(size):
+            """
+            Allocate a writable shared memory object.
+
+            :param size: Size in bytes
+            :return: Object to fill through its buffer and send
+            """
+            cdef Object ret
+
+            ret = Object.__new__(Object)
+            ret.obj = rpc_shmem_create(size)
+            if ret.obj == <rpc_object_t>NULL:
+                raise_internal_exc()
+
+            ret.writable = True
+            return ret
+
     @staticmethod
     cdef wrap(rpc_object_t ptr, bint retain=True):
         cdef Object ret
@@ -261,13 +369,17 @@ cdef class Object(object):
     cdef rpc_object_t unwrap(self) nogil:
         return self.obj
 
-    def unpack(self):
+    def unpack(self, deep=False):
         """
         Unpack boxed value into a native Python value recursively.
 
-        :param self:
+        :param deep: Turn arrays and dictionaries into plain lists and
+                     dicts all the way down instead of wrapping them
         :return:
         """
+        if deep:
+            return rpc_to_py(self.obj)
+
         if self.type == ObjectType.FD:
             return fd(self.value)
 
@@ -369,6 +481,38 @@ cdef class Array(Object):
 
         super(Array, self).__init__(iterable, typei=typei)
 
+    @staticmethod
+    def from_buffer(values, objtype):
+        """
+        Create a packed array of numbers from a buffer, such as a NumPy
+        array of int64, uint64 or float64. The values are copied once
+        into the array; there's no per-element conversion.
+
+        :param values: Contiguous buffer of 8-byte values
+        :param objtype: ObjectType.INT64, ObjectType.UINT64 or ObjectType.DOUBLE
+        :return: Packed Array
+        """
+        cdef Py_buffer view
+        cdef rpc_object_t ptr
+        cdef rpc_type_t ctype
+
+        if objtype not in (ObjectType.INT64, ObjectType.UINT64, ObjectType.DOUBLE):
+            raise ValueError('Only int64, uint64 and double can be packed')
+
+        ctype = <rpc_type_t><int>objtype
+
+        PyObject_GetBuffer(values, &view, PyBUF_CONTIG_RO)
+        try:
+            if view.len % 8 != 0:
+                raise ValueError('Buffer size is not a multiple of 8 bytes')
+
+            with nogil:
+                ptr = rpc_array_create_typed(ctype, view.buf, view.len // 8)
+        finally:
+            PyBuffer_Release(&view)
+
+        return Array.wrap(ptr, False)
+
     @staticmethod
     cdef bint c_applier(void *arg, size_t index, rpc_object_t value) with gil:
         cdef object cb = <object>arg
@@ -488,6 +632,10 @@ cdef class Array(Object):
         rpc_array_remove_index(self.obj, index)
 
     def __iter__(self):
+        if rpc_array_get_packed_type(self.obj) != RPC_TYPE_NULL:
+            yield from rpc_to_py(self.obj)
+            return
+
         result = []
         def collect(idx, v):
             result.append(v)
@@ -692,11 +840,209 @@ cdef raise_internal_exc(rpc=False):
     raise exc(errno.EFAULT, "Unknown error")
 
 
+cdef rpc_object_t py_to_rpc(object value) except NULL:
+    """
+    Convert a Python value into a new librpc object, with the common
+    types handled right here rather than through Object().
+    """
+    cdef rpc_object_t result
+    cdef Object boxed
+    cdef type t = type(value)
+
+    if value is None:
+        return rpc_null_create()
+
+    if t is bool:
+        return rpc_bool_create(value)
+
+    if t is int:
+        return rpc_int64_create(value)
+
+    if t is float:
+        return rpc_double_create(value)
+
+    if t is str:
+        bstr = (<str>value).encode('utf-8')
+        return rpc_string_create(bstr)
+
+    if isinstance(value, (list, tuple)):
+        if len(value) >= PACK_MIN:
+            result = py_pack_numbers(value)
+            if result != <rpc_object_t>NULL:
+                return result
+
+        result = rpc_array_create()
+        try:
+            for v in value:
+                rpc_array_append_stolen_value(result, py_to_rpc(v))
+        except:
+            rpc_release(result)
+            raise
+
+        return result
+
+    if isinstance(value, dict):
+        result = rpc_dictionary_create()
+        try:
+            for k, v in value.items():
+                bkey = k.encode('utf-8')
+                rpc_dictionary_steal_value(result, bkey, py_to_rpc(v))
+        except:
+            rpc_release(result)
+            raise
+
+        return result
+
+    boxed = Object(value)
+    return rpc_retain(boxed.obj)
+
+
+cdef rpc_object_t py_pack_numbers(object value):
+    """
+    Build a packed array out of a list of all ints or all floats.
+    Returns NULL, with no exception set, for anything else.
+    """
+    cdef rpc_object_t result
+    cdef int64_t *ints
+    cdef double *doubles
+    cdef Py_ssize_t count = len(value)
+    cdef Py_ssize_t i
+    cdef type t = type(value[0])
+
+    if t is float:
+        result = rpc_array_create_typed(RPC_TYPE_DOUBLE, NULL, count)
+        doubles = rpc_array_get_double_ptr(result)
+        for i in range(count):
+            v = value[i]
+            if type(v) is not float:
+                rpc_release(result)
+                return <rpc_object_t>NULL
+
+            doubles[i] = <double>v
+
+        return result
+
+    if t is int:
+        result = rpc_array_create_typed(RPC_TYPE_INT64, NULL, count)
+        ints = rpc_array_get_int64_ptr(result)
+        for i in range(count):
+            v = value[i]
+            if type(v) is not int:
+                rpc_release(result)
+                return <rpc_object_t>NULL
+
+            try:
+                ints[i] = <int64_t>v
+            except OverflowError:
+                rpc_release(result)
+                return <rpc_object_t>NULL
+
+        return result
+
+    return <rpc_object_t>NULL
+
+
+cdef object rpc_to_py(rpc_object_t obj):
+    """
+    Convert a librpc object tree into plain Python values, walking
+    arrays by index and packed arrays straight off their storage.
+    """
+    cdef rpct_typei_t typei
+    cdef rpc_type_t packed
+    cdef int64_t *ints
+    cdef uint64_t *uints
+    cdef double *doubles
+    cdef const char *c_string
+    cdef size_t count
+    cdef size_t i
+
+    if obj == <rpc_object_t>NULL:
+        return None
+
+    typei = rpct_get_typei(obj)
+    if typei != <rpct_typei_t>NULL and rpct_type_get_class(rpct_typei_get_type(typei)) != RPC_TYPING_BUILTIN:
+        return Object.wrap(obj).unpack()
+
+    objtype = rpc_get_type(obj)
+
+    if objtype == RPC_TYPE_NULL:
+        return None
+
+    if objtype == RPC_TYPE_BOOL:
+        return rpc_bool_get_value(obj)
+
+    if objtype == RPC_TYPE_INT64:
+        return rpc_int64_get_value(obj)
+
+    if objtype == RPC_TYPE_UINT64:
+        return uint(rpc_uint64_get_value(obj))
+
+    if objtype == RPC_TYPE_DOUBLE:
+        return rpc_double_get_value(obj)
+
+    if objtype == RPC_TYPE_STRING:
+        c_string = rpc_string_get_string_ptr(obj)
+        return c_string[:rpc_string_get_length(obj)].decode('utf-8')
+
+    if objtype == RPC_TYPE_ARRAY:
+        count = rpc_array_get_count(obj)
+        packed = rpc_array_get_packed_type(obj)
+
+        if packed == RPC_TYPE_INT64:
+            ints = rpc_array_get_int64_ptr(obj)
+            return [ints[i] for i in range(count)]
+
+        if packed == RPC_TYPE_UINT64:
+            uints = rpc_array_get_uint64_ptr(obj)
+            return [uint(uints[i]) for i in range(count)]
+
+        if packed == RPC_TYPE_DOUBLE:
+            doubles = rpc_array_get_double_ptr(obj)
+            return [doubles[i] for i in range(count)]
+
+        return [rpc_to_py(rpc_array_get_value(obj, i)) for i in range(count)]
+
+    if objtype == RPC_TYPE_DICTIONARY:
+        # [result, exception raised by the applier]
+        holder = [{}, None]
+        rpc_dictionary_apply(
+            obj,
+            RPC_DICTIONARY_APPLIER(
+                <rpc_dictionary_applier_f>rpc_to_py_applier,
+                <void *>holder
+            )
+        )
+
+        if holder[1] is not None:
+            raise holder[1]
+
+        return holder[0]
+
+    return Object.wrap(obj).unpack()
+
+
+cdef bint rpc_to_py_applier(void *arg, const char *key, rpc_object_t value) with gil:
+    cdef list holder = <list>arg
+
+    try:
+        holder[0][key.decode('utf-8')] = rpc_to_py(value)
+        return True
+    except BaseException as e:
+        holder[1] = e
+        return False
+
+
 cdef void destruct_bytes(void *arg, void *buffer) with gil:
     cdef object value = <object>arg
     Py_DECREF(value)
 
 
+cdef void destruct_buffer(void *arg, void *buffer) with gil:
+    cdef Py_buffer *view = <Py_buffer *>arg
+    PyBuffer_Release(view)
+    free(view)
+
+
 class uint(int):
     def __init__(self, x=0, base=None):
         if base:
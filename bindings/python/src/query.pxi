@@ -172,3 +172,44 @@ def query(object, rules, **params):
         postprocess,
         unpack
     )
+
+
+def request(rules=None, **params):
+    cdef rpc_query_params rpc_params
+    cdef Object rpc_rules = None
+
+    rpc_params.single = bool(params.pop('single', False))
+    rpc_params.count = bool(params.pop('count', None))
+    rpc_params.offset = int(params.pop('offset', 0))
+    rpc_params.limit = int(params.pop('limit', 0))
+    rpc_params.reverse = bool(params.pop('reverse', False))
+    rpc_params.sort = NULL
+    rpc_params.callback = NULL
+
+    if rules is not None:
+        rpc_rules = Object(rules)
+
+    return Object.wrap(rpc_query_request_create(
+        rpc_rules.unwrap() if rpc_rules is not None else <rpc_object_t>NULL,
+        &rpc_params
+    ))
+
+
+def run_request(object, request, unpack=None):
+    cdef rpc_query_iter_t query_iter
+    cdef Object rpc_request = None
+
+    if request is not None:
+        rpc_request = Object(request)
+
+    rpc_obj = Object(object)
+
+    query_iter = rpc_query_request_run(
+        rpc_obj.unwrap(),
+        rpc_request.unwrap() if rpc_request is not None else <rpc_object_t>NULL
+    )
+
+    if query_iter == <rpc_query_iter_t>NULL:
+        return None
+
+    return QueryIterator.wrap(query_iter, None, None, unpack)
@@ -58,14 +58,21 @@ cdef class Context(object):
         if rpc_context_register_instance(self.context, instance.instance) != 0:
             raise_internal_exc()
 
-    def register_method(self, name, fn, interface=None):
+    def register_method(self, name, fn, interface=None, Dispatcher dispatcher=None):
+        cdef void *arg = <void *>fn
+        cdef rpc_function_f cb = <rpc_function_f>c_cb_function
+
+        if dispatcher is not None:
+            arg = dispatcher.target(fn)
+            cb = <rpc_function_f>c_cb_dispatch
+
         self.methods[name] = fn
         if rpc_context_register_func(
             self.context,
             cstr_or_null(interface),
             name.encode('utf-8'),
-            <void *>fn,
-            <rpc_function_f>c_cb_function
+            arg,
+            cb
         ) != 0:
             raise_internal_exc()
 
@@ -136,16 +143,23 @@ cdef class Instance(object):
         if rpc_instance_register_interface(self.instance, b_interface, NULL, <void *>self) != 0:
             raise_internal_exc()
 
-    def register_method(self, interface, name, fn):
+    def register_method(self, interface, name, fn, Dispatcher dispatcher=None):
+        cdef void *arg = <void *>fn
+        cdef rpc_function_f cb = <rpc_function_f>c_cb_function
+
         b_interface = interface.encode('utf-8')
         b_name = name.encode('utf-8')
 
+        if dispatcher is not None:
+            arg = dispatcher.target(fn)
+            cb = <rpc_function_f>c_cb_dispatch
+
         if rpc_instance_register_func(
             self.instance,
             b_interface,
             b_name,
-            <void *>fn,
-            <rpc_function_f>c_cb_function
+            arg,
+            cb
         ) != 0:
             raise_internal_exc()
 
@@ -183,7 +197,7 @@ cdef class Instance(object):
 
 
 cdef class Service(object):
-    def __init__(self, path=None, description='Generic instance', instance=None):
+    def __init__(self, path=None, description='Generic instance', instance=None, dispatcher=None):
         self.methods = {}
         self.properties = {}
         self.interfaces = {}
@@ -206,7 +220,7 @@ cdef class Service(object):
                     self.instance.register_interface(interface)
                     self.interfaces[interface] = True
 
-                self.instance.register_method(interface, name, fn)
+                self.instance.register_method(interface, name, fn, dispatcher)
                 self.methods[name] = fn
                 continue
 
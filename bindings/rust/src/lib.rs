@@ -27,25 +27,28 @@
 
 extern crate libc;
 extern crate block;
+extern crate futures_core;
 use std::fmt;
+use std::str;
+use std::slice;
 use std::ffi::{CString, CStr};
 use std::collections::hash_map::HashMap;
 use std::os::raw::{c_char, c_void};
 use std::ptr::{null, null_mut};
-use std::mem::transmute;
 use std::cell::RefCell;
 use std::rc::Weak;
+use std::future::Future;
+use std::pin::Pin;
+use std::sync::{Arc, Mutex};
+use std::task::{Context, Poll, Waker};
 use libc::free;
 use block::{Block, ConcreteBlock};
+use futures_core::Stream;
 
 macro_rules! to_cstr {
     ($e:expr) => (CString::new($e).unwrap())
 }
 
-macro_rules! null_block {
-    () => (transmute::<*mut c_void, _>(null_mut()))
-}
-
 #[repr(C)]
 #[derive(Debug)]
 pub enum RawType
@@ -69,6 +72,7 @@ pub enum RawType
 pub enum CallStatus
 {
     InProgress,
+    StreamStart,
     MoreAvailable,
     Done,
     Error,
@@ -81,6 +85,15 @@ pub enum RawConnection {}
 pub enum RawClient {}
 pub enum RawCall {}
 
+/// Plain function callback of `rpc_connection_call_f()`.
+pub type CallbackFn = extern "C" fn(ctx: *mut c_void, call: *mut RawCall) -> bool;
+
+/// State behind the context pointer of an asynchronous call's callback.
+struct AsyncCallback<'a> {
+    connection: &'a Connection,
+    callback: Box<Fn(&Call) -> bool + 'a>
+}
+
 pub struct Object
 {
     value: *mut RawObject,
@@ -103,6 +116,33 @@ pub struct Call<'a>
     value: *mut RawCall
 }
 
+/// Shared between a pending future and the completion block that
+/// librpc runs once the call has something to report.
+struct Wakeup
+{
+    fired: bool,
+    waker: Option<Waker>
+}
+
+/// Resolves once with the call's result, from any executor (tokio
+/// included) as the wakeup comes from librpc's completion path.
+pub struct CallFuture
+{
+    value: *mut RawCall,
+    wakeup: Arc<Mutex<Wakeup>>,
+    armed: bool,
+    settled: bool
+}
+
+/// Yields every fragment of a streaming call, one continue at a time.
+pub struct CallStream
+{
+    value: *mut RawCall,
+    wakeup: Arc<Mutex<Wakeup>>,
+    armed: bool,
+    ended: bool
+}
+
 pub struct Instance<'a>
 {
     connection: &'a Connection,
@@ -159,8 +199,16 @@ extern {
     pub fn rpc_date_create(value: u64) -> *mut RawObject;
     pub fn rpc_date_get_value(obj: *mut RawObject) -> u64;
     pub fn rpc_string_create(value: *const c_char) -> *mut RawObject;
+    pub fn rpc_string_create_len(value: *const c_char, len: usize) -> *mut RawObject;
     pub fn rpc_string_get_string_ptr(value: *mut RawObject) -> *const c_char;
+    pub fn rpc_string_get_length(value: *mut RawObject) -> usize;
     pub fn rpc_data_create(ptr: *const u8, len: usize, dtor: *const c_void) -> *mut RawObject;
+    pub fn rpc_data_get_bytes_ptr(value: *mut RawObject) -> *const u8;
+    pub fn rpc_data_get_length(value: *mut RawObject) -> usize;
+    pub fn rpc_error_get_code(value: *mut RawObject) -> i32;
+    pub fn rpc_error_get_message(value: *mut RawObject) -> *const c_char;
+    pub fn rpc_error_get_extra(value: *mut RawObject) -> *mut RawObject;
+    pub fn rpc_error_get_stack(value: *mut RawObject) -> *mut RawObject;
     pub fn rpc_array_create() -> *mut RawObject;
     pub fn rpc_dictionary_create() -> *mut RawObject;
     pub fn rpc_array_append_value(obj: *mut RawObject, value: *mut RawObject);
@@ -176,12 +224,19 @@ extern {
                                interface: *const c_char, name: *const c_char,
                                args: *const RawObject,
                                callback: &Block<(*mut RawCall,), bool>) -> *mut RawCall;
+    pub fn rpc_connection_call_f(conn: *mut RawConnection, path: *const c_char,
+                                 interface: *const c_char, name: *const c_char,
+                                 args: *const RawObject, callback: Option<CallbackFn>,
+                                 ctx: *mut c_void) -> *mut RawCall;
 
     pub fn rpc_call_status(call: *mut RawCall) -> CallStatus;
     pub fn rpc_call_result(call: *mut RawCall) -> *mut RawObject;
-    pub fn rpc_call_continue(call: *mut RawCall);
-    pub fn rpc_call_abort(call: *mut RawCall);
-    pub fn rpc_call_wait(call: *mut RawCall);
+    pub fn rpc_call_continue(call: *mut RawCall, sync: bool) -> i32;
+    pub fn rpc_call_abort(call: *mut RawCall) -> i32;
+    pub fn rpc_call_wait(call: *mut RawCall) -> i32;
+    pub fn rpc_call_await(call: *mut RawCall, executor: *const c_void,
+                          then: &Block<(*mut RawCall,), ()>) -> i32;
+    pub fn rpc_call_free(call: *mut RawCall);
 
     /* rpc/client.h */
     pub fn rpc_client_create(uri: *const c_char, params: *const RawObject) -> *mut RawClient;
@@ -296,8 +351,7 @@ impl Object {
                 Value::Binary(ref val) => rpc_data_create(val.as_ptr(), val.len(), null()),
                 Value::Object(ref val) => rpc_retain(val.value),
                 Value::String(ref val) => {
-                    let c_val = to_cstr!(val.as_str());
-                    rpc_string_create(c_val.as_ptr())
+                    rpc_string_create_len(val.as_ptr() as *const c_char, val.len())
                 },
                 Value::Array(val) => {
                     let arr = rpc_array_create();
@@ -325,6 +379,46 @@ impl Object {
         }
     }
 
+    /// Takes a new reference on an object owned by someone else.
+    fn borrow(value: *mut RawObject) -> Object {
+        unsafe {
+            Object { value: rpc_retain(value) }
+        }
+    }
+
+    /// Borrows the string held by the object, without copying it.
+    pub fn as_str(&self) -> Option<&str> {
+        unsafe {
+            match self.get_raw_type() {
+                RawType::String => {
+                    let bytes = slice::from_raw_parts(
+                        rpc_string_get_string_ptr(self.value) as *const u8,
+                        rpc_string_get_length(self.value));
+
+                    str::from_utf8(bytes).ok()
+                },
+                _ => Option::None
+            }
+        }
+    }
+
+    /// Borrows the buffer of a binary object, without copying it.
+    pub fn as_bytes(&self) -> Option<&[u8]> {
+        unsafe {
+            match self.get_raw_type() {
+                RawType::Binary => {
+                    let len = rpc_data_get_length(self.value);
+                    match len {
+                        0 => Option::Some(&[]),
+                        _ => Option::Some(slice::from_raw_parts(
+                            rpc_data_get_bytes_ptr(self.value), len))
+                    }
+                },
+                _ => Option::None
+            }
+        }
+    }
+
     pub fn get_raw_type(&self) -> RawType {
         unsafe {
             rpc_get_type(self.value)
@@ -339,14 +433,35 @@ impl Object {
                 RawType::Uint64 => Value::Uint64(rpc_uint64_get_value(self.value)),
                 RawType::Int64 => Value::Int64(rpc_int64_get_value(self.value)),
                 RawType::Double => Value::Double(rpc_double_get_value(self.value)),
-                RawType::String => Value::String(String::from(CStr::from_ptr(
-                    rpc_string_get_string_ptr(self.value)).to_str().unwrap())),
+                RawType::String => Value::String(String::from(self.as_str().unwrap())),
                 RawType::Date => Value::Date(rpc_date_get_value(self.value)),
-                RawType::Binary => Value::Null,
+                RawType::Binary => Value::Binary(self.as_bytes().unwrap().to_vec()),
                 RawType::Fd => Value::Fd(rpc_fd_get_value(self.value)),
                 RawType::Array => Value::Null,
                 RawType::Dictionary => Value::Null,
-                RawType::Error => Value::Null,
+                RawType::Error => Value::Error(Error::from_object(self)),
+            }
+        }
+    }
+}
+
+impl Error {
+    pub fn from_object(obj: &Object) -> Error {
+        unsafe {
+            let message = rpc_error_get_message(obj.value);
+            let unpack = |value: *mut RawObject| match value.is_null() {
+                true => Value::Null,
+                false => Object::borrow(value).unpack()
+            };
+
+            Error {
+                code: rpc_error_get_code(obj.value) as u32,
+                message: match message.is_null() {
+                    true => String::new(),
+                    false => CStr::from_ptr(message).to_string_lossy().into_owned()
+                },
+                stack_trace: Box::new(unpack(rpc_error_get_stack(obj.value))),
+                extra: Box::new(unpack(rpc_error_get_extra(obj.value)))
             }
         }
     }
@@ -378,7 +493,19 @@ impl<'a> Call<'a> {
 
             match result.is_null() {
                 true => Option::None,
-                false => Option::Some(Object { value: result }.unpack())
+                false => Option::Some(Object::borrow(result).unpack())
+            }
+        }
+    }
+
+    /// Borrows the current result object, without unpacking it.
+    pub fn result_object(&self) -> Option<Object> {
+        unsafe {
+            let result = rpc_call_result(self.value);
+
+            match result.is_null() {
+                true => Option::None,
+                false => Option::Some(Object::borrow(result))
             }
         }
     }
@@ -406,21 +533,208 @@ impl<'a> Call<'a> {
     }
 }
 
+impl Wakeup {
+    fn new() -> Arc<Mutex<Wakeup>> {
+        Arc::new(Mutex::new(Wakeup { fired: false, waker: Option::None }))
+    }
+}
+
+/// Registers a waker, then asks librpc to fire it once the call either
+/// settles or has another fragment queued. The completion may run right
+/// away on this thread, hence the waker goes in first.
+fn call_arm(call: *mut RawCall, wakeup: &Arc<Mutex<Wakeup>>, waker: &Waker) {
+    wakeup.lock().unwrap().waker = Option::Some(waker.clone());
+
+    let shared = wakeup.clone();
+    let block = ConcreteBlock::new(move |_call: *mut RawCall| {
+        let mut state = shared.lock().unwrap();
+        state.fired = true;
+        if let Option::Some(waker) = state.waker.take() {
+            waker.wake();
+        }
+    }).copy();
+
+    unsafe {
+        rpc_call_await(call, null(), &block);
+    }
+}
+
+/// Consumes a wakeup, if one has arrived since the last poll.
+fn call_fired(wakeup: &Arc<Mutex<Wakeup>>, waker: &Waker) -> bool {
+    let mut state = wakeup.lock().unwrap();
+
+    if state.fired {
+        state.fired = false;
+        return true;
+    }
+
+    state.waker = Option::Some(waker.clone());
+    false
+}
+
+fn call_chunk(call: *mut RawCall) -> Value {
+    unsafe {
+        let result = rpc_call_result(call);
+
+        match result.is_null() {
+            true => Value::Null,
+            false => Object::borrow(result).unpack()
+        }
+    }
+}
+
+fn call_error(call: *mut RawCall) -> Error {
+    match call_chunk(call) {
+        Value::Error(err) => err,
+        other => Error {
+            code: 0,
+            message: String::from("Call did not complete"),
+            stack_trace: Box::new(Value::Null),
+            extra: Box::new(other)
+        }
+    }
+}
+
+// librpc calls are safe to poll and complete from any thread.
+unsafe impl Send for CallFuture {}
+unsafe impl Send for CallStream {}
+
+impl Future for CallFuture {
+    type Output = Result<Value, Error>;
+
+    fn poll(self: Pin<&mut Self>, cx: &mut Context) -> Poll<Self::Output> {
+        let this = self.get_mut();
+
+        if !this.armed {
+            this.armed = true;
+            call_arm(this.value, &this.wakeup, cx.waker());
+        }
+
+        if !call_fired(&this.wakeup, cx.waker()) {
+            return Poll::Pending;
+        }
+
+        this.settled = true;
+        unsafe {
+            Poll::Ready(match rpc_call_status(this.value) {
+                CallStatus::Done |
+                CallStatus::MoreAvailable => Ok(call_chunk(this.value)),
+                _ => Err(call_error(this.value))
+            })
+        }
+    }
+}
+
+impl Drop for CallFuture {
+    fn drop(&mut self) {
+        unsafe {
+            if !self.settled {
+                rpc_call_abort(self.value);
+            }
+
+            rpc_call_free(self.value);
+        }
+    }
+}
+
+impl Stream for CallStream {
+    type Item = Result<Value, Error>;
+
+    fn poll_next(self: Pin<&mut Self>, cx: &mut Context) -> Poll<Option<Self::Item>> {
+        let this = self.get_mut();
+
+        loop {
+            if this.ended {
+                return Poll::Ready(Option::None);
+            }
+
+            if !this.armed {
+                this.armed = true;
+                call_arm(this.value, &this.wakeup, cx.waker());
+            }
+
+            if !call_fired(&this.wakeup, cx.waker()) {
+                return Poll::Pending;
+            }
+
+            this.armed = false;
+            unsafe {
+                match rpc_call_status(this.value) {
+                    CallStatus::StreamStart => {
+                        rpc_call_continue(this.value, false);
+                    },
+                    CallStatus::MoreAvailable => {
+                        let chunk = call_chunk(this.value);
+                        rpc_call_continue(this.value, false);
+                        return Poll::Ready(Option::Some(Ok(chunk)));
+                    },
+                    CallStatus::Ended |
+                    CallStatus::Done => {
+                        this.ended = true;
+                    },
+                    _ => {
+                        this.ended = true;
+                        return Poll::Ready(Option::Some(Err(call_error(this.value))));
+                    }
+                }
+            }
+        }
+    }
+}
+
+impl Drop for CallStream {
+    fn drop(&mut self) {
+        unsafe {
+            if !self.ended {
+                rpc_call_abort(self.value);
+            }
+
+            rpc_call_free(self.value);
+        }
+    }
+}
+
 impl Connection {
-    pub fn call(&self, name: &str, path: &str, interface: &str, args: &[Value]) -> Call {
+    fn call_raw(&self, name: &str, path: &str, interface: &str,
+                args: &[Value]) -> *mut RawCall {
         unsafe {
             let c_path = to_cstr!(path);
             let c_interface = to_cstr!(interface);
             let c_name = to_cstr!(name);
-            let call = rpc_connection_call(
+
+            rpc_connection_call_f(
                 self.value, c_path.as_ptr(), c_interface.as_ptr(), c_name.as_ptr(),
-                Object::create(args).value, null_block!()
-            );
+                Object::create(args).value, Option::None, null_mut()
+            )
+        }
+    }
 
-            Call { value: call, connection: self }
+    /// Issues a call that resolves as a `Future`, without blocking.
+    pub fn call_future(&self, name: &str, path: &str, interface: &str,
+                       args: &[Value]) -> CallFuture {
+        CallFuture {
+            value: self.call_raw(name, path, interface, args),
+            wakeup: Wakeup::new(),
+            armed: false,
+            settled: false
         }
     }
 
+    /// Issues a streaming call whose fragments arrive as a `Stream`.
+    pub fn call_stream(&self, name: &str, path: &str, interface: &str,
+                       args: &[Value]) -> CallStream {
+        CallStream {
+            value: self.call_raw(name, path, interface, args),
+            wakeup: Wakeup::new(),
+            armed: false,
+            ended: false
+        }
+    }
+
+    pub fn call(&self, name: &str, path: &str, interface: &str, args: &[Value]) -> Call {
+        Call { value: self.call_raw(name, path, interface, args), connection: self }
+    }
+
     pub fn call_sync(&self, name: &str, path: &str, interface: &str,
                      args: &[Value]) -> Option<Value> {
         let mut c = self.call(name, path, interface, args);
@@ -434,19 +748,43 @@ impl Connection {
             let c_path = to_cstr!(path);
             let c_interface = to_cstr!(interface);
             let c_name = to_cstr!(name);
-            let block = ConcreteBlock::new(move |raw_call| {
-                let call = Call { connection: self, value: raw_call };
-                callback(&call)
-            });
+            let ctx = Box::into_raw(Box::new(AsyncCallback {
+                connection: self,
+                callback: callback
+            }));
 
-            rpc_connection_call(
+            let call = rpc_connection_call_f(
                 self.value, c_path.as_ptr(), c_interface.as_ptr(), c_name.as_ptr(),
-                Object::create(args).value, &block
+                Object::create(args).value, Option::Some(call_async_trampoline),
+                ctx as *mut c_void
             );
+
+            if call.is_null() {
+                drop(Box::from_raw(ctx));
+            }
         }
     }
 }
 
+/// Runs the boxed callback of `Connection::call_async()`. No block is
+/// copied per call; the box goes away with the call's final result.
+extern "C" fn call_async_trampoline(ctx: *mut c_void, raw_call: *mut RawCall) -> bool {
+    let state = ctx as *mut AsyncCallback;
+    let more = unsafe {
+        let call = Call { connection: (*state).connection, value: raw_call };
+        ((*state).callback)(&call)
+    };
+
+    match unsafe { rpc_call_status(raw_call) } {
+        CallStatus::Done | CallStatus::Error | CallStatus::Aborted | CallStatus::Ended => {
+            unsafe { drop(Box::from_raw(state)); }
+        },
+        _ => {}
+    }
+
+    more
+}
+
 impl Client {
     pub fn connect(uri: &str) -> Client {
         unsafe {
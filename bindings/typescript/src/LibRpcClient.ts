@@ -7,7 +7,7 @@ import {assign, fromPairs, startsWith} from 'lodash';
 import {Observable} from 'rxjs/Observable';
 import {distinctUntilChanged, filter, map, take} from 'rxjs/operators';
 import {Subject} from 'rxjs/Subject';
-import {LibRpcConnector} from './LibRpcConnector';
+import {LibRpcConnector, LibRpcDecodingOptions} from './LibRpcConnector';
 import {LibRpcEvent, LibRpcFragment, LibRpcRequest, LibRpcResponse} from './model';
 import {v4} from './uuidv4';
 
@@ -62,9 +62,15 @@ export class LibRpcClient {
      * @param {string} url librpc server's URL
      * @param {boolean} isDebugEnabled Should messages sent and received be logged in the console?
      * @param {LibRpcConnector} connector Override url and re-use provided LibRpcConnector instance
+     * @param {LibRpcDecodingOptions} decoding How incoming frames are decoded and delivered
      */
-    public constructor(url: string, isDebugEnabled: boolean = false, connector?: LibRpcConnector) {
-        this.connector = (connector || new LibRpcConnector(url, isDebugEnabled));
+    public constructor(
+        url: string,
+        isDebugEnabled: boolean = false,
+        connector?: LibRpcConnector,
+        decoding: LibRpcDecodingOptions = {}
+    ) {
+        this.connector = (connector || new LibRpcConnector(url, isDebugEnabled, undefined, 0, decoding));
     }
 
     /**
@@ -78,6 +84,21 @@ export class LibRpcClient {
         );
     }
 
+    /**
+     * Streams payloads of 'events.event' messages in batches, one per delivery;
+     * see `batchPerFrame` in LibRpcDecodingOptions.
+     * @returns {Observable<LibRpcEvent[]>}
+     */
+    public get eventBatches$(): Observable<LibRpcEvent[]> {
+        return this.connector.listenBatches().pipe(
+            map((messages: LibRpcResponse[]) => messages
+                .filter(LibRpcClient.isEvent)
+                .map((message: LibRpcResponse<LibRpcEvent>) => message.args)
+            ),
+            filter((events: LibRpcEvent[]) => events.length > 0)
+        );
+    }
+
     /**
      * Streams connection status as a boolean value (true = connected, false = disconnected).
      * @returns {Observable<boolean>}
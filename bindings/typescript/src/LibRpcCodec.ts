@@ -0,0 +1,71 @@
+/**
+ * @module LibRpcClient
+ */
+import {Codec, createCodec, decode} from 'msgpack-lite';
+import {inflateRaw} from 'pako';
+
+export const DEFLATE_EXT_TYPE = 0x05;
+
+/*
+ * librpc sends packed arrays as plain msgpack arrays of uniform numbers;
+ * below this length a typed array isn't worth the allocation.
+ */
+export const TYPED_ARRAY_MIN = 16;
+
+export interface LibRpcDecoderRequest {
+    frame: ArrayBuffer | string;
+    typedArrays: boolean;
+}
+
+export interface LibRpcDecoderResponse {
+    message?: any;
+    error?: string;
+}
+
+export function createLibRpcCodec(): Codec {
+    const codec = createCodec();
+    const unpackers: Map<number, (buffer: Uint8Array) => any> = new Map([
+        [0x01, (buffer: Uint8Array) => new Date(new DataView(buffer.buffer, 0).getUint32(0, true) * 1000)],
+        [0x04, (buffer: Uint8Array) => decode(buffer, {codec: codec})],
+        [DEFLATE_EXT_TYPE, (buffer: Uint8Array) => decode(inflateRaw(buffer), {codec: codec})],
+    ]);
+
+    unpackers.forEach(
+        (unPacker: (buffer: Uint8Array) => any, eType: number) => codec.addExtUnpacker(eType, unPacker)
+    );
+    return codec;
+}
+
+/**
+ * Decode a WebSocket frame, binary frames being msgpack and text frames JSON.
+ * @param {ArrayBuffer | string} data Frame payload
+ * @param {Codec} codec Codec returned by createLibRpcCodec()
+ * @returns {any}
+ */
+export function decodeFrame(data: ArrayBuffer | string, codec: Codec): any {
+    return typeof data === 'object' ? decode(new Uint8Array(data), {codec: codec}) : JSON.parse(data);
+}
+
+/**
+ * Replace every numeric array of at least TYPED_ARRAY_MIN elements in a decoded
+ * message by a Float64Array, whose buffer is collected in `transfer` so it can
+ * be handed over with postMessage() instead of being cloned.
+ * @param value Decoded message, modified in place
+ * @param {ArrayBuffer[]} transfer Receives the buffers of created typed arrays
+ * @returns {any}
+ */
+export function packNumericArrays(value: any, transfer: ArrayBuffer[]): any {
+    if (Array.isArray(value)) {
+        if (value.length >= TYPED_ARRAY_MIN && value.every((item: any) => typeof item === 'number')) {
+            const packed = new Float64Array(value);
+            transfer.push(packed.buffer as ArrayBuffer);
+            return packed;
+        }
+        for (let i = 0; i < value.length; i++) {
+            value[i] = packNumericArrays(value[i], transfer);
+        }
+    } else if (value && value.constructor === Object) {
+        Object.keys(value).forEach((key: string) => value[key] = packNumericArrays(value[key], transfer));
+    }
+    return value;
+}
@@ -1,43 +1,77 @@
 /**
  * @module LibRpcClient
  */
-import {Codec, createCodec, decode, encode} from 'msgpack-lite';
+import {Codec, encode} from 'msgpack-lite';
+import {deflateRaw} from 'pako';
 import {BehaviorSubject} from 'rxjs/BehaviorSubject';
 import {Observable} from 'rxjs/Observable';
 import {Subject} from 'rxjs/Subject';
+import {
+    createLibRpcCodec,
+    decodeFrame,
+    DEFLATE_EXT_TYPE,
+    LibRpcDecoderRequest,
+    LibRpcDecoderResponse,
+    packNumericArrays
+} from './LibRpcCodec';
 import {LibRpcRequest} from './model';
 import {WebSocketFactory} from './WebSocketFactory';
 
+const DEFLATE_PROTOCOL = 'librpc.deflate';
+
+export interface LibRpcDecodingOptions {
+    /** URL of the LibRpcDecoderWorker bundle; frames are decoded on the main thread without it */
+    decoderWorkerUrl?: string;
+    /** Turn long numeric arrays into Float64Array */
+    typedArrays?: boolean;
+    /** Deliver incoming messages once per animation frame rather than one by one */
+    batchPerFrame?: boolean;
+}
+
 export class LibRpcConnector {
     public isConnected$ = new BehaviorSubject<boolean>(false);
 
-    private EXT_UNPACKERS: Map<number, (buffer: Uint8Array) => any> = new Map([
-        [0x01, (buffer: Uint8Array) => new Date(new DataView(buffer.buffer, 0).getUint32(0, true) * 1000)],
-        [0x04, (buffer: Uint8Array) => decode(buffer, {codec: this.codec})],
-    ]);
-
     private ws: WebSocket;
     private messages$: Subject<any>;
+    private batches$: Subject<any[]>;
     private messageBuffer: Buffer[];
     private codec: Codec;
+    private decoder?: Worker;
+    private pending: any[];
+    private isFlushScheduled: boolean;
 
     public constructor(
         private url: string,
         private isDebugEnabled: boolean = false,
-        private webSocketFactory: WebSocketFactory = new WebSocketFactory()
+        private webSocketFactory: WebSocketFactory = new WebSocketFactory(),
+        private compressThreshold: number = 0,
+        private decoding: LibRpcDecodingOptions = {}
     ) {
-        this.codec = createCodec();
-        this.EXT_UNPACKERS.forEach(
-            (unPacker: (buffer: Uint8Array) => any, eType: number) => this.codec.addExtUnpacker(eType, unPacker)
-        );
+        this.codec = createLibRpcCodec();
         this.messages$ = new Subject<any>();
+        this.batches$ = new Subject<any[]>();
         this.messageBuffer = [];
+        this.pending = [];
+        this.isFlushScheduled = false;
+
+        if (this.decoding.decoderWorkerUrl) {
+            this.decoder = new Worker(this.decoding.decoderWorkerUrl);
+            this.decoder.onmessage = (event: MessageEvent) => {
+                const response = event.data as LibRpcDecoderResponse;
+                if (response.error) {
+                    // tslint:disable-next-line:no-console
+                    console.error('Cannot decode frame:', response.error);
+                } else {
+                    this.receive(response.message);
+                }
+            };
+        }
 
         if (this.isDebugEnabled) {
             // tslint:disable-next-line:no-console
             this.messages$.subscribe((message: any) => console.log('RECV\n', JSON.stringify(message)));
         }
-        this.ws = this.webSocketFactory.get(this.url);
+        this.ws = this.webSocketFactory.get(this.url, [DEFLATE_PROTOCOL]);
         this.connect();
     }
 
@@ -49,7 +83,7 @@ export class LibRpcConnector {
         const data = encode(message);
         switch (this.ws.readyState) {
             case this.webSocketFactory.OPEN:
-                this.ws.send(data);
+                this.ws.send(this.compress(data));
                 break;
             case this.webSocketFactory.CLOSED:
             case this.webSocketFactory.CLOSING:
@@ -67,6 +101,16 @@ export class LibRpcConnector {
         return this.messages$;
     }
 
+    /**
+     * Streams incoming messages grouped by delivery: one animation frame's worth
+     * of them with `batchPerFrame`, otherwise one message at a time.
+     * @returns {Observable<any[]>}
+     */
+    public listenBatches(): Observable<any[]> {
+        this.listen();
+        return this.batches$;
+    }
+
     public listen(): Observable<any> {
         if (!this.ws ||
             this.ws.readyState === this.webSocketFactory.CLOSED ||
@@ -78,7 +122,7 @@ export class LibRpcConnector {
     }
 
     private connect() {
-        this.ws = this.webSocketFactory.get(this.url);
+        this.ws = this.webSocketFactory.get(this.url, [DEFLATE_PROTOCOL]);
         this.isConnected$.next(this.ws.readyState === this.webSocketFactory.OPEN);
         this.ws.binaryType = 'arraybuffer';
         this.ws.onopen = () => {
@@ -89,19 +133,73 @@ export class LibRpcConnector {
                 this.isConnected$.next(false);
             };
 
-            this.ws.onmessage = (message: MessageEvent) => {
-                this.messages$.next(
-                    typeof message.data === 'object' ?
-                        decode(new Uint8Array(message.data), {codec: this.codec}) : JSON.parse(message.data)
-                );
-            };
+            this.ws.onmessage = (message: MessageEvent) => this.decode(message.data);
         };
     }
 
+    private decode(frame: ArrayBuffer | string) {
+        if (this.decoder) {
+            const request: LibRpcDecoderRequest = {frame: frame, typedArrays: !!this.decoding.typedArrays};
+            this.decoder.postMessage(request, typeof frame === 'object' ? [frame] : []);
+            return;
+        }
+        const message = decodeFrame(frame, this.codec);
+        this.receive(this.decoding.typedArrays ? packNumericArrays(message, []) : message);
+    }
+
+    private receive(message: any) {
+        if (!this.decoding.batchPerFrame) {
+            this.messages$.next(message);
+            this.batches$.next([message]);
+            return;
+        }
+        this.pending.push(message);
+        if (!this.isFlushScheduled) {
+            this.isFlushScheduled = true;
+            if (typeof requestAnimationFrame === 'function') {
+                requestAnimationFrame(() => this.flush());
+            } else {
+                setTimeout(() => this.flush(), 16);
+            }
+        }
+    }
+
+    private flush() {
+        const batch = this.pending;
+        this.pending = [];
+        this.isFlushScheduled = false;
+        batch.forEach((message: any) => this.messages$.next(message));
+        this.batches$.next(batch);
+    }
+
+    /*
+     * Frames above the threshold are deflated and wrapped in a msgpack ext,
+     * provided the server agreed to it during the handshake.
+     */
+    private compress(data: Buffer): Uint8Array {
+        if (this.compressThreshold <= 0 ||
+            data.length < this.compressThreshold ||
+            this.ws.protocol !== DEFLATE_PROTOCOL
+        ) {
+            return data;
+        }
+        const deflated = deflateRaw(data);
+        if (deflated.length + 6 >= data.length) {
+            return data;
+        }
+        const frame = new Uint8Array(deflated.length + 6);
+        const view = new DataView(frame.buffer);
+        view.setUint8(0, 0xc9);
+        view.setUint32(1, deflated.length);
+        view.setUint8(5, DEFLATE_EXT_TYPE);
+        frame.set(deflated, 6);
+        return frame;
+    }
+
     private emptyMessageQueue() {
         let data = this.messageBuffer.shift();
         while (data) {
-            this.ws.send(data);
+            this.ws.send(this.compress(data));
             data = this.messageBuffer.shift();
         }
     }
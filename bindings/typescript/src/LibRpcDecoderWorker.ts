@@ -0,0 +1,29 @@
+/**
+ * @module LibRpcClient
+ * Web Worker entry point decoding frames off the main thread.
+ * Built as its own bundle and passed to LibRpcConnector via `decoderWorkerUrl`.
+ */
+import {
+    createLibRpcCodec,
+    decodeFrame,
+    LibRpcDecoderRequest,
+    LibRpcDecoderResponse,
+    packNumericArrays
+} from './LibRpcCodec';
+
+const codec = createLibRpcCodec();
+const worker: Worker = self as any;
+
+worker.onmessage = (event: MessageEvent) => {
+    const request = event.data as LibRpcDecoderRequest;
+    const transfer: ArrayBuffer[] = [];
+    let response: LibRpcDecoderResponse;
+
+    try {
+        const message = decodeFrame(request.frame, codec);
+        response = {message: request.typedArrays ? packNumericArrays(message, transfer) : message};
+    } catch (e) {
+        response = {error: String(e)};
+    }
+    worker.postMessage(response, transfer);
+};
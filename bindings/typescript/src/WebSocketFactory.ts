@@ -7,7 +7,7 @@ export class WebSocketFactory {
     public CONNECTING = WebSocket.CONNECTING;
     public OPEN = WebSocket.OPEN;
 
-    public get(url: string): WebSocket {
-        return new WebSocket(url);
+    public get(url: string, protocols?: string[]): WebSocket {
+        return new WebSocket(url, protocols);
     }
 }
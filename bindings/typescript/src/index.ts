@@ -1,2 +1,3 @@
 export * from './model';
 export * from './LibRpcClient';
+export {LibRpcDecodingOptions} from './LibRpcConnector';
@@ -0,0 +1,43 @@
+import {expect} from 'chai';
+import {encode} from 'msgpack-lite';
+import 'mocha';
+
+import {createLibRpcCodec, decodeFrame, packNumericArrays, TYPED_ARRAY_MIN} from '../src/LibRpcCodec';
+
+describe('LibRpcCodec', () => {
+    describe('decodeFrame', () => {
+        it('should decode binary frames as msgpack', () => {
+            const data = encode({name: 'event', args: [1, 2]});
+            const frame = data.buffer.slice(data.byteOffset, data.byteOffset + data.length);
+
+            expect(decodeFrame(frame as ArrayBuffer, createLibRpcCodec())).to.deep.equal({name: 'event', args: [1, 2]});
+        });
+
+        it('should decode text frames as JSON', () => {
+            expect(decodeFrame('{"name": "event"}', createLibRpcCodec())).to.deep.equal({name: 'event'});
+        });
+    });
+
+    describe('packNumericArrays', () => {
+        it('should turn long numeric arrays into transferable Float64Array', () => {
+            const values = Array.from({length: TYPED_ARRAY_MIN}, (v: any, i: number) => i * 0.5);
+            const transfer: ArrayBuffer[] = [];
+
+            const result = packNumericArrays({args: {samples: values}}, transfer);
+
+            expect(result.args.samples).to.be.instanceof(Float64Array);
+            expect(Array.from(result.args.samples)).to.deep.equal(values);
+            expect(transfer).to.deep.equal([result.args.samples.buffer]);
+        });
+
+        it('should leave short and mixed arrays alone', () => {
+            const mixed = Array.from({length: TYPED_ARRAY_MIN}, (v: any, i: number) => i % 2 ? i : 'x');
+            const transfer: ArrayBuffer[] = [];
+
+            const result = packNumericArrays([[1, 2, 3], mixed], transfer);
+
+            expect(result).to.deep.equal([[1, 2, 3], mixed]);
+            expect(transfer).to.be.empty;
+        });
+    });
+});
@@ -2,7 +2,7 @@ const packageInfo = require('./package.json');
 const path = require('path');
 const _ = require('lodash');
 
-module.exports = {
+const config = {
     entry: {
         'index': './src/index.ts',
     },
@@ -39,3 +39,20 @@ module.exports = {
         ]
     },
 };
+
+/*
+ * The decoder worker runs in its own global scope where the externals
+ * above can't be resolved, so it is bundled with its dependencies.
+ */
+const workerConfig = _.assign({}, config, {
+    entry: {
+        'decoder.worker': './src/LibRpcDecoderWorker.ts',
+    },
+    output: _.assign({}, config.output, {
+        library: undefined,
+        libraryTarget: 'var',
+    }),
+    externals: [],
+});
+
+module.exports = [config, workerConfig];
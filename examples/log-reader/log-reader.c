@@ -59,7 +59,13 @@ main(int argc, const char *argv[])
 		return (1);
 	}
 
-	client = rpc_client_create(argv[1], rpc_fd_create(fds[1]));
+	/*
+	 * With log streaming, the transport buffers logs on its own and
+	 * only reads more off the device as we drain the pipe.
+	 */
+	client = rpc_client_create(argv[1], rpc_object_pack("{f,b}",
+	    RPC_USB_LOG_FD, fds[1],
+	    RPC_USB_LOG_STREAM, true));
 	if (client == NULL) {
 		fprintf(stderr, "connect failed: %s\n", strerror(errno));
 		return (1);
@@ -39,6 +39,50 @@
 extern "C" {
 #endif
 
+/**
+ * Bus connection parameter (uint64) with the number of requests that may
+ * await an acknowledgement from the device at the same time.
+ *
+ * The default of 1 waits for every request to be acknowledged before
+ * sending the next one. With a larger window, a send returns as soon as
+ * the request is on its way and a failure reported by the device is
+ * returned by the next send instead.
+ */
+#define	RPC_BUS_WINDOW		"bus_window"
+
+/**
+ * Bus connection parameter (boolean) making the connection talk to the
+ * device over the shared memory rings of the kernel module instead of
+ * netlink. Requests and responses are limited to half the ring size.
+ */
+#define	RPC_BUS_RING		"bus_ring"
+
+/**
+ * USB connection parameter (uint64) switching the connection to bulk
+ * transfers, with this many transfers in flight per direction.
+ *
+ * Requires a device exposing a bulk IN and a bulk OUT endpoint on its
+ * first interface; each message is a single bulk transfer terminated by
+ * a short packet. The default of 0 keeps using control transfers.
+ */
+#define	RPC_USB_TRANSFERS	"usb_transfers"
+
+/**
+ * USB connection parameter (file descriptor) the device log is written
+ * to, for when the parameters are given as a dictionary.
+ */
+#define	RPC_USB_LOG_FD		"usb_log_fd"
+
+/**
+ * USB connection parameter (boolean) enabling log streaming.
+ *
+ * Device logs are then read in large chunks by a dedicated thread into
+ * a client-side ring buffer and written out to RPC_USB_LOG_FD as fast as
+ * its reader consumes them. The device is polled again right away while
+ * it has more to give, and not at all while the ring buffer is full.
+ */
+#define	RPC_USB_LOG_STREAM	"usb_log_stream"
+
 /**
  * Bus hot-plug event type.
  */
@@ -100,6 +144,10 @@ int rpc_bus_ping(const char *_Nonnull serial);
 /**
  * Enumerates connected devices on the RPC bus.
  *
+ * While the bus is open, the first call asks the devices and later
+ * calls return a snapshot of the nodes kept current by attach and
+ * detach events, so polling this is cheap.
+ *
  * @param result Array of @ref rpc_bus_node elements
  * @return 0 on success, -1 on error
  */
@@ -51,6 +51,19 @@ struct rpc_client;
  */
 typedef struct rpc_client *rpc_client_t;
 
+/**
+ * Client I/O loop structure.
+ */
+struct rpc_client_loop;
+
+/**
+ * Client I/O loop handle.
+ *
+ * An I/O loop is a thread running a main loop that drives the
+ * connections of any number of clients.
+ */
+typedef struct rpc_client_loop *rpc_client_loop_t;
+
 /**
  * Creates a new, connected RPC client.
  *
@@ -59,6 +72,9 @@ typedef struct rpc_client *rpc_client_t;
  * - tcp://(ip-address):(port) connects using a TCP socket
  * - ws://(ip-address):(port)/(path) connects using a WebSocket
  * - loopback://(id) connects using a local transport
+ * - mux+unix://(path) or mux+tcp://(ip-address):(port) opens a logical
+ *   connection over a socket shared with every other mux+ client of the
+ *   same endpoint; the server has to listen on the same mux+ URI
  *
  * @param uri Endpoint URI
  * @param params Transport-specific parameters or NULL
@@ -67,6 +83,147 @@ typedef struct rpc_client *rpc_client_t;
 _Nullable rpc_client_t rpc_client_create(const char *_Nonnull uri,
     _Nullable rpc_object_t params);
 
+/**
+ * Creates a new, connected RPC client driven by a shared I/O loop.
+ *
+ * Unlike rpc_client_create(), which starts a thread per client, the
+ * client's connection runs on @p loop. If @p loop is NULL, the client
+ * is placed on the least loaded loop of a process-wide pool sized
+ * after the number of CPUs (at most 4). Callbacks of every client on
+ * the same loop are serialized, so they should not block.
+ *
+ * mux+ URIs always use the loop shared by multiplexed clients.
+ *
+ * @param uri Endpoint URI, see rpc_client_create()
+ * @param params Transport-specific parameters or NULL
+ * @param loop I/O loop to attach to or NULL
+ * @return Connect RPC client handle
+ */
+_Nullable rpc_client_t rpc_client_create_ex(const char *_Nonnull uri,
+    _Nullable rpc_object_t params, _Nullable rpc_client_loop_t loop);
+
+/**
+ * Starts a new I/O loop thread.
+ *
+ * @param name Thread name or NULL
+ * @return I/O loop handle
+ */
+_Nonnull rpc_client_loop_t rpc_client_loop_create(const char *_Nullable name);
+
+/**
+ * Drops the caller's reference to an I/O loop.
+ *
+ * Clients created on the loop keep it running; the thread exits once
+ * the last of them is closed. Must not be called from the loop thread.
+ *
+ * @param loop I/O loop handle
+ */
+void rpc_client_loop_release(_Nonnull rpc_client_loop_t loop);
+
+/**
+ * Client pool structure.
+ */
+struct rpc_client_pool;
+
+/**
+ * Client pool handle.
+ *
+ * A client pool keeps a fixed number of connections to one or more
+ * replicas of the same service, hands out the least loaded one for
+ * each call and reconnects dropped ones in the background.
+ */
+typedef struct rpc_client_pool *rpc_client_pool_t;
+
+/**
+ * Enumerates possible client pool load balancing policies.
+ */
+typedef enum rpc_client_pool_policy
+{
+	RPC_CLIENT_POOL_LEAST_OUTSTANDING,	/**< Fewest calls in flight */
+	RPC_CLIENT_POOL_TWO_CHOICES,		/**< Less loaded of two random */
+} rpc_client_pool_policy_t;
+
+/**
+ * Creates a client pool.
+ *
+ * @p size connections are opened and assigned to @p uris round-robin;
+ * a size of 0 opens one connection per URI. Endpoints that can't be
+ * reached yet are retried in the background, so the pool is returned
+ * even if no connection could be established.
+ *
+ * @param uris Array of endpoint URIs, see rpc_client_create()
+ * @param nuris Number of elements in @p uris
+ * @param size Number of connections to keep or 0
+ * @param policy Load balancing policy
+ * @param params Transport-specific parameters or NULL
+ * @return Client pool handle or NULL on error
+ */
+_Nullable rpc_client_pool_t rpc_client_pool_create(
+    const char *_Nonnull const *_Nonnull uris, size_t nuris, size_t size,
+    rpc_client_pool_policy_t policy, _Nullable rpc_object_t params);
+
+/**
+ * Picks a connection from the pool according to its policy.
+ *
+ * The connection counts as busy until it's handed back with
+ * rpc_client_pool_release(). Sets last error to ENOTCONN if no
+ * connection is currently up.
+ *
+ * @param pool Client pool handle
+ * @return Connection handle or NULL
+ */
+_Nullable rpc_connection_t rpc_client_pool_acquire(
+    _Nonnull rpc_client_pool_t pool);
+
+/**
+ * Hands a connection obtained with rpc_client_pool_acquire() back.
+ *
+ * @param pool Client pool handle
+ * @param conn Connection handle
+ */
+void rpc_client_pool_release(_Nonnull rpc_client_pool_t pool,
+    _Nonnull rpc_connection_t conn);
+
+/**
+ * Performs a synchronous call on a connection picked from the pool.
+ *
+ * @param pool Client pool handle
+ * @param path Object path
+ * @param interface Interface name
+ * @param method Method name
+ * @param args Array of arguments (stolen)
+ * @return Result of the call or NULL on error
+ */
+_Nullable rpc_object_t rpc_client_pool_call_sync(
+    _Nonnull rpc_client_pool_t pool, const char *_Nullable path,
+    const char *_Nullable interface, const char *_Nonnull method,
+    _Nonnull rpc_object_t args);
+
+/**
+ * Enables or disables hedging for a method called through the pool.
+ *
+ * rpc_client_pool_call_sync() on a hedged method sends a duplicate
+ * call to a different connection if no response arrived within the
+ * 95th percentile of recent call latencies; the first successful
+ * response wins and the other attempt is aborted. Only enable it for
+ * idempotent methods.
+ *
+ * @param pool Client pool handle
+ * @param interface Interface name as passed to rpc_client_pool_call_sync()
+ * @param method Method name
+ * @param hedged Whether to hedge calls to the method
+ */
+void rpc_client_pool_set_hedged(_Nonnull rpc_client_pool_t pool,
+    const char *_Nullable interface, const char *_Nonnull method,
+    bool hedged);
+
+/**
+ * Closes all connections of a pool and frees it.
+ *
+ * @param pool Client pool handle
+ */
+void rpc_client_pool_free(_Nonnull rpc_client_pool_t pool);
+
 /**
  * Gets the connection object from a client.
  *
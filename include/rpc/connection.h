@@ -48,6 +48,7 @@ extern "C" {
 
 struct rpc_context;
 struct rpc_connection;
+struct _GMainContext;
 struct rpc_call;
 
 /**
@@ -62,7 +63,8 @@ typedef enum rpc_error_code
 	RPC_SPURIOUS_RESPONSE,		/**< Response to unknown request */
 	RPC_LOGOUT,			/**< Logged out by server */
 	RPC_TRANSPORT_ERROR,		/**< Transport-specific error */
-	RPC_OTHER			/**< Other or unknown reason */
+	RPC_OTHER,			/**< Other or unknown reason */
+	RPC_EVENTS_LOST			/**< Events missed while away */
 } rpc_error_code_t;
 
 /**
@@ -88,6 +90,17 @@ typedef enum rpc_call_type
 	RPC_INBOUND_CALL,		/**< Call to be delivered to responder */
 } rpc_call_type_t;
 
+/**
+ * Enumerates call scheduling priorities.
+ */
+typedef enum rpc_call_priority
+{
+	RPC_PRIORITY_DEFAULT,		/**< Inherit, normal if unset */
+	RPC_PRIORITY_LOW,		/**< Bulk work */
+	RPC_PRIORITY_NORMAL,		/**< Regular calls */
+	RPC_PRIORITY_HIGH,		/**< Control plane, health checks */
+} rpc_call_priority_t;
+
 /**
  * Definition of RPC connection pointer.
  */
@@ -116,6 +129,13 @@ typedef void (^rpc_property_handler_t)(_Nonnull rpc_object_t value);
 typedef void (^rpc_error_handler_t)(rpc_error_code_t code,
     _Nullable rpc_object_t args);
 
+/**
+ * Definition of send queue drain handler block type.
+ *
+ * @see rpc_connection_set_writable_handler()
+ */
+typedef void (^rpc_writable_handler_t)(void);
+
 /**
  * Definition of raw message handler block type.
  */
@@ -127,6 +147,40 @@ typedef int (^rpc_raw_handler_t)(const void *_Nonnull msg, size_t len,
  */
 typedef bool (^rpc_callback_t)(_Nonnull rpc_call_t call);
 
+/**
+ * Definition of RPC event handler function type.
+ *
+ * @see rpc_connection_register_event_handler_f()
+ */
+typedef void (*rpc_handler_f)(void *_Nullable ctx,
+    const char *_Nullable path, const char *_Nullable interface,
+    const char *_Nonnull name, _Nonnull rpc_object_t args);
+
+/**
+ * Definition of RPC callback function type.
+ *
+ * @see rpc_connection_call_f()
+ */
+typedef bool (*rpc_callback_f)(void *_Nullable ctx, _Nonnull rpc_call_t call);
+
+/**
+ * Definition of a unit of work handed to an executor.
+ */
+typedef void (^rpc_work_t)(void);
+
+/**
+ * Definition of an executor block.
+ *
+ * An executor runs @p work, either right away or later on a thread of
+ * its choice. Executors deferring the work have to Block_copy() it.
+ */
+typedef void (^rpc_executor_t)(_Nonnull rpc_work_t work);
+
+/**
+ * Definition of a call continuation block type.
+ */
+typedef void (^rpc_then_t)(_Nonnull rpc_call_t call);
+
 /**
  * Converts function pointer to a @ref rpc_handler_t block type.
  */
@@ -152,6 +206,14 @@ typedef bool (^rpc_callback_t)(_Nonnull rpc_call_t call);
 		_fn(_arg, _code, _args);				\
 	}
 
+/**
+ * Converts function pointer to a @ref rpc_writable_handler_t block type.
+ */
+#define	RPC_WRITABLE_HANDLER(_fn, _arg)					\
+	^(void) {							\
+		_fn(_arg);						\
+	}
+
 /**
  * Converts function pointer to a @ref rpc_message_handler_t block type.
  */
@@ -160,6 +222,14 @@ typedef bool (^rpc_callback_t)(_Nonnull rpc_call_t call);
 		return (_fn(_arg, _msg, _len, _fds, _nfd));		\
 	}
 
+/**
+ * Converts function pointer to a @ref rpc_then_t block type.
+ */
+#define	RPC_THEN(_fn, _arg)						\
+	^(rpc_call_t _call) {						\
+		_fn(_arg, _call);					\
+	}
+
 /**
  * Converts function pointer to a @ref rpc_callback_t block type.
  */
@@ -173,9 +243,177 @@ typedef bool (^rpc_callback_t)(_Nonnull rpc_call_t call);
  */
 #define RPC_NULL_FORMAT "[]"
 
+/**
+ * Connection parameter (boolean) selecting 64-bit integer call IDs
+ * instead of UUID strings.
+ *
+ * Only enable it when the peer is known to accept integer call IDs.
+ * Servers accept both forms and answer using whatever ID they received.
+ */
+#define	RPC_CONNECTION_NUMERIC_IDS	"numeric_ids"
+
+/**
+ * Connection parameter (boolean) selecting the compact frame envelope:
+ * a fixed binary header with an opcode and a 64-bit call ID, followed
+ * by the msgpack encoded arguments, instead of a dictionary with
+ * string keys. Implies @ref RPC_CONNECTION_NUMERIC_IDS.
+ *
+ * Only enable it when the peer is known to accept compact frames.
+ * Servers accept both envelopes and switch a connection to the compact
+ * one once they received a compact frame over it.
+ */
+#define	RPC_CONNECTION_COMPACT_FRAMES	"compact_frames"
+
+/**
+ * Connection parameter (uint64) enabling send batching: the number of
+ * queued bytes that triggers a flush.
+ *
+ * @see rpc_connection_set_batching()
+ */
+#define	RPC_CONNECTION_BATCH_BYTES	"batch_bytes"
+
+/**
+ * Connection parameter (uint64) with the longest time, in milliseconds,
+ * a frame may stay queued when send batching is enabled.
+ *
+ * @see rpc_connection_set_batching()
+ */
+#define	RPC_CONNECTION_BATCH_LATENCY	"batch_latency"
+
+/**
+ * Connection parameter (boolean) enabling shared memory region reuse.
+ *
+ * The memory file behind a shared memory object is passed to the peer
+ * once; subsequent objects backed by the same file only carry its
+ * connection-scoped region ID, and the peer hands out a duplicate of the
+ * descriptor it kept. Only enable it when the peer supports regions.
+ */
+#define	RPC_CONNECTION_SHMEM_REGIONS	"shmem_regions"
+
+/**
+ * Socket transport parameter (boolean) controlling TCP_NODELAY on TCP
+ * connections. Defaults to true.
+ *
+ * Like the other socket tuning parameters, it may also be passed to
+ * rpc_server_create_ex(), which applies it to accepted connections.
+ */
+#define	RPC_CONNECTION_TCP_NODELAY	"tcp_nodelay"
+
+/**
+ * Socket transport parameter (boolean) keeping TCP connections in quick
+ * ACK mode, so that received frames are acknowledged right away. Linux
+ * only.
+ */
+#define	RPC_CONNECTION_TCP_QUICKACK	"tcp_quickack"
+
+/**
+ * Socket transport parameter (uint64) with the socket send buffer size,
+ * in bytes (SO_SNDBUF).
+ */
+#define	RPC_CONNECTION_SNDBUF		"sndbuf"
+
+/**
+ * Socket transport parameter (uint64) with the socket receive buffer
+ * size, in bytes (SO_RCVBUF).
+ */
+#define	RPC_CONNECTION_RCVBUF		"rcvbuf"
+
+/**
+ * Socket transport parameter (uint64) with the time, in microseconds,
+ * to busy poll the device queue on blocking receives (SO_BUSY_POLL).
+ * Linux only; raising it above net.core.busy_read needs CAP_NET_ADMIN.
+ */
+#define	RPC_CONNECTION_BUSY_POLL	"busy_poll"
+
+/**
+ * Socket transport parameter (string) with the path of a PEM certificate
+ * for tls:// connections. Needed by servers, and by clients when the
+ * server asks for a client certificate.
+ *
+ * tls:// is TCP with TLS, available when librpc was built with
+ * ENABLE_KTLS: the handshake is done with GnuTLS, after which the kernel
+ * (the "tls" module) encrypts and decrypts the stream, keeping the
+ * socket's zero-copy send paths. Servers take the TLS parameters from
+ * rpc_server_create_ex().
+ */
+#define	RPC_CONNECTION_TLS_CERT		"tls_cert"
+
+/**
+ * Socket transport parameter (string) with the path of the PEM private
+ * key matching #RPC_CONNECTION_TLS_CERT.
+ */
+#define	RPC_CONNECTION_TLS_KEY		"tls_key"
+
+/**
+ * Socket transport parameter (string) with the path of a PEM bundle of
+ * trusted CAs. Clients use the system trust store without it; servers
+ * given one require and verify client certificates.
+ */
+#define	RPC_CONNECTION_TLS_CA		"tls_ca"
+
+/**
+ * Socket transport parameter (boolean) making tls:// clients check the
+ * server certificate and its host name. Defaults to true.
+ */
+#define	RPC_CONNECTION_TLS_VERIFY	"tls_verify"
+
+/**
+ * WebSocket transport parameter (uint64) enabling compression of outgoing
+ * frames at least this many bytes long. Defaults to 0 (disabled).
+ *
+ * Compression is only used when the peer advertised support for it during
+ * the handshake, so it is safe to enable against any peer. Servers take it
+ * from the parameters passed to rpc_server_create_ex().
+ */
+#define	RPC_CONNECTION_WS_COMPRESS	"ws_compress_threshold"
+
+/**
+ * Connection parameter (string) selecting a frame compression codec:
+ * "lz4" (fast, for local links) or "zstd" (better ratio, for slow links).
+ * Each is only available when librpc was built with its library.
+ *
+ * There is no handshake: both peers must be configured with the same
+ * codec (and dictionary, if any). Servers take it from the parameters
+ * passed to rpc_server_create_ex().
+ */
+#define	RPC_CONNECTION_COMPRESS		"compress"
+
+/**
+ * Connection parameter (uint64) with the smallest frame size, in bytes,
+ * that gets compressed. Defaults to 4096.
+ */
+#define	RPC_CONNECTION_COMPRESS_THRESHOLD	"compress_threshold"
+
+/**
+ * Connection parameter (binary) with a dictionary for the zstd codec,
+ * typically trained on representative frames with `zstd --train`.
+ */
+#define	RPC_CONNECTION_COMPRESS_DICT	"compress_dict"
+
+/**
+ * Connection parameter (bool) enabling the compact encoding of typed
+ * structs in outgoing frames, see @ref rpct_serialize_compact. Peers
+ * decode it whenever they have the same IDL loaded, so enable it once
+ * both sides share it, for instance after @ref rpct_download_idl.
+ */
+#define	RPC_CONNECTION_COMPACT_STRUCTS	"compact_structs"
+
+/**
+ * Connection parameter (bool) replacing repeated type names with small
+ * integer IDs. The first frame using a type carries both its name and
+ * its newly assigned ID (@ref RPCT_TYPE_ID_FIELD). Later frames carry
+ * only the ID. The IDs only mean something on this connection. Peers
+ * always accept them, so only the sending side needs this parameter.
+ */
+#define	RPC_CONNECTION_TYPE_IDS		"type_ids"
+
 /**
  * Creates a new connection from the provided opaque cookie.
  *
+ * If @p params is a dictionary, it may contain generic connection
+ * parameters such as @ref RPC_CONNECTION_NUMERIC_IDS, in addition to
+ * transport-specific ones.
+ *
  * @param cookie Opaque data
  * @param params Transport-specific parameters
  * @return Connection handle or NULL on failure
@@ -248,6 +486,29 @@ bool rpc_connection_is_valid(_Nonnull rpc_connection_t conn);
  */
 int rpc_connection_get_fd(_Nonnull rpc_connection_t conn);
 
+/**
+ * Takes the connection's socket away from librpc.
+ *
+ * Stops receiving on @p conn and returns a duplicate of its socket
+ * descriptor, so the caller can move the byte stream elsewhere, e.g.
+ * splice it to another socket. Bytes the transport had already read
+ * ahead, but not yet parsed, are returned in @p pending and must be
+ * consumed before anything read from the descriptor. The caller
+ * frees @p pending with g_free().
+ *
+ * Frames can still be sent on @p conn afterwards. Closing @p conn
+ * then leaves the socket itself open, for the returned descriptor.
+ * Meant for connections with no frame in flight from the peer; only
+ * stream socket connections served by a reader thread support it.
+ *
+ * @param conn Connection handle
+ * @param pending Where to store the read-ahead bytes or NULL
+ * @param pending_len Where to store the length of @p pending
+ * @return Socket descriptor on success, -1 on error
+ */
+int rpc_connection_detach(_Nonnull rpc_connection_t conn,
+    void *_Nullable *_Nonnull pending, size_t *_Nonnull pending_len);
+
 /**
  * Frees resources associated with @ref rpc_connection_t.
  *
@@ -255,6 +516,148 @@ int rpc_connection_get_fd(_Nonnull rpc_connection_t conn);
  */
 void rpc_connection_free(_Nonnull rpc_connection_t conn);
 
+/**
+ * Enables or disables send batching on the connection.
+ *
+ * With batching enabled, outgoing frames are queued and written to
+ * the transport together, in a single system call, once @p max_bytes
+ * worth of frames accumulate or @p max_latency milliseconds pass since
+ * the first frame was queued, whichever comes first. Frames carrying
+ * file descriptors flush the queue and are sent on their own.
+ *
+ * Transport errors for queued frames are reported when the queue is
+ * flushed, not by the call that queued the frame.
+ *
+ * @param conn Connection handle
+ * @param max_bytes Flush threshold in bytes, 0 to disable batching
+ * @param max_latency Maximum queueing delay in milliseconds
+ * @return 0 on success, -1 if the transport doesn't support batching
+ */
+int rpc_connection_set_batching(_Nonnull rpc_connection_t conn,
+    size_t max_bytes, unsigned int max_latency);
+
+/**
+ * Bounds the memory taken by stream fragments received on the connection.
+ *
+ * Fragments that arrived but weren't consumed with rpc_call_continue()
+ * yet are counted against @p nbytes, across all streaming calls of the
+ * connection. Once the budget is used up, calls stop handing new
+ * credits to their producers until enough fragments are consumed; what
+ * is already in flight still arrives, so the budget may be exceeded by
+ * up to one window per call. rpc_call_set_prefetch_bytes() bounds a
+ * single call the same way.
+ *
+ * @param conn Connection handle
+ * @param nbytes Budget in bytes, 0 for no limit
+ * @return 0 on success
+ */
+int rpc_connection_set_fragment_budget(_Nonnull rpc_connection_t conn,
+    size_t nbytes);
+
+/**
+ * Bounds the memory taken by received stream fragments process-wide.
+ *
+ * Works like rpc_connection_set_fragment_budget(), with a ceiling on
+ * the fragments queued on all connections together.
+ *
+ * @param nbytes Ceiling in bytes, 0 for no limit
+ */
+void rpc_connection_set_fragment_ceiling(size_t nbytes);
+
+/**
+ * Returns the memory currently taken by received stream fragments.
+ *
+ * Fragments are only accounted for while a budget or a ceiling is set.
+ *
+ * @return Bytes of queued fragments on all connections
+ */
+size_t rpc_connection_get_fragment_memory(void);
+
+/**
+ * Limits the number of inbound calls from the connection that run
+ * at the same time.
+ *
+ * With a limit set, calls from the connection are started strictly in
+ * the order they arrived and at most @p max_inflight of them run at
+ * once; the rest wait in a per-connection queue. A limit of 1 makes
+ * the connection fully serial. This overrides the context default set
+ * with rpc_context_set_dispatch_limit().
+ *
+ * @param conn Connection handle
+ * @param max_inflight Maximum concurrent calls, 0 to use the default
+ */
+void rpc_connection_set_dispatch_limit(_Nonnull rpc_connection_t conn,
+    unsigned int max_inflight);
+
+/**
+ * Sets the priority requested for calls made over the connection.
+ *
+ * The priority travels with each call and, if not
+ * @ref RPC_PRIORITY_DEFAULT, overrides whatever priority the server
+ * assigned to the method or its interface.
+ *
+ * @param conn Connection handle
+ * @param priority Priority of subsequent outgoing calls
+ */
+void rpc_connection_set_call_priority(_Nonnull rpc_connection_t conn,
+    rpc_call_priority_t priority);
+
+/**
+ * Enables or disables coalescing of identical calls.
+ *
+ * While enabled, a call made with the same path, interface, method and
+ * arguments (compared with rpc_equal()) as one still in flight is not
+ * sent; it completes with the result of the earlier call instead. Each
+ * coalesced call remains a call of its own: it can be waited on, aborted
+ * or freed independently, and times out on its own schedule.
+ *
+ * Meant for read-only methods, where one answer is as good as another.
+ * Results received on the connection are frozen (see rpc_object_freeze()),
+ * as they may be handed to several callers. If the first call streams,
+ * is aborted, freed or times out, the calls waiting on it are sent
+ * separately. Calls taking input are never coalesced.
+ *
+ * Disabled by default.
+ *
+ * @param conn Connection handle
+ * @param enable Whether to coalesce calls
+ */
+void rpc_connection_set_coalescing(_Nonnull rpc_connection_t conn,
+    bool enable);
+
+/**
+ * Client-side event delivery modes.
+ *
+ * @see rpc_connection_set_event_delivery()
+ */
+typedef enum rpc_event_delivery
+{
+	RPC_EVENT_DELIVERY_POOL,	/**< Each event is its own pool task */
+	RPC_EVENT_DELIVERY_INLINE,	/**< Handlers run on the reader */
+	RPC_EVENT_DELIVERY_SERIAL,	/**< One drainer takes queued events */
+} rpc_event_delivery_t;
+
+/**
+ * Selects how events received over the connection reach their handlers.
+ *
+ * The default, @ref RPC_EVENT_DELIVERY_POOL, pushes every event to the
+ * callback thread pool. With @ref RPC_EVENT_DELIVERY_INLINE, handlers
+ * run on the thread reading from the transport, before the next frame
+ * is read; they must not block or issue synchronous calls on the same
+ * connection. @ref RPC_EVENT_DELIVERY_SERIAL queues events and has a
+ * single pool task deliver everything queued, in order, so a stream of
+ * events costs one cross-thread wakeup per burst rather than one per
+ * event.
+ *
+ * Call callbacks are not affected.
+ *
+ * @param conn Connection handle
+ * @param mode Delivery mode
+ * @return 0 on success, -1 on failure
+ */
+int rpc_connection_set_event_delivery(_Nonnull rpc_connection_t conn,
+    rpc_event_delivery_t mode);
+
 #ifdef ENABLE_LIBDISPATCH
 /**
  * Assigns a libdispatch queue to the connection.
@@ -271,6 +674,15 @@ int rpc_connection_set_dispatch_queue(_Nonnull rpc_connection_t conn,
     _Nonnull dispatch_queue_t queue);
 #endif
 
+/**
+ * Prefix marking a subscription path as a pattern.
+ *
+ * Without it, a path is matched literally, '*' included.
+ *
+ * @see rpc_connection_subscribe_event()
+ */
+#define	RPC_PATH_PATTERN_PREFIX	"pattern:"
+
 /**
  * Subscribes for an event.
  *
@@ -281,6 +693,18 @@ int rpc_connection_set_dispatch_queue(_Nonnull rpc_connection_t conn,
  * Calls to rpc_connection_subscribe_event() must be paired with
  * rpc_connection_unsubscribe_event().
  *
+ * @p path may contain wildcards if it starts with
+ * @ref RPC_PATH_PATTERN_PREFIX. A trailing '*' covers every path
+ * starting with what precedes it: "/devices/" followed by '*' takes
+ * the events of the whole /devices subtree. A '*' followed by a '/'
+ * stands for the rest of one path component instead: "/devices/",
+ * '*' and "/status" put together match the path of every device's
+ * status object, one level down.
+ *
+ * New subscriptions made within one iteration of the connection's main
+ * loop are sent together, in a single message, either from the loop or
+ * right before the next message that goes out on the connection.
+ *
  * @param conn Connection to subscribe on
  * @param name Event name
  * @return 0 on success, -1 on failure
@@ -305,6 +729,51 @@ int rpc_connection_unsubscribe_event(_Nonnull rpc_connection_t conn,
     const char *_Nullable path, const char *_Nullable interface,
     const char *_Nonnull name);
 
+/**
+ * Subscribes for a number of events at once.
+ *
+ * Works like calling rpc_connection_subscribe_event() for each of them,
+ * except that the subscriptions go out in a single message right away.
+ *
+ * @param conn Connection to subscribe on
+ * @param subscriptions Array of dictionaries with "path", "interface"
+ * and "name" keys
+ * @return 0 on success, -1 on failure
+ */
+int rpc_connection_subscribe_events(_Nonnull rpc_connection_t conn,
+    _Nonnull rpc_object_t subscriptions);
+
+/**
+ * Asks the server to deliver events through a shared memory ring.
+ *
+ * Works on client connections able to pass descriptors, that is to a
+ * server on the same host. If the server context has an event ring,
+ * see rpc_context_set_event_ring(), subsequent events are read from
+ * it on the connection's main context and handed to the usual event
+ * handlers. Otherwise events keep coming over the connection, as they
+ * do until the server has answered.
+ *
+ * @param conn Client connection
+ * @return 0 on success, -1 on failure
+ */
+int rpc_connection_attach_event_ring(_Nonnull rpc_connection_t conn);
+
+/**
+ * Undoes a number of event subscriptions at once.
+ *
+ * Works like calling rpc_connection_unsubscribe_event() for each of
+ * them, sending a single message for those whose reference count
+ * reaches 0. If any of them is unknown, none is undone.
+ *
+ * @param conn Connection to undo the subscriptions on
+ * @param subscriptions Array of dictionaries with "path", "interface"
+ * and "name" keys
+ * @return 0 on success, -1 on failure (ENOENT if a subscription
+ * wasn't found)
+ */
+int rpc_connection_unsubscribe_events(_Nonnull rpc_connection_t conn,
+    _Nonnull rpc_object_t subscriptions);
+
 /**
  * Registers an event handler block for an event of a given name.
  *
@@ -341,6 +810,27 @@ void *_Nullable rpc_connection_register_event_handler(
 int rpc_connection_unregister_event_handler(_Nonnull rpc_connection_t conn,
     void *_Nonnull cookie);
 
+/**
+ * Same as @ref rpc_connection_register_event_handler, but takes a
+ * function pointer and a context pointer passed back to it.
+ *
+ * Unlike wrapping the function with RPC_HANDLER(), no block gets
+ * copied to the heap, neither here nor when the event is delivered.
+ * The returned cookie is unregistered the same way.
+ *
+ * @param conn Connection to register an event handler for
+ * @param path Object path or NULL
+ * @param interface Interface name or NULL
+ * @param name Name of an event to be handled
+ * @param fn Event handler function
+ * @param ctx Context pointer passed to @p fn
+ * @return Cookie for @ref rpc_connection_unregister_event_handler or NULL.
+ */
+void *_Nullable rpc_connection_register_event_handler_f(
+    _Nonnull rpc_connection_t conn, const char *_Nullable path,
+    const char *_Nullable interface, const char *_Nonnull name,
+    _Nonnull rpc_handler_f fn, void *_Nullable ctx);
+
 /**
  * Performs a synchronous RPC method call using a given connection.
  *
@@ -455,17 +945,97 @@ _Nullable rpc_call_t rpc_connection_call(_Nonnull rpc_connection_t conn,
     _Nullable rpc_callback_t callback);
 
 /**
+ * Same as @ref rpc_connection_call, but the callback is a plain
+ * function pointer invoked with @p ctx, the way dispatch_async_f()
+ * relates to dispatch_async().
  *
- * @param conn
- * @param path
- * @param interface
- * @param name
- * @return
+ * The call stores @p fn and @p ctx as they are, so issuing it does not
+ * Block_copy() anything. @p ctx has to stay valid until the callback
+ * has seen the last result, or until the call is freed.
+ *
+ * @param conn Connection to do a call on
+ * @param path Object path or NULL
+ * @param interface Interface name or NULL
+ * @param name Name of a method to be called
+ * @param args RPC method arguments array
+ * @param fn Callback function or NULL
+ * @param ctx Context pointer passed to @p fn
+ * @return RPC call object
+ */
+_Nullable rpc_call_t rpc_connection_call_f(_Nonnull rpc_connection_t conn,
+    const char *_Nullable path, const char *_Nullable interface,
+    const char *_Nonnull name, _Nullable rpc_object_t args,
+    _Nullable rpc_callback_f fn, void *_Nullable ctx);
+
+/**
+ * Performs a RPC method call whose arguments go on streaming after it.
+ *
+ * Same as @ref rpc_connection_call, except that the method gets to
+ * read more input: fragments sent with @ref rpc_call_yield_arg until
+ * @ref rpc_call_end_input is called, which it receives one by one with
+ * rpc_function_next_input(). This is how large datasets are uploaded
+ * without building them into a single frame.
+ *
+ * @param conn Connection to do a call on
+ * @param path Object path or NULL
+ * @param interface Interface name or NULL
+ * @param name Name of a method to be called
+ * @param args Arguments known upfront, or NULL
+ * @param callback Callback function pointer to be called on RPC completion
+ * @return RPC call object
+ */
+_Nullable rpc_call_t rpc_connection_call_upload(
+    _Nonnull rpc_connection_t conn, const char *_Nullable path,
+    const char *_Nullable interface, const char *_Nonnull name,
+    _Nullable rpc_object_t args, _Nullable rpc_callback_t callback);
+
+/**
+ * Performs several RPC method calls in a single request frame.
+ *
+ * Each element of @p calls is a dictionary with "path", "interface",
+ * "method" and "args" keys, as in rpc_connection_call(). The server
+ * runs them concurrently and answers with a single response: an array
+ * holding, in order, either the result or the error object of every
+ * call. Methods that stream fail with ENOTSUP inside a batch.
+ *
+ * @param conn Connection to do the calls on
+ * @param calls Array of call descriptions
+ * @param callback Callback function pointer to be called on completion
+ * @return RPC call object
+ */
+_Nullable rpc_call_t rpc_connection_call_batch(_Nonnull rpc_connection_t conn,
+    _Nonnull rpc_object_t calls, _Nullable rpc_callback_t callback);
+
+/**
+ * Reads a property of a remote instance.
+ *
+ * Served locally when the interface's properties are cached, see
+ * @ref rpc_connection_cache_properties.
+ *
+ * @param conn Connection handle
+ * @param path Instance path
+ * @param interface Interface name
+ * @param name Property name
+ * @return Property value or an error object
  */
 _Nullable rpc_object_t rpc_connection_get_property(
     _Nonnull rpc_connection_t conn, const char *_Nullable path,
     const char *_Nullable interface, const char *_Nonnull name);
 
+/**
+ * Reads the same property from many instances in one round trip.
+ *
+ * @param conn Connection handle
+ * @param paths Instance paths
+ * @param npaths Number of paths in @p paths
+ * @param interface Interface name
+ * @param name Property name
+ * @return Array of values or errors in @p paths order, NULL on failure
+ */
+_Nullable rpc_object_t rpc_connection_get_properties(
+    _Nonnull rpc_connection_t conn, const char *_Nonnull const *_Nonnull paths,
+    size_t npaths, const char *_Nonnull interface, const char *_Nonnull name);
+
 /**
  *
  * @param conn
@@ -525,6 +1095,38 @@ void *_Nullable rpc_connection_watch_property(
     const char *_Nullable interface, const char *_Nonnull property,
     _Nonnull rpc_property_handler_t handler);
 
+/**
+ * Keeps a local copy of the properties of @p interface at @p path.
+ *
+ * Subscribes to Observable.changed on @p path and primes the cache
+ * with one Observable.get_all round trip. From then on
+ * @ref rpc_connection_get_property answers from the cache, which
+ * follows the changed events. Properties whose changes the server
+ * doesn't report aren't kept coherent. Setting a property through
+ * @ref rpc_connection_set_property drops its cached value until the
+ * next read or changed event.
+ *
+ * Calling it again for the same interface does nothing.
+ *
+ * @param conn Connection handle
+ * @param path Instance path
+ * @param interface Interface name
+ * @return 0 on success, -1 on error
+ */
+int rpc_connection_cache_properties(_Nonnull rpc_connection_t conn,
+    const char *_Nullable path, const char *_Nonnull interface);
+
+/**
+ * Stops caching properties of @p interface at @p path.
+ *
+ * @param conn Connection handle
+ * @param path Instance path
+ * @param interface Interface name
+ * @return 0 on success, -1 if the properties weren't cached
+ */
+int rpc_connection_uncache_properties(_Nonnull rpc_connection_t conn,
+    const char *_Nullable path, const char *_Nonnull interface);
+
 /**
  * Sends an event.
  *
@@ -537,6 +1139,20 @@ int rpc_connection_send_event(_Nonnull rpc_connection_t conn,
     const char *_Nullable path, const char *_Nullable interface,
     const char *_Nonnull name, _Nonnull rpc_object_t args);
 
+/**
+ * Sends several events in a single "events.event_burst" frame.
+ *
+ * @p events is an array of dictionaries with "path", "interface",
+ * "name" and "args" keys. Events the peer is not subscribed to are
+ * skipped. If only one event is left, it is sent as a plain event.
+ *
+ * @param conn Connection to send events across
+ * @param events Array of events
+ * @return 0 on success, -1 on failure
+ */
+int rpc_connection_send_event_burst(_Nonnull rpc_connection_t conn,
+    _Nonnull rpc_object_t events);
+
 /**
  * Ping the other end of a connection.
  */
@@ -582,6 +1198,76 @@ void rpc_connection_set_event_handler(_Nonnull rpc_connection_t conn,
 void rpc_connection_set_error_handler(_Nonnull rpc_connection_t conn,
     _Nullable rpc_error_handler_t handler);
 
+/**
+ * Sets the watermarks of a connection's send queue.
+ *
+ * The send queue holds the frames being written out or waiting for
+ * the transport, which fills up when the peer doesn't read fast
+ * enough. Once it holds @p high frames the connection is saturated:
+ * rpc_connection_is_saturated() returns true and
+ * rpc_function_yield_try() refuses new fragments. It stops being
+ * saturated when the queue drains to @p low frames, at which point
+ * the writable handlers run. Defaults are 64 and 16.
+ *
+ * @param conn Connection handle
+ * @param low Low watermark, in frames
+ * @param high High watermark, in frames, 0 to never saturate
+ * @return 0 on success, -1 on failure (EINVAL if @p low > @p high)
+ */
+int rpc_connection_set_send_watermarks(_Nonnull rpc_connection_t conn,
+    size_t low, size_t high);
+
+/**
+ * Returns whether a connection's send queue is above its high watermark.
+ *
+ * @param conn Connection handle
+ * @return true if saturated, false otherwise
+ */
+bool rpc_connection_is_saturated(_Nonnull rpc_connection_t conn);
+
+/**
+ * Sets a handler called once a saturated connection drains.
+ *
+ * The handler runs on the thread that completed the send bringing
+ * the queue down to the low watermark, so it must not block.
+ *
+ * @param conn Connection handle
+ * @param handler Handler block, NULL to remove it
+ */
+void rpc_connection_set_writable_handler(_Nonnull rpc_connection_t conn,
+    _Nullable rpc_writable_handler_t handler);
+
+/**
+ * Returns the session token a server handed out to a client connection.
+ *
+ * Servers only do so with RPC_SERVER_SESSION_GRACE set.
+ *
+ * @param conn Client connection handle
+ * @return Token, to be freed with g_free(), or NULL if there's none
+ */
+char *_Nullable rpc_connection_get_session(_Nonnull rpc_connection_t conn);
+
+/**
+ * Carries the event subscriptions of a lost client connection over to
+ * a new one.
+ *
+ * @p conn gets copies of the subscriptions of @p old, along with their
+ * handlers; cookies returned by rpc_connection_register_event_handler()
+ * keep referring to @p old. If @p old had a session, @p conn asks the
+ * server to resume it: the server puts the subscriptions back in place
+ * and first replays the events that were missed in the meantime. If
+ * some of them got dropped, or the session is gone and @p conn has to
+ * subscribe again, the error handler of @p conn sees RPC_EVENTS_LOST.
+ * Calls in progress on @p old aren't carried over.
+ *
+ * @param conn New client connection, with no subscriptions of its own
+ * @param old Connection to take the subscriptions of
+ * @return 0 on success, -1 on failure (EBUSY if @p conn already has
+ * subscriptions)
+ */
+int rpc_connection_resume_session(_Nonnull rpc_connection_t conn,
+    _Nonnull rpc_connection_t old);
+
 /**
  *
  * @param conn
@@ -636,6 +1322,38 @@ gid_t rpc_connection_get_remote_gid(_Nonnull rpc_connection_t conn);
  */
 pid_t rpc_connection_get_remote_pid(_Nonnull rpc_connection_t conn);
 
+/**
+ * Connection traffic statistics.
+ *
+ * Times are in microseconds. Frames sent in a single batch are counted
+ * individually.
+ */
+struct rpc_connection_stats
+{
+	uint64_t	rcs_frames_in;		/**< Frames received */
+	uint64_t	rcs_frames_out;		/**< Frames handed to the transport */
+	uint64_t	rcs_bytes_in;		/**< Bytes received */
+	uint64_t	rcs_bytes_out;		/**< Bytes handed to the transport */
+	uint64_t	rcs_serialize_time;	/**< Time spent encoding frames */
+	uint64_t	rcs_deserialize_time;	/**< Time spent decoding frames */
+	uint64_t	rcs_send_wait_time;	/**< Time spent waiting to send */
+	unsigned int	rcs_calls_outstanding;	/**< Outbound calls not done yet */
+	unsigned int	rcs_calls_inflight;	/**< Inbound calls not done yet */
+	unsigned int	rcs_subscriptions;	/**< Event subscriptions held */
+};
+
+/**
+ * Reads traffic statistics of @p conn.
+ *
+ * Counters accumulate from the moment the connection was opened,
+ * while call and subscription figures are a snapshot.
+ *
+ * @param conn Connection handle
+ * @param stats Structure to fill in
+ */
+void rpc_connection_get_stats(_Nonnull rpc_connection_t conn,
+    struct rpc_connection_stats *_Nonnull stats);
+
 /**
  * Waits for a call to change status.
  *
@@ -665,15 +1383,77 @@ int rpc_call_continue(_Nonnull rpc_call_t call, bool sync);
  */
 int rpc_call_abort(_Nonnull rpc_call_t call);
 
+/**
+ * Sends the next argument fragment of an upload call.
+ *
+ * Takes over @p fragment. Blocks while the method is a window of
+ * fragments behind, so uploads run in bounded memory on both ends.
+ * Fails with EPIPE if the call already finished, for instance because
+ * the method responded without reading all of its input.
+ *
+ * @param call Call made with @ref rpc_connection_call_upload
+ * @param fragment Argument fragment
+ * @return 0 on success, -1 on error
+ */
+int rpc_call_yield_arg(_Nonnull rpc_call_t call,
+    _Nonnull rpc_object_t fragment);
+
+/**
+ * Tells the method of an upload call that no more input follows.
+ *
+ * @param call Call made with @ref rpc_connection_call_upload
+ * @return 0 on success, -1 on error
+ */
+int rpc_call_end_input(_Nonnull rpc_call_t call);
+
 /**
  * Sets how many items librpc should prefetch in a streaming call.
  *
- * @param call
- * @param nitems
- * @return
+ * The producer may run up to @p nitems fragments ahead of the consumer.
+ * More credit is granted once half of the window has been consumed, so
+ * a large enough window keeps the stream from stalling on round trips.
+ * With @p nitems set to 0, the window is sized automatically from the
+ * measured round-trip time and fragment rate.
+ *
+ * @param call Streaming call handle
+ * @param nitems Window size in fragments, 0 to auto-tune
+ * @return 0 on success
  */
 int rpc_call_set_prefetch(_Nonnull rpc_call_t call, size_t nitems);
 
+/**
+ * Additionally limits the streaming window by size.
+ *
+ * The producer stops once fragments totalling @p nbytes are in flight
+ * or queued on the consumer side, and continues as they are consumed.
+ * Has to be set before the first rpc_call_continue() on the call.
+ *
+ * @param call Streaming call handle
+ * @param nbytes Window size in bytes, 0 for no byte limit
+ * @return 0 on success, -1 if the stream already started
+ */
+int rpc_call_set_prefetch_bytes(_Nonnull rpc_call_t call, size_t nbytes);
+
+/**
+ * Has the fragments of a streaming call delivered through shared memory.
+ *
+ * A ring of @p size bytes is allocated and handed to the server with
+ * the first rpc_call_continue(). The server then serializes fragments
+ * into the ring and sends only a short notice for each, along with the
+ * usual flow control. Fragments carrying descriptors, or larger than
+ * the room left in the ring, still travel over the connection; the
+ * largest that can use the ring is a quarter of @p size. Servers not
+ * supporting this ignore the ring.
+ *
+ * Only works on connections able to pass descriptors, and has to be
+ * set before the first rpc_call_continue() on the call.
+ *
+ * @param call Streaming call handle
+ * @param size Size of the ring, in bytes
+ * @return 0 on success, -1 on failure
+ */
+int rpc_call_set_stream_ring(_Nonnull rpc_call_t call, size_t size);
+
 /**
  * Waits for a call to change status.
  *
@@ -687,6 +1467,106 @@ int rpc_call_set_prefetch(_Nonnull rpc_call_t call, size_t nitems);
 int rpc_call_timedwait(_Nonnull rpc_call_t call,
     const struct timespec *_Nonnull ts);
 
+/**
+ * Returns a descriptor that polls readable once the call has a status
+ * update, for use with external event loops.
+ *
+ * The descriptor is created on first use and owned by the call. Once it
+ * polls readable, rpc_call_wait() returns right away and rearms it.
+ * Calls nobody asks a descriptor for use none.
+ *
+ * @param call Call handle
+ * @return File descriptor number or -1 on error
+ */
+int rpc_call_get_fd(_Nonnull rpc_call_t call);
+
+/**
+ * Overrides the timeout of a call that is still in progress.
+ *
+ * The new timeout counts from the moment of this call, with
+ * millisecond resolution. Calls otherwise time out after the
+ * connection default.
+ *
+ * @param call Outbound call handle
+ * @param msecs Timeout in milliseconds, 0 to never time out
+ * @return 0 on success, -1 if the call already finished or timed out
+ */
+int rpc_call_set_timeout(_Nonnull rpc_call_t call, uint64_t msecs);
+
+/**
+ * Schedules a continuation to run once a call finishes.
+ *
+ * A call is finished once it is done, failed, was aborted or its
+ * stream ended. The continuation runs on @p executor, or inline on the
+ * thread that finished the call if @p executor is NULL - usually the
+ * connection's reader thread, so it should not block. It runs right
+ * away if the call had already finished, and never if the call is freed
+ * before finishing.
+ *
+ * Unlike the callback given to rpc_connection_call(), continuations
+ * do not hop through the connection's callback pool.
+ *
+ * @param call Outbound call handle
+ * @param executor Executor to run @p fn on or NULL to run it inline
+ * @param fn Continuation block
+ * @return 0 on success, -1 on failure
+ */
+int rpc_call_then(_Nonnull rpc_call_t call, _Nullable rpc_executor_t executor,
+    _Nonnull rpc_then_t fn);
+
+/**
+ * Schedules a block to run once a call has a status update.
+ *
+ * Like rpc_call_wait(), but without blocking: @p fn runs on
+ * @p executor as soon as rpc_call_status() has something other than
+ * RPC_CALL_IN_PROGRESS to report, right away if it already does.
+ * Streaming consumers call rpc_call_continue() and then await again.
+ *
+ * @param call Outbound call handle
+ * @param executor Executor to run @p fn on or NULL to run it inline
+ * @param fn Block to run
+ * @return 0 on success, -1 on failure
+ */
+int rpc_call_await(_Nonnull rpc_call_t call, _Nullable rpc_executor_t executor,
+    _Nonnull rpc_then_t fn);
+
+/**
+ * Runs @p fn on @p executor once all the calls in @p calls finish.
+ *
+ * @param calls Array of outbound call handles
+ * @param ncalls Number of calls in @p calls
+ * @param executor Executor to run @p fn on or NULL to run it inline
+ * @param fn Block to run
+ * @return 0 on success, -1 on failure
+ */
+int rpc_call_when_all(_Nonnull rpc_call_t *_Nonnull calls, size_t ncalls,
+    _Nullable rpc_executor_t executor, _Nonnull rpc_work_t fn);
+
+/**
+ * Returns an executor running work on a GLib main context.
+ *
+ * The context has to outlive the executor. Release the executor with
+ * Block_release().
+ *
+ * @param context GMainContext to run work on
+ * @return Executor block
+ */
+_Nonnull rpc_executor_t rpc_executor_main_context(
+    struct _GMainContext *_Nonnull context);
+
+#ifdef ENABLE_LIBDISPATCH
+/**
+ * Returns an executor running work on a libdispatch queue.
+ *
+ * Release the executor with Block_release().
+ *
+ * @param queue libdispatch queue
+ * @return Executor block
+ */
+_Nonnull rpc_executor_t rpc_executor_dispatch_queue(
+    _Nonnull dispatch_queue_t queue);
+#endif
+
 /**
  * Checks whether a call has been completed successfully.
  *
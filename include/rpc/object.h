@@ -72,6 +72,94 @@ typedef enum {
  */
 typedef struct rpc_object *rpc_object_t;
 
+/**
+ * Definition of compiled pack/unpack format pointer.
+ */
+typedef struct rpc_pack_fmt *rpc_pack_fmt_t;
+
+#if defined(__linux__)
+/**
+ * Enumerates shared memory creation flags.
+ *
+ * @see rpc_shmem_create_ex()
+ */
+typedef enum rpc_shmem_flags {
+	RPC_SHMEM_HUGETLB = (1 << 0),	/**< back with default-size huge pages */
+	RPC_SHMEM_SEALABLE = (1 << 1),	/**< fix the size, allow write sealing */
+	RPC_SHMEM_NUMA_BIND = (1 << 2),	/**< bind pages to a single NUMA node */
+} rpc_shmem_flags_t;
+
+/**
+ * Builds rpc_shmem_create_ex() flags binding memory to NUMA node @p n.
+ */
+#define	RPC_SHMEM_NUMA_NODE(n)	(RPC_SHMEM_NUMA_BIND | ((int)(n) << 16))
+
+/**
+ * Definition of shared memory pool pointer.
+ */
+typedef struct rpc_shmem_pool *rpc_shmem_pool_t;
+#endif
+
+/**
+ * Enumerates librpc internal allocator caches.
+ */
+typedef enum rpc_alloc_cache {
+	RPC_ALLOC_OBJECT,		/**< struct rpc_object cache */
+	RPC_ALLOC_CALL			/**< struct rpc_call cache */
+} rpc_alloc_cache_t;
+
+/**
+ * Internal allocator cache statistics.
+ */
+struct rpc_alloc_stats
+{
+	uint64_t	ras_allocs;	/**< Number of allocations */
+	uint64_t	ras_hits;	/**< Allocations served from the cache */
+	uint64_t	ras_frees;	/**< Number of frees */
+};
+
+/**
+ * Enumerates subsystems tagging memory requested from the allocator.
+ *
+ * @see rpc_set_allocator()
+ */
+typedef enum rpc_alloc_tag {
+	RPC_ALLOC_TAG_OBJECT,		/**< objects and packed arrays */
+	RPC_ALLOC_TAG_CALL,		/**< struct rpc_call */
+	RPC_ALLOC_TAG_FRAME,		/**< frame buffers */
+	RPC_ALLOC_TAG_TRANSPORT,	/**< transport I/O buffers */
+	RPC_ALLOC_TAG_COUNT
+} rpc_alloc_tag_t;
+
+/**
+ * Custom memory allocator.
+ *
+ * Every callback receives the tag of the subsystem asking for memory
+ * and the size of the block, so frees can be accounted for without
+ * a lookup. @p ra_arg is passed through unchanged.
+ */
+struct rpc_allocator
+{
+	void *_Nullable (*_Nonnull ra_alloc)(void *_Nullable arg,
+	    rpc_alloc_tag_t tag, size_t size);
+	void *_Nullable (*_Nonnull ra_realloc)(void *_Nullable arg,
+	    rpc_alloc_tag_t tag, void *_Nullable ptr, size_t oldsize,
+	    size_t size);
+	void (*_Nonnull ra_free)(void *_Nullable arg, rpc_alloc_tag_t tag,
+	    void *_Nullable ptr, size_t size);
+	void *_Nullable ra_arg;
+};
+
+/**
+ * Per-tag allocation statistics.
+ */
+struct rpc_alloc_tag_stats
+{
+	uint64_t	rats_allocs;	/**< Number of allocations */
+	uint64_t	rats_frees;	/**< Number of frees */
+	int64_t		rats_bytes;	/**< Bytes in use */
+};
+
 /**
  * Definition of array applier block type.
  *
@@ -208,6 +296,45 @@ int rpc_release_impl(_Nonnull rpc_object_t object);
  */
 int rpc_get_refcount(_Nullable rpc_object_t object);
 
+/**
+ * Reads statistics of an internal allocator cache.
+ *
+ * Counters are collected per thread and published in batches, so
+ * they may lag slightly behind the actual allocation activity.
+ *
+ * @param cache Cache to read statistics of
+ * @param stats Structure to fill in
+ * @return 0 on success, -1 on failure
+ */
+int rpc_get_alloc_stats(rpc_alloc_cache_t cache,
+    struct rpc_alloc_stats *_Nonnull stats);
+
+/**
+ * Replaces the allocator backing librpc's tagged allocations.
+ *
+ * Covers objects, calls, frame buffers and transport I/O buffers;
+ * other bookkeeping structures still come from g_malloc(). The
+ * allocator can only be replaced before any tagged allocation has
+ * been made, which in practice means before any other librpc call.
+ * The structure is copied.
+ *
+ * @param allocator Allocator to use, or NULL for the default
+ * @return 0 on success, -1 on failure (EBUSY if memory is in use)
+ */
+int rpc_set_allocator(const struct rpc_allocator *_Nullable allocator);
+
+/**
+ * Reads allocation statistics of a subsystem tag.
+ *
+ * Counters are kept regardless of which allocator is installed.
+ *
+ * @param tag Tag to read statistics of
+ * @param stats Structure to fill in
+ * @return 0 on success, -1 on failure
+ */
+int rpc_get_alloc_tag_stats(rpc_alloc_tag_t tag,
+    struct rpc_alloc_tag_stats *_Nonnull stats);
+
 /**
  * Gets line number of object location in source file (if any).
  *
@@ -235,6 +362,12 @@ size_t rpc_get_column_number(_Nonnull rpc_object_t object);
 /**
  * Creates and returns independent copy of an object.
  *
+ * Dictionaries and arrays holding only scalars are copied lazily: the copy
+ * shares storage with the original until either of them is modified, at
+ * which point it is cloned. Containers holding other containers are copied
+ * one level at a time, down to those. Reading a copy, or the original,
+ * never modifies it.
+ *
  * @param object Object to be copied.
  * @return Copy of an provided as the function argument.
  */
@@ -272,11 +405,66 @@ bool rpc_equal(_Nullable rpc_object_t o1, _Nullable rpc_object_t o2);
 /**
  * Returns numerical hash calculated from the value of an object.
  *
+ * Numbers, booleans and dates hash to their value. Hashes of frozen
+ * objects are computed once, when they're frozen.
+ *
  * @param object Object to be hashed.
  * @return Numerical hash.
  */
 size_t rpc_hash(_Nonnull rpc_object_t object);
 
+/**
+ * Returns a hash of the value of an object, keyed with @p seed.
+ *
+ * Unlike rpc_hash(), every value goes through the seeded mixing,
+ * so hashes can't be predicted without knowing the seed. A seed of 0
+ * gives the same result as rpc_hash().
+ *
+ * @param object Object to be hashed.
+ * @param seed Hash seed.
+ * @return Numerical hash.
+ */
+size_t rpc_hash_seeded(_Nonnull rpc_object_t object, uint64_t seed);
+
+/**
+ * Makes an object, and everything it contains, immutable.
+ *
+ * A frozen object can be used from any number of threads at once without
+ * locking. Its hash is computed once at this point and its serialized form
+ * is kept after the first time it is sent, so returning it as a result or
+ * caching it doesn't reencode it every time. Any attempt to modify a frozen
+ * object aborts the program. Copies made with rpc_copy() are not frozen.
+ *
+ * Freezing is itself a modification and must not race with other users of
+ * the object.
+ *
+ * @param object Object to be frozen.
+ * @return The object passed as the argument.
+ */
+_Nonnull rpc_object_t rpc_object_freeze(_Nonnull rpc_object_t object);
+
+/**
+ * Checks whether an object was frozen with rpc_object_freeze().
+ *
+ * @param object Object to be checked.
+ * @return true if the object is frozen, otherwise false.
+ */
+bool rpc_object_is_frozen(_Nonnull rpc_object_t object);
+
+/**
+ * Sets the size from which object trees are destroyed in the background.
+ *
+ * When the last reference to an array or a dictionary goes away and it
+ * holds an estimated @p nodes objects or more, its contents are freed
+ * by a library thread rather than the one calling rpc_release(). The
+ * container itself is gone right away; destructors of binary objects
+ * inside it run later, on that thread. Defaults to 65536, 0 turns
+ * background reclamation off.
+ *
+ * @param nodes Tree size threshold.
+ */
+void rpc_object_set_reclaim_threshold(size_t nodes);
+
 /**
  * Creates and returns null byte terminated human readable string representation
  * of an object.
@@ -532,6 +720,101 @@ int rpc_object_unpack(_Nonnull rpc_object_t, const char *_Nonnull fmt, ...);
 int rpc_object_vunpack(_Nonnull rpc_object_t, const char *_Nonnull fmt,
     va_list ap);
 
+/**
+ * Compiles a rpc_object_pack() or rpc_object_unpack() format string.
+ *
+ * The result can be passed to rpc_object_pack_fmt() and
+ * rpc_object_unpack_fmt() any number of times, from any thread, without
+ * the format being parsed again. rpc_object_pack() and rpc_object_unpack()
+ * keep a cache of compiled formats on their own, this only saves the
+ * cache lookup.
+ *
+ * @param fmt Format string.
+ * @return Compiled format or NULL if the format string is malformed.
+ */
+_Nullable rpc_pack_fmt_t rpc_pack_fmt_compile(const char *_Nonnull fmt);
+
+/**
+ * Frees a format returned by rpc_pack_fmt_compile().
+ *
+ * @param fmt Compiled format.
+ */
+void rpc_pack_fmt_free(_Nullable rpc_pack_fmt_t fmt);
+
+/**
+ * Returns a compiled format from the library's cache, compiling it first
+ * if needed.
+ *
+ * The returned format is never freed.
+ *
+ * @param fmt Format string.
+ * @return Compiled format or NULL if the format string is malformed.
+ */
+_Nullable rpc_pack_fmt_t rpc_pack_fmt_get(const char *_Nonnull fmt);
+
+/**
+ * Returns the format cached in @p slot, filling it from rpc_pack_fmt_get()
+ * on first use.
+ *
+ * @see RPC_PACK_FMT
+ */
+_Nullable rpc_pack_fmt_t rpc_pack_fmt_once(
+    _Nullable rpc_pack_fmt_t *_Nonnull slot, const char *_Nonnull fmt);
+
+/**
+ * Compiles a constant format string once per call site.
+ *
+ * Example: rpc_object_pack_fmt(RPC_PACK_FMT("{s,i}"), "key", 1);
+ */
+#define	RPC_PACK_FMT(_fmt)						\
+	__extension__ ({						\
+		static rpc_pack_fmt_t _rpc_pack_fmt_slot;		\
+		rpc_pack_fmt_once(&_rpc_pack_fmt_slot, (_fmt));		\
+	})
+
+/**
+ * Packs values according to a compiled format.
+ *
+ * @see rpc_object_pack
+ * @param fmt Compiled format.
+ * @param ... Variable length list of values to be packed.
+ * @return Packed object or NULL on error.
+ */
+_Nullable rpc_object_t rpc_object_pack_fmt(_Nullable rpc_pack_fmt_t fmt, ...);
+
+/**
+ * Packs values according to a compiled format.
+ *
+ * @see rpc_object_vpack
+ * @param fmt Compiled format.
+ * @param ap Variable arguments list structure.
+ * @return Packed object or NULL on error.
+ */
+_Nullable rpc_object_t rpc_object_vpack_fmt(_Nullable rpc_pack_fmt_t fmt,
+    va_list ap);
+
+/**
+ * Unpacks values according to a compiled format.
+ *
+ * @see rpc_object_unpack
+ * @param fmt Compiled format.
+ * @param ... Variable length list of values to be unpacked.
+ * @return The number of successfully unpacked objects or -1 on error.
+ */
+int rpc_object_unpack_fmt(_Nonnull rpc_object_t, _Nullable rpc_pack_fmt_t fmt,
+    ...);
+
+/**
+ * Unpacks values according to a compiled format.
+ *
+ * @see rpc_object_vunpack
+ * @param fmt Compiled format.
+ * @param ap Variable arguments list structure.
+ * @return The number of successfully unpacked objects or -1 on error.
+ */
+int rpc_object_vunpack_fmt(_Nonnull rpc_object_t, _Nullable rpc_pack_fmt_t fmt,
+    va_list ap);
+
 /**
  * Creates an object holding null value.
  *
@@ -623,6 +906,17 @@ double rpc_double_get_value(_Nonnull rpc_object_t xdouble);
  */
 _Nonnull rpc_object_t rpc_date_create(int64_t interval);
 
+/**
+ * Creates an RPC object holding a date with nanosecond precision.
+ *
+ * Dates are stored as nanoseconds since the UNIX epoch, which covers
+ * years 1678 to 2262.
+ *
+ * @param nsec Nanoseconds since the UNIX epoch.
+ * @return Newly created object.
+ */
+_Nonnull rpc_object_t rpc_date_create_ns(int64_t nsec);
+
 /**
  * Creates an RPC object holding a date from current UTC time.
  *
@@ -641,6 +935,17 @@ _Nonnull rpc_object_t rpc_date_create_from_current(void);
  */
 int64_t rpc_date_get_value(_Nonnull rpc_object_t xdate);
 
+/**
+ * Returns the value of a date object in nanoseconds since the UNIX epoch.
+ *
+ * If rpc_object_t passed as the first argument if not of RPC_TYPE_DATE
+ * type, the function returns 0.
+ *
+ * @param xdate Object to read the value from.
+ * @return Nanoseconds since the UNIX epoch.
+ */
+int64_t rpc_date_get_value_ns(_Nonnull rpc_object_t xdate);
+
 /**
  * Creates an RPC object holding a binary data.
  *
@@ -663,6 +968,28 @@ _Nonnull rpc_object_t rpc_data_create(const void *_Nullable bytes,
 _Nonnull rpc_object_t rpc_data_create_iov(struct iovec *_Nonnull iov,
     size_t niov);
 
+/**
+ * Creates a binary object holding a range of a regular file.
+ *
+ * The range is mapped read-only rather than read into memory, so the
+ * object behaves as any other binary. The socket transport recognizes
+ * such objects when writing a frame and has the kernel send the bytes
+ * straight from the page cache with sendfile(). Receivers get plain
+ * binary data, which makes this usable over TCP and WebSocket links
+ * where RPC_TYPE_FD cannot be passed.
+ *
+ * The descriptor is duplicated and may be closed by the caller.
+ * Truncating the file while the object is alive makes the mapping
+ * fault on access.
+ *
+ * @param fd Descriptor of a regular file.
+ * @param offset Start of the range.
+ * @param length Length of the range, 0 meaning up to the end of file.
+ * @return Newly created object or NULL in case of error.
+ */
+_Nullable rpc_object_t rpc_data_create_file(int fd, off_t offset,
+    size_t length);
+
 /**
  * Returns the length of internal binary data buffer of a provided object.
  *
@@ -791,6 +1118,64 @@ _Nonnull rpc_object_t rpc_array_create_ex(
     const _Nonnull rpc_object_t *_Nonnull objects, size_t count,
     bool steal);
 
+/**
+ * Creates a packed array of numbers.
+ *
+ * A packed array keeps its elements as contiguous native values
+ * instead of one object each. It behaves like any other array, and
+ * stays packed as long as it's only read and written through count,
+ * apply, typed getters and setters of its own type, and serializers.
+ * Anything that needs the elements as objects, such as
+ * rpc_array_get_value() or storing a value of another type, converts
+ * it to an ordinary array for good.
+ *
+ * The msgpack serializer also reads long arrays of numbers of one
+ * type as packed arrays.
+ *
+ * @param type RPC_TYPE_INT64, RPC_TYPE_UINT64 or RPC_TYPE_DOUBLE
+ * @param values Array of @p count int64_t, uint64_t or double values
+ *        to copy, or NULL to start with zeroes
+ * @param count Number of values
+ * @return Newly created object or NULL if @p type can't be packed
+ */
+_Nullable rpc_object_t rpc_array_create_typed(rpc_type_t type,
+    const void *_Nullable values, size_t count);
+
+/**
+ * Returns the element type of a packed array.
+ *
+ * @param array Input array
+ * @return Element type or RPC_TYPE_NULL if @p array is not packed
+ */
+rpc_type_t rpc_array_get_packed_type(_Nonnull rpc_object_t array);
+
+/**
+ * Returns the values of a packed array of int64.
+ *
+ * The pointer may be written through, and stays valid until the array
+ * is resized, converted or freed.
+ *
+ * @param array Input array
+ * @return Pointer to the values or NULL if not a packed int64 array
+ */
+int64_t *_Nullable rpc_array_get_int64_ptr(_Nonnull rpc_object_t array);
+
+/**
+ * Same as rpc_array_get_int64_ptr(), but for uint64 values.
+ *
+ * @param array Input array
+ * @return Pointer to the values or NULL if not a packed uint64 array
+ */
+uint64_t *_Nullable rpc_array_get_uint64_ptr(_Nonnull rpc_object_t array);
+
+/**
+ * Same as rpc_array_get_int64_ptr(), but for double values.
+ *
+ * @param array Input array
+ * @return Pointer to the values or NULL if not a packed double array
+ */
+double *_Nullable rpc_array_get_double_ptr(_Nonnull rpc_object_t array);
+
 /**
  * Inserts an object to @p array at @p index and increments @p value
  * refcount.
@@ -946,6 +1331,59 @@ bool rpc_array_reverse_apply(_Nonnull rpc_object_t array,
 void rpc_array_sort(_Nonnull rpc_object_t array,
     _Nonnull rpc_array_cmp_t comparator);
 
+/**
+ * Default number of elements per task of the parallel array functions.
+ */
+#define	RPC_ARRAY_PARALLEL_GRAIN	4096
+
+/**
+ * Parallel variant of rpc_array_apply().
+ *
+ * The array is split into chunks of @p grain elements that are processed
+ * concurrently on the library's worker pool, the calling thread included.
+ * The applier must therefore be safe to call from several threads at once,
+ * and the array must not be modified until the function returns. Returning
+ * false from the applier stops the iteration, but chunks that are already
+ * running finish their current element first. Arrays of up to @p grain
+ * elements are processed by rpc_array_apply() in the calling thread.
+ *
+ * @param array Input array.
+ * @param grain Elements per task, or 0 for RPC_ARRAY_PARALLEL_GRAIN.
+ * @param applier Block of code to be executed for each array element.
+ * @return Iteration terminated (true)/finished (false) boolean flag.
+ */
+bool rpc_array_apply_parallel(_Nonnull rpc_object_t array, size_t grain,
+    _Nonnull rpc_array_applier_t applier);
+
+/**
+ * Parallel variant of rpc_array_map().
+ *
+ * Elements are replaced in place, each task writing to its own range of
+ * the array. The same threading rules as for rpc_array_apply_parallel()
+ * apply to the mapper.
+ *
+ * @param array Input array.
+ * @param grain Elements per task, or 0 for RPC_ARRAY_PARALLEL_GRAIN.
+ * @param mapper Block of code to be executed for each array element.
+ */
+void rpc_array_map_parallel(_Nonnull rpc_object_t array, size_t grain,
+    _Nonnull rpc_array_mapper_t mapper);
+
+/**
+ * Parallel variant of rpc_array_sort().
+ *
+ * Runs of @p grain elements are sorted concurrently and then merged in
+ * pairs, one pass per doubling of the run length. Like rpc_array_sort(),
+ * the sort is stable. The comparator is called from several threads at
+ * once.
+ *
+ * @param array Array to be sorted.
+ * @param grain Elements per run, or 0 for RPC_ARRAY_PARALLEL_GRAIN.
+ * @param comparator Comparator to be used during sort operation.
+ */
+void rpc_array_sort_parallel(_Nonnull rpc_object_t array, size_t grain,
+    _Nonnull rpc_array_cmp_t comparator);
+
 /**
  * Takes an input array and copies a selected number of its elements,
  * starting from a given index, creating an output array.
@@ -1206,9 +1644,39 @@ int rpc_array_dup_fd(_Nonnull rpc_object_t array, size_t index);
  */
 _Nullable rpc_object_t rpc_shmem_create(size_t size);
 
+/**
+ * Allocates a chunk of a shared memory of a given size with extra options.
+ *
+ * With RPC_SHMEM_HUGETLB the backing file is rounded up to the default
+ * huge page size. With RPC_SHMEM_SEALABLE the file can no longer grow or
+ * shrink, so a receiver can map it without guarding against SIGBUS, and
+ * rpc_shmem_seal() may later make it immutable. RPC_SHMEM_NUMA_NODE()
+ * binds the pages to the given node.
+ *
+ * @param size Size (in bytes) of a shared memory to be allocated.
+ * @param flags Bitwise OR of rpc_shmem_flags_t values.
+ * @return Newly created object or NULL in case of failure.
+ */
+_Nullable rpc_object_t rpc_shmem_create_ex(size_t size, int flags);
+
+/**
+ * Makes a shared memory object created with RPC_SHMEM_SEALABLE immutable.
+ *
+ * The object must not be mapped at the time of the call. Afterwards,
+ * rpc_shmem_map() returns read-only mappings, and receivers may use the
+ * contents in place without copying them first.
+ *
+ * @param shmem Shared memory object.
+ * @return 0 on success, -1 on failure.
+ */
+int rpc_shmem_seal(_Nonnull rpc_object_t shmem);
+
 /**
  * Maps a given shared memory object to an actual address.
  *
+ * Objects referring to the same memory file share a single cached
+ * mapping of the whole file. Write-sealed objects are mapped read-only.
+ *
  * @param shmem Input shared memory object.
  * @return Address a shared memory has been mapped to.
  */
@@ -1229,17 +1697,62 @@ void rpc_shmem_unmap(_Nonnull rpc_object_t shmem, void *_Nonnull addr);
  * @return Size of a shared memory.
  */
 size_t rpc_shmem_get_size(_Nonnull rpc_object_t shmem);
+
+/**
+ * Creates a shared memory pool backed by a single memory file.
+ *
+ * Shared memory objects allocated from a pool are page-aligned slices
+ * of the same file, so creating one costs no system calls and a peer
+ * that has seen the pool once maps each further slice from its cache.
+ *
+ * @param size Size (in bytes) of the pool, rounded up to a page.
+ * @return Newly created pool or NULL in case of failure.
+ */
+_Nullable rpc_shmem_pool_t rpc_shmem_pool_create(size_t size);
+
+/**
+ * Destroys a shared memory pool.
+ *
+ * Objects allocated from the pool must not be used afterwards.
+ *
+ * @param pool Pool to destroy.
+ */
+void rpc_shmem_pool_destroy(_Nullable rpc_shmem_pool_t pool);
+
+/**
+ * Allocates a shared memory object from a pool.
+ *
+ * @param pool Pool to allocate from.
+ * @param size Size (in bytes) of the slice.
+ * @return Newly created object or NULL if the pool is exhausted.
+ */
+_Nullable rpc_object_t rpc_shmem_pool_alloc(_Nonnull rpc_shmem_pool_t pool,
+    size_t size);
+
+/**
+ * Returns a slice previously allocated with rpc_shmem_pool_alloc()
+ * to the pool.
+ *
+ * The object itself still has to be released by the caller.
+ *
+ * @param pool Pool the slice was allocated from.
+ * @param shmem Shared memory object.
+ */
+void rpc_shmem_pool_free(_Nonnull rpc_shmem_pool_t pool,
+    _Nonnull rpc_object_t shmem);
 #endif
 
 /**
- * Creates an RPC object representing an error condition with automatically
- * extracted stack trace.
+ * Creates an RPC object representing an error condition.
  *
  * It can hold data about numerical error code, string describing
  * the actual error in human readable format and extra auxiliary data.
  *
  * Extra is an optional argument and can be safely set to NULL when not needed.
  *
+ * The stack trace is captured unless turned off with
+ * rpc_error_set_capture_stacks(), and is null then.
+ *
  * @param code Numerical error code.
  * @param msg String representing an actual error description.
  * @param extra Extra data (optional).
@@ -1267,6 +1780,17 @@ _Nonnull rpc_object_t rpc_error_create_with_stack(int code,
     const char *_Nonnull msg, _Nullable rpc_object_t extra,
     _Nullable rpc_object_t stack);
 
+/**
+ * Turns stack capture in rpc_error_create() on or off.
+ *
+ * Capture is on by default. Walking and symbolizing the stack costs far
+ * more than the rest of the error, so programs creating many errors may
+ * want to turn it off.
+ *
+ * @param enable Whether to capture stacks.
+ */
+void rpc_error_set_capture_stacks(bool enable);
+
 /**
  * Returns numerical error code of a provided error object.
  *
@@ -52,6 +52,47 @@ struct rpc_query_iter;
  */
 typedef struct rpc_query_iter *rpc_query_iter_t;
 
+/**
+ * A compiled form of query rules.
+ *
+ * The plan holds pre-split field paths, resolved operators and compiled
+ * regular expressions, so it can be evaluated against many objects without
+ * re-parsing the rules. A plan is immutable once compiled and can be shared
+ * between threads.
+ */
+struct rpc_query_plan;
+
+/**
+ * Definition of rpc_query_plan pointer type.
+ */
+typedef struct rpc_query_plan *rpc_query_plan_t;
+
+/**
+ * A set of secondary indexes over a snapshot of an array.
+ *
+ * Each index covers a single "key1.key2.0" like path of the array elements.
+ * Queries run through rpc_query_index_run use the indexes to narrow down
+ * candidate elements for "=", "in", "<", "<=", ">" and ">=" rules and fall
+ * back to scanning for everything else.
+ */
+struct rpc_query_index;
+
+/**
+ * Definition of rpc_query_index pointer type.
+ */
+typedef struct rpc_query_index *rpc_query_index_t;
+
+/**
+ * Kind of a secondary index.
+ *
+ * Hash indexes serve "=" and "in" rules, sorted indexes serve range
+ * rules as well.
+ */
+typedef enum {
+	RPC_QUERY_INDEX_HASH,
+	RPC_QUERY_INDEX_SORTED
+} rpc_query_index_type_t;
+
 /**
  * Definition of query callback block type.
  *
@@ -88,11 +129,12 @@ typedef _Nullable rpc_object_t (^rpc_query_cb_t)(_Nonnull rpc_object_t object);
  * - sort (rpc_array_cmp_t) - sort the input array before yielding the
  *   results - the sorting function is taking a rpc_array_cmp_t block as
  *   an argument to figure out relations between input an array's elements
- *   (a > b, a = b, a < b).
+ *   (a > b, a = b, a < b). When limit is set as well, only the matching
+ *   elements which can be yielded are selected and sorted, and the input
+ *   array is left intact.
  * - reverse (boolean) - reverse the order of elements of an input array
- *   (always done after eventual sorting) - be aware that this operation
- *   has to create an intermediate object to store elements in the reversed
- *   order, so it might be expensive for large data sets.
+ *   (always done after eventual sorting) - the array is iterated backwards,
+ *   without creating an intermediate copy.
  * - callback (rpc_query_cb_t) - for each of the matching elements run
  *   a callback function first - query will return an RPC object returned
  *   by a callback function, but will skip it if a callback function
@@ -274,6 +316,137 @@ _Nullable rpc_query_iter_t rpc_query_fmt(_Nonnull rpc_object_t object,
 _Nullable rpc_object_t rpc_query_apply(_Nonnull rpc_object_t object,
     _Nonnull rpc_object_t rules);
 
+/**
+ * Compiles query rules into a reusable plan.
+ *
+ * Rules have the same format as in the rpc_query function case. Malformed
+ * rules are compiled into parts of the plan that never match, just the way
+ * rpc_query treats them. The rules object is not referenced by the plan
+ * and can be modified or released afterwards.
+ *
+ * @param rules Query rules.
+ * @return Compiled plan, to be released using rpc_query_plan_free.
+ */
+_Nonnull rpc_query_plan_t rpc_query_compile(_Nullable rpc_object_t rules);
+
+/**
+ * Releases a compiled query plan.
+ *
+ * Iterators created with rpc_query_plan_run keep their own reference to
+ * the plan, so it is safe to release it while they are still in use.
+ *
+ * @param plan Plan to be released.
+ */
+void rpc_query_plan_free(_Nullable rpc_query_plan_t plan);
+
+/**
+ * Performs a query operation on a given object using a compiled plan.
+ *
+ * The function works exactly the same as the rpc_query function.
+ *
+ * @param object Object to be queried.
+ * @param params Query parameters.
+ * @param plan Compiled query rules.
+ * @return Query iterator.
+ */
+_Nullable rpc_query_iter_t rpc_query_plan_run(_Nonnull rpc_object_t object,
+    _Nullable rpc_query_params_t params, _Nonnull rpc_query_plan_t plan);
+
+/**
+ * Checks if a given RPC object does match a compiled plan.
+ *
+ * The function works exactly the same as the rpc_query_apply function.
+ *
+ * @param object Object to be checked against a given plan.
+ * @param plan Compiled query rules.
+ * @return The object itself if is matches the plan, otherwise NULL.
+ */
+_Nullable rpc_object_t rpc_query_plan_apply(_Nullable rpc_object_t object,
+    _Nonnull rpc_query_plan_t plan);
+
+/**
+ * Creates an empty index set over a given array.
+ *
+ * The index set takes a copy of the array, so it keeps describing the
+ * contents the array had at the time of the call. Copies share storage
+ * until written, so creating an index set does not duplicate the array
+ * unless either side is modified later. Rebuild the index set to pick up
+ * the modifications.
+ *
+ * @param array Array to be indexed.
+ * @return Index set or NULL in case of error.
+ */
+_Nullable rpc_query_index_t rpc_query_index_create(_Nonnull rpc_object_t array);
+
+/**
+ * Adds an index on a given path to an index set.
+ *
+ * Elements which do not contain the path are left out of the index. Adding
+ * an index that already exists is a no-op.
+ *
+ * @param index Index set.
+ * @param path Path to be indexed, in the rpc_query_get format.
+ * @param type Kind of index.
+ * @return 0 on success, -1 on error.
+ */
+int rpc_query_index_add(_Nonnull rpc_query_index_t index,
+    const char *_Nonnull path, rpc_query_index_type_t type);
+
+/**
+ * Performs a query operation on an indexed array using a compiled plan.
+ *
+ * The function works the same as the rpc_query_plan_run function called
+ * on the indexed array snapshot, except for the sort parameter never
+ * reordering the snapshot itself.
+ *
+ * @param index Index set.
+ * @param params Query parameters.
+ * @param plan Compiled query rules.
+ * @return Query iterator.
+ */
+_Nullable rpc_query_iter_t rpc_query_index_run(_Nonnull rpc_query_index_t index,
+    _Nullable rpc_query_params_t params, _Nonnull rpc_query_plan_t plan);
+
+/**
+ * Releases an index set.
+ *
+ * Iterators returned by rpc_query_index_run stay valid afterwards.
+ *
+ * @param index Index set to be released.
+ */
+void rpc_query_index_free(_Nullable rpc_query_index_t index);
+
+/**
+ * Creates an object describing a query, to be sent to a server.
+ *
+ * This is the client side of query pushdown: a streaming method which
+ * returns a filtered collection takes the resulting object as an argument
+ * and passes it to rpc_function_yield_query, so only the matching
+ * elements are sent back. The object is a dictionary with the "rules"
+ * key and the "single", "count", "offset", "limit" and "reverse" query
+ * parameters. The sort and callback parameters cannot be sent and are
+ * ignored.
+ *
+ * @param rules Query rules, NULL to match every element.
+ * @param params Query parameters.
+ * @return Query request object.
+ */
+_Nonnull rpc_object_t rpc_query_request_create(_Nullable rpc_object_t rules,
+    _Nullable rpc_query_params_t params);
+
+/**
+ * Performs a query described by a query request object.
+ *
+ * Missing request keys fall back to their defaults, and a NULL request
+ * yields every element of the object.
+ *
+ * @param object Object to be queried.
+ * @param request Query request, as created by rpc_query_request_create.
+ * @return Query iterator or NULL in case of error.
+ */
+_Nullable rpc_query_iter_t rpc_query_request_run(_Nonnull rpc_object_t object,
+    _Nullable rpc_object_t request);
+
 /**
  * Yields the next RPC object matching params and rules stored within
  * iterator structure.
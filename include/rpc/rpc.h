@@ -38,5 +38,6 @@
 #include <rpc/query.h>
 #include <rpc/typing.h>
 #include <rpc/rpcd.h>
+#include <rpc/thread.h>
 
 #endif /* LIBRPC_RPC_H */
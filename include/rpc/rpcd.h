@@ -48,6 +48,11 @@ typedef void (^rpcd_service_applier_t)(const char *_Nonnull name,
 /**
  * Looks up a service with given name and connects to it.
  *
+ * Services that rpcd lets clients reach directly are resolved once and
+ * cached until the TTL handed out by rpcd runs out or rpcd announces
+ * that the service unregistered; later calls connect straight to the
+ * service without a round trip through rpcd.
+ *
  * @param rpcd_uri URI of the rpcd server
  * @param service_name FQDN name of the service
  * @return RPC client handle or NULL in case of an error
@@ -55,6 +60,42 @@ typedef void (^rpcd_service_applier_t)(const char *_Nonnull name,
 _Nullable rpc_client_t rpcd_connect_to(const char *_Nullable rpcd_uri,
     const char *_Nonnull service_name);
 
+/**
+ * Returns the credential token rpcd issued along with the cached
+ * endpoint of @p service_name.
+ *
+ * The token is opaque to librpc; services that want to make sure
+ * clients went through rpcd first may ask for it.
+ *
+ * @param rpcd_uri URI of the rpcd server
+ * @param service_name FQDN name of the service
+ * @return Token to be freed with g_free() or NULL if none is cached
+ */
+char *_Nullable rpcd_get_service_token(const char *_Nullable rpcd_uri,
+    const char *_Nonnull service_name);
+
+/**
+ * Publishes events through rpcd.
+ *
+ * rpcd emits the events from its own context, on paths below
+ * /(service_name), so that it rather than the service fans them out
+ * to every subscriber, WebSocket clients of its root path included.
+ * @p events has the same shape as in rpc_connection_send_event_burst().
+ *
+ * @param client Client connected to rpcd
+ * @param service_name FQDN name of the publishing service
+ * @param events Array of events
+ * @return Number of events published or -1 on error
+ */
+int rpcd_publish(_Nonnull rpc_client_t client,
+    const char *_Nonnull service_name, _Nonnull rpc_object_t events);
+
+/**
+ * Forgets every cached service endpoint, forcing subsequent
+ * rpcd_connect_to() calls to resolve through rpcd again.
+ */
+void rpcd_flush_cache(void);
+
 /**
  * Iterates through services found on a rpcd server at @p rpcd_uri.
  *
@@ -38,6 +38,53 @@
 extern "C" {
 #endif
 
+/**
+ * Smallest msgpack extension tag available to
+ * rpc_serializer_register_ext(). Lower tags are reserved for librpc.
+ */
+#define	RPC_SERIALIZER_EXT_MIN		32
+
+/**
+ * Largest msgpack extension tag.
+ */
+#define	RPC_SERIALIZER_EXT_MAX		127
+
+/**
+ * Size of the buffer extension encoders write into.
+ */
+#define	RPC_SERIALIZER_EXT_MAX_SIZE	256
+
+/**
+ * Encodes a value into @p buf, @p size bytes long. Returns the number of
+ * bytes written, or -1 to have the value written as its plain builtin
+ * type instead.
+ */
+typedef ssize_t (^rpc_serializer_ext_encoder_t)(_Nonnull rpc_object_t value,
+    void *_Nonnull buf, size_t size);
+
+/**
+ * Builds a value from the @p len bytes produced by the matching encoder.
+ * Typically returns an object typed with rpct_new(). Returning NULL
+ * makes the value read as null.
+ */
+typedef _Nullable rpc_object_t (^rpc_serializer_ext_decoder_t)(
+    const void *_Nonnull buf, size_t len);
+
+/**
+ * A read-only view of data written by the "flat" serializer.
+ */
+typedef struct rpc_flat *rpc_flat_t;
+
+/**
+ * A value inside a flat view.
+ */
+typedef uint64_t rpc_flat_node_t;
+
+/**
+ * Node returned where there is no value.
+ */
+#define	RPC_FLAT_NONE	0
+
 /**
  * Checks whether specified serializer is available.
  *
@@ -49,7 +96,8 @@ bool rpc_serializer_exists(const char *_Nonnull serializer);
 /**
  * Loads an RPC object from a serialized blob.
  *
- * @param serializer Serializer type (msgpack, json or yaml)
+ * @param serializer Serializer type (msgpack, msgpack-canonical, json,
+ *     yaml or flat)
  * @param frame Blob pointer
  * @param len Blob length
  * @return RPC object or NULL in case of error.
@@ -59,7 +107,14 @@ _Nullable rpc_object_t rpc_serializer_load(const char *_Nonnull serializer,
 
 /**
  * Dumps an RPC object into a serialized blob form.
- * @param serializer Serializer type (msgpack, json or yaml)
+ *
+ * The msgpack-canonical serializer writes frames any msgpack reader
+ * accepts, with dictionary keys sorted and integers in their shortest
+ * encoding, so equal objects always produce identical bytes. Use it
+ * for hashing, signing or caching serialized values.
+ *
+ * @param serializer Serializer type (msgpack, msgpack-canonical, json,
+ *     yaml or flat)
  * @param framep Pointer to a variable holding blob pointer
  * @param lenp Pointer to a variable holding resulting blob length
  * @return 0 on success, -1 on error
@@ -68,6 +123,250 @@ int rpc_serializer_dump(const char *_Nonnull serializer,
     _Nonnull rpc_object_t obj, void *_Nullable *_Nonnull framep,
     size_t *_Nullable lenp);
 
+/**
+ * Reads a single value out of a msgpack frame.
+ *
+ * Only the value designated by @p path is turned into an object, the
+ * rest of the frame is stepped over. This lets routers and filters
+ * working on raw frames, see rpc_connection_set_raw_message_handler(),
+ * look at a message envelope without decoding its payload.
+ *
+ * @p path is a sequence of dictionary keys and array indices separated
+ * by dots, for instance "args.path" or "args.0". Compressed frames
+ * have to be expanded first.
+ *
+ * @param frame Frame pointer
+ * @param len Frame length
+ * @param path Path to the value
+ * @return Value or NULL if the frame is invalid or has no such value.
+ */
+_Nullable rpc_object_t rpc_serializer_peek(const void *_Nonnull frame,
+    size_t len, const char *_Nonnull path);
+
+/**
+ * Loads a msgpack frame, except for one member of its top dictionary.
+ *
+ * The member called @p key is left encoded: @p rawp and @p rawlenp are
+ * set to the bytes holding it, inside @p frame, or to NULL and 0 when
+ * the frame has no such member. Pass them to
+ * rpc_serializer_dump_envelope() to forward the message without
+ * decoding and encoding its payload again.
+ *
+ * @param frame Frame pointer
+ * @param len Frame length
+ * @param key Member to leave encoded, typically "args"
+ * @param rawp Set to the encoded member
+ * @param rawlenp Set to the length of the encoded member
+ * @return Dictionary without @p key, or NULL in case of error.
+ */
+_Nullable rpc_object_t rpc_serializer_load_envelope(
+    const void *_Nonnull frame, size_t len, const char *_Nonnull key,
+    const void *_Nullable *_Nonnull rawp, size_t *_Nonnull rawlenp);
+
+/**
+ * Dumps a dictionary into a msgpack frame, adding an encoded member.
+ *
+ * Counterpart of rpc_serializer_load_envelope(). The @p rawlen bytes
+ * at @p raw are written as is as the value of @p key. When @p raw is
+ * NULL the envelope is dumped alone.
+ *
+ * @param envelope Dictionary to dump, without @p key
+ * @param key Member name
+ * @param raw Encoded member value
+ * @param rawlen Length of the encoded member value
+ * @param framep Pointer to a variable holding blob pointer
+ * @param lenp Pointer to a variable holding resulting blob length
+ * @return 0 on success, -1 on error
+ */
+int rpc_serializer_dump_envelope(_Nonnull rpc_object_t envelope,
+    const char *_Nonnull key, const void *_Nullable raw, size_t rawlen,
+    void *_Nullable *_Nonnull framep, size_t *_Nonnull lenp);
+
+/**
+ * Registers a msgpack extension type for values of a given type.
+ *
+ * Values typed as @p type are written by the msgpack serializer as a
+ * msgpack extension with tag @p tag and the encoder's output as its
+ * payload, instead of a dictionary carrying the type name. Extensions
+ * with that tag are read back with the decoder. Other serializers write
+ * such values as their plain builtin value.
+ *
+ * Register extensions before any object gets serialized, and the same
+ * way on both ends of a connection.
+ *
+ * @param tag Extension tag, from RPC_SERIALIZER_EXT_MIN to
+ *        RPC_SERIALIZER_EXT_MAX
+ * @param type Canonical name of the type
+ * @param encoder Encoder block
+ * @param decoder Decoder block
+ * @return 0 on success, -1 on error
+ */
+int rpc_serializer_register_ext(int tag, const char *_Nonnull type,
+    _Nonnull rpc_serializer_ext_encoder_t encoder,
+    _Nonnull rpc_serializer_ext_decoder_t decoder);
+
+/**
+ * Maps a file written by the "flat" serializer for reading.
+ *
+ * Nothing is parsed up front: nodes are located by offset and checked
+ * as they are visited, so opening a file of any size takes the same
+ * time and the pages of the parts never visited are never read in.
+ *
+ * @param path File path
+ * @return Flat view or NULL in case of error.
+ */
+_Nullable rpc_flat_t rpc_flat_open(const char *_Nonnull path);
+
+/**
+ * Opens a buffer written by the "flat" serializer for reading.
+ *
+ * The buffer is not copied, so it must outlive the view.
+ *
+ * @param buf Buffer pointer
+ * @param len Buffer length
+ * @return Flat view or NULL if the buffer isn't flat data.
+ */
+_Nullable rpc_flat_t rpc_flat_open_buffer(const void *_Nonnull buf,
+    size_t len);
+
+/**
+ * Closes a flat view.
+ *
+ * A file stays mapped for as long as binary objects returned by
+ * rpc_flat_get_object() reference it.
+ *
+ * @param flat Flat view
+ */
+void rpc_flat_close(_Nonnull rpc_flat_t flat);
+
+/**
+ * Returns the top level value of a flat view.
+ *
+ * @param flat Flat view
+ * @return Root node
+ */
+rpc_flat_node_t rpc_flat_get_root(_Nonnull rpc_flat_t flat);
+
+/**
+ * Returns the type of a node.
+ *
+ * @param flat Flat view
+ * @param node Node
+ * @return Node type, RPC_TYPE_NULL for RPC_FLAT_NONE or an invalid node
+ */
+rpc_type_t rpc_flat_get_type(_Nonnull rpc_flat_t flat, rpc_flat_node_t node);
+
+/**
+ * Returns the number of elements of an array or dictionary node, or
+ * the length of a string or binary node.
+ *
+ * @param flat Flat view
+ * @param node Node
+ * @return Count or length, 0 for other nodes
+ */
+size_t rpc_flat_get_count(_Nonnull rpc_flat_t flat, rpc_flat_node_t node);
+
+/**
+ * Returns an element of an array node.
+ *
+ * @param flat Flat view
+ * @param node Array node
+ * @param index Element index
+ * @return Element or RPC_FLAT_NONE
+ */
+rpc_flat_node_t rpc_flat_array_get(_Nonnull rpc_flat_t flat,
+    rpc_flat_node_t node, size_t index);
+
+/**
+ * Looks a key up in a dictionary node, in logarithmic time.
+ *
+ * @param flat Flat view
+ * @param node Dictionary node
+ * @param key Key
+ * @return Value or RPC_FLAT_NONE
+ */
+rpc_flat_node_t rpc_flat_dictionary_get(_Nonnull rpc_flat_t flat,
+    rpc_flat_node_t node, const char *_Nonnull key);
+
+/**
+ * Returns the key of an entry of a dictionary node. Entries are sorted
+ * by key.
+ *
+ * @param flat Flat view
+ * @param node Dictionary node
+ * @param index Entry index
+ * @return Key, pointing into the view, or NULL
+ */
+const char *_Nullable rpc_flat_dictionary_get_key(_Nonnull rpc_flat_t flat,
+    rpc_flat_node_t node, size_t index);
+
+/**
+ * Returns the value of an entry of a dictionary node.
+ *
+ * @param flat Flat view
+ * @param node Dictionary node
+ * @param index Entry index
+ * @return Value or RPC_FLAT_NONE
+ */
+rpc_flat_node_t rpc_flat_dictionary_get_value(_Nonnull rpc_flat_t flat,
+    rpc_flat_node_t node, size_t index);
+
+/**
+ * Returns the value of a boolean node, or false.
+ */
+bool rpc_flat_get_bool(_Nonnull rpc_flat_t flat, rpc_flat_node_t node);
+
+/**
+ * Returns the value of an int64 node, or 0.
+ */
+int64_t rpc_flat_get_int64(_Nonnull rpc_flat_t flat, rpc_flat_node_t node);
+
+/**
+ * Returns the value of a uint64 node, or 0.
+ */
+uint64_t rpc_flat_get_uint64(_Nonnull rpc_flat_t flat, rpc_flat_node_t node);
+
+/**
+ * Returns the value of a double node, or 0.
+ */
+double rpc_flat_get_double(_Nonnull rpc_flat_t flat, rpc_flat_node_t node);
+
+/**
+ * Returns the value of a date node in nanoseconds since the UNIX
+ * epoch, or 0.
+ */
+int64_t rpc_flat_get_date(_Nonnull rpc_flat_t flat, rpc_flat_node_t node);
+
+/**
+ * Returns the value of a string node, pointing into the view, or NULL.
+ */
+const char *_Nullable rpc_flat_get_string(_Nonnull rpc_flat_t flat,
+    rpc_flat_node_t node);
+
+/**
+ * Returns the bytes of a binary node, pointing into the view, or NULL.
+ *
+ * @param flat Flat view
+ * @param node Binary node
+ * @param lenp Set to the length of the data
+ * @return Data pointer
+ */
+const void *_Nullable rpc_flat_get_binary(_Nonnull rpc_flat_t flat,
+    rpc_flat_node_t node, size_t *_Nonnull lenp);
+
+/**
+ * Builds an object out of a node and everything below it.
+ *
+ * Only that part of the view is read. Binary data of a mapped file is
+ * referenced rather than copied.
+ *
+ * @param flat Flat view
+ * @param node Node
+ * @return Object or NULL if the node is invalid.
+ */
+_Nullable rpc_object_t rpc_flat_get_object(_Nonnull rpc_flat_t flat,
+    rpc_flat_node_t node);
+
 #ifdef __cplusplus
 }
 #endif
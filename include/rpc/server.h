@@ -52,10 +52,15 @@ struct rpc_server;
  */
 typedef struct rpc_server *rpc_server_t;
 
+/**
+ * Enumerates server events reported to rpc_server_set_event_handler().
+ */
 typedef enum rpc_server_event
 {
-	RPC_SERVER_CLIENT_CONNECT,
-	RPC_SERVER_CLIENT_DISCONNECT,
+	RPC_SERVER_CLIENT_CONNECT,	/**< Client connected */
+	RPC_SERVER_CLIENT_DISCONNECT,	/**< Client went away */
+	RPC_SERVER_CLIENT_SLOW,		/**< Client can't keep up, see
+					     rpc_server_set_slow_consumer_policy() */
 } rpc_server_event_t;
 
 /**
@@ -72,6 +77,79 @@ typedef void (^rpc_server_ev_handler_t)(_Nonnull rpc_connection_t conn,
 		_fn(_arg, _conn, _event);				\
 	}
 
+/**
+ * Server parameter (string) selecting how a socket server receives:
+ * "threads" (the default) runs a reader thread per connection,
+ * RPC_SERVER_IO_EPOLL multiplexes all connections over a small pool
+ * of I/O threads. Linux only.
+ */
+#define	RPC_SERVER_IO_MODEL	"io_model"
+
+/**
+ * Value of RPC_SERVER_IO_MODEL selecting the epoll backend.
+ */
+#define	RPC_SERVER_IO_EPOLL	"epoll"
+
+/**
+ * Value of RPC_SERVER_IO_MODEL selecting the io_uring backend: same
+ * thread pool as RPC_SERVER_IO_EPOLL, but receiving through multishot
+ * recvmsg requests with a shared buffer ring. Needs a librpc built with
+ * ENABLE_IO_URING; I/O threads fall back to epoll where the kernel lacks
+ * support.
+ */
+#define	RPC_SERVER_IO_URING	"io_uring"
+
+/**
+ * Server parameter (uint64) with the number of I/O threads used by
+ * the epoll backend. Defaults to the number of CPUs, up to 4.
+ *
+ * WebSocket servers also take it: each I/O thread runs its own HTTP
+ * server and main context, all accepting from the same listening socket.
+ * There, it defaults to 1 (everything on the server main context).
+ */
+#define	RPC_SERVER_IO_THREADS	"io_threads"
+
+/**
+ * Server parameter (uint64) with the number of accept shards of a TCP
+ * server. Each shard binds its own SO_REUSEPORT socket, letting the
+ * kernel spread incoming connections, and accepts on a thread of its
+ * own; connections it accepts use that thread's main context. Defaults
+ * to 1, which accepts on the server main context. Linux only.
+ */
+#define	RPC_SERVER_ACCEPT_SHARDS	"accept_shards"
+
+/**
+ * Server parameter (fd or array of fds) with listening sockets for a
+ * socket server to take over instead of binding to its URI, one per
+ * accept shard. A plain fd as the whole parameter object does the same
+ * for a single socket.
+ */
+#define	RPC_SERVER_LISTEN_FD	"listen_fd"
+
+/**
+ * Server parameter (int64) with the file mode of a unix domain socket,
+ * for when the parameters are given as a dictionary.
+ */
+#define	RPC_SERVER_UNIX_MODE	"unix_mode"
+
+/**
+ * Server parameter (uint64) with the number of milliseconds a client's
+ * session outlives its connection. When set, every client gets a
+ * session token on connecting; after a disconnect, its subscriptions
+ * are kept this long, along with the events it misses, for a new
+ * connection to take over with rpc_connection_resume_session().
+ * Defaults to 0, no sessions.
+ */
+#define	RPC_SERVER_SESSION_GRACE	"session_grace"
+
+/**
+ * Server parameter (uint64) with the number of channels a mux+ client
+ * may have open over one physical connection at a time. Frames opening
+ * channels past it are refused and the channel is closed back to the
+ * client. Defaults to 1024.
+ */
+#define	RPC_SERVER_MUX_MAX_CHANNELS	"mux_max_channels"
+
 /**
  * Creates a server instance listening on a given URI.
  *
@@ -107,7 +185,8 @@ void rpc_server_pause(_Nonnull rpc_server_t server);
  *
  * @param uri URI to listen on
  * @param context RPC context for a server instance
- * @param params Additional parameters for a transport
+ * @param params Additional parameters for a transport, for example
+ *     a dictionary of RPC_SERVER_IO_MODEL and friends
  * @return Server handle
  */
 _Nullable rpc_server_t rpc_server_create_ex(const char *_Nonnull uri,
@@ -142,6 +221,25 @@ void rpc_server_broadcast_event(_Nonnull rpc_server_t server,
 void rpc_server_set_event_handler(_Nonnull rpc_server_t server,
     _Nullable rpc_server_ev_handler_t handler);
 
+/**
+ * Sets up detection of clients that don't keep up with the server.
+ *
+ * A connection is slow once its send queue has stayed saturated (see
+ * rpc_connection_set_send_watermarks()) for @p timeout milliseconds,
+ * or one of its streaming calls has waited that long for the consumer
+ * to grant credits with rpc_call_continue(). The event handler then
+ * gets RPC_SERVER_CLIENT_SLOW, once until the connection recovers.
+ * With @p disconnect set, the connection is also aborted right away,
+ * with an ETIMEDOUT error, so that queued fragments and events are
+ * released.
+ *
+ * @param server Server handle
+ * @param timeout Time in milliseconds, 0 to turn detection off
+ * @param disconnect Whether to abort slow connections
+ */
+void rpc_server_set_slow_consumer_policy(_Nonnull rpc_server_t server,
+    uint64_t timeout, bool disconnect);
+
 /**
  * Closes a given RPC server.
  *
@@ -150,6 +248,20 @@ void rpc_server_set_event_handler(_Nonnull rpc_server_t server,
  */
 int rpc_server_close(_Nonnull rpc_server_t server);
 
+/**
+ * Reads traffic statistics summed over connections of @p server.
+ *
+ * Counters include connections that are already gone, while call and
+ * subscription figures only cover the live ones. Single connections
+ * can be inspected with rpc_connection_get_stats(), for example from
+ * the RPC_SERVER_CLIENT_CONNECT event handler.
+ *
+ * @param server Server handle
+ * @param stats Structure to fill in
+ */
+void rpc_server_get_stats(_Nonnull rpc_server_t server,
+    struct rpc_connection_stats *_Nonnull stats);
+
 /**
  * Sets up some number of servers using systemd socket activation
  * information.
@@ -162,6 +274,57 @@ int rpc_server_socket_activate(_Nonnull rpc_context_t context,
     _Nonnull rpc_server_t *_Nonnull *_Nonnull servers,
     _Nullable rpc_object_t *_Nullable rest);
 
+#if defined(__linux__)
+/**
+ * Hands servers over to a process waiting in rpc_server_handoff_receive().
+ *
+ * Connects to the unix socket at @p path and passes the new process a
+ * duplicate of every listening socket of @p servers, so that no
+ * connection attempt gets refused while one process replaces another.
+ *
+ * With @p connections set, idle connections move along too: those with
+ * no call in flight either way, nothing left to send and no shared
+ * memory regions or type IDs negotiated. Their event subscriptions
+ * carry over and their peers see no reconnect. Other connections stay.
+ * Events emitted while a connection moves may get lost.
+ *
+ * Both processes accept from the sockets until @p servers get closed,
+ * which the caller should do once this returns. Only socket transport
+ * servers can be handed over, and only to a process running as the same
+ * user.
+ *
+ * @param path Path of the handoff socket
+ * @param servers Servers to hand over
+ * @param count Number of servers in @p servers
+ * @param connections Whether to hand over idle connections
+ * @return 0 on success, -1 on error
+ */
+int rpc_server_handoff(const char *_Nonnull path,
+    _Nonnull rpc_server_t *_Nonnull servers, size_t count, bool connections);
+
+/**
+ * Takes servers over from a process calling rpc_server_handoff().
+ *
+ * Listens on a unix socket at @p path, only accessible to the current
+ * user, waits for a process of the same user to connect and creates a
+ * server for every one it hands over, with its URI and @p params plus
+ * RPC_SERVER_LISTEN_FD. Connections that come along are attached to
+ * their servers with their subscriptions.
+ *
+ * The servers start paused, like any other; calls on connections that
+ * came along wait until rpc_server_resume().
+ *
+ * @param context RPC context for the servers
+ * @param path Path of the handoff socket
+ * @param params Server parameters (dictionary) or NULL
+ * @param servers Where to store an array of the servers created
+ * @return Number of servers created or -1 on error
+ */
+int rpc_server_handoff_receive(_Nonnull rpc_context_t context,
+    const char *_Nonnull path, _Nullable rpc_object_t params,
+    _Nonnull rpc_server_t *_Nullable *_Nonnull servers);
+#endif
+
 #ifdef __cplusplus
 }
 #endif
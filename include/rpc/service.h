@@ -59,6 +59,13 @@ extern "C" {
 #define	RPC_OBSERVABLE_INTERFACE	"com.twoporeguys.librpc.Observable"
 #define	RPC_DEFAULT_INTERFACE		"com.twoporeguys.librpc.Default"
 
+/**
+ * Property cache TTL: keep the value until the property is reported
+ * changed. See @ref rpc_instance_set_property_cache.
+ */
+#define	RPC_PROPERTY_CACHE_UNTIL_CHANGED	((unsigned int)-1)
+#define	RPC_STATS_INTERFACE		"com.twoporeguys.librpc.Stats"
+
 /**
  * RPC context structure.
  */
@@ -107,6 +114,16 @@ typedef void (^rpc_property_setter_t)(void *_Nonnull cookie,
  */
 typedef void (^rpc_abort_handler_t)(void);
 
+/**
+ * What to do with an event when a connection's event queue is full.
+ */
+typedef enum rpc_emit_policy
+{
+	RPC_EMIT_DROP_OLDEST,		/**< Discard the oldest queued event */
+	RPC_EMIT_DROP_NEWEST,		/**< Discard the event being emitted */
+	RPC_EMIT_BLOCK			/**< Wait until the queue drains */
+} rpc_emit_policy_t;
+
 /**
  * A macro to convert function pointer into @ref rpc_function_t block.
  */
@@ -150,6 +167,22 @@ typedef void (^rpc_abort_handler_t)(void);
                 }							\
 	}
 
+/**
+ * Same as @ref RPC_PROPERTY_RO, but getter results are cached for
+ * @p _ttl milliseconds. See @ref rpc_instance_set_property_cache.
+ */
+#define	RPC_PROPERTY_RO_CACHED(_name, _getter, _ttl)			\
+	{								\
+		.rim_type = RPC_MEMBER_PROPERTY,			\
+		.rim_name = (#_name),					\
+		.rim_property = {					\
+                        .rp_getter = RPC_PROPERTY_GETTER(_getter),	\
+			.rp_setter = NULL,				\
+			.rp_arg = NULL,					\
+			.rp_cache_ttl = (_ttl)				\
+                }							\
+	}
+
 /**
  * A convenience macro to declare write-only property in the vtable array.
  */
@@ -186,7 +219,7 @@ typedef void (^rpc_abort_handler_t)(void);
 		.rim_type = RPC_MEMBER_METHOD,				\
 		.rim_name = (#_name),					\
 		.rim_method = {						\
-                        .rm_block = RPC_FUNCTION(_fn),			\
+                        .rm_func = (_fn),				\
 			.rm_arg = NULL					\
                 }							\
 	}
@@ -204,6 +237,51 @@ typedef void (^rpc_abort_handler_t)(void);
                 }							\
 	}
 
+/**
+ * Same as @ref RPC_METHOD, but the method runs directly on the thread
+ * that received the call. See @ref RPC_METHOD_FLAG_INLINE.
+ */
+#define	RPC_METHOD_INLINE(_name, _fn)					\
+	{								\
+		.rim_type = RPC_MEMBER_METHOD,				\
+		.rim_name = (#_name),					\
+		.rim_method = {						\
+                        .rm_func = (_fn),				\
+			.rm_arg = NULL,					\
+			.rm_flags = RPC_METHOD_FLAG_INLINE		\
+                }							\
+	}
+
+/**
+ * Same as @ref RPC_METHOD, but the method runs on a fiber.
+ * See @ref RPC_METHOD_FLAG_FIBER.
+ */
+#define	RPC_METHOD_FIBER(_name, _fn)					\
+	{								\
+		.rim_type = RPC_MEMBER_METHOD,				\
+		.rim_name = (#_name),					\
+		.rim_method = {						\
+                        .rm_func = (_fn),				\
+			.rm_arg = NULL,					\
+			.rm_flags = RPC_METHOD_FLAG_FIBER		\
+                }							\
+	}
+
+/**
+ * Same as @ref RPC_METHOD, but results are cached for @p _ttl
+ * milliseconds. See @ref rpc_instance_set_method_cache.
+ */
+#define	RPC_METHOD_CACHED(_name, _fn, _ttl)				\
+	{								\
+		.rim_type = RPC_MEMBER_METHOD,				\
+		.rim_name = (#_name),					\
+		.rim_method = {						\
+                        .rm_func = (_fn),				\
+			.rm_arg = NULL,					\
+			.rm_cache_ttl = (_ttl)				\
+                }							\
+	}
+
 #define	RPC_MEMBER_END {}
 
 /**
@@ -226,13 +304,57 @@ enum rpc_property_rights
 };
 
 
+/**
+ * Enumerates possible method flags.
+ */
+enum rpc_method_flags
+{
+	/**
+	 * Run the method on the connection's receive thread instead of
+	 * handing it off to a dispatch worker. That saves a queue push
+	 * and a thread switch per call, but the method must be quick and
+	 * must never block: no other frame is read from the connection
+	 * until it returns.
+	 */
+	RPC_METHOD_FLAG_INLINE = (1 << 0),
+
+	/**
+	 * Run the method on a fiber instead of a dispatch worker. While
+	 * the method waits in rpc_function_yield() or for stream flow
+	 * control, the fiber is parked and its thread runs other calls,
+	 * so many streaming methods can share a few threads. Any other
+	 * blocking call still blocks the thread underneath. Where fibers
+	 * are not supported, the flag is ignored.
+	 */
+	RPC_METHOD_FLAG_FIBER = (1 << 1),
+};
+
+/**
+ * Validation policy of typed calls.
+ *
+ * Rates are the fraction of calls, between 0 and 1, that get checked
+ * against their IDL signature. Validation is only done at all when
+ * the typing hooks are installed on the context.
+ */
+struct rpc_validation_policy
+{
+	double	rvp_args_rate;		/**< Argument validation rate */
+	double	rvp_result_rate;	/**< Return value validation rate */
+	bool	rvp_skip_local;		/**< Trust peers running as our uid */
+};
+
 /**
  * Method descriptor.
  */
 struct rpc_if_method
 {
-	__unsafe_unretained _Nonnull rpc_function_t rm_block;
+	__unsafe_unretained _Nullable rpc_function_t rm_block;
 	void *_Nullable	rm_arg;
+	unsigned int rm_flags;
+	rpc_call_priority_t rm_priority;
+	unsigned int rm_cache_ttl;	/**< Result cache TTL in ms, 0: off */
+	void *_Nullable	rm_typing;	/**< Resolved IDL member, internal */
+	_Nullable rpc_function_f rm_func; /**< Takes precedence over rm_block */
 };
 
 /**
@@ -244,6 +366,9 @@ struct rpc_if_property
 	__unsafe_unretained _Nullable rpc_property_setter_t rp_setter;
 	void *_Nullable rp_arg;
 	bool rp_notify;
+	unsigned int rp_coalesce;	/**< Min ms between changes, 0: off */
+	unsigned int rp_cache_ttl;	/**< Getter cache TTL in ms, 0: off */
+	bool rp_delta;			/**< Changes go out as patches */
 };
 
 /**
@@ -310,6 +435,35 @@ int rpc_context_register_instance(_Nonnull rpc_context_t context,
 void rpc_context_unregister_instance(_Nonnull rpc_context_t context,
     const char *_Nonnull path);
 
+/**
+ * Registers @p count instances in @p context at once.
+ *
+ * Either all of them are registered or, if any path is already taken
+ * or appears twice in the batch, none are and the call fails with
+ * EEXIST. Publishing a batch costs a single RCU grace period, so this
+ * is the way to bring up thousands of instances without holding up
+ * calls in flight.
+ *
+ * @param context RPC context handle
+ * @param instances Array of RPC instance handles
+ * @param count Number of entries in @p instances
+ * @return 0 on success, -1 on error
+ */
+int rpc_context_register_instances(_Nonnull rpc_context_t context,
+    _Nonnull rpc_instance_t *_Nonnull instances, size_t count);
+
+/**
+ * Unregisters instances at @p count paths from @p context at once.
+ *
+ * Paths that aren't registered are skipped.
+ *
+ * @param context RPC context handle
+ * @param paths Array of instance paths
+ * @param count Number of entries in @p paths
+ */
+void rpc_context_unregister_instances(_Nonnull rpc_context_t context,
+    const char *_Nonnull *_Nonnull paths, size_t count);
+
 /**
  * Registers a given rpc_method structure as an RPC method in a given context.
  *
@@ -405,6 +559,260 @@ void rpc_context_emit_event(_Nonnull rpc_context_t context,
     const char *_Nullable path, const char *_Nullable interface,
     const char *_Nonnull name, _Nonnull rpc_object_t args);
 
+/**
+ * Configures event burst coalescing for the context.
+ *
+ * Once enabled, events emitted with rpc_context_emit_event() are
+ * collected for up to @p max_latency milliseconds, or until
+ * @p max_count of them are pending, and are then delivered to each
+ * watching connection as a single burst.
+ *
+ * @param context RPC context handle
+ * @param max_count Maximum events per burst, 0 or 1 to disable bursts
+ * @param max_latency Maximum delay of the first event in a burst, in ms
+ */
+void rpc_context_set_event_burst(_Nonnull rpc_context_t context,
+    size_t max_count, unsigned int max_latency);
+
+/**
+ * Bounds the per-connection queues of events waiting to be sent.
+ *
+ * Events are delivered by a pool of emitter threads, with every
+ * watching connection assigned to one of them. Each connection has
+ * its own queue, so a slow peer only delays its own events. Once
+ * @p limit events are queued for a connection, @p policy decides which
+ * event gives way.
+ *
+ * @param context RPC context handle
+ * @param limit Maximum queued events per connection, 0 for no limit
+ * @param policy Policy applied when the queue is full
+ */
+void rpc_context_set_emit_queue_limit(_Nonnull rpc_context_t context,
+    size_t limit, rpc_emit_policy_t policy);
+
+/**
+ * Publishes events through shared memory rings to local subscribers.
+ *
+ * Clients on the same host that ask for it with
+ * rpc_connection_attach_event_ring() get a memory file of @p size bytes
+ * of their own. The events they subscribed to are written there and they
+ * read them directly; the server only wakes them up through an eventfd.
+ * Clients can map their ring only read-only. Remote clients, and those
+ * that didn't ask, keep getting events over their connection.
+ *
+ * The ring never waits for its readers. A client falling behind by
+ * more than @p size bytes loses the events it missed. Available on
+ * Linux only.
+ *
+ * @param context RPC context handle
+ * @param size Size of the ring, in bytes
+ * @return 0 on success, -1 on failure
+ */
+int rpc_context_set_event_ring(_Nonnull rpc_context_t context, size_t size);
+
+/**
+ * Configures the threads that run inbound calls.
+ *
+ * Calls are executed by a fixed set of workers, each with its own
+ * queue. Calls from one connection go to the same worker; idle workers
+ * steal from busy ones. The workers are started when the first call is
+ * dispatched, so this has to be called before that.
+ *
+ * Every method that blocks, for example waiting on a nested call,
+ * occupies a worker while it does so. Size the pool accordingly.
+ *
+ * @param context RPC context handle
+ * @param nworkers Number of workers, 0 for one per CPU (at least 4)
+ * @param pin Bind each worker to a CPU where supported
+ * @return 0 on success, -1 if the workers are already running
+ */
+int rpc_context_set_dispatch_workers(_Nonnull rpc_context_t context,
+    size_t nworkers, bool pin);
+
+/**
+ * Makes a context dispatch its calls on the process-wide executor
+ * instead of workers of its own.
+ *
+ * Processes hosting many contexts would otherwise run a pool per
+ * context. The shared executor has one set of workers, and each context
+ * on it gets a share of them proportional to @p weight among the
+ * contexts that currently have calls to run; no context is ever left
+ * without a worker. Priority lanes are still served in order, but the
+ * settings of rpc_context_set_dispatch_workers() and
+ * rpc_context_set_priority_weights() don't apply.
+ *
+ * Like the dispatch workers, this has to be set before the first call
+ * is dispatched. Methods that block occupy a shared worker, which
+ * holds up other contexts too.
+ *
+ * @param context RPC context handle
+ * @param weight Relative share of the executor, 0 to use private workers
+ * @return 0 on success, -1 if the dispatcher is already running
+ */
+int rpc_context_set_shared_executor(_Nonnull rpc_context_t context,
+    unsigned int weight);
+
+/**
+ * Sets the number of workers of the process-wide executor.
+ *
+ * The executor is started on first use, so this has to be called
+ * before any context or connection uses it.
+ *
+ * @param nworkers Number of workers, 0 for one per CPU (at least 4)
+ * @return 0 on success, -1 if the executor is already running
+ */
+int rpc_executor_set_workers(size_t nworkers);
+
+/**
+ * Makes connections created from now on run their callbacks on the
+ * process-wide executor instead of a thread pool of their own.
+ *
+ * Each connection still runs up to one callback per CPU at a time.
+ *
+ * @param share true to use the shared executor
+ */
+void rpc_executor_set_share_callbacks(bool share);
+
+/**
+ * Configures the threads that run fibers for methods flagged with
+ * @ref RPC_METHOD_FLAG_FIBER.
+ *
+ * Like the dispatch workers, they are started with the first such
+ * call, so this has to be called before that.
+ *
+ * @param context RPC context handle
+ * @param nthreads Number of threads, 0 for one per CPU
+ * @return 0 on success, -1 if the threads are already running
+ */
+int rpc_context_set_fiber_threads(_Nonnull rpc_context_t context,
+    size_t nthreads);
+
+/**
+ * Sets the default limit of concurrently running calls per connection.
+ *
+ * @param context RPC context handle
+ * @param max_inflight Maximum concurrent calls per connection,
+ *        0 for no limit
+ * @see rpc_connection_set_dispatch_limit()
+ */
+void rpc_context_set_dispatch_limit(_Nonnull rpc_context_t context,
+    unsigned int max_inflight);
+
+/**
+ * Admission controller statistics.
+ */
+struct rpc_admission_stats
+{
+	unsigned int	rads_limit;	/**< Current concurrency limit */
+	unsigned int	rads_inflight;	/**< Admitted calls not finished yet */
+	unsigned int	rads_queued;	/**< Admitted calls waiting for a worker */
+	uint64_t	rads_admitted;	/**< Calls admitted so far */
+	uint64_t	rads_rejected;	/**< Calls shed so far */
+	uint64_t	rads_latency;	/**< Smoothed call latency in usecs */
+};
+
+/**
+ * Enables admission control of incoming calls.
+ *
+ * At most @p limit calls are queued or running on the context's
+ * workers at a time. Calls past the limit are not queued, they fail
+ * right away with EAGAIN, so an overloaded server answers quickly
+ * instead of letting every caller time out.
+ *
+ * With @p adaptive set, @p limit is only an upper bound. The actual
+ * limit starts there and follows AIMD: it grows by one while at least
+ * half of it is in use and latency looks normal. It shrinks by 10%
+ * once a call takes over twice the smoothed latency, at most once per
+ * round of calls.
+ *
+ * Calls that reply asynchronously count until their method returns,
+ * not until they respond.
+ *
+ * @param context RPC context handle
+ * @param limit Maximum concurrent calls, 0 to disable admission control
+ * @param adaptive Adjust the limit to observed latency
+ */
+void rpc_context_set_admission_limit(_Nonnull rpc_context_t context,
+    unsigned int limit, bool adaptive);
+
+/**
+ * Reads admission controller statistics.
+ *
+ * @param context RPC context handle
+ * @param stats Structure to fill in
+ */
+void rpc_context_get_admission_stats(_Nonnull rpc_context_t context,
+    struct rpc_admission_stats *_Nonnull stats);
+
+/**
+ * Returns per-method call statistics of @p context.
+ *
+ * Each element of the returned array describes a single method and
+ * carries call and error counts, plus queueing and execution latency
+ * summaries in microseconds. The same data is served by the
+ * get_methods method of the RPC_STATS_INTERFACE on the root instance.
+ *
+ * @param context RPC context handle
+ * @return Array of dictionaries
+ */
+_Nonnull rpc_object_t rpc_context_get_stats(_Nonnull rpc_context_t context);
+
+/**
+ * Clears per-method call statistics of @p context.
+ *
+ * @param context RPC context handle
+ */
+void rpc_context_reset_stats(_Nonnull rpc_context_t context);
+
+/**
+ * Sets the default fragment batching of streaming calls.
+ *
+ * @param context RPC context handle
+ * @param max_items Maximum objects per frame
+ * @param max_bytes Approximate maximum frame payload, 0 for no limit
+ * @see rpc_function_set_fragment_batch()
+ */
+void rpc_context_set_fragment_batch(_Nonnull rpc_context_t context,
+    size_t max_items, size_t max_bytes);
+
+/**
+ * Switches the dispatcher from strict to weighted priority scheduling.
+ *
+ * By default, a call only runs when no call of higher priority is
+ * waiting. With weights set, each priority with pending calls gets
+ * its weight's worth of calls per round instead, so lower priorities
+ * can't starve. Passing all zeroes restores strict scheduling.
+ *
+ * Like rpc_context_set_dispatch_workers(), this must be called before
+ * the first call is dispatched.
+ *
+ * @param context RPC context handle
+ * @param high Weight of @ref RPC_PRIORITY_HIGH calls
+ * @param normal Weight of @ref RPC_PRIORITY_NORMAL calls
+ * @param low Weight of @ref RPC_PRIORITY_LOW calls
+ * @return 0 on success, -1 if the workers are already running
+ */
+int rpc_context_set_priority_weights(_Nonnull rpc_context_t context,
+    unsigned int high, unsigned int normal, unsigned int low);
+
+/**
+ * Sets the validation policy of typed calls.
+ *
+ * A policy applies to a single method, to every method of an interface
+ * when @p method is NULL, or to everything without a more specific
+ * policy when @p interface is NULL as well. Without any policy, every
+ * call is validated.
+ *
+ * @param context RPC context handle
+ * @param interface Interface name or NULL
+ * @param method Method name or NULL
+ * @param policy Policy to apply, or NULL to remove it
+ * @return 0 on success, -1 on error
+ */
+int rpc_context_set_validation_policy(_Nonnull rpc_context_t context,
+    const char *_Nullable interface, const char *_Nullable method,
+    const struct rpc_validation_policy *_Nullable policy);
+
 /**
  * Returns the argument associated with method.
  *
@@ -437,6 +845,31 @@ _Nullable rpc_connection_t rpc_function_get_connection(void *_Nonnull cookie);
  */
 _Nonnull rpc_instance_t rpc_function_get_instance(void *_Nonnull cookie);
 
+/**
+ * Returns the trace context of the call, in W3C traceparent form.
+ *
+ * The context names the span of this call, with the trace ID taken
+ * from the caller. Calls the function makes on the same thread carry
+ * it along on their own.
+ *
+ * @param cookie Running call handle
+ * @return traceparent string or NULL if the caller sent no context
+ */
+const char *_Nullable rpc_function_get_trace_context(void *_Nonnull cookie);
+
+/**
+ * Returns the point in time after which the caller stops waiting.
+ *
+ * Clients send their call timeout along with each call; the server
+ * turns it into a deadline on arrival and drops calls that reach a
+ * worker too late. Long-running methods may compare the deadline
+ * with g_get_monotonic_time() to give up early.
+ *
+ * @param cookie Running call handle
+ * @return Deadline in monotonic microseconds, 0 if the caller sent none
+ */
+int64_t rpc_function_get_deadline(void *_Nonnull cookie);
+
 /**
  * Returns the called method name.
  *
@@ -507,12 +940,81 @@ int rpc_function_start_stream(void *_Nonnull cookie);
 /**
  * Generates a new value in a streaming response.
  *
+ * Once the peer aborts the call or disconnects, this returns -1 with
+ * last error set to ECONNRESET right away, also when it's blocked
+ * waiting for credits, and fragments not sent yet are dropped.
+ * Producers should stop as soon as they see that.
+ *
  * @param cookie Running call handle
  * @param fragment Next data fragment
  * @return Status. Success is reported by returning 0
  */
 int rpc_function_yield(void *_Nonnull cookie, _Nonnull rpc_object_t fragment);
 
+/**
+ * Returns the next argument fragment uploaded by the caller.
+ *
+ * Calls made with rpc_connection_call_upload() are followed by a
+ * stream of fragments the client sends with rpc_call_yield_arg().
+ * This waits for the next one, and lets the client send more as
+ * they're consumed, so only a small window of them is ever buffered.
+ *
+ * Returns NULL once the client called rpc_call_end_input(), right
+ * away for calls made without upload, and with last error set to
+ * ECONNRESET if the call got aborted.
+ *
+ * @param cookie Running call handle
+ * @return Fragment, to be released by the caller, or NULL
+ */
+_Nullable rpc_object_t rpc_function_next_input(void *_Nonnull cookie);
+
+/**
+ * Generates a new value in a streaming response, without waiting.
+ *
+ * Like rpc_function_yield(), but if the consumer has no credits left
+ * or the connection is saturated (see
+ * rpc_connection_set_send_watermarks()) it returns -1 with last error
+ * set to EAGAIN right away. The fragment is then left with the caller,
+ * and the handler set with rpc_function_set_writable_handler() runs
+ * once yielding can go on.
+ *
+ * @param cookie Running call handle
+ * @param fragment Next data fragment
+ * @return Status. Success is reported by returning 0
+ */
+int rpc_function_yield_try(void *_Nonnull cookie,
+    _Nonnull rpc_object_t fragment);
+
+/**
+ * Sets a handler called when a stream becomes writable again.
+ *
+ * The handler runs once after each rpc_function_yield_try() that
+ * failed with EAGAIN, as soon as the consumer grants credits or the
+ * connection drains, whichever was missing. It must not block.
+ *
+ * @param cookie Running call handle
+ * @param handler Handler block, NULL to remove it
+ */
+void rpc_function_set_writable_handler(void *_Nonnull cookie,
+    _Nullable rpc_writable_handler_t handler);
+
+/**
+ * Streams the elements of an array matching a query request.
+ *
+ * Starts a streaming response unless one is already in progress and
+ * yields only the elements matching @p request, created on the client
+ * side with rpc_query_request_create(), evaluating the query
+ * incrementally as the consumer grants credits. The stream is
+ * left open, so the method can yield more data or end it afterwards.
+ *
+ * @param cookie Running call handle
+ * @param object Array to be queried
+ * @param request Query request, NULL to stream every element
+ * @return Status. Success is reported by returning 0
+ */
+int rpc_function_yield_query(void *_Nonnull cookie,
+    _Nonnull rpc_object_t object, _Nullable rpc_object_t request);
+
 /**
  * Ends a streaming response.
  *
@@ -553,6 +1055,25 @@ bool rpc_function_should_abort(void *_Nonnull cookie);
 void rpc_function_set_async_abort_handler(void *_Nonnull cookie,
     _Nullable rpc_abort_handler_t handler);
 
+/**
+ * Packs yielded fragments of a streaming call into batches.
+ *
+ * Up to @p max_items objects passed to rpc_function_yield(), or
+ * roughly @p max_bytes worth of them, travel in one fragment frame
+ * and are unpacked again on the consumer side, so callers see no
+ * difference. A batch is also sent once the consumer's credits are
+ * used up, when the stream ends, and when its oldest item has waited
+ * for a few milliseconds at the time of the next yield. Peers that
+ * don't announce support for batches get one fragment per frame.
+ *
+ * @param cookie Running call handle
+ * @param max_items Maximum objects per frame, 0 or 1 for no limit on
+ *        count (batching by size only, if @p max_bytes is set)
+ * @param max_bytes Approximate maximum frame payload, 0 for no limit
+ */
+void rpc_function_set_fragment_batch(void *_Nonnull cookie,
+    size_t max_items, size_t max_bytes);
+
 /**
  * Increments the refcount on a call.
  *
@@ -660,6 +1181,55 @@ int rpc_instance_register_interface(_Nonnull rpc_instance_t instance,
     const char *_Nonnull interface,
     const struct rpc_if_member *_Nullable vtable, void *_Nullable arg);
 
+/**
+ * Sets the scheduling priority of methods in @p interface.
+ *
+ * Applies to methods that don't have a priority of their own.
+ *
+ * @param instance Instance handle
+ * @param interface Interface name
+ * @param priority Priority of the interface's methods
+ * @return 0 on success, -1 if the interface was not found
+ */
+int rpc_instance_set_interface_priority(_Nonnull rpc_instance_t instance,
+    const char *_Nonnull interface, rpc_call_priority_t priority);
+
+/**
+ * Enables or disables caching of results of method @p name.
+ *
+ * Meant for idempotent methods whose result depends only on their
+ * arguments and the instance's state. A successful result is kept
+ * for @p ttl_ms milliseconds, keyed on the instance path, interface,
+ * method name and arguments, and repeated calls are answered from
+ * the cache without running the method or the post-call hook. Where
+ * the transport allows, the response goes out from the serialized
+ * bytes kept with the entry.
+ *
+ * Errors and results carrying file descriptors are never cached.
+ * Cached results of an instance are dropped whenever one of its
+ * properties changes (see @ref rpc_instance_property_changed), its
+ * members change, or @ref rpc_instance_invalidate_cache is called.
+ *
+ * @param instance Instance handle
+ * @param interface Interface name
+ * @param name Method name
+ * @param ttl_ms Time to keep results for, 0 disables the cache
+ * @return 0 on success, -1 if the method was not found
+ */
+int rpc_instance_set_method_cache(_Nonnull rpc_instance_t instance,
+    const char *_Nonnull interface, const char *_Nonnull name,
+    unsigned int ttl_ms);
+
+/**
+ * Drops all cached method results of @p instance.
+ *
+ * Call it after changing state that cached methods depend on, when
+ * that change isn't reported with @ref rpc_instance_property_changed.
+ *
+ * @param instance Instance handle
+ */
+void rpc_instance_invalidate_cache(_Nonnull rpc_instance_t instance);
+
 /**
  * Unregisters interface @p interface from @p instance along with all
  * interface members.
@@ -713,6 +1283,9 @@ int rpc_instance_register_block(_Nonnull rpc_instance_t instance,
  * Same as @ref rpc_instance_register_block, but takes a function pointer
  * instead.
  *
+ * The function is stored and called directly, without being wrapped
+ * in a heap-allocated block.
+ *
  * @param instance Instance handle
  * @param interface Interface name
  * @param name Method name
@@ -808,6 +1381,14 @@ int rpc_instance_register_event(_Nonnull rpc_instance_t instance,
  * If @p value is @p NULL, then librpc will internally query the getter
  * for the value.
  *
+ * Cached method results of @p instance are dropped as well.
+ *
+ * If the property has a coalescing interval (see
+ * @ref rpc_instance_set_property_coalesce), changes closer together
+ * than that are conflated: the first one goes out right away, and
+ * of the rest only the latest value is sent once the interval has
+ * passed.
+ *
  * @param instance Instance handle
  * @param interface Interface name
  * @param name Property name
@@ -817,6 +1398,76 @@ void rpc_instance_property_changed(_Nonnull rpc_instance_t instance,
     const char *_Nonnull interface, const char *_Nonnull name,
     _Nullable rpc_object_t value);
 
+/**
+ * Sets the minimum interval between change notifications of a property.
+ *
+ * The interval can also come from the "coalesce" field of the property
+ * in its IDL interface declaration, in milliseconds; it's picked up
+ * when the property is registered. Setting it here takes precedence.
+ *
+ * @param instance Instance handle
+ * @param interface Interface name
+ * @param name Property name
+ * @param interval_ms Interval in milliseconds, 0 disables coalescing
+ * @return 0 on success, -1 if the property was not found
+ */
+int rpc_instance_set_property_coalesce(_Nonnull rpc_instance_t instance,
+    const char *_Nonnull interface, const char *_Nonnull name,
+    unsigned int interval_ms);
+
+/**
+ * Lets the getter results of a property be cached.
+ *
+ * Reads through the Observable interface (get, get_all and the value
+ * of changed events reported without one) are answered from the
+ * cache for @p ttl_ms milliseconds after the getter last ran, or
+ * until the property changes if @p ttl_ms is
+ * @ref RPC_PROPERTY_CACHE_UNTIL_CHANGED. Reporting a change with
+ * @ref rpc_instance_property_changed replaces the cached value with
+ * the one passed, or drops it if none was. Getter errors are never
+ * cached.
+ *
+ * To have get_all answered from a serialized snapshot as well, enable
+ * the result cache of the Observable get_all method with
+ * @ref rpc_instance_set_method_cache; property changes drop it.
+ *
+ * @param instance Instance handle
+ * @param interface Interface name
+ * @param name Property name
+ * @param ttl_ms Time to keep values for, 0 disables the cache
+ * @return 0 on success, -1 if the property was not found
+ */
+int rpc_instance_set_property_cache(_Nonnull rpc_instance_t instance,
+    const char *_Nonnull interface, const char *_Nonnull name,
+    unsigned int ttl_ms);
+
+/**
+ * Makes changes of a dictionary property go out as patches.
+ *
+ * Each Observable.changed event then carries, instead of "value", a
+ * "patch" array holding the differences from the value sent last:
+ * {"path", "value"} entries for members that were added or changed
+ * and {"path"} entries for members that went away, paths being dot
+ * separated as understood by @ref rpc_query_set. The full value is
+ * still sent the first time, and whenever the value isn't a
+ * dictionary, a key can't be written as a path or the patch would
+ * hardly be smaller. A change that leaves the value equal to the one
+ * sent last isn't reported at all.
+ *
+ * Clients keeping properties with
+ * @ref rpc_connection_cache_properties apply patches to their copy.
+ * Other subscribers, including @ref rpc_connection_watch_property
+ * handlers, only get to see full values.
+ *
+ * @param instance Instance handle
+ * @param interface Interface name
+ * @param name Property name
+ * @param enable Whether to send patches
+ * @return 0 on success, -1 if the property was not found
+ */
+int rpc_instance_set_property_delta(_Nonnull rpc_instance_t instance,
+    const char *_Nonnull interface, const char *_Nonnull name, bool enable);
+
 /**
  * Returns instance associated with the getter or setter call.
  *
@@ -0,0 +1,212 @@
+/*
+ * Copyright 2015-2017 Two Pore Guys, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef LIBRPC_THREAD_H
+#define LIBRPC_THREAD_H
+
+#include <rpc/object.h>
+
+/**
+ * @file thread.h
+ *
+ * Attributes of threads started by the library.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Enumerates the roles of threads started by the library.
+ */
+typedef enum rpc_thread_role
+{
+	RPC_THREAD_WORKER,	/**< Dispatch workers, fibers, context pool */
+	RPC_THREAD_EMITTER,	/**< Event emitters */
+	RPC_THREAD_IO,		/**< Transport readers and I/O threads */
+	RPC_THREAD_CLIENT,	/**< Client main loops */
+	RPC_THREAD_SERVER,	/**< Server main loops and listeners */
+	RPC_THREAD_CALLBACK,	/**< Per-connection callback pools */
+	RPC_THREAD_BUS,		/**< Bus main loop */
+	RPC_THREAD_TIMER,	/**< Timer wheels and background upkeep */
+	RPC_THREAD_NROLES
+} rpc_thread_role_t;
+
+/**
+ * Enumerates the places where library threads may spin before blocking.
+ */
+typedef enum rpc_spin_site
+{
+	RPC_SPIN_READER,	/**< Transport I/O threads waiting for input */
+	RPC_SPIN_DISPATCH,	/**< Dispatch workers waiting for calls */
+	RPC_SPIN_CALL_WAIT,	/**< rpc_call_wait() waiting for a result */
+	RPC_SPIN_NSITES
+} rpc_spin_site_t;
+
+/**
+ * Enumerates the library locks whose contention can be measured.
+ */
+typedef enum rpc_lock_site
+{
+	RPC_LOCK_CONTEXT,		/**< Context instance tree lock */
+	RPC_LOCK_SERVER,		/**< Server state lock */
+	RPC_LOCK_SERVER_CONNECTIONS,	/**< Server connection list lock */
+	RPC_LOCK_WORKQ,			/**< Dispatch work queue lock */
+	RPC_LOCK_NSITES
+} rpc_lock_site_t;
+
+/**
+ * Contention figures of one lock site, summed over every lock of it.
+ */
+struct rpc_lock_stats
+{
+	uint64_t		rls_acquisitions;	/**< Times taken */
+	uint64_t		rls_contended;	/**< Times found held */
+	uint64_t		rls_wait_time;	/**< Time blocked, in usec */
+};
+
+/**
+ * Thread attribute (array of int64) with the CPUs a thread may run on.
+ * Linux only.
+ */
+#define	RPC_THREAD_CPUS		"cpus"
+
+/**
+ * Thread attribute (string) with the scheduling policy: "other",
+ * "fifo", "rr", "batch" or "idle". Defaults to leaving it alone.
+ */
+#define	RPC_THREAD_POLICY	"policy"
+
+/**
+ * Thread attribute (int64) with the static priority that goes with
+ * RPC_THREAD_POLICY. Defaults to 0.
+ */
+#define	RPC_THREAD_PRIORITY	"priority"
+
+/**
+ * Thread attribute (string) with the name to give the thread instead
+ * of the library's own. Truncated to what the system allows.
+ */
+#define	RPC_THREAD_NAME		"name"
+
+/**
+ * Definition of the thread start hook block type.
+ *
+ * @param role Role of the starting thread
+ * @param name Name the thread got
+ */
+typedef void (^rpc_thread_hook_t)(rpc_thread_role_t role,
+    const char *_Nonnull name);
+
+/**
+ * Converts function pointer to a @ref rpc_thread_hook_t block type.
+ */
+#define	RPC_THREAD_HOOK(_fn, _arg)					\
+	^(rpc_thread_role_t _role, const char *_name) {			\
+		_fn(_arg, _role, _name);				\
+	}
+
+/**
+ * Sets the attributes of threads of a given role.
+ *
+ * Attributes are applied by each thread to itself when it starts, so
+ * this affects threads started afterwards only. Failures to apply them,
+ * for example lacking the privileges for a realtime policy, are
+ * ignored.
+ *
+ * @param role Thread role
+ * @param attrs Dictionary of RPC_THREAD_* attributes or NULL to reset;
+ *        not consumed
+ * @return 0 on success, -1 if the attributes are invalid
+ */
+int rpc_thread_set_attributes(rpc_thread_role_t role,
+    _Nullable rpc_object_t attrs);
+
+/**
+ * Sets a block run by every library thread when it starts, after its
+ * attributes were applied and before it does anything else.
+ *
+ * @param hook Hook block or NULL to remove it
+ */
+void rpc_thread_set_hook(_Nullable rpc_thread_hook_t hook);
+
+/**
+ * Makes threads waiting at a given site spin for a while before they
+ * block.
+ *
+ * Every wakeup of a blocked thread costs a futex or eventfd round trip.
+ * On latency-critical local links, busy-waiting for up to @p usec
+ * microseconds first lets the thread pick up the next message without
+ * one. Spinning is off by default at every site.
+ *
+ * A few safeguards keep the CPU cost bounded. All threads spinning at
+ * a site together get at most @p budget percent of one CPU, measured
+ * over 100ms windows; past that they block right away until the next
+ * window. A site where spinning keeps failing to catch a wakeup only
+ * tries again now and then, until it succeeds. And spinning never
+ * takes the last free CPU, so it is never enabled on a single CPU.
+ *
+ * @param site Spin site
+ * @param usec Longest spin per wait in microseconds, or 0 to disable
+ * @param budget CPU share in percent of one CPU, or 0 for 10
+ * @return 0 on success, -1 if the site is invalid
+ */
+int rpc_thread_set_spin(rpc_spin_site_t site, unsigned int usec,
+    unsigned int budget);
+
+/**
+ * Turns lock contention accounting on or off.
+ *
+ * Accounting is off by default, in which case taking a lock costs
+ * nothing more than usual. When on, every lock taken at one of the
+ * @ref rpc_lock_site_t sites is counted, and the time spent blocked
+ * on a lock found held is measured.
+ *
+ * @param enable Whether to account lock contention
+ */
+void rpc_lock_stats_enable(bool enable);
+
+/**
+ * Returns the contention figures gathered for a lock site.
+ *
+ * @param site Lock site
+ * @param stats Receives the figures
+ * @return 0 on success, -1 if the site is invalid
+ */
+int rpc_get_lock_stats(rpc_lock_site_t site,
+    struct rpc_lock_stats *_Nonnull stats);
+
+/**
+ * Resets the contention figures of every lock site.
+ */
+void rpc_reset_lock_stats(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIBRPC_THREAD_H */
@@ -0,0 +1,252 @@
+/*
+ * Copyright 2015-2017 Two Pore Guys, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef LIBRPC_TRACE_H
+#define LIBRPC_TRACE_H
+
+#include <stdint.h>
+#include <rpc/object.h>
+
+/**
+ * @file trace.h
+ *
+ * Binary frame tracing and distributed trace context propagation.
+ *
+ * Each thread records fixed-size entries into a ring of its own, so
+ * tracing takes no locks and formats nothing while it runs. Rings are
+ * merged only when they are dumped.
+ *
+ * Trace contexts follow the W3C Trace Context "traceparent" format.
+ * A context set on a thread is sent along with calls made from it, and
+ * method handlers run within the context of the call they serve, so
+ * nested calls join the caller's trace.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Magic number opening a trace dump.
+ */
+#define	RPC_TRACE_MAGIC		0x52504354u
+
+/**
+ * Version of the trace dump layout.
+ */
+#define	RPC_TRACE_VERSION	1
+
+/**
+ * Size of a buffer holding a traceparent string, including the
+ * terminating NUL.
+ */
+#define	RPC_TRACEPARENT_SIZE	56
+
+/**
+ * Enumerates points of the frame path where entries are recorded.
+ */
+typedef enum rpc_trace_stage
+{
+	RPC_TRACE_STAGE_SEND,		/**< Frame submitted for sending */
+	RPC_TRACE_STAGE_WRITE,		/**< Bytes handed to the transport */
+	RPC_TRACE_STAGE_READ,		/**< Bytes received from the transport */
+	RPC_TRACE_STAGE_DISPATCH,	/**< Frame decoded and dispatched */
+	RPC_TRACE_STAGE_COUNT
+} rpc_trace_stage_t;
+
+/**
+ * Enumerates frame types.
+ */
+typedef enum rpc_trace_frame
+{
+	RPC_TRACE_FRAME_UNKNOWN,
+	RPC_TRACE_FRAME_CALL,
+	RPC_TRACE_FRAME_CALL_BATCH,
+	RPC_TRACE_FRAME_RESPONSE,
+	RPC_TRACE_FRAME_START_STREAM,
+	RPC_TRACE_FRAME_FRAGMENT,
+	RPC_TRACE_FRAME_CONTINUE,
+	RPC_TRACE_FRAME_END,
+	RPC_TRACE_FRAME_ABORT,
+	RPC_TRACE_FRAME_ERROR,
+	RPC_TRACE_FRAME_EVENT,
+	RPC_TRACE_FRAME_EVENT_BURST,
+	RPC_TRACE_FRAME_SUBSCRIBE,
+	RPC_TRACE_FRAME_UNSUBSCRIBE,
+	RPC_TRACE_FRAME_COUNT
+} rpc_trace_frame_t;
+
+/**
+ * Trace dump header. All fields are in host byte order.
+ */
+struct rpc_trace_header
+{
+	uint32_t	rth_magic;	/**< RPC_TRACE_MAGIC */
+	uint16_t	rth_version;	/**< RPC_TRACE_VERSION */
+	uint16_t	rth_record_size; /**< Size of a single record */
+	uint64_t	rth_count;	/**< Number of records that follow */
+};
+
+/**
+ * A single trace entry.
+ */
+struct rpc_trace_record
+{
+	uint64_t	rtr_time;	/**< CLOCK_MONOTONIC time in nsecs */
+	uint64_t	rtr_conn;	/**< Connection address */
+	uint64_t	rtr_call_id;	/**< Call ID, hashed if not numeric */
+	uint32_t	rtr_size;	/**< Size in bytes, 0 if not known */
+	uint16_t	rtr_thread;	/**< Index of the recording thread */
+	uint8_t		rtr_stage;	/**< One of rpc_trace_stage_t */
+	uint8_t		rtr_frame;	/**< One of rpc_trace_frame_t */
+};
+
+/**
+ * Span of an inbound call served within a trace context.
+ *
+ * Times are in microseconds.
+ */
+struct rpc_span
+{
+	const char *_Nonnull	rsp_trace_id;	/**< 32 hex digits */
+	const char *_Nonnull	rsp_span_id;	/**< 16 hex digits */
+	const char *_Nonnull	rsp_parent_id;	/**< Caller's span ID */
+	const char *_Nullable	rsp_path;	/**< Instance path */
+	const char *_Nullable	rsp_interface;	/**< Interface name */
+	const char *_Nonnull	rsp_method;	/**< Method name */
+	int64_t			rsp_start;	/**< Wall clock time of dispatch */
+	uint64_t		rsp_queue_time;	/**< Dispatch to method start */
+	uint64_t		rsp_exec_time;	/**< Method start to completion */
+	uint64_t		rsp_send_time;	/**< Encoding and sending results */
+	bool			rsp_error;	/**< Call failed */
+};
+
+/**
+ * Definition of the span handler block type.
+ *
+ * @param span Finished span, valid only until the handler returns
+ */
+typedef void (^rpc_span_handler_t)(const struct rpc_span *_Nonnull span);
+
+/**
+ * Converts function pointer to a @ref rpc_span_handler_t block type.
+ */
+#define	RPC_SPAN_HANDLER(_fn, _arg)					\
+	^(const struct rpc_span *_span) {				\
+		_fn(_arg, _span);					\
+	}
+
+/**
+ * Starts recording trace entries.
+ *
+ * Rings of threads that record their first entry afterwards hold
+ * @p nrecords entries, rounded up to a power of two. Rings that exist
+ * already keep their size.
+ *
+ * @param nrecords Entries per thread
+ * @return 0 on success, -1 if @p nrecords is 0
+ */
+int rpc_trace_enable(size_t nrecords);
+
+/**
+ * Stops recording trace entries. Entries recorded so far are kept and
+ * can still be dumped.
+ */
+void rpc_trace_disable(void);
+
+/**
+ * Returns the entries kept in all rings as a binary object.
+ *
+ * The data starts with a struct rpc_trace_header, followed by
+ * records ordered by time. The same dump is returned by the get_trace
+ * method of the RPC_STATS_INTERFACE on the root instance.
+ *
+ * @return Binary object
+ */
+_Nonnull rpc_object_t rpc_trace_dump(void);
+
+/**
+ * Returns a name of a trace stage.
+ *
+ * @param stage Trace stage
+ * @return Stage name
+ */
+const char *_Nonnull rpc_trace_stage_name(rpc_trace_stage_t stage);
+
+/**
+ * Returns a name of a frame type.
+ *
+ * @param frame Frame type
+ * @return Frame type name in "namespace.name" form
+ */
+const char *_Nonnull rpc_trace_frame_name(rpc_trace_frame_t frame);
+
+/**
+ * Sets the trace context of the calling thread.
+ *
+ * Calls made by the thread afterwards carry the context as their
+ * parent.
+ *
+ * @param traceparent W3C traceparent string or NULL to clear
+ * @return 0 on success, -1 if @p traceparent is malformed
+ */
+int rpc_trace_context_set(const char *_Nullable traceparent);
+
+/**
+ * Starts a new trace on the calling thread, with random trace and
+ * span IDs.
+ *
+ * @param sampled Whether spans of the trace should be exported
+ */
+void rpc_trace_context_start(bool sampled);
+
+/**
+ * Returns the trace context of the calling thread.
+ *
+ * Within a method handler this is the context of the call being
+ * served.
+ *
+ * @return traceparent string valid until the context of the thread
+ *         changes, or NULL if there is none
+ */
+const char *_Nullable rpc_trace_context_get(void);
+
+/**
+ * Sets a block called as spans of sampled inbound calls finish.
+ *
+ * The handler runs on the thread that completed the call, so it
+ * should hand the span off rather than block.
+ *
+ * @param handler Span handler or NULL to remove it
+ */
+void rpc_trace_set_span_handler(_Nullable rpc_span_handler_t handler);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIBRPC_TRACE_H */
@@ -40,6 +40,19 @@ extern "C" {
 #define	RPCT_TYPING_INTERFACE	"com.twoporeguys.librpc.Typing"
 #define	RPCT_TYPE_FIELD		"%type"
 #define	RPCT_VALUE_FIELD	"%value"
+#define	RPCT_COMPACT_FIELD	"%c"
+#define	RPCT_TYPE_ID_FIELD	"%tid"
+
+/**
+ * Suffix of binary IDL blobs produced by @ref rpct_compile_file.
+ */
+#define	RPCT_COMPILED_SUFFIX	".idlc"
+
+/**
+ * Environment variable overriding where @ref rpct_download_idl keeps
+ * downloaded IDL. Set it empty to disable the cache.
+ */
+#define	RPCT_IDL_CACHE_ENV	"LIBRPC_IDL_CACHE"
 
 struct rpct_type;
 struct rpct_typei;
@@ -173,6 +186,36 @@ int rpct_init(bool load_system_types);
  */
 void rpct_free(void);
 
+/**
+ * Enables or disables lazy loading of IDL types.
+ *
+ * In lazy mode, @ref rpct_load_types_dir only reads the files and
+ * indexes the names of the types and interfaces they declare. Each
+ * type or interface is then parsed the first time it's looked up, and
+ * enumerating them with @ref rpct_types_apply or
+ * @ref rpct_interface_apply loads everything that's left. This cuts
+ * startup time and memory for short-lived tools that touch only a
+ * few types. May be called before @ref rpct_init, so that system
+ * types are loaded lazily too.
+ *
+ * @param lazy true to enable lazy loading
+ */
+void rpct_set_lazy_loading(bool lazy);
+
+/**
+ * Sets how many errors validation reports.
+ *
+ * With the default limit of 0, validation of an array or dictionary
+ * stops at its first invalid element. A non-zero limit requests a full
+ * report instead: every element is validated, up to @p limit errors are
+ * kept, and validation stops once that many have been collected. Large
+ * containers are validated in parallel on the library's worker pool
+ * either way.
+ *
+ * @param limit Maximum number of errors, or 0 to stop at the first one
+ */
+void rpct_set_error_limit(size_t limit);
+
 /**
  * Reads IDL file without parsing it. @ref rpct_load_types must be called
  * on the same path again to load the associated types.
@@ -182,6 +225,20 @@ void rpct_free(void);
  */
 int rpct_read_file(const char *path);
 
+/**
+ * Compiles an IDL file into a binary blob.
+ *
+ * The blob holds the same definitions as the YAML source, encoded as
+ * msgpack. When @ref rpct_read_file finds a blob called
+ * @p path followed by @ref RPCT_COMPILED_SUFFIX that is not older than
+ * the source, it maps and decodes that blob and skips YAML parsing.
+ *
+ * @param path Path to the IDL file
+ * @param output Path of the blob, or NULL to put it next to the source
+ * @return 0 on success, -1 on error
+ */
+int rpct_compile_file(const char *_Nonnull path, const char *_Nullable output);
+
 /**
  * Reads IDL object without parsing it. @ref rpct_load_types must be called
  * on the same name again to load the associated types.
@@ -639,11 +696,34 @@ void rpct_set_value(rpc_object_t object, const char *value);
 /**
  * Serializes object hierarchy preserving type information.
  *
+ * Subtrees that carry no type information beyond builtin types are
+ * not copied; the result shares them with @p object. Callers must
+ * not modify the result in place.
+ *
  * @param object Object to serialize
  * @return Object with encoded type information
  */
 rpc_object_t rpct_serialize(rpc_object_t object);
 
+/**
+ * Serializes object hierarchy like rpct_serialize(), but encodes
+ * typed structs compactly.
+ *
+ * A struct becomes a single @ref RPCT_COMPACT_FIELD key holding an
+ * array: a 32-bit ID derived from the type name, followed by member
+ * values sorted by member name. rpct_deserialize() decodes it as long
+ * as the same type definition is loaded, so only use it with peers that
+ * share the IDL, for instance after @ref rpct_download_idl.
+ *
+ * Generic structs, structs with missing or extra members, and types
+ * whose ID collides with another known type name are encoded the usual
+ * way.
+ *
+ * @param object Object to serialize
+ * @return Object with encoded type information
+ */
+rpc_object_t rpct_serialize_compact(rpc_object_t object);
+
 /**
  * Deserializes object hierarchy previously serialized with rpct_serialize()
  *
@@ -708,13 +788,30 @@ rpc_object_t rpct_post_call_hook(void *cookie, rpc_object_t args);
 void rpct_allow_idl_download(rpc_context_t context);
 
 /**
- * XXX
+ * Loads the IDL a server exposes through @ref rpct_allow_idl_download.
+ *
+ * Servers publish a digest of their IDL. A digest this process has
+ * already loaded makes the call return right away. Otherwise the IDL
+ * is mapped from the on-disk cache, in the same msgpack form as
+ * @ref rpct_compile_file output, and only downloaded when the cache
+ * has no entry for that digest; the download then fills it. The cache
+ * lives under the user cache directory, or where @ref RPCT_IDL_CACHE_ENV
+ * points.
  *
  * @param conn Connection handle
  * @return 0 on success, -1 on error
  */
 int rpct_download_idl(rpc_connection_t conn);
 
+/**
+ * Returns a digest of all IDL files loaded in this process.
+ *
+ * The digest changes whenever a file gets added.
+ *
+ * @return Hex encoded digest, to be freed with g_free()
+ */
+char *_Nonnull rpct_get_idl_digest(void);
+
 #ifdef __cplusplus
 }
 #endif
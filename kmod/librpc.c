@@ -29,12 +29,21 @@
 #include <linux/module.h>
 #include <linux/init.h>
 #include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/list.h>
+#include <linux/netlink.h>
 #include <linux/fs.h>
 #include <linux/workqueue.h>
 #include <linux/connector.h>
 #include <linux/stat.h>
+#include <linux/miscdevice.h>
+#include <linux/poll.h>
+#include <linux/vmalloc.h>
+#include <linux/kref.h>
 #include "librpc.h"
 
+struct librpc_ring_ctx;
+
 static int librpc_bus_match(struct device *dev, struct device_driver *drv);
 static void librpc_cn_callback(struct cn_msg *, struct netlink_skb_parms *);
 static void librpc_dev_release(struct device *);
@@ -45,11 +54,63 @@ static ssize_t librpc_device_show_name(struct device *,
     struct device_attribute *, char *);
 static ssize_t librpc_device_show_descr(struct device *,
     struct device_attribute *, char *);
+static ssize_t librpc_device_show_dropped(struct device *,
+    struct device_attribute *, char *);
 static ssize_t librpc_device_show_serial(struct device *,
     struct device_attribute *, char *);
-static void librpc_cn_send_ack(uint32_t, uint32_t, uint32_t, int);
+static void librpc_cn_send_ack(uint32_t, uint32_t, uint32_t, int, bool);
+static void librpc_cn_defer_ack(uint32_t, uint32_t, uint32_t);
+static void librpc_cn_flush_acks(uint32_t);
+static void librpc_cn_flush_acks_locked(void);
+static void librpc_cn_ack_timeout(struct work_struct *);
+static void librpc_cn_send_message(int, uint32_t, int, uint32_t, const void *,
+    size_t);
+static int librpc_reassemble(struct librpc_message *, size_t, uint32_t,
+    void **, size_t *);
+static void librpc_reassembly_free_locked(struct librpc_reassembly *);
+static void librpc_reassembly_purge(bool, uint32_t, bool);
+static void librpc_reassembly_timeout(struct work_struct *);
+static int librpc_netlink_event(struct notifier_block *, unsigned long,
+    void *);
 static void librpc_cn_send_presence(int, uint32_t, struct librpc_endpoint *);
+static struct librpc_device *librpc_find_parent(struct device *);
+static void librpc_batch_add(struct librpc_device *, int, const void *,
+    size_t);
+static void librpc_batch_flush_locked(struct librpc_device *);
+static void librpc_batch_timeout(struct work_struct *);
 static void librpc_request(struct work_struct *);
+static void librpc_ring_copy_in(struct librpc_ring_header *, uint64_t,
+    const void *, size_t);
+static void librpc_ring_copy_out(struct librpc_ring_header *, uint64_t,
+    void *, size_t);
+static int librpc_ring_put(struct librpc_ring_ctx *, int, uint32_t, int,
+    const void *, size_t);
+static long librpc_ring_kick(struct librpc_ring_ctx *);
+static void librpc_ring_release(struct kref *);
+static int librpc_ring_open(struct inode *, struct file *);
+static int librpc_ring_close(struct inode *, struct file *);
+static int librpc_ring_mmap(struct file *, struct vm_area_struct *);
+static unsigned int librpc_ring_poll(struct file *, poll_table *);
+static long librpc_ring_ioctl(struct file *, unsigned int, unsigned long);
+
+/*
+ * Per-file state of the ring interface, see LIBRPC_RING_DEVICE. Calls
+ * made through the rings hold a reference, so that answers arriving after
+ * the file is closed have somewhere to go.
+ */
+struct librpc_ring_ctx
+{
+	struct kref			kref;
+	struct list_head		link;
+	struct librpc_device *		rpcdev;
+	void *				mem;
+	struct librpc_ring_header *	tx;
+	struct librpc_ring_header *	rx;
+	struct mutex			tx_mtx;
+	struct mutex			rx_mtx;
+	wait_queue_head_t		wq;
+	bool				dead;
+};
 
 struct librpc_call
 {
@@ -61,6 +122,7 @@ struct librpc_call
 	struct device *		dev;
 	void *			data;
 	size_t			len;
+	struct librpc_ring_ctx *ring;
 	struct work_struct	work;
 };
 
@@ -70,6 +132,71 @@ struct librpc_dev
     	uint32_t		seq;
 };
 
+/*
+ * Successful requests from senders that accept cumulative ACKs are
+ * acknowledged in batches: one LIBRPC_ACK_UPTO per LIBRPC_ACK_BATCH
+ * requests, or after LIBRPC_ACK_DELAY_MS, whichever comes first.
+ */
+#define	LIBRPC_ACK_BATCH	16
+#define	LIBRPC_ACK_DELAY_MS	1
+
+/*
+ * Largest fragment that still fits the receive buffers on both ends.
+ */
+#define	LIBRPC_FRAG_SIZE	(CONNECTOR_MAX_MSG_SIZE - NLMSG_HDRLEN - \
+    sizeof(struct cn_msg) - sizeof(struct librpc_message))
+
+/*
+ * Events and logs of a device are held back for up to LIBRPC_BATCH_DELAY_MS
+ * and go out together once that much time passed or a batch is full.
+ */
+#define	LIBRPC_BATCH_DELAY_MS	5
+#define	LIBRPC_BATCH_SIZE	LIBRPC_FRAG_SIZE
+
+/*
+ * Requests arriving in fragments are held at most LIBRPC_REASSEMBLY_TIMEOUT_MS
+ * and limited per sender and in total, so a peer can't pin kernel memory by
+ * opening reassemblies it never finishes.
+ */
+#define	LIBRPC_REASSEMBLY_TIMEOUT_MS	10000
+#define	LIBRPC_REASSEMBLY_PEER_MAX	4
+#define	LIBRPC_REASSEMBLY_MAX		32
+#define	LIBRPC_REASSEMBLY_BYTES		(4 * LIBRPC_MAX_MESSAGE)
+
+struct librpc_reassembly
+{
+	struct list_head	link;
+	uint32_t		portid;
+	uint32_t		id;
+	size_t			total;
+	size_t			done;
+	unsigned long		expires;
+	void *			data;
+};
+
+struct librpc_pending_ack
+{
+	uint32_t		portid;
+	uint32_t		seq;
+	uint32_t		ack;
+	unsigned int		count;
+};
+
+static const struct file_operations librpc_ring_fops = {
+	.owner = THIS_MODULE,
+	.open = librpc_ring_open,
+	.release = librpc_ring_close,
+	.mmap = librpc_ring_mmap,
+	.poll = librpc_ring_poll,
+	.unlocked_ioctl = librpc_ring_ioctl
+};
+
+static struct miscdevice librpc_ring_miscdev = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = "librpc-ring",
+	.fops = &librpc_ring_fops
+};
+
 static struct cb_id librpc_cb_id = {
 	.idx = CN_LIBRPC_IDX,
 	.val = CN_LIBRPC_VAL
@@ -84,7 +211,8 @@ static const struct device_attribute librpc_device_attrs[] = {
 	__ATTR(address, S_IRUGO, librpc_device_show_address, NULL),
 	__ATTR(name, S_IRUGO, librpc_device_show_name, NULL),
 	__ATTR(description, S_IRUGO, librpc_device_show_descr, NULL),
-	__ATTR(serial, S_IRUGO, librpc_device_show_serial, NULL)
+	__ATTR(serial, S_IRUGO, librpc_device_show_serial, NULL),
+	__ATTR(dropped, S_IRUGO, librpc_device_show_dropped, NULL)
 };
 
 static struct workqueue_struct *librpc_wq;
@@ -93,6 +221,21 @@ static struct librpc_dev *dev;
 static DEFINE_MUTEX(librpc_mtx);
 static DEFINE_IDR(librpc_device_ids);
 static uint32_t resp_seq;
+static struct librpc_pending_ack librpc_pending_ack;
+static DEFINE_MUTEX(librpc_ack_mtx);
+static DECLARE_DELAYED_WORK(librpc_ack_work, librpc_cn_ack_timeout);
+static atomic_t librpc_msg_id;
+static LIST_HEAD(librpc_reassembly_list);
+static DEFINE_MUTEX(librpc_reassembly_mtx);
+static size_t librpc_reassembly_count;
+static size_t librpc_reassembly_bytes;
+static DECLARE_DELAYED_WORK(librpc_reassembly_work,
+    librpc_reassembly_timeout);
+static struct notifier_block librpc_netlink_nb = {
+	.notifier_call = librpc_netlink_event
+};
+static LIST_HEAD(librpc_ring_list);
+static DEFINE_MUTEX(librpc_ring_mtx);
 
 struct librpc_device *
 librpc_device_register(const char *name, struct device *dev,
@@ -118,9 +261,16 @@ librpc_device_register(const char *name, struct device *dev,
 
 	dev_set_name(&rpcdev->dev, "librpc%d", id);
 
+	/* Without a batch buffer, events and logs go out one by one */
+	mutex_init(&rpcdev->batch_mtx);
+	INIT_DELAYED_WORK(&rpcdev->batch_work, librpc_batch_timeout);
+	rpcdev->batch = kzalloc(sizeof(struct cn_msg) +
+	    sizeof(struct librpc_message) + LIBRPC_BATCH_SIZE, GFP_KERNEL);
+
 	ret = ops->enumerate(dev, &rpcdev->endp);
 	if (ret != 0) {
 		dev_err(&rpcdev->dev, "cannot enumerate librpc endpoint: %d\n", ret);
+		kfree(rpcdev->batch);
 		kfree(rpcdev);
 		mutex_unlock(&librpc_mtx);
 		return (ERR_PTR(ret));
@@ -128,6 +278,7 @@ librpc_device_register(const char *name, struct device *dev,
 
         ret = device_register(&rpcdev->dev);
 	if (ret != 0) {
+		kfree(rpcdev->batch);
 		kfree(rpcdev);
 		mutex_unlock(&librpc_mtx);
 		return (ERR_PTR(ret));
@@ -145,8 +296,23 @@ librpc_device_register(const char *name, struct device *dev,
 void
 librpc_device_unregister(struct librpc_device *rpcdev)
 {
+	struct librpc_ring_ctx *ctx;
 	int i;
 
+	mutex_lock(&librpc_ring_mtx);
+	list_for_each_entry(ctx, &librpc_ring_list, link) {
+		if (ctx->rpcdev == rpcdev) {
+			ctx->dead = true;
+			wake_up_interruptible(&ctx->wq);
+		}
+	}
+	mutex_unlock(&librpc_ring_mtx);
+
+	cancel_delayed_work_sync(&rpcdev->batch_work);
+	mutex_lock(&rpcdev->batch_mtx);
+	librpc_batch_flush_locked(rpcdev);
+	mutex_unlock(&rpcdev->batch_mtx);
+
 	mutex_lock(&librpc_mtx);
 	for (i = 0; i < ARRAY_SIZE(librpc_device_attrs); i++)
 		device_remove_file(&rpcdev->dev, &librpc_device_attrs[i]);
@@ -154,6 +320,7 @@ librpc_device_unregister(struct librpc_device *rpcdev)
 	device_unregister(&rpcdev->dev);
 	idr_remove(&librpc_device_ids, rpcdev->address);
 	librpc_cn_send_presence(LIBRPC_DEPART, rpcdev->address, &rpcdev->endp);
+	kfree(rpcdev->batch);
 	kfree(rpcdev);
 	mutex_unlock(&librpc_mtx);
 }
@@ -163,79 +330,80 @@ librpc_device_answer(struct device *dev, void *arg, const void *buf,
     size_t length)
 {
 	struct librpc_call *call = arg;
-	struct {
-	    struct cn_msg cn;
-	    struct librpc_message msg;
-	    char response[length];
-	} packet;
 
-	printk("librpc_device_answer: buf=%p, length=%zu\n", buf, sizeof(packet));
+	printk("librpc_device_answer: buf=%p, length=%zu\n", buf, length);
 	print_hex_dump(KERN_INFO, "response: ", DUMP_PREFIX_ADDRESS, 16,
-	    1, buf, length, true);
+	    1, buf, min_t(size_t, length, 256), true);
 
-	packet.cn.id = librpc_cb_id;
-	packet.cn.seq = resp_seq++;
-	packet.cn.ack = 0;
-	packet.cn.len = sizeof(packet);
-	packet.cn.flags = 0;
-	packet.msg.opcode = LIBRPC_RESPONSE;
-	packet.msg.status = 0;
+	if (call->ring != NULL) {
+		if (librpc_ring_put(call->ring, LIBRPC_RESPONSE,
+		    call->rpcdev->address, 0, buf, length) != 0)
+			librpc_ring_put(call->ring, LIBRPC_RESPONSE,
+			    call->rpcdev->address, ENOBUFS, NULL, 0);
 
-	memcpy(packet.response, buf, length);
-	cn_netlink_send(&packet.cn, call->portid, 0, GFP_KERNEL);
+		kref_put(&call->ring->kref, librpc_ring_release);
+		call->ring = NULL;
+		return;
+	}
+
+	librpc_cn_send_message(LIBRPC_RESPONSE, call->rpcdev->address, 0,
+	    call->portid, buf, length);
 }
 
 void
 librpc_device_error(struct device *dev, void *arg, int error)
 {
 	struct librpc_call *call = arg;
-	struct {
-	    struct cn_msg cn;
-	    struct librpc_message msg;
-	} packet;
 
 	printk("librpc_device_error: error=%d\n", error);
+	if (call->ring != NULL) {
+		librpc_ring_put(call->ring, LIBRPC_RESPONSE,
+		    call->rpcdev->address, error, NULL, 0);
+		kref_put(&call->ring->kref, librpc_ring_release);
+		call->ring = NULL;
+		return;
+	}
 
-	packet.cn.id = librpc_cb_id;
-	packet.cn.seq = resp_seq++;
-	packet.cn.ack = 0;
-	packet.cn.len = sizeof(packet);
-	packet.cn.flags = 0;
-	packet.msg.opcode = LIBRPC_RESPONSE;
-	packet.msg.status = error;
-
-	cn_netlink_send(&packet.cn, call->portid, 0, GFP_KERNEL);
+	librpc_cn_send_message(LIBRPC_RESPONSE, call->rpcdev->address, error,
+	    call->portid, NULL, 0);
 }
 
 void
 librpc_device_event(struct device *dev, const void *buf, size_t length)
 {
-	struct {
-		struct cn_msg cn;
-		struct librpc_message msg;
-		char response[length];
-	} packet;
+	struct librpc_device *rpcdev;
+	struct librpc_ring_ctx *ctx;
 
 	printk("librpc_device_event: device=%p\n", dev);
-
-	packet.cn.id = librpc_cb_id;
-	packet.cn.seq = resp_seq++;
-	packet.cn.ack = 0;
-	packet.cn.len = sizeof(packet);
-	packet.cn.flags = 0;
-	packet.msg.opcode = LIBRPC_EVENT;
-	packet.msg.status = 0;
-
-	memcpy(packet.response, buf, length);
-	cn_netlink_send(&packet.cn, 0, 0, GFP_KERNEL);
+	rpcdev = librpc_find_parent(dev);
+	if (rpcdev != NULL) {
+		librpc_batch_add(rpcdev, LIBRPC_EVENT, buf, length);
+		put_device(&rpcdev->dev);
+	} else
+		librpc_cn_send_message(LIBRPC_EVENT, 0, 0, 0, buf, length);
+
+	mutex_lock(&librpc_ring_mtx);
+	list_for_each_entry(ctx, &librpc_ring_list, link) {
+		if (ctx->rpcdev != NULL && ctx->rpcdev->dev.parent == dev)
+			librpc_ring_put(ctx, LIBRPC_EVENT, ctx->rpcdev->address,
+			    0, buf, length);
+	}
+	mutex_unlock(&librpc_ring_mtx);
 }
 
 void
 librpc_device_log(struct device *dev, const char *log, size_t len)
 {
+	struct librpc_device *rpcdev;
 
 	dev_dbg(dev, "librpc_device_log: len=%zu, buf=%p\n", len, log);
 	dev_info(dev, "%*s\n", (int)len, log);
+
+	rpcdev = librpc_find_parent(dev);
+	if (rpcdev != NULL) {
+		librpc_batch_add(rpcdev, LIBRPC_LOG, log, len);
+		put_device(&rpcdev->dev);
+	}
 }
 
 int
@@ -276,6 +444,119 @@ librpc_find_device(uint32_t address)
 	    librpc_match_device));
 }
 
+static int
+librpc_match_parent(struct device *dev, void *data)
+{
+
+	return (dev->parent == data);
+}
+
+/*
+ * Returns the endpoint registered for a driver's device, with a
+ * reference held.
+ */
+static struct librpc_device *
+librpc_find_parent(struct device *parent)
+{
+	struct device *dev;
+
+	dev = bus_find_device(&librpc_bus_type, NULL, parent,
+	    librpc_match_parent);
+	return (dev != NULL ? to_librpc_device(dev) : NULL);
+}
+
+/*
+ * Queues an event or log record for the next batch of a device. A record
+ * too large for a batch goes out by itself, after the records queued
+ * before it.
+ */
+static void
+librpc_batch_add(struct librpc_device *rpcdev, int opcode, const void *buf,
+    size_t length)
+{
+	struct librpc_message *msg;
+	struct librpc_batch_record *rec;
+	size_t size = sizeof(*rec) + LIBRPC_BATCH_ALIGN(length);
+
+	mutex_lock(&rpcdev->batch_mtx);
+	if (rpcdev->batch == NULL || size > LIBRPC_BATCH_SIZE) {
+		librpc_batch_flush_locked(rpcdev);
+		mutex_unlock(&rpcdev->batch_mtx);
+		librpc_cn_send_message(opcode, rpcdev->address, 0, 0, buf,
+		    length);
+		return;
+	}
+
+	if (rpcdev->batch_len + size > LIBRPC_BATCH_SIZE)
+		librpc_batch_flush_locked(rpcdev);
+
+	msg = (struct librpc_message *)(rpcdev->batch + 1);
+	rec = (struct librpc_batch_record *)(msg->data + rpcdev->batch_len);
+	memset(rec, 0, size);
+	rec->len = length;
+	rec->opcode = opcode;
+	memcpy(rec + 1, buf, length);
+	rpcdev->batch_len += size;
+
+	if (rpcdev->batch_len == size)
+		schedule_delayed_work(&rpcdev->batch_work,
+		    msecs_to_jiffies(LIBRPC_BATCH_DELAY_MS));
+
+	mutex_unlock(&rpcdev->batch_mtx);
+}
+
+static void
+librpc_batch_flush_locked(struct librpc_device *rpcdev)
+{
+	struct librpc_message *msg;
+	struct librpc_batch_record *rec;
+	uint32_t count = 0;
+	size_t offset;
+	int ret;
+
+	if (rpcdev->batch == NULL || rpcdev->batch_len == 0)
+		return;
+
+	msg = (struct librpc_message *)(rpcdev->batch + 1);
+	for (offset = 0; offset < rpcdev->batch_len; count++) {
+		rec = (struct librpc_batch_record *)(msg->data + offset);
+		offset += sizeof(*rec) + LIBRPC_BATCH_ALIGN(rec->len);
+	}
+
+	rpcdev->batch->id = librpc_cb_id;
+	rpcdev->batch->seq = resp_seq++;
+	rpcdev->batch->ack = 0;
+	rpcdev->batch->len = sizeof(*msg) + rpcdev->batch_len;
+	rpcdev->batch->flags = 0;
+	msg->opcode = LIBRPC_BATCH;
+	msg->address = rpcdev->address;
+	msg->status = rpcdev->batch_dropped;
+	msg->id = (uint32_t)atomic_inc_return(&librpc_msg_id);
+	msg->offset = 0;
+	msg->total = 0;
+
+	/* Nobody listening is not a drop; running out of buffers is */
+	ret = cn_netlink_send(rpcdev->batch, 0, 0, GFP_KERNEL);
+	if (ret < 0 && ret != -ESRCH) {
+		atomic_add(count, &rpcdev->dropped);
+		rpcdev->batch_dropped += count;
+	} else
+		rpcdev->batch_dropped = 0;
+
+	rpcdev->batch_len = 0;
+}
+
+static void
+librpc_batch_timeout(struct work_struct *work)
+{
+	struct librpc_device *rpcdev = container_of(to_delayed_work(work),
+	    struct librpc_device, batch_work);
+
+	mutex_lock(&rpcdev->batch_mtx);
+	librpc_batch_flush_locked(rpcdev);
+	mutex_unlock(&rpcdev->batch_mtx);
+}
+
 static void
 librpc_request(struct work_struct *work)
 {
@@ -299,6 +580,8 @@ librpc_cn_callback(struct cn_msg *cn, struct netlink_skb_parms *nsp)
 	struct librpc_call *call;
 	struct librpc_device *rpcdev;
 	struct device *dev;
+	void *data;
+	size_t len;
 	int ret = 0;
 
 	printk("librpc_cn_callback: msg: opcode=%d, address=0x%08x, len=%d, "
@@ -327,28 +610,327 @@ librpc_cn_callback(struct cn_msg *cn, struct netlink_skb_parms *nsp)
 			goto ack;
 		}
 
+		len = cn->len - sizeof(*msg);
+		if (msg->total > len) {
+			/* Every fragment gets acknowledged on its own */
+			ret = librpc_reassemble(msg, len, nsp->portid, &data,
+			    &len);
+			if (ret == -EINPROGRESS) {
+				ret = 0;
+				goto ack;
+			}
+
+			if (ret != 0) {
+				ret = -ret;
+				goto ack;
+			}
+		} else {
+			data = kmalloc(len, GFP_KERNEL);
+			memcpy(data, msg->data, len);
+		}
+
 		call = kzalloc(sizeof(*call), GFP_KERNEL);
 		call->rpcdev = to_librpc_device(dev);
 		call->dev = dev->parent;
-		call->len = cn->len - sizeof(*msg);
-		call->data = kmalloc(call->len, GFP_KERNEL);
+		call->len = len;
+		call->data = data;
 		call->portid = nsp->portid;
 		call->seq = cn->seq;
 		call->ack = cn->ack;
 		call->id = cn->seq;
 
-		memcpy(call->data, msg->data, call->len);
 		INIT_WORK(&call->work, &librpc_request);
 		queue_work(librpc_wq, &call->work);
 		break;
 	}
 
 ack:
-	librpc_cn_send_ack(cn->seq, cn->ack, nsp->portid, ret);
+	if (ret == 0 && (cn->flags & LIBRPC_CN_ACK_CUMULATIVE)) {
+		librpc_cn_defer_ack(cn->seq, cn->ack, nsp->portid);
+		return;
+	}
+
+	librpc_cn_flush_acks(nsp->portid);
+	librpc_cn_send_ack(cn->seq, cn->ack, nsp->portid, ret, false);
+}
+
+/*
+ * Collects a request fragment. Returns 0 along with the complete request
+ * once the last fragment is in, -EINPROGRESS while fragments are missing.
+ *
+ * Fragments are sent in order, so each one has to start where the data
+ * collected so far ends. A repeat of a fragment we already have is ignored;
+ * anything else drops the reassembly. That way a request is only handed on
+ * once every byte of it has been written.
+ */
+static int
+librpc_reassemble(struct librpc_message *msg, size_t len, uint32_t portid,
+    void **datap, size_t *lenp)
+{
+	struct librpc_reassembly *r;
+	bool found = false;
+	size_t peer = 0;
+
+	if (msg->total > LIBRPC_MAX_MESSAGE || msg->offset > msg->total ||
+	    len > msg->total - msg->offset)
+		return (-EMSGSIZE);
+
+	librpc_reassembly_purge(false, 0, true);
+	mutex_lock(&librpc_reassembly_mtx);
+	list_for_each_entry(r, &librpc_reassembly_list, link) {
+		if (r->portid != portid)
+			continue;
+
+		if (r->id == msg->id) {
+			found = true;
+			break;
+		}
+
+		peer++;
+	}
+
+	if (!found) {
+		if (msg->offset != 0) {
+			mutex_unlock(&librpc_reassembly_mtx);
+			return (-EPROTO);
+		}
+
+		if (peer >= LIBRPC_REASSEMBLY_PEER_MAX ||
+		    librpc_reassembly_count >= LIBRPC_REASSEMBLY_MAX ||
+		    msg->total > LIBRPC_REASSEMBLY_BYTES -
+		    librpc_reassembly_bytes) {
+			mutex_unlock(&librpc_reassembly_mtx);
+			return (-ENOBUFS);
+		}
+
+		r = kzalloc(sizeof(*r), GFP_KERNEL);
+		if (r == NULL) {
+			mutex_unlock(&librpc_reassembly_mtx);
+			return (-ENOMEM);
+		}
+
+		r->data = kvmalloc(msg->total, GFP_KERNEL);
+		if (r->data == NULL) {
+			mutex_unlock(&librpc_reassembly_mtx);
+			kfree(r);
+			return (-ENOMEM);
+		}
+
+		r->portid = portid;
+		r->id = msg->id;
+		r->total = msg->total;
+		r->expires = jiffies +
+		    msecs_to_jiffies(LIBRPC_REASSEMBLY_TIMEOUT_MS);
+		list_add(&r->link, &librpc_reassembly_list);
+		librpc_reassembly_count++;
+		librpc_reassembly_bytes += r->total;
+		schedule_delayed_work(&librpc_reassembly_work,
+		    msecs_to_jiffies(LIBRPC_REASSEMBLY_TIMEOUT_MS));
+	}
+
+	if (r->total != msg->total) {
+		librpc_reassembly_free_locked(r);
+		mutex_unlock(&librpc_reassembly_mtx);
+		return (-EPROTO);
+	}
+
+	if (msg->offset + len <= r->done && msg->offset < r->done) {
+		mutex_unlock(&librpc_reassembly_mtx);
+		return (-EINPROGRESS);
+	}
+
+	if (msg->offset != r->done) {
+		librpc_reassembly_free_locked(r);
+		mutex_unlock(&librpc_reassembly_mtx);
+		return (-EPROTO);
+	}
+
+	memcpy(r->data + msg->offset, msg->data, len);
+	r->done += len;
+	if (r->done < r->total) {
+		mutex_unlock(&librpc_reassembly_mtx);
+		return (-EINPROGRESS);
+	}
+
+	*datap = r->data;
+	*lenp = r->total;
+	r->data = NULL;
+	librpc_reassembly_free_locked(r);
+	mutex_unlock(&librpc_reassembly_mtx);
+	return (0);
+}
+
+static void
+librpc_reassembly_free_locked(struct librpc_reassembly *r)
+{
+
+	list_del(&r->link);
+	librpc_reassembly_count--;
+	librpc_reassembly_bytes -= r->total;
+	kvfree(r->data);
+	kfree(r);
+}
+
+/*
+ * Drops reassemblies: all of them, those of one sender, or (if expired is
+ * set) the ones that have been waiting for too long.
+ */
+static void
+librpc_reassembly_purge(bool by_portid, uint32_t portid, bool expired)
+{
+	struct librpc_reassembly *r;
+	struct librpc_reassembly *tmp;
+
+	mutex_lock(&librpc_reassembly_mtx);
+	list_for_each_entry_safe(r, tmp, &librpc_reassembly_list, link) {
+		if (by_portid && r->portid != portid)
+			continue;
+
+		if (expired && time_before(jiffies, r->expires))
+			continue;
+
+		librpc_reassembly_free_locked(r);
+	}
+
+	mutex_unlock(&librpc_reassembly_mtx);
+}
+
+static void
+librpc_reassembly_timeout(struct work_struct *work)
+{
+	bool pending;
+
+	librpc_reassembly_purge(false, 0, true);
+	mutex_lock(&librpc_reassembly_mtx);
+	pending = !list_empty(&librpc_reassembly_list);
+	mutex_unlock(&librpc_reassembly_mtx);
+
+	if (pending)
+		schedule_delayed_work(&librpc_reassembly_work,
+		    msecs_to_jiffies(LIBRPC_REASSEMBLY_TIMEOUT_MS));
+}
+
+/*
+ * A connector socket went away: whatever it was sending is never going
+ * to be completed.
+ */
+static int
+librpc_netlink_event(struct notifier_block *nb, unsigned long event,
+    void *ptr)
+{
+	struct netlink_notify *n = ptr;
+
+	if (event != NETLINK_URELEASE || n->protocol != NETLINK_CONNECTOR)
+		return (NOTIFY_DONE);
+
+	librpc_reassembly_purge(true, n->portid, false);
+	return (NOTIFY_DONE);
+}
+
+/*
+ * Sends a message to userspace, cut into as many fragments as it takes.
+ */
+static void
+librpc_cn_send_message(int opcode, uint32_t address, int status,
+    uint32_t portid, const void *buf, size_t length)
+{
+	struct cn_msg *cn;
+	struct librpc_message *msg;
+	size_t offset = 0;
+	size_t chunk;
+	uint32_t id = (uint32_t)atomic_inc_return(&librpc_msg_id);
+
+	cn = kzalloc(sizeof(*cn) + sizeof(*msg) +
+	    min_t(size_t, length, LIBRPC_FRAG_SIZE), GFP_KERNEL);
+	if (cn == NULL) {
+		printk("librpc_cn_send_message: out of memory\n");
+		return;
+	}
+
+	msg = (struct librpc_message *)(cn + 1);
+
+	do {
+		chunk = min_t(size_t, length - offset, LIBRPC_FRAG_SIZE);
+
+		cn->id = librpc_cb_id;
+		cn->seq = resp_seq++;
+		cn->ack = 0;
+		cn->len = sizeof(*msg) + chunk;
+		cn->flags = 0;
+		msg->opcode = opcode;
+		msg->address = address;
+		msg->status = status;
+		msg->id = id;
+		msg->offset = offset;
+		msg->total = length;
+
+		if (chunk > 0)
+			memcpy(msg->data, buf + offset, chunk);
+
+		cn_netlink_send(cn, portid, 0, GFP_KERNEL);
+		offset += chunk;
+	} while (offset < length);
+
+	kfree(cn);
 }
 
 static void
-librpc_cn_send_ack(uint32_t seq, uint32_t ack, uint32_t portid, int error)
+librpc_cn_defer_ack(uint32_t seq, uint32_t ack, uint32_t portid)
+{
+	struct librpc_pending_ack *pending = &librpc_pending_ack;
+
+	mutex_lock(&librpc_ack_mtx);
+	if (pending->count > 0 && pending->portid != portid)
+		librpc_cn_flush_acks_locked();
+
+	pending->portid = portid;
+	pending->seq = seq;
+	pending->ack = ack;
+
+	if (++pending->count >= LIBRPC_ACK_BATCH)
+		librpc_cn_flush_acks_locked();
+	else
+		schedule_delayed_work(&librpc_ack_work,
+		    msecs_to_jiffies(LIBRPC_ACK_DELAY_MS));
+
+	mutex_unlock(&librpc_ack_mtx);
+}
+
+static void
+librpc_cn_flush_acks(uint32_t portid)
+{
+
+	mutex_lock(&librpc_ack_mtx);
+	if (librpc_pending_ack.portid == portid)
+		librpc_cn_flush_acks_locked();
+	mutex_unlock(&librpc_ack_mtx);
+}
+
+static void
+librpc_cn_flush_acks_locked(void)
+{
+	struct librpc_pending_ack *pending = &librpc_pending_ack;
+
+	if (pending->count == 0)
+		return;
+
+	librpc_cn_send_ack(pending->seq, pending->ack, pending->portid, 0,
+	    true);
+	pending->count = 0;
+}
+
+static void
+librpc_cn_ack_timeout(struct work_struct *work)
+{
+
+	mutex_lock(&librpc_ack_mtx);
+	librpc_cn_flush_acks_locked();
+	mutex_unlock(&librpc_ack_mtx);
+}
+
+static void
+librpc_cn_send_ack(uint32_t seq, uint32_t ack, uint32_t portid, int error,
+    bool cumulative)
 {
 	int ret;
 	struct {
@@ -356,15 +938,17 @@ librpc_cn_send_ack(uint32_t seq, uint32_t ack, uint32_t portid, int error)
 		struct librpc_message msg;
 	} packet;
 
-	printk("librpc_cn_send_ack: seq=%d, portid=%d, status=%d\n",
-	    seq, portid, error);
+	printk("librpc_cn_send_ack: seq=%d, portid=%d, status=%d, "
+	    "cumulative=%d\n", seq, portid, error, cumulative);
+
+	memset(&packet, 0, sizeof(packet));
 
 	packet.cn.id = librpc_cb_id;
 	packet.cn.seq = seq;
 	packet.cn.ack = ack + 1;
-	packet.cn.len = sizeof(packet);
+	packet.cn.len = sizeof(packet) - sizeof(packet.cn);
 	packet.cn.flags = 0;
-	packet.msg.opcode = LIBRPC_ACK;
+	packet.msg.opcode = cumulative ? LIBRPC_ACK_UPTO : LIBRPC_ACK;
 	packet.msg.status = error;
 
 	ret = cn_netlink_send(&packet.cn, portid, 0, GFP_KERNEL);
@@ -372,6 +956,267 @@ librpc_cn_send_ack(uint32_t seq, uint32_t ack, uint32_t portid, int error)
 		printk("librpc_cn_send_ack: send failed, err=%d\n", ret);
 }
 
+static void
+librpc_ring_copy_in(struct librpc_ring_header *ring, uint64_t pos,
+    const void *buf, size_t len)
+{
+	char *data = (char *)(ring + 1);
+	size_t offset = pos % LIBRPC_RING_SIZE;
+	size_t chunk = min_t(size_t, len, LIBRPC_RING_SIZE - offset);
+
+	memcpy(data + offset, buf, chunk);
+	memcpy(data, buf + chunk, len - chunk);
+}
+
+static void
+librpc_ring_copy_out(struct librpc_ring_header *ring, uint64_t pos, void *buf,
+    size_t len)
+{
+	char *data = (char *)(ring + 1);
+	size_t offset = pos % LIBRPC_RING_SIZE;
+	size_t chunk = min_t(size_t, len, LIBRPC_RING_SIZE - offset);
+
+	memcpy(buf, data + offset, chunk);
+	memcpy(buf + chunk, data, len - chunk);
+}
+
+/*
+ * Appends a record to the RX ring: a single copy from the driver's buffer
+ * straight into memory userspace reads from.
+ */
+static int
+librpc_ring_put(struct librpc_ring_ctx *ctx, int opcode, uint32_t address,
+    int status, const void *buf, size_t len)
+{
+	struct librpc_ring_header *ring = ctx->rx;
+	struct librpc_ring_record rec = {
+		.len = len,
+		.opcode = opcode,
+		.status = status,
+		.address = address
+	};
+	uint64_t head;
+	uint64_t tail;
+
+	if (len > LIBRPC_RING_MAX_RECORD)
+		return (-EMSGSIZE);
+
+	mutex_lock(&ctx->rx_mtx);
+	head = ring->head;
+	tail = smp_load_acquire(&ring->tail);
+	if (head - tail > LIBRPC_RING_SIZE ||
+	    LIBRPC_RING_SIZE - (head - tail) < sizeof(rec) + len) {
+		mutex_unlock(&ctx->rx_mtx);
+		return (-ENOBUFS);
+	}
+
+	librpc_ring_copy_in(ring, head, &rec, sizeof(rec));
+	librpc_ring_copy_in(ring, head + sizeof(rec), buf, len);
+	smp_store_release(&ring->head, head + sizeof(rec) + len);
+	mutex_unlock(&ctx->rx_mtx);
+
+	wake_up_interruptible(&ctx->wq);
+	return (0);
+}
+
+/*
+ * Consumes the TX ring. Requests are copied out, since drivers may hold
+ * on to the data after the request callback returns.
+ */
+static long
+librpc_ring_kick(struct librpc_ring_ctx *ctx)
+{
+	struct librpc_ring_header *ring = ctx->tx;
+	struct librpc_ring_record rec;
+	struct librpc_device *rpcdev;
+	struct librpc_call *call;
+	uint64_t head;
+	uint64_t tail;
+	void *data;
+	long ret = 0;
+
+	/* Bound under the lock that detach takes, and held while we work */
+	mutex_lock(&librpc_ring_mtx);
+	rpcdev = ctx->dead ? NULL : ctx->rpcdev;
+	if (rpcdev != NULL)
+		get_device(&rpcdev->dev);
+	mutex_unlock(&librpc_ring_mtx);
+
+	if (rpcdev == NULL)
+		return (-ENXIO);
+
+	mutex_lock(&ctx->tx_mtx);
+	tail = READ_ONCE(ring->tail);
+	head = smp_load_acquire(&ring->head);
+
+	/* Both indices come from userspace */
+	if (head - tail > LIBRPC_RING_SIZE) {
+		mutex_unlock(&ctx->tx_mtx);
+		put_device(&rpcdev->dev);
+		return (-EINVAL);
+	}
+
+	while (head - tail >= sizeof(rec)) {
+		librpc_ring_copy_out(ring, tail, &rec, sizeof(rec));
+		if (rec.len > LIBRPC_RING_MAX_RECORD ||
+		    head - tail - sizeof(rec) < rec.len) {
+			ret = -EINVAL;
+			break;
+		}
+
+		if (READ_ONCE(ctx->dead)) {
+			ret = -ENODEV;
+			break;
+		}
+
+		if (rec.opcode != LIBRPC_REQUEST) {
+			librpc_ring_put(ctx, LIBRPC_RESPONSE, rec.address,
+			    EINVAL, NULL, 0);
+			tail += sizeof(rec) + rec.len;
+			continue;
+		}
+
+		data = kmalloc(rec.len, GFP_KERNEL);
+		call = kzalloc(sizeof(*call), GFP_KERNEL);
+		if (data == NULL || call == NULL) {
+			kfree(data);
+			kfree(call);
+			ret = -ENOMEM;
+			break;
+		}
+
+		librpc_ring_copy_out(ring, tail + sizeof(rec), data, rec.len);
+		tail += sizeof(rec) + rec.len;
+
+		kref_get(&ctx->kref);
+		call->rpcdev = rpcdev;
+		call->dev = rpcdev->dev.parent;
+		call->data = data;
+		call->len = rec.len;
+		call->ring = ctx;
+		INIT_WORK(&call->work, &librpc_request);
+		queue_work(librpc_wq, &call->work);
+	}
+
+	smp_store_release(&ring->tail, tail);
+	mutex_unlock(&ctx->tx_mtx);
+	put_device(&rpcdev->dev);
+	return (ret);
+}
+
+static void
+librpc_ring_release(struct kref *kref)
+{
+	struct librpc_ring_ctx *ctx = container_of(kref,
+	    struct librpc_ring_ctx, kref);
+
+	if (ctx->rpcdev != NULL)
+		put_device(&ctx->rpcdev->dev);
+
+	vfree(ctx->mem);
+	kfree(ctx);
+}
+
+static int
+librpc_ring_open(struct inode *inode, struct file *file)
+{
+	struct librpc_ring_ctx *ctx;
+
+	ctx = kzalloc(sizeof(*ctx), GFP_KERNEL);
+	if (ctx == NULL)
+		return (-ENOMEM);
+
+	ctx->mem = vmalloc_user(PAGE_ALIGN(LIBRPC_RING_MAP_SIZE));
+	if (ctx->mem == NULL) {
+		kfree(ctx);
+		return (-ENOMEM);
+	}
+
+	kref_init(&ctx->kref);
+	INIT_LIST_HEAD(&ctx->link);
+	mutex_init(&ctx->tx_mtx);
+	mutex_init(&ctx->rx_mtx);
+	init_waitqueue_head(&ctx->wq);
+	ctx->tx = ctx->mem;
+	ctx->rx = ctx->mem + LIBRPC_RING_SPAN;
+	file->private_data = ctx;
+	return (0);
+}
+
+static int
+librpc_ring_close(struct inode *inode, struct file *file)
+{
+	struct librpc_ring_ctx *ctx = file->private_data;
+
+	mutex_lock(&librpc_ring_mtx);
+	list_del_init(&ctx->link);
+	mutex_unlock(&librpc_ring_mtx);
+
+	kref_put(&ctx->kref, librpc_ring_release);
+	return (0);
+}
+
+static int
+librpc_ring_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct librpc_ring_ctx *ctx = file->private_data;
+
+	return (remap_vmalloc_range(vma, ctx->mem, vma->vm_pgoff));
+}
+
+static unsigned int
+librpc_ring_poll(struct file *file, poll_table *wait)
+{
+	struct librpc_ring_ctx *ctx = file->private_data;
+	unsigned int mask = 0;
+
+	poll_wait(file, &ctx->wq, wait);
+
+	if (smp_load_acquire(&ctx->rx->head) != READ_ONCE(ctx->rx->tail))
+		mask |= POLLIN | POLLRDNORM;
+
+	if (ctx->dead)
+		mask |= POLLHUP;
+
+	return (mask);
+}
+
+static long
+librpc_ring_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	struct librpc_ring_ctx *ctx = file->private_data;
+	struct device *dev;
+	uint32_t address;
+
+	switch (cmd) {
+	case LIBRPC_IOC_BIND:
+		if (copy_from_user(&address, (void __user *)arg,
+		    sizeof(address)))
+			return (-EFAULT);
+
+		dev = librpc_find_device(address);
+		if (dev == NULL)
+			return (-ENOENT);
+
+		mutex_lock(&librpc_ring_mtx);
+		if (ctx->rpcdev != NULL) {
+			mutex_unlock(&librpc_ring_mtx);
+			put_device(dev);
+			return (-EBUSY);
+		}
+
+		ctx->rpcdev = to_librpc_device(dev);
+		list_add(&ctx->link, &librpc_ring_list);
+		mutex_unlock(&librpc_ring_mtx);
+		return (0);
+
+	case LIBRPC_IOC_KICK:
+		return (librpc_ring_kick(ctx));
+	}
+
+	return (-ENOTTY);
+}
+
 static void
 librpc_cn_send_presence(int opcode, uint32_t address,
     struct librpc_endpoint *endpoint)
@@ -385,10 +1230,12 @@ librpc_cn_send_presence(int opcode, uint32_t address,
 	printk("librpc_cn_send_presence: opcode=%d, epname=%s\n",
 	    opcode, endpoint->name);
 
+	memset(&packet, 0, sizeof(packet));
+
 	packet.cn.id = librpc_cb_id;
 	packet.cn.seq = resp_seq++;
 	packet.cn.ack = 0;
-	packet.cn.len = sizeof(packet);
+	packet.cn.len = sizeof(packet) - sizeof(packet.cn);
 	packet.cn.flags = 0;
 	packet.msg.opcode = opcode;
 	packet.msg.address = address;
@@ -407,6 +1254,15 @@ librpc_device_show_address(struct device *dev, struct device_attribute *attr,
 	return (sprintf(buf, "%u\n", rpcdev->address));
 }
 
+static ssize_t
+librpc_device_show_dropped(struct device *dev, struct device_attribute *attr,
+    char *buf)
+{
+	struct librpc_device *rpcdev = to_librpc_device(dev);
+
+	return (sprintf(buf, "%d\n", atomic_read(&rpcdev->dropped)));
+}
+
 static ssize_t
 librpc_device_show_name(struct device *dev, struct device_attribute *attr,
     char *buf)
@@ -473,6 +1329,14 @@ librpc_init(void)
 		goto done;
 	}
 
+	ret = misc_register(&librpc_ring_miscdev);
+	if (ret != 0)
+		goto done;
+
+	ret = netlink_register_notifier(&librpc_netlink_nb);
+	if (ret != 0)
+		goto done;
+
 	ret = cn_add_callback(&librpc_cb_id, "librpc", librpc_cn_callback);
 	if (ret != 0)
 		goto done;
@@ -486,6 +1350,12 @@ static void __exit
 librpc_exit(void)
 {
 	cn_del_callback(&librpc_cb_id);
+	netlink_unregister_notifier(&librpc_netlink_nb);
+	cancel_delayed_work_sync(&librpc_reassembly_work);
+	librpc_reassembly_purge(false, 0, false);
+	misc_deregister(&librpc_ring_miscdev);
+	cancel_delayed_work_sync(&librpc_ack_work);
+	librpc_cn_flush_acks_locked();
 	bus_for_each_dev(&librpc_bus_type, NULL, NULL, librpc_device_destroy);
 	device_destroy(librpc_class, MKDEV(0, 0));
 	class_destroy(librpc_class);
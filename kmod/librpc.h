@@ -53,17 +53,96 @@ enum librpc_opcode
         LIBRPC_ARRIVE,
         LIBRPC_DEPART,
 	LIBRPC_EVENT,
-	LIBRPC_LOG
+	LIBRPC_LOG,
+	LIBRPC_ACK_UPTO,
+	LIBRPC_BATCH
 };
 
+/*
+ * Set in cn_msg flags by senders that understand LIBRPC_ACK_UPTO, which
+ * acknowledges every request up to and including its sequence number.
+ * Failed requests are still acknowledged one by one with LIBRPC_ACK.
+ */
+#define	LIBRPC_CN_ACK_CUMULATIVE	0x1
+
+/*
+ * Messages that do not fit a single connector message travel as a series
+ * of fragments sharing the same id. Each fragment carries its offset and
+ * the total length, so the receiver can put the message back together.
+ * A total of zero stands for a message consisting of a single fragment.
+ */
 struct librpc_message
 {
         uint8_t                 opcode;
         uint32_t                address;
         int                     status;
+        uint32_t                id;
+        uint32_t                offset;
+        uint32_t                total;
         char                    data[];
 };
 
+#define LIBRPC_MAX_MESSAGE      (64 * 1024 * 1024)
+
+/*
+ * Events and log lines of a device are sent to userspace in batches: a
+ * single LIBRPC_BATCH message whose payload is a series of records, each
+ * a librpc_batch_record followed by its payload padded to 4 bytes. The
+ * message status holds the number of records dropped since the previous
+ * batch of the same device went out.
+ */
+struct librpc_batch_record
+{
+        uint32_t                len;
+        uint8_t                 opcode;
+        uint8_t                 __pad[3];
+};
+
+#define LIBRPC_BATCH_ALIGN(len) (((len) + 3) & ~3u)
+
+/*
+ * Ring interface, for bulk data that should not go through netlink.
+ *
+ * A file opened on LIBRPC_RING_DEVICE and bound to a device address with
+ * LIBRPC_IOC_BIND maps LIBRPC_RING_MAP_SIZE bytes: the TX ring (userspace
+ * to kernel) followed by the RX ring (kernel to userspace). Each ring is
+ * a librpc_ring_header followed by LIBRPC_RING_SIZE bytes of data, a byte
+ * stream of librpc_ring_record headers each followed by its payload. The
+ * producer advances head, the consumer advances tail; both grow without
+ * bound and are taken modulo LIBRPC_RING_SIZE.
+ *
+ * LIBRPC_IOC_KICK has the kernel consume the TX ring before returning.
+ * poll() reports POLLIN while the RX ring is not empty and POLLHUP once
+ * the device is gone.
+ */
+#define LIBRPC_RING_DEVICE      "/dev/librpc-ring"
+#define LIBRPC_RING_SIZE        (1024 * 1024)
+#define LIBRPC_RING_MAX_RECORD  (LIBRPC_RING_SIZE / 2)
+
+struct librpc_ring_header
+{
+        uint64_t                head;
+        uint64_t                __pad0[7];
+        uint64_t                tail;
+        uint64_t                __pad1[7];
+};
+
+struct librpc_ring_record
+{
+        uint32_t                len;
+        uint8_t                 opcode;
+        uint8_t                 __pad[3];
+        int32_t                 status;
+        uint32_t                address;
+};
+
+#define LIBRPC_RING_SPAN        (sizeof(struct librpc_ring_header) + \
+    LIBRPC_RING_SIZE)
+#define LIBRPC_RING_MAP_SIZE    (2 * LIBRPC_RING_SPAN)
+
+#define LIBRPC_IOC_BIND         _IOW('L', 1, uint32_t)
+#define LIBRPC_IOC_KICK         _IO('L', 2)
+
 #ifdef __KERNEL__
 
 struct librpc_device
@@ -74,6 +153,12 @@ struct librpc_device
         struct module *                 owner;
         struct device                   dev;
         const struct librpc_ops *       ops;
+        struct mutex                    batch_mtx;
+        struct delayed_work             batch_work;
+        struct cn_msg *                 batch;
+        size_t                          batch_len;
+        uint32_t                        batch_dropped;
+        atomic_t                        dropped;
 };
 
 struct librpc_ops
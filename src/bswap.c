@@ -0,0 +1,142 @@
+/*
+ * Copyright 2015-2017 Two Pore Guys, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <string.h>
+#include <glib.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+#include "bswap.h"
+
+typedef void (*rpc_bswap64_fn_t)(uint64_t *, const uint64_t *, size_t);
+
+static void rpc_bswap64_scalar(uint64_t *, const uint64_t *, size_t);
+#if defined(__x86_64__) || defined(__i386__)
+static void rpc_bswap64_ssse3(uint64_t *, const uint64_t *, size_t);
+static void rpc_bswap64_avx2(uint64_t *, const uint64_t *, size_t);
+#elif defined(__aarch64__)
+static void rpc_bswap64_neon(uint64_t *, const uint64_t *, size_t);
+#endif
+static rpc_bswap64_fn_t rpc_bswap64_select(void);
+
+static void
+rpc_bswap64_scalar(uint64_t *dst, const uint64_t *src, size_t count)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+#if G_BYTE_ORDER == G_LITTLE_ENDIAN
+		dst[i] = GUINT64_SWAP_LE_BE(src[i]);
+#else
+		dst[i] = src[i];
+#endif
+	}
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("ssse3")))
+static void
+rpc_bswap64_ssse3(uint64_t *dst, const uint64_t *src, size_t count)
+{
+	const __m128i mask = _mm_set_epi8(8, 9, 10, 11, 12, 13, 14, 15,
+	    0, 1, 2, 3, 4, 5, 6, 7);
+	__m128i v;
+	size_t i;
+
+	for (i = 0; i + 2 <= count; i += 2) {
+		v = _mm_loadu_si128((const __m128i *)(src + i));
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_shuffle_epi8(v, mask));
+	}
+
+	rpc_bswap64_scalar(dst + i, src + i, count - i);
+}
+
+__attribute__((target("avx2")))
+static void
+rpc_bswap64_avx2(uint64_t *dst, const uint64_t *src, size_t count)
+{
+	const __m256i mask = _mm256_set_epi8(8, 9, 10, 11, 12, 13, 14, 15,
+	    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+	    0, 1, 2, 3, 4, 5, 6, 7);
+	__m256i v;
+	size_t i;
+
+	for (i = 0; i + 4 <= count; i += 4) {
+		v = _mm256_loadu_si256((const __m256i *)(src + i));
+		_mm256_storeu_si256((__m256i *)(dst + i),
+		    _mm256_shuffle_epi8(v, mask));
+	}
+
+	rpc_bswap64_scalar(dst + i, src + i, count - i);
+}
+#elif defined(__aarch64__)
+static void
+rpc_bswap64_neon(uint64_t *dst, const uint64_t *src, size_t count)
+{
+	uint8x16_t v;
+	size_t i;
+
+	for (i = 0; i + 2 <= count; i += 2) {
+		v = vld1q_u8((const uint8_t *)(src + i));
+		vst1q_u8((uint8_t *)(dst + i), vrev64q_u8(v));
+	}
+
+	rpc_bswap64_scalar(dst + i, src + i, count - i);
+}
+#endif
+
+static rpc_bswap64_fn_t
+rpc_bswap64_select(void)
+{
+
+#if G_BYTE_ORDER == G_LITTLE_ENDIAN
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return (rpc_bswap64_avx2);
+
+	if (__builtin_cpu_supports("ssse3"))
+		return (rpc_bswap64_ssse3);
+#elif defined(__aarch64__)
+	return (rpc_bswap64_neon);
+#endif
+#endif
+	return (rpc_bswap64_scalar);
+}
+
+void
+rpc_bswap64_array(uint64_t *dst, const uint64_t *src, size_t count)
+{
+	static gsize kernel = 0;
+
+	if (g_once_init_enter(&kernel))
+		g_once_init_leave(&kernel, (gsize)rpc_bswap64_select());
+
+	((rpc_bswap64_fn_t)kernel)(dst, src, count);
+}
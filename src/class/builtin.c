@@ -67,6 +67,13 @@ builtin_deserialize(rpc_object_t obj)
 		return (result);
 	}
 
+	/*
+	 * Binary leaves may borrow their bytes from the received frame;
+	 * take a reference instead of duplicating the payload.
+	 */
+	if (rpc_get_type(obj) == RPC_TYPE_BINARY)
+		return (rpc_retain(obj));
+
 	return (rpc_copy(obj));
 }
 
@@ -27,12 +27,80 @@
 #include <assert.h>
 #include "../linker_set.h"
 #include "../internal.h"
+#include "../workq.h"
+
+static bool container_validate_dict(struct rpct_typei *, rpc_object_t,
+    struct rpct_error_context *);
+
+/*
+ * Large dictionaries are snapshotted into flat arrays of keys and values,
+ * which get split into chunks the same way rpc_array_apply_parallel()
+ * splits arrays.
+ */
+static bool
+container_validate_dict(struct rpct_typei *value_typei, rpc_object_t obj,
+    struct rpct_error_context *errctx)
+{
+	__block gint invalid = 0;
+	__block gint stop = 0;
+	GPtrArray *keys;
+	GPtrArray *values;
+	size_t count;
+
+	count = rpc_dictionary_get_count(obj);
+	keys = g_ptr_array_sized_new((guint)count);
+	values = g_ptr_array_sized_new((guint)count);
+	rpc_dictionary_apply(obj, ^(const char *key, rpc_object_t value) {
+		g_ptr_array_add(keys, (gpointer)key);
+		g_ptr_array_add(values, value);
+		return ((bool)true);
+	});
+
+	count = keys->len;
+	rpc_workq_parallel((count + RPCT_VALIDATE_GRAIN - 1) /
+	    RPCT_VALIDATE_GRAIN, ^(size_t chunk) {
+		struct rpct_error_context newctx;
+		size_t end = MIN(count, (chunk + 1) * RPCT_VALIDATE_GRAIN);
+		size_t i;
+		bool ret;
+
+		for (i = chunk * RPCT_VALIDATE_GRAIN; i < end; i++) {
+			if (g_atomic_int_get(&stop))
+				return;
+
+			rpct_derive_error_context(&newctx, errctx,
+			    g_ptr_array_index(keys, i));
+			ret = rpct_validate_instance(value_typei,
+			    g_ptr_array_index(values, i), &newctx);
+			rpct_release_error_context(&newctx);
+			if (ret)
+				continue;
+
+			g_atomic_int_set(&invalid, 1);
+			if (errctx->limit == 0 ||
+			    rpct_error_limit_reached(errctx)) {
+				g_atomic_int_set(&stop, 1);
+				return;
+			}
+		}
+	});
+
+	g_ptr_array_free(keys, true);
+	g_ptr_array_free(values, true);
+	return (invalid == 0);
+}
 
 static bool
 container_validate(struct rpct_typei *typei, rpc_object_t obj,
     struct rpct_error_context *errctx)
 {
+	struct rpct_error_context pctx = *errctx;
+	struct rpct_error_context *ctx = errctx;
+	__block gint invalid = 0;
 	rpct_typei_t value_typei;
+	GMutex mtx;
+	size_t count;
+	bool parallel;
 	bool fail;
 
 	/*
@@ -45,29 +113,73 @@ container_validate(struct rpct_typei *typei, rpc_object_t obj,
 
 	switch (rpc_get_type(obj)) {
 	case RPC_TYPE_ARRAY:
-		fail = rpc_array_apply(obj, ^(size_t idx, rpc_object_t value) {
+		count = rpc_array_get_count(obj);
+		break;
+
+	case RPC_TYPE_DICTIONARY:
+		count = rpc_dictionary_get_count(obj);
+		break;
+
+	default:
+		count = 0;
+		break;
+	}
+
+	/* Nested containers reuse the lock of the outermost parallel one */
+	parallel = count > RPCT_VALIDATE_GRAIN;
+	if (parallel && errctx->lock == NULL) {
+		g_mutex_init(&mtx);
+		pctx.lock = &mtx;
+		ctx = &pctx;
+	}
+
+	switch (rpc_get_type(obj)) {
+	case RPC_TYPE_ARRAY:
+		/*
+		 * Elements are validated past a failure only when a full
+		 * report was requested, and until it holds enough errors.
+		 */
+		fail = rpc_array_apply_parallel(obj, RPCT_VALIDATE_GRAIN,
+		    ^(size_t idx, rpc_object_t value) {
 			struct rpct_error_context newctx;
 			char *name = g_strdup_printf("%zu", idx);
 			bool ret;
 
-			rpct_derive_error_context(&newctx, errctx, name);
+			rpct_derive_error_context(&newctx, ctx, name);
 			ret = rpct_validate_instance(value_typei, value, &newctx);
 			rpct_release_error_context(&newctx);
 			g_free(name);
-			return (ret);
+			if (ret)
+				return ((bool)true);
+
+			g_atomic_int_set(&invalid, 1);
+			return ((bool)(ctx->limit != 0 &&
+			    !rpct_error_limit_reached(ctx)));
 		});
+		fail = fail || invalid != 0;
 		break;
 
 	case RPC_TYPE_DICTIONARY:
+		if (parallel) {
+			fail = !container_validate_dict(value_typei, obj, ctx);
+			break;
+		}
+
 		fail = rpc_dictionary_apply(obj, ^(const char *key, rpc_object_t value) {
 			struct rpct_error_context newctx;
 			bool ret;
 
-			rpct_derive_error_context(&newctx, errctx, key);
+			rpct_derive_error_context(&newctx, ctx, key);
 			ret = rpct_validate_instance(value_typei, value, &newctx);
 			rpct_release_error_context(&newctx);
-			return (ret);
+			if (ret)
+				return ((bool)true);
+
+			g_atomic_int_set(&invalid, 1);
+			return ((bool)(ctx->limit != 0 &&
+			    !rpct_error_limit_reached(ctx)));
 		});
+		fail = fail || invalid != 0;
 		break;
 
 	default:
@@ -76,6 +188,9 @@ container_validate(struct rpct_typei *typei, rpc_object_t obj,
 		break;
 	}
 
+	if (ctx == &pctx)
+		g_mutex_clear(&mtx);
+
 	if (fail)
 		return (false);
 
@@ -68,14 +68,15 @@ enum_validate(struct rpct_typei *typei, rpc_object_t obj,
 static rpc_object_t
 enum_serialize(rpc_object_t obj)
 {
+	rpc_object_t result;
 
 	assert(obj != NULL);
 	assert(obj->ro_typei != NULL);
 	assert(rpc_get_type(obj) == RPC_TYPE_STRING);
 
-	return (rpc_object_pack("{s,v}",
-	    RPCT_TYPE_FIELD, obj->ro_typei->canonical_form,
-	    RPCT_VALUE_FIELD, rpc_copy(obj)));
+	result = rpc_object_pack("{v}", RPCT_VALUE_FIELD, rpc_copy(obj));
+	rpct_set_type_field(result, obj->ro_typei);
+	return (result);
 }
 
 static rpc_object_t
@@ -118,6 +118,12 @@ struct_serialize(rpc_object_t obj)
 	assert(obj->ro_typei != NULL);
 	assert(rpc_get_type(obj) == RPC_TYPE_DICTIONARY);
 
+	if (rpct_compact_enabled()) {
+		result = rpct_compact_struct(obj);
+		if (result != NULL)
+			return (result);
+	}
+
 	result = rpc_dictionary_create();
 
 	/* Serialize every member */
@@ -126,8 +132,7 @@ struct_serialize(rpc_object_t obj)
 		return ((bool)true);
 	});
 
-	rpc_dictionary_set_string(result, RPCT_TYPE_FIELD,
-	    obj->ro_typei->canonical_form);
+	rpct_set_type_field(result, obj->ro_typei);
 
 	return (result);
 }
@@ -144,7 +149,8 @@ struct_deserialize(rpc_object_t obj)
 
 	/* Serialize every member */
 	rpc_dictionary_apply(obj, ^(const char *key, rpc_object_t value) {
-		if (g_strcmp0(key, RPCT_TYPE_FIELD) == 0)
+		if (g_strcmp0(key, RPCT_TYPE_FIELD) == 0 ||
+		    g_strcmp0(key, RPCT_TYPE_ID_FIELD) == 0)
 			return ((bool)true);
 
 		rpc_dictionary_steal_value(result, key, rpct_deserialize(value));
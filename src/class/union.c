@@ -29,6 +29,9 @@
 #include "../linker_set.h"
 #include "../internal.h"
 
+static bool union_branch_accepts(struct rpct_typei *, rpc_type_t);
+static struct rpct_union_branches *union_build_branches(struct rpct_typei *);
+
 static struct rpct_member *union_read_member(const char *decl,
     rpc_object_t obj, struct rpct_type *type)
 {
@@ -66,34 +69,109 @@ static struct rpct_member *union_read_member(const char *decl,
 	return (member);
 }
 
+/*
+ * Tells whether a branch of the given (specialized) type can match an
+ * object of the given builtin type at all. Anything not known for sure
+ * is kept as a candidate.
+ */
+static bool
+union_branch_accepts(struct rpct_typei *mtypei, rpc_type_t type)
+{
+	struct rpct_typei *raw;
+
+	raw = mtypei->proxy ? NULL : rpct_unwind_typei(mtypei);
+	if (raw == NULL || raw->proxy)
+		return (true);
+
+	switch (raw->type->clazz) {
+	case RPC_TYPING_BUILTIN:
+		if (g_strcmp0(raw->canonical_form, "any") == 0)
+			return (true);
+
+		if (g_strcmp0(raw->canonical_form, "nullptr") == 0)
+			return (type == RPC_TYPE_NULL);
+
+		return (g_strcmp0(raw->canonical_form,
+		    rpc_get_type_name(type)) == 0);
+
+	case RPC_TYPING_STRUCT:
+		return (type == RPC_TYPE_DICTIONARY);
+
+	case RPC_TYPING_ENUM:
+		return (type == RPC_TYPE_STRING);
+
+	default:
+		return (true);
+	}
+}
+
+static struct rpct_union_branches *
+union_build_branches(struct rpct_typei *typei)
+{
+	struct rpct_union_branches *branches;
+	guint i;
+
+	branches = g_malloc0(sizeof(*branches));
+	for (i = 0; i < RPCT_BUILTIN_COUNT; i++)
+		branches->rub_members[i] = g_ptr_array_new();
+
+	rpct_members_apply(typei->type, ^(struct rpct_member *member) {
+		struct rpct_typei *mtypei;
+		guint t;
+
+		mtypei = rpct_typei_get_member_type(typei, member);
+		for (t = 0; t < RPCT_BUILTIN_COUNT; t++) {
+			if (union_branch_accepts(mtypei, (rpc_type_t)t))
+				g_ptr_array_add(branches->rub_members[t], member);
+		}
+
+		return ((bool)true);
+	});
+
+	return (branches);
+}
+
 static bool
 union_validate(struct rpct_typei *typei, rpc_object_t obj,
     struct rpct_error_context *errctx)
 {
-	__block struct rpct_typei *mtypei;
-	__block rpc_object_t interior = NULL;
+	struct rpct_union_branches *branches;
+	struct rpct_typei *mtypei = NULL;
+	rpc_object_t interior = NULL;
+	GPtrArray *members;
+	guint i;
 	bool ret;
 
-	ret = rpct_members_apply(typei->type, ^(struct rpct_member *member) {
+	if (g_once_init_enter(&typei->branches)) {
+		branches = union_build_branches(typei);
+		g_once_init_leave(&typei->branches, branches);
+	}
+
+	/*
+	 * Branches are still instantiated on every call, because doing so
+	 * also swaps in the member's constraints.
+	 */
+	members = typei->branches->rub_members[obj->ro_type];
+	for (i = 0; i < members->len; i++) {
 		struct rpct_error_context newctx = {
 			.path = errctx->path,
 			.errors = g_ptr_array_new()
 		};
 
-		mtypei = rpct_typei_get_member_type(typei, member);
+		mtypei = rpct_typei_get_member_type(typei,
+		    g_ptr_array_index(members, i));
 		interior = rpc_copy(obj);
 		rpct_set_typei(mtypei, interior);
 
-		if (rpct_validate_instance(mtypei, interior, &newctx)) {
-			g_ptr_array_free(newctx.errors, true);
-			return ((bool)false);
-		}
-
+		ret = rpct_validate_instance(mtypei, interior, &newctx);
 		g_ptr_array_free(newctx.errors, true);
-		return ((bool)true);
-	});
+		if (ret)
+			break;
+
+		rpc_release(interior);
+	}
 
-	if (!ret) {
+	if (i == members->len) {
 		rpct_add_error(errctx, NULL,
 		    "None of the union branches matches the object");
 		return (false);
@@ -107,13 +185,14 @@ union_validate(struct rpct_typei *typei, rpc_object_t obj,
 static rpc_object_t
 union_serialize(rpc_object_t obj)
 {
+	rpc_object_t result;
 
 	assert(obj != NULL);
 	assert(obj->ro_typei != NULL);
 
-	return (rpc_object_pack("{s,v}",
-	    RPCT_TYPE_FIELD, obj->ro_typei->canonical_form,
-	    RPCT_VALUE_FIELD, rpc_copy(obj)));
+	result = rpc_object_pack("{v}", RPCT_VALUE_FIELD, rpc_copy(obj));
+	rpct_set_type_field(result, obj->ro_typei);
+	return (result);
 }
 
 static rpc_object_t
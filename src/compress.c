@@ -0,0 +1,260 @@
+/*
+ * Copyright 2015-2017 Two Pore Guys, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <glib.h>
+#ifdef LZ4_SUPPORT
+#include <lz4.h>
+#endif
+#ifdef ZSTD_SUPPORT
+#include <zstd.h>
+#endif
+#include "internal.h"
+#include "compress.h"
+#include "serializer/msgpack.h"
+
+/* ext 32 header, codec ID, original size */
+#define	COMPRESS_HDR_SIZE	11
+#define	COMPRESS_MAX_FRAME	(256 * 1024 * 1024)
+
+/*
+ * Receivers allocate the original size up front, so it may be at most
+ * this many times the compressed payload. LZ4 never gets past it; zstd
+ * frames that would are sent uncompressed instead.
+ */
+#define	COMPRESS_MAX_RATIO	255
+
+struct rpc_compressor
+{
+	int			rcm_codec;
+#ifdef ZSTD_SUPPORT
+	GMutex			rcm_mtx;
+	ZSTD_CCtx *		rcm_cctx;
+	ZSTD_DCtx *		rcm_dctx;
+	ZSTD_CDict *		rcm_cdict;
+	ZSTD_DDict *		rcm_ddict;
+#endif
+};
+
+struct rpc_compressor *
+rpc_compressor_new(const char *codec, const void *dict, size_t dictlen)
+{
+	struct rpc_compressor *comp;
+
+	comp = g_malloc0(sizeof(*comp));
+
+#ifdef LZ4_SUPPORT
+	if (g_strcmp0(codec, "lz4") == 0)
+		comp->rcm_codec = RPC_COMPRESS_LZ4;
+#endif
+#ifdef ZSTD_SUPPORT
+	if (g_strcmp0(codec, "zstd") == 0) {
+		comp->rcm_codec = RPC_COMPRESS_ZSTD;
+		g_mutex_init(&comp->rcm_mtx);
+		comp->rcm_cctx = ZSTD_createCCtx();
+		comp->rcm_dctx = ZSTD_createDCtx();
+		if (dict != NULL && dictlen > 0) {
+			comp->rcm_cdict = ZSTD_createCDict(dict, dictlen,
+			    ZSTD_CLEVEL_DEFAULT);
+			comp->rcm_ddict = ZSTD_createDDict(dict, dictlen);
+		}
+	}
+#endif
+
+	if (comp->rcm_codec == 0) {
+		rpc_set_last_errorf(ENOTSUP, "Unsupported compression codec %s",
+		    codec);
+		g_free(comp);
+		return (NULL);
+	}
+
+	return (comp);
+}
+
+void
+rpc_compressor_free(struct rpc_compressor *comp)
+{
+
+	if (comp == NULL)
+		return;
+
+#ifdef ZSTD_SUPPORT
+	if (comp->rcm_codec == RPC_COMPRESS_ZSTD) {
+		ZSTD_freeCCtx(comp->rcm_cctx);
+		ZSTD_freeDCtx(comp->rcm_dctx);
+		ZSTD_freeCDict(comp->rcm_cdict);
+		ZSTD_freeDDict(comp->rcm_ddict);
+		g_mutex_clear(&comp->rcm_mtx);
+	}
+#endif
+
+	g_free(comp);
+}
+
+/*
+ * Returns NULL when the frame does not shrink. Callers serialize sends,
+ * so the compression context needs no locking.
+ */
+GBytes *
+rpc_compress_frame(struct rpc_compressor *comp, const void *buf, size_t len)
+{
+	uint8_t *out;
+	size_t bound = 0;
+	size_t size = 0;
+	uint32_t val;
+
+	if (len > COMPRESS_MAX_FRAME)
+		return (NULL);
+
+#ifdef LZ4_SUPPORT
+	if (comp->rcm_codec == RPC_COMPRESS_LZ4)
+		bound = (size_t)LZ4_compressBound((int)len);
+#endif
+#ifdef ZSTD_SUPPORT
+	if (comp->rcm_codec == RPC_COMPRESS_ZSTD)
+		bound = ZSTD_compressBound(len);
+#endif
+
+	out = g_malloc(COMPRESS_HDR_SIZE + bound);
+
+#ifdef LZ4_SUPPORT
+	if (comp->rcm_codec == RPC_COMPRESS_LZ4) {
+		size = (size_t)MAX(LZ4_compress_default(buf,
+		    (char *)out + COMPRESS_HDR_SIZE, (int)len, (int)bound), 0);
+	}
+#endif
+#ifdef ZSTD_SUPPORT
+	if (comp->rcm_codec == RPC_COMPRESS_ZSTD) {
+		size = comp->rcm_cdict != NULL
+		    ? ZSTD_compress_usingCDict(comp->rcm_cctx,
+			out + COMPRESS_HDR_SIZE, bound, buf, len, comp->rcm_cdict)
+		    : ZSTD_compressCCtx(comp->rcm_cctx,
+			out + COMPRESS_HDR_SIZE, bound, buf, len,
+			ZSTD_CLEVEL_DEFAULT);
+
+		if (ZSTD_isError(size))
+			size = 0;
+	}
+#endif
+
+	if (size == 0 || COMPRESS_HDR_SIZE + size >= len ||
+	    len / COMPRESS_MAX_RATIO > size) {
+		g_free(out);
+		return (NULL);
+	}
+
+	out[0] = 0xc9;
+	val = GUINT32_TO_BE((uint32_t)(size + COMPRESS_HDR_SIZE - 6));
+	memcpy(&out[1], &val, sizeof(val));
+	out[5] = MSGPACK_EXTTYPE_COMPRESSED;
+	out[6] = (uint8_t)comp->rcm_codec;
+	val = GUINT32_TO_BE((uint32_t)len);
+	memcpy(&out[7], &val, sizeof(val));
+
+	return (g_bytes_new_take(out, COMPRESS_HDR_SIZE + size));
+}
+
+bool
+rpc_frame_is_compressed(const void *buf, size_t len)
+{
+	const uint8_t *data = buf;
+
+	return (len > COMPRESS_HDR_SIZE && data[0] == 0xc9 &&
+	    data[5] == MSGPACK_EXTTYPE_COMPRESSED);
+}
+
+/*
+ * Only frames in the codec negotiated for the connection are accepted.
+ * The original size is checked before anything is allocated, so a small
+ * frame can't make us set aside a huge buffer.
+ */
+GBytes *
+rpc_decompress_frame(struct rpc_compressor *comp, const void *buf, size_t len)
+{
+	const uint8_t *data = buf;
+	uint8_t *out;
+	uint32_t val;
+	size_t extlen;
+	size_t size;
+	bool ok = false;
+
+	if (comp == NULL || data[6] != comp->rcm_codec) {
+		rpc_set_last_errorf(EPROTO,
+		    "Compressed frame without negotiated compression");
+		return (NULL);
+	}
+
+	memcpy(&val, &data[1], sizeof(val));
+	extlen = GUINT32_FROM_BE(val);
+	memcpy(&val, &data[7], sizeof(val));
+	size = GUINT32_FROM_BE(val);
+	if (extlen + 6 != len || extlen < COMPRESS_HDR_SIZE - 6) {
+		rpc_set_last_errorf(EINVAL, "Malformed compressed frame");
+		return (NULL);
+	}
+
+	if (size > COMPRESS_MAX_FRAME ||
+	    size / COMPRESS_MAX_RATIO > len - COMPRESS_HDR_SIZE) {
+		rpc_set_last_errorf(EFBIG, "Compressed frame too large");
+		return (NULL);
+	}
+
+	data += COMPRESS_HDR_SIZE;
+	len -= COMPRESS_HDR_SIZE;
+	out = g_malloc(MAX(size, 1));
+
+	switch (((const uint8_t *)buf)[6]) {
+#ifdef LZ4_SUPPORT
+	case RPC_COMPRESS_LZ4:
+		ok = LZ4_decompress_safe((const char *)data, (char *)out,
+		    (int)len, (int)size) == (int)size;
+		break;
+#endif
+#ifdef ZSTD_SUPPORT
+	case RPC_COMPRESS_ZSTD:
+		g_mutex_lock(&comp->rcm_mtx);
+		ok = (comp->rcm_ddict != NULL
+		    ? ZSTD_decompress_usingDDict(comp->rcm_dctx, out, size,
+			data, len, comp->rcm_ddict)
+		    : ZSTD_decompressDCtx(comp->rcm_dctx, out, size, data,
+			len)) == size;
+		g_mutex_unlock(&comp->rcm_mtx);
+		break;
+#endif
+	default:
+		break;
+	}
+
+	if (!ok) {
+		rpc_set_last_errorf(EINVAL, "Cannot decompress frame");
+		g_free(out);
+		return (NULL);
+	}
+
+	return (g_bytes_new_take(out, size));
+}
@@ -0,0 +1,55 @@
+/*
+ * Copyright 2015-2017 Two Pore Guys, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef LIBRPC_COMPRESS_H
+#define LIBRPC_COMPRESS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <glib.h>
+
+/*
+ * Frame compression. A compressed frame is a msgpack ext carrying the
+ * codec ID, the size of the original frame and the compressed data. No
+ * regular frame starts like that, so receivers tell compressed frames
+ * apart without any help from the transport.
+ */
+#define	RPC_COMPRESS_LZ4	1
+#define	RPC_COMPRESS_ZSTD	2
+
+struct rpc_compressor;
+
+struct rpc_compressor *rpc_compressor_new(const char *codec, const void *dict,
+    size_t dictlen);
+void rpc_compressor_free(struct rpc_compressor *comp);
+GBytes *rpc_compress_frame(struct rpc_compressor *comp, const void *buf,
+    size_t len);
+bool rpc_frame_is_compressed(const void *buf, size_t len);
+GBytes *rpc_decompress_frame(struct rpc_compressor *comp, const void *buf,
+    size_t len);
+
+#endif /* LIBRPC_COMPRESS_H */
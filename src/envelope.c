@@ -0,0 +1,78 @@
+/*
+ * Copyright 2015-2017 Two Pore Guys, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+#include <string.h>
+#include <glib.h>
+#include "envelope.h"
+
+bool
+rpc_frame_is_enveloped(const void *buf, size_t len)
+{
+	const uint8_t *data = buf;
+
+	return (len >= RPC_ENVELOPE_HDR_SIZE && data[0] == RPC_ENVELOPE_MAGIC);
+}
+
+void
+rpc_envelope_encode(const struct rpc_envelope *env, uint8_t *hdr)
+{
+	uint32_t deadline;
+	uint64_t id;
+
+	hdr[0] = RPC_ENVELOPE_MAGIC;
+	hdr[1] = (uint8_t)env->re_op;
+	hdr[2] = env->re_flags;
+	hdr[3] = 0;
+
+	deadline = GUINT32_TO_LE(env->re_deadline);
+	id = GUINT64_TO_LE(env->re_id);
+	memcpy(&hdr[4], &deadline, sizeof(deadline));
+	memcpy(&hdr[8], &id, sizeof(id));
+}
+
+int
+rpc_envelope_decode(const void *buf, size_t len, struct rpc_envelope *env)
+{
+	const uint8_t *hdr = buf;
+	uint32_t deadline;
+	uint64_t id;
+
+	if (!rpc_frame_is_enveloped(buf, len) || hdr[3] != 0)
+		return (-1);
+
+	if (hdr[1] == RPC_OP_NONE || hdr[1] >= RPC_OP_MAX)
+		return (-1);
+
+	memcpy(&deadline, &hdr[4], sizeof(deadline));
+	memcpy(&id, &hdr[8], sizeof(id));
+	env->re_op = (rpc_frame_op_t)hdr[1];
+	env->re_flags = hdr[2];
+	env->re_deadline = GUINT32_FROM_LE(deadline);
+	env->re_id = GUINT64_FROM_LE(id);
+	return (0);
+}
@@ -0,0 +1,99 @@
+/*
+ * Copyright 2015-2017 Two Pore Guys, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+#ifndef LIBRPC_ENVELOPE_H
+#define LIBRPC_ENVELOPE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Compact frame envelope. A fixed header stands in for the namespace,
+ * name and id keys of the dictionary envelope and is followed by the
+ * msgpack encoded args. It starts with 0xc1, a byte msgpack never
+ * uses, so receivers tell both envelopes apart by the first byte.
+ *
+ *   0		magic
+ *   1		opcode
+ *   2		flags
+ *   3		reserved, zero
+ *   4..7	deadline of a call in milliseconds, little endian
+ *   8..15	call ID, little endian
+ */
+#define	RPC_ENVELOPE_MAGIC	0xc1
+#define	RPC_ENVELOPE_HDR_SIZE	16
+
+#define	RPC_ENVELOPE_NO_ID	0x01	/* The frame has a null ID */
+#define	RPC_ENVELOPE_DEADLINE	0x02	/* The deadline field is valid */
+
+/*
+ * Opcodes are part of the wire format, so new ones only ever go at the
+ * end. They also index the connection's dispatch table.
+ */
+typedef enum rpc_frame_op
+{
+	RPC_OP_NONE = 0,
+	RPC_OP_CALL,
+	RPC_OP_CALL_BATCH,
+	RPC_OP_RESPONSE,
+	RPC_OP_START_STREAM,
+	RPC_OP_FRAGMENT,
+	RPC_OP_CONTINUE,
+	RPC_OP_INPUT,
+	RPC_OP_INPUT_END,
+	RPC_OP_INPUT_CONTINUE,
+	RPC_OP_END,
+	RPC_OP_ABORT,
+	RPC_OP_ERROR,
+	RPC_OP_EVENT,
+	RPC_OP_EVENT_BURST,
+	RPC_OP_SUBSCRIBE,
+	RPC_OP_UNSUBSCRIBE,
+	RPC_OP_RING_ATTACH,
+	RPC_OP_RING,
+	RPC_OP_SESSION_TOKEN,
+	RPC_OP_SESSION_RESUME,
+	RPC_OP_SESSION_RESUMED,
+	RPC_OP_MAX
+} rpc_frame_op_t;
+
+struct rpc_envelope
+{
+	rpc_frame_op_t		re_op;
+	uint8_t			re_flags;
+	uint32_t		re_deadline;
+	uint64_t		re_id;
+};
+
+bool rpc_frame_is_enveloped(const void *buf, size_t len);
+void rpc_envelope_encode(const struct rpc_envelope *env, uint8_t *hdr);
+int rpc_envelope_decode(const void *buf, size_t len,
+    struct rpc_envelope *env);
+
+#endif /* LIBRPC_ENVELOPE_H */
@@ -0,0 +1,240 @@
+/*
+ * Copyright 2015-2017 Two Pore Guys, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+#include <glib.h>
+#include "fiber.h"
+#include "thread.h"
+
+struct rpc_fiber
+{
+	ucontext_t		rf_context;
+	ucontext_t *		rf_return;
+	struct rpc_fiber_sched *rf_sched;
+	void *			rf_stack;
+	size_t			rf_stack_size;
+	rpc_fiber_fn_t		rf_fn;
+	void *			rf_item;
+	void *			rf_arg;
+	GMutex *		rf_unlock;
+	bool			rf_done;
+};
+
+struct rpc_fiber_sched
+{
+	GAsyncQueue *		rfs_ready;
+	GThread **		rfs_threads;
+	guint			rfs_nthreads;
+};
+
+static void rpc_fiber_main(void);
+static void rpc_fiber_free(struct rpc_fiber *fiber);
+static void *rpc_fiber_sched_thread(void *arg);
+
+static GPrivate rpc_fiber_current;
+
+static void
+rpc_fiber_main(void)
+{
+	struct rpc_fiber *fiber;
+
+	fiber = g_private_get(&rpc_fiber_current);
+	fiber->rf_fn(fiber->rf_item, fiber->rf_arg);
+
+	/* We may have moved threads, so rf_return is whoever runs us now */
+	fiber->rf_done = true;
+	setcontext(fiber->rf_return);
+}
+
+static void
+rpc_fiber_free(struct rpc_fiber *fiber)
+{
+
+	munmap(fiber->rf_stack, fiber->rf_stack_size);
+	g_free(fiber);
+}
+
+static void *
+rpc_fiber_sched_thread(void *arg)
+{
+	struct rpc_fiber_sched *sched = arg;
+	struct rpc_fiber *fiber;
+	ucontext_t self;
+	GMutex *unlock;
+	bool done;
+
+	for (;;) {
+		fiber = g_async_queue_pop(sched->rfs_ready);
+		if (fiber == (struct rpc_fiber *)sched)
+			break;
+
+		fiber->rf_return = &self;
+		g_private_set(&rpc_fiber_current, fiber);
+		swapcontext(&self, &fiber->rf_context);
+		g_private_set(&rpc_fiber_current, NULL);
+
+		/*
+		 * The fiber is off its stack now. Once the mutex is
+		 * released, a waker may hand it to another thread, so
+		 * nothing about it can be touched after that.
+		 */
+		done = fiber->rf_done;
+		unlock = fiber->rf_unlock;
+		fiber->rf_unlock = NULL;
+		if (unlock != NULL)
+			g_mutex_unlock(unlock);
+
+		if (done)
+			rpc_fiber_free(fiber);
+	}
+
+	return (NULL);
+}
+
+struct rpc_fiber_sched *
+rpc_fiber_sched_new(guint nthreads)
+{
+	struct rpc_fiber_sched *sched;
+	guint i;
+
+	if (nthreads == 0)
+		nthreads = g_get_num_processors();
+
+	sched = g_malloc0(sizeof(*sched));
+	sched->rfs_ready = g_async_queue_new();
+	sched->rfs_nthreads = MIN(nthreads, RPC_FIBER_MAX_THREADS);
+	sched->rfs_threads = g_malloc0_n(sched->rfs_nthreads,
+	    sizeof(GThread *));
+
+	for (i = 0; i < sched->rfs_nthreads; i++) {
+		sched->rfs_threads[i] = rpc_thread_new(RPC_THREAD_WORKER,
+		    "librpc fiber", rpc_fiber_sched_thread, sched);
+	}
+
+	return (sched);
+}
+
+void
+rpc_fiber_sched_free(struct rpc_fiber_sched *sched)
+{
+	guint i;
+
+	if (sched == NULL)
+		return;
+
+	/* The scheduler itself is the stop marker, once per thread */
+	for (i = 0; i < sched->rfs_nthreads; i++)
+		g_async_queue_push(sched->rfs_ready, sched);
+
+	for (i = 0; i < sched->rfs_nthreads; i++)
+		g_thread_join(sched->rfs_threads[i]);
+
+	g_async_queue_unref(sched->rfs_ready);
+	g_free(sched->rfs_threads);
+	g_free(sched);
+}
+
+int
+rpc_fiber_spawn(struct rpc_fiber_sched *sched, rpc_fiber_fn_t fn,
+    void *item, void *arg)
+{
+	struct rpc_fiber *fiber;
+	size_t page;
+
+	page = (size_t)sysconf(_SC_PAGESIZE);
+	fiber = g_malloc0(sizeof(*fiber));
+	fiber->rf_sched = sched;
+	fiber->rf_fn = fn;
+	fiber->rf_item = item;
+	fiber->rf_arg = arg;
+	fiber->rf_stack_size = RPC_FIBER_STACK_SIZE + page;
+	fiber->rf_stack = mmap(NULL, fiber->rf_stack_size,
+	    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK,
+	    -1, 0);
+
+	if (fiber->rf_stack == MAP_FAILED) {
+		g_free(fiber);
+		return (-1);
+	}
+
+	/* Stacks grow down, so the guard page goes at the bottom */
+	if (mprotect(fiber->rf_stack, page, PROT_NONE) != 0 ||
+	    getcontext(&fiber->rf_context) != 0) {
+		rpc_fiber_free(fiber);
+		return (-1);
+	}
+
+	fiber->rf_context.uc_stack.ss_sp = (char *)fiber->rf_stack + page;
+	fiber->rf_context.uc_stack.ss_size = RPC_FIBER_STACK_SIZE;
+	fiber->rf_context.uc_link = NULL;
+	makecontext(&fiber->rf_context, rpc_fiber_main, 0);
+	g_async_queue_push(sched->rfs_ready, fiber);
+	return (0);
+}
+
+struct rpc_fiber *
+rpc_fiber_self(void)
+{
+
+	return (g_private_get(&rpc_fiber_current));
+}
+
+void
+rpc_fiber_park(GSList **waiters, GMutex *mtx)
+{
+	struct rpc_fiber *fiber;
+
+	fiber = g_private_get(&rpc_fiber_current);
+	g_assert(fiber != NULL);
+
+	*waiters = g_slist_prepend(*waiters, fiber);
+	fiber->rf_unlock = mtx;
+	swapcontext(&fiber->rf_context, fiber->rf_return);
+
+	/* Resumed, possibly elsewhere; the scheduler dropped the mutex */
+	g_mutex_lock(mtx);
+}
+
+void
+rpc_fiber_wake_all(GSList **waiters)
+{
+	struct rpc_fiber *fiber;
+	GSList *iter;
+
+	for (iter = *waiters; iter != NULL; iter = iter->next) {
+		fiber = iter->data;
+		g_async_queue_push(fiber->rf_sched->rfs_ready, fiber);
+	}
+
+	g_slist_free(*waiters);
+	*waiters = NULL;
+}
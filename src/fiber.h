@@ -0,0 +1,101 @@
+/*
+ * Copyright 2015-2017 Two Pore Guys, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef LIBRPC_FIBER_H
+#define LIBRPC_FIBER_H
+
+#include <stdbool.h>
+#include <glib.h>
+
+/*
+ * M:N user-space threads. A scheduler runs any number of fibers on a
+ * small, fixed set of OS threads; a fiber that has to wait for a
+ * condition parks itself instead of blocking the thread, which then
+ * goes on to run the next ready fiber. A parked fiber may be resumed
+ * on a different thread than the one it parked on.
+ *
+ * Parking is done under the caller's mutex: the fiber joins a waiter
+ * list, and the mutex is only released once the fiber is off its
+ * stack, so a wakeup can't slip in between. Whoever signals the
+ * condition calls rpc_fiber_wake_all() with the same mutex held.
+ *
+ * Fibers are only available where ucontext(3) is, which currently
+ * means Linux. Elsewhere rpc_fiber_sched_new() returns NULL and
+ * rpc_fiber_self() is always NULL, so callers fall back to threads.
+ */
+#if defined(__linux__)
+#define	RPC_HAVE_FIBERS		1
+#endif
+
+#define	RPC_FIBER_STACK_SIZE	(256 * 1024)
+#define	RPC_FIBER_MAX_THREADS	64
+
+struct rpc_fiber;
+struct rpc_fiber_sched;
+
+typedef void (*rpc_fiber_fn_t)(void *item, void *arg);
+
+#if defined(RPC_HAVE_FIBERS)
+struct rpc_fiber_sched *rpc_fiber_sched_new(guint nthreads);
+void rpc_fiber_sched_free(struct rpc_fiber_sched *sched);
+int rpc_fiber_spawn(struct rpc_fiber_sched *sched, rpc_fiber_fn_t fn,
+    void *item, void *arg);
+struct rpc_fiber *rpc_fiber_self(void);
+void rpc_fiber_park(GSList **waiters, GMutex *mtx);
+void rpc_fiber_wake_all(GSList **waiters);
+#else
+static inline struct rpc_fiber_sched *
+rpc_fiber_sched_new(guint nthreads __attribute__((unused)))
+{
+
+	return (NULL);
+}
+
+static inline void
+rpc_fiber_sched_free(struct rpc_fiber_sched *sched __attribute__((unused)))
+{
+
+}
+
+static inline int
+rpc_fiber_spawn(struct rpc_fiber_sched *sched __attribute__((unused)),
+    rpc_fiber_fn_t fn __attribute__((unused)),
+    void *item __attribute__((unused)), void *arg __attribute__((unused)))
+{
+
+	return (-1);
+}
+
+static inline struct rpc_fiber *
+rpc_fiber_self(void)
+{
+
+	return (NULL);
+}
+#endif
+
+#endif /* LIBRPC_FIBER_H */
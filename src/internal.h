@@ -30,6 +30,10 @@
 
 #include <stdatomic.h>
 #include <stdio.h>
+#include <string.h>
+#ifndef _WIN32
+#include <sys/uio.h>
+#endif
 #include <glib.h>
 #include <rpc/object.h>
 #include <rpc/query.h>
@@ -39,11 +43,18 @@
 #include <rpc/server.h>
 #include <rpc/bus.h>
 #include <rpc/typing.h>
+#include <rpc/trace.h>
 #ifdef LIBDISPATCH_SUPPORT
 #include <dispatch/dispatch.h>
 #endif
 #include "linker_set.h"
 #include "notify.h"
+#include "rcu.h"
+#include "timer.h"
+#include "workq.h"
+#include "fiber.h"
+#include "thread.h"
+#include "probes.h"
 
 #ifndef __unused
 #define __unused __attribute__((unused))
@@ -63,6 +74,46 @@
 #define RPC_TRANSPORT_FD_PASSING		(1 << 2)
 #define	RPC_TRANSPORT_NO_RPCT_SERIALIZE		(1 << 3)
 
+/*
+ * Well-known dictionary keys. Atoms live in one static block, so a key
+ * can be recognized as an atom by its address alone: dictionaries store
+ * atom keys without duplicating them and use precomputed hashes.
+ */
+#define	RPC_ATOMS(X)					\
+	X(NAMESPACE, "namespace")			\
+	X(NAME, "name")					\
+	X(ID, "id")					\
+	X(ARGS, "args")					\
+	X(PATH, "path")					\
+	X(INTERFACE, "interface")			\
+	X(METHOD, "method")				\
+	X(SEQNO, "seqno")				\
+	X(INCREMENT, "increment")			\
+	X(FRAGMENT, "fragment")				\
+	X(CODE, "code")					\
+	X(MESSAGE, "message")				\
+	X(EXTRA, "extra")				\
+	X(STACK, "stack")				\
+	X(PRIORITY, "priority")				\
+	X(TIMEOUT, "timeout")				\
+	X(BYTES, "bytes")				\
+	X(FRAGMENTS, "fragments")			\
+	X(BATCH, "batch")				\
+	X(TRACEPARENT, "traceparent")			\
+	X(TYPE, RPCT_TYPE_FIELD)			\
+	X(VALUE, RPCT_VALUE_FIELD)
+
+#define	RPC_ATOM_FIELD(_id, _str)	char _id[sizeof(_str)];
+
+struct rpc_atom_storage
+{
+	RPC_ATOMS(RPC_ATOM_FIELD)
+};
+
+#undef RPC_ATOM_FIELD
+
+#define	RPC_ATOM(_id)	((const char *)rpc_atoms._id)
+
 #if RPC_DEBUG
 #define debugf(...) 				\
     do { 					\
@@ -86,27 +137,150 @@
 #define CONNECTION_ABORTED	(1 << 1)
 #define CONNECTION_RELEASED	(1 << 2)
 
+/*
+ * Frames are serialized into a per-connection buffer of this size.
+ * On transports that support it, larger frames are streamed out in
+ * chunks of this size rather than being built in memory first.
+ */
+#define	RPC_SEND_CHUNK_SIZE	(64 * 1024)
+
+/*
+ * Received frames larger than RPC_RECV_STREAM_MIN are parsed while they
+ * are being read, through a read buffer of RPC_RECV_CHUNK_SIZE, instead
+ * of being buffered whole first. Parsing that way copies binaries out,
+ * so it only pays off well above the frames whose binaries are sliced
+ * out of the receive buffer.
+ */
+#define	RPC_RECV_CHUNK_SIZE	(64 * 1024)
+#define	RPC_RECV_STREAM_MIN	(16 * 1024 * 1024)
+
+/*
+ * Upper bound on frames coalesced into a single batched write, which
+ * keeps the transport's vector count well below IOV_MAX.
+ */
+#define	RPC_SEND_BATCH_MAX_FRAMES	256
+
+/*
+ * Default send queue watermarks, in frames
+ */
+#define	RPC_SEND_QUEUE_HIGH		64
+#define	RPC_SEND_QUEUE_LOW		16
+
+/*
+ * Default RPC_CONNECTION_COMPRESS_THRESHOLD: smaller frames rarely shrink
+ * enough to pay for the codec.
+ */
+#define	RPC_COMPRESS_THRESHOLD	4096
+
+/*
+ * Emitter shard count is capped at this many threads. A shard sends at
+ * most RPC_EMIT_QUANTUM events for one connection before moving on to
+ * the next one.
+ */
+#define	RPC_EMIT_MAX_SHARDS		8
+#define	RPC_EMIT_QUANTUM		64
+
+/*
+ * Events a suspended session keeps for its client; past that, the
+ * oldest ones go and the client is told some got lost.
+ */
+#define	RPC_SESSION_MAX_EVENTS		1024
+
+/*
+ * Number of instance registry shards, then Discoverable paging: the
+ * largest page list_instances returns, instances gathered per lock
+ * hold by stream_instances, and how many registry changes are kept
+ * for get_changes.
+ */
+#define	RPC_INSTANCE_SHARDS		16
+#define	RPC_INSTANCE_PAGE_MAX		1024
+#define	RPC_INSTANCE_STREAM_BATCH	256
+#define	RPC_INSTANCE_LOG_MAX		4096
+
+/*
+ * Bounds of the auto-tuned streaming window, in fragments. The window
+ * starts at RPC_STREAM_INITIAL_WINDOW and then tracks twice the number
+ * of fragments that arrive during one measured round trip.
+ */
+#define	RPC_STREAM_INITIAL_WINDOW	16
+#define	RPC_STREAM_MAX_WINDOW		4096
+
+/*
+ * Fragment batching: largest number of yielded objects packed into
+ * a single rpc.fragment frame, and the longest time, in milliseconds,
+ * the oldest of them may be held back.
+ */
+#define	RPC_FRAGMENT_BATCH_MAX		1024
+#define	RPC_FRAGMENT_BATCH_LATENCY	10
+
+/*
+ * Number of rpc.input fragments a client uploading call arguments may
+ * have sent and not yet seen consumed by the method.
+ */
+#define	RPC_INPUT_WINDOW		16
+
+/*
+ * Dates are kept as nanoseconds since the epoch.
+ */
+#define	RPC_DATE_NSEC_PER_SEC	1000000000LL
+
+/*
+ * Cached method results kept per instance. Once an instance is at the
+ * limit, new results are only stored after expired ones make room.
+ */
+#define	RPC_RESULT_CACHE_MAX	256
+#define	RPC_ADMISSION_MIN	1
+#define	RPC_ADMISSION_BACKOFF	0.9
+#define	RPC_ADMISSION_TOLERANCE	2.0
+#define	RPC_ADMISSION_SMOOTHING	20
+
+/*
+ * Key of the interface-wide and context-wide validation policies.
+ * Neither interface nor method names can contain it.
+ */
+#define	RPC_VALIDATION_ANY		"*"
+
 #ifdef _WIN32
 typedef int uid_t;
 typedef int gid_t;
+
+struct iovec
+{
+	void *			iov_base;
+	size_t			iov_len;
+};
 #endif
 
 struct rpc_connection;
 struct rpc_credentials;
 struct rpc_server;
 struct rpct_validator;
+struct rpct_validation_plan;
 struct rpct_error_context;
 
 typedef int (*rpc_recv_msg_fn_t)(struct rpc_connection *, const void *, size_t,
     int *, size_t);
+typedef int (*rpc_recv_bytes_fn_t)(struct rpc_connection *, GBytes *,
+    int *, size_t);
+typedef int (*rpc_recv_object_fn_t)(struct rpc_connection *, rpc_object_t,
+    int *, size_t);
 typedef int (*rpc_send_msg_fn_t)(void *, const void *, size_t, const int *, size_t);
+typedef int (*rpc_send_msgv_fn_t)(void *, const struct iovec *, size_t,
+    const int *, size_t);
+typedef int (*rpc_send_begin_fn_t)(void *, size_t, const int *, size_t);
+typedef int (*rpc_send_chunk_fn_t)(void *, const void *, size_t);
+typedef int (*rpc_send_batch_fn_t)(void *, const struct iovec *, size_t);
 typedef int (*rpc_abort_fn_t)(void *);
 typedef int (*rpc_get_fd_fn_t)(void *);
+typedef int (*rpc_detach_fn_t)(void *, GBytes **);
 typedef void (*rpc_release_fn_t)(void *);
 typedef int (*rpc_close_fn_t)(struct rpc_connection *);
 typedef int (*rpc_accept_fn_t)(struct rpc_server *, struct rpc_connection *);
 typedef bool (*rpc_valid_fn_t)(struct rpc_server *);
 typedef int (*rpc_teardown_fn_t)(struct rpc_server *);
+typedef int (*rpc_listen_fds_fn_t)(struct rpc_server *, int **, size_t *);
+typedef struct rpc_connection *(*rpc_adopt_fn_t)(struct rpc_server *, int,
+    const void *, size_t);
 typedef int (*rpc_set_creds_fn_t)(struct rpc_connection *, pid_t, uid_t, gid_t);
 
 typedef struct rpct_member *(*rpct_member_fn_t)(const char *, rpc_object_t,
@@ -128,12 +302,82 @@ typedef void (*rpc_fn_kill_fn_t)(void *);
 typedef bool (*rpc_fn_should_abt_fn_t)(void *);
 typedef void (*rpc_fn_set_abt_h_fn_t)(void *, rpc_abort_handler_t);
 
+typedef enum {
+	RPC_QUERY_RULE_FALSE,
+	RPC_QUERY_RULE_ALL,
+	RPC_QUERY_RULE_AND,
+	RPC_QUERY_RULE_OR,
+	RPC_QUERY_RULE_NOR,
+	RPC_QUERY_RULE_FIELD
+} rpc_query_rule_type_t;
+
+struct rpc_query_rule;
+typedef bool (*rpc_query_op_fn_t)(rpc_object_t, struct rpc_query_rule *);
+
+struct rpc_query_operator
+{
+	const char *		rqo_name;
+	rpc_query_op_fn_t	rqo_fn;
+};
+
+struct rpc_query_segment
+{
+	char *			rqs_key;
+	size_t			rqs_index;
+};
+
+struct rpc_query_rule
+{
+	rpc_query_rule_type_t	rqr_type;
+	GPtrArray *		rqr_children;
+	bool			rqr_has_path;
+	char *			rqr_path_str;
+	struct rpc_query_segment *rqr_path;
+	size_t			rqr_npath;
+	rpc_query_op_fn_t	rqr_op;
+	rpc_object_t		rqr_value;
+	GRegex *		rqr_regex;
+};
+
+struct rpc_query_plan
+{
+	volatile gint		rqp_refcnt;
+	struct rpc_query_rule *	rqp_root;
+};
+
+struct rpc_query_index_entry
+{
+	guint32			rqie_key;
+	guint			rqie_pos;
+};
+
+struct rpc_query_index_path
+{
+	char *			rqip_path;
+	rpc_query_index_type_t	rqip_type;
+	GHashTable *		rqip_hash;
+	GArray *		rqip_sorted;
+};
+
+struct rpc_query_index
+{
+	rpc_object_t		rqx_source;
+	GPtrArray *		rqx_paths;
+};
+
+struct rpc_query_top
+{
+	rpc_object_t		rqt_obj;
+	size_t			rqt_pos;
+};
+
 struct rpc_query_iter
 {
 	rpc_object_t 		rqi_source;
 	size_t 			rqi_idx;
-	rpc_object_t 		rqi_rules;
+	struct rpc_query_plan *	rqi_plan;
 	rpc_query_params_t 	rqi_params;
+	bool			rqi_reverse;
 	bool			rqi_done;
 	bool			rqi_initialized;
 	uint32_t		rqi_limit;
@@ -146,11 +390,39 @@ struct rpc_binary_value
 	rpc_binary_destructor_t rbv_destructor;
 };
 
+/*
+ * Strings up to RPC_INLINE_STRING_MAX bytes are stored inside the object
+ * itself; rsv_heap is NULL for those. It fits in the space already
+ * taken by struct rpc_error_value, so union rpc_value does not grow.
+ */
+#define	RPC_INLINE_STRING_MAX	22
+
+struct rpc_string_value
+{
+	char *			rsv_heap;
+	union {
+		size_t		rsv_length;
+		struct {
+			uint8_t	rsv_inline_length;
+			char	rsv_inline[RPC_INLINE_STRING_MAX + 1];
+		};
+	};
+};
+
 struct rpc_shmem_block
 {
     	int			rsb_fd;
     	off_t 			rsb_offset;
     	size_t 			rsb_size;
+	int64_t			rsb_region;
+};
+
+struct rpc_shmem_region
+{
+	dev_t			rsr_dev;
+	ino_t			rsr_ino;
+	int			rsr_fd;
+	int64_t			rsr_id;
 };
 
 struct rpc_error_value
@@ -161,12 +433,63 @@ struct rpc_error_value
 	rpc_object_t 		rev_stack;
 };
 
+/*
+ * Dictionary storage: entries are kept densely in insertion order.
+ * Dictionaries with up to RPC_DICT_LINEAR_MAX slots are searched
+ * linearly; bigger ones get an open-addressed index of entry numbers.
+ */
+#define	RPC_DICT_LINEAR_MAX	8
+#define	RPC_DICT_MIN_CAPACITY	4
+
+struct rpc_dict_entry
+{
+	char *			rde_key;
+	rpc_object_t		rde_value;	/* NULL if removed */
+	guint			rde_hash;
+};
+
+struct rpc_dict
+{
+	struct rpc_dict_entry *	rd_entries;
+	uint32_t *		rd_index;	/* entry number + 1, 0 if free */
+	uint32_t		rd_count;
+	uint32_t		rd_used;
+	uint32_t		rd_capacity;
+	uint32_t		rd_index_size;
+	volatile gint		rd_shares;	/* objects using this table */
+};
+
+/*
+ * Contiguous storage of an array whose elements all are int64, uint64
+ * or double. rv_list is NULL while an array is packed. The first call
+ * that needs its elements as objects, such as rpc_array_get_value(),
+ * boxes them into rv_list for good.
+ */
+#define	RPC_ARRAY_PACK_MIN	16
+
+struct rpc_packed_array
+{
+	rpc_type_t		rpa_type;
+	size_t			rpa_count;
+	size_t			rpa_capacity;
+	union {
+		int64_t *	rpa_int64;
+		uint64_t *	rpa_uint64;
+		double *	rpa_double;
+		void *		rpa_data;
+	};
+};
+
 union rpc_value
 {
-	GHashTable *		rv_dict;
-	GPtrArray *		rv_list;
-	GString *		rv_str;
-	GDateTime *		rv_datetime;
+	struct rpc_dict *	rv_dict;
+	struct {
+		GPtrArray *	rv_list;
+		struct rpc_packed_array *rv_packed;
+		volatile gint *	rv_shares;	/* NULL until copied */
+	};
+	struct rpc_string_value	rv_str;
+	int64_t			rv_date;	/* nanoseconds since the epoch */
 	uint64_t 		rv_ui;
 	int64_t			rv_i;
 	bool			rv_b;
@@ -179,16 +502,33 @@ union rpc_value
 #endif
 };
 
+/*
+ * Rarely needed per-object state, allocated on demand so that objects
+ * which never use it don't pay for it. Source positions are only ever
+ * set by the YAML parser.
+ */
+struct rpc_object_ext
+{
+	bool			roe_frozen;
+	uint32_t		roe_line;
+	uint32_t		roe_column;
+	size_t			roe_hash;
+	GBytes *		roe_packed;
+};
+
 struct rpc_object
 {
 	rpc_type_t		ro_type;
 	volatile int		ro_refcnt;
-	size_t			ro_line;
-	size_t			ro_column;
+	struct rpc_arena *	ro_arena;
+	struct rpc_object_ext *	ro_ext;
 	union rpc_value		ro_value;
 	struct rpct_typei *	ro_typei;
 };
 
+#define	RPC_OBJECT_FROZEN(_obj)						\
+	((_obj)->ro_ext != NULL && (_obj)->ro_ext->roe_frozen)
+
 struct rpc_subscription
 {
 	char *			rsu_name;
@@ -199,34 +539,120 @@ struct rpc_subscription
     	GPtrArray *		rsu_handlers;
 };
 
+/*
+ * Client-side copy of the properties of one remote interface, keyed
+ * on "path\ninterface" in rco_prop_cache and kept up to date from
+ * Observable.changed events.
+ */
+struct rpc_property_cache
+{
+	GHashTable *		rpr_values;
+	void *			rpr_cookie;
+};
+
+/*
+ * What's left of a server connection that went away with a session
+ * open, see RPC_SERVER_SESSION_GRACE: its subscriptions, and events
+ * matching them that its client missed. Kept in rcx_sessions until the
+ * client resumes or the grace period runs out.
+ */
+struct rpc_session
+{
+	char *			rse_token;
+	struct rpc_context *	rse_context;
+	struct rpc_server *	rse_server;
+	bool			rse_has_creds;
+	uid_t			rse_uid;
+	rpc_object_t		rse_subscriptions;
+	GMutex			rse_mtx;
+	GQueue			rse_events;
+	bool			rse_lost;
+	GSource *		rse_timer;
+	volatile gint		rse_refcnt;
+};
+
 struct rpc_subscription_handler
 {
 	struct rpc_subscription *rsh_parent;
 	rpc_handler_t 		rsh_handler;
+	rpc_handler_f		rsh_fn;
+	void *			rsh_ctx;
+};
+
+/*
+ * Inbound calls received in one rpc.call_batch frame. Results are
+ * collected in order and go out in a single response once every
+ * call in the batch closed.
+ */
+struct rpc_call_batch
+{
+	rpc_connection_t	rcb_conn;
+	rpc_object_t		rcb_id;
+	rpc_object_t		rcb_results;
+	GMutex			rcb_mtx;
+	volatile gint		rcb_pending;
+};
+
+struct rpc_trace_context
+{
+	bool			rtc_valid;
+	uint8_t			rtc_flags;
+	uint64_t		rtc_trace_hi;
+	uint64_t		rtc_trace_lo;
+	uint64_t		rtc_span_id;
+	uint64_t		rtc_parent_id;
 };
 
+struct rpc_flight;
+
 struct rpc_call
 {
 	rpc_connection_t    	rc_conn;
 	rpc_context_t 		rc_context;
 	rpc_call_type_t        	rc_type;
-	char *			rc_path;
-	char *			rc_interface;
-	char *        		rc_method_name;
+	const char *		rc_path;
+	const char *		rc_interface;
+	const char *		rc_method_name;
+	rpc_object_t		rc_frame;
 	rpc_object_t        	rc_id;
 	rpc_object_t        	rc_args;
 	rpc_object_t		rc_err;
 	volatile int		rc_refcount;
 	struct notify		rc_notify;
 	GMutex			rc_mtx;
-	GMutex			rc_ref_mtx;
-	GSource *		rc_timeout;
-	GQueue *		rc_queue;
-	bool			rc_timedout;
+	struct rpc_timer	rc_timer;
+	GQueue			rc_queue;
+	GSList *		rc_thens;
+	GSList *		rc_waiters;
+	struct rpc_call_batch *	rc_batch;
+	size_t			rc_batch_idx;
+	rpc_object_t		rc_batch_result;
+	bool			rc_settled;
 	rpc_callback_t    	rc_callback;
+	rpc_callback_f		rc_callback_fn;
+	void *			rc_callback_ctx;
 	atomic_int_fast64_t	rc_producer_seqno;
 	atomic_int_fast64_t	rc_consumer_seqno; /* also rc_seqno */
 	uint64_t 		rc_prefetch;
+	uint64_t		rc_prefetch_bytes;
+	int64_t			rc_bytes_owed;
+	int64_t			rc_credit_bytes;
+	bool			rc_byte_credits;
+	gint64			rc_grant_time;
+	int64_t			rc_grant_seqno;
+	gint64			rc_rtt;
+	gint64			rc_interarrival;
+	gint64			rc_last_arrival;
+	rpc_object_t		rc_frag_batch;
+	int64_t			rc_frag_batch_seqno;
+	size_t			rc_frag_batch_bytes;
+	gint64			rc_frag_batch_time;
+	size_t			rc_frag_batch_max_items;
+	size_t			rc_frag_batch_max_bytes;
+	bool			rc_frag_batch_ok;
+	rpc_writable_handler_t	rc_writable_handler;
+	bool			rc_want_writable;
+	_Atomic int64_t		rc_starved_since;
 	rpc_instance_t 		rc_instance;
 	rpc_abort_handler_t	rc_abort_handler;
 	struct rpc_if_method *	rc_if_method;
@@ -235,6 +661,32 @@ struct rpc_call
 	bool			rc_responded;
 	bool			rc_ended;
 	bool			rc_aborted;
+	bool			rc_limited;
+	bool			rc_method_missing;
+	gint64			rc_admitted;
+	struct rpc_call *	rc_pending_next;
+	gint64			rc_deadline;
+	gint64			rc_queued;
+	gint64			rc_started;
+	bool			rc_failed;
+	struct rpc_trace_context rc_trace;
+	char *			rc_traceparent;
+	gint64			rc_send_time;
+	guint			rc_cache_gen;
+	rpc_call_priority_t	rc_priority;
+	bool			rc_input;	/* args followed by rpc.input */
+	bool			rc_input_ended;
+	GQueue			rc_input_queue;	/* inbound, not consumed */
+	int64_t			rc_input_seqno;	/* sent, or consumed */
+	int64_t			rc_input_credit; /* allowed, or granted */
+	bool			rc_grant_withheld;
+	/* Coalesced calls, see rpc_connection_set_coalescing() */
+	struct rpc_flight *	rc_flight;
+	rpc_object_t		rc_flight_frame; /* unsent, for followers */
+#if defined(__linux__)
+	struct rpc_event_ring *	rc_stream_ring;	/* fragments, if negotiated */
+	bool			rc_stream_ring_sent;
+#endif
 };
 
 struct rpc_credentials
@@ -275,15 +727,100 @@ struct rpc_connection
 	GHashTable *		rco_inbound_calls;
     	GPtrArray *		rco_subscriptions;
 	GRWLock			rco_subscription_rwlock;
+	/* New subscriptions waiting to go out in one events.subscribe */
+	GMutex			rco_sub_pending_mtx;
+	rpc_object_t		rco_sub_pending;
+	volatile gint		rco_sub_npending;
+	GHashTable *		rco_prop_cache;
+	GMutex			rco_prop_cache_mtx;
 	GMutex			rco_mtx;
 	GMutex			rco_ref_mtx;
 	GMutex			rco_send_mtx;
+	void *			rco_send_buf;
+	GPtrArray *		rco_batch;
+	GPtrArray *		rco_batch_tags;
+	size_t			rco_batch_bytes;
+	size_t			rco_batch_max_bytes;
+	guint			rco_batch_latency;
+	GSource *		rco_batch_timer;
+	struct rpc_compressor *	rco_compressor;
+	size_t			rco_compress_threshold;
+	bool			rco_compact_structs;
+	bool			rco_type_ids;
+	struct rpct_type_table *rco_type_table;
+
+	/* Traffic counters, see rpc_connection_get_stats() */
+	_Atomic uint64_t	rco_frames_in;
+	_Atomic uint64_t	rco_frames_out;
+	_Atomic uint64_t	rco_bytes_in;
+	_Atomic uint64_t	rco_bytes_out;
+	_Atomic uint64_t	rco_serialize_time;
+	_Atomic uint64_t	rco_deserialize_time;
+	_Atomic uint64_t	rco_send_wait_time;
+
+	/* Send queue depth, see rpc_connection_set_send_watermarks() */
+	_Atomic size_t		rco_send_queue;
+	size_t			rco_send_low;
+	size_t			rco_send_high;
+	size_t			rco_fragment_budget;
+	_Atomic int64_t		rco_fragment_queued;
+	volatile gint		rco_saturated;
+	_Atomic int64_t		rco_saturated_since;
+	bool			rco_slow;
+	rpc_writable_handler_t	rco_writable_handler;
+
 	GRWLock			rco_icall_rwlock;
 	GRWLock			rco_call_rwlock;
 	GMainContext *		rco_main_context;
 	rpc_object_t            rco_error;
     	GThreadPool *		rco_callback_pool;
+	struct rpc_exec_tenant *rco_callback_exec;
+	volatile gsize		rco_callbacks_ready;
 	rpc_object_t 		rco_params;
+	bool			rco_numeric_ids;
+	/* Set by the receiving thread when the peer uses it, hence atomic */
+	volatile gint		rco_compact_frames;
+	char *			rco_session_token;
+#if defined(__linux__)
+	/* Memory files already passed to and received from the peer */
+	bool			rco_shmem_regions;
+	GArray *		rco_shmem_tx;
+	int64_t			rco_shmem_next_region;
+	GMutex			rco_shmem_mtx;
+	GHashTable *		rco_shmem_rx;
+
+	/*
+	 * Event ring of this connection alone. A server writes the events
+	 * the client subscribed to into rco_event_ring and signals
+	 * rco_event_ring_fd instead of sending their frames; a client
+	 * reads its read-only mapping of that ring once woken up.
+	 */
+	struct rpc_event_ring *	rco_event_ring;
+	GSource *		rco_event_ring_source;
+	int			rco_event_ring_fd;
+#endif
+
+	/* Events waiting for an emitter shard */
+	GMutex			rco_emit_mtx;
+	GCond			rco_emit_cv;
+	GQueue			rco_emit_queue;
+	bool			rco_emit_scheduled;
+	guint64			rco_emit_dropped;
+	GMutex			rco_dispatch_mtx;
+	GQueue			rco_dispatch_queue;
+
+	/* Received events, see rpc_connection_set_event_delivery() */
+	volatile rpc_event_delivery_t rco_event_delivery;
+	GMutex			rco_event_mtx;
+	GQueue			rco_event_queue;
+	bool			rco_event_draining;
+	guint			rco_dispatch_inflight;
+	volatile guint		rco_dispatch_limit;
+	rpc_call_priority_t	rco_call_priority;
+	volatile gint		rco_coalesce;
+	GHashTable *		rco_flights;
+	GMutex			rco_flight_mtx;
+	_Atomic uint64_t	rco_next_id;
     	int			rco_flags;
 	volatile uint		rco_state;
 	volatile int		rco_refcnt;
@@ -293,32 +830,49 @@ struct rpc_connection
 
     	/* Callbacks */
 	rpc_recv_msg_fn_t	rco_recv_msg;
+	rpc_recv_bytes_fn_t	rco_recv_bytes;
+	rpc_recv_object_fn_t	rco_recv_object;
 	rpc_send_msg_fn_t	rco_send_msg;
+	rpc_send_msgv_fn_t	rco_send_msgv;
+	rpc_send_begin_fn_t	rco_send_begin;
+	rpc_send_chunk_fn_t	rco_send_chunk;
+	rpc_send_batch_fn_t	rco_send_batch;
 	rpc_abort_fn_t 		rco_abort;
 	rpc_close_fn_t		rco_close;
     	rpc_get_fd_fn_t 	rco_get_fd;
+	rpc_detach_fn_t		rco_detach;
 	rpc_release_fn_t	rco_release;
 	rpc_set_creds_fn_t	rco_set_creds;
 	void *			rco_arg;
 	struct rpc_fn_callbacks rco_fn_cbs;
 };
 
+/*
+ * Server dispatch state. Dispatchers announce themselves by adding
+ * RPC_SERVER_ACTIVE, so pause and close can wait for the ones that
+ * already passed the flag check.
+ */
+#define	RPC_SERVER_PAUSED	(1u << 0)
+#define	RPC_SERVER_CLOSED	(1u << 1)
+#define	RPC_SERVER_DRAINING	(1u << 2)
+#define	RPC_SERVER_FLAGS	(RPC_SERVER_ACTIVE - 1)
+#define	RPC_SERVER_ACTIVE	(1u << 3)
+
 struct rpc_server
 {
     	GMainContext *		rs_g_context;
     	GMainLoop *		rs_g_loop;
     	GThread *		rs_thread;
     	GList *			rs_connections;
-	GQueue *		rs_calls;
+	_Atomic(struct rpc_call *) rs_pending;
+	_Atomic guint		rs_dispatch_state;
     	GMutex			rs_mtx;
-	GMutex			rs_calls_mtx;
     	GCond			rs_cv;
 	GRWLock			rs_connections_rwlock;
 	struct rpc_context *	rs_context;
     	const char *		rs_uri;
     	int 			rs_flags;
     	bool			rs_operational;
-	bool			rs_paused;
 	bool			rs_closed;
 	bool			rs_threaded_teardown;
         rpc_object_t            rs_error;
@@ -327,25 +881,32 @@ struct rpc_server
 	int			rs_conn_refused;
 	volatile int		rs_conn_closed;
 	int			rs_conn_aborted;
+	struct rpc_connection_stats rs_closed_stats;
 	rpc_object_t 		rs_params;
 	rpc_server_ev_handler_t rs_event_handler;
+	uint64_t		rs_slow_timeout;
+	bool			rs_slow_disconnect;
+	GSource *		rs_slow_timer;
+	guint			rs_session_grace;
 
     	/* Callbacks */
 	rpc_valid_fn_t		rs_valid;
     	rpc_accept_fn_t		rs_accept;
     	rpc_teardown_fn_t	rs_teardown;
 	rpc_teardown_fn_t	rs_teardown_end;
+	rpc_listen_fds_fn_t	rs_get_listen_fds;
+	rpc_adopt_fn_t		rs_adopt;
     	void *			rs_arg;
 };
 
 struct rpc_client
 {
     	GMainContext *		rci_g_context;
-    	GMainLoop *		rci_g_loop;
-    	GThread *		rci_thread;
+	struct rpc_client_loop *rci_loop;
     	rpc_connection_t 	rci_connection;
     	const char *		rci_uri;
 	rpc_object_t 		rci_params;
+	bool			rci_shared;
 };
 
 struct rpc_instance
@@ -357,18 +918,68 @@ struct rpc_instance
 	int	 		ri_refcnt;
 	rpc_context_t 		ri_context;
 	GHashTable *		ri_interfaces;
+	GHashTable *		ri_interfaces_rcu;
+	GSequenceIter *		ri_seq;
+	GHashTable *		ri_notify;
+	GHashTable *		ri_prop_cache;
+	uint64_t		ri_prop_gen;
+	GHashTable *		ri_prop_sent;	/* last values of delta props */
+	GMutex			ri_delta_mtx;
 	GMutex			ri_mtx;
 	GCond			ri_cv;
 	GRWLock			ri_rwlock;
 };
 
+/*
+ * Observable.changed state of a property with a coalescing interval,
+ * kept per instance under rcx_notify_mtx. While queued, it holds a
+ * reference to the instance and the latest value; NULL there means
+ * the getter is asked when the notification goes out.
+ */
+struct rpc_property_notify
+{
+	rpc_instance_t		rpn_instance;
+	char *			rpn_interface;
+	char *			rpn_name;
+	rpc_object_t		rpn_value;
+	bool			rpn_queued;
+	gint64			rpn_last;
+	gint64			rpn_deadline;
+};
+
+/*
+ * Cached getter result, kept in ri_prop_cache under ri_mtx. An expiry
+ * of 0 means the value stays until the property is reported changed.
+ * Every change bumps ri_prop_gen, so a getter that raced one doesn't
+ * get to cache what it read.
+ */
+struct rpc_property_cached
+{
+	rpc_object_t		rpv_value;
+	gint64			rpv_expires;
+};
+
+/*
+ * One slice of the instance registry, picked by path hash. Calls find
+ * their instance in the RCU snapshot; registering copies only the
+ * table of the shard it lands in.
+ */
+struct rpc_instance_shard
+{
+	GRWLock			ris_rwlock;
+	GHashTable *		ris_instances;
+	GHashTable *		ris_rcu;
+};
+
 struct rpc_interface_priv
 {
 	const char *		rip_name;
 	char *			rip_description;
 	void *			rip_arg;
 	GHashTable *		rip_members;
+	GHashTable *		rip_members_rcu;
 	GRWLock			rip_rwlock;
+	rpc_call_priority_t	rip_priority;
 };
 
 struct rpc_property_cookie
@@ -382,18 +993,83 @@ struct rpc_property_cookie
 struct rpc_context
 {
     	GThreadPool *		rcx_threadpool;
-	GHashTable *		rcx_instances;
+	struct rpc_workq *	rcx_workq;
+	struct rpc_exec_tenant *rcx_exec;
+	guint			rcx_exec_weight;
+	GMutex			rcx_workq_mtx;
+	guint			rcx_workq_nworkers;
+	bool			rcx_workq_pin;
+	struct rpc_fiber_sched *rcx_fibers;
+	guint			rcx_fibers_nthreads;
+	volatile guint		rcx_dispatch_limit;
+	GMutex			rcx_adm_mtx;
+	guint			rcx_adm_max;
+	bool			rcx_adm_adaptive;
+	volatile guint		rcx_adm_limit;
+	double			rcx_adm_limit_f;
+	double			rcx_adm_latency;
+	gint64			rcx_adm_backoff;
+	volatile gint		rcx_adm_inflight;
+	volatile gint		rcx_adm_running;
+	_Atomic uint64_t	rcx_adm_admitted;
+	_Atomic uint64_t	rcx_adm_rejected;
+	guint			rcx_prio_weights[RPC_WORKQ_NLANES];
+	bool			rcx_prio_weighted;
+	size_t			rcx_frag_batch_items;
+	size_t			rcx_frag_batch_bytes;
+	struct rpc_instance_shard rcx_instance_shards[RPC_INSTANCE_SHARDS];
+	GRWLock			rcx_instance_index_rwlock;
+	GSequence *		rcx_instance_seq;
+	uint64_t		rcx_instance_gen;
+	uint64_t		rcx_instance_log_floor;
+	GQueue			rcx_instance_log;
 	GPtrArray * 		rcx_servers;
 	GRWLock			rcx_rwlock;
 	GRWLock			rcx_server_rwlock;
 	rpc_instance_t 		rcx_root;
+	struct rpc_stats *	rcx_stats;
 	GAsyncQueue *		rcx_emit_queue;
 	GThread *		rcx_emit_thread;
 	GHashTable *		rcx_event_watchers;
+	volatile gsize		rcx_burst_max_count;
+	volatile guint		rcx_burst_latency;
+	GHashTable *		rcx_sub_index;
+	struct rpc_sub_trie *	rcx_sub_trie;
+	GHashTable *		rcx_sessions;
+	struct rpc_emit_shard *	rcx_emit_shards;
+	guint			rcx_emit_nshards;
+	volatile gsize		rcx_emit_limit;
+	volatile gint		rcx_emit_policy;
+#if defined(__linux__)
+	volatile gsize		rcx_event_ring_size;
+#endif
 
 	/* Hooks */
 	rpc_function_t		rcx_pre_call_hook;
 	rpc_function_t		rcx_post_call_hook;
+	GHashTable *		rcx_validation;
+	GRWLock			rcx_validation_lock;
+	GHashTable *		rcx_result_cache;
+	GMutex			rcx_result_cache_mtx;
+	GMutex			rcx_notify_mtx;
+	GCond			rcx_notify_cv;
+	GSequence *		rcx_notify_queue;
+	GThread *		rcx_notify_thread;
+	bool			rcx_notify_stop;
+};
+
+struct rpc_result_cache
+{
+	GHashTable *		rrc_results;
+	guint			rrc_gen;
+};
+
+struct rpc_cached_result
+{
+	rpc_object_t		rcr_args;
+	rpc_object_t		rcr_result;
+	GBytes *		rcr_packed;
+	gint64			rcr_expires;
 };
 
 struct rpc_bus_transport
@@ -422,14 +1098,85 @@ struct rpc_serializer
 	const char *name;
 };
 
+#if defined(__linux__)
+#define	RPCT_BUILTIN_COUNT	(RPC_TYPE_SHMEM + 1)
+#else
+#define	RPCT_BUILTIN_COUNT	(RPC_TYPE_ERROR + 1)
+#endif
+
 struct rpct_context
 {
+	GRecMutex		lock;
 	GHashTable *		files;
 	GHashTable *		types;
 	GHashTable *		interfaces;
 	GHashTable *		typei_cache;
+	GRWLock			typei_cache_lock;
+	GHashTable *		compat_cache;
+	GRWLock			compat_lock;
+	struct rpct_typei *	builtin_typei[RPCT_BUILTIN_COUNT];
+	GHashTable *		type_index;
+	GHashTable *		interface_index;
+	GMutex			compact_lock;
+	GHashTable *		compact_names;
+	GHashTable *		compact_ids;
 	rpc_function_t		pre_call_hook;
 	rpc_function_t 		post_call_hook;
+	GMutex			idl_lock;
+	char *			idl_digest;
+	GHashTable *		idl_applied;
+};
+
+/*
+ * Type names seen on one connection. Outgoing names get IDs in the order
+ * they're first sent, which only holds as long as frames are serialized
+ * under the send lock. Incoming IDs resolve to type instances, and are
+ * only touched by the receiving thread. A peer defining more than
+ * RPCT_TYPE_TABLE_MAX of them sets rtt_overflow, and the connection
+ * drops it.
+ */
+#define	RPCT_TYPE_TABLE_MAX	4096
+
+struct rpct_type_table
+{
+	GHashTable *		rtt_out;
+	GHashTable *		rtt_in;
+	uint64_t		rtt_next_id;
+	bool			rtt_defined;
+	bool			rtt_overflow;
+};
+
+/*
+ * Layout of a struct type in the compact encoding. Members are sent in
+ * the order of their sorted names, after an ID derived from the type
+ * name. A NULL members array marks a type that is always sent verbatim.
+ */
+struct rpct_compact_type
+{
+	uint32_t		id;
+	char *			name;
+	GPtrArray *		members;
+};
+
+/*
+ * Where a not yet materialized type or interface is declared. Both
+ * pointers reference the owning file's body.
+ */
+struct rpct_index_entry
+{
+	struct rpct_file *	file;
+	const char *		decl;
+	rpc_object_t		body;
+};
+
+/*
+ * One IDL file parsed by the thread pool in rpct_load_types_dir().
+ * The body is NULL if the file couldn't be parsed.
+ */
+struct rpct_parse_job
+{
+	char *			path;
+	rpc_object_t		body;
 };
 
 struct rpct_file
@@ -486,9 +1233,23 @@ struct rpct_typei
 	char *			canonical_form;
 	GHashTable *		specializations;
 	GHashTable *		constraints;
+	volatile guint		constraints_gen;
+	struct rpct_validation_plan *plan;
+	struct rpct_union_branches *branches;
+	GHashTable *		derived;
+	bool			cached;
 	volatile int		refcnt;
 };
 
+/*
+ * Members of a union instance that can possibly match an object of each
+ * builtin type, so validation only tries those branches.
+ */
+struct rpct_union_branches
+{
+	GPtrArray *		rub_members[RPCT_BUILTIN_COUNT];
+};
+
 struct rpct_member
 {
 	char *			name;
@@ -514,10 +1275,20 @@ struct rpct_argument
 	bool			opt;
 };
 
+/*
+ * Containers of more than RPCT_VALIDATE_GRAIN elements are validated in
+ * chunks of that size on the shared worker pool. Errors are then added
+ * under the lock, which derived contexts inherit. A limit of 0 keeps
+ * every error, but containers stop at their first invalid element.
+ */
+#define	RPCT_VALIDATE_GRAIN	1024
+
 struct rpct_error_context
 {
 	char *			path;
 	GPtrArray *		errors;
+	GMutex *		lock;
+	guint			limit;
 };
 
 struct rpct_class_handler
@@ -545,21 +1316,194 @@ struct rpct_validator
 	rpct_validator_fn_t 	validate;
 };
 
+/*
+ * Validation program compiled from a type instance the first time it's
+ * used, so that validating an object doesn't have to resolve the class
+ * handler, unwind typedefs or look validators up by name again.
+ */
+struct rpct_plan_step
+{
+	const char *		name;
+	const struct rpct_validator *validator;	/**< NULL if not found */
+	rpc_object_t		arg;
+};
+
+struct rpct_validation_plan
+{
+	struct rpct_typei *	raw;
+	const struct rpct_class_handler *handler;
+	guint			constraints_gen; /**< Compiled from */
+	bool			any;
+	bool			accept_null;
+	int			builtin;	/**< rpc_type_t or -1 */
+	rpc_type_t		objtype;	/**< Steps are for this type */
+	guint			nsteps;
+	struct rpct_plan_step	steps[];
+};
+
+extern INTERNAL_LINKAGE const struct rpc_atom_storage rpc_atoms;
+extern INTERNAL_LINKAGE volatile gint rpc_trace_ring_enabled;
+
+static inline bool
+rpc_trace_ring_on(void)
+{
+
+	return (G_UNLIKELY(g_atomic_int_get(&rpc_trace_ring_enabled)));
+}
+
+static inline bool
+rpc_atom_is(const char *str)
+{
+
+	return ((uintptr_t)str >= (uintptr_t)&rpc_atoms &&
+	    (uintptr_t)str < (uintptr_t)&rpc_atoms + sizeof(rpc_atoms));
+}
+
+/*
+ * Whether a streaming call's consumer has granted credits for another
+ * fragment. Called with rc_mtx held.
+ */
+static inline bool
+rpc_call_has_credits(struct rpc_call *call)
+{
+
+	return (call->rc_producer_seqno != call->rc_consumer_seqno &&
+	    (!call->rc_byte_credits || call->rc_credit_bytes > 0));
+}
+
+static inline bool
+rpc_path_is_pattern(const char *path)
+{
+
+	return (path != NULL &&
+	    g_str_has_prefix(path, RPC_PATH_PATTERN_PREFIX));
+}
+
+/*
+ * Paths without RPC_PATH_PATTERN_PREFIX only match themselves. After
+ * the prefix, a pattern ending with '*' matches every path that starts
+ * with whatever precedes the asterisk. Elsewhere, a '*' right before
+ * a '/' stands for the rest of one path component: "/a/", '*', "/b"
+ * matches "/a/x/b" but not "/a/x/y/b". Any other '*' is literal.
+ */
+static inline bool
+rpc_path_matches(const char *pattern, const char *path)
+{
+
+	if (g_strcmp0(pattern, path) == 0)
+		return (true);
+
+	if (!rpc_path_is_pattern(pattern) || path == NULL)
+		return (false);
+
+	pattern += strlen(RPC_PATH_PATTERN_PREFIX);
+
+	for (;;) {
+		if (pattern[0] == '*' && pattern[1] == '\0')
+			return (true);
+
+		if (pattern[0] == '*' && pattern[1] == '/') {
+			path = strchr(path, '/');
+			if (path == NULL)
+				return (false);
+
+			pattern++;
+			continue;
+		}
+
+		if (*pattern != *path)
+			return (false);
+
+		if (*pattern == '\0')
+			return (true);
+
+		pattern++;
+		path++;
+	}
+}
+
+INTERNAL_LINKAGE const char *rpc_atom_lookup(const char *str, size_t len);
+INTERNAL_LINKAGE char *rpc_atom_strdup(const char *str);
+INTERNAL_LINKAGE guint rpc_atom_str_hash(gconstpointer key);
+INTERNAL_LINKAGE gboolean rpc_atom_str_equal(gconstpointer a, gconstpointer b);
+INTERNAL_LINKAGE void rpc_atom_str_free(gpointer key);
+
+INTERNAL_LINKAGE struct rpc_dict *rpc_dict_new(size_t hint);
+INTERNAL_LINKAGE void rpc_dict_free(struct rpc_dict *dict);
+INTERNAL_LINKAGE struct rpc_dict *rpc_dict_retain(struct rpc_dict *dict);
+INTERNAL_LINKAGE void rpc_dict_release(struct rpc_dict *dict);
+INTERNAL_LINKAGE rpc_object_t rpc_dict_lookup(struct rpc_dict *dict,
+    const char *key);
+INTERNAL_LINKAGE void rpc_dict_insert(struct rpc_dict *dict, const char *key,
+    rpc_object_t value);
+INTERNAL_LINKAGE bool rpc_dict_remove(struct rpc_dict *dict, const char *key);
+INTERNAL_LINKAGE void rpc_dict_remove_all(struct rpc_dict *dict);
+INTERNAL_LINKAGE struct rpc_dict_entry *rpc_dict_next(struct rpc_dict *dict,
+    size_t *pos);
+INTERNAL_LINKAGE struct rpc_dict *rpc_dict_copy(struct rpc_dict *dict,
+    rpc_object_t (*copy_fn)(rpc_object_t));
+
 INTERNAL_LINKAGE rpc_object_t rpc_prim_create(rpc_type_t type,
     union rpc_value val);
+INTERNAL_LINKAGE rpc_object_t rpc_string_create_bytes(const char *string,
+    size_t length);
+INTERNAL_LINKAGE GBytes *rpc_object_get_packed(rpc_object_t object);
+INTERNAL_LINKAGE void rpc_object_set_position(rpc_object_t object,
+    size_t line, size_t column);
+INTERNAL_LINKAGE bool rpc_data_file_range(const void *ptr, size_t len,
+    int *fd, off_t *offset);
 
 #if defined(__linux__)
 INTERNAL_LINKAGE rpc_object_t rpc_shmem_recreate(int fd, off_t offset,
     size_t size);
 INTERNAL_LINKAGE int rpc_shmem_get_fd(rpc_object_t shmem);
 INTERNAL_LINKAGE off_t rpc_shmem_get_offset(rpc_object_t shmem);
+INTERNAL_LINKAGE void *rpc_shmem_cache_map(int fd, off_t offset, size_t size);
+INTERNAL_LINKAGE void rpc_shmem_cache_unmap(void *addr);
+INTERNAL_LINKAGE int rpc_shmem_cache_evict(int fd);
+
+struct rpc_event_ring;
+INTERNAL_LINKAGE struct rpc_event_ring *rpc_event_ring_create(size_t size,
+    bool sealed);
+INTERNAL_LINKAGE struct rpc_event_ring *rpc_event_ring_open(
+    rpc_object_t shmem, uint64_t start);
+INTERNAL_LINKAGE void rpc_event_ring_free(struct rpc_event_ring *ring);
+INTERNAL_LINKAGE rpc_object_t rpc_event_ring_get_shmem(
+    struct rpc_event_ring *ring);
+INTERNAL_LINKAGE uint64_t rpc_event_ring_get_head(struct rpc_event_ring *ring);
+INTERNAL_LINKAGE uint64_t rpc_event_ring_get_dropped(
+    struct rpc_event_ring *ring);
+INTERNAL_LINKAGE int64_t rpc_event_ring_write(struct rpc_event_ring *ring,
+    const void *buf, size_t len);
+INTERNAL_LINKAGE int64_t rpc_event_ring_put(struct rpc_event_ring *ring,
+    const void *buf, size_t len);
+INTERNAL_LINKAGE GBytes *rpc_event_ring_read(struct rpc_event_ring *ring);
+INTERNAL_LINKAGE void rpc_event_ring_commit(struct rpc_event_ring *ring);
+INTERNAL_LINKAGE size_t rpc_connection_send_ring_fragment(
+    rpc_connection_t conn, rpc_object_t id, struct rpc_event_ring *ring,
+    int64_t seqno, rpc_object_t fragment, bool measure);
 #endif
 
 INTERNAL_LINKAGE rpc_object_t rpc_error_create_from_gerror(GError *g_error);
+INTERNAL_LINKAGE rpc_object_t rpc_error_create_shared(int code,
+    const char *msg, rpc_object_t extra);
 
 INTERNAL_LINKAGE void rpc_abort(const char *fmt, ...);
 INTERNAL_LINKAGE void rpc_trace(const char *msg, const char *ident,
     rpc_object_t frame);
+INTERNAL_LINKAGE void rpc_trace_frame(rpc_trace_stage_t stage,
+    rpc_connection_t conn, rpc_object_t frame, size_t size);
+INTERNAL_LINKAGE void rpc_trace_bytes(rpc_trace_stage_t stage,
+    rpc_connection_t conn, size_t size);
+INTERNAL_LINKAGE void rpc_trace_ctx_accept(struct rpc_call *call,
+    rpc_object_t args);
+INTERNAL_LINKAGE void rpc_trace_ctx_propagate(rpc_object_t payload);
+INTERNAL_LINKAGE void rpc_trace_ctx_enter(const struct rpc_trace_context *ctx,
+    struct rpc_trace_context *saved);
+INTERNAL_LINKAGE void rpc_trace_ctx_leave(const struct rpc_trace_context *saved);
+INTERNAL_LINKAGE void rpc_trace_ctx_format(const struct rpc_trace_context *ctx,
+    char *buf);
+INTERNAL_LINKAGE void rpc_trace_export_span(struct rpc_call *call, gint64 now);
 INTERNAL_LINKAGE char *rpc_get_backtrace(void);
 INTERNAL_LINKAGE char *rpc_generate_v4_uuid(void);
 INTERNAL_LINKAGE gboolean rpc_kill_main_loop(void *arg);
@@ -588,10 +1532,36 @@ INTERNAL_LINKAGE int rpc_connection_retain(rpc_connection_t);
 INTERNAL_LINKAGE int rpc_connection_release(rpc_connection_t);
 INTERNAL_LINKAGE int rpc_connection_retain_if_valid(rpc_connection_t, bool);
 INTERNAL_LINKAGE int rpc_context_dispatch(rpc_context_t, struct rpc_call *);
+INTERNAL_LINKAGE void rpc_context_index_add(rpc_context_t, rpc_connection_t,
+    const char *, const char *, const char *);
+INTERNAL_LINKAGE void rpc_context_index_remove(rpc_context_t, rpc_connection_t,
+    const char *, const char *, const char *);
+INTERNAL_LINKAGE void rpc_context_index_remove_connection_locked(rpc_context_t,
+    rpc_connection_t);
+INTERNAL_LINKAGE bool rpc_context_should_validate(struct rpc_call *, bool);
+INTERNAL_LINKAGE void rpc_emit_entry_release(void *);
 INTERNAL_LINKAGE int rpc_server_dispatch(rpc_server_t, struct rpc_call *);
 INTERNAL_LINKAGE void rpc_server_release(rpc_server_t);
 INTERNAL_LINKAGE void rpc_server_quit(rpc_server_t);
 INTERNAL_LINKAGE void rpc_server_disconnect(rpc_server_t, rpc_connection_t);
+INTERNAL_LINKAGE bool rpc_connection_check_slow(rpc_connection_t, gint64,
+    gint64);
+INTERNAL_LINKAGE void rpc_connection_drop(rpc_connection_t, rpc_object_t);
+INTERNAL_LINKAGE bool rpc_connection_is_idle(rpc_connection_t);
+INTERNAL_LINKAGE rpc_object_t rpc_connection_save_subscriptions(
+    rpc_connection_t);
+INTERNAL_LINKAGE void rpc_connection_restore_subscriptions(rpc_connection_t,
+    rpc_object_t);
+INTERNAL_LINKAGE void rpc_connection_start_session(rpc_connection_t);
+INTERNAL_LINKAGE char *rpc_session_token_new(void);
+INTERNAL_LINKAGE void rpc_session_suspend(rpc_connection_t);
+INTERNAL_LINKAGE struct rpc_session *rpc_session_take(rpc_context_t,
+    const char *);
+INTERNAL_LINKAGE void rpc_session_offer_locked(rpc_context_t, rpc_server_t,
+    rpc_object_t);
+INTERNAL_LINKAGE void rpc_session_drop_server(rpc_server_t);
+INTERNAL_LINKAGE void rpc_session_release(struct rpc_session *);
+INTERNAL_LINKAGE int rpc_server_accept(rpc_server_t, rpc_connection_t);
 INTERNAL_LINKAGE GMainContext *rpc_server_get_main_context(rpc_server_t);
 INTERNAL_LINKAGE GMainContext *rpc_client_get_main_context(rpc_client_t);
 
@@ -601,16 +1571,31 @@ INTERNAL_LINKAGE void rpc_connection_send_errx(rpc_connection_t, rpc_object_t,
     rpc_object_t);
 INTERNAL_LINKAGE void rpc_connection_send_response(rpc_connection_t,
     rpc_object_t, rpc_object_t);
+INTERNAL_LINKAGE GBytes *rpc_connection_pack_result(rpc_object_t);
+INTERNAL_LINKAGE void rpc_connection_send_packed_response(rpc_connection_t,
+    rpc_object_t, rpc_object_t, GBytes *);
 INTERNAL_LINKAGE void rpc_connection_send_start_stream(rpc_connection_t,
     rpc_object_t, int64_t);
-INTERNAL_LINKAGE void rpc_connection_send_fragment(rpc_connection_t,
-    rpc_object_t, int64_t, rpc_object_t);
+INTERNAL_LINKAGE size_t rpc_connection_send_fragment(rpc_connection_t,
+    rpc_object_t, int64_t, rpc_object_t, bool);
+INTERNAL_LINKAGE void rpc_connection_purge_call(rpc_connection_t, rpc_object_t);
+INTERNAL_LINKAGE size_t rpc_connection_send_fragments(rpc_connection_t,
+    rpc_object_t, int64_t, rpc_object_t, bool);
 INTERNAL_LINKAGE void rpc_connection_send_end(rpc_connection_t, rpc_object_t,
     int64_t);
+INTERNAL_LINKAGE void rpc_connection_send_input_credit(rpc_connection_t,
+    rpc_object_t, int64_t);
 INTERNAL_LINKAGE void rpc_connection_close_inbound_call(struct rpc_call *);
+INTERNAL_LINKAGE void rpc_call_batch_set_result(struct rpc_call *,
+    rpc_object_t);
 INTERNAL_LINKAGE int rpc_connection_call_retain(struct rpc_call *call);
 INTERNAL_LINKAGE int rpc_connection_call_release(struct rpc_call *call);
 INTERNAL_LINKAGE int rpc_connection_get_subscription_count(rpc_connection_t conn);
+INTERNAL_LINKAGE void rpc_connection_add_stats(rpc_connection_t,
+    struct rpc_connection_stats *);
+INTERNAL_LINKAGE GBytes *rpc_connection_pack_event(rpc_object_t);
+INTERNAL_LINKAGE int rpc_connection_send_event_frame(rpc_connection_t,
+    rpc_object_t, GBytes *);
 
 INTERNAL_LINKAGE void rpc_bus_event(rpc_bus_event_t, struct rpc_bus_node *);
 
@@ -621,6 +1606,8 @@ INTERNAL_LINKAGE void rpct_derive_error_context(
     const char *name);
 INTERNAL_LINKAGE void rpct_release_error_context(
     struct rpct_error_context *ctx);
+INTERNAL_LINKAGE bool rpct_error_limit_reached(
+    struct rpct_error_context *ctx);
 INTERNAL_LINKAGE bool rpct_validate_instance(struct rpct_typei *typei,
     rpc_object_t obj, struct rpct_error_context *errctx);
 INTERNAL_LINKAGE bool rpct_run_validators(struct rpct_typei *typei,
@@ -628,6 +1615,17 @@ INTERNAL_LINKAGE bool rpct_run_validators(struct rpct_typei *typei,
 INTERNAL_LINKAGE struct rpct_typei *rpct_instantiate_type(const char *decl,
     struct rpct_typei *parent, struct rpct_type *ptype,
     struct rpct_file *origin);
+INTERNAL_LINKAGE struct rpct_typei *rpct_builtin_typei(rpc_type_t type);
+INTERNAL_LINKAGE struct rpct_typei *rpct_unwind_typei(struct rpct_typei *typei);
+INTERNAL_LINKAGE bool rpct_compact_enabled(void);
+INTERNAL_LINKAGE unsigned int rpct_property_coalesce(const char *interface,
+    const char *name);
+INTERNAL_LINKAGE struct rpct_type_table *rpct_type_table_new(void);
+INTERNAL_LINKAGE void rpct_type_table_free(struct rpct_type_table *table);
+INTERNAL_LINKAGE void rpct_set_type_table(struct rpct_type_table *table);
+INTERNAL_LINKAGE void rpct_set_type_field(rpc_object_t dict,
+    struct rpct_typei *typei);
+INTERNAL_LINKAGE rpc_object_t rpct_compact_struct(rpc_object_t obj);
 
 INTERNAL_LINKAGE void rpc_function_respond_impl(void *cookie,
     rpc_object_t object);
@@ -29,16 +29,40 @@
 #define LIBRPC_NOTIFY_H
 
 #include <sys/types.h>
+#include <glib.h>
+#include "thread.h"
 
+/*
+ * Wakeup primitive guarded by the caller's mutex, which must be held
+ * around every call below. Deadlines are in g_get_monotonic_time()
+ * units. Waiters sleep on a condition variable, so no descriptor exists
+ * until somebody asks for one with notify_get_fd(); from then on,
+ * signals also make that descriptor readable until the next
+ * notify_drain().
+ *
+ * Called from a fiber, notify_wait() parks the fiber rather than the
+ * thread under it. notify_timedwait() always blocks the thread.
+ *
+ * notify_wait_spin() first drops the mutex and spins on the signal
+ * count for as long as the given site allows, see rpc_spin_begin().
+ * Fibers never spin.
+ */
 struct notify
 {
+	GCond	cv;
 	int 	fd;
+	GSList *fibers;
+	volatile gint seq;
 };
 
 void notify_init(struct notify *notify);
 void notify_free(struct notify *notify);
-int notify_wait(struct notify *notify);
-int notify_timedwait(struct notify *notify, const struct timespec *ts);
+int notify_wait(struct notify *notify, GMutex *mtx);
+int notify_wait_spin(struct notify *notify, GMutex *mtx,
+    rpc_spin_site_t site);
+int notify_timedwait(struct notify *notify, GMutex *mtx, gint64 deadline);
 int notify_signal(struct notify *notify);
+int notify_get_fd(struct notify *notify);
+void notify_drain(struct notify *notify);
 
 #endif /* LIBRPC_NOTIFY_H */
@@ -29,64 +29,98 @@
 #include <stdio.h>
 #include <errno.h>
 #include <unistd.h>
-#include <poll.h>
 #include <sys/types.h>
 #include <sys/eventfd.h>
+#include <glib.h>
+#include "fiber.h"
 #include "notify.h"
 
 void
 notify_init(struct notify *notify)
 {
 
-	notify->fd = eventfd(0, 0);
+	g_cond_init(&notify->cv);
+	notify->fd = -1;
+	notify->fibers = NULL;
+	notify->seq = 0;
 }
 
 void
 notify_free(struct notify *notify)
 {
 
-	close(notify->fd);
+	g_cond_clear(&notify->cv);
+	if (notify->fd != -1)
+		close(notify->fd);
 }
 
 int
-notify_wait(struct notify *notify)
+notify_wait(struct notify *notify, GMutex *mtx)
 {
-	eventfd_t value;
 
-	if (eventfd_read(notify->fd, &value) < 0)
-		return (-1);
+	if (rpc_fiber_self() != NULL) {
+		rpc_fiber_park(&notify->fibers, mtx);
+		return (1);
+	}
 
-	return ((int)value);
+	g_cond_wait(&notify->cv, mtx);
+	return (1);
 }
 
 int
-notify_timedwait(struct notify *notify, const struct timespec *ts)
+notify_wait_spin(struct notify *notify, GMutex *mtx, rpc_spin_site_t site)
 {
-	struct pollfd pfd;
-	eventfd_t value;
+	gint seq;
 
-	pfd.fd = notify->fd;
-	pfd.events = POLLIN;
-	pfd.revents = 0;
+	if (rpc_fiber_self() == NULL && rpc_spin_enabled(site)) {
+		seq = g_atomic_int_get(&notify->seq);
+		g_mutex_unlock(mtx);
+		rpc_spin_wait(site, &notify->seq, seq);
+		g_mutex_lock(mtx);
 
-	switch (ppoll(&pfd, 1, ts, NULL)) {
-	case 1:
-		if (eventfd_read(notify->fd, &value) < 0)
-			return (-1);
+		/* Signals come under the mutex, so none was missed */
+		if (g_atomic_int_get(&notify->seq) != seq)
+			return (1);
+	}
 
-		return ((int)value);
+	return (notify_wait(notify, mtx));
+}
 
-	case 0:
-		return (0);
+int
+notify_timedwait(struct notify *notify, GMutex *mtx, gint64 deadline)
+{
 
-	default:
-		return (-1);
-	}
+	return (g_cond_wait_until(&notify->cv, mtx, deadline) ? 1 : 0);
 }
 
 int
 notify_signal(struct notify *notify)
 {
 
-	return (eventfd_write(notify->fd, 1));
+	g_atomic_int_inc(&notify->seq);
+	g_cond_broadcast(&notify->cv);
+	rpc_fiber_wake_all(&notify->fibers);
+	if (notify->fd != -1)
+		return (eventfd_write(notify->fd, 1));
+
+	return (0);
+}
+
+int
+notify_get_fd(struct notify *notify)
+{
+
+	if (notify->fd == -1)
+		notify->fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+	return (notify->fd);
+}
+
+void
+notify_drain(struct notify *notify)
+{
+	eventfd_t value;
+
+	if (notify->fd != -1)
+		eventfd_read(notify->fd, &value);
 }
@@ -33,74 +33,64 @@
 #include "internal.h"
 #include "notify.h"
 
-static int kqueue_fd = -1;
-static int id = 0;
-static GMutex kq_mtx;
+/*
+ * A kqueue descriptor polls readable while it has pending events, so
+ * the pollable form of a notify is a kqueue of its own with a single
+ * user event in it.
+ */
+#define	NOTIFY_IDENT	1
 
 void
 notify_init(struct notify *notify)
 {
-	struct kevent kev;
-
-	g_mutex_lock(&kq_mtx);
-	if (kqueue_fd == -1) {
-		kqueue_fd = kqueue();
-		g_assert(kqueue_fd != -1);
-	}
-	g_mutex_unlock(&kq_mtx);
 
-	notify->fd = ++id;
-
-	EV_SET(&kev, notify->fd, EVFILT_USER, EV_ADD, 0, 0, NULL);
-	if (kevent(kqueue_fd, &kev, 1, NULL, 0, NULL) != 0)
-		g_assert_not_reached();
+	g_cond_init(&notify->cv);
+	notify->fd = -1;
+	notify->fibers = NULL;
+	notify->seq = 0;
 }
 
 void
 notify_free(struct notify *notify)
 {
-	struct kevent kev;
-	int ret;
 
-	EV_SET(&kev, notify->fd, EVFILT_USER, EV_CLEAR | EV_DELETE, 0, 0, NULL);
-	ret = kevent(kqueue_fd, &kev, 1, NULL, 0, NULL);
-
-	/*
-	 * I have no idea why kevent() returns EINPROGRESS, as it's not
-	 * documented anywhere, so let's ignore it. ¯\_(ツ)_/¯
-	 */
-	if (ret != 0 && errno != EINPROGRESS)
-		rpc_abort("kevent() failure: ret=%d, errno=%d", ret, errno);
+	g_cond_clear(&notify->cv);
+	if (notify->fd != -1)
+		close(notify->fd);
 }
 
 int
-notify_wait(struct notify *notify)
+notify_wait(struct notify *notify, GMutex *mtx)
 {
 
-	return (notify_timedwait(notify, NULL));
+	g_cond_wait(&notify->cv, mtx);
+	return (1);
 }
 
 int
-notify_timedwait(struct notify *notify, const struct timespec *ts)
+notify_wait_spin(struct notify *notify, GMutex *mtx, rpc_spin_site_t site)
 {
-	struct kevent kev;
-	int ret;
-
-	for (;;) {
-		ret = kevent(kqueue_fd, NULL, 0, &kev, 1, ts);
-		if (ret < 0)
-			return (-1);
+	gint seq;
 
-		if (ret == 0)
-			return (0);
+	if (rpc_spin_enabled(site)) {
+		seq = g_atomic_int_get(&notify->seq);
+		g_mutex_unlock(mtx);
+		rpc_spin_wait(site, &notify->seq, seq);
+		g_mutex_lock(mtx);
 
-		if (kev.ident == (uintptr_t)notify->fd)
-			break;
+		/* Signals come under the mutex, so none was missed */
+		if (g_atomic_int_get(&notify->seq) != seq)
+			return (1);
 	}
 
-	EV_SET(&kev, notify->fd, EVFILT_USER, EV_CLEAR, 0, 0, NULL);
-	kevent(kqueue_fd, &kev, 1, NULL, 0, NULL);
-	return (1);
+	return (notify_wait(notify, mtx));
+}
+
+int
+notify_timedwait(struct notify *notify, GMutex *mtx, gint64 deadline)
+{
+
+	return (g_cond_wait_until(&notify->cv, mtx, deadline) ? 1 : 0);
 }
 
 int
@@ -108,6 +98,40 @@ notify_signal(struct notify *notify)
 {
 	struct kevent kev;
 
-	EV_SET(&kev, notify->fd, EVFILT_USER, 0, NOTE_TRIGGER, 1, NULL);
-	return (kevent(kqueue_fd, &kev, 1, NULL, 0, NULL));
+	g_atomic_int_inc(&notify->seq);
+	g_cond_broadcast(&notify->cv);
+	if (notify->fd == -1)
+		return (0);
+
+	EV_SET(&kev, NOTIFY_IDENT, EVFILT_USER, 0, NOTE_TRIGGER, 0, NULL);
+	return (kevent(notify->fd, &kev, 1, NULL, 0, NULL));
+}
+
+int
+notify_get_fd(struct notify *notify)
+{
+	struct kevent kev;
+
+	if (notify->fd != -1)
+		return (notify->fd);
+
+	notify->fd = kqueue();
+	if (notify->fd == -1)
+		return (-1);
+
+	EV_SET(&kev, NOTIFY_IDENT, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, NULL);
+	if (kevent(notify->fd, &kev, 1, NULL, 0, NULL) != 0)
+		rpc_abort("kevent() failure: errno=%d", errno);
+
+	return (notify->fd);
+}
+
+void
+notify_drain(struct notify *notify)
+{
+	struct timespec ts = { 0, 0 };
+	struct kevent kev;
+
+	if (notify->fd != -1)
+		kevent(notify->fd, NULL, 0, &kev, 1, &ts);
 }
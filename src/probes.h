@@ -0,0 +1,66 @@
+/*
+ * Copyright 2015-2017 Two Pore Guys, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef LIBRPC_PROBES_H
+#define LIBRPC_PROBES_H
+
+/*
+ * Static tracepoints of the "librpc" USDT provider. A probe nobody is
+ * attached to costs a single nop, and without USDT_SUPPORT the macros
+ * expand to nothing at all.
+ *
+ *   frame__send(conn, frame)		frame submitted for sending
+ *   frame__write(conn, len)		bytes handed to the transport
+ *   frame__recv(conn, len)		bytes received from the transport
+ *   call__enqueue(conn, call, interface, method)
+ *					inbound call queued for a worker
+ *   call__dequeue(conn, call)		inbound call picked up by a worker
+ *   call__done(conn, call, failed)	inbound call closed
+ *   call__settle(conn, call)		outbound call finished
+ *   call__timeout(conn, call)		outbound call timed out
+ *   call__abort(conn, call, remote)	call aborted, by the peer if remote
+ */
+
+#ifdef USDT_SUPPORT
+#include <sys/sdt.h>
+
+#define	RPC_PROBE1(_name, _a)						\
+	DTRACE_PROBE1(librpc, _name, _a)
+#define	RPC_PROBE2(_name, _a, _b)					\
+	DTRACE_PROBE2(librpc, _name, _a, _b)
+#define	RPC_PROBE3(_name, _a, _b, _c)					\
+	DTRACE_PROBE3(librpc, _name, _a, _b, _c)
+#define	RPC_PROBE4(_name, _a, _b, _c, _d)				\
+	DTRACE_PROBE4(librpc, _name, _a, _b, _c, _d)
+#else
+#define	RPC_PROBE1(_name, _a)				do { } while (0)
+#define	RPC_PROBE2(_name, _a, _b)			do { } while (0)
+#define	RPC_PROBE3(_name, _a, _b, _c)			do { } while (0)
+#define	RPC_PROBE4(_name, _a, _b, _c, _d)		do { } while (0)
+#endif
+
+#endif /* LIBRPC_PROBES_H */
@@ -0,0 +1,211 @@
+/*
+ * Copyright 2015-2017 Two Pore Guys, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <glib.h>
+#include "rcu.h"
+#include "thread.h"
+
+#define	RPC_RCU_CACHELINE	64
+#define	RPC_RCU_SPINS		100
+
+struct rpc_rcu_slot
+{
+	volatile gint		rrs_readers[2];
+} __attribute__((aligned(RPC_RCU_CACHELINE)));
+
+struct rpc_rcu_callback
+{
+	struct rpc_rcu_callback *rrc_next;
+	GDestroyNotify		rrc_fn;
+	gpointer		rrc_data;
+};
+
+static struct rpc_rcu_slot *rpc_rcu_get_slot(void);
+static guint rpc_rcu_readers(int idx);
+static void rpc_rcu_wait(int idx);
+static gpointer rpc_rcu_reclaimer(gpointer);
+static gpointer rpc_rcu_reclaimer_start(gpointer);
+
+static struct rpc_rcu_slot rpc_rcu_slots[RPC_RCU_SLOTS];
+static volatile gint rpc_rcu_epoch;
+static volatile gint rpc_rcu_next_slot;
+static GMutex rpc_rcu_mtx;
+static GPrivate rpc_rcu_slot_key;
+static GMutex rpc_rcu_cb_mtx;
+static GCond rpc_rcu_cb_cv;
+static struct rpc_rcu_callback *rpc_rcu_callbacks;
+static GOnce rpc_rcu_reclaimer_once = G_ONCE_INIT;
+
+static struct rpc_rcu_slot *
+rpc_rcu_get_slot(void)
+{
+	gint idx;
+
+	idx = GPOINTER_TO_INT(g_private_get(&rpc_rcu_slot_key));
+	if (idx == 0) {
+		idx = (g_atomic_int_add(&rpc_rcu_next_slot, 1) %
+		    RPC_RCU_SLOTS) + 1;
+		g_private_set(&rpc_rcu_slot_key, GINT_TO_POINTER(idx));
+	}
+
+	return (&rpc_rcu_slots[idx - 1]);
+}
+
+static guint
+rpc_rcu_readers(int idx)
+{
+	guint i;
+	guint sum = 0;
+
+	for (i = 0; i < RPC_RCU_SLOTS; i++)
+		sum += (guint)g_atomic_int_get(
+		    &rpc_rcu_slots[i].rrs_readers[idx]);
+
+	return (sum);
+}
+
+static void
+rpc_rcu_wait(int idx)
+{
+	guint spins = 0;
+
+	while (rpc_rcu_readers(idx) != 0) {
+		if (++spins < RPC_RCU_SPINS)
+			g_thread_yield();
+		else
+			g_usleep(10);
+	}
+}
+
+int
+rpc_rcu_read_lock(void)
+{
+	struct rpc_rcu_slot *slot;
+	int idx;
+
+	slot = rpc_rcu_get_slot();
+	idx = g_atomic_int_get(&rpc_rcu_epoch) & 1;
+	g_atomic_int_inc(&slot->rrs_readers[idx]);
+	return (idx);
+}
+
+void
+rpc_rcu_read_unlock(int idx)
+{
+
+	g_atomic_int_add(&rpc_rcu_get_slot()->rrs_readers[idx], -1);
+}
+
+void
+rpc_rcu_synchronize(void)
+{
+	int idx;
+
+	g_mutex_lock(&rpc_rcu_mtx);
+
+	/*
+	 * A reader may have sampled the epoch just before the previous
+	 * flip and entered the now-inactive set late; drain it first so
+	 * the flip below really starts a fresh grace period.
+	 */
+	idx = g_atomic_int_get(&rpc_rcu_epoch) & 1;
+	rpc_rcu_wait(idx ^ 1);
+	g_atomic_int_inc(&rpc_rcu_epoch);
+	rpc_rcu_wait(idx);
+
+	g_mutex_unlock(&rpc_rcu_mtx);
+}
+
+/*
+ * Takes every callback queued so far and runs them after one grace
+ * period, so a burst of publishes costs a single wait, on this thread
+ * rather than the publishers'.
+ */
+static gpointer
+rpc_rcu_reclaimer(gpointer arg)
+{
+	struct rpc_rcu_callback *batch;
+	struct rpc_rcu_callback *cb;
+
+	for (;;) {
+		g_mutex_lock(&rpc_rcu_cb_mtx);
+		while (rpc_rcu_callbacks == NULL)
+			g_cond_wait(&rpc_rcu_cb_cv, &rpc_rcu_cb_mtx);
+
+		batch = rpc_rcu_callbacks;
+		rpc_rcu_callbacks = NULL;
+		g_mutex_unlock(&rpc_rcu_cb_mtx);
+
+		rpc_rcu_synchronize();
+		while ((cb = batch) != NULL) {
+			batch = cb->rrc_next;
+			cb->rrc_fn(cb->rrc_data);
+			g_free(cb);
+		}
+	}
+
+	return (NULL);
+}
+
+static gpointer
+rpc_rcu_reclaimer_start(gpointer arg)
+{
+
+	g_thread_unref(rpc_thread_new(RPC_THREAD_TIMER, "rpc rcu",
+	    rpc_rcu_reclaimer, NULL));
+	return (NULL);
+}
+
+void
+rpc_rcu_call(gpointer data, GDestroyNotify destroy)
+{
+	struct rpc_rcu_callback *cb;
+
+	if (data == NULL || destroy == NULL)
+		return;
+
+	g_once(&rpc_rcu_reclaimer_once, rpc_rcu_reclaimer_start, NULL);
+	cb = g_malloc(sizeof(*cb));
+	cb->rrc_fn = destroy;
+	cb->rrc_data = data;
+
+	g_mutex_lock(&rpc_rcu_cb_mtx);
+	cb->rrc_next = rpc_rcu_callbacks;
+	rpc_rcu_callbacks = cb;
+	g_cond_signal(&rpc_rcu_cb_cv);
+	g_mutex_unlock(&rpc_rcu_cb_mtx);
+}
+
+void
+rpc_rcu_assign(gpointer *ptr, gpointer value, GDestroyNotify destroy)
+{
+	gpointer old;
+
+	old = g_atomic_pointer_get(ptr);
+	g_atomic_pointer_set(ptr, value);
+	rpc_rcu_call(old, destroy);
+}
@@ -0,0 +1,64 @@
+/*
+ * Copyright 2015-2017 Two Pore Guys, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef LIBRPC_RCU_H
+#define LIBRPC_RCU_H
+
+#include <glib.h>
+
+/*
+ * Read-copy-update for lookup tables that are read on every call but
+ * change only when something gets registered. Readers bracket their
+ * access with rpc_rcu_read_lock()/rpc_rcu_read_unlock(), which only
+ * bump a per-thread-slot counter and never block. Writers build a new
+ * copy of the structure and publish it with rpc_rcu_assign(), which
+ * returns right away; the old copy is destroyed once every reader that
+ * could still see it has left its read-side section. rpc_rcu_call()
+ * defers any other destructor the same way. Deferred callbacks run on
+ * a background thread that covers everything queued so far with one
+ * grace period, so a burst of publishes doesn't wait out one each.
+ *
+ * Grace periods are tracked sleepable-RCU style with two counter sets
+ * per slot and a global epoch whose low bit selects the set new
+ * readers enter. rpc_rcu_synchronize() flips the epoch and waits for
+ * the previous set to drain, so a grace period is a few atomic loads
+ * per slot plus however long the slowest reader takes.
+ *
+ * Read-side sections must be short and must not call
+ * rpc_rcu_synchronize() or anything that publishes.
+ */
+#define	RPC_RCU_SLOTS		64
+
+#define	rpc_rcu_dereference(_p)	g_atomic_pointer_get(&(_p))
+
+int rpc_rcu_read_lock(void);
+void rpc_rcu_read_unlock(int idx);
+void rpc_rcu_synchronize(void);
+void rpc_rcu_assign(gpointer *ptr, gpointer value, GDestroyNotify destroy);
+void rpc_rcu_call(gpointer data, GDestroyNotify destroy);
+
+#endif /* LIBRPC_RCU_H */
@@ -0,0 +1,128 @@
+/*
+ * Copyright 2015-2017 Two Pore Guys, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stddef.h>
+#include <string.h>
+#include <glib.h>
+#include <rpc/object.h>
+#include "internal.h"
+
+struct rpc_atom_entry
+{
+	const char *		rae_str;
+	size_t			rae_len;
+};
+
+static void rpc_atom_init(void);
+
+#define	RPC_ATOM_INIT(_id, _str)	._id = _str,
+#define	RPC_ATOM_ENTRY(_id, _str)	{ rpc_atoms._id, sizeof(_str) - 1 },
+
+const struct rpc_atom_storage rpc_atoms = {
+	RPC_ATOMS(RPC_ATOM_INIT)
+};
+
+static const struct rpc_atom_entry rpc_atom_entries[] = {
+	RPC_ATOMS(RPC_ATOM_ENTRY)
+	{ NULL, 0 }
+};
+
+static guint rpc_atom_hashes[sizeof(struct rpc_atom_storage)];
+static gsize rpc_atom_initialized;
+
+static void
+rpc_atom_init(void)
+{
+	const struct rpc_atom_entry *e;
+
+	if (g_once_init_enter(&rpc_atom_initialized)) {
+		for (e = &rpc_atom_entries[0]; e->rae_str != NULL; e++) {
+			rpc_atom_hashes[e->rae_str - (const char *)&rpc_atoms] =
+			    g_str_hash(e->rae_str);
+		}
+
+		g_once_init_leave(&rpc_atom_initialized, 1);
+	}
+}
+
+const char *
+rpc_atom_lookup(const char *str, size_t len)
+{
+	const struct rpc_atom_entry *e;
+
+	for (e = &rpc_atom_entries[0]; e->rae_str != NULL; e++) {
+		if (e->rae_len != len || e->rae_str[0] != str[0])
+			continue;
+
+		if (memcmp(e->rae_str, str, len) == 0)
+			return (e->rae_str);
+	}
+
+	return (NULL);
+}
+
+char *
+rpc_atom_strdup(const char *str)
+{
+
+	if (rpc_atom_is(str))
+		return ((char *)str);
+
+	return (g_strdup(str));
+}
+
+guint
+rpc_atom_str_hash(gconstpointer key)
+{
+
+	/* Atom hashes match g_str_hash(), so plain strings still match */
+	if (rpc_atom_is(key)) {
+		rpc_atom_init();
+		return (rpc_atom_hashes[(const char *)key -
+		    (const char *)&rpc_atoms]);
+	}
+
+	return (g_str_hash(key));
+}
+
+gboolean
+rpc_atom_str_equal(gconstpointer a, gconstpointer b)
+{
+
+	if (a == b)
+		return (true);
+
+	return (strcmp(a, b) == 0);
+}
+
+void
+rpc_atom_str_free(gpointer key)
+{
+
+	if (!rpc_atom_is(key))
+		g_free(key);
+}
@@ -30,6 +30,13 @@
 #include <rpc/bus.h>
 #include "internal.h"
 
+static void rpc_bus_node_copy(struct rpc_bus_node *,
+    const struct rpc_bus_node *);
+static void rpc_bus_node_free(void *);
+static void rpc_bus_cache_fill(struct rpc_bus_node *, size_t);
+static int rpc_bus_cache_snapshot(struct rpc_bus_node **);
+static void rpc_bus_cache_flush(void);
+
 static rpc_bus_event_handler_t rpc_bus_event_handler = NULL;
 static GMainContext *rpc_g_main_context = NULL;
 static GMainLoop *rpc_g_main_loop = NULL;
@@ -38,6 +45,114 @@ static GMutex rpc_bus_mtx = { 0 };
 static void *rpc_bus_context = NULL;
 static gint rpc_bus_refcnt = 0;
 
+/*
+ * Nodes known on the bus, keyed by address. The cache is filled by the
+ * first enumeration after the bus is opened and then kept up to date by
+ * attach and detach events, so later enumerations don't have to go to
+ * the devices. An event that comes in while the cache is being filled
+ * may or may not be reflected in what the transport returned, so the
+ * cache is only trusted if none did.
+ */
+static GMutex rpc_bus_cache_mtx;
+static GHashTable *rpc_bus_nodes = NULL;
+static bool rpc_bus_cache_valid = false;
+static bool rpc_bus_cache_filling = false;
+static bool rpc_bus_cache_raced = false;
+
+static void
+rpc_bus_node_copy(struct rpc_bus_node *dst, const struct rpc_bus_node *src)
+{
+
+	dst->rbn_name = g_strdup(src->rbn_name);
+	dst->rbn_description = g_strdup(src->rbn_description);
+	dst->rbn_serial = g_strdup(src->rbn_serial);
+	dst->rbn_address = src->rbn_address;
+}
+
+static void
+rpc_bus_node_free(void *arg)
+{
+	struct rpc_bus_node *node = arg;
+
+	g_free((char *)node->rbn_name);
+	g_free((char *)node->rbn_description);
+	g_free((char *)node->rbn_serial);
+	g_free(node);
+}
+
+static void
+rpc_bus_cache_fill(struct rpc_bus_node *result, size_t count)
+{
+	struct rpc_bus_node *node;
+	size_t i;
+
+	g_mutex_lock(&rpc_bus_cache_mtx);
+	rpc_bus_cache_filling = false;
+	if (rpc_bus_cache_raced || rpc_bus_context == NULL) {
+		g_mutex_unlock(&rpc_bus_cache_mtx);
+		return;
+	}
+
+	if (rpc_bus_nodes == NULL) {
+		rpc_bus_nodes = g_hash_table_new_full(NULL, NULL, NULL,
+		    rpc_bus_node_free);
+	}
+
+	g_hash_table_remove_all(rpc_bus_nodes);
+	for (i = 0; i < count; i++) {
+		node = g_malloc0(sizeof(*node));
+		rpc_bus_node_copy(node, &result[i]);
+		g_hash_table_insert(rpc_bus_nodes,
+		    GUINT_TO_POINTER(node->rbn_address), node);
+	}
+
+	rpc_bus_cache_valid = true;
+	g_mutex_unlock(&rpc_bus_cache_mtx);
+}
+
+static int
+rpc_bus_cache_snapshot(struct rpc_bus_node **resultp)
+{
+	GHashTableIter iter;
+	struct rpc_bus_node *result = NULL;
+	struct rpc_bus_node *node;
+	size_t count = 0;
+
+	g_mutex_lock(&rpc_bus_cache_mtx);
+	if (!rpc_bus_cache_valid) {
+		rpc_bus_cache_filling = true;
+		rpc_bus_cache_raced = false;
+		g_mutex_unlock(&rpc_bus_cache_mtx);
+		return (-1);
+	}
+
+	if (g_hash_table_size(rpc_bus_nodes) > 0) {
+		result = g_malloc0_n(g_hash_table_size(rpc_bus_nodes),
+		    sizeof(*result));
+	}
+
+	g_hash_table_iter_init(&iter, rpc_bus_nodes);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&node))
+		rpc_bus_node_copy(&result[count++], node);
+
+	g_mutex_unlock(&rpc_bus_cache_mtx);
+	*resultp = result;
+	return ((int)count);
+}
+
+static void
+rpc_bus_cache_flush(void)
+{
+
+	g_mutex_lock(&rpc_bus_cache_mtx);
+	rpc_bus_cache_valid = false;
+	if (rpc_bus_nodes != NULL) {
+		g_hash_table_destroy(rpc_bus_nodes);
+		rpc_bus_nodes = NULL;
+	}
+	g_mutex_unlock(&rpc_bus_cache_mtx);
+}
+
 static void *
 rpc_bus_worker(void *arg __unused)
 {
@@ -73,7 +188,8 @@ rpc_bus_open(void)
 	}
 
 	rpc_g_main_context = g_main_context_new();
-	rpc_g_main_thread = g_thread_new("bus", rpc_bus_worker, NULL);
+	rpc_g_main_thread = rpc_thread_new(RPC_THREAD_BUS, "bus", rpc_bus_worker,
+	    NULL);
 	rpc_bus_context = bus->bus_ops->open(rpc_g_main_context);
 	if (rpc_bus_context != NULL)
 		rpc_bus_refcnt++;
@@ -117,6 +233,7 @@ rpc_bus_close(void)
 		g_main_context_unref(rpc_g_main_context);
 		g_thread_join(rpc_g_main_thread);
 		rpc_bus_context = NULL;
+		rpc_bus_cache_flush();
 	}
 
 done:
@@ -160,6 +277,16 @@ rpc_bus_enumerate(struct rpc_bus_node **resultp)
 	int ret = 0;
 
 	g_mutex_lock(&rpc_bus_mtx);
+
+	/* Without the bus open, no events keep the cache current */
+	if (rpc_bus_context != NULL) {
+		ret = rpc_bus_cache_snapshot(resultp);
+		if (ret >= 0)
+			goto done;
+
+		ret = 0;
+	}
+
 	bus = rpc_find_transport("bus");
 	if (bus == NULL) {
 		errno = ENXIO;
@@ -178,6 +305,9 @@ rpc_bus_enumerate(struct rpc_bus_node **resultp)
 		goto done;
 	}
 
+	if (rpc_bus_context != NULL)
+		rpc_bus_cache_fill(result, count);
+
 	*resultp = result;
 	ret = (int)count;
 
@@ -214,6 +344,31 @@ rpc_bus_unregister_event_handler(void)
 void
 rpc_bus_event(rpc_bus_event_t event, struct rpc_bus_node *node)
 {
+	struct rpc_bus_node *copy;
+
+	g_mutex_lock(&rpc_bus_cache_mtx);
+	if (rpc_bus_cache_filling)
+		rpc_bus_cache_raced = true;
+
+	if (rpc_bus_cache_valid) {
+		switch (event) {
+		case RPC_BUS_ATTACHED:
+			copy = g_malloc0(sizeof(*copy));
+			rpc_bus_node_copy(copy, node);
+			g_hash_table_insert(rpc_bus_nodes,
+			    GUINT_TO_POINTER(copy->rbn_address), copy);
+			break;
+
+		case RPC_BUS_DETACHED:
+			g_hash_table_remove(rpc_bus_nodes,
+			    GUINT_TO_POINTER(node->rbn_address));
+			break;
+
+		default:
+			break;
+		}
+	}
+	g_mutex_unlock(&rpc_bus_cache_mtx);
 
 	if (rpc_bus_event_handler != NULL)
 		rpc_bus_event_handler(event, node);
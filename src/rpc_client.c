@@ -30,32 +30,115 @@
 #include <gio/gio.h>
 #include "internal.h"
 
+#define	RPC_MUX_PREFIX		"mux+"
+#define	RPC_CLIENT_POOL_MAX	4
+
+struct rpc_client_loop
+{
+	GMainContext *		rcl_context;
+	GMainLoop *		rcl_loop;
+	GThread *		rcl_thread;
+	volatile gint		rcl_refcnt;
+};
+
+static void *rpc_client_worker(void *);
+static struct rpc_client_loop *rpc_client_loop_retain(
+    struct rpc_client_loop *);
+static void rpc_client_loop_free(struct rpc_client_loop *);
+static struct rpc_client_loop *rpc_client_pool_get(void);
+static rpc_client_t rpc_client_create_on(const char *, rpc_object_t,
+    struct rpc_client_loop *, bool);
+
+/*
+ * Multiplexed clients are meant to come in large numbers, so they all
+ * share this main loop instead of running one each.
+ */
+static GMutex rpc_client_shared_mtx;
+static struct rpc_client_loop *rpc_client_shared;
+
+/*
+ * Process-wide loops for rpc_client_create_ex() callers that don't
+ * bring their own. Created on first use and kept for the lifetime of
+ * the process; each new client goes to the least loaded one.
+ */
+static GMutex rpc_client_pool_mtx;
+static struct rpc_client_loop *rpc_client_pool[RPC_CLIENT_POOL_MAX];
+static guint rpc_client_pool_size;
+
 static void *
 rpc_client_worker(void *arg)
 {
 	sigset_t set;
-	rpc_client_t client = arg;
+	struct rpc_client_loop *loop = arg;
 
 	sigemptyset(&set);
 	sigaddset(&set, SIGINT);
 	sigaddset(&set, SIGTERM);
 	pthread_sigmask(SIG_BLOCK, &set, NULL);
 
-	g_main_context_push_thread_default(client->rci_g_context);
-	g_main_loop_run(client->rci_g_loop);
+	g_main_context_push_thread_default(loop->rcl_context);
+	g_main_loop_run(loop->rcl_loop);
 	return (NULL);
 }
 
-rpc_client_t
-rpc_client_create(const char *uri, rpc_object_t params)
+static struct rpc_client_loop *
+rpc_client_loop_retain(struct rpc_client_loop *loop)
+{
+
+	g_atomic_int_inc(&loop->rcl_refcnt);
+	return (loop);
+}
+
+static void
+rpc_client_loop_free(struct rpc_client_loop *loop)
+{
+
+	g_main_context_invoke(loop->rcl_context,
+	    (GSourceFunc)rpc_kill_main_loop, loop->rcl_loop);
+	g_thread_join(loop->rcl_thread);
+	g_main_loop_unref(loop->rcl_loop);
+	g_main_context_unref(loop->rcl_context);
+	g_free(loop);
+}
+
+static struct rpc_client_loop *
+rpc_client_pool_get(void)
+{
+	struct rpc_client_loop *result;
+	guint i;
+
+	g_mutex_lock(&rpc_client_pool_mtx);
+	if (rpc_client_pool_size == 0) {
+		rpc_client_pool_size = CLAMP(g_get_num_processors(), 1,
+		    RPC_CLIENT_POOL_MAX);
+
+		for (i = 0; i < rpc_client_pool_size; i++)
+			rpc_client_pool[i] = rpc_client_loop_create(
+			    "librpc client pool");
+	}
+
+	result = rpc_client_pool[0];
+	for (i = 1; i < rpc_client_pool_size; i++) {
+		if (g_atomic_int_get(&rpc_client_pool[i]->rcl_refcnt) <
+		    g_atomic_int_get(&result->rcl_refcnt))
+			result = rpc_client_pool[i];
+	}
+
+	rpc_client_loop_retain(result);
+	g_mutex_unlock(&rpc_client_pool_mtx);
+	return (result);
+}
+
+static rpc_client_t
+rpc_client_create_on(const char *uri, rpc_object_t params,
+    struct rpc_client_loop *loop, bool shared)
 {
 	rpc_client_t client;
 
 	client = g_malloc0(sizeof(*client));
-	client->rci_g_context = g_main_context_new();
-	client->rci_g_loop = g_main_loop_new(client->rci_g_context, false);
-	client->rci_thread = g_thread_new("librpc client", rpc_client_worker,
-	    client);
+	client->rci_loop = loop;
+	client->rci_g_context = loop->rcl_context;
+	client->rci_shared = shared;
 	client->rci_uri = uri;
 	client->rci_params = params;
 
@@ -71,6 +154,65 @@ rpc_client_create(const char *uri, rpc_object_t params)
 	return (client);
 }
 
+rpc_client_loop_t
+rpc_client_loop_create(const char *name)
+{
+	struct rpc_client_loop *loop;
+
+	loop = g_malloc0(sizeof(*loop));
+	loop->rcl_refcnt = 1;
+	loop->rcl_context = g_main_context_new();
+	loop->rcl_loop = g_main_loop_new(loop->rcl_context, false);
+	loop->rcl_thread = rpc_thread_new(RPC_THREAD_CLIENT,
+	    name != NULL ? name : "librpc client", rpc_client_worker, loop);
+
+	return (loop);
+}
+
+void
+rpc_client_loop_release(rpc_client_loop_t loop)
+{
+
+	if (g_atomic_int_dec_and_test(&loop->rcl_refcnt))
+		rpc_client_loop_free(loop);
+}
+
+rpc_client_t
+rpc_client_create(const char *uri, rpc_object_t params)
+{
+	struct rpc_client_loop *loop;
+
+	if (g_str_has_prefix(uri, RPC_MUX_PREFIX)) {
+		g_mutex_lock(&rpc_client_shared_mtx);
+		if (rpc_client_shared == NULL)
+			rpc_client_shared = rpc_client_loop_create(
+			    "librpc mux client");
+		else
+			rpc_client_loop_retain(rpc_client_shared);
+
+		loop = rpc_client_shared;
+		g_mutex_unlock(&rpc_client_shared_mtx);
+		return (rpc_client_create_on(uri, params, loop, true));
+	}
+
+	return (rpc_client_create_on(uri, params,
+	    rpc_client_loop_create("librpc client"), false));
+}
+
+rpc_client_t
+rpc_client_create_ex(const char *uri, rpc_object_t params,
+    rpc_client_loop_t loop)
+{
+
+	if (g_str_has_prefix(uri, RPC_MUX_PREFIX))
+		return (rpc_client_create(uri, params));
+
+	loop = loop != NULL ? rpc_client_loop_retain(loop) :
+	    rpc_client_pool_get();
+
+	return (rpc_client_create_on(uri, params, loop, false));
+}
+
 GMainContext *
 rpc_client_get_main_context(rpc_client_t client)
 {
@@ -88,6 +230,8 @@ rpc_client_get_connection(rpc_client_t client)
 void
 rpc_client_close(rpc_client_t client)
 {
+	struct rpc_client_loop *loop = client->rci_loop;
+	bool last;
 
 	if ((client->rci_connection != NULL) &&
 	    rpc_connection_retain_if_valid(client->rci_connection, false) == 0) {
@@ -104,10 +248,21 @@ rpc_client_close(rpc_client_t client)
 		client->rci_connection = NULL;
         }
 
-	g_main_context_invoke(client->rci_g_context,
-	    (GSourceFunc)rpc_kill_main_loop, client->rci_g_loop);
-	g_thread_join(client->rci_thread);
-	g_main_loop_unref(client->rci_g_loop);
-	g_main_context_unref(client->rci_g_context);
+	if (!client->rci_shared) {
+		rpc_client_loop_release(loop);
+		g_free(client);
+		return;
+	}
+
+	/* A new mux client must not pick up a loop being torn down */
+	g_mutex_lock(&rpc_client_shared_mtx);
+	last = g_atomic_int_dec_and_test(&loop->rcl_refcnt);
+	if (last)
+		rpc_client_shared = NULL;
+	g_mutex_unlock(&rpc_client_shared_mtx);
+
+	if (last)
+		rpc_client_loop_free(loop);
+
 	g_free(client);
 }
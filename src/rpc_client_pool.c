@@ -0,0 +1,558 @@
+/*
+ * Copyright 2015-2017 Two Pore Guys, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <rpc/object.h>
+#include <rpc/client.h>
+#include <rpc/connection.h>
+#include <glib.h>
+#include "internal.h"
+
+#define	RPC_CLIENT_POOL_RECONNECT	1000	/* msecs */
+#define	RPC_CLIENT_POOL_LAT_SAMPLES	128
+#define	RPC_CLIENT_POOL_LAT_MIN		20	/* samples before p95 is used */
+#define	RPC_CLIENT_POOL_HEDGE_DEFAULT	10000	/* usecs */
+#define	RPC_CLIENT_POOL_HEDGE_MIN	1000	/* usecs */
+
+struct rpc_client_pool_member
+{
+	char *			rcpm_uri;
+	rpc_client_t		rcpm_client;
+	volatile gint		rcpm_outstanding;
+};
+
+struct rpc_client_pool
+{
+	GMutex			rcp_mtx;
+	GCond			rcp_cv;
+	GThread *		rcp_thread;
+	bool			rcp_stop;
+	rpc_client_pool_policy_t rcp_policy;
+	rpc_object_t		rcp_params;
+	struct rpc_client_pool_member *rcp_members;
+	size_t			rcp_nmembers;
+	guint			rcp_next;
+	GHashTable *		rcp_hedged;
+	gint64			rcp_latency[RPC_CLIENT_POOL_LAT_SAMPLES];
+	guint			rcp_nlatency;
+	gint64			rcp_hedge_delay;
+};
+
+static bool rpc_client_pool_usable(struct rpc_client_pool_member *);
+static struct rpc_client_pool_member *rpc_client_pool_pick(
+    struct rpc_client_pool *, struct rpc_client_pool_member *);
+static struct rpc_client_pool_member *rpc_client_pool_take(
+    struct rpc_client_pool *, struct rpc_client_pool_member *);
+static void rpc_client_pool_put(struct rpc_client_pool *,
+    struct rpc_client_pool_member *);
+static gint rpc_client_pool_cmp_latency(gconstpointer, gconstpointer);
+static void rpc_client_pool_record(struct rpc_client_pool *, gint64);
+static bool rpc_client_pool_is_hedged(struct rpc_client_pool *,
+    const char *, const char *);
+static rpc_call_t rpc_client_pool_start(struct rpc_client_pool_member *,
+    GAsyncQueue *, const char *, const char *, const char *, rpc_object_t);
+static rpc_object_t rpc_client_pool_call_hedged(struct rpc_client_pool *,
+    const char *, const char *, const char *, rpc_object_t);
+static void rpc_client_pool_reconnect(struct rpc_client_pool *);
+static void *rpc_client_pool_worker(void *);
+
+static bool
+rpc_client_pool_usable(struct rpc_client_pool_member *member)
+{
+
+	return (member->rcpm_client != NULL && rpc_connection_is_open(
+	    rpc_client_get_connection(member->rcpm_client)));
+}
+
+static struct rpc_client_pool_member *
+rpc_client_pool_pick(struct rpc_client_pool *pool,
+    struct rpc_client_pool_member *exclude)
+{
+	struct rpc_client_pool_member *best = NULL;
+	struct rpc_client_pool_member *member;
+	struct rpc_client_pool_member *other;
+	size_t i;
+
+	if (pool->rcp_policy == RPC_CLIENT_POOL_TWO_CHOICES &&
+	    pool->rcp_nmembers > 1) {
+		member = &pool->rcp_members[g_random_int_range(0,
+		    (gint32)pool->rcp_nmembers)];
+		other = &pool->rcp_members[g_random_int_range(0,
+		    (gint32)pool->rcp_nmembers)];
+
+		if (member == exclude || !rpc_client_pool_usable(member))
+			member = other;
+
+		if (other != exclude && rpc_client_pool_usable(other) &&
+		    g_atomic_int_get(&other->rcpm_outstanding) <
+		    g_atomic_int_get(&member->rcpm_outstanding))
+			member = other;
+
+		if (member != exclude && rpc_client_pool_usable(member))
+			return (member);
+
+		/* Both samples are down, fall back to a full scan */
+	}
+
+	/* Start after the previous pick so ties rotate between members */
+	for (i = 0; i < pool->rcp_nmembers; i++) {
+		member = &pool->rcp_members[
+		    (pool->rcp_next + i) % pool->rcp_nmembers];
+
+		if (member == exclude || !rpc_client_pool_usable(member))
+			continue;
+
+		if (best == NULL || g_atomic_int_get(&member->rcpm_outstanding)
+		    < g_atomic_int_get(&best->rcpm_outstanding))
+			best = member;
+	}
+
+	pool->rcp_next++;
+	return (best);
+}
+
+static struct rpc_client_pool_member *
+rpc_client_pool_take(struct rpc_client_pool *pool,
+    struct rpc_client_pool_member *exclude)
+{
+	struct rpc_client_pool_member *member;
+
+	g_mutex_lock(&pool->rcp_mtx);
+	member = rpc_client_pool_pick(pool, exclude);
+	if (member != NULL)
+		g_atomic_int_inc(&member->rcpm_outstanding);
+	g_mutex_unlock(&pool->rcp_mtx);
+	return (member);
+}
+
+static void
+rpc_client_pool_put(struct rpc_client_pool *pool,
+    struct rpc_client_pool_member *member)
+{
+
+	g_mutex_lock(&pool->rcp_mtx);
+	g_atomic_int_add(&member->rcpm_outstanding, -1);
+	g_mutex_unlock(&pool->rcp_mtx);
+}
+
+static gint
+rpc_client_pool_cmp_latency(gconstpointer a, gconstpointer b)
+{
+	gint64 la = *(const gint64 *)a;
+	gint64 lb = *(const gint64 *)b;
+
+	return (la < lb ? -1 : la > lb);
+}
+
+/*
+ * Keeps a ring of recent call latencies. The hedging delay is their
+ * 95th percentile, refreshed every eighth of the ring so that sorting
+ * stays off most calls.
+ */
+static void
+rpc_client_pool_record(struct rpc_client_pool *pool, gint64 latency)
+{
+	gint64 sorted[RPC_CLIENT_POOL_LAT_SAMPLES];
+	guint n;
+
+	g_mutex_lock(&pool->rcp_mtx);
+	pool->rcp_latency[pool->rcp_nlatency++ % RPC_CLIENT_POOL_LAT_SAMPLES] =
+	    latency;
+
+	n = MIN(pool->rcp_nlatency, RPC_CLIENT_POOL_LAT_SAMPLES);
+	if (n < RPC_CLIENT_POOL_LAT_MIN ||
+	    pool->rcp_nlatency % (RPC_CLIENT_POOL_LAT_SAMPLES / 8) != 0) {
+		g_mutex_unlock(&pool->rcp_mtx);
+		return;
+	}
+
+	memcpy(sorted, pool->rcp_latency, n * sizeof(gint64));
+	qsort(sorted, n, sizeof(gint64), rpc_client_pool_cmp_latency);
+	pool->rcp_hedge_delay = MAX(sorted[n * 95 / 100],
+	    RPC_CLIENT_POOL_HEDGE_MIN);
+	g_mutex_unlock(&pool->rcp_mtx);
+}
+
+static bool
+rpc_client_pool_is_hedged(struct rpc_client_pool *pool,
+    const char *interface, const char *method)
+{
+	char *key;
+	bool result;
+
+	key = g_strdup_printf("%s.%s", interface != NULL ? interface : "",
+	    method);
+
+	g_mutex_lock(&pool->rcp_mtx);
+	result = (bool)g_hash_table_contains(pool->rcp_hedged, key);
+	g_mutex_unlock(&pool->rcp_mtx);
+	g_free(key);
+	return (result);
+}
+
+/*
+ * Each attempt reports back through the queue once it settles. The
+ * block owns a queue reference and the queue frees the calls nobody
+ * popped, so a losing attempt cleans up after itself whenever it ends.
+ */
+static rpc_call_t
+rpc_client_pool_start(struct rpc_client_pool_member *member, GAsyncQueue *q,
+    const char *path, const char *interface, const char *method,
+    rpc_object_t args)
+{
+	rpc_call_t call;
+
+	call = rpc_connection_call(rpc_client_get_connection(
+	    member->rcpm_client), path, interface, method, args, NULL);
+	if (call == NULL)
+		return (NULL);
+
+	g_async_queue_ref(q);
+	rpc_call_await(call, NULL, ^(rpc_call_t c) {
+		g_async_queue_push(q, c);
+		g_async_queue_unref(q);
+	});
+
+	return (call);
+}
+
+static rpc_object_t
+rpc_client_pool_call_hedged(struct rpc_client_pool *pool, const char *path,
+    const char *interface, const char *method, rpc_object_t args)
+{
+	struct rpc_client_pool_member *first;
+	struct rpc_client_pool_member *second = NULL;
+	GAsyncQueue *q;
+	rpc_call_t calls[2] = { NULL, NULL };
+	rpc_call_t winner;
+	rpc_call_t loser = NULL;
+	rpc_object_t result;
+	gint64 delay;
+	gint64 start;
+
+	first = rpc_client_pool_take(pool, NULL);
+	if (first == NULL) {
+		rpc_release(args);
+		rpc_set_last_error(ENOTCONN, "No connection available", NULL);
+		return (NULL);
+	}
+
+	g_mutex_lock(&pool->rcp_mtx);
+	delay = pool->rcp_hedge_delay != 0 ? pool->rcp_hedge_delay :
+	    RPC_CLIENT_POOL_HEDGE_DEFAULT;
+	g_mutex_unlock(&pool->rcp_mtx);
+
+	q = g_async_queue_new_full((GDestroyNotify)rpc_call_free);
+	start = g_get_monotonic_time();
+	calls[0] = rpc_client_pool_start(first, q, path, interface, method,
+	    rpc_retain(args));
+	if (calls[0] == NULL) {
+		rpc_release(args);
+		rpc_client_pool_put(pool, first);
+		g_async_queue_unref(q);
+		return (NULL);
+	}
+
+	winner = g_async_queue_timeout_pop(q, (guint64)delay);
+	if (winner == NULL) {
+		second = rpc_client_pool_take(pool, first);
+		if (second != NULL) {
+			debugf("hedging %s after %" G_GINT64_FORMAT " us",
+			    method, delay);
+			calls[1] = rpc_client_pool_start(second, q, path,
+			    interface, method, rpc_retain(args));
+		}
+
+		winner = g_async_queue_pop(q);
+		loser = calls[1] == NULL ? NULL :
+		    winner == calls[0] ? calls[1] : calls[0];
+
+		/* An error doesn't win while the other attempt may succeed */
+		if (loser != NULL && !rpc_call_success(winner)) {
+			rpc_call_free(winner);
+			winner = g_async_queue_pop(q);
+			loser = NULL;
+		}
+	}
+
+	rpc_release(args);
+	rpc_client_pool_record(pool, g_get_monotonic_time() - start);
+
+	result = rpc_call_result(winner);
+	if (result != NULL)
+		rpc_retain(result);
+
+	/* The loser is freed by the queue once it settles */
+	if (loser != NULL && rpc_call_status(loser) == RPC_CALL_IN_PROGRESS)
+		rpc_call_abort(loser);
+
+	rpc_call_free(winner);
+	g_async_queue_unref(q);
+	rpc_client_pool_put(pool, first);
+	if (second != NULL)
+		rpc_client_pool_put(pool, second);
+
+	return (result);
+}
+
+static void
+rpc_client_pool_reconnect(struct rpc_client_pool *pool)
+{
+	struct rpc_client_pool_member *member;
+	rpc_client_t client;
+	rpc_client_t old;
+	size_t i;
+
+	for (i = 0; i < pool->rcp_nmembers; i++) {
+		member = &pool->rcp_members[i];
+
+		/*
+		 * A dead connection is only replaced once nobody holds it,
+		 * callers see their calls fail and release it soon enough.
+		 */
+		g_mutex_lock(&pool->rcp_mtx);
+		if (rpc_client_pool_usable(member) ||
+		    g_atomic_int_get(&member->rcpm_outstanding) > 0) {
+			g_mutex_unlock(&pool->rcp_mtx);
+			continue;
+		}
+
+		old = member->rcpm_client;
+		member->rcpm_client = NULL;
+		g_mutex_unlock(&pool->rcp_mtx);
+
+		client = rpc_client_create_ex(member->rcpm_uri,
+		    pool->rcp_params, NULL);
+
+		/* Pick up the old connection's session, if it had one */
+		if (client != NULL && old != NULL &&
+		    rpc_connection_resume_session(
+		    rpc_client_get_connection(client),
+		    rpc_client_get_connection(old)) != 0)
+			debugf("resuming on %s failed", member->rcpm_uri);
+
+		if (old != NULL)
+			rpc_client_close(old);
+
+		if (client == NULL) {
+			debugf("reconnecting to %s failed", member->rcpm_uri);
+			continue;
+		}
+
+		g_mutex_lock(&pool->rcp_mtx);
+		member->rcpm_client = client;
+		g_mutex_unlock(&pool->rcp_mtx);
+	}
+}
+
+static void *
+rpc_client_pool_worker(void *arg)
+{
+	struct rpc_client_pool *pool = arg;
+	gint64 deadline;
+
+	g_mutex_lock(&pool->rcp_mtx);
+	while (!pool->rcp_stop) {
+		deadline = g_get_monotonic_time() +
+		    RPC_CLIENT_POOL_RECONNECT * G_TIME_SPAN_MILLISECOND;
+
+		if (g_cond_wait_until(&pool->rcp_cv, &pool->rcp_mtx, deadline))
+			continue;
+
+		g_mutex_unlock(&pool->rcp_mtx);
+		rpc_client_pool_reconnect(pool);
+		g_mutex_lock(&pool->rcp_mtx);
+	}
+
+	g_mutex_unlock(&pool->rcp_mtx);
+	return (NULL);
+}
+
+rpc_client_pool_t
+rpc_client_pool_create(const char *const *uris, size_t nuris, size_t size,
+    rpc_client_pool_policy_t policy, rpc_object_t params)
+{
+	struct rpc_client_pool *pool;
+	struct rpc_client_pool_member *member;
+	size_t i;
+
+	if (uris == NULL || nuris == 0) {
+		rpc_set_last_error(EINVAL, "No URIs given", NULL);
+		return (NULL);
+	}
+
+	if (size == 0)
+		size = nuris;
+
+	pool = g_malloc0(sizeof(*pool));
+	g_mutex_init(&pool->rcp_mtx);
+	g_cond_init(&pool->rcp_cv);
+	pool->rcp_policy = policy;
+	pool->rcp_hedged = g_hash_table_new_full(g_str_hash, g_str_equal,
+	    g_free, NULL);
+	pool->rcp_params = params != NULL ? rpc_retain(params) : NULL;
+	pool->rcp_nmembers = size;
+	pool->rcp_members = g_malloc0_n(size, sizeof(*pool->rcp_members));
+
+	/* Connections are spread over the replicas round-robin */
+	for (i = 0; i < size; i++) {
+		member = &pool->rcp_members[i];
+		member->rcpm_uri = g_strdup(uris[i % nuris]);
+		member->rcpm_client = rpc_client_create_ex(member->rcpm_uri,
+		    params, NULL);
+	}
+
+	pool->rcp_thread = rpc_thread_new(RPC_THREAD_TIMER, "librpc client pool",
+	    rpc_client_pool_worker, pool);
+
+	return (pool);
+}
+
+rpc_connection_t
+rpc_client_pool_acquire(rpc_client_pool_t pool)
+{
+	struct rpc_client_pool_member *member;
+	rpc_connection_t result;
+
+	g_mutex_lock(&pool->rcp_mtx);
+	member = rpc_client_pool_pick(pool, NULL);
+	if (member == NULL) {
+		g_mutex_unlock(&pool->rcp_mtx);
+		rpc_set_last_error(ENOTCONN, "No connection available", NULL);
+		return (NULL);
+	}
+
+	g_atomic_int_inc(&member->rcpm_outstanding);
+	result = rpc_client_get_connection(member->rcpm_client);
+	g_mutex_unlock(&pool->rcp_mtx);
+	return (result);
+}
+
+void
+rpc_client_pool_release(rpc_client_pool_t pool, rpc_connection_t conn)
+{
+	struct rpc_client_pool_member *member;
+	size_t i;
+
+	g_mutex_lock(&pool->rcp_mtx);
+	for (i = 0; i < pool->rcp_nmembers; i++) {
+		member = &pool->rcp_members[i];
+		if (member->rcpm_client != NULL &&
+		    rpc_client_get_connection(member->rcpm_client) == conn) {
+			g_atomic_int_add(&member->rcpm_outstanding, -1);
+			break;
+		}
+	}
+
+	g_mutex_unlock(&pool->rcp_mtx);
+}
+
+rpc_object_t
+rpc_client_pool_call_sync(rpc_client_pool_t pool, const char *path,
+    const char *interface, const char *method, rpc_object_t args)
+{
+	rpc_connection_t conn;
+	rpc_call_t call;
+	rpc_object_t result;
+	gint64 start;
+
+	if (rpc_client_pool_is_hedged(pool, interface, method))
+		return (rpc_client_pool_call_hedged(pool, path, interface,
+		    method, args));
+
+	start = g_get_monotonic_time();
+	conn = rpc_client_pool_acquire(pool);
+	if (conn == NULL) {
+		rpc_release(args);
+		return (NULL);
+	}
+
+	call = rpc_connection_call(conn, path, interface, method, args, NULL);
+	if (call == NULL) {
+		rpc_client_pool_release(pool, conn);
+		return (NULL);
+	}
+
+	rpc_call_wait(call);
+	result = rpc_call_result(call);
+	if (result != NULL)
+		rpc_retain(result);
+
+	rpc_call_free(call);
+	rpc_client_pool_release(pool, conn);
+	rpc_client_pool_record(pool, g_get_monotonic_time() - start);
+	return (result);
+}
+
+void
+rpc_client_pool_set_hedged(rpc_client_pool_t pool, const char *interface,
+    const char *method, bool hedged)
+{
+	char *key;
+
+	key = g_strdup_printf("%s.%s", interface != NULL ? interface : "",
+	    method);
+
+	g_mutex_lock(&pool->rcp_mtx);
+	if (hedged)
+		g_hash_table_add(pool->rcp_hedged, key);
+	else {
+		g_hash_table_remove(pool->rcp_hedged, key);
+		g_free(key);
+	}
+	g_mutex_unlock(&pool->rcp_mtx);
+}
+
+void
+rpc_client_pool_free(rpc_client_pool_t pool)
+{
+	size_t i;
+
+	g_mutex_lock(&pool->rcp_mtx);
+	pool->rcp_stop = true;
+	g_cond_signal(&pool->rcp_cv);
+	g_mutex_unlock(&pool->rcp_mtx);
+	g_thread_join(pool->rcp_thread);
+
+	for (i = 0; i < pool->rcp_nmembers; i++) {
+		if (pool->rcp_members[i].rcpm_client != NULL)
+			rpc_client_close(pool->rcp_members[i].rcpm_client);
+
+		g_free(pool->rcp_members[i].rcpm_uri);
+	}
+
+	if (pool->rcp_params != NULL)
+		rpc_release(pool->rcp_params);
+
+	g_free(pool->rcp_members);
+	g_hash_table_destroy(pool->rcp_hedged);
+	g_cond_clear(&pool->rcp_cv);
+	g_mutex_clear(&pool->rcp_mtx);
+	g_free(pool);
+}
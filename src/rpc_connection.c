@@ -26,7 +26,14 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <errno.h>
+#include <sys/stat.h>
+#if defined(__linux__)
+#include <sys/eventfd.h>
+#include <glib-unix.h>
+#endif
 #include <glib.h>
 #include <glib/gprintf.h>
 #include <rpc/config.h>
@@ -38,10 +45,16 @@
 #include "linker_set.h"
 #include "internal.h"
 #include "notify.h"
+#include "slab.h"
+#include "compress.h"
+#include "envelope.h"
+#include "stats.h"
+#include "thread.h"
 #include "serializer/msgpack.h"
 
 #define	DEFAULT_RPC_TIMEOUT	60
 #define	MAX_FDS			128
+#define	MAX_SHMEM_REGIONS	64
 
 typedef enum rpc_close_source
 {
@@ -50,34 +63,172 @@ typedef enum rpc_close_source
 } rpc_close_source_t;
 
 struct work_item;
+struct rpc_call_then;
 
-static rpc_object_t rpc_new_id(void);
+static rpc_object_t rpc_new_id(rpc_connection_t);
+static guint rpc_call_id_hash(gconstpointer);
+static gboolean rpc_call_id_equal(gconstpointer, gconstpointer);
 static rpc_object_t rpc_pack_frame(const char *, const char *, rpc_object_t,
     rpc_object_t);
 static bool rpc_run_callback(rpc_connection_t, struct work_item *);
+static bool rpc_callback_event(rpc_connection_t, rpc_object_t);
 static struct rpc_call *rpc_call_alloc(rpc_connection_t, rpc_object_t,
+    rpc_object_t,
     const char *, const char *, const char *, rpc_object_t);
+static void rpc_send_lock(rpc_connection_t);
+static void rpc_count_time(_Atomic uint64_t *, gint64);
+static void rpc_count_out(rpc_connection_t, size_t, size_t);
 static int rpc_send_frame(rpc_connection_t, rpc_object_t);
+static int rpc_send_frame_tagged(rpc_connection_t, rpc_object_t, rpc_object_t);
+static int rpc_send_frame_queued(rpc_connection_t, rpc_object_t, rpc_object_t);
+static int rpc_connection_flush_subscriptions(rpc_connection_t);
+static gboolean rpc_connection_flush_subscriptions_idle(gpointer);
+static void rpc_connection_queue_subscription(rpc_connection_t,
+    rpc_object_t);
+static int rpc_send_frame_out(rpc_connection_t, rpc_object_t, rpc_object_t);
+static void rpc_send_queue_leave(rpc_connection_t);
+static void rpc_connection_schedule_writable(rpc_connection_t);
+static gboolean rpc_connection_notify_writable(gpointer);
+static rpc_writable_handler_t rpc_call_writable_locked(struct rpc_call *);
+static rpc_call_t rpc_connection_start_call(rpc_connection_t, rpc_call_t,
+    rpc_object_t);
+static rpc_call_t rpc_connection_call_impl(rpc_connection_t, const char *,
+    const char *, const char *, rpc_object_t, rpc_callback_t, rpc_callback_f,
+    void *, bool);
+static void *rpc_connection_add_event_handler(rpc_connection_t,
+    const char *, const char *, const char *, rpc_handler_t, rpc_handler_f,
+    void *);
+static inline bool rpc_call_has_callback(struct rpc_call *);
+static guint rpc_flight_hash(gconstpointer);
+static gboolean rpc_flight_equal(gconstpointer, gconstpointer);
+static void rpc_flight_free(struct rpc_flight *);
+static rpc_call_t rpc_connection_start_flight(rpc_connection_t, rpc_call_t,
+    rpc_object_t);
+static void rpc_flight_end(rpc_call_t, rpc_call_status_t, rpc_object_t);
+static void rpc_flight_leave(rpc_call_t);
+static void rpc_flight_deliver(rpc_call_t, rpc_call_status_t, rpc_object_t);
+static void rpc_flight_send(rpc_call_t);
+static int rpc_send_compressed_locked(rpc_connection_t, rpc_object_t,
+    const int *, size_t, rpc_object_t);
+static int rpc_connection_set_compression(rpc_connection_t, rpc_object_t);
+static int64_t rpc_call_window_locked(struct rpc_call *);
+static int rpc_call_grant_locked(struct rpc_call *);
+static bool rpc_fragment_accounting(rpc_connection_t);
+static bool rpc_fragment_over_budget(rpc_connection_t);
+static void rpc_fragment_charge(rpc_connection_t, int64_t);
+static void rpc_fragment_withhold_locked(struct rpc_call *);
+static void rpc_fragment_resume(void);
+static int rpc_send_batch_frame_locked(rpc_connection_t, rpc_object_t,
+    const int *, size_t, rpc_object_t);
+static int rpc_send_batch_bytes_locked(rpc_connection_t, GBytes *,
+    const int *, size_t, rpc_object_t);
+static void rpc_send_batch_tag_free(gpointer);
+static bool rpc_object_has_fds(rpc_object_t);
+static char *rpc_property_cache_key(const char *, const char *);
+static void rpc_property_cache_free(struct rpc_property_cache *);
+static void rpc_property_cache_update(rpc_connection_t, const char *,
+    rpc_object_t);
+static void rpc_property_cache_put(rpc_connection_t, const char *,
+    const char *, const char *, rpc_object_t, bool);
+static void rpc_property_cache_patch(rpc_connection_t, const char *,
+    const char *, const char *, rpc_object_t);
+#if defined(__linux__)
+static bool rpc_shmem_region_lookup(rpc_connection_t, rpc_object_t);
+static void rpc_shmem_region_settle(rpc_connection_t, guint, int);
+static int rpc_shmem_region_restore(rpc_connection_t, rpc_object_t, int *,
+    size_t);
+#endif
+static int rpc_send_batch_flush_locked(rpc_connection_t);
+static gboolean rpc_send_batch_timeout(gpointer);
+static int rpc_recv_msg(struct rpc_connection *, const void *, size_t, int *,
+    size_t);
+static int rpc_recv_bytes(struct rpc_connection *, GBytes *, int *, size_t);
+static int rpc_recv_object(struct rpc_connection *, rpc_object_t, int *,
+    size_t);
+static int rpc_recv_frame(struct rpc_connection *, const void *, size_t,
+    GBytes *, int *, size_t);
+static int rpc_recv_dispatch(struct rpc_connection *, rpc_object_t, int *,
+    size_t);
+static int rpc_recv_enveloped(struct rpc_connection *, const void *, size_t,
+    int *, size_t);
+static rpc_frame_op_t rpc_frame_lookup_op(const char *, const char *);
+static void rpc_connection_placeholders_init(void);
+static GHashTable *rpc_call_table(GHashTable **);
+static GPtrArray *rpc_connection_subscriptions(rpc_connection_t);
+static GHashTable *rpc_connection_prop_cache(rpc_connection_t);
+static void rpc_connection_callbacks_init(rpc_connection_t);
+static bool rpc_frame_get_envelope(rpc_object_t, struct rpc_envelope *);
+static bool rpc_frame_has_large_binary(rpc_object_t);
+static int rpc_send_enveloped_locked(rpc_connection_t, rpc_object_t,
+    const struct rpc_envelope *, const int *, size_t, rpc_object_t);
+static int rpc_send_vectored_locked(rpc_connection_t, const uint8_t *,
+    const struct iovec *, size_t, const int *, size_t);
+static void rpc_connection_dispatch_op(rpc_connection_t, rpc_frame_op_t,
+    rpc_object_t, rpc_object_t);
 static void on_rpc_call(rpc_connection_t, rpc_object_t, rpc_object_t);
+static void on_rpc_call_batch(rpc_connection_t, rpc_object_t, rpc_object_t);
 static void on_rpc_response(rpc_connection_t, rpc_object_t, rpc_object_t);
 static void on_rpc_start_stream(rpc_connection_t, rpc_object_t, rpc_object_t);
 static void on_rpc_fragment(rpc_connection_t, rpc_object_t, rpc_object_t);
+#if defined(__linux__)
+static rpc_object_t rpc_call_ring_fragment(rpc_connection_t, struct rpc_call *);
+#endif
 static void on_rpc_continue(rpc_connection_t, rpc_object_t, rpc_object_t);
+static void on_rpc_input(rpc_connection_t, rpc_object_t, rpc_object_t);
+static void on_rpc_input_end(rpc_connection_t, rpc_object_t, rpc_object_t);
+static void on_rpc_input_continue(rpc_connection_t, rpc_object_t,
+    rpc_object_t);
+static rpc_call_t rpc_connection_find_inbound_call(rpc_connection_t,
+    rpc_object_t);
 static void on_rpc_end(rpc_connection_t, rpc_object_t, rpc_object_t);
 static void on_rpc_abort(rpc_connection_t, rpc_object_t, rpc_object_t);
 static void on_rpc_error(rpc_connection_t, rpc_object_t, rpc_object_t);
 static void on_events_event(rpc_connection_t, rpc_object_t, rpc_object_t);
 static void on_events_event_burst(rpc_connection_t, rpc_object_t, rpc_object_t);
+static void rpc_event_deliver(rpc_connection_t, rpc_object_t);
+static bool rpc_event_drain(rpc_connection_t);
 static void on_events_subscribe(rpc_connection_t, rpc_object_t, rpc_object_t);
 static void on_events_unsubscribe(rpc_connection_t, rpc_object_t, rpc_object_t);
+#if defined(__linux__)
+static void on_events_ring_attach(rpc_connection_t, rpc_object_t,
+    rpc_object_t);
+static void on_events_ring(rpc_connection_t, rpc_object_t, rpc_object_t);
+static bool rpc_event_ring_wanted(rpc_connection_t, rpc_object_t);
+static void rpc_event_ring_dispatch(rpc_connection_t, GBytes *);
+static gboolean rpc_event_ring_readable(gint, GIOCondition, gpointer);
+#endif
+static void on_session_token(rpc_connection_t, rpc_object_t, rpc_object_t);
+static void on_session_resume(rpc_connection_t, rpc_object_t, rpc_object_t);
+static void on_session_resumed(rpc_connection_t, rpc_object_t, rpc_object_t);
+static rpc_object_t rpc_connection_pack_subscriptions_locked(rpc_connection_t);
 static void rpc_callback_worker(void *, void *);
+static void rpc_connection_send_response_frame(rpc_connection_t, rpc_object_t,
+    rpc_object_t);
+static void rpc_dispatch_call(rpc_connection_t, rpc_object_t, rpc_object_t,
+    struct rpc_call_batch *, size_t);
+static void rpc_call_batch_release(struct rpc_call_batch *);
+static void rpc_call_batch_put(struct rpc_call_batch *, size_t,
+    rpc_object_t);
+static void rpc_executor_run(rpc_executor_t, rpc_work_t);
+static gboolean rpc_executor_invoke(gpointer);
+static void rpc_executor_work_free(gpointer);
+static GSList *rpc_call_wake_locked(rpc_call_t);
+static GSList *rpc_call_settle_locked(rpc_call_t);
+static void rpc_call_run_then(struct rpc_call_then *);
+static void rpc_call_run_thens(GSList *);
+static void rpc_call_drop_then(gpointer);
 static inline rpc_call_status_t rpc_call_status_locked(rpc_call_t);
 static int rpc_call_wait_locked(rpc_call_t);
-static gboolean rpc_call_timeout(gpointer user_data);
+static struct rpc_timer_wheel *rpc_call_timers(void);
+static void rpc_call_timeout(void *);
+static void arm_timeout_locked(rpc_call_t, uint64_t);
 static struct rpc_subscription *rpc_connection_subscribe_event_locked(
     rpc_connection_t, const char *, const char *, const char *, bool);
 static struct rpc_subscription *rpc_connection_find_subscription(rpc_connection_t,
     const char *, const char *, const char *);
+static struct rpc_subscription *rpc_connection_match_subscription(
+    rpc_connection_t, const char *, const char *, const char *);
+static void rpc_connection_unwatch(rpc_connection_t);
 static void rpc_connection_free_resources(rpc_connection_t);
 static int cancel_timeout_locked(rpc_call_t call);
 static void rpc_connection_set_default_fn_handlers(rpc_connection_t);
@@ -85,12 +236,13 @@ static inline rpc_object_t rpc_call_result_save(rpc_call_t call);
 static int rpc_connection_do_close(rpc_connection_t conn, rpc_close_source_t);
 static rpc_connection_t rpc_connection_init(int);
 static void rpc_abort_worker(void *arg, void *data);
+static bool rpc_abort_push(struct rpc_connection *, struct rpc_call *);
 static void call_abort_locked(struct rpc_call *call);
 static void rpc_subscription_release(struct rpc_subscription *sub);
 static void rpc_rsh_release(struct rpc_subscription_handler *rsh);
 static int rpc_set_creds(rpc_connection_t conn, pid_t pid, uid_t uid, gid_t gid);
 static int rpc_connection_unsubscribe_event_locked(rpc_connection_t conn,
-    struct rpc_subscription *sub);
+    struct rpc_subscription *sub, rpc_object_t batch);
 
 struct message_handler
 {
@@ -103,35 +255,218 @@ struct queue_item
 {
 	rpc_call_status_t status;
 	rpc_object_t item;
+	int64_t bytes;
+	int64_t charged;	/* against the fragment budgets */
 };
 
 struct work_item
 {
     	rpc_call_t call;
     	rpc_object_t event;
+	rpc_object_t burst;
+	size_t burst_idx;
+	bool drain;
+};
+
+struct rpc_call_then
+{
+	rpc_call_t		rct_call;
+	rpc_executor_t		rct_executor;
+	rpc_then_t		rct_fn;
+};
+
+/*
+ * Identical calls in flight, see rpc_connection_set_coalescing(). Only
+ * the leader goes out; followers are registered like any outbound call
+ * and complete with its result, or are sent on their own if the result
+ * can't be shared.
+ */
+struct rpc_flight
+{
+	char *			rf_path;
+	char *			rf_interface;
+	char *			rf_method;
+	rpc_object_t		rf_args;
+	guint			rf_hash;
+	rpc_call_t		rf_leader;
+	GPtrArray *		rf_followers;
 };
 
-static const struct message_handler handlers[] = {
-	{ "rpc", "call", on_rpc_call },
-	{ "rpc", "response", on_rpc_response },
-	{ "rpc", "start_stream", on_rpc_start_stream },
-	{ "rpc", "fragment", on_rpc_fragment },
-	{ "rpc", "continue", on_rpc_continue },
-	{ "rpc", "end", on_rpc_end },
-	{ "rpc", "abort", on_rpc_abort },
-	{ "rpc", "error", on_rpc_error },
-	{ "events", "event", on_events_event },
-	{ "events", "event_burst", on_events_event_burst },
-	{ "events", "subscribe", on_events_subscribe },
-	{ "events", "unsubscribe", on_events_unsubscribe },
-	{ }
+/*
+ * Indexed by opcode. Names are unique across namespaces, so frames in
+ * the dictionary envelope find their opcode by name alone.
+ */
+static const struct message_handler handlers[RPC_OP_MAX] = {
+	[RPC_OP_CALL] = { "rpc", "call", on_rpc_call },
+	[RPC_OP_CALL_BATCH] = { "rpc", "call_batch", on_rpc_call_batch },
+	[RPC_OP_RESPONSE] = { "rpc", "response", on_rpc_response },
+	[RPC_OP_START_STREAM] = { "rpc", "start_stream", on_rpc_start_stream },
+	[RPC_OP_FRAGMENT] = { "rpc", "fragment", on_rpc_fragment },
+	[RPC_OP_CONTINUE] = { "rpc", "continue", on_rpc_continue },
+	[RPC_OP_INPUT] = { "rpc", "input", on_rpc_input },
+	[RPC_OP_INPUT_END] = { "rpc", "input_end", on_rpc_input_end },
+	[RPC_OP_INPUT_CONTINUE] = {
+	    "rpc", "input_continue", on_rpc_input_continue },
+	[RPC_OP_END] = { "rpc", "end", on_rpc_end },
+	[RPC_OP_ABORT] = { "rpc", "abort", on_rpc_abort },
+	[RPC_OP_ERROR] = { "rpc", "error", on_rpc_error },
+	[RPC_OP_EVENT] = { "events", "event", on_events_event },
+	[RPC_OP_EVENT_BURST] = {
+	    "events", "event_burst", on_events_event_burst },
+	[RPC_OP_SUBSCRIBE] = { "events", "subscribe", on_events_subscribe },
+	[RPC_OP_UNSUBSCRIBE] = {
+	    "events", "unsubscribe", on_events_unsubscribe },
+#if defined(__linux__)
+	[RPC_OP_RING_ATTACH] = {
+	    "events", "ring_attach", on_events_ring_attach },
+	[RPC_OP_RING] = { "events", "ring", on_events_ring },
+#endif
+	[RPC_OP_SESSION_TOKEN] = { "session", "token", on_session_token },
+	[RPC_OP_SESSION_RESUME] = { "session", "resume", on_session_resume },
+	[RPC_OP_SESSION_RESUMED] = {
+	    "session", "resumed", on_session_resumed },
 };
 
+static GHashTable *handlers_by_name;
+
+/*
+ * Tables of a connection that saw no calls, subscriptions, property
+ * caches or memory files yet all point to these shared, always empty
+ * placeholders; the first insertion swaps in a table of its own, under
+ * the lock that already protects it. Idle connections, which servers
+ * may hold by the hundred thousand, then don't pay for them.
+ */
+static GHashTable *rpc_empty_calls;
+static GHashTable *rpc_empty_prop_cache;
+static GPtrArray *rpc_empty_subscriptions;
+#if defined(__linux__)
+static GArray *rpc_empty_shmem_tx;
+static GHashTable *rpc_empty_shmem_rx;
+#endif
+
+/*
+ * Bytes of received fragments not consumed yet, in every connection,
+ * and streaming calls whose grants wait for some of them to go.
+ */
+static _Atomic int64_t rpc_fragment_total;
+static _Atomic uint64_t rpc_fragment_ceiling;
+static GMutex rpc_fragment_mtx;
+static GQueue rpc_fragment_starved = G_QUEUE_INIT;
+static volatile gint rpc_fragment_nstarved;
+
 static GRWLock active_rwlock;
 static GHashTable *active_connections = NULL;
 
+#if defined(__linux__)
+/*
+ * Called with rco_send_mtx held. Returns true if the peer already holds
+ * the memory file backing the object, in which case only the region ID
+ * is sent. Otherwise the file is remembered under a fresh region ID that
+ * travels along with the descriptor.
+ */
+static bool
+rpc_shmem_region_lookup(rpc_connection_t conn, rpc_object_t obj)
+{
+	struct rpc_shmem_region region;
+	struct rpc_shmem_region *entry;
+	struct stat st;
+	guint i;
+
+	if (!conn->rco_shmem_regions)
+		return (false);
+
+	if (fstat(obj->ro_value.rv_shmem.rsb_fd, &st) != 0)
+		return (false);
+
+	for (i = 0; i < conn->rco_shmem_tx->len; i++) {
+		entry = &g_array_index(conn->rco_shmem_tx,
+		    struct rpc_shmem_region, i);
+		if (entry->rsr_dev == st.st_dev && entry->rsr_ino == st.st_ino) {
+			obj->ro_value.rv_shmem.rsb_fd = -1;
+			obj->ro_value.rv_shmem.rsb_region = entry->rsr_id;
+			return (true);
+		}
+	}
+
+	if (conn->rco_shmem_tx->len >= MAX_SHMEM_REGIONS)
+		return (false);
+
+	/* Keep the file open so its inode can't be reused under us */
+	region.rsr_dev = st.st_dev;
+	region.rsr_ino = st.st_ino;
+	region.rsr_fd = dup(obj->ro_value.rv_shmem.rsb_fd);
+	region.rsr_id = ++conn->rco_shmem_next_region;
+	if (region.rsr_fd < 0)
+		return (false);
+
+	if (conn->rco_shmem_tx == rpc_empty_shmem_tx)
+		conn->rco_shmem_tx = g_array_new(false, true,
+		    sizeof(struct rpc_shmem_region));
+
+	g_array_append_val(conn->rco_shmem_tx, region);
+	obj->ro_value.rv_shmem.rsb_region = region.rsr_id;
+	return (false);
+}
+
+/*
+ * Called with rco_send_mtx held once the frame is out. If it didn't make
+ * it, the peer never got the descriptors of the regions it registered,
+ * so those are forgotten again and the next frame passes them anew.
+ */
+static void
+rpc_shmem_region_settle(rpc_connection_t conn, guint mark, int ret)
+{
+	guint i;
+
+	if (ret == 0 || conn->rco_shmem_tx->len <= mark)
+		return;
+
+	for (i = mark; i < conn->rco_shmem_tx->len; i++)
+		close(g_array_index(conn->rco_shmem_tx,
+		    struct rpc_shmem_region, i).rsr_fd);
+
+	g_array_set_size(conn->rco_shmem_tx, mark);
+}
+
+static int
+rpc_shmem_region_restore(rpc_connection_t conn, rpc_object_t obj, int *fds,
+    size_t nfds)
+{
+	int64_t id = obj->ro_value.rv_shmem.rsb_region;
+	int idx = obj->ro_value.rv_shmem.rsb_fd;
+	gpointer value;
+	int fd = -1;
+
+	obj->ro_value.rv_shmem.rsb_region = 0;
+
+	g_mutex_lock(&conn->rco_shmem_mtx);
+	if (idx >= 0 && (size_t)idx < nfds) {
+		fd = fds[idx];
+		if (id > 0 && g_hash_table_size(conn->rco_shmem_rx) <
+		    MAX_SHMEM_REGIONS && !g_hash_table_contains(
+		    conn->rco_shmem_rx, GSIZE_TO_POINTER(id))) {
+			if (conn->rco_shmem_rx == rpc_empty_shmem_rx)
+				conn->rco_shmem_rx = g_hash_table_new(NULL,
+				    NULL);
+
+			g_hash_table_insert(conn->rco_shmem_rx,
+			    GSIZE_TO_POINTER(id), GINT_TO_POINTER(dup(fd)));
+		}
+	} else if (id > 0 && g_hash_table_lookup_extended(conn->rco_shmem_rx,
+	    GSIZE_TO_POINTER(id), NULL, &value)) {
+		/* The caller owns the descriptor, as if it came over the wire */
+		fd = dup(GPOINTER_TO_INT(value));
+	}
+	g_mutex_unlock(&conn->rco_shmem_mtx);
+
+	obj->ro_value.rv_shmem.rsb_fd = fd;
+	return (fd);
+}
+#endif
+
 static size_t
-rpc_serialize_fds(rpc_object_t obj, int *fds, size_t *nfds, size_t idx)
+rpc_serialize_fds(rpc_connection_t conn, rpc_object_t obj, int *fds,
+    size_t *nfds, size_t idx)
 {
 	__block size_t counter = idx;
 
@@ -144,6 +479,9 @@ rpc_serialize_fds(rpc_object_t obj, int *fds, size_t *nfds, size_t idx)
 
 #if defined(__linux__)
 	case RPC_TYPE_SHMEM:
+		if (rpc_shmem_region_lookup(conn, obj))
+			break;
+
 		fds[counter] = obj->ro_value.rv_shmem.rsb_fd;
 		obj->ro_value.rv_shmem.rsb_fd = (int)counter;
 		counter++;
@@ -152,7 +490,8 @@ rpc_serialize_fds(rpc_object_t obj, int *fds, size_t *nfds, size_t idx)
 
 	case RPC_TYPE_ARRAY:
 		rpc_array_apply(obj, ^(size_t aidx __unused, rpc_object_t i) {
-			counter += rpc_serialize_fds(i, fds, nfds, idx);
+			counter += rpc_serialize_fds(conn, i, fds, nfds,
+			    idx);
 			return ((bool)true);
 		});
 		break;
@@ -160,7 +499,8 @@ rpc_serialize_fds(rpc_object_t obj, int *fds, size_t *nfds, size_t idx)
 	case RPC_TYPE_DICTIONARY:
 		rpc_dictionary_apply(obj, ^(const char *name __unused,
 		    rpc_object_t i) {
-			counter += rpc_serialize_fds(i, fds, nfds, idx);
+			counter += rpc_serialize_fds(conn, i, fds, nfds,
+			    idx);
 			return ((bool)true);
 		});
 		break;
@@ -172,8 +512,42 @@ rpc_serialize_fds(rpc_object_t obj, int *fds, size_t *nfds, size_t idx)
 	return (counter);
 }
 
+static bool
+rpc_object_has_fds(rpc_object_t obj)
+{
+	__block bool found = false;
+
+	switch (rpc_get_type(obj)) {
+	case RPC_TYPE_FD:
+#if defined(__linux__)
+	case RPC_TYPE_SHMEM:
+#endif
+		return (true);
+
+	case RPC_TYPE_ARRAY:
+		rpc_array_apply(obj, ^(size_t idx __unused, rpc_object_t i) {
+			found = rpc_object_has_fds(i);
+			return ((bool)!found);
+		});
+		break;
+
+	case RPC_TYPE_DICTIONARY:
+		rpc_dictionary_apply(obj, ^(const char *name __unused,
+		    rpc_object_t i) {
+			found = rpc_object_has_fds(i);
+			return ((bool)!found);
+		});
+		break;
+
+	default:
+		break;
+	}
+
+	return (found);
+}
+
 static void
-rpc_restore_fds(rpc_object_t obj, int *fds, size_t nfds)
+rpc_restore_fds(rpc_connection_t conn, rpc_object_t obj, int *fds, size_t nfds)
 {
 
 	switch (rpc_get_type(obj)) {
@@ -183,15 +557,14 @@ rpc_restore_fds(rpc_object_t obj, int *fds, size_t nfds)
 
 #if defined(__linux__)
 		case RPC_TYPE_SHMEM:
-			obj->ro_value.rv_shmem.rsb_fd =
-			    fds[obj->ro_value.rv_shmem.rsb_fd];
+			rpc_shmem_region_restore(conn, obj, fds, nfds);
 			break;
 #endif
 
 		case RPC_TYPE_ARRAY:
 			rpc_array_apply(obj, ^(size_t idx __unused,
 			    rpc_object_t item) {
-				rpc_restore_fds(item, fds, nfds);
+				rpc_restore_fds(conn, item, fds, nfds);
 				return ((bool)true);
 			});
 			break;
@@ -199,7 +572,7 @@ rpc_restore_fds(rpc_object_t obj, int *fds, size_t nfds)
 		case RPC_TYPE_DICTIONARY:
 			rpc_dictionary_apply(obj, ^(const char *key __unused,
 			    rpc_object_t value) {
-				rpc_restore_fds(value, fds, nfds);
+				rpc_restore_fds(conn, value, fds, nfds);
 				return ((bool)true);
 			});
 			break;
@@ -224,6 +597,15 @@ rpc_run_callback(rpc_connection_t conn, struct work_item *item)
 		return (true);
 	}
 #endif
+	rpc_connection_callbacks_init(conn);
+	if (conn->rco_callback_exec != NULL) {
+		return (rpc_exec_submit(conn->rco_callback_exec,
+		    (guintptr)conn, 0, item));
+	}
+
+	if (conn->rco_callback_pool == NULL)
+		return (false);
+
 	g_thread_pool_push(conn->rco_callback_pool, item, &err);
 	if (err != NULL) {
 		g_error_free(err);
@@ -233,31 +615,35 @@ rpc_run_callback(rpc_connection_t conn, struct work_item *item)
 	return (true);
 }
 
+static inline bool
+rpc_call_has_callback(struct rpc_call *call)
+{
+
+	return (call->rc_callback != NULL || call->rc_callback_fn != NULL);
+}
+
 static void
 rpc_callback_worker(void *arg, void *data)
 {
 	struct work_item *item = arg;
-	struct rpc_subscription *sub;
-	struct rpc_subscription_handler *handler;
-	const char *path;
-	const char *interface;
-	const char *name;
 	rpc_call_t call;
 	rpc_connection_t conn = data;
 	rpc_call_status_t call_status;
 	bool ret;
 
-
+	rpc_thread_enter(RPC_THREAD_CALLBACK, "rpc callback");
 	if (rpc_connection_retain_if_valid(conn, true) != 0)
 		return;
 
 	if (item->call) {
 		call = item->call;
 
-		if (call->rc_callback == NULL)
+		if (!rpc_call_has_callback(call))
 			goto done;
 
-		ret = call->rc_callback(call);
+		ret = call->rc_callback_fn != NULL
+		    ? call->rc_callback_fn(call->rc_callback_ctx, call)
+		    : call->rc_callback(call);
 
 		call_status = rpc_call_status(call);
 		if (call_status == RPC_CALL_MORE_AVAILABLE ||
@@ -272,41 +658,181 @@ rpc_callback_worker(void *arg, void *data)
 	}
 
 	if (item->event) {
+		if (!rpc_callback_event(conn, item->event))
+			goto requeue;
 
-		path = rpc_dictionary_get_string(item->event, "path");
-		interface = rpc_dictionary_get_string(item->event, "interface");
-		name = rpc_dictionary_get_string(item->event, "name");
-		data = rpc_dictionary_get_value(item->event, "args");
-		g_rw_lock_writer_lock(&conn->rco_subscription_rwlock);
-		sub = rpc_connection_find_subscription(conn, path, interface, name);
+		rpc_release(item->event);
+	}
 
-		if (sub != NULL) {
-			if (sub->rsu_busy) {
-				rpc_run_callback(conn, item);
-				g_rw_lock_writer_unlock(&conn->rco_subscription_rwlock);
-				rpc_connection_release(conn);
-				return;
-			}
-			sub->rsu_busy = true;
-			for (guint i = 0; i < sub->rsu_handlers->len; i++) {
-				handler = g_ptr_array_index(sub->rsu_handlers, i);
-				g_rw_lock_writer_unlock(&conn->rco_subscription_rwlock);
-				handler->rsh_handler(path, interface, name, data);
-				g_rw_lock_writer_lock(&conn->rco_subscription_rwlock);
-			}
-			sub->rsu_busy = false;
+	if (item->burst) {
+		/* Resumes where it left off if it had to be requeued */
+		for (; item->burst_idx < rpc_array_get_count(item->burst);
+		    item->burst_idx++) {
+			if (!rpc_callback_event(conn, rpc_array_get_value(
+			    item->burst, item->burst_idx)))
+				goto requeue;
 		}
-		g_rw_lock_writer_unlock(&conn->rco_subscription_rwlock);
 
-		if (conn->rco_event_handler != NULL)
-			conn->rco_event_handler(path, interface, name, data);
+		rpc_release(item->burst);
+	}
 
-		rpc_release(item->event);
+	if (item->drain) {
+		if (!rpc_event_drain(conn))
+			goto requeue;
 	}
 
 done:
 	rpc_connection_release(conn);
 	g_free(item);
+	return;
+
+requeue:
+	/* A handler for this subscription is still running */
+	rpc_run_callback(conn, item);
+	rpc_connection_release(conn);
+}
+
+static void
+rpc_executor_run(rpc_executor_t executor, rpc_work_t work)
+{
+
+	if (executor == NULL) {
+		work();
+		return;
+	}
+
+	executor(work);
+}
+
+static gboolean
+rpc_executor_invoke(gpointer arg)
+{
+	rpc_work_t work = arg;
+
+	work();
+	return (G_SOURCE_REMOVE);
+}
+
+static void
+rpc_executor_work_free(gpointer arg)
+{
+
+	Block_release(arg);
+}
+
+/*
+ * Hands the blocks waiting for the next status update over to the
+ * caller, who runs them once the call mutex is dropped.
+ */
+static GSList *
+rpc_call_wake_locked(rpc_call_t call)
+{
+	GSList *waiters = call->rc_waiters;
+
+	call->rc_waiters = NULL;
+	return (g_slist_reverse(waiters));
+}
+
+/*
+ * Same as rpc_call_wake_locked(), but also marks the call finished and
+ * takes its continuations.
+ */
+static GSList *
+rpc_call_settle_locked(rpc_call_t call)
+{
+	GSList *thens = call->rc_thens;
+
+	RPC_PROBE2(call__settle, call->rc_conn, call);
+	call->rc_settled = true;
+	call->rc_thens = NULL;
+	return (g_slist_concat(rpc_call_wake_locked(call),
+	    g_slist_reverse(thens)));
+}
+
+static void
+rpc_call_run_then(struct rpc_call_then *then)
+{
+	rpc_call_t call = then->rct_call;
+	rpc_then_t fn = then->rct_fn;
+
+	rpc_executor_run(then->rct_executor, ^{
+		fn(call);
+		Block_release(fn);
+		rpc_connection_call_release(call);
+	});
+
+	if (then->rct_executor != NULL)
+		Block_release(then->rct_executor);
+
+	g_free(then);
+}
+
+static void
+rpc_call_run_thens(GSList *thens)
+{
+	GSList *iter;
+
+	for (iter = thens; iter != NULL; iter = iter->next)
+		rpc_call_run_then(iter->data);
+
+	g_slist_free(thens);
+}
+
+static void
+rpc_call_drop_then(gpointer arg)
+{
+	struct rpc_call_then *then = arg;
+
+	Block_release(then->rct_fn);
+	if (then->rct_executor != NULL)
+		Block_release(then->rct_executor);
+
+	rpc_connection_call_release(then->rct_call);
+	g_free(then);
+}
+
+static bool
+rpc_callback_event(rpc_connection_t conn, rpc_object_t event)
+{
+	struct rpc_subscription *sub;
+	struct rpc_subscription_handler *handler;
+	const char *path;
+	const char *interface;
+	const char *name;
+	rpc_object_t data;
+
+	path = rpc_dictionary_get_string(event, RPC_ATOM(PATH));
+	interface = rpc_dictionary_get_string(event, RPC_ATOM(INTERFACE));
+	name = rpc_dictionary_get_string(event, RPC_ATOM(NAME));
+	data = rpc_dictionary_get_value(event, RPC_ATOM(ARGS));
+	g_rw_lock_writer_lock(&conn->rco_subscription_rwlock);
+	sub = rpc_connection_match_subscription(conn, path, interface, name);
+
+	if (sub != NULL) {
+		if (sub->rsu_busy) {
+			g_rw_lock_writer_unlock(&conn->rco_subscription_rwlock);
+			return (false);
+		}
+		sub->rsu_busy = true;
+		for (guint i = 0; i < sub->rsu_handlers->len; i++) {
+			handler = g_ptr_array_index(sub->rsu_handlers, i);
+			g_rw_lock_writer_unlock(&conn->rco_subscription_rwlock);
+			if (handler->rsh_fn != NULL)
+				handler->rsh_fn(handler->rsh_ctx, path,
+				    interface, name, data);
+			else
+				handler->rsh_handler(path, interface, name,
+				    data);
+			g_rw_lock_writer_lock(&conn->rco_subscription_rwlock);
+		}
+		sub->rsu_busy = false;
+	}
+	g_rw_lock_writer_unlock(&conn->rco_subscription_rwlock);
+
+	if (conn->rco_event_handler != NULL)
+		conn->rco_event_handler(path, interface, name, data);
+
+	return (true);
 }
 
 static rpc_object_t
@@ -316,10 +842,11 @@ rpc_pack_frame(const char *ns, const char *name, rpc_object_t id,
 	rpc_object_t obj;
 
 	obj = rpc_dictionary_create();
-	rpc_dictionary_set_string(obj, "namespace", ns);
-	rpc_dictionary_set_string(obj, "name", name);
-	rpc_dictionary_steal_value(obj, "id", id ? rpc_retain(id) : rpc_null_create());
-	rpc_dictionary_steal_value(obj, "args", args);
+	rpc_dictionary_set_string(obj, RPC_ATOM(NAMESPACE), ns);
+	rpc_dictionary_set_string(obj, RPC_ATOM(NAME), name);
+	rpc_dictionary_steal_value(obj, RPC_ATOM(ID),
+	    id ? rpc_retain(id) : rpc_null_create());
+	rpc_dictionary_steal_value(obj, RPC_ATOM(ARGS), args);
 	return (obj);
 }
 
@@ -352,57 +879,214 @@ rpc_connection_set_context(rpc_connection_t conn, rpc_context_t ctx)
 	return (ret);
 }
 
+static struct rpc_timer_wheel *
+rpc_call_timers(void)
+{
+	static struct rpc_timer_wheel *timers;
+
+	if (g_once_init_enter(&timers))
+		g_once_init_leave(&timers, rpc_timer_wheel_new("librpc timers"));
+
+	return (timers);
+}
+
+static void
+arm_timeout_locked(rpc_call_t call, uint64_t msecs)
+{
+
+	/* The timer holds a reference until it expires or gets cancelled */
+	rpc_connection_call_retain(call);
+	rpc_timer_arm(rpc_call_timers(), &call->rc_timer, msecs,
+	    rpc_call_timeout, call);
+}
+
 static int
 cancel_timeout_locked(rpc_call_t call)
 {
-	/* Cancel timeout source */
-	if (call->rc_timeout != NULL) {
-		if (call->rc_timedout)
-			return (-1);
 
-		g_source_destroy(call->rc_timeout);
-		g_source_unref(call->rc_timeout);
-		call->rc_timeout = NULL;
+	switch (rpc_timer_cancel(rpc_call_timers(), &call->rc_timer)) {
+	case 1:
+		/* Never the last reference, the caller holds one */
+		rpc_connection_call_release(call);
+		return (0);
+
+	case -1:
+		return (-1);
+
+	default:
+		return (0);
 	}
-	return (0);
 }
 
 static void
-on_rpc_call(rpc_connection_t conn, rpc_object_t args, rpc_object_t id)
+rpc_call_batch_release(struct rpc_call_batch *batch)
 {
-	rpc_call_t call;
-	const char *method = NULL;
-	const char *interface = NULL;
-	const char *path = NULL;
-	rpc_object_t call_args = NULL;
-	rpc_object_t err;
-	int res;
 
-	if (conn->rco_rpc_context == NULL) {
-		rpc_connection_send_err(conn, id, ENOTSUP, "Not supported");
+	if (!g_atomic_int_dec_and_test(&batch->rcb_pending))
 		return;
-	}
-
-	rpc_object_unpack(args, "{s,s,s,v}",
-	    "method", &method,
-	    "interface", &interface,
-	    "path", &path,
-	    "args", &call_args);
 
-	rpc_retain(id);
-	call = rpc_call_alloc(conn, id, path, interface, method, call_args);
-	if (call == NULL) {
-		err = rpc_get_last_error();
-		rpc_connection_send_err(conn, id, rpc_error_get_code(err),
-		    rpc_error_get_message(err));
-		return;
-	}
+	rpc_connection_send_response(batch->rcb_conn, batch->rcb_id,
+	    batch->rcb_results);
 
-	call->rc_type = RPC_INBOUND_CALL;
+	rpc_release(batch->rcb_id);
+	g_mutex_clear(&batch->rcb_mtx);
+	g_free(batch);
+}
+
+static void
+rpc_call_batch_put(struct rpc_call_batch *batch, size_t idx,
+    rpc_object_t result)
+{
+
+	g_mutex_lock(&batch->rcb_mtx);
+	rpc_array_steal_value(batch->rcb_results, idx, result);
+	g_mutex_unlock(&batch->rcb_mtx);
+	rpc_call_batch_release(batch);
+}
+
+void
+rpc_call_batch_set_result(struct rpc_call *call, rpc_object_t result)
+{
+
+	/* Whatever comes first is the answer */
+	if (call->rc_batch_result != NULL) {
+		rpc_release(result);
+		return;
+	}
+
+	call->rc_batch_result = result;
+}
+
+static void
+on_rpc_call(rpc_connection_t conn, rpc_object_t args, rpc_object_t id)
+{
+
+	rpc_retain(id);
+	rpc_dispatch_call(conn, args, id, NULL, 0);
+}
+
+static void
+on_rpc_call_batch(rpc_connection_t conn, rpc_object_t args, rpc_object_t id)
+{
+	struct rpc_call_batch *batch;
+	size_t count;
+	size_t i;
+
+	if (conn->rco_rpc_context == NULL) {
+		rpc_connection_send_err(conn, id, ENOTSUP, "Not supported");
+		return;
+	}
+
+	if (args == NULL || rpc_get_type(args) != RPC_TYPE_ARRAY) {
+		rpc_connection_send_err(conn, id, EINVAL, "Malformed batch");
+		return;
+	}
+
+	count = rpc_array_get_count(args);
+	batch = g_malloc0(sizeof(*batch));
+	batch->rcb_conn = conn;
+	batch->rcb_id = rpc_retain(id);
+	batch->rcb_results = rpc_array_create();
+	g_mutex_init(&batch->rcb_mtx);
+
+	/* One extra for the fan-out itself, so nothing is sent halfway */
+	batch->rcb_pending = (gint)count + 1;
+
+	for (i = 0; i < count; i++) {
+		rpc_dispatch_call(conn, rpc_array_get_value(args, i),
+		    rpc_string_create_with_format("batch:%p:%zu", batch, i),
+		    batch, i);
+	}
+
+	rpc_call_batch_release(batch);
+}
+
+/*
+ * Dispatches a single call, consuming @p id. Calls that are part of a
+ * batch report back to @p batch instead of answering on their own.
+ */
+static void
+rpc_dispatch_call(rpc_connection_t conn, rpc_object_t args, rpc_object_t id,
+    struct rpc_call_batch *batch, size_t idx)
+{
+	rpc_call_t call;
+	const char *method = NULL;
+	const char *interface = NULL;
+	const char *path = NULL;
+	rpc_object_t call_args = NULL;
+	rpc_object_t prio;
+	rpc_object_t timeout;
+	rpc_object_t err;
+	int res;
+
+	if (conn->rco_rpc_context == NULL) {
+		rpc_connection_send_err(conn, id, ENOTSUP, "Not supported");
+		rpc_release(id);
+		return;
+	}
+
+	rpc_object_unpack(args, "{s,s,s,v}",
+	    "method", &method,
+	    "interface", &interface,
+	    "path", &path,
+	    "args", &call_args);
+
+	call = rpc_call_alloc(conn, id, args, path, interface, method,
+	    call_args);
+	if (call == NULL) {
+		err = rpc_get_last_error();
+		if (batch != NULL)
+			rpc_call_batch_put(batch, idx, rpc_error_create(
+			    rpc_error_get_code(err),
+			    rpc_error_get_message(err), NULL));
+		else
+			rpc_connection_send_err(conn, id,
+			    rpc_error_get_code(err),
+			    rpc_error_get_message(err));
+
+		rpc_release(id);
+		return;
+	}
+
+	call->rc_type = RPC_INBOUND_CALL;
+	call->rc_batch = batch;
+	call->rc_batch_idx = idx;
+
+	/* Arguments streamed in with rpc.input frames follow */
+	if (batch == NULL && rpc_dictionary_get_bool(args, "input")) {
+		call->rc_input = true;
+		call->rc_input_credit = RPC_INPUT_WINDOW;
+	}
+
+	/* Optional, and anything out of range is ignored */
+	prio = rpc_dictionary_get_value(args, RPC_ATOM(PRIORITY));
+	if (prio != NULL && rpc_get_type(prio) == RPC_TYPE_UINT64 &&
+	    rpc_uint64_get_value(prio) <= RPC_PRIORITY_HIGH)
+		call->rc_priority =
+		    (rpc_call_priority_t)rpc_uint64_get_value(prio);
+
+	if (prio != NULL && rpc_get_type(prio) == RPC_TYPE_INT64 &&
+	    rpc_int64_get_value(prio) >= 0 &&
+	    rpc_int64_get_value(prio) <= RPC_PRIORITY_HIGH)
+		call->rc_priority =
+		    (rpc_call_priority_t)rpc_int64_get_value(prio);
+
+	/*
+	 * The caller's remaining budget, in msecs. It's relative so that
+	 * the two ends don't need synchronized clocks.
+	 */
+	timeout = rpc_dictionary_get_value(args, RPC_ATOM(TIMEOUT));
+	if (timeout != NULL && rpc_get_type(timeout) == RPC_TYPE_UINT64 &&
+	    rpc_uint64_get_value(timeout) > 0 &&
+	    rpc_uint64_get_value(timeout) < G_MAXINT64 / 1000)
+		call->rc_deadline = g_get_monotonic_time() +
+		    (gint64)rpc_uint64_get_value(timeout) * 1000;
+
+	rpc_trace_ctx_accept(call, args);
 
 	g_rw_lock_writer_lock(&conn->rco_icall_rwlock);
-	g_hash_table_insert(conn->rco_inbound_calls,
-	    (gpointer)rpc_string_get_string_ptr(id), call);
+	g_hash_table_insert(rpc_call_table(&conn->rco_inbound_calls),
+	    call->rc_id, call);
 	g_rw_lock_writer_unlock(&conn->rco_icall_rwlock);
 
 	if (conn->rco_server != NULL)
@@ -426,10 +1110,10 @@ on_rpc_response(rpc_connection_t conn, rpc_object_t args, rpc_object_t id)
 	struct queue_item *q_item;
 	struct work_item *item;
 	rpc_call_t call;
+	GSList *thens;
 
 	g_rw_lock_reader_lock(&conn->rco_call_rwlock);
-	call = g_hash_table_lookup(conn->rco_calls,
-	    rpc_string_get_string_ptr(id));
+	call = g_hash_table_lookup(conn->rco_calls, id);
 	if (call == NULL) {
 		g_rw_lock_reader_unlock(&conn->rco_call_rwlock);
 		return;
@@ -449,20 +1133,29 @@ on_rpc_response(rpc_connection_t conn, rpc_object_t args, rpc_object_t id)
 
 	g_rw_lock_reader_unlock(&conn->rco_call_rwlock);
 
-	if (call->rc_callback) {
+	if (rpc_call_has_callback(call)) {
 		item = g_malloc0(sizeof(*item));
 		item->call = call;
 		if (!rpc_run_callback(conn, item))
 			g_free(item);
 	}
 
-	q_item = g_malloc(sizeof(*q_item));
+	/* May be shared with coalesced calls */
+	if (g_atomic_pointer_get(&conn->rco_flights) != NULL)
+		rpc_object_freeze(args);
+
+	q_item = g_malloc0(sizeof(*q_item));
 	q_item->status = RPC_CALL_DONE;
 	q_item->item = rpc_retain(args);
 
-	g_queue_push_tail(call->rc_queue, q_item);
+	g_queue_push_tail(&call->rc_queue, q_item);
 	notify_signal(&call->rc_notify);
+	thens = rpc_call_settle_locked(call);
 	g_mutex_unlock(&call->rc_mtx);
+	rpc_call_run_thens(thens);
+	if (call->rc_flight != NULL)
+		rpc_flight_end(call, RPC_CALL_DONE, args);
+
 	rpc_connection_call_release(call);
 }
 
@@ -472,11 +1165,11 @@ on_rpc_start_stream(rpc_connection_t conn, rpc_object_t args, rpc_object_t id)
 	struct queue_item *q_item;
 	struct work_item *item;
 	rpc_call_t call;
+	GSList *waiters;
 	int64_t seqno;
 
 	g_rw_lock_reader_lock(&conn->rco_call_rwlock);
-	call = g_hash_table_lookup(conn->rco_calls,
-	    rpc_string_get_string_ptr(id));
+	call = g_hash_table_lookup(conn->rco_calls, id);
 	if (call == NULL) {
 		g_rw_lock_reader_unlock(&conn->rco_call_rwlock);
 		return;
@@ -494,20 +1187,27 @@ on_rpc_start_stream(rpc_connection_t conn, rpc_object_t args, rpc_object_t id)
 
 	seqno = rpc_dictionary_get_int64(args, "seqno");
 
-	if (call->rc_callback) {
+	if (rpc_call_has_callback(call)) {
 		item = g_malloc0(sizeof(*item));
 		item->call = call;
 		if (!rpc_run_callback(conn, item))
 			g_free(item);
 	}
 
-	q_item = g_malloc(sizeof(*q_item));
+	q_item = g_malloc0(sizeof(*q_item));
 	q_item->status = RPC_CALL_STREAM_START;
 	q_item->item = rpc_null_create();
 
-	g_queue_push_tail(call->rc_queue, q_item);
+	g_queue_push_tail(&call->rc_queue, q_item);
 	notify_signal(&call->rc_notify);
+	waiters = rpc_call_wake_locked(call);
 	g_mutex_unlock(&call->rc_mtx);
+	rpc_call_run_thens(waiters);
+
+	/* A stream can't be shared, coalesced calls get their own */
+	if (call->rc_flight != NULL)
+		rpc_flight_end(call, RPC_CALL_STREAM_START, NULL);
+
 	rpc_connection_call_release(call);
 }
 
@@ -517,12 +1217,19 @@ on_rpc_fragment(rpc_connection_t conn, rpc_object_t args, rpc_object_t id)
 	struct queue_item *q_item;
 	struct work_item *item;
 	rpc_call_t call;
+	GSList *waiters;
 	rpc_object_t payload;
+	rpc_object_t batch;
+	rpc_object_t ring_payload = NULL;
 	int64_t seqno;
+	int64_t bytes;
+	size_t count;
+	size_t i;
+	gint64 sample;
+	gint64 now;
 
 	g_rw_lock_reader_lock(&conn->rco_call_rwlock);
-	call = g_hash_table_lookup(conn->rco_calls,
-	    rpc_string_get_string_ptr(id));
+	call = g_hash_table_lookup(conn->rco_calls, id);
 	if (call == NULL) {
 		g_rw_lock_reader_unlock(&conn->rco_call_rwlock);
 		return;
@@ -540,46 +1247,127 @@ on_rpc_fragment(rpc_connection_t conn, rpc_object_t args, rpc_object_t id)
 	g_rw_lock_reader_unlock(&conn->rco_call_rwlock);
 
 	seqno = rpc_dictionary_get_int64(args, "seqno");
-	payload = rpc_dictionary_get_value(args, "fragment");
+	bytes = rpc_dictionary_get_int64(args, RPC_ATOM(BYTES));
+	payload = rpc_dictionary_get_value(args, RPC_ATOM(FRAGMENT));
+	batch = rpc_dictionary_get_value(args, RPC_ATOM(FRAGMENTS));
+#if defined(__linux__)
+	/* The payload went through the call's ring ahead of this frame */
+	if (payload == NULL && batch == NULL && call->rc_stream_ring != NULL &&
+	    rpc_dictionary_get_bool(args, "ring"))
+		payload = ring_payload = rpc_call_ring_fragment(conn, call);
+#endif
 
-	if (payload == NULL) {
+	/* Batched fragments arrive as an array of consecutive items */
+	if (payload != NULL)
+		count = 1;
+	else if (batch != NULL && rpc_get_type(batch) == RPC_TYPE_ARRAY)
+		count = rpc_array_get_count(batch);
+	else
+		count = 0;
+
+	if (count == 0) {
 		debugf("Fragment with no payload received on %p", conn);
 		g_mutex_unlock(&call->rc_mtx);
 		rpc_connection_call_release(call);
 		return;
 	}
 
-	if (call->rc_callback) {
-		item = g_malloc0(sizeof(*item));
-		item->call = call;
-		if (!rpc_run_callback(conn, item))
-			g_free(item);
+	/* A fragment covered by the last grant closes the RTT sample */
+	now = g_get_monotonic_time();
+	if (call->rc_grant_time != 0 &&
+	    seqno + (int64_t)count > call->rc_grant_seqno) {
+		sample = now - call->rc_grant_time;
+		call->rc_rtt = call->rc_rtt == 0 ? sample :
+		    (7 * call->rc_rtt + sample) / 8;
+		call->rc_grant_time = 0;
+	}
+
+	if (call->rc_last_arrival != 0) {
+		sample = (now - call->rc_last_arrival) / (gint64)count;
+		call->rc_interarrival = call->rc_interarrival == 0 ? sample :
+		    (7 * call->rc_interarrival + sample) / 8;
 	}
 
-	q_item = g_malloc(sizeof(*q_item));
-	q_item->status = RPC_CALL_MORE_AVAILABLE;
-	q_item->item = rpc_retain(payload);
+	call->rc_last_arrival = now;
+
+	for (i = 0; i < count; i++) {
+		if (rpc_call_has_callback(call)) {
+			item = g_malloc0(sizeof(*item));
+			item->call = call;
+			if (!rpc_run_callback(conn, item))
+				g_free(item);
+		}
+
+		q_item = g_malloc0(sizeof(*q_item));
+		q_item->status = RPC_CALL_MORE_AVAILABLE;
+		q_item->item = rpc_retain(payload != NULL ? payload :
+		    rpc_array_get_value(batch, i));
+		q_item->bytes = bytes / (int64_t)count +
+		    (i == 0 ? bytes % (int64_t)count : 0);
+		if (rpc_fragment_accounting(conn)) {
+			q_item->charged = q_item->bytes > 0 ? q_item->bytes :
+			    (int64_t)rpc_msgpack_size(q_item->item);
+			rpc_fragment_charge(conn, q_item->charged);
+		}
+
+		g_queue_push_tail(&call->rc_queue, q_item);
+	}
 
-	g_queue_push_tail(call->rc_queue, q_item);
 	notify_signal(&call->rc_notify);
+	waiters = rpc_call_wake_locked(call);
 	g_mutex_unlock(&call->rc_mtx);
+	rpc_call_run_thens(waiters);
+	rpc_release(ring_payload);
 	rpc_connection_call_release(call);
 }
 
+#if defined(__linux__)
+/*
+ * Takes the next fragment out of a call's ring, freeing its room for
+ * the producer right away. Called with the call's lock held.
+ */
+static rpc_object_t
+rpc_call_ring_fragment(rpc_connection_t conn, struct rpc_call *call)
+{
+	rpc_object_t msg;
+	rpc_object_t result;
+	GBytes *record;
+
+	record = rpc_event_ring_read(call->rc_stream_ring);
+	if (record == NULL)
+		return (NULL);
+
+	rpc_event_ring_commit(call->rc_stream_ring);
+	msg = rpc_msgpack_deserialize_bytes(record);
+	g_bytes_unref(record);
+	if (msg == NULL)
+		return (NULL);
+
+	rpct_set_type_table(conn->rco_type_table);
+	result = rpct_deserialize(msg);
+	rpct_set_type_table(NULL);
+	rpc_release(msg);
+	return (result);
+}
+#endif
+
 static void
 on_rpc_continue(rpc_connection_t conn, rpc_object_t args, rpc_object_t id)
 {
 	struct rpc_call *call;
+	rpc_writable_handler_t handler;
+	rpc_object_t bytes;
+	rpc_object_t shmem;
 	int64_t seqno = 0;
 	int64_t increment = 1;
 
 	rpc_object_unpack(args, "{i,i}",
 	    "seqno", &seqno,
 	    "increment", &increment);
+	bytes = rpc_dictionary_get_value(args, RPC_ATOM(BYTES));
 
 	g_rw_lock_reader_lock(&conn->rco_icall_rwlock);
-	call = g_hash_table_lookup(conn->rco_inbound_calls,
-	    rpc_string_get_string_ptr(id));
+	call = g_hash_table_lookup(conn->rco_inbound_calls, id);
 	if (call == NULL) {
 		g_rw_lock_reader_unlock(&conn->rco_icall_rwlock);
 		if (conn->rco_error_handler != NULL)
@@ -591,6 +1379,124 @@ on_rpc_continue(rpc_connection_t conn, rpc_object_t args, rpc_object_t id)
 	g_mutex_lock(&call->rc_mtx);
 	g_rw_lock_reader_unlock(&conn->rco_icall_rwlock);
 	call->rc_consumer_seqno += increment;
+	atomic_store(&call->rc_starved_since, 0);
+
+	/* Consumers that can unpack batched fragments say so */
+	if (rpc_dictionary_get_bool(args, RPC_ATOM(BATCH)))
+		call->rc_frag_batch_ok = true;
+
+#if defined(__linux__)
+	/* A ring comes with the first grant, before anything is sent */
+	shmem = rpc_dictionary_get_value(args, "ring");
+	if (shmem != NULL && call->rc_stream_ring == NULL &&
+	    !call->rc_streaming && call->rc_conn->rco_supports_fd_passing)
+		call->rc_stream_ring = rpc_event_ring_open(shmem, 0);
+#endif
+
+	/* The first byte grant switches the producer to byte accounting */
+	if (bytes != NULL && rpc_get_type(bytes) == RPC_TYPE_INT64) {
+		call->rc_byte_credits = true;
+		call->rc_credit_bytes += rpc_int64_get_value(bytes);
+	}
+
+	notify_signal(&call->rc_notify);
+	handler = rpc_call_writable_locked(call);
+	g_mutex_unlock(&call->rc_mtx);
+
+	if (handler != NULL) {
+		handler();
+		Block_release(handler);
+	}
+
+	rpc_connection_call_release(call);
+}
+
+/*
+ * Returns the inbound call @p id expecting more input, retained and
+ * with its lock held, or NULL. Input for calls that are gone already
+ * or never asked for it is dropped.
+ */
+static rpc_call_t
+rpc_connection_find_inbound_call(rpc_connection_t conn, rpc_object_t id)
+{
+	struct rpc_call *call;
+
+	g_rw_lock_reader_lock(&conn->rco_icall_rwlock);
+	call = g_hash_table_lookup(conn->rco_inbound_calls, id);
+	if (call == NULL) {
+		g_rw_lock_reader_unlock(&conn->rco_icall_rwlock);
+		return (NULL);
+	}
+
+	rpc_connection_call_retain(call);
+	g_mutex_lock(&call->rc_mtx);
+	g_rw_lock_reader_unlock(&conn->rco_icall_rwlock);
+
+	if (!call->rc_input || call->rc_input_ended || call->rc_aborted) {
+		g_mutex_unlock(&call->rc_mtx);
+		rpc_connection_call_release(call);
+		return (NULL);
+	}
+
+	return (call);
+}
+
+static void
+on_rpc_input(rpc_connection_t conn, rpc_object_t args, rpc_object_t id)
+{
+	struct rpc_call *call;
+	rpc_object_t fragment;
+
+	fragment = rpc_dictionary_get_value(args, RPC_ATOM(FRAGMENT));
+	if (fragment == NULL)
+		return;
+
+	call = rpc_connection_find_inbound_call(conn, id);
+	if (call == NULL)
+		return;
+
+	g_queue_push_tail(&call->rc_input_queue, rpc_retain(fragment));
+	notify_signal(&call->rc_notify);
+	g_mutex_unlock(&call->rc_mtx);
+	rpc_connection_call_release(call);
+}
+
+static void
+on_rpc_input_end(rpc_connection_t conn, rpc_object_t args __unused,
+    rpc_object_t id)
+{
+	struct rpc_call *call;
+
+	call = rpc_connection_find_inbound_call(conn, id);
+	if (call == NULL)
+		return;
+
+	call->rc_input_ended = true;
+	notify_signal(&call->rc_notify);
+	g_mutex_unlock(&call->rc_mtx);
+	rpc_connection_call_release(call);
+}
+
+static void
+on_rpc_input_continue(rpc_connection_t conn, rpc_object_t args,
+    rpc_object_t id)
+{
+	rpc_call_t call;
+	int64_t increment;
+
+	increment = rpc_dictionary_get_int64(args, "increment");
+
+	g_rw_lock_reader_lock(&conn->rco_call_rwlock);
+	call = g_hash_table_lookup(conn->rco_calls, id);
+	if (call == NULL || increment <= 0) {
+		g_rw_lock_reader_unlock(&conn->rco_call_rwlock);
+		return;
+	}
+
+	rpc_connection_call_retain(call);
+	g_mutex_lock(&call->rc_mtx);
+	g_rw_lock_reader_unlock(&conn->rco_call_rwlock);
+	call->rc_input_credit += increment;
 	notify_signal(&call->rc_notify);
 	g_mutex_unlock(&call->rc_mtx);
 	rpc_connection_call_release(call);
@@ -601,10 +1507,10 @@ on_rpc_end(rpc_connection_t conn, rpc_object_t args __unused, rpc_object_t id)
 {
 	struct queue_item *q_item;
 	rpc_call_t call;
+	GSList *thens;
 
 	g_rw_lock_reader_lock(&conn->rco_call_rwlock);
-	call = g_hash_table_lookup(conn->rco_calls,
-	    rpc_string_get_string_ptr(id));
+	call = g_hash_table_lookup(conn->rco_calls, id);
 	if (call == NULL) {
 		g_rw_lock_reader_unlock(&conn->rco_call_rwlock);
 		if (conn->rco_error_handler != NULL)
@@ -623,13 +1529,15 @@ on_rpc_end(rpc_connection_t conn, rpc_object_t args __unused, rpc_object_t id)
 
 	g_rw_lock_reader_unlock(&conn->rco_call_rwlock);
 
-	q_item = g_malloc(sizeof(*q_item));
+	q_item = g_malloc0(sizeof(*q_item));
 	q_item->status = RPC_CALL_ENDED;
 	q_item->item = rpc_retain(args);
 
-	g_queue_push_tail(call->rc_queue, q_item);
+	g_queue_push_tail(&call->rc_queue, q_item);
 	notify_signal(&call->rc_notify);
+	thens = rpc_call_settle_locked(call);
 	g_mutex_unlock(&call->rc_mtx);
+	rpc_call_run_thens(thens);
 	rpc_connection_call_release(call);
 }
 
@@ -639,8 +1547,7 @@ on_rpc_abort(rpc_connection_t conn, rpc_object_t args __unused, rpc_object_t id)
 	struct rpc_call *call;
 
 	g_rw_lock_reader_lock(&conn->rco_icall_rwlock);
-	call = g_hash_table_lookup(conn->rco_inbound_calls,
-	    rpc_string_get_string_ptr(id));
+	call = g_hash_table_lookup(conn->rco_inbound_calls, id);
 	if (call == NULL) {
 		g_rw_lock_reader_unlock(&conn->rco_icall_rwlock);
 		if (conn->rco_error_handler != NULL)
@@ -651,9 +1558,13 @@ on_rpc_abort(rpc_connection_t conn, rpc_object_t args __unused, rpc_object_t id)
 	rpc_connection_call_retain(call);
 	g_mutex_lock(&call->rc_mtx);
 	g_rw_lock_reader_unlock(&conn->rco_icall_rwlock);
+	RPC_PROBE3(call__abort, conn, call, true);
 	call->rc_ended = true;
 	call->rc_aborted = true;
 	notify_signal(&call->rc_notify);
+
+	/* Fragments still batched up would only be thrown away */
+	rpc_connection_purge_call(conn, call->rc_id);
 	if (call->rc_abort_handler) {
 		/* call_abort_locked() will cause the call release */
 		call_abort_locked(call);
@@ -668,10 +1579,10 @@ on_rpc_error(rpc_connection_t conn, rpc_object_t args, rpc_object_t id)
 {
 	struct queue_item *q_item;
 	rpc_call_t call;
+	GSList *thens;
 
 	g_rw_lock_reader_lock(&conn->rco_call_rwlock);
-	call = g_hash_table_lookup(conn->rco_calls,
-	    rpc_string_get_string_ptr(id));
+	call = g_hash_table_lookup(conn->rco_calls, id);
 	if (call == NULL) {
 		g_rw_lock_reader_unlock(&conn->rco_call_rwlock);
 
@@ -679,7 +1590,7 @@ on_rpc_error(rpc_connection_t conn, rpc_object_t args, rpc_object_t id)
 		if (rpc_error_get_code(args) == ENXIO) {
 			g_rw_lock_reader_lock(&conn->rco_icall_rwlock);
 			call = g_hash_table_lookup(conn->rco_inbound_calls,
-			    rpc_string_get_string_ptr(id));
+			    id);
 			if (call != NULL) {
 				rpc_connection_call_retain(call);
 				g_mutex_lock(&call->rc_mtx);
@@ -709,13 +1620,21 @@ on_rpc_error(rpc_connection_t conn, rpc_object_t args, rpc_object_t id)
 
 	g_rw_lock_reader_unlock(&conn->rco_call_rwlock);
 
-	q_item = g_malloc(sizeof(*q_item));
+	if (g_atomic_pointer_get(&conn->rco_flights) != NULL)
+		rpc_object_freeze(args);
+
+	q_item = g_malloc0(sizeof(*q_item));
 	q_item->status = RPC_CALL_ERROR;
 	q_item->item = rpc_retain(args);
 
-	g_queue_push_tail(call->rc_queue, q_item);
+	g_queue_push_tail(&call->rc_queue, q_item);
 	notify_signal(&call->rc_notify);
+	thens = rpc_call_settle_locked(call);
 	g_mutex_unlock(&call->rc_mtx);
+	rpc_call_run_thens(thens);
+	if (call->rc_flight != NULL)
+		rpc_flight_end(call, RPC_CALL_ERROR, args);
+
 	rpc_connection_call_release(call);
 }
 
@@ -723,30 +1642,115 @@ static void
 on_events_event(rpc_connection_t conn, rpc_object_t args,
     rpc_object_t id __unused)
 {
-	struct work_item *item;
 
 	if (args == NULL)
 		return;
 
+	rpc_event_deliver(conn, args);
+}
+
+static void
+on_events_event_burst(rpc_connection_t conn, rpc_object_t args,
+    rpc_object_t id __unused)
+{
+	struct work_item *item;
+
+	if (args == NULL || rpc_get_type(args) != RPC_TYPE_ARRAY)
+		return;
+
+	if (conn->rco_event_delivery != RPC_EVENT_DELIVERY_POOL) {
+		rpc_array_apply(args, ^(size_t idx __unused, rpc_object_t v) {
+			rpc_event_deliver(conn, v);
+			return ((bool)true);
+		});
+
+		return;
+	}
+
+	/* The whole burst is handled by a single callback worker */
 	rpc_retain(args);
 	item = g_malloc0(sizeof(*item));
-	item->event = args;
+	item->burst = args;
 	rpc_run_callback(conn, item);
 }
 
 static void
-on_events_event_burst(rpc_connection_t conn, rpc_object_t args,
-    rpc_object_t id __unused)
+rpc_event_deliver(rpc_connection_t conn, rpc_object_t event)
 {
+	struct work_item *item;
+	bool schedule = false;
 
-	rpc_array_apply(args, ^(size_t idx __unused, rpc_object_t value) {
-		struct work_item *item;
+	switch (conn->rco_event_delivery) {
+	case RPC_EVENT_DELIVERY_INLINE:
+		/* Another thread may be iterating the handlers right now */
+		if (rpc_callback_event(conn, event))
+			return;
 
-		rpc_retain(value);
-		item = g_malloc0(sizeof(*item));
-		rpc_run_callback(conn, item);
-		return ((bool)true);
-	});
+		break;
+
+	case RPC_EVENT_DELIVERY_SERIAL:
+		g_mutex_lock(&conn->rco_event_mtx);
+		g_queue_push_tail(&conn->rco_event_queue, rpc_retain(event));
+		if (!conn->rco_event_draining) {
+			conn->rco_event_draining = true;
+			schedule = true;
+		}
+		g_mutex_unlock(&conn->rco_event_mtx);
+
+		if (schedule) {
+			item = g_malloc0(sizeof(*item));
+			item->drain = true;
+			if (!rpc_run_callback(conn, item))
+				g_free(item);
+		}
+
+		return;
+
+	default:
+		break;
+	}
+
+	item = g_malloc0(sizeof(*item));
+	item->event = rpc_retain(event);
+	rpc_run_callback(conn, item);
+}
+
+/*
+ * Delivers whatever got queued, taking the lock once per batch. Returns
+ * false, with the undelivered events back at the head of the queue, if
+ * a handler was busy and the drain has to be retried.
+ */
+static bool
+rpc_event_drain(rpc_connection_t conn)
+{
+	GQueue batch = G_QUEUE_INIT;
+	rpc_object_t event;
+
+	for (;;) {
+		g_mutex_lock(&conn->rco_event_mtx);
+		if (g_queue_is_empty(&conn->rco_event_queue)) {
+			conn->rco_event_draining = false;
+			g_mutex_unlock(&conn->rco_event_mtx);
+			return (true);
+		}
+
+		batch = conn->rco_event_queue;
+		g_queue_init(&conn->rco_event_queue);
+		g_mutex_unlock(&conn->rco_event_mtx);
+
+		while ((event = g_queue_peek_head(&batch)) != NULL) {
+			if (!rpc_callback_event(conn, event)) {
+				g_mutex_lock(&conn->rco_event_mtx);
+				while ((event = g_queue_pop_tail(&batch)))
+					g_queue_push_head(
+					    &conn->rco_event_queue, event);
+				g_mutex_unlock(&conn->rco_event_mtx);
+				return (false);
+			}
+
+			rpc_release(g_queue_pop_head(&batch));
+		}
+	}
 }
 
 static void
@@ -761,6 +1765,7 @@ on_events_subscribe(rpc_connection_t conn, rpc_object_t args,
 		const char *path = NULL;
 		const char *interface = NULL;
 		const char *name = NULL;
+		bool created = false;
 
 		if (rpc_object_unpack(value, "{s,s,s}",
 		    "name", &name,
@@ -777,15 +1782,18 @@ on_events_subscribe(rpc_connection_t conn, rpc_object_t args,
 			sub->rsu_path = g_strdup(path);
 			sub->rsu_interface = g_strdup(interface);
 			sub->rsu_name = g_strdup(name);
-			g_ptr_array_add(conn->rco_subscriptions, sub);
+			g_ptr_array_add(rpc_connection_subscriptions(conn),
+			    sub);
+			created = true;
 		}
 
 		sub->rsu_refcount++;
 		if (conn->rco_subscriptions->len == 1) {
 			/* just added, add conn to context */
 			g_rw_lock_writer_unlock(&conn->rco_subscription_rwlock);
-			g_rw_lock_writer_lock(
-			    &conn->rco_rpc_context->rcx_rwlock);
+			rpc_rw_lock_writer_lock(
+			    &conn->rco_rpc_context->rcx_rwlock,
+			    RPC_LOCK_CONTEXT);
 			g_hash_table_insert(
 			    conn->rco_rpc_context->rcx_event_watchers, conn, conn);
 			g_rw_lock_writer_unlock(
@@ -794,6 +1802,11 @@ on_events_subscribe(rpc_connection_t conn, rpc_object_t args,
 			g_rw_lock_writer_unlock(&conn->rco_subscription_rwlock);
 		}
 
+		if (created) {
+			rpc_context_index_add(conn->rco_rpc_context, conn,
+			    path, interface, name);
+		}
+
 		return ((bool)true);
 	});
 }
@@ -814,7 +1827,9 @@ static void
 rpc_rsh_release(struct rpc_subscription_handler *rsh)
 {
 
-	Block_release(rsh->rsh_handler);
+	if (rsh->rsh_handler != NULL)
+		Block_release(rsh->rsh_handler);
+
 	g_free(rsh);
 }
 
@@ -849,13 +1864,22 @@ on_events_unsubscribe(rpc_connection_t conn, rpc_object_t args,
 			g_ptr_array_remove(conn->rco_subscriptions, sub);
 			if (conn->rco_subscriptions->len == 0) {
 				g_rw_lock_writer_unlock(&conn->rco_subscription_rwlock);
-				g_rw_lock_writer_lock(&conn->rco_rpc_context->rcx_rwlock);
+				rpc_rw_lock_writer_lock(
+				    &conn->rco_rpc_context->rcx_rwlock,
+				    RPC_LOCK_CONTEXT);
 				g_assert(g_hash_table_remove(
 				    conn->rco_rpc_context->rcx_event_watchers,
 				    conn));
 				g_rw_lock_writer_unlock(&conn->rco_rpc_context->rcx_rwlock);
+				rpc_context_index_remove(conn->rco_rpc_context,
+				    conn, path, interface, name);
 				return ((bool)true);
 			}
+
+			g_rw_lock_writer_unlock(&conn->rco_subscription_rwlock);
+			rpc_context_index_remove(conn->rco_rpc_context, conn,
+			    path, interface, name);
+			return ((bool)true);
 		}
 		g_rw_lock_writer_unlock(&conn->rco_subscription_rwlock);
 		return ((bool)true);
@@ -863,12 +1887,301 @@ on_events_unsubscribe(rpc_connection_t conn, rpc_object_t args,
 
 }
 
-static int
-rpc_set_creds(rpc_connection_t conn, pid_t pid, uid_t uid, gid_t gid)
+#if defined(__linux__)
+/*
+ * A local client asks for events through a ring. It gets one of its own,
+ * sealed so that it can only map it read-only, and only the events it
+ * subscribed to are written there; once attached, those cost it just a
+ * wakeup.
+ */
+static void
+on_events_ring_attach(rpc_connection_t conn, rpc_object_t args,
+    rpc_object_t id __unused)
 {
-	int ret = 0;
+	rpc_context_t context = conn->rco_rpc_context;
+	struct rpc_event_ring *ring = NULL;
+	rpc_object_t notify;
+	gsize size;
+	int fd;
+
+	notify = rpc_dictionary_get_value(args, "notify");
+	if (notify == NULL || rpc_get_type(notify) != RPC_TYPE_FD)
+		return;
 
-	g_assert(rpc_connection_supports_credentials(conn));
+	fd = rpc_fd_get_value(notify);
+	size = context != NULL ?
+	    __atomic_load_n(&context->rcx_event_ring_size, __ATOMIC_ACQUIRE) :
+	    0;
+	if (size > 0 && conn->rco_server != NULL)
+		ring = rpc_event_ring_create(size, true);
+
+	g_rw_lock_writer_lock(&conn->rco_subscription_rwlock);
+	if (ring == NULL || conn->rco_event_ring_fd != -1) {
+		g_rw_lock_writer_unlock(&conn->rco_subscription_rwlock);
+		debugf("conn %p: no event ring to attach to", conn);
+		rpc_event_ring_free(ring);
+		close(fd);
+		return;
+	}
+
+	conn->rco_event_ring = ring;
+	conn->rco_event_ring_fd = fd;
+	g_rw_lock_writer_unlock(&conn->rco_subscription_rwlock);
+
+	rpc_send_frame(conn, rpc_pack_frame("events", "ring", NULL,
+	    rpc_object_pack("{v,u}",
+	    "shmem", rpc_retain(rpc_event_ring_get_shmem(ring)),
+	    "start", rpc_event_ring_get_head(ring))));
+}
+
+static void
+on_events_ring(rpc_connection_t conn, rpc_object_t args,
+    rpc_object_t id __unused)
+{
+	struct rpc_event_ring *ring;
+	rpc_object_t shmem;
+	GSource *source;
+
+	shmem = rpc_dictionary_get_value(args, "shmem");
+	if (shmem == NULL || conn->rco_client == NULL ||
+	    conn->rco_event_ring_fd == -1 || conn->rco_event_ring != NULL)
+		return;
+
+	ring = rpc_event_ring_open(shmem,
+	    rpc_dictionary_get_uint64(args, "start"));
+	if (ring == NULL) {
+		debugf("conn %p: cannot open event ring: %s", conn,
+		    rpc_error_get_message(rpc_get_last_error()));
+		return;
+	}
+
+	conn->rco_event_ring = ring;
+	source = g_unix_fd_source_new(conn->rco_event_ring_fd, G_IO_IN);
+	g_source_set_callback(source, (GSourceFunc)rpc_event_ring_readable,
+	    conn, NULL);
+	g_source_attach(source, conn->rco_main_context);
+	conn->rco_event_ring_source = source;
+}
+
+/*
+ * The server only writes subscribed events into the ring, but some may
+ * have been in flight while the client unsubscribed.
+ */
+static bool
+rpc_event_ring_wanted(rpc_connection_t conn, rpc_object_t event)
+{
+	bool wanted;
+
+	if (rpc_get_type(event) != RPC_TYPE_DICTIONARY)
+		return (false);
+
+	g_rw_lock_reader_lock(&conn->rco_subscription_rwlock);
+	wanted = rpc_connection_match_subscription(conn,
+	    rpc_dictionary_get_string(event, RPC_ATOM(PATH)),
+	    rpc_dictionary_get_string(event, RPC_ATOM(INTERFACE)),
+	    rpc_dictionary_get_string(event, RPC_ATOM(NAME))) != NULL;
+	g_rw_lock_reader_unlock(&conn->rco_subscription_rwlock);
+
+	return (wanted);
+}
+
+static void
+rpc_event_ring_dispatch(rpc_connection_t conn, GBytes *record)
+{
+	rpc_object_t msg;
+	rpc_object_t frame;
+	rpc_object_t args;
+	rpc_object_t burst;
+	const char *name;
+
+	msg = rpc_msgpack_deserialize_bytes(record);
+	if (msg == NULL)
+		return;
+
+	rpct_set_type_table(conn->rco_type_table);
+	frame = rpct_deserialize(msg);
+	rpct_set_type_table(NULL);
+	rpc_release(msg);
+	if (frame == NULL)
+		return;
+
+	name = rpc_dictionary_get_string(frame, RPC_ATOM(NAME));
+	args = rpc_dictionary_get_value(frame, RPC_ATOM(ARGS));
+	if (g_strcmp0(name, "event") == 0) {
+		if (rpc_event_ring_wanted(conn, args))
+			on_events_event(conn, args, NULL);
+	} else if (g_strcmp0(name, "event_burst") == 0 &&
+	    rpc_get_type(args) == RPC_TYPE_ARRAY) {
+		burst = rpc_array_create();
+		rpc_array_apply(args, ^(size_t idx __unused, rpc_object_t v) {
+			if (rpc_event_ring_wanted(conn, v))
+				rpc_array_append_value(burst, v);
+
+			return ((bool)true);
+		});
+
+		if (rpc_array_get_count(burst) > 0)
+			on_events_event_burst(conn, burst, NULL);
+
+		rpc_release(burst);
+	}
+
+	rpc_release(frame);
+}
+
+static gboolean
+rpc_event_ring_readable(gint fd, GIOCondition cond __unused,
+    gpointer user_data)
+{
+	rpc_connection_t conn = user_data;
+	eventfd_t value;
+	GBytes *record;
+	uint64_t dropped;
+
+	if (rpc_connection_retain_if_valid(conn, true) != 0)
+		return (G_SOURCE_REMOVE);
+
+	eventfd_read(fd, &value);
+	dropped = rpc_event_ring_get_dropped(conn->rco_event_ring);
+	while ((record = rpc_event_ring_read(conn->rco_event_ring)) != NULL) {
+		rpc_event_ring_dispatch(conn, record);
+		g_bytes_unref(record);
+	}
+
+	if (rpc_event_ring_get_dropped(conn->rco_event_ring) != dropped)
+		debugf("conn %p: fell behind the event ring", conn);
+
+	rpc_connection_release(conn);
+	return (G_SOURCE_CONTINUE);
+}
+#endif
+
+static void
+on_session_token(rpc_connection_t conn, rpc_object_t args,
+    rpc_object_t id __unused)
+{
+	const char *token;
+
+	if (conn->rco_client == NULL)
+		return;
+
+	token = rpc_dictionary_get_string(args, "token");
+	if (token == NULL)
+		return;
+
+	g_mutex_lock(&conn->rco_mtx);
+	g_free(conn->rco_session_token);
+	conn->rco_session_token = g_strdup(token);
+	g_mutex_unlock(&conn->rco_mtx);
+}
+
+static void
+on_session_resume(rpc_connection_t conn, rpc_object_t args,
+    rpc_object_t id __unused)
+{
+	struct rpc_session *session;
+	rpc_object_t events;
+	rpc_object_t frame;
+	bool resumed = false;
+	bool lost = false;
+	size_t replayed = 0;
+
+	if (conn->rco_server == NULL)
+		return;
+
+	session = rpc_session_take(conn->rco_rpc_context,
+	    rpc_dictionary_get_string(args, "token"));
+
+	/* Somebody else's session stays where it is */
+	if (session != NULL && session->rse_has_creds &&
+	    (!conn->rco_has_creds ||
+	    conn->rco_creds.rcc_uid != session->rse_uid)) {
+		debugf("conn %p can't resume session %s, uid mismatch",
+		    conn, session->rse_token);
+		rpc_session_release(session);
+		session = NULL;
+	}
+
+	if (session != NULL) {
+		resumed = true;
+		rpc_connection_restore_subscriptions(conn,
+		    session->rse_subscriptions);
+
+		events = rpc_array_create();
+		g_mutex_lock(&session->rse_mtx);
+		while (!g_queue_is_empty(&session->rse_events)) {
+			rpc_array_append_stolen_value(events,
+			    g_queue_pop_head(&session->rse_events));
+		}
+		lost = session->rse_lost;
+		g_mutex_unlock(&session->rse_mtx);
+
+		/* The reply goes after the events it accounts for */
+		replayed = rpc_array_get_count(events);
+		if (replayed > 0 &&
+		    rpc_connection_send_event_burst(conn, events) != 0)
+			lost = true;
+
+		debugf("conn %p resumed session %s, %zu events replayed",
+		    conn, session->rse_token, replayed);
+		rpc_release(events);
+		rpc_session_release(session);
+	}
+
+	frame = rpc_pack_frame("session", "resumed", NULL, rpc_object_pack(
+	    "{b,b,u}",
+	    "resumed", resumed,
+	    "lost", lost,
+	    "replayed", (uint64_t)replayed));
+
+	if (rpc_send_frame(conn, frame) != 0)
+		debugf("couldn't answer session resume on conn %p", conn);
+}
+
+static void
+on_session_resumed(rpc_connection_t conn, rpc_object_t args,
+    rpc_object_t id __unused)
+{
+	rpc_object_t frame;
+
+	if (conn->rco_client == NULL)
+		return;
+
+	if (rpc_dictionary_get_bool(args, "resumed")) {
+		if (rpc_dictionary_get_bool(args, "lost") &&
+		    conn->rco_error_handler != NULL)
+			conn->rco_error_handler(RPC_EVENTS_LOST, args);
+
+		return;
+	}
+
+	/*
+	 * The session is gone, so subscribe the long way. That covers
+	 * the subscriptions still pending, too.
+	 */
+	g_rw_lock_writer_lock(&conn->rco_subscription_rwlock);
+	g_mutex_lock(&conn->rco_sub_pending_mtx);
+	rpc_release(conn->rco_sub_pending);
+	conn->rco_sub_pending = NULL;
+	g_atomic_int_set(&conn->rco_sub_npending, 0);
+	g_mutex_unlock(&conn->rco_sub_pending_mtx);
+	frame = rpc_pack_frame("events", "subscribe", NULL,
+	    rpc_connection_pack_subscriptions_locked(conn));
+	g_rw_lock_writer_unlock(&conn->rco_subscription_rwlock);
+
+	if (rpc_send_frame(conn, frame) != 0)
+		debugf("resubscribing failed on conn %p", conn);
+
+	if (conn->rco_error_handler != NULL)
+		conn->rco_error_handler(RPC_EVENTS_LOST, args);
+}
+
+static int
+rpc_set_creds(rpc_connection_t conn, pid_t pid, uid_t uid, gid_t gid)
+{
+	int ret = 0;
+
+	g_assert(rpc_connection_supports_credentials(conn));
 	if (rpc_connection_retain_if_valid(conn, true) == 0) {
 		g_mutex_lock(&conn->rco_mtx);
 		conn->rco_has_creds = true;
@@ -888,8 +2201,47 @@ static int
 rpc_recv_msg(struct rpc_connection *conn, const void *frame, size_t len,
     int *fds, size_t nfds)
 {
+
+	return (rpc_recv_frame(conn, frame, len, NULL, fds, nfds));
+}
+
+static int
+rpc_recv_bytes(struct rpc_connection *conn, GBytes *frame, int *fds,
+    size_t nfds)
+{
+	const void *data;
+	gsize len;
+
+	data = g_bytes_get_data(frame, &len);
+	return (rpc_recv_frame(conn, data, len, frame, fds, nfds));
+}
+
+static int
+rpc_recv_object(struct rpc_connection *conn, rpc_object_t msg, int *fds,
+    size_t nfds)
+{
+	int ret;
+
+	if (rpc_connection_retain_if_valid(conn, true) != 0) {
+		debugf("Rejecting msg, conn %p is closed", conn);
+		if (msg != NULL)
+			rpc_release(msg);
+
+		return (-1);
+	}
+
+	atomic_fetch_add(&conn->rco_frames_in, 1);
+	ret = rpc_recv_dispatch(conn, msg, fds, nfds);
+	rpc_connection_release(conn);
+	return (ret);
+}
+
+static int
+rpc_recv_frame(struct rpc_connection *conn, const void *frame, size_t len,
+    GBytes *bytes, int *fds, size_t nfds)
+{
 	rpc_object_t msg = (rpc_object_t)frame;
-	rpc_object_t msgt;
+	gint64 start;
 	int ret = 0;
 
 	if (rpc_connection_retain_if_valid(conn, true) != 0) {
@@ -898,50 +2250,167 @@ rpc_recv_msg(struct rpc_connection *conn, const void *frame, size_t len,
 	}
 
 	debugf("received frame: addr=%p, len=%zu", frame, len);
+	atomic_fetch_add(&conn->rco_frames_in, 1);
+	atomic_fetch_add(&conn->rco_bytes_in, len);
+	RPC_PROBE2(frame__recv, conn, len);
+	if (rpc_trace_ring_on())
+		rpc_trace_bytes(RPC_TRACE_STAGE_READ, conn, len);
 
 	if (conn->rco_raw_handler != NULL) {
 		ret = (conn->rco_raw_handler(frame, len, fds, nfds));
 		goto done;
 	}
 
-	if ((conn->rco_flags & RPC_TRANSPORT_NO_SERIALIZE) == 0) {
-		msg = rpc_msgpack_deserialize(frame, len);
-		if (msg == NULL) {
-			if (conn->rco_error_handler != NULL) {
-				conn->rco_error_handler(RPC_SPURIOUS_RESPONSE,
-				    NULL);
-			}
-			ret = -1;
-			goto done;
+	if ((conn->rco_flags & RPC_TRANSPORT_NO_SERIALIZE) == 0 &&
+	    rpc_frame_is_enveloped(frame, len)) {
+		ret = rpc_recv_enveloped(conn, frame, len, fds, nfds);
+		goto done;
+	}
+
+	start = g_get_monotonic_time();
+	if ((conn->rco_flags & RPC_TRANSPORT_NO_SERIALIZE) == 0 &&
+	    rpc_frame_is_compressed(frame, len)) {
+		bytes = rpc_decompress_frame(conn->rco_compressor, frame, len);
+		msg = NULL;
+		if (bytes != NULL) {
+			msg = rpc_msgpack_deserialize_bytes(bytes);
+			g_bytes_unref(bytes);
 		}
+	} else if ((conn->rco_flags & RPC_TRANSPORT_NO_SERIALIZE) == 0) {
+		msg = bytes != NULL
+		    ? rpc_msgpack_deserialize_bytes(bytes)
+		    : rpc_msgpack_deserialize(frame, len);
 	} else
 		rpc_retain(msg);
 
+	rpc_count_time(&conn->rco_deserialize_time, start);
+	ret = rpc_recv_dispatch(conn, msg, fds, nfds);
+
+done:
+	rpc_connection_release(conn);
+	return (ret);
+}
+
+static int
+rpc_recv_dispatch(struct rpc_connection *conn, rpc_object_t msg, int *fds,
+    size_t nfds)
+{
+	rpc_object_t msgt;
+	gint64 start;
+
+	if (msg == NULL) {
+		if (conn->rco_error_handler != NULL)
+			conn->rco_error_handler(RPC_SPURIOUS_RESPONSE, NULL);
+
+		return (-1);
+	}
+
 	if (rpc_get_type(msg) != RPC_TYPE_DICTIONARY) {
 		if (conn->rco_error_handler != NULL)
 			conn->rco_error_handler(RPC_SPURIOUS_RESPONSE, msg);
 		rpc_release(msg);
-		ret = -1;
-		goto done;
+		return (-1);
 	}
 
+	start = g_get_monotonic_time();
+	rpct_set_type_table(conn->rco_type_table);
 	msgt = rpct_deserialize(msg);
+	rpct_set_type_table(NULL);
+	rpc_count_time(&conn->rco_deserialize_time, start);
 	rpc_release(msg);
 
+	if (conn->rco_type_table->rtt_overflow) {
+		debugf("peer defined too many types, dropping it");
+		rpc_release(msgt);
+		return (-1);
+	}
+
 	if (msgt == NULL) {
 		if (conn->rco_error_handler != NULL)
 			conn->rco_error_handler(RPC_SPURIOUS_RESPONSE, NULL);
 
-		ret = -1;
-		goto done;
+		return (-1);
 	}
 
-	rpc_restore_fds(msgt, fds, nfds);
+	rpc_restore_fds(conn, msgt, fds, nfds);
 	rpc_connection_dispatch(conn, msgt);
+	return (0);
+}
 
-done:
-	rpc_connection_release(conn);
-	return (ret);
+/*
+ * Frames in the compact envelope skip the dictionary altogether: the
+ * opcode picks the handler and only the args are deserialized.
+ */
+static int
+rpc_recv_enveloped(struct rpc_connection *conn, const void *frame,
+    size_t len, int *fds, size_t nfds)
+{
+	struct rpc_envelope env;
+	rpc_object_t msg;
+	rpc_object_t args;
+	rpc_object_t id;
+	gint64 start;
+
+	start = g_get_monotonic_time();
+	msg = NULL;
+	if (rpc_envelope_decode(frame, len, &env) == 0) {
+		msg = rpc_msgpack_deserialize(
+		    (const uint8_t *)frame + RPC_ENVELOPE_HDR_SIZE,
+		    len - RPC_ENVELOPE_HDR_SIZE);
+	}
+
+	if (msg == NULL) {
+		if (conn->rco_error_handler != NULL)
+			conn->rco_error_handler(RPC_SPURIOUS_RESPONSE, NULL);
+
+		return (-1);
+	}
+
+	rpct_set_type_table(conn->rco_type_table);
+	args = rpct_deserialize(msg);
+	rpct_set_type_table(NULL);
+	rpc_count_time(&conn->rco_deserialize_time, start);
+	rpc_release(msg);
+
+	if (conn->rco_type_table->rtt_overflow) {
+		debugf("peer defined too many types, dropping it");
+		rpc_release(args);
+		return (-1);
+	}
+
+	if (args == NULL) {
+		if (conn->rco_error_handler != NULL)
+			conn->rco_error_handler(RPC_SPURIOUS_RESPONSE, NULL);
+
+		return (-1);
+	}
+
+	/* The peer speaks the compact envelope, so answer in kind */
+	if (!g_atomic_int_get(&conn->rco_compact_frames))
+		g_atomic_int_set(&conn->rco_compact_frames, true);
+	rpc_restore_fds(conn, args, fds, nfds);
+
+	if ((env.re_flags & RPC_ENVELOPE_DEADLINE) &&
+	    rpc_get_type(args) == RPC_TYPE_DICTIONARY &&
+	    !rpc_dictionary_has_key(args, RPC_ATOM(TIMEOUT)))
+		rpc_dictionary_set_uint64(args, RPC_ATOM(TIMEOUT),
+		    env.re_deadline);
+
+	id = (env.re_flags & RPC_ENVELOPE_NO_ID) ? rpc_null_create() :
+	    rpc_uint64_create(env.re_id);
+
+	debugf("inbound compact frame: op=%d", env.re_op);
+	if (rpc_trace_ring_on() && handlers[env.re_op].name != NULL) {
+		msg = rpc_pack_frame(handlers[env.re_op].namespace,
+		    handlers[env.re_op].name, id, rpc_retain(args));
+		rpc_trace_frame(RPC_TRACE_STAGE_DISPATCH, conn, msg, 0);
+		rpc_release(msg);
+	}
+
+	rpc_connection_dispatch_op(conn, env.re_op, id, args);
+	rpc_release(id);
+	rpc_release(args);
+	return (0);
 }
 
 static void
@@ -964,6 +2433,7 @@ rpc_abort_worker(void *arg, void *data)
 	struct rpc_call *call = arg;
 	struct rpc_connection *conn = data;
 
+	rpc_thread_enter(RPC_THREAD_CALLBACK, "rpc callback");
 	g_mutex_lock(&call->rc_mtx);
 	g_assert(call->rc_conn == conn);
 	if (call->rc_abort_handler)
@@ -974,14 +2444,37 @@ rpc_abort_worker(void *arg, void *data)
 	}
 }
 
+static bool
+rpc_abort_push(struct rpc_connection *conn, struct rpc_call *call)
+{
+	GError *err = NULL;
+
+	rpc_connection_callbacks_init(conn);
+	if (conn->rco_callback_exec != NULL) {
+		return (rpc_exec_submit(conn->rco_callback_exec,
+		    (guintptr)conn, 0, call));
+	}
+
+	if (conn->rco_callback_pool == NULL)
+		return (false);
+
+	g_thread_pool_push(conn->rco_callback_pool, call, &err);
+	if (err != NULL) {
+		g_error_free(err);
+		return (false);
+	}
+
+	return (true);
+}
+
 static int
 rpc_close(rpc_connection_t conn)
 {
 	GHashTableIter iter;
 	struct rpc_call *call;
 	struct queue_item *q_item;
+	GSList *thens = NULL;
 	char *key;
-	GError *err = NULL;
 
 	g_mutex_lock(&conn->rco_mtx);
 
@@ -1008,6 +2501,11 @@ rpc_close(rpc_connection_t conn)
 
 	g_mutex_unlock(&conn->rco_mtx);
 
+	/* Emitters blocked on a full event queue give up on us */
+	g_mutex_lock(&conn->rco_emit_mtx);
+	g_cond_broadcast(&conn->rco_emit_cv);
+	g_mutex_unlock(&conn->rco_emit_mtx);
+
 	/* Tear down all the running inbound/outbound calls */
 
 	g_rw_lock_reader_lock(&conn->rco_icall_rwlock);
@@ -1020,9 +2518,7 @@ rpc_close(rpc_connection_t conn)
 		if (call->rc_abort_handler) {
 			rpc_connection_call_retain(call);
 			g_mutex_unlock(&call->rc_mtx);
-			g_thread_pool_push(conn->rco_callback_pool, call, &err);
-			if (err != NULL) {
-				g_error_free(err);
+			if (!rpc_abort_push(conn, call)) {
 				Block_release(call->rc_abort_handler);
 				call->rc_abort_handler = NULL;
 				rpc_connection_call_release(call);
@@ -1042,18 +2538,22 @@ rpc_close(rpc_connection_t conn)
 			continue;
 		}
 
-		q_item = g_malloc(sizeof(*q_item));
+		q_item = g_malloc0(sizeof(*q_item));
 		q_item->status = RPC_CALL_ERROR;
 		q_item->item = rpc_error_create(ECONNABORTED,
 		    "Connection closed", NULL);
 
-		g_queue_push_tail(call->rc_queue, q_item);
+		g_queue_push_tail(&call->rc_queue, q_item);
 		notify_signal(&call->rc_notify);
+		thens = g_slist_concat(thens, rpc_call_settle_locked(call));
 		g_mutex_unlock(&call->rc_mtx);
 	}
 
 	g_rw_lock_reader_unlock(&conn->rco_call_rwlock);
 
+	/* Continuations may free their calls, so run them unlocked */
+	rpc_call_run_thens(thens);
+
 	if ((g_atomic_int_get(&conn->rco_state) & CONNECTION_CLOSED) != 0)
 		rpc_connection_do_close(conn, RPC_ABORTED);
 	rpc_connection_release(conn);
@@ -1061,9 +2561,14 @@ rpc_close(rpc_connection_t conn)
 	return (0);
 }
 
+/*
+ * Path, interface and method name are borrowed from @p frame, which
+ * the call keeps a reference to.
+ */
 static struct rpc_call *
-rpc_call_alloc(rpc_connection_t conn, rpc_object_t id, const char *path,
-    const char *interface, const char *method, rpc_object_t args)
+rpc_call_alloc(rpc_connection_t conn, rpc_object_t id, rpc_object_t frame,
+    const char *path, const char *interface, const char *method,
+    rpc_object_t args)
 {
 	struct rpc_call *call;
 	rpc_object_t call_args;
@@ -1092,320 +2597,1230 @@ rpc_call_alloc(rpc_connection_t conn, rpc_object_t id, const char *path,
 	} else
 		call_args = rpc_array_create();
 
-	call = g_malloc0(sizeof(*call));
+	call = rpc_slab_alloc(&rpc_call_slab);
 	call->rc_refcount = 1;
-	call->rc_queue = g_queue_new();
+	g_queue_init(&call->rc_queue);
 	call->rc_prefetch = 1;
 	call->rc_conn = conn;
 	call->rc_context = conn->rco_rpc_context;
-	call->rc_path = g_strdup(path);
-	call->rc_interface = g_strdup(interface);
-	call->rc_method_name = g_strdup(method);
+	call->rc_frame = rpc_retain(frame);
+	call->rc_path = path;
+	call->rc_interface = interface;
+	call->rc_method_name = method;
 	call->rc_args = call_args;
-	call->rc_id = id != NULL ? id : rpc_new_id();
+	call->rc_id = id != NULL ? id : rpc_new_id(conn);
 	g_mutex_init(&call->rc_mtx);
-	g_mutex_init(&call->rc_ref_mtx);
 	notify_init(&call->rc_notify);
 
 	return (call);
 }
 
-static int
-rpc_send_frame(rpc_connection_t conn, rpc_object_t frame)
+/*
+ * Takes the send lock. Only a contended lock is timed, so the common
+ * case costs no clock reads.
+ */
+static void
+rpc_send_lock(rpc_connection_t conn)
 {
-	void *buf = frame;
-	int fds[MAX_FDS];
-	rpc_object_t tmp;
-	size_t len = 0, nfds = 0;
-	int ret;
-
-	if ((conn->rco_flags & RPC_TRANSPORT_NO_RPCT_SERIALIZE) == 0) {
-		tmp = rpct_serialize(frame);
-		rpc_release(frame);
-		frame = tmp;
-		buf = tmp;
-	}
+	gint64 start;
 
-#ifdef RPC_TRACE
-	rpc_trace("SEND", conn->rco_uri, frame);
-#endif
+	if (g_mutex_trylock(&conn->rco_send_mtx))
+		return;
 
+	start = g_get_monotonic_time();
 	g_mutex_lock(&conn->rco_send_mtx);
-	nfds = rpc_serialize_fds(frame, fds, NULL, 0);
+	rpc_count_time(&conn->rco_send_wait_time, start);
+}
 
-	if ((conn->rco_flags & RPC_TRANSPORT_NO_SERIALIZE) == 0) {
-		if (rpc_msgpack_serialize(frame, &buf, &len) != 0) {
-			g_mutex_unlock(&conn->rco_send_mtx);
-			rpc_release(frame);
-			return (-1);
-		}
-	}
-
-	ret = conn->rco_send_msg(conn->rco_arg, buf, len, fds, nfds);
-	rpc_release(frame);
-
-	if ((conn->rco_flags & RPC_TRANSPORT_NO_SERIALIZE) == 0)
-		free(buf);
+static void
+rpc_count_time(_Atomic uint64_t *counter, gint64 start)
+{
 
-	g_mutex_unlock(&conn->rco_send_mtx);
-	return (ret);
+	atomic_fetch_add(counter, (uint64_t)MAX(g_get_monotonic_time() - start,
+	    0));
 }
 
-static struct rpc_subscription *
-rpc_connection_find_subscription(rpc_connection_t conn, const char *path,
-    const char *interface, const char *name)
+static void
+rpc_count_out(rpc_connection_t conn, size_t nframes, size_t len)
 {
-	struct rpc_subscription *result;
-	guint i;
-
-	for (i = 0; i < conn->rco_subscriptions->len; i++) {
-		result = g_ptr_array_index(conn->rco_subscriptions, i);
-
-		if (g_strcmp0(result->rsu_path, path) != 0)
-			continue;
 
-		if (g_strcmp0(result->rsu_interface, interface) != 0)
-			continue;
+	atomic_fetch_add(&conn->rco_frames_out, nframes);
+	atomic_fetch_add(&conn->rco_bytes_out, len);
+	if (rpc_trace_ring_on())
+		rpc_trace_bytes(RPC_TRACE_STAGE_WRITE, conn, len);
 
-		if (g_strcmp0(result->rsu_name, name) != 0)
-			continue;
+	RPC_PROBE2(frame__write, conn, len);
+}
 
-		return (result);
-	}
+static int
+rpc_send_frame(rpc_connection_t conn, rpc_object_t frame)
+{
 
-	return (NULL);
+	return (rpc_send_frame_tagged(conn, frame, NULL));
 }
 
-void
-rpc_connection_send_err(rpc_connection_t conn, rpc_object_t id, int code,
-    const char *descr, ...)
+/*
+ * Every frame on its way out counts towards the send queue until the
+ * transport has taken it, so a peer that stops reading shows up as a
+ * growing queue of blocked senders.
+ */
+static int
+rpc_send_frame_tagged(rpc_connection_t conn, rpc_object_t frame,
+    rpc_object_t tag)
 {
-	rpc_object_t err;
-	va_list ap;
-	char *str;
 
-	va_start(ap, descr);
-	g_vasprintf(&str, descr, ap);
-	va_end(ap);
+	/*
+	 * Subscriptions still waiting for the loop go out first, so the
+	 * server sees them before anything the client sent after them.
+	 */
+	if (g_atomic_int_get(&conn->rco_sub_npending) > 0)
+		rpc_connection_flush_subscriptions(conn);
 
-	err = rpc_error_create(code, str, NULL);
-	rpc_connection_send_errx(conn, id, err);
-	g_free(str);
+	return (rpc_send_frame_queued(conn, frame, tag));
 }
 
 static int
-rpc_call_wait_locked(rpc_call_t call)
+rpc_send_frame_queued(rpc_connection_t conn, rpc_object_t frame,
+    rpc_object_t tag)
 {
-	int ret = 0;
-
-	while (g_queue_is_empty(call->rc_queue)) {
-		g_mutex_unlock(&call->rc_mtx);
-		ret = notify_wait(&call->rc_notify);
-		if (ret < 0 && errno == EINTR) {
-			rpc_set_last_errorf(EINTR, "Interrupted by signal");
-			g_mutex_lock(&call->rc_mtx);
-			return (-1);
-		}
+	size_t depth;
+	int ret;
 
-		g_mutex_lock(&call->rc_mtx);
-	}
+	depth = atomic_fetch_add(&conn->rco_send_queue, 1) + 1;
+	if (conn->rco_send_high > 0 && depth >= conn->rco_send_high &&
+	    g_atomic_int_compare_and_exchange(&conn->rco_saturated, false,
+	    true))
+		atomic_store(&conn->rco_saturated_since, g_get_monotonic_time());
 
+	ret = rpc_send_frame_out(conn, frame, tag);
+	rpc_send_queue_leave(conn);
 	return (ret);
 }
 
-static gboolean
-rpc_call_timeout(gpointer user_data)
+static void
+rpc_send_queue_leave(rpc_connection_t conn)
 {
-	struct queue_item *q_item;
-	rpc_call_t call = user_data;
-
-	if (g_source_is_destroyed(g_main_current_source()))
-		return (false);
+	size_t depth;
 
-	g_mutex_lock(&call->rc_mtx);
-	call->rc_timedout = true;
+	depth = atomic_fetch_sub(&conn->rco_send_queue, 1) - 1;
+	if (depth > conn->rco_send_low)
+		return;
 
-	/* make sure when we get the lock someone hasn't already handled this */
-	if (call->rc_timeout == NULL ||
-	    g_source_is_destroyed(call->rc_timeout)) {
-		g_mutex_unlock(&call->rc_mtx);
-		return false;
+	if (g_atomic_int_compare_and_exchange(&conn->rco_saturated, true,
+	    false)) {
+		atomic_store(&conn->rco_saturated_since, 0);
+		rpc_connection_schedule_writable(conn);
 	}
-
-	q_item = g_malloc(sizeof(*q_item));
-	q_item->status = RPC_CALL_ERROR;
-	q_item->item = rpc_error_create(ETIMEDOUT, "Call timed out", NULL);
-
-	g_queue_push_tail(call->rc_queue, q_item);
-	notify_signal(&call->rc_notify);
-	g_mutex_unlock(&call->rc_mtx);
-
-	return (false);
 }
 
-void
-rpc_connection_send_errx(rpc_connection_t conn, rpc_object_t id __unused,
-    rpc_object_t err)
+/*
+ * Senders may hold a call's lock, so writable handlers run from the
+ * connection's main context rather than from the send path.
+ */
+static void
+rpc_connection_schedule_writable(rpc_connection_t conn)
 {
-	rpc_object_t frame;
+	GSource *source;
 
-	frame = rpc_pack_frame("rpc", "error", id, err);
-	rpc_send_frame(conn, frame);
+	rpc_connection_retain(conn);
+	source = g_idle_source_new();
+	g_source_set_callback(source, rpc_connection_notify_writable, conn,
+	    NULL);
+	g_source_attach(source, conn->rco_main_context);
+	g_source_unref(source);
 }
 
-void
-rpc_connection_send_response(rpc_connection_t conn, rpc_object_t id,
-    rpc_object_t response)
+/*
+ * Runs the connection's writable handler and those of the streaming
+ * calls that hit a full queue. Handlers are collected first, so none
+ * of them runs with a call or connection lock held.
+ */
+static gboolean
+rpc_connection_notify_writable(gpointer user_data)
 {
-	rpc_object_t frame;
+	rpc_connection_t conn = user_data;
+	GHashTableIter iter;
+	GPtrArray *handlers;
+	rpc_writable_handler_t handler;
+	struct rpc_call *call;
+	guint i;
 
-	if (response == NULL)
-		response = rpc_null_create();
+	handlers = g_ptr_array_new();
+	g_rw_lock_reader_lock(&conn->rco_icall_rwlock);
+	g_hash_table_iter_init(&iter, conn->rco_inbound_calls);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&call)) {
+		g_mutex_lock(&call->rc_mtx);
+		handler = rpc_call_writable_locked(call);
+		g_mutex_unlock(&call->rc_mtx);
+		if (handler != NULL)
+			g_ptr_array_add(handlers, handler);
+	}
+	g_rw_lock_reader_unlock(&conn->rco_icall_rwlock);
 
-	frame = rpc_pack_frame("rpc", "response", id, response);
-	rpc_send_frame(conn, frame);
-}
+	if (conn->rco_writable_handler != NULL)
+		conn->rco_writable_handler();
 
-void
-rpc_connection_send_start_stream(rpc_connection_t conn, rpc_object_t id,
-    int64_t seqno)
-{
-	rpc_object_t frame;
-	rpc_object_t args;
+	for (i = 0; i < handlers->len; i++) {
+		handler = g_ptr_array_index(handlers, i);
+		handler();
+		Block_release(handler);
+	}
 
-	args = rpc_dictionary_create();
-	rpc_dictionary_set_int64(args, "seqno", seqno);
-	frame = rpc_pack_frame("rpc", "start_stream", id, args);
-	rpc_send_frame(conn, frame);
+	g_ptr_array_free(handlers, true);
+	rpc_connection_release(conn);
+	return (G_SOURCE_REMOVE);
 }
 
-void
-rpc_connection_send_fragment(rpc_connection_t conn, rpc_object_t id,
-    int64_t seqno, rpc_object_t fragment)
+/*
+ * Returns a copy of the call's writable handler if an earlier
+ * rpc_function_yield_try() is waiting for the stream to become
+ * writable and it now is. Called with rc_mtx held.
+ */
+static rpc_writable_handler_t
+rpc_call_writable_locked(struct rpc_call *call)
 {
-	rpc_object_t frame;
-	rpc_object_t args;
 
-	args = rpc_dictionary_create();
-	rpc_dictionary_set_int64(args, "seqno", seqno);
-	rpc_dictionary_steal_value(args, "fragment", fragment);
-	frame = rpc_pack_frame("rpc", "fragment", id, args);
-	rpc_send_frame(conn, frame);
-}
+	if (!call->rc_want_writable || call->rc_writable_handler == NULL)
+		return (NULL);
 
-void
-rpc_connection_send_end(rpc_connection_t conn, rpc_object_t id, int64_t seqno)
-{
-	rpc_object_t frame;
-	rpc_object_t args;
+	if (!rpc_call_has_credits(call) ||
+	    g_atomic_int_get(&call->rc_conn->rco_saturated))
+		return (NULL);
 
-	args = rpc_dictionary_create();
-	rpc_dictionary_set_int64(args, "seqno", seqno);
-	frame = rpc_pack_frame("rpc", "end", id, args);
-	rpc_send_frame(conn, frame);
+	call->rc_want_writable = false;
+	return (Block_copy(call->rc_writable_handler));
 }
 
-int
-rpc_connection_call_retain(struct rpc_call *call)
+/*
+ * Frames sent on behalf of a streaming call are tagged with its id,
+ * so they can be taken out of the send batch if the call goes away
+ * before the batch is flushed.
+ */
+static int
+rpc_send_frame_out(rpc_connection_t conn, rpc_object_t frame,
+    rpc_object_t tag)
 {
+	void *buf = frame;
+	int fds[MAX_FDS];
+	int *fdp = fds;
+	rpc_object_t tmp;
+	rpc_object_t body;
+	struct iovec *iov = NULL;
+	struct rpc_envelope env;
+	uint8_t hdr[RPC_ENVELOPE_HDR_SIZE];
+	uint8_t *hdrp = hdr;
+	size_t len = 0, nfds = 0, niov = 0;
+	bool locked = false;
+	bool compact;
+	bool batch;
+	gint64 start;
+	int ret;
+#if defined(__linux__)
+	guint regions;
+#endif
 
-	g_assert(call->rc_refcount > 0);
-	g_mutex_lock(&call->rc_ref_mtx);
-	if (call->rc_refcount < 1) {
-		g_mutex_unlock(&call->rc_ref_mtx);
-		return (-1);
-	}
+	RPC_PROBE2(frame__send, conn, frame);
+	if (rpc_trace_ring_on())
+		rpc_trace_frame(RPC_TRACE_STAGE_SEND, conn, frame, 0);
 
-	++call->rc_refcount;
+	if ((conn->rco_flags & RPC_TRANSPORT_NO_RPCT_SERIALIZE) == 0) {
+		/* Type IDs have to reach the peer in the order they're assigned */
+		if (conn->rco_type_ids) {
+			rpc_send_lock(conn);
+			locked = true;
+			conn->rco_type_table->rtt_defined = false;
+			rpct_set_type_table(conn->rco_type_table);
+		}
 
-	g_mutex_unlock(&call->rc_ref_mtx);
-	return (0);
-}
+		start = g_get_monotonic_time();
+		tmp = conn->rco_compact_structs ?
+		    rpct_serialize_compact(frame) : rpct_serialize(frame);
+		rpc_count_time(&conn->rco_serialize_time, start);
+		rpc_release(frame);
+		frame = tmp;
+		buf = tmp;
 
-int
-rpc_connection_call_release(struct rpc_call *call)
-{
+		/* A frame defining IDs must not be dropped from the batch */
+		if (conn->rco_type_ids) {
+			rpct_set_type_table(NULL);
+			if (conn->rco_type_table->rtt_defined)
+				tag = NULL;
+		}
+	}
 
-	g_assert(call->rc_refcount > 0);
-	g_mutex_lock(&call->rc_ref_mtx);
+#ifdef RPC_TRACE
+	rpc_trace("SEND", conn->rco_uri, frame);
+#endif
 
-	if (call->rc_refcount > 1) {
-		call->rc_refcount--;
-		g_mutex_unlock(&call->rc_ref_mtx);
-		return (0);
-	} else if (call->rc_refcount < 1) {
-		g_mutex_unlock(&call->rc_ref_mtx);
-		return (-1);
+	if (!locked)
+		rpc_send_lock(conn);
+#if defined(__linux__)
+	regions = conn->rco_shmem_tx->len;
+#endif
+	nfds = rpc_serialize_fds(conn, frame, fds, NULL, 0);
+
+	if ((conn->rco_flags & RPC_TRANSPORT_NO_SERIALIZE) == 0 &&
+	    conn->rco_compressor != NULL) {
+		ret = rpc_send_compressed_locked(conn, frame, fds, nfds, tag);
+		goto done;
 	}
 
-	call->rc_refcount = -1;
-	g_mutex_unlock(&call->rc_ref_mtx);
+	compact = (conn->rco_flags & RPC_TRANSPORT_NO_SERIALIZE) == 0 &&
+	    g_atomic_int_get(&conn->rco_compact_frames) &&
+	    rpc_frame_get_envelope(frame, &env);
+
+	/* The deadline travels in the header, the receiver puts it back */
+	if (compact && (env.re_flags & RPC_ENVELOPE_DEADLINE))
+		rpc_dictionary_remove_key(rpc_dictionary_get_value(frame,
+		    RPC_ATOM(ARGS)), RPC_ATOM(TIMEOUT));
+
+	/*
+	 * Batching copies frames into the batch, so those with binaries
+	 * the transport could take in place go out on their own, after
+	 * what's queued.
+	 */
+	batch = (conn->rco_flags & RPC_TRANSPORT_NO_SERIALIZE) == 0 &&
+	    conn->rco_batch_max_bytes > 0;
+	if (batch && conn->rco_send_msgv != NULL &&
+	    rpc_frame_has_large_binary(frame)) {
+		batch = false;
+		ret = rpc_send_batch_flush_locked(conn);
+		if (ret != 0)
+			goto done;
+	}
 
-	if (call->rc_callback != NULL)
-		Block_release(call->rc_callback);
+	if (compact && (batch ||
+	    (conn->rco_send_begin == NULL && conn->rco_send_msgv == NULL))) {
+		ret = rpc_send_enveloped_locked(conn, frame, &env, fds, nfds,
+		    tag);
+		goto done;
+	}
 
-	if (call->rc_instance != NULL)
-		rpc_instance_release(call->rc_instance);
+	if (batch) {
+		ret = rpc_send_batch_frame_locked(conn, frame, fds, nfds,
+		    tag);
+		goto done;
+	}
 
-	rpc_release(call->rc_err);
-	rpc_release(call->rc_id);
-	rpc_release(call->rc_args);
-	g_free(call->rc_path);
-	g_free(call->rc_interface);
-	g_free(call->rc_method_name);
-	notify_free(&call->rc_notify);
-	g_mutex_clear(&call->rc_mtx);
-	g_mutex_clear(&call->rc_ref_mtx);
+	if ((conn->rco_flags & RPC_TRANSPORT_NO_SERIALIZE) == 0 &&
+	    conn->rco_send_begin != NULL) {
+		/*
+		 * Streaming path: a frame that fits RPC_SEND_CHUNK_SIZE,
+		 * not counting the binaries it references, goes out in a
+		 * single vectored send. A larger one is written out in
+		 * RPC_SEND_CHUNK_SIZE pieces as it is serialized, so no
+		 * frame-sized buffer is ever built.
+		 */
+		if (conn->rco_send_buf == NULL)
+			conn->rco_send_buf = rpc_alloc(RPC_ALLOC_TAG_FRAME,
+			    RPC_SEND_CHUNK_SIZE);
+
+		/* In the compact envelope, the header goes out first */
+		body = frame;
+		if (compact) {
+			rpc_envelope_encode(&env, hdr);
+			body = rpc_dictionary_get_value(frame, RPC_ATOM(ARGS));
+		}
 
-	if (call->rc_queue != NULL)
-		g_queue_free(call->rc_queue);
+		ret = rpc_msgpack_serialize_stream(body, conn->rco_send_buf,
+		    RPC_SEND_CHUNK_SIZE, conn->rco_send_msgv == NULL ? NULL :
+		    ^(const struct iovec *vec, size_t nvec) {
+			return (rpc_send_vectored_locked(conn, compact ? hdrp :
+			    NULL, vec, nvec, fdp, nfds));
+		}, ^(size_t size) {
+			size_t extra = compact ? RPC_ENVELOPE_HDR_SIZE : 0;
+
+			rpc_count_out(conn, 1, size + extra);
+			/* Blocks cannot capture arrays, hence fdp and hdrp */
+			if (conn->rco_send_begin(conn->rco_arg, size + extra,
+			    fdp, nfds) != 0)
+				return (-1);
+
+			return (compact ? conn->rco_send_chunk(conn->rco_arg,
+			    hdrp, RPC_ENVELOPE_HDR_SIZE) : 0);
+		}, ^(const void *chunk, size_t chunk_len) {
+			return (conn->rco_send_chunk(conn->rco_arg, chunk,
+			    chunk_len));
+		});
 
-	rpc_connection_release(call->rc_conn); /*drop the call's ref */
-	g_free(call);
-	return (0);
-}
+		goto done;
+	}
 
-void
-rpc_connection_close_inbound_call(struct rpc_call *call)
-{
-	rpc_connection_t conn = call->rc_conn;
+	if ((conn->rco_flags & RPC_TRANSPORT_NO_SERIALIZE) == 0 &&
+	    conn->rco_send_msgv != NULL) {
+		/*
+		 * Vectored path: large binary leaves are passed to the
+		 * transport in place, so the frame must stay alive
+		 * until the send completes.
+		 */
+		start = g_get_monotonic_time();
+		body = frame;
+		if (compact) {
+			rpc_envelope_encode(&env, hdr);
+			body = rpc_dictionary_get_value(frame, RPC_ATOM(ARGS));
+		}
 
-	rpc_connection_retain(conn);
+		if (rpc_msgpack_serialize_iov(body, &buf, &len, &iov,
+		    &niov) != 0) {
+			ret = -1;
+			goto done;
+		}
 
-	g_rw_lock_writer_lock(&conn->rco_icall_rwlock);
+		rpc_count_time(&conn->rco_serialize_time, start);
+		ret = rpc_send_vectored_locked(conn, compact ? hdr : NULL, iov,
+		    niov, fds, nfds);
+		g_free(iov);
+		free(buf);
+		goto done;
+	}
 
-	if (!g_hash_table_remove(conn->rco_inbound_calls, rpc_string_get_string_ptr(
-	    call->rc_id))) {
-		g_rw_lock_writer_unlock(&conn->rco_icall_rwlock);
-		rpc_connection_release(conn);
-		return;
+	if ((conn->rco_flags & RPC_TRANSPORT_NO_SERIALIZE) == 0) {
+		start = g_get_monotonic_time();
+		if (rpc_msgpack_serialize(frame, &buf, &len) != 0) {
+			ret = -1;
+			goto done;
+		}
+
+		rpc_count_time(&conn->rco_serialize_time, start);
 	}
 
-	g_rw_lock_writer_unlock(&conn->rco_icall_rwlock);
+	rpc_count_out(conn, 1, len);
+	ret = conn->rco_send_msg(conn->rco_arg, buf, len, fds, nfds);
+	if ((conn->rco_flags & RPC_TRANSPORT_NO_SERIALIZE) == 0)
+		free(buf);
 
-	rpc_connection_call_release(call);
-	rpc_connection_release(conn);
+done:
+#if defined(__linux__)
+	rpc_shmem_region_settle(conn, regions, ret);
+#endif
+	rpc_release(frame);
+	g_mutex_unlock(&conn->rco_send_mtx);
+	return (ret);
 }
 
-static rpc_object_t
-rpc_new_id(void)
+/*
+ * Sends a serialized frame, preceded by its compact envelope header if
+ * @p hdr isn't NULL.
+ */
+static int
+rpc_send_vectored_locked(rpc_connection_t conn, const uint8_t *hdr,
+    const struct iovec *vec, size_t nvec, const int *fds, size_t nfds)
 {
-	char *str = rpc_generate_v4_uuid();
-	rpc_object_t ret = rpc_string_create(str);
+	struct iovec *iov;
+	size_t len = 0;
+	size_t n = 0;
+	size_t i;
+	int ret;
 
-	g_free(str);
+	iov = g_malloc_n(nvec + 1, sizeof(*iov));
+	if (hdr != NULL) {
+		iov[n].iov_base = (void *)hdr;
+		iov[n].iov_len = RPC_ENVELOPE_HDR_SIZE;
+		len += iov[n++].iov_len;
+	}
+
+	for (i = 0; i < nvec; i++) {
+		iov[n] = vec[i];
+		len += iov[n++].iov_len;
+	}
+
+	rpc_count_out(conn, 1, len);
+	ret = conn->rco_send_msgv(conn->rco_arg, iov, n, fds, nfds);
+	g_free(iov);
 	return (ret);
 }
 
-static void
-rpc_connection_set_default_fn_handlers(rpc_connection_t conn)
+/*
+ * Frames fit the compact envelope if their name has an opcode and their
+ * ID is an integer or null; others keep going out as dictionaries.
+ */
+static bool
+rpc_frame_get_envelope(rpc_object_t frame, struct rpc_envelope *env)
 {
+	rpc_object_t id;
+	rpc_object_t args;
+	rpc_object_t timeout;
+	const char *namespace;
+	const char *name;
 
-	conn->rco_fn_cbs.rcf_fn_respond = rpc_function_respond_impl;
-	conn->rco_fn_cbs.rcf_fn_error = rpc_function_error_impl;
-	conn->rco_fn_cbs.rcf_fn_error_ex = rpc_function_error_ex_impl;
-	conn->rco_fn_cbs.rcf_fn_start_stream = rpc_function_start_stream_impl;
-	conn->rco_fn_cbs.rcf_fn_yield = rpc_function_yield_impl;
+	namespace = rpc_dictionary_get_string(frame, RPC_ATOM(NAMESPACE));
+	name = rpc_dictionary_get_string(frame, RPC_ATOM(NAME));
+	id = rpc_dictionary_get_value(frame, RPC_ATOM(ID));
+	args = rpc_dictionary_get_value(frame, RPC_ATOM(ARGS));
+	if (namespace == NULL || name == NULL || id == NULL || args == NULL)
+		return (false);
+
+	env->re_op = rpc_frame_lookup_op(namespace, name);
+	if (env->re_op == RPC_OP_NONE)
+		return (false);
+
+	env->re_flags = 0;
+	env->re_deadline = 0;
+	env->re_id = 0;
+	switch (rpc_get_type(id)) {
+	case RPC_TYPE_NULL:
+		env->re_flags |= RPC_ENVELOPE_NO_ID;
+		break;
+
+	case RPC_TYPE_UINT64:
+		env->re_id = rpc_uint64_get_value(id);
+		break;
+
+	default:
+		return (false);
+	}
+
+	if (env->re_op == RPC_OP_CALL &&
+	    rpc_get_type(args) == RPC_TYPE_DICTIONARY) {
+		timeout = rpc_dictionary_get_value(args, RPC_ATOM(TIMEOUT));
+		if (timeout != NULL &&
+		    rpc_get_type(timeout) == RPC_TYPE_UINT64 &&
+		    rpc_uint64_get_value(timeout) <= G_MAXUINT32) {
+			env->re_flags |= RPC_ENVELOPE_DEADLINE;
+			env->re_deadline =
+			    (uint32_t)rpc_uint64_get_value(timeout);
+		}
+	}
+
+	return (true);
+}
+
+/*
+ * Whether the vectored path would reference any of the frame's binaries
+ * in place rather than copying them.
+ */
+static bool
+rpc_frame_has_large_binary(rpc_object_t obj)
+{
+	__block bool found = false;
+
+	switch (rpc_get_type(obj)) {
+	case RPC_TYPE_BINARY:
+		return (rpc_data_get_length(obj) >= MSGPACK_IOV_THRESHOLD);
+
+	case RPC_TYPE_ARRAY:
+		/* Packed arrays only ever hold numbers */
+		if (obj->ro_value.rv_packed != NULL)
+			break;
+
+		rpc_array_apply(obj, ^(size_t idx __unused, rpc_object_t v) {
+			found = rpc_frame_has_large_binary(v);
+			return ((bool)!found);
+		});
+		break;
+
+	case RPC_TYPE_DICTIONARY:
+		rpc_dictionary_apply(obj, ^(const char *key __unused,
+		    rpc_object_t v) {
+			found = rpc_frame_has_large_binary(v);
+			return ((bool)!found);
+		});
+		break;
+
+	default:
+		break;
+	}
+
+	return (found);
+}
+
+static int
+rpc_send_enveloped_locked(rpc_connection_t conn, rpc_object_t frame,
+    const struct rpc_envelope *env, const int *fds, size_t nfds,
+    rpc_object_t tag)
+{
+	uint8_t hdr[RPC_ENVELOPE_HDR_SIZE];
+	GBytes *bytes;
+	void *buf;
+	size_t len;
+	gint64 start;
+	int ret;
+
+	start = g_get_monotonic_time();
+	rpc_envelope_encode(env, hdr);
+	if (rpc_msgpack_serialize_prefixed(rpc_dictionary_get_value(frame,
+	    RPC_ATOM(ARGS)), hdr, sizeof(hdr), &buf, &len) != 0)
+		return (-1);
+
+	rpc_count_time(&conn->rco_serialize_time, start);
+	if (conn->rco_batch_max_bytes > 0) {
+		bytes = g_bytes_new_with_free_func(buf, len, free, buf);
+		ret = rpc_send_batch_bytes_locked(conn, bytes, fds, nfds, tag);
+		g_bytes_unref(bytes);
+		return (ret);
+	}
+
+	rpc_count_out(conn, 1, len);
+	ret = conn->rco_send_msg(conn->rco_arg, buf, len, fds, nfds);
+	free(buf);
+	return (ret);
+}
+
+/*
+ * With compression on, every frame is serialized exactly once, here; its
+ * size then decides whether it is worth compressing.
+ */
+static int
+rpc_send_compressed_locked(rpc_connection_t conn, rpc_object_t frame,
+    const int *fds, size_t nfds, rpc_object_t tag)
+{
+	GBytes *bytes;
+	GBytes *compressed = NULL;
+	const void *data;
+	void *buf;
+	size_t len;
+	gint64 start;
+	int ret;
+
+	start = g_get_monotonic_time();
+	if (rpc_msgpack_serialize(frame, &buf, &len) != 0)
+		return (-1);
+
+	/* Small frames, and frames that do not shrink, go out as they are */
+	if (len >= conn->rco_compress_threshold)
+		compressed = rpc_compress_frame(conn->rco_compressor, buf,
+		    len);
+
+	rpc_count_time(&conn->rco_serialize_time, start);
+	if (compressed != NULL) {
+		free(buf);
+		bytes = compressed;
+	} else
+		bytes = g_bytes_new_with_free_func(buf, len, free, buf);
+
+	if (conn->rco_batch_max_bytes > 0)
+		ret = rpc_send_batch_bytes_locked(conn, bytes, fds, nfds,
+		    tag);
+	else {
+		data = g_bytes_get_data(bytes, &len);
+		rpc_count_out(conn, 1, len);
+		ret = conn->rco_send_msg(conn->rco_arg, data, len, fds, nfds);
+	}
+
+	g_bytes_unref(bytes);
+	return (ret);
+}
+
+static int
+rpc_connection_set_compression(rpc_connection_t conn, rpc_object_t params)
+{
+	const char *codec;
+	const void *dict;
+	size_t dictlen = 0;
+
+	if (params == NULL || rpc_get_type(params) != RPC_TYPE_DICTIONARY)
+		return (0);
+
+	conn->rco_compact_structs = rpc_dictionary_get_bool(params,
+	    RPC_CONNECTION_COMPACT_STRUCTS);
+	conn->rco_type_ids = rpc_dictionary_get_bool(params,
+	    RPC_CONNECTION_TYPE_IDS);
+
+	codec = rpc_dictionary_get_string(params, RPC_CONNECTION_COMPRESS);
+	if (codec == NULL)
+		return (0);
+
+	dict = rpc_dictionary_get_data(params, RPC_CONNECTION_COMPRESS_DICT,
+	    &dictlen);
+	conn->rco_compressor = rpc_compressor_new(codec, dict, dictlen);
+	if (conn->rco_compressor == NULL)
+		return (-1);
+
+	conn->rco_compress_threshold = RPC_COMPRESS_THRESHOLD;
+	if (rpc_dictionary_has_key(params, RPC_CONNECTION_COMPRESS_THRESHOLD)) {
+		conn->rco_compress_threshold = (size_t)rpc_dictionary_get_uint64(
+		    params, RPC_CONNECTION_COMPRESS_THRESHOLD);
+	}
+
+	return (0);
+}
+
+static struct rpc_subscription *
+rpc_connection_find_subscription(rpc_connection_t conn, const char *path,
+    const char *interface, const char *name)
+{
+	struct rpc_subscription *result;
+	guint i;
+
+	for (i = 0; i < conn->rco_subscriptions->len; i++) {
+		result = g_ptr_array_index(conn->rco_subscriptions, i);
+
+		if (g_strcmp0(result->rsu_path, path) != 0)
+			continue;
+
+		if (g_strcmp0(result->rsu_interface, interface) != 0)
+			continue;
+
+		if (g_strcmp0(result->rsu_name, name) != 0)
+			continue;
+
+		return (result);
+	}
+
+	return (NULL);
+}
+
+static struct rpc_subscription *
+rpc_connection_match_subscription(rpc_connection_t conn, const char *path,
+    const char *interface, const char *name)
+{
+	struct rpc_subscription *result;
+	guint i;
+
+	for (i = 0; i < conn->rco_subscriptions->len; i++) {
+		result = g_ptr_array_index(conn->rco_subscriptions, i);
+
+		if (g_strcmp0(result->rsu_interface, interface) != 0)
+			continue;
+
+		if (g_strcmp0(result->rsu_name, name) != 0)
+			continue;
+
+		if (!rpc_path_matches(result->rsu_path, path))
+			continue;
+
+		return (result);
+	}
+
+	return (NULL);
+}
+
+static void
+rpc_connection_unwatch(rpc_connection_t conn)
+{
+	rpc_context_t context = conn->rco_rpc_context;
+
+	if (context == NULL)
+		return;
+
+	/* No new events may be queued for the connection past this point */
+	rpc_rw_lock_writer_lock(&context->rcx_rwlock, RPC_LOCK_CONTEXT);
+	g_hash_table_remove(context->rcx_event_watchers, conn);
+	rpc_context_index_remove_connection_locked(context, conn);
+	g_rw_lock_writer_unlock(&context->rcx_rwlock);
+}
+
+void
+rpc_connection_send_err(rpc_connection_t conn, rpc_object_t id, int code,
+    const char *descr, ...)
+{
+	rpc_object_t err;
+	va_list ap;
+	char *str;
+
+	if (strchr(descr, '%') == NULL) {
+		err = rpc_error_create_shared(code, descr, NULL);
+		rpc_connection_send_errx(conn, id, err);
+		return;
+	}
+
+	va_start(ap, descr);
+	g_vasprintf(&str, descr, ap);
+	va_end(ap);
+
+	err = rpc_error_create(code, str, NULL);
+	rpc_connection_send_errx(conn, id, err);
+	g_free(str);
+}
+
+static int
+rpc_call_wait_locked(rpc_call_t call)
+{
+
+	while (g_queue_is_empty(&call->rc_queue)) {
+		notify_wait_spin(&call->rc_notify, &call->rc_mtx,
+		    RPC_SPIN_CALL_WAIT);
+	}
+
+	notify_drain(&call->rc_notify);
+	return (0);
+}
+
+static void
+rpc_call_timeout(void *arg)
+{
+	struct queue_item *q_item;
+	rpc_call_t call = arg;
+	GSList *thens;
+
+	RPC_PROBE2(call__timeout, call->rc_conn, call);
+	g_mutex_lock(&call->rc_mtx);
+	q_item = g_malloc0(sizeof(*q_item));
+	q_item->status = RPC_CALL_ERROR;
+	q_item->item = rpc_error_create_shared(ETIMEDOUT, "Call timed out",
+	    NULL);
+
+	g_queue_push_tail(&call->rc_queue, q_item);
+	notify_signal(&call->rc_notify);
+	thens = rpc_call_settle_locked(call);
+	g_mutex_unlock(&call->rc_mtx);
+	rpc_call_run_thens(thens);
+
+	/* Coalesced calls still have time left, let them try on their own */
+	if (call->rc_flight != NULL)
+		rpc_flight_end(call, RPC_CALL_ERROR, NULL);
+
+	rpc_connection_call_release(call);
+}
+
+void
+rpc_connection_send_errx(rpc_connection_t conn, rpc_object_t id __unused,
+    rpc_object_t err)
+{
+	rpc_object_t frame;
+
+	frame = rpc_pack_frame("rpc", "error", id, err);
+	rpc_send_frame(conn, frame);
+}
+
+void
+rpc_connection_send_response(rpc_connection_t conn, rpc_object_t id,
+    rpc_object_t response)
+{
+	GBytes *packed;
+
+	if (response == NULL)
+		response = rpc_null_create();
+
+	/* Frozen results keep their encoding around, splice it in */
+	packed = rpc_object_get_packed(response);
+	if (packed != NULL) {
+		rpc_connection_send_packed_response(conn, id, response, packed);
+		g_bytes_unref(packed);
+		return;
+	}
+
+	rpc_connection_send_response_frame(conn, id, response);
+}
+
+GBytes *
+rpc_connection_pack_result(rpc_object_t result)
+{
+	rpc_object_t tmp;
+	void *buf;
+	size_t len;
+
+	/* Descriptors are per-connection, so such results can't be shared */
+	if (rpc_object_has_fds(result))
+		return (NULL);
+
+	tmp = rpct_serialize(result);
+	if (rpc_msgpack_serialize(tmp, &buf, &len) != 0) {
+		rpc_release(tmp);
+		return (NULL);
+	}
+
+	rpc_release(tmp);
+	return (g_bytes_new_with_free_func(buf, len, free, buf));
+}
+
+void
+rpc_connection_send_packed_response(rpc_connection_t conn, rpc_object_t id,
+    rpc_object_t response, GBytes *packed)
+{
+	struct rpc_envelope env;
+	GBytes *bytes;
+	rpc_object_t frame;
+	const void *args;
+	void *buf;
+	gsize argslen;
+	size_t len;
+	int ret;
+
+	if (packed == NULL || (conn->rco_flags &
+	    (RPC_TRANSPORT_NO_SERIALIZE | RPC_TRANSPORT_NO_RPCT_SERIALIZE)))
+		goto fallback;
+
+	/* Big enough to be compressed, which needs the whole frame anyway */
+	args = g_bytes_get_data(packed, &argslen);
+	if (conn->rco_compressor != NULL &&
+	    argslen >= conn->rco_compress_threshold)
+		goto fallback;
+
+	if (g_atomic_int_get(&conn->rco_compact_frames) &&
+	    (id == NULL || rpc_get_type(id) == RPC_TYPE_UINT64)) {
+		/* The packed result is the whole body, just prepend a header */
+		env.re_op = RPC_OP_RESPONSE;
+		env.re_flags = id == NULL ? RPC_ENVELOPE_NO_ID : 0;
+		env.re_deadline = 0;
+		env.re_id = id == NULL ? 0 : rpc_uint64_get_value(id);
+		len = RPC_ENVELOPE_HDR_SIZE + argslen;
+		buf = malloc(len);
+		if (buf == NULL)
+			goto fallback;
+
+		rpc_envelope_encode(&env, buf);
+		memcpy((uint8_t *)buf + RPC_ENVELOPE_HDR_SIZE, args, argslen);
+	} else {
+		frame = rpc_dictionary_create();
+		rpc_dictionary_set_string(frame, RPC_ATOM(NAMESPACE), "rpc");
+		rpc_dictionary_set_string(frame, RPC_ATOM(NAME), "response");
+		rpc_dictionary_steal_value(frame, RPC_ATOM(ID),
+		    id ? rpc_retain(id) : rpc_null_create());
+		ret = rpc_msgpack_serialize_splice(frame, RPC_ATOM(ARGS), args,
+		    argslen, &buf, &len);
+		rpc_release(frame);
+
+		if (ret != 0)
+			goto fallback;
+	}
+
+	rpc_release(response);
+	rpc_send_lock(conn);
+	if (conn->rco_batch_max_bytes > 0) {
+		bytes = g_bytes_new_with_free_func(buf, len, free, buf);
+		rpc_send_batch_bytes_locked(conn, bytes, NULL, 0, NULL);
+		g_bytes_unref(bytes);
+	} else {
+		rpc_count_out(conn, 1, len);
+		conn->rco_send_msg(conn->rco_arg, buf, len, NULL, 0);
+		free(buf);
+	}
+	g_mutex_unlock(&conn->rco_send_mtx);
+	return;
+
+fallback:
+	rpc_connection_send_response_frame(conn, id, response);
+}
+
+static void
+rpc_connection_send_response_frame(rpc_connection_t conn, rpc_object_t id,
+    rpc_object_t response)
+{
+	rpc_object_t frame;
+
+	frame = rpc_pack_frame("rpc", "response", id, response);
+	rpc_send_frame(conn, frame);
+}
+
+void
+rpc_connection_send_start_stream(rpc_connection_t conn, rpc_object_t id,
+    int64_t seqno)
+{
+	rpc_object_t frame;
+	rpc_object_t args;
+
+	args = rpc_dictionary_create();
+	rpc_dictionary_set_int64(args, "seqno", seqno);
+	frame = rpc_pack_frame("rpc", "start_stream", id, args);
+	rpc_send_frame(conn, frame);
+}
+
+size_t
+rpc_connection_send_fragment(rpc_connection_t conn, rpc_object_t id,
+    int64_t seqno, rpc_object_t fragment, bool measure)
+{
+	rpc_object_t frame;
+	rpc_object_t args;
+	size_t size = 0;
+
+	args = rpc_dictionary_create();
+	rpc_dictionary_set_int64(args, "seqno", seqno);
+
+	/* Consumers granting byte credits need to know what to give back */
+	if (measure) {
+		size = rpc_msgpack_size(fragment);
+		rpc_dictionary_set_int64(args, RPC_ATOM(BYTES), (int64_t)size);
+	}
+
+	rpc_dictionary_steal_value(args, "fragment", fragment);
+	frame = rpc_pack_frame("rpc", "fragment", id, args);
+	rpc_send_frame_tagged(conn, frame, id);
+	return (size);
+}
+
+size_t
+rpc_connection_send_fragments(rpc_connection_t conn, rpc_object_t id,
+    int64_t seqno, rpc_object_t fragments, bool measure)
+{
+	rpc_object_t frame;
+	rpc_object_t args;
+	size_t size = 0;
+
+	/* Covers seqno up to seqno + count - 1, one credit per element */
+	args = rpc_dictionary_create();
+	rpc_dictionary_set_int64(args, "seqno", seqno);
+
+	if (measure) {
+		size = rpc_msgpack_size(fragments);
+		rpc_dictionary_set_int64(args, RPC_ATOM(BYTES), (int64_t)size);
+	}
+
+	rpc_dictionary_steal_value(args, RPC_ATOM(FRAGMENTS), fragments);
+	frame = rpc_pack_frame("rpc", "fragment", id, args);
+	rpc_send_frame_tagged(conn, frame, id);
+	return (size);
+}
+
+#if defined(__linux__)
+/*
+ * Puts the fragment into the call's ring and sends only a doorbell in
+ * its place. Fragments with descriptors, or that don't fit in the room
+ * left, go out in frames of their own; the client reads the ring in
+ * frame order, so the stream stays in sequence either way.
+ */
+size_t
+rpc_connection_send_ring_fragment(rpc_connection_t conn, rpc_object_t id,
+    struct rpc_event_ring *ring, int64_t seqno, rpc_object_t fragment,
+    bool measure)
+{
+	rpc_object_t frame;
+	rpc_object_t args;
+	rpc_object_t tmp;
+	void *buf;
+	size_t len;
+
+	if (rpc_object_has_fds(fragment))
+		goto fallback;
+
+	tmp = rpct_serialize(fragment);
+	if (rpc_msgpack_serialize(tmp, &buf, &len) != 0) {
+		rpc_release(tmp);
+		goto fallback;
+	}
+
+	rpc_release(tmp);
+	if (rpc_event_ring_put(ring, buf, len) < 0) {
+		free(buf);
+		goto fallback;
+	}
+
+	free(buf);
+	rpc_release(fragment);
+
+	args = rpc_object_pack("{i,b}",
+	    "seqno", seqno,
+	    "ring", true);
+	if (measure)
+		rpc_dictionary_set_int64(args, RPC_ATOM(BYTES), (int64_t)len);
+
+	frame = rpc_pack_frame("rpc", "fragment", id, args);
+	rpc_send_frame_tagged(conn, frame, id);
+	return (measure ? len : 0);
+
+fallback:
+	return (rpc_connection_send_fragment(conn, id, seqno, fragment,
+	    measure));
+}
+#endif
+
+void
+rpc_connection_send_end(rpc_connection_t conn, rpc_object_t id, int64_t seqno)
+{
+	rpc_object_t frame;
+	rpc_object_t args;
+
+	args = rpc_dictionary_create();
+	rpc_dictionary_set_int64(args, "seqno", seqno);
+	frame = rpc_pack_frame("rpc", "end", id, args);
+	rpc_send_frame(conn, frame);
+}
+
+void
+rpc_connection_send_input_credit(rpc_connection_t conn, rpc_object_t id,
+    int64_t increment)
+{
+	rpc_object_t frame;
+	rpc_object_t args;
+
+	args = rpc_dictionary_create();
+	rpc_dictionary_set_int64(args, "increment", increment);
+	frame = rpc_pack_frame("rpc", "input_continue", id, args);
+	rpc_send_frame(conn, frame);
+}
+
+int
+rpc_connection_call_retain(struct rpc_call *call)
+{
+	int old;
+
+	g_assert(call->rc_refcount > 0);
+	do {
+		old = g_atomic_int_get(&call->rc_refcount);
+		if (old < 1)
+			return (-1);
+	} while (!g_atomic_int_compare_and_exchange(&call->rc_refcount, old,
+	    old + 1));
+
+	return (0);
+}
+
+int
+rpc_connection_call_release(struct rpc_call *call)
+{
+	int old;
+
+	g_assert(call->rc_refcount > 0);
+	do {
+		old = g_atomic_int_get(&call->rc_refcount);
+		if (old < 1)
+			return (-1);
+	} while (!g_atomic_int_compare_and_exchange(&call->rc_refcount, old,
+	    old - 1));
+
+	if (old > 1)
+		return (0);
+
+	if (call->rc_callback != NULL)
+		Block_release(call->rc_callback);
+
+	if (call->rc_instance != NULL)
+		rpc_instance_release(call->rc_instance);
+
+	rpc_release(call->rc_err);
+	rpc_release(call->rc_id);
+	rpc_release(call->rc_args);
+	rpc_release(call->rc_frame);
+	rpc_release(call->rc_flight_frame);
+	rpc_release(call->rc_batch_result);
+	notify_free(&call->rc_notify);
+	g_mutex_clear(&call->rc_mtx);
+
+	rpc_release(call->rc_frag_batch);
+	while (!g_queue_is_empty(&call->rc_input_queue))
+		rpc_release(g_queue_pop_head(&call->rc_input_queue));
+
+#if defined(__linux__)
+	rpc_event_ring_free(call->rc_stream_ring);
+#endif
+
+	g_free(call->rc_traceparent);
+	if (call->rc_writable_handler != NULL)
+		Block_release(call->rc_writable_handler);
+
+	rpc_connection_release(call->rc_conn); /*drop the call's ref */
+	rpc_slab_free(&rpc_call_slab, call);
+	return (0);
+}
+
+void
+rpc_connection_close_inbound_call(struct rpc_call *call)
+{
+	rpc_connection_t conn = call->rc_conn;
+	gint64 now;
+
+	rpc_connection_retain(conn);
+
+	g_rw_lock_writer_lock(&conn->rco_icall_rwlock);
+
+	if (!g_hash_table_remove(conn->rco_inbound_calls, call->rc_id)) {
+		g_rw_lock_writer_unlock(&conn->rco_icall_rwlock);
+		rpc_connection_release(conn);
+		return;
+	}
+
+	g_rw_lock_writer_unlock(&conn->rco_icall_rwlock);
+
+	RPC_PROBE3(call__done, conn, call, call->rc_failed);
+	now = g_get_monotonic_time();
+	if (call->rc_context != NULL)
+		rpc_stats_record_call(call->rc_context->rcx_stats, call, now);
+
+	if (call->rc_trace.rtc_valid)
+		rpc_trace_export_span(call, now);
+
+	if (call->rc_batch != NULL) {
+		rpc_call_batch_put(call->rc_batch, call->rc_batch_idx,
+		    call->rc_batch_result != NULL ? call->rc_batch_result :
+		    rpc_error_create(EINVAL, "Call closed without response",
+		    NULL));
+		call->rc_batch = NULL;
+		call->rc_batch_result = NULL;
+	}
+
+	rpc_connection_call_release(call);
+	rpc_connection_release(conn);
+}
+
+static rpc_object_t
+rpc_new_id(rpc_connection_t conn)
+{
+	char *str;
+	rpc_object_t ret;
+
+	if (conn->rco_numeric_ids) {
+		return (rpc_uint64_create(
+		    (uint64_t)atomic_fetch_add(&conn->rco_next_id, 1)));
+	}
+
+	str = rpc_generate_v4_uuid();
+	ret = rpc_string_create(str);
+	g_free(str);
+	return (ret);
+}
+
+static guint
+rpc_call_id_hash(gconstpointer key)
+{
+	rpc_object_t id = (rpc_object_t)key;
+	uint64_t value;
+
+	switch (rpc_get_type(id)) {
+	case RPC_TYPE_UINT64:
+		/* Keep sequential IDs spread and accept 64-bit ones */
+		value = id->ro_value.rv_ui;
+		return ((guint)(value ^ (value >> 32)) * 2654435761u);
+
+	case RPC_TYPE_INT64:
+		value = (uint64_t)id->ro_value.rv_i;
+		return ((guint)(value ^ (value >> 32)) * 2654435761u);
+
+	case RPC_TYPE_STRING:
+		return (g_str_hash(rpc_string_get_string_ptr(id)));
+
+	default:
+		return (0);
+	}
+}
+
+static gboolean
+rpc_call_id_equal(gconstpointer a, gconstpointer b)
+{
+	rpc_object_t ida = (rpc_object_t)a;
+	rpc_object_t idb = (rpc_object_t)b;
+
+	/*
+	 * Peers may encode a small ID with either sign; both hash the
+	 * same, so match them by value when it fits the other type.
+	 */
+	if (rpc_get_type(ida) == RPC_TYPE_INT64 &&
+	    rpc_get_type(idb) == RPC_TYPE_UINT64)
+		return (ida->ro_value.rv_i >= 0 &&
+		    (uint64_t)ida->ro_value.rv_i == idb->ro_value.rv_ui);
+
+	if (rpc_get_type(ida) == RPC_TYPE_UINT64 &&
+	    rpc_get_type(idb) == RPC_TYPE_INT64)
+		return (idb->ro_value.rv_i >= 0 &&
+		    (uint64_t)idb->ro_value.rv_i == ida->ro_value.rv_ui);
+
+	if (rpc_get_type(ida) != rpc_get_type(idb))
+		return (false);
+
+	switch (rpc_get_type(ida)) {
+	case RPC_TYPE_UINT64:
+		return (ida->ro_value.rv_ui == idb->ro_value.rv_ui);
+
+	case RPC_TYPE_INT64:
+		return (ida->ro_value.rv_i == idb->ro_value.rv_i);
+
+	case RPC_TYPE_STRING:
+		return (g_strcmp0(rpc_string_get_string_ptr(ida),
+		    rpc_string_get_string_ptr(idb)) == 0);
+
+	default:
+		return (rpc_equal(ida, idb));
+	}
+}
+
+static void
+rpc_connection_set_default_fn_handlers(rpc_connection_t conn)
+{
+
+	conn->rco_fn_cbs.rcf_fn_respond = rpc_function_respond_impl;
+	conn->rco_fn_cbs.rcf_fn_error = rpc_function_error_impl;
+	conn->rco_fn_cbs.rcf_fn_error_ex = rpc_function_error_ex_impl;
+	conn->rco_fn_cbs.rcf_fn_start_stream = rpc_function_start_stream_impl;
+	conn->rco_fn_cbs.rcf_fn_yield = rpc_function_yield_impl;
 	conn->rco_fn_cbs.rcf_fn_end = rpc_function_end_impl;
 	conn->rco_fn_cbs.rcf_fn_kill = rpc_function_kill_impl;
 	conn->rco_fn_cbs.rcf_should_abort = rpc_function_should_abort_impl;
@@ -1413,892 +3828,2793 @@ rpc_connection_set_default_fn_handlers(rpc_connection_t conn)
 	    rpc_function_set_async_abort_handler_impl;
 }
 
-static rpc_connection_t
-rpc_connection_init(int flags)
+static rpc_connection_t
+rpc_connection_init(int flags)
+{
+	struct rpc_connection *conn = g_malloc0(sizeof(*conn));
+
+	rpc_connection_placeholders_init();
+	g_mutex_init(&conn->rco_mtx);
+	g_mutex_init(&conn->rco_ref_mtx);
+	g_mutex_init(&conn->rco_send_mtx);
+	conn->rco_send_low = RPC_SEND_QUEUE_LOW;
+	conn->rco_send_high = RPC_SEND_QUEUE_HIGH;
+	g_mutex_init(&conn->rco_emit_mtx);
+	g_cond_init(&conn->rco_emit_cv);
+	g_queue_init(&conn->rco_emit_queue);
+	g_mutex_init(&conn->rco_dispatch_mtx);
+	g_queue_init(&conn->rco_dispatch_queue);
+	g_mutex_init(&conn->rco_event_mtx);
+	g_queue_init(&conn->rco_event_queue);
+	g_rw_lock_init(&conn->rco_subscription_rwlock);
+	g_mutex_init(&conn->rco_sub_pending_mtx);
+	g_rw_lock_init(&conn->rco_call_rwlock);
+	g_rw_lock_init(&conn->rco_icall_rwlock);
+#if defined(__linux__)
+	g_mutex_init(&conn->rco_shmem_mtx);
+	conn->rco_shmem_tx = rpc_empty_shmem_tx;
+	conn->rco_shmem_rx = rpc_empty_shmem_rx;
+	conn->rco_event_ring_fd = -1;
+#endif
+
+	conn->rco_calls = rpc_empty_calls;
+	conn->rco_inbound_calls = rpc_empty_calls;
+	conn->rco_next_id = 1;
+	conn->rco_type_table = rpct_type_table_new();
+	conn->rco_subscriptions = rpc_empty_subscriptions;
+	g_mutex_init(&conn->rco_prop_cache_mtx);
+	conn->rco_prop_cache = rpc_empty_prop_cache;
+	g_mutex_init(&conn->rco_flight_mtx);
+	conn->rco_rpc_timeout = DEFAULT_RPC_TIMEOUT;
+	conn->rco_recv_msg = rpc_recv_msg;
+	conn->rco_recv_bytes = rpc_recv_bytes;
+	conn->rco_recv_object = rpc_recv_object;
+	conn->rco_close = rpc_close;
+
+	conn->rco_flags = flags;
+	if (rpc_connection_supports_credentials(conn))
+		conn->rco_set_creds = rpc_set_creds;
+
+	conn->rco_refcnt = 1;
+	conn->rco_arg = conn;
+	rpc_connection_set_default_fn_handlers(conn);
+
+	if (active_connections == NULL) {
+		active_connections = g_hash_table_new(NULL, NULL);
+		g_rw_lock_init(&active_rwlock);
+	}
+
+	return(conn);
+}
+
+static void
+rpc_connection_placeholders_init(void)
+{
+	static gsize initialized = 0;
+
+	if (!g_once_init_enter(&initialized))
+		return;
+
+	rpc_empty_calls = g_hash_table_new(rpc_call_id_hash,
+	    rpc_call_id_equal);
+	rpc_empty_prop_cache = g_hash_table_new(g_str_hash, g_str_equal);
+	rpc_empty_subscriptions = g_ptr_array_new();
+#if defined(__linux__)
+	rpc_empty_shmem_tx = g_array_new(false, true,
+	    sizeof(struct rpc_shmem_region));
+	rpc_empty_shmem_rx = g_hash_table_new(NULL, NULL);
+#endif
+	g_once_init_leave(&initialized, 1);
+}
+
+static GHashTable *
+rpc_call_table(GHashTable **table)
+{
+
+	if (*table == rpc_empty_calls)
+		*table = g_hash_table_new(rpc_call_id_hash, rpc_call_id_equal);
+
+	return (*table);
+}
+
+/* Called with rco_subscription_rwlock held for writing */
+static GPtrArray *
+rpc_connection_subscriptions(rpc_connection_t conn)
+{
+
+	if (conn->rco_subscriptions == rpc_empty_subscriptions) {
+		conn->rco_subscriptions = g_ptr_array_new_with_free_func(
+		    (GDestroyNotify)rpc_subscription_release);
+	}
+
+	return (conn->rco_subscriptions);
+}
+
+/* Called with rco_prop_cache_mtx held */
+static GHashTable *
+rpc_connection_prop_cache(rpc_connection_t conn)
+{
+
+	if (conn->rco_prop_cache == rpc_empty_prop_cache) {
+		conn->rco_prop_cache = g_hash_table_new_full(g_str_hash,
+		    g_str_equal, g_free,
+		    (GDestroyNotify)rpc_property_cache_free);
+	}
+
+	return (conn->rco_prop_cache);
+}
+
+/*
+ * Callback threads are set up on the first callback, which connections
+ * that only ever answer calls never see. Server connections only run
+ * aborts there, so they all share the process-wide executor.
+ */
+static void
+rpc_connection_callbacks_init(rpc_connection_t conn)
+{
+	GError *err = NULL;
+
+	if (!g_once_init_enter(&conn->rco_callbacks_ready))
+		return;
+
+	if (conn->rco_server != NULL) {
+		conn->rco_callback_exec = rpc_exec_tenant_new(1,
+		    g_get_num_processors(), rpc_abort_worker, conn);
+	} else if (rpc_exec_get_share_callbacks()) {
+		conn->rco_callback_exec = rpc_exec_tenant_new(1,
+		    g_get_num_processors(), rpc_callback_worker, conn);
+	} else {
+		conn->rco_callback_pool = g_thread_pool_new(
+		    &rpc_callback_worker, conn, g_get_num_processors(), false,
+		    &err);
+		if (err != NULL)
+			g_error_free(err);
+	}
+
+	g_once_init_leave(&conn->rco_callbacks_ready, 1);
+}
+
+rpc_connection_t
+rpc_connection_alloc(rpc_server_t server)
+{
+	struct rpc_connection *conn = NULL;
+
+	conn = rpc_connection_init(server->rs_flags);
+
+	conn->rco_uri = server->rs_uri;
+	conn->rco_server = server;
+	conn->rco_main_context = rpc_server_get_main_context(server);
+#if defined(__linux__)
+	if (server->rs_params != NULL &&
+	    rpc_get_type(server->rs_params) == RPC_TYPE_DICTIONARY) {
+		conn->rco_shmem_regions = rpc_dictionary_get_bool(
+		    server->rs_params, RPC_CONNECTION_SHMEM_REGIONS);
+	}
+#endif
+
+	/* Codecs missing from this build leave server frames uncompressed */
+	if (rpc_connection_set_compression(conn, server->rs_params) != 0)
+		debugf("Compression disabled on conn %p", conn);
+
+	g_rw_lock_writer_lock(&active_rwlock);
+	g_assert(!g_hash_table_contains(active_connections, conn));
+	if (!g_hash_table_insert(active_connections, conn, conn))
+		g_assert_not_reached();
+	g_rw_lock_writer_unlock(&active_rwlock);
+
+	return (conn);
+}
+
+rpc_connection_t
+rpc_connection_create(void *cookie, rpc_object_t params)
+{
+	const struct rpc_transport *transport;
+	struct rpc_connection *conn = NULL;
+	struct rpc_client *client = cookie;
+	char *scheme = NULL;
+
+	scheme = g_uri_parse_scheme(client->rci_uri);
+	transport = rpc_find_transport(scheme);
+	g_free(scheme);
+
+	if (transport == NULL) {
+		rpc_set_last_error(ENXIO, "Transport not found", NULL);
+		return (NULL);
+	}
+
+	conn = rpc_connection_init(transport->flags);
+
+	conn->rco_client = client;
+	conn->rco_params = params;
+	conn->rco_uri = client->rci_uri;
+
+	if (params != NULL && rpc_get_type(params) == RPC_TYPE_DICTIONARY) {
+		conn->rco_numeric_ids = rpc_dictionary_get_bool(params,
+		    RPC_CONNECTION_NUMERIC_IDS);
+		g_atomic_int_set(&conn->rco_compact_frames,
+		    rpc_dictionary_get_bool(params,
+		    RPC_CONNECTION_COMPACT_FRAMES));
+		if (g_atomic_int_get(&conn->rco_compact_frames))
+			conn->rco_numeric_ids = true;
+#if defined(__linux__)
+		conn->rco_shmem_regions = rpc_dictionary_get_bool(params,
+		    RPC_CONNECTION_SHMEM_REGIONS);
+#endif
+	}
+	conn->rco_main_context = rpc_client_get_main_context(client);
+	rpc_connection_set_default_fn_handlers(conn);
+
+	if (rpc_connection_set_compression(conn, params) != 0)
+		goto fail;
+
+	if (transport->connect(conn, conn->rco_uri, params) != 0)
+		goto fail;
+
+	if (params != NULL && rpc_get_type(params) == RPC_TYPE_DICTIONARY &&
+	    rpc_dictionary_has_key(params, RPC_CONNECTION_BATCH_BYTES)) {
+		rpc_connection_set_batching(conn,
+		    (size_t)rpc_dictionary_get_uint64(params,
+		    RPC_CONNECTION_BATCH_BYTES),
+		    (unsigned int)rpc_dictionary_get_uint64(params,
+		    RPC_CONNECTION_BATCH_LATENCY));
+	}
+
+	if (conn->rco_flags & RPC_TRANSPORT_FD_PASSING)
+		conn->rco_supports_fd_passing = transport->is_fd_passing(conn);
+
+	g_rw_lock_writer_lock(&active_rwlock);
+	g_assert(!g_hash_table_contains(active_connections, conn));
+	if (!g_hash_table_insert(active_connections, conn, conn))
+		g_assert_not_reached();
+	g_rw_lock_writer_unlock(&active_rwlock);
+
+	return (conn);
+fail:
+	if (conn != NULL)
+		rpc_connection_free_resources(conn);
+	return (NULL);
+}
+
+int
+rpc_connection_register_context(rpc_connection_t conn, rpc_context_t ctx)
+{
+
+	if (rpc_connection_retain_if_valid(conn, true) == 0) {
+		g_mutex_lock(&conn->rco_mtx);
+		conn->rco_rpc_context = ctx;
+		g_mutex_unlock(&conn->rco_mtx);
+		rpc_connection_release(conn);
+		return (0);
+	}
+	return (-1);
+}
+
+int rpc_connection_get_subscription_count(rpc_connection_t conn)
+{
+
+	return (
+	    rpc_connection_is_open(conn) ? conn->rco_subscriptions->len : -1);
+}
+
+static void
+rpc_connection_free_resources(rpc_connection_t conn)
+{
+#if defined(__linux__)
+	GHashTableIter iter;
+	gpointer value;
+	guint i;
+#endif
+
+	g_assert_cmpint(g_hash_table_size(conn->rco_calls), ==, 0);
+	g_assert_cmpint(g_hash_table_size(conn->rco_inbound_calls), ==, 0);
+	if (conn->rco_calls != rpc_empty_calls)
+		g_hash_table_destroy(conn->rco_calls);
+
+	if (conn->rco_inbound_calls != rpc_empty_calls)
+		g_hash_table_destroy(conn->rco_inbound_calls);
+
+	if (conn->rco_subscriptions != NULL &&
+	    conn->rco_subscriptions != rpc_empty_subscriptions)
+		g_ptr_array_free(conn->rco_subscriptions, true);
+
+	if (conn->rco_prop_cache != rpc_empty_prop_cache)
+		g_hash_table_destroy(conn->rco_prop_cache);
+
+	g_mutex_clear(&conn->rco_prop_cache_mtx);
+
+	if (conn->rco_flights != NULL)
+		g_hash_table_destroy(conn->rco_flights);
+
+	g_mutex_clear(&conn->rco_flight_mtx);
+
+	if (conn->rco_callback_pool != NULL) {
+		g_thread_pool_free(conn->rco_callback_pool, true, false);
+		conn->rco_callback_pool = NULL;
+	}
+
+	if (conn->rco_callback_exec != NULL) {
+		rpc_exec_tenant_free(conn->rco_callback_exec, false);
+		conn->rco_callback_exec = NULL;
+	}
+
+	while (!g_queue_is_empty(&conn->rco_event_queue))
+		rpc_release(g_queue_pop_head(&conn->rco_event_queue));
+
+	rpc_release(conn->rco_error);
+	g_free(conn->rco_endpoint_address);
+	g_free(conn->rco_session_token);
+	rpc_free(RPC_ALLOC_TAG_FRAME, conn->rco_send_buf, RPC_SEND_CHUNK_SIZE);
+	Block_release(conn->rco_writable_handler);
+	rpc_compressor_free(conn->rco_compressor);
+	rpct_type_table_free(conn->rco_type_table);
+
+	if (conn->rco_batch_timer != NULL) {
+		g_source_destroy(conn->rco_batch_timer);
+		g_source_unref(conn->rco_batch_timer);
+	}
+
+	if (conn->rco_batch != NULL) {
+		g_ptr_array_free(conn->rco_batch, true);
+		g_ptr_array_free(conn->rco_batch_tags, true);
+	}
+
+	while (!g_queue_is_empty(&conn->rco_emit_queue))
+		rpc_emit_entry_release(g_queue_pop_head(&conn->rco_emit_queue));
+
+#if defined(__linux__)
+	for (i = 0; i < conn->rco_shmem_tx->len; i++) {
+		close(g_array_index(conn->rco_shmem_tx,
+		    struct rpc_shmem_region, i).rsr_fd);
+	}
+
+	g_hash_table_iter_init(&iter, conn->rco_shmem_rx);
+	while (g_hash_table_iter_next(&iter, NULL, &value))
+		close(GPOINTER_TO_INT(value));
+
+	if (conn->rco_shmem_tx != rpc_empty_shmem_tx)
+		g_array_free(conn->rco_shmem_tx, true);
+
+	if (conn->rco_shmem_rx != rpc_empty_shmem_rx)
+		g_hash_table_destroy(conn->rco_shmem_rx);
+
+	g_mutex_clear(&conn->rco_shmem_mtx);
+
+	if (conn->rco_event_ring_source != NULL) {
+		g_source_destroy(conn->rco_event_ring_source);
+		g_source_unref(conn->rco_event_ring_source);
+	}
+
+	rpc_event_ring_free(conn->rco_event_ring);
+	if (conn->rco_event_ring_fd != -1)
+		close(conn->rco_event_ring_fd);
+#endif
+
+	g_mutex_clear(&conn->rco_emit_mtx);
+	g_cond_clear(&conn->rco_emit_cv);
+	g_mutex_clear(&conn->rco_dispatch_mtx);
+	g_rw_lock_clear(&conn->rco_call_rwlock);
+	g_rw_lock_clear(&conn->rco_icall_rwlock);
+	g_rw_lock_clear(&conn->rco_subscription_rwlock);
+	rpc_release(conn->rco_sub_pending);
+	g_mutex_clear(&conn->rco_sub_pending_mtx);
+}
+
+int
+rpc_connection_close(rpc_connection_t conn)
+{
+
+	return (rpc_connection_do_close(conn, RPC_CLOSE_CALLED));
+}
+
+int
+rpc_connection_do_close(rpc_connection_t conn, rpc_close_source_t source)
+{
+	rpc_abort_fn_t abort_func;
+	uint state;
+
+	debugf("%s state: %d conn: %p refcnt: %d  arg: %p, source: %d",
+	    conn->rco_server ? "Server" : "Client",
+	    conn->rco_state, conn, conn->rco_refcnt,
+	    conn->rco_arg, source);
+
+	/* Frames queued before an orderly close still go out */
+	if (source == RPC_CLOSE_CALLED && conn->rco_batch_max_bytes > 0) {
+		rpc_send_lock(conn);
+		rpc_send_batch_flush_locked(conn);
+		g_mutex_unlock(&conn->rco_send_mtx);
+	}
+
+	g_mutex_lock(&conn->rco_mtx);
+	if (source == RPC_CLOSE_CALLED)
+		g_atomic_int_or(&conn->rco_state, CONNECTION_CLOSED);
+
+	/* rco_state will only be modified under rco_mtx */
+	state = g_atomic_int_get(&conn->rco_state);
+
+	if ((conn->rco_abort != NULL) &&
+	    (state & CONNECTION_ABORTED) == 0) {
+		abort_func = conn->rco_abort;
+		conn->rco_abort = NULL;
+		g_mutex_unlock(&conn->rco_mtx);
+
+		rpc_connection_retain(conn);
+		abort_func(conn->rco_arg);
+		rpc_connection_release(conn);
+		return (0);
+	}
+	if ((state & CONNECTION_RELEASED) != 0)
+		goto done;
+
+	if (conn->rco_client != NULL) {
+		if ((state & CONNECTION_CLOSED) == 0)
+			goto done;
+
+		g_atomic_int_or(&conn->rco_state, CONNECTION_RELEASED);
+		g_mutex_unlock(&conn->rco_mtx);
+
+	} else if (conn->rco_server != NULL) {
+		g_atomic_int_inc(&conn->rco_server->rs_conn_closed);
+		g_atomic_int_or(&conn->rco_state, CONNECTION_RELEASED);
+		g_mutex_unlock(&conn->rco_mtx);
+
+		/* Subscriptions outlive the connection if it has a session */
+		rpc_session_suspend(conn);
+		rpc_connection_unwatch(conn);
+
+		/* if server isn't closed this will undo server's ref */
+		rpc_server_disconnect(conn->rco_server, conn);
+	}
+	/* undo connection's initial reference */
+	rpc_connection_release(conn);
+	return (0);
+done:
+	g_mutex_unlock(&conn->rco_mtx);
+	return (0);
+}
+
+bool
+rpc_connection_is_valid(rpc_connection_t conn)
+{
+	bool ret;
+
+	/* Use this when waiting for a conn to become invalid */
+	if (conn == NULL)
+		return (false);
+	g_rw_lock_reader_lock(&active_rwlock);
+	ret =  g_hash_table_contains(active_connections, conn);
+	g_rw_lock_reader_unlock(&active_rwlock);
+
+	return (ret);
+}
+
+bool
+rpc_connection_is_open(rpc_connection_t conn)
+{
+
+	/* conn if non-null must be valid */
+	return (conn != NULL &&
+	    (g_atomic_int_get(&conn->rco_state) == CONNECTION_OPEN));
+}
+
+int
+rpc_connection_retain(rpc_connection_t conn)
+{
+
+	/* conn if non-null is expected to be valid */
+	if (conn == NULL)
+		return (-1);
+
+	g_atomic_int_inc(&conn->rco_refcnt);
+	g_assert(conn->rco_refcnt > 1);
+
+	return (0);
+}
+
+int
+rpc_connection_release(rpc_connection_t conn)
+{
+
+	/* conn if non-null is expected to be valid */
+	if (conn == NULL)
+		return (-1);
+
+	g_assert(conn->rco_refcnt > 0);
+	if (g_atomic_int_dec_and_test(&conn->rco_refcnt)) {
+
+		g_assert((g_atomic_int_get(&conn->rco_state) &
+		    CONNECTION_CLOSED) != 0);
+
+		g_rw_lock_writer_lock(&active_rwlock);
+		if (!g_hash_table_contains(active_connections, conn)) {
+			/* someone might have retained and released and done
+			 * cleanup while we waited for the lock. just exit.
+			 */
+			g_assert_not_reached(); /* current code won't permit */
+			g_rw_lock_writer_unlock(&active_rwlock);
+			return (0);
+		}
+		if (g_atomic_int_get(&conn->rco_refcnt) > 0) {
+			/* someone retained; just exit for now */
+			g_assert_not_reached(); /* current code won't permit */
+			g_rw_lock_writer_unlock(&active_rwlock);
+			return (0);
+		}
+
+		/* ok, we have the lock, the conn is valid and unretained */
+		if (!g_hash_table_remove(active_connections, conn))
+			g_assert_not_reached();
+		g_rw_lock_writer_unlock(&active_rwlock);
+
+		if (conn->rco_release && conn->rco_arg) {
+			conn->rco_release(conn->rco_arg);
+			conn->rco_arg = NULL;
+		}
+		rpc_connection_free_resources(conn);
+
+		debugf("%s in thread %p freed %p",
+		    conn->rco_server ? "Server" : "Client",
+		    g_thread_self(), conn);
+
+		conn->rco_refcnt = -1;
+
+		if (conn->rco_server != NULL) {
+			/* undo connection's ref on server */
+			rpc_server_release(conn->rco_server);
+		}
+		g_free(conn);
+	}
+
+	return (0);
+}
+
+int
+rpc_connection_get_fd(rpc_connection_t conn)
+{
+
+	return (conn->rco_get_fd(conn->rco_arg));
+}
+
+int
+rpc_connection_detach(rpc_connection_t conn, void **pending,
+    size_t *pending_len)
+{
+	GBytes *bytes = NULL;
+	const void *data;
+	gsize len;
+	int fd;
+
+	*pending = NULL;
+	*pending_len = 0;
+
+	if (conn->rco_detach == NULL) {
+		rpc_set_last_errorf(ENOTSUP,
+		    "Transport can't hand over its socket");
+		return (-1);
+	}
+
+	if (rpc_connection_retain_if_valid(conn, true) != 0) {
+		rpc_set_last_error(ECONNRESET, "Connection closed", NULL);
+		return (-1);
+	}
+
+	fd = conn->rco_detach(conn->rco_arg, &bytes);
+	rpc_connection_release(conn);
+
+	if (fd < 0)
+		return (-1);
+
+	if (bytes != NULL) {
+		data = g_bytes_get_data(bytes, &len);
+		if (len > 0) {
+			*pending = g_memdup(data, (guint)len);
+			*pending_len = len;
+		}
+
+		g_bytes_unref(bytes);
+	}
+
+	return (fd);
+}
+
+int
+rpc_connection_set_batching(rpc_connection_t conn, size_t max_bytes,
+    unsigned int max_latency)
+{
+
+	if (max_bytes > 0 && conn->rco_send_batch == NULL) {
+		rpc_set_last_errorf(ENOTSUP,
+		    "Transport doesn't support send batching");
+		return (-1);
+	}
+
+	rpc_send_lock(conn);
+	rpc_send_batch_flush_locked(conn);
+
+	if (conn->rco_batch == NULL) {
+		conn->rco_batch = g_ptr_array_new_with_free_func(
+		    (GDestroyNotify)g_bytes_unref);
+		conn->rco_batch_tags = g_ptr_array_new_with_free_func(
+		    rpc_send_batch_tag_free);
+	}
+
+	conn->rco_batch_max_bytes = max_bytes;
+	conn->rco_batch_latency = max_latency;
+	g_mutex_unlock(&conn->rco_send_mtx);
+	return (0);
+}
+
+void
+rpc_connection_set_dispatch_limit(rpc_connection_t conn,
+    unsigned int max_inflight)
+{
+
+	conn->rco_dispatch_limit = max_inflight;
+}
+
+void
+rpc_connection_set_call_priority(rpc_connection_t conn,
+    rpc_call_priority_t priority)
+{
+
+	conn->rco_call_priority = priority;
+}
+
+void
+rpc_connection_set_coalescing(rpc_connection_t conn, bool enable)
+{
+
+	g_mutex_lock(&conn->rco_flight_mtx);
+	if (enable && conn->rco_flights == NULL)
+		g_atomic_pointer_set(&conn->rco_flights, g_hash_table_new(
+		    rpc_flight_hash, rpc_flight_equal));
+
+	g_atomic_int_set(&conn->rco_coalesce, enable);
+	g_mutex_unlock(&conn->rco_flight_mtx);
+}
+
+int
+rpc_connection_set_event_delivery(rpc_connection_t conn,
+    rpc_event_delivery_t mode)
+{
+
+	if (mode != RPC_EVENT_DELIVERY_POOL &&
+	    mode != RPC_EVENT_DELIVERY_INLINE &&
+	    mode != RPC_EVENT_DELIVERY_SERIAL) {
+		rpc_set_last_error(EINVAL, "Invalid event delivery mode", NULL);
+		return (-1);
+	}
+
+	conn->rco_event_delivery = mode;
+	return (0);
+}
+
+void
+rpc_connection_free(rpc_connection_t conn)
+{
+
+
+}
+
+#ifdef ENABLE_LIBDISPATCH
+int
+rpc_connection_set_dispatch_queue(rpc_connection_t conn, dispatch_queue_t queue)
+{
+	GError *err = NULL;
+
+	if (conn->rco_callback_pool != NULL)
+		g_thread_pool_set_max_threads(conn->rco_callback_pool, 0, &err);
+
+	conn->rco_dispatch_queue = queue;
+	return (0);
+}
+#endif
+
+static rpc_frame_op_t
+rpc_frame_lookup_op(const char *namespace, const char *name)
+{
+	static gsize initialized = 0;
+	GHashTable *index;
+	rpc_frame_op_t op;
+	int i;
+
+	if (g_once_init_enter(&initialized)) {
+		index = g_hash_table_new(g_str_hash, g_str_equal);
+		for (i = RPC_OP_NONE + 1; i < RPC_OP_MAX; i++) {
+			if (handlers[i].name != NULL)
+				g_hash_table_insert(index,
+				    (gpointer)handlers[i].name,
+				    GINT_TO_POINTER(i));
+		}
+
+		handlers_by_name = index;
+		g_once_init_leave(&initialized, 1);
+	}
+
+	op = (rpc_frame_op_t)GPOINTER_TO_INT(g_hash_table_lookup(
+	    handlers_by_name, name));
+	if (op == RPC_OP_NONE || strcmp(namespace, handlers[op].namespace))
+		return (RPC_OP_NONE);
+
+	return (op);
+}
+
+static void
+rpc_connection_dispatch_op(rpc_connection_t conn, rpc_frame_op_t op,
+    rpc_object_t id, rpc_object_t args)
+{
+
+	if (op == RPC_OP_NONE || op >= RPC_OP_MAX ||
+	    handlers[op].handler == NULL) {
+		rpc_connection_send_err(conn, id, ENXIO,
+		    "No request handler found");
+		return;
+	}
+
+	handlers[op].handler(conn, args, id);
+}
+
+void
+rpc_connection_dispatch(rpc_connection_t conn, rpc_object_t frame)
+{
+	rpc_object_t id;
+	const char *namespace;
+	const char *name;
+
+	/* Must be called with the connection retained */
+	id = rpc_dictionary_get_value(frame, RPC_ATOM(ID));
+	namespace = rpc_dictionary_get_string(frame, RPC_ATOM(NAMESPACE));
+	name = rpc_dictionary_get_string(frame, RPC_ATOM(NAME));
+
+	if (id == NULL || namespace == NULL || name == NULL) {
+		rpc_connection_send_err(conn, id, EINVAL, "Malformed request");
+		return;
+	}
+
+	debugf("inbound call: namespace=%s, name=%s, id=%p", namespace, name,
+	    id);
+
+	if (rpc_trace_ring_on())
+		rpc_trace_frame(RPC_TRACE_STAGE_DISPATCH, conn, frame, 0);
+
+#ifdef RPC_TRACE
+	rpc_trace("RECV", conn->rco_uri, frame);
+#endif
+
+	rpc_connection_dispatch_op(conn, rpc_frame_lookup_op(namespace, name),
+	    id, rpc_dictionary_get_value(frame, RPC_ATOM(ARGS)));
+	rpc_release(frame);
+}
+
+static int
+rpc_send_batch_frame_locked(rpc_connection_t conn, rpc_object_t frame,
+    const int *fds, size_t nfds, rpc_object_t tag)
+{
+	GBytes *bytes;
+	void *buf;
+	size_t len;
+	gint64 start;
+	int ret;
+
+	start = g_get_monotonic_time();
+	if (rpc_msgpack_serialize(frame, &buf, &len) != 0)
+		return (-1);
+
+	rpc_count_time(&conn->rco_serialize_time, start);
+	bytes = g_bytes_new_with_free_func(buf, len, free, buf);
+	ret = rpc_send_batch_bytes_locked(conn, bytes, fds, nfds, tag);
+	g_bytes_unref(bytes);
+	return (ret);
+}
+
+static int
+rpc_send_batch_bytes_locked(rpc_connection_t conn, GBytes *bytes,
+    const int *fds, size_t nfds, rpc_object_t tag)
+{
+	const void *buf;
+	gsize len;
+
+	buf = g_bytes_get_data(bytes, &len);
+
+	/*
+	 * Frames carrying descriptors, or big enough to fill the batch
+	 * by themselves, go out on their own right after the queue.
+	 */
+	if (nfds > 0 || len >= conn->rco_batch_max_bytes) {
+		if (rpc_send_batch_flush_locked(conn) != 0)
+			return (-1);
+
+		rpc_count_out(conn, 1, len);
+		return (conn->rco_send_msg(conn->rco_arg, buf, len, fds,
+		    nfds));
+	}
+
+	g_ptr_array_add(conn->rco_batch, g_bytes_ref(bytes));
+	g_ptr_array_add(conn->rco_batch_tags,
+	    tag != NULL ? rpc_retain(tag) : NULL);
+	conn->rco_batch_bytes += len;
+
+	if (conn->rco_batch_bytes >= conn->rco_batch_max_bytes ||
+	    conn->rco_batch->len >= RPC_SEND_BATCH_MAX_FRAMES)
+		return (rpc_send_batch_flush_locked(conn));
+
+	/* The timer keeps the connection alive until it fires or is gone */
+	if (conn->rco_batch_timer == NULL) {
+		conn->rco_batch_timer = g_timeout_source_new(
+		    conn->rco_batch_latency);
+		rpc_connection_retain(conn);
+		g_source_set_callback(conn->rco_batch_timer,
+		    rpc_send_batch_timeout, conn,
+		    (GDestroyNotify)rpc_connection_release);
+		g_source_attach(conn->rco_batch_timer, conn->rco_main_context);
+	}
+
+	return (0);
+}
+
+static int
+rpc_send_batch_flush_locked(rpc_connection_t conn)
+{
+	struct iovec *iov;
+	GBytes *item;
+	gsize len;
+	guint i;
+	int ret;
+
+	if (conn->rco_batch_timer != NULL) {
+		g_source_destroy(conn->rco_batch_timer);
+		g_source_unref(conn->rco_batch_timer);
+		conn->rco_batch_timer = NULL;
+	}
+
+	if (conn->rco_batch == NULL || conn->rco_batch->len == 0)
+		return (0);
+
+	iov = g_malloc_n(conn->rco_batch->len, sizeof(*iov));
+	for (i = 0; i < conn->rco_batch->len; i++) {
+		item = g_ptr_array_index(conn->rco_batch, i);
+		iov[i].iov_base = (void *)g_bytes_get_data(item, &len);
+		iov[i].iov_len = len;
+	}
+
+	rpc_count_out(conn, conn->rco_batch->len, conn->rco_batch_bytes);
+	ret = conn->rco_send_batch(conn->rco_arg, iov, conn->rco_batch->len);
+	g_free(iov);
+	g_ptr_array_set_size(conn->rco_batch, 0);
+	g_ptr_array_set_size(conn->rco_batch_tags, 0);
+	conn->rco_batch_bytes = 0;
+	return (ret);
+}
+
+static void
+rpc_send_batch_tag_free(gpointer tag)
+{
+
+	if (tag != NULL)
+		rpc_release(tag);
+}
+
+void
+rpc_connection_purge_call(rpc_connection_t conn, rpc_object_t id)
+{
+	GBytes *item;
+	guint i;
+
+	rpc_send_lock(conn);
+	if (conn->rco_batch == NULL) {
+		g_mutex_unlock(&conn->rco_send_mtx);
+		return;
+	}
+
+	for (i = conn->rco_batch->len; i > 0; i--) {
+		if (g_ptr_array_index(conn->rco_batch_tags, i - 1) != id)
+			continue;
+
+		item = g_ptr_array_index(conn->rco_batch, i - 1);
+		conn->rco_batch_bytes -= g_bytes_get_size(item);
+		g_ptr_array_remove_index(conn->rco_batch, i - 1);
+		g_ptr_array_remove_index(conn->rco_batch_tags, i - 1);
+	}
+	g_mutex_unlock(&conn->rco_send_mtx);
+}
+
+static gboolean
+rpc_send_batch_timeout(gpointer user_data)
+{
+	rpc_connection_t conn = user_data;
+
+	if (rpc_connection_retain_if_valid(conn, true) != 0)
+		return (G_SOURCE_REMOVE);
+
+	rpc_send_lock(conn);
+	if (rpc_send_batch_flush_locked(conn) != 0)
+		debugf("batched send failed, conn %p", conn);
+	g_mutex_unlock(&conn->rco_send_mtx);
+
+	rpc_connection_release(conn);
+	return (G_SOURCE_REMOVE);
+}
+
+static struct rpc_subscription *
+rpc_connection_subscribe_event_locked(rpc_connection_t conn, const char *path,
+    const char *interface, const char *name, bool check_busy)
+{
+	struct rpc_subscription *sub;
+
+	sub = rpc_connection_find_subscription(conn, path, interface, name);
+	if (sub == NULL) {
+		sub = g_malloc0(sizeof(*sub));
+		sub->rsu_path = g_strdup(path);
+		sub->rsu_interface = g_strdup(interface);
+		sub->rsu_name = g_strdup(name);
+		sub->rsu_handlers = g_ptr_array_new_with_free_func((GDestroyNotify)rpc_rsh_release);
+		rpc_connection_queue_subscription(conn, rpc_object_pack(
+		    "{s,s,s}",
+		    "path", path,
+		    "interface", interface,
+		    "name", name));
+		sub->rsu_refcount = 1;
+		g_ptr_array_add(rpc_connection_subscriptions(conn), sub);
+	} else {
+		if (!check_busy || !sub->rsu_busy)
+			sub->rsu_refcount++;
+	}
+	return (sub);
+}
+
+int
+rpc_connection_subscribe_event(rpc_connection_t conn, const char *path,
+    const char *interface, const char *name)
+{
+	struct rpc_subscription *sub;
+
+	if (rpc_connection_retain_if_valid(conn, true) != 0) {
+		rpc_set_last_error(ECONNRESET, "Connection closed", NULL);
+		return (-1);
+	}
+
+	g_rw_lock_writer_lock(&conn->rco_subscription_rwlock);
+	sub = rpc_connection_subscribe_event_locked(conn, path, interface,
+	    name, false);
+	g_rw_lock_writer_unlock(&conn->rco_subscription_rwlock);
+
+	if (sub == NULL)
+		rpc_set_last_error(EFAULT, "Unknown error", NULL);
+
+	rpc_connection_release(conn);
+	return (sub == NULL) ? -1 : 0;
+}
+
+int
+rpc_connection_unsubscribe_event(rpc_connection_t conn, const char *path,
+    const char *interface, const char *name)
+{
+	struct rpc_subscription *sub;
+	int ret = 0;
+
+	if (rpc_connection_retain_if_valid(conn, true) != 0) {
+		rpc_set_last_error(ECONNRESET, "Connection closed", NULL);
+		return (-1);
+	}
+
+	g_rw_lock_writer_lock(&conn->rco_subscription_rwlock);
+	sub = rpc_connection_find_subscription(conn, path, interface, name);
+	if (sub == NULL) {
+		g_rw_lock_writer_unlock(&conn->rco_subscription_rwlock);
+		rpc_set_last_error(ENOENT, "Subscription not found", NULL);
+		rpc_connection_release(conn);
+		return (-1);
+	}
+	ret = rpc_connection_unsubscribe_event_locked(conn, sub, NULL);
+	g_rw_lock_writer_unlock(&conn->rco_subscription_rwlock);
+	rpc_connection_release(conn);
+	return (ret);
+}
+
+int
+rpc_connection_subscribe_events(rpc_connection_t conn,
+    rpc_object_t subscriptions)
+{
+	__block int ret = 0;
+
+	if (rpc_get_type(subscriptions) != RPC_TYPE_ARRAY) {
+		rpc_set_last_error(EINVAL, "Subscriptions must be an array",
+		    NULL);
+		return (-1);
+	}
+
+	if (rpc_connection_retain_if_valid(conn, true) != 0) {
+		rpc_set_last_error(ECONNRESET, "Connection closed", NULL);
+		return (-1);
+	}
+
+	g_rw_lock_writer_lock(&conn->rco_subscription_rwlock);
+	rpc_array_apply(subscriptions, ^(size_t idx __unused,
+	    rpc_object_t value) {
+		const char *name;
+
+		name = rpc_dictionary_get_string(value, "name");
+		if (name == NULL) {
+			rpc_set_last_error(EINVAL, "Event name missing", NULL);
+			ret = -1;
+			return ((bool)false);
+		}
+
+		rpc_connection_subscribe_event_locked(conn,
+		    rpc_dictionary_get_string(value, "path"),
+		    rpc_dictionary_get_string(value, "interface"),
+		    name, false);
+
+		return ((bool)true);
+	});
+	g_rw_lock_writer_unlock(&conn->rco_subscription_rwlock);
+
+	/* No need to wait for the loop, everything is in already */
+	if (rpc_connection_flush_subscriptions(conn) != 0)
+		ret = -1;
+
+	rpc_connection_release(conn);
+	return (ret);
+}
+
+int
+rpc_connection_attach_event_ring(rpc_connection_t conn)
+{
+#if defined(__linux__)
+	int fd;
+	int ret;
+
+	if (conn->rco_client == NULL || !conn->rco_supports_fd_passing) {
+		rpc_set_last_error(ENOTSUP,
+		    "Event rings need a local client connection", NULL);
+		return (-1);
+	}
+
+	if (rpc_connection_retain_if_valid(conn, true) != 0) {
+		rpc_set_last_error(ECONNRESET, "Connection closed", NULL);
+		return (-1);
+	}
+
+	g_rw_lock_writer_lock(&conn->rco_subscription_rwlock);
+	if (conn->rco_event_ring_fd != -1) {
+		g_rw_lock_writer_unlock(&conn->rco_subscription_rwlock);
+		rpc_connection_release(conn);
+		return (0);
+	}
+
+	fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (fd < 0) {
+		g_rw_lock_writer_unlock(&conn->rco_subscription_rwlock);
+		rpc_set_last_errorf(errno, "Cannot create eventfd: %s",
+		    strerror(errno));
+		rpc_connection_release(conn);
+		return (-1);
+	}
+
+	conn->rco_event_ring_fd = fd;
+	g_rw_lock_writer_unlock(&conn->rco_subscription_rwlock);
+
+	ret = rpc_send_frame(conn, rpc_pack_frame("events", "ring_attach",
+	    NULL, rpc_object_pack("{v}", "notify", rpc_fd_create(fd))));
+
+	rpc_connection_release(conn);
+	return (ret);
+#else
+	rpc_set_last_error(ENOTSUP, "Event rings need memory files", NULL);
+	return (-1);
+#endif
+}
+
+int
+rpc_connection_unsubscribe_events(rpc_connection_t conn,
+    rpc_object_t subscriptions)
+{
+	__block bool found = true;
+	__block rpc_object_t batch;
+	rpc_object_t frame;
+	int ret = 0;
+
+	if (rpc_get_type(subscriptions) != RPC_TYPE_ARRAY) {
+		rpc_set_last_error(EINVAL, "Subscriptions must be an array",
+		    NULL);
+		return (-1);
+	}
+
+	if (rpc_connection_retain_if_valid(conn, true) != 0) {
+		rpc_set_last_error(ECONNRESET, "Connection closed", NULL);
+		return (-1);
+	}
+
+	/* Look everything up first, so that an unknown one changes nothing */
+	g_rw_lock_writer_lock(&conn->rco_subscription_rwlock);
+	rpc_array_apply(subscriptions, ^(size_t idx __unused,
+	    rpc_object_t value) {
+		found = rpc_connection_find_subscription(conn,
+		    rpc_dictionary_get_string(value, "path"),
+		    rpc_dictionary_get_string(value, "interface"),
+		    rpc_dictionary_get_string(value, "name")) != NULL;
+
+		return ((bool)found);
+	});
+
+	if (!found) {
+		g_rw_lock_writer_unlock(&conn->rco_subscription_rwlock);
+		rpc_set_last_error(ENOENT, "Subscription not found", NULL);
+		rpc_connection_release(conn);
+		return (-1);
+	}
+
+	batch = rpc_array_create();
+	rpc_array_apply(subscriptions, ^(size_t idx __unused,
+	    rpc_object_t value) {
+		struct rpc_subscription *sub;
+
+		/* Listed more times than subscribed to is no error */
+		sub = rpc_connection_find_subscription(conn,
+		    rpc_dictionary_get_string(value, "path"),
+		    rpc_dictionary_get_string(value, "interface"),
+		    rpc_dictionary_get_string(value, "name"));
+		if (sub != NULL)
+			rpc_connection_unsubscribe_event_locked(conn, sub,
+			    batch);
+
+		return ((bool)true);
+	});
+
+	if (rpc_array_get_count(batch) > 0) {
+		frame = rpc_pack_frame("events", "unsubscribe", NULL, batch);
+		ret = rpc_send_frame(conn, frame);
+	} else
+		rpc_release(batch);
+	g_rw_lock_writer_unlock(&conn->rco_subscription_rwlock);
+
+	rpc_connection_release(conn);
+	return (ret);
+}
+
+/*
+ * Called with the subscriptions locked. New subscriptions made within
+ * one main loop iteration reach the server in a single events.subscribe
+ * frame, sent from the loop or ahead of whatever frame goes out next.
+ */
+static void
+rpc_connection_queue_subscription(rpc_connection_t conn, rpc_object_t entry)
+{
+	GSource *source;
+
+	g_mutex_lock(&conn->rco_sub_pending_mtx);
+	if (conn->rco_sub_pending == NULL)
+		conn->rco_sub_pending = rpc_array_create();
+
+	rpc_array_append_stolen_value(conn->rco_sub_pending, entry);
+	if (g_atomic_int_add(&conn->rco_sub_npending, 1) == 0) {
+		rpc_connection_retain(conn);
+		source = g_idle_source_new();
+		g_source_set_callback(source,
+		    rpc_connection_flush_subscriptions_idle, conn,
+		    (GDestroyNotify)rpc_connection_release);
+		g_source_attach(source, conn->rco_main_context);
+		g_source_unref(source);
+	}
+	g_mutex_unlock(&conn->rco_sub_pending_mtx);
+}
+
+/*
+ * Sends pending subscriptions. The lock is held until they're out, so
+ * a concurrent sender that sees them pending can't get ahead of them.
+ */
+static int
+rpc_connection_flush_subscriptions(rpc_connection_t conn)
+{
+	rpc_object_t frame;
+	int ret = 0;
+
+	g_mutex_lock(&conn->rco_sub_pending_mtx);
+	if (conn->rco_sub_pending != NULL) {
+		frame = rpc_pack_frame("events", "subscribe", NULL,
+		    conn->rco_sub_pending);
+		conn->rco_sub_pending = NULL;
+		ret = rpc_send_frame_queued(conn, frame, NULL);
+	}
+
+	g_atomic_int_set(&conn->rco_sub_npending, 0);
+	g_mutex_unlock(&conn->rco_sub_pending_mtx);
+	return (ret);
+}
+
+static gboolean
+rpc_connection_flush_subscriptions_idle(gpointer user_data)
 {
-	struct rpc_connection *conn = g_malloc0(sizeof(*conn));
+	rpc_connection_t conn = user_data;
 
-	g_mutex_init(&conn->rco_mtx);
-	g_mutex_init(&conn->rco_ref_mtx);
-	g_mutex_init(&conn->rco_send_mtx);
-	g_rw_lock_init(&conn->rco_subscription_rwlock);
-	g_rw_lock_init(&conn->rco_call_rwlock);
-	g_rw_lock_init(&conn->rco_icall_rwlock);
+	if (rpc_connection_flush_subscriptions(conn) != 0)
+		debugf("sending subscriptions failed, conn %p", conn);
 
-	conn->rco_calls = g_hash_table_new(g_str_hash, g_str_equal);
-	conn->rco_inbound_calls = g_hash_table_new(g_str_hash, g_str_equal);
-	conn->rco_subscriptions = g_ptr_array_new_with_free_func((GDestroyNotify)rpc_subscription_release);
-	conn->rco_rpc_timeout = DEFAULT_RPC_TIMEOUT;
-	conn->rco_recv_msg = rpc_recv_msg;
-	conn->rco_close = rpc_close;
+	return (G_SOURCE_REMOVE);
+}
 
-	conn->rco_flags = flags;
-	if (rpc_connection_supports_credentials(conn))
-		conn->rco_set_creds = rpc_set_creds;
+static int
+rpc_connection_unsubscribe_event_locked(rpc_connection_t conn,
+    struct rpc_subscription *sub, rpc_object_t batch)
+{
+	rpc_object_t frame;
+	rpc_object_t args;
+	int ret = 0;
 
-	conn->rco_refcnt = 1;
-	conn->rco_arg = conn;
-	rpc_connection_set_default_fn_handlers(conn);
+	/*
+	 * Called with the connection retained and the subscription locked.
+	 * With @p batch, the unsubscription is added to it to be sent along
+	 * with others instead.
+	 */
 
-	if (active_connections == NULL) {
-		active_connections = g_hash_table_new(NULL, NULL);
-		g_rw_lock_init(&active_rwlock);
+	sub->rsu_refcount--;
+	if (sub->rsu_refcount > 0)
+		return (0);
+
+	args = rpc_object_pack("{s,s,s}",
+	    "path", sub->rsu_path,
+	    "interface", sub->rsu_interface,
+	    "name", sub->rsu_name);
+
+	if (batch != NULL)
+		rpc_array_append_stolen_value(batch, args);
+	else {
+		frame = rpc_pack_frame("events", "unsubscribe", NULL,
+		    rpc_array_create_ex(&args, 1, true));
+		ret = rpc_send_frame(conn, frame);
 	}
 
-	return(conn);
+	g_ptr_array_remove(conn->rco_subscriptions, sub);
+
+	return (ret);
+}
+
+int
+rpc_connection_retain_if_valid(rpc_connection_t conn, bool open)
+{
+
+	g_rw_lock_reader_lock(&active_rwlock);
+	if (!g_hash_table_contains(active_connections, conn)) {
+		g_rw_lock_reader_unlock(&active_rwlock);
+		return (-1);
+	}
+	rpc_connection_retain(conn);
+	g_rw_lock_reader_unlock(&active_rwlock);
+
+	/* Unless the conn mutex is held, state may change after this check */
+	if (open && g_atomic_int_get(&conn->rco_state) != CONNECTION_OPEN) {
+		rpc_connection_release(conn);
+		return (-1);
+	}
+
+	return (0);
+}
+
+void *
+rpc_connection_register_event_handler(rpc_connection_t conn, const char *path,
+    const char *interface, const char *name, rpc_handler_t handler)
+{
+
+	return (rpc_connection_add_event_handler(conn, path, interface, name,
+	    handler, NULL, NULL));
+}
+
+void *
+rpc_connection_register_event_handler_f(rpc_connection_t conn,
+    const char *path, const char *interface, const char *name,
+    rpc_handler_f fn, void *ctx)
+{
+
+	return (rpc_connection_add_event_handler(conn, path, interface, name,
+	    NULL, fn, ctx));
+}
+
+static void *
+rpc_connection_add_event_handler(rpc_connection_t conn, const char *path,
+    const char *interface, const char *name, rpc_handler_t handler,
+    rpc_handler_f fn, void *ctx)
+{
+	struct rpc_subscription *sub;
+	struct rpc_subscription_handler *rsh = NULL;
+
+	if (rpc_connection_retain_if_valid(conn, true) != 0) {
+		rpc_set_last_error(ECONNRESET, "Connection closed", NULL);
+		return (NULL);
+	}
+
+	g_rw_lock_writer_lock(&conn->rco_subscription_rwlock);
+
+	sub = rpc_connection_subscribe_event_locked(conn, path, interface,
+	    name, true);
+	if (sub == NULL) {
+		/* Couldn't inform server, error has been set */
+		goto done;
+	}
+	if (sub->rsu_busy) {
+		/* no state changes were made, tell caller to retry */
+		rpc_set_last_error(EBUSY, "Subscription locked, retry", NULL);
+		goto done;
+	}
+	rsh = g_malloc0(sizeof(*rsh));
+	rsh->rsh_parent = sub;
+	rsh->rsh_handler = handler != NULL ? Block_copy(handler) : NULL;
+	rsh->rsh_fn = fn;
+	rsh->rsh_ctx = ctx;
+	g_ptr_array_add(sub->rsu_handlers, rsh);
+done:
+	g_rw_lock_writer_unlock(&conn->rco_subscription_rwlock);
+	rpc_connection_release(conn);
+
+	return (rsh);
+}
+
+int
+rpc_connection_unregister_event_handler(rpc_connection_t conn, void *cookie)
+{
+	struct rpc_subscription_handler *rsh = cookie;
+	struct rpc_subscription *sub;
+	int ret = 0;
+
+	if (rpc_connection_retain_if_valid(conn, true) != 0) {
+		rpc_set_last_error(ECONNRESET, "Connection closed", NULL);
+		return (-1);
+	}
+
+	sub = rsh->rsh_parent;
+
+	g_rw_lock_writer_lock(&conn->rco_subscription_rwlock);
+	if (sub->rsu_busy) {
+		ret = -1;
+		rpc_set_last_error(EBUSY, "Subscription locked, retry", NULL);
+		goto done;
+	}
+	if (g_ptr_array_remove(sub->rsu_handlers, rsh))
+		rpc_connection_unsubscribe_event_locked(conn, sub, NULL);
+
+done:
+	g_rw_lock_writer_unlock(&conn->rco_subscription_rwlock);
+	rpc_connection_release(conn);
+	return ret;
+}
+
+rpc_object_t
+rpc_connection_call_syncv(rpc_connection_t conn, const char *path,
+    const char *interface, const char *method, va_list ap)
+{
+	rpc_call_t call;
+	rpc_object_t args;
+	rpc_object_t result;
+	rpc_object_t i;
+
+	args = rpc_array_create();
+
+	for (;;) {
+		i = va_arg(ap, rpc_object_t);
+		if (i == NULL)
+			break;
+
+		rpc_array_append_stolen_value(args, i);
+	}
+
+	if ((call = rpc_connection_call(conn, path, interface, method, args, NULL)) == NULL)
+		return (NULL);
+
+	rpc_call_wait(call);
+	result = rpc_call_result_save(call);
+	rpc_call_free(call);
+	return (result);
+}
+
+rpc_object_t
+rpc_connection_call_sync(rpc_connection_t conn, const char *path,
+    const char *interface, const char *method, ...)
+{
+	rpc_object_t result;
+	va_list ap;
+
+	va_start(ap, method);
+	result = rpc_connection_call_syncv(conn, path, interface, method, ap);
+	va_end(ap);
+
+	return (result);
+}
+
+rpc_object_t
+rpc_connection_call_syncp(rpc_connection_t conn, const char *path,
+    const char *interface, const char *method, const char *fmt, ...)
+{
+	rpc_object_t result;
+	va_list ap;
+
+	va_start(ap, fmt);
+	result = rpc_connection_call_syncpv(conn, path, interface, method, fmt, ap);
+	va_end(ap);
+
+	return (result);
+}
+
+rpc_object_t rpc_connection_call_syncpv(rpc_connection_t conn,
+    const char *path, const char *interface, const char *method,
+    const char *fmt, va_list ap)
+{
+	rpc_call_t call;
+	rpc_auto_object_t args = NULL;
+	rpc_object_t result;
+
+	args = rpc_object_vpack(fmt, ap);
+	call = rpc_connection_call(conn, path, interface, method, args, NULL);
+
+	if (call == NULL)
+		return (NULL);
+
+	rpc_call_wait(call);
+	result = rpc_call_result_save(call);
+	rpc_call_free(call);
+	return (result);
+}
+
+rpc_object_t
+rpc_connection_call_simple(rpc_connection_t conn, const char *name,
+    const char *fmt, ...)
+{
+	va_list ap;
+	rpc_object_t result;
+
+	va_start(ap, fmt);
+	result = rpc_connection_call_syncpv(conn, NULL, NULL, name, fmt, ap);
+	va_end(ap);
+
+	return (result);
+}
+
+rpc_call_t
+rpc_connection_call(rpc_connection_t conn, const char *path,
+    const char *interface, const char *name, rpc_object_t args,
+    rpc_callback_t callback)
+{
+
+	return (rpc_connection_call_impl(conn, path, interface, name, args,
+	    callback, NULL, NULL, false));
+}
+
+rpc_call_t
+rpc_connection_call_upload(rpc_connection_t conn, const char *path,
+    const char *interface, const char *name, rpc_object_t args,
+    rpc_callback_t callback)
+{
+
+	return (rpc_connection_call_impl(conn, path, interface, name, args,
+	    callback, NULL, NULL, true));
+}
+
+rpc_call_t
+rpc_connection_call_f(rpc_connection_t conn, const char *path,
+    const char *interface, const char *name, rpc_object_t args,
+    rpc_callback_f fn, void *ctx)
+{
+
+	return (rpc_connection_call_impl(conn, path, interface, name, args,
+	    NULL, fn, ctx, false));
 }
 
-rpc_connection_t
-rpc_connection_alloc(rpc_server_t server)
+static rpc_call_t
+rpc_connection_call_impl(rpc_connection_t conn, const char *path,
+    const char *interface, const char *name, rpc_object_t args,
+    rpc_callback_t callback, rpc_callback_f fn, void *ctx, bool input)
 {
-	struct rpc_connection *conn = NULL;
-	GError *err = NULL;
+	struct rpc_call *call;
+	rpc_object_t payload;
+	rpc_object_t frame;
 
-	conn = rpc_connection_init(server->rs_flags);
+	payload = rpc_dictionary_create();
 
-	conn->rco_uri = server->rs_uri;
-	conn->rco_server = server;
-	conn->rco_main_context = rpc_server_get_main_context(server);
+	if (path != NULL)
+		rpc_dictionary_set_string(payload, RPC_ATOM(PATH), path);
 
-	conn->rco_callback_pool = g_thread_pool_new(&rpc_abort_worker, conn,
-	    g_get_num_processors(), false, &err);
-	if (err != NULL) {
-		g_error_free(err);
-		rpc_connection_free_resources(conn);
-		return NULL;
+	if (interface != NULL)
+		rpc_dictionary_set_string(payload, RPC_ATOM(INTERFACE),
+		    interface);
+
+	if (name != NULL)
+		rpc_dictionary_set_string(payload, RPC_ATOM(METHOD), name);
+
+	/* The call borrows its names from the payload it is sent with */
+	call = rpc_call_alloc(conn, NULL, payload,
+	    rpc_dictionary_get_string(payload, RPC_ATOM(PATH)),
+	    rpc_dictionary_get_string(payload, RPC_ATOM(INTERFACE)),
+	    rpc_dictionary_get_string(payload, RPC_ATOM(METHOD)), args);
+	if (call == NULL) {
+		rpc_release(payload);
+		return (NULL);
 	}
 
-	g_rw_lock_writer_lock(&active_rwlock);
-	g_assert(!g_hash_table_contains(active_connections, conn));
-	if (!g_hash_table_insert(active_connections, conn, conn))
-		g_assert_not_reached();
-	g_rw_lock_writer_unlock(&active_rwlock);
+	call->rc_type = RPC_OUTBOUND_CALL;
+	call->rc_callback = callback != NULL ? Block_copy(callback) : NULL;
+	call->rc_callback_fn = fn;
+	call->rc_callback_ctx = ctx;
+	rpc_dictionary_set_value(payload, RPC_ATOM(ARGS), call->rc_args);
+
+	if (input) {
+		call->rc_input = true;
+		call->rc_input_credit = RPC_INPUT_WINDOW;
+		rpc_dictionary_set_bool(payload, "input", true);
+	}
 
-	return (conn);
+	if (conn->rco_call_priority != RPC_PRIORITY_DEFAULT)
+		rpc_dictionary_set_uint64(payload, RPC_ATOM(PRIORITY),
+		    (uint64_t)conn->rco_call_priority);
+
+	/* Tell the server how long we're going to wait */
+	if (conn->rco_rpc_timeout != 0)
+		rpc_dictionary_set_uint64(payload, RPC_ATOM(TIMEOUT),
+		    (uint64_t)conn->rco_rpc_timeout * 1000);
+
+	/* Nested calls join the trace of the call being served */
+	rpc_trace_ctx_propagate(payload);
+
+	frame = rpc_pack_frame("rpc", "call", call->rc_id, payload);
+	if (!input && g_atomic_int_get(&conn->rco_coalesce))
+		return (rpc_connection_start_flight(conn, call, frame));
+
+	return (rpc_connection_start_call(conn, call, frame));
 }
 
-rpc_connection_t
-rpc_connection_create(void *cookie, rpc_object_t params)
+rpc_call_t
+rpc_connection_call_batch(rpc_connection_t conn, rpc_object_t calls,
+    rpc_callback_t callback)
 {
-	GError *err = NULL;
-	const struct rpc_transport *transport;
-	struct rpc_connection *conn = NULL;
-	struct rpc_client *client = cookie;
-	char *scheme = NULL;
-
-	scheme = g_uri_parse_scheme(client->rci_uri);
-	transport = rpc_find_transport(scheme);
-	g_free(scheme);
+	struct rpc_call *call;
+	rpc_object_t frame;
 
-	if (transport == NULL) {
-		rpc_set_last_error(ENXIO, "Transport not found", NULL);
+	if (calls == NULL || rpc_get_type(calls) != RPC_TYPE_ARRAY) {
+		rpc_set_last_errorf(EINVAL, "Calls must be an array");
 		return (NULL);
 	}
 
-	conn = rpc_connection_init(transport->flags);
+	call = rpc_call_alloc(conn, NULL, calls, NULL, NULL, "call_batch",
+	    NULL);
+	if (call == NULL)
+		return (NULL);
 
-	conn->rco_client = client;
-	conn->rco_params = params;
-	conn->rco_uri = client->rci_uri;
-	conn->rco_main_context = rpc_client_get_main_context(client);
+	call->rc_type = RPC_OUTBOUND_CALL;
+	call->rc_callback = callback != NULL ? Block_copy(callback) : NULL;
+	frame = rpc_pack_frame("rpc", "call_batch", call->rc_id,
+	    rpc_retain(calls));
+	return (rpc_connection_start_call(conn, call, frame));
+}
 
-	conn->rco_callback_pool = g_thread_pool_new(&rpc_callback_worker, conn,
-	    g_get_num_processors(), false, &err);
-	rpc_connection_set_default_fn_handlers(conn);
+static rpc_call_t
+rpc_connection_start_call(rpc_connection_t conn, rpc_call_t call,
+    rpc_object_t frame)
+{
 
-	if (err != NULL) {
-		g_error_free(err);
-		goto fail;
-	}
-	if (transport->connect(conn, conn->rco_uri, params) != 0)
-		goto fail;
+	g_mutex_lock(&call->rc_mtx);
+	g_rw_lock_writer_lock(&conn->rco_call_rwlock);
+	g_hash_table_insert(rpc_call_table(&conn->rco_calls), call->rc_id,
+	    call);
+	g_rw_lock_writer_unlock(&conn->rco_call_rwlock);
 
-	if (conn->rco_flags & RPC_TRANSPORT_FD_PASSING)
-		conn->rco_supports_fd_passing = transport->is_fd_passing(conn);
+	arm_timeout_locked(call, (uint64_t)conn->rco_rpc_timeout * 1000);
+	g_mutex_unlock(&call->rc_mtx);
 
-	g_rw_lock_writer_lock(&active_rwlock);
-	g_assert(!g_hash_table_contains(active_connections, conn));
-	if (!g_hash_table_insert(active_connections, conn, conn))
-		g_assert_not_reached();
-	g_rw_lock_writer_unlock(&active_rwlock);
+	if (rpc_send_frame(conn, frame) != 0) {
+		rpc_call_free(call);
+		return (NULL);
+	}
 
-	return (conn);
-fail:
-	if (conn != NULL)
-		rpc_connection_free_resources(conn);
-	return (NULL);
+	return (call);
 }
 
-int
-rpc_connection_register_context(rpc_connection_t conn, rpc_context_t ctx)
+static guint
+rpc_flight_hash(gconstpointer key)
 {
+	const struct rpc_flight *flight = key;
 
-	if (rpc_connection_retain_if_valid(conn, true) == 0) {
-		g_mutex_lock(&conn->rco_mtx);
-		conn->rco_rpc_context = ctx;
-		g_mutex_unlock(&conn->rco_mtx);
-		rpc_connection_release(conn);
-		return (0);
-	}
-	return (-1);
+	return (flight->rf_hash);
 }
 
-int rpc_connection_get_subscription_count(rpc_connection_t conn)
+static gboolean
+rpc_flight_equal(gconstpointer a, gconstpointer b)
 {
-
-	return (
-	    rpc_connection_is_open(conn) ? conn->rco_subscriptions->len : -1);
+	const struct rpc_flight *fa = a;
+	const struct rpc_flight *fb = b;
+
+	return (fa->rf_hash == fb->rf_hash &&
+	    g_strcmp0(fa->rf_method, fb->rf_method) == 0 &&
+	    g_strcmp0(fa->rf_interface, fb->rf_interface) == 0 &&
+	    g_strcmp0(fa->rf_path, fb->rf_path) == 0 &&
+	    rpc_equal(fa->rf_args, fb->rf_args));
 }
 
 static void
-rpc_connection_free_resources(rpc_connection_t conn)
+rpc_flight_free(struct rpc_flight *flight)
 {
 
-	g_assert_cmpint(g_hash_table_size(conn->rco_calls), ==, 0);
-	g_assert_cmpint(g_hash_table_size(conn->rco_inbound_calls), ==, 0);
-	g_hash_table_destroy(conn->rco_calls);
-	g_hash_table_destroy(conn->rco_inbound_calls);
-
-	if (conn->rco_subscriptions != NULL)
-		g_ptr_array_free(conn->rco_subscriptions, true);
+	g_ptr_array_free(flight->rf_followers, true);
+	rpc_release(flight->rf_args);
+	g_free(flight->rf_path);
+	g_free(flight->rf_interface);
+	g_free(flight->rf_method);
+	g_free(flight);
+}
 
-	if (conn->rco_callback_pool != NULL) {
-		g_thread_pool_free(conn->rco_callback_pool, true, false);
-		conn->rco_callback_pool = NULL;
+static rpc_call_t
+rpc_connection_start_flight(rpc_connection_t conn, rpc_call_t call,
+    rpc_object_t frame)
+{
+	struct rpc_flight key;
+	struct rpc_flight *flight;
+	bool settled;
+
+	key.rf_path = (char *)call->rc_path;
+	key.rf_interface = (char *)call->rc_interface;
+	key.rf_method = (char *)call->rc_method_name;
+	key.rf_args = call->rc_args;
+	key.rf_hash = g_str_hash(call->rc_method_name != NULL ?
+	    call->rc_method_name : "");
+	if (call->rc_args != NULL)
+		key.rf_hash ^= (guint)rpc_hash(call->rc_args);
+
+	g_mutex_lock(&conn->rco_flight_mtx);
+	flight = g_hash_table_lookup(conn->rco_flights, &key);
+
+	/* Settled without a result to share, e.g. the connection closed */
+	if (flight != NULL) {
+		g_mutex_lock(&flight->rf_leader->rc_mtx);
+		settled = flight->rf_leader->rc_settled;
+		g_mutex_unlock(&flight->rf_leader->rc_mtx);
+		if (settled) {
+			g_mutex_unlock(&conn->rco_flight_mtx);
+			return (rpc_connection_start_call(conn, call, frame));
+		}
 	}
 
-	rpc_release(conn->rco_error);
-	g_free(conn->rco_endpoint_address);
-	g_rw_lock_clear(&conn->rco_call_rwlock);
-	g_rw_lock_clear(&conn->rco_icall_rwlock);
-	g_rw_lock_clear(&conn->rco_subscription_rwlock);
-}
+	if (flight == NULL) {
+		flight = g_malloc0(sizeof(*flight));
+		flight->rf_path = g_strdup(key.rf_path);
+		flight->rf_interface = g_strdup(key.rf_interface);
+		flight->rf_method = g_strdup(key.rf_method);
+		flight->rf_args = call->rc_args != NULL ?
+		    rpc_retain(call->rc_args) : NULL;
+		flight->rf_hash = key.rf_hash;
+		flight->rf_leader = call;
+		flight->rf_followers = g_ptr_array_new();
+		call->rc_flight = flight;
+		g_hash_table_add(conn->rco_flights, flight);
+		g_mutex_unlock(&conn->rco_flight_mtx);
+		return (rpc_connection_start_call(conn, call, frame));
+	}
 
-int
-rpc_connection_close(rpc_connection_t conn)
-{
+	/*
+	 * Registered and timed like a call of its own, so waiting on it,
+	 * aborting it or timing out works the same; only the frame is
+	 * held back until it turns out the leader's result can't be used.
+	 */
+	g_mutex_lock(&call->rc_mtx);
+	call->rc_flight = flight;
+	call->rc_flight_frame = frame;
+	g_ptr_array_add(flight->rf_followers, call);
+	g_rw_lock_writer_lock(&conn->rco_call_rwlock);
+	g_hash_table_insert(rpc_call_table(&conn->rco_calls), call->rc_id,
+	    call);
+	g_rw_lock_writer_unlock(&conn->rco_call_rwlock);
 
-	return (rpc_connection_do_close(conn, RPC_CLOSE_CALLED));
+	arm_timeout_locked(call, (uint64_t)conn->rco_rpc_timeout * 1000);
+	g_mutex_unlock(&call->rc_mtx);
+	g_mutex_unlock(&conn->rco_flight_mtx);
+	return (call);
 }
 
-int
-rpc_connection_do_close(rpc_connection_t conn, rpc_close_source_t source)
+static void
+rpc_flight_end(rpc_call_t call, rpc_call_status_t status, rpc_object_t result)
 {
-	rpc_abort_fn_t abort_func;
-	uint state;
+	rpc_connection_t conn = call->rc_conn;
+	struct rpc_flight *flight;
+	GPtrArray *followers = NULL;
+	rpc_call_t follower;
+	guint i;
 
-	debugf("%s state: %d conn: %p refcnt: %d  arg: %p, source: %d",
-	    conn->rco_server ? "Server" : "Client",
-	    conn->rco_state, conn, conn->rco_refcnt,
-	    conn->rco_arg, source);
+	g_mutex_lock(&conn->rco_flight_mtx);
+	flight = call->rc_flight;
+	if (flight == NULL || flight->rf_leader != call) {
+		g_mutex_unlock(&conn->rco_flight_mtx);
+		return;
+	}
 
-	g_mutex_lock(&conn->rco_mtx);
-	if (source == RPC_CLOSE_CALLED)
-		g_atomic_int_or(&conn->rco_state, CONNECTION_CLOSED);
+	g_hash_table_remove(conn->rco_flights, flight);
+	followers = flight->rf_followers;
+	flight->rf_followers = g_ptr_array_new();
+	for (i = 0; i < followers->len; i++) {
+		follower = g_ptr_array_index(followers, i);
+		follower->rc_flight = NULL;
+		rpc_connection_call_retain(follower);
+	}
 
-	/* rco_state will only be modified under rco_mtx */
-	state = g_atomic_int_get(&conn->rco_state);
+	call->rc_flight = NULL;
+	rpc_flight_free(flight);
+	g_mutex_unlock(&conn->rco_flight_mtx);
 
-	if ((conn->rco_abort != NULL) &&
-	    (state & CONNECTION_ABORTED) == 0) {
-		abort_func = conn->rco_abort;
-		conn->rco_abort = NULL;
-		g_mutex_unlock(&conn->rco_mtx);
+	for (i = 0; i < followers->len; i++) {
+		follower = g_ptr_array_index(followers, i);
+		if (result != NULL)
+			rpc_flight_deliver(follower, status, result);
+		else
+			rpc_flight_send(follower);
 
-		rpc_connection_retain(conn);
-		abort_func(conn->rco_arg);
-		rpc_connection_release(conn);
-		return (0);
+		rpc_connection_call_release(follower);
 	}
-	if ((state & CONNECTION_RELEASED) != 0)
-		goto done;
 
-	if (conn->rco_client != NULL) {
-		if ((state & CONNECTION_CLOSED) == 0)
-			goto done;
+	g_ptr_array_free(followers, true);
+}
 
-		g_atomic_int_or(&conn->rco_state, CONNECTION_RELEASED);
-		g_mutex_unlock(&conn->rco_mtx);
+static void
+rpc_flight_leave(rpc_call_t call)
+{
+	rpc_connection_t conn = call->rc_conn;
+	struct rpc_flight *flight;
 
-	} else if (conn->rco_server != NULL) {
-		g_atomic_int_inc(&conn->rco_server->rs_conn_closed);
-		g_atomic_int_or(&conn->rco_state, CONNECTION_RELEASED);
-		g_mutex_unlock(&conn->rco_mtx);
+	g_mutex_lock(&conn->rco_flight_mtx);
+	flight = call->rc_flight;
+	if (flight == NULL) {
+		g_mutex_unlock(&conn->rco_flight_mtx);
+		return;
+	}
 
-		/* if server isn't closed this will undo server's ref */
-		rpc_server_disconnect(conn->rco_server, conn);
+	if (flight->rf_leader == call) {
+		g_mutex_unlock(&conn->rco_flight_mtx);
+		rpc_flight_end(call, RPC_CALL_ABORTED, NULL);
+		return;
 	}
-	/* undo connection's initial reference */
-	rpc_connection_release(conn);
-	return (0);
-done:
-	g_mutex_unlock(&conn->rco_mtx);
-	return (0);
+
+	g_ptr_array_remove(flight->rf_followers, call);
+	call->rc_flight = NULL;
+	g_mutex_unlock(&conn->rco_flight_mtx);
 }
 
-bool
-rpc_connection_is_valid(rpc_connection_t conn)
+static void
+rpc_flight_deliver(rpc_call_t call, rpc_call_status_t status,
+    rpc_object_t result)
 {
-	bool ret;
+	struct queue_item *q_item;
+	struct work_item *item;
+	GSList *thens;
 
-	/* Use this when waiting for a conn to become invalid */
-	if (conn == NULL)
-		return (false);
-	g_rw_lock_reader_lock(&active_rwlock);
-	ret =  g_hash_table_contains(active_connections, conn);
-	g_rw_lock_reader_unlock(&active_rwlock);
+	g_mutex_lock(&call->rc_mtx);
+	if (call->rc_settled || cancel_timeout_locked(call) != 0) {
+		g_mutex_unlock(&call->rc_mtx);
+		return;
+	}
 
-	return (ret);
+	if (status == RPC_CALL_DONE && rpc_call_has_callback(call)) {
+		item = g_malloc0(sizeof(*item));
+		item->call = call;
+		if (!rpc_run_callback(call->rc_conn, item))
+			g_free(item);
+	}
+
+	/* Never sent, so nothing on the wire refers to it anymore */
+	rpc_release(call->rc_flight_frame);
+	call->rc_flight_frame = NULL;
+
+	q_item = g_malloc0(sizeof(*q_item));
+	q_item->status = status;
+	q_item->item = rpc_retain(result);
+
+	g_queue_push_tail(&call->rc_queue, q_item);
+	notify_signal(&call->rc_notify);
+	thens = rpc_call_settle_locked(call);
+	g_mutex_unlock(&call->rc_mtx);
+	rpc_call_run_thens(thens);
 }
 
-bool
-rpc_connection_is_open(rpc_connection_t conn)
+static void
+rpc_flight_send(rpc_call_t call)
 {
+	rpc_object_t frame;
+	rpc_object_t error;
 
-	/* conn if non-null must be valid */
-	return (conn != NULL &&
-	    (g_atomic_int_get(&conn->rco_state) == CONNECTION_OPEN));
+	g_mutex_lock(&call->rc_mtx);
+	frame = call->rc_flight_frame;
+	call->rc_flight_frame = NULL;
+	if (call->rc_settled) {
+		g_mutex_unlock(&call->rc_mtx);
+		rpc_release(frame);
+		return;
+	}
+
+	g_mutex_unlock(&call->rc_mtx);
+	if (frame == NULL || rpc_send_frame(call->rc_conn, frame) == 0)
+		return;
+
+	error = rpc_error_create(ECONNRESET, "Cannot send call", NULL);
+	rpc_flight_deliver(call, RPC_CALL_ERROR, error);
+	rpc_release(error);
 }
 
-int
-rpc_connection_retain(rpc_connection_t conn)
+rpc_object_t
+rpc_connection_get_property(rpc_connection_t conn, const char *path,
+    const char *interface, const char *name)
 {
+	struct rpc_property_cache *cache;
+	rpc_object_t result = NULL;
+	char *key;
 
-	/* conn if non-null is expected to be valid */
-	if (conn == NULL)
-		return (-1);
+	key = rpc_property_cache_key(path, interface);
+	g_mutex_lock(&conn->rco_prop_cache_mtx);
+	cache = g_hash_table_lookup(conn->rco_prop_cache, key);
+	if (cache != NULL && rpc_connection_is_open(conn)) {
+		result = g_hash_table_lookup(cache->rpr_values, name);
+		if (result != NULL)
+			rpc_retain(result);
+	}
+	g_mutex_unlock(&conn->rco_prop_cache_mtx);
 
-	g_atomic_int_inc(&conn->rco_refcnt);
-	g_assert(conn->rco_refcnt > 1);
+	if (result != NULL) {
+		g_free(key);
+		return (result);
+	}
 
-	return (0);
+	result = rpc_connection_call_syncp(conn, path, RPC_OBSERVABLE_INTERFACE,
+	    "get", "[s,s]", interface, name);
+
+	/* Whatever a changed event brought in meanwhile is newer */
+	if (cache != NULL)
+		rpc_property_cache_put(conn, path, interface, name, result,
+		    false);
+
+	g_free(key);
+	return (result);
 }
 
 int
-rpc_connection_release(rpc_connection_t conn)
+rpc_connection_cache_properties(rpc_connection_t conn, const char *path,
+    const char *interface)
 {
+	struct rpc_property_cache *cache;
+	rpc_object_t values;
+	char *key;
+	void *cookie;
+
+	key = rpc_property_cache_key(path, interface);
+	g_mutex_lock(&conn->rco_prop_cache_mtx);
+	if (g_hash_table_contains(conn->rco_prop_cache, key)) {
+		g_mutex_unlock(&conn->rco_prop_cache_mtx);
+		g_free(key);
+		return (0);
+	}
+
+	/* In place before subscribing, so no event gets lost */
+	cache = g_malloc0(sizeof(*cache));
+	cache->rpr_values = g_hash_table_new_full(g_str_hash, g_str_equal,
+	    g_free, (GDestroyNotify)rpc_release_impl);
+	g_hash_table_insert(rpc_connection_prop_cache(conn), key, cache);
+	g_mutex_unlock(&conn->rco_prop_cache_mtx);
+
+	cookie = rpc_connection_register_event_handler(conn, path,
+	    RPC_OBSERVABLE_INTERFACE, "changed", ^(const char *ev_path,
+	    const char *ev_iface __unused, const char *ev_name __unused,
+	    rpc_object_t args) {
+		rpc_property_cache_update(conn, ev_path, args);
+	});
 
-	/* conn if non-null is expected to be valid */
-	if (conn == NULL)
+	if (cookie == NULL) {
+		g_mutex_lock(&conn->rco_prop_cache_mtx);
+		g_hash_table_remove(conn->rco_prop_cache, key);
+		g_mutex_unlock(&conn->rco_prop_cache_mtx);
 		return (-1);
+	}
 
-	g_assert(conn->rco_refcnt > 0);
-	if (g_atomic_int_dec_and_test(&conn->rco_refcnt)) {
+	g_mutex_lock(&conn->rco_prop_cache_mtx);
+	cache->rpr_cookie = cookie;
+	g_mutex_unlock(&conn->rco_prop_cache_mtx);
 
-		g_assert((g_atomic_int_get(&conn->rco_state) &
-		    CONNECTION_CLOSED) != 0);
+	values = rpc_connection_call_syncp(conn, path, RPC_OBSERVABLE_INTERFACE,
+	    "get_all", "[s]", interface);
 
-		g_rw_lock_writer_lock(&active_rwlock);
-		if (!g_hash_table_contains(active_connections, conn)) {
-			/* someone might have retained and released and done
-			 * cleanup while we waited for the lock. just exit.
-			 */
-			g_assert_not_reached(); /* current code won't permit */
-			g_rw_lock_writer_unlock(&active_rwlock);
-			return (0);
-		}
-		if (g_atomic_int_get(&conn->rco_refcnt) > 0) {
-			/* someone retained; just exit for now */
-			g_assert_not_reached(); /* current code won't permit */
-			g_rw_lock_writer_unlock(&active_rwlock);
-			return (0);
-		}
+	if (values == NULL || rpc_get_type(values) != RPC_TYPE_ARRAY) {
+		if (values != NULL && rpc_get_type(values) == RPC_TYPE_ERROR)
+			rpc_set_last_rpc_error(values);
 
-		/* ok, we have the lock, the conn is valid and unretained */
-		if (!g_hash_table_remove(active_connections, conn))
-			g_assert_not_reached();
-		g_rw_lock_writer_unlock(&active_rwlock);
+		if (values != NULL)
+			rpc_release(values);
 
-		if (conn->rco_release && conn->rco_arg) {
-			conn->rco_release(conn->rco_arg);
-			conn->rco_arg = NULL;
-		}
-		rpc_connection_free_resources(conn);
+		rpc_connection_uncache_properties(conn, path, interface);
+		return (-1);
+	}
 
-		debugf("%s in thread %p freed %p",
-		    conn->rco_server ? "Server" : "Client",
-		    g_thread_self(), conn);
+	rpc_array_apply(values, ^(size_t idx __unused, rpc_object_t item) {
+		rpc_property_cache_put(conn, path, interface,
+		    rpc_dictionary_get_string(item, "name"),
+		    rpc_dictionary_get_value(item, "value"), false);
+		return ((bool)true);
+	});
 
-		conn->rco_refcnt = -1;
+	rpc_release(values);
+	return (0);
+}
 
-		if (conn->rco_server != NULL) {
-			/* undo connection's ref on server */
-			rpc_server_release(conn->rco_server);
-		}
-		g_free(conn);
+int
+rpc_connection_uncache_properties(rpc_connection_t conn, const char *path,
+    const char *interface)
+{
+	struct rpc_property_cache *cache = NULL;
+	char *key;
+	char *orig_key;
+
+	key = rpc_property_cache_key(path, interface);
+	g_mutex_lock(&conn->rco_prop_cache_mtx);
+	if (!g_hash_table_lookup_extended(conn->rco_prop_cache, key,
+	    (gpointer *)&orig_key, (gpointer *)&cache)) {
+		g_mutex_unlock(&conn->rco_prop_cache_mtx);
+		g_free(key);
+		rpc_set_last_error(ENOENT, "Properties not cached", NULL);
+		return (-1);
 	}
 
+	g_hash_table_steal(conn->rco_prop_cache, key);
+	g_mutex_unlock(&conn->rco_prop_cache_mtx);
+
+	if (cache->rpr_cookie != NULL)
+		rpc_connection_unregister_event_handler(conn,
+		    cache->rpr_cookie);
+
+	rpc_property_cache_free(cache);
+	g_free(orig_key);
+	g_free(key);
 	return (0);
 }
 
-int
-rpc_connection_get_fd(rpc_connection_t conn)
+static char *
+rpc_property_cache_key(const char *path, const char *interface)
 {
 
-	return (conn->rco_get_fd(conn->rco_arg));
+	return (g_strdup_printf("%s\n%s", path != NULL ? path : "/",
+	    interface));
 }
 
-void
-rpc_connection_free(rpc_connection_t conn)
+static void
+rpc_property_cache_free(struct rpc_property_cache *cache)
 {
 
-
+	g_hash_table_destroy(cache->rpr_values);
+	g_free(cache);
 }
 
-#ifdef ENABLE_LIBDISPATCH
-int
-rpc_connection_set_dispatch_queue(rpc_connection_t conn, dispatch_queue_t queue)
+static void
+rpc_property_cache_put(rpc_connection_t conn, const char *path,
+    const char *interface, const char *name, rpc_object_t value,
+    bool replace)
 {
-	GError *err = NULL;
+	struct rpc_property_cache *cache;
+	char *key;
 
-	if (conn->rco_callback_pool == NULL)
-		return (-1);
+	if (name == NULL || value == NULL)
+		return;
 
-	g_thread_pool_set_max_threads(conn->rco_callback_pool, 0, &err);
-	conn->rco_dispatch_queue = queue;
-	return (0);
+	key = rpc_property_cache_key(path, interface);
+	g_mutex_lock(&conn->rco_prop_cache_mtx);
+	cache = g_hash_table_lookup(conn->rco_prop_cache, key);
+	if (cache == NULL)
+		goto done;
+
+	/* Errors are never served from the cache */
+	if (rpc_get_type(value) == RPC_TYPE_ERROR) {
+		g_hash_table_remove(cache->rpr_values, name);
+		goto done;
+	}
+
+	if (replace || !g_hash_table_contains(cache->rpr_values, name)) {
+		g_hash_table_insert(cache->rpr_values, g_strdup(name),
+		    rpc_retain(value));
+	}
+done:
+	g_mutex_unlock(&conn->rco_prop_cache_mtx);
+	g_free(key);
 }
-#endif
 
-void
-rpc_connection_dispatch(rpc_connection_t conn, rpc_object_t frame)
+static void
+rpc_property_cache_update(rpc_connection_t conn, const char *path,
+    rpc_object_t args)
 {
-	rpc_object_t id;
-	rpc_object_t args;
-	const struct message_handler *h;
-	const char *namespace;
+	const char *interface;
 	const char *name;
+	rpc_object_t value;
+	rpc_object_t patch;
 
-	/* Must be called with the connection retained */
-	id = rpc_dictionary_get_value(frame, "id");
-	namespace = rpc_dictionary_get_string(frame, "namespace");
-	name = rpc_dictionary_get_string(frame, "name");
+	if (rpc_object_unpack(args, "{s,s,v}",
+	    "interface", &interface,
+	    "name", &name,
+	    "value", &value) == 3) {
+		rpc_property_cache_put(conn, path, interface, name, value,
+		    true);
+		return;
+	}
 
-	if (id == NULL || namespace == NULL || name == NULL) {
-		rpc_connection_send_err(conn, id, EINVAL, "Malformed request");
+	if (rpc_object_unpack(args, "{s,s,v}",
+	    "interface", &interface,
+	    "name", &name,
+	    "patch", &patch) == 3)
+		rpc_property_cache_patch(conn, path, interface, name, patch);
+}
+
+/*
+ * Applies a patch sent for a delta property (see
+ * rpc_instance_set_property_delta()) to a copy of the cached value,
+ * which readers may still hold. Without a dictionary to apply it to,
+ * the value is dropped and fetched again on the next read.
+ */
+static void
+rpc_property_cache_patch(rpc_connection_t conn, const char *path,
+    const char *interface, const char *name, rpc_object_t patch)
+{
+	struct rpc_property_cache *cache;
+	rpc_object_t value;
+	char *key;
+
+	if (rpc_get_type(patch) != RPC_TYPE_ARRAY)
 		return;
+
+	key = rpc_property_cache_key(path, interface);
+	g_mutex_lock(&conn->rco_prop_cache_mtx);
+	cache = g_hash_table_lookup(conn->rco_prop_cache, key);
+	if (cache == NULL)
+		goto done;
+
+	value = g_hash_table_lookup(cache->rpr_values, name);
+	if (value == NULL || rpc_get_type(value) != RPC_TYPE_DICTIONARY) {
+		g_hash_table_remove(cache->rpr_values, name);
+		goto done;
 	}
 
-	debugf("inbound call: namespace=%s, name=%s, id=%s", namespace, name,
-	    rpc_string_get_string_ptr(id));
+	value = rpc_copy(value);
+	rpc_array_apply(patch, ^(size_t idx __unused, rpc_object_t item) {
+		const char *ppath;
+		rpc_object_t pvalue;
 
-#ifdef RPC_TRACE
-	rpc_trace("RECV", conn->rco_uri, frame);
-#endif
+		ppath = rpc_dictionary_get_string(item, "path");
+		if (ppath == NULL)
+			return ((bool)true);
 
-	for (h = &handlers[0]; h->namespace != NULL; h++) {
-		if (g_strcmp0(namespace, h->namespace))
-			continue;
+		pvalue = rpc_dictionary_get_value(item, "value");
+		if (pvalue != NULL)
+			rpc_query_set(value, ppath, pvalue, false);
+		else
+			rpc_query_delete(value, ppath);
 
-		if (g_strcmp0(name, h->name))
-			continue;
+		return ((bool)true);
+	});
 
-		args = rpc_dictionary_get_value(frame, "args");
-		h->handler(conn, args, id);
-		rpc_release(frame);
-		return;
+	g_hash_table_insert(cache->rpr_values, g_strdup(name), value);
+done:
+	g_mutex_unlock(&conn->rco_prop_cache_mtx);
+	g_free(key);
+}
+
+rpc_object_t
+rpc_connection_get_properties(rpc_connection_t conn,
+    const char *const *paths, size_t npaths, const char *interface,
+    const char *name)
+{
+	rpc_auto_object_t calls = NULL;
+	rpc_object_t result;
+	rpc_call_t call;
+	size_t i;
+
+	calls = rpc_array_create();
+	for (i = 0; i < npaths; i++) {
+		rpc_array_append_stolen_value(calls, rpc_object_pack(
+		    "{s,s,s,v}",
+		    "path", paths[i],
+		    "interface", RPC_OBSERVABLE_INTERFACE,
+		    "method", "get",
+		    "args", rpc_object_pack("[s,s]", interface, name)));
 	}
 
-	rpc_connection_send_err(conn, id, ENXIO, "No request handler found");
-	rpc_release(frame);
+	call = rpc_connection_call_batch(conn, calls, NULL);
+	if (call == NULL)
+		return (NULL);
+
+	rpc_call_wait(call);
+	result = rpc_call_result_save(call);
+	rpc_call_free(call);
+	return (result);
 }
 
-static struct rpc_subscription *
-rpc_connection_subscribe_event_locked(rpc_connection_t conn, const char *path,
-    const char *interface, const char *name, bool check_busy)
+
+rpc_object_t
+rpc_connection_set_property(rpc_connection_t conn, const char *path,
+    const char *interface, const char *name, rpc_object_t value)
 {
-	struct rpc_subscription *sub;
-	rpc_object_t frame;
-	rpc_object_t args;
+	struct rpc_property_cache *cache;
+	rpc_object_t result;
+	char *key;
 
-	sub = rpc_connection_find_subscription(conn, path, interface, name);
-	if (sub == NULL) {
-		sub = g_malloc0(sizeof(*sub));
-		sub->rsu_path = g_strdup(path);
-		sub->rsu_interface = g_strdup(interface);
-		sub->rsu_name = g_strdup(name);
-		sub->rsu_handlers = g_ptr_array_new_with_free_func((GDestroyNotify)rpc_rsh_release);
-		args = rpc_object_pack("[{s,s,s}]",
-		    "path", path,
-		    "interface", interface,
-		    "name", name);
+	result = rpc_connection_call_syncp(conn, path, RPC_OBSERVABLE_INTERFACE,
+	    "set", "[s,s,v]", interface, name, value);
 
-		frame = rpc_pack_frame("events", "subscribe", NULL, args);
+	/* The next read goes to the server, not to a copy older than it */
+	key = rpc_property_cache_key(path, interface);
+	g_mutex_lock(&conn->rco_prop_cache_mtx);
+	cache = g_hash_table_lookup(conn->rco_prop_cache, key);
+	if (cache != NULL)
+		g_hash_table_remove(cache->rpr_values, name);
+	g_mutex_unlock(&conn->rco_prop_cache_mtx);
 
-		if (rpc_send_frame(conn, frame) != 0) {
-			rpc_subscription_release(sub);
-			return (NULL);
-		}
-		sub->rsu_refcount = 1;
-		g_ptr_array_add(conn->rco_subscriptions, sub);
-	} else {
-		if (!check_busy || !sub->rsu_busy)
-			sub->rsu_refcount++;
-	}
-	return (sub);
+	g_free(key);
+	return (result);
 }
 
-int
-rpc_connection_subscribe_event(rpc_connection_t conn, const char *path,
-    const char *interface, const char *name)
+
+rpc_object_t
+rpc_connection_set_propertyp(rpc_connection_t conn, const char *path,
+    const char *interface, const char *name, const char *fmt, ...)
 {
-	struct rpc_subscription *sub;
+	rpc_object_t value;
+	va_list ap;
 
-	if (rpc_connection_retain_if_valid(conn, true) != 0) {
-		rpc_set_last_error(ECONNRESET, "Connection closed", NULL);
-		return (-1);
-	}
+	va_start(ap, fmt);
+	value = rpc_object_vpack(fmt, ap);
+	va_end(ap);
 
-	g_rw_lock_writer_lock(&conn->rco_subscription_rwlock);
-	sub = rpc_connection_subscribe_event_locked(conn, path, interface,
-	    name, false);
-	g_rw_lock_writer_unlock(&conn->rco_subscription_rwlock);
+	return (rpc_connection_set_property(conn, path, interface, name, value));
+}
 
-	if (sub == NULL)
-		rpc_set_last_error(EFAULT, "Unknown error", NULL);
 
-	rpc_connection_release(conn);
-	return (sub == NULL) ? -1 : 0;
+rpc_object_t
+rpc_connection_set_propertypv(rpc_connection_t conn, const char *path,
+    const char *interface, const char *name, const char *fmt, va_list ap)
+{
+	rpc_object_t value;
+
+	value = rpc_object_vpack(fmt, ap);
+	return (rpc_connection_set_property(conn, path, interface, name, value));
+}
+
+void *
+rpc_connection_watch_property(rpc_connection_t conn, const char *path,
+    const char *interface, const char *property,
+    rpc_property_handler_t handler)
+{
+	/* add some memory leaks to we can remove them later */
+	path = g_strdup(path);
+	interface = g_strdup(interface);
+	property = g_strdup(property);
+
+	rpc_handler_t block = ^(const char *_p __unused, const char *_i __unused,
+	    const char *_n __unused, rpc_object_t args) {
+		const char *ev_iface;
+		const char *ev_name;
+		rpc_object_t ev_value;
+
+		if (rpc_object_unpack(args, "{s,s,v}",
+		    "interface", &ev_iface,
+		    "name", &ev_name,
+		    "value", &ev_value) < 3)
+			return;
+
+		if (g_strcmp0(interface, ev_iface) != 0)
+			return;
+
+		if (g_strcmp0(property, ev_name) != 0)
+			return;
+
+		handler(ev_value);
+	};
+
+	return (rpc_connection_register_event_handler(conn, path,
+	    RPC_OBSERVABLE_INTERFACE, "changed", block));
 }
 
 int
-rpc_connection_unsubscribe_event(rpc_connection_t conn, const char *path,
-    const char *interface, const char *name)
+rpc_connection_send_event(rpc_connection_t conn, const char *path,
+    const char *interface, const char *name, rpc_object_t args)
 {
+	rpc_object_t frame;
+	rpc_object_t event;
 	struct rpc_subscription *sub;
 	int ret = 0;
 
-	if (rpc_connection_retain_if_valid(conn, true) != 0) {
-		rpc_set_last_error(ECONNRESET, "Connection closed", NULL);
+	if (rpc_connection_retain_if_valid(conn, true) != 0)
 		return (-1);
-	}
 
-	g_rw_lock_writer_lock(&conn->rco_subscription_rwlock);
-	sub = rpc_connection_find_subscription(conn, path, interface, name);
-	if (sub == NULL) {
-		g_rw_lock_writer_unlock(&conn->rco_subscription_rwlock);
-		rpc_set_last_error(ENOENT, "Subscription not found", NULL);
-		rpc_connection_release(conn);
-		return (-1);
-	}
-	ret = rpc_connection_unsubscribe_event_locked(conn, sub);
-	g_rw_lock_writer_unlock(&conn->rco_subscription_rwlock);
+	/* Any listeners? */
+	g_rw_lock_reader_lock(&conn->rco_subscription_rwlock);
+	if (rpc_connection_get_subscription_count(conn) < 1)
+		goto done;
+
+	sub = rpc_connection_match_subscription(conn, path, interface, name);
+	if (sub == NULL)
+		goto done;
+
+	event = rpc_object_pack("{s,s,s,v}",
+	    "path", path,
+	    "interface", interface,
+	    "name", name,
+	    "args", rpc_retain(args));
+
+	frame = rpc_pack_frame("events", "event", NULL, event);
+	ret = rpc_send_frame(conn, frame);
+
+done:
+	g_rw_lock_reader_unlock(&conn->rco_subscription_rwlock);
 	rpc_connection_release(conn);
 	return (ret);
 }
 
-static int
-rpc_connection_unsubscribe_event_locked(rpc_connection_t conn,
-    struct rpc_subscription *sub)
+int
+rpc_connection_send_event_burst(rpc_connection_t conn, rpc_object_t events)
 {
+	__block rpc_object_t burst;
 	rpc_object_t frame;
-	rpc_object_t args;
 	int ret = 0;
 
-	/* Called with the connection retained and the subscription locked  */
-
-	sub->rsu_refcount--;
-	if (sub->rsu_refcount > 0)
-		return (0);
+	if (rpc_connection_retain_if_valid(conn, true) != 0)
+		return (-1);
 
-	args = rpc_object_pack("[{s,s,s}]",
-	    "path", sub->rsu_path,
-	    "interface", sub->rsu_interface,
-	    "name", sub->rsu_name);
+	g_rw_lock_reader_lock(&conn->rco_subscription_rwlock);
+	if (rpc_connection_get_subscription_count(conn) < 1)
+		goto done;
 
-	frame = rpc_pack_frame("events", "unsubscribe", NULL, args);
-	ret = rpc_send_frame(conn, frame);
+	burst = rpc_array_create();
+	rpc_array_apply(events, ^(size_t idx __unused, rpc_object_t value) {
+		if (rpc_connection_match_subscription(conn,
+		    rpc_dictionary_get_string(value, RPC_ATOM(PATH)),
+		    rpc_dictionary_get_string(value, RPC_ATOM(INTERFACE)),
+		    rpc_dictionary_get_string(value, RPC_ATOM(NAME))) != NULL)
+			rpc_array_append_value(burst, value);
 
-	g_ptr_array_remove(conn->rco_subscriptions, sub);
+		return ((bool)true);
+	});
 
-	return (ret);
-}
+	switch (rpc_array_get_count(burst)) {
+	case 0:
+		rpc_release(burst);
+		goto done;
 
-int
-rpc_connection_retain_if_valid(rpc_connection_t conn, bool open)
-{
+	case 1:
+		frame = rpc_pack_frame("events", "event", NULL,
+		    rpc_retain(rpc_array_get_value(burst, 0)));
+		rpc_release(burst);
+		break;
 
-	g_rw_lock_reader_lock(&active_rwlock);
-	if (!g_hash_table_contains(active_connections, conn)) {
-		g_rw_lock_reader_unlock(&active_rwlock);
-		return (-1);
+	default:
+		frame = rpc_pack_frame("events", "event_burst", NULL, burst);
+		break;
 	}
-	rpc_connection_retain(conn);
-	g_rw_lock_reader_unlock(&active_rwlock);
 
-	/* Unless the conn mutex is held, state may change after this check */
-	if (open && g_atomic_int_get(&conn->rco_state) != CONNECTION_OPEN) {
-		rpc_connection_release(conn);
-		return (-1);
-	}
+	ret = rpc_send_frame(conn, frame);
 
-	return (0);
+done:
+	g_rw_lock_reader_unlock(&conn->rco_subscription_rwlock);
+	rpc_connection_release(conn);
+	return (ret);
 }
 
-void *
-rpc_connection_register_event_handler(rpc_connection_t conn, const char *path,
-    const char *interface, const char *name, rpc_handler_t handler)
+GBytes *
+rpc_connection_pack_event(rpc_object_t event)
 {
-	struct rpc_subscription *sub;
-	struct rpc_subscription_handler *rsh = NULL;
+	rpc_object_t frame;
+	rpc_object_t tmp;
+	void *buf;
+	size_t len;
 
-	if (rpc_connection_retain_if_valid(conn, true) != 0) {
-		rpc_set_last_error(ECONNRESET, "Connection closed", NULL);
+	/* Descriptors are per-connection, so such events can't be shared */
+	if (rpc_object_has_fds(event))
 		return (NULL);
-	}
 
-	g_rw_lock_writer_lock(&conn->rco_subscription_rwlock);
+	if (rpc_get_type(event) != RPC_TYPE_ARRAY)
+		frame = rpc_pack_frame("events", "event", NULL,
+		    rpc_retain(event));
+	else if (rpc_array_get_count(event) == 1)
+		frame = rpc_pack_frame("events", "event", NULL,
+		    rpc_retain(rpc_array_get_value(event, 0)));
+	else
+		frame = rpc_pack_frame("events", "event_burst", NULL,
+		    rpc_retain(event));
 
-	sub = rpc_connection_subscribe_event_locked(conn, path, interface,
-	    name, true);
-	if (sub == NULL) {
-		/* Couldn't inform server, error has been set */
-		goto done;
-	}
-	if (sub->rsu_busy) {
-		/* no state changes were made, tell caller to retry */
-		rpc_set_last_error(EBUSY, "Subscription locked, retry", NULL);
-		goto done;
+	tmp = rpct_serialize(frame);
+	rpc_release(frame);
+
+	if (rpc_msgpack_serialize(tmp, &buf, &len) != 0) {
+		rpc_release(tmp);
+		return (NULL);
 	}
-	rsh = g_malloc0(sizeof(*rsh));
-	rsh->rsh_parent = sub;
-	rsh->rsh_handler = Block_copy(handler);
-	g_ptr_array_add(sub->rsu_handlers, rsh);
-done:
-	g_rw_lock_writer_unlock(&conn->rco_subscription_rwlock);
-	rpc_connection_release(conn);
 
-	return (rsh);
+	rpc_release(tmp);
+	return (g_bytes_new_with_free_func(buf, len, free, buf));
 }
 
 int
-rpc_connection_unregister_event_handler(rpc_connection_t conn, void *cookie)
+rpc_connection_send_event_frame(rpc_connection_t conn, rpc_object_t event,
+    GBytes *frame)
 {
-	struct rpc_subscription_handler *rsh = cookie;
-	struct rpc_subscription *sub;
+	__block bool matches = true;
+	bool ring = false;
+	const void *buf;
+	gsize len;
 	int ret = 0;
 
-	if (rpc_connection_retain_if_valid(conn, true) != 0) {
-		rpc_set_last_error(ECONNRESET, "Connection closed", NULL);
-		return (-1);
-	}
+	if (frame == NULL || (conn->rco_flags &
+	    (RPC_TRANSPORT_NO_SERIALIZE | RPC_TRANSPORT_NO_RPCT_SERIALIZE)))
+		goto fallback;
 
-	sub = rsh->rsh_parent;
+	if (rpc_connection_retain_if_valid(conn, true) != 0)
+		return (-1);
 
-	g_rw_lock_writer_lock(&conn->rco_subscription_rwlock);
-	if (sub->rsu_busy) {
-		ret = -1;
-		rpc_set_last_error(EBUSY, "Subscription locked, retry", NULL);
-		goto done;
+	/*
+	 * The shared frame is only usable if this connection wants
+	 * every event in it; otherwise it needs its own filtered copy.
+	 */
+	g_rw_lock_reader_lock(&conn->rco_subscription_rwlock);
+	if (rpc_get_type(event) == RPC_TYPE_ARRAY) {
+		rpc_array_apply(event, ^(size_t idx __unused,
+		    rpc_object_t value) {
+			matches = rpc_connection_match_subscription(conn,
+			    rpc_dictionary_get_string(value, RPC_ATOM(PATH)),
+			    rpc_dictionary_get_string(value,
+			    RPC_ATOM(INTERFACE)),
+			    rpc_dictionary_get_string(value,
+			    RPC_ATOM(NAME))) != NULL;
+			return ((bool)matches);
+		});
+	} else {
+		matches = rpc_connection_match_subscription(conn,
+		    rpc_dictionary_get_string(event, RPC_ATOM(PATH)),
+		    rpc_dictionary_get_string(event, RPC_ATOM(INTERFACE)),
+		    rpc_dictionary_get_string(event, RPC_ATOM(NAME))) != NULL;
 	}
-	if (g_ptr_array_remove(sub->rsu_handlers, rsh))
-		rpc_connection_unsubscribe_event_locked(conn, sub);
-
-done:
-	g_rw_lock_writer_unlock(&conn->rco_subscription_rwlock);
-	rpc_connection_release(conn);
-	return ret;
-}
-
-rpc_object_t
-rpc_connection_call_syncv(rpc_connection_t conn, const char *path,
-    const char *interface, const char *method, va_list ap)
-{
-	rpc_call_t call;
-	rpc_object_t args;
-	rpc_object_t result;
-	rpc_object_t i;
+#if defined(__linux__)
+	/*
+	 * Clients reading a ring get the frame there and a wakeup. Bursts
+	 * they only want part of go through the filtering path below, and
+	 * so does a frame too large for the ring.
+	 */
+	if (matches && conn->rco_server != NULL &&
+	    conn->rco_event_ring != NULL) {
+		buf = g_bytes_get_data(frame, &len);
+		if (rpc_event_ring_write(conn->rco_event_ring, buf, len) >= 0) {
+			ring = true;
+			ret = eventfd_write(conn->rco_event_ring_fd, 1);
+		}
+	}
+#endif
+	g_rw_lock_reader_unlock(&conn->rco_subscription_rwlock);
 
-	args = rpc_array_create();
+	if (ring) {
+		rpc_connection_release(conn);
+		return (ret);
+	}
 
-	for (;;) {
-		i = va_arg(ap, rpc_object_t);
-		if (i == NULL)
-			break;
+	if (!matches) {
+		rpc_connection_release(conn);
+		if (rpc_get_type(event) != RPC_TYPE_ARRAY)
+			return (0);
 
-		rpc_array_append_stolen_value(args, i);
+		goto fallback;
 	}
 
-	if ((call = rpc_connection_call(conn, path, interface, method, args, NULL)) == NULL)
-		return (NULL);
+	/*
+	 * The shared frame is plain msgpack of a full-size envelope;
+	 * anything this connection negotiated on top of that needs the
+	 * event encoded for it alone.
+	 */
+	if (g_atomic_int_get(&conn->rco_compact_frames) || conn->rco_type_ids ||
+	    conn->rco_compact_structs || (conn->rco_compressor != NULL &&
+	    g_bytes_get_size(frame) >= conn->rco_compress_threshold)) {
+		rpc_connection_release(conn);
+		goto fallback;
+	}
 
-	rpc_call_wait(call);
-	result = rpc_call_result_save(call);
-	rpc_call_free(call);
-	return (result);
-}
+	rpc_send_lock(conn);
+	if (conn->rco_batch_max_bytes > 0)
+		ret = rpc_send_batch_bytes_locked(conn, frame, NULL, 0, NULL);
+	else {
+		buf = g_bytes_get_data(frame, &len);
+		rpc_count_out(conn, 1, len);
+		ret = conn->rco_send_msg(conn->rco_arg, buf, len, NULL, 0);
+	}
+	g_mutex_unlock(&conn->rco_send_mtx);
 
-rpc_object_t
-rpc_connection_call_sync(rpc_connection_t conn, const char *path,
-    const char *interface, const char *method, ...)
-{
-	rpc_object_t result;
-	va_list ap;
+	rpc_connection_release(conn);
+	return (ret);
 
-	va_start(ap, method);
-	result = rpc_connection_call_syncv(conn, path, interface, method, ap);
-	va_end(ap);
+fallback:
+	if (rpc_get_type(event) == RPC_TYPE_ARRAY)
+		return (rpc_connection_send_event_burst(conn, event));
 
-	return (result);
+	return (rpc_connection_send_event(conn,
+	    rpc_dictionary_get_string(event, RPC_ATOM(PATH)),
+	    rpc_dictionary_get_string(event, RPC_ATOM(INTERFACE)),
+	    rpc_dictionary_get_string(event, RPC_ATOM(NAME)),
+	    rpc_dictionary_get_value(event, RPC_ATOM(ARGS))));
 }
 
-rpc_object_t
-rpc_connection_call_syncp(rpc_connection_t conn, const char *path,
-    const char *interface, const char *method, const char *fmt, ...)
+int
+rpc_connection_send_raw_message(rpc_connection_t conn, const void *msg,
+    size_t len, const int *fds, size_t nfds)
 {
-	rpc_object_t result;
-	va_list ap;
+	int ret;
 
-	va_start(ap, fmt);
-	result = rpc_connection_call_syncpv(conn, path, interface, method, fmt, ap);
-	va_end(ap);
+	g_mutex_lock(&conn->rco_mtx);
+	rpc_count_out(conn, 1, len);
+	ret = conn->rco_send_msg(conn->rco_arg, msg, len, fds, nfds);
+	g_mutex_unlock(&conn->rco_mtx);
 
-	return (result);
+	return (ret);
 }
 
-rpc_object_t rpc_connection_call_syncpv(rpc_connection_t conn,
-    const char *path, const char *interface, const char *method,
-    const char *fmt, va_list ap)
+void
+rpc_connection_set_raw_message_handler(rpc_connection_t conn,
+    rpc_raw_handler_t handler)
 {
-	rpc_call_t call;
-	rpc_auto_object_t args = NULL;
-	rpc_object_t result;
 
-	args = rpc_object_vpack(fmt, ap);
-	call = rpc_connection_call(conn, path, interface, method, args, NULL);
+	g_mutex_lock(&conn->rco_mtx);
+	if (conn->rco_raw_handler != NULL) {
+		Block_release(conn->rco_raw_handler);
+		conn->rco_raw_handler = NULL;
+	}
 
-	if (call == NULL)
-		return (NULL);
+	if (handler == NULL) {
+		g_mutex_unlock(&conn->rco_mtx);
+		return;
+	}
 
-	rpc_call_wait(call);
-	result = rpc_call_result_save(call);
-	rpc_call_free(call);
-	return (result);
+	conn->rco_raw_handler = Block_copy(handler);
+	g_mutex_unlock(&conn->rco_mtx);
 }
 
-rpc_object_t
-rpc_connection_call_simple(rpc_connection_t conn, const char *name,
-    const char *fmt, ...)
+void
+rpc_connection_set_event_handler(rpc_connection_t conn, rpc_handler_t h)
 {
-	va_list ap;
-	rpc_object_t result;
-
-	va_start(ap, fmt);
-	result = rpc_connection_call_syncpv(conn, NULL, NULL, name, fmt, ap);
-	va_end(ap);
 
-	return (result);
+	Block_release(conn->rco_event_handler);
+	conn->rco_event_handler = Block_copy(h);
 }
 
-rpc_call_t
-rpc_connection_call(rpc_connection_t conn, const char *path,
-    const char *interface, const char *name, rpc_object_t args,
-    rpc_callback_t callback)
+void
+rpc_connection_set_error_handler(rpc_connection_t conn, rpc_error_handler_t h)
 {
-	struct rpc_call *call;
-	rpc_object_t payload;
-	rpc_object_t frame;
-
-	call = rpc_call_alloc(conn, NULL, path, interface, name, args);
-	if (call == NULL)
-		return (NULL);
-
-	call->rc_type = RPC_OUTBOUND_CALL;
-	call->rc_callback = callback != NULL ? Block_copy(callback) : NULL;
-	payload = rpc_dictionary_create();
 
-	if (path != NULL)
-		rpc_dictionary_set_string(payload, "path", path);
+	Block_release(conn->rco_error_handler);
+	conn->rco_error_handler = Block_copy(h);
+}
 
-	if (interface != NULL)
-		rpc_dictionary_set_string(payload, "interface", interface);
+int
+rpc_connection_set_send_watermarks(rpc_connection_t conn, size_t low,
+    size_t high)
+{
 
-	rpc_dictionary_set_string(payload, "method", name);
-	rpc_dictionary_set_value(payload, "args", call->rc_args);
-	frame = rpc_pack_frame("rpc", "call", call->rc_id, payload);
+	if (high > 0 && low > high) {
+		rpc_set_last_errorf(EINVAL,
+		    "Low watermark above high watermark");
+		return (-1);
+	}
 
-	g_mutex_lock(&call->rc_mtx);
-	g_rw_lock_writer_lock(&conn->rco_call_rwlock);
-	g_hash_table_insert(conn->rco_calls,
-	    (gpointer)rpc_string_get_string_ptr(call->rc_id), call);
-	g_rw_lock_writer_unlock(&conn->rco_call_rwlock);
+	conn->rco_send_low = low;
+	conn->rco_send_high = high;
+	if (high == 0 || atomic_load(&conn->rco_send_queue) <= low) {
+		if (g_atomic_int_compare_and_exchange(&conn->rco_saturated,
+		    true, false)) {
+			atomic_store(&conn->rco_saturated_since, 0);
+			rpc_connection_schedule_writable(conn);
+		}
+	}
 
-	call->rc_timeout = g_timeout_source_new_seconds(conn->rco_rpc_timeout);
-	g_source_set_callback(call->rc_timeout, &rpc_call_timeout, call, NULL);
-	g_source_attach(call->rc_timeout, conn->rco_main_context);
-	g_mutex_unlock(&call->rc_mtx);
+	return (0);
+}
 
-	if (rpc_send_frame(conn, frame) != 0) {
-		rpc_call_free(call);
-		return (NULL);
+/*
+ * Returns true when @p conn has just become slow: saturated, or with
+ * a stream starved of credits, for at least @p limit microseconds.
+ * Only the server's checker calls this, and it reads nothing that
+ * needs a lock, so a stuck sender can't hold it up.
+ */
+bool
+rpc_connection_check_slow(rpc_connection_t conn, gint64 now, gint64 limit)
+{
+	GHashTableIter iter;
+	struct rpc_call *call;
+	int64_t since;
+	bool slow = false;
+
+	since = atomic_load(&conn->rco_saturated_since);
+	if (since != 0 && now - since >= limit)
+		slow = true;
+
+	if (!slow) {
+		g_rw_lock_reader_lock(&conn->rco_icall_rwlock);
+		g_hash_table_iter_init(&iter, conn->rco_inbound_calls);
+		while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&call)) {
+			since = atomic_load(&call->rc_starved_since);
+			if (since != 0 && now - since >= limit) {
+				slow = true;
+				break;
+			}
+		}
+		g_rw_lock_reader_unlock(&conn->rco_icall_rwlock);
 	}
 
-	return (call);
+	if (!slow) {
+		conn->rco_slow = false;
+		return (false);
+	}
+
+	if (conn->rco_slow)
+		return (false);
+
+	conn->rco_slow = true;
+	return (true);
 }
 
-rpc_object_t
-rpc_connection_get_property(rpc_connection_t conn, const char *path,
-    const char *interface, const char *name)
+/*
+ * Aborts a connection without flushing what's queued for it, keeping
+ * @p error as the reason reported to its error handler.
+ */
+void
+rpc_connection_drop(rpc_connection_t conn, rpc_object_t error)
 {
 
-	return (rpc_connection_call_syncp(conn, path, RPC_OBSERVABLE_INTERFACE,
-	    "get", "[s,s]", interface, name));
-}
+	g_mutex_lock(&conn->rco_mtx);
+	if (conn->rco_error == NULL)
+		conn->rco_error = error;
+	else
+		rpc_release(error);
+	g_mutex_unlock(&conn->rco_mtx);
 
+	rpc_connection_do_close(conn, RPC_ABORTED);
+}
 
-rpc_object_t
-rpc_connection_set_property(rpc_connection_t conn, const char *path,
-    const char *interface, const char *name, rpc_object_t value)
+/*
+ * Tells whether @p conn could move to another process as-is: nothing
+ * in flight either way, nothing queued for sending, and no per-peer
+ * state besides its subscriptions, which rpc_server_handoff() carries
+ * along.
+ */
+bool
+rpc_connection_is_idle(rpc_connection_t conn)
 {
+	bool idle;
 
-	return (rpc_connection_call_syncp(conn, path, RPC_OBSERVABLE_INTERFACE,
-	    "set", "[s,s,v]", interface, name, value));
-}
+	if (conn->rco_detach == NULL || conn->rco_type_table != NULL)
+		return (false);
 
+#if defined(__linux__)
+	g_mutex_lock(&conn->rco_shmem_mtx);
+	idle = (conn->rco_shmem_tx == NULL || conn->rco_shmem_tx->len == 0) &&
+	    (conn->rco_shmem_rx == NULL ||
+	    g_hash_table_size(conn->rco_shmem_rx) == 0);
+	g_mutex_unlock(&conn->rco_shmem_mtx);
+	if (!idle)
+		return (false);
+#endif
 
-rpc_object_t
-rpc_connection_set_propertyp(rpc_connection_t conn, const char *path,
-    const char *interface, const char *name, const char *fmt, ...)
-{
-	rpc_object_t value;
-	va_list ap;
+	g_rw_lock_reader_lock(&conn->rco_icall_rwlock);
+	idle = g_hash_table_size(conn->rco_inbound_calls) == 0;
+	g_rw_lock_reader_unlock(&conn->rco_icall_rwlock);
+	if (!idle)
+		return (false);
 
-	va_start(ap, fmt);
-	value = rpc_object_vpack(fmt, ap);
-	va_end(ap);
+	g_rw_lock_reader_lock(&conn->rco_call_rwlock);
+	idle = g_hash_table_size(conn->rco_calls) == 0;
+	g_rw_lock_reader_unlock(&conn->rco_call_rwlock);
+	if (!idle)
+		return (false);
 
-	return (rpc_connection_set_property(conn, path, interface, name, value));
+	g_mutex_lock(&conn->rco_send_mtx);
+	idle = conn->rco_batch == NULL || conn->rco_batch->len == 0;
+	g_mutex_unlock(&conn->rco_send_mtx);
+	return (idle);
 }
 
-
+/*
+ * Describes the events @p conn subscribed to, in a form
+ * rpc_connection_restore_subscriptions() takes back.
+ */
 rpc_object_t
-rpc_connection_set_propertypv(rpc_connection_t conn, const char *path,
-    const char *interface, const char *name, const char *fmt, va_list ap)
+rpc_connection_save_subscriptions(rpc_connection_t conn)
 {
-	rpc_object_t value;
+	struct rpc_subscription *sub;
+	rpc_object_t result;
+	guint i;
 
-	value = rpc_object_vpack(fmt, ap);
-	return (rpc_connection_set_property(conn, path, interface, name, value));
+	result = rpc_array_create();
+	g_rw_lock_reader_lock(&conn->rco_subscription_rwlock);
+	for (i = 0; i < conn->rco_subscriptions->len; i++) {
+		sub = g_ptr_array_index(conn->rco_subscriptions, i);
+		rpc_array_append_stolen_value(result, rpc_object_pack(
+		    "{s,s,s,u}",
+		    "name", sub->rsu_name,
+		    "interface", sub->rsu_interface,
+		    "path", sub->rsu_path,
+		    "refcount", (uint64_t)sub->rsu_refcount));
+	}
+	g_rw_lock_reader_unlock(&conn->rco_subscription_rwlock);
+
+	return (result);
 }
 
-void *
-rpc_connection_watch_property(rpc_connection_t conn, const char *path,
-    const char *interface, const char *property,
-    rpc_property_handler_t handler)
+void
+rpc_connection_restore_subscriptions(rpc_connection_t conn,
+    rpc_object_t subscriptions)
 {
-	/* add some memory leaks to we can remove them later */
-	path = g_strdup(path);
-	interface = g_strdup(interface);
-	property = g_strdup(property);
-
-	rpc_handler_t block = ^(const char *_p __unused, const char *_i __unused,
-	    const char *_n __unused, rpc_object_t args) {
-		const char *ev_iface;
-		const char *ev_name;
-		rpc_object_t ev_value;
+	rpc_object_t args;
 
-		if (rpc_object_unpack(args, "{s,s,v}",
-		    "interface", &ev_iface,
-		    "name", &ev_name,
-		    "value", &ev_value) < 3)
-			return;
+	if (subscriptions == NULL ||
+	    rpc_get_type(subscriptions) != RPC_TYPE_ARRAY)
+		return;
 
-		if (g_strcmp0(interface, ev_iface) != 0)
-			return;
+	/* Replay one events.subscribe entry per reference */
+	args = rpc_array_create();
+	rpc_array_apply(subscriptions, ^(size_t index __unused,
+	    rpc_object_t value) {
+		uint64_t refcount;
 
-		if (g_strcmp0(property, ev_name) != 0)
-			return;
+		refcount = rpc_dictionary_get_uint64(value, "refcount");
+		while (refcount-- > 0)
+			rpc_array_append_value(args, value);
 
-		handler(ev_value);
-	};
+		return ((bool)true);
+	});
 
-	return (rpc_connection_register_event_handler(conn, path,
-	    RPC_OBSERVABLE_INTERFACE, "changed", block));
+	on_events_subscribe(conn, args, NULL);
+	rpc_release(args);
 }
 
-int
-rpc_connection_send_event(rpc_connection_t conn, const char *path,
-    const char *interface, const char *name, rpc_object_t args)
+void
+rpc_connection_start_session(rpc_connection_t conn)
 {
 	rpc_object_t frame;
-	rpc_object_t event;
-	struct rpc_subscription *sub;
-	int ret = 0;
 
-	if (rpc_connection_retain_if_valid(conn, true) != 0)
-		return (-1);
+	g_mutex_lock(&conn->rco_mtx);
+	if (conn->rco_session_token == NULL)
+		conn->rco_session_token = rpc_session_token_new();
 
-	/* Any listeners? */
-	g_rw_lock_reader_lock(&conn->rco_subscription_rwlock);
-	if (rpc_connection_get_subscription_count(conn) < 1)
-		goto done;
+	frame = rpc_pack_frame("session", "token", NULL, rpc_object_pack(
+	    "{s}", "token", conn->rco_session_token));
+	g_mutex_unlock(&conn->rco_mtx);
 
-	sub = rpc_connection_find_subscription(conn, path, interface, name);
-	if (sub == NULL)
-		goto done;
+	if (rpc_send_frame(conn, frame) != 0)
+		debugf("couldn't send session token on conn %p", conn);
+}
 
-	event = rpc_object_pack("{s,s,s,v}",
-	    "path", path,
-	    "interface", interface,
-	    "name", name,
-	    "args", rpc_retain(args));
+/*
+ * Called with rco_subscription_rwlock held. Lists the subscriptions of
+ * a client connection as one events.subscribe argument.
+ */
+static rpc_object_t
+rpc_connection_pack_subscriptions_locked(rpc_connection_t conn)
+{
+	struct rpc_subscription *sub;
+	rpc_object_t result;
+	guint i;
 
-	frame = rpc_pack_frame("events", "event", NULL, event);
-	ret = rpc_send_frame(conn, frame);
+	result = rpc_array_create();
+	for (i = 0; i < conn->rco_subscriptions->len; i++) {
+		sub = g_ptr_array_index(conn->rco_subscriptions, i);
+		rpc_array_append_stolen_value(result, rpc_object_pack(
+		    "{s,s,s}",
+		    "path", sub->rsu_path,
+		    "interface", sub->rsu_interface,
+		    "name", sub->rsu_name));
+	}
 
-done:
-	g_rw_lock_reader_unlock(&conn->rco_subscription_rwlock);
-	rpc_connection_release(conn);
-	return (ret);
+	return (result);
 }
 
-int
-rpc_connection_send_raw_message(rpc_connection_t conn, const void *msg,
-    size_t len, const int *fds, size_t nfds)
+char *
+rpc_connection_get_session(rpc_connection_t conn)
 {
-	int ret;
+	char *token;
 
 	g_mutex_lock(&conn->rco_mtx);
-	ret = conn->rco_send_msg(conn->rco_arg, msg, len, fds, nfds);
+	token = g_strdup(conn->rco_session_token);
 	g_mutex_unlock(&conn->rco_mtx);
 
-	return (ret);
+	return (token);
 }
 
-void
-rpc_connection_set_raw_message_handler(rpc_connection_t conn,
-    rpc_raw_handler_t handler)
+int
+rpc_connection_resume_session(rpc_connection_t conn, rpc_connection_t old)
 {
+	struct rpc_subscription *sub;
+	struct rpc_subscription *copy;
+	struct rpc_subscription_handler *rsh;
+	struct rpc_subscription_handler *orsh;
+	rpc_object_t frame;
+	char *token;
+	guint i;
+	guint j;
+	int ret;
 
-	g_mutex_lock(&conn->rco_mtx);
-	if (conn->rco_raw_handler != NULL) {
-		Block_release(conn->rco_raw_handler);
-		conn->rco_raw_handler = NULL;
+	if (conn->rco_client == NULL || old->rco_client == NULL) {
+		rpc_set_last_error(EINVAL, "Not a client connection", NULL);
+		return (-1);
 	}
 
-	if (handler == NULL) {
-		g_mutex_unlock(&conn->rco_mtx);
-		return;
+	if (rpc_connection_retain_if_valid(conn, true) != 0) {
+		rpc_set_last_error(ECONNRESET, "Connection closed", NULL);
+		return (-1);
 	}
 
-	conn->rco_raw_handler = Block_copy(handler);
-	g_mutex_unlock(&conn->rco_mtx);
+	if (rpc_connection_retain_if_valid(old, false) != 0) {
+		rpc_connection_release(conn);
+		rpc_set_last_error(EINVAL, "Invalid connection", NULL);
+		return (-1);
+	}
+
+	token = rpc_connection_get_session(old);
+
+	g_rw_lock_reader_lock(&old->rco_subscription_rwlock);
+	g_rw_lock_writer_lock(&conn->rco_subscription_rwlock);
+	if (conn->rco_subscriptions->len > 0) {
+		g_rw_lock_writer_unlock(&conn->rco_subscription_rwlock);
+		g_rw_lock_reader_unlock(&old->rco_subscription_rwlock);
+		rpc_set_last_error(EBUSY, "Connection has subscriptions", NULL);
+		ret = -1;
+		goto done;
+	}
+
+	for (i = 0; i < old->rco_subscriptions->len; i++) {
+		sub = g_ptr_array_index(old->rco_subscriptions, i);
+		copy = g_malloc0(sizeof(*copy));
+		copy->rsu_path = g_strdup(sub->rsu_path);
+		copy->rsu_interface = g_strdup(sub->rsu_interface);
+		copy->rsu_name = g_strdup(sub->rsu_name);
+		copy->rsu_refcount = sub->rsu_refcount;
+		copy->rsu_handlers = g_ptr_array_new_with_free_func(
+		    (GDestroyNotify)rpc_rsh_release);
+
+		for (j = 0; j < sub->rsu_handlers->len; j++) {
+			orsh = g_ptr_array_index(sub->rsu_handlers, j);
+			rsh = g_malloc0(sizeof(*rsh));
+			rsh->rsh_parent = copy;
+			rsh->rsh_handler = orsh->rsh_handler != NULL
+			    ? Block_copy(orsh->rsh_handler) : NULL;
+			rsh->rsh_fn = orsh->rsh_fn;
+			rsh->rsh_ctx = orsh->rsh_ctx;
+			g_ptr_array_add(copy->rsu_handlers, rsh);
+		}
+
+		g_ptr_array_add(rpc_connection_subscriptions(conn), copy);
+	}
+	g_rw_lock_reader_unlock(&old->rco_subscription_rwlock);
+
+	/*
+	 * Without a session, or if the server lost it (see
+	 * on_session_resumed()), the server hears about all the
+	 * subscriptions in one frame.
+	 */
+	if (token != NULL) {
+		frame = rpc_pack_frame("session", "resume", NULL,
+		    rpc_object_pack("{s}", "token", token));
+	} else if (conn->rco_subscriptions->len > 0) {
+		frame = rpc_pack_frame("events", "subscribe", NULL,
+		    rpc_connection_pack_subscriptions_locked(conn));
+	} else
+		frame = NULL;
+	g_rw_lock_writer_unlock(&conn->rco_subscription_rwlock);
+
+	ret = frame != NULL ? rpc_send_frame(conn, frame) : 0;
+done:
+	g_free(token);
+	rpc_connection_release(old);
+	rpc_connection_release(conn);
+	return (ret);
 }
 
-void
-rpc_connection_set_event_handler(rpc_connection_t conn, rpc_handler_t h)
+bool
+rpc_connection_is_saturated(rpc_connection_t conn)
 {
 
-	Block_release(conn->rco_event_handler);
-	conn->rco_event_handler = Block_copy(h);
+	return (g_atomic_int_get(&conn->rco_saturated));
 }
 
 void
-rpc_connection_set_error_handler(rpc_connection_t conn, rpc_error_handler_t h)
+rpc_connection_set_writable_handler(rpc_connection_t conn,
+    rpc_writable_handler_t handler)
 {
 
-	Block_release(conn->rco_error_handler);
-	conn->rco_error_handler = Block_copy(h);
+	Block_release(conn->rco_writable_handler);
+	conn->rco_writable_handler = Block_copy(handler);
 }
 
 const char *
@@ -2353,16 +6669,126 @@ rpc_connection_get_remote_pid(rpc_connection_t conn)
 	return (conn->rco_creds.rcc_pid);
 }
 
+void
+rpc_connection_get_stats(rpc_connection_t conn,
+    struct rpc_connection_stats *stats)
+{
+
+	memset(stats, 0, sizeof(*stats));
+	rpc_connection_add_stats(conn, stats);
+}
+
+void
+rpc_connection_add_stats(rpc_connection_t conn,
+    struct rpc_connection_stats *stats)
+{
+
+	stats->rcs_frames_in += atomic_load(&conn->rco_frames_in);
+	stats->rcs_frames_out += atomic_load(&conn->rco_frames_out);
+	stats->rcs_bytes_in += atomic_load(&conn->rco_bytes_in);
+	stats->rcs_bytes_out += atomic_load(&conn->rco_bytes_out);
+	stats->rcs_serialize_time += atomic_load(&conn->rco_serialize_time);
+	stats->rcs_deserialize_time +=
+	    atomic_load(&conn->rco_deserialize_time);
+	stats->rcs_send_wait_time += atomic_load(&conn->rco_send_wait_time);
+
+	g_rw_lock_reader_lock(&conn->rco_call_rwlock);
+	stats->rcs_calls_outstanding += g_hash_table_size(conn->rco_calls);
+	g_rw_lock_reader_unlock(&conn->rco_call_rwlock);
+
+	g_rw_lock_reader_lock(&conn->rco_icall_rwlock);
+	stats->rcs_calls_inflight += g_hash_table_size(
+	    conn->rco_inbound_calls);
+	g_rw_lock_reader_unlock(&conn->rco_icall_rwlock);
+
+	g_rw_lock_reader_lock(&conn->rco_subscription_rwlock);
+	stats->rcs_subscriptions += conn->rco_subscriptions->len;
+	g_rw_lock_reader_unlock(&conn->rco_subscription_rwlock);
+}
+
 int
 rpc_call_wait(rpc_call_t call)
 {
 	int ret;
 
-	g_assert_nonnull(call);
-	g_mutex_lock(&call->rc_mtx);
-	ret = rpc_call_wait_locked(call);
-	g_mutex_unlock(&call->rc_mtx);
+	g_assert_nonnull(call);
+	g_mutex_lock(&call->rc_mtx);
+	ret = rpc_call_wait_locked(call);
+	g_mutex_unlock(&call->rc_mtx);
+
+	return (ret);
+}
+
+/*
+ * Tops the producer's grant up once half of the window has been used,
+ * rather than when it runs dry, so the producer never has to wait for
+ * a full round trip. With a window of one this is the old lock-step
+ * behavior. While queued fragments use up the connection's budget or
+ * the process-wide ceiling, the grant is withheld until some of them
+ * are consumed, see rpc_fragment_resume().
+ */
+static int
+rpc_call_grant_locked(struct rpc_call *call)
+{
+	struct queue_item *q_item;
+	rpc_object_t frame;
+	rpc_object_t args;
+	int64_t seqno;
+	int64_t window;
+	int64_t outstanding;
+	int64_t increment;
+	int ret = 0;
+
+	window = rpc_call_window_locked(call);
+	outstanding = call->rc_producer_seqno - call->rc_consumer_seqno;
+	if (outstanding > window / 2 && (call->rc_prefetch_bytes == 0 ||
+	    call->rc_bytes_owed < (int64_t)call->rc_prefetch_bytes / 2))
+		return (0);
+
+	if (rpc_fragment_over_budget(call->rc_conn)) {
+		rpc_fragment_withhold_locked(call);
+
+		/* Unless memory got freed before we were on the list */
+		if (rpc_fragment_over_budget(call->rc_conn))
+			return (0);
+	}
+
+	seqno = call->rc_producer_seqno + 1;
+	increment = MAX(window - outstanding, 0);
+	args = rpc_object_pack("{i,i,b}",
+	    "seqno", seqno,
+	    "increment", increment,
+	    "batch", true);
+
+	if (call->rc_prefetch_bytes > 0) {
+		rpc_dictionary_set_int64(args, RPC_ATOM(BYTES),
+		    call->rc_bytes_owed);
+		call->rc_bytes_owed = 0;
+	}
+
+#if defined(__linux__)
+	if (call->rc_stream_ring != NULL && !call->rc_stream_ring_sent) {
+		rpc_dictionary_set_value(args, "ring",
+		    rpc_event_ring_get_shmem(call->rc_stream_ring));
+		call->rc_stream_ring_sent = true;
+	}
+#endif
+
+	frame = rpc_pack_frame("rpc", "continue", call->rc_id, args);
+	if (rpc_send_frame(call->rc_conn, frame) != 0) {
+		q_item = g_malloc0(sizeof(*q_item));
+		q_item->status = RPC_CALL_ERROR;
+		q_item->item = rpc_retain(rpc_get_last_error());
+		g_queue_push_tail(&call->rc_queue, q_item);
+		ret = -1;
+	}
 
+	if (call->rc_grant_time == 0 && increment > 0) {
+		call->rc_grant_time = g_get_monotonic_time();
+		call->rc_grant_seqno = seqno;
+	}
+
+	call->rc_producer_seqno += increment;
 	return (ret);
 }
 
@@ -2371,9 +6797,8 @@ rpc_call_continue(rpc_call_t call, bool sync)
 {
 	struct queue_item *q_item;
 	rpc_call_status_t status;
-	rpc_object_t frame;
-	int64_t seqno;
-	int ret = 0;
+	int64_t charged;
+	int ret;
 
 	g_mutex_lock(&call->rc_mtx);
 	status = rpc_call_status_locked(call);
@@ -2386,31 +6811,27 @@ rpc_call_continue(rpc_call_t call, bool sync)
 		return (-1);
 	}
 
-	if (call->rc_consumer_seqno == call->rc_producer_seqno) {
-		seqno = call->rc_producer_seqno + 1;
-		frame = rpc_pack_frame("rpc", "continue", call->rc_id, rpc_object_pack(
-		    "{i,i}",
-		    "seqno", seqno,
-		    "increment", call->rc_prefetch));
-
-		if (rpc_send_frame(call->rc_conn, frame) != 0) {
-			q_item = g_malloc0(sizeof(*q_item));
-			q_item->status = RPC_CALL_ERROR;
-			q_item->item = rpc_retain(rpc_get_last_error());
-			g_queue_push_tail(call->rc_queue, q_item);
-			ret = -1;
-		}
-
-		call->rc_producer_seqno += call->rc_prefetch;
-	}
-
+	ret = rpc_call_grant_locked(call);
 	call->rc_consumer_seqno++;
 
 	/* It is assumed that the caller retains q_item->item if it is needed */
-	q_item = g_queue_pop_head(call->rc_queue);
+	q_item = g_queue_pop_head(&call->rc_queue);
+	if (q_item->status == RPC_CALL_MORE_AVAILABLE &&
+	    call->rc_prefetch_bytes > 0)
+		call->rc_bytes_owed += q_item->bytes;
+
+	charged = q_item->charged;
 	rpc_release(q_item->item);
 	g_free(q_item);
 
+	/* Grants of other calls may be waiting for that memory */
+	if (charged > 0) {
+		rpc_fragment_charge(call->rc_conn, -charged);
+		g_mutex_unlock(&call->rc_mtx);
+		rpc_fragment_resume();
+		g_mutex_lock(&call->rc_mtx);
+	}
+
 	if (sync && ret == 0) {
 		if (rpc_call_wait_locked(call) < 0) {
 			g_mutex_unlock(&call->rc_mtx);
@@ -2431,6 +6852,7 @@ rpc_call_abort(rpc_call_t call)
 	struct queue_item *q_item;
 	rpc_call_status_t status;
 	rpc_object_t frame;
+	GSList *thens = NULL;
 
 	g_mutex_lock(&call->rc_mtx);
 	status = rpc_call_status_locked(call);
@@ -2443,52 +6865,324 @@ rpc_call_abort(rpc_call_t call)
 		return (-1);
 	}
 
-	frame = rpc_pack_frame("rpc", "abort", call->rc_id, rpc_null_create());
-	if (rpc_send_frame(call->rc_conn, frame) != 0) {
-		g_mutex_unlock(&call->rc_mtx);
-		return (-1);
+	/* A coalesced call that was never sent has nothing to abort */
+	if (call->rc_flight_frame == NULL) {
+		frame = rpc_pack_frame("rpc", "abort", call->rc_id,
+		    rpc_null_create());
+		if (rpc_send_frame(call->rc_conn, frame) != 0) {
+			g_mutex_unlock(&call->rc_mtx);
+			return (-1);
+		}
 	}
 
+	RPC_PROBE3(call__abort, call->rc_conn, call, false);
 	if (cancel_timeout_locked(call) == 0) {
-		q_item = g_malloc(sizeof(*q_item));
+		q_item = g_malloc0(sizeof(*q_item));
 		q_item->status = RPC_CALL_ABORTED;
 		q_item->item = NULL;
-		g_queue_push_tail(call->rc_queue, q_item);
+		g_queue_push_tail(&call->rc_queue, q_item);
+		thens = rpc_call_settle_locked(call);
 	}
 
 	g_mutex_unlock(&call->rc_mtx);
+	rpc_call_run_thens(thens);
+	if (call->rc_flight != NULL)
+		rpc_flight_leave(call);
+
 	return (0);
 }
 
+int
+rpc_call_yield_arg(rpc_call_t call, rpc_object_t fragment)
+{
+	rpc_object_t args;
+	int ret;
+
+	g_mutex_lock(&call->rc_mtx);
+	if (!call->rc_input || call->rc_input_ended) {
+		g_mutex_unlock(&call->rc_mtx);
+		rpc_release(fragment);
+		rpc_set_last_error(EINVAL, "Call takes no more input", NULL);
+		return (-1);
+	}
+
+	/* The method consumes its input at its own pace */
+	while (call->rc_input_seqno >= call->rc_input_credit &&
+	    !call->rc_settled)
+		notify_wait(&call->rc_notify, &call->rc_mtx);
+
+	if (call->rc_settled) {
+		g_mutex_unlock(&call->rc_mtx);
+		rpc_release(fragment);
+		rpc_set_last_error(EPIPE, "Call already finished", NULL);
+		return (-1);
+	}
+
+	args = rpc_dictionary_create();
+	rpc_dictionary_set_int64(args, "seqno", call->rc_input_seqno);
+	rpc_dictionary_steal_value(args, RPC_ATOM(FRAGMENT), fragment);
+	ret = rpc_send_frame(call->rc_conn, rpc_pack_frame("rpc", "input",
+	    call->rc_id, args));
+	if (ret == 0)
+		call->rc_input_seqno++;
+
+	g_mutex_unlock(&call->rc_mtx);
+	return (ret);
+}
+
+int
+rpc_call_end_input(rpc_call_t call)
+{
+	rpc_object_t args;
+
+	g_mutex_lock(&call->rc_mtx);
+	if (!call->rc_input || call->rc_input_ended) {
+		g_mutex_unlock(&call->rc_mtx);
+		rpc_set_last_error(EINVAL, "Call takes no more input", NULL);
+		return (-1);
+	}
+
+	call->rc_input_ended = true;
+	args = rpc_dictionary_create();
+	rpc_dictionary_set_int64(args, "seqno", call->rc_input_seqno);
+	g_mutex_unlock(&call->rc_mtx);
+
+	return (rpc_send_frame(call->rc_conn, rpc_pack_frame("rpc",
+	    "input_end", call->rc_id, args)));
+}
+
 int
 rpc_call_set_prefetch(_Nonnull rpc_call_t call, size_t nitems)
 {
 
 	g_mutex_lock(&call->rc_mtx);
-	call->rc_prefetch = (int64_t)nitems;
+	call->rc_prefetch = (int64_t)MIN(nitems, RPC_STREAM_MAX_WINDOW);
+	g_mutex_unlock(&call->rc_mtx);
+	return (0);
+}
+
+int
+rpc_call_set_prefetch_bytes(_Nonnull rpc_call_t call, size_t nbytes)
+{
+
+	g_mutex_lock(&call->rc_mtx);
+	if (call->rc_producer_seqno > 0) {
+		g_mutex_unlock(&call->rc_mtx);
+		rpc_set_last_errorf(EBUSY, "Stream already started");
+		return (-1);
+	}
+
+	/* The whole window goes out with the first grant */
+	call->rc_prefetch_bytes = nbytes;
+	call->rc_bytes_owed = (int64_t)nbytes;
+	g_mutex_unlock(&call->rc_mtx);
+	return (0);
+}
+
+int
+rpc_connection_set_fragment_budget(rpc_connection_t conn, size_t nbytes)
+{
+
+	conn->rco_fragment_budget = nbytes;
+	rpc_fragment_resume();
+	return (0);
+}
+
+void
+rpc_connection_set_fragment_ceiling(size_t nbytes)
+{
+
+	atomic_store(&rpc_fragment_ceiling, (uint64_t)nbytes);
+	rpc_fragment_resume();
+}
+
+size_t
+rpc_connection_get_fragment_memory(void)
+{
+	int64_t total = atomic_load(&rpc_fragment_total);
+
+	return (total > 0 ? (size_t)total : 0);
+}
+
+int
+rpc_call_set_stream_ring(_Nonnull rpc_call_t call, size_t size)
+{
+#if defined(__linux__)
+	struct rpc_event_ring *ring;
+
+	if (!call->rc_conn->rco_supports_fd_passing) {
+		rpc_set_last_errorf(ENOTSUP,
+		    "Stream rings need descriptor passing");
+		return (-1);
+	}
+
+	g_mutex_lock(&call->rc_mtx);
+	if (call->rc_producer_seqno > 0 || call->rc_stream_ring != NULL) {
+		g_mutex_unlock(&call->rc_mtx);
+		rpc_set_last_errorf(EBUSY, "Stream already started");
+		return (-1);
+	}
+
+	ring = rpc_event_ring_create(size, false);
+	if (ring == NULL) {
+		g_mutex_unlock(&call->rc_mtx);
+		return (-1);
+	}
+
+	call->rc_stream_ring = ring;
 	g_mutex_unlock(&call->rc_mtx);
 	return (0);
+#else
+	rpc_set_last_errorf(ENOTSUP, "Stream rings need memory files");
+	return (-1);
+#endif
+}
+
+static bool
+rpc_fragment_accounting(rpc_connection_t conn)
+{
+
+	return (conn->rco_fragment_budget > 0 ||
+	    atomic_load(&rpc_fragment_ceiling) > 0);
+}
+
+static bool
+rpc_fragment_over_budget(rpc_connection_t conn)
+{
+	uint64_t ceiling = atomic_load(&rpc_fragment_ceiling);
+
+	if (conn->rco_fragment_budget > 0 &&
+	    atomic_load(&conn->rco_fragment_queued) >=
+	    (int64_t)conn->rco_fragment_budget)
+		return (true);
+
+	return (ceiling > 0 &&
+	    atomic_load(&rpc_fragment_total) >= (int64_t)ceiling);
+}
+
+static void
+rpc_fragment_charge(rpc_connection_t conn, int64_t bytes)
+{
+
+	atomic_fetch_add(&conn->rco_fragment_queued, bytes);
+	atomic_fetch_add(&rpc_fragment_total, bytes);
+}
+
+/*
+ * Parks a call whose grant can't go out yet. The list holds a call
+ * reference, so the call stays around until it is resumed.
+ */
+static void
+rpc_fragment_withhold_locked(struct rpc_call *call)
+{
+
+	if (call->rc_grant_withheld)
+		return;
+
+	call->rc_grant_withheld = true;
+	rpc_connection_call_retain(call);
+	g_mutex_lock(&rpc_fragment_mtx);
+	g_queue_push_tail(&rpc_fragment_starved, call);
+	g_atomic_int_inc(&rpc_fragment_nstarved);
+	g_mutex_unlock(&rpc_fragment_mtx);
+}
+
+/*
+ * Gives every parked call another chance at its grant, after queued
+ * fragments were consumed or dropped. Calls still over budget go
+ * straight back to the list. Called without any call locked.
+ */
+static void
+rpc_fragment_resume(void)
+{
+	struct rpc_call *call;
+	rpc_call_status_t status;
+	GQueue retry;
+
+	if (g_atomic_int_get(&rpc_fragment_nstarved) == 0)
+		return;
+
+	g_mutex_lock(&rpc_fragment_mtx);
+	retry = rpc_fragment_starved;
+	g_queue_init(&rpc_fragment_starved);
+	g_atomic_int_set(&rpc_fragment_nstarved, 0);
+	g_mutex_unlock(&rpc_fragment_mtx);
+
+	while ((call = g_queue_pop_head(&retry)) != NULL) {
+		g_mutex_lock(&call->rc_mtx);
+		call->rc_grant_withheld = false;
+		status = rpc_call_status_locked(call);
+		if ((status == RPC_CALL_IN_PROGRESS ||
+		    status == RPC_CALL_MORE_AVAILABLE ||
+		    status == RPC_CALL_STREAM_START) &&
+		    rpc_call_grant_locked(call) != 0)
+			notify_signal(&call->rc_notify);
+
+		g_mutex_unlock(&call->rc_mtx);
+		rpc_connection_call_release(call);
+	}
+}
+
+static int64_t
+rpc_call_window_locked(struct rpc_call *call)
+{
+	int64_t window;
+
+	if (call->rc_prefetch > 0)
+		return ((int64_t)call->rc_prefetch);
+
+	/* Auto-tuned: keep two round trips' worth of fragments in flight */
+	if (call->rc_rtt == 0 || call->rc_interarrival == 0)
+		return (RPC_STREAM_INITIAL_WINDOW);
+
+	window = 2 * call->rc_rtt / call->rc_interarrival;
+	return (CLAMP(window, 1, RPC_STREAM_MAX_WINDOW));
 }
 
 inline int
 rpc_call_timedwait(rpc_call_t call, const struct timespec *ts)
 {
+	gint64 deadline;
 	int ret = 0;
 
+	deadline = g_get_monotonic_time() + ts->tv_sec * G_TIME_SPAN_SECOND +
+	    ts->tv_nsec / 1000;
+
 	g_mutex_lock(&call->rc_mtx);
-	while (g_queue_is_empty(call->rc_queue)) {
-		g_mutex_unlock(&call->rc_mtx);
-		if (!notify_timedwait(&call->rc_notify, ts)) {
+	while (g_queue_is_empty(&call->rc_queue)) {
+		if (!notify_timedwait(&call->rc_notify, &call->rc_mtx,
+		    deadline)) {
 			ret = -1;
 			break;
 		}
-		g_mutex_lock(&call->rc_mtx);
 	}
 
+	notify_drain(&call->rc_notify);
 	g_mutex_unlock(&call->rc_mtx);
 	return (ret);
 }
 
+int
+rpc_call_get_fd(rpc_call_t call)
+{
+	int fd;
+
+	g_mutex_lock(&call->rc_mtx);
+	fd = notify_get_fd(&call->rc_notify);
+
+	/* Do not miss whatever happened before */
+	if (fd != -1 && !g_queue_is_empty(&call->rc_queue))
+		notify_signal(&call->rc_notify);
+
+	g_mutex_unlock(&call->rc_mtx);
+
+	if (fd == -1)
+		rpc_set_last_errorf(errno, "Cannot create descriptor: %s",
+		    strerror(errno));
+
+	return (fd);
+}
+
 int
 rpc_call_success(rpc_call_t call)
 {
@@ -2501,8 +7195,8 @@ rpc_call_status_locked(rpc_call_t call)
 {
 	struct queue_item *q_item;
 
-	if (!g_queue_is_empty(call->rc_queue)) {
-		q_item = g_queue_peek_head(call->rc_queue);
+	if (!g_queue_is_empty(&call->rc_queue)) {
+		q_item = g_queue_peek_head(&call->rc_queue);
 		return (q_item->status);
 	}
 
@@ -2520,13 +7214,143 @@ rpc_call_status(rpc_call_t call)
 	return (result);
 }
 
+int
+rpc_call_set_timeout(rpc_call_t call, uint64_t msecs)
+{
+
+	g_mutex_lock(&call->rc_mtx);
+	if (call->rc_type != RPC_OUTBOUND_CALL ||
+	    rpc_call_status_locked(call) != RPC_CALL_IN_PROGRESS ||
+	    cancel_timeout_locked(call) != 0) {
+		g_mutex_unlock(&call->rc_mtx);
+		rpc_set_last_errorf(EINVAL, "Call is not in progress");
+		return (-1);
+	}
+
+	if (msecs > 0)
+		arm_timeout_locked(call, msecs);
+
+	g_mutex_unlock(&call->rc_mtx);
+	return (0);
+}
+
+int
+rpc_call_then(rpc_call_t call, rpc_executor_t executor, rpc_then_t fn)
+{
+	struct rpc_call_then *then;
+	bool settled;
+
+	if (call->rc_type != RPC_OUTBOUND_CALL) {
+		rpc_set_last_errorf(EINVAL, "Not an outbound call");
+		return (-1);
+	}
+
+	then = g_malloc(sizeof(*then));
+	then->rct_call = call;
+	then->rct_executor = executor != NULL ? Block_copy(executor) : NULL;
+	then->rct_fn = Block_copy(fn);
+	rpc_connection_call_retain(call);
+
+	g_mutex_lock(&call->rc_mtx);
+	settled = call->rc_settled;
+	if (!settled)
+		call->rc_thens = g_slist_prepend(call->rc_thens, then);
+	g_mutex_unlock(&call->rc_mtx);
+
+	if (settled)
+		rpc_call_run_then(then);
+
+	return (0);
+}
+
+int
+rpc_call_await(rpc_call_t call, rpc_executor_t executor, rpc_then_t fn)
+{
+	struct rpc_call_then *then;
+	bool ready;
+
+	if (call->rc_type != RPC_OUTBOUND_CALL) {
+		rpc_set_last_errorf(EINVAL, "Not an outbound call");
+		return (-1);
+	}
+
+	then = g_malloc(sizeof(*then));
+	then->rct_call = call;
+	then->rct_executor = executor != NULL ? Block_copy(executor) : NULL;
+	then->rct_fn = Block_copy(fn);
+	rpc_connection_call_retain(call);
+
+	g_mutex_lock(&call->rc_mtx);
+	ready = call->rc_settled || !g_queue_is_empty(&call->rc_queue);
+	if (!ready)
+		call->rc_waiters = g_slist_prepend(call->rc_waiters, then);
+	g_mutex_unlock(&call->rc_mtx);
+
+	if (ready)
+		rpc_call_run_then(then);
+
+	return (0);
+}
+
+int
+rpc_call_when_all(rpc_call_t *calls, size_t ncalls, rpc_executor_t executor,
+    rpc_work_t fn)
+{
+	__block volatile gint remaining = (gint)ncalls;
+	size_t i;
+
+	for (i = 0; i < ncalls; i++) {
+		if (calls[i]->rc_type != RPC_OUTBOUND_CALL) {
+			rpc_set_last_errorf(EINVAL, "Not an outbound call");
+			return (-1);
+		}
+	}
+
+	if (ncalls == 0) {
+		rpc_executor_run(executor, fn);
+		return (0);
+	}
+
+	/* The last call to finish hands fn over to the executor */
+	for (i = 0; i < ncalls; i++) {
+		rpc_call_then(calls[i], NULL, ^(rpc_call_t call __unused) {
+			if (g_atomic_int_dec_and_test(&remaining))
+				rpc_executor_run(executor, fn);
+		});
+	}
+
+	return (0);
+}
+
+rpc_executor_t
+rpc_executor_main_context(struct _GMainContext *context)
+{
+
+	return (Block_copy(^(rpc_work_t work) {
+		g_main_context_invoke_full(context, G_PRIORITY_DEFAULT,
+		    rpc_executor_invoke, Block_copy(work),
+		    rpc_executor_work_free);
+	}));
+}
+
+#ifdef ENABLE_LIBDISPATCH
+rpc_executor_t
+rpc_executor_dispatch_queue(dispatch_queue_t queue)
+{
+
+	return (Block_copy(^(rpc_work_t work) {
+		dispatch_async(queue, work);
+	}));
+}
+#endif
+
 inline rpc_object_t
 rpc_call_result(rpc_call_t call)
 {
 	struct queue_item *q_item;
 
 	g_mutex_lock(&call->rc_mtx);
-	q_item = g_queue_peek_head(call->rc_queue);
+	q_item = g_queue_peek_head(&call->rc_queue);
 	g_mutex_unlock(&call->rc_mtx);
 
 	return (q_item != NULL ? q_item->item : NULL);
@@ -2538,7 +7362,7 @@ rpc_call_result_save(rpc_call_t call)
 	struct queue_item *q_item;
 
 	g_mutex_lock(&call->rc_mtx);
-	q_item = g_queue_peek_head(call->rc_queue);
+	q_item = g_queue_peek_head(&call->rc_queue);
 	if (q_item != NULL)
 		rpc_retain(q_item->item);
 	g_mutex_unlock(&call->rc_mtx);
@@ -2551,21 +7375,37 @@ rpc_call_free(rpc_call_t call)
 {
 	rpc_connection_t conn = call->rc_conn;
 	struct queue_item *q_item;
+	GSList *thens;
+	int64_t charged = 0;
 
 	rpc_connection_retain(conn);
+	if (call->rc_flight != NULL)
+		rpc_flight_leave(call);
 
 	g_mutex_lock(&call->rc_mtx);
 	cancel_timeout_locked(call);
-	while (!g_queue_is_empty(call->rc_queue)) {
-		q_item = g_queue_pop_head(call->rc_queue);
+	while (!g_queue_is_empty(&call->rc_queue)) {
+		q_item = g_queue_pop_head(&call->rc_queue);
+		charged += q_item->charged;
 		rpc_release(q_item->item);
 		g_free(q_item);
 	}
+
+	/* Continuations of a call that never finished will not run */
+	thens = g_slist_concat(call->rc_thens, call->rc_waiters);
+	call->rc_thens = NULL;
+	call->rc_waiters = NULL;
 	g_mutex_unlock(&call->rc_mtx);
 
+	g_slist_free_full(thens, rpc_call_drop_then);
+
+	if (charged > 0) {
+		rpc_fragment_charge(conn, -charged);
+		rpc_fragment_resume();
+	}
+
 	g_rw_lock_writer_lock(&conn->rco_call_rwlock);
-	g_hash_table_remove(conn->rco_calls,
-	    (gpointer)rpc_string_get_string_ptr(call->rc_id));
+	g_hash_table_remove(conn->rco_calls, call->rc_id);
 	g_rw_lock_writer_unlock(&conn->rco_call_rwlock);
 
 	rpc_connection_call_release(call);
@@ -0,0 +1,336 @@
+/*
+ * Copyright 2015-2017 Two Pore Guys, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <string.h>
+#include <glib.h>
+#include <rpc/object.h>
+#include "internal.h"
+
+static int rpc_dict_find(struct rpc_dict *, const char *, guint *);
+static void rpc_dict_index_insert(struct rpc_dict *, uint32_t);
+static void rpc_dict_resize(struct rpc_dict *, uint32_t);
+
+struct rpc_dict *
+rpc_dict_new(size_t hint)
+{
+	struct rpc_dict *dict;
+
+	dict = g_malloc0(sizeof(*dict));
+	dict->rd_shares = 1;
+	if (hint > 0)
+		rpc_dict_resize(dict, (uint32_t)MAX(hint, RPC_DICT_MIN_CAPACITY));
+
+	return (dict);
+}
+
+void
+rpc_dict_free(struct rpc_dict *dict)
+{
+
+	rpc_dict_remove_all(dict);
+	g_free(dict->rd_entries);
+	g_free(dict->rd_index);
+	g_free(dict);
+}
+
+/*
+ * Tables are shared between a dictionary and its copies until one of
+ * them writes; see rpc_copy().
+ */
+struct rpc_dict *
+rpc_dict_retain(struct rpc_dict *dict)
+{
+
+	g_atomic_int_inc(&dict->rd_shares);
+	return (dict);
+}
+
+void
+rpc_dict_release(struct rpc_dict *dict)
+{
+
+	if (g_atomic_int_dec_and_test(&dict->rd_shares))
+		rpc_dict_free(dict);
+}
+
+static int
+rpc_dict_find(struct rpc_dict *dict, const char *key, guint *hashp)
+{
+	struct rpc_dict_entry *e;
+	uint32_t mask;
+	uint32_t slot;
+	uint32_t i;
+	guint hash;
+
+	if (dict->rd_index == NULL) {
+		/* Small dictionary: plain linear scan, no hashing at all */
+		for (i = 0; i < dict->rd_used; i++) {
+			e = &dict->rd_entries[i];
+			if (e->rde_value == NULL)
+				continue;
+
+			if (e->rde_key == key || strcmp(e->rde_key, key) == 0)
+				return ((int)i);
+		}
+
+		return (-1);
+	}
+
+	hash = rpc_atom_str_hash(key);
+	mask = dict->rd_index_size - 1;
+
+	if (hashp != NULL)
+		*hashp = hash;
+
+	for (slot = hash & mask;; slot = (slot + 1) & mask) {
+		i = dict->rd_index[slot];
+		if (i == 0)
+			return (-1);
+
+		/* Slots pointing to removed entries work as tombstones */
+		e = &dict->rd_entries[i - 1];
+		if (e->rde_value == NULL || e->rde_hash != hash)
+			continue;
+
+		if (e->rde_key == key || strcmp(e->rde_key, key) == 0)
+			return ((int)(i - 1));
+	}
+}
+
+static void
+rpc_dict_index_insert(struct rpc_dict *dict, uint32_t idx)
+{
+	uint32_t mask = dict->rd_index_size - 1;
+	uint32_t slot;
+
+	slot = dict->rd_entries[idx].rde_hash & mask;
+	while (dict->rd_index[slot] != 0)
+		slot = (slot + 1) & mask;
+
+	dict->rd_index[slot] = idx + 1;
+}
+
+static void
+rpc_dict_resize(struct rpc_dict *dict, uint32_t capacity)
+{
+	struct rpc_dict_entry *entries;
+	uint32_t i;
+	uint32_t n = 0;
+
+	entries = g_malloc_n(capacity, sizeof(*entries));
+
+	/* Compact live entries, preserving insertion order */
+	for (i = 0; i < dict->rd_used; i++) {
+		if (dict->rd_entries[i].rde_value != NULL)
+			entries[n++] = dict->rd_entries[i];
+	}
+
+	g_free(dict->rd_entries);
+	dict->rd_entries = entries;
+	dict->rd_capacity = capacity;
+	dict->rd_used = n;
+
+	g_free(dict->rd_index);
+	dict->rd_index = NULL;
+	dict->rd_index_size = 0;
+
+	if (capacity <= RPC_DICT_LINEAR_MAX)
+		return;
+
+	/* Keep the index at most half full, tombstones included */
+	dict->rd_index_size = 1;
+	while (dict->rd_index_size < capacity * 2)
+		dict->rd_index_size <<= 1;
+
+	dict->rd_index = g_malloc0_n(dict->rd_index_size, sizeof(uint32_t));
+	for (i = 0; i < n; i++) {
+		entries[i].rde_hash = rpc_atom_str_hash(entries[i].rde_key);
+		rpc_dict_index_insert(dict, i);
+	}
+}
+
+rpc_object_t
+rpc_dict_lookup(struct rpc_dict *dict, const char *key)
+{
+	int idx;
+
+	idx = rpc_dict_find(dict, key, NULL);
+	if (idx < 0)
+		return (NULL);
+
+	return (dict->rd_entries[idx].rde_value);
+}
+
+void
+rpc_dict_insert(struct rpc_dict *dict, const char *key, rpc_object_t value)
+{
+	struct rpc_dict_entry *e;
+	rpc_object_t old;
+	guint hash = 0;
+	int idx;
+
+	idx = rpc_dict_find(dict, key, &hash);
+	if (idx >= 0) {
+		e = &dict->rd_entries[idx];
+		old = e->rde_value;
+		e->rde_value = value;
+		rpc_release_impl(old);
+		return;
+	}
+
+	if (dict->rd_used == dict->rd_capacity) {
+		if (dict->rd_capacity == 0)
+			rpc_dict_resize(dict, RPC_DICT_MIN_CAPACITY);
+		else if (dict->rd_count <= dict->rd_capacity / 2)
+			rpc_dict_resize(dict, dict->rd_capacity);
+		else
+			rpc_dict_resize(dict, dict->rd_capacity * 2);
+
+		/* The index may have just been created */
+		if (dict->rd_index != NULL)
+			hash = rpc_atom_str_hash(key);
+	}
+
+	e = &dict->rd_entries[dict->rd_used];
+	e->rde_key = rpc_atom_strdup(key);
+	e->rde_value = value;
+	e->rde_hash = hash;
+
+	if (dict->rd_index != NULL)
+		rpc_dict_index_insert(dict, dict->rd_used);
+
+	dict->rd_used++;
+	dict->rd_count++;
+}
+
+bool
+rpc_dict_remove(struct rpc_dict *dict, const char *key)
+{
+	struct rpc_dict_entry *e;
+	rpc_object_t old;
+	int idx;
+
+	idx = rpc_dict_find(dict, key, NULL);
+	if (idx < 0)
+		return (false);
+
+	e = &dict->rd_entries[idx];
+	old = e->rde_value;
+	rpc_atom_str_free(e->rde_key);
+	e->rde_key = NULL;
+	e->rde_value = NULL;
+	dict->rd_count--;
+
+	if (dict->rd_count == 0) {
+		dict->rd_used = 0;
+		if (dict->rd_index != NULL) {
+			memset(dict->rd_index, 0,
+			    dict->rd_index_size * sizeof(uint32_t));
+		}
+	} else if (dict->rd_index == NULL && (uint32_t)idx == dict->rd_used - 1)
+		dict->rd_used--;
+
+	rpc_release_impl(old);
+	return (true);
+}
+
+void
+rpc_dict_remove_all(struct rpc_dict *dict)
+{
+	struct rpc_dict_entry *entries = dict->rd_entries;
+	struct rpc_dict_entry *e;
+	uint32_t i;
+	uint32_t used = dict->rd_used;
+
+	/*
+	 * Take the entries away first: releasing values may re-enter the
+	 * dictionary, and whatever gets inserted then goes to a new table.
+	 */
+	dict->rd_entries = NULL;
+	dict->rd_used = 0;
+	dict->rd_count = 0;
+	dict->rd_capacity = 0;
+	g_free(dict->rd_index);
+	dict->rd_index = NULL;
+	dict->rd_index_size = 0;
+
+	for (i = 0; i < used; i++) {
+		e = &entries[i];
+		if (e->rde_value == NULL)
+			continue;
+
+		rpc_atom_str_free(e->rde_key);
+		rpc_release_impl(e->rde_value);
+	}
+
+	g_free(entries);
+}
+
+struct rpc_dict_entry *
+rpc_dict_next(struct rpc_dict *dict, size_t *pos)
+{
+	struct rpc_dict_entry *e;
+
+	while (*pos < dict->rd_used) {
+		e = &dict->rd_entries[(*pos)++];
+		if (e->rde_value != NULL)
+			return (e);
+	}
+
+	return (NULL);
+}
+
+struct rpc_dict *
+rpc_dict_copy(struct rpc_dict *dict, rpc_object_t (*copy_fn)(rpc_object_t))
+{
+	struct rpc_dict *result;
+	struct rpc_dict_entry *e;
+	size_t pos = 0;
+
+	result = rpc_dict_new(dict->rd_count);
+	while ((e = rpc_dict_next(dict, &pos)) != NULL) {
+		result->rd_entries[result->rd_used] = (struct rpc_dict_entry){
+			.rde_key = rpc_atom_strdup(e->rde_key),
+			.rde_value = copy_fn(e->rde_value),
+			.rde_hash = e->rde_hash
+		};
+
+		if (result->rd_index != NULL) {
+			if (dict->rd_index == NULL) {
+				result->rd_entries[result->rd_used].rde_hash =
+				    rpc_atom_str_hash(e->rde_key);
+			}
+
+			rpc_dict_index_insert(result, result->rd_used);
+		}
+
+		result->rd_used++;
+		result->rd_count++;
+	}
+
+	return (result);
+}
@@ -0,0 +1,323 @@
+/*
+ * Copyright 2015-2017 Two Pore Guys, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Event ring: a memory file a server connection writes the event frames
+ * its local client subscribed to into, for the client to read in place
+ * instead of getting them over the socket.
+ *
+ * There is a single writer and any number of readers, none of which the
+ * writer waits for. Records are a length word followed by the frame and
+ * may wrap around the end of the data area. The writer bumps "reserve"
+ * before overwriting anything and "head" once a record is complete; a
+ * reader that finds "reserve" past its position by more than the ring
+ * size has been lapped and skips ahead, counting what it lost.
+ *
+ * Streaming calls use the same layout with a single reader that must not
+ * lose anything: the reader publishes its position in "tail" and the
+ * writer only puts records that fit in front of it.
+ *
+ * The writer keeps its own position in private memory and only publishes
+ * it in the header, so nothing a reader scribbles into the mapping can
+ * make it write out of place. Rings created sealed can't be mapped
+ * writable by anyone but the writer.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <rpc/object.h>
+#include "internal.h"
+#include "memfd.h"
+
+#define	RPC_EVENT_RING_MAGIC	0x52455652
+#define	RPC_EVENT_RING_VERSION	1
+#define	RPC_EVENT_RING_HDR	64
+#define	RPC_EVENT_RING_MIN	(64 * 1024)
+
+struct rpc_event_ring_header
+{
+	uint32_t		rerh_magic;
+	uint32_t		rerh_version;
+	uint64_t		rerh_size;
+	uint64_t		rerh_reserve;
+	uint64_t		rerh_head;
+	uint64_t		rerh_tail;
+};
+
+struct rpc_event_ring_record
+{
+	uint32_t		rerr_len;
+	uint32_t		rerr_reserved;
+};
+
+struct rpc_event_ring
+{
+	rpc_object_t		rer_shmem;
+	struct rpc_event_ring_header *rer_header;
+	char *			rer_data;
+	size_t			rer_size;
+	GMutex			rer_mtx;
+	uint64_t		rer_head;
+	uint64_t		rer_tail;
+	uint64_t		rer_dropped;
+};
+
+static void rpc_event_ring_copy_in(struct rpc_event_ring *, uint64_t,
+    const void *, size_t);
+static void rpc_event_ring_copy_out(struct rpc_event_ring *, uint64_t,
+    void *, size_t);
+
+static void
+rpc_event_ring_copy_in(struct rpc_event_ring *ring, uint64_t pos,
+    const void *buf, size_t len)
+{
+	size_t offset = (size_t)(pos % ring->rer_size);
+	size_t chunk = MIN(len, ring->rer_size - offset);
+
+	memcpy(ring->rer_data + offset, buf, chunk);
+	memcpy(ring->rer_data, (const char *)buf + chunk, len - chunk);
+}
+
+static void
+rpc_event_ring_copy_out(struct rpc_event_ring *ring, uint64_t pos, void *buf,
+    size_t len)
+{
+	size_t offset = (size_t)(pos % ring->rer_size);
+	size_t chunk = MIN(len, ring->rer_size - offset);
+
+	memcpy(buf, ring->rer_data + offset, chunk);
+	memcpy((char *)buf + chunk, ring->rer_data, len - chunk);
+}
+
+/*
+ * With @p sealed set, the file is sealed against writes once the writer
+ * has mapped it, so readers can only ever map it read-only. Streaming
+ * rings leave it open: their reader publishes its position in "tail".
+ */
+struct rpc_event_ring *
+rpc_event_ring_create(size_t size, bool sealed)
+{
+	struct rpc_event_ring *ring;
+	rpc_object_t shmem;
+
+	size = MAX(size, RPC_EVENT_RING_MIN);
+	shmem = rpc_shmem_create_ex(size + RPC_EVENT_RING_HDR,
+	    RPC_SHMEM_SEALABLE);
+	if (shmem == NULL)
+		return (NULL);
+
+	ring = g_malloc0(sizeof(*ring));
+	ring->rer_shmem = shmem;
+	ring->rer_header = rpc_shmem_map(shmem);
+	ring->rer_data = (char *)ring->rer_header + RPC_EVENT_RING_HDR;
+	ring->rer_size = size;
+	g_mutex_init(&ring->rer_mtx);
+
+	ring->rer_header->rerh_version = RPC_EVENT_RING_VERSION;
+	ring->rer_header->rerh_size = size;
+	__atomic_store_n(&ring->rer_header->rerh_magic, RPC_EVENT_RING_MAGIC,
+	    __ATOMIC_RELEASE);
+
+	if (sealed && fcntl(rpc_shmem_get_fd(shmem), F_ADD_SEALS,
+	    F_SEAL_FUTURE_WRITE) != 0) {
+		rpc_set_last_errorf(errno, "Cannot seal event ring: %s",
+		    g_strerror(errno));
+		rpc_event_ring_free(ring);
+		return (NULL);
+	}
+
+	return (ring);
+}
+
+struct rpc_event_ring *
+rpc_event_ring_open(rpc_object_t shmem, uint64_t start)
+{
+	struct rpc_event_ring *ring;
+	struct rpc_event_ring_header *header;
+	size_t size;
+
+	if (rpc_get_type(shmem) != RPC_TYPE_SHMEM ||
+	    rpc_shmem_get_size(shmem) < RPC_EVENT_RING_HDR) {
+		rpc_set_last_error(EINVAL, "Not an event ring", NULL);
+		return (NULL);
+	}
+
+	header = rpc_shmem_map(shmem);
+	size = rpc_shmem_get_size(shmem) - RPC_EVENT_RING_HDR;
+	if (__atomic_load_n(&header->rerh_magic, __ATOMIC_ACQUIRE) !=
+	    RPC_EVENT_RING_MAGIC ||
+	    header->rerh_version != RPC_EVENT_RING_VERSION ||
+	    header->rerh_size == 0 || header->rerh_size > size) {
+		rpc_shmem_unmap(shmem, header);
+		rpc_set_last_error(EINVAL, "Not an event ring", NULL);
+		return (NULL);
+	}
+
+	ring = g_malloc0(sizeof(*ring));
+	ring->rer_shmem = rpc_retain(shmem);
+	ring->rer_header = header;
+	ring->rer_data = (char *)header + RPC_EVENT_RING_HDR;
+	ring->rer_size = (size_t)header->rerh_size;
+	ring->rer_tail = start;
+	g_mutex_init(&ring->rer_mtx);
+	return (ring);
+}
+
+void
+rpc_event_ring_free(struct rpc_event_ring *ring)
+{
+
+	if (ring == NULL)
+		return;
+
+	rpc_shmem_unmap(ring->rer_shmem, ring->rer_header);
+	rpc_release(ring->rer_shmem);
+	g_mutex_clear(&ring->rer_mtx);
+	g_free(ring);
+}
+
+rpc_object_t
+rpc_event_ring_get_shmem(struct rpc_event_ring *ring)
+{
+
+	return (ring->rer_shmem);
+}
+
+uint64_t
+rpc_event_ring_get_head(struct rpc_event_ring *ring)
+{
+
+	return (__atomic_load_n(&ring->rer_header->rerh_head,
+	    __ATOMIC_ACQUIRE));
+}
+
+uint64_t
+rpc_event_ring_get_dropped(struct rpc_event_ring *ring)
+{
+
+	return (ring->rer_dropped);
+}
+
+int64_t
+rpc_event_ring_write(struct rpc_event_ring *ring, const void *buf, size_t len)
+{
+	struct rpc_event_ring_header *header = ring->rer_header;
+	struct rpc_event_ring_record rec = { .rerr_len = (uint32_t)len };
+	uint64_t head;
+
+	/* Keep records small enough that readers see several of them */
+	if (len > ring->rer_size / 4)
+		return (-1);
+
+	g_mutex_lock(&ring->rer_mtx);
+	head = ring->rer_head;
+	__atomic_store_n(&header->rerh_reserve, head + sizeof(rec) + len,
+	    __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	rpc_event_ring_copy_in(ring, head, &rec, sizeof(rec));
+	rpc_event_ring_copy_in(ring, head + sizeof(rec), buf, len);
+	ring->rer_head = head + sizeof(rec) + len;
+	__atomic_store_n(&header->rerh_head, ring->rer_head, __ATOMIC_RELEASE);
+	g_mutex_unlock(&ring->rer_mtx);
+
+	return ((int64_t)head);
+}
+
+int64_t
+rpc_event_ring_put(struct rpc_event_ring *ring, const void *buf, size_t len)
+{
+	struct rpc_event_ring_header *header = ring->rer_header;
+	uint64_t head;
+	uint64_t tail;
+
+	/* There's only one writer, so the room can't shrink meanwhile */
+	head = ring->rer_head;
+	tail = __atomic_load_n(&header->rerh_tail, __ATOMIC_ACQUIRE);
+	if (head - tail > ring->rer_size || ring->rer_size - (head - tail) <
+	    sizeof(struct rpc_event_ring_record) + len)
+		return (-1);
+
+	return (rpc_event_ring_write(ring, buf, len));
+}
+
+void
+rpc_event_ring_commit(struct rpc_event_ring *ring)
+{
+
+	__atomic_store_n(&ring->rer_header->rerh_tail, ring->rer_tail,
+	    __ATOMIC_RELEASE);
+}
+
+GBytes *
+rpc_event_ring_read(struct rpc_event_ring *ring)
+{
+	struct rpc_event_ring_header *header = ring->rer_header;
+	struct rpc_event_ring_record rec;
+	uint64_t head;
+	uint64_t reserve;
+	void *buf;
+
+	for (;;) {
+		head = __atomic_load_n(&header->rerh_head, __ATOMIC_ACQUIRE);
+		if (head - ring->rer_tail < sizeof(rec))
+			return (NULL);
+
+		if (head - ring->rer_tail > ring->rer_size)
+			goto lapped;
+
+		rpc_event_ring_copy_out(ring, ring->rer_tail, &rec,
+		    sizeof(rec));
+		if (rec.rerr_len > ring->rer_size / 4 ||
+		    head - ring->rer_tail - sizeof(rec) < rec.rerr_len)
+			goto lapped;
+
+		buf = g_malloc(rec.rerr_len);
+		rpc_event_ring_copy_out(ring, ring->rer_tail + sizeof(rec),
+		    buf, rec.rerr_len);
+
+		/* The copy only counts if the writer didn't catch up with it */
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		reserve = __atomic_load_n(&header->rerh_reserve,
+		    __ATOMIC_RELAXED);
+		if (reserve - ring->rer_tail > ring->rer_size) {
+			g_free(buf);
+			goto lapped;
+		}
+
+		ring->rer_tail += sizeof(rec) + rec.rerr_len;
+		return (g_bytes_new_take(buf, rec.rerr_len));
+
+lapped:
+		ring->rer_dropped++;
+		ring->rer_tail = __atomic_load_n(&header->rerh_head,
+		    __ATOMIC_ACQUIRE);
+	}
+}
@@ -0,0 +1,628 @@
+/*
+ * Copyright 2015-2017 Two Pore Guys, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Server handoff: a process on its way out passes its listening sockets,
+ * and optionally its idle connections, to the process replacing it.
+ *
+ * The two talk over a unix stream socket. Every record is a two-word
+ * header, with the payload length and the number of descriptors, sent
+ * together with the descriptors, followed by a msgpack dictionary. A
+ * "server" record carries the listening sockets of one server, each
+ * "connection" record one connected socket of the server at index
+ * "server", and an "end" record closes the stream.
+ *
+ * Whoever is on the other end gets live sockets, so both sides insist on
+ * a peer running as the same user. The receiving socket is bound in a
+ * private directory and only moved to its path once it is mode 0600.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <glib.h>
+#include <rpc/object.h>
+#include <rpc/serializer.h>
+#include <rpc/server.h>
+#include "internal.h"
+#include "thread.h"
+
+#define	RPC_HANDOFF_MAX_FDS	64
+#define	RPC_HANDOFF_MAX_RECORD	(1024 * 1024)
+
+static int rpc_handoff_address(const char *, struct sockaddr_un *);
+static int rpc_handoff_check_peer(int);
+static int rpc_handoff_listen(const char *);
+static int rpc_handoff_write(int, const void *, size_t);
+static int rpc_handoff_read(int, void *, size_t);
+static int rpc_handoff_send(int, rpc_object_t, const int *, size_t);
+static rpc_object_t rpc_handoff_recv(int, int *, size_t *);
+static int rpc_handoff_server(int, rpc_server_t, size_t, bool);
+static void rpc_handoff_close_fds(const int *, size_t);
+
+static int
+rpc_handoff_address(const char *path, struct sockaddr_un *sun)
+{
+
+	memset(sun, 0, sizeof(*sun));
+	sun->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(sun->sun_path)) {
+		rpc_set_last_error(ENAMETOOLONG, "Handoff path too long",
+		    NULL);
+		return (-1);
+	}
+
+	strcpy(sun->sun_path, path);
+	return (0);
+}
+
+static int
+rpc_handoff_check_peer(int sock)
+{
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0) {
+		rpc_set_last_errorf(errno, "Cannot get handoff peer: %s",
+		    strerror(errno));
+		return (-1);
+	}
+
+	if (cred.uid != geteuid()) {
+		rpc_set_last_errorf(EPERM,
+		    "Handoff peer %d runs as user %u", (int)cred.pid,
+		    (unsigned int)cred.uid);
+		return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * Binds the handoff socket in a fresh 0700 directory next to @p path,
+ * so nobody can connect before it is mode 0600, then renames it into
+ * place.
+ */
+static int
+rpc_handoff_listen(const char *path)
+{
+	struct sockaddr_un sun;
+	g_autofree char *dir = g_strdup_printf("%s.XXXXXX", path);
+	g_autofree char *tmp = NULL;
+	int listener;
+
+	if (g_mkdtemp_full(dir, 0700) == NULL) {
+		rpc_set_last_errorf(errno, "Cannot create directory for %s: %s",
+		    path, strerror(errno));
+		return (-1);
+	}
+
+	tmp = g_build_filename(dir, "handoff", NULL);
+	if (rpc_handoff_address(tmp, &sun) != 0) {
+		rmdir(dir);
+		return (-1);
+	}
+
+	listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (listener < 0) {
+		rpc_set_last_errorf(errno, "Cannot create socket: %s",
+		    strerror(errno));
+		rmdir(dir);
+		return (-1);
+	}
+
+	if (bind(listener, (struct sockaddr *)&sun, sizeof(sun)) != 0 ||
+	    chmod(tmp, 0600) != 0 || listen(listener, 1) != 0 ||
+	    rename(tmp, path) != 0) {
+		rpc_set_last_errorf(errno, "Cannot listen on %s: %s", path,
+		    strerror(errno));
+		close(listener);
+		unlink(tmp);
+		rmdir(dir);
+		return (-1);
+	}
+
+	rmdir(dir);
+	return (listener);
+}
+
+static int
+rpc_handoff_write(int sock, const void *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = send(sock, buf, len, MSG_NOSIGNAL);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+
+			rpc_set_last_errorf(errno, "Handoff write failed: %s",
+			    strerror(errno));
+			return (-1);
+		}
+
+		buf = (const char *)buf + ret;
+		len -= (size_t)ret;
+	}
+
+	return (0);
+}
+
+static int
+rpc_handoff_read(int sock, void *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = recv(sock, buf, len, 0);
+		if (ret < 0 && errno == EINTR)
+			continue;
+
+		if (ret <= 0) {
+			rpc_set_last_errorf(ret < 0 ? errno : ECONNRESET,
+			    "Handoff read failed: %s",
+			    ret < 0 ? strerror(errno) : "connection closed");
+			return (-1);
+		}
+
+		buf = (char *)buf + ret;
+		len -= (size_t)ret;
+	}
+
+	return (0);
+}
+
+/*
+ * Sends one record. The descriptors travel with the header, which is
+ * small enough to always leave in one piece; the payload follows.
+ */
+static int
+rpc_handoff_send(int sock, rpc_object_t record, const int *fds, size_t nfds)
+{
+	struct msghdr msg = { 0 };
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int) * RPC_HANDOFF_MAX_FDS)];
+	} control;
+	uint32_t header[2];
+	void *frame;
+	size_t len;
+	ssize_t ret;
+
+	g_assert(nfds <= RPC_HANDOFF_MAX_FDS);
+
+	if (rpc_serializer_dump("msgpack", record, &frame, &len) != 0)
+		return (-1);
+
+	header[0] = (uint32_t)len;
+	header[1] = (uint32_t)nfds;
+	iov.iov_base = header;
+	iov.iov_len = sizeof(header);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	if (nfds > 0) {
+		memset(&control, 0, sizeof(control));
+		msg.msg_control = control.buf;
+		msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+		memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+	}
+
+	do
+		ret = sendmsg(sock, &msg, MSG_NOSIGNAL);
+	while (ret < 0 && errno == EINTR);
+
+	if (ret != (ssize_t)sizeof(header)) {
+		rpc_set_last_errorf(ret < 0 ? errno : EIO,
+		    "Cannot send handoff record: %s",
+		    ret < 0 ? strerror(errno) : "short write");
+		free(frame);
+		return (-1);
+	}
+
+	ret = rpc_handoff_write(sock, frame, len);
+	free(frame);
+	return ((int)ret);
+}
+
+/*
+ * Receives one record into @p fds, which has room for
+ * RPC_HANDOFF_MAX_FDS descriptors.
+ */
+static rpc_object_t
+rpc_handoff_recv(int sock, int *fds, size_t *nfds)
+{
+	struct msghdr msg = { 0 };
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int) * RPC_HANDOFF_MAX_FDS)];
+	} control;
+	rpc_object_t record;
+	uint32_t header[2];
+	void *frame;
+	ssize_t ret;
+
+	*nfds = 0;
+	iov.iov_base = header;
+	iov.iov_len = sizeof(header);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	do
+		ret = recvmsg(sock, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+	while (ret < 0 && errno == EINTR);
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); ret > 0 && cmsg != NULL;
+	    cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET ||
+		    cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+
+		*nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		memcpy(fds, CMSG_DATA(cmsg), *nfds * sizeof(int));
+	}
+
+	if (ret != (ssize_t)sizeof(header) || (msg.msg_flags & MSG_CTRUNC)) {
+		rpc_set_last_errorf(ret < 0 ? errno : EIO,
+		    "Cannot receive handoff record: %s",
+		    ret < 0 ? strerror(errno) : "truncated");
+		goto fail;
+	}
+
+	if (header[0] > RPC_HANDOFF_MAX_RECORD || header[1] != *nfds) {
+		rpc_set_last_error(EINVAL, "Malformed handoff record", NULL);
+		goto fail;
+	}
+
+	frame = g_malloc(header[0]);
+	if (rpc_handoff_read(sock, frame, header[0]) != 0) {
+		g_free(frame);
+		goto fail;
+	}
+
+	record = rpc_serializer_load("msgpack", frame, header[0]);
+	g_free(frame);
+	if (record == NULL || rpc_get_type(record) != RPC_TYPE_DICTIONARY) {
+		rpc_set_last_error(EINVAL, "Malformed handoff record", NULL);
+		rpc_release(record);
+		goto fail;
+	}
+
+	return (record);
+
+fail:
+	rpc_handoff_close_fds(fds, *nfds);
+	*nfds = 0;
+	return (NULL);
+}
+
+static void
+rpc_handoff_close_fds(const int *fds, size_t nfds)
+{
+	size_t i;
+
+	for (i = 0; i < nfds; i++)
+		close(fds[i]);
+}
+
+/*
+ * Sends the listening sockets of @p server, then the connections that
+ * can move along. A connection is looked at again right before and
+ * after it is detached: one that got busy before stays behind, one that
+ * got busy in between has lost its reader and is closed, so its client
+ * reconnects to the new owner.
+ */
+static int
+rpc_handoff_server(int sock, rpc_server_t server, size_t index,
+    bool connections)
+{
+	rpc_connection_t conn;
+	rpc_object_t record;
+	rpc_object_t subscriptions;
+	GPtrArray *idle;
+	GList *iter;
+	void *pending;
+	size_t pending_len;
+	size_t nfds;
+	int *fds;
+	int ret;
+	int fd;
+	guint i;
+
+	if (server->rs_get_listen_fds == NULL) {
+		rpc_set_last_error(ENOTSUP,
+		    "Transport can't hand over its sockets", NULL);
+		return (-1);
+	}
+
+	if (server->rs_get_listen_fds(server, &fds, &nfds) != 0)
+		return (-1);
+
+	g_assert(nfds <= RPC_HANDOFF_MAX_FDS);
+	record = rpc_object_pack("{s,s}",
+	    "kind", "server",
+	    "uri", server->rs_uri);
+	ret = rpc_handoff_send(sock, record, fds, nfds);
+	rpc_release(record);
+	rpc_handoff_close_fds(fds, nfds);
+	g_free(fds);
+
+	if (ret != 0 || !connections)
+		return (ret);
+
+	idle = g_ptr_array_new();
+	rpc_rw_lock_reader_lock(&server->rs_connections_rwlock,
+	    RPC_LOCK_SERVER_CONNECTIONS);
+	for (iter = server->rs_connections; iter != NULL; iter = iter->next) {
+		conn = iter->data;
+		if (!rpc_connection_is_idle(conn))
+			continue;
+
+		rpc_connection_retain(conn);
+		g_ptr_array_add(idle, conn);
+	}
+	g_rw_lock_reader_unlock(&server->rs_connections_rwlock);
+
+	for (i = 0; i < idle->len; i++) {
+		conn = g_ptr_array_index(idle, i);
+		if (ret != 0) {
+			rpc_connection_release(conn);
+			continue;
+		}
+
+		if (!rpc_connection_is_idle(conn)) {
+			debugf("connection %p got busy, keeping it", conn);
+			rpc_connection_release(conn);
+			continue;
+		}
+
+		subscriptions = rpc_connection_save_subscriptions(conn);
+		fd = rpc_connection_detach(conn, &pending, &pending_len);
+		if (fd < 0) {
+			debugf("connection %p can't be handed over", conn);
+			rpc_release(subscriptions);
+			rpc_connection_release(conn);
+			continue;
+		}
+
+		if (!rpc_connection_is_idle(conn)) {
+			debugf("connection %p got busy while detached", conn);
+			close(fd);
+			g_free(pending);
+			rpc_release(subscriptions);
+			rpc_connection_close(conn);
+			rpc_connection_release(conn);
+			continue;
+		}
+
+		record = rpc_object_pack("{s,u,v,v}",
+		    "kind", "connection",
+		    "server", (uint64_t)index,
+		    "pending", rpc_data_create(pending, pending_len, NULL),
+		    "subscriptions", subscriptions);
+		ret = rpc_handoff_send(sock, record, &fd, 1);
+		rpc_release(record);
+		close(fd);
+		g_free(pending);
+
+		/* The socket stays open, for the new owner */
+		rpc_connection_close(conn);
+		rpc_connection_release(conn);
+	}
+
+	g_ptr_array_free(idle, true);
+	return (ret);
+}
+
+int
+rpc_server_handoff(const char *path, rpc_server_t *servers, size_t count,
+    bool connections)
+{
+	struct sockaddr_un sun;
+	rpc_object_t record;
+	size_t i;
+	int sock;
+	int ret = 0;
+
+	if (rpc_handoff_address(path, &sun) != 0)
+		return (-1);
+
+	sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock < 0) {
+		rpc_set_last_errorf(errno, "Cannot create socket: %s",
+		    strerror(errno));
+		return (-1);
+	}
+
+	if (connect(sock, (struct sockaddr *)&sun, sizeof(sun)) != 0) {
+		rpc_set_last_errorf(errno, "Cannot connect to %s: %s", path,
+		    strerror(errno));
+		close(sock);
+		return (-1);
+	}
+
+	if (rpc_handoff_check_peer(sock) != 0) {
+		close(sock);
+		return (-1);
+	}
+
+	for (i = 0; i < count && ret == 0; i++)
+		ret = rpc_handoff_server(sock, servers[i], i, connections);
+
+	if (ret == 0) {
+		record = rpc_object_pack("{s}", "kind", "end");
+		ret = rpc_handoff_send(sock, record, NULL, 0);
+		rpc_release(record);
+	}
+
+	close(sock);
+	return (ret);
+}
+
+int
+rpc_server_handoff_receive(rpc_context_t context, const char *path,
+    rpc_object_t params, rpc_server_t **servers)
+{
+	rpc_connection_t conn;
+	rpc_server_t server;
+	rpc_object_t record;
+	rpc_object_t args;
+	rpc_object_t listen_fds;
+	GPtrArray *received;
+	const char *kind;
+	const void *pending;
+	size_t pending_len;
+	int fds[RPC_HANDOFF_MAX_FDS];
+	size_t nfds;
+	size_t i;
+	uint64_t index;
+	int listener;
+	int sock;
+	int n = 0;
+
+	*servers = NULL;
+	listener = rpc_handoff_listen(path);
+	if (listener < 0)
+		return (-1);
+
+	/* Someone else got in first; keep waiting for the real sender */
+	for (;;) {
+		sock = accept(listener, NULL, NULL);
+		if (sock < 0 && errno == EINTR)
+			continue;
+
+		if (sock < 0) {
+			rpc_set_last_errorf(errno, "Cannot accept on %s: %s",
+			    path, strerror(errno));
+			break;
+		}
+
+		if (rpc_handoff_check_peer(sock) == 0)
+			break;
+
+		debugf("rejecting handoff peer: %s",
+		    rpc_error_get_message(rpc_get_last_error()));
+		close(sock);
+	}
+
+	close(listener);
+	unlink(path);
+	if (sock < 0)
+		return (-1);
+
+	/* Index by sender; servers that failed to come up stay NULL */
+	received = g_ptr_array_new();
+	for (;;) {
+		record = rpc_handoff_recv(sock, fds, &nfds);
+		if (record == NULL)
+			break;
+
+		kind = rpc_dictionary_get_string(record, "kind");
+		if (g_strcmp0(kind, "end") == 0) {
+			rpc_release(record);
+			break;
+		}
+
+		if (g_strcmp0(kind, "server") == 0) {
+			args = params != NULL &&
+			    rpc_get_type(params) == RPC_TYPE_DICTIONARY ?
+			    rpc_copy(params) : rpc_dictionary_create();
+			listen_fds = rpc_array_create();
+			for (i = 0; i < nfds; i++) {
+				rpc_array_append_stolen_value(listen_fds,
+				    rpc_fd_create(fds[i]));
+			}
+
+			rpc_dictionary_steal_value(args, RPC_SERVER_LISTEN_FD,
+			    listen_fds);
+
+			/* The server keeps pointing at the URI */
+			server = rpc_server_create_ex(g_strdup(
+			    rpc_dictionary_get_string(record, "uri")), context,
+			    args);
+			if (server == NULL) {
+				/*
+				 * The transport may own some descriptors by
+				 * now and closed them; leave the rest be.
+				 */
+				debugf("cannot take over %s",
+				    rpc_dictionary_get_string(record, "uri"));
+				rpc_release(args);
+			}
+
+			g_ptr_array_add(received, server);
+		} else if (g_strcmp0(kind, "connection") == 0 && nfds == 1) {
+			index = rpc_dictionary_get_uint64(record, "server");
+			server = index < received->len ?
+			    g_ptr_array_index(received, index) : NULL;
+			pending = rpc_dictionary_get_data(record, "pending",
+			    &pending_len);
+			conn = server != NULL && server->rs_adopt != NULL ?
+			    server->rs_adopt(server, fds[0], pending,
+			    pending_len) : NULL;
+			if (conn == NULL) {
+				/* The peer will notice and reconnect */
+				close(fds[0]);
+			} else {
+				rpc_connection_restore_subscriptions(conn,
+				    rpc_dictionary_get_value(record,
+				    "subscriptions"));
+			}
+		} else
+			rpc_handoff_close_fds(fds, nfds);
+
+		rpc_release(record);
+	}
+
+	close(sock);
+
+	*servers = g_malloc0(sizeof(rpc_server_t) * MAX(received->len, 1));
+	for (i = 0; i < received->len; i++) {
+		server = g_ptr_array_index(received, i);
+		if (server != NULL)
+			(*servers)[n++] = server;
+	}
+
+	g_ptr_array_free(received, true);
+	return (n);
+}
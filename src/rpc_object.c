@@ -27,6 +27,7 @@
 
 
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #ifndef _WIN32
 #include <sys/mman.h>
@@ -44,6 +45,8 @@
 #include <sys/uio.h>
 #include "serializer/json.h"
 #include "internal.h"
+#include "slab.h"
+#include "thread.h"
 #if defined(__linux__)
 #include "memfd.h"
 #endif
@@ -74,30 +77,239 @@ static struct rpc_object this_null_obj = {
 
 static rpc_object_t this_null = &this_null_obj;
 
+/*
+ * Errors the library itself produces over and over. Its own call sites
+ * go through rpc_error_create_shared(), which hands out a shared frozen
+ * instance of these instead of allocating.
+ */
+static struct rpc_common_error
+{
+	int		code;
+	const char *	msg;
+	rpc_object_t	obj;
+} rpc_common_errors[] = {
+	{ ENOENT, "Method not found" },
+	{ ENOENT, "Member not found" },
+	{ ENOENT, "No valid instance found" },
+	{ ENOENT, "Interface not found" },
+	{ ENOENT, "Property not found" },
+	{ EINVAL, "Invalid arguments passed" },
+	{ ECONNRESET, "Call aborted" },
+	{ ECONNRESET, "Server not active" },
+	{ ETIMEDOUT, "Call timed out" },
+	{ ETIMEDOUT, "Deadline exceeded" },
+	{ EAGAIN, "Server overloaded" },
+};
+
+static volatile gint rpc_error_stacks = 1;
+
+/*
+ * Contents of a large container whose last reference was dropped, on
+ * their way to the reclaimer thread.
+ */
+#define	RPC_RECLAIM_DEFAULT	(64 * 1024)
+
+struct rpc_reclaim_item
+{
+	rpc_type_t		rri_type;
+	GPtrArray *		rri_list;
+	volatile gint *		rri_shares;
+	struct rpc_dict *	rri_dict;
+};
+
+static volatile gsize rpc_reclaim_threshold = RPC_RECLAIM_DEFAULT;
+static GPrivate rpc_reclaim_thread;
+
+/*
+ * Binary objects created by rpc_data_create_file(), so that transports
+ * can hand their bytes to sendfile() rather than copying the mapping.
+ */
+struct rpc_file_range
+{
+	const void *		rfr_ptr;
+	size_t			rfr_length;
+	int			rfr_fd;
+	off_t			rfr_offset;
+};
+
+static GSList *rpc_file_ranges;
+static GMutex rpc_file_ranges_mtx;
+static volatile gint rpc_file_ranges_count;
+
+static bool rpc_array_packable(rpc_type_t);
+static rpc_object_t rpc_error_alloc(int, const char *, rpc_object_t,
+    rpc_object_t);
+static rpc_object_t rpc_error_lookup_common(int, const char *);
+static bool rpc_reclaim_defer(rpc_object_t);
+static size_t rpc_reclaim_estimate(rpc_object_t);
+static size_t rpc_reclaim_children(rpc_object_t);
+static GAsyncQueue *rpc_reclaim_queue(void);
+static gpointer rpc_reclaim_worker(gpointer);
+static void rpc_file_range_remove(struct rpc_file_range *);
+static rpc_object_t rpc_packed_box(struct rpc_packed_array *, size_t);
+static void rpc_packed_free(struct rpc_packed_array *);
+static bool rpc_packed_equal(struct rpc_packed_array *,
+    struct rpc_packed_array *);
+static bool rpc_packed_put(rpc_object_t, size_t, rpc_type_t, const void *);
+static void rpc_array_unpack(rpc_object_t);
+static bool rpc_packed_apply(struct rpc_packed_array *, rpc_array_applier_t,
+    bool);
+static void rpc_object_check_mutable(rpc_object_t);
+static GMutex *rpc_cow_lock(rpc_object_t);
+static bool rpc_object_is_container(rpc_object_t);
+static bool rpc_array_is_leaf(rpc_object_t);
+static bool rpc_dictionary_is_leaf(rpc_object_t);
+static volatile gint *rpc_array_share(rpc_object_t);
+static void rpc_array_store_release(GPtrArray *, volatile gint *);
+static void rpc_array_unshare(rpc_object_t);
+static void rpc_dictionary_unshare(rpc_object_t);
+static void rpc_array_merge(gpointer *, gpointer *, size_t, size_t, size_t,
+    rpc_array_cmp_t);
+
+#define	RPC_COW_LOCKS	64
+
+static GMutex rpc_cow_locks[RPC_COW_LOCKS];
+
 rpc_object_t
 rpc_prim_create(rpc_type_t type, union rpc_value val)
 {
 	struct rpc_object *ro;
+	struct rpc_arena *arena = NULL;
+
+	ro = rpc_arena_alloc(sizeof(*ro), &arena);
+	if (ro == NULL)
+		ro = (rpc_object_t)rpc_slab_alloc(&rpc_object_slab);
 
-	ro = (rpc_object_t)g_malloc0(sizeof(*ro));
 	if (ro == NULL)
 		rpc_abort("malloc() returned NULL");
 
+	ro->ro_arena = arena;
+	ro->ro_ext = NULL;
 	ro->ro_type = type;
 	ro->ro_value = val;
 	ro->ro_refcnt = 1;
 	return (ro);
 }
 
-static size_t
-rpc_data_hash(const uint8_t *data, size_t length)
+/*
+ * Byte hashing follows wyhash: 64-bit multiply-and-fold mixing of
+ * input words, three independent lanes over long inputs. It goes at
+ * about memory speed without any vector code.
+ */
+#define	RPC_HASH_P0	0xa0761d6478bd642full
+#define	RPC_HASH_P1	0xe7037ed1a0b428dbull
+#define	RPC_HASH_P2	0x8ebc6af09c88c6e3ull
+#define	RPC_HASH_P3	0x589965cc75374cc3ull
+
+static inline uint64_t
+rpc_hash_mix(uint64_t a, uint64_t b)
+{
+#if defined(__SIZEOF_INT128__)
+	__uint128_t r = (__uint128_t)a * b;
+
+	return ((uint64_t)r ^ (uint64_t)(r >> 64));
+#else
+	uint64_t ha = a >> 32, la = (uint32_t)a;
+	uint64_t hb = b >> 32, lb = (uint32_t)b;
+	uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+	uint64_t t = rl + (rm0 << 32);
+	uint64_t lo = t + (rm1 << 32);
+	uint64_t hi = rh + (rm0 >> 32) + (rm1 >> 32) + (t < rl) + (lo < t);
+
+	return (lo ^ hi);
+#endif
+}
+
+static inline uint64_t
+rpc_hash_read64(const uint8_t *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return (v);
+}
+
+static inline uint64_t
+rpc_hash_read32(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return (v);
+}
+
+static uint64_t
+rpc_hash_bytes(const void *data, size_t len, uint64_t seed)
+{
+	const uint8_t *p = data;
+	uint64_t see1;
+	uint64_t see2;
+	uint64_t a;
+	uint64_t b;
+	size_t i = len;
+
+	seed ^= rpc_hash_mix(seed ^ RPC_HASH_P0, RPC_HASH_P1);
+	if (len <= 16) {
+		if (len >= 4) {
+			a = (rpc_hash_read32(p) << 32) |
+			    rpc_hash_read32(p + ((len >> 3) << 2));
+			b = (rpc_hash_read32(p + len - 4) << 32) |
+			    rpc_hash_read32(p + len - 4 - ((len >> 3) << 2));
+		} else if (len > 0) {
+			a = ((uint64_t)p[0] << 16) |
+			    ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+			b = 0;
+		} else
+			a = b = 0;
+	} else {
+		if (i >= 48) {
+			see1 = seed;
+			see2 = seed;
+			do {
+				seed = rpc_hash_mix(
+				    rpc_hash_read64(p) ^ RPC_HASH_P1,
+				    rpc_hash_read64(p + 8) ^ seed);
+				see1 = rpc_hash_mix(
+				    rpc_hash_read64(p + 16) ^ RPC_HASH_P2,
+				    rpc_hash_read64(p + 24) ^ see1);
+				see2 = rpc_hash_mix(
+				    rpc_hash_read64(p + 32) ^ RPC_HASH_P3,
+				    rpc_hash_read64(p + 40) ^ see2);
+				p += 48;
+				i -= 48;
+			} while (i >= 48);
+			seed ^= see1 ^ see2;
+		}
+
+		while (i > 16) {
+			seed = rpc_hash_mix(rpc_hash_read64(p) ^ RPC_HASH_P1,
+			    rpc_hash_read64(p + 8) ^ seed);
+			p += 16;
+			i -= 16;
+		}
+
+		a = rpc_hash_read64(p + i - 16);
+		b = rpc_hash_read64(p + i - 8);
+	}
+
+	a ^= RPC_HASH_P1;
+	b ^= seed;
+	return (rpc_hash_mix(rpc_hash_mix(a, b) ^ RPC_HASH_P0 ^ len,
+	    b ^ RPC_HASH_P1));
+}
+
+/*
+ * Unseeded, numbers hash to their value, which rpc_cmp() and the
+ * query operators built on it depend on.
+ */
+static inline uint64_t
+rpc_hash_scalar(uint64_t value, uint64_t seed)
 {
-	size_t hash = 5381;
 
-	while (length--)
-		hash = ((hash << 5) + hash) + data[length];
+	if (seed == 0)
+		return (value);
 
-	return (hash);
+	return (rpc_hash_mix(value ^ RPC_HASH_P0, seed ^ RPC_HASH_P1));
 }
 
 static void
@@ -107,6 +319,7 @@ rpc_create_description(GString *description, rpc_object_t object,
 	unsigned int local_indent_lvl = indent_lvl + 1;
 	size_t data_length, i;
 	uint8_t *data_ptr;
+	GDateTime *datetime;
 	char *str_date;
 
 	if ((indent_lvl > 0) && (!nested))
@@ -163,9 +376,11 @@ rpc_create_description(GString *description, rpc_object_t object,
 		break;
 
 	case RPC_TYPE_DATE:
-		str_date = g_date_time_format(object->ro_value.rv_datetime,
-		    "%F %T");
+		datetime = g_date_time_new_from_unix_utc(
+		    rpc_date_get_value(object));
+		str_date = g_date_time_format(datetime, "%F %T");
 		g_string_append(description, str_date);
+		g_date_time_unref(datetime);
 		g_free(str_date);
 		break;
 
@@ -257,201 +472,6 @@ rpc_create_description(GString *description, rpc_object_t object,
 		g_string_append(description, "\n");
 }
 
-static int
-rpc_object_unpack_layer(rpc_object_t branch, const char *fmt, int fmt_cnt,
-    int *cnt, va_list ap)
-{
-	rpc_object_t array = NULL;
-	rpc_object_t dictionary = NULL;
-	rpc_object_t current = branch;
-	const char *search_ptr;
-	const char *comma_ptr;
-	const char *colon_ptr;
-	char *idx_end_ptr;
-	char *key;
-	char delim;
-	int i = 0;
-	char ch;
-	bool is_container;
-	size_t idx = 0;
-
-	if (branch == NULL)
-		return (-1);
-
-	for (i = fmt_cnt; fmt[i] != '\0'; i++) {
-		ch = fmt[i];
-		is_container = (array != NULL) || (dictionary != NULL);
-
-		if (array != NULL)
-			delim = ']';
-
-		if (dictionary != NULL)
-			delim = '}';
-
-		if (is_container && (ch != delim)) {
-			comma_ptr = NULL;
-			colon_ptr = NULL;
-			search_ptr = &fmt[i];
-			while (1) {
-				if (*search_ptr == ',') {
-					comma_ptr = search_ptr;
-					break;
-				}
-
-				if (*search_ptr == ':')
-					colon_ptr = search_ptr;
-
-				if (*search_ptr == '[')
-					break;
-
-				if (*search_ptr == ']')
-					break;
-
-				if (*search_ptr == '{')
-					break;
-
-				if (*search_ptr == '}')
-					break;
-
-				search_ptr++;
-			}
-
-			if (array != NULL) {
-				if (colon_ptr != NULL) {
-					idx = (size_t)strtol(&fmt[i],
-					    &idx_end_ptr, 10);
-
-					if (idx_end_ptr != colon_ptr)
-						return (-1);
-
-					current = rpc_array_get_value(array,
-					    idx);
-				} else {
-					current = rpc_array_get_value(array,
-					    idx++);
-				}
-			} else {
-				if (colon_ptr != NULL)
-					key = g_strndup(&fmt[i],
-					    (colon_ptr - &fmt[i]));
-				else
-					key = g_strdup(
-					    va_arg(ap, const char *));
-
-				current = rpc_dictionary_get_value(dictionary,
-				    key);
-				g_free(key);
-			}
-
-			if ((comma_ptr == NULL) &&
-			    (*search_ptr != delim)) {
-				i = i + (int)(search_ptr - &fmt[i]);
-				ch = *search_ptr;
-			} else if ((comma_ptr == NULL) &&
-				   (*search_ptr == delim)) {
-				ch = *(search_ptr - 1);
-				i = i + (int)(search_ptr - &fmt[i]) - 1;
-			} else {
-				ch = *(search_ptr - 1);
-				i = i + (int)(search_ptr - &fmt[i]);
-			}
-
-			if (current == NULL) {
-				va_arg(ap, void *);
-				if (ch == 'B')
-					va_arg(ap, void *);
-				continue;
-			}
-
-		}
-
-		if (!is_container && (current == NULL)) {
-			va_arg(ap, void *);
-			if (ch == 'B')
-				va_arg(ap, void *);
-			continue;
-		}
-
-		switch (ch) {
-		case '*':
-			goto inc;
-
-		case 'v':
-			*va_arg(ap, rpc_object_t *) = current;
-			goto inc;
-
-		case 'b':
-			*va_arg(ap, bool *) = rpc_bool_get_value(current);
-			goto inc;
-
-		case 'i':
-			*va_arg(ap, int64_t *) = rpc_int64_get_value(current);
-			goto inc;
-
-		case 'u':
-			*va_arg(ap, uint64_t *) = rpc_uint64_get_value(current);
-			goto inc;
-
-		case 'd':
-			*va_arg(ap, double *) = rpc_double_get_value(current);
-			goto inc;
-
-		case 'f':
-			*va_arg(ap, int *) = rpc_fd_get_value(current);
-			goto inc;
-
-		case 's':
-			*va_arg(ap, const char **) = rpc_string_get_string_ptr(
-			    current);
-			goto inc;
-
-		case 'B':
-			*va_arg(ap, const void **) = rpc_data_get_bytes_ptr(
-			    current);
-			*va_arg(ap, size_t *) = rpc_data_get_length(current);
-			goto inc;
-
-		case 'R':
-			if (array == NULL) {
-				errno = EINVAL;
-				return (-1);
-			}
-
-			*va_arg(ap, rpc_object_t *) = rpc_array_slice(array,
-			    idx + 1, -1);
-
-inc:			(*cnt)++;
-			break;
-
-		case '[':
-			if ((array == NULL) && (dictionary == NULL)) {
-				array = current;
-				break;
-			}
-
-		case '{':
-			if ((array == NULL) && (dictionary == NULL)) {
-				dictionary = current;
-				break;
-			}
-
-			i = rpc_object_unpack_layer(current, fmt, i, cnt, ap);
-			if (i == -1)
-				return (i);
-			break;
-
-		case ']':
-		case '}':
-			return (i);
-
-		default:
-			return (-1);
-		}
-	}
-
-	return (i);
-}
-
 static int
 rpc_array_comparator_converter(const void *p1, const void *p2, void *data)
 {
@@ -491,11 +511,7 @@ rpc_release_impl(rpc_object_t object)
 			break;
 
 		case RPC_TYPE_STRING:
-			g_string_free(object->ro_value.rv_str, true);
-			break;
-
-		case RPC_TYPE_DATE:
-			g_date_time_unref(object->ro_value.rv_datetime);
+			g_free(object->ro_value.rv_str.rsv_heap);
 			break;
 
 		case RPC_TYPE_NULL:
@@ -509,11 +525,18 @@ rpc_release_impl(rpc_object_t object)
 			return (0);
 
 		case RPC_TYPE_ARRAY:
-			g_ptr_array_unref(object->ro_value.rv_list);
+			if (object->ro_value.rv_packed != NULL)
+				rpc_packed_free(object->ro_value.rv_packed);
+			else if (!rpc_reclaim_defer(object)) {
+				rpc_array_store_release(
+				    object->ro_value.rv_list,
+				    object->ro_value.rv_shares);
+			}
 			break;
 
 		case RPC_TYPE_DICTIONARY:
-			g_hash_table_unref(object->ro_value.rv_dict);
+			if (!rpc_reclaim_defer(object))
+				rpc_dict_release(object->ro_value.rv_dict);
 			break;
 
 		case RPC_TYPE_ERROR:
@@ -530,7 +553,18 @@ rpc_release_impl(rpc_object_t object)
 		if (object->ro_typei != NULL)
 			rpct_typei_release(object->ro_typei);
 
-		g_free(object);
+		if (object->ro_ext != NULL) {
+			if (object->ro_ext->roe_packed != NULL)
+				g_bytes_unref(object->ro_ext->roe_packed);
+
+			g_free(object->ro_ext);
+		}
+
+		if (object->ro_arena != NULL)
+			rpc_arena_release(object->ro_arena);
+		else
+			rpc_slab_free(&rpc_object_slab, object);
+
 		return (0);
 	}
 
@@ -550,14 +584,31 @@ inline size_t
 rpc_get_line_number(rpc_object_t object)
 {
 
-	return (object->ro_line);
+	if (object->ro_ext == NULL)
+		return (0);
+
+	return (object->ro_ext->roe_line);
 }
 
 inline size_t
 rpc_get_column_number(rpc_object_t object)
 {
 
-	return (object->ro_column);
+	if (object->ro_ext == NULL)
+		return (0);
+
+	return (object->ro_ext->roe_column);
+}
+
+void
+rpc_object_set_position(rpc_object_t object, size_t line, size_t column)
+{
+
+	if (object->ro_ext == NULL)
+		object->ro_ext = g_malloc0(sizeof(*object->ro_ext));
+
+	object->ro_ext->roe_line = (uint32_t)line;
+	object->ro_ext->roe_column = (uint32_t)column;
 }
 
 inline rpc_type_t
@@ -584,6 +635,8 @@ inline rpc_object_t
 rpc_copy(rpc_object_t object)
 {
 	rpc_object_t result = NULL;
+	rpc_object_t extra;
+	union rpc_value value;
 	void *buffer;
 
 	switch (object->ro_type) {
@@ -604,7 +657,7 @@ rpc_copy(rpc_object_t object)
 		break;
 
 	case RPC_TYPE_DATE:
-		result = rpc_date_create(rpc_date_get_value(object));
+		result = rpc_date_create_ns(object->ro_value.rv_date);
 		break;
 
 	case RPC_TYPE_DOUBLE:
@@ -616,7 +669,8 @@ rpc_copy(rpc_object_t object)
 		break;
 
 	case RPC_TYPE_STRING:
-		result = rpc_string_create(rpc_string_get_string_ptr(object));
+		result = rpc_string_create_len(rpc_string_get_string_ptr(object),
+		    rpc_string_get_length(object));
 		break;
 
 	case RPC_TYPE_BINARY:
@@ -636,25 +690,48 @@ rpc_copy(rpc_object_t object)
 #endif
 
 	case RPC_TYPE_ERROR:
-		result = rpc_error_create(rpc_error_get_code(object),
-		    rpc_error_get_message(object),
-		    rpc_copy(rpc_error_get_extra(object)));
+		/* A copy has to be mutable, never one of the shared errors */
+		extra = rpc_copy(rpc_error_get_extra(object));
+		result = rpc_error_alloc(rpc_error_get_code(object),
+		    rpc_error_get_message(object), extra,
+		    rpc_retain(rpc_error_get_stack(object)));
+		rpc_release(extra);
 		break;
 
 	case RPC_TYPE_DICTIONARY:
-		result = rpc_dictionary_create();
-		rpc_dictionary_apply(object, ^(const char *k, rpc_object_t v) {
-		    	rpc_dictionary_steal_value(result, k, rpc_copy(v));
-		    	return ((bool)true);
-		});
+		/* Tables of scalars are shared until either side writes */
+		if (rpc_dictionary_is_leaf(object))
+			value.rv_dict = rpc_dict_retain(
+			    object->ro_value.rv_dict);
+		else
+			value.rv_dict = rpc_dict_copy(
+			    object->ro_value.rv_dict, rpc_copy);
+
+		result = rpc_prim_create(RPC_TYPE_DICTIONARY, value);
 		break;
 
 	case RPC_TYPE_ARRAY:
-		result = rpc_array_create();
-		rpc_array_apply(object, ^(size_t idx, rpc_object_t v) {
-			rpc_array_steal_value(result, idx, rpc_copy(v));
-		    	return ((bool)true);
-		});
+		if (object->ro_value.rv_packed != NULL) {
+			result = rpc_array_create_typed(
+			    object->ro_value.rv_packed->rpa_type,
+			    object->ro_value.rv_packed->rpa_data,
+			    object->ro_value.rv_packed->rpa_count);
+			break;
+		}
+
+		if (!rpc_array_is_leaf(object)) {
+			result = rpc_array_create();
+			rpc_array_apply(object, ^(size_t idx, rpc_object_t v) {
+				rpc_array_steal_value(result, idx, rpc_copy(v));
+				return ((bool)true);
+			});
+			break;
+		}
+
+		value.rv_shares = rpc_array_share(object);
+		value.rv_list = g_ptr_array_ref(object->ro_value.rv_list);
+		value.rv_packed = NULL;
+		result = rpc_prim_create(RPC_TYPE_ARRAY, value);
 		break;
 	}
 
@@ -713,11 +790,15 @@ rpc_equal(rpc_object_t o1, rpc_object_t o2)
 		    (o1_fdstat.st_ino == o2_fdstat.st_ino));
 
 	case RPC_TYPE_DATE:
-		return (rpc_date_get_value(o1) == rpc_date_get_value(o2));
+		return (o1->ro_value.rv_date == o2->ro_value.rv_date);
 
 	case RPC_TYPE_STRING:
-		return (bool)(g_string_equal(o1->ro_value.rv_str,
-		    o2->ro_value.rv_str));
+		if (rpc_string_get_length(o1) != rpc_string_get_length(o2))
+			return (false);
+
+		return (memcmp(rpc_string_get_string_ptr(o1),
+		    rpc_string_get_string_ptr(o2),
+		    rpc_string_get_length(o1)) == 0);
 
 	case RPC_TYPE_BINARY:
 		data_len = rpc_data_get_length(o1);
@@ -769,6 +850,13 @@ rpc_equal(rpc_object_t o1, rpc_object_t o2)
 		if (rpc_array_get_count(o1) != rpc_array_get_count(o2))
 			return (false);
 
+		if (o1->ro_value.rv_packed != NULL &&
+		    o2->ro_value.rv_packed != NULL &&
+		    o1->ro_value.rv_packed->rpa_type ==
+		    o2->ro_value.rv_packed->rpa_type)
+			return (rpc_packed_equal(o1->ro_value.rv_packed,
+			    o2->ro_value.rv_packed));
+
 		return (!rpc_array_apply(o1, ^(size_t idx, rpc_object_t v1) {
 			rpc_object_t v2;
 
@@ -785,67 +873,198 @@ rpc_equal(rpc_object_t o1, rpc_object_t o2)
 inline size_t
 rpc_hash(rpc_object_t object)
 {
-	__block size_t hash = 0;
+
+	if (RPC_OBJECT_FROZEN(object))
+		return (object->ro_ext->roe_hash);
+
+	return (rpc_hash_seeded(object, 0));
+}
+
+size_t
+rpc_hash_seeded(rpc_object_t object, uint64_t seed)
+{
+	struct rpc_packed_array *packed;
+	__block uint64_t hash;
 	struct stat fdstat;
+	GString *message;
+	size_t i;
+
+	if (seed == 0 && RPC_OBJECT_FROZEN(object))
+		return (object->ro_ext->roe_hash);
 
 	switch (object->ro_type) {
 	case RPC_TYPE_NULL:
-		return (0);
+		return ((size_t)rpc_hash_scalar(0, seed));
 
 	case RPC_TYPE_BOOL:
-		return ((size_t)object->ro_value.rv_b);
+		return ((size_t)rpc_hash_scalar(object->ro_value.rv_b, seed));
 
 	case RPC_TYPE_INT64:
-		return ((size_t)object->ro_value.rv_i);
+		return ((size_t)rpc_hash_scalar(
+		    (uint64_t)object->ro_value.rv_i, seed));
 
 	case RPC_TYPE_UINT64:
-		return ((size_t)object->ro_value.rv_ui);
+		return ((size_t)rpc_hash_scalar(object->ro_value.rv_ui, seed));
 
 	case RPC_TYPE_DOUBLE:
-		return ((size_t)object->ro_value.rv_d);
+		return ((size_t)rpc_hash_scalar(
+		    (uint64_t)(size_t)object->ro_value.rv_d, seed));
 
 	case RPC_TYPE_FD:
 		fstat(object->ro_value.rv_fd, &fdstat);
-		return (fdstat.st_dev ^ fdstat.st_ino);
+		return ((size_t)rpc_hash_scalar(fdstat.st_dev ^ fdstat.st_ino,
+		    seed));
 
 	case RPC_TYPE_DATE:
-		return ((size_t)rpc_date_get_value(object));
+		return ((size_t)rpc_hash_scalar(
+		    (uint64_t)object->ro_value.rv_date, seed));
 
 	case RPC_TYPE_STRING:
-		return (g_string_hash(object->ro_value.rv_str));
+		return ((size_t)rpc_hash_bytes(
+		    rpc_string_get_string_ptr(object),
+		    rpc_string_get_length(object), seed));
 
 	case RPC_TYPE_BINARY:
-		return (rpc_data_hash((uint8_t *)rpc_data_get_bytes_ptr(object),
-		    rpc_data_get_length(object)));
+		return ((size_t)rpc_hash_bytes(rpc_data_get_bytes_ptr(object),
+		    rpc_data_get_length(object), seed));
 
 	case RPC_TYPE_ERROR:
-		return (object->ro_value.rv_error.rev_code ^
-		    g_string_hash(object->ro_value.rv_error.rev_message) ^
-		    rpc_hash(object->ro_value.rv_error.rev_extra));
+		message = object->ro_value.rv_error.rev_message;
+		hash = rpc_hash_scalar(
+		    (uint64_t)object->ro_value.rv_error.rev_code, seed);
+		hash ^= rpc_hash_bytes(message->str, message->len, seed);
+		if (object->ro_value.rv_error.rev_extra != NULL)
+			hash ^= rpc_hash_seeded(
+			    object->ro_value.rv_error.rev_extra, seed);
+
+		return ((size_t)hash);
 
 #if defined(__linux__)
 	case RPC_TYPE_SHMEM:
 		fstat(object->ro_value.rv_shmem.rsb_fd, &fdstat);
-		return (fdstat.st_dev ^ fdstat.st_ino);
+		return ((size_t)rpc_hash_scalar(fdstat.st_dev ^ fdstat.st_ino,
+		    seed));
 #endif
 
 	case RPC_TYPE_DICTIONARY:
+		/* Order-insensitive, equal dictionaries may iterate apart */
+		hash = 0;
 		rpc_dictionary_apply(object, ^(const char *k, rpc_object_t v) {
-		    	hash ^= rpc_data_hash((const uint8_t *)k, strlen(k));
-		    	hash ^= rpc_hash(v);
-		    	return ((bool)true);
+			hash ^= rpc_hash_mix(rpc_hash_bytes(k, strlen(k), seed),
+			    rpc_hash_seeded(v, seed) ^ RPC_HASH_P2);
+			return ((bool)true);
 		});
-		return (hash);
+		return ((size_t)hash);
+
+	case RPC_TYPE_ARRAY:
+		hash = rpc_hash_scalar(rpc_array_get_count(object), seed);
+		packed = object->ro_value.rv_packed;
+		if (packed == NULL) {
+			rpc_array_apply(object, ^(size_t idx __unused,
+			    rpc_object_t v) {
+				hash = rpc_hash_mix(hash ^ RPC_HASH_P3,
+				    rpc_hash_seeded(v, seed) ^ RPC_HASH_P1);
+				return ((bool)true);
+			});
+			return ((size_t)hash);
+		}
+
+		/* Same as hashing the boxed values, without boxing them */
+		for (i = 0; i < packed->rpa_count; i++) {
+			hash = rpc_hash_mix(hash ^ RPC_HASH_P3, RPC_HASH_P1 ^
+			    rpc_hash_scalar(packed->rpa_type == RPC_TYPE_DOUBLE
+			    ? (uint64_t)(size_t)packed->rpa_double[i]
+			    : packed->rpa_uint64[i], seed));
+		}
+
+		return ((size_t)hash);
+	}
+
+	return (0);
+}
+
+rpc_object_t
+rpc_object_freeze(rpc_object_t object)
+{
+	rpc_object_t extra;
+	rpc_object_t stack;
+
+	if (object->ro_type == RPC_TYPE_NULL || RPC_OBJECT_FROZEN(object))
+		return (object);
 
+	switch (object->ro_type) {
 	case RPC_TYPE_ARRAY:
+		/* Borrowing accessors would otherwise box elements on read */
+		rpc_array_unpack(object);
 		rpc_array_apply(object, ^(size_t idx __unused, rpc_object_t v) {
-		    	hash ^= rpc_hash(v);
-		    	return ((bool)true);
+			rpc_object_freeze(v);
+			return ((bool)true);
+		});
+		break;
+
+	case RPC_TYPE_DICTIONARY:
+		rpc_dictionary_apply(object, ^(const char *k __unused,
+		    rpc_object_t v) {
+			rpc_object_freeze(v);
+			return ((bool)true);
 		});
-		return (hash);
+		break;
+
+	case RPC_TYPE_ERROR:
+		extra = object->ro_value.rv_error.rev_extra;
+		stack = object->ro_value.rv_error.rev_stack;
+		if (extra != NULL)
+			rpc_object_freeze(extra);
+
+		if (stack != NULL)
+			rpc_object_freeze(stack);
+		break;
+
+	default:
+		break;
 	}
 
-	return (0);
+	/* Children are frozen already, so this is a single level walk */
+	if (object->ro_ext == NULL)
+		object->ro_ext = g_malloc0(sizeof(*object->ro_ext));
+
+	object->ro_ext->roe_hash = rpc_hash(object);
+	object->ro_ext->roe_frozen = true;
+	return (object);
+}
+
+bool
+rpc_object_is_frozen(rpc_object_t object)
+{
+
+	return (object->ro_type == RPC_TYPE_NULL || RPC_OBJECT_FROZEN(object));
+}
+
+GBytes *
+rpc_object_get_packed(rpc_object_t object)
+{
+	struct rpc_object_ext *ext;
+	GBytes *packed;
+
+	if (!RPC_OBJECT_FROZEN(object))
+		return (NULL);
+
+	ext = object->ro_ext;
+	packed = g_atomic_pointer_get(&ext->roe_packed);
+	if (packed == NULL) {
+		packed = rpc_connection_pack_result(object);
+		if (packed == NULL)
+			return (NULL);
+
+		/* Lost a race with another sender, use its copy */
+		if (!g_atomic_pointer_compare_and_exchange(&ext->roe_packed,
+		    NULL, packed)) {
+			g_bytes_unref(packed);
+			packed = g_atomic_pointer_get(&ext->roe_packed);
+		}
+	}
+
+	return (g_bytes_ref(packed));
 }
 
 inline char *
@@ -875,369 +1094,82 @@ rpc_object_pack(const char *fmt, ...)
 	return result;
 }
 
-rpc_object_t
-rpc_object_vpack(const char *fmt, va_list ap)
-{
-	GQueue *stack = g_queue_new();
-	GQueue *key_q = g_queue_new();
-	GQueue *idx_q = g_queue_new();
-	rpc_object_t current = NULL;
-	rpc_object_t container = NULL;
-	rpc_object_t tmp;
-	const char *ptr;
-	const char *search_ptr;
-	const char *comma_ptr;
-	const char *colon_ptr;
-	const char *type_start;
-	char *idx_end_ptr;
-	char *key;
-	char *type = NULL;
-	char ch;
-	char delim;
-	size_t *idx;
-	uint32_t nesting;
-
-	for (ptr = fmt; *ptr != '\0'; ptr++) {
-
-		ch = *ptr;
-		if (container != NULL) {
-			if (rpc_get_type(container) == RPC_TYPE_ARRAY)
-				delim = ']';
-			else
-				delim = '}';
-		}
-
-		if ((container != NULL) && (ch != delim)) {
-			comma_ptr = NULL;
-			colon_ptr = NULL;
-			search_ptr = ptr;
-			while (1) {
-				if (*search_ptr == ',') {
-					comma_ptr = search_ptr;
-					break;
-				}
+int
+rpc_object_unpack(rpc_object_t obj, const char *fmt, ...)
+{
+	va_list ap;
+	int result;
 
-				if (*search_ptr == ':')
-					colon_ptr = search_ptr;
+	va_start(ap, fmt);
 
-				if (*search_ptr == '<')
-					break;
+	result = rpc_object_vunpack(obj, fmt, ap);
 
-				if (*search_ptr == '[')
-					break;
+	va_end(ap);
+	return (result);
+}
 
-				if (*search_ptr == ']')
-					break;
+inline rpc_object_t
+rpc_null_create(void)
+{
+	return (rpc_retain(this_null));
+}
 
-				if (*search_ptr == '{')
-					break;
+inline rpc_object_t
+rpc_bool_create(bool value)
+{
+	union rpc_value val;
 
-				if (*search_ptr == '}')
-					break;
+	val.rv_b = value;
+	return (rpc_prim_create(RPC_TYPE_BOOL, val));
+}
 
-				if (*search_ptr == '\'')
-					break;
+inline bool
+rpc_bool_get_value(rpc_object_t xbool)
+{
 
-				search_ptr++;
-			}
+	if (xbool->ro_type != RPC_TYPE_BOOL)
+		return (false);
 
-			if (rpc_get_type(container) == RPC_TYPE_ARRAY) {
-				idx = g_malloc0(sizeof(size_t));
-				if (colon_ptr != NULL) {
-					*idx = (size_t)strtol(ptr,
-					    &idx_end_ptr, 10);
-
-					if (idx_end_ptr != colon_ptr)
-						goto error;
-				} else {
-					*idx = rpc_array_get_count(
-					    container);
-				}
-				g_queue_push_tail(idx_q, idx);
-			} else {
-				if (colon_ptr != NULL) {
-					g_queue_push_tail(key_q,
-					    g_strndup(ptr,
-					    (colon_ptr - ptr)));
-
-				} else {
-					key = g_strdup(
-					    va_arg(ap, const char *));
-					g_queue_push_tail(key_q,
-					    (gpointer)key);
-				}
-			}
+	return (xbool->ro_value.rv_b);
+}
 
-			if ((comma_ptr == NULL) &&
-			    (*search_ptr != delim)) {
-				ptr = search_ptr;
-				ch = *search_ptr;
-			} else if ((comma_ptr == NULL) &&
-			    (*search_ptr == delim)) {
-				ch = *(search_ptr - 1);
-				ptr = search_ptr - 1;
-			} else {
-				ch = *(search_ptr - 1);
-				ptr = search_ptr;
-			}
+inline rpc_object_t
+rpc_int64_create(int64_t value)
+{
+	union rpc_value val;
 
-		}
+	val.rv_i = value;
+	return (rpc_prim_create(RPC_TYPE_INT64, val));
+}
 
-		switch (ch) {
-		case 'v':
-		case 'V':
-			current = va_arg(ap, rpc_object_t);
-			if (current == NULL) {
-				current = rpc_null_create();
-				break;
-			}
+inline int64_t
+rpc_int64_get_value(rpc_object_t xint)
+{
 
-			if (ch == 'V')
-				rpc_retain(current);
+	if (xint->ro_type != RPC_TYPE_INT64)
+		return (-1);
 
-			break;
+	return (xint->ro_value.rv_i);
+}
 
-		case 'n':
-			current = rpc_null_create();
-			break;
+inline rpc_object_t
+rpc_uint64_create(uint64_t value)
+{
+	union rpc_value val;
 
-		case 'b':
-			current = rpc_bool_create(va_arg(ap, int));
-			break;
+	val.rv_ui = value;
+	return (rpc_prim_create(RPC_TYPE_UINT64, val));
+}
 
-		case 'B':
-			current = rpc_data_create(va_arg(ap, const void *),
-			    va_arg(ap, size_t),
-			    va_arg(ap, rpc_binary_destructor_t));
-			break;
+inline uint64_t
+rpc_uint64_get_value(rpc_object_t xuint)
+{
 
-		case 'I':
-			current = rpc_data_create_iov(
-			    va_arg(ap, struct iovec *), va_arg(ap, size_t));
-			break;
+	if (xuint->ro_type != RPC_TYPE_UINT64)
+		return (0);
 
-		case 'f':
-			current = rpc_fd_create(va_arg(ap, int));
-			break;
-
-		case 'i':
-			current = rpc_int64_create(va_arg(ap, int64_t));
-			break;
-
-		case 'u':
-			current = rpc_uint64_create(va_arg(ap, uint64_t));
-			break;
-
-		case 'd':
-			current = rpc_double_create(va_arg(ap, double));
-			break;
-
-		case 'D':
-			current = rpc_date_create(va_arg(ap, int64_t));
-			break;
-
-		case 's':
-			current = rpc_string_create(va_arg(ap, const char *));
-			break;
-
-		case '\'':
-			search_ptr = strchr(ptr + 1, '\'');
-			if (search_ptr == NULL)
-				goto error;
-
-			current = rpc_string_create_len(ptr + 1,
-			    search_ptr - ptr - 1);
-			ptr = search_ptr + 1;
-			break;
-
-		case '<':
-			type_start = ptr + 1;
-			nesting = 1;
-			while (nesting != 0) {
-				ptr++;
-
-				if (*(ptr) == '<')
-					nesting++;
-
-				if (*(ptr) == '>')
-					nesting--;
-			}
-			type = g_strndup(type_start, (ptr - type_start));
-			continue;
-
-		case '{':
-			container = rpc_dictionary_create();
-			if (type != NULL) {
-				tmp = rpct_new(type, container);
-				if (tmp == NULL)
-					goto error;
-
-				g_free(type);
-				rpc_release(container);
-				type = NULL;
-				container = tmp;
-			}
-
-			g_queue_push_tail(stack, container);
-			continue;
-
-		case '[':
-			container = rpc_array_create();
-			if (type != NULL) {
-				tmp = rpct_new(type, container);
-				if (tmp == NULL)
-					goto error;
-
-				g_free(type);
-				rpc_release(container);
-				type = NULL;
-				container = tmp;
-			}
-
-			g_queue_push_tail(stack, container);
-			continue;
-
-		case '}':
-		case ']':
-			if (*(ptr + 1) == ',')
-				ptr++;
-
-			current = g_queue_pop_tail(stack);
-			container = g_queue_peek_tail(stack);
-			break;
-
-		default:
-			goto error;
-		}
-
-		if (type != NULL) {
-			current = rpct_new(type, current);
-			if (current == NULL)
-				goto error;
-
-			g_free(type);
-			type = NULL;
-		}
-
-		if (container != NULL) {
-			if (rpc_get_type(container) == RPC_TYPE_DICTIONARY) {
-				key = g_queue_pop_tail(key_q);
-				rpc_dictionary_steal_value(container, key,
-				    current);
-				g_free(key);
-			}
-
-			if (rpc_get_type(container) == RPC_TYPE_ARRAY) {
-				idx = g_queue_pop_tail(idx_q);
-				rpc_array_steal_value(container, *idx, current);
-				g_free(idx);
-			}
-
-			continue;
-		}
-
-		g_queue_free(stack);
-		g_queue_free_full(key_q, g_free);
-		g_queue_free_full(idx_q, g_free);
-
-		return (current);
-	}
-
-error:
-	rpc_release(current);
-
-	g_queue_free(stack);
-	g_queue_free_full(key_q, g_free);
-	g_queue_free_full(idx_q, g_free);
-	errno = EINVAL;
-
-	return (NULL);
-}
-
-int
-rpc_object_unpack(rpc_object_t obj, const char *fmt, ...)
-{
-	va_list ap;
-	int result;
-
-	va_start(ap, fmt);
-
-	result = rpc_object_vunpack(obj, fmt, ap);
-
-	va_end(ap);
-	return (result);
-}
-
-int
-rpc_object_vunpack(rpc_object_t obj, const char *fmt, va_list ap)
-{
-	int cnt = 0;
-
-	return (rpc_object_unpack_layer(obj, fmt, 0, &cnt, ap) > 0 ? cnt : -1);
-}
-
-inline rpc_object_t
-rpc_null_create(void)
-{
-	return (rpc_retain(this_null));
-}
-
-inline rpc_object_t
-rpc_bool_create(bool value)
-{
-	union rpc_value val;
-
-	val.rv_b = value;
-	return (rpc_prim_create(RPC_TYPE_BOOL, val));
-}
-
-inline bool
-rpc_bool_get_value(rpc_object_t xbool)
-{
-
-	if (xbool->ro_type != RPC_TYPE_BOOL)
-		return (false);
-
-	return (xbool->ro_value.rv_b);
-}
-
-inline rpc_object_t
-rpc_int64_create(int64_t value)
-{
-	union rpc_value val;
-
-	val.rv_i = value;
-	return (rpc_prim_create(RPC_TYPE_INT64, val));
-}
-
-inline int64_t
-rpc_int64_get_value(rpc_object_t xint)
-{
-
-	if (xint->ro_type != RPC_TYPE_INT64)
-		return (-1);
-
-	return (xint->ro_value.rv_i);
-}
-
-inline rpc_object_t
-rpc_uint64_create(uint64_t value)
-{
-	union rpc_value val;
-
-	val.rv_ui = value;
-	return (rpc_prim_create(RPC_TYPE_UINT64, val));
-}
-
-inline uint64_t
-rpc_uint64_get_value(rpc_object_t xuint)
-{
-
-	if (xuint->ro_type != RPC_TYPE_UINT64)
-		return (0);
-
-	return (xuint->ro_value.rv_ui);
-}
+	return (xuint->ro_value.rv_ui);
+}
 
 inline rpc_object_t
 rpc_double_create(double value)
@@ -1260,30 +1192,51 @@ rpc_double_get_value(rpc_object_t xdouble)
 
 inline rpc_object_t
 rpc_date_create(int64_t interval)
+{
+
+	return (rpc_date_create_ns(interval * RPC_DATE_NSEC_PER_SEC));
+}
+
+inline rpc_object_t
+rpc_date_create_ns(int64_t nsec)
 {
 	union rpc_value val;
 
-	val.rv_datetime = g_date_time_new_from_unix_utc(interval);
+	val.rv_date = nsec;
 	return (rpc_prim_create(RPC_TYPE_DATE, val));
 }
 
 inline rpc_object_t
 rpc_date_create_from_current(void)
 {
-	union rpc_value val;
 
-	val.rv_datetime = g_date_time_new_now_utc();
-	return (rpc_prim_create(RPC_TYPE_DATE, val));
+	return (rpc_date_create_ns(g_get_real_time() * 1000));
 }
 
 inline int64_t
 rpc_date_get_value(rpc_object_t xdate)
+{
+	int64_t sec;
+
+	if (xdate->ro_type != RPC_TYPE_DATE)
+		return (0);
+
+	/* Round towards the past, like GDateTime did */
+	sec = xdate->ro_value.rv_date / RPC_DATE_NSEC_PER_SEC;
+	if (xdate->ro_value.rv_date % RPC_DATE_NSEC_PER_SEC < 0)
+		sec--;
+
+	return (sec);
+}
+
+inline int64_t
+rpc_date_get_value_ns(rpc_object_t xdate)
 {
 
 	if (xdate->ro_type != RPC_TYPE_DATE)
 		return (0);
 
-	return (g_date_time_to_unix(xdate->ro_value.rv_datetime));
+	return (xdate->ro_value.rv_date);
 }
 
 inline rpc_object_t
@@ -1330,6 +1283,123 @@ rpc_data_create_iov(struct iovec *iov, size_t niov)
 	    RPC_BINARY_DESTRUCTOR(g_free)));
 }
 
+rpc_object_t
+rpc_data_create_file(int fd, off_t offset, size_t length)
+{
+	struct rpc_file_range *range;
+	struct stat st;
+	void *addr;
+	char *data;
+	off_t start;
+	size_t maplen;
+	long pagesize;
+	int dupfd;
+
+	if (fstat(fd, &st) != 0) {
+		rpc_set_last_errorf(errno, "Cannot stat file: %s",
+		    strerror(errno));
+		return (NULL);
+	}
+
+	if (!S_ISREG(st.st_mode) || offset < 0 || offset > st.st_size) {
+		rpc_set_last_error(EINVAL, "Invalid file range", NULL);
+		return (NULL);
+	}
+
+	if (length == 0)
+		length = (size_t)(st.st_size - offset);
+
+	if (length > (size_t)(st.st_size - offset)) {
+		rpc_set_last_error(EINVAL, "Range exceeds the file size", NULL);
+		return (NULL);
+	}
+
+	if (length == 0)
+		return (rpc_data_create(NULL, 0, NULL));
+
+	pagesize = sysconf(_SC_PAGESIZE);
+	start = offset - (offset % pagesize);
+	maplen = length + (size_t)(offset - start);
+
+	addr = mmap(NULL, maplen, PROT_READ, MAP_SHARED, fd, start);
+	if (addr == MAP_FAILED) {
+		rpc_set_last_errorf(errno, "Cannot map file: %s",
+		    strerror(errno));
+		return (NULL);
+	}
+
+#if defined(MADV_SEQUENTIAL)
+	madvise(addr, maplen, MADV_SEQUENTIAL);
+#endif
+
+	dupfd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	if (dupfd < 0) {
+		rpc_set_last_errorf(errno, "Cannot duplicate descriptor: %s",
+		    strerror(errno));
+		munmap(addr, maplen);
+		return (NULL);
+	}
+
+	data = (char *)addr + (offset - start);
+	range = g_malloc(sizeof(*range));
+	range->rfr_ptr = data;
+	range->rfr_length = length;
+	range->rfr_fd = dupfd;
+	range->rfr_offset = offset;
+
+	g_mutex_lock(&rpc_file_ranges_mtx);
+	rpc_file_ranges = g_slist_prepend(rpc_file_ranges, range);
+	g_atomic_int_inc(&rpc_file_ranges_count);
+	g_mutex_unlock(&rpc_file_ranges_mtx);
+
+	return (rpc_data_create(data, length, ^(void *buf __unused) {
+		rpc_file_range_remove(range);
+		munmap(addr, maplen);
+	}));
+}
+
+static void
+rpc_file_range_remove(struct rpc_file_range *range)
+{
+
+	g_mutex_lock(&rpc_file_ranges_mtx);
+	rpc_file_ranges = g_slist_remove(rpc_file_ranges, range);
+	g_atomic_int_dec_and_test(&rpc_file_ranges_count);
+	g_mutex_unlock(&rpc_file_ranges_mtx);
+
+	close(range->rfr_fd);
+	g_free(range);
+}
+
+bool
+rpc_data_file_range(const void *ptr, size_t len, int *fd, off_t *offset)
+{
+	struct rpc_file_range *range;
+	const char *p = ptr;
+	const char *base;
+	GSList *iter;
+	bool found = false;
+
+	if (g_atomic_int_get(&rpc_file_ranges_count) == 0)
+		return (false);
+
+	g_mutex_lock(&rpc_file_ranges_mtx);
+	for (iter = rpc_file_ranges; iter != NULL; iter = iter->next) {
+		range = iter->data;
+		base = range->rfr_ptr;
+		if (p < base || p + len > base + range->rfr_length)
+			continue;
+
+		*fd = range->rfr_fd;
+		*offset = range->rfr_offset + (p - base);
+		found = true;
+		break;
+	}
+
+	g_mutex_unlock(&rpc_file_ranges_mtx);
+	return (found);
+}
+
 inline size_t
 rpc_data_get_length(rpc_object_t xdata)
 {
@@ -1369,6 +1439,39 @@ rpc_data_get_bytes(rpc_object_t xdata, void *buffer, size_t off, size_t length)
 	return (cpy_size);
 }
 
+static void
+rpc_string_value_init(union rpc_value *val, const char *string, size_t length)
+{
+
+	if (length <= RPC_INLINE_STRING_MAX) {
+		val->rv_str.rsv_heap = NULL;
+		val->rv_str.rsv_inline_length = (uint8_t)length;
+		memcpy(val->rv_str.rsv_inline, string, length);
+		val->rv_str.rsv_inline[length] = '\0';
+		return;
+	}
+
+	val->rv_str.rsv_heap = g_malloc(length + 1);
+	val->rv_str.rsv_length = length;
+	memcpy(val->rv_str.rsv_heap, string, length);
+	val->rv_str.rsv_heap[length] = '\0';
+}
+
+static void
+rpc_string_value_take(union rpc_value *val, char *string)
+{
+	size_t length = strlen(string);
+
+	if (length <= RPC_INLINE_STRING_MAX) {
+		rpc_string_value_init(val, string, length);
+		g_free(string);
+		return;
+	}
+
+	val->rv_str.rsv_heap = string;
+	val->rv_str.rsv_length = length;
+}
+
 inline rpc_object_t
 rpc_string_create(const char *string)
 {
@@ -1377,7 +1480,7 @@ rpc_string_create(const char *string)
 	if (string == NULL)
 		return (rpc_null_create());
 
-	val.rv_str = g_string_new(string);
+	rpc_string_value_init(&val, string, strlen(string));
 	return (rpc_prim_create(RPC_TYPE_STRING, val));
 }
 
@@ -1391,7 +1494,21 @@ rpc_string_create_len(const char *string, size_t length)
 	if ((null_b != NULL) && (null_b != string + length))
 		return (rpc_null_create());
 
-	val.rv_str = g_string_new_len(string, length);
+	rpc_string_value_init(&val, string, length);
+	return (rpc_prim_create(RPC_TYPE_STRING, val));
+}
+
+/*
+ * Unlike rpc_string_create_len(), keeps embedded NULs. The wire format
+ * allows them and the length is stored anyway, so decoded strings go
+ * back out unchanged.
+ */
+rpc_object_t
+rpc_string_create_bytes(const char *string, size_t length)
+{
+	union rpc_value val;
+
+	rpc_string_value_init(&val, string, length);
 	return (rpc_prim_create(RPC_TYPE_STRING, val));
 }
 
@@ -1402,8 +1519,7 @@ rpc_string_create_with_format(const char *fmt, ...)
 	union rpc_value val;
 
 	va_start(ap, fmt);
-	val.rv_str = g_string_new(NULL);
-	g_string_vprintf(val.rv_str, fmt, ap);
+	rpc_string_value_take(&val, g_strdup_vprintf(fmt, ap));
 	va_end(ap);
 
 	return (rpc_prim_create(RPC_TYPE_STRING, val));
@@ -1414,8 +1530,7 @@ rpc_string_create_with_format_and_arguments(const char *fmt, va_list ap)
 {
 	union rpc_value val;
 
-	val.rv_str = g_string_new(NULL);
-	g_string_vprintf(val.rv_str, fmt, ap);
+	rpc_string_value_take(&val, g_strdup_vprintf(fmt, ap));
 	return (rpc_prim_create(RPC_TYPE_STRING, val));
 }
 
@@ -1426,7 +1541,10 @@ rpc_string_get_length(rpc_object_t xstring)
 	if (xstring->ro_type != RPC_TYPE_STRING)
 		return (0);
 
-	return (xstring->ro_value.rv_str->len);
+	if (xstring->ro_value.rv_str.rsv_heap == NULL)
+		return (xstring->ro_value.rv_str.rsv_inline_length);
+
+	return (xstring->ro_value.rv_str.rsv_length);
 }
 
 inline const char *
@@ -1436,7 +1554,10 @@ rpc_string_get_string_ptr(rpc_object_t xstring)
 	if (xstring->ro_type != RPC_TYPE_STRING)
 		return (NULL);
 
-	return (xstring->ro_value.rv_str->str);
+	if (xstring->ro_value.rv_str.rsv_heap == NULL)
+		return (xstring->ro_value.rv_str.rsv_inline);
+
+	return (xstring->ro_value.rv_str.rsv_heap);
 }
 
 inline rpc_object_t
@@ -1472,21 +1593,8 @@ rpc_fd_dup(rpc_object_t xfd)
 inline rpc_object_t
 rpc_shmem_create(size_t size)
 {
-	union rpc_value val;
-
-	if (size == 0)
-		return (NULL);
-
-	val.rv_shmem.rsb_size = size;
-	val.rv_shmem.rsb_offset = 0;
-	val.rv_shmem.rsb_fd = memfd_create("librpc", 0);
-
-	if (ftruncate(val.rv_shmem.rsb_fd, (off_t)size) != 0) {
-		close(val.rv_shmem.rsb_fd);
-		return (NULL);
-	}
 
-	return (rpc_prim_create(RPC_TYPE_SHMEM, val));
+	return (rpc_shmem_create_ex(size, 0));
 }
 
 inline rpc_object_t
@@ -1496,175 +1604,711 @@ rpc_shmem_recreate(int fd, off_t offset, size_t size)
 	val.rv_shmem.rsb_fd = fd;
 	val.rv_shmem.rsb_offset = offset;
 	val.rv_shmem.rsb_size = size;
+	val.rv_shmem.rsb_region = 0;
 
 	return (rpc_prim_create(RPC_TYPE_SHMEM, val));
 }
 
-inline void
-rpc_shmem_unmap(rpc_object_t shmem, void *addr)
+inline void
+rpc_shmem_unmap(rpc_object_t shmem, void *addr)
+{
+
+	if (addr == NULL)
+		return;
+
+	if (shmem == NULL)
+		return;
+
+	rpc_shmem_cache_unmap(addr);
+}
+
+inline void *
+rpc_shmem_map(rpc_object_t shmem)
+{
+
+	return (rpc_shmem_cache_map(shmem->ro_value.rv_shmem.rsb_fd,
+	    shmem->ro_value.rv_shmem.rsb_offset,
+	    shmem->ro_value.rv_shmem.rsb_size));
+}
+
+inline size_t
+rpc_shmem_get_size(rpc_object_t shmem)
+{
+
+	return (shmem->ro_value.rv_shmem.rsb_size);
+}
+
+int
+rpc_shmem_get_fd(rpc_object_t shmem)
+{
+
+	if (shmem == NULL)
+		return (0);
+
+	return (shmem->ro_value.rv_shmem.rsb_fd);
+}
+off_t rpc_shmem_get_offset(rpc_object_t shmem)
+{
+
+	if (shmem == NULL)
+		return (0);
+
+	return (shmem->ro_value.rv_shmem.rsb_offset);
+}
+#endif
+
+rpc_object_t
+rpc_error_create(int code, const char *msg, rpc_object_t extra)
+{
+	rpc_object_t obj;
+	char *stack;
+
+	if (!g_atomic_int_get(&rpc_error_stacks))
+		return (rpc_error_alloc(code, msg, extra, rpc_null_create()));
+
+	stack = rpc_get_backtrace();
+	obj = rpc_string_create(stack);
+	g_free(stack);
+
+	return (rpc_error_alloc(code, msg, extra, obj));
+}
+
+/*
+ * For the library's own errors: those without extra whose code and
+ * message match one of rpc_common_errors come from a shared, frozen
+ * instance, with no stack. Everything else is a regular new error.
+ */
+rpc_object_t
+rpc_error_create_shared(int code, const char *msg, rpc_object_t extra)
+{
+	rpc_object_t common;
+
+	if (extra == NULL) {
+		common = rpc_error_lookup_common(code, msg);
+		if (common != NULL)
+			return (common);
+	}
+
+	return (rpc_error_create(code, msg, extra));
+}
+
+void
+rpc_object_set_reclaim_threshold(size_t nodes)
+{
+
+	rpc_reclaim_threshold = nodes;
+}
+
+/*
+ * Called as the last reference to a container goes away. Hands its
+ * table over to the reclaimer thread if the tree below is big enough
+ * to stall the caller, in which case it returns true.
+ */
+static bool
+rpc_reclaim_defer(rpc_object_t object)
+{
+	struct rpc_reclaim_item *item;
+	size_t threshold = rpc_reclaim_threshold;
+
+	if (threshold == 0 || g_private_get(&rpc_reclaim_thread) != NULL)
+		return (false);
+
+	/* Still used by a copy, releasing it is just a decrement */
+	if (object->ro_type == RPC_TYPE_ARRAY) {
+		if (object->ro_value.rv_shares != NULL &&
+		    g_atomic_int_get(object->ro_value.rv_shares) > 1)
+			return (false);
+	} else if (g_atomic_int_get(&object->ro_value.rv_dict->rd_shares) > 1)
+		return (false);
+
+	if (rpc_reclaim_estimate(object) < threshold)
+		return (false);
+
+	item = g_malloc0(sizeof(*item));
+	item->rri_type = object->ro_type;
+	if (object->ro_type == RPC_TYPE_ARRAY) {
+		item->rri_list = object->ro_value.rv_list;
+		item->rri_shares = object->ro_value.rv_shares;
+	} else
+		item->rri_dict = object->ro_value.rv_dict;
+
+	g_async_queue_push(rpc_reclaim_queue(), item);
+	return (true);
+}
+
+/*
+ * Guesses the size of a tree from its fan-out and that of its first
+ * child, assuming results are mostly lists of similar records. Walking
+ * the whole tree would cost about as much as freeing it.
+ */
+static size_t
+rpc_reclaim_estimate(rpc_object_t object)
+{
+	struct rpc_dict_entry *e;
+	rpc_object_t first = NULL;
+	size_t count;
+	size_t pos = 0;
+
+	count = rpc_reclaim_children(object);
+	if (count == 0)
+		return (0);
+
+	if (object->ro_type == RPC_TYPE_ARRAY)
+		first = g_ptr_array_index(object->ro_value.rv_list, 0);
+	else if ((e = rpc_dict_next(object->ro_value.rv_dict, &pos)) != NULL)
+		first = e->rde_value;
+
+	if (first == NULL)
+		return (count);
+
+	return (count + count * rpc_reclaim_children(first));
+}
+
+static size_t
+rpc_reclaim_children(rpc_object_t object)
+{
+
+	switch (object->ro_type) {
+	case RPC_TYPE_ARRAY:
+		if (object->ro_value.rv_packed != NULL)
+			return (0);
+
+		return (object->ro_value.rv_list->len);
+
+	case RPC_TYPE_DICTIONARY:
+		return (object->ro_value.rv_dict->rd_count);
+
+	default:
+		return (0);
+	}
+}
+
+static GAsyncQueue *
+rpc_reclaim_queue(void)
+{
+	static GAsyncQueue *queue = NULL;
+	GAsyncQueue *q;
+
+	if (g_once_init_enter(&queue)) {
+		q = g_async_queue_new();
+		g_thread_unref(rpc_thread_new(RPC_THREAD_TIMER,
+		    "librpc reclaim", rpc_reclaim_worker, q));
+		g_once_init_leave(&queue, q);
+	}
+
+	return (queue);
+}
+
+static gpointer
+rpc_reclaim_worker(gpointer arg)
+{
+	GAsyncQueue *queue = arg;
+	struct rpc_reclaim_item *item;
+
+	/* Whatever gets released here is freed in place */
+	g_private_set(&rpc_reclaim_thread, GINT_TO_POINTER(1));
+
+	for (;;) {
+		item = g_async_queue_pop(queue);
+		if (item->rri_type == RPC_TYPE_ARRAY)
+			rpc_array_store_release(item->rri_list,
+			    item->rri_shares);
+		else
+			rpc_dict_release(item->rri_dict);
+
+		g_free(item);
+	}
+
+	return (NULL);
+}
+
+void
+rpc_error_set_capture_stacks(bool enable)
+{
+
+	g_atomic_int_set(&rpc_error_stacks, enable ? 1 : 0);
+}
+
+/*
+ * Retains @p extra, takes over the reference to @p stack.
+ */
+static rpc_object_t
+rpc_error_alloc(int code, const char *msg, rpc_object_t extra,
+    rpc_object_t stack)
+{
+	union rpc_value val;
+
+	val.rv_error.rev_code = code;
+	val.rv_error.rev_message = g_string_new(msg);
+	val.rv_error.rev_extra = extra != NULL
+	    ? rpc_retain(extra)
+	    : rpc_null_create();
+	val.rv_error.rev_stack = stack;
+
+	return (rpc_prim_create(RPC_TYPE_ERROR, val));
+}
+
+static rpc_object_t
+rpc_error_lookup_common(int code, const char *msg)
+{
+	static gsize initialized = 0;
+	struct rpc_common_error *err;
+	size_t i;
+
+	if (g_once_init_enter(&initialized)) {
+		for (i = 0; i < G_N_ELEMENTS(rpc_common_errors); i++) {
+			err = &rpc_common_errors[i];
+			err->obj = rpc_object_freeze(rpc_error_alloc(err->code,
+			    err->msg, NULL, rpc_null_create()));
+		}
+
+		g_once_init_leave(&initialized, 1);
+	}
+
+	for (i = 0; i < G_N_ELEMENTS(rpc_common_errors); i++) {
+		err = &rpc_common_errors[i];
+		if (err->code == code && strcmp(err->msg, msg) == 0)
+			return (rpc_retain(err->obj));
+	}
+
+	return (NULL);
+}
+
+
+rpc_object_t
+rpc_error_create_from_gerror(GError *g_error)
+{
+
+        return (rpc_error_create(g_error->code, g_error->message, NULL));
+}
+
+
+rpc_object_t
+rpc_error_create_with_stack(int code, const char *msg, rpc_object_t extra,
+    rpc_object_t stack)
+{
+
+	return (rpc_error_alloc(code, msg, extra, stack != NULL
+	    ? rpc_retain(stack)
+	    : rpc_null_create()));
+}
+
+
+int
+rpc_error_get_code(rpc_object_t error)
+{
+	if (rpc_get_type(error) != RPC_TYPE_ERROR)
+		return (-1);
+
+	return (error->ro_value.rv_error.rev_code);
+}
+
+const char *
+rpc_error_get_message(rpc_object_t error)
+{
+	if (rpc_get_type(error) != RPC_TYPE_ERROR)
+		return (NULL);
+
+	return (error->ro_value.rv_error.rev_message->str);
+}
+
+rpc_object_t
+rpc_error_get_extra(rpc_object_t error)
+{
+	if (rpc_get_type(error) != RPC_TYPE_ERROR)
+		return (NULL);
+
+	return (error->ro_value.rv_error.rev_extra);
+}
+
+rpc_object_t
+rpc_error_get_stack(rpc_object_t error)
+{
+	if (rpc_get_type(error) != RPC_TYPE_ERROR)
+		return (NULL);
+
+	return (error->ro_value.rv_error.rev_stack);
+}
+
+void
+rpc_error_set_extra(rpc_object_t error, rpc_object_t extra)
+{
+
+	if (rpc_get_type(error) != RPC_TYPE_ERROR)
+		return;
+
+	rpc_object_check_mutable(error);
+	if (error->ro_value.rv_error.rev_extra != NULL)
+		rpc_release(error->ro_value.rv_error.rev_extra);
+
+	rpc_retain(extra);
+	error->ro_value.rv_error.rev_extra = extra;
+}
+
+static void
+rpc_object_check_mutable(rpc_object_t object)
+{
+
+	if (RPC_OBJECT_FROZEN(object))
+		rpc_abort("Trying to modify a frozen object");
+}
+
+/*
+ * Copy-on-write containers. rpc_copy() of a dictionary or an array
+ * holding only scalars shares the table with the original, and
+ * whichever side first writes to it takes a private copy. Containers
+ * holding containers are copied one level at a time, so every element
+ * handed out by a read belongs to one object only and reads never have
+ * to unshare anything. The swap is done under a lock striped by object.
+ */
+static GMutex *
+rpc_cow_lock(rpc_object_t object)
+{
+
+	return (&rpc_cow_locks[((uintptr_t)object >> 6) % RPC_COW_LOCKS]);
+}
+
+static bool
+rpc_object_is_container(rpc_object_t object)
+{
+
+	return (object->ro_type == RPC_TYPE_DICTIONARY ||
+	    object->ro_type == RPC_TYPE_ARRAY);
+}
+
+static bool
+rpc_array_is_leaf(rpc_object_t array)
+{
+	GPtrArray *list = array->ro_value.rv_list;
+	guint i;
+
+	for (i = 0; i < list->len; i++) {
+		if (rpc_object_is_container(g_ptr_array_index(list, i)))
+			return (false);
+	}
+
+	return (true);
+}
+
+static bool
+rpc_dictionary_is_leaf(rpc_object_t dictionary)
+{
+	struct rpc_dict *dict = dictionary->ro_value.rv_dict;
+	struct rpc_dict_entry *e;
+	size_t pos = 0;
+
+	while ((e = rpc_dict_next(dict, &pos)) != NULL) {
+		if (rpc_object_is_container(e->rde_value))
+			return (false);
+	}
+
+	return (true);
+}
+
+static volatile gint *
+rpc_array_share(rpc_object_t array)
+{
+	volatile gint *shares;
+	GMutex *mtx;
+
+	mtx = rpc_cow_lock(array);
+	g_mutex_lock(mtx);
+	shares = array->ro_value.rv_shares;
+	if (shares == NULL) {
+		shares = g_malloc(sizeof(*shares));
+		*shares = 1;
+		array->ro_value.rv_shares = shares;
+	}
+
+	g_atomic_int_inc(shares);
+	g_mutex_unlock(mtx);
+	return (shares);
+}
+
+static void
+rpc_array_store_release(GPtrArray *list, volatile gint *shares)
+{
+
+	if (shares != NULL && g_atomic_int_dec_and_test(shares))
+		g_free((gpointer)shares);
+
+	g_ptr_array_unref(list);
+}
+
+static void
+rpc_array_unshare(rpc_object_t array)
+{
+	volatile gint *shares;
+	GPtrArray *list;
+	GPtrArray *copy;
+	GMutex *mtx;
+	guint i;
+
+	shares = array->ro_value.rv_shares;
+	if (shares == NULL || g_atomic_int_get(shares) == 1)
+		return;
+
+	/* Its elements are frozen as well, nobody can write through them */
+	if (RPC_OBJECT_FROZEN(array))
+		return;
+
+	mtx = rpc_cow_lock(array);
+	g_mutex_lock(mtx);
+	shares = array->ro_value.rv_shares;
+	if (shares != NULL && g_atomic_int_get(shares) > 1) {
+		list = array->ro_value.rv_list;
+		copy = g_ptr_array_new_full(list->len,
+		    (GDestroyNotify)rpc_release_impl);
+		for (i = 0; i < list->len; i++) {
+			g_ptr_array_add(copy,
+			    rpc_retain(g_ptr_array_index(list, i)));
+		}
+
+		array->ro_value.rv_list = copy;
+		array->ro_value.rv_shares = NULL;
+		rpc_array_store_release(list, shares);
+	}
+	g_mutex_unlock(mtx);
+}
+
+static void
+rpc_dictionary_unshare(rpc_object_t dictionary)
 {
+	struct rpc_dict *dict;
+	GMutex *mtx;
 
-	if (addr == NULL)
-		return;
-
-	if (shmem == NULL)
+	if (g_atomic_int_get(&dictionary->ro_value.rv_dict->rd_shares) == 1 ||
+	    RPC_OBJECT_FROZEN(dictionary))
 		return;
 
-	munmap(addr, shmem->ro_value.rv_shmem.rsb_size);
+	mtx = rpc_cow_lock(dictionary);
+	g_mutex_lock(mtx);
+	dict = dictionary->ro_value.rv_dict;
+	if (g_atomic_int_get(&dict->rd_shares) > 1) {
+		dictionary->ro_value.rv_dict = rpc_dict_copy(dict,
+		    rpc_retain);
+		rpc_dict_release(dict);
+	}
+	g_mutex_unlock(mtx);
 }
 
-inline void *
-rpc_shmem_map(rpc_object_t shmem)
+static bool
+rpc_array_packable(rpc_type_t type)
 {
 
-	return (mmap(NULL, shmem->ro_value.rv_shmem.rsb_size,
-	    PROT_READ | PROT_WRITE, MAP_SHARED, shmem->ro_value.rv_shmem.rsb_fd,
-	    shmem->ro_value.rv_shmem.rsb_offset));
+	return (type == RPC_TYPE_INT64 || type == RPC_TYPE_UINT64 ||
+	    type == RPC_TYPE_DOUBLE);
 }
 
-inline size_t
-rpc_shmem_get_size(rpc_object_t shmem)
+static rpc_object_t
+rpc_packed_box(struct rpc_packed_array *packed, size_t index)
 {
 
-	return (shmem->ro_value.rv_shmem.rsb_size);
+	switch (packed->rpa_type) {
+	case RPC_TYPE_INT64:
+		return (rpc_int64_create(packed->rpa_int64[index]));
+
+	case RPC_TYPE_UINT64:
+		return (rpc_uint64_create(packed->rpa_uint64[index]));
+
+	default:
+		return (rpc_double_create(packed->rpa_double[index]));
+	}
 }
 
-int
-rpc_shmem_get_fd(rpc_object_t shmem)
+static void
+rpc_packed_free(struct rpc_packed_array *packed)
 {
 
-	if (shmem == NULL)
-		return (0);
-
-	return (shmem->ro_value.rv_shmem.rsb_fd);
+	rpc_free(RPC_ALLOC_TAG_OBJECT, packed->rpa_data,
+	    packed->rpa_capacity * sizeof(int64_t));
+	rpc_free(RPC_ALLOC_TAG_OBJECT, packed, sizeof(*packed));
 }
-off_t rpc_shmem_get_offset(rpc_object_t shmem)
+
+static bool
+rpc_packed_equal(struct rpc_packed_array *p1, struct rpc_packed_array *p2)
 {
+	size_t i;
 
-	if (shmem == NULL)
-		return (0);
+	/* Doubles compare by value, like rpc_equal() does for them */
+	if (p1->rpa_type != RPC_TYPE_DOUBLE) {
+		return (memcmp(p1->rpa_data, p2->rpa_data,
+		    p1->rpa_count * sizeof(int64_t)) == 0);
+	}
 
-	return (shmem->ro_value.rv_shmem.rsb_offset);
+	for (i = 0; i < p1->rpa_count; i++) {
+		if (p1->rpa_double[i] != p2->rpa_double[i])
+			return (false);
+	}
+
+	return (true);
 }
-#endif
 
-rpc_object_t
-rpc_error_create(int code, const char *msg, rpc_object_t extra)
+/*
+ * Stores a value in a packed array, in place or appended at the end.
+ * Returns false if the array is not packed, holds another type or the
+ * index would leave a gap; the caller then goes the boxed way.
+ */
+static bool
+rpc_packed_put(rpc_object_t array, size_t index, rpc_type_t type,
+    const void *value)
 {
-	char *stack;
-	union rpc_value val;
-
-	if (extra == NULL)
-		extra = rpc_null_create();
-	else
-		rpc_retain(extra);
+	struct rpc_packed_array *packed;
+	size_t capacity;
 
-	stack = rpc_get_backtrace();
+	if (array->ro_type != RPC_TYPE_ARRAY)
+		return (false);
 
-	val.rv_error.rev_code = code;
-	val.rv_error.rev_message = g_string_new(msg);
-	val.rv_error.rev_extra = extra;
-	val.rv_error.rev_stack = rpc_string_create(stack);
+	packed = array->ro_value.rv_packed;
+	if (packed == NULL || packed->rpa_type != type)
+		return (false);
 
-	g_free(stack);
+	if (index == (size_t)-1)
+		index = packed->rpa_count;
 
-	return (rpc_prim_create(RPC_TYPE_ERROR, val));
-}
+	if (index > packed->rpa_count)
+		return (false);
 
+	if (index == packed->rpa_count) {
+		if (packed->rpa_count == packed->rpa_capacity) {
+			capacity = MAX(packed->rpa_capacity * 2,
+			    RPC_ARRAY_PACK_MIN);
+			packed->rpa_data = rpc_realloc(RPC_ALLOC_TAG_OBJECT,
+			    packed->rpa_data,
+			    packed->rpa_capacity * sizeof(int64_t),
+			    capacity * sizeof(int64_t));
+			packed->rpa_capacity = capacity;
+		}
 
-rpc_object_t
-rpc_error_create_from_gerror(GError *g_error)
-{
+		packed->rpa_count++;
+	}
 
-        return (rpc_error_create(g_error->code, g_error->message, NULL));
+	memcpy((char *)packed->rpa_data + index * sizeof(int64_t), value,
+	    sizeof(int64_t));
+	return (true);
 }
 
-
-rpc_object_t
-rpc_error_create_with_stack(int code, const char *msg, rpc_object_t extra,
-    rpc_object_t stack)
+static void
+rpc_array_unpack(rpc_object_t array)
 {
-	rpc_object_t result;
+	struct rpc_packed_array *packed = array->ro_value.rv_packed;
+	GPtrArray *list;
+	size_t i;
 
-	result = rpc_error_create(code, msg, extra);
-	rpc_release(result->ro_value.rv_error.rev_stack);
-	result->ro_value.rv_error.rev_stack = stack;
-	rpc_retain(stack);
-	return (result);
-}
+	if (packed == NULL)
+		return;
 
+	list = g_ptr_array_new_full((guint)packed->rpa_count,
+	    (GDestroyNotify)rpc_release_impl);
+	for (i = 0; i < packed->rpa_count; i++)
+		g_ptr_array_add(list, rpc_packed_box(packed, i));
 
-int
-rpc_error_get_code(rpc_object_t error)
+	array->ro_value.rv_packed = NULL;
+	array->ro_value.rv_shares = NULL;
+	array->ro_value.rv_list = list;
+	rpc_packed_free(packed);
+}
+
+inline rpc_object_t
+rpc_array_create(void)
 {
-	if (rpc_get_type(error) != RPC_TYPE_ERROR)
-		return (-1);
+	union rpc_value val;
 
-	return (error->ro_value.rv_error.rev_code);
+	val.rv_list = g_ptr_array_new_with_free_func(
+	    (GDestroyNotify)rpc_release_impl);
+	val.rv_packed = NULL;
+	val.rv_shares = NULL;
+	return (rpc_prim_create(RPC_TYPE_ARRAY, val));
 }
 
-const char *
-rpc_error_get_message(rpc_object_t error)
+rpc_object_t
+rpc_array_create_typed(rpc_type_t type, const void *values, size_t count)
 {
-	if (rpc_get_type(error) != RPC_TYPE_ERROR)
+	struct rpc_packed_array *packed;
+	union rpc_value val;
+
+	if (!rpc_array_packable(type)) {
+		rpc_set_last_errorf(EINVAL, "Cannot pack %s values",
+		    rpc_get_type_name(type));
 		return (NULL);
+	}
 
-	return (error->ro_value.rv_error.rev_message->str);
+	packed = rpc_alloc(RPC_ALLOC_TAG_OBJECT, sizeof(*packed));
+	packed->rpa_type = type;
+	packed->rpa_count = count;
+	packed->rpa_capacity = MAX(count, 1);
+	packed->rpa_data = rpc_alloc0(RPC_ALLOC_TAG_OBJECT,
+	    packed->rpa_capacity * sizeof(int64_t));
+
+	if (values != NULL)
+		memcpy(packed->rpa_data, values, count * sizeof(int64_t));
+
+	val.rv_list = NULL;
+	val.rv_packed = packed;
+	val.rv_shares = NULL;
+	return (rpc_prim_create(RPC_TYPE_ARRAY, val));
 }
 
-rpc_object_t
-rpc_error_get_extra(rpc_object_t error)
+rpc_type_t
+rpc_array_get_packed_type(rpc_object_t array)
 {
-	if (rpc_get_type(error) != RPC_TYPE_ERROR)
-		return (NULL);
 
-	return (error->ro_value.rv_error.rev_extra);
+	if (array->ro_type != RPC_TYPE_ARRAY ||
+	    array->ro_value.rv_packed == NULL)
+		return (RPC_TYPE_NULL);
+
+	return (array->ro_value.rv_packed->rpa_type);
 }
 
-rpc_object_t
-rpc_error_get_stack(rpc_object_t error)
+int64_t *
+rpc_array_get_int64_ptr(rpc_object_t array)
 {
-	if (rpc_get_type(error) != RPC_TYPE_ERROR)
+
+	if (rpc_array_get_packed_type(array) != RPC_TYPE_INT64)
 		return (NULL);
 
-	return (error->ro_value.rv_error.rev_stack);
+	return (array->ro_value.rv_packed->rpa_int64);
 }
 
-void
-rpc_error_set_extra(rpc_object_t error, rpc_object_t extra)
+uint64_t *
+rpc_array_get_uint64_ptr(rpc_object_t array)
 {
 
-	if (rpc_get_type(error) != RPC_TYPE_ERROR)
-		return;
-
-	if (error->ro_value.rv_error.rev_extra != NULL)
-		rpc_release(error->ro_value.rv_error.rev_extra);
+	if (rpc_array_get_packed_type(array) != RPC_TYPE_UINT64)
+		return (NULL);
 
-	rpc_retain(extra);
-	error->ro_value.rv_error.rev_extra = extra;
+	return (array->ro_value.rv_packed->rpa_uint64);
 }
 
-inline rpc_object_t
-rpc_array_create(void)
+double *
+rpc_array_get_double_ptr(rpc_object_t array)
 {
-	union rpc_value val;
 
-	val.rv_list = g_ptr_array_new_with_free_func(
-	    (GDestroyNotify)rpc_release_impl);
-	return (rpc_prim_create(RPC_TYPE_ARRAY, val));
+	if (rpc_array_get_packed_type(array) != RPC_TYPE_DOUBLE)
+		return (NULL);
+
+	return (array->ro_value.rv_packed->rpa_double);
 }
 
 inline rpc_object_t
 rpc_array_create_ex(const rpc_object_t *objects, size_t count, bool steal)
 {
 	rpc_object_t array_object;
+	union rpc_value val;
 	size_t i;
 	void (*setter_fn)(rpc_object_t, rpc_object_t);
 
 	setter_fn = steal ? &rpc_array_append_stolen_value :
 	    &rpc_array_append_value;
 
-	array_object = rpc_array_create();
+	/* Sized up front, so filling it never reallocates */
+	val.rv_list = g_ptr_array_sized_new((guint)count);
+	g_ptr_array_set_free_func(val.rv_list,
+	    (GDestroyNotify)rpc_release_impl);
+	val.rv_packed = NULL;
+	val.rv_shares = NULL;
+
+	array_object = rpc_prim_create(RPC_TYPE_ARRAY, val);
 	for (i = 0; i < count; i++)
 		setter_fn(array_object, objects[i]);
 
@@ -1692,6 +2336,16 @@ rpc_array_steal_value(rpc_object_t array, size_t index, rpc_object_t value)
 	if (array->ro_type != RPC_TYPE_ARRAY)
 		rpc_abort("Trying array API on non-array object");
 
+	rpc_object_check_mutable(array);
+
+	if (array->ro_value.rv_packed != NULL && value->ro_typei == NULL &&
+	    rpc_packed_put(array, index, value->ro_type, &value->ro_value)) {
+		rpc_release_impl(value);
+		return;
+	}
+
+	rpc_array_unpack(array);
+	rpc_array_unshare(array);
 	for (i = (index - array->ro_value.rv_list->len); i > 0; i--) {
 		rpc_array_append_stolen_value(
 		    array,
@@ -1712,13 +2366,25 @@ rpc_array_steal_value(rpc_object_t array, size_t index, rpc_object_t value)
 inline void
 rpc_array_remove_index(rpc_object_t array, size_t index)
 {
+	struct rpc_packed_array *packed;
 
 	if (array->ro_type != RPC_TYPE_ARRAY)
 		rpc_abort("Trying array API on non-array object");
 
+	rpc_object_check_mutable(array);
+
 	if (index >= rpc_array_get_count(array))
 		return;
 
+	packed = array->ro_value.rv_packed;
+	if (packed != NULL) {
+		memmove(packed->rpa_int64 + index, packed->rpa_int64 + index + 1,
+		    (packed->rpa_count - index - 1) * sizeof(int64_t));
+		packed->rpa_count--;
+		return;
+	}
+
+	rpc_array_unshare(array);
 	g_ptr_array_remove_index(array->ro_value.rv_list, (guint)index);
 }
 
@@ -1730,10 +2396,18 @@ rpc_array_remove_all(rpc_object_t array)
 	if (array->ro_type != RPC_TYPE_ARRAY)
 		rpc_abort("Trying array API on non-array object");
 
+	rpc_object_check_mutable(array);
+
 	cnt = rpc_array_get_count(array);
 	if (cnt == 0)
 		return;
 
+	if (array->ro_value.rv_packed != NULL) {
+		array->ro_value.rv_packed->rpa_count = 0;
+		return;
+	}
+
+	rpc_array_unshare(array);
 	g_ptr_array_remove_range(array->ro_value.rv_list, 0, (guint)cnt);
 }
 
@@ -1752,15 +2426,27 @@ rpc_array_append_stolen_value(rpc_object_t array, rpc_object_t value)
 	if (array->ro_type != RPC_TYPE_ARRAY)
 		rpc_abort("Trying array API on non-array object");
 
+	rpc_object_check_mutable(array);
+
+	if (array->ro_value.rv_packed != NULL) {
+		rpc_array_steal_value(array, (size_t)-1, value);
+		return;
+	}
+
+	rpc_array_unshare(array);
 	g_ptr_array_add(array->ro_value.rv_list, value);
 }
 
 inline rpc_object_t
 rpc_array_get_value(rpc_object_t array, size_t index)
 {
+	rpc_object_t value;
+
 	if (array->ro_type != RPC_TYPE_ARRAY)
 		return (NULL);
 
+	/* The caller borrows the element, so it has to exist for real */
+	rpc_array_unpack(array);
 	if (index >= array->ro_value.rv_list->len)
 		return (NULL);
 
@@ -1773,15 +2459,47 @@ rpc_array_get_count(rpc_object_t array)
 	if (array->ro_type != RPC_TYPE_ARRAY)
 		return (0);
 
+	if (array->ro_value.rv_packed != NULL)
+		return (array->ro_value.rv_packed->rpa_count);
+
 	return (array->ro_value.rv_list->len);
 }
 
+/*
+ * Runs an applier over a packed array without boxing it for good, so
+ * concurrent readers don't race on the conversion.
+ */
+static bool
+rpc_packed_apply(struct rpc_packed_array *packed, rpc_array_applier_t applier,
+    bool reverse)
+{
+	rpc_object_t v;
+	size_t i;
+	size_t idx;
+	bool stop;
+
+	for (i = 0; i < packed->rpa_count; i++) {
+		idx = reverse ? packed->rpa_count - i - 1 : i;
+		v = rpc_packed_box(packed, idx);
+		stop = !applier(idx, v);
+		rpc_release_impl(v);
+		if (stop)
+			return (true);
+	}
+
+	return (false);
+}
+
 inline bool
 rpc_array_apply(rpc_object_t array, rpc_array_applier_t applier)
 {
 	bool flag = false;
 	size_t i;
 
+	if (array->ro_value.rv_packed != NULL)
+		return (rpc_packed_apply(array->ro_value.rv_packed, applier,
+		    false));
+
 	for (i = 0; i < array->ro_value.rv_list->len; i++) {
 		if (!applier(i, g_ptr_array_index(array->ro_value.rv_list, i))) {
 			flag = true;
@@ -1798,6 +2516,9 @@ rpc_array_map(rpc_object_t array, rpc_array_mapper_t mapper)
 	rpc_object_t oldv, newv;
 	size_t i;
 
+	rpc_object_check_mutable(array);
+	rpc_array_unpack(array);
+	rpc_array_unshare(array);
 	for (i = 0; i < array->ro_value.rv_list->len; i++) {
 		oldv = g_ptr_array_index(array->ro_value.rv_list, i);
 		newv = mapper(i, oldv);
@@ -1833,6 +2554,10 @@ rpc_array_reverse_apply(rpc_object_t array, rpc_array_applier_t applier)
 	size_t i;
 	size_t idx;
 
+	if (array->ro_value.rv_packed != NULL)
+		return (rpc_packed_apply(array->ro_value.rv_packed, applier,
+		    true));
+
 	for (i = array->ro_value.rv_list->len; i > 0 ; i--) {
 		idx = i - 1;
 		if (!applier(idx, g_ptr_array_index(array->ro_value.rv_list,
@@ -1852,21 +2577,206 @@ rpc_array_sort(rpc_object_t array, rpc_array_cmp_t comparator)
 	if (array->ro_type != RPC_TYPE_ARRAY)
 		rpc_abort("Trying array API on non-array object");
 
+	rpc_object_check_mutable(array);
+
+	rpc_array_unpack(array);
+	rpc_array_unshare(array);
 	g_ptr_array_sort_with_data(array->ro_value.rv_list,
 	    &rpc_array_comparator_converter, (void *)comparator);
 }
 
+/*
+ * Parallel variants. The array is split into chunks of grain elements,
+ * which run as tasks on the library's shared pool, see
+ * rpc_workq_parallel(). Arrays of up to grain elements are handed to
+ * the sequential functions.
+ */
+bool
+rpc_array_apply_parallel(rpc_object_t array, size_t grain,
+    rpc_array_applier_t applier)
+{
+	__block gint stop = 0;
+	struct rpc_packed_array *packed;
+	gpointer *values;
+	size_t count;
+
+	if (array->ro_type != RPC_TYPE_ARRAY)
+		rpc_abort("Trying array API on non-array object");
+
+	grain = grain > 0 ? grain : RPC_ARRAY_PARALLEL_GRAIN;
+	count = rpc_array_get_count(array);
+	if (count <= grain)
+		return (rpc_array_apply(array, applier));
+
+	packed = array->ro_value.rv_packed;
+	values = packed == NULL ? array->ro_value.rv_list->pdata : NULL;
+
+	rpc_workq_parallel((count + grain - 1) / grain, ^(size_t chunk) {
+		rpc_object_t v;
+		size_t end = MIN(count, (chunk + 1) * grain);
+		size_t i;
+		bool cont;
+
+		for (i = chunk * grain; i < end; i++) {
+			if (g_atomic_int_get(&stop))
+				return;
+
+			if (packed == NULL) {
+				cont = applier(i, values[i]);
+			} else {
+				v = rpc_packed_box(packed, i);
+				cont = applier(i, v);
+				rpc_release_impl(v);
+			}
+
+			if (!cont) {
+				g_atomic_int_set(&stop, 1);
+				return;
+			}
+		}
+	});
+
+	return (stop != 0);
+}
+
+void
+rpc_array_map_parallel(rpc_object_t array, size_t grain,
+    rpc_array_mapper_t mapper)
+{
+	gpointer *values;
+	size_t count;
+
+	if (array->ro_type != RPC_TYPE_ARRAY)
+		rpc_abort("Trying array API on non-array object");
+
+	rpc_object_check_mutable(array);
+
+	grain = grain > 0 ? grain : RPC_ARRAY_PARALLEL_GRAIN;
+	count = rpc_array_get_count(array);
+	if (count <= grain) {
+		rpc_array_map(array, mapper);
+		return;
+	}
+
+	/* Results go straight into the slots of the elements they replace */
+	rpc_array_unpack(array);
+	rpc_array_unshare(array);
+	values = array->ro_value.rv_list->pdata;
+
+	rpc_workq_parallel((count + grain - 1) / grain, ^(size_t chunk) {
+		rpc_object_t oldv;
+		size_t end = MIN(count, (chunk + 1) * grain);
+		size_t i;
+
+		for (i = chunk * grain; i < end; i++) {
+			oldv = values[i];
+			values[i] = mapper(i, oldv);
+			rpc_release_impl(oldv);
+		}
+	});
+}
+
+static void
+rpc_array_merge(gpointer *src, gpointer *dst, size_t lo, size_t mid,
+    size_t hi, rpc_array_cmp_t comparator)
+{
+	size_t i = lo;
+	size_t j = mid;
+	size_t k = lo;
+
+	/* Ties go to the left run, which keeps the sort stable */
+	while (i < mid && j < hi) {
+		if (comparator(src[j], src[i]) < 0)
+			dst[k++] = src[j++];
+		else
+			dst[k++] = src[i++];
+	}
+
+	while (i < mid)
+		dst[k++] = src[i++];
+
+	while (j < hi)
+		dst[k++] = src[j++];
+}
+
+void
+rpc_array_sort_parallel(rpc_object_t array, size_t grain,
+    rpc_array_cmp_t comparator)
+{
+	gpointer *values;
+	gpointer *src;
+	gpointer *dst;
+	gpointer *tmp;
+	size_t count;
+	size_t width;
+
+	if (array->ro_type != RPC_TYPE_ARRAY)
+		rpc_abort("Trying array API on non-array object");
+
+	rpc_object_check_mutable(array);
+
+	grain = grain > 0 ? grain : RPC_ARRAY_PARALLEL_GRAIN;
+	count = rpc_array_get_count(array);
+	if (count <= grain) {
+		rpc_array_sort(array, comparator);
+		return;
+	}
+
+	rpc_array_unpack(array);
+	rpc_array_unshare(array);
+	values = array->ro_value.rv_list->pdata;
+
+	/* Sort runs of grain elements, then merge pairs of runs per pass */
+	src = values;
+	rpc_workq_parallel((count + grain - 1) / grain, ^(size_t run) {
+		size_t start = run * grain;
+
+		g_qsort_with_data(src + start, (gint)MIN(grain, count - start),
+		    sizeof(gpointer), &rpc_array_comparator_converter,
+		    (void *)comparator);
+	});
+
+	dst = g_malloc_n(count, sizeof(gpointer));
+	for (width = grain; width < count; width *= 2) {
+		rpc_workq_parallel((count + 2 * width - 1) / (2 * width),
+		    ^(size_t pair) {
+			size_t lo = pair * 2 * width;
+
+			rpc_array_merge(src, dst, lo, MIN(lo + width, count),
+			    MIN(lo + 2 * width, count), comparator);
+		});
+
+		tmp = src;
+		src = dst;
+		dst = tmp;
+	}
+
+	if (src != values) {
+		memcpy(values, src, count * sizeof(gpointer));
+		dst = src;
+	}
+
+	g_free(dst);
+}
+
 rpc_object_t
 rpc_array_slice(rpc_object_t array, size_t index, ssize_t len)
 {
 	size_t i;
 	size_t end;
 	rpc_object_t result;
+	struct rpc_packed_array *packed = array->ro_value.rv_packed;
 
 	if (len == -1)
-		end = array->ro_value.rv_list->len;
+		end = rpc_array_get_count(array);
 	else
-		end = MIN(array->ro_value.rv_list->len, index + len);
+		end = MIN(rpc_array_get_count(array), index + len);
+
+	if (packed != NULL) {
+		return (rpc_array_create_typed(packed->rpa_type,
+		    packed->rpa_int64 + MIN(index, end),
+		    end - MIN(index, end)));
+	}
 
 	result = rpc_array_create();
 
@@ -1887,6 +2797,9 @@ inline void
 rpc_array_set_int64(rpc_object_t array, size_t index, int64_t value)
 {
 
+	if (rpc_packed_put(array, index, RPC_TYPE_INT64, &value))
+		return;
+
 	rpc_array_steal_value(array, index, rpc_int64_create(value));
 }
 
@@ -1894,6 +2807,9 @@ inline void
 rpc_array_set_uint64(rpc_object_t array, size_t index, uint64_t value)
 {
 
+	if (rpc_packed_put(array, index, RPC_TYPE_UINT64, &value))
+		return;
+
 	rpc_array_steal_value(array, index, rpc_uint64_create(value));
 }
 
@@ -1901,6 +2817,9 @@ inline void
 rpc_array_set_double(rpc_object_t array, size_t index, double value)
 {
 
+	if (rpc_packed_put(array, index, RPC_TYPE_DOUBLE, &value))
+		return;
+
 	rpc_array_steal_value(array, index, rpc_double_create(value));
 }
 
@@ -1952,6 +2871,9 @@ rpc_array_get_int64(rpc_object_t array, size_t index)
 	if (index >= rpc_array_get_count(array))
 		return (0);
 
+	if (rpc_array_get_packed_type(array) == RPC_TYPE_INT64)
+		return (array->ro_value.rv_packed->rpa_int64[index]);
+
 	return (rpc_int64_get_value(rpc_array_get_value(array, index)));
 }
 
@@ -1961,6 +2883,9 @@ rpc_array_get_uint64(rpc_object_t array, size_t index)
 	if (index >= rpc_array_get_count(array))
 		return (0);
 
+	if (rpc_array_get_packed_type(array) == RPC_TYPE_UINT64)
+		return (array->ro_value.rv_packed->rpa_uint64[index]);
+
 	return (rpc_uint64_get_value(rpc_array_get_value(array, index)));
 }
 
@@ -1971,6 +2896,9 @@ rpc_array_get_double(rpc_object_t array, size_t index)
 	if (index >= rpc_array_get_count(array))
 		return (0);
 
+	if (rpc_array_get_packed_type(array) == RPC_TYPE_DOUBLE)
+		return (array->ro_value.rv_packed->rpa_double[index]);
+
 	return (rpc_double_get_value(rpc_array_get_value(array, index)));
 }
 
@@ -2036,8 +2964,7 @@ rpc_dictionary_create(void)
 {
 	union rpc_value val;
 
-	val.rv_dict = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
-	    (GDestroyNotify)rpc_release_impl);
+	val.rv_dict = rpc_dict_new(0);
 
 	return (rpc_prim_create(RPC_TYPE_DICTIONARY, val));
 }
@@ -2047,13 +2974,16 @@ rpc_dictionary_create_ex(const char * const *keys, const rpc_object_t *values,
     size_t count, bool steal)
 {
 	rpc_object_t object;
+	union rpc_value val;
 	size_t i;
 	void (*setter_fn)(rpc_object_t, const char *, rpc_object_t);
 
 	setter_fn = steal ? &rpc_dictionary_steal_value :
 	    &rpc_dictionary_set_value;
 
-	object = rpc_dictionary_create();
+	/* Sized for all the keys, so filling it never rehashes */
+	val.rv_dict = rpc_dict_new(count);
+	object = rpc_prim_create(RPC_TYPE_DICTIONARY, val);
 
 	for (i = 0; i < count; i++)
 		setter_fn(object, keys[i], values[i]);
@@ -2068,8 +2998,8 @@ rpc_dictionary_set_value(rpc_object_t dictionary, const char *key,
 	if (value == NULL)
 		rpc_dictionary_remove_key(dictionary, key);
 	else {
-		rpc_dictionary_steal_value(dictionary, key, value);
 		rpc_retain(value);
+		rpc_dictionary_steal_value(dictionary, key, value);
 	}
 }
 
@@ -2081,8 +3011,10 @@ rpc_dictionary_steal_value(rpc_object_t dictionary, const char *key,
 	if (dictionary->ro_type != RPC_TYPE_DICTIONARY)
 		rpc_abort("Trying dictionary API on non-dictionary object");
 
-	g_hash_table_insert(dictionary->ro_value.rv_dict,
-	    (gpointer)g_strdup(key), value);
+	rpc_object_check_mutable(dictionary);
+
+	rpc_dictionary_unshare(dictionary);
+	rpc_dict_insert(dictionary->ro_value.rv_dict, key, value);
 }
 
 inline void
@@ -2093,8 +3025,10 @@ rpc_dictionary_steal_value_internal(rpc_object_t dictionary, const char *key,
 	if (dictionary->ro_type != RPC_TYPE_DICTIONARY)
 		rpc_abort("Trying dictionary API on non-dictionary object");
 
-	g_hash_table_insert(dictionary->ro_value.rv_dict,
-	    (gpointer)g_strdup(key), value);
+	rpc_object_check_mutable(dictionary);
+
+	rpc_dictionary_unshare(dictionary);
+	rpc_dict_insert(dictionary->ro_value.rv_dict, key, value);
 }
 
 inline void
@@ -2104,7 +3038,10 @@ rpc_dictionary_remove_key(rpc_object_t dictionary, const char *key)
 	if (dictionary->ro_type != RPC_TYPE_DICTIONARY)
 		rpc_abort("Trying dictionary API on non-dictionary object");
 
-	g_hash_table_remove(dictionary->ro_value.rv_dict, key);
+	rpc_object_check_mutable(dictionary);
+
+	rpc_dictionary_unshare(dictionary);
+	rpc_dict_remove(dictionary->ro_value.rv_dict, key);
 }
 
 inline void
@@ -2114,7 +3051,10 @@ rpc_dictionary_remove_all(rpc_object_t dictionary)
 	if (dictionary->ro_type != RPC_TYPE_DICTIONARY)
 		rpc_abort("Trying dictionary API on non-dictionary object");
 
-	g_hash_table_remove_all(dictionary->ro_value.rv_dict);
+	rpc_object_check_mutable(dictionary);
+
+	rpc_dictionary_unshare(dictionary);
+	rpc_dict_remove_all(dictionary->ro_value.rv_dict);
 
 }
 
@@ -2126,6 +3066,8 @@ rpc_dictionary_detach_key(rpc_object_t dictionary, const char *key)
 	if (dictionary->ro_type != RPC_TYPE_DICTIONARY)
 		rpc_abort("Trying dictionary API on non-dictionary object");
 
+	rpc_object_check_mutable(dictionary);
+
 	result = rpc_dictionary_get_value(dictionary, key);
 	if (result == NULL)
 		return (NULL);
@@ -2144,49 +3086,43 @@ rpc_dictionary_get_value(rpc_object_t dictionary,
 	if (dictionary->ro_type != RPC_TYPE_DICTIONARY)
 		return (NULL);
 
-	return ((rpc_object_t)g_hash_table_lookup(
-	    dictionary->ro_value.rv_dict, key));
+	return (rpc_dict_lookup(dictionary->ro_value.rv_dict, key));
 }
 
 inline size_t
 rpc_dictionary_get_count(rpc_object_t dictionary)
 {
 
-	return ((size_t)g_hash_table_size(dictionary->ro_value.rv_dict));
+	return ((size_t)dictionary->ro_value.rv_dict->rd_count);
 }
 
 inline bool
 rpc_dictionary_apply(rpc_object_t dictionary, rpc_dictionary_applier_t applier)
 {
-	GHashTableIter iter;
-	gpointer key, value;
-	bool flag = false;
+	struct rpc_dict_entry *e;
+	size_t pos = 0;
 
-	g_hash_table_iter_init(&iter, dictionary->ro_value.rv_dict);
-
-	while (g_hash_table_iter_next(&iter, &key, &value)) {
-		if (!applier((const char *)key, (rpc_object_t)value)) {
-			flag = true;
-			break;
-		}
+	while ((e = rpc_dict_next(dictionary->ro_value.rv_dict, &pos)) != NULL) {
+		if (!applier(e->rde_key, e->rde_value))
+			return (true);
 	}
 
-	return (flag);
+	return (false);
 }
 
 inline void
 rpc_dictionary_map(rpc_object_t dictionary, rpc_dictionary_mapper_t mapper)
 {
-	GHashTableIter iter;
-	gpointer key, value;
-	rpc_object_t oldv, newv;
-
-	g_hash_table_iter_init(&iter, dictionary->ro_value.rv_dict);
+	struct rpc_dict_entry *e;
+	rpc_object_t oldv;
+	size_t pos = 0;
 
-	while (g_hash_table_iter_next(&iter, &key, &value)) {
-		oldv = (rpc_object_t)value;
-		newv = mapper((const char *)key, oldv);
-		g_hash_table_iter_replace(&iter, newv);
+	rpc_object_check_mutable(dictionary);
+	rpc_dictionary_unshare(dictionary);
+	while ((e = rpc_dict_next(dictionary->ro_value.rv_dict, &pos)) != NULL) {
+		oldv = e->rde_value;
+		e->rde_value = mapper(e->rde_key, oldv);
+		rpc_release_impl(oldv);
 	}
 }
 
@@ -2194,7 +3130,7 @@ inline bool
 rpc_dictionary_has_key(rpc_object_t dictionary, const char *key)
 {
 
-	return (g_hash_table_lookup(dictionary->ro_value.rv_dict, key) != NULL);
+	return (rpc_dict_lookup(dictionary->ro_value.rv_dict, key) != NULL);
 }
 
 inline void
@@ -0,0 +1,750 @@
+/*
+ * Copyright 2015-2017 Two Pore Guys, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <glib.h>
+#include <rpc/object.h>
+#include <rpc/typing.h>
+#include "internal.h"
+
+/*
+ * Compiled rpc_object_pack()/rpc_object_unpack() format strings.
+ *
+ * A format is parsed once into a flat, pre-order list of ops: one per
+ * value, plus an opening and a closing op per container. Each op records
+ * where its value goes in the enclosing container (a literal key or
+ * index from the format, or one taken from the argument list), so
+ * executing a format is a single pass over the list that never looks at
+ * the string again.
+ *
+ * rpc_object_vpack() and rpc_object_vunpack() go through a process-wide
+ * cache of compiled formats keyed by their text. Call sites that want to
+ * skip even that lookup keep the compiled format themselves, see
+ * RPC_PACK_FMT().
+ */
+
+#define	RPC_PACK_MAX_DEPTH	32
+#define	RPC_PACK_CACHE_MAX	512
+#define	RPC_PACK_STOP_CHARS	"<[]{}'"
+#define	RPC_PACK_CHARS		"vVnbBIfiudDs'"
+#define	RPC_UNPACK_CHARS	"*vbBfiudsR"
+
+typedef enum {
+	RPC_PACK_KEY_NONE = 0,
+	RPC_PACK_KEY_ARG,
+	RPC_PACK_KEY_NAME,
+	RPC_PACK_KEY_INDEX,
+	RPC_PACK_KEY_NEXT
+} rpc_pack_key_t;
+
+struct rpc_pack_op
+{
+	char			rpo_ch;
+	rpc_pack_key_t		rpo_key;
+	char *			rpo_name;
+	size_t			rpo_index;
+	char *			rpo_type;
+	char *			rpo_str;
+	size_t			rpo_len;
+};
+
+struct rpc_pack_fmt
+{
+	struct rpc_pack_op *	rpf_ops;
+	size_t			rpf_nops;
+	bool			rpf_pack;
+	bool			rpf_unpack;
+};
+
+struct rpc_pack_frame
+{
+	rpc_object_t		rpf_container;
+	bool			rpf_array;
+	const char *		rpf_key;
+	size_t			rpf_index;
+	size_t			rpf_next;
+};
+
+static void rpc_pack_op_clear(struct rpc_pack_op *);
+static const char *rpc_pack_compile_key(const char *, char,
+    struct rpc_pack_op *);
+static const char *rpc_pack_compile_value(GArray *, const char *, char,
+    size_t, struct rpc_pack_op *);
+static rpc_pack_fmt_t rpc_pack_fmt_intern(const char *, bool *);
+
+static GHashTable *rpc_pack_cache;
+static GRWLock rpc_pack_cache_lock;
+
+static void
+rpc_pack_op_clear(struct rpc_pack_op *op)
+{
+
+	g_free(op->rpo_name);
+	g_free(op->rpo_type);
+	g_free(op->rpo_str);
+}
+
+/*
+ * Parses the optional "key:" or "index:" prefix of a container element.
+ * Without one, dictionary keys come from the argument list and array
+ * indexes follow the previous element.
+ */
+static const char *
+rpc_pack_compile_key(const char *p, char delim, struct rpc_pack_op *op)
+{
+	const char *colon = NULL;
+	const char *s;
+	char *end;
+
+	for (s = p; *s != ','; s++) {
+		if (*s == ':')
+			colon = s;
+
+		if (strchr(RPC_PACK_STOP_CHARS, *s) != NULL)
+			break;
+	}
+
+	if (colon == NULL) {
+		op->rpo_key = delim == '}' ? RPC_PACK_KEY_ARG : RPC_PACK_KEY_NEXT;
+		return (p);
+	}
+
+	if (delim == '}') {
+		op->rpo_key = RPC_PACK_KEY_NAME;
+		op->rpo_name = g_strndup(p, (gsize)(colon - p));
+		return (colon + 1);
+	}
+
+	op->rpo_key = RPC_PACK_KEY_INDEX;
+	op->rpo_index = (size_t)strtoul(p, &end, 10);
+	if (end != colon)
+		return (NULL);
+
+	return (colon + 1);
+}
+
+/*
+ * Parses one value and appends its ops, taking over the strings already
+ * attached to the op. Returns the position after the value and its
+ * trailing separator, or NULL on a malformed format.
+ */
+static const char *
+rpc_pack_compile_value(GArray *ops, const char *p, char delim, size_t depth,
+    struct rpc_pack_op *op)
+{
+	struct rpc_pack_op child;
+	const char *start;
+	const char *s;
+	uint32_t nesting;
+	char close;
+
+	if (delim != '\0') {
+		/* As before, a scalar is the last character of its element */
+		for (s = p; *s != ',' && *s != delim; s++) {
+			if (strchr(RPC_PACK_STOP_CHARS, *s) != NULL)
+				break;
+		}
+
+		if (*s == ',' || *s == delim) {
+			if (s == p)
+				goto error;
+
+			op->rpo_ch = *(s - 1);
+			g_array_append_val(ops, *op);
+			return (*s == ',' ? s + 1 : s);
+		}
+
+		p = s;
+	}
+
+	switch (*p) {
+	case '<':
+		if (op->rpo_type != NULL)
+			goto error;
+
+		start = ++p;
+		for (nesting = 1; nesting != 0; p++) {
+			if (*p == '\0')
+				goto error;
+
+			if (*p == '<')
+				nesting++;
+
+			if (*p == '>')
+				nesting--;
+		}
+
+		op->rpo_type = g_strndup(start, (gsize)(p - 1 - start));
+		return (rpc_pack_compile_value(ops, p, delim, depth, op));
+
+	case '{':
+	case '[':
+		if (depth == RPC_PACK_MAX_DEPTH)
+			goto error;
+
+		close = *p == '{' ? '}' : ']';
+		op->rpo_ch = *p;
+		g_array_append_val(ops, *op);
+
+		for (p++; *p != close;) {
+			memset(&child, 0, sizeof(child));
+			p = rpc_pack_compile_key(p, close, &child);
+			if (p == NULL) {
+				rpc_pack_op_clear(&child);
+				return (NULL);
+			}
+
+			p = rpc_pack_compile_value(ops, p, close, depth + 1,
+			    &child);
+			if (p == NULL)
+				return (NULL);
+		}
+
+		memset(&child, 0, sizeof(child));
+		child.rpo_ch = close;
+		g_array_append_val(ops, child);
+		p++;
+		break;
+
+	case '\'':
+		s = strchr(p + 1, '\'');
+		if (s == NULL)
+			goto error;
+
+		op->rpo_ch = '\'';
+		op->rpo_len = (size_t)(s - p - 1);
+		op->rpo_str = g_strndup(p + 1, op->rpo_len);
+		g_array_append_val(ops, *op);
+		p = s + 1;
+		break;
+
+	default:
+		if (delim != '\0' || *p == '\0')
+			goto error;
+
+		op->rpo_ch = *p;
+		g_array_append_val(ops, *op);
+		return (p + 1);
+	}
+
+	if (delim != '\0' && *p == ',')
+		p++;
+
+	return (p);
+
+error:
+	rpc_pack_op_clear(op);
+	return (NULL);
+}
+
+rpc_pack_fmt_t
+rpc_pack_fmt_compile(const char *fmt)
+{
+	struct rpc_pack_fmt *result;
+	struct rpc_pack_op op = { 0 };
+	struct rpc_pack_op *o;
+	GArray *ops;
+	size_t i;
+
+	ops = g_array_new(false, true, sizeof(struct rpc_pack_op));
+	if (rpc_pack_compile_value(ops, fmt, '\0', 0, &op) == NULL)
+		goto error;
+
+	result = g_malloc0(sizeof(*result));
+	result->rpf_pack = true;
+	result->rpf_unpack = true;
+
+	for (i = 0; i < ops->len; i++) {
+		o = &g_array_index(ops, struct rpc_pack_op, i);
+		if (strchr("{[]}", o->rpo_ch) != NULL)
+			continue;
+
+		if (o->rpo_ch == '\0' || (strchr(RPC_PACK_CHARS, o->rpo_ch) == NULL &&
+		    strchr(RPC_UNPACK_CHARS, o->rpo_ch) == NULL)) {
+			g_free(result);
+			goto error;
+		}
+
+		if (strchr(RPC_PACK_CHARS, o->rpo_ch) == NULL)
+			result->rpf_pack = false;
+
+		if (strchr(RPC_UNPACK_CHARS, o->rpo_ch) == NULL ||
+		    o->rpo_type != NULL)
+			result->rpf_unpack = false;
+	}
+
+	result->rpf_nops = ops->len;
+	result->rpf_ops = (struct rpc_pack_op *)(void *)g_array_free(ops,
+	    false);
+	return (result);
+
+error:
+	for (i = 0; i < ops->len; i++)
+		rpc_pack_op_clear(&g_array_index(ops, struct rpc_pack_op, i));
+
+	g_array_free(ops, true);
+	errno = EINVAL;
+	return (NULL);
+}
+
+void
+rpc_pack_fmt_free(rpc_pack_fmt_t fmt)
+{
+	size_t i;
+
+	if (fmt == NULL)
+		return;
+
+	for (i = 0; i < fmt->rpf_nops; i++)
+		rpc_pack_op_clear(&fmt->rpf_ops[i]);
+
+	g_free(fmt->rpf_ops);
+	g_free(fmt);
+}
+
+/*
+ * Cached compiled formats are never freed, so that pointers to them can
+ * be kept without any reference counting. If owned is given, a full cache
+ * makes this return a private copy instead, which the caller must free.
+ */
+static rpc_pack_fmt_t
+rpc_pack_fmt_intern(const char *fmt, bool *owned)
+{
+	rpc_pack_fmt_t result;
+	rpc_pack_fmt_t other;
+
+	g_rw_lock_reader_lock(&rpc_pack_cache_lock);
+	result = rpc_pack_cache != NULL
+	    ? g_hash_table_lookup(rpc_pack_cache, fmt)
+	    : NULL;
+	g_rw_lock_reader_unlock(&rpc_pack_cache_lock);
+
+	if (owned != NULL)
+		*owned = false;
+
+	if (result != NULL)
+		return (result);
+
+	result = rpc_pack_fmt_compile(fmt);
+	if (result == NULL)
+		return (NULL);
+
+	g_rw_lock_writer_lock(&rpc_pack_cache_lock);
+	if (rpc_pack_cache == NULL)
+		rpc_pack_cache = g_hash_table_new(g_str_hash, g_str_equal);
+
+	other = g_hash_table_lookup(rpc_pack_cache, fmt);
+	if (other == NULL && (owned == NULL ||
+	    g_hash_table_size(rpc_pack_cache) < RPC_PACK_CACHE_MAX)) {
+		g_hash_table_insert(rpc_pack_cache, g_strdup(fmt), result);
+		other = result;
+	}
+	g_rw_lock_writer_unlock(&rpc_pack_cache_lock);
+
+	if (other == NULL) {
+		*owned = true;
+		return (result);
+	}
+
+	if (other != result)
+		rpc_pack_fmt_free(result);
+
+	return (other);
+}
+
+rpc_pack_fmt_t
+rpc_pack_fmt_get(const char *fmt)
+{
+
+	return (rpc_pack_fmt_intern(fmt, NULL));
+}
+
+rpc_pack_fmt_t
+rpc_pack_fmt_once(rpc_pack_fmt_t *slot, const char *fmt)
+{
+	rpc_pack_fmt_t result;
+
+	result = g_atomic_pointer_get(slot);
+	if (result != NULL)
+		return (result);
+
+	/* Racing threads get the same cached pointer */
+	result = rpc_pack_fmt_intern(fmt, NULL);
+	g_atomic_pointer_set(slot, result);
+	return (result);
+}
+
+rpc_object_t
+rpc_object_vpack(const char *fmt, va_list ap)
+{
+	rpc_pack_fmt_t compiled;
+	rpc_object_t result;
+	bool owned;
+
+	compiled = rpc_pack_fmt_intern(fmt, &owned);
+	if (compiled == NULL)
+		return (NULL);
+
+	result = rpc_object_vpack_fmt(compiled, ap);
+	if (owned)
+		rpc_pack_fmt_free(compiled);
+
+	return (result);
+}
+
+int
+rpc_object_vunpack(rpc_object_t obj, const char *fmt, va_list ap)
+{
+	rpc_pack_fmt_t compiled;
+	bool owned;
+	int result;
+
+	compiled = rpc_pack_fmt_intern(fmt, &owned);
+	if (compiled == NULL)
+		return (-1);
+
+	result = rpc_object_vunpack_fmt(obj, compiled, ap);
+	if (owned)
+		rpc_pack_fmt_free(compiled);
+
+	return (result);
+}
+
+rpc_object_t
+rpc_object_pack_fmt(rpc_pack_fmt_t fmt, ...)
+{
+	rpc_object_t result;
+	va_list ap;
+
+	va_start(ap, fmt);
+	result = rpc_object_vpack_fmt(fmt, ap);
+	va_end(ap);
+
+	return (result);
+}
+
+rpc_object_t
+rpc_object_vpack_fmt(rpc_pack_fmt_t fmt, va_list ap)
+{
+	struct rpc_pack_frame stack[RPC_PACK_MAX_DEPTH];
+	struct rpc_pack_frame *top;
+	const struct rpc_pack_op *op;
+	rpc_object_t current = NULL;
+	rpc_object_t tmp;
+	const char *key = NULL;
+	size_t depth = 0;
+	size_t idx = 0;
+	size_t i;
+
+	if (fmt == NULL || !fmt->rpf_pack) {
+		errno = EINVAL;
+		return (NULL);
+	}
+
+	for (i = 0; i < fmt->rpf_nops; i++) {
+		op = &fmt->rpf_ops[i];
+		if (op->rpo_ch == '}' || op->rpo_ch == ']') {
+			top = &stack[--depth];
+			current = top->rpf_container;
+			key = top->rpf_key;
+			idx = top->rpf_index;
+			goto insert;
+		}
+
+		/* Keys come before the value in the argument list */
+		if (depth > 0) {
+			top = &stack[depth - 1];
+			if (top->rpf_array) {
+				idx = op->rpo_key == RPC_PACK_KEY_INDEX
+				    ? op->rpo_index
+				    : top->rpf_next;
+				top->rpf_next = idx + 1;
+			} else {
+				key = op->rpo_key == RPC_PACK_KEY_NAME
+				    ? op->rpo_name
+				    : va_arg(ap, const char *);
+			}
+		}
+
+		switch (op->rpo_ch) {
+		case 'v':
+		case 'V':
+			current = va_arg(ap, rpc_object_t);
+			if (current == NULL) {
+				current = rpc_null_create();
+				break;
+			}
+
+			if (op->rpo_ch == 'V')
+				rpc_retain(current);
+
+			break;
+
+		case 'n':
+			current = rpc_null_create();
+			break;
+
+		case 'b':
+			current = rpc_bool_create(va_arg(ap, int));
+			break;
+
+		case 'B':
+			current = rpc_data_create(va_arg(ap, const void *),
+			    va_arg(ap, size_t),
+			    va_arg(ap, rpc_binary_destructor_t));
+			break;
+
+		case 'I':
+			current = rpc_data_create_iov(
+			    va_arg(ap, struct iovec *), va_arg(ap, size_t));
+			break;
+
+		case 'f':
+			current = rpc_fd_create(va_arg(ap, int));
+			break;
+
+		case 'i':
+			current = rpc_int64_create(va_arg(ap, int64_t));
+			break;
+
+		case 'u':
+			current = rpc_uint64_create(va_arg(ap, uint64_t));
+			break;
+
+		case 'd':
+			current = rpc_double_create(va_arg(ap, double));
+			break;
+
+		case 'D':
+			current = rpc_date_create(va_arg(ap, int64_t));
+			break;
+
+		case 's':
+			current = rpc_string_create(va_arg(ap, const char *));
+			break;
+
+		case '\'':
+			current = rpc_string_create_len(op->rpo_str,
+			    op->rpo_len);
+			break;
+
+		case '{':
+		case '[':
+			current = op->rpo_ch == '{'
+			    ? rpc_dictionary_create()
+			    : rpc_array_create();
+			break;
+
+		default:
+			g_assert_not_reached();
+		}
+
+		if (op->rpo_type != NULL) {
+			tmp = rpct_new(op->rpo_type, current);
+			rpc_release(current);
+			current = tmp;
+			if (current == NULL)
+				goto error;
+		}
+
+		if (op->rpo_ch == '{' || op->rpo_ch == '[') {
+			top = &stack[depth++];
+			top->rpf_container = current;
+			top->rpf_array = op->rpo_ch == '[';
+			top->rpf_key = key;
+			top->rpf_index = idx;
+			top->rpf_next = 0;
+			current = NULL;
+			continue;
+		}
+
+insert:
+		if (depth == 0)
+			return (current);
+
+		top = &stack[depth - 1];
+		if (top->rpf_array)
+			rpc_array_steal_value(top->rpf_container, idx, current);
+		else
+			rpc_dictionary_steal_value(top->rpf_container, key,
+			    current);
+
+		current = NULL;
+	}
+
+error:
+	/* Containers are only attached to their parents once closed */
+	while (depth > 0)
+		rpc_release(stack[--depth].rpf_container);
+
+	errno = EINVAL;
+	return (NULL);
+}
+
+int
+rpc_object_unpack_fmt(rpc_object_t obj, rpc_pack_fmt_t fmt, ...)
+{
+	va_list ap;
+	int result;
+
+	va_start(ap, fmt);
+	result = rpc_object_vunpack_fmt(obj, fmt, ap);
+	va_end(ap);
+
+	return (result);
+}
+
+int
+rpc_object_vunpack_fmt(rpc_object_t obj, rpc_pack_fmt_t fmt, va_list ap)
+{
+	struct rpc_pack_frame stack[RPC_PACK_MAX_DEPTH];
+	struct rpc_pack_frame *top;
+	const struct rpc_pack_op *op;
+	rpc_object_t container;
+	rpc_object_t current;
+	const char *key;
+	size_t depth = 0;
+	size_t idx = 0;
+	size_t i;
+	int cnt = 0;
+
+	if (obj == NULL || fmt == NULL || !fmt->rpf_unpack) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	for (i = 0; i < fmt->rpf_nops; i++) {
+		op = &fmt->rpf_ops[i];
+		if (op->rpo_ch == '}' || op->rpo_ch == ']') {
+			depth--;
+			continue;
+		}
+
+		/*
+		 * Missing containers still have their subtree walked, with
+		 * every lookup failing, to consume the matching arguments.
+		 */
+		current = obj;
+		if (depth > 0) {
+			top = &stack[depth - 1];
+			container = top->rpf_container;
+			if (top->rpf_array) {
+				idx = op->rpo_key == RPC_PACK_KEY_INDEX
+				    ? op->rpo_index
+				    : top->rpf_next;
+				top->rpf_next = idx + 1;
+				current = container != NULL
+				    ? rpc_array_get_value(container, idx)
+				    : NULL;
+			} else {
+				key = op->rpo_key == RPC_PACK_KEY_NAME
+				    ? op->rpo_name
+				    : va_arg(ap, const char *);
+				current = container != NULL
+				    ? rpc_dictionary_get_value(container, key)
+				    : NULL;
+			}
+		}
+
+		if (op->rpo_ch == '{' || op->rpo_ch == '[') {
+			top = &stack[depth++];
+			top->rpf_container = current;
+			top->rpf_array = op->rpo_ch == '[';
+			top->rpf_next = 0;
+			continue;
+		}
+
+		if (op->rpo_ch == 'R' && (depth == 0 ||
+		    !stack[depth - 1].rpf_array)) {
+			errno = EINVAL;
+			return (-1);
+		}
+
+		if (current == NULL) {
+			if (op->rpo_ch != '*')
+				va_arg(ap, void *);
+
+			if (op->rpo_ch == 'B')
+				va_arg(ap, void *);
+
+			continue;
+		}
+
+		switch (op->rpo_ch) {
+		case '*':
+			break;
+
+		case 'v':
+			*va_arg(ap, rpc_object_t *) = current;
+			break;
+
+		case 'b':
+			*va_arg(ap, bool *) = rpc_bool_get_value(current);
+			break;
+
+		case 'i':
+			*va_arg(ap, int64_t *) = rpc_int64_get_value(current);
+			break;
+
+		case 'u':
+			*va_arg(ap, uint64_t *) = rpc_uint64_get_value(current);
+			break;
+
+		case 'd':
+			*va_arg(ap, double *) = rpc_double_get_value(current);
+			break;
+
+		case 'f':
+			*va_arg(ap, int *) = rpc_fd_get_value(current);
+			break;
+
+		case 's':
+			*va_arg(ap, const char **) = rpc_string_get_string_ptr(
+			    current);
+			break;
+
+		case 'B':
+			*va_arg(ap, const void **) = rpc_data_get_bytes_ptr(
+			    current);
+			*va_arg(ap, size_t *) = rpc_data_get_length(current);
+			break;
+
+		case 'R':
+			*va_arg(ap, rpc_object_t *) = rpc_array_slice(
+			    stack[depth - 1].rpf_container, idx, -1);
+			break;
+
+		default:
+			g_assert_not_reached();
+		}
+
+		cnt++;
+	}
+
+	return (cnt);
+}
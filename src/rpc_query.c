@@ -34,7 +34,11 @@
 #endif
 #include "internal.h"
 
-static bool eval_rule(rpc_object_t obj, rpc_object_t rule);
+static struct rpc_query_rule *rpc_query_compile_rule(rpc_object_t);
+static struct rpc_query_rule *rpc_query_compile_list(rpc_query_rule_type_t,
+    rpc_object_t);
+static void rpc_query_rule_free(struct rpc_query_rule *);
+static bool rpc_query_rule_eval(struct rpc_query_rule *, rpc_object_t);
 
 static rpc_object_t
 rpc_query_get_parent(rpc_object_t object, const char *path,
@@ -63,203 +67,1053 @@ rpc_query_get_parent(rpc_object_t object, const char *path,
 }
 
 static bool
-eval_logic_and(rpc_object_t obj, rpc_object_t lst)
+op_in(rpc_object_t o1, rpc_object_t o2)
 {
-	__block bool result = false;
+	if (rpc_get_type(o2) == RPC_TYPE_ARRAY)
+		return (rpc_array_contains(o2, o1));
 
-	if (rpc_get_type(lst) != RPC_TYPE_ARRAY)
-		return (false);
+	if (rpc_get_type(o1) == RPC_TYPE_ARRAY)
+		return (rpc_array_contains(o1, o2));
 
-	rpc_array_apply(lst, ^(size_t idx __unused, rpc_object_t v) {
-		result = eval_rule(obj, v);
-		return ((bool)result);
-	});
+	return (false);
+}
 
-	return (result);
+static bool
+rpc_query_op_eq(rpc_object_t item, struct rpc_query_rule *rule)
+{
+
+	return (rpc_equal(item, rule->rqr_value));
 }
 
 static bool
-eval_logic_or(rpc_object_t obj, rpc_object_t lst)
+rpc_query_op_ne(rpc_object_t item, struct rpc_query_rule *rule)
 {
-	__block bool result = false;
 
-	if (rpc_get_type(lst) != RPC_TYPE_ARRAY)
-		return (false);
+	return (rpc_cmp(item, rule->rqr_value) != 0);
+}
 
-	rpc_array_apply(lst, ^(size_t idx __unused, rpc_object_t v) {
-	    result = eval_rule(obj, v);
-	    return ((bool)!result);
-	});
+static bool
+rpc_query_op_gt(rpc_object_t item, struct rpc_query_rule *rule)
+{
 
-	return (result);
+	return (rpc_cmp(item, rule->rqr_value) > 0);
 }
 
 static bool
-eval_logic_nor(rpc_object_t obj, rpc_object_t lst)
+rpc_query_op_lt(rpc_object_t item, struct rpc_query_rule *rule)
 {
-	__block bool result = false;
 
-	if (rpc_get_type(lst) != RPC_TYPE_ARRAY)
-		return (false);
+	return (rpc_cmp(item, rule->rqr_value) < 0);
+}
 
-	rpc_array_apply(lst, ^(size_t idx __unused, rpc_object_t v) {
-	    result = !eval_rule(obj, v);
-	    return ((bool)result);
-	});
+static bool
+rpc_query_op_ge(rpc_object_t item, struct rpc_query_rule *rule)
+{
 
-	return (result);
+	return (rpc_cmp(item, rule->rqr_value) >= 0);
 }
 
 static bool
-eval_logic_operator(rpc_object_t obj, rpc_object_t rule)
+rpc_query_op_le(rpc_object_t item, struct rpc_query_rule *rule)
 {
-	const char *op;
-	rpc_object_t lst;
-	rpc_object_t op_val;
 
-	if (rpc_get_type(rule) != RPC_TYPE_ARRAY)
+	return (rpc_cmp(item, rule->rqr_value) <= 0);
+}
+
+static bool
+rpc_query_op_regex(rpc_object_t item, struct rpc_query_rule *rule)
+{
+
+	if (rule->rqr_regex == NULL)
 		return (false);
 
-	op_val = rpc_array_get_value(rule, 0);
-	if (rpc_get_type(op_val) == RPC_TYPE_ARRAY)
-		return (eval_logic_and(obj, rule));
+	if (rpc_get_type(item) != RPC_TYPE_STRING)
+		return (false);
 
-	op = rpc_string_get_string_ptr(op_val);
-	lst = rpc_array_get_value(rule, 1);
+	return ((bool)g_regex_match(rule->rqr_regex,
+	    rpc_string_get_string_ptr(item), 0, NULL));
+}
 
-	if (!g_strcmp0(op, "or"))
-		return (eval_logic_or(obj, lst));
+static bool
+rpc_query_op_in(rpc_object_t item, struct rpc_query_rule *rule)
+{
 
-	if (!g_strcmp0(op, "and"))
-		return (eval_logic_and(obj, lst));
+	return (op_in(item, rule->rqr_value));
+}
 
-	if (!g_strcmp0(op, "nor"))
-		return (eval_logic_nor(obj, lst));
+static bool
+rpc_query_op_nin(rpc_object_t item, struct rpc_query_rule *rule)
+{
 
-	return (false);
+	return (!op_in(item, rule->rqr_value));
 }
 
+#ifndef _WIN32
 static bool
-op_in(rpc_object_t o1, rpc_object_t o2)
+rpc_query_op_match(rpc_object_t item, struct rpc_query_rule *rule)
 {
-	if (rpc_get_type(o2) == RPC_TYPE_ARRAY)
-		return (rpc_array_contains(o2, o1));
 
-	if (rpc_get_type(o1) == RPC_TYPE_ARRAY)
-		return (rpc_array_contains(o1, o2));
+	if (rpc_get_type(rule->rqr_value) != RPC_TYPE_STRING)
+		return (false);
 
-	return (false);
+	if (rpc_get_type(item) != RPC_TYPE_STRING)
+		return (false);
+
+	return (fnmatch(rpc_string_get_string_ptr(rule->rqr_value),
+	    rpc_string_get_string_ptr(item), 0) == 0);
 }
+#endif
 
-static bool
-eval_field_operator(rpc_object_t obj, rpc_object_t rule)
+static const struct rpc_query_operator rpc_query_operators[] = {
+	{ "=", rpc_query_op_eq },
+	{ "!=", rpc_query_op_ne },
+	{ ">", rpc_query_op_gt },
+	{ "<", rpc_query_op_lt },
+	{ ">=", rpc_query_op_ge },
+	{ "<=", rpc_query_op_le },
+	{ "~", rpc_query_op_regex },
+	{ "in", rpc_query_op_in },
+	{ "contains", rpc_query_op_in },
+	{ "nin", rpc_query_op_nin },
+	{ "ncontains", rpc_query_op_nin },
+#ifndef _WIN32
+	{ "match", rpc_query_op_match },
+#endif
+	{ NULL, NULL }
+};
+
+static struct rpc_query_rule *
+rpc_query_rule_new(rpc_query_rule_type_t type)
+{
+	struct rpc_query_rule *rule;
+
+	rule = g_malloc0(sizeof(*rule));
+	rule->rqr_type = type;
+	return (rule);
+}
+
+static void
+rpc_query_rule_free(struct rpc_query_rule *rule)
 {
+	size_t i;
+
+	if (rule->rqr_children != NULL)
+		g_ptr_array_free(rule->rqr_children, true);
+
+	for (i = 0; i < rule->rqr_npath; i++)
+		g_free(rule->rqr_path[i].rqs_key);
+
+	g_free(rule->rqr_path_str);
+	if (rule->rqr_regex != NULL)
+		g_regex_unref(rule->rqr_regex);
+
+	g_free(rule->rqr_path);
+	rpc_release(rule->rqr_value);
+	g_free(rule);
+}
+
+static struct rpc_query_rule *
+rpc_query_compile_list(rpc_query_rule_type_t type, rpc_object_t lst)
+{
+	struct rpc_query_rule *rule;
+
+	if (rpc_get_type(lst) != RPC_TYPE_ARRAY)
+		return (rpc_query_rule_new(RPC_QUERY_RULE_FALSE));
+
+	rule = rpc_query_rule_new(type);
+	rule->rqr_children = g_ptr_array_new_with_free_func(
+	    (GDestroyNotify)rpc_query_rule_free);
+
+	rpc_array_apply(lst, ^(size_t idx __unused, rpc_object_t v) {
+		g_ptr_array_add(rule->rqr_children, rpc_query_compile_rule(v));
+		return ((bool)true);
+	});
+
+	return (rule);
+}
+
+/*
+ * Splits the path the same way rpc_query_get() does, with array indexes
+ * converted up front.
+ */
+static void
+rpc_query_compile_path(struct rpc_query_rule *rule, const char *path)
+{
+	char *split_path;
+	char *token;
+	GArray *segments;
+	struct rpc_query_segment seg;
+
+	segments = g_array_new(false, false, sizeof(seg));
+	split_path = g_strdup(path);
+	token = strtok(split_path, ".");
+	while (token != NULL) {
+		seg.rqs_key = g_strdup(token);
+		seg.rqs_index = (size_t)atoi(token);
+		g_array_append_val(segments, seg);
+		token = strtok(NULL, ".");
+	}
+
+	g_free(split_path);
+	rule->rqr_npath = segments->len;
+	rule->rqr_path = (struct rpc_query_segment *)(void *)g_array_free(
+	    segments, false);
+}
+
+static struct rpc_query_rule *
+rpc_query_compile_field(rpc_object_t rule_obj)
+{
+	const struct rpc_query_operator *oper;
+	struct rpc_query_rule *rule;
 	const char *left;
 	const char *op;
 	rpc_object_t right;
-	rpc_object_t item;
 
-	if (rpc_get_type(rule) != RPC_TYPE_ARRAY)
-		return (false);
+	left = rpc_array_get_string(rule_obj, 0);
+	op = rpc_array_get_string(rule_obj, 1);
+	right = rpc_array_get_value(rule_obj, 2);
 
-	left = rpc_array_get_string(rule, 0);
-	op = rpc_array_get_string(rule, 1);
-	right = rpc_array_get_value(rule, 2);
+	for (oper = rpc_query_operators; oper->rqo_name != NULL; oper++) {
+		if (!g_strcmp0(op, oper->rqo_name))
+			break;
+	}
 
-	item = rpc_query_get(obj, left, NULL);
+	if (oper->rqo_fn == NULL)
+		return (rpc_query_rule_new(RPC_QUERY_RULE_FALSE));
 
-	if (!g_strcmp0(op, "="))
-		return (rpc_equal(item, right));
+	rule = rpc_query_rule_new(RPC_QUERY_RULE_FIELD);
+	rule->rqr_op = oper->rqo_fn;
+	rule->rqr_value = rpc_retain(right);
+	rule->rqr_has_path = left != NULL;
+	if (left != NULL) {
+		rule->rqr_path_str = g_strdup(left);
+		rpc_query_compile_path(rule, left);
+	}
 
-	if (!g_strcmp0(op, "!="))
-		return (rpc_cmp(item, right) != 0);
+	/* An invalid pattern never matches, as g_regex_match_simple() did */
+	if (oper->rqo_fn == rpc_query_op_regex &&
+	    rpc_get_type(right) == RPC_TYPE_STRING) {
+		rule->rqr_regex = g_regex_new(rpc_string_get_string_ptr(right),
+		    0, 0, NULL);
+	}
 
-	if (!g_strcmp0(op, ">"))
-		return (rpc_cmp(item, right) > 0);
+	return (rule);
+}
 
-	if (!g_strcmp0(op, "<"))
-		return (rpc_cmp(item, right) < 0);
+static struct rpc_query_rule *
+rpc_query_compile_rule(rpc_object_t rule_obj)
+{
+	rpc_object_t op_val;
+	const char *op;
 
-	if (!g_strcmp0(op, ">="))
-		return (rpc_cmp(item, right) >= 0);
+	if (rpc_get_type(rule_obj) != RPC_TYPE_ARRAY)
+		return (rpc_query_rule_new(RPC_QUERY_RULE_FALSE));
 
-	if (!g_strcmp0(op, "<="))
-		return (rpc_cmp(item, right) <= 0);
+	switch (rpc_array_get_count(rule_obj)) {
+	case 2:
+		/* A pair of rules is an implicit "and" */
+		op_val = rpc_array_get_value(rule_obj, 0);
+		if (rpc_get_type(op_val) == RPC_TYPE_ARRAY)
+			return (rpc_query_compile_list(RPC_QUERY_RULE_AND,
+			    rule_obj));
 
-	if (!g_strcmp0(op, "~")) {
-		if (rpc_get_type(right) != RPC_TYPE_STRING)
-			return (false);
+		op = rpc_string_get_string_ptr(op_val);
+		if (!g_strcmp0(op, "or"))
+			return (rpc_query_compile_list(RPC_QUERY_RULE_OR,
+			    rpc_array_get_value(rule_obj, 1)));
 
-		if (rpc_get_type(item) != RPC_TYPE_STRING)
-			return (false);
+		if (!g_strcmp0(op, "and"))
+			return (rpc_query_compile_list(RPC_QUERY_RULE_AND,
+			    rpc_array_get_value(rule_obj, 1)));
 
-		return ((bool)g_regex_match_simple(
-		    rpc_string_get_string_ptr(right),
-		    rpc_string_get_string_ptr(item), 0, 0));
+		if (!g_strcmp0(op, "nor"))
+			return (rpc_query_compile_list(RPC_QUERY_RULE_NOR,
+			    rpc_array_get_value(rule_obj, 1)));
+
+		return (rpc_query_rule_new(RPC_QUERY_RULE_FALSE));
+
+	case 3:
+		return (rpc_query_compile_field(rule_obj));
 
+	default:
+		return (rpc_query_rule_new(RPC_QUERY_RULE_FALSE));
 	}
+}
 
-	if ((!g_strcmp0(op, "in")) || (!g_strcmp0(op, "contains")))
-		return (op_in(item, right));
+static rpc_object_t
+rpc_query_rule_get(struct rpc_query_rule *rule, rpc_object_t obj)
+{
+	struct rpc_query_segment *seg;
+	rpc_object_t leaf = obj;
+	size_t i;
 
-	if ((!g_strcmp0(op, "nin")) || (!g_strcmp0(op, "ncontains")))
-		return (!op_in(item, right));
+	if (!rule->rqr_has_path)
+		return (NULL);
 
-#ifndef _WIN32
-	if (!g_strcmp0(op, "match")) {
-		if (rpc_get_type(right) != RPC_TYPE_STRING)
-			return (false);
+	for (i = 0; i < rule->rqr_npath; i++) {
+		seg = &rule->rqr_path[i];
+		switch (rpc_get_type(leaf)) {
+		case RPC_TYPE_DICTIONARY:
+			leaf = rpc_dictionary_get_value(leaf, seg->rqs_key);
+			break;
 
-		if (rpc_get_type(item) != RPC_TYPE_STRING)
-			return (false);
+		case RPC_TYPE_ARRAY:
+			leaf = rpc_array_get_value(leaf, seg->rqs_index);
+			break;
 
-		return (fnmatch(rpc_string_get_string_ptr(right),
-		    rpc_string_get_string_ptr(item), 0) == 0);
+		default:
+			return (NULL);
+		}
 	}
-#endif
 
-	return (false);
+	return (leaf);
 }
 
+/*
+ * Empty "and", "or" and "nor" lists never match, while an empty top
+ * level rule list matches everything.
+ */
 static bool
-eval_rule(rpc_object_t obj, rpc_object_t rule)
+rpc_query_rule_eval(struct rpc_query_rule *rule, rpc_object_t obj)
 {
-	if (rpc_get_type(rule) != RPC_TYPE_ARRAY)
+	struct rpc_query_rule *child;
+	bool result = false;
+	guint i;
+
+	switch (rule->rqr_type) {
+	case RPC_QUERY_RULE_FALSE:
 		return (false);
 
-	switch (rule->ro_value.rv_list->len) {
-	case 2:
-		return (eval_logic_operator(obj, rule));
-	case 3:
-		return (eval_field_operator(obj, rule));
+	case RPC_QUERY_RULE_FIELD:
+		return (rule->rqr_op(rpc_query_rule_get(rule, obj), rule));
+
+	case RPC_QUERY_RULE_ALL:
+		result = true;
+		/* FALLTHROUGH */
+
 	default:
-		return (false);
+		break;
 	}
+
+	for (i = 0; i < rule->rqr_children->len; i++) {
+		child = g_ptr_array_index(rule->rqr_children, i);
+		result = rpc_query_rule_eval(child, obj);
+		switch (rule->rqr_type) {
+		case RPC_QUERY_RULE_ALL:
+		case RPC_QUERY_RULE_AND:
+			if (!result)
+				return (false);
+			break;
+
+		case RPC_QUERY_RULE_OR:
+			if (result)
+				return (true);
+			break;
+
+		case RPC_QUERY_RULE_NOR:
+			if (result)
+				return (false);
+
+			result = true;
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	return (result);
 }
 
-static rpc_object_t
-rpc_query_steal_apply(rpc_object_t object, rpc_object_t rules)
+rpc_query_plan_t
+rpc_query_compile(rpc_object_t rules)
 {
-	__block bool fail = false;
+	rpc_query_plan_t plan;
 
-	if (object == NULL)
+	plan = g_malloc0(sizeof(*plan));
+	plan->rqp_refcnt = 1;
+
+	/* Rules that aren't a list match nothing */
+	if (rpc_get_type(rules) == RPC_TYPE_ARRAY)
+		plan->rqp_root = rpc_query_compile_list(RPC_QUERY_RULE_ALL,
+		    rules);
+	else
+		plan->rqp_root = rpc_query_rule_new(RPC_QUERY_RULE_FALSE);
+
+	return (plan);
+}
+
+static rpc_query_plan_t
+rpc_query_plan_retain(rpc_query_plan_t plan)
+{
+
+	g_atomic_int_inc(&plan->rqp_refcnt);
+	return (plan);
+}
+
+void
+rpc_query_plan_free(rpc_query_plan_t plan)
+{
+
+	if (plan == NULL || !g_atomic_int_dec_and_test(&plan->rqp_refcnt))
+		return;
+
+	rpc_query_rule_free(plan->rqp_root);
+	g_free(plan);
+}
+
+/*
+ * rpc_cmp() compares the 32-bit truncated hashes of both objects using a
+ * wrapping subtraction, so the set of keys comparing greater (or less)
+ * than a value is a cyclic range of half of the hash space.
+ */
+#define	RPC_QUERY_INDEX_HALF	((guint64)1 << 31)
+#define	RPC_QUERY_INDEX_SPACE	((guint64)1 << 32)
+
+static guint
+rpc_query_index_hash(gconstpointer key)
+{
+
+	return ((guint)rpc_hash((rpc_object_t)key));
+}
+
+static gboolean
+rpc_query_index_equal(gconstpointer a, gconstpointer b)
+{
+
+	return ((gboolean)rpc_equal((rpc_object_t)a, (rpc_object_t)b));
+}
+
+static guint32
+rpc_query_index_key(rpc_object_t object)
+{
+
+	return ((guint32)(int)rpc_hash(object));
+}
+
+static gint
+rpc_query_index_entry_cmp(gconstpointer a, gconstpointer b)
+{
+	const struct rpc_query_index_entry *e1 = a;
+	const struct rpc_query_index_entry *e2 = b;
+
+	if (e1->rqie_key != e2->rqie_key)
+		return (e1->rqie_key < e2->rqie_key ? -1 : 1);
+
+	if (e1->rqie_pos != e2->rqie_pos)
+		return (e1->rqie_pos < e2->rqie_pos ? -1 : 1);
+
+	return (0);
+}
+
+static gint
+rpc_query_index_pos_cmp(gconstpointer a, gconstpointer b)
+{
+	guint p1 = *(const guint *)a;
+	guint p2 = *(const guint *)b;
+
+	if (p1 == p2)
+		return (0);
+
+	return (p1 < p2 ? -1 : 1);
+}
+
+static void
+rpc_query_index_positions_free(gpointer positions)
+{
+
+	g_array_free(positions, true);
+}
+
+static void
+rpc_query_index_path_free(gpointer arg)
+{
+	struct rpc_query_index_path *ipath = arg;
+
+	if (ipath->rqip_hash != NULL)
+		g_hash_table_destroy(ipath->rqip_hash);
+
+	if (ipath->rqip_sorted != NULL)
+		g_array_free(ipath->rqip_sorted, true);
+
+	g_free(ipath->rqip_path);
+	g_free(ipath);
+}
+
+static struct rpc_query_index_path *
+rpc_query_index_find(rpc_query_index_t index, const char *path,
+    bool need_sorted)
+{
+	struct rpc_query_index_path *ipath;
+	struct rpc_query_index_path *result = NULL;
+	guint i;
+
+	for (i = 0; i < index->rqx_paths->len; i++) {
+		ipath = g_ptr_array_index(index->rqx_paths, i);
+		if (g_strcmp0(ipath->rqip_path, path))
+			continue;
+
+		if (ipath->rqip_type == RPC_QUERY_INDEX_SORTED) {
+			if (need_sorted || result == NULL)
+				result = ipath;
+
+			continue;
+		}
+
+		/* Hash indexes give exact matches, so prefer them */
+		if (!need_sorted)
+			return (ipath);
+	}
+
+	return (result);
+}
+
+/*
+ * Collects positions of sorted index entries with keys in [lo, hi).
+ */
+static void
+rpc_query_index_scan(struct rpc_query_index_path *ipath, guint64 lo,
+    guint64 hi, GArray *result)
+{
+	struct rpc_query_index_entry *entry;
+	guint first = 0;
+	guint last = ipath->rqip_sorted->len;
+	guint mid;
+
+	while (first < last) {
+		mid = first + (last - first) / 2;
+		entry = &g_array_index(ipath->rqip_sorted,
+		    struct rpc_query_index_entry, mid);
+		if (entry->rqie_key < lo)
+			first = mid + 1;
+		else
+			last = mid;
+	}
+
+	for (; first < ipath->rqip_sorted->len; first++) {
+		entry = &g_array_index(ipath->rqip_sorted,
+		    struct rpc_query_index_entry, first);
+		if (entry->rqie_key >= hi)
+			break;
+
+		g_array_append_val(result, entry->rqie_pos);
+	}
+}
+
+static void
+rpc_query_index_range(struct rpc_query_index_path *ipath, guint32 start,
+    guint64 len, GArray *result)
+{
+	guint64 end = start + len;
+
+	if (end <= RPC_QUERY_INDEX_SPACE) {
+		rpc_query_index_scan(ipath, start, end, result);
+		return;
+	}
+
+	rpc_query_index_scan(ipath, start, RPC_QUERY_INDEX_SPACE, result);
+	rpc_query_index_scan(ipath, 0, end - RPC_QUERY_INDEX_SPACE, result);
+}
+
+static void
+rpc_query_index_lookup(struct rpc_query_index_path *ipath,
+    rpc_object_t value, GArray *result)
+{
+	GArray *positions;
+
+	if (ipath->rqip_hash == NULL) {
+		rpc_query_index_range(ipath, rpc_query_index_key(value), 1,
+		    result);
+		return;
+	}
+
+	positions = g_hash_table_lookup(ipath->rqip_hash, value);
+	if (positions != NULL)
+		g_array_append_vals(result, positions->data, positions->len);
+}
+
+static void
+rpc_query_index_normalize(GArray *positions)
+{
+	guint i;
+	guint n = 0;
+
+	g_array_sort(positions, rpc_query_index_pos_cmp);
+	for (i = 0; i < positions->len; i++) {
+		if (n > 0 && g_array_index(positions, guint, n - 1) ==
+		    g_array_index(positions, guint, i))
+			continue;
+
+		g_array_index(positions, guint, n++) =
+		    g_array_index(positions, guint, i);
+	}
+
+	g_array_set_size(positions, n);
+}
+
+static GArray *
+rpc_query_index_merge(GArray *a, GArray *b, bool intersect)
+{
+	GArray *result;
+	guint i = 0;
+	guint j = 0;
+	guint pa;
+	guint pb;
+
+	result = g_array_new(false, false, sizeof(guint));
+	while (i < a->len && j < b->len) {
+		pa = g_array_index(a, guint, i);
+		pb = g_array_index(b, guint, j);
+		if (pa == pb) {
+			g_array_append_val(result, pa);
+			i++;
+			j++;
+		} else if (pa < pb) {
+			if (!intersect)
+				g_array_append_val(result, pa);
+			i++;
+		} else {
+			if (!intersect)
+				g_array_append_val(result, pb);
+			j++;
+		}
+	}
+
+	if (!intersect) {
+		g_array_append_vals(result, &g_array_index(a, guint, i),
+		    a->len - i);
+		g_array_append_vals(result, &g_array_index(b, guint, j),
+		    b->len - j);
+	}
+
+	g_array_free(a, true);
+	g_array_free(b, true);
+	return (result);
+}
+
+/*
+ * Returns a sorted set of source positions which may satisfy a field rule,
+ * or NULL if no index applies to it.
+ */
+static GArray *
+rpc_query_index_field(rpc_query_index_t index, struct rpc_query_rule *rule)
+{
+	struct rpc_query_index_path *ipath;
+	rpc_query_op_fn_t op = rule->rqr_op;
+	rpc_object_t value = rule->rqr_value;
+	GArray *result;
+	guint32 key;
+
+	if (!rule->rqr_has_path)
 		return (NULL);
 
-	if (rules == NULL)
+	if (op == rpc_query_op_eq || op == rpc_query_op_in) {
+		if (op == rpc_query_op_in &&
+		    rpc_get_type(value) != RPC_TYPE_ARRAY)
+			return (NULL);
+
+		ipath = rpc_query_index_find(index, rule->rqr_path_str, false);
+		if (ipath == NULL)
+			return (NULL);
+
+		result = g_array_new(false, false, sizeof(guint));
+		if (op == rpc_query_op_eq) {
+			rpc_query_index_lookup(ipath, value, result);
+		} else {
+			rpc_array_apply(value, ^(size_t idx __unused,
+			    rpc_object_t v) {
+				rpc_query_index_lookup(ipath, v, result);
+				return ((bool)true);
+			});
+		}
+
+		rpc_query_index_normalize(result);
+		return (result);
+	}
+
+	if (op != rpc_query_op_gt && op != rpc_query_op_ge &&
+	    op != rpc_query_op_lt && op != rpc_query_op_le)
 		return (NULL);
 
-	if (rpc_get_type(rules) != RPC_TYPE_ARRAY)
+	ipath = rpc_query_index_find(index, rule->rqr_path_str, true);
+	if (ipath == NULL || ipath->rqip_sorted == NULL)
 		return (NULL);
 
-	rpc_array_apply(rules, ^(size_t idx __unused, rpc_object_t v) {
-		if (!eval_rule(object, v)) {
-			fail = true;
-			return ((bool)false);
+	key = rpc_query_index_key(value);
+	result = g_array_new(false, false, sizeof(guint));
+	if (op == rpc_query_op_gt)
+		rpc_query_index_range(ipath, key + 1,
+		    RPC_QUERY_INDEX_HALF - 1, result);
+	else if (op == rpc_query_op_ge)
+		rpc_query_index_range(ipath, key, RPC_QUERY_INDEX_HALF,
+		    result);
+	else if (op == rpc_query_op_lt)
+		rpc_query_index_range(ipath,
+		    (guint32)(key + RPC_QUERY_INDEX_HALF),
+		    RPC_QUERY_INDEX_HALF, result);
+	else
+		rpc_query_index_range(ipath,
+		    (guint32)(key + RPC_QUERY_INDEX_HALF),
+		    RPC_QUERY_INDEX_HALF + 1, result);
+
+	rpc_query_index_normalize(result);
+	return (result);
+}
+
+/*
+ * Narrows down a rule to candidate positions. The result is a superset of
+ * the matching positions, NULL meaning the whole source.
+ */
+static GArray *
+rpc_query_index_candidates(rpc_query_index_t index,
+    struct rpc_query_rule *rule)
+{
+	struct rpc_query_rule *child;
+	GArray *result = NULL;
+	GArray *current;
+	guint i;
+
+	switch (rule->rqr_type) {
+	case RPC_QUERY_RULE_FALSE:
+		return (g_array_new(false, false, sizeof(guint)));
+
+	case RPC_QUERY_RULE_FIELD:
+		return (rpc_query_index_field(index, rule));
+
+	case RPC_QUERY_RULE_ALL:
+	case RPC_QUERY_RULE_AND:
+		if (rule->rqr_type == RPC_QUERY_RULE_AND &&
+		    rule->rqr_children->len == 0)
+			return (g_array_new(false, false, sizeof(guint)));
+
+		for (i = 0; i < rule->rqr_children->len; i++) {
+			child = g_ptr_array_index(rule->rqr_children, i);
+			current = rpc_query_index_candidates(index, child);
+			if (current == NULL)
+				continue;
+
+			result = result == NULL ? current :
+			    rpc_query_index_merge(result, current, true);
+
+			if (result->len == 0)
+				break;
+		}
+
+		return (result);
+
+	case RPC_QUERY_RULE_OR:
+		result = g_array_new(false, false, sizeof(guint));
+		for (i = 0; i < rule->rqr_children->len; i++) {
+			child = g_ptr_array_index(rule->rqr_children, i);
+			current = rpc_query_index_candidates(index, child);
+			if (current == NULL) {
+				g_array_free(result, true);
+				return (NULL);
+			}
+
+			result = rpc_query_index_merge(result, current, false);
 		}
-	    	return (bool)true;
+
+		return (result);
+
+	default:
+		return (NULL);
+	}
+}
+
+rpc_query_index_t
+rpc_query_index_create(rpc_object_t array)
+{
+	rpc_query_index_t index;
+
+	if (rpc_get_type(array) != RPC_TYPE_ARRAY) {
+		rpc_set_last_error(EINVAL, "Indexes can be built on arrays only",
+		    NULL);
+		return (NULL);
+	}
+
+	index = g_malloc0(sizeof(*index));
+	index->rqx_source = rpc_copy(array);
+	index->rqx_paths = g_ptr_array_new_with_free_func(
+	    rpc_query_index_path_free);
+
+	return (index);
+}
+
+int
+rpc_query_index_add(rpc_query_index_t index, const char *path,
+    rpc_query_index_type_t type)
+{
+	struct rpc_query_index_path *ipath;
+	struct rpc_query_rule *getter;
+
+	if (path == NULL) {
+		rpc_set_last_error(EINVAL, "Index path not specified", NULL);
+		return (-1);
+	}
+
+	if (type != RPC_QUERY_INDEX_HASH && type != RPC_QUERY_INDEX_SORTED) {
+		rpc_set_last_error(EINVAL, "Invalid index type", NULL);
+		return (-1);
+	}
+
+	ipath = rpc_query_index_find(index, path,
+	    type == RPC_QUERY_INDEX_SORTED);
+	if (ipath != NULL && ipath->rqip_type == type)
+		return (0);
+
+	getter = rpc_query_rule_new(RPC_QUERY_RULE_FIELD);
+	getter->rqr_has_path = true;
+	rpc_query_compile_path(getter, path);
+
+	ipath = g_malloc0(sizeof(*ipath));
+	ipath->rqip_path = g_strdup(path);
+	ipath->rqip_type = type;
+
+	if (type == RPC_QUERY_INDEX_HASH)
+		ipath->rqip_hash = g_hash_table_new_full(rpc_query_index_hash,
+		    rpc_query_index_equal, (GDestroyNotify)rpc_release_impl,
+		    rpc_query_index_positions_free);
+	else
+		ipath->rqip_sorted = g_array_new(false, false,
+		    sizeof(struct rpc_query_index_entry));
+
+	rpc_array_apply(index->rqx_source, ^(size_t idx, rpc_object_t v) {
+		struct rpc_query_index_entry entry;
+		rpc_object_t item;
+		GArray *positions;
+		guint pos = (guint)idx;
+
+		/* Elements missing the path can't match any indexed rule */
+		item = rpc_query_rule_get(getter, v);
+		if (item == NULL)
+			return ((bool)true);
+
+		if (ipath->rqip_sorted != NULL) {
+			entry.rqie_key = rpc_query_index_key(item);
+			entry.rqie_pos = pos;
+			g_array_append_val(ipath->rqip_sorted, entry);
+			return ((bool)true);
+		}
+
+		positions = g_hash_table_lookup(ipath->rqip_hash, item);
+		if (positions == NULL) {
+			positions = g_array_new(false, false, sizeof(guint));
+			g_hash_table_insert(ipath->rqip_hash, rpc_retain(item),
+			    positions);
+		}
+
+		g_array_append_val(positions, pos);
+		return ((bool)true);
 	});
 
-	return (fail ? NULL : object);
+	if (ipath->rqip_sorted != NULL)
+		g_array_sort(ipath->rqip_sorted, rpc_query_index_entry_cmp);
+
+	rpc_query_rule_free(getter);
+	g_ptr_array_add(index->rqx_paths, ipath);
+	return (0);
+}
+
+rpc_query_iter_t
+rpc_query_index_run(rpc_query_index_t index, rpc_query_params_t params,
+    rpc_query_plan_t plan)
+{
+	rpc_query_iter_t iter;
+	rpc_object_t subset;
+	GArray *candidates;
+	guint i;
+
+	candidates = rpc_query_index_candidates(index, plan->rqp_root);
+	if (candidates == NULL) {
+		/* Sorting happens in place, so never hand out the snapshot */
+		subset = rpc_copy(index->rqx_source);
+	} else {
+		subset = rpc_array_create();
+		for (i = 0; i < candidates->len; i++) {
+			rpc_array_append_value(subset, rpc_array_get_value(
+			    index->rqx_source,
+			    g_array_index(candidates, guint, i)));
+		}
+
+		g_array_free(candidates, true);
+	}
+
+	/* Candidates are a superset, the plan still checks every one */
+	iter = rpc_query_plan_run(subset, params, plan);
+	rpc_release(subset);
+	return (iter);
+}
+
+void
+rpc_query_index_free(rpc_query_index_t index)
+{
+
+	if (index == NULL)
+		return;
+
+	g_ptr_array_free(index->rqx_paths, true);
+	rpc_release(index->rqx_source);
+	g_free(index);
+}
+
+static rpc_object_t
+rpc_query_steal_apply(rpc_object_t object, rpc_query_plan_t plan)
+{
+
+	if (object == NULL)
+		return (NULL);
+
+	return (rpc_query_rule_eval(plan->rqp_root, object) ? object : NULL);
+}
+
+static rpc_object_t
+rpc_query_get_current(rpc_query_iter_t iter)
+{
+	size_t count;
+
+	if (!iter->rqi_reverse)
+		return (rpc_array_get_value(iter->rqi_source, iter->rqi_idx));
+
+	count = rpc_array_get_count(iter->rqi_source);
+	if (iter->rqi_idx >= count)
+		return (NULL);
+
+	return (rpc_array_get_value(iter->rqi_source,
+	    count - 1 - iter->rqi_idx));
+}
+
+/*
+ * Orders elements the way sorting and then reversing the source would,
+ * with ties broken by the original position like a stable sort does.
+ */
+static int
+rpc_query_top_cmp(rpc_query_iter_t iter, const struct rpc_query_top *t1,
+    const struct rpc_query_top *t2)
+{
+	int ret;
+
+	ret = iter->rqi_params->sort(t1->rqt_obj, t2->rqt_obj);
+	if (ret == 0 && t1->rqt_pos != t2->rqt_pos)
+		ret = t1->rqt_pos < t2->rqt_pos ? -1 : 1;
+
+	return (iter->rqi_params->reverse ? -ret : ret);
+}
+
+static gint
+rpc_query_top_sort_cmp(gconstpointer a, gconstpointer b, gpointer data)
+{
+
+	return (rpc_query_top_cmp(data, a, b));
+}
+
+static void
+rpc_query_top_sift_down(rpc_query_iter_t iter, GArray *heap, guint i)
+{
+	struct rpc_query_top *nodes = (struct rpc_query_top *)heap->data;
+	struct rpc_query_top tmp;
+	guint largest;
+	guint child;
+
+	for (;;) {
+		largest = i;
+		child = 2 * i + 1;
+		if (child < heap->len &&
+		    rpc_query_top_cmp(iter, &nodes[child], &nodes[largest]) > 0)
+			largest = child;
+
+		child++;
+		if (child < heap->len &&
+		    rpc_query_top_cmp(iter, &nodes[child], &nodes[largest]) > 0)
+			largest = child;
+
+		if (largest == i)
+			return;
+
+		tmp = nodes[i];
+		nodes[i] = nodes[largest];
+		nodes[largest] = tmp;
+		i = largest;
+	}
+}
+
+static void
+rpc_query_top_sift_up(rpc_query_iter_t iter, GArray *heap, guint i)
+{
+	struct rpc_query_top *nodes = (struct rpc_query_top *)heap->data;
+	struct rpc_query_top tmp;
+	guint parent;
+
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (rpc_query_top_cmp(iter, &nodes[i], &nodes[parent]) <= 0)
+			return;
+
+		tmp = nodes[i];
+		nodes[i] = nodes[parent];
+		nodes[parent] = tmp;
+		i = parent;
+	}
+}
+
+/*
+ * With both sort and limit set only the first offset + limit matches in
+ * the sorted order can ever be yielded, so keep them in a bounded max-heap
+ * instead of sorting the whole source. The source is replaced with the
+ * selected matches, already in the final order.
+ */
+static void
+rpc_query_top_k(rpc_query_iter_t iter)
+{
+	struct rpc_query_top entry;
+	rpc_object_t source = iter->rqi_source;
+	rpc_object_t result;
+	GArray *heap;
+	guint64 k;
+	size_t count;
+	size_t i;
+	guint j;
+
+	k = iter->rqi_params->offset + iter->rqi_params->limit;
+	if (k < iter->rqi_params->limit)
+		k = G_MAXUINT64;
+
+	heap = g_array_new(false, false, sizeof(struct rpc_query_top));
+	count = rpc_array_get_count(source);
+
+	for (i = 0; i < count; i++) {
+		entry.rqt_obj = rpc_array_get_value(source, i);
+		entry.rqt_pos = i;
+		if (rpc_query_steal_apply(entry.rqt_obj, iter->rqi_plan) == NULL)
+			continue;
+
+		if (heap->len < k) {
+			g_array_append_val(heap, entry);
+			rpc_query_top_sift_up(iter, heap, heap->len - 1);
+			continue;
+		}
+
+		if (rpc_query_top_cmp(iter, &entry,
+		    &g_array_index(heap, struct rpc_query_top, 0)) >= 0)
+			continue;
+
+		g_array_index(heap, struct rpc_query_top, 0) = entry;
+		rpc_query_top_sift_down(iter, heap, 0);
+	}
+
+	g_array_sort_with_data(heap, rpc_query_top_sort_cmp, iter);
+
+	result = rpc_array_create();
+	for (j = 0; j < heap->len; j++) {
+		rpc_array_append_value(result,
+		    g_array_index(heap, struct rpc_query_top, j).rqt_obj);
+	}
+
+	g_array_free(heap, true);
+	rpc_release(iter->rqi_source);
+	iter->rqi_source = result;
+	iter->rqi_idx = 0;
+	iter->rqi_reverse = false;
 }
 
 static rpc_object_t
@@ -269,9 +1123,9 @@ rpc_query_find_next(rpc_query_iter_t iter)
 	rpc_object_t result = NULL;
 
 	do {
-		current = rpc_array_get_value(iter->rqi_source, iter->rqi_idx);
+		current = rpc_query_get_current(iter);
 		iter->rqi_idx++;
-		result = rpc_query_steal_apply(current, iter->rqi_rules);
+		result = rpc_query_steal_apply(current, iter->rqi_plan);
 
 	} while ((current != NULL) && (result == NULL));
 
@@ -488,6 +1342,19 @@ rpc_query_contains(rpc_object_t object, const char *path)
 
 rpc_query_iter_t
 rpc_query(rpc_object_t object, rpc_query_params_t params, rpc_object_t rules)
+{
+	rpc_query_iter_t iter;
+	rpc_query_plan_t plan;
+
+	plan = rpc_query_compile(rules);
+	iter = rpc_query_plan_run(object, params, plan);
+	rpc_query_plan_free(plan);
+	return (iter);
+}
+
+rpc_query_iter_t
+rpc_query_plan_run(rpc_object_t object, rpc_query_params_t params,
+    rpc_query_plan_t plan)
 {
 	rpc_query_iter_t iter;
 	rpc_query_params_t local_params;
@@ -507,12 +1374,12 @@ rpc_query(rpc_object_t object, rpc_query_params_t params, rpc_object_t rules)
 	iter->rqi_source = object;
 	iter->rqi_idx = 0;
 	iter->rqi_params = local_params;
-	iter->rqi_rules = rules;
+	iter->rqi_plan = rpc_query_plan_retain(plan);
+	iter->rqi_reverse = false;
 	iter->rqi_done = false;
 	iter->rqi_initialized = false;
 	iter->rqi_limit = 0;
 
-	rpc_retain(rules);
 	rpc_retain(object);
 	return (iter);
 }
@@ -537,19 +1404,107 @@ rpc_query_fmt(rpc_object_t object, rpc_query_params_t params,
 rpc_object_t
 rpc_query_apply(rpc_object_t object, rpc_object_t rules)
 {
+	rpc_query_plan_t plan;
 	rpc_object_t result;
 
 	if (rpc_get_type(rules) != RPC_TYPE_ARRAY)
 		return (NULL);
 
-	result = rpc_query_steal_apply(object, rules);
+	plan = rpc_query_compile(rules);
+	result = rpc_query_plan_apply(object, plan);
+	rpc_query_plan_free(plan);
+	return (result);
+}
 
+rpc_object_t
+rpc_query_plan_apply(rpc_object_t object, rpc_query_plan_t plan)
+{
+	rpc_object_t result;
+
+	result = rpc_query_steal_apply(object, plan);
 	if (result != NULL)
 		rpc_retain(result);
 
 	return (result);
 }
 
+rpc_object_t
+rpc_query_request_create(rpc_object_t rules, rpc_query_params_t params)
+{
+	rpc_object_t request;
+
+	request = rpc_dictionary_create();
+	if (rules != NULL)
+		rpc_dictionary_set_value(request, "rules", rules);
+
+	if (params == NULL)
+		return (request);
+
+	rpc_dictionary_set_bool(request, "single", params->single);
+	rpc_dictionary_set_bool(request, "count", params->count);
+	rpc_dictionary_set_uint64(request, "offset", params->offset);
+	rpc_dictionary_set_uint64(request, "limit", params->limit);
+	rpc_dictionary_set_bool(request, "reverse", params->reverse);
+	return (request);
+}
+
+static uint64_t
+rpc_query_request_get_uint(rpc_object_t request, const char *key)
+{
+	rpc_object_t value;
+	int64_t ival;
+
+	value = rpc_dictionary_get_value(request, key);
+	switch (rpc_get_type(value)) {
+	case RPC_TYPE_UINT64:
+		return (rpc_uint64_get_value(value));
+
+	case RPC_TYPE_INT64:
+		ival = rpc_int64_get_value(value);
+		return (ival > 0 ? (uint64_t)ival : 0);
+
+	default:
+		return (0);
+	}
+}
+
+rpc_query_iter_t
+rpc_query_request_run(rpc_object_t object, rpc_object_t request)
+{
+	struct rpc_query_params params = { 0 };
+	rpc_query_plan_t plan;
+	rpc_query_iter_t iter;
+	rpc_object_t rules = NULL;
+	rpc_object_t all;
+
+	if (request != NULL) {
+		if (rpc_get_type(request) != RPC_TYPE_DICTIONARY) {
+			rpc_set_last_error(EINVAL,
+			    "Query request has to be a dictionary", NULL);
+			return (NULL);
+		}
+
+		rules = rpc_dictionary_get_value(request, "rules");
+		params.single = rpc_dictionary_get_bool(request, "single");
+		params.count = rpc_dictionary_get_bool(request, "count");
+		params.offset = rpc_query_request_get_uint(request, "offset");
+		params.limit = rpc_query_request_get_uint(request, "limit");
+		params.reverse = rpc_dictionary_get_bool(request, "reverse");
+	}
+
+	if (rules == NULL) {
+		/* No rules at all means no filtering */
+		all = rpc_array_create();
+		plan = rpc_query_compile(all);
+		rpc_release(all);
+	} else
+		plan = rpc_query_compile(rules);
+
+	iter = rpc_query_plan_run(object, &params, plan);
+	rpc_query_plan_free(plan);
+	return (iter);
+}
+
 bool
 rpc_query_next(rpc_query_iter_t iter, rpc_object_t *chunk)
 {
@@ -563,19 +1518,15 @@ rpc_query_next(rpc_query_iter_t iter, rpc_object_t *chunk)
 	}
 
 	if (!iter->rqi_initialized) {
-		if (iter->rqi_params->sort)
-			rpc_array_sort(iter->rqi_source, iter->rqi_params->sort);
-
-		if (iter->rqi_params->reverse) {
-			temp_obj = rpc_array_create();
-			rpc_array_reverse_apply(iter->rqi_source,
-			    ^(size_t idx __unused, rpc_object_t v) {
-				rpc_array_append_value(temp_obj, v);
-				return ((bool) true);
-			});
-
-			rpc_release(iter->rqi_source);
-			iter->rqi_source = temp_obj;
+		if (iter->rqi_params->sort && iter->rqi_params->limit > 0 &&
+		    !iter->rqi_params->count) {
+			rpc_query_top_k(iter);
+		} else {
+			if (iter->rqi_params->sort)
+				rpc_array_sort(iter->rqi_source,
+				    iter->rqi_params->sort);
+
+			iter->rqi_reverse = iter->rqi_params->reverse;
 		}
 
 		for (i = 0; i < iter->rqi_params->offset; i++) {
@@ -634,7 +1585,7 @@ void
 rpc_query_iter_free(rpc_query_iter_t iter)
 {
 
-	rpc_release(iter->rqi_rules);
+	rpc_query_plan_free(iter->rqi_plan);
 	rpc_release(iter->rqi_source);
 	g_free(iter->rqi_params);
 	g_free(iter);
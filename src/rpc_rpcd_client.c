@@ -32,7 +32,38 @@
 #include <rpc/rpcd.h>
 #include "internal.h"
 
+/*
+ * Services resolved through rpcd, per rpcd instance. The rpcd client
+ * used for the first resolve stays open as a watcher so that rpcd can
+ * tell us when a service goes away; a lost watcher drops the directory.
+ */
+struct rpcd_endpoint
+{
+	char *			uri;
+	char *			token;
+	gint64			expires;
+};
+
+struct rpcd_directory
+{
+	rpc_client_t		watcher;
+	GHashTable *		endpoints;
+	bool			dead;
+};
+
 static const char *rpcd_get_socket_location(void);
+static void rpcd_endpoint_free(void *);
+static struct rpcd_directory *rpcd_directory_get(const char *);
+static void rpcd_directory_free(struct rpcd_directory *);
+static void rpcd_directory_watch(struct rpcd_directory *);
+static char *rpcd_cache_lookup(const char *, const char *);
+static rpc_client_t rpcd_cache_insert(const char *, rpc_client_t,
+    const char *, rpc_object_t);
+static void rpcd_cache_invalidate(const char *, const char *);
+static rpc_client_t rpcd_connect_via(rpc_client_t, const char *);
+
+static GMutex rpcd_cache_mtx;
+static GHashTable *rpcd_cache;
 
 static const char *
 rpcd_get_socket_location(void)
@@ -46,25 +77,242 @@ rpcd_get_socket_location(void)
 	return (location);
 }
 
+static void
+rpcd_endpoint_free(void *arg)
+{
+	struct rpcd_endpoint *endpoint = arg;
+
+	g_free(endpoint->uri);
+	g_free(endpoint->token);
+	g_free(endpoint);
+}
+
+static struct rpcd_directory *
+rpcd_directory_get(const char *rpcd_uri)
+{
+	struct rpcd_directory *dir;
+
+	if (rpcd_cache == NULL) {
+		rpcd_cache = g_hash_table_new_full(g_str_hash, g_str_equal,
+		    g_free, NULL);
+	}
+
+	dir = g_hash_table_lookup(rpcd_cache, rpcd_uri);
+	if (dir == NULL) {
+		dir = g_malloc0(sizeof(*dir));
+		dir->endpoints = g_hash_table_new_full(g_str_hash,
+		    g_str_equal, g_free, rpcd_endpoint_free);
+		g_hash_table_insert(rpcd_cache, g_strdup(rpcd_uri), dir);
+	}
+
+	return (dir);
+}
+
+static void
+rpcd_directory_free(struct rpcd_directory *dir)
+{
+
+	/* Closing the watcher guarantees its handlers are done with us */
+	if (dir->watcher != NULL)
+		rpc_client_close(dir->watcher);
+
+	g_hash_table_destroy(dir->endpoints);
+	g_free(dir);
+}
+
+static void
+rpcd_directory_watch(struct rpcd_directory *dir)
+{
+	rpc_connection_t conn;
+
+	conn = rpc_client_get_connection(dir->watcher);
+	rpc_connection_register_event_handler(conn, "/",
+	    RPCD_MANAGER_INTERFACE, "service_removed",
+	    ^(const char *path, const char *interface, const char *name,
+	    rpc_object_t args) {
+		const char *service;
+
+		service = rpc_dictionary_get_string(args, "name");
+		if (service == NULL)
+			return;
+
+		g_mutex_lock(&rpcd_cache_mtx);
+		g_hash_table_remove(dir->endpoints, service);
+		g_mutex_unlock(&rpcd_cache_mtx);
+	});
+
+	rpc_connection_set_error_handler(conn,
+	    ^(rpc_error_code_t code, rpc_object_t args) {
+		/*
+		 * Without the watcher we'd miss removals; forget everything
+		 * and let the next connect replace the directory.
+		 */
+		g_mutex_lock(&rpcd_cache_mtx);
+		dir->dead = true;
+		g_hash_table_remove_all(dir->endpoints);
+		g_mutex_unlock(&rpcd_cache_mtx);
+	});
+}
+
+static char *
+rpcd_cache_lookup(const char *rpcd_uri, const char *service_name)
+{
+	struct rpcd_directory *dir = NULL;
+	struct rpcd_endpoint *endpoint;
+	char *uri = NULL;
+
+	g_mutex_lock(&rpcd_cache_mtx);
+	if (rpcd_cache != NULL)
+		dir = g_hash_table_lookup(rpcd_cache, rpcd_uri);
+
+	if (dir != NULL && dir->dead) {
+		g_hash_table_remove(rpcd_cache, rpcd_uri);
+		g_mutex_unlock(&rpcd_cache_mtx);
+		rpcd_directory_free(dir);
+		return (NULL);
+	}
+
+	if (dir != NULL) {
+		endpoint = g_hash_table_lookup(dir->endpoints, service_name);
+		if (endpoint != NULL &&
+		    endpoint->expires <= g_get_monotonic_time()) {
+			g_hash_table_remove(dir->endpoints, service_name);
+			endpoint = NULL;
+		}
+
+		if (endpoint != NULL)
+			uri = g_strdup(endpoint->uri);
+	}
+
+	g_mutex_unlock(&rpcd_cache_mtx);
+	return (uri);
+}
+
+static rpc_client_t
+rpcd_cache_insert(const char *rpcd_uri, rpc_client_t client,
+    const char *service_name, rpc_object_t resolved)
+{
+	struct rpcd_directory *dir;
+	struct rpcd_endpoint *endpoint;
+	const char *uri = NULL;
+	const char *token = NULL;
+	int64_t ttl = 0;
+
+	if (rpc_object_unpack(resolved, "{s,s,i}",
+	    "uri", &uri,
+	    "token", &token,
+	    "ttl", &ttl) < 3 || ttl <= 0)
+		return (client);
+
+	g_mutex_lock(&rpcd_cache_mtx);
+	dir = rpcd_directory_get(rpcd_uri);
+	if (dir->dead) {
+		g_mutex_unlock(&rpcd_cache_mtx);
+		return (client);
+	}
+
+	endpoint = g_malloc0(sizeof(*endpoint));
+	endpoint->uri = g_strdup(uri);
+	endpoint->token = g_strdup(token);
+	endpoint->expires = g_get_monotonic_time() + ttl * G_USEC_PER_SEC;
+	g_hash_table_insert(dir->endpoints, g_strdup(service_name), endpoint);
+
+	if (dir->watcher != NULL) {
+		g_mutex_unlock(&rpcd_cache_mtx);
+		return (client);
+	}
+
+	dir->watcher = client;
+	g_mutex_unlock(&rpcd_cache_mtx);
+	rpcd_directory_watch(dir);
+	return (NULL);
+}
+
+static void
+rpcd_cache_invalidate(const char *rpcd_uri, const char *service_name)
+{
+	struct rpcd_directory *dir = NULL;
+
+	g_mutex_lock(&rpcd_cache_mtx);
+	if (rpcd_cache != NULL)
+		dir = g_hash_table_lookup(rpcd_cache, rpcd_uri);
+
+	if (dir != NULL)
+		g_hash_table_remove(dir->endpoints, service_name);
+
+	g_mutex_unlock(&rpcd_cache_mtx);
+}
+
 rpc_client_t
 rpcd_connect_to(const char *rpcd_uri, const char *service_name)
 {
 	rpc_client_t client;
-	rpc_connection_t conn;
-	rpc_auto_object_t result = NULL;
+	rpc_client_t direct;
+	rpc_auto_object_t resolved = NULL;
+	const char *location;
 	char *path;
+	char *uri;
 
 	if (rpcd_uri == NULL)
 		rpcd_uri = rpcd_get_socket_location();
 
+	uri = rpcd_cache_lookup(rpcd_uri, service_name);
+	if (uri != NULL) {
+		direct = rpc_client_create(uri, NULL);
+		g_free(uri);
+		if (direct != NULL)
+			return (direct);
+
+		/* The service went away without rpcd telling us */
+		rpcd_cache_invalidate(rpcd_uri, service_name);
+	}
+
 	client = rpc_client_create(rpcd_uri, NULL);
 	if (client == NULL)
 		return (NULL);
 
+	path = g_strdup_printf("/%s", service_name);
+	resolved = rpc_connection_call_syncp(rpc_client_get_connection(client),
+	    path, RPCD_SERVICE_INTERFACE, "resolve", "[]");
+	g_free(path);
+
+	/* Older rpcd or a bridged service: go through connect */
+	location = resolved != NULL && !rpc_is_error(resolved) ?
+	    rpc_dictionary_get_string(resolved, "uri") : NULL;
+	if (location == NULL)
+		return (rpcd_connect_via(client, service_name));
+
+	direct = rpc_client_create(location, NULL);
+	client = rpcd_cache_insert(rpcd_uri, client, service_name, resolved);
+	if (direct != NULL) {
+		if (client != NULL)
+			rpc_client_close(client);
+
+		return (direct);
+	}
+
+	rpcd_cache_invalidate(rpcd_uri, service_name);
+	if (client == NULL) {
+		client = rpc_client_create(rpcd_uri, NULL);
+		if (client == NULL)
+			return (NULL);
+	}
+
+	return (rpcd_connect_via(client, service_name));
+}
+
+static rpc_client_t
+rpcd_connect_via(rpc_client_t client, const char *service_name)
+{
+	rpc_connection_t conn;
+	rpc_auto_object_t result = NULL;
+	char *path;
+
 	conn = rpc_client_get_connection(client);
 	path = g_strdup_printf("/%s", service_name);
 	result = rpc_connection_call_syncp(conn, path, RPCD_SERVICE_INTERFACE,
 	    "connect", "[]");
+	g_free(path);
 
 	if (result == NULL) {
 		rpc_client_close(client);
@@ -91,6 +339,77 @@ rpcd_connect_to(const char *rpcd_uri, const char *service_name)
 	g_assert_not_reached();
 }
 
+int
+rpcd_publish(rpc_client_t client, const char *service_name,
+    rpc_object_t events)
+{
+	rpc_connection_t conn;
+	rpc_auto_object_t result = NULL;
+	char *path;
+
+	conn = rpc_client_get_connection(client);
+	path = g_strdup_printf("/%s", service_name);
+	result = rpc_connection_call_syncp(conn, path, RPCD_SERVICE_INTERFACE,
+	    "publish", "[V]", events);
+	g_free(path);
+
+	if (result == NULL)
+		return (-1);
+
+	if (rpc_is_error(result)) {
+		rpc_set_last_rpc_error(result);
+		return (-1);
+	}
+
+	return ((int)rpc_uint64_get_value(result));
+}
+
+char *
+rpcd_get_service_token(const char *rpcd_uri, const char *service_name)
+{
+	struct rpcd_directory *dir = NULL;
+	struct rpcd_endpoint *endpoint = NULL;
+	char *token = NULL;
+
+	if (rpcd_uri == NULL)
+		rpcd_uri = rpcd_get_socket_location();
+
+	g_mutex_lock(&rpcd_cache_mtx);
+	if (rpcd_cache != NULL)
+		dir = g_hash_table_lookup(rpcd_cache, rpcd_uri);
+
+	if (dir != NULL)
+		endpoint = g_hash_table_lookup(dir->endpoints, service_name);
+
+	if (endpoint != NULL && endpoint->expires > g_get_monotonic_time())
+		token = g_strdup(endpoint->token);
+
+	g_mutex_unlock(&rpcd_cache_mtx);
+	return (token);
+}
+
+void
+rpcd_flush_cache(void)
+{
+	GHashTable *cache;
+	GHashTableIter iter;
+	struct rpcd_directory *dir;
+
+	g_mutex_lock(&rpcd_cache_mtx);
+	cache = rpcd_cache;
+	rpcd_cache = NULL;
+	g_mutex_unlock(&rpcd_cache_mtx);
+
+	if (cache == NULL)
+		return;
+
+	g_hash_table_iter_init(&iter, cache);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&dir))
+		rpcd_directory_free(dir);
+
+	g_hash_table_destroy(cache);
+}
+
 int
 rpcd_services_apply(const char *rpcd_uri, rpcd_service_applier_t applier)
 {
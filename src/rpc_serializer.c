@@ -28,6 +28,7 @@
 #include <errno.h>
 #include <rpc/serializer.h>
 #include "internal.h"
+#include "serializer/msgpack.h"
 
 bool
 rpc_serializer_exists(const char *serializer)
@@ -75,3 +76,52 @@ rpc_serializer_dump(const char *serializer, rpc_object_t obj, void **framep,
 
 	return (impl->serialize(typed, framep, lenp));
 }
+
+rpc_object_t
+rpc_serializer_peek(const void *frame, size_t len, const char *path)
+{
+	rpc_auto_object_t untyped = NULL;
+
+	untyped = rpc_msgpack_peek(frame, len, path);
+	if (untyped == NULL)
+		return (NULL);
+
+	return (rpct_deserialize(untyped));
+}
+
+rpc_object_t
+rpc_serializer_load_envelope(const void *frame, size_t len, const char *key,
+    const void **rawp, size_t *rawlenp)
+{
+	rpc_auto_object_t untyped = NULL;
+
+	untyped = rpc_msgpack_deserialize_envelope(frame, len, key, rawp,
+	    rawlenp);
+	if (untyped == NULL)
+		return (NULL);
+
+	return (rpct_deserialize(untyped));
+}
+
+int
+rpc_serializer_dump_envelope(rpc_object_t envelope, const char *key,
+    const void *raw, size_t rawlen, void **framep, size_t *lenp)
+{
+	rpc_auto_object_t typed = NULL;
+
+	if (rpc_get_type(envelope) != RPC_TYPE_DICTIONARY) {
+		rpc_set_last_error(EINVAL, "Envelope is not a dictionary",
+		    NULL);
+		return (-1);
+	}
+
+	typed = rpct_serialize(envelope);
+	if (typed == NULL)
+		return (-1);
+
+	if (raw == NULL)
+		return (rpc_msgpack_serialize(typed, framep, lenp));
+
+	return (rpc_msgpack_serialize_splice(typed, key, raw, rawlen,
+	    framep, lenp));
+}
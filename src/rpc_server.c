@@ -37,13 +37,19 @@
 #include <launch.h>
 #endif
 #include "internal.h"
+#include "thread.h"
 
-static int rpc_server_accept(rpc_server_t, rpc_connection_t);
 static void rpc_server_cleanup(rpc_server_t);
 static bool rpc_server_valid(rpc_server_t);
 static void * rpc_server_worker(void *);
 static gboolean rpc_server_listen(void *);
-static void server_queue_purge(rpc_server_t);
+static void rpc_server_push_pending(rpc_server_t, struct rpc_call *);
+static struct rpc_call *rpc_server_take_pending(rpc_server_t);
+static void rpc_server_drain(rpc_server_t);
+static void rpc_server_quiesce(rpc_server_t);
+static void server_queue_purge(rpc_server_t, struct rpc_call *);
+static void rpc_server_fold_stats(rpc_server_t, rpc_connection_t);
+static gboolean rpc_server_check_slow(gpointer);
 
 static void
 rpc_server_cleanup(rpc_server_t server)
@@ -53,16 +59,21 @@ rpc_server_cleanup(rpc_server_t server)
 	    (GSourceFunc)rpc_kill_main_loop, server->rs_g_loop);
         g_thread_join(server->rs_thread);
 
+	if (server->rs_slow_timer != NULL) {
+		g_source_destroy(server->rs_slow_timer);
+		g_source_unref(server->rs_slow_timer);
+		server->rs_slow_timer = NULL;
+	}
+
         g_main_loop_unref(server->rs_g_loop);
         g_main_context_unref(server->rs_g_context);
-	g_queue_free(server->rs_calls);
 }
 
 static bool
 rpc_server_valid(rpc_server_t server)
 {
 
-	g_mutex_lock(&server->rs_mtx);
+	rpc_mutex_lock(&server->rs_mtx, RPC_LOCK_SERVER);
 	if (server->rs_closed) {
 		g_mutex_unlock(&server->rs_mtx);
 		return (false);
@@ -71,11 +82,11 @@ rpc_server_valid(rpc_server_t server)
 	return (true);
 }
 
-static int
+int
 rpc_server_accept(rpc_server_t server, rpc_connection_t conn)
 {
 
-	g_mutex_lock(&server->rs_mtx);
+	rpc_mutex_lock(&server->rs_mtx, RPC_LOCK_SERVER);
 	if (server->rs_closed) {
 		server->rs_conn_refused++;
 		/* ok to change state here because the conn isn't live yet */
@@ -88,7 +99,8 @@ rpc_server_accept(rpc_server_t server, rpc_connection_t conn)
 	debugf("Server accepting connection %p", conn);
 	conn->rco_rpc_context = server->rs_context;
 
-	g_rw_lock_writer_lock(&server->rs_connections_rwlock);
+	rpc_rw_lock_writer_lock(&server->rs_connections_rwlock,
+	    RPC_LOCK_SERVER_CONNECTIONS);
 	server->rs_connections = g_list_append(server->rs_connections, conn);
 	rpc_connection_retain(conn);
 	g_rw_lock_writer_unlock(&server->rs_connections_rwlock);
@@ -96,6 +108,9 @@ rpc_server_accept(rpc_server_t server, rpc_connection_t conn)
 	server->rs_conn_made++;
 	g_mutex_unlock(&server->rs_mtx);
 
+	if (server->rs_session_grace > 0)
+		rpc_connection_start_session(conn);
+
 	if (server->rs_event_handler != NULL)
 		server->rs_event_handler(conn, RPC_SERVER_CLIENT_CONNECT);
 
@@ -109,7 +124,7 @@ rpc_server_disconnect(rpc_server_t server, rpc_connection_t conn)
 
 	debugf("Disconnecting: %p, closed == %d\n", conn, server->rs_closed);
 
-	g_mutex_lock(&server->rs_mtx);
+	rpc_mutex_lock(&server->rs_mtx, RPC_LOCK_SERVER);
 
 	if (server->rs_closed) {
 		g_mutex_unlock(&server->rs_mtx);
@@ -119,8 +134,10 @@ rpc_server_disconnect(rpc_server_t server, rpc_connection_t conn)
 	g_assert((g_atomic_int_get(&conn->rco_state) & CONNECTION_ABORTED)
 	    != 0);
 
-	g_rw_lock_writer_lock(&server->rs_connections_rwlock);
+	rpc_rw_lock_writer_lock(&server->rs_connections_rwlock,
+	    RPC_LOCK_SERVER_CONNECTIONS);
 	server->rs_connections = g_list_remove(server->rs_connections, conn);
+	rpc_server_fold_stats(server, conn);
 	g_rw_lock_writer_unlock(&server->rs_connections_rwlock);
 	g_mutex_unlock(&server->rs_mtx);
 
@@ -155,7 +172,7 @@ rpc_server_listen(void *arg)
 	const struct rpc_transport *transport;
 	char *scheme;
 
-	g_mutex_lock(&server->rs_mtx);
+	rpc_mutex_lock(&server->rs_mtx, RPC_LOCK_SERVER);
 
 	scheme = g_uri_parse_scheme(server->rs_uri);
 	transport = rpc_find_transport(scheme);
@@ -215,21 +232,24 @@ rpc_server_create_ex(const char *uri, rpc_context_t context, rpc_object_t params
 
 	server = g_malloc0(sizeof(*server));
 	server->rs_uri = uri;
-	server->rs_paused = true;
-	server->rs_calls = g_queue_new();
+	server->rs_dispatch_state = RPC_SERVER_PAUSED;
 	server->rs_context = context;
 	server->rs_accept = rpc_server_accept;
 	server->rs_valid = rpc_server_valid;
 	server->rs_params = params;
+	if (params != NULL && rpc_get_type(params) == RPC_TYPE_DICTIONARY) {
+		server->rs_session_grace = (guint)MIN(G_MAXUINT,
+		    rpc_dictionary_get_uint64(params,
+		    RPC_SERVER_SESSION_GRACE));
+	}
 	server->rs_g_context = g_main_context_new();
 	server->rs_g_loop = g_main_loop_new(server->rs_g_context, false);
-	server->rs_thread = g_thread_new("librpc server", rpc_server_worker,
-	    server);
+	server->rs_thread = rpc_thread_new(RPC_THREAD_SERVER, "librpc server",
+	    rpc_server_worker, server);
 	g_cond_init(&server->rs_cv);
 	g_mutex_init(&server->rs_mtx);
-	g_mutex_init(&server->rs_calls_mtx);
 
-	g_mutex_lock(&server->rs_mtx);
+	rpc_mutex_lock(&server->rs_mtx, RPC_LOCK_SERVER);
 	g_main_context_invoke(server->rs_g_context, rpc_server_listen, server);
 
 	while (server->rs_error == NULL && !server->rs_operational)
@@ -259,19 +279,74 @@ rpc_server_broadcast_event(rpc_server_t server, const char *path,
 {
 
 	GList *item;
+	rpc_object_t event;
+	GBytes *frame;
 
-	g_rw_lock_reader_lock(&server->rs_connections_rwlock);
+	rpc_rw_lock_reader_lock(&server->rs_connections_rwlock,
+	    RPC_LOCK_SERVER_CONNECTIONS);
         if (server->rs_closed) {
 		g_rw_lock_reader_unlock(&server->rs_connections_rwlock);
 		return;
 	}
 
+	/* Serialize once; every subscribed connection gets the same bytes */
+	event = rpc_object_pack("{s,s,s,v}",
+	    "path", path,
+	    "interface", interface,
+	    "name", name,
+	    "args", rpc_retain(args));
+	frame = rpc_connection_pack_event(event);
+
+	rpc_rw_lock_reader_lock(&server->rs_context->rcx_rwlock,
+	    RPC_LOCK_CONTEXT);
+	rpc_session_offer_locked(server->rs_context, server, event);
+	g_rw_lock_reader_unlock(&server->rs_context->rcx_rwlock);
+
 	for (item = g_list_first(server->rs_connections); item;
 	     item = item->next) {
 		rpc_connection_t conn = item->data;
-		rpc_connection_send_event(conn, path, interface, name, args);
+		rpc_connection_send_event_frame(conn, event, frame);
 	}
 	g_rw_lock_reader_unlock(&server->rs_connections_rwlock);
+
+	if (frame != NULL)
+		g_bytes_unref(frame);
+
+	rpc_release(event);
+}
+
+/*
+ * Keeps the traffic of a departing connection in the server totals.
+ * Called with rs_connections_rwlock held for writing.
+ */
+static void
+rpc_server_fold_stats(rpc_server_t server, rpc_connection_t conn)
+{
+	struct rpc_connection_stats *total = &server->rs_closed_stats;
+	struct rpc_connection_stats stats;
+
+	rpc_connection_get_stats(conn, &stats);
+	total->rcs_frames_in += stats.rcs_frames_in;
+	total->rcs_frames_out += stats.rcs_frames_out;
+	total->rcs_bytes_in += stats.rcs_bytes_in;
+	total->rcs_bytes_out += stats.rcs_bytes_out;
+	total->rcs_serialize_time += stats.rcs_serialize_time;
+	total->rcs_deserialize_time += stats.rcs_deserialize_time;
+	total->rcs_send_wait_time += stats.rcs_send_wait_time;
+}
+
+void
+rpc_server_get_stats(rpc_server_t server, struct rpc_connection_stats *stats)
+{
+	GList *item;
+
+	rpc_rw_lock_reader_lock(&server->rs_connections_rwlock,
+	    RPC_LOCK_SERVER_CONNECTIONS);
+	*stats = server->rs_closed_stats;
+	for (item = g_list_first(server->rs_connections); item;
+	     item = item->next)
+		rpc_connection_add_stats(item->data, stats);
+	g_rw_lock_reader_unlock(&server->rs_connections_rwlock);
 }
 
 void
@@ -286,46 +361,224 @@ rpc_server_set_event_handler(rpc_server_t server,
 		server->rs_event_handler = Block_copy(handler);
 }
 
+void
+rpc_server_set_slow_consumer_policy(rpc_server_t server, uint64_t timeout,
+    bool disconnect)
+{
+
+	rpc_mutex_lock(&server->rs_mtx, RPC_LOCK_SERVER);
+	if (server->rs_slow_timer != NULL) {
+		g_source_destroy(server->rs_slow_timer);
+		g_source_unref(server->rs_slow_timer);
+		server->rs_slow_timer = NULL;
+	}
+
+	server->rs_slow_timeout = timeout;
+	server->rs_slow_disconnect = disconnect;
+
+	/* Checking a few times per period bounds the detection delay */
+	if (timeout > 0 && !server->rs_closed) {
+		server->rs_slow_timer = g_timeout_source_new(
+		    (guint)CLAMP(timeout / 4, 100, G_MAXUINT));
+		g_source_set_callback(server->rs_slow_timer,
+		    rpc_server_check_slow, server, NULL);
+		g_source_attach(server->rs_slow_timer, server->rs_g_context);
+	}
+	g_mutex_unlock(&server->rs_mtx);
+}
+
+static gboolean
+rpc_server_check_slow(gpointer user_data)
+{
+	rpc_server_t server = user_data;
+	rpc_connection_t conn;
+	GPtrArray *slow;
+	GList *iter;
+	gint64 now;
+	gint64 limit;
+	bool disconnect;
+	guint i;
+
+	rpc_mutex_lock(&server->rs_mtx, RPC_LOCK_SERVER);
+	if (server->rs_closed) {
+		g_mutex_unlock(&server->rs_mtx);
+		return (G_SOURCE_CONTINUE);
+	}
+
+	limit = (gint64)server->rs_slow_timeout * 1000;
+	disconnect = server->rs_slow_disconnect;
+	g_mutex_unlock(&server->rs_mtx);
+
+	now = g_get_monotonic_time();
+	slow = g_ptr_array_new();
+
+	rpc_rw_lock_reader_lock(&server->rs_connections_rwlock,
+	    RPC_LOCK_SERVER_CONNECTIONS);
+	for (iter = server->rs_connections; iter != NULL; iter = iter->next) {
+		conn = iter->data;
+		if (!rpc_connection_check_slow(conn, now, limit))
+			continue;
+
+		rpc_connection_retain(conn);
+		g_ptr_array_add(slow, conn);
+	}
+	g_rw_lock_reader_unlock(&server->rs_connections_rwlock);
+
+	for (i = 0; i < slow->len; i++) {
+		conn = g_ptr_array_index(slow, i);
+		debugf("slow consumer on connection %p", conn);
+
+		if (server->rs_event_handler != NULL)
+			server->rs_event_handler(conn, RPC_SERVER_CLIENT_SLOW);
+
+		if (disconnect) {
+			rpc_connection_drop(conn, rpc_error_create(ETIMEDOUT,
+			    "Slow consumer", NULL));
+		}
+
+		rpc_connection_release(conn);
+	}
+
+	g_ptr_array_free(slow, true);
+	return (G_SOURCE_CONTINUE);
+}
+
+/*
+ * Calls are dispatched straight to the context unless the server is
+ * paused, closed, or still draining calls queued earlier; those go to
+ * a lock-free pending list instead, so the common path takes no locks.
+ */
 int
 rpc_server_dispatch(rpc_server_t server, struct rpc_call *call)
 {
+	guint state;
 	int ret;
 
-	g_mutex_lock(&server->rs_calls_mtx);
+	state = atomic_fetch_add(&server->rs_dispatch_state,
+	    RPC_SERVER_ACTIVE);
+	if ((state & RPC_SERVER_FLAGS) == 0 &&
+	    atomic_load(&server->rs_pending) == NULL) {
+		ret = rpc_context_dispatch(server->rs_context, call);
+		atomic_fetch_sub(&server->rs_dispatch_state,
+		    RPC_SERVER_ACTIVE);
+		return (ret);
+	}
 
-	if (server->rs_closed) {
-		g_mutex_unlock(&server->rs_calls_mtx);
-		call->rc_err =
-		    rpc_error_create(ECONNRESET, "Server not active", NULL);
+	if (state & RPC_SERVER_CLOSED) {
+		atomic_fetch_sub(&server->rs_dispatch_state,
+		    RPC_SERVER_ACTIVE);
+		call->rc_err = rpc_error_create_shared(ECONNRESET,
+		    "Server not active", NULL);
 		return (-1);
 	}
 
-	if (server->rs_paused || !g_queue_is_empty(server->rs_calls))  {
-		g_queue_push_tail(server->rs_calls, call);
-		g_mutex_unlock(&server->rs_calls_mtx);
-		return (0);
+	/*
+	 * Stay active until the call is on the list, or rpc_server_close()
+	 * could purge the list before it gets there.
+	 */
+	rpc_server_push_pending(server, call);
+	atomic_fetch_sub(&server->rs_dispatch_state, RPC_SERVER_ACTIVE);
+	rpc_server_drain(server);
+	return (0);
+}
+
+static void
+rpc_server_push_pending(rpc_server_t server, struct rpc_call *call)
+{
+	struct rpc_call *head;
+
+	head = atomic_load(&server->rs_pending);
+	do
+		call->rc_pending_next = head;
+	while (!atomic_compare_exchange_weak(&server->rs_pending, &head,
+	    call));
+}
+
+/*
+ * Detaches the whole pending list and returns it oldest call first.
+ */
+static struct rpc_call *
+rpc_server_take_pending(rpc_server_t server)
+{
+	struct rpc_call *head;
+	struct rpc_call *next;
+	struct rpc_call *list = NULL;
+
+	head = atomic_exchange(&server->rs_pending, NULL);
+	while (head != NULL) {
+		next = head->rc_pending_next;
+		head->rc_pending_next = list;
+		list = head;
+		head = next;
 	}
 
-	ret = rpc_context_dispatch(server->rs_context, call);
-	g_mutex_unlock(&server->rs_calls_mtx);
-	return (ret);
+	return (list);
 }
 
-/*called with rs_call_mtx held*/
+/*
+ * Dispatches pending calls unless the server is paused or closed. One
+ * thread drains at a time; whoever queues a call while it's at it
+ * leaves the call to it, and it checks again after letting go.
+ */
 static void
-server_queue_purge(rpc_server_t server)
+rpc_server_drain(rpc_server_t server)
+{
+	guint state;
+
+	for (;;) {
+		state = atomic_load(&server->rs_dispatch_state);
+		if (state & RPC_SERVER_FLAGS)
+			return;
+
+		if (!atomic_compare_exchange_weak(&server->rs_dispatch_state,
+		    &state, state | RPC_SERVER_DRAINING))
+			continue;
+
+		while (atomic_load(&server->rs_pending) != NULL) {
+			if (atomic_load(&server->rs_dispatch_state) &
+			    (RPC_SERVER_PAUSED | RPC_SERVER_CLOSED))
+				break;
+
+			server_queue_purge(server,
+			    rpc_server_take_pending(server));
+		}
+
+		atomic_fetch_and(&server->rs_dispatch_state,
+		    ~RPC_SERVER_DRAINING);
+		if (atomic_load(&server->rs_pending) == NULL)
+			return;
+	}
+}
+
+/*
+ * Waits for dispatchers and drainers that started before a flag was
+ * raised. They don't block, so this is short.
+ */
+static void
+rpc_server_quiesce(rpc_server_t server)
+{
+
+	while (atomic_load(&server->rs_dispatch_state) &
+	    ~(RPC_SERVER_PAUSED | RPC_SERVER_CLOSED))
+		g_thread_yield();
+}
+
+static void
+server_queue_purge(rpc_server_t server, struct rpc_call *list)
 {
 	struct rpc_call *icall;
 
-	while (!g_queue_is_empty(server->rs_calls)) {
-		icall = g_queue_pop_head(server->rs_calls);
+	while (list != NULL) {
+		icall = list;
+		list = icall->rc_pending_next;
+		icall->rc_pending_next = NULL;
 
 		if (!server->rs_closed) {
 			if (rpc_context_dispatch(server->rs_context,
 			    icall) == 0)
 				continue;
 		} else {
-			icall->rc_err = rpc_error_create(ECONNRESET,
+			icall->rc_err = rpc_error_create_shared(ECONNRESET,
 			    "Server not active", NULL);
 		}
 
@@ -343,38 +596,33 @@ server_queue_purge(rpc_server_t server)
 void
 rpc_server_resume(rpc_server_t server)
 {
+	guint state;
 
-	g_mutex_lock(&server->rs_calls_mtx);
-
-	if (server->rs_closed) {
-		g_mutex_unlock(&server->rs_calls_mtx);
+	state = atomic_fetch_and(&server->rs_dispatch_state,
+	    ~RPC_SERVER_PAUSED);
+	if (state & RPC_SERVER_CLOSED)
 		return;
-	}
 
-	server->rs_paused = false;
-	server_queue_purge(server);
-	g_mutex_unlock(&server->rs_calls_mtx);
+	rpc_server_drain(server);
 }
 
 void
 rpc_server_pause(rpc_server_t server)
 {
+	guint state;
 
-	g_mutex_lock(&server->rs_calls_mtx);
-	if (server->rs_closed) {
-		g_mutex_unlock(&server->rs_calls_mtx);
+	state = atomic_fetch_or(&server->rs_dispatch_state, RPC_SERVER_PAUSED);
+	if (state & RPC_SERVER_CLOSED)
 		return;
-	}
 
-	server->rs_paused = true;
-	g_mutex_unlock(&server->rs_calls_mtx);
+	rpc_server_quiesce(server);
 }
 
 void
 rpc_server_release(rpc_server_t server)
 {
 
-	g_mutex_lock(&server->rs_mtx);
+	rpc_mutex_lock(&server->rs_mtx, RPC_LOCK_SERVER);
 	g_assert(server->rs_refcnt > 0);
 	if (server->rs_closed && server->rs_refcnt == 1) {
 		g_rw_lock_writer_lock(&server->rs_context->rcx_server_rwlock);
@@ -412,12 +660,13 @@ rpc_server_close(rpc_server_t server)
 		rpc_set_last_errorf(ENOTSUP, "Not supported by transport");
 		return (-1);
 	}
-	g_mutex_lock(&server->rs_mtx);
-	g_mutex_lock(&server->rs_calls_mtx);
+	rpc_mutex_lock(&server->rs_mtx, RPC_LOCK_SERVER);
 	server->rs_closed = true;
-	server_queue_purge(server);
-	g_mutex_unlock(&server->rs_calls_mtx);
+	atomic_fetch_or(&server->rs_dispatch_state, RPC_SERVER_CLOSED);
+	rpc_server_quiesce(server);
+	server_queue_purge(server, rpc_server_take_pending(server));
 	g_mutex_unlock(&server->rs_mtx);
+	rpc_session_drop_server(server);
 
 	/* stop listening. */
 	if (!server->rs_threaded_teardown)
@@ -427,7 +676,8 @@ rpc_server_close(rpc_server_t server)
 	debugf("TORNDOWN");
 
 	/* Drop all connections */
-	g_rw_lock_reader_lock(&server->rs_connections_rwlock);
+	rpc_rw_lock_reader_lock(&server->rs_connections_rwlock,
+	    RPC_LOCK_SERVER_CONNECTIONS);
 	if (server->rs_connections != NULL) {
 		for (iter = server->rs_connections; iter != NULL; iter = iter->next) {
 			conn = iter->data;
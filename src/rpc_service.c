@@ -29,15 +29,32 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <rpc/object.h>
 #include <rpc/connection.h>
 #include <rpc/service.h>
 #include <glib.h>
 #include <glib/gprintf.h>
 #include "internal.h"
+#include "stats.h"
+#include "thread.h"
+#include "serializer/msgpack.h"
+
+/* Past this many changes, a delta property sends its whole value */
+#define	RPC_PROPERTY_DELTA_MAX	64
 
 static bool rpc_context_path_is_valid(const char *);
 static rpc_object_t rpc_get_objects(void *, rpc_object_t);
+static rpc_object_t rpc_list_instances(void *, rpc_object_t);
+static rpc_object_t rpc_stream_instances(void *, rpc_object_t);
+static rpc_object_t rpc_get_instance_changes(void *, rpc_object_t);
+static gint rpc_instance_path_cmp(gconstpointer, gconstpointer, gpointer);
+static char *rpc_instances_page_locked(rpc_context_t, const char *,
+    const char *, size_t, rpc_object_t);
+static char *rpc_instances_prefix(void *, rpc_object_t, const char **,
+    uint64_t *);
+static void rpc_instance_log_locked(rpc_context_t, bool, const char *);
+static void rpc_instance_change_free(struct rpc_instance_change *);
 static rpc_object_t rpc_get_interfaces(void *, rpc_object_t);
 static rpc_object_t rpc_get_methods(void *, rpc_object_t);
 static rpc_object_t rpc_get_events(void *, rpc_object_t);
@@ -45,14 +62,95 @@ static rpc_object_t rpc_interface_exists(void *, rpc_object_t);
 static rpc_object_t rpc_observable_property_get(void *, rpc_object_t);
 static rpc_object_t rpc_observable_property_get_all(void *, rpc_object_t);
 static rpc_object_t rpc_observable_property_set(void *, rpc_object_t);
+static void rpc_property_notify_emit(rpc_instance_t, struct rpc_if_member *,
+    const char *, const char *, rpc_object_t);
+static bool rpc_property_notify_defer(rpc_instance_t, struct rpc_if_member *,
+    const char *, const char *, rpc_object_t);
+static gint rpc_property_notify_cmp(gconstpointer, gconstpointer, gpointer);
+static gpointer rpc_property_notify_worker(gpointer);
+static void rpc_property_notify_free(struct rpc_property_notify *);
+static rpc_object_t rpc_property_read(rpc_instance_t, struct rpc_if_member *,
+    const char *, const char *, rpc_object_t *);
+static void rpc_property_cache_update(rpc_instance_t, const char *,
+    const char *, unsigned int, rpc_object_t);
+static struct rpc_property_cached *rpc_property_cached_new(rpc_object_t,
+    unsigned int);
+static void rpc_property_cached_free(struct rpc_property_cached *);
+static rpc_object_t rpc_property_delta(rpc_instance_t, const char *,
+    const char *, rpc_object_t);
+static bool rpc_property_diff(rpc_object_t, rpc_object_t, const char *,
+    rpc_object_t);
+static bool rpc_property_diff_add(rpc_object_t, const char *, const char *,
+    rpc_object_t);
+static void rpc_context_run_call(struct rpc_call *, rpc_context_t);
+static bool rpc_context_admit(rpc_context_t, struct rpc_call *);
+static void rpc_context_admission_leave(rpc_context_t, gint64);
+static GHashTable *rpc_snapshot_new(void);
+static void rpc_snapshot_publish(GHashTable **, GHashTable *);
+static guint rpc_instance_shard_index(const char *);
+static struct rpc_instance_shard *rpc_instance_shard(rpc_context_t,
+    const char *);
+static void rpc_instance_shards_lock(rpc_context_t, guint);
+static void rpc_instance_shards_unlock(rpc_context_t, guint);
+static void rpc_instance_shards_publish(rpc_context_t, guint);
+static void rpc_context_workq_handler(void *, void *);
+static bool rpc_context_limit_enter(rpc_context_t, struct rpc_call *);
+static void rpc_context_limit_leave(rpc_context_t, rpc_connection_t);
+static rpc_call_priority_t rpc_instance_get_interface_priority(
+    rpc_instance_t, const char *);
+static void rpc_function_flush_locked(struct rpc_call *);
+static gint64 rpc_function_send_begin(struct rpc_call *);
+static size_t rpc_function_send_fragment(struct rpc_call *, rpc_object_t);
+static void rpc_function_send_end(struct rpc_call *, gint64);
+static struct rpc_workq *rpc_context_get_workq(rpc_context_t);
+static struct rpc_exec_tenant *rpc_context_get_exec(rpc_context_t);
+static void rpc_context_schedule(rpc_context_t, struct rpc_call *);
+static char *rpc_result_cache_key(struct rpc_call *);
+static void rpc_result_cache_free(struct rpc_result_cache *);
+static void rpc_cached_result_free(struct rpc_cached_result *);
+static gboolean rpc_cached_result_expired(gpointer, gpointer, gpointer);
+static bool rpc_result_cache_respond(rpc_context_t, struct rpc_call *);
+static void rpc_result_cache_store(rpc_context_t, struct rpc_call *,
+    rpc_object_t);
+static void rpc_result_cache_invalidate(rpc_context_t, const char *, bool);
 void rpc_interface_free(struct rpc_interface_priv *);
 void rpc_if_member_free(struct rpc_if_member *);
+struct emit_item;
 static gpointer emit_events(gpointer data);
+static rpc_object_t emit_item_to_event(struct emit_item *);
+static void emit_item_free(struct emit_item *);
+struct rpc_emit_entry;
+static struct rpc_emit_entry *emit_entry_new(rpc_context_t, rpc_object_t);
+static void emit_enqueue(rpc_context_t, rpc_connection_t,
+    struct rpc_emit_entry *);
+static gpointer emit_shard_worker(gpointer data);
+static void emit_collect_targets(rpc_context_t, rpc_object_t, GHashTable *);
+static char *rpc_context_index_key(const char *, const char *, const char *);
+static void rpc_sub_wildcard_free(struct rpc_sub_wildcard *);
+static struct rpc_sub_trie *rpc_sub_trie_new(struct rpc_sub_trie *,
+    const char *);
+static void rpc_sub_trie_free(struct rpc_sub_trie *);
+static bool rpc_sub_trie_is_glob(const char *);
+static struct rpc_sub_trie *rpc_sub_trie_child(struct rpc_sub_trie *,
+    const char *, bool);
+static struct rpc_sub_trie *rpc_sub_trie_walk(struct rpc_sub_trie *,
+    const char *, bool, GPtrArray **, char **);
+static bool rpc_sub_trie_is_empty(struct rpc_sub_trie *);
+static void rpc_sub_trie_prune(struct rpc_sub_trie *);
+static void rpc_sub_wildcards_remove_conn(GPtrArray *, rpc_connection_t);
+static bool rpc_sub_trie_remove_conn(struct rpc_sub_trie *, rpc_connection_t);
+static void rpc_sub_trie_collect(GPtrArray *, const char *, const char *,
+    const char *, GHashTable *);
+static void rpc_sub_trie_match(struct rpc_sub_trie *, char *, const char *,
+    const char *, GHashTable *);
 
 static const struct rpc_if_member rpc_discoverable_vtable[] = {
 	RPC_EVENT(instance_added),
 	RPC_EVENT(instance_removed),
 	RPC_METHOD(get_instances, rpc_get_objects),
+	RPC_METHOD(list_instances, rpc_list_instances),
+	RPC_METHOD(stream_instances, rpc_stream_instances),
+	RPC_METHOD(get_changes, rpc_get_instance_changes),
 	RPC_MEMBER_END
 };
 
@@ -82,6 +180,51 @@ struct emit_item {
 	rpc_object_t	args;
 };
 
+/*
+ * One per emitted event (or burst), shared by every connection queue
+ * it lands on. The frame is serialized once up front.
+ */
+struct rpc_emit_entry {
+	volatile gint	ree_refcnt;
+	rpc_object_t	ree_event;
+	GBytes *	ree_frame;
+};
+
+struct rpc_emit_shard {
+	GThread *	res_thread;
+	GAsyncQueue *	res_queue;
+};
+
+/*
+ * Subscriptions to path patterns, indexed one path component per level
+ * past RPC_PATH_PATTERN_PREFIX. A child whose key ends with '*' takes
+ * every component starting with what precedes the asterisk. Patterns
+ * whose last component ends with '*' cover the whole subtree and sit in
+ * rst_tails of the node above it, along with the start of that last
+ * component; the other ones sit in rst_ends of the node they lead to.
+ */
+struct rpc_sub_trie {
+	struct rpc_sub_trie *	rst_parent;
+	char *			rst_key;
+	GHashTable *		rst_children;
+	GPtrArray *		rst_globs;
+	GPtrArray *		rst_tails;
+	GPtrArray *		rst_ends;
+};
+
+struct rpc_instance_change {
+	uint64_t	ric_gen;
+	bool		ric_added;
+	char *		ric_path;
+};
+
+struct rpc_sub_wildcard {
+	char *		rsw_prefix;
+	char *		rsw_interface;
+	char *		rsw_name;
+	rpc_connection_t rsw_conn;
+};
+
 enum tp_type {
 	TYPE_CALL,
 	TYPE_INSTANCE,
@@ -99,13 +242,14 @@ rpc_context_tp_handler(gpointer data, gpointer user_data)
 	struct tp_item *item = data;
 	struct rpc_call *call;
 	rpc_instance_t instance;
-	struct rpc_if_method *method;
-	rpc_object_t result;
 
+	rpc_thread_enter(RPC_THREAD_WORKER, "rpc context pool");
 	if (item->type == TYPE_INSTANCE) {
 		instance = item->data;
 		g_assert(instance->ri_destroyed);
 
+		/* Lookups in an older snapshot may still be about to retain */
+		rpc_rcu_synchronize();
 		g_mutex_lock(&instance->ri_mtx);
 		while (instance->ri_refcnt > 0)
 			g_cond_wait(&instance->ri_cv, &instance->ri_mtx);
@@ -115,21 +259,36 @@ rpc_context_tp_handler(gpointer data, gpointer user_data)
 		g_mutex_clear(&instance->ri_mtx);
 		g_rw_lock_clear(&instance->ri_rwlock);
 		g_free(instance->ri_path);
+		g_hash_table_unref(instance->ri_interfaces_rcu);
 		g_hash_table_destroy(instance->ri_interfaces);
+		g_hash_table_destroy(instance->ri_notify);
+		g_hash_table_destroy(instance->ri_prop_cache);
+		g_hash_table_destroy(instance->ri_prop_sent);
+		g_mutex_clear(&instance->ri_delta_mtx);
 		g_free(instance);
 		g_free(item);
 		return;
 	}
 
 	call = item->data;
-	method = call->rc_if_method;
 	g_free(item);
+	rpc_context_run_call(call, context);
+}
+
+static void
+rpc_context_run_call(struct rpc_call *call, rpc_context_t context)
+{
+	struct rpc_if_method *method = call->rc_if_method;
+	struct rpc_trace_context saved;
+	rpc_object_t result;
 
 	if (rpc_connection_call_retain(call) < 0) {
 		debugf("Can't dispatch call %p, not valid", call);
 		return;
 	}
 
+	RPC_PROBE2(call__dequeue, call->rc_conn, call);
+
 	if (call->rc_aborted || !rpc_connection_is_open(call->rc_conn)) {
 		debugf("Can't dispatch call, aborted or conn %p not open",
 		    call->rc_conn);
@@ -145,21 +304,40 @@ rpc_context_tp_handler(gpointer data, gpointer user_data)
 		return;
 	}
 
+	/* Nobody is waiting for the result anymore */
+	if (call->rc_deadline != 0 &&
+	    g_get_monotonic_time() >= call->rc_deadline) {
+		debugf("Dropping call %p, deadline passed", call);
+		rpc_function_error(call, ETIMEDOUT, "Deadline exceeded");
+		rpc_connection_call_release(call);
+		rpc_connection_close_inbound_call(call);
+		return;
+	}
+
 	g_assert(call->rc_type == RPC_INBOUND_CALL);
 
 	call->rc_m_arg = method->rm_arg;
 	call->rc_context = context;
 	call->rc_consumer_seqno = 1;
+	call->rc_frag_batch_max_items = context->rcx_frag_batch_items;
+	call->rc_frag_batch_max_bytes = context->rcx_frag_batch_bytes;
 
 	debugf("method=%p", method);
 
+	call->rc_started = g_get_monotonic_time();
+	rpc_trace_ctx_enter(&call->rc_trace, &saved);
 	if (context->rcx_pre_call_hook != NULL) {
 		context->rcx_pre_call_hook(call, call->rc_args);
 		if (call->rc_responded)
 			goto done;
 	}
 
-	result = method->rm_block((void *)call, call->rc_args);
+	if (method->rm_cache_ttl > 0 && rpc_result_cache_respond(context, call))
+		goto done;
+
+	result = method->rm_func != NULL
+	    ? method->rm_func((void *)call, call->rc_args)
+	    : method->rm_block((void *)call, call->rc_args);
 
 	if (result == RPC_FUNCTION_STILL_RUNNING)
 		goto done;
@@ -175,29 +353,573 @@ rpc_context_tp_handler(gpointer data, gpointer user_data)
 	else if (!call->rc_ended)
 		rpc_function_end(call);
 done:
+	rpc_trace_ctx_leave(&saved);
 	rpc_connection_call_release(call);
 }
 
+static char *
+rpc_result_cache_key(struct rpc_call *call)
+{
+
+	return (g_strdup_printf("%s\n%s\n%zx",
+	    call->rc_interface != NULL ? call->rc_interface :
+	    RPC_DEFAULT_INTERFACE, call->rc_method_name,
+	    call->rc_args != NULL ? rpc_hash(call->rc_args) : 0));
+}
+
+static void
+rpc_result_cache_free(struct rpc_result_cache *cache)
+{
+
+	g_hash_table_destroy(cache->rrc_results);
+	g_free(cache);
+}
+
+static void
+rpc_cached_result_free(struct rpc_cached_result *entry)
+{
+
+	if (entry->rcr_args != NULL)
+		rpc_release(entry->rcr_args);
+
+	if (entry->rcr_packed != NULL)
+		g_bytes_unref(entry->rcr_packed);
+
+	rpc_release(entry->rcr_result);
+	g_free(entry);
+}
+
+static gboolean
+rpc_cached_result_expired(gpointer key __unused, gpointer value, gpointer arg)
+{
+	struct rpc_cached_result *entry = value;
+	gint64 *now = arg;
+
+	return (entry->rcr_expires <= *now);
+}
+
+static bool
+rpc_result_cache_respond(rpc_context_t context, struct rpc_call *call)
+{
+	struct rpc_result_cache *cache;
+	struct rpc_cached_result *entry;
+	GBytes *packed = NULL;
+	rpc_object_t result;
+	char *key;
+
+	key = rpc_result_cache_key(call);
+	g_mutex_lock(&context->rcx_result_cache_mtx);
+	cache = g_hash_table_lookup(context->rcx_result_cache,
+	    call->rc_instance->ri_path);
+
+	/*
+	 * Unregistering drops the cache only after the instance is gone
+	 * from the index, so checking under the lock can't bring one back.
+	 */
+	if (cache == NULL && rpc_context_find_instance(context,
+	    call->rc_instance->ri_path) != call->rc_instance) {
+		g_mutex_unlock(&context->rcx_result_cache_mtx);
+		g_free(key);
+		return (false);
+	}
+
+	if (cache == NULL) {
+		cache = g_malloc0(sizeof(*cache));
+		cache->rrc_results = g_hash_table_new_full(g_str_hash,
+		    g_str_equal, g_free, (GDestroyNotify)rpc_cached_result_free);
+		cache->rrc_gen = 1;
+		g_hash_table_insert(context->rcx_result_cache,
+		    g_strdup(call->rc_instance->ri_path), cache);
+	}
+
+	entry = g_hash_table_lookup(cache->rrc_results, key);
+	if (entry != NULL && entry->rcr_expires <= g_get_monotonic_time()) {
+		g_hash_table_remove(cache->rrc_results, key);
+		entry = NULL;
+	}
+
+	/* Keys only carry the hash of the arguments */
+	if (entry != NULL && !rpc_equal(entry->rcr_args, call->rc_args))
+		entry = NULL;
+
+	if (entry == NULL) {
+		/* Lets rpc_result_cache_store() spot a racing invalidation */
+		call->rc_cache_gen = cache->rrc_gen;
+		g_mutex_unlock(&context->rcx_result_cache_mtx);
+		g_free(key);
+		return (false);
+	}
+
+	result = rpc_retain(entry->rcr_result);
+	if (entry->rcr_packed != NULL)
+		packed = g_bytes_ref(entry->rcr_packed);
+
+	g_mutex_unlock(&context->rcx_result_cache_mtx);
+	g_free(key);
+
+	if (call->rc_batch != NULL)
+		rpc_call_batch_set_result(call, result);
+	else
+		rpc_connection_send_packed_response(call->rc_conn,
+		    call->rc_id, result, packed);
+
+	if (packed != NULL)
+		g_bytes_unref(packed);
+
+	call->rc_responded = true;
+	rpc_connection_close_inbound_call(call);
+	return (true);
+}
+
+static void
+rpc_result_cache_store(rpc_context_t context, struct rpc_call *call,
+    rpc_object_t result)
+{
+	struct rpc_result_cache *cache;
+	struct rpc_cached_result *entry;
+	GBytes *packed;
+	gint64 now;
+
+	if (rpc_get_type(result) == RPC_TYPE_ERROR)
+		return;
+
+	/* Packed once here, so that hits skip the serializer entirely */
+	packed = rpc_object_get_packed(result);
+	if (packed == NULL)
+		packed = rpc_connection_pack_result(result);
+
+	if (packed == NULL)
+		return;
+
+	now = g_get_monotonic_time();
+	g_mutex_lock(&context->rcx_result_cache_mtx);
+	cache = g_hash_table_lookup(context->rcx_result_cache,
+	    call->rc_instance->ri_path);
+
+	if (cache == NULL || cache->rrc_gen != call->rc_cache_gen) {
+		g_mutex_unlock(&context->rcx_result_cache_mtx);
+		g_bytes_unref(packed);
+		return;
+	}
+
+	if (g_hash_table_size(cache->rrc_results) >= RPC_RESULT_CACHE_MAX)
+		g_hash_table_foreach_remove(cache->rrc_results,
+		    rpc_cached_result_expired, &now);
+
+	if (g_hash_table_size(cache->rrc_results) >= RPC_RESULT_CACHE_MAX) {
+		g_mutex_unlock(&context->rcx_result_cache_mtx);
+		g_bytes_unref(packed);
+		return;
+	}
+
+	entry = g_malloc0(sizeof(*entry));
+	entry->rcr_args = call->rc_args != NULL ?
+	    rpc_retain(call->rc_args) : NULL;
+	entry->rcr_result = rpc_retain(result);
+	entry->rcr_packed = packed;
+	entry->rcr_expires = now +
+	    (gint64)call->rc_if_method->rm_cache_ttl * 1000;
+	g_hash_table_insert(cache->rrc_results, rpc_result_cache_key(call),
+	    entry);
+	g_mutex_unlock(&context->rcx_result_cache_mtx);
+}
+
+static void
+rpc_result_cache_invalidate(rpc_context_t context, const char *path,
+    bool remove)
+{
+	struct rpc_result_cache *cache;
+
+	g_mutex_lock(&context->rcx_result_cache_mtx);
+	cache = g_hash_table_lookup(context->rcx_result_cache, path);
+	if (cache != NULL) {
+		/*
+		 * Bumping the generation keeps calls that started before
+		 * the change from storing a stale result afterwards.
+		 */
+		cache->rrc_gen = MAX(cache->rrc_gen + 1, 1);
+		g_hash_table_remove_all(cache->rrc_results);
+		if (remove)
+			g_hash_table_remove(context->rcx_result_cache, path);
+	}
+	g_mutex_unlock(&context->rcx_result_cache_mtx);
+}
+
+static void
+rpc_context_workq_handler(void *data, void *user_data)
+{
+	struct rpc_call *call = data;
+	rpc_context_t context = user_data;
+	rpc_connection_t conn = call->rc_conn;
+	bool limited = call->rc_limited;
+	gint64 admitted = call->rc_admitted;
+
+	/* The call may be gone once it has run */
+	g_atomic_int_inc(&context->rcx_adm_running);
+	rpc_context_run_call(call, context);
+	g_atomic_int_add(&context->rcx_adm_running, -1);
+	if (limited)
+		rpc_context_limit_leave(context, conn);
+
+	if (admitted != 0)
+		rpc_context_admission_leave(context, admitted);
+}
+
+static bool
+rpc_context_admit(rpc_context_t context, struct rpc_call *call)
+{
+	guint limit;
+
+	limit = g_atomic_int_get(&context->rcx_adm_limit);
+	if (limit == 0)
+		return (true);
+
+	if (g_atomic_int_add(&context->rcx_adm_inflight, 1) >= (gint)limit) {
+		g_atomic_int_add(&context->rcx_adm_inflight, -1);
+		atomic_fetch_add(&context->rcx_adm_rejected, 1);
+		return (false);
+	}
+
+	atomic_fetch_add(&context->rcx_adm_admitted, 1);
+	call->rc_admitted = g_get_monotonic_time();
+	return (true);
+}
+
+static void
+rpc_context_admission_leave(rpc_context_t context, gint64 admitted)
+{
+	gint64 now = g_get_monotonic_time();
+	double latency = (double)(now - admitted);
+	double inflight;
+
+	inflight = g_atomic_int_add(&context->rcx_adm_inflight, -1) - 1;
+
+	g_mutex_lock(&context->rcx_adm_mtx);
+	if (context->rcx_adm_latency == 0)
+		context->rcx_adm_latency = latency;
+
+	if (context->rcx_adm_adaptive && context->rcx_adm_max != 0) {
+		/*
+		 * Calls admitted before the last backoff still carry the
+		 * old load; only newer ones may back off again.
+		 */
+		if (latency > RPC_ADMISSION_TOLERANCE *
+		    context->rcx_adm_latency) {
+			if (admitted > context->rcx_adm_backoff) {
+				context->rcx_adm_limit_f = MAX(
+				    context->rcx_adm_limit_f *
+				    RPC_ADMISSION_BACKOFF, RPC_ADMISSION_MIN);
+				context->rcx_adm_backoff = now;
+			}
+		} else if (inflight * 2 >= context->rcx_adm_limit_f) {
+			context->rcx_adm_limit_f = MIN(
+			    context->rcx_adm_limit_f + 1,
+			    context->rcx_adm_max);
+		}
+
+		g_atomic_int_set(&context->rcx_adm_limit,
+		    (guint)context->rcx_adm_limit_f);
+	}
+
+	context->rcx_adm_latency += (latency - context->rcx_adm_latency) /
+	    RPC_ADMISSION_SMOOTHING;
+	g_mutex_unlock(&context->rcx_adm_mtx);
+}
+
+/*
+ * Returns true if the call may start now, false if it had to wait
+ * behind earlier calls from the same connection.
+ */
+static bool
+rpc_context_limit_enter(rpc_context_t context, struct rpc_call *call)
+{
+	rpc_connection_t conn = call->rc_conn;
+	guint limit;
+
+	limit = conn->rco_dispatch_limit;
+	if (limit == 0)
+		limit = context->rcx_dispatch_limit;
+
+	if (limit == 0)
+		return (true);
+
+	/* Held until the call has run, so the queue outlives it */
+	call->rc_limited = true;
+	rpc_connection_retain(conn);
+
+	g_mutex_lock(&conn->rco_dispatch_mtx);
+	if (conn->rco_dispatch_inflight >= limit ||
+	    !g_queue_is_empty(&conn->rco_dispatch_queue)) {
+		g_queue_push_tail(&conn->rco_dispatch_queue, call);
+		g_mutex_unlock(&conn->rco_dispatch_mtx);
+		return (false);
+	}
+
+	conn->rco_dispatch_inflight++;
+	g_mutex_unlock(&conn->rco_dispatch_mtx);
+	return (true);
+}
+
+static void
+rpc_context_limit_leave(rpc_context_t context, rpc_connection_t conn)
+{
+	struct rpc_call *next;
+
+	/* The finished call's slot goes straight to the next one in line */
+	g_mutex_lock(&conn->rco_dispatch_mtx);
+	next = g_queue_pop_head(&conn->rco_dispatch_queue);
+	if (next == NULL)
+		conn->rco_dispatch_inflight--;
+	g_mutex_unlock(&conn->rco_dispatch_mtx);
+
+	if (next != NULL)
+		rpc_context_schedule(context, next);
+
+	rpc_connection_release(conn);
+}
+
+static struct rpc_workq *
+rpc_context_get_workq(rpc_context_t context)
+{
+	struct rpc_workq *wq;
+
+	wq = g_atomic_pointer_get(&context->rcx_workq);
+	if (wq != NULL)
+		return (wq);
+
+	/* Started on first use, so the worker count can still be set */
+	g_mutex_lock(&context->rcx_workq_mtx);
+	wq = context->rcx_workq;
+	if (wq == NULL) {
+		wq = rpc_workq_new(context->rcx_workq_nworkers,
+		    context->rcx_workq_pin, context->rcx_prio_weighted ?
+		    context->rcx_prio_weights : NULL,
+		    rpc_context_workq_handler, context);
+		g_atomic_pointer_set(&context->rcx_workq, wq);
+	}
+	g_mutex_unlock(&context->rcx_workq_mtx);
+	return (wq);
+}
+
+static struct rpc_exec_tenant *
+rpc_context_get_exec(rpc_context_t context)
+{
+	struct rpc_exec_tenant *tenant;
+
+	tenant = g_atomic_pointer_get(&context->rcx_exec);
+	if (tenant != NULL)
+		return (tenant);
+
+	g_mutex_lock(&context->rcx_workq_mtx);
+	tenant = context->rcx_exec;
+	if (tenant == NULL) {
+		tenant = rpc_exec_tenant_new(context->rcx_exec_weight, 0,
+		    rpc_context_workq_handler, context);
+		g_atomic_pointer_set(&context->rcx_exec, tenant);
+	}
+	g_mutex_unlock(&context->rcx_workq_mtx);
+	return (tenant);
+}
+
+static void
+rpc_context_schedule(rpc_context_t context, struct rpc_call *call)
+{
+	struct rpc_fiber_sched *sched = NULL;
+
+	RPC_PROBE4(call__enqueue, call->rc_conn, call, call->rc_interface,
+	    call->rc_method_name);
+	if (call->rc_if_method->rm_flags & RPC_METHOD_FLAG_FIBER) {
+		g_mutex_lock(&context->rcx_workq_mtx);
+		if (context->rcx_fibers == NULL) {
+			context->rcx_fibers = rpc_fiber_sched_new(
+			    context->rcx_fibers_nthreads);
+		}
+		sched = context->rcx_fibers;
+		g_mutex_unlock(&context->rcx_workq_mtx);
+	}
+
+	/* Without fibers, or out of stacks, a worker will do */
+	if (sched != NULL && rpc_fiber_spawn(sched,
+	    rpc_context_workq_handler, call, context) == 0)
+		return;
+
+	if (context->rcx_exec_weight != 0) {
+		rpc_exec_submit(rpc_context_get_exec(context),
+		    (guintptr)call->rc_conn,
+		    RPC_PRIORITY_HIGH - call->rc_priority, call);
+		return;
+	}
+
+	/* Keep calls from one connection on the same worker if possible */
+	rpc_workq_push(rpc_context_get_workq(context),
+	    (guintptr)call->rc_conn, RPC_PRIORITY_HIGH - call->rc_priority,
+	    call);
+}
+
+static GHashTable *
+rpc_snapshot_new(void)
+{
+
+	return (g_hash_table_new(g_str_hash, g_str_equal));
+}
+
+/*
+ * Replaces a lookup snapshot with a fresh copy of its master table.
+ * Keys and values stay owned by the master; callers that drop an entry
+ * steal it first and hand it to rpc_rcu_call(), since readers of the
+ * previous snapshot may still be looking at it.
+ */
+static void
+rpc_snapshot_publish(GHashTable **snapshot, GHashTable *master)
+{
+	GHashTableIter iter;
+	GHashTable *copy;
+	gpointer key;
+	gpointer value;
+
+	copy = rpc_snapshot_new();
+	g_hash_table_iter_init(&iter, master);
+	while (g_hash_table_iter_next(&iter, &key, &value))
+		g_hash_table_insert(copy, key, value);
+
+	rpc_rcu_assign((gpointer *)snapshot, copy,
+	    (GDestroyNotify)g_hash_table_unref);
+}
+
+static guint
+rpc_instance_shard_index(const char *path)
+{
+
+	return (g_str_hash(path) % RPC_INSTANCE_SHARDS);
+}
+
+static struct rpc_instance_shard *
+rpc_instance_shard(rpc_context_t context, const char *path)
+{
+
+	return (&context->rcx_instance_shards[rpc_instance_shard_index(path)]);
+}
+
+/*
+ * Shards named by @p mask are always taken in ascending order, so two
+ * batches touching overlapping shards can't deadlock.
+ */
+static void
+rpc_instance_shards_lock(rpc_context_t context, guint mask)
+{
+	guint i;
+
+	for (i = 0; i < RPC_INSTANCE_SHARDS; i++) {
+		if (mask & (1u << i))
+			g_rw_lock_writer_lock(
+			    &context->rcx_instance_shards[i].ris_rwlock);
+	}
+}
+
+static void
+rpc_instance_shards_unlock(rpc_context_t context, guint mask)
+{
+	guint i;
+
+	for (i = RPC_INSTANCE_SHARDS; i-- > 0;) {
+		if (mask & (1u << i))
+			g_rw_lock_writer_unlock(
+			    &context->rcx_instance_shards[i].ris_rwlock);
+	}
+}
+
+/*
+ * Like rpc_snapshot_publish(), for every shard in @p mask at once.
+ */
+static void
+rpc_instance_shards_publish(rpc_context_t context, guint mask)
+{
+	struct rpc_instance_shard *shard;
+	GHashTableIter iter;
+	GHashTable *copy;
+	gpointer key;
+	gpointer value;
+	guint i;
+
+	for (i = 0; i < RPC_INSTANCE_SHARDS; i++) {
+		if (!(mask & (1u << i)))
+			continue;
+
+		shard = &context->rcx_instance_shards[i];
+		copy = rpc_snapshot_new();
+		g_hash_table_iter_init(&iter, shard->ris_instances);
+		while (g_hash_table_iter_next(&iter, &key, &value))
+			g_hash_table_insert(copy, key, value);
+
+		rpc_rcu_assign((gpointer *)&shard->ris_rcu, copy,
+		    (GDestroyNotify)g_hash_table_unref);
+	}
+}
+
 rpc_context_t
 rpc_context_create(void)
 {
 	GError *err;
 	rpc_context_t result;
+	struct rpc_emit_shard *shard;
+	struct rpc_instance_shard *ishard;
+	guint i;
 
 	rpct_init(true);
 
 	result = g_malloc0(sizeof(*result));
 	result->rcx_root = rpc_instance_new(NULL, "/");
 	result->rcx_servers = g_ptr_array_new();
-	result->rcx_instances = g_hash_table_new(g_str_hash, g_str_equal);
+	for (i = 0; i < RPC_INSTANCE_SHARDS; i++) {
+		ishard = &result->rcx_instance_shards[i];
+		g_rw_lock_init(&ishard->ris_rwlock);
+		ishard->ris_instances = g_hash_table_new(g_str_hash,
+		    g_str_equal);
+		ishard->ris_rcu = rpc_snapshot_new();
+	}
+
+	g_rw_lock_init(&result->rcx_instance_index_rwlock);
+	result->rcx_instance_seq = g_sequence_new(NULL);
+	g_queue_init(&result->rcx_instance_log);
 	result->rcx_threadpool = g_thread_pool_new(rpc_context_tp_handler,
 	    result, -1, false, &err);
-	result->rcx_emit_queue = g_async_queue_new();
-	result->rcx_emit_thread = g_thread_new("emitter", emit_events,
-	    result->rcx_emit_queue);
+	g_mutex_init(&result->rcx_workq_mtx);
+	g_mutex_init(&result->rcx_adm_mtx);
+	g_rw_lock_init(&result->rcx_validation_lock);
+	result->rcx_validation = g_hash_table_new_full(g_str_hash, g_str_equal,
+	    g_free, (GDestroyNotify)g_hash_table_destroy);
+	g_mutex_init(&result->rcx_result_cache_mtx);
+	result->rcx_result_cache = g_hash_table_new_full(g_str_hash,
+	    g_str_equal, g_free, (GDestroyNotify)rpc_result_cache_free);
+	g_mutex_init(&result->rcx_notify_mtx);
+	g_cond_init(&result->rcx_notify_cv);
+	result->rcx_notify_queue = g_sequence_new(NULL);
 	result->rcx_event_watchers = g_hash_table_new(NULL, NULL);
+	result->rcx_sub_index = g_hash_table_new_full(g_str_hash, g_str_equal,
+	    g_free, (GDestroyNotify)g_hash_table_unref);
+	result->rcx_sub_trie = rpc_sub_trie_new(NULL, "");
+	result->rcx_sessions = g_hash_table_new_full(g_str_hash, g_str_equal,
+	    NULL, (GDestroyNotify)rpc_session_release);
+	result->rcx_emit_nshards = CLAMP(g_get_num_processors(), 1,
+	    RPC_EMIT_MAX_SHARDS);
+	result->rcx_emit_shards = g_malloc0_n(result->rcx_emit_nshards,
+	    sizeof(struct rpc_emit_shard));
+
+	for (i = 0; i < result->rcx_emit_nshards; i++) {
+		shard = &result->rcx_emit_shards[i];
+		shard->res_queue = g_async_queue_new();
+		shard->res_thread = rpc_thread_new(RPC_THREAD_EMITTER,
+		    "emitter shard", emit_shard_worker, shard);
+	}
+
+	result->rcx_emit_queue = g_async_queue_new();
+	result->rcx_emit_thread = rpc_thread_new(RPC_THREAD_EMITTER, "emitter",
+	    emit_events, result->rcx_emit_queue);
 
+	result->rcx_stats = rpc_stats_new();
 	rpc_instance_set_description(result->rcx_root, "Root object");
+	rpc_instance_register_interface(result->rcx_root, RPC_STATS_INTERFACE,
+	    rpc_stats_vtable, NULL);
 	rpc_context_register_instance(result, result->rcx_root);
 	return (result);
 }
@@ -206,20 +928,81 @@ void
 rpc_context_free(rpc_context_t context)
 {
 	struct emit_item *item;
+	struct rpc_emit_shard *shard;
+	struct rpc_property_notify *notify;
+	GSequenceIter *iter;
+	guint i;
 
 	if (context == NULL)
 		return;
 
+	/* Coalesced changes still pending hold instance references */
+	g_mutex_lock(&context->rcx_notify_mtx);
+	context->rcx_notify_stop = true;
+	g_cond_signal(&context->rcx_notify_cv);
+	g_mutex_unlock(&context->rcx_notify_mtx);
+	if (context->rcx_notify_thread != NULL)
+		g_thread_join(context->rcx_notify_thread);
+
+	while (!g_sequence_is_empty(context->rcx_notify_queue)) {
+		iter = g_sequence_get_begin_iter(context->rcx_notify_queue);
+		notify = g_sequence_get(iter);
+		g_sequence_remove(iter);
+		notify->rpn_queued = false;
+		rpc_release(notify->rpn_value);
+		notify->rpn_value = NULL;
+		rpc_instance_release(notify->rpn_instance);
+	}
+
+	g_sequence_free(context->rcx_notify_queue);
+	g_cond_clear(&context->rcx_notify_cv);
+	g_mutex_clear(&context->rcx_notify_mtx);
+
 	/* free the instance before taking down the tp */
 	rpc_instance_free(context->rcx_root);
+	rpc_workq_free(context->rcx_workq);
+	rpc_exec_tenant_free(context->rcx_exec, true);
+	rpc_fiber_sched_free(context->rcx_fibers);
 	g_thread_pool_free(context->rcx_threadpool, true, true);
+	g_mutex_clear(&context->rcx_workq_mtx);
+	g_mutex_clear(&context->rcx_adm_mtx);
 
 	item = g_malloc(sizeof (*item));
 	item->context = NULL;
 	g_async_queue_push(context->rcx_emit_queue, item);
 	g_thread_join(context->rcx_emit_thread);
 	g_async_queue_unref(context->rcx_emit_queue);
+
+	/* Shards finish what's already queued, then see the sentinel */
+	for (i = 0; i < context->rcx_emit_nshards; i++) {
+		shard = &context->rcx_emit_shards[i];
+		g_async_queue_push(shard->res_queue, shard);
+		g_thread_join(shard->res_thread);
+		g_async_queue_unref(shard->res_queue);
+	}
+
+	g_free(context->rcx_emit_shards);
 	g_hash_table_destroy(context->rcx_event_watchers);
+	g_hash_table_destroy(context->rcx_sub_index);
+	rpc_sub_trie_free(context->rcx_sub_trie);
+	g_hash_table_destroy(context->rcx_sessions);
+	g_hash_table_destroy(context->rcx_validation);
+	g_rw_lock_clear(&context->rcx_validation_lock);
+	g_hash_table_destroy(context->rcx_result_cache);
+	g_mutex_clear(&context->rcx_result_cache_mtx);
+	for (i = 0; i < RPC_INSTANCE_SHARDS; i++) {
+		g_hash_table_unref(context->rcx_instance_shards[i].ris_rcu);
+		g_hash_table_destroy(
+		    context->rcx_instance_shards[i].ris_instances);
+		g_rw_lock_clear(&context->rcx_instance_shards[i].ris_rwlock);
+	}
+
+	g_rw_lock_clear(&context->rcx_instance_index_rwlock);
+	g_sequence_free(context->rcx_instance_seq);
+	while (!g_queue_is_empty(&context->rcx_instance_log))
+		rpc_instance_change_free(
+		    g_queue_pop_head(&context->rcx_instance_log));
+	rpc_stats_free(context->rcx_stats);
 	g_free(context);
 }
 
@@ -227,24 +1010,40 @@ int
 rpc_context_dispatch(rpc_context_t context, struct rpc_call *call)
 {
 	struct rpc_if_member *member;
-	GError *err = NULL;
 	rpc_instance_t instance = NULL;
-	struct tp_item *item;
+	rpc_connection_t conn;
+	gint64 admitted;
+	bool limited;
 
 	debugf("call=%p, name=%s", call, call->rc_method_name);
 
+	call->rc_queued = g_get_monotonic_time();
 	if (!rpc_connection_is_open(call->rc_conn)) {
 		debugf("Can't dispatch call, conn %p closed", call->rc_conn);
 		return (-1);
 	}
 
+	if (call->rc_deadline != 0 &&
+	    g_get_monotonic_time() >= call->rc_deadline) {
+		call->rc_err = rpc_error_create_shared(ETIMEDOUT,
+		    "Deadline exceeded", NULL);
+		return (-1);
+	}
+
+	/* Shed before doing any work on the call */
+	if (!rpc_context_admit(context, call)) {
+		call->rc_err = rpc_error_create_shared(EAGAIN,
+		    "Server overloaded", NULL);
+		return (-1);
+	}
+
 	instance = rpc_instance_find_and_retain(context,
 	    call->rc_path == NULL ? "/" : call->rc_path);
 
 	if (instance == NULL) {
-		call->rc_err = rpc_error_create(ENOENT, "No valid instance found",
-		    NULL);
-		return (-1);
+		call->rc_err = rpc_error_create_shared(ENOENT,
+		    "No valid instance found", NULL);
+		goto unadmit;
 	}
 
 	call->rc_instance = instance;
@@ -255,47 +1054,76 @@ rpc_context_dispatch(rpc_context_t context, struct rpc_call *call)
 	if (member == NULL) {
 		member = rpc_instance_find_member(instance,
 		    RPC_DEFAULT_INTERFACE, "method_missing");
+		call->rc_method_missing = true;
 	}
 
 	if (member == NULL || member->rim_type != RPC_MEMBER_METHOD) {
-		call->rc_err = rpc_error_create(ENOENT, "Member not found",
-		    NULL);
+		call->rc_err = rpc_error_create_shared(ENOENT,
+		    "Member not found", NULL);
 		rpc_instance_release(instance);
-		return (-1);
+		goto unadmit;
 	}
 
 	call->rc_if_method = &member->rim_method;
-	item = g_malloc(sizeof(*item));
-	item->type = TYPE_CALL;
-	item->data = call;
-	g_thread_pool_push(context->rcx_threadpool, item, &err);
-	if (err != NULL) {
-		call->rc_err = rpc_error_create(EFAULT, "Cannot submit call",
-		    NULL);
-		g_free(item);
-		g_error_free(err);
-		rpc_instance_release(instance);
-		return (-1);
+
+	/* The caller's request wins, then the method, then the interface */
+	if (call->rc_priority == RPC_PRIORITY_DEFAULT)
+		call->rc_priority = member->rim_method.rm_priority;
+
+	if (call->rc_priority == RPC_PRIORITY_DEFAULT)
+		call->rc_priority = rpc_instance_get_interface_priority(
+		    instance, call->rc_interface);
+
+	if (call->rc_priority == RPC_PRIORITY_DEFAULT)
+		call->rc_priority = RPC_PRIORITY_NORMAL;
+
+	if (!rpc_context_limit_enter(context, call))
+		return (0);
+
+	if (member->rim_method.rm_flags & RPC_METHOD_FLAG_INLINE) {
+		conn = call->rc_conn;
+		limited = call->rc_limited;
+		admitted = call->rc_admitted;
+		g_atomic_int_inc(&context->rcx_adm_running);
+		rpc_context_run_call(call, context);
+		g_atomic_int_add(&context->rcx_adm_running, -1);
+		if (limited)
+			rpc_context_limit_leave(context, conn);
+
+		if (admitted != 0)
+			rpc_context_admission_leave(context, admitted);
+
+		return (0);
 	}
 
+	rpc_context_schedule(context, call);
 	return (0);
+
+unadmit:
+	if (call->rc_admitted != 0) {
+		g_atomic_int_add(&context->rcx_adm_inflight, -1);
+		call->rc_admitted = 0;
+	}
+
+	return (-1);
 }
 
 rpc_instance_t
 rpc_context_find_instance(rpc_context_t context, const char *path)
 {
 	rpc_instance_t result;
+	int idx;
 
 	if (context == NULL)
 		return (NULL);
 
+	if (path == NULL)
+		return (context->rcx_root);
 
-	g_rw_lock_reader_lock(&context->rcx_rwlock);
-	result = path == NULL
-	    ? context->rcx_root
-	    : g_hash_table_lookup(context->rcx_instances, path);
-
-	g_rw_lock_reader_unlock(&context->rcx_rwlock);
+	idx = rpc_rcu_read_lock();
+	result = g_hash_table_lookup(rpc_rcu_dereference(
+	    rpc_instance_shard(context, path)->ris_rcu), path);
+	rpc_rcu_read_unlock(idx);
 	return (result);
 }
 
@@ -303,15 +1131,17 @@ rpc_instance_t
 rpc_instance_find_and_retain(rpc_context_t context, const char *path)
 {
 	rpc_instance_t instance;
+	int idx;
 
 	if (context == NULL)
 		return (NULL);
 
-
-	g_rw_lock_reader_lock(&context->rcx_rwlock);
-	instance = g_hash_table_lookup(context->rcx_instances, path);
+	/* rpc_instance_free() waits out a grace period, so this is safe */
+	idx = rpc_rcu_read_lock();
+	instance = g_hash_table_lookup(rpc_rcu_dereference(
+	    rpc_instance_shard(context, path)->ris_rcu), path);
 	instance = rpc_instance_retain(instance);
-	g_rw_lock_reader_unlock(&context->rcx_rwlock);
+	rpc_rcu_read_unlock(idx);
 	return (instance);
 }
 
@@ -326,16 +1156,17 @@ void
 rpc_instance_emit_event(rpc_instance_t instance, const char *interface,
     const char *name, rpc_object_t args)
 {
-	rpc_context_t context;
+	struct rpc_instance_shard *shard;
 
 	g_mutex_lock(&instance->ri_mtx);
 	if (instance->ri_context) {
-		context = instance->ri_context;
+		shard = rpc_instance_shard(instance->ri_context,
+		    instance->ri_path);
 		g_mutex_unlock(&instance->ri_mtx);
-		g_rw_lock_reader_lock(&context->rcx_rwlock);
+		g_rw_lock_reader_lock(&shard->ris_rwlock);
 		rpc_context_emit_event(instance->ri_context, instance->ri_path,
 		    interface, name, args);
-		g_rw_lock_reader_unlock(&context->rcx_rwlock);
+		g_rw_lock_reader_unlock(&shard->ris_rwlock);
 		return;
 	}
 	rpc_release(args);
@@ -361,35 +1192,83 @@ rpc_instance_register_property(rpc_instance_t instance, const char *interface,
 int
 rpc_context_register_instance(rpc_context_t context, rpc_instance_t instance)
 {
-	GHashTableIter iter;
-	rpc_object_t payload;
-	rpc_object_t ifaces;
-	const char *key;
 
-	g_rw_lock_writer_lock(&context->rcx_rwlock);
+	return (rpc_context_register_instances(context, &instance, 1));
+}
 
-	if (g_hash_table_contains(context->rcx_instances, instance->ri_path)) {
-		rpc_set_last_error(EEXIST, "Instance already exists", NULL);
-		g_rw_lock_writer_unlock(&context->rcx_rwlock);
-		return (-1);
+int
+rpc_context_register_instances(rpc_context_t context,
+    rpc_instance_t *instances, size_t count)
+{
+	struct rpc_instance_shard *shard;
+	GHashTableIter iter;
+	GHashTable *seen = NULL;
+	rpc_object_t payload;
+	rpc_object_t ifaces;
+	rpc_instance_t instance;
+	const char *key;
+	guint mask = 0;
+	size_t i;
+
+	if (count == 0)
+		return (0);
+
+	for (i = 0; i < count; i++)
+		mask |= 1u << rpc_instance_shard_index(instances[i]->ri_path);
+
+	if (count > 1)
+		seen = g_hash_table_new(g_str_hash, g_str_equal);
+
+	rpc_instance_shards_lock(context, mask);
+
+	for (i = 0; i < count; i++) {
+		key = instances[i]->ri_path;
+		shard = rpc_instance_shard(context, key);
+		if (g_hash_table_contains(shard->ris_instances, key) ||
+		    (seen != NULL && !g_hash_table_add(seen, (gpointer)key))) {
+			rpc_set_last_error(EEXIST, "Instance already exists",
+			    NULL);
+			rpc_instance_shards_unlock(context, mask);
+			if (seen != NULL)
+				g_hash_table_destroy(seen);
+			return (-1);
+		}
 	}
 
-	ifaces = rpc_array_create();
-	g_hash_table_iter_init(&iter, instance->ri_interfaces);
-	while (g_hash_table_iter_next(&iter, (gpointer)&key, NULL))
-		rpc_array_append_stolen_value(ifaces, rpc_string_create(key));
+	if (seen != NULL)
+		g_hash_table_destroy(seen);
 
-	payload = rpc_object_pack("{s,v}",
-	    "path", instance->ri_path,
-	    "interfaces", ifaces);
+	g_rw_lock_writer_lock(&context->rcx_instance_index_rwlock);
 
-	rpc_context_emit_event(context, "/", RPC_DISCOVERABLE_INTERFACE,
-	    "instance_added", payload);
+	for (i = 0; i < count; i++) {
+		instance = instances[i];
+		ifaces = rpc_array_create();
+		g_hash_table_iter_init(&iter, instance->ri_interfaces);
+		while (g_hash_table_iter_next(&iter, (gpointer)&key, NULL))
+			rpc_array_append_stolen_value(ifaces,
+			    rpc_string_create(key));
 
-	instance->ri_context = context;
+		payload = rpc_object_pack("{s,v}",
+		    "path", instance->ri_path,
+		    "interfaces", ifaces);
 
-	g_hash_table_insert(context->rcx_instances, instance->ri_path, instance);
-	g_rw_lock_writer_unlock(&context->rcx_rwlock);
+		rpc_context_emit_event(context, "/",
+		    RPC_DISCOVERABLE_INTERFACE, "instance_added", payload);
+
+		instance->ri_context = context;
+
+		shard = rpc_instance_shard(context, instance->ri_path);
+		g_hash_table_insert(shard->ris_instances, instance->ri_path,
+		    instance);
+		instance->ri_seq = g_sequence_insert_sorted(
+		    context->rcx_instance_seq, instance, rpc_instance_path_cmp,
+		    NULL);
+		rpc_instance_log_locked(context, true, instance->ri_path);
+	}
+
+	g_rw_lock_writer_unlock(&context->rcx_instance_index_rwlock);
+	rpc_instance_shards_publish(context, mask);
+	rpc_instance_shards_unlock(context, mask);
 	return (0);
 }
 
@@ -397,15 +1276,57 @@ void
 rpc_context_unregister_instance(rpc_context_t context, const char *path)
 {
 
-	g_rw_lock_writer_lock(&context->rcx_rwlock);
+	rpc_context_unregister_instances(context, &path, 1);
+}
 
-	if (g_hash_table_remove(context->rcx_instances, path)) {
-		rpc_context_emit_event(context, "/",
-		    RPC_DISCOVERABLE_INTERFACE, "instance_removed",
-		    rpc_string_create(path));
+void
+rpc_context_unregister_instances(rpc_context_t context, const char **paths,
+    size_t count)
+{
+	struct rpc_instance_shard *shard;
+	rpc_instance_t instance;
+	GPtrArray *removed;
+	guint mask = 0;
+	size_t i;
+
+	if (count == 0)
+		return;
+
+	for (i = 0; i < count; i++)
+		mask |= 1u << rpc_instance_shard_index(paths[i]);
+
+	removed = g_ptr_array_new();
+	rpc_instance_shards_lock(context, mask);
+	g_rw_lock_writer_lock(&context->rcx_instance_index_rwlock);
+
+	for (i = 0; i < count; i++) {
+		shard = rpc_instance_shard(context, paths[i]);
+		instance = g_hash_table_lookup(shard->ris_instances, paths[i]);
+		if (instance == NULL)
+			continue;
+
+		g_sequence_remove(instance->ri_seq);
+		instance->ri_seq = NULL;
+		rpc_instance_log_locked(context, false, paths[i]);
+		g_hash_table_remove(shard->ris_instances, paths[i]);
+		g_ptr_array_add(removed, (gpointer)paths[i]);
 	}
 
-	g_rw_lock_writer_unlock(&context->rcx_rwlock);
+	g_rw_lock_writer_unlock(&context->rcx_instance_index_rwlock);
+
+	if (removed->len > 0) {
+		rpc_instance_shards_publish(context, mask);
+		for (i = 0; i < removed->len; i++) {
+			rpc_result_cache_invalidate(context,
+			    g_ptr_array_index(removed, i), true);
+			rpc_context_emit_event(context, "/",
+			    RPC_DISCOVERABLE_INTERFACE, "instance_removed",
+			    rpc_string_create(g_ptr_array_index(removed, i)));
+		}
+	}
+
+	rpc_instance_shards_unlock(context, mask);
+	g_ptr_array_free(removed, true);
 }
 
 int
@@ -429,11 +1350,9 @@ int
 rpc_context_register_func(rpc_context_t context, const char *interface,
     const char *name, void *arg, rpc_function_f func)
 {
-	rpc_function_t fn = ^(void *cookie, rpc_object_t args) {
-		return (func(cookie, args));
-	};
 
-	return (rpc_context_register_block(context, interface, name, arg, fn));
+	return (rpc_instance_register_func(context->rcx_root, interface,
+	    name, arg, func));
 }
 
 int
@@ -445,757 +1364,2644 @@ rpc_context_unregister_member(rpc_context_t context, const char *interface,
 	    name));
 }
 
-static gpointer
-emit_events(gpointer data)
+static rpc_object_t
+emit_item_to_event(struct emit_item *item)
 {
-	struct emit_item *item;
-	GAsyncQueue *q = data;
-	rpc_connection_t conn;
-	rpc_context_t context;
-	GHashTableIter iter;
 
-	for (;;) {
-		item = g_async_queue_pop(q);
-		if (item->context == NULL)
-			break;
-		context = item->context;
-
-		g_rw_lock_reader_lock(&context->rcx_rwlock);
-		g_hash_table_iter_init(&iter, context->rcx_event_watchers);
-		while (g_hash_table_iter_next(&iter, (gpointer)&conn, NULL)) {
-			rpc_connection_send_event(conn, item->path,
-			    item->interface, item->name, item->args);
-		}
-
-		g_rw_lock_reader_unlock(&context->rcx_rwlock);
-		rpc_release(item->args);
-		g_free(item->path);
-		g_free(item->interface);
-		g_free(item->name);
-		g_free(item);
-	}
-	return (NULL);
+	return (rpc_object_pack("{s,s,s,v}",
+	    "path", item->path,
+	    "interface", item->interface,
+	    "name", item->name,
+	    "args", rpc_retain(item->args)));
 }
 
-void
-rpc_context_emit_event(rpc_context_t context, const char *path,
-    const char *interface, const char *name, rpc_object_t args)
+static void
+emit_item_free(struct emit_item *item)
 {
-	struct emit_item *item = g_malloc(sizeof (*item));
-
-	item->context = context;
-	item->path = g_strdup(path);
-	item->interface = g_strdup(interface);
-	item->name = g_strdup(name);
-	item->args = args;
 
-	g_async_queue_push(context->rcx_emit_queue, item);
+	rpc_release(item->args);
+	g_free(item->path);
+	g_free(item->interface);
+	g_free(item->name);
+	g_free(item);
 }
 
-inline void *
-rpc_function_get_arg(void *cookie)
+static struct rpc_emit_entry *
+emit_entry_new(rpc_context_t context, rpc_object_t event)
 {
-	struct rpc_call *call = cookie;
+	struct rpc_emit_entry *entry;
 
-	return (call->rc_m_arg);
+	entry = g_malloc0(sizeof(*entry));
+	entry->ree_refcnt = 1;
+	entry->ree_event = event;
+	entry->ree_frame = rpc_connection_pack_event(event);
+	return (entry);
 }
 
-inline rpc_connection_t
-rpc_function_get_connection(void *cookie)
+void
+rpc_emit_entry_release(void *data)
 {
-	struct rpc_call *call = cookie;
+	struct rpc_emit_entry *entry = data;
 
-	return (rpc_connection_is_open(call->rc_conn) ? call->rc_conn : NULL);
+	if (!g_atomic_int_dec_and_test(&entry->ree_refcnt))
+		return;
+
+	if (entry->ree_frame != NULL)
+		g_bytes_unref(entry->ree_frame);
+
+	rpc_release(entry->ree_event);
+	g_free(entry);
 }
 
-inline rpc_context_t
-rpc_function_get_context(void *cookie)
+static void
+emit_enqueue(rpc_context_t context, rpc_connection_t conn,
+    struct rpc_emit_entry *entry)
 {
-	struct rpc_call *call = cookie;
+	struct rpc_emit_shard *shard;
+	gsize limit = context->rcx_emit_limit;
+	bool schedule = false;
+	guint idx;
+
+	g_mutex_lock(&conn->rco_emit_mtx);
+	if (limit > 0 && conn->rco_emit_queue.length >= limit) {
+		switch (context->rcx_emit_policy) {
+		case RPC_EMIT_DROP_NEWEST:
+			conn->rco_emit_dropped++;
+			g_mutex_unlock(&conn->rco_emit_mtx);
+			return;
 
-	return (call->rc_context);
+		case RPC_EMIT_DROP_OLDEST:
+			rpc_emit_entry_release(
+			    g_queue_pop_head(&conn->rco_emit_queue));
+			conn->rco_emit_dropped++;
+			break;
+
+		case RPC_EMIT_BLOCK:
+			/* rpc_close() wakes us up, nothing drains it then */
+			while (conn->rco_emit_queue.length >= limit &&
+			    rpc_connection_is_open(conn))
+				g_cond_wait(&conn->rco_emit_cv,
+				    &conn->rco_emit_mtx);
+
+			if (!rpc_connection_is_open(conn)) {
+				g_mutex_unlock(&conn->rco_emit_mtx);
+				return;
+			}
+			break;
+		}
+	}
+
+	g_atomic_int_inc(&entry->ree_refcnt);
+	g_queue_push_tail(&conn->rco_emit_queue, entry);
+	if (!conn->rco_emit_scheduled) {
+		conn->rco_emit_scheduled = true;
+		schedule = true;
+	}
+	g_mutex_unlock(&conn->rco_emit_mtx);
+
+	if (!schedule)
+		return;
+
+	/* The shard holds a reference until it drains the queue */
+	rpc_connection_retain(conn);
+	idx = (guint)(((uintptr_t)conn >> 4) * 2654435761u) %
+	    context->rcx_emit_nshards;
+	shard = &context->rcx_emit_shards[idx];
+	g_async_queue_push(shard->res_queue, conn);
 }
 
-inline rpc_instance_t
-rpc_function_get_instance(void *cookie)
+static gpointer
+emit_shard_worker(gpointer data)
 {
-	struct rpc_call *call = cookie;
+	struct rpc_emit_shard *shard = data;
+	struct rpc_emit_entry *entry;
+	rpc_connection_t conn;
+	guint sent;
+	bool more;
 
-	return (call->rc_instance);
+	for (;;) {
+		conn = g_async_queue_pop(shard->res_queue);
+		if (conn == (rpc_connection_t)shard)
+			break;
+
+		/* Let other connections on this shard have a go, too */
+		for (sent = 0, more = true; sent < RPC_EMIT_QUANTUM; sent++) {
+			g_mutex_lock(&conn->rco_emit_mtx);
+			entry = g_queue_pop_head(&conn->rco_emit_queue);
+			if (entry == NULL) {
+				conn->rco_emit_scheduled = false;
+				g_mutex_unlock(&conn->rco_emit_mtx);
+				more = false;
+				break;
+			}
+
+			g_cond_signal(&conn->rco_emit_cv);
+			g_mutex_unlock(&conn->rco_emit_mtx);
+
+			rpc_connection_send_event_frame(conn,
+			    entry->ree_event, entry->ree_frame);
+			rpc_emit_entry_release(entry);
+		}
+
+		if (more) {
+			g_async_queue_push(shard->res_queue, conn);
+			continue;
+		}
+
+		rpc_connection_release(conn);
+	}
+
+	return (NULL);
 }
 
-const char *
-rpc_function_get_name(void *cookie)
+static char *
+rpc_context_index_key(const char *path, const char *interface,
+    const char *name)
 {
-	struct rpc_call *call = cookie;
 
-	return (call->rc_method_name);
+	/* NULL and empty components must not collide */
+	return (g_strdup_printf("%c%s\x1f%c%s\x1f%c%s",
+	    path != NULL ? '+' : '-', path != NULL ? path : "",
+	    interface != NULL ? '+' : '-', interface != NULL ? interface : "",
+	    name != NULL ? '+' : '-', name != NULL ? name : ""));
 }
 
-const char *
-rpc_function_get_path(void *cookie)
+static void
+rpc_sub_wildcard_free(struct rpc_sub_wildcard *wc)
 {
-	struct rpc_call *call = cookie;
 
-	return (call->rc_path);
+	g_free(wc->rsw_prefix);
+	g_free(wc->rsw_interface);
+	g_free(wc->rsw_name);
+	g_free(wc);
 }
 
-const char *
-rpc_function_get_interface(void *cookie)
+static struct rpc_sub_trie *
+rpc_sub_trie_new(struct rpc_sub_trie *parent, const char *key)
 {
-	struct rpc_call *call = cookie;
+	struct rpc_sub_trie *trie;
+
+	trie = g_malloc0(sizeof(*trie));
+	trie->rst_parent = parent;
+	trie->rst_key = g_strdup(key);
+	trie->rst_children = g_hash_table_new(g_str_hash, g_str_equal);
+	trie->rst_globs = g_ptr_array_new();
+	trie->rst_tails = g_ptr_array_new_with_free_func(
+	    (GDestroyNotify)rpc_sub_wildcard_free);
+	trie->rst_ends = g_ptr_array_new_with_free_func(
+	    (GDestroyNotify)rpc_sub_wildcard_free);
+
+	return (trie);
+}
 
-	return (call->rc_interface);
+static void
+rpc_sub_trie_free(struct rpc_sub_trie *trie)
+{
+	GHashTableIter iter;
+	struct rpc_sub_trie *child;
+	guint i;
+
+	g_hash_table_iter_init(&iter, trie->rst_children);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&child))
+		rpc_sub_trie_free(child);
+
+	for (i = 0; i < trie->rst_globs->len; i++)
+		rpc_sub_trie_free(g_ptr_array_index(trie->rst_globs, i));
+
+	g_hash_table_destroy(trie->rst_children);
+	g_ptr_array_free(trie->rst_globs, true);
+	g_ptr_array_free(trie->rst_tails, true);
+	g_ptr_array_free(trie->rst_ends, true);
+	g_free(trie->rst_key);
+	g_free(trie);
 }
 
-void
-rpc_function_respond(void *cookie, rpc_object_t object)
+static bool
+rpc_sub_trie_is_glob(const char *component)
 {
-	struct rpc_call *call = cookie;
 
-	call->rc_conn->rco_fn_cbs.rcf_fn_respond(cookie, object);
+	return (g_str_has_suffix(component, "*"));
 }
 
-void
-rpc_function_respond_impl(void *cookie, rpc_object_t object)
+static struct rpc_sub_trie *
+rpc_sub_trie_child(struct rpc_sub_trie *trie, const char *key, bool create)
 {
-	struct rpc_call *call = cookie;
+	struct rpc_sub_trie *child;
+	guint i;
+
+	if (!rpc_sub_trie_is_glob(key)) {
+		child = g_hash_table_lookup(trie->rst_children, key);
+		if (child == NULL && create) {
+			child = rpc_sub_trie_new(trie, key);
+			g_hash_table_insert(trie->rst_children, child->rst_key,
+			    child);
+		}
 
-	g_assert(call->rc_type == RPC_INBOUND_CALL);
-	if (!call->rc_responded)
-		rpc_connection_send_response(call->rc_conn,
-		    call->rc_id, object);
+		return (child);
+	}
 
-	rpc_connection_close_inbound_call(call);
-}
+	for (i = 0; i < trie->rst_globs->len; i++) {
+		child = g_ptr_array_index(trie->rst_globs, i);
+		if (strcmp(child->rst_key, key) == 0)
+			return (child);
+	}
 
-void
-rpc_function_error(void *cookie, int code, const char *message, ...)
-{
-	struct rpc_call *call = cookie;
-	va_list ap;
+	if (!create)
+		return (NULL);
 
-	va_start(ap, message);
-	call->rc_conn->rco_fn_cbs.rcf_fn_error(cookie, code, message, ap);
-	va_end(ap);
+	child = rpc_sub_trie_new(trie, key);
+	g_ptr_array_add(trie->rst_globs, child);
+	return (child);
 }
 
-void
-rpc_function_error_impl(void *cookie, int code, const char *message, va_list ap)
+/*
+ * Finds the node and the list a pattern goes to, creating nodes on the
+ * way if asked to. For subtree patterns, @p prefix gets the start of
+ * their last component.
+ */
+static struct rpc_sub_trie *
+rpc_sub_trie_walk(struct rpc_sub_trie *trie, const char *pattern,
+    bool create, GPtrArray **list, char **prefix)
 {
-	struct rpc_call *call = cookie;
-	char *msg;
+	char **components;
+	guint n;
+	guint i;
+
+	components = g_strsplit(pattern, "/", -1);
+	n = g_strv_length(components);
+
+	for (i = 0; trie != NULL && i + 1 < n; i++)
+		trie = rpc_sub_trie_child(trie, components[i], create);
+
+	if (trie != NULL && rpc_sub_trie_is_glob(components[n - 1])) {
+		*list = trie->rst_tails;
+		*prefix = g_strndup(components[n - 1],
+		    strlen(components[n - 1]) - 1);
+	} else if (trie != NULL) {
+		trie = rpc_sub_trie_child(trie, components[n - 1], create);
+		*list = trie != NULL ? trie->rst_ends : NULL;
+		*prefix = NULL;
+	}
 
-	g_vasprintf(&msg, message, ap);
-	rpc_connection_send_err(call->rc_conn, call->rc_id, code, msg);
-	call->rc_responded = true;
-	g_free(msg);
+	g_strfreev(components);
+	return (trie);
 }
 
-void
-rpc_function_error_ex(void *cookie, rpc_object_t exception)
+static bool
+rpc_sub_trie_is_empty(struct rpc_sub_trie *trie)
 {
-	struct rpc_call *call = cookie;
 
-	call->rc_conn->rco_fn_cbs.rcf_fn_error_ex(cookie, exception);
+	return (g_hash_table_size(trie->rst_children) == 0 &&
+	    trie->rst_globs->len == 0 && trie->rst_tails->len == 0 &&
+	    trie->rst_ends->len == 0);
 }
 
-void
-rpc_function_error_ex_impl(void *cookie, rpc_object_t exception)
+/* Takes empty nodes out, from @p trie up */
+static void
+rpc_sub_trie_prune(struct rpc_sub_trie *trie)
 {
-	struct rpc_call *call = cookie;
-
-	rpc_connection_send_errx(call->rc_conn, call->rc_id, exception);
-	call->rc_responded = true;
+	struct rpc_sub_trie *parent;
+
+	while (trie->rst_parent != NULL && rpc_sub_trie_is_empty(trie)) {
+		parent = trie->rst_parent;
+		if (rpc_sub_trie_is_glob(trie->rst_key))
+			g_ptr_array_remove(parent->rst_globs, trie);
+		else
+			g_hash_table_remove(parent->rst_children,
+			    trie->rst_key);
+
+		rpc_sub_trie_free(trie);
+		trie = parent;
+	}
 }
 
-int
-rpc_function_start_stream(void *cookie)
+static void
+rpc_sub_wildcards_remove_conn(GPtrArray *list, rpc_connection_t conn)
 {
-	struct rpc_call *call = cookie;
+	struct rpc_sub_wildcard *wc;
+	guint i;
 
-	return (call->rc_conn->rco_fn_cbs.rcf_fn_start_stream(cookie));
+	for (i = 0; i < list->len;) {
+		wc = g_ptr_array_index(list, i);
+		if (wc->rsw_conn == conn) {
+			g_ptr_array_remove_index_fast(list, i);
+			continue;
+		}
+
+		i++;
+	}
 }
 
-int
-rpc_function_start_stream_impl(void *cookie)
+/* Returns true if @p trie was left empty */
+static bool
+rpc_sub_trie_remove_conn(struct rpc_sub_trie *trie, rpc_connection_t conn)
 {
-	struct rpc_call *call = cookie;
-	struct rpc_context *context = call->rc_context;
+	GHashTableIter iter;
+	struct rpc_sub_trie *child;
+	guint i;
 
-	g_mutex_lock(&call->rc_mtx);
+	rpc_sub_wildcards_remove_conn(trie->rst_tails, conn);
+	rpc_sub_wildcards_remove_conn(trie->rst_ends, conn);
 
-	while (call->rc_producer_seqno == call->rc_consumer_seqno &&
-	       !call->rc_aborted) {
-		g_mutex_unlock(&call->rc_mtx);
-		notify_wait(&call->rc_notify);
-		g_mutex_lock(&call->rc_mtx);
+	g_hash_table_iter_init(&iter, trie->rst_children);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&child)) {
+		if (rpc_sub_trie_remove_conn(child, conn)) {
+			g_hash_table_iter_remove(&iter);
+			rpc_sub_trie_free(child);
+		}
 	}
 
-	if (call->rc_aborted) {
-		if (!call->rc_ended) {
-			rpc_function_error(call, ECONNRESET, "Call aborted");
-			call->rc_ended = true;
+	for (i = 0; i < trie->rst_globs->len;) {
+		child = g_ptr_array_index(trie->rst_globs, i);
+		if (rpc_sub_trie_remove_conn(child, conn)) {
+			g_ptr_array_remove_index_fast(trie->rst_globs, i);
+			rpc_sub_trie_free(child);
+			continue;
 		}
 
-		g_mutex_unlock(&call->rc_mtx);
-		return (-1);
+		i++;
 	}
 
-	if (context->rcx_pre_call_hook != NULL) {
+	return (rpc_sub_trie_is_empty(trie));
+}
+
+static void
+rpc_sub_trie_collect(GPtrArray *list, const char *prefix,
+    const char *interface, const char *name, GHashTable *targets)
+{
+	struct rpc_sub_wildcard *wc;
+	guint i;
+
+	for (i = 0; i < list->len; i++) {
+		wc = g_ptr_array_index(list, i);
+		if (prefix != NULL && !g_str_has_prefix(prefix, wc->rsw_prefix))
+			continue;
+
+		if (g_strcmp0(wc->rsw_interface, interface) != 0 ||
+		    g_strcmp0(wc->rsw_name, name) != 0)
+			continue;
 
+		g_hash_table_add(targets, wc->rsw_conn);
 	}
-	rpc_connection_send_start_stream(call->rc_conn, call->rc_id,
-	    call->rc_producer_seqno);
+}
 
-	call->rc_producer_seqno++;
-	call->rc_streaming = true;
-	g_mutex_unlock(&call->rc_mtx);
-	return (0);
+/*
+ * Adds the connections whose wildcards match @p rest, the part of
+ * the path below @p trie. The path is cut into components in place
+ * on the way down and put back together on the way up.
+ */
+static void
+rpc_sub_trie_match(struct rpc_sub_trie *trie, char *rest,
+    const char *interface, const char *name, GHashTable *targets)
+{
+	struct rpc_sub_trie *child;
+	char *next;
+	size_t len;
+	guint i;
+
+	if (trie->rst_tails->len > 0)
+		rpc_sub_trie_collect(trie->rst_tails, rest, interface, name,
+		    targets);
+
+	next = strchr(rest, '/');
+	if (next != NULL)
+		*next = '\0';
+
+	child = g_hash_table_lookup(trie->rst_children, rest);
+	if (child != NULL && next == NULL)
+		rpc_sub_trie_collect(child->rst_ends, NULL, interface, name,
+		    targets);
+	else if (child != NULL)
+		rpc_sub_trie_match(child, next + 1, interface, name, targets);
+
+	for (i = 0; i < trie->rst_globs->len; i++) {
+		child = g_ptr_array_index(trie->rst_globs, i);
+		len = strlen(child->rst_key) - 1;
+		if (strncmp(child->rst_key, rest, len) != 0)
+			continue;
+
+		if (next == NULL)
+			rpc_sub_trie_collect(child->rst_ends, NULL, interface,
+			    name, targets);
+		else
+			rpc_sub_trie_match(child, next + 1, interface, name,
+			    targets);
+	}
+
+	if (next != NULL)
+		*next = '/';
 }
 
-int
-rpc_function_yield(void *cookie, rpc_object_t fragment)
+void
+rpc_context_index_add(rpc_context_t context, rpc_connection_t conn,
+    const char *path, const char *interface, const char *name)
 {
-	struct rpc_call *call = cookie;
+	struct rpc_sub_wildcard *wc;
+	GPtrArray *list;
+	GHashTable *conns;
+	char *key;
+
+	rpc_rw_lock_writer_lock(&context->rcx_rwlock, RPC_LOCK_CONTEXT);
+	if (rpc_path_is_pattern(path)) {
+		wc = g_malloc0(sizeof(*wc));
+		rpc_sub_trie_walk(context->rcx_sub_trie,
+		    path + strlen(RPC_PATH_PATTERN_PREFIX), true, &list,
+		    &wc->rsw_prefix);
+		wc->rsw_interface = g_strdup(interface);
+		wc->rsw_name = g_strdup(name);
+		wc->rsw_conn = conn;
+		g_ptr_array_add(list, wc);
+		g_rw_lock_writer_unlock(&context->rcx_rwlock);
+		return;
+	}
 
-	return (call->rc_conn->rco_fn_cbs.rcf_fn_yield(cookie, fragment));
+	key = rpc_context_index_key(path, interface, name);
+	conns = g_hash_table_lookup(context->rcx_sub_index, key);
+	if (conns == NULL) {
+		conns = g_hash_table_new(NULL, NULL);
+		g_hash_table_insert(context->rcx_sub_index, key, conns);
+	} else
+		g_free(key);
+
+	g_hash_table_add(conns, conn);
+	g_rw_lock_writer_unlock(&context->rcx_rwlock);
 }
 
-int
-rpc_function_yield_impl(void *cookie, rpc_object_t fragment)
+void
+rpc_context_index_remove(rpc_context_t context, rpc_connection_t conn,
+    const char *path, const char *interface, const char *name)
 {
-	struct rpc_call *call = cookie;
-	struct rpc_context *context = call->rc_context;
+	struct rpc_sub_wildcard *wc;
+	struct rpc_sub_trie *trie;
+	GPtrArray *list;
+	GHashTable *conns;
+	char *prefix;
+	char *key;
+	guint i;
+
+	rpc_rw_lock_writer_lock(&context->rcx_rwlock, RPC_LOCK_CONTEXT);
+	if (rpc_path_is_pattern(path)) {
+		trie = rpc_sub_trie_walk(context->rcx_sub_trie,
+		    path + strlen(RPC_PATH_PATTERN_PREFIX), false, &list,
+		    &prefix);
+		for (i = 0; trie != NULL && i < list->len; i++) {
+			wc = g_ptr_array_index(list, i);
+			if (wc->rsw_conn == conn &&
+			    g_strcmp0(wc->rsw_prefix, prefix) == 0 &&
+			    g_strcmp0(wc->rsw_interface, interface) == 0 &&
+			    g_strcmp0(wc->rsw_name, name) == 0) {
+				g_ptr_array_remove_index_fast(list, i);
+				rpc_sub_trie_prune(trie);
+				break;
+			}
+		}
 
-	g_mutex_lock(&call->rc_mtx);
+		if (trie != NULL)
+			g_free(prefix);
 
-	while (call->rc_producer_seqno == call->rc_consumer_seqno &&
-	    !call->rc_aborted) {
-		g_mutex_unlock(&call->rc_mtx);
-		notify_wait(&call->rc_notify);
-		g_mutex_lock(&call->rc_mtx);
+		g_rw_lock_writer_unlock(&context->rcx_rwlock);
+		return;
 	}
 
-	if (call->rc_aborted) {
-		if (!call->rc_ended) {
-			rpc_function_error(call, ECONNRESET, "Call aborted");
-			call->rc_ended = true;
-		}
+	key = rpc_context_index_key(path, interface, name);
+	conns = g_hash_table_lookup(context->rcx_sub_index, key);
+	if (conns != NULL) {
+		g_hash_table_remove(conns, conn);
+		if (g_hash_table_size(conns) == 0)
+			g_hash_table_remove(context->rcx_sub_index, key);
+	}
 
-		g_mutex_unlock(&call->rc_mtx);
-		rpc_release(fragment);
-		return (-1);
+	g_free(key);
+	g_rw_lock_writer_unlock(&context->rcx_rwlock);
+}
+
+void
+rpc_context_index_remove_connection_locked(rpc_context_t context,
+    rpc_connection_t conn)
+{
+	GHashTableIter iter;
+	GHashTable *conns;
+
+	g_hash_table_iter_init(&iter, context->rcx_sub_index);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&conns)) {
+		g_hash_table_remove(conns, conn);
+		if (g_hash_table_size(conns) == 0)
+			g_hash_table_iter_remove(&iter);
 	}
 
-	if (context->rcx_pre_call_hook != NULL) {
+	rpc_sub_trie_remove_conn(context->rcx_sub_trie, conn);
+}
+
+static void
+emit_collect_targets(rpc_context_t context, rpc_object_t event,
+    GHashTable *targets)
+{
+	GHashTableIter iter;
+	GHashTable *conns;
+	rpc_connection_t conn;
+	const char *path;
+	const char *interface;
+	const char *name;
+	char *copy;
+	char *key;
+
+	path = rpc_dictionary_get_string(event, "path");
+	interface = rpc_dictionary_get_string(event, "interface");
+	name = rpc_dictionary_get_string(event, "name");
 
+	key = rpc_context_index_key(path, interface, name);
+	conns = g_hash_table_lookup(context->rcx_sub_index, key);
+	g_free(key);
+
+	if (conns != NULL) {
+		g_hash_table_iter_init(&iter, conns);
+		while (g_hash_table_iter_next(&iter, (gpointer *)&conn, NULL))
+			g_hash_table_add(targets, conn);
 	}
-	rpc_connection_send_fragment(call->rc_conn, call->rc_id,
-	    call->rc_producer_seqno, fragment);
 
-	call->rc_producer_seqno++;
-	call->rc_streaming = true;
-	g_mutex_unlock(&call->rc_mtx);
-	return (0);
+	if (path == NULL || rpc_sub_trie_is_empty(context->rcx_sub_trie))
+		return;
+
+	/* Cost: one trie level per path component, not one per wildcard */
+	copy = g_strdup(path);
+	rpc_sub_trie_match(context->rcx_sub_trie, copy, interface, name,
+	    targets);
+	g_free(copy);
 }
 
-int
-rpc_function_retain(void *cookie)
+static gpointer
+emit_events(gpointer data)
 {
-	struct rpc_call *call = cookie;
+	struct emit_item *item;
+	struct rpc_emit_entry *entry;
+	GAsyncQueue *q = data;
+	rpc_connection_t conn;
+	rpc_context_t context;
+	GHashTableIter iter;
+	GHashTable *targets;
+	GPtrArray *conns;
+	guint i;
+	rpc_object_t event;
+	gint64 deadline;
+	gint64 now;
+	gsize max_count;
+	bool stop = false;
+
+	while (!stop) {
+		item = g_async_queue_pop(q);
+		if (item->context == NULL)
+			break;
+		context = item->context;
+		max_count = context->rcx_burst_max_count;
+		event = emit_item_to_event(item);
+		emit_item_free(item);
+
+		if (max_count >= 2) {
+			/*
+			 * Gather whatever else arrives within the latency
+			 * window and send it to every watcher as one burst.
+			 */
+			event = rpc_array_create_ex(&event, 1, true);
+			deadline = g_get_monotonic_time() +
+			    (gint64)context->rcx_burst_latency * 1000;
+
+			while (rpc_array_get_count(event) < max_count) {
+				now = g_get_monotonic_time();
+				if (now >= deadline)
+					break;
+
+				item = g_async_queue_timeout_pop(q,
+				    (guint64)(deadline - now));
+				if (item == NULL)
+					break;
+
+				if (item->context == NULL) {
+					stop = true;
+					break;
+				}
+
+				rpc_array_append_stolen_value(event,
+				    emit_item_to_event(item));
+				emit_item_free(item);
+			}
+		}
 
-	return (rpc_connection_call_retain(call));
+		/*
+		 * Only queue the event here. Emitter shards do the sending,
+		 * so a slow watcher doesn't hold up the others. The index
+		 * narrows the targets down to actual subscribers, and all
+		 * of them share the one serialized frame. Queueing may block
+		 * on a full watcher, so it's done without the context lock.
+		 */
+		rpc_rw_lock_reader_lock(&context->rcx_rwlock, RPC_LOCK_CONTEXT);
+		rpc_session_offer_locked(context, NULL, event);
+		targets = g_hash_table_new(NULL, NULL);
+		if (rpc_get_type(event) == RPC_TYPE_ARRAY) {
+			rpc_array_apply(event, ^(size_t idx __unused,
+			    rpc_object_t value) {
+				emit_collect_targets(context, value, targets);
+				return ((bool)true);
+			});
+		} else
+			emit_collect_targets(context, event, targets);
+
+		if (g_hash_table_size(targets) == 0) {
+			g_rw_lock_reader_unlock(&context->rcx_rwlock);
+			g_hash_table_destroy(targets);
+			rpc_release(event);
+			continue;
+		}
+
+		entry = emit_entry_new(context, event);
+		conns = g_ptr_array_new_with_free_func(
+		    (GDestroyNotify)rpc_connection_release);
+		g_hash_table_iter_init(&iter, targets);
+		while (g_hash_table_iter_next(&iter, (gpointer)&conn, NULL)) {
+			rpc_connection_retain(conn);
+			g_ptr_array_add(conns, conn);
+		}
+
+		g_rw_lock_reader_unlock(&context->rcx_rwlock);
+		g_hash_table_destroy(targets);
+
+		for (i = 0; i < conns->len; i++)
+			emit_enqueue(context, g_ptr_array_index(conns, i),
+			    entry);
+
+		g_ptr_array_free(conns, true);
+		rpc_emit_entry_release(entry);
+	}
+	return (NULL);
 }
 
-int
-rpc_function_release(void *cookie)
+void
+rpc_context_emit_event(rpc_context_t context, const char *path,
+    const char *interface, const char *name, rpc_object_t args)
+{
+	struct emit_item *item = g_malloc(sizeof (*item));
+
+	item->context = context;
+	item->path = g_strdup(path);
+	item->interface = g_strdup(interface);
+	item->name = g_strdup(name);
+	item->args = args;
+
+	g_async_queue_push(context->rcx_emit_queue, item);
+}
+
+inline void *
+rpc_function_get_arg(void *cookie)
 {
 	struct rpc_call *call = cookie;
 
-	return (rpc_connection_call_release(call));
+	return (call->rc_m_arg);
 }
 
-void
-rpc_function_end(void *cookie)
+inline rpc_connection_t
+rpc_function_get_connection(void *cookie)
 {
 	struct rpc_call *call = cookie;
 
-	call->rc_conn->rco_fn_cbs.rcf_fn_end(cookie);
+	return (rpc_connection_is_open(call->rc_conn) ? call->rc_conn : NULL);
 }
 
-void
-rpc_function_end_impl(void *cookie)
+inline rpc_context_t
+rpc_function_get_context(void *cookie)
 {
 	struct rpc_call *call = cookie;
 
-	g_mutex_lock(&call->rc_mtx);
+	return (call->rc_context);
+}
 
-	while (call->rc_producer_seqno == call->rc_consumer_seqno &&
-	    !call->rc_aborted) {
-		g_mutex_unlock(&call->rc_mtx);
-		notify_wait(&call->rc_notify);
-		g_mutex_lock(&call->rc_mtx);
-	}
+const char *
+rpc_function_get_trace_context(void *cookie)
+{
+	struct rpc_call *call = cookie;
 
-	if (call->rc_aborted) {
-		if (!call->rc_ended && !call->rc_responded) {
-			rpc_function_error(call, ECONNRESET,
-			    "Call aborted");
-			call->rc_ended = true;
-		}
-		g_mutex_unlock(&call->rc_mtx);
-		rpc_connection_close_inbound_call(call);
+	if (!call->rc_trace.rtc_valid)
+		return (NULL);
 
-		return;
+	if (call->rc_traceparent == NULL) {
+		call->rc_traceparent = g_malloc(RPC_TRACEPARENT_SIZE);
+		rpc_trace_ctx_format(&call->rc_trace, call->rc_traceparent);
 	}
 
-	if (!call->rc_ended)
-		rpc_connection_send_end(call->rc_conn, call->rc_id,
-		    call->rc_producer_seqno);
-
-	call->rc_producer_seqno++;
-	call->rc_streaming = true;
-	call->rc_ended = true;
-	g_mutex_unlock(&call->rc_mtx);
-	rpc_connection_close_inbound_call(call);
+	return (call->rc_traceparent);
 }
 
-void
-rpc_function_kill(void *cookie)
+inline rpc_instance_t
+rpc_function_get_instance(void *cookie)
 {
 	struct rpc_call *call = cookie;
 
-	call->rc_conn->rco_fn_cbs.rcf_fn_kill(cookie);
+	return (call->rc_instance);
 }
 
-void
-rpc_function_kill_impl(void *cookie)
+int64_t
+rpc_function_get_deadline(void *cookie)
 {
 	struct rpc_call *call = cookie;
 
-	g_mutex_lock(&call->rc_mtx);
-	call->rc_aborted = true;
-	notify_signal(&call->rc_notify);
-	g_mutex_unlock(&call->rc_mtx);
+	return (call->rc_deadline);
 }
 
-bool
-rpc_function_should_abort(void *cookie)
+const char *
+rpc_function_get_name(void *cookie)
 {
 	struct rpc_call *call = cookie;
 
-	return (call->rc_conn->rco_fn_cbs.rcf_should_abort(cookie));
+	return (call->rc_method_name);
 }
 
-bool rpc_function_should_abort_impl(void *cookie)
+const char *
+rpc_function_get_path(void *cookie)
 {
 	struct rpc_call *call = cookie;
 
-	return (call->rc_aborted);
+	return (call->rc_path);
 }
 
-void rpc_function_set_async_abort_handler(void *cookie,
-    rpc_abort_handler_t handler)
+const char *
+rpc_function_get_interface(void *cookie)
 {
 	struct rpc_call *call = cookie;
 
-	call->rc_conn->rco_fn_cbs.rcf_set_async_abort_handler(cookie, handler);
+	return (call->rc_interface);
 }
 
-void rpc_function_set_async_abort_handler_impl(void *cookie,
-    rpc_abort_handler_t handler)
+void
+rpc_function_respond(void *cookie, rpc_object_t object)
 {
 	struct rpc_call *call = cookie;
 
-	if (call->rc_abort_handler != NULL)
-		Block_release(call->rc_abort_handler);
-
-	call->rc_abort_handler = Block_copy(handler);
+	call->rc_conn->rco_fn_cbs.rcf_fn_respond(cookie, object);
 }
 
-rpc_instance_t
-rpc_instance_new(void *arg, const char *fmt, ...)
+void
+rpc_function_respond_impl(void *cookie, rpc_object_t object)
 {
-	va_list ap;
-	rpc_instance_t result;
-	char *path;
-
-	va_start(ap, fmt);
-	path = g_strdup_vprintf(fmt, ap);
-	va_end(ap);
-
-	if (!rpc_context_path_is_valid(path)) {
-		rpc_set_last_error(EINVAL, "Invalid path", NULL);
-		g_free(path);
-		return (NULL);
-	}
-
-	result = g_malloc0(sizeof(*result));
-	g_mutex_init(&result->ri_mtx);
-	g_cond_init(&result->ri_cv);
-	g_rw_lock_init(&result->ri_rwlock);
-	result->ri_path = path;
-	result->ri_interfaces = g_hash_table_new_full(g_str_hash, g_str_equal,
-	    g_free, (GDestroyNotify)rpc_interface_free);
-	result->ri_arg = arg;
+	struct rpc_call *call = cookie;
+	gint64 start;
 
-	rpc_instance_register_interface(result, RPC_DISCOVERABLE_INTERFACE,
-	    rpc_discoverable_vtable, NULL);
+	g_assert(call->rc_type == RPC_INBOUND_CALL);
+	if (object == NULL)
+		object = rpc_null_create();
 
-	rpc_instance_register_interface(result, RPC_INTROSPECTABLE_INTERFACE,
-	    rpc_introspectable_vtable, NULL);
+	if (rpc_get_type(object) == RPC_TYPE_ERROR)
+		call->rc_failed = true;
 
-	rpc_instance_register_interface(result, RPC_DEFAULT_INTERFACE,
-	    NULL, NULL);
+	if (call->rc_cache_gen != 0 && !call->rc_responded)
+		rpc_result_cache_store(call->rc_context, call, object);
 
-	rpc_instance_register_interface(result, RPC_OBSERVABLE_INTERFACE,
-	    rpc_observable_vtable, NULL);
+	if (call->rc_batch != NULL)
+		rpc_call_batch_set_result(call, object);
+	else if (!call->rc_responded) {
+		start = rpc_function_send_begin(call);
+		rpc_connection_send_response(call->rc_conn,
+		    call->rc_id, object);
+		rpc_function_send_end(call, start);
+	} else
+		rpc_release(object);
 
-	return (result);
+	rpc_connection_close_inbound_call(call);
 }
 
 void
-rpc_instance_set_description(rpc_instance_t instance, const char *fmt, ...)
+rpc_function_error(void *cookie, int code, const char *message, ...)
 {
+	struct rpc_call *call = cookie;
 	va_list ap;
-	char *description;
 
-	va_start(ap, fmt);
-	description = g_strdup_vprintf(fmt, ap);
+	va_start(ap, message);
+	call->rc_conn->rco_fn_cbs.rcf_fn_error(cookie, code, message, ap);
 	va_end(ap);
-
-	instance->ri_descr = description;
 }
 
-void *
-rpc_instance_get_arg(rpc_instance_t instance)
+void
+rpc_function_error_impl(void *cookie, int code, const char *message, va_list ap)
 {
+	struct rpc_call *call = cookie;
+	rpc_object_t err;
+	char *msg = NULL;
 
-	g_assert_nonnull(instance);
+	/* Plain messages skip formatting and may hit a shared error */
+	if (strchr(message, '%') != NULL)
+		g_vasprintf(&msg, message, ap);
 
-	return (instance->ri_arg);
+	err = rpc_error_create_shared(code, msg != NULL ? msg : message,
+	    NULL);
+	if (call->rc_batch != NULL)
+		rpc_call_batch_set_result(call, err);
+	else
+		rpc_connection_send_errx(call->rc_conn, call->rc_id, err);
+
+	call->rc_failed = true;
+	call->rc_responded = true;
+	g_free(msg);
 }
 
-const char *
-rpc_instance_get_path(rpc_instance_t instance)
+void
+rpc_function_error_ex(void *cookie, rpc_object_t exception)
 {
+	struct rpc_call *call = cookie;
 
-	g_assert_nonnull(instance);
-
-	return (instance->ri_path);
+	call->rc_conn->rco_fn_cbs.rcf_fn_error_ex(cookie, exception);
 }
 
 void
-rpc_instance_free(rpc_instance_t instance)
+rpc_function_error_ex_impl(void *cookie, rpc_object_t exception)
 {
-	struct tp_item *item;
+	struct rpc_call *call = cookie;
 
-	g_assert_nonnull(instance);
-	item = g_malloc(sizeof(*item));
+	if (call->rc_batch != NULL)
+		rpc_call_batch_set_result(call, exception);
+	else
+		rpc_connection_send_errx(call->rc_conn, call->rc_id, exception);
 
-	g_mutex_lock(&instance->ri_mtx);
-	item->type = TYPE_INSTANCE;
-	item->data = instance;
-	instance->ri_destroyed = true;
+	call->rc_failed = true;
+	call->rc_responded = true;
+}
 
-	/* wait on any outstanding calls to complete in another thread. */
-	g_thread_pool_push(instance->ri_context->rcx_threadpool, item, NULL);
-	g_mutex_unlock(&instance->ri_mtx);
+int
+rpc_function_start_stream(void *cookie)
+{
+	struct rpc_call *call = cookie;
 
+	return (call->rc_conn->rco_fn_cbs.rcf_fn_start_stream(cookie));
 }
 
-struct rpc_if_member *
-rpc_instance_find_member(rpc_instance_t instance, const char *interface,
-    const char *name)
+int
+rpc_function_start_stream_impl(void *cookie)
 {
-	struct rpc_interface_priv *iface;
-	struct rpc_if_member *result;
+	struct rpc_call *call = cookie;
+	struct rpc_context *context = call->rc_context;
+	void *block = NULL;
 
-	if (name == NULL)
+	if (call->rc_batch != NULL) {
+		rpc_function_error(call, ENOTSUP,
+		    "Streaming is not supported in call batches");
+		return (-1);
+	}
+
+	g_mutex_lock(&call->rc_mtx);
+
+	while (call->rc_producer_seqno == call->rc_consumer_seqno &&
+	       !call->rc_aborted) {
+		if (block == NULL)
+			block = rpc_workq_block_begin();
+
+		notify_wait(&call->rc_notify, &call->rc_mtx);
+	}
+
+	rpc_workq_block_end(block);
+
+	if (call->rc_aborted) {
+		if (!call->rc_ended) {
+			rpc_function_error(call, ECONNRESET, "Call aborted");
+			call->rc_ended = true;
+		}
+
+		g_mutex_unlock(&call->rc_mtx);
+		return (-1);
+	}
+
+	if (context->rcx_pre_call_hook != NULL) {
+
+	}
+	rpc_connection_send_start_stream(call->rc_conn, call->rc_id,
+	    call->rc_producer_seqno);
+
+	call->rc_producer_seqno++;
+	call->rc_streaming = true;
+	g_mutex_unlock(&call->rc_mtx);
+	return (0);
+}
+
+int
+rpc_function_yield(void *cookie, rpc_object_t fragment)
+{
+	struct rpc_call *call = cookie;
+
+	return (call->rc_conn->rco_fn_cbs.rcf_fn_yield(cookie, fragment));
+}
+
+int
+rpc_function_yield_impl(void *cookie, rpc_object_t fragment)
+{
+	struct rpc_call *call = cookie;
+	struct rpc_context *context = call->rc_context;
+	size_t max_items;
+	bool batching;
+	bool flush = false;
+	gint64 start;
+	gint64 now;
+	void *block = NULL;
+
+	g_mutex_lock(&call->rc_mtx);
+
+	/*
+	 * Block only once the consumer's credits run out: either the
+	 * fragment count or, if it granted any, the byte budget. A single
+	 * fragment may overdraw the byte budget, so a fragment bigger
+	 * than the whole window cannot stall the stream.
+	 */
+	while (!rpc_call_has_credits(call) && !call->rc_aborted) {
+		if (atomic_load(&call->rc_starved_since) == 0) {
+			atomic_store(&call->rc_starved_since,
+			    g_get_monotonic_time());
+		}
+
+		rpc_function_flush_locked(call);
+		if (block == NULL)
+			block = rpc_workq_block_begin();
+
+		notify_wait(&call->rc_notify, &call->rc_mtx);
+	}
+
+	rpc_workq_block_end(block);
+
+	if (call->rc_aborted) {
+		if (!call->rc_ended) {
+			rpc_function_error(call, ECONNRESET, "Call aborted");
+			call->rc_ended = true;
+		}
+
+		/* Drop whatever is still waiting to go out, ours or batched */
+		rpc_release(call->rc_frag_batch);
+		call->rc_frag_batch = NULL;
+		rpc_connection_purge_call(call->rc_conn, call->rc_id);
+		g_mutex_unlock(&call->rc_mtx);
+		rpc_release(fragment);
+		rpc_set_last_error(ECONNRESET, "Call aborted", NULL);
+		return (-1);
+	}
+
+	if (context->rcx_pre_call_hook != NULL) {
+
+	}
+
+	batching = call->rc_frag_batch_ok &&
+	    (call->rc_frag_batch_max_items > 1 ||
+	    call->rc_frag_batch_max_bytes > 0);
+#if defined(__linux__)
+	/* Ring notices are small enough already */
+	if (call->rc_stream_ring != NULL)
+		batching = false;
+#endif
+
+	if (!batching) {
+		start = rpc_function_send_begin(call);
+		call->rc_credit_bytes -= (int64_t)rpc_function_send_fragment(
+		    call, fragment);
+		rpc_function_send_end(call, start);
+	} else {
+		now = g_get_monotonic_time();
+		if (call->rc_frag_batch == NULL) {
+			call->rc_frag_batch = rpc_array_create();
+			call->rc_frag_batch_seqno = call->rc_producer_seqno;
+			call->rc_frag_batch_time = now;
+		}
+
+		if (call->rc_frag_batch_max_bytes > 0)
+			call->rc_frag_batch_bytes += rpc_msgpack_size(fragment);
+
+		rpc_array_append_stolen_value(call->rc_frag_batch, fragment);
+		max_items = call->rc_frag_batch_max_items > 1 ?
+		    MIN(call->rc_frag_batch_max_items, RPC_FRAGMENT_BATCH_MAX) :
+		    RPC_FRAGMENT_BATCH_MAX;
+
+		if (rpc_array_get_count(call->rc_frag_batch) >= max_items ||
+		    (call->rc_frag_batch_max_bytes > 0 &&
+		    call->rc_frag_batch_bytes >=
+		    call->rc_frag_batch_max_bytes) ||
+		    now - call->rc_frag_batch_time >=
+		    RPC_FRAGMENT_BATCH_LATENCY * 1000)
+			flush = true;
+	}
+
+	call->rc_producer_seqno++;
+	call->rc_streaming = true;
+
+	/* Don't sit on items the consumer has already paid for */
+	if (flush || call->rc_producer_seqno == call->rc_consumer_seqno)
+		rpc_function_flush_locked(call);
+
+	g_mutex_unlock(&call->rc_mtx);
+	return (0);
+}
+
+rpc_object_t
+rpc_function_next_input(void *cookie)
+{
+	struct rpc_call *call = cookie;
+	rpc_object_t result;
+	int64_t increment;
+	void *block = NULL;
+
+	g_mutex_lock(&call->rc_mtx);
+	while (call->rc_input && g_queue_is_empty(&call->rc_input_queue) &&
+	    !call->rc_input_ended && !call->rc_aborted) {
+		if (block == NULL)
+			block = rpc_workq_block_begin();
+
+		notify_wait(&call->rc_notify, &call->rc_mtx);
+	}
+
+	rpc_workq_block_end(block);
+
+	if (call->rc_aborted) {
+		g_mutex_unlock(&call->rc_mtx);
+		rpc_set_last_error(ECONNRESET, "Call aborted", NULL);
+		return (NULL);
+	}
+
+	result = g_queue_pop_head(&call->rc_input_queue);
+	if (result == NULL) {
+		g_mutex_unlock(&call->rc_mtx);
 		return (NULL);
+	}
+
+	/* Hand credits back once half of the window has been consumed */
+	call->rc_input_seqno++;
+	increment = call->rc_input_seqno + RPC_INPUT_WINDOW -
+	    call->rc_input_credit;
+	if (!call->rc_input_ended && increment >= RPC_INPUT_WINDOW / 2) {
+		call->rc_input_credit += increment;
+		rpc_connection_send_input_credit(call->rc_conn, call->rc_id,
+		    increment);
+	}
+
+	g_mutex_unlock(&call->rc_mtx);
+	return (result);
+}
+
+int
+rpc_function_yield_try(void *cookie, rpc_object_t fragment)
+{
+	struct rpc_call *call = cookie;
+
+	g_mutex_lock(&call->rc_mtx);
+	if (!call->rc_aborted && (!rpc_call_has_credits(call) ||
+	    rpc_connection_is_saturated(call->rc_conn))) {
+		/* Don't hold back what's batched while we can't go on */
+		if (!rpc_connection_is_saturated(call->rc_conn))
+			rpc_function_flush_locked(call);
+
+		/*
+		 * Checked again with the flag set: a drain or a credit
+		 * grant that raced with us either sees the flag or left
+		 * the stream writable by now.
+		 */
+		call->rc_want_writable = true;
+		if (!rpc_call_has_credits(call) &&
+		    atomic_load(&call->rc_starved_since) == 0) {
+			atomic_store(&call->rc_starved_since,
+			    g_get_monotonic_time());
+		}
+
+		if (!rpc_call_has_credits(call) ||
+		    rpc_connection_is_saturated(call->rc_conn)) {
+			g_mutex_unlock(&call->rc_mtx);
+			rpc_set_last_error(EAGAIN, "Stream is not writable",
+			    NULL);
+			return (-1);
+		}
+
+		call->rc_want_writable = false;
+	}
+
+	g_mutex_unlock(&call->rc_mtx);
+	return (rpc_function_yield(cookie, fragment));
+}
+
+void
+rpc_function_set_writable_handler(void *cookie,
+    rpc_writable_handler_t handler)
+{
+	struct rpc_call *call = cookie;
+
+	g_mutex_lock(&call->rc_mtx);
+	if (call->rc_writable_handler != NULL)
+		Block_release(call->rc_writable_handler);
+
+	call->rc_writable_handler = handler != NULL ?
+	    Block_copy(handler) : NULL;
+	g_mutex_unlock(&call->rc_mtx);
+}
+
+static void
+rpc_function_flush_locked(struct rpc_call *call)
+{
+	rpc_object_t batch = call->rc_frag_batch;
+	size_t size;
+	gint64 start;
+
+	if (batch == NULL)
+		return;
+
+	call->rc_frag_batch = NULL;
+	call->rc_frag_batch_bytes = 0;
+	start = rpc_function_send_begin(call);
+
+	if (rpc_array_get_count(batch) == 1) {
+		size = rpc_connection_send_fragment(call->rc_conn, call->rc_id,
+		    call->rc_frag_batch_seqno,
+		    rpc_retain(rpc_array_get_value(batch, 0)),
+		    call->rc_byte_credits);
+		rpc_release(batch);
+	} else {
+		size = rpc_connection_send_fragments(call->rc_conn,
+		    call->rc_id, call->rc_frag_batch_seqno, batch,
+		    call->rc_byte_credits);
+	}
+
+	rpc_function_send_end(call, start);
+	call->rc_credit_bytes -= (int64_t)size;
+}
+
+static size_t
+rpc_function_send_fragment(struct rpc_call *call, rpc_object_t fragment)
+{
+
+#if defined(__linux__)
+	if (call->rc_stream_ring != NULL)
+		return (rpc_connection_send_ring_fragment(call->rc_conn,
+		    call->rc_id, call->rc_stream_ring,
+		    call->rc_producer_seqno, fragment,
+		    call->rc_byte_credits));
+#endif
+
+	return (rpc_connection_send_fragment(call->rc_conn, call->rc_id,
+	    call->rc_producer_seqno, fragment, call->rc_byte_credits));
+}
+
+/*
+ * Time spent sending results only matters for spans, so untraced
+ * calls skip the clock reads.
+ */
+static gint64
+rpc_function_send_begin(struct rpc_call *call)
+{
+
+	return (call->rc_trace.rtc_valid ? g_get_monotonic_time() : 0);
+}
+
+static void
+rpc_function_send_end(struct rpc_call *call, gint64 start)
+{
+
+	if (start != 0)
+		call->rc_send_time += g_get_monotonic_time() - start;
+}
+
+void
+rpc_function_set_fragment_batch(void *cookie, size_t max_items,
+    size_t max_bytes)
+{
+	struct rpc_call *call = cookie;
+
+	g_mutex_lock(&call->rc_mtx);
+	rpc_function_flush_locked(call);
+	call->rc_frag_batch_max_items = max_items;
+	call->rc_frag_batch_max_bytes = max_bytes;
+	g_mutex_unlock(&call->rc_mtx);
+}
+
+int
+rpc_function_retain(void *cookie)
+{
+	struct rpc_call *call = cookie;
+
+	return (rpc_connection_call_retain(call));
+}
+
+int
+rpc_function_release(void *cookie)
+{
+	struct rpc_call *call = cookie;
+
+	return (rpc_connection_call_release(call));
+}
+
+int
+rpc_function_yield_query(void *cookie, rpc_object_t object,
+    rpc_object_t request)
+{
+	struct rpc_call *call = cookie;
+	rpc_query_iter_t iter;
+	rpc_object_t chunk;
+	bool more;
+	int ret = 0;
+
+	iter = rpc_query_request_run(object, request);
+	if (iter == NULL)
+		return (-1);
+
+	if (!call->rc_streaming && rpc_function_start_stream(cookie) != 0) {
+		rpc_query_iter_free(iter);
+		return (-1);
+	}
+
+	do {
+		more = rpc_query_next(iter, &chunk);
+		if (chunk == NULL)
+			break;
+
+		if (rpc_function_yield(cookie, chunk) != 0) {
+			ret = -1;
+			break;
+		}
+	} while (more);
+
+	rpc_query_iter_free(iter);
+	return (ret);
+}
+
+void
+rpc_function_end(void *cookie)
+{
+	struct rpc_call *call = cookie;
+
+	call->rc_conn->rco_fn_cbs.rcf_fn_end(cookie);
+}
+
+void
+rpc_function_end_impl(void *cookie)
+{
+	struct rpc_call *call = cookie;
+	void *block = NULL;
+
+	g_mutex_lock(&call->rc_mtx);
+	if (!call->rc_aborted)
+		rpc_function_flush_locked(call);
+
+	while (call->rc_producer_seqno == call->rc_consumer_seqno &&
+	    !call->rc_aborted) {
+		if (block == NULL)
+			block = rpc_workq_block_begin();
+
+		notify_wait(&call->rc_notify, &call->rc_mtx);
+	}
+
+	rpc_workq_block_end(block);
+
+	if (call->rc_aborted) {
+		if (!call->rc_ended && !call->rc_responded) {
+			rpc_function_error(call, ECONNRESET,
+			    "Call aborted");
+			call->rc_ended = true;
+		}
+		g_mutex_unlock(&call->rc_mtx);
+		rpc_connection_close_inbound_call(call);
+
+		return;
+	}
+
+	if (!call->rc_ended)
+		rpc_connection_send_end(call->rc_conn, call->rc_id,
+		    call->rc_producer_seqno);
+
+	call->rc_producer_seqno++;
+	call->rc_streaming = true;
+	call->rc_ended = true;
+	g_mutex_unlock(&call->rc_mtx);
+	rpc_connection_close_inbound_call(call);
+}
+
+void
+rpc_function_kill(void *cookie)
+{
+	struct rpc_call *call = cookie;
+
+	call->rc_conn->rco_fn_cbs.rcf_fn_kill(cookie);
+}
+
+void
+rpc_function_kill_impl(void *cookie)
+{
+	struct rpc_call *call = cookie;
+
+	g_mutex_lock(&call->rc_mtx);
+	call->rc_aborted = true;
+	notify_signal(&call->rc_notify);
+	g_mutex_unlock(&call->rc_mtx);
+}
+
+bool
+rpc_function_should_abort(void *cookie)
+{
+	struct rpc_call *call = cookie;
+
+	return (call->rc_conn->rco_fn_cbs.rcf_should_abort(cookie));
+}
+
+bool rpc_function_should_abort_impl(void *cookie)
+{
+	struct rpc_call *call = cookie;
+
+	return (call->rc_aborted);
+}
+
+void rpc_function_set_async_abort_handler(void *cookie,
+    rpc_abort_handler_t handler)
+{
+	struct rpc_call *call = cookie;
+
+	call->rc_conn->rco_fn_cbs.rcf_set_async_abort_handler(cookie, handler);
+}
+
+void rpc_function_set_async_abort_handler_impl(void *cookie,
+    rpc_abort_handler_t handler)
+{
+	struct rpc_call *call = cookie;
+
+	if (call->rc_abort_handler != NULL)
+		Block_release(call->rc_abort_handler);
+
+	call->rc_abort_handler = Block_copy(handler);
+}
+
+rpc_instance_t
+rpc_instance_new(void *arg, const char *fmt, ...)
+{
+	va_list ap;
+	rpc_instance_t result;
+	char *path;
+
+	va_start(ap, fmt);
+	path = g_strdup_vprintf(fmt, ap);
+	va_end(ap);
+
+	if (!rpc_context_path_is_valid(path)) {
+		rpc_set_last_error(EINVAL, "Invalid path", NULL);
+		g_free(path);
+		return (NULL);
+	}
+
+	result = g_malloc0(sizeof(*result));
+	g_mutex_init(&result->ri_mtx);
+	g_cond_init(&result->ri_cv);
+	g_rw_lock_init(&result->ri_rwlock);
+	result->ri_path = path;
+	result->ri_interfaces = g_hash_table_new_full(g_str_hash, g_str_equal,
+	    g_free, (GDestroyNotify)rpc_interface_free);
+	result->ri_interfaces_rcu = rpc_snapshot_new();
+	result->ri_notify = g_hash_table_new_full(g_str_hash, g_str_equal,
+	    g_free, (GDestroyNotify)rpc_property_notify_free);
+	result->ri_prop_cache = g_hash_table_new_full(g_str_hash, g_str_equal,
+	    g_free, (GDestroyNotify)rpc_property_cached_free);
+	result->ri_prop_sent = g_hash_table_new_full(g_str_hash, g_str_equal,
+	    g_free, (GDestroyNotify)rpc_release_impl);
+	g_mutex_init(&result->ri_delta_mtx);
+	result->ri_arg = arg;
+
+	rpc_instance_register_interface(result, RPC_DISCOVERABLE_INTERFACE,
+	    rpc_discoverable_vtable, NULL);
+
+	rpc_instance_register_interface(result, RPC_INTROSPECTABLE_INTERFACE,
+	    rpc_introspectable_vtable, NULL);
+
+	/* Discovery shouldn't wait behind bulk calls */
+	rpc_instance_set_interface_priority(result, RPC_DISCOVERABLE_INTERFACE,
+	    RPC_PRIORITY_HIGH);
+	rpc_instance_set_interface_priority(result,
+	    RPC_INTROSPECTABLE_INTERFACE, RPC_PRIORITY_HIGH);
+
+	rpc_instance_register_interface(result, RPC_DEFAULT_INTERFACE,
+	    NULL, NULL);
+
+	rpc_instance_register_interface(result, RPC_OBSERVABLE_INTERFACE,
+	    rpc_observable_vtable, NULL);
+
+	return (result);
+}
+
+void
+rpc_instance_set_description(rpc_instance_t instance, const char *fmt, ...)
+{
+	va_list ap;
+	char *description;
+
+	va_start(ap, fmt);
+	description = g_strdup_vprintf(fmt, ap);
+	va_end(ap);
+
+	instance->ri_descr = description;
+}
+
+void *
+rpc_instance_get_arg(rpc_instance_t instance)
+{
+
+	g_assert_nonnull(instance);
+
+	return (instance->ri_arg);
+}
+
+const char *
+rpc_instance_get_path(rpc_instance_t instance)
+{
+
+	g_assert_nonnull(instance);
+
+	return (instance->ri_path);
+}
+
+void
+rpc_instance_free(rpc_instance_t instance)
+{
+	struct tp_item *item;
+
+	g_assert_nonnull(instance);
+	item = g_malloc(sizeof(*item));
+
+	g_mutex_lock(&instance->ri_mtx);
+	item->type = TYPE_INSTANCE;
+	item->data = instance;
+	instance->ri_destroyed = true;
+
+	/* wait on any outstanding calls to complete in another thread. */
+	g_thread_pool_push(instance->ri_context->rcx_threadpool, item, NULL);
+	g_mutex_unlock(&instance->ri_mtx);
+
+}
+
+struct rpc_if_member *
+rpc_instance_find_member(rpc_instance_t instance, const char *interface,
+    const char *name)
+{
+	struct rpc_interface_priv *iface;
+	struct rpc_if_member *result;
+	int idx;
+
+	if (name == NULL)
+		return (NULL);
+
+	if (interface == NULL)
+		interface = RPC_DEFAULT_INTERFACE;
+
+	idx = rpc_rcu_read_lock();
+	iface = g_hash_table_lookup(
+	    rpc_rcu_dereference(instance->ri_interfaces_rcu), interface);
+
+	if (iface == NULL) {
+		rpc_rcu_read_unlock(idx);
+		debugf("member %s not found on %s\n", name,
+		    interface);
+		return (NULL);
+	}
+
+	result = g_hash_table_lookup(
+	    rpc_rcu_dereference(iface->rip_members_rcu), name);
+	rpc_rcu_read_unlock(idx);
+
+	return (result);
+}
+
+static rpc_call_priority_t
+rpc_instance_get_interface_priority(rpc_instance_t instance,
+    const char *interface)
+{
+	struct rpc_interface_priv *iface;
+	rpc_call_priority_t result = RPC_PRIORITY_DEFAULT;
+	int idx;
+
+	if (interface == NULL)
+		interface = RPC_DEFAULT_INTERFACE;
+
+	idx = rpc_rcu_read_lock();
+	iface = g_hash_table_lookup(
+	    rpc_rcu_dereference(instance->ri_interfaces_rcu), interface);
+	if (iface != NULL)
+		result = iface->rip_priority;
+	rpc_rcu_read_unlock(idx);
+
+	return (result);
+}
+
+int
+rpc_instance_set_interface_priority(rpc_instance_t instance,
+    const char *interface, rpc_call_priority_t priority)
+{
+	struct rpc_interface_priv *iface;
+
+	g_rw_lock_writer_lock(&instance->ri_rwlock);
+	iface = g_hash_table_lookup(instance->ri_interfaces, interface);
+	if (iface == NULL) {
+		g_rw_lock_writer_unlock(&instance->ri_rwlock);
+		rpc_set_last_error(ENOENT, "Interface not found", NULL);
+		return (-1);
+	}
+
+	iface->rip_priority = priority;
+	g_rw_lock_writer_unlock(&instance->ri_rwlock);
+	return (0);
+}
+
+int
+rpc_instance_set_method_cache(rpc_instance_t instance, const char *interface,
+    const char *name, unsigned int ttl_ms)
+{
+	struct rpc_if_member *member;
+
+	member = rpc_instance_find_member(instance, interface, name);
+	if (member == NULL || member->rim_type != RPC_MEMBER_METHOD) {
+		rpc_set_last_error(ENOENT, "Method not found", NULL);
+		return (-1);
+	}
+
+	member->rim_method.rm_cache_ttl = ttl_ms;
+	rpc_instance_invalidate_cache(instance);
+	return (0);
+}
+
+int
+rpc_instance_set_property_coalesce(rpc_instance_t instance,
+    const char *interface, const char *name, unsigned int interval_ms)
+{
+	struct rpc_if_member *member;
+
+	member = rpc_instance_find_member(instance, interface, name);
+	if (member == NULL || member->rim_type != RPC_MEMBER_PROPERTY) {
+		rpc_set_last_error(ENOENT, "Property not found", NULL);
+		return (-1);
+	}
+
+	member->rim_property.rp_coalesce = interval_ms;
+	return (0);
+}
+
+int
+rpc_instance_set_property_cache(rpc_instance_t instance,
+    const char *interface, const char *name, unsigned int ttl_ms)
+{
+	struct rpc_if_member *member;
+
+	member = rpc_instance_find_member(instance, interface, name);
+	if (member == NULL || member->rim_type != RPC_MEMBER_PROPERTY) {
+		rpc_set_last_error(ENOENT, "Property not found", NULL);
+		return (-1);
+	}
+
+	member->rim_property.rp_cache_ttl = ttl_ms;
+	rpc_property_cache_update(instance, interface, name, 0, NULL);
+	return (0);
+}
+
+int
+rpc_instance_set_property_delta(rpc_instance_t instance,
+    const char *interface, const char *name, bool enable)
+{
+	struct rpc_if_member *member;
+	char *key;
+
+	member = rpc_instance_find_member(instance, interface, name);
+	if (member == NULL || member->rim_type != RPC_MEMBER_PROPERTY) {
+		rpc_set_last_error(ENOENT, "Property not found", NULL);
+		return (-1);
+	}
+
+	key = g_strdup_printf("%s.%s", interface, name);
+	g_mutex_lock(&instance->ri_delta_mtx);
+	member->rim_property.rp_delta = enable;
+	g_hash_table_remove(instance->ri_prop_sent, key);
+	g_mutex_unlock(&instance->ri_delta_mtx);
+	g_free(key);
+	return (0);
+}
+
+void
+rpc_instance_invalidate_cache(rpc_instance_t instance)
+{
+
+	if (instance->ri_context == NULL)
+		return;
+
+	rpc_result_cache_invalidate(instance->ri_context, instance->ri_path,
+	    false);
+}
+
+bool
+rpc_instance_has_interface(rpc_instance_t instance, const char *interface)
+{
+	bool result;
+	int idx;
+
+	g_assert_nonnull(interface);
+
+	idx = rpc_rcu_read_lock();
+	result = (bool)g_hash_table_contains(
+	    rpc_rcu_dereference(instance->ri_interfaces_rcu), interface);
+	rpc_rcu_read_unlock(idx);
+	return (result);
+}
+
+int
+rpc_instance_register_interface(rpc_instance_t instance,
+    const char *interface, const struct rpc_if_member *vtable, void *arg)
+{
+	struct rpc_interface_priv *priv;
+	const struct rpc_if_member *member;
+
+	g_assert_nonnull(interface);
+
+	if (rpc_instance_has_interface(instance, interface))
+		return (0);
+
+	priv = g_malloc0(sizeof(*priv));
+	g_rw_lock_init(&priv->rip_rwlock);
+	priv->rip_members = g_hash_table_new_full(g_str_hash, g_str_equal,
+	    g_free, (GDestroyNotify)rpc_if_member_free);
+	priv->rip_members_rcu = rpc_snapshot_new();
+	priv->rip_arg = arg;
+	priv->rip_name = g_strdup(interface);
+
+	g_rw_lock_writer_lock(&instance->ri_rwlock);
+	g_hash_table_insert(instance->ri_interfaces, g_strdup(priv->rip_name),
+	    priv);
+	rpc_snapshot_publish(&instance->ri_interfaces_rcu,
+	    instance->ri_interfaces);
+	g_rw_lock_writer_unlock(&instance->ri_rwlock);
+
+	if (vtable != NULL) {
+		for (member = &vtable[0]; member->rim_name != NULL; member++)
+			rpc_instance_register_member(instance, interface, 
+			    member);
+	}
+
+	rpc_instance_emit_event(instance, RPC_INTROSPECTABLE_INTERFACE,
+	    "interface_added", rpc_string_create(interface));
+
+	return (0);
+}
+
+void
+rpc_instance_unregister_interface(rpc_instance_t instance,
+    const char *interface)
+{
+	struct rpc_interface_priv *priv;
+	gpointer key;
+
+	g_rw_lock_writer_lock(&instance->ri_rwlock);
+	if (!g_hash_table_lookup_extended(instance->ri_interfaces, interface,
+	    &key, (gpointer *)&priv)) {
+		g_rw_lock_writer_unlock(&instance->ri_rwlock);
+		return;
+	}
+
+	/* Lookups may still hold the old snapshot until it's replaced */
+	g_hash_table_steal(instance->ri_interfaces, interface);
+	rpc_snapshot_publish(&instance->ri_interfaces_rcu,
+	    instance->ri_interfaces);
+	g_rw_lock_writer_unlock(&instance->ri_rwlock);
+	rpc_rcu_call(key, g_free);
+	rpc_rcu_call(priv, (GDestroyNotify)rpc_interface_free);
+
+	rpc_instance_emit_event(instance, RPC_INTROSPECTABLE_INTERFACE,
+	    "interface_removed", rpc_string_create(interface));
+}
+
+void
+rpc_interface_free(struct rpc_interface_priv *priv)
+{
+
+	g_hash_table_unref(priv->rip_members_rcu);
+	g_hash_table_destroy(priv->rip_members);
+	g_rw_lock_clear(&priv->rip_rwlock);
+	g_free(priv->rip_description);
+	g_free(priv);
+}
+
+void
+rpc_if_member_free(struct rpc_if_member *member)
+{
+
+	if (member->rim_type == RPC_MEMBER_METHOD) {
+		if (member->rim_method.rm_block != NULL)
+			Block_release(member->rim_method.rm_block);
+	}
+
+	if (member->rim_type == RPC_MEMBER_PROPERTY) {
+		if (member->rim_property.rp_getter != NULL)
+			Block_release(member->rim_property.rp_getter);
+
+		if (member->rim_property.rp_setter != NULL)
+			Block_release(member->rim_property.rp_setter);
+	}
+
+	g_free((void *)member->rim_name);
+	g_free(member);
+}
+
+int rpc_instance_register_member(rpc_instance_t instance, const char *interface,
+    const struct rpc_if_member *member)
+{
+	struct rpc_interface_priv *priv;
+	struct rpc_if_member *copy;
+	struct rpc_if_member *old = NULL;
+	gpointer key = NULL;
+
+	if (interface == NULL)
+		interface = RPC_DEFAULT_INTERFACE;
+
+	priv = g_hash_table_lookup(instance->ri_interfaces, interface);
+	if (priv == NULL) {
+		rpc_set_last_error(ENOENT, "Interface not found", NULL);
+		return (-1);
+	}
+
+	copy = g_memdup(member, sizeof(*member));
+	copy->rim_name = g_strdup(member->rim_name);
+
+	if (copy->rim_type == RPC_MEMBER_METHOD) {
+		if (copy->rim_method.rm_block != NULL)
+			copy->rim_method.rm_block = Block_copy(
+			    copy->rim_method.rm_block);
+
+		if (copy->rim_method.rm_arg == NULL)
+			copy->rim_method.rm_arg = priv->rip_arg;
+
+		copy->rim_method.rm_typing = NULL;
+	}
+
+	if (copy->rim_type == RPC_MEMBER_PROPERTY) {
+		if (copy->rim_property.rp_getter != NULL) {
+			copy->rim_property.rp_getter = Block_copy(
+			    copy->rim_property.rp_getter);
+		}
+
+		if (copy->rim_property.rp_setter != NULL) {
+			copy->rim_property.rp_setter = Block_copy(
+			    copy->rim_property.rp_setter);
+		}
+
+		if (copy->rim_property.rp_arg == NULL)
+			copy->rim_property.rp_arg = priv->rip_arg;
+
+		if (copy->rim_property.rp_coalesce == 0)
+			copy->rim_property.rp_coalesce = rpct_property_coalesce(
+			    interface, member->rim_name);
+	}
+
+	g_rw_lock_writer_lock(&priv->rip_rwlock);
+	if (g_hash_table_lookup_extended(priv->rip_members, member->rim_name,
+	    &key, (gpointer *)&old))
+		g_hash_table_steal(priv->rip_members, member->rim_name);
+
+	g_hash_table_insert(priv->rip_members, g_strdup(member->rim_name), copy);
+	rpc_snapshot_publish(&priv->rip_members_rcu, priv->rip_members);
+	g_rw_lock_writer_unlock(&priv->rip_rwlock);
+
+	if (old != NULL) {
+		rpc_rcu_call(key, g_free);
+		rpc_rcu_call(old, (GDestroyNotify)rpc_if_member_free);
+	}
+
+	if (copy->rim_type == RPC_MEMBER_PROPERTY)
+		rpc_property_cache_update(instance, interface, copy->rim_name,
+		    0, NULL);
+
+	if (instance->ri_context != NULL)
+		rpc_result_cache_invalidate(instance->ri_context,
+		    instance->ri_path, false);
+
+	return (0);
+}
+
+int
+rpc_instance_register_block(rpc_instance_t instance, const char *interface,
+    const char *name, void *arg, rpc_function_t func)
+{
+	struct rpc_if_member member;
+
+	member.rim_name = name;
+	member.rim_type = RPC_MEMBER_METHOD;
+	member.rim_method.rm_block = func;
+	member.rim_method.rm_func = NULL;
+	member.rim_method.rm_arg = arg;
+	member.rim_method.rm_flags = 0;
+	member.rim_method.rm_priority = RPC_PRIORITY_DEFAULT;
+	member.rim_method.rm_cache_ttl = 0;
+	member.rim_method.rm_typing = NULL;
+
+	return (rpc_instance_register_member(instance, interface, &member));
+}
+
+int
+rpc_instance_register_func(rpc_instance_t instance, const char *interface,
+    const char *name, void *arg, rpc_function_f func)
+{
+	struct rpc_if_member member;
+
+	member.rim_name = name;
+	member.rim_type = RPC_MEMBER_METHOD;
+	member.rim_method.rm_block = NULL;
+	member.rim_method.rm_func = func;
+	member.rim_method.rm_arg = arg;
+	member.rim_method.rm_flags = 0;
+	member.rim_method.rm_priority = RPC_PRIORITY_DEFAULT;
+	member.rim_method.rm_cache_ttl = 0;
+	member.rim_method.rm_typing = NULL;
+
+	return (rpc_instance_register_member(instance, interface, &member));
+}
+
+int
+rpc_instance_unregister_member(rpc_instance_t instance, const char *interface,
+    const char *name)
+{
+	struct rpc_interface_priv *priv;
+	struct rpc_if_member *member;
+	gpointer key;
+
+	g_assert_nonnull(name);
 
 	if (interface == NULL)
 		interface = RPC_DEFAULT_INTERFACE;
 
-	g_rw_lock_reader_lock(&instance->ri_rwlock);
-	iface = g_hash_table_lookup(instance->ri_interfaces, interface);
-	g_rw_lock_reader_unlock(&instance->ri_rwlock);
+	priv = g_hash_table_lookup(instance->ri_interfaces, interface);
+	if (priv == NULL) {
+		rpc_set_last_error(ENOENT, "Interface not found", NULL);
+		return (-1);
+	}
 
-	if (iface == NULL) {
-		debugf("member %s not found on %s\n", name,
-		    interface);
-		return (NULL);
+	g_rw_lock_writer_lock(&priv->rip_rwlock);
+	if (!g_hash_table_lookup_extended(priv->rip_members, name, &key,
+	    (gpointer *)&member)) {
+		rpc_set_last_error(ENOENT, "Member not found", NULL);
+		g_rw_lock_writer_unlock(&priv->rip_rwlock);
+		return (-1);
 	}
 
-	g_rw_lock_reader_lock(&iface->rip_rwlock);
-	result = g_hash_table_lookup(iface->rip_members, name);
-	g_rw_lock_reader_unlock(&iface->rip_rwlock);
+	g_hash_table_steal(priv->rip_members, name);
+	rpc_snapshot_publish(&priv->rip_members_rcu, priv->rip_members);
+	g_rw_lock_writer_unlock(&priv->rip_rwlock);
+	rpc_rcu_call(key, g_free);
+	rpc_rcu_call(member, (GDestroyNotify)rpc_if_member_free);
 
-	return (result);
+	debugf("unregistered %s", name);
+	return (0);
 }
 
-bool
-rpc_instance_has_interface(rpc_instance_t instance, const char *interface)
+void
+rpc_context_set_pre_call_hook(rpc_context_t context, rpc_function_t fn)
 {
 
-	g_assert_nonnull(interface);
+	context->rcx_pre_call_hook = fn;
+}
+
+
+void
+rpc_context_set_post_call_hook(rpc_context_t context, rpc_function_t fn)
+{
+
+	context->rcx_post_call_hook = fn;
+}
+
+void
+rpc_context_set_event_burst(rpc_context_t context, size_t max_count,
+    unsigned int max_latency)
+{
+
+	context->rcx_burst_latency = max_latency;
+	context->rcx_burst_max_count = max_count;
+}
+
+void
+rpc_context_set_emit_queue_limit(rpc_context_t context, size_t limit,
+    rpc_emit_policy_t policy)
+{
 
-	return ((bool)g_hash_table_contains(instance->ri_interfaces, interface));
+	context->rcx_emit_policy = policy;
+	context->rcx_emit_limit = limit;
 }
 
 int
-rpc_instance_register_interface(rpc_instance_t instance,
-    const char *interface, const struct rpc_if_member *vtable, void *arg)
+rpc_context_set_event_ring(rpc_context_t context, size_t size)
 {
-	struct rpc_interface_priv *priv;
-	const struct rpc_if_member *member;
+#if defined(__linux__)
+	gsize unset = 0;
+
+	/* Rings are created per connection, as local clients attach */
+	if (!__atomic_compare_exchange_n(&context->rcx_event_ring_size,
+	    &unset, MAX(size, 1), false, __ATOMIC_SEQ_CST,
+	    __ATOMIC_SEQ_CST)) {
+		rpc_set_last_errorf(EBUSY, "Event ring already set up");
+		return (-1);
+	}
 
-	g_assert_nonnull(interface);
+	return (0);
+#else
+	rpc_set_last_errorf(ENOTSUP, "Event rings need memory files");
+	return (-1);
+#endif
+}
 
-	if (rpc_instance_has_interface(instance, interface))
-		return (0);
+int
+rpc_context_set_dispatch_workers(rpc_context_t context, size_t nworkers,
+    bool pin)
+{
+	int ret = 0;
+
+	g_mutex_lock(&context->rcx_workq_mtx);
+	if (context->rcx_workq != NULL) {
+		rpc_set_last_errorf(EBUSY, "Dispatcher already running");
+		ret = -1;
+	} else {
+		context->rcx_workq_nworkers = (guint)MIN(nworkers,
+		    RPC_WORKQ_MAX_WORKERS);
+		context->rcx_workq_pin = pin;
+	}
+	g_mutex_unlock(&context->rcx_workq_mtx);
+	return (ret);
+}
 
-	priv = g_malloc0(sizeof(*priv));
-	g_rw_lock_init(&priv->rip_rwlock);
-	priv->rip_members = g_hash_table_new_full(g_str_hash, g_str_equal,
-	    g_free, (GDestroyNotify)rpc_if_member_free);
-	priv->rip_arg = arg;
-	priv->rip_name = g_strdup(interface);
+int
+rpc_context_set_shared_executor(rpc_context_t context, unsigned int weight)
+{
+	int ret = 0;
+
+	g_mutex_lock(&context->rcx_workq_mtx);
+	if (context->rcx_workq != NULL || context->rcx_exec != NULL) {
+		rpc_set_last_errorf(EBUSY, "Dispatcher already running");
+		ret = -1;
+	} else
+		context->rcx_exec_weight = weight;
+	g_mutex_unlock(&context->rcx_workq_mtx);
+	return (ret);
+}
 
-	g_rw_lock_writer_lock(&instance->ri_rwlock);
-	g_hash_table_insert(instance->ri_interfaces, g_strdup(priv->rip_name),
-	    priv);
-	g_rw_lock_writer_unlock(&instance->ri_rwlock);
+int
+rpc_executor_set_workers(size_t nworkers)
+{
 
-	if (vtable != NULL) {
-		for (member = &vtable[0]; member->rim_name != NULL; member++)
-			rpc_instance_register_member(instance, interface, 
-			    member);
+	if (rpc_exec_set_workers((guint)MIN(nworkers, G_MAXUINT)) != 0) {
+		rpc_set_last_errorf(EBUSY, "Shared executor already running");
+		return (-1);
 	}
 
-	rpc_instance_emit_event(instance, RPC_INTROSPECTABLE_INTERFACE,
-	    "interface_added", rpc_string_create(interface));
+	return (0);
+}
+
+void
+rpc_executor_set_share_callbacks(bool share)
+{
 
+	rpc_exec_set_share_callbacks(share);
+}
+
+int
+rpc_context_set_fiber_threads(rpc_context_t context, size_t nthreads)
+{
+	int ret = 0;
+
+	g_mutex_lock(&context->rcx_workq_mtx);
+	if (context->rcx_fibers != NULL) {
+		rpc_set_last_errorf(EBUSY, "Fiber threads already running");
+		ret = -1;
+	} else {
+		context->rcx_fibers_nthreads = (guint)MIN(nthreads,
+		    RPC_FIBER_MAX_THREADS);
+	}
+	g_mutex_unlock(&context->rcx_workq_mtx);
+	return (ret);
+}
+
+int
+rpc_context_set_priority_weights(rpc_context_t context, unsigned int high,
+    unsigned int normal, unsigned int low)
+{
+	int ret = 0;
+
+	g_mutex_lock(&context->rcx_workq_mtx);
+	if (context->rcx_workq != NULL) {
+		rpc_set_last_errorf(EBUSY, "Dispatcher already running");
+		ret = -1;
+	} else {
+		context->rcx_prio_weights[0] = high;
+		context->rcx_prio_weights[1] = normal;
+		context->rcx_prio_weights[2] = low;
+		context->rcx_prio_weighted = high != 0 || normal != 0 ||
+		    low != 0;
+	}
+	g_mutex_unlock(&context->rcx_workq_mtx);
+	return (ret);
+}
+
+int
+rpc_context_set_validation_policy(rpc_context_t context, const char *interface,
+    const char *method, const struct rpc_validation_policy *policy)
+{
+	GHashTable *methods;
+
+	if (interface == NULL && method != NULL) {
+		rpc_set_last_errorf(EINVAL, "Method given without interface");
+		return (-1);
+	}
+
+	if (interface == NULL)
+		interface = RPC_VALIDATION_ANY;
+
+	if (method == NULL)
+		method = RPC_VALIDATION_ANY;
+
+	g_rw_lock_writer_lock(&context->rcx_validation_lock);
+	methods = g_hash_table_lookup(context->rcx_validation, interface);
+
+	if (policy == NULL) {
+		if (methods != NULL) {
+			g_hash_table_remove(methods, method);
+			if (g_hash_table_size(methods) == 0)
+				g_hash_table_remove(context->rcx_validation,
+				    interface);
+		}
+
+		g_rw_lock_writer_unlock(&context->rcx_validation_lock);
+		return (0);
+	}
+
+	if (methods == NULL) {
+		methods = g_hash_table_new_full(g_str_hash, g_str_equal,
+		    g_free, g_free);
+		g_hash_table_insert(context->rcx_validation,
+		    g_strdup(interface), methods);
+	}
+
+	g_hash_table_insert(methods, g_strdup(method),
+	    g_memdup(policy, sizeof(*policy)));
+	g_rw_lock_writer_unlock(&context->rcx_validation_lock);
 	return (0);
 }
 
+static bool
+rpc_validation_sample(double rate)
+{
+
+	if (rate >= 1.0)
+		return (true);
+
+	if (rate <= 0.0)
+		return (false);
+
+	return (g_random_double() < rate);
+}
+
+bool
+rpc_context_should_validate(struct rpc_call *call, bool result)
+{
+	rpc_context_t context = call->rc_context;
+	const struct rpc_validation_policy *policy = NULL;
+	struct rpc_validation_policy found;
+	GHashTable *methods;
+
+	/* No policies: validate everything, without taking the lock */
+	if (context == NULL || g_hash_table_size(context->rcx_validation) == 0)
+		return (true);
+
+	g_rw_lock_reader_lock(&context->rcx_validation_lock);
+	methods = g_hash_table_lookup(context->rcx_validation,
+	    call->rc_interface);
+	if (methods != NULL) {
+		policy = g_hash_table_lookup(methods, call->rc_method_name);
+		if (policy == NULL)
+			policy = g_hash_table_lookup(methods,
+			    RPC_VALIDATION_ANY);
+	}
+
+	if (policy == NULL) {
+		methods = g_hash_table_lookup(context->rcx_validation,
+		    RPC_VALIDATION_ANY);
+		if (methods != NULL)
+			policy = g_hash_table_lookup(methods,
+			    RPC_VALIDATION_ANY);
+	}
+
+	if (policy == NULL) {
+		g_rw_lock_reader_unlock(&context->rcx_validation_lock);
+		return (true);
+	}
+
+	found = *policy;
+	g_rw_lock_reader_unlock(&context->rcx_validation_lock);
+
+	if (found.rvp_skip_local && call->rc_conn != NULL &&
+	    rpc_connection_has_credentials(call->rc_conn) &&
+	    rpc_connection_get_remote_uid(call->rc_conn) == getuid())
+		return (false);
+
+	return (rpc_validation_sample(result
+	    ? found.rvp_result_rate
+	    : found.rvp_args_rate));
+}
+
 void
-rpc_instance_unregister_interface(rpc_instance_t instance,
-    const char *interface)
+rpc_context_set_fragment_batch(rpc_context_t context, size_t max_items,
+    size_t max_bytes)
 {
-	g_rw_lock_writer_lock(&instance->ri_rwlock);
-	g_hash_table_remove(instance->ri_interfaces, interface);
-	g_rw_lock_writer_unlock(&instance->ri_rwlock);
 
-	rpc_instance_emit_event(instance, RPC_INTROSPECTABLE_INTERFACE,
-	    "interface_removed", rpc_string_create(interface));
+	context->rcx_frag_batch_items = max_items;
+	context->rcx_frag_batch_bytes = max_bytes;
 }
 
 void
-rpc_interface_free(struct rpc_interface_priv *priv)
+rpc_context_set_dispatch_limit(rpc_context_t context,
+    unsigned int max_inflight)
 {
 
-	g_hash_table_destroy(priv->rip_members);
-	g_rw_lock_clear(&priv->rip_rwlock);
-	g_free(priv->rip_description);
-	g_free(priv);
+	context->rcx_dispatch_limit = max_inflight;
 }
 
 void
-rpc_if_member_free(struct rpc_if_member *member)
+rpc_context_set_admission_limit(rpc_context_t context, unsigned int limit,
+    bool adaptive)
 {
 
-	if (member->rim_type == RPC_MEMBER_METHOD) {
-		if (member->rim_method.rm_block != NULL)
-			Block_release(member->rim_method.rm_block);
-	}
+	g_mutex_lock(&context->rcx_adm_mtx);
+	context->rcx_adm_max = limit;
+	context->rcx_adm_adaptive = adaptive;
+	context->rcx_adm_limit_f = limit;
+	g_atomic_int_set(&context->rcx_adm_limit, limit);
+	g_mutex_unlock(&context->rcx_adm_mtx);
+}
 
-	if (member->rim_type == RPC_MEMBER_PROPERTY) {
-		if (member->rim_property.rp_getter != NULL)
-			Block_release(member->rim_property.rp_getter);
+void
+rpc_context_get_admission_stats(rpc_context_t context,
+    struct rpc_admission_stats *stats)
+{
+	gint inflight;
+	gint running;
 
-		if (member->rim_property.rp_setter != NULL)
-			Block_release(member->rim_property.rp_setter);
-	}
+	inflight = g_atomic_int_get(&context->rcx_adm_inflight);
+	running = g_atomic_int_get(&context->rcx_adm_running);
 
-	g_free((void *)member->rim_name);
-	g_free(member);
+	stats->rads_limit = g_atomic_int_get(&context->rcx_adm_limit);
+	stats->rads_inflight = (unsigned int)MAX(inflight, 0);
+	stats->rads_queued = (unsigned int)MAX(inflight - running, 0);
+	stats->rads_admitted = atomic_load(&context->rcx_adm_admitted);
+	stats->rads_rejected = atomic_load(&context->rcx_adm_rejected);
+
+	g_mutex_lock(&context->rcx_adm_mtx);
+	stats->rads_latency = (uint64_t)context->rcx_adm_latency;
+	g_mutex_unlock(&context->rcx_adm_mtx);
 }
 
-int rpc_instance_register_member(rpc_instance_t instance, const char *interface,
-    const struct rpc_if_member *member)
+rpc_object_t
+rpc_context_get_stats(rpc_context_t context)
 {
-	struct rpc_interface_priv *priv;
-	struct rpc_if_member *copy;
 
-	if (interface == NULL)
-		interface = RPC_DEFAULT_INTERFACE;
+	return (rpc_stats_get(context->rcx_stats));
+}
 
-	priv = g_hash_table_lookup(instance->ri_interfaces, interface);
-	if (priv == NULL) {
-		rpc_set_last_error(ENOENT, "Interface not found", NULL);
+void
+rpc_context_reset_stats(rpc_context_t context)
+{
+
+	rpc_stats_reset(context->rcx_stats);
+}
+
+int
+rpc_instance_get_property_rights(rpc_instance_t instance, const char *interface,
+    const char *name)
+{
+	struct rpc_if_member *member;
+	int rights = 0;
+
+	member = rpc_instance_find_member(instance, interface, name);
+	if (member == NULL || member->rim_type != RPC_MEMBER_PROPERTY) {
+		rpc_set_last_error(ENOENT, "Property not found", NULL);
 		return (-1);
 	}
 
-	copy = g_memdup(member, sizeof(*member));
-	copy->rim_name = g_strdup(member->rim_name);
+	if (member->rim_property.rp_getter != NULL)
+		rights |= RPC_PROPERTY_READ;
+
+	if (member->rim_property.rp_setter != NULL)
+		rights |= RPC_PROPERTY_WRITE;
+
+	return (rights);
+}
+
+void
+rpc_instance_property_changed(rpc_instance_t instance, const char *interface,
+    const char *name, rpc_object_t value)
+{
+	struct rpc_if_member *prop;
+
+	prop = rpc_instance_find_member(instance, interface, name);
+	g_assert(prop != NULL);
+	g_assert(prop->rim_type == RPC_MEMBER_PROPERTY);
+
+	if (prop->rim_property.rp_cache_ttl > 0)
+		rpc_property_cache_update(instance, interface, name,
+		    prop->rim_property.rp_cache_ttl, value);
+
+	if (prop->rim_property.rp_coalesce > 0 &&
+	    instance->ri_context != NULL &&
+	    rpc_property_notify_defer(instance, prop, interface, name, value))
+		return;
+
+	rpc_property_notify_emit(instance, prop, interface, name, value);
+}
+
+static void
+rpc_property_notify_emit(rpc_instance_t instance, struct rpc_if_member *prop,
+    const char *interface, const char *name, rpc_object_t value)
+{
+	rpc_object_t error = NULL;
+	rpc_object_t args;
+	bool release = false;
+
+	if (value == NULL) {
+		value = rpc_property_read(instance, prop, interface, name,
+		    &error);
+		if (error != NULL) {
+			rpc_release(error);
+			return;
+		}
+
+		release = true;
+	}
+
+	if (instance->ri_context != NULL)
+		rpc_result_cache_invalidate(instance->ri_context,
+		    instance->ri_path, false);
+
+	if (!prop->rim_property.rp_delta) {
+		rpc_instance_emit_event(instance, RPC_OBSERVABLE_INTERFACE,
+		    "changed", rpc_object_pack("{s,s,v}",
+			"interface", interface,
+			"name", name,
+			"value", rpc_retain(value)));
+		goto done;
+	}
+
+	/* Patches have to reach subscribers in the order they're made */
+	g_mutex_lock(&instance->ri_delta_mtx);
+	args = rpc_property_delta(instance, interface, name, value);
+	if (args != NULL) {
+		rpc_instance_emit_event(instance, RPC_OBSERVABLE_INTERFACE,
+		    "changed", args);
+	}
+	g_mutex_unlock(&instance->ri_delta_mtx);
+
+done:
+	if (release)
+		rpc_release(value);
+}
+
+/*
+ * Builds the Observable.changed arguments of a delta property and
+ * remembers @p value as sent. Returns NULL if it didn't change.
+ * Called with ri_delta_mtx held.
+ */
+static rpc_object_t
+rpc_property_delta(rpc_instance_t instance, const char *interface,
+    const char *name, rpc_object_t value)
+{
+	rpc_object_t last;
+	rpc_object_t patch;
+	char *key;
+
+	key = g_strdup_printf("%s.%s", interface, name);
+	last = g_hash_table_lookup(instance->ri_prop_sent, key);
+	if (last != NULL && rpc_equal(last, value)) {
+		g_free(key);
+		return (NULL);
+	}
+
+	patch = rpc_array_create();
+	if (last == NULL || rpc_get_type(last) != RPC_TYPE_DICTIONARY ||
+	    rpc_get_type(value) != RPC_TYPE_DICTIONARY ||
+	    !rpc_property_diff(last, value, NULL, patch)) {
+		rpc_release(patch);
+		patch = NULL;
+	}
+
+	/* A copy, as the caller may go on changing its object */
+	g_hash_table_replace(instance->ri_prop_sent, key, rpc_copy(value));
+
+	if (patch == NULL) {
+		return (rpc_object_pack("{s,s,v}",
+		    "interface", interface,
+		    "name", name,
+		    "value", rpc_retain(value)));
+	}
+
+	return (rpc_object_pack("{s,s,v}",
+	    "interface", interface,
+	    "name", name,
+	    "patch", patch));
+}
 
-	if (copy->rim_type == RPC_MEMBER_METHOD) {
-		copy->rim_method.rm_block = Block_copy(
-		    copy->rim_method.rm_block);
+/*
+ * Appends to @p patch the changes turning dictionary @p old into @p new.
+ * Returns false if they can't be expressed as a reasonably short patch.
+ */
+static bool
+rpc_property_diff(rpc_object_t old, rpc_object_t new, const char *prefix,
+    rpc_object_t patch)
+{
+	__block bool ok = true;
 
-		if (copy->rim_method.rm_arg == NULL)
-			copy->rim_method.rm_arg = priv->rip_arg;
-	}
+	rpc_dictionary_apply(old, ^(const char *key, rpc_object_t v __unused) {
+		if (!rpc_dictionary_has_key(new, key))
+			ok = rpc_property_diff_add(patch, prefix, key, NULL);
 
-	if (copy->rim_type == RPC_MEMBER_PROPERTY) {
-		if (copy->rim_property.rp_getter != NULL) {
-			copy->rim_property.rp_getter = Block_copy(
-			    copy->rim_property.rp_getter);
-		}
+		return (ok);
+	});
 
-		if (copy->rim_property.rp_setter != NULL) {
-			copy->rim_property.rp_setter = Block_copy(
-			    copy->rim_property.rp_setter);
+	if (!ok)
+		return (false);
+
+	rpc_dictionary_apply(new, ^(const char *key, rpc_object_t v) {
+		rpc_object_t prev;
+		char *path;
+
+		prev = rpc_dictionary_get_value(old, key);
+		if (prev != NULL &&
+		    rpc_get_type(prev) == RPC_TYPE_DICTIONARY &&
+		    rpc_get_type(v) == RPC_TYPE_DICTIONARY &&
+		    strchr(key, '.') == NULL && *key != '\0') {
+			path = prefix != NULL
+			    ? g_strdup_printf("%s.%s", prefix, key)
+			    : g_strdup(key);
+			ok = rpc_property_diff(prev, v, path, patch);
+			g_free(path);
+			return (ok);
 		}
 
-		if (copy->rim_property.rp_arg == NULL)
-			copy->rim_property.rp_arg = priv->rip_arg;
+		if (prev == NULL || !rpc_equal(prev, v))
+			ok = rpc_property_diff_add(patch, prefix, key, v);
 
-	}
+		return (ok);
+	});
 
-	g_rw_lock_writer_lock(&priv->rip_rwlock);
-	g_hash_table_insert(priv->rip_members, g_strdup(member->rim_name), copy);
-	g_rw_lock_writer_unlock(&priv->rip_rwlock);
-	return (0);
+	return (ok);
 }
 
-int
-rpc_instance_register_block(rpc_instance_t instance, const char *interface,
-    const char *name, void *arg, rpc_function_t func)
+static bool
+rpc_property_diff_add(rpc_object_t patch, const char *prefix,
+    const char *key, rpc_object_t value)
 {
-	struct rpc_if_member member;
+	rpc_object_t entry;
 
-	member.rim_name = name;
-	member.rim_type = RPC_MEMBER_METHOD;
-	member.rim_method.rm_block = func;
-	member.rim_method.rm_arg = arg;
+	if (strchr(key, '.') != NULL || *key == '\0' ||
+	    rpc_array_get_count(patch) >= RPC_PROPERTY_DELTA_MAX)
+		return (false);
 
-	return (rpc_instance_register_member(instance, interface, &member));
-}
+	entry = rpc_dictionary_create();
+	rpc_dictionary_steal_value(entry, "path", prefix != NULL
+	    ? rpc_string_create_with_format("%s.%s", prefix, key)
+	    : rpc_string_create(key));
+	if (value != NULL)
+		rpc_dictionary_set_value(entry, "value", value);
 
-int
-rpc_instance_register_func(rpc_instance_t instance, const char *interface,
-    const char *name, void *arg, rpc_function_f func)
-{
-	return (rpc_instance_register_block(instance, interface, name, arg,
-	    RPC_FUNCTION(func)));
+	rpc_array_append_stolen_value(patch, entry);
+	return (true);
 }
 
-int
-rpc_instance_unregister_member(rpc_instance_t instance, const char *interface,
-    const char *name)
+/*
+ * Returns true if the change was queued or folded into one already
+ * queued, false if the caller should send it out right away: the first
+ * change after a quiet interval isn't delayed.
+ */
+static bool
+rpc_property_notify_defer(rpc_instance_t instance, struct rpc_if_member *prop,
+    const char *interface, const char *name, rpc_object_t value)
 {
-	struct rpc_interface_priv *priv;
-	struct rpc_if_member *member;
+	rpc_context_t context = instance->ri_context;
+	struct rpc_property_notify *notify;
+	gint64 interval = (gint64)prop->rim_property.rp_coalesce * 1000;
+	gint64 now = g_get_monotonic_time();
+	char *key;
+
+	key = g_strdup_printf("%s.%s", interface, name);
+	g_mutex_lock(&context->rcx_notify_mtx);
+	if (context->rcx_notify_stop) {
+		g_mutex_unlock(&context->rcx_notify_mtx);
+		g_free(key);
+		return (false);
+	}
 
-	g_assert_nonnull(name);
+	notify = g_hash_table_lookup(instance->ri_notify, key);
+	if (notify == NULL) {
+		notify = g_malloc0(sizeof(*notify));
+		notify->rpn_instance = instance;
+		notify->rpn_interface = g_strdup(interface);
+		notify->rpn_name = g_strdup(name);
+		notify->rpn_last = now;
+		g_hash_table_insert(instance->ri_notify, key, notify);
+		g_mutex_unlock(&context->rcx_notify_mtx);
+		return (false);
+	}
 
-	if (interface == NULL)
-		interface = RPC_DEFAULT_INTERFACE;
+	g_free(key);
 
-	priv = g_hash_table_lookup(instance->ri_interfaces, interface);
-	if (priv == NULL) {
-		rpc_set_last_error(ENOENT, "Interface not found", NULL);
-		return (-1);
+	if (notify->rpn_queued) {
+		rpc_release(notify->rpn_value);
+		notify->rpn_value = value != NULL ? rpc_retain(value) : NULL;
+		g_mutex_unlock(&context->rcx_notify_mtx);
+		return (true);
 	}
 
-	g_rw_lock_writer_lock(&priv->rip_rwlock);
-	member = g_hash_table_lookup(priv->rip_members, name);
-	if (member == NULL) {
-		rpc_set_last_error(ENOENT, "Member not found", NULL);
-		g_rw_lock_writer_unlock(&priv->rip_rwlock);
-		return (-1);
+	if (now - notify->rpn_last >= interval ||
+	    rpc_instance_retain(instance) == NULL) {
+		notify->rpn_last = now;
+		g_mutex_unlock(&context->rcx_notify_mtx);
+		return (false);
 	}
 
-	g_hash_table_remove(priv->rip_members, name);
-	g_rw_lock_writer_unlock(&priv->rip_rwlock);
+	notify->rpn_value = value != NULL ? rpc_retain(value) : NULL;
+	notify->rpn_queued = true;
+	notify->rpn_deadline = notify->rpn_last + interval;
+	g_sequence_insert_sorted(context->rcx_notify_queue, notify,
+	    rpc_property_notify_cmp, NULL);
 
-	debugf("unregistered %s", name);
-	return (0);
+	if (context->rcx_notify_thread == NULL)
+		context->rcx_notify_thread = rpc_thread_new(
+		    RPC_THREAD_EMITTER, "property notify",
+		    rpc_property_notify_worker, context);
+
+	g_cond_signal(&context->rcx_notify_cv);
+	g_mutex_unlock(&context->rcx_notify_mtx);
+	return (true);
 }
 
-void
-rpc_context_set_pre_call_hook(rpc_context_t context, rpc_function_t fn)
+static gint
+rpc_property_notify_cmp(gconstpointer a, gconstpointer b,
+    gpointer user_data __unused)
 {
+	const struct rpc_property_notify *na = a;
+	const struct rpc_property_notify *nb = b;
 
-	context->rcx_pre_call_hook = fn;
+	if (na->rpn_deadline == nb->rpn_deadline)
+		return (0);
+
+	return (na->rpn_deadline < nb->rpn_deadline ? -1 : 1);
 }
 
+static gpointer
+rpc_property_notify_worker(gpointer data)
+{
+	rpc_context_t context = data;
+	struct rpc_property_notify *notify;
+	struct rpc_if_member *prop;
+	GSequenceIter *iter;
+	rpc_object_t value;
 
-void
-rpc_context_set_post_call_hook(rpc_context_t context, rpc_function_t fn)
+	g_mutex_lock(&context->rcx_notify_mtx);
+	while (!context->rcx_notify_stop) {
+		if (g_sequence_is_empty(context->rcx_notify_queue)) {
+			g_cond_wait(&context->rcx_notify_cv,
+			    &context->rcx_notify_mtx);
+			continue;
+		}
+
+		iter = g_sequence_get_begin_iter(context->rcx_notify_queue);
+		notify = g_sequence_get(iter);
+		if (g_get_monotonic_time() < notify->rpn_deadline) {
+			g_cond_wait_until(&context->rcx_notify_cv,
+			    &context->rcx_notify_mtx, notify->rpn_deadline);
+			continue;
+		}
+
+		g_sequence_remove(iter);
+		value = notify->rpn_value;
+		notify->rpn_value = NULL;
+		notify->rpn_queued = false;
+		notify->rpn_last = g_get_monotonic_time();
+		g_mutex_unlock(&context->rcx_notify_mtx);
+
+		/* Our instance reference keeps notify around too */
+		prop = rpc_instance_find_member(notify->rpn_instance,
+		    notify->rpn_interface, notify->rpn_name);
+		if (prop != NULL && prop->rim_type == RPC_MEMBER_PROPERTY)
+			rpc_property_notify_emit(notify->rpn_instance, prop,
+			    notify->rpn_interface, notify->rpn_name, value);
+
+		rpc_release(value);
+		rpc_instance_release(notify->rpn_instance);
+		g_mutex_lock(&context->rcx_notify_mtx);
+	}
+
+	g_mutex_unlock(&context->rcx_notify_mtx);
+	return (NULL);
+}
+
+static void
+rpc_property_notify_free(struct rpc_property_notify *notify)
 {
 
-	context->rcx_post_call_hook = fn;
+	rpc_release(notify->rpn_value);
+	g_free(notify->rpn_interface);
+	g_free(notify->rpn_name);
+	g_free(notify);
 }
 
-int
-rpc_instance_get_property_rights(rpc_instance_t instance, const char *interface,
-    const char *name)
+/*
+ * Runs the getter of a property, or answers from its cache. Returns a
+ * new reference; on a getter error, returns NULL and hands the error
+ * object over through @p error.
+ */
+static rpc_object_t
+rpc_property_read(rpc_instance_t instance, struct rpc_if_member *member,
+    const char *interface, const char *name, rpc_object_t *error)
 {
-	struct rpc_if_member *member;
-	int rights = 0;
+	struct rpc_property_cookie prop;
+	struct rpc_property_cached *cached;
+	unsigned int ttl = member->rim_property.rp_cache_ttl;
+	rpc_object_t value;
+	uint64_t gen = 0;
+	char *key = NULL;
 
-	member = rpc_instance_find_member(instance, interface, name);
-	if (member == NULL || member->rim_type != RPC_MEMBER_PROPERTY) {
-		rpc_set_last_error(ENOENT, "Property not found", NULL);
-		return (-1);
+	if (ttl > 0) {
+		key = g_strdup_printf("%s.%s", interface, name);
+		g_mutex_lock(&instance->ri_mtx);
+		cached = g_hash_table_lookup(instance->ri_prop_cache, key);
+		if (cached != NULL && (cached->rpv_expires == 0 ||
+		    g_get_monotonic_time() < cached->rpv_expires)) {
+			value = rpc_retain(cached->rpv_value);
+			g_mutex_unlock(&instance->ri_mtx);
+			g_free(key);
+			return (value);
+		}
+
+		gen = instance->ri_prop_gen;
+		g_mutex_unlock(&instance->ri_mtx);
 	}
 
-	if (member->rim_property.rp_getter != NULL)
-		rights |= RPC_PROPERTY_READ;
+	prop.instance = instance;
+	prop.name = name;
+	prop.arg = member->rim_property.rp_arg;
+	prop.error = NULL;
+	value = member->rim_property.rp_getter(&prop);
 
-	if (member->rim_property.rp_setter != NULL)
-		rights |= RPC_PROPERTY_WRITE;
+	if (prop.error != NULL) {
+		*error = prop.error;
+		g_free(key);
+		return (NULL);
+	}
 
-	return (rights);
+	if (key == NULL || value == NULL)
+		return (value);
+
+	g_mutex_lock(&instance->ri_mtx);
+	if (instance->ri_prop_gen != gen) {
+		g_mutex_unlock(&instance->ri_mtx);
+		g_free(key);
+		return (value);
+	}
+
+	g_hash_table_replace(instance->ri_prop_cache, key,
+	    rpc_property_cached_new(value, ttl));
+	g_mutex_unlock(&instance->ri_mtx);
+	return (value);
 }
 
-void
-rpc_instance_property_changed(rpc_instance_t instance, const char *interface,
-    const char *name, rpc_object_t value)
+/*
+ * A property changed: caches @p value for @p ttl milliseconds, or just
+ * drops what was cached if there's no value to keep.
+ */
+static void
+rpc_property_cache_update(rpc_instance_t instance, const char *interface,
+    const char *name, unsigned int ttl, rpc_object_t value)
 {
-	struct rpc_if_member *prop;
-	struct rpc_property_cookie cookie;
-	bool release = false;
+	char *key;
 
-	prop = rpc_instance_find_member(instance, interface, name);
-	g_assert(prop != NULL);
-	g_assert(prop->rim_type == RPC_MEMBER_PROPERTY);
+	key = g_strdup_printf("%s.%s", interface, name);
+	g_mutex_lock(&instance->ri_mtx);
+	instance->ri_prop_gen++;
 
-	if (value == NULL) {
-		cookie.instance = instance;
-		cookie.name = name;
-		cookie.arg = prop->rim_property.rp_arg;
-		cookie.error = NULL;
-		value = prop->rim_property.rp_getter(&cookie);
+	if (value == NULL || ttl == 0) {
+		g_hash_table_remove(instance->ri_prop_cache, key);
+		g_mutex_unlock(&instance->ri_mtx);
+		g_free(key);
+		return;
+	}
 
-		if (cookie.error != NULL)
-			return;
+	g_hash_table_replace(instance->ri_prop_cache, key,
+	    rpc_property_cached_new(value, ttl));
+	g_mutex_unlock(&instance->ri_mtx);
+}
 
-		release = true;
-	}
+static struct rpc_property_cached *
+rpc_property_cached_new(rpc_object_t value, unsigned int ttl)
+{
+	struct rpc_property_cached *cached;
 
-	rpc_instance_emit_event(instance, RPC_OBSERVABLE_INTERFACE, "changed",
-	    rpc_object_pack("{s,s,v}",
-		"interface", interface,
-		"name", name,
-		"value", rpc_retain(value)));
+	cached = g_malloc(sizeof(*cached));
+	cached->rpv_value = rpc_retain(value);
+	cached->rpv_expires = ttl == RPC_PROPERTY_CACHE_UNTIL_CHANGED ? 0 :
+	    g_get_monotonic_time() + (gint64)ttl * 1000;
+	return (cached);
+}
 
-	if (release)
-		rpc_release(value);
+static void
+rpc_property_cached_free(struct rpc_property_cached *cached)
+{
+
+	rpc_release(cached->rpv_value);
+	g_free(cached);
 }
 
 rpc_instance_t
@@ -1242,11 +4048,9 @@ static rpc_object_t
 rpc_get_objects(void *cookie, rpc_object_t args __unused)
 {
 	rpc_context_t context = rpc_function_get_context(cookie);
-	GHashTableIter iter;
-	const char *k;
-	char *prefix = NULL;
+	char *prefix;
+	char *next;
 	rpc_instance_t instance;
-	rpc_instance_t v;
 	rpc_object_t list;
 
 	instance = rpc_function_get_instance(cookie);
@@ -1254,21 +4058,276 @@ rpc_get_objects(void *cookie, rpc_object_t args __unused)
 
 	if (strlen(rpc_instance_get_path(instance)) > 1)
 		prefix = g_strdup_printf("%s/", rpc_instance_get_path(instance));
+	else
+		prefix = g_strdup("");
+
+	g_rw_lock_reader_lock(&context->rcx_instance_index_rwlock);
+	next = rpc_instances_page_locked(context, prefix, NULL, G_MAXSIZE,
+	    list);
+	g_rw_lock_reader_unlock(&context->rcx_instance_index_rwlock);
+	g_free(next);
+	g_free(prefix);
+	return (list);
+}
 
-	g_rw_lock_reader_lock(&context->rcx_rwlock);
-	g_hash_table_iter_init(&iter, context->rcx_instances);
+static gint
+rpc_instance_path_cmp(gconstpointer a, gconstpointer b,
+    gpointer user_data __unused)
+{
+	const struct rpc_instance *ia = a;
+	const struct rpc_instance *ib = b;
+
+	return (strcmp(ia->ri_path, ib->ri_path));
+}
+
+/*
+ * Called with rcx_instance_index_rwlock held. Appends up to @p limit
+ * instances whose path starts with @p prefix and sorts after @p cursor,
+ * if given, to @p list. Returns the cursor to carry on from, or NULL
+ * once that was the last of them.
+ */
+static char *
+rpc_instances_page_locked(rpc_context_t context, const char *prefix,
+    const char *cursor, size_t limit, rpc_object_t list)
+{
+	struct rpc_instance key;
+	GSequenceIter *iter;
+	GSequenceIter *prev;
+	rpc_instance_t instance;
+	const char *last = NULL;
+	size_t count = 0;
+
+	/* Searching lands right after an equal path; that's what we want */
+	if (cursor != NULL && strcmp(cursor, prefix) >= 0) {
+		key.ri_path = (char *)cursor;
+		iter = g_sequence_search(context->rcx_instance_seq, &key,
+		    rpc_instance_path_cmp, NULL);
+	} else {
+		key.ri_path = (char *)prefix;
+		iter = g_sequence_search(context->rcx_instance_seq, &key,
+		    rpc_instance_path_cmp, NULL);
+		if (!g_sequence_iter_is_begin(iter)) {
+			prev = g_sequence_iter_prev(iter);
+			instance = g_sequence_get(prev);
+			if (strcmp(instance->ri_path, prefix) == 0)
+				iter = prev;
+		}
+	}
+
+	for (; !g_sequence_iter_is_end(iter);
+	    iter = g_sequence_iter_next(iter)) {
+		instance = g_sequence_get(iter);
+		if (!g_str_has_prefix(instance->ri_path, prefix))
+			return (NULL);
+
+		if (count++ == limit)
+			return (g_strdup(last));
 
-	while (g_hash_table_iter_next(&iter, (gpointer)&k, (gpointer)&v)) {
-		if (prefix != NULL && !g_str_has_prefix(v->ri_path, prefix))
-			continue;
 		rpc_array_append_stolen_value(list, rpc_object_pack("{s,s}",
-		    "path", v->ri_path,
-		    "description", v->ri_descr));
+		    "path", instance->ri_path,
+		    "description", instance->ri_descr));
+		last = instance->ri_path;
+	}
+
+	return (NULL);
+}
+
+/*
+ * Reads the optional {prefix, cursor, limit} dictionary the paging
+ * methods take. The prefix defaults to the subtree of the instance
+ * the call is on, like get_instances.
+ */
+static char *
+rpc_instances_prefix(void *cookie, rpc_object_t args, const char **cursor,
+    uint64_t *limit)
+{
+	rpc_instance_t instance = rpc_function_get_instance(cookie);
+	rpc_object_t opts = NULL;
+	const char *prefix;
+
+	if (rpc_array_get_count(args) > 0)
+		opts = rpc_array_get_value(args, 0);
+
+	if (opts != NULL && rpc_get_type(opts) != RPC_TYPE_DICTIONARY)
+		opts = NULL;
+
+	prefix = opts != NULL ? rpc_dictionary_get_string(opts, "prefix") :
+	    NULL;
+	if (cursor != NULL)
+		*cursor = opts != NULL ?
+		    rpc_dictionary_get_string(opts, "cursor") : NULL;
+
+	if (limit != NULL) {
+		*limit = opts != NULL ?
+		    rpc_dictionary_get_uint64(opts, "limit") : 0;
+		if (*limit == 0 || *limit > RPC_INSTANCE_PAGE_MAX)
+			*limit = RPC_INSTANCE_PAGE_MAX;
+	}
+
+	if (prefix != NULL)
+		return (g_strdup(prefix));
+
+	if (strlen(rpc_instance_get_path(instance)) > 1)
+		return (g_strdup_printf("%s/",
+		    rpc_instance_get_path(instance)));
+
+	return (g_strdup(""));
+}
+
+static rpc_object_t
+rpc_list_instances(void *cookie, rpc_object_t args)
+{
+	rpc_context_t context = rpc_function_get_context(cookie);
+	rpc_object_t result;
+	rpc_object_t list;
+	const char *cursor;
+	char *prefix;
+	char *next;
+	uint64_t limit;
+	uint64_t gen;
+
+	prefix = rpc_instances_prefix(cookie, args, &cursor, &limit);
+	list = rpc_array_create();
+
+	g_rw_lock_reader_lock(&context->rcx_instance_index_rwlock);
+	next = rpc_instances_page_locked(context, prefix, cursor,
+	    (size_t)limit, list);
+	gen = context->rcx_instance_gen;
+	g_rw_lock_reader_unlock(&context->rcx_instance_index_rwlock);
+
+	result = rpc_object_pack("{v,s,u}",
+	    "instances", list,
+	    "cursor", next,
+	    "generation", gen);
+
+	g_free(next);
+	g_free(prefix);
+	return (result);
+}
+
+/*
+ * Streams the same instances get_instances returns, one fragment each,
+ * taking the lock for one batch at a time so that registering doesn't
+ * wait for a slow consumer.
+ */
+static rpc_object_t
+rpc_stream_instances(void *cookie, rpc_object_t args)
+{
+	rpc_context_t context = rpc_function_get_context(cookie);
+	__block int ret = 0;
+	rpc_object_t batch;
+	char *cursor = NULL;
+	char *prefix;
+	char *next;
+
+	prefix = rpc_instances_prefix(cookie, args, NULL, NULL);
+	if (rpc_function_start_stream(cookie) != 0) {
+		g_free(prefix);
+		return (NULL);
 	}
 
-	g_rw_lock_reader_unlock(&context->rcx_rwlock);
+	do {
+		batch = rpc_array_create();
+		g_rw_lock_reader_lock(&context->rcx_instance_index_rwlock);
+		next = rpc_instances_page_locked(context, prefix, cursor,
+		    RPC_INSTANCE_STREAM_BATCH, batch);
+		g_rw_lock_reader_unlock(&context->rcx_instance_index_rwlock);
+		g_free(cursor);
+		cursor = next;
+
+		rpc_array_apply(batch, ^(size_t idx __unused,
+		    rpc_object_t value) {
+			ret = rpc_function_yield(cookie, rpc_retain(value));
+			return ((bool)(ret == 0));
+		});
+		rpc_release(batch);
+	} while (cursor != NULL && ret == 0);
+
+	g_free(cursor);
 	g_free(prefix);
-	return (list);
+	rpc_function_end(cookie);
+	return (RPC_FUNCTION_STILL_RUNNING);
+}
+
+/*
+ * Instance registry changes past a given generation, so that a client
+ * that listed or streamed the instances can keep up without listing
+ * them all again. Without an argument, it just tells the current
+ * generation. "reset" is set if the changes asked for aren't kept
+ * anymore.
+ */
+static rpc_object_t
+rpc_get_instance_changes(void *cookie, rpc_object_t args)
+{
+	rpc_context_t context = rpc_function_get_context(cookie);
+	struct rpc_instance_change *change;
+	rpc_object_t changes;
+	GList *item;
+	uint64_t since;
+	uint64_t gen;
+	bool reset;
+
+	since = rpc_array_get_count(args) > 0 ?
+	    rpc_array_get_uint64(args, 0) : G_MAXUINT64;
+
+	changes = rpc_array_create();
+	g_rw_lock_reader_lock(&context->rcx_instance_index_rwlock);
+	gen = context->rcx_instance_gen;
+	if (since > gen)
+		since = gen;
+
+	reset = since < context->rcx_instance_log_floor;
+	for (item = g_queue_peek_tail_link(&context->rcx_instance_log);
+	    !reset && item != NULL; item = item->prev) {
+		change = item->data;
+		if (change->ric_gen <= since)
+			break;
+	}
+
+	for (item = item != NULL ? item->next :
+	    g_queue_peek_head_link(&context->rcx_instance_log);
+	    !reset && item != NULL; item = item->next) {
+		change = item->data;
+		rpc_array_append_stolen_value(changes, rpc_object_pack(
+		    "{u,s,s}",
+		    "generation", change->ric_gen,
+		    "change", change->ric_added ? "added" : "removed",
+		    "path", change->ric_path));
+	}
+	g_rw_lock_reader_unlock(&context->rcx_instance_index_rwlock);
+
+	return (rpc_object_pack("{u,b,v}",
+	    "generation", gen,
+	    "reset", reset,
+	    "changes", changes));
+}
+
+/* Called with rcx_instance_index_rwlock held for writing */
+static void
+rpc_instance_log_locked(rpc_context_t context, bool added, const char *path)
+{
+	struct rpc_instance_change *change;
+
+	change = g_malloc(sizeof(*change));
+	change->ric_gen = ++context->rcx_instance_gen;
+	change->ric_added = added;
+	change->ric_path = g_strdup(path);
+	g_queue_push_tail(&context->rcx_instance_log, change);
+
+	if (g_queue_get_length(&context->rcx_instance_log) >
+	    RPC_INSTANCE_LOG_MAX) {
+		change = g_queue_pop_head(&context->rcx_instance_log);
+		context->rcx_instance_log_floor = change->ric_gen;
+		rpc_instance_change_free(change);
+	}
+}
+
+static void
+rpc_instance_change_free(struct rpc_instance_change *change)
+{
+
+	g_free(change->ric_path);
+	g_free(change);
 }
 
 static rpc_object_t
@@ -1384,7 +4443,7 @@ rpc_observable_property_get(void *cookie, rpc_object_t args)
 {
 	rpc_instance_t inst = rpc_function_get_instance(cookie);
 	rpc_object_t result;
-	struct rpc_property_cookie prop;
+	rpc_object_t error = NULL;
 	struct rpc_if_member *member;
 	const char *interface;
 	const char *name;
@@ -1405,14 +4464,9 @@ rpc_observable_property_get(void *cookie, rpc_object_t args)
 		return (NULL);
 	}
 
-	prop.instance = inst;
-	prop.name = name;
-	prop.arg = member->rim_property.rp_arg;
-	prop.error = NULL;
-	result = member->rim_property.rp_getter(&prop);
-
-	if (prop.error != NULL) {
-		rpc_function_error_ex(cookie, prop.error);
+	result = rpc_property_read(inst, member, interface, name, &error);
+	if (error != NULL) {
+		rpc_function_error_ex(cookie, error);
 		return (NULL);
 	}
 
@@ -1465,7 +4519,7 @@ rpc_observable_property_get_all(void *cookie, rpc_object_t args)
 {
 	rpc_instance_t inst = rpc_function_get_instance(cookie);
 	GHashTableIter iter;
-	struct rpc_property_cookie prop;
+	rpc_object_t error;
 	const char *interface;
 	const char *k;
 	struct rpc_if_member *v;
@@ -1504,14 +4558,10 @@ rpc_observable_property_get_all(void *cookie, rpc_object_t args)
 			continue;
 		}
 
-		prop.instance = inst;
-		prop.name = k;
-		prop.arg = v->rim_property.rp_arg;
-		prop.error = NULL;
-		value = v->rim_property.rp_getter(&prop);
-
-		if (prop.error != NULL)
-			value = prop.error;
+		error = NULL;
+		value = rpc_property_read(inst, v, interface, k, &error);
+		if (error != NULL)
+			value = error;
 
 		item = rpc_object_pack(
 		    "<com.twoporeguys.librpc.PropertyDescriptor>{s,v}",
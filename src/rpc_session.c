@@ -0,0 +1,301 @@
+/*
+ * Copyright 2015-2017 Two Pore Guys, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Resumable sessions. A server with RPC_SERVER_SESSION_GRACE set hands
+ * each client a session token right after accepting it. When the
+ * connection goes away, its subscriptions stay behind under that token
+ * for the grace period, collecting the events the client misses. A
+ * client reconnecting with the token gets the subscriptions back and
+ * the missed events replayed, instead of subscribing all over again.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib.h>
+#include <rpc/object.h>
+#include <rpc/server.h>
+#include "internal.h"
+#include "thread.h"
+
+#define	RPC_SESSION_TOKEN_BYTES	16
+
+static bool rpc_session_wants(struct rpc_session *, rpc_object_t);
+static void rpc_session_queue(struct rpc_session *, rpc_object_t);
+static gboolean rpc_session_expire(gpointer);
+static void rpc_session_stop_timer(struct rpc_session *);
+
+static bool
+rpc_session_wants(struct rpc_session *session, rpc_object_t event)
+{
+	__block bool wants = false;
+	const char *path;
+	const char *interface;
+	const char *name;
+
+	path = rpc_dictionary_get_string(event, "path");
+	interface = rpc_dictionary_get_string(event, "interface");
+	name = rpc_dictionary_get_string(event, "name");
+
+	rpc_array_apply(session->rse_subscriptions, ^(size_t idx __unused,
+	    rpc_object_t value) {
+		wants = g_strcmp0(rpc_dictionary_get_string(value, "name"),
+		    name) == 0 &&
+		    g_strcmp0(rpc_dictionary_get_string(value, "interface"),
+		    interface) == 0 &&
+		    rpc_path_matches(rpc_dictionary_get_string(value, "path"),
+		    path);
+
+		return ((bool)!wants);
+	});
+
+	return (wants);
+}
+
+static void
+rpc_session_queue(struct rpc_session *session, rpc_object_t event)
+{
+
+	if (!rpc_session_wants(session, event))
+		return;
+
+	g_mutex_lock(&session->rse_mtx);
+	if (g_queue_get_length(&session->rse_events) >=
+	    RPC_SESSION_MAX_EVENTS) {
+		rpc_release(g_queue_pop_head(&session->rse_events));
+		session->rse_lost = true;
+	}
+
+	g_queue_push_tail(&session->rse_events, rpc_retain(event));
+	g_mutex_unlock(&session->rse_mtx);
+}
+
+static gboolean
+rpc_session_expire(gpointer data)
+{
+	struct rpc_session *session = data;
+	rpc_context_t context = session->rse_context;
+
+	debugf("session %s expired", session->rse_token);
+
+	/* Unless rpc_session_take() got to it first */
+	rpc_rw_lock_writer_lock(&context->rcx_rwlock, RPC_LOCK_CONTEXT);
+	if (g_hash_table_lookup(context->rcx_sessions,
+	    session->rse_token) == session)
+		g_hash_table_remove(context->rcx_sessions, session->rse_token);
+	g_rw_lock_writer_unlock(&context->rcx_rwlock);
+
+	return (G_SOURCE_REMOVE);
+}
+
+static void
+rpc_session_stop_timer(struct rpc_session *session)
+{
+
+	if (session->rse_timer != NULL)
+		g_source_destroy(session->rse_timer);
+}
+
+char *
+rpc_session_token_new(void)
+{
+	uint8_t bytes[RPC_SESSION_TOKEN_BYTES];
+	ssize_t ret = -1;
+	GString *token;
+	int fd;
+	int i;
+
+	/* Tokens stand for a whole session, so they shouldn't be guessable */
+	fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+	if (fd >= 0) {
+		ret = read(fd, bytes, sizeof(bytes));
+		close(fd);
+	}
+
+	if (ret != (ssize_t)sizeof(bytes))
+		return (rpc_generate_v4_uuid());
+
+	token = g_string_sized_new(sizeof(bytes) * 2);
+	for (i = 0; i < RPC_SESSION_TOKEN_BYTES; i++)
+		g_string_append_printf(token, "%02x", bytes[i]);
+
+	return (g_string_free(token, false));
+}
+
+void
+rpc_session_suspend(rpc_connection_t conn)
+{
+	struct rpc_session *session;
+	rpc_server_t server = conn->rco_server;
+	rpc_context_t context = conn->rco_rpc_context;
+
+	if (server == NULL || server->rs_session_grace == 0 ||
+	    conn->rco_session_token == NULL)
+		return;
+
+	session = g_malloc0(sizeof(*session));
+	session->rse_subscriptions = rpc_connection_save_subscriptions(conn);
+	if (rpc_array_get_count(session->rse_subscriptions) == 0) {
+		rpc_release(session->rse_subscriptions);
+		g_free(session);
+		return;
+	}
+
+	session->rse_token = g_strdup(conn->rco_session_token);
+	session->rse_context = context;
+	session->rse_server = server;
+	session->rse_has_creds = conn->rco_has_creds;
+	session->rse_uid = conn->rco_creds.rcc_uid;
+	session->rse_refcnt = 2;
+	g_mutex_init(&session->rse_mtx);
+	g_queue_init(&session->rse_events);
+
+	/* Checked under the same lock rpc_session_drop_server() takes */
+	rpc_rw_lock_writer_lock(&context->rcx_rwlock, RPC_LOCK_CONTEXT);
+	if (server->rs_closed) {
+		g_rw_lock_writer_unlock(&context->rcx_rwlock);
+		session->rse_refcnt = 1;
+		rpc_session_release(session);
+		return;
+	}
+
+	g_hash_table_replace(context->rcx_sessions, session->rse_token,
+	    session);
+
+	session->rse_timer = g_timeout_source_new(server->rs_session_grace);
+	g_source_set_callback(session->rse_timer, rpc_session_expire,
+	    session, (GDestroyNotify)rpc_session_release);
+	g_source_attach(session->rse_timer, server->rs_g_context);
+	g_rw_lock_writer_unlock(&context->rcx_rwlock);
+
+	debugf("suspended session %s of conn %p for %u ms",
+	    session->rse_token, conn, server->rs_session_grace);
+}
+
+struct rpc_session *
+rpc_session_take(rpc_context_t context, const char *token)
+{
+	struct rpc_session *session;
+
+	if (token == NULL)
+		return (NULL);
+
+	rpc_rw_lock_writer_lock(&context->rcx_rwlock, RPC_LOCK_CONTEXT);
+	session = g_hash_table_lookup(context->rcx_sessions, token);
+	if (session != NULL)
+		g_hash_table_steal(context->rcx_sessions, token);
+	g_rw_lock_writer_unlock(&context->rcx_rwlock);
+
+	if (session != NULL)
+		rpc_session_stop_timer(session);
+
+	return (session);
+}
+
+/*
+ * Called with rcx_rwlock held for reading, on events on their way to
+ * the connections subscribed to them; those of @p server only, unless
+ * it's NULL.
+ */
+void
+rpc_session_offer_locked(rpc_context_t context, rpc_server_t server,
+    rpc_object_t event)
+{
+	struct rpc_session *session;
+	GHashTableIter iter;
+
+	if (g_hash_table_size(context->rcx_sessions) == 0)
+		return;
+
+	g_hash_table_iter_init(&iter, context->rcx_sessions);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&session)) {
+		if (server != NULL && session->rse_server != server)
+			continue;
+
+		if (rpc_get_type(event) != RPC_TYPE_ARRAY) {
+			rpc_session_queue(session, event);
+			continue;
+		}
+
+		rpc_array_apply(event, ^(size_t idx __unused,
+		    rpc_object_t value) {
+			rpc_session_queue(session, value);
+			return ((bool)true);
+		});
+	}
+}
+
+void
+rpc_session_drop_server(rpc_server_t server)
+{
+	struct rpc_session *session;
+	rpc_context_t context = server->rs_context;
+	GHashTableIter iter;
+	GPtrArray *dropped;
+	guint i;
+
+	dropped = g_ptr_array_new();
+	rpc_rw_lock_writer_lock(&context->rcx_rwlock, RPC_LOCK_CONTEXT);
+	g_hash_table_iter_init(&iter, context->rcx_sessions);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&session)) {
+		if (session->rse_server != server)
+			continue;
+
+		g_hash_table_iter_steal(&iter);
+		g_ptr_array_add(dropped, session);
+	}
+	g_rw_lock_writer_unlock(&context->rcx_rwlock);
+
+	for (i = 0; i < dropped->len; i++) {
+		session = g_ptr_array_index(dropped, i);
+		rpc_session_stop_timer(session);
+		rpc_session_release(session);
+	}
+
+	g_ptr_array_free(dropped, true);
+}
+
+void
+rpc_session_release(struct rpc_session *session)
+{
+
+	if (!g_atomic_int_dec_and_test(&session->rse_refcnt))
+		return;
+
+	if (session->rse_timer != NULL)
+		g_source_unref(session->rse_timer);
+
+	while (!g_queue_is_empty(&session->rse_events))
+		rpc_release(g_queue_pop_head(&session->rse_events));
+
+	rpc_release(session->rse_subscriptions);
+	g_mutex_clear(&session->rse_mtx);
+	g_free(session->rse_token);
+	g_free(session);
+}
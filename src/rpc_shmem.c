@@ -0,0 +1,577 @@
+/*
+ * Copyright 2015-2017 Two Pore Guys, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <glib.h>
+#include <rpc/object.h>
+#include "internal.h"
+#include "memfd.h"
+
+#define	RPC_SHMEM_CACHE_IDLE	16
+#define	RPC_SHMEM_HUGEPAGE_SIZE	(2 * 1024 * 1024)
+
+#ifndef MPOL_BIND
+#define	MPOL_BIND		2
+#endif
+
+struct rpc_shmem_mapping
+{
+	dev_t			rsm_dev;
+	ino_t			rsm_ino;
+	void *			rsm_addr;
+	size_t			rsm_size;
+	int			rsm_refcnt;
+};
+
+struct rpc_shmem_extent
+{
+	off_t			rse_offset;
+	size_t			rse_size;
+};
+
+struct rpc_shmem_pool
+{
+	int			rsp_fd;
+	void *			rsp_addr;
+	size_t			rsp_size;
+	GMutex			rsp_mtx;
+	GList *			rsp_free;
+	GHashTable *		rsp_used;
+};
+
+static void rpc_shmem_cache_trim_locked(void);
+static GList *rpc_shmem_cache_find_locked(const void *);
+static void rpc_shmem_pool_insert_free(struct rpc_shmem_pool *, off_t, size_t);
+static size_t rpc_shmem_hugepage_size(void);
+static int rpc_shmem_bind_node(int, size_t, int);
+
+static GMutex rpc_shmem_cache_mtx;
+static GQueue rpc_shmem_cache = G_QUEUE_INIT;
+
+/*
+ * Mapping cache: every distinct shared memory file (identified by device
+ * and inode, so that dup'ed or re-received descriptors hit the same entry)
+ * is mapped once in full. rpc_shmem_map() then hands out pointers into that
+ * mapping. Unreferenced mappings are kept around, most recently used first,
+ * so that map/unmap cycles on the same region do not go back to the kernel.
+ */
+static void
+rpc_shmem_cache_trim_locked(void)
+{
+	struct rpc_shmem_mapping *mapping;
+	GList *iter;
+	GList *prev;
+	guint idle = 0;
+
+	for (iter = rpc_shmem_cache.head; iter != NULL; iter = iter->next) {
+		mapping = iter->data;
+		if (mapping->rsm_refcnt == 0)
+			idle++;
+	}
+
+	for (iter = rpc_shmem_cache.tail; iter != NULL && idle >
+	    RPC_SHMEM_CACHE_IDLE; iter = prev) {
+		prev = iter->prev;
+		mapping = iter->data;
+		if (mapping->rsm_refcnt != 0)
+			continue;
+
+		munmap(mapping->rsm_addr, mapping->rsm_size);
+		g_queue_delete_link(&rpc_shmem_cache, iter);
+		g_free(mapping);
+		idle--;
+	}
+}
+
+static GList *
+rpc_shmem_cache_find_locked(const void *addr)
+{
+	struct rpc_shmem_mapping *mapping;
+	GList *iter;
+
+	for (iter = rpc_shmem_cache.head; iter != NULL; iter = iter->next) {
+		mapping = iter->data;
+		if ((const uint8_t *)addr >= (uint8_t *)mapping->rsm_addr &&
+		    (const uint8_t *)addr < (uint8_t *)mapping->rsm_addr +
+		    mapping->rsm_size)
+			return (iter);
+	}
+
+	return (NULL);
+}
+
+void *
+rpc_shmem_cache_map(int fd, off_t offset, size_t size)
+{
+	struct rpc_shmem_mapping *mapping;
+	struct stat st;
+	GList *iter;
+	void *addr;
+	int seals;
+	int prot = PROT_READ | PROT_WRITE;
+
+	if (fstat(fd, &st) != 0)
+		return (MAP_FAILED);
+
+	/* A write-sealed file rejects writable shared mappings */
+	seals = fcntl(fd, F_GET_SEALS);
+	if (seals > 0 && (seals & (F_SEAL_WRITE | F_SEAL_FUTURE_WRITE)))
+		prot = PROT_READ;
+
+	if (offset < 0 || (size_t)offset + size > (size_t)st.st_size) {
+		errno = EINVAL;
+		return (MAP_FAILED);
+	}
+
+	g_mutex_lock(&rpc_shmem_cache_mtx);
+	for (iter = rpc_shmem_cache.head; iter != NULL; iter = iter->next) {
+		mapping = iter->data;
+		if (mapping->rsm_dev != st.st_dev ||
+		    mapping->rsm_ino != st.st_ino)
+			continue;
+
+		/* The file has grown past what we mapped; map it again */
+		if ((size_t)offset + size > mapping->rsm_size)
+			continue;
+
+		mapping->rsm_refcnt++;
+		g_queue_unlink(&rpc_shmem_cache, iter);
+		g_queue_push_head_link(&rpc_shmem_cache, iter);
+		g_mutex_unlock(&rpc_shmem_cache_mtx);
+		return ((uint8_t *)mapping->rsm_addr + offset);
+	}
+
+	addr = mmap(NULL, (size_t)st.st_size, prot, MAP_SHARED, fd, 0);
+	if (addr == MAP_FAILED) {
+		g_mutex_unlock(&rpc_shmem_cache_mtx);
+		return (MAP_FAILED);
+	}
+
+	mapping = g_malloc0(sizeof(*mapping));
+	mapping->rsm_dev = st.st_dev;
+	mapping->rsm_ino = st.st_ino;
+	mapping->rsm_addr = addr;
+	mapping->rsm_size = (size_t)st.st_size;
+	mapping->rsm_refcnt = 1;
+	g_queue_push_head(&rpc_shmem_cache, mapping);
+	rpc_shmem_cache_trim_locked();
+	g_mutex_unlock(&rpc_shmem_cache_mtx);
+
+	return ((uint8_t *)addr + offset);
+}
+
+void
+rpc_shmem_cache_unmap(void *addr)
+{
+	struct rpc_shmem_mapping *mapping;
+	GList *iter;
+
+	g_mutex_lock(&rpc_shmem_cache_mtx);
+	iter = rpc_shmem_cache_find_locked(addr);
+	if (iter == NULL) {
+		g_mutex_unlock(&rpc_shmem_cache_mtx);
+		return;
+	}
+
+	mapping = iter->data;
+	g_assert(mapping->rsm_refcnt > 0);
+	mapping->rsm_refcnt--;
+	rpc_shmem_cache_trim_locked();
+	g_mutex_unlock(&rpc_shmem_cache_mtx);
+}
+
+/*
+ * Drops idle cached mappings of the file behind @p fd. Fails with EBUSY
+ * if the file is still mapped by somebody.
+ */
+int
+rpc_shmem_cache_evict(int fd)
+{
+	struct rpc_shmem_mapping *mapping;
+	struct stat st;
+	GList *iter;
+	GList *next;
+	int ret = 0;
+
+	if (fstat(fd, &st) != 0)
+		return (-1);
+
+	g_mutex_lock(&rpc_shmem_cache_mtx);
+	for (iter = rpc_shmem_cache.head; iter != NULL; iter = next) {
+		next = iter->next;
+		mapping = iter->data;
+		if (mapping->rsm_dev != st.st_dev ||
+		    mapping->rsm_ino != st.st_ino)
+			continue;
+
+		if (mapping->rsm_refcnt != 0) {
+			errno = EBUSY;
+			ret = -1;
+			continue;
+		}
+
+		munmap(mapping->rsm_addr, mapping->rsm_size);
+		g_queue_delete_link(&rpc_shmem_cache, iter);
+		g_free(mapping);
+	}
+	g_mutex_unlock(&rpc_shmem_cache_mtx);
+
+	return (ret);
+}
+
+static size_t
+rpc_shmem_hugepage_size(void)
+{
+	static gsize hugepage_size = 0;
+	unsigned long kb;
+	char line[128];
+	FILE *f;
+
+	if (g_once_init_enter(&hugepage_size)) {
+		kb = 0;
+		f = fopen("/proc/meminfo", "r");
+		if (f != NULL) {
+			while (fgets(line, sizeof(line), f) != NULL) {
+				if (sscanf(line, "Hugepagesize: %lu kB",
+				    &kb) == 1)
+					break;
+			}
+
+			fclose(f);
+		}
+
+		g_once_init_leave(&hugepage_size,
+		    kb != 0 ? kb * 1024 : RPC_SHMEM_HUGEPAGE_SIZE);
+	}
+
+	return (hugepage_size);
+}
+
+/*
+ * Sets the shared memory policy of the whole file. For tmpfs and
+ * hugetlbfs the policy belongs to the file, so it outlives this
+ * temporary mapping and applies to whoever faults the pages in.
+ */
+static int
+rpc_shmem_bind_node(int fd, size_t size, int node)
+{
+	unsigned long mask[(node / (8 * sizeof(unsigned long))) + 1];
+	void *addr;
+	long ret;
+
+	memset(mask, 0, sizeof(mask));
+	mask[node / (8 * sizeof(unsigned long))] =
+	    1UL << (node % (8 * sizeof(unsigned long)));
+
+	addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (addr == MAP_FAILED)
+		return (-1);
+
+	ret = syscall(__NR_mbind, addr, size, MPOL_BIND, mask,
+	    (unsigned long)node + 2, 0);
+	munmap(addr, size);
+	return (ret == 0 ? 0 : -1);
+}
+
+rpc_object_t
+rpc_shmem_create_ex(size_t size, int flags)
+{
+	union rpc_value val;
+	unsigned int mfd_flags = 0;
+	size_t granule;
+	size_t fsize;
+	int node;
+	int fd;
+
+	if (size == 0) {
+		rpc_set_last_errorf(EINVAL, "Size cannot be zero");
+		return (NULL);
+	}
+
+	granule = (size_t)sysconf(_SC_PAGESIZE);
+	if (flags & RPC_SHMEM_HUGETLB) {
+		mfd_flags |= MFD_HUGETLB;
+		granule = rpc_shmem_hugepage_size();
+	}
+
+	if (flags & RPC_SHMEM_SEALABLE)
+		mfd_flags |= MFD_ALLOW_SEALING;
+
+	fsize = (size + granule - 1) & ~(granule - 1);
+	fd = memfd_create("librpc", mfd_flags);
+	if (fd < 0) {
+		rpc_set_last_errorf(errno, "Cannot create memfd: %s",
+		    g_strerror(errno));
+		return (NULL);
+	}
+
+	if (ftruncate(fd, (off_t)fsize) != 0) {
+		rpc_set_last_errorf(errno, "Cannot resize memfd: %s",
+		    g_strerror(errno));
+		goto fail;
+	}
+
+	if (flags & RPC_SHMEM_NUMA_BIND) {
+		node = (flags >> 16) & 0xffff;
+		if (rpc_shmem_bind_node(fd, fsize, node) != 0) {
+			rpc_set_last_errorf(errno,
+			    "Cannot bind memory to NUMA node %d: %s", node,
+			    g_strerror(errno));
+			goto fail;
+		}
+	}
+
+	if ((flags & RPC_SHMEM_SEALABLE) &&
+	    fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW) != 0) {
+		rpc_set_last_errorf(errno, "Cannot seal memfd: %s",
+		    g_strerror(errno));
+		goto fail;
+	}
+
+	val.rv_shmem.rsb_fd = fd;
+	val.rv_shmem.rsb_offset = 0;
+	val.rv_shmem.rsb_size = size;
+	val.rv_shmem.rsb_region = 0;
+	return (rpc_prim_create(RPC_TYPE_SHMEM, val));
+
+fail:
+	close(fd);
+	return (NULL);
+}
+
+int
+rpc_shmem_seal(rpc_object_t shmem)
+{
+	int fd;
+
+	if (shmem == NULL || rpc_get_type(shmem) != RPC_TYPE_SHMEM) {
+		rpc_set_last_errorf(EINVAL, "Not a shared memory object");
+		return (-1);
+	}
+
+	fd = rpc_shmem_get_fd(shmem);
+
+	/* Idle cached mappings are writable and would block the seal */
+	if (rpc_shmem_cache_evict(fd) != 0) {
+		rpc_set_last_errorf(errno, "Shared memory is still mapped");
+		return (-1);
+	}
+
+	if (fcntl(fd, F_ADD_SEALS, F_SEAL_WRITE | F_SEAL_SEAL) != 0) {
+		rpc_set_last_errorf(errno, "Cannot seal shared memory: %s",
+		    g_strerror(errno));
+		return (-1);
+	}
+
+	return (0);
+}
+
+static void
+rpc_shmem_pool_insert_free(struct rpc_shmem_pool *pool, off_t offset,
+    size_t size)
+{
+	struct rpc_shmem_extent *extent;
+	struct rpc_shmem_extent *neigh;
+	GList *iter;
+	GList *next;
+
+	for (iter = pool->rsp_free; iter != NULL; iter = iter->next) {
+		neigh = iter->data;
+		if (neigh->rse_offset > offset)
+			break;
+	}
+
+	extent = g_malloc0(sizeof(*extent));
+	extent->rse_offset = offset;
+	extent->rse_size = size;
+	pool->rsp_free = g_list_insert_before(pool->rsp_free, iter, extent);
+	iter = g_list_find(pool->rsp_free, extent);
+
+	/* Coalesce with the following extent */
+	next = iter->next;
+	if (next != NULL) {
+		neigh = next->data;
+		if (extent->rse_offset + (off_t)extent->rse_size ==
+		    neigh->rse_offset) {
+			extent->rse_size += neigh->rse_size;
+			pool->rsp_free = g_list_delete_link(pool->rsp_free,
+			    next);
+			g_free(neigh);
+		}
+	}
+
+	/* Coalesce with the preceding extent */
+	if (iter->prev != NULL) {
+		neigh = iter->prev->data;
+		if (neigh->rse_offset + (off_t)neigh->rse_size ==
+		    extent->rse_offset) {
+			neigh->rse_size += extent->rse_size;
+			pool->rsp_free = g_list_delete_link(pool->rsp_free,
+			    iter);
+			g_free(extent);
+		}
+	}
+}
+
+rpc_shmem_pool_t
+rpc_shmem_pool_create(size_t size)
+{
+	struct rpc_shmem_pool *pool;
+	size_t pagesize = (size_t)sysconf(_SC_PAGESIZE);
+	int fd;
+
+	if (size == 0) {
+		rpc_set_last_errorf(EINVAL, "Pool size cannot be zero");
+		return (NULL);
+	}
+
+	size = (size + pagesize - 1) & ~(pagesize - 1);
+	fd = memfd_create("librpc-pool", 0);
+	if (fd < 0) {
+		rpc_set_last_errorf(errno, "Cannot create memfd: %s",
+		    g_strerror(errno));
+		return (NULL);
+	}
+
+	if (ftruncate(fd, (off_t)size) != 0) {
+		rpc_set_last_errorf(errno, "Cannot resize memfd: %s",
+		    g_strerror(errno));
+		close(fd);
+		return (NULL);
+	}
+
+	pool = g_malloc0(sizeof(*pool));
+	pool->rsp_fd = fd;
+	pool->rsp_size = size;
+
+	/* Holding a reference pins the mapping for the pool's lifetime */
+	pool->rsp_addr = rpc_shmem_cache_map(fd, 0, size);
+	if (pool->rsp_addr == MAP_FAILED) {
+		rpc_set_last_errorf(errno, "Cannot map pool: %s",
+		    g_strerror(errno));
+		close(fd);
+		g_free(pool);
+		return (NULL);
+	}
+
+	g_mutex_init(&pool->rsp_mtx);
+	pool->rsp_used = g_hash_table_new(NULL, NULL);
+	rpc_shmem_pool_insert_free(pool, 0, size);
+	return (pool);
+}
+
+void
+rpc_shmem_pool_destroy(rpc_shmem_pool_t pool)
+{
+
+	if (pool == NULL)
+		return;
+
+	rpc_shmem_cache_unmap(pool->rsp_addr);
+	close(pool->rsp_fd);
+	g_list_free_full(pool->rsp_free, g_free);
+	g_hash_table_destroy(pool->rsp_used);
+	g_mutex_clear(&pool->rsp_mtx);
+	g_free(pool);
+}
+
+rpc_object_t
+rpc_shmem_pool_alloc(rpc_shmem_pool_t pool, size_t size)
+{
+	struct rpc_shmem_extent *extent;
+	size_t pagesize = (size_t)sysconf(_SC_PAGESIZE);
+	size_t rounded;
+	off_t offset;
+	GList *iter;
+
+	if (size == 0) {
+		rpc_set_last_errorf(EINVAL, "Allocation size cannot be zero");
+		return (NULL);
+	}
+
+	/* Keep slices page aligned so they can also be mmap'ed on their own */
+	rounded = (size + pagesize - 1) & ~(pagesize - 1);
+
+	g_mutex_lock(&pool->rsp_mtx);
+	for (iter = pool->rsp_free; iter != NULL; iter = iter->next) {
+		extent = iter->data;
+		if (extent->rse_size >= rounded)
+			break;
+	}
+
+	if (iter == NULL) {
+		g_mutex_unlock(&pool->rsp_mtx);
+		rpc_set_last_errorf(ENOMEM, "Shared memory pool exhausted");
+		return (NULL);
+	}
+
+	offset = extent->rse_offset;
+	extent->rse_offset += (off_t)rounded;
+	extent->rse_size -= rounded;
+	if (extent->rse_size == 0) {
+		pool->rsp_free = g_list_delete_link(pool->rsp_free, iter);
+		g_free(extent);
+	}
+
+	g_hash_table_insert(pool->rsp_used, GSIZE_TO_POINTER(offset),
+	    GSIZE_TO_POINTER(rounded));
+	g_mutex_unlock(&pool->rsp_mtx);
+
+	return (rpc_shmem_recreate(pool->rsp_fd, offset, size));
+}
+
+void
+rpc_shmem_pool_free(rpc_shmem_pool_t pool, rpc_object_t shmem)
+{
+	gpointer size;
+	off_t offset;
+
+	if (shmem == NULL || rpc_get_type(shmem) != RPC_TYPE_SHMEM)
+		return;
+
+	if (rpc_shmem_get_fd(shmem) != pool->rsp_fd)
+		return;
+
+	offset = rpc_shmem_get_offset(shmem);
+	g_mutex_lock(&pool->rsp_mtx);
+	if (!g_hash_table_lookup_extended(pool->rsp_used,
+	    GSIZE_TO_POINTER(offset), NULL, &size)) {
+		g_mutex_unlock(&pool->rsp_mtx);
+		return;
+	}
+
+	g_hash_table_remove(pool->rsp_used, GSIZE_TO_POINTER(offset));
+	rpc_shmem_pool_insert_free(pool, offset, GPOINTER_TO_SIZE(size));
+	g_mutex_unlock(&pool->rsp_mtx);
+}
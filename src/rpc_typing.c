@@ -25,11 +25,14 @@
  */
 
 #include <errno.h>
+#include <sys/stat.h>
 #include <glib.h>
 #include <yaml.h>
 #include <rpc/object.h>
 #include <rpc/serializer.h>
 #include "internal.h"
+#include "serializer/yaml.h"
+#include "serializer/msgpack.h"
 
 #define SYSTEM_IDL_PATH		TOSTRING(RPC_PREFIX) "/share/idl"
 
@@ -39,15 +42,47 @@ static int rpct_lookup_type(const char *, const char **, rpc_object_t *,
 static struct rpct_type *rpct_find_type(const char *);
 static struct rpct_type *rpct_find_type_fuzzy(const char *, struct rpct_file *);
 static rpc_object_t rpct_stream_idl(void *, rpc_object_t);
+static rpc_object_t rpct_idl_digest(void *, rpc_object_t);
+static char *rpct_idl_cache_path(const char *);
+static int rpct_read_idl_cache(const char *);
+static int rpct_fetch_idl(rpc_connection_t, rpc_object_t);
 static int rpct_check_fields(rpc_object_t, ...);
 #if 0
 static inline bool rpct_type_is_fully_specialized(struct rpct_typei *inst);
 #endif
-static inline struct rpct_typei *rpct_unwind_typei(struct rpct_typei *);
 static char *rpct_canonical_type(struct rpct_typei *);
 static int rpct_read_type(struct rpct_file *, const char *, rpc_object_t);
 static int rpct_parse_type(const char *, GPtrArray *);
 static void rpct_interface_free(struct rpct_interface *);
+static rpc_object_t rpct_serialize_shared(rpc_object_t);
+static rpc_object_t rpct_read_compiled(const char *);
+static rpc_object_t rpct_read_yaml(const char *);
+static rpc_object_t rpct_parse_file(const char *);
+static void rpct_parse_worker(gpointer, gpointer);
+static int rpct_collect_files(const char *, GPtrArray *);
+static void rpct_index_file(struct rpct_file *);
+static void rpct_materialize_all(void);
+static struct rpct_if_member *rpct_call_member(struct rpc_call *);
+static struct rpct_validation_plan *rpct_compile_plan(struct rpct_typei *,
+    rpc_object_t);
+static struct rpct_validation_plan *rpct_get_plan(struct rpct_typei *,
+    rpc_object_t);
+static uint32_t rpct_compact_id(const char *);
+static const char *rpct_compact_find_name(uint32_t);
+static gint rpct_compact_cmp(gconstpointer, gconstpointer);
+static void rpct_compact_type_free(struct rpct_compact_type *);
+static struct rpct_compact_type *rpct_compact_type_locked(struct rpct_type *);
+static rpc_object_t rpct_deserialize_compact(rpc_object_t);
+static struct rpct_typei *rpct_resolve_type_id(rpc_object_t, const char *);
+static bool rpct_typei_concrete(struct rpct_typei *);
+static struct rpct_typei *rpct_derived_lookup(struct rpct_typei *,
+    const char *);
+static void rpct_derived_insert(struct rpct_typei *, const char *,
+    struct rpct_typei *);
+static bool rpct_typei_check_compatible(struct rpct_typei *,
+    struct rpct_typei *);
+static guint rpct_typei_pair_hash(gconstpointer);
+static gboolean rpct_typei_pair_equal(gconstpointer, gconstpointer);
 
 static GRegex *rpct_instance_regex = NULL;
 static GRegex *rpct_interface_regex = NULL;
@@ -57,6 +92,10 @@ static GRegex *rpct_property_regex = NULL;
 static GRegex *rpct_event_regex = NULL;
 
 static struct rpct_context *context = NULL;
+static bool rpct_lazy = false;
+static guint rpct_error_limit = 0;
+static GPrivate rpct_compact_mode;
+static GPrivate rpct_type_table_current;
 static const char *builtin_types[] = {
 	"nulltype",
 	"bool",
@@ -77,6 +116,7 @@ static const char *builtin_types[] = {
 
 static const struct rpc_if_member rpct_typing_vtable[] = {
 	RPC_METHOD(download, rpct_stream_idl),
+	RPC_METHOD(digest, rpct_idl_digest),
 	RPC_MEMBER_END
 };
 
@@ -254,6 +294,8 @@ rpct_find_type(const char *name)
 	struct rpct_file *file;
 	rpct_type_t type = NULL;
 
+	/* Recursive: loading a type looks up the types it refers to */
+	g_rec_mutex_lock(&context->lock);
 	type = g_hash_table_lookup(context->types, name);
 
 	if (type == NULL) {
@@ -272,8 +314,8 @@ rpct_find_type(const char *name)
 			debugf("successfully chain-loaded %s", name);
 	}
 
+	g_rec_mutex_unlock(&context->lock);
 	return (type);
-
 }
 
 static rpc_object_t
@@ -293,6 +335,62 @@ rpct_stream_idl(void *cookie, rpc_object_t args __unused)
 	return (NULL);
 }
 
+static rpc_object_t
+rpct_idl_digest(void *cookie __unused, rpc_object_t args __unused)
+{
+	char *digest;
+
+	digest = rpct_get_idl_digest();
+	return (rpc_string_create_len(digest, strlen(digest)));
+}
+
+char *
+rpct_get_idl_digest(void)
+{
+	GChecksum *checksum;
+	GList *names;
+	GList *iter;
+	struct rpct_file *file;
+	void *frame;
+	size_t len;
+	char *result;
+
+	g_mutex_lock(&context->idl_lock);
+	if (context->idl_digest != NULL) {
+		result = g_strdup(context->idl_digest);
+		g_mutex_unlock(&context->idl_lock);
+		return (result);
+	}
+
+	/* Sorted by name, so the digest doesn't depend on load order */
+	g_rec_mutex_lock(&context->lock);
+	names = g_list_sort(g_hash_table_get_keys(context->files),
+	    (GCompareFunc)strcmp);
+	checksum = g_checksum_new(G_CHECKSUM_SHA256);
+
+	for (iter = names; iter != NULL; iter = iter->next) {
+		file = g_hash_table_lookup(context->files, iter->data);
+		g_checksum_update(checksum, (const guchar *)file->path,
+		    (gssize)strlen(file->path) + 1);
+
+		if (rpc_serializer_dump("msgpack", file->body, &frame,
+		    &len) == 0) {
+			g_checksum_update(checksum, frame, (gssize)len);
+			free(frame);
+		}
+	}
+
+	g_rec_mutex_unlock(&context->lock);
+
+	context->idl_digest = g_strdup(g_checksum_get_string(checksum));
+	result = g_strdup(context->idl_digest);
+	g_mutex_unlock(&context->idl_lock);
+
+	g_checksum_free(checksum);
+	g_list_free(names);
+	return (result);
+}
+
 static int
 rpct_read_meta(struct rpct_file *file, rpc_object_t obj)
 {
@@ -330,6 +428,73 @@ rpct_read_meta(struct rpct_file *file, rpc_object_t obj)
 	return (ret >= 3 ? 0 : -1);
 }
 
+/*
+ * A concrete instance has no type variable left anywhere in it, so its
+ * canonical form says all there is to it and it can be shared.
+ */
+static bool
+rpct_typei_concrete(struct rpct_typei *typei)
+{
+	GHashTableIter iter;
+	struct rpct_typei *subtype;
+
+	if (typei->proxy || typei->type == NULL)
+		return (false);
+
+	g_hash_table_iter_init(&iter, typei->specializations);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&subtype)) {
+		if (!rpct_typei_concrete(subtype))
+			return (false);
+	}
+
+	return (true);
+}
+
+/*
+ * Declarations instantiated in context of a parent instance, eg. the
+ * members of a struct or the values of a container, always resolve to
+ * the same thing for that parent. Concrete results are remembered on
+ * the parent, so the next lookup skips parsing the declaration.
+ */
+static struct rpct_typei *
+rpct_derived_lookup(struct rpct_typei *parent, const char *decl)
+{
+	struct rpct_typei *ret = NULL;
+
+	g_rw_lock_reader_lock(&context->typei_cache_lock);
+	if (parent->derived != NULL) {
+		ret = g_hash_table_lookup(parent->derived, decl);
+		if (ret != NULL)
+			rpct_typei_retain(ret);
+	}
+
+	g_rw_lock_reader_unlock(&context->typei_cache_lock);
+	return (ret);
+}
+
+static void
+rpct_derived_insert(struct rpct_typei *parent, const char *decl,
+    struct rpct_typei *typei)
+{
+
+	/* Recursive types would keep themselves alive */
+	if (typei == parent || !typei->cached)
+		return;
+
+	g_rw_lock_writer_lock(&context->typei_cache_lock);
+	if (parent->derived == NULL) {
+		parent->derived = g_hash_table_new_full(g_str_hash,
+		    g_str_equal, g_free, (GDestroyNotify)rpct_typei_release);
+	}
+
+	if (!g_hash_table_contains(parent->derived, decl)) {
+		g_hash_table_insert(parent->derived, g_strdup(decl),
+		    rpct_typei_retain(typei));
+	}
+
+	g_rw_lock_writer_unlock(&context->typei_cache_lock);
+}
+
 struct rpct_typei *
 rpct_instantiate_type(const char *decl, struct rpct_typei *parent,
     struct rpct_type *ptype, struct rpct_file *origin)
@@ -341,8 +506,11 @@ rpct_instantiate_type(const char *decl, struct rpct_typei *parent,
 	struct rpct_typei *ret = NULL;
 	struct rpct_typei *subtype;
 	char *decltype = NULL;
+	struct rpct_typei *cached;
 	char *declvars = NULL;
 	int found_proxy_type = -1;
+	bool fresh = false;
+	bool derived;
 
 	debugf("instantiating type %s", decl);
 
@@ -351,6 +519,29 @@ rpct_instantiate_type(const char *decl, struct rpct_typei *parent,
 		return (NULL);
 	}
 
+	derived = parent != NULL && ptype == parent->type &&
+	    origin == parent->type->file;
+	if (derived) {
+		ret = rpct_derived_lookup(parent, decl);
+		if (ret != NULL)
+			return (ret);
+	}
+
+	if (parent == NULL && origin == NULL) {
+		/*
+		 * Context-free lookup of a declaration that is already
+		 * in canonical form: skip parsing and resolution.
+		 */
+		g_rw_lock_reader_lock(&context->typei_cache_lock);
+		ret = g_hash_table_lookup(context->typei_cache, decl);
+		if (ret != NULL)
+			rpct_typei_retain(ret);
+
+		g_rw_lock_reader_unlock(&context->typei_cache_lock);
+		if (ret != NULL)
+			return (ret);
+	}
+
 	if (!g_regex_match(rpct_instance_regex, decl, 0, &match)) {
 		rpc_set_last_errorf(EINVAL, "Invalid type specification: %s",
 		    decl);
@@ -372,11 +563,19 @@ rpct_instantiate_type(const char *decl, struct rpct_typei *parent,
 		 * up in the cache
 		 */
 
+		g_rw_lock_reader_lock(&context->typei_cache_lock);
 		ret = g_hash_table_lookup(context->typei_cache, decltype);
+		if (ret != NULL)
+			rpct_typei_retain(ret);
+
+		g_rw_lock_reader_unlock(&context->typei_cache_lock);
 		if (ret != NULL) {
+			if (derived)
+				rpct_derived_insert(parent, decl, ret);
+
 			g_free(decltype);
 			g_match_info_free(match);
-			return (rpct_typei_retain(ret));
+			return (ret);
 		}
 	}
 
@@ -426,6 +625,7 @@ rpct_instantiate_type(const char *decl, struct rpct_typei *parent,
 	ret->refcnt = 1;
 	ret->type = type;
 	ret->parent = parent;
+	fresh = true;
 	ret->specializations = g_hash_table_new_full(g_str_hash, g_str_equal,
 	    g_free, (GDestroyNotify)rpct_typei_release);
 	ret->constraints = type->constraints;
@@ -489,15 +689,50 @@ done:
 	if (declvars != NULL)
 		g_free(declvars);
 
-	if (ret != NULL && ret->type != NULL && !ret->type->generic) {
-		rpct_typei_retain(ret);
+	if (ret == NULL || !fresh || !rpct_typei_concrete(ret))
+		return (ret);
+
+	/*
+	 * Concrete specializations of generic types are cached too. They
+	 * resolve their own variables, so they don't need the parent they
+	 * happened to be instantiated in. If another thread got there first,
+	 * its instance wins, so equal types stay a pointer compare.
+	 */
+	g_rw_lock_writer_lock(&context->typei_cache_lock);
+	cached = g_hash_table_lookup(context->typei_cache, ret->canonical_form);
+	if (cached == NULL) {
+		if (ret->type->generic)
+			ret->parent = NULL;
+
+		ret->cached = true;
 		g_hash_table_insert(context->typei_cache,
-		    g_strdup(ret->canonical_form), ret);
+		    g_strdup(ret->canonical_form), rpct_typei_retain(ret));
+	} else
+		rpct_typei_retain(cached);
+
+	g_rw_lock_writer_unlock(&context->typei_cache_lock);
+
+	if (cached != NULL) {
+		rpct_typei_release(ret);
+		ret = cached;
 	}
 
+	if (derived)
+		rpct_derived_insert(parent, decl, ret);
+
 	return (ret);
 }
 
+struct rpct_typei *
+rpct_builtin_typei(rpc_type_t type)
+{
+
+	if (type >= RPCT_BUILTIN_COUNT || context->builtin_typei[type] == NULL)
+		return (rpct_new_typei(rpc_get_type_name(type)));
+
+	return (rpct_typei_retain(context->builtin_typei[type]));
+}
+
 static struct rpct_typei *
 rpct_instantiate_member(struct rpct_member *member, struct rpct_typei *parent)
 {
@@ -506,6 +741,7 @@ rpct_instantiate_member(struct rpct_member *member, struct rpct_typei *parent)
 	ret = rpct_instantiate_type(member->type->canonical_form,
 	    parent, parent->type, parent->type->file);
 	ret->constraints = member->constraints;
+	g_atomic_int_inc(&ret->constraints_gen);
 	return (ret);
 }
 
@@ -580,7 +816,7 @@ rpct_type_is_fully_specialized(struct rpct_typei *inst)
 }
 #endif
 
-static inline struct rpct_typei *
+struct rpct_typei *
 rpct_unwind_typei(struct rpct_typei *typei)
 {
 	struct rpct_typei *current = typei;
@@ -598,8 +834,67 @@ rpct_unwind_typei(struct rpct_typei *typei)
 	return (NULL);
 }
 
+struct rpct_typei_pair
+{
+	struct rpct_typei *	decl;
+	struct rpct_typei *	type;
+};
+
+static guint
+rpct_typei_pair_hash(gconstpointer key)
+{
+	const struct rpct_typei_pair *pair = key;
+
+	return (g_direct_hash(pair->decl) * 31 + g_direct_hash(pair->type));
+}
+
+static gboolean
+rpct_typei_pair_equal(gconstpointer a, gconstpointer b)
+{
+	const struct rpct_typei_pair *pa = a;
+	const struct rpct_typei_pair *pb = b;
+
+	return (pa->decl == pb->decl && pa->type == pb->type);
+}
+
+/*
+ * Cached instances live until rpct_free(), so the result for a pair of
+ * them can be remembered by address. Others might be freed and their
+ * address reused, and are always checked.
+ */
 bool
 rpct_typei_is_compatible(struct rpct_typei *decl, struct rpct_typei *type)
+{
+	struct rpct_typei_pair key = { decl, type };
+	struct rpct_typei_pair *pair;
+	gpointer value;
+	bool compatible;
+
+	if (decl == type)
+		return (true);
+
+	if (!decl->cached || !type->cached)
+		return (rpct_typei_check_compatible(decl, type));
+
+	g_rw_lock_reader_lock(&context->compat_lock);
+	value = g_hash_table_lookup(context->compat_cache, &key);
+	g_rw_lock_reader_unlock(&context->compat_lock);
+	if (value != NULL)
+		return (GPOINTER_TO_INT(value) == 2);
+
+	compatible = rpct_typei_check_compatible(decl, type);
+	pair = g_memdup(&key, sizeof(key));
+
+	g_rw_lock_writer_lock(&context->compat_lock);
+	g_hash_table_insert(context->compat_cache, pair,
+	    GINT_TO_POINTER(compatible ? 2 : 1));
+	g_rw_lock_writer_unlock(&context->compat_lock);
+
+	return (compatible);
+}
+
+static bool
+rpct_typei_check_compatible(struct rpct_typei *decl, struct rpct_typei *type)
 {
 	struct rpct_type *parent_type;
 	bool compatible = false;
@@ -725,48 +1020,91 @@ static int
 rpct_lookup_type(const char *name, const char **decl, rpc_object_t *result,
     struct rpct_file **filep)
 {
-	GHashTableIter iter;
-	const char *filename;
-	struct rpct_file *file;
-	__block int ret = -1;
+	struct rpct_index_entry *entry;
 
-	g_hash_table_iter_init(&iter, context->files);
+	debugf("looking for %s in the index", name);
+
+	entry = g_hash_table_lookup(context->type_index, name);
+	if (entry == NULL)
+		return (-1);
 
-	while (g_hash_table_iter_next(&iter, (gpointer *)&filename,
-	    (gpointer *)&file)) {
+	*decl = entry->decl;
+	*result = entry->body;
+	*filep = entry->file;
+	return (0);
+}
+
+/*
+ * Records the full name of every type and interface declared in a file,
+ * so that they can be materialized on first use without scanning
+ * every loaded file.
+ */
+static void
+rpct_index_file(struct rpct_file *file)
+{
 
-		debugf("looking for %s in %s", name, filename);
+	rpc_dictionary_apply(file->body, ^(const char *key, rpc_object_t value) {
+		struct rpct_index_entry *entry;
+		GMatchInfo *m = NULL;
+		GHashTable *index;
+		char *name;
 
-		rpc_dictionary_apply(file->body,
-		    ^(const char *key, rpc_object_t value) {
-			GMatchInfo *m;
-			g_autofree char *type_name = NULL;
-			g_autofree char *full_name = NULL;
+		if (g_strcmp0(key, "meta") == 0)
+			return ((bool)true);
 
+		if (g_regex_match(rpct_interface_regex, key, 0, &m)) {
+			name = g_match_info_fetch(m, 1);
+			index = context->interface_index;
+		} else {
+			g_match_info_free(m);
 			if (!g_regex_match(rpct_type_regex, key, 0, &m)) {
 				g_match_info_free(m);
 				return ((bool)true);
 			}
-			type_name = g_match_info_fetch(m, 2);
-			full_name = file->ns != NULL
-			    ? g_strdup_printf("%s.%s", file->ns, type_name)
-			    : g_strdup(type_name);
-
-			if (g_strcmp0(full_name, name) == 0) {
-				*decl = key;
-				*result = value;
-				*filep = file;
-				ret = 0;
-				g_match_info_free(m);
-				return ((bool)false);
-			}
 
-			g_match_info_free(m);
+			name = g_match_info_fetch(m, 2);
+			index = context->type_index;
+		}
+
+		g_match_info_free(m);
+
+		if (file->ns != NULL) {
+			char *tmp = name;
+
+			name = g_strdup_printf("%s.%s", file->ns, tmp);
+			g_free(tmp);
+		}
+
+		if (g_hash_table_contains(index, name)) {
+			g_free(name);
 			return ((bool)true);
-		});
-	}
+		}
 
-	return (ret);
+		entry = g_malloc0(sizeof(*entry));
+		entry->file = file;
+		entry->decl = key;
+		entry->body = value;
+		g_hash_table_insert(index, name, entry);
+		return ((bool)true);
+	});
+}
+
+static void
+rpct_materialize_all(void)
+{
+	GHashTableIter iter;
+	const char *name;
+
+	if (!rpct_lazy)
+		return;
+
+	g_hash_table_iter_init(&iter, context->type_index);
+	while (g_hash_table_iter_next(&iter, (gpointer *)&name, NULL))
+		rpct_find_type(name);
+
+	g_hash_table_iter_init(&iter, context->interface_index);
+	while (g_hash_table_iter_next(&iter, (gpointer *)&name, NULL))
+		rpct_find_interface(name);
 }
 
 static int
@@ -941,22 +1279,24 @@ rpct_read_property(struct rpct_file *file, struct rpct_interface *iface,
 	bool read_write = false;
 	bool write_only = false;
 	bool notify = false;
+	int64_t coalesce = 0;
 	int ret = -1;
 
 	g_assert_nonnull(decl);
 	g_assert_nonnull(obj);
 
 	if (rpct_check_fields(obj, "description", "type", "read-only",
-	    "read-write", "write-only", "notify", NULL) != 0)
+	    "read-write", "write-only", "notify", "coalesce", NULL) != 0)
 		return (-1);
 
-	rpc_object_unpack(obj, "{s,s,b,b,b,b}",
+	rpc_object_unpack(obj, "{s,s,b,b,b,b,i}",
 	    "description", &description,
 	    "type", &type,
 	    "read-only", &read_only,
 	    "read-write", &read_write,
 	    "write-only", &write_only,
-	    "notify", &notify);
+	    "notify", &notify,
+	    "coalesce", &coalesce);
 
 	if (!type) {
 		rpc_set_last_errorf(EINVAL, "Property %s has no type defined",
@@ -979,6 +1319,8 @@ rpct_read_property(struct rpct_file *file, struct rpct_interface *iface,
 	prop->member.rim_name = g_strdup(name);
 	prop->member.rim_type = RPC_MEMBER_PROPERTY;
 	prop->member.rim_property.rp_notify = notify;
+	prop->member.rim_property.rp_coalesce = (unsigned int)CLAMP(coalesce,
+	    0, G_MAXUINT);
 	prop->description = g_strdup(description);
 
 	if (!read_only && !write_only && !read_write) {
@@ -1285,32 +1627,78 @@ rpct_read_idl(const char *name, rpc_object_t idl)
 		return (-1);
 	}
 
+	g_rec_mutex_lock(&context->lock);
 	if (g_hash_table_contains(context->files, name)) {
+		g_rec_mutex_unlock(&context->lock);
 		debugf("file %s already loaded", name);
+		rpct_file_free(file);
 		return (0);
 	}
 
 	g_hash_table_insert(context->files, g_strdup(name), file);
+	rpct_index_file(file);
+	g_rec_mutex_unlock(&context->lock);
+
+	g_mutex_lock(&context->idl_lock);
+	g_clear_pointer(&context->idl_digest, g_free);
+	g_mutex_unlock(&context->idl_lock);
 	return (0);
 }
 
+/*
+ * Maps a compiled IDL blob next to the given source file and decodes
+ * it, as long as it's not older than the source. Returns NULL if
+ * there's no usable blob, in which case the YAML source is parsed.
+ */
+static rpc_object_t
+rpct_read_compiled(const char *path)
+{
+	GMappedFile *mapped;
+	struct stat src_st;
+	struct stat blob_st;
+	rpc_object_t obj;
+	char *blob;
+
+	blob = g_strconcat(path, RPCT_COMPILED_SUFFIX, NULL);
+
+	if (stat(blob, &blob_st) != 0 || stat(path, &src_st) != 0 ||
+	    blob_st.st_mtime < src_st.st_mtime) {
+		g_free(blob);
+		return (NULL);
+	}
+
+	mapped = g_mapped_file_new(blob, false, NULL);
+	g_free(blob);
+
+	if (mapped == NULL)
+		return (NULL);
+
+	obj = rpc_serializer_load("msgpack", g_mapped_file_get_contents(mapped),
+	    g_mapped_file_get_length(mapped));
+	g_mapped_file_unref(mapped);
+
+	if (obj != NULL && rpc_get_type(obj) != RPC_TYPE_DICTIONARY) {
+		rpc_release(obj);
+		return (NULL);
+	}
+
+	return (obj);
+}
+
 int
-rpct_read_file(const char *path)
+rpct_compile_file(const char *path, const char *output)
 {
 	char *contents;
+	char *blob;
+	void *frame;
 	size_t length;
 	rpc_auto_object_t obj = NULL;
 	GError *err = NULL;
-
-	debugf("trying to read %s", path);
-
-	if (g_hash_table_contains(context->files, path)) {
-		debugf("file %s already loaded", path);
-		return (0);
-	}
+	bool ok;
 
 	if (!g_file_get_contents(path, &contents, &length, &err)) {
 		rpc_set_last_gerror(err);
+		g_error_free(err);
 		return (-1);
 	}
 
@@ -1320,81 +1708,315 @@ rpct_read_file(const char *path)
 	if (obj == NULL)
 		return (-1);
 
-	return (rpct_read_idl(path, obj));
-}
+	if (rpc_serializer_dump("msgpack", obj, &frame, &length) != 0)
+		return (-1);
 
-bool
-rpct_run_validators(struct rpct_typei *typei, rpc_object_t obj,
-    struct rpct_error_context *errctx)
-{
-	GHashTableIter iter;
-	const struct rpct_validator *v;
-	const char *typename = rpc_get_type_name(rpc_get_type(obj));
-	const char *key;
-	rpc_object_t value;
-	bool valid = true;
+	blob = output != NULL
+	    ? g_strdup(output)
+	    : g_strconcat(path, RPCT_COMPILED_SUFFIX, NULL);
 
-	/* Run validators */
-	g_hash_table_iter_init(&iter, typei->constraints);
-	while (g_hash_table_iter_next(&iter, (gpointer *)&key,
-	    (gpointer *)&value)) {
-		v = rpc_find_validator(typename, key);
-		if (v == NULL) {
-			rpct_add_error(errctx, NULL, "Validator %s not found",
-			    key);
-			valid = false;
-			continue;
-		}
+	ok = g_file_set_contents(blob, frame, (gssize)length, &err);
+	g_free(blob);
+	free(frame);
 
-		debugf("Running validator %s on %s", key, typename);
-		if (!v->validate(obj, value, typei, errctx))
-			valid = false;
+	if (!ok) {
+		rpc_set_last_gerror(err);
+		g_error_free(err);
+		return (-1);
 	}
 
-	return (valid);
+	return (0);
 }
 
-bool
-rpct_validate_instance(struct rpct_typei *typei, rpc_object_t obj,
-    struct rpct_error_context *errctx)
+/*
+ * Parses a YAML IDL file entry by entry, straight from a mapping of the
+ * file. Parsing stops as soon as the meta section turns out malformed, and
+ * rpct_read_idl() reports the missing section then.
+ */
+static rpc_object_t
+rpct_read_yaml(const char *path)
 {
-	const struct rpct_class_handler *handler;
-	struct rpct_typei *raw_typei;
-	bool valid;
+	GMappedFile *mapped;
+	GError *err = NULL;
+	rpc_object_t body;
+	int ret;
 
-	raw_typei = rpct_unwind_typei(typei);
+	mapped = g_mapped_file_new(path, false, &err);
+	if (mapped == NULL) {
+		rpc_set_last_gerror(err);
+		g_error_free(err);
+		return (NULL);
+	}
 
-	/* Step 1: is it typed at all? */
-	if (obj->ro_typei == NULL) {
-		/* Can only be builtin type */
-		if (g_strcmp0(raw_typei->canonical_form, "any") == 0)
-			goto step3;
+	body = rpc_dictionary_create();
+	ret = rpc_yaml_load_entries(g_mapped_file_get_contents(mapped),
+	    g_mapped_file_get_length(mapped),
+	    ^(const char *key, rpc_object_t value) {
+		if (key == NULL)
+			return ((bool)false);
 
-		if (g_strcmp0(raw_typei->canonical_form, "nullptr") == 0) {
-			if (obj->ro_type == RPC_TYPE_NULL)
-				goto step3;
-		}
+		if (g_strcmp0(key, "meta") == 0 &&
+		    rpc_get_type(value) != RPC_TYPE_DICTIONARY)
+			return ((bool)false);
 
-		if (g_strcmp0(rpc_get_type_name(obj->ro_type),
-		    raw_typei->canonical_form) == 0)
-			goto step3;
+		rpc_dictionary_set_value(body, key, value);
+		return ((bool)true);
+	});
 
-		rpct_add_error(errctx, NULL,
-		    "Incompatible type %s, should be %s",
-		    rpc_get_type_name(obj->ro_type),
-		    raw_typei->canonical_form);
-		return (false);
+	g_mapped_file_unref(mapped);
+
+	if (ret != 0) {
+		rpc_release(body);
+		return (NULL);
 	}
 
-	/* Step 2: check type */
-	if (!rpct_typei_is_compatible(raw_typei,
-	    rpct_unwind_typei(obj->ro_typei))) {
-		rpct_add_error(errctx, NULL,
-		    "Incompatible type %s, should be %s",
-		    obj->ro_typei->canonical_form,
-		    typei->canonical_form);
+	return (body);
+}
 
-		valid = false;
+/*
+ * Returns the body of an IDL file, from its compiled blob if there's
+ * an up to date one. Doesn't touch the typing context, so it's safe to
+ * call from multiple threads at once.
+ */
+static rpc_object_t
+rpct_parse_file(const char *path)
+{
+	rpc_object_t obj;
+
+	obj = rpct_read_compiled(path);
+	if (obj != NULL)
+		return (obj);
+
+	return (rpct_read_yaml(path));
+}
+
+static void
+rpct_parse_worker(gpointer data, gpointer user_data __unused)
+{
+	struct rpct_parse_job *job = data;
+
+	job->body = rpct_parse_file(job->path);
+}
+
+int
+rpct_read_file(const char *path)
+{
+	rpc_auto_object_t obj = NULL;
+
+	debugf("trying to read %s", path);
+
+	if (g_hash_table_contains(context->files, path)) {
+		debugf("file %s already loaded", path);
+		return (0);
+	}
+
+	obj = rpct_parse_file(path);
+	if (obj == NULL)
+		return (-1);
+
+	return (rpct_read_idl(path, obj));
+}
+
+static struct rpct_validation_plan *
+rpct_compile_plan(struct rpct_typei *typei, rpc_object_t obj)
+{
+	struct rpct_validation_plan *plan;
+	struct rpct_plan_step *step;
+	GHashTableIter iter;
+	const char *typename = rpc_get_type_name(rpc_get_type(obj));
+	const char *key;
+	rpc_object_t value;
+	guint nsteps;
+	guint gen;
+
+	/* Read first, so a swap while compiling leaves the plan stale */
+	gen = g_atomic_int_get(&typei->constraints_gen);
+	nsteps = typei->constraints != NULL ?
+	    g_hash_table_size(typei->constraints) : 0;
+	plan = g_malloc0(sizeof(*plan) + nsteps * sizeof(*step));
+	plan->raw = rpct_unwind_typei(typei);
+	plan->handler = rpc_find_class_handler(NULL, typei->type->clazz);
+	plan->constraints_gen = gen;
+	plan->any = g_strcmp0(plan->raw->canonical_form, "any") == 0;
+	plan->accept_null = g_strcmp0(plan->raw->canonical_form,
+	    "nullptr") == 0;
+	plan->builtin = -1;
+	plan->objtype = rpc_get_type(obj);
+	g_assert_nonnull(plan->handler);
+
+	for (guint i = 0; i < RPCT_BUILTIN_COUNT; i++) {
+		if (g_strcmp0(rpc_get_type_name((rpc_type_t)i),
+		    plan->raw->canonical_form) == 0) {
+			plan->builtin = (int)i;
+			break;
+		}
+	}
+
+	if (nsteps == 0)
+		return (plan);
+
+	g_hash_table_iter_init(&iter, typei->constraints);
+	while (g_hash_table_iter_next(&iter, (gpointer *)&key,
+	    (gpointer *)&value)) {
+		step = &plan->steps[plan->nsteps++];
+		step->name = key;
+		step->arg = value;
+		step->validator = rpc_find_validator(typename, key);
+	}
+
+	return (plan);
+}
+
+static struct rpct_validation_plan *
+rpct_get_plan(struct rpct_typei *typei, rpc_object_t obj)
+{
+	struct rpct_validation_plan *plan;
+
+	if (g_once_init_enter(&typei->plan)) {
+		plan = rpct_compile_plan(typei, obj);
+		g_once_init_leave(&typei->plan, plan);
+	}
+
+	plan = typei->plan;
+
+	/*
+	 * Member instantiation may swap the constraints of a shared
+	 * instance; such a plan is stale and we interpret instead. The
+	 * old table can be freed and another allocated at its address,
+	 * so it's the generation that tells them apart.
+	 */
+	if (plan->constraints_gen != g_atomic_int_get(&typei->constraints_gen))
+		return (NULL);
+
+	return (plan);
+}
+
+bool
+rpct_run_validators(struct rpct_typei *typei, rpc_object_t obj,
+    struct rpct_error_context *errctx)
+{
+	struct rpct_validation_plan *plan;
+	struct rpct_plan_step *step;
+	GHashTableIter iter;
+	const struct rpct_validator *v;
+	const char *typename = rpc_get_type_name(rpc_get_type(obj));
+	const char *key;
+	rpc_object_t value;
+	bool valid = true;
+
+	plan = rpct_get_plan(typei, obj);
+	if (plan != NULL && plan->objtype == rpc_get_type(obj)) {
+		for (guint i = 0; i < plan->nsteps; i++) {
+			step = &plan->steps[i];
+			if (step->validator == NULL) {
+				rpct_add_error(errctx, NULL,
+				    "Validator %s not found", step->name);
+				valid = false;
+				continue;
+			}
+
+			if (!step->validator->validate(obj, step->arg, typei,
+			    errctx))
+				valid = false;
+		}
+
+		return (valid);
+	}
+
+	/* Run validators */
+	g_hash_table_iter_init(&iter, typei->constraints);
+	while (g_hash_table_iter_next(&iter, (gpointer *)&key,
+	    (gpointer *)&value)) {
+		v = rpc_find_validator(typename, key);
+		if (v == NULL) {
+			rpct_add_error(errctx, NULL, "Validator %s not found",
+			    key);
+			valid = false;
+			continue;
+		}
+
+		debugf("Running validator %s on %s", key, typename);
+		if (!v->validate(obj, value, typei, errctx))
+			valid = false;
+	}
+
+	return (valid);
+}
+
+bool
+rpct_validate_instance(struct rpct_typei *typei, rpc_object_t obj,
+    struct rpct_error_context *errctx)
+{
+	const struct rpct_class_handler *handler;
+	struct rpct_validation_plan *plan;
+	struct rpct_typei *raw_typei;
+	bool valid;
+
+	plan = rpct_get_plan(typei, obj);
+	if (plan == NULL)
+		goto interpret;
+
+	raw_typei = plan->raw;
+	handler = plan->handler;
+
+	if (obj->ro_typei == NULL) {
+		if (plan->any || (int)obj->ro_type == plan->builtin ||
+		    (plan->accept_null && obj->ro_type == RPC_TYPE_NULL))
+			return (handler->validate_fn(typei, obj, errctx));
+
+		rpct_add_error(errctx, NULL,
+		    "Incompatible type %s, should be %s",
+		    rpc_get_type_name(obj->ro_type),
+		    raw_typei->canonical_form);
+		return (false);
+	}
+
+	/* Cached instances make an exact match a pointer compare */
+	if (obj->ro_typei != raw_typei && !rpct_typei_is_compatible(raw_typei,
+	    rpct_unwind_typei(obj->ro_typei))) {
+		rpct_add_error(errctx, NULL,
+		    "Incompatible type %s, should be %s",
+		    obj->ro_typei->canonical_form,
+		    typei->canonical_form);
+		return (false);
+	}
+
+	return (handler->validate_fn(typei, obj, errctx));
+
+interpret:
+	raw_typei = rpct_unwind_typei(typei);
+
+	/* Step 1: is it typed at all? */
+	if (obj->ro_typei == NULL) {
+		/* Can only be builtin type */
+		if (g_strcmp0(raw_typei->canonical_form, "any") == 0)
+			goto step3;
+
+		if (g_strcmp0(raw_typei->canonical_form, "nullptr") == 0) {
+			if (obj->ro_type == RPC_TYPE_NULL)
+				goto step3;
+		}
+
+		if (g_strcmp0(rpc_get_type_name(obj->ro_type),
+		    raw_typei->canonical_form) == 0)
+			goto step3;
+
+		rpct_add_error(errctx, NULL,
+		    "Incompatible type %s, should be %s",
+		    rpc_get_type_name(obj->ro_type),
+		    raw_typei->canonical_form);
+		return (false);
+	}
+
+	/* Step 2: check type */
+	if (!rpct_typei_is_compatible(raw_typei,
+	    rpct_unwind_typei(obj->ro_typei))) {
+		rpct_add_error(errctx, NULL,
+		    "Incompatible type %s, should be %s",
+		    obj->ro_typei->canonical_form,
+		    typei->canonical_form);
+
+		valid = false;
 		goto done;
 	}
 
@@ -1423,6 +2045,8 @@ rpct_validate_args(struct rpct_if_member *func, rpc_object_t args,
 
 	errctx.path = "";
 	errctx.errors = g_ptr_array_new();
+	errctx.lock = NULL;
+	errctx.limit = rpct_error_limit;
 
 	rpc_array_apply(args, ^(size_t idx, rpc_object_t i) {
 		struct rpct_argument *arg;
@@ -1480,6 +2104,8 @@ rpct_validate(struct rpct_typei *typei, rpc_object_t obj, rpc_object_t *errors)
 
 	errctx.path = "";
 	errctx.errors = g_ptr_array_new();
+	errctx.lock = NULL;
+	errctx.limit = rpct_error_limit;
 
 	valid = rpct_validate_instance(typei, obj, &errctx);
 
@@ -1499,6 +2125,31 @@ rpct_validate(struct rpct_typei *typei, rpc_object_t obj, rpc_object_t *errors)
 	return (valid);
 }
 
+/*
+ * Interfaces are never unloaded, so once a method has been resolved to
+ * its IDL member the pointer can be kept on the method itself. Misses
+ * aren't cached since the IDL may be loaded later, and neither are
+ * calls routed to method_missing, which share one method descriptor.
+ */
+static struct rpct_if_member *
+rpct_call_member(struct rpc_call *ic)
+{
+	struct rpc_if_method *method = ic->rc_if_method;
+	struct rpct_if_member *member;
+
+	if (method != NULL && !ic->rc_method_missing) {
+		member = g_atomic_pointer_get(&method->rm_typing);
+		if (member != NULL)
+			return (member);
+	}
+
+	member = rpct_find_if_member(ic->rc_interface, ic->rc_method_name);
+	if (member != NULL && method != NULL && !ic->rc_method_missing)
+		g_atomic_pointer_set(&method->rm_typing, member);
+
+	return (member);
+}
+
 rpc_object_t
 rpct_pre_call_hook(void *cookie, rpc_object_t args)
 {
@@ -1508,7 +2159,10 @@ rpct_pre_call_hook(void *cookie, rpc_object_t args)
 	rpc_object_t errors;
 
 	g_assert(ic->rc_type == RPC_INBOUND_CALL);
-	member = rpct_find_if_member(ic->rc_interface, ic->rc_method_name);
+	if (!rpc_context_should_validate(ic, false))
+		return (NULL);
+
+	member = rpct_call_member(ic);
 	if (member == NULL)
 		return (NULL);
 
@@ -1533,7 +2187,10 @@ rpct_post_call_hook(void *cookie, rpc_object_t result)
 	rpc_object_t errors;
 
 	g_assert(ic->rc_type == RPC_INBOUND_CALL);
-	member = rpct_find_if_member(ic->rc_interface, ic->rc_method_name);
+	if (!rpc_context_should_validate(ic, true))
+		return (NULL);
+
+	member = rpct_call_member(ic);
 	if (member == NULL)
 		return (NULL);
 
@@ -1552,8 +2209,146 @@ rpct_allow_idl_download(rpc_context_t context)
 	    RPCT_TYPING_INTERFACE, rpct_typing_vtable, NULL);
 }
 
+/*
+ * Returns where the IDL with the given digest is cached, or NULL if
+ * caching is off. The digest comes from the server, so anything but
+ * a plain hex string is refused rather than used in a path.
+ */
+static char *
+rpct_idl_cache_path(const char *digest)
+{
+	const char *dir;
+	const char *p;
+	char *name;
+	char *result;
+
+	if (*digest == '\0')
+		return (NULL);
+
+	for (p = digest; *p != '\0'; p++) {
+		if (!g_ascii_isxdigit(*p))
+			return (NULL);
+	}
+
+	dir = g_getenv(RPCT_IDL_CACHE_ENV);
+	if (dir != NULL && *dir == '\0')
+		return (NULL);
+
+	name = g_strconcat(digest, RPCT_COMPILED_SUFFIX, NULL);
+	result = dir != NULL
+	    ? g_build_filename(dir, name, NULL)
+	    : g_build_filename(g_get_user_cache_dir(), "librpc", "idl", name,
+	    NULL);
+
+	g_free(name);
+	return (result);
+}
+
+static int
+rpct_read_idl_cache(const char *path)
+{
+	GMappedFile *mapped;
+	rpc_auto_object_t files = NULL;
+
+	mapped = g_mapped_file_new(path, false, NULL);
+	if (mapped == NULL)
+		return (-1);
+
+	files = rpc_serializer_load("msgpack",
+	    g_mapped_file_get_contents(mapped),
+	    g_mapped_file_get_length(mapped));
+	g_mapped_file_unref(mapped);
+
+	if (files == NULL || rpc_get_type(files) != RPC_TYPE_ARRAY)
+		return (-1);
+
+	return (rpc_array_apply(files, ^(size_t idx __unused,
+	    rpc_object_t entry) {
+		const char *name;
+		rpc_object_t body;
+
+		if (rpc_object_unpack(entry, "{s,v}",
+		    "name", &name,
+		    "body", &body) < 2)
+			return ((bool)false);
+
+		return ((bool)(rpct_read_idl(name, body) == 0));
+	}) ? -1 : 0);
+}
+
 int
 rpct_download_idl(rpc_connection_t conn)
+{
+	rpc_object_t digest;
+	rpc_object_t files;
+	void *frame;
+	size_t len;
+	char *cache = NULL;
+	char *dir;
+	char *hash = NULL;
+	int ret;
+
+	/* Servers that predate the digest just get the full download */
+	digest = rpc_connection_call_syncp(conn, "/", RPCT_TYPING_INTERFACE,
+	    "digest", "[]");
+	if (digest != NULL && rpc_get_type(digest) == RPC_TYPE_STRING)
+		hash = g_strdup(rpc_string_get_string_ptr(digest));
+
+	rpc_release(digest);
+
+	if (hash != NULL) {
+		g_mutex_lock(&context->idl_lock);
+		ret = g_hash_table_contains(context->idl_applied, hash);
+		g_mutex_unlock(&context->idl_lock);
+
+		if (ret) {
+			g_free(hash);
+			return (0);
+		}
+
+		cache = rpct_idl_cache_path(hash);
+		if (cache != NULL && rpct_read_idl_cache(cache) == 0) {
+			ret = 0;
+			goto done;
+		}
+	}
+
+	files = rpc_array_create();
+	ret = rpct_fetch_idl(conn, files);
+
+	if (ret == 0 && cache != NULL &&
+	    rpc_serializer_dump("msgpack", files, &frame, &len) == 0) {
+		/* Replaced atomically, so readers never see a torn file */
+		dir = g_path_get_dirname(cache);
+		if (g_mkdir_with_parents(dir, 0700) == 0)
+			g_file_set_contents(cache, frame, (gssize)len, NULL);
+
+		g_free(dir);
+		free(frame);
+	}
+
+	rpc_release(files);
+
+done:
+	if (ret == 0 && hash != NULL) {
+		g_mutex_lock(&context->idl_lock);
+		g_hash_table_add(context->idl_applied, hash);
+		g_mutex_unlock(&context->idl_lock);
+		hash = NULL;
+	}
+
+	g_free(hash);
+	g_free(cache);
+	rpct_load_types_cached();
+	return (ret);
+}
+
+/*
+ * Streams every IDL file from the server, reading each one in and
+ * keeping it in @p files for the cache.
+ */
+static int
+rpct_fetch_idl(rpc_connection_t conn, rpc_object_t files)
 {
 	rpc_call_t call;
 	rpc_object_t result;
@@ -1586,6 +2381,7 @@ next:
 		if (rpct_read_idl(name, body) < 0)
 			ret = -1;
 
+		rpc_array_append_value(files, result);
 		rpc_call_continue(call, true);
 		goto next;
 
@@ -1602,7 +2398,6 @@ next:
 	}
 
 	rpc_call_free(call);
-	rpct_load_types_cached();
 	return (ret);
 }
 
@@ -1631,6 +2426,11 @@ rpct_init(bool load_system_types)
 	    G_REGEX_MATCH_NOTEMPTY, NULL);
 
 	context = g_malloc0(sizeof(*context));
+	g_rec_mutex_init(&context->lock);
+	g_rw_lock_init(&context->typei_cache_lock);
+	g_rw_lock_init(&context->compat_lock);
+	context->compat_cache = g_hash_table_new_full(rpct_typei_pair_hash,
+	    rpct_typei_pair_equal, g_free, NULL);
 	context->files = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
 	    (GDestroyNotify)rpct_file_free);
 	context->types = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
@@ -1639,6 +2439,17 @@ rpct_init(bool load_system_types)
 	    NULL, (GDestroyNotify)rpct_interface_free);
 	context->typei_cache = g_hash_table_new_full(g_str_hash, g_str_equal,
 	    g_free, (GDestroyNotify)rpct_typei_release);
+	context->type_index = g_hash_table_new_full(g_str_hash, g_str_equal,
+	    g_free, g_free);
+	context->interface_index = g_hash_table_new_full(g_str_hash,
+	    g_str_equal, g_free, g_free);
+	g_mutex_init(&context->compact_lock);
+	g_mutex_init(&context->idl_lock);
+	context->idl_applied = g_hash_table_new_full(g_str_hash, g_str_equal,
+	    g_free, NULL);
+	context->compact_names = g_hash_table_new_full(g_str_hash, g_str_equal,
+	    NULL, (GDestroyNotify)rpct_compact_type_free);
+	context->compact_ids = g_hash_table_new(g_direct_hash, g_direct_equal);
 
 	for (b = builtin_types; *b != NULL; b++) {
 		type = g_malloc0(sizeof(*type));
@@ -1653,6 +2464,12 @@ rpct_init(bool load_system_types)
 		g_hash_table_insert(context->types, g_strdup(type->name), type);
 	}
 
+	/* Preallocate instances of every builtin type */
+	for (guint i = 0; i < RPCT_BUILTIN_COUNT; i++) {
+		context->builtin_typei[i] = rpct_instantiate_type(
+		    rpc_get_type_name((rpc_type_t)i), NULL, NULL, NULL);
+	}
+
 	/* Load system-wide types */
 	if (load_system_types)
 		return (rpct_load_types_dir(SYSTEM_IDL_PATH));
@@ -1664,10 +2481,39 @@ void
 rpct_free(void)
 {
 
+	for (guint i = 0; i < RPCT_BUILTIN_COUNT; i++) {
+		if (context->builtin_typei[i] != NULL)
+			rpct_typei_release(context->builtin_typei[i]);
+	}
+
+	g_hash_table_unref(context->compact_ids);
+	g_hash_table_unref(context->compact_names);
+	g_mutex_clear(&context->compact_lock);
+	g_hash_table_unref(context->idl_applied);
+	g_free(context->idl_digest);
+	g_mutex_clear(&context->idl_lock);
 	g_hash_table_unref(context->files);
+	g_rw_lock_clear(&context->typei_cache_lock);
+	g_hash_table_unref(context->compat_cache);
+	g_rw_lock_clear(&context->compat_lock);
+	g_rec_mutex_clear(&context->lock);
 	g_free(context);
 }
 
+void
+rpct_set_lazy_loading(bool lazy)
+{
+
+	rpct_lazy = lazy;
+}
+
+void
+rpct_set_error_limit(size_t limit)
+{
+
+	rpct_error_limit = (guint)MIN(limit, G_MAXUINT);
+}
+
 rpct_typei_t
 rpct_typei_retain(rpct_typei_t typei)
 {
@@ -1685,6 +2531,18 @@ rpct_typei_release(rpct_typei_t typei)
 	if (typei->specializations != NULL)
 		g_hash_table_destroy(typei->specializations);
 
+	if (typei->derived != NULL)
+		g_hash_table_destroy(typei->derived);
+
+	g_free(typei->plan);
+
+	if (typei->branches != NULL) {
+		for (guint i = 0; i < RPCT_BUILTIN_COUNT; i++)
+			g_ptr_array_free(typei->branches->rub_members[i], true);
+
+		g_free(typei->branches);
+	}
+
 	g_free(typei->canonical_form);
 	g_free(typei);
 }
@@ -1743,15 +2601,17 @@ rpct_load_types(const char *path)
 	return (0);
 }
 
-int
-rpct_load_types_dir(const char *path)
+/*
+ * Recursively gathers paths of the IDL files under the given directory
+ * that aren't loaded yet.
+ */
+static int
+rpct_collect_files(const char *path, GPtrArray *files)
 {
 	GDir *dir;
-	GPtrArray *files;
 	GError *error = NULL;
 	const char *name;
 	char *s;
-	guint i;
 
 	dir = g_dir_open(path, 0, &error);
 	if (dir == NULL) {
@@ -1760,8 +2620,6 @@ rpct_load_types_dir(const char *path)
 		return (-1);
 	}
 
-	files = g_ptr_array_new_with_free_func((GDestroyNotify)g_free);
-
 	for (;;) {
 		name = g_dir_read_name(dir);
 		if (name == NULL)
@@ -1769,17 +2627,13 @@ rpct_load_types_dir(const char *path)
 
 		s = g_build_filename(path, name, NULL);
 		if (g_file_test(s, G_FILE_TEST_IS_DIR)) {
-			rpct_load_types_dir(s);
+			rpct_collect_files(s, files);
 			g_free(s);
 			continue;
 		}
 
-		if (!g_str_has_suffix(name, ".yaml")) {
-			g_free(s);
-			continue;
-		}
-
-		if (rpct_read_file(s) != 0) {
+		if (!g_str_has_suffix(name, ".yaml") ||
+		    g_hash_table_contains(context->files, s)) {
 			g_free(s);
 			continue;
 		}
@@ -1787,13 +2641,72 @@ rpct_load_types_dir(const char *path)
 		g_ptr_array_add(files, s);
 	}
 
-	g_dir_close(dir);
+	g_dir_close(dir);
+	return (0);
+}
+
+int
+rpct_load_types_dir(const char *path)
+{
+	GThreadPool *pool = NULL;
+	GPtrArray *files;
+	struct rpct_parse_job *jobs;
+	struct rpct_parse_job *job;
+	guint i;
+
+	files = g_ptr_array_new_with_free_func((GDestroyNotify)g_free);
+	if (rpct_collect_files(path, files) != 0) {
+		g_ptr_array_free(files, true);
+		return (-1);
+	}
+
+	/*
+	 * Files are parsed in parallel, but only the calling thread adds
+	 * them to the context, in directory order, once all are done.
+	 */
+	jobs = g_new0(struct rpct_parse_job, files->len);
+	if (files->len > 1) {
+		pool = g_thread_pool_new(rpct_parse_worker, NULL,
+		    (gint)MIN(files->len, g_get_num_processors()), false,
+		    NULL);
+	}
+
+	for (i = 0; i < files->len; i++) {
+		job = &jobs[i];
+		job->path = g_ptr_array_index(files, i);
+		if (pool != NULL)
+			g_thread_pool_push(pool, job, NULL);
+		else
+			rpct_parse_worker(job, NULL);
+	}
+
+	if (pool != NULL)
+		g_thread_pool_free(pool, false, true);
 
 	for (i = 0; i < files->len; i++) {
-		s = g_ptr_array_index(files, i);
-		rpct_load_types(s);
+		job = &jobs[i];
+		if (job->body == NULL)
+			continue;
+
+		if (rpct_read_idl(job->path, job->body) != 0)
+			rpc_release(job->body);
 	}
 
+	/*
+	 * Every file is indexed by now, so references across files and
+	 * directories resolve regardless of the order types get loaded in.
+	 * In lazy mode, types are materialized by the first lookup.
+	 */
+	for (i = 0; i < files->len && !rpct_lazy; i++) {
+		job = &jobs[i];
+		if (job->body != NULL)
+			rpct_load_types(job->path);
+	}
+
+	for (i = 0; i < files->len; i++)
+		rpc_release(jobs[i].body);
+
+	g_free(jobs);
 	g_ptr_array_free(files, true);
 	return (0);
 }
@@ -2062,6 +2975,7 @@ rpct_types_apply(rpct_type_applier_t applier)
 	char *key;
 	rpct_type_t value;
 
+	rpct_materialize_all();
 	g_hash_table_iter_init(&iter, context->types);
 	while (g_hash_table_iter_next(&iter, (gpointer *)&key,
 	    (gpointer *)&value)) {
@@ -2099,6 +3013,7 @@ rpct_interface_apply(rpct_interface_applier_t applier)
 	struct rpct_interface *value;
 	bool flag = false;
 
+	rpct_materialize_all();
 	g_hash_table_iter_init(&iter, context->interfaces);
 	while (g_hash_table_iter_next(&iter, (gpointer *)&key,
 	    (gpointer *)&value)) {
@@ -2133,9 +3048,23 @@ rpct_if_member_apply(rpct_interface_t iface, rpct_if_member_applier_t applier)
 rpct_interface_t
 rpct_find_interface(const char *name)
 {
+	struct rpct_index_entry *entry;
 	struct rpct_interface *iface;
 
+	g_rec_mutex_lock(&context->lock);
 	iface = g_hash_table_lookup(context->interfaces, name);
+	if (iface == NULL) {
+		entry = g_hash_table_lookup(context->interface_index, name);
+		if (entry != NULL) {
+			debugf("interface %s not loaded, trying to load", name);
+			rpct_read_interface(entry->file, entry->decl,
+			    entry->body);
+			iface = g_hash_table_lookup(context->interfaces, name);
+		}
+	}
+
+	g_rec_mutex_unlock(&context->lock);
+
 	if (iface == NULL) {
 		rpc_set_last_errorf(ENOENT, "Interface not found");
 		return (NULL);
@@ -2163,53 +3092,484 @@ rpct_find_if_member(const char *interface, const char *member)
 	return (ret);
 }
 
-rpc_object_t
-rpct_serialize(rpc_object_t object)
+/*
+ * Coalescing interval the IDL declares for a property, 0 if it doesn't
+ * or the interface isn't known. Unlike rpct_find_if_member(), a miss
+ * doesn't touch the last error: this runs for every property an
+ * instance registers.
+ */
+unsigned int
+rpct_property_coalesce(const char *interface, const char *name)
+{
+	struct rpct_interface *iface;
+	struct rpct_if_member *member;
+
+	if (context == NULL)
+		return (0);
+
+	if (!g_hash_table_contains(context->interfaces, interface) &&
+	    !g_hash_table_contains(context->interface_index, interface))
+		return (0);
+
+	iface = rpct_find_interface(interface);
+	if (iface == NULL)
+		return (0);
+
+	member = g_hash_table_lookup(iface->members, name);
+	if (member == NULL || member->member.rim_type != RPC_MEMBER_PROPERTY)
+		return (0);
+
+	return (member->member.rim_property.rp_coalesce);
+}
+
+/*
+ * Returns a serialized replacement for object, or NULL if object can
+ * go on the wire as it is. Builtin type instances are never encoded,
+ * so only the spine leading to a non-builtin typed value (or to a
+ * file descriptor, which rpc_serialize_fds() rewrites in place) has
+ * to be rebuilt; every other subtree is shared with the original.
+ */
+static rpc_object_t
+rpct_serialize_shared(rpc_object_t object)
 {
 	const struct rpct_class_handler *handler;
-	rpct_class_t clazz;
+	GPtrArray *parts;
 	rpc_object_t cont;
+	__block bool changed = false;
+	__block guint idx = 0;
+
+	/* Left typed for the msgpack writer to encode as an extension */
+	if (object->ro_typei != NULL &&
+	    rpc_msgpack_ext_registered(object->ro_typei->canonical_form))
+		return (NULL);
+
+	if (object->ro_typei != NULL &&
+	    object->ro_typei->type->clazz != RPC_TYPING_BUILTIN) {
+		handler = rpc_find_class_handler(NULL,
+		    object->ro_typei->type->clazz);
+		g_assert_nonnull(handler);
+		return (handler->serialize_fn(object));
+	}
+
+	switch (rpc_get_type(object)) {
+	case RPC_TYPE_FD:
+#if defined(__linux__)
+	case RPC_TYPE_SHMEM:
+#endif
+		cont = rpc_copy(object);
+		cont->ro_typei = rpct_builtin_typei(rpc_get_type(object));
+		return (cont);
+
+	case RPC_TYPE_DICTIONARY:
+	case RPC_TYPE_ARRAY:
+		break;
+
+	default:
+		return (NULL);
+	}
+
+	parts = g_ptr_array_new();
+
+	if (rpc_get_type(object) == RPC_TYPE_DICTIONARY) {
+		rpc_dictionary_apply(object, ^(const char *key __unused,
+		    rpc_object_t v) {
+			rpc_object_t part = rpct_serialize_shared(v);
+
+			changed = changed || part != NULL;
+			g_ptr_array_add(parts, part);
+			return ((bool)true);
+		});
+
+		if (!changed) {
+			g_ptr_array_free(parts, true);
+			return (NULL);
+		}
+
+		cont = rpc_dictionary_create();
+		cont->ro_typei = rpct_builtin_typei(RPC_TYPE_DICTIONARY);
+		rpc_dictionary_apply(object, ^(const char *key, rpc_object_t v) {
+			rpc_object_t part = g_ptr_array_index(parts, idx++);
+
+			rpc_dictionary_steal_value(cont, key,
+			    part != NULL ? part : rpc_retain(v));
+			return ((bool)true);
+		});
+	} else {
+		rpc_array_apply(object, ^(size_t i __unused, rpc_object_t v) {
+			rpc_object_t part = rpct_serialize_shared(v);
+
+			changed = changed || part != NULL;
+			g_ptr_array_add(parts, part);
+			return ((bool)true);
+		});
+
+		if (!changed) {
+			g_ptr_array_free(parts, true);
+			return (NULL);
+		}
+
+		cont = rpc_array_create();
+		cont->ro_typei = rpct_builtin_typei(RPC_TYPE_ARRAY);
+		rpc_array_apply(object, ^(size_t i __unused, rpc_object_t v) {
+			rpc_object_t part = g_ptr_array_index(parts, idx++);
+
+			rpc_array_append_stolen_value(cont,
+			    part != NULL ? part : rpc_retain(v));
+			return ((bool)true);
+		});
+	}
+
+	g_ptr_array_free(parts, true);
+	return (cont);
+}
+
+rpc_object_t
+rpct_serialize(rpc_object_t object)
+{
+	rpc_object_t result;
 
 	if (context == NULL)
 		return (rpc_retain(object));
 
-	if (object->ro_typei == NULL ||
-	    object->ro_typei->type->clazz == RPC_TYPING_BUILTIN) {
-		/* Try recursively */
-		if (rpc_get_type(object) == RPC_TYPE_DICTIONARY) {
-			cont = rpc_dictionary_create();
-			cont->ro_typei = rpct_new_typei("dictionary");
-			rpc_dictionary_apply(object,
-			    ^(const char *key, rpc_object_t v) {
-				rpc_dictionary_steal_value(cont, key,
-				    rpct_serialize(v));
-				return ((bool)true);
-			});
-
-			return (cont);
-		} else if (rpc_get_type(object) == RPC_TYPE_ARRAY) {
-			cont = rpc_array_create();
-			cont->ro_typei = rpct_new_typei("array");
-			rpc_array_apply(object, ^(size_t idx, rpc_object_t v) {
-				rpc_array_append_stolen_value(cont,
-				    rpct_serialize(v));
-				return ((bool)true);
-			});
+	result = rpct_serialize_shared(object);
+	if (result == NULL)
+		return (rpc_retain(object));
 
-			return (cont);
-		} else {
-			cont = rpc_copy(object);
-			cont->ro_typei = rpct_new_typei(
-			    rpc_get_type_name(rpc_get_type(object)));
-			return (cont);
+	return (result);
+}
+
+rpc_object_t
+rpct_serialize_compact(rpc_object_t object)
+{
+	rpc_object_t result;
+
+	g_private_set(&rpct_compact_mode, GINT_TO_POINTER(true));
+	result = rpct_serialize(object);
+	g_private_set(&rpct_compact_mode, NULL);
+	return (result);
+}
+
+bool
+rpct_compact_enabled(void)
+{
+
+	return (g_private_get(&rpct_compact_mode) != NULL);
+}
+
+struct rpct_type_table *
+rpct_type_table_new(void)
+{
+	struct rpct_type_table *table;
+
+	table = g_malloc0(sizeof(*table));
+	table->rtt_out = g_hash_table_new_full(g_str_hash, g_str_equal,
+	    g_free, NULL);
+	table->rtt_in = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+	    g_free, (GDestroyNotify)rpct_typei_release);
+	table->rtt_next_id = 1;
+	return (table);
+}
+
+void
+rpct_type_table_free(struct rpct_type_table *table)
+{
+
+	if (table == NULL)
+		return;
+
+	g_hash_table_destroy(table->rtt_out);
+	g_hash_table_destroy(table->rtt_in);
+	g_free(table);
+}
+
+void
+rpct_set_type_table(struct rpct_type_table *table)
+{
+
+	g_private_set(&rpct_type_table_current, table);
+}
+
+/*
+ * Tags a serialized value with its type: by name, by ID only once the
+ * peer has been told the name, or by both the first time.
+ */
+void
+rpct_set_type_field(rpc_object_t dict, struct rpct_typei *typei)
+{
+	struct rpct_type_table *table;
+	gpointer id;
+
+	table = g_private_get(&rpct_type_table_current);
+	if (table == NULL) {
+		rpc_dictionary_set_string(dict, RPCT_TYPE_FIELD,
+		    typei->canonical_form);
+		return;
+	}
+
+	id = g_hash_table_lookup(table->rtt_out, typei->canonical_form);
+	if (id != NULL) {
+		rpc_dictionary_set_uint64(dict, RPCT_TYPE_ID_FIELD,
+		    GPOINTER_TO_SIZE(id));
+		return;
+	}
+
+	id = GSIZE_TO_POINTER(table->rtt_next_id++);
+	g_hash_table_insert(table->rtt_out, g_strdup(typei->canonical_form),
+	    id);
+	table->rtt_defined = true;
+	rpc_dictionary_set_string(dict, RPCT_TYPE_FIELD, typei->canonical_form);
+	rpc_dictionary_set_uint64(dict, RPCT_TYPE_ID_FIELD,
+	    GPOINTER_TO_SIZE(id));
+}
+
+/*
+ * Returns the type a value tagged with RPCT_TYPE_ID_FIELD refers to,
+ * remembering the ID if the value defines it.
+ */
+static struct rpct_typei *
+rpct_resolve_type_id(rpc_object_t object, const char *typedecl)
+{
+	struct rpct_type_table *table;
+	struct rpct_typei *typei;
+	rpc_object_t idobj;
+	int64_t id;
+
+	table = g_private_get(&rpct_type_table_current);
+	if (table == NULL)
+		return (typedecl != NULL ? rpct_new_typei(typedecl) : NULL);
+
+	idobj = rpc_dictionary_get_value(object, RPCT_TYPE_ID_FIELD);
+	switch (rpc_get_type(idobj)) {
+	case RPC_TYPE_UINT64:
+		id = (int64_t)rpc_uint64_get_value(idobj);
+		break;
+
+	case RPC_TYPE_INT64:
+		id = rpc_int64_get_value(idobj);
+		break;
+
+	default:
+		return (NULL);
+	}
+
+	if (typedecl == NULL) {
+		typei = g_hash_table_lookup(table->rtt_in, &id);
+		return (typei != NULL ? rpct_typei_retain(typei) : NULL);
+	}
+
+	if (g_hash_table_size(table->rtt_in) >= RPCT_TYPE_TABLE_MAX &&
+	    !g_hash_table_contains(table->rtt_in, &id)) {
+		table->rtt_overflow = true;
+		return (NULL);
+	}
+
+	typei = rpct_new_typei(typedecl);
+	if (typei != NULL) {
+		g_hash_table_insert(table->rtt_in, g_memdup(&id, sizeof(id)),
+		    rpct_typei_retain(typei));
+	}
+
+	return (typei);
+}
+
+/*
+ * 32-bit FNV-1a of the type name. IDs only have to agree between peers
+ * loading the same IDL, and rpct_compact_find_name() rules out names
+ * that collide.
+ */
+static uint32_t
+rpct_compact_id(const char *name)
+{
+	uint32_t hash = 2166136261u;
+
+	for (; *name != '\0'; name++) {
+		hash ^= (uint8_t)*name;
+		hash *= 16777619u;
+	}
+
+	return (hash);
+}
+
+/*
+ * Looks for the one known type name, materialized or not, matching the
+ * given ID. Returns NULL if there's none or more than one.
+ */
+static const char *
+rpct_compact_find_name(uint32_t id)
+{
+	GHashTable *tables[] = { context->types, context->type_index };
+	GHashTableIter iter;
+	const char *name;
+	const char *found = NULL;
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS(tables); i++) {
+		g_hash_table_iter_init(&iter, tables[i]);
+		while (g_hash_table_iter_next(&iter, (gpointer *)&name, NULL)) {
+			if (rpct_compact_id(name) != id)
+				continue;
+
+			if (found != NULL && g_strcmp0(found, name) != 0)
+				return (NULL);
+
+			found = name;
 		}
 	}
 
-	clazz = object->ro_typei->type->clazz;
-	handler = rpc_find_class_handler(NULL, clazz);
-	g_assert_nonnull(handler);
+	return (found);
+}
+
+static gint
+rpct_compact_cmp(gconstpointer a, gconstpointer b)
+{
+
+	return (g_strcmp0(*(const char **)a, *(const char **)b));
+}
+
+static void
+rpct_compact_type_free(struct rpct_compact_type *compact)
+{
+
+	if (compact->members != NULL)
+		g_ptr_array_free(compact->members, true);
+
+	g_free(compact->name);
+	g_free(compact);
+}
+
+/*
+ * Returns the compact layout of a struct type, building it on first use.
+ * Member names point into the type, which outlives the layout.
+ */
+static struct rpct_compact_type *
+rpct_compact_type_locked(struct rpct_type *type)
+{
+	struct rpct_compact_type *compact;
+	GHashTableIter iter;
+	const char *name;
+
+	compact = g_hash_table_lookup(context->compact_names, type->name);
+	if (compact != NULL)
+		return (compact);
+
+	compact = g_malloc0(sizeof(*compact));
+	compact->name = g_strdup(type->name);
+	compact->id = rpct_compact_id(type->name);
+	g_hash_table_insert(context->compact_names, compact->name, compact);
+
+	if (type->clazz != RPC_TYPING_STRUCT || type->generic ||
+	    g_strcmp0(rpct_compact_find_name(compact->id), type->name) != 0)
+		return (compact);
+
+	compact->members = g_ptr_array_new();
+	g_hash_table_iter_init(&iter, type->members);
+	while (g_hash_table_iter_next(&iter, (gpointer *)&name, NULL))
+		g_ptr_array_add(compact->members, (gpointer)name);
+
+	g_ptr_array_sort(compact->members, rpct_compact_cmp);
+	g_hash_table_insert(context->compact_ids,
+	    GUINT_TO_POINTER(compact->id), compact);
+	return (compact);
+}
+
+rpc_object_t
+rpct_compact_struct(rpc_object_t obj)
+{
+	struct rpct_compact_type *compact;
+	rpc_object_t packed;
+	rpc_object_t value;
+	guint i;
+
+	g_mutex_lock(&context->compact_lock);
+	compact = rpct_compact_type_locked(obj->ro_typei->type);
+	g_mutex_unlock(&context->compact_lock);
+
+	if (compact->members == NULL ||
+	    rpc_dictionary_get_count(obj) != compact->members->len)
+		return (NULL);
+
+	packed = rpc_array_create();
+	rpc_array_append_stolen_value(packed, rpc_uint64_create(compact->id));
+
+	for (i = 0; i < compact->members->len; i++) {
+		value = rpc_dictionary_get_value(obj,
+		    g_ptr_array_index(compact->members, i));
+		if (value == NULL) {
+			rpc_release(packed);
+			return (NULL);
+		}
+
+		rpc_array_append_stolen_value(packed, rpct_serialize(value));
+	}
+
+	return (rpc_object_pack("{v}", RPCT_COMPACT_FIELD, packed));
+}
+
+/*
+ * Expands a compact struct back into its verbose form and decodes that,
+ * so both encodings end up going through the same class handler.
+ */
+static rpc_object_t
+rpct_deserialize_compact(rpc_object_t packed)
+{
+	struct rpct_compact_type *compact = NULL;
+	struct rpct_type *type;
+	rpc_object_t verbose;
+	rpc_object_t result;
+	const char *name;
+	uint64_t id;
+	guint i;
+
+	if (rpc_get_type(packed) != RPC_TYPE_ARRAY ||
+	    rpc_array_get_count(packed) == 0)
+		return (rpc_error_create(EINVAL, "Invalid compact struct", NULL));
+
+	switch (rpc_get_type(rpc_array_get_value(packed, 0))) {
+	case RPC_TYPE_UINT64:
+		id = rpc_array_get_uint64(packed, 0);
+		break;
+
+	case RPC_TYPE_INT64:
+		id = (uint64_t)rpc_array_get_int64(packed, 0);
+		break;
 
-	return (handler->serialize_fn(object));
+	default:
+		return (rpc_error_create(EINVAL, "Invalid compact struct", NULL));
+	}
+
+	g_mutex_lock(&context->compact_lock);
+	compact = g_hash_table_lookup(context->compact_ids,
+	    GUINT_TO_POINTER((uint32_t)id));
+	if (compact == NULL) {
+		name = rpct_compact_find_name((uint32_t)id);
+		type = name != NULL ? rpct_find_type(name) : NULL;
+		if (type != NULL)
+			compact = rpct_compact_type_locked(type);
+	}
+	g_mutex_unlock(&context->compact_lock);
+
+	if (compact == NULL || compact->members == NULL) {
+		return (rpc_error_create(ENOENT, "Type information not found",
+		    rpc_object_pack("{id:u}", id)));
+	}
+
+	if (rpc_array_get_count(packed) != compact->members->len + 1) {
+		return (rpc_error_create(EINVAL,
+		    "Compact struct doesn't match its type",
+		    rpc_object_pack("{type:s}", compact->name)));
+	}
+
+	verbose = rpc_dictionary_create();
+	for (i = 0; i < compact->members->len; i++) {
+		rpc_dictionary_set_value(verbose,
+		    g_ptr_array_index(compact->members, i),
+		    rpc_array_get_value(packed, i + 1));
+	}
+
+	rpc_dictionary_set_string(verbose, RPCT_TYPE_FIELD, compact->name);
+	result = rpct_deserialize(verbose);
+	rpc_release(verbose);
+	return (result);
 }
 
 rpc_object_t
@@ -2229,15 +3589,27 @@ rpct_deserialize(rpc_object_t object)
 		return (rpc_retain(object));
 
 	if (objtype == RPC_TYPE_DICTIONARY) {
+		if (rpc_dictionary_get_count(object) == 1 &&
+		    rpc_dictionary_has_key(object, RPCT_COMPACT_FIELD)) {
+			return (rpct_deserialize_compact(
+			    rpc_dictionary_get_value(object,
+			    RPCT_COMPACT_FIELD)));
+		}
+
 		typedecl = rpc_dictionary_get_string(object, RPCT_TYPE_FIELD);
-		if (typedecl == NULL)
+		if (rpc_dictionary_has_key(object, RPCT_TYPE_ID_FIELD))
+			typei = rpct_resolve_type_id(object, typedecl);
+		else if (typedecl != NULL)
+			typei = rpct_new_typei(typedecl);
+		else
 			goto builtin;
 
-		typei = rpct_new_typei(typedecl);
 		if (typei == NULL) {
 			return (rpc_error_create(ENOENT,
 			    "Type information not found",
-			    rpc_object_pack("{type:s}", typedecl)));
+			    typedecl != NULL
+			    ? rpc_object_pack("{type:s}", typedecl)
+			    : NULL));
 		}
 
 		clazz = typei->type->clazz;
@@ -2254,7 +3626,7 @@ builtin:
 	g_assert_nonnull(handler);
 
 	result = handler->deserialize_fn(object);
-	result->ro_typei = rpct_new_typei(rpc_get_type_name(objtype));
+	result->ro_typei = rpct_builtin_typei(objtype);
 	return (result);
 }
 
@@ -2265,6 +3637,8 @@ rpct_derive_error_context(struct rpct_error_context *newctx,
 
 	newctx->path = g_strdup_printf("%s.%s", oldctx->path, name);
 	newctx->errors = oldctx->errors;
+	newctx->lock = oldctx->lock;
+	newctx->limit = oldctx->limit;
 }
 
 void
@@ -2288,5 +3662,41 @@ rpct_add_error(struct rpct_error_context *ctx, rpc_object_t extra,
 	err->extra = extra;
 	va_end(ap);
 
-	g_ptr_array_add(ctx->errors, err);
+	if (ctx->lock != NULL)
+		g_mutex_lock(ctx->lock);
+
+	if (ctx->limit == 0 || ctx->errors->len < ctx->limit) {
+		g_ptr_array_add(ctx->errors, err);
+		err = NULL;
+	}
+
+	if (ctx->lock != NULL)
+		g_mutex_unlock(ctx->lock);
+
+	/* Past the limit, errors are dropped */
+	if (err != NULL) {
+		rpc_release(err->extra);
+		g_free(err->message);
+		g_free(err->path);
+		g_free(err);
+	}
+}
+
+bool
+rpct_error_limit_reached(struct rpct_error_context *ctx)
+{
+	bool ret;
+
+	if (ctx->limit == 0)
+		return (false);
+
+	if (ctx->lock != NULL)
+		g_mutex_lock(ctx->lock);
+
+	ret = ctx->errors->len >= ctx->limit;
+
+	if (ctx->lock != NULL)
+		g_mutex_unlock(ctx->lock);
+
+	return (ret);
 }
@@ -0,0 +1,816 @@
+/*
+ * Copyright 2015-2017 Two Pore Guys, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <Block.h>
+#include <glib.h>
+#include <rpc/object.h>
+#include <rpc/serializer.h>
+#include "../linker_set.h"
+#include "../internal.h"
+#include "flat.h"
+
+struct rpc_flat
+{
+	volatile gint		rf_refcnt;
+	const char *		rf_base;
+	size_t			rf_size;
+	void *			rf_map;
+	size_t			rf_maplen;
+};
+
+struct flat_writer
+{
+	GByteArray *		fw_buf;
+	GHashTable *		fw_keys;
+	bool			fw_failed;
+};
+
+static uint64_t flat_append(struct flat_writer *, rpc_type_t, uint64_t,
+    const void *, size_t, const void *, size_t);
+static uint64_t flat_write_key(struct flat_writer *, const char *);
+static uint64_t flat_write_object(struct flat_writer *, rpc_object_t);
+static int flat_compare_keys(const void *, const void *);
+static rpc_flat_t flat_new(const void *, size_t);
+static const struct flat_node *flat_node(rpc_flat_t, rpc_flat_node_t,
+    rpc_type_t);
+static const struct flat_node *flat_children(rpc_flat_t, rpc_flat_node_t,
+    rpc_type_t, size_t);
+static rpc_flat_node_t flat_child(rpc_flat_node_t, rpc_flat_node_t);
+static rpc_object_t flat_build(rpc_flat_t, rpc_flat_node_t);
+
+/*
+ * Appends a node followed by up to two tails, padded to FLAT_ALIGN.
+ * Returns the offset of the node.
+ */
+static uint64_t
+flat_append(struct flat_writer *fw, rpc_type_t type, uint64_t value,
+    const void *tail, size_t taillen, const void *tail2, size_t tail2len)
+{
+	static const char zeroes[FLAT_ALIGN];
+	struct flat_node node;
+	uint64_t offset = fw->fw_buf->len;
+	size_t len;
+
+	memset(&node, 0, sizeof(node));
+	node.fn_type = (uint8_t)type;
+	node.fn_uint = value;
+
+	g_byte_array_append(fw->fw_buf, (const guint8 *)&node, sizeof(node));
+	if (taillen > 0)
+		g_byte_array_append(fw->fw_buf, tail, (guint)taillen);
+
+	if (tail2len > 0)
+		g_byte_array_append(fw->fw_buf, tail2, (guint)tail2len);
+
+	len = fw->fw_buf->len % FLAT_ALIGN;
+	if (len != 0) {
+		g_byte_array_append(fw->fw_buf, (const guint8 *)zeroes,
+		    (guint)(FLAT_ALIGN - len));
+	}
+
+	return (offset);
+}
+
+static uint64_t
+flat_write_key(struct flat_writer *fw, const char *key)
+{
+	gpointer offset;
+
+	/* Datasets tend to repeat the same keys, so store each once */
+	if (g_hash_table_lookup_extended(fw->fw_keys, key, NULL, &offset))
+		return ((uint64_t)GPOINTER_TO_SIZE(offset));
+
+	offset = GSIZE_TO_POINTER(flat_append(fw, RPC_TYPE_STRING,
+	    strlen(key), key, strlen(key) + 1, NULL, 0));
+	g_hash_table_insert(fw->fw_keys, g_strdup(key), offset);
+	return ((uint64_t)GPOINTER_TO_SIZE(offset));
+}
+
+static int
+flat_compare_keys(const void *a, const void *b)
+{
+
+	return (strcmp(*(const char * const *)a, *(const char * const *)b));
+}
+
+static uint64_t
+flat_write_object(struct flat_writer *fw, rpc_object_t obj)
+{
+	uint64_t *offsets;
+	struct flat_pair *pairs;
+	GPtrArray *keys;
+	rpc_object_t extra;
+	uint64_t result;
+	uint64_t refs[2];
+	const char *str;
+	size_t count;
+	size_t i;
+
+	if (fw->fw_failed)
+		return (0);
+
+	switch (rpc_get_type(obj)) {
+	case RPC_TYPE_NULL:
+		return (flat_append(fw, RPC_TYPE_NULL, 0, NULL, 0, NULL, 0));
+
+	case RPC_TYPE_BOOL:
+		return (flat_append(fw, RPC_TYPE_BOOL, rpc_bool_get_value(obj),
+		    NULL, 0, NULL, 0));
+
+	case RPC_TYPE_INT64:
+		return (flat_append(fw, RPC_TYPE_INT64,
+		    (uint64_t)rpc_int64_get_value(obj), NULL, 0, NULL, 0));
+
+	case RPC_TYPE_UINT64:
+		return (flat_append(fw, RPC_TYPE_UINT64,
+		    rpc_uint64_get_value(obj), NULL, 0, NULL, 0));
+
+	case RPC_TYPE_DATE:
+		return (flat_append(fw, RPC_TYPE_DATE,
+		    (uint64_t)rpc_date_get_value_ns(obj), NULL, 0, NULL, 0));
+
+	case RPC_TYPE_FD:
+		return (flat_append(fw, RPC_TYPE_FD,
+		    (uint64_t)(int64_t)rpc_fd_get_value(obj), NULL, 0, NULL,
+		    0));
+
+	case RPC_TYPE_DOUBLE:
+		result = flat_append(fw, RPC_TYPE_DOUBLE, 0, NULL, 0, NULL,
+		    0);
+		((struct flat_node *)(fw->fw_buf->data + result))->fn_double =
+		    rpc_double_get_value(obj);
+		return (result);
+
+	case RPC_TYPE_STRING:
+		str = rpc_string_get_string_ptr(obj);
+		count = rpc_string_get_length(obj);
+		return (flat_append(fw, RPC_TYPE_STRING, count, str, count,
+		    "", 1));
+
+	case RPC_TYPE_BINARY:
+		count = rpc_data_get_length(obj);
+		return (flat_append(fw, RPC_TYPE_BINARY, count,
+		    rpc_data_get_bytes_ptr(obj), count, NULL, 0));
+
+	case RPC_TYPE_ARRAY:
+		count = rpc_array_get_count(obj);
+		offsets = g_malloc0_n(MAX(count, 1), sizeof(*offsets));
+		rpc_array_apply(obj, ^(size_t idx, rpc_object_t value) {
+			offsets[idx] = flat_write_object(fw, value);
+			return ((bool)!fw->fw_failed);
+		});
+
+		result = flat_append(fw, RPC_TYPE_ARRAY, count, offsets,
+		    count * sizeof(*offsets), NULL, 0);
+		g_free(offsets);
+		return (result);
+
+	case RPC_TYPE_DICTIONARY:
+		keys = g_ptr_array_new();
+		rpc_dictionary_apply(obj, ^(const char *key, rpc_object_t v) {
+			g_ptr_array_add(keys, (gpointer)key);
+			return ((bool)true);
+		});
+
+		/* Sorted, so that readers can bisect */
+		qsort(keys->pdata, keys->len, sizeof(gpointer),
+		    flat_compare_keys);
+		pairs = g_malloc0_n(MAX(keys->len, 1), sizeof(*pairs));
+		for (i = 0; i < keys->len; i++) {
+			pairs[i].fp_key = flat_write_key(fw,
+			    g_ptr_array_index(keys, i));
+			pairs[i].fp_value = flat_write_object(fw,
+			    rpc_dictionary_get_value(obj,
+			    g_ptr_array_index(keys, i)));
+		}
+
+		result = flat_append(fw, RPC_TYPE_DICTIONARY, keys->len, pairs,
+		    keys->len * sizeof(*pairs), NULL, 0);
+		g_ptr_array_free(keys, true);
+		g_free(pairs);
+		return (result);
+
+	case RPC_TYPE_ERROR:
+		str = rpc_error_get_message(obj);
+		extra = rpc_error_get_extra(obj);
+		refs[0] = flat_write_key(fw, str != NULL ? str : "");
+		refs[1] = extra != NULL ? flat_write_object(fw, extra) : 0;
+		return (flat_append(fw, RPC_TYPE_ERROR,
+		    (uint64_t)(int64_t)rpc_error_get_code(obj), refs,
+		    sizeof(refs), NULL, 0));
+
+	default:
+		/* Shared memory makes no sense on disk */
+		rpc_set_last_errorf(EINVAL, "Cannot store %s objects flat",
+		    rpc_get_type_name(rpc_get_type(obj)));
+		fw->fw_failed = true;
+		return (0);
+	}
+}
+
+int
+rpc_flat_serialize(rpc_object_t obj, void **frame, size_t *size)
+{
+	struct flat_writer fw;
+	struct flat_header hdr;
+
+	memset(&hdr, 0, sizeof(hdr));
+	fw.fw_buf = g_byte_array_new();
+	fw.fw_keys = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+	    NULL);
+	fw.fw_failed = false;
+
+	g_byte_array_append(fw.fw_buf, (const guint8 *)&hdr, sizeof(hdr));
+	hdr.fh_root = flat_write_object(&fw, obj);
+	g_hash_table_destroy(fw.fw_keys);
+
+	if (fw.fw_failed) {
+		g_byte_array_free(fw.fw_buf, true);
+		return (-1);
+	}
+
+	hdr.fh_magic = FLAT_MAGIC;
+	hdr.fh_version = FLAT_VERSION;
+	hdr.fh_size = fw.fw_buf->len;
+	memcpy(fw.fw_buf->data, &hdr, sizeof(hdr));
+
+	*size = fw.fw_buf->len;
+	*frame = g_byte_array_free(fw.fw_buf, false);
+	return (0);
+}
+
+rpc_object_t
+rpc_flat_deserialize(const void *frame, size_t size)
+{
+	rpc_flat_t flat;
+	rpc_object_t result;
+
+	flat = rpc_flat_open_buffer(frame, size);
+	if (flat == NULL)
+		return (NULL);
+
+	result = rpc_flat_get_object(flat, rpc_flat_get_root(flat));
+	rpc_flat_close(flat);
+	return (result);
+}
+
+static rpc_flat_t
+flat_new(const void *buf, size_t len)
+{
+	const struct flat_header *hdr = buf;
+	rpc_flat_t flat;
+
+	if (len < sizeof(*hdr) || hdr->fh_magic != FLAT_MAGIC) {
+		rpc_set_last_errorf(EINVAL, "Not flat data");
+		return (NULL);
+	}
+
+	if (hdr->fh_version != FLAT_VERSION) {
+		rpc_set_last_errorf(ENOTSUP, "Unsupported flat data version %u",
+		    hdr->fh_version);
+		return (NULL);
+	}
+
+	if (hdr->fh_size > len) {
+		rpc_set_last_errorf(EINVAL, "Truncated flat data");
+		return (NULL);
+	}
+
+	/* The node bound checks below rely on there being a root node */
+	if (hdr->fh_size < sizeof(*hdr) + sizeof(struct flat_node)) {
+		rpc_set_last_errorf(EINVAL, "Flat data too short");
+		return (NULL);
+	}
+
+	flat = g_malloc0(sizeof(*flat));
+	flat->rf_refcnt = 1;
+	flat->rf_base = buf;
+	flat->rf_size = (size_t)hdr->fh_size;
+	return (flat);
+}
+
+/*
+ * Returns a node after checking that it lies within the view and, unless
+ * @type is RPC_TYPE_NULL, that it has the given type.
+ */
+static const struct flat_node *
+flat_node(rpc_flat_t flat, rpc_flat_node_t node, rpc_type_t type)
+{
+	const struct flat_node *fn;
+
+	if (node < sizeof(struct flat_header) || node % FLAT_ALIGN != 0 ||
+	    node > flat->rf_size - sizeof(*fn))
+		return (NULL);
+
+	fn = (const struct flat_node *)(flat->rf_base + node);
+	switch (fn->fn_type) {
+	case RPC_TYPE_NULL:
+	case RPC_TYPE_BOOL:
+	case RPC_TYPE_UINT64:
+	case RPC_TYPE_INT64:
+	case RPC_TYPE_DOUBLE:
+	case RPC_TYPE_DATE:
+	case RPC_TYPE_STRING:
+	case RPC_TYPE_BINARY:
+	case RPC_TYPE_FD:
+	case RPC_TYPE_DICTIONARY:
+	case RPC_TYPE_ARRAY:
+	case RPC_TYPE_ERROR:
+		break;
+
+	default:
+		return (NULL);
+	}
+
+	if (type != RPC_TYPE_NULL && fn->fn_type != type)
+		return (NULL);
+
+	return (fn);
+}
+
+/*
+ * Same as flat_node(), also checking that the @size bytes of each of the
+ * fn_count entries following the node lie within the view.
+ */
+static const struct flat_node *
+flat_children(rpc_flat_t flat, rpc_flat_node_t node, rpc_type_t type,
+    size_t size)
+{
+	const struct flat_node *fn;
+	size_t room;
+
+	fn = flat_node(flat, node, type);
+	if (fn == NULL)
+		return (NULL);
+
+	room = flat->rf_size - (size_t)node - sizeof(*fn);
+	if (fn->fn_count > room / size)
+		return (NULL);
+
+	return (fn);
+}
+
+static rpc_flat_node_t
+flat_child(rpc_flat_node_t parent, rpc_flat_node_t child)
+{
+
+	/* Children come first, anything else is corrupt or a cycle */
+	return (child < parent ? child : RPC_FLAT_NONE);
+}
+
+rpc_flat_t
+rpc_flat_open(const char *path)
+{
+	struct stat st;
+	rpc_flat_t flat;
+	void *map;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		rpc_set_last_errorf(errno, "Cannot open %s: %s", path,
+		    strerror(errno));
+		return (NULL);
+	}
+
+	if (fstat(fd, &st) != 0) {
+		rpc_set_last_errorf(errno, "Cannot stat %s: %s", path,
+		    strerror(errno));
+		close(fd);
+		return (NULL);
+	}
+
+	if (st.st_size < (off_t)sizeof(struct flat_header)) {
+		rpc_set_last_errorf(EINVAL, "Not flat data");
+		close(fd);
+		return (NULL);
+	}
+
+	map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		rpc_set_last_errorf(errno, "Cannot map %s: %s", path,
+		    strerror(errno));
+		return (NULL);
+	}
+
+	flat = flat_new(map, (size_t)st.st_size);
+	if (flat == NULL) {
+		munmap(map, (size_t)st.st_size);
+		return (NULL);
+	}
+
+	flat->rf_map = map;
+	flat->rf_maplen = (size_t)st.st_size;
+	return (flat);
+}
+
+rpc_flat_t
+rpc_flat_open_buffer(const void *buf, size_t len)
+{
+
+	return (flat_new(buf, len));
+}
+
+void
+rpc_flat_close(rpc_flat_t flat)
+{
+
+	if (!g_atomic_int_dec_and_test(&flat->rf_refcnt))
+		return;
+
+	if (flat->rf_map != NULL)
+		munmap(flat->rf_map, flat->rf_maplen);
+
+	g_free(flat);
+}
+
+rpc_flat_node_t
+rpc_flat_get_root(rpc_flat_t flat)
+{
+	const struct flat_header *hdr;
+
+	hdr = (const struct flat_header *)flat->rf_base;
+	return (flat_node(flat, hdr->fh_root, RPC_TYPE_NULL) != NULL ?
+	    hdr->fh_root : RPC_FLAT_NONE);
+}
+
+rpc_type_t
+rpc_flat_get_type(rpc_flat_t flat, rpc_flat_node_t node)
+{
+	const struct flat_node *fn;
+
+	fn = flat_node(flat, node, RPC_TYPE_NULL);
+	return (fn != NULL ? (rpc_type_t)fn->fn_type : RPC_TYPE_NULL);
+}
+
+size_t
+rpc_flat_get_count(rpc_flat_t flat, rpc_flat_node_t node)
+{
+	const struct flat_node *fn;
+
+	fn = flat_node(flat, node, RPC_TYPE_NULL);
+	if (fn == NULL)
+		return (0);
+
+	switch (fn->fn_type) {
+	case RPC_TYPE_STRING:
+		return (rpc_flat_get_string(flat, node) != NULL ?
+		    (size_t)fn->fn_count : 0);
+
+	case RPC_TYPE_BINARY:
+		return (flat_children(flat, node, RPC_TYPE_BINARY, 1) != NULL ?
+		    (size_t)fn->fn_count : 0);
+
+	case RPC_TYPE_ARRAY:
+		return (flat_children(flat, node, RPC_TYPE_ARRAY,
+		    sizeof(uint64_t)) != NULL ? (size_t)fn->fn_count : 0);
+
+	case RPC_TYPE_DICTIONARY:
+		return (flat_children(flat, node, RPC_TYPE_DICTIONARY,
+		    sizeof(struct flat_pair)) != NULL ?
+		    (size_t)fn->fn_count : 0);
+
+	default:
+		return (0);
+	}
+}
+
+rpc_flat_node_t
+rpc_flat_array_get(rpc_flat_t flat, rpc_flat_node_t node, size_t index)
+{
+	const struct flat_node *fn;
+	const uint64_t *offsets;
+
+	fn = flat_children(flat, node, RPC_TYPE_ARRAY, sizeof(*offsets));
+	if (fn == NULL || index >= fn->fn_count)
+		return (RPC_FLAT_NONE);
+
+	offsets = (const uint64_t *)(fn + 1);
+	return (flat_child(node, offsets[index]));
+}
+
+rpc_flat_node_t
+rpc_flat_dictionary_get(rpc_flat_t flat, rpc_flat_node_t node,
+    const char *key)
+{
+	const struct flat_node *fn;
+	const struct flat_pair *pairs;
+	const char *name;
+	size_t lo = 0;
+	size_t hi;
+	size_t mid;
+	int cmp;
+
+	fn = flat_children(flat, node, RPC_TYPE_DICTIONARY, sizeof(*pairs));
+	if (fn == NULL)
+		return (RPC_FLAT_NONE);
+
+	pairs = (const struct flat_pair *)(fn + 1);
+	hi = (size_t)fn->fn_count;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		name = rpc_flat_get_string(flat,
+		    flat_child(node, pairs[mid].fp_key));
+		if (name == NULL)
+			return (RPC_FLAT_NONE);
+
+		cmp = strcmp(key, name);
+		if (cmp == 0)
+			return (flat_child(node, pairs[mid].fp_value));
+
+		if (cmp < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	return (RPC_FLAT_NONE);
+}
+
+const char *
+rpc_flat_dictionary_get_key(rpc_flat_t flat, rpc_flat_node_t node,
+    size_t index)
+{
+	const struct flat_node *fn;
+	const struct flat_pair *pairs;
+
+	fn = flat_children(flat, node, RPC_TYPE_DICTIONARY, sizeof(*pairs));
+	if (fn == NULL || index >= fn->fn_count)
+		return (NULL);
+
+	pairs = (const struct flat_pair *)(fn + 1);
+	return (rpc_flat_get_string(flat, flat_child(node,
+	    pairs[index].fp_key)));
+}
+
+rpc_flat_node_t
+rpc_flat_dictionary_get_value(rpc_flat_t flat, rpc_flat_node_t node,
+    size_t index)
+{
+	const struct flat_node *fn;
+	const struct flat_pair *pairs;
+
+	fn = flat_children(flat, node, RPC_TYPE_DICTIONARY, sizeof(*pairs));
+	if (fn == NULL || index >= fn->fn_count)
+		return (RPC_FLAT_NONE);
+
+	pairs = (const struct flat_pair *)(fn + 1);
+	return (flat_child(node, pairs[index].fp_value));
+}
+
+bool
+rpc_flat_get_bool(rpc_flat_t flat, rpc_flat_node_t node)
+{
+	const struct flat_node *fn;
+
+	fn = flat_node(flat, node, RPC_TYPE_BOOL);
+	return (fn != NULL && fn->fn_uint != 0);
+}
+
+int64_t
+rpc_flat_get_int64(rpc_flat_t flat, rpc_flat_node_t node)
+{
+	const struct flat_node *fn;
+
+	fn = flat_node(flat, node, RPC_TYPE_INT64);
+	return (fn != NULL ? fn->fn_int : 0);
+}
+
+uint64_t
+rpc_flat_get_uint64(rpc_flat_t flat, rpc_flat_node_t node)
+{
+	const struct flat_node *fn;
+
+	fn = flat_node(flat, node, RPC_TYPE_UINT64);
+	return (fn != NULL ? fn->fn_uint : 0);
+}
+
+double
+rpc_flat_get_double(rpc_flat_t flat, rpc_flat_node_t node)
+{
+	const struct flat_node *fn;
+
+	fn = flat_node(flat, node, RPC_TYPE_DOUBLE);
+	return (fn != NULL ? fn->fn_double : 0);
+}
+
+int64_t
+rpc_flat_get_date(rpc_flat_t flat, rpc_flat_node_t node)
+{
+	const struct flat_node *fn;
+
+	fn = flat_node(flat, node, RPC_TYPE_DATE);
+	return (fn != NULL ? fn->fn_int : 0);
+}
+
+const char *
+rpc_flat_get_string(rpc_flat_t flat, rpc_flat_node_t node)
+{
+	const struct flat_node *fn;
+	const char *str;
+
+	/* The terminating NUL has to be there too */
+	fn = flat_children(flat, node, RPC_TYPE_STRING, 1);
+	if (fn == NULL || fn->fn_count == flat->rf_size - node - sizeof(*fn))
+		return (NULL);
+
+	str = (const char *)(fn + 1);
+	return (str[fn->fn_count] == '\0' ? str : NULL);
+}
+
+const void *
+rpc_flat_get_binary(rpc_flat_t flat, rpc_flat_node_t node, size_t *lenp)
+{
+	const struct flat_node *fn;
+
+	fn = flat_children(flat, node, RPC_TYPE_BINARY, 1);
+	if (fn == NULL) {
+		*lenp = 0;
+		return (NULL);
+	}
+
+	*lenp = (size_t)fn->fn_count;
+	return (fn + 1);
+}
+
+static rpc_object_t
+flat_build(rpc_flat_t flat, rpc_flat_node_t node)
+{
+	const struct flat_node *fn;
+	const uint64_t *refs;
+	rpc_object_t result;
+	rpc_object_t value;
+	const char *str;
+	const void *data;
+	void *copy;
+	size_t count;
+	size_t len;
+	size_t i;
+
+	fn = flat_node(flat, node, RPC_TYPE_NULL);
+	if (fn == NULL) {
+		rpc_set_last_errorf(EINVAL, "Invalid flat node");
+		return (NULL);
+	}
+
+	switch (fn->fn_type) {
+	case RPC_TYPE_NULL:
+		return (rpc_null_create());
+
+	case RPC_TYPE_BOOL:
+		return (rpc_bool_create(fn->fn_uint != 0));
+
+	case RPC_TYPE_INT64:
+		return (rpc_int64_create(fn->fn_int));
+
+	case RPC_TYPE_UINT64:
+		return (rpc_uint64_create(fn->fn_uint));
+
+	case RPC_TYPE_DOUBLE:
+		return (rpc_double_create(fn->fn_double));
+
+	case RPC_TYPE_DATE:
+		return (rpc_date_create_ns(fn->fn_int));
+
+	case RPC_TYPE_FD:
+		return (rpc_fd_create((int)fn->fn_int));
+
+	case RPC_TYPE_STRING:
+		str = rpc_flat_get_string(flat, node);
+		if (str == NULL)
+			break;
+
+		return (rpc_string_create_len(str, (size_t)fn->fn_count));
+
+	case RPC_TYPE_BINARY:
+		data = rpc_flat_get_binary(flat, node, &len);
+		if (data == NULL)
+			break;
+
+		/* Borrowed buffers may go away, mapped files stay */
+		if (flat->rf_map == NULL) {
+			copy = g_malloc(len);
+			memcpy(copy, data, len);
+			return (rpc_data_create(copy, len,
+			    RPC_BINARY_DESTRUCTOR(g_free)));
+		}
+
+		g_atomic_int_inc(&flat->rf_refcnt);
+		return (rpc_data_create(data, len, ^(void *buf __unused) {
+			rpc_flat_close(flat);
+		}));
+
+	case RPC_TYPE_ARRAY:
+		count = rpc_flat_get_count(flat, node);
+		if (count != (size_t)fn->fn_count)
+			break;
+
+		result = rpc_array_create();
+		for (i = 0; i < count; i++) {
+			value = flat_build(flat, rpc_flat_array_get(flat, node,
+			    i));
+			if (value == NULL) {
+				rpc_release(result);
+				return (NULL);
+			}
+
+			rpc_array_append_stolen_value(result, value);
+		}
+
+		return (result);
+
+	case RPC_TYPE_DICTIONARY:
+		count = rpc_flat_get_count(flat, node);
+		if (count != (size_t)fn->fn_count)
+			break;
+
+		result = rpc_dictionary_create();
+		for (i = 0; i < count; i++) {
+			str = rpc_flat_dictionary_get_key(flat, node, i);
+			value = str != NULL ? flat_build(flat,
+			    rpc_flat_dictionary_get_value(flat, node, i)) :
+			    NULL;
+			if (value == NULL) {
+				rpc_release(result);
+				return (NULL);
+			}
+
+			rpc_dictionary_steal_value(result, str, value);
+		}
+
+		return (result);
+
+	case RPC_TYPE_ERROR:
+		if (flat->rf_size - node - sizeof(*fn) < 2 * sizeof(*refs))
+			break;
+
+		refs = (const uint64_t *)(fn + 1);
+		str = rpc_flat_get_string(flat, flat_child(node, refs[0]));
+		if (str == NULL)
+			break;
+
+		value = NULL;
+		if (refs[1] != 0) {
+			value = flat_build(flat, flat_child(node, refs[1]));
+			if (value == NULL)
+				return (NULL);
+		}
+
+		result = rpc_error_create((int)fn->fn_int, str, value);
+		if (value != NULL)
+			rpc_release(value);
+
+		return (result);
+	}
+
+	rpc_set_last_errorf(EINVAL, "Invalid flat node");
+	return (NULL);
+}
+
+rpc_object_t
+rpc_flat_get_object(rpc_flat_t flat, rpc_flat_node_t node)
+{
+
+	return (flat_build(flat, node));
+}
+
+static struct rpc_serializer flat_serializer = {
+	.name = "flat",
+	.serialize = &rpc_flat_serialize,
+	.deserialize = &rpc_flat_deserialize
+};
+
+DECLARE_SERIALIZER(flat_serializer);
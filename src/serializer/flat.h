@@ -0,0 +1,94 @@
+/*
+ * Copyright 2015-2017 Two Pore Guys, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+#ifndef LIBRPC_FLAT_H
+#define LIBRPC_FLAT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <rpc/object.h>
+
+/*
+ * Flat layout: a header followed by nodes, each aligned to FLAT_ALIGN
+ * bytes, in host byte order. Every node starts with a flat_node. Its
+ * value is the scalar itself, the byte length of a string or binary,
+ * or the element count of an array or dictionary. What follows the
+ * node depends on its type:
+ *
+ * - string: the bytes and a terminating NUL
+ * - binary: the bytes
+ * - array: an offset per element
+ * - dictionary: a flat_pair per entry, sorted by key
+ * - error: the offsets of the message and of the extra data, or 0
+ *
+ * Offsets are from the start of the buffer. Children are always
+ * written before their parent, so a child's offset is lower than its
+ * parent's; readers rely on it to rule out cycles. Dictionary keys are
+ * string nodes, shared between entries with the same key.
+ */
+#define	FLAT_MAGIC		0x46435052
+#define	FLAT_VERSION		1
+#define	FLAT_ALIGN		8
+
+struct flat_header
+{
+	uint32_t		fh_magic;
+	uint32_t		fh_version;
+	uint64_t		fh_root;
+	uint64_t		fh_size;
+};
+
+struct flat_node
+{
+	uint8_t			fn_type;
+	uint8_t			fn_pad[7];
+	union {
+		int64_t		fn_int;
+		uint64_t	fn_uint;
+		double		fn_double;
+		uint64_t	fn_count;
+	};
+};
+
+struct flat_pair
+{
+	uint64_t		fp_key;
+	uint64_t		fp_value;
+};
+
+int rpc_flat_serialize(rpc_object_t, void **, size_t *);
+rpc_object_t rpc_flat_deserialize(const void *, size_t);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIBRPC_FLAT_H */
@@ -31,7 +31,6 @@
 #include <math.h>
 #include <rpc/object.h>
 #include <yajl/yajl_parse.h>
-#include <yajl/yajl_gen.h>
 #include "../linker_set.h"
 #include "../internal.h"
 #include "json.h"
@@ -43,57 +42,161 @@ struct parse_context
 	char *key_buf;
 };
 
-static yajl_gen_status rpc_json_write_object(yajl_gen gen, rpc_object_t object);
+/* Extension and error keys, quoted and followed by a colon */
+#define	RPC_JSON_KEY(_key)	"\"" _key "\":"
+#define	RPC_JSON_MAX_DEPTH	128
 
-static inline yajl_gen_status
-rpc_json_write_ext_long(yajl_gen gen, const unsigned char *key, long value)
-{
-	yajl_gen_status status;
+#define	rpc_json_append_literal(_out, _str)				\
+	g_string_append_len(_out, _str, sizeof(_str) - 1)
+
+#define	rpc_json_write_ext(_out, _object, _type, _depth)		\
+	rpc_json_write_object_ext(_out, _object, RPC_JSON_KEY(_type),	\
+	    sizeof(RPC_JSON_KEY(_type)) - 1, _depth)
+
+static int rpc_json_write_object(GString *out, rpc_object_t object,
+    int depth);
 
-	status = yajl_gen_string(gen, key, strlen((const char *)key));
-	if (status != yajl_gen_status_ok)
-		return (status);
+static const char rpc_json_hex[] = "0123456789ABCDEF";
 
-	status = yajl_gen_integer(gen, value);
-	return (status);
+/*
+ * Tells whether any of the eight bytes of a word is a control character,
+ * a quote or a backslash, using the usual "has byte less than" and
+ * "has zero byte" bit tricks.
+ */
+static inline bool
+rpc_json_word_needs_escape(uint64_t word)
+{
+	const uint64_t ones = 0x0101010101010101ULL;
+	const uint64_t highs = 0x8080808080808080ULL;
+	uint64_t quote = word ^ (ones * '"');
+	uint64_t bslash = word ^ (ones * '\\');
+	uint64_t found;
+
+	found = (word - ones * 0x20) & ~word;
+	found |= (quote - ones) & ~quote;
+	found |= (bslash - ones) & ~bslash;
+	return ((found & highs) != 0);
 }
 
-static inline yajl_gen_status
-rpc_json_write_ext_str(yajl_gen gen, const unsigned char *key,
-    const char *value)
+/*
+ * Escapes the same characters as yajl_gen does by default, copying
+ * clean runs of the string in one go.
+ */
+static void
+rpc_json_escape(GString *out, const char *str, size_t len)
 {
-	yajl_gen_status status;
+	const char *end = str + len;
+	const char *run = str;
+	const char *p = str;
+	char esc[6] = { '\\', 'u', '0', '0', '0', '0' };
+	uint64_t word;
+	unsigned char c;
+
+	while (p < end) {
+		if (end - p >= (ptrdiff_t)sizeof(word)) {
+			memcpy(&word, p, sizeof(word));
+			if (!rpc_json_word_needs_escape(word)) {
+				p += sizeof(word);
+				continue;
+			}
+		}
+
+		c = (unsigned char)*p;
+		if (c >= 0x20 && c != '"' && c != '\\') {
+			p++;
+			continue;
+		}
+
+		g_string_append_len(out, run, p - run);
+		switch (c) {
+		case '"':
+			rpc_json_append_literal(out, "\\\"");
+			break;
+
+		case '\\':
+			rpc_json_append_literal(out, "\\\\");
+			break;
+
+		case '\n':
+			rpc_json_append_literal(out, "\\n");
+			break;
+
+		case '\r':
+			rpc_json_append_literal(out, "\\r");
+			break;
+
+		case '\t':
+			rpc_json_append_literal(out, "\\t");
+			break;
 
-	status = yajl_gen_string(gen, key, strlen((const char *)key));
-	if (status != yajl_gen_status_ok)
-		return (status);
+		case '\b':
+			rpc_json_append_literal(out, "\\b");
+			break;
+
+		case '\f':
+			rpc_json_append_literal(out, "\\f");
+			break;
+
+		default:
+			esc[4] = rpc_json_hex[c >> 4];
+			esc[5] = rpc_json_hex[c & 0xf];
+			g_string_append_len(out, esc, sizeof(esc));
+			break;
+		}
+
+		run = ++p;
+	}
 
-	status = yajl_gen_string(gen, (const unsigned char *)value,
-	    strlen(value));
-	return (status);
+	g_string_append_len(out, run, p - run);
 }
 
-static inline yajl_gen_status
-rpc_json_write_ext_obj(yajl_gen gen, const unsigned char *key,
-    rpc_object_t value)
+static void
+rpc_json_write_string(GString *out, const char *str, size_t len)
 {
-	yajl_gen_status status;
 
-	status = yajl_gen_string(gen, key, strlen((const char *)key));
-	if (status != yajl_gen_status_ok)
-		return (status);
+	g_string_append_c(out, '"');
+	rpc_json_escape(out, str, len);
+	g_string_append_c(out, '"');
+}
 
-	status = rpc_json_write_object(gen, value);
+static void
+rpc_json_write_int(GString *out, int64_t value)
+{
+	char buf[24];
+	char *p = buf + sizeof(buf);
+	uint64_t uval;
+
+	uval = value < 0 ? -(uint64_t)value : (uint64_t)value;
+	do {
+		*--p = (char)('0' + uval % 10);
+		uval /= 10;
+	} while (uval != 0);
+
+	if (value < 0)
+		*--p = '-';
 
-	return (status);
+	g_string_append_len(out, p, buf + sizeof(buf) - p);
 }
 
-#define rpc_json_write_ext(gen, key, value)		\
-	_Generic(((void)0, (void)0, value),		\
-		int64_t: rpc_json_write_ext_long,	\
-		const char *: rpc_json_write_ext_str,	\
-		rpc_object_t: rpc_json_write_ext_obj	\
-	)(gen, key, value)
+/*
+ * Uses 15 significant digits whenever they read back as the same value,
+ * which covers most doubles coming from decimal input, and falls back to
+ * 17 digits, which always do. Unlike printf(), this doesn't depend on
+ * the locale.
+ */
+static void
+rpc_json_write_double(GString *out, double value)
+{
+	char buf[G_ASCII_DTOSTR_BUF_SIZE];
+
+	g_ascii_formatd(buf, sizeof(buf), "%.15g", value);
+	if (g_ascii_strtod(buf, NULL) != value)
+		g_ascii_formatd(buf, sizeof(buf), "%.17g", value);
+
+	g_string_append(out, buf);
+	if (strspn(buf, "0123456789-") == strlen(buf))
+		rpc_json_append_literal(out, ".0");
+}
 
 static int
 rpc_json_context_insert_value(void *ctx_ptr, rpc_object_t value)
@@ -144,18 +247,14 @@ rpc_json_context_insert_value(void *ctx_ptr, rpc_object_t value)
 	return (1);
 }
 
-static void
-rpc_json_try_unpack_ext(void *ctx_ptr, rpc_object_t leaf)
+rpc_object_t
+rpc_json_unpack_ext(rpc_object_t leaf)
 {
-	struct parse_context *ctx = ctx_ptr;
-	rpc_object_t branch;
 	rpc_object_t dict_value;
 	rpc_object_t unpacked_value;
 	void *data_buf;
 	size_t data_len;
 	const char *base64_data;
-	GHashTableIter iter;
-	gpointer key, value;
 	int err_code;
 	const char *err_msg;
 	const char *dbl_type;
@@ -239,6 +338,22 @@ rpc_json_try_unpack_ext(void *ctx_ptr, rpc_object_t leaf)
 
 #endif
 	} else
+		return (NULL);
+
+	return (unpacked_value);
+}
+
+static void
+rpc_json_try_unpack_ext(void *ctx_ptr, rpc_object_t leaf)
+{
+	struct parse_context *ctx = ctx_ptr;
+	rpc_object_t branch;
+	rpc_object_t unpacked_value;
+	struct rpc_dict_entry *e;
+	size_t pos = 0;
+
+	unpacked_value = rpc_json_unpack_ext(leaf);
+	if (unpacked_value == NULL)
 		return;
 
 	branch = (rpc_object_t)g_queue_peek_head(ctx->leaf_stack);
@@ -249,12 +364,10 @@ rpc_json_try_unpack_ext(void *ctx_ptr, rpc_object_t leaf)
 		rpc_release(leaf);
 
 	} else if (branch->ro_type == RPC_TYPE_DICTIONARY) {
-		g_hash_table_iter_init(&iter, branch->ro_value.rv_dict);
-
-		while (g_hash_table_iter_next(&iter, &key, &value)) {
-			if (value == leaf) {
-				g_hash_table_iter_replace(&iter,
-				    unpacked_value);
+		while ((e = rpc_dict_next(branch->ro_value.rv_dict, &pos))) {
+			if (e->rde_value == leaf) {
+				e->rde_value = unpacked_value;
+				rpc_release_impl(leaf);
 				break;
 			}
 		}
@@ -393,50 +506,45 @@ static yajl_callbacks callbacks = {
     rpc_json_end_array
 };
 
-static yajl_gen_status
-rpc_json_write_object_ext(yajl_gen gen, rpc_object_t object,
-    const uint8_t *type, size_t type_size)
+static int
+rpc_json_write_object_ext(GString *out, rpc_object_t object,
+    const char *type, size_t type_size, int depth)
 {
-	yajl_gen_status status;
 	const void *data_buf;
 	char *base64_data;
 	double d_value;
+	int ret = 0;
 
-	if ((status = yajl_gen_map_open(gen)) != yajl_gen_status_ok)
-		return (status);
+	if (depth >= RPC_JSON_MAX_DEPTH)
+		return (-1);
 
-	status = yajl_gen_string(gen, type, type_size);
-	if (status != yajl_gen_status_ok)
-		return (status);
+	g_string_append_c(out, '{');
+	g_string_append_len(out, type, type_size);
 
 	switch (object->ro_type) {
 	case RPC_TYPE_UINT64:
-		status = yajl_gen_integer(gen,
-		    (long long)rpc_uint64_get_value(object));
+		rpc_json_write_int(out, (int64_t)rpc_uint64_get_value(object));
 		break;
 
 	case RPC_TYPE_DATE:
-		status = yajl_gen_integer(gen, rpc_date_get_value(object));
+		rpc_json_write_int(out, rpc_date_get_value(object));
 		break;
 
 	case RPC_TYPE_FD:
-		status = yajl_gen_integer(gen, rpc_fd_get_value(object));
+		rpc_json_write_int(out, rpc_fd_get_value(object));
 		break;
 
 	case RPC_TYPE_DOUBLE:
 		d_value = rpc_double_get_value(object);
 		if (d_value == INFINITY)
-			status = yajl_gen_string(gen,
-			    (const uint8_t *)JSON_EXTTYPE_DBL_INF,
-			    strlen(JSON_EXTTYPE_DBL_INF));
+			rpc_json_append_literal(out,
+			    "\"" JSON_EXTTYPE_DBL_INF "\"");
 		else if (d_value == -INFINITY)
-			status = yajl_gen_string(gen,
-			    (const uint8_t *)JSON_EXTTYPE_DBL_NINF,
-			    strlen(JSON_EXTTYPE_DBL_NINF));
+			rpc_json_append_literal(out,
+			    "\"" JSON_EXTTYPE_DBL_NINF "\"");
 		else
-			status = yajl_gen_string(gen,
-			    (const uint8_t *)JSON_EXTTYPE_DBL_NAN,
-			    strlen(JSON_EXTTYPE_DBL_NAN));
+			rpc_json_append_literal(out,
+			    "\"" JSON_EXTTYPE_DBL_NAN "\"");
 
 		break;
 
@@ -449,70 +557,61 @@ rpc_json_write_object_ext(yajl_gen gen, rpc_object_t object,
 			    object->ro_value.rv_bin.rbv_length);
 		}
 
-		status = yajl_gen_string(gen, (const uint8_t *)base64_data,
-		    strlen(base64_data));
+		/* Base64 never needs escaping */
+		g_string_append_c(out, '"');
+		g_string_append(out, base64_data);
+		g_string_append_c(out, '"');
 		g_free(base64_data);
 		break;
 
 	case RPC_TYPE_ERROR:
-		if ((status = yajl_gen_map_open(gen)) != yajl_gen_status_ok)
-			return (status);
-
-		status = rpc_json_write_ext(gen,
-		    (const uint8_t *)JSON_EXTTYPE_ERROR_CODE,
-		    (int64_t)rpc_error_get_code(object));
-		if (status != yajl_gen_status_ok)
-			return (status);
+		if (depth + 1 >= RPC_JSON_MAX_DEPTH)
+			return (-1);
 
-		status = rpc_json_write_ext(gen,
-		    (const uint8_t *)JSON_EXTTYPE_ERROR_MSG,
-		    rpc_error_get_message(object));
-		if (status != yajl_gen_status_ok)
-			return (status);
+		rpc_json_append_literal(out,
+		    "{" RPC_JSON_KEY(JSON_EXTTYPE_ERROR_CODE));
+		rpc_json_write_int(out, rpc_error_get_code(object));
+		rpc_json_append_literal(out,
+		    "," RPC_JSON_KEY(JSON_EXTTYPE_ERROR_MSG));
+		rpc_json_write_string(out, rpc_error_get_message(object),
+		    strlen(rpc_error_get_message(object)));
 
 		if (rpc_error_get_extra(object) != NULL) {
-			status = rpc_json_write_ext(gen,
-			    (const uint8_t *) JSON_EXTTYPE_ERROR_XTRA,
-			    rpc_error_get_extra(object));
-			if (status != yajl_gen_status_ok)
-				return (status);
+			rpc_json_append_literal(out,
+			    "," RPC_JSON_KEY(JSON_EXTTYPE_ERROR_XTRA));
+			ret = rpc_json_write_object(out,
+			    rpc_error_get_extra(object), depth + 2);
+			if (ret != 0)
+				return (ret);
 		}
 
 		if (rpc_error_get_stack(object) != NULL) {
-			status = rpc_json_write_ext(gen,
-			    (const uint8_t *) JSON_EXTTYPE_ERROR_STCK,
-			    rpc_error_get_stack(object));
-			if (status != yajl_gen_status_ok)
-				return (status);
+			rpc_json_append_literal(out,
+			    "," RPC_JSON_KEY(JSON_EXTTYPE_ERROR_STCK));
+			ret = rpc_json_write_object(out,
+			    rpc_error_get_stack(object), depth + 2);
+			if (ret != 0)
+				return (ret);
 		}
 
-		status = yajl_gen_map_close(gen);
+		g_string_append_c(out, '}');
 		break;
 
 #if defined(__linux__)
 	case RPC_TYPE_SHMEM:
-		if ((status = yajl_gen_map_open(gen)) != yajl_gen_status_ok)
-			return (status);
-
-		status = rpc_json_write_ext(gen,
-		    (const uint8_t *)JSON_EXTTYPE_SHMEM_ADDR,
-		    (int64_t)rpc_shmem_get_offset(object));
-		if (status != yajl_gen_status_ok)
-			return (status);
-
-		status = rpc_json_write_ext(gen,
-		    (const uint8_t *)JSON_EXTTYPE_SHMEM_LEN,
-		    (int64_t)rpc_shmem_get_size(object));
-		if (status != yajl_gen_status_ok)
-			return (status);
-
-		status = rpc_json_write_ext(gen,
-		    (const uint8_t *)JSON_EXTTYPE_SHMEM_FD,
-		    (int64_t)rpc_shmem_get_fd(object));
-		if (status != yajl_gen_status_ok)
-			return (status);
-
-		status = yajl_gen_map_close(gen);
+		if (depth + 1 >= RPC_JSON_MAX_DEPTH)
+			return (-1);
+
+		rpc_json_append_literal(out,
+		    "{" RPC_JSON_KEY(JSON_EXTTYPE_SHMEM_ADDR));
+		rpc_json_write_int(out, (int64_t)rpc_shmem_get_offset(object));
+		rpc_json_append_literal(out,
+		    "," RPC_JSON_KEY(JSON_EXTTYPE_SHMEM_LEN));
+		rpc_json_write_int(out, (int64_t)rpc_shmem_get_size(object));
+		rpc_json_append_literal(out,
+		    "," RPC_JSON_KEY(JSON_EXTTYPE_SHMEM_FD));
+		rpc_json_write_int(out, (int64_t)rpc_shmem_get_fd(object));
+		g_string_append_c(out, '}');
 		break;
 #endif
 
@@ -521,151 +620,147 @@ rpc_json_write_object_ext(yajl_gen gen, rpc_object_t object,
 
 	}
 
-	if (status != yajl_gen_status_ok)
-		return (status);
-
-	return (yajl_gen_map_close(gen));
+	g_string_append_c(out, '}');
+	return (ret);
 }
 
-static yajl_gen_status
-rpc_json_write_object(yajl_gen gen, rpc_object_t object)
+static int
+rpc_json_write_object(GString *out, rpc_object_t object, int depth)
 {
-	__block yajl_gen_status status;
+	__block int ret = 0;
+	__block bool first = true;
 	double value;
 
 	switch (object->ro_type) {
 	case RPC_TYPE_NULL:
-		return (yajl_gen_null(gen));
+		rpc_json_append_literal(out, "null");
+		return (0);
 
 	case RPC_TYPE_BOOL:
-		return (yajl_gen_bool(gen, rpc_bool_get_value(object)));
+		if (rpc_bool_get_value(object))
+			rpc_json_append_literal(out, "true");
+		else
+			rpc_json_append_literal(out, "false");
+
+		return (0);
 
 	case RPC_TYPE_INT64:
-		return (yajl_gen_integer(gen, rpc_int64_get_value(object)));
+		rpc_json_write_int(out, rpc_int64_get_value(object));
+		return (0);
 
 	case RPC_TYPE_UINT64:
-		return (rpc_json_write_object_ext(gen, object,
-		    (const uint8_t *)JSON_EXTTYPE_UINT64,
-		    strlen(JSON_EXTTYPE_UINT64)));
+		return (rpc_json_write_ext(out, object, JSON_EXTTYPE_UINT64,
+		    depth));
 
 	case RPC_TYPE_DATE:
-		return (rpc_json_write_object_ext(gen, object,
-		    (const uint8_t *)JSON_EXTTYPE_DATE,
-		    strlen(JSON_EXTTYPE_DATE)));
+		return (rpc_json_write_ext(out, object, JSON_EXTTYPE_DATE,
+		    depth));
 
 	case RPC_TYPE_BINARY:
-		return (rpc_json_write_object_ext(gen, object,
-		    (const uint8_t *)JSON_EXTTYPE_BINARY,
-		    strlen(JSON_EXTTYPE_BINARY)));
+		return (rpc_json_write_ext(out, object, JSON_EXTTYPE_BINARY,
+		    depth));
 
 	case RPC_TYPE_FD:
-		return (rpc_json_write_object_ext(gen, object,
-		    (const uint8_t *)JSON_EXTTYPE_FD,
-		    strlen(JSON_EXTTYPE_FD)));
+		return (rpc_json_write_ext(out, object, JSON_EXTTYPE_FD,
+		    depth));
 
 	case RPC_TYPE_ERROR:
-		return (rpc_json_write_object_ext(gen, object,
-		    (const uint8_t *)JSON_EXTTYPE_ERROR,
-		    strlen(JSON_EXTTYPE_ERROR)));
+		return (rpc_json_write_ext(out, object, JSON_EXTTYPE_ERROR,
+		    depth));
 
 #if defined(__linux__)
 	case RPC_TYPE_SHMEM:
-		return (rpc_json_write_object_ext(gen, object,
-		    (const uint8_t *)JSON_EXTTYPE_SHMEM,
-		    strlen(JSON_EXTTYPE_SHMEM)));
+		return (rpc_json_write_ext(out, object, JSON_EXTTYPE_SHMEM,
+		    depth));
 
 #endif
 	case RPC_TYPE_DOUBLE:
 		value = rpc_double_get_value(object);
 		if (!isfinite(value)) {
-			return (rpc_json_write_object_ext(gen, object,
-			    (const uint8_t *) JSON_EXTTYPE_DBL,
-			    strlen(JSON_EXTTYPE_DBL)));
+			return (rpc_json_write_ext(out, object,
+			    JSON_EXTTYPE_DBL, depth));
 		}
 
-		return (yajl_gen_double(gen, value));
+		rpc_json_write_double(out, value);
+		return (0);
 
 	case RPC_TYPE_STRING:
-		return (yajl_gen_string(gen,
-		    (const uint8_t *)rpc_string_get_string_ptr(object),
-		    rpc_string_get_length(object)));
+		rpc_json_write_string(out, rpc_string_get_string_ptr(object),
+		    rpc_string_get_length(object));
+		return (0);
 
 	case RPC_TYPE_DICTIONARY:
-		status = yajl_gen_map_open(gen);
-		if (status != yajl_gen_status_ok)
-			return (status);
+		if (depth >= RPC_JSON_MAX_DEPTH)
+			return (-1);
 
+		g_string_append_c(out, '{');
 		rpc_dictionary_apply(object, ^(const char *k, rpc_object_t v) {
-			char *esc_key;
-
-			if ((k[0] == '\\') || (k[0] == '$')) {
-				esc_key = g_strdup_printf("\\%s", k);
-				status = yajl_gen_string(gen,
-				    (const uint8_t *) esc_key, strlen(esc_key));
-				g_free(esc_key);
-			} else {
-				status = yajl_gen_string(gen,
-				    (const uint8_t *) k, strlen(k));
-			}
+			if (!first)
+				g_string_append_c(out, ',');
 
-			if (status != yajl_gen_status_ok)
-				return ((bool)false);
+			first = false;
 
-			status = rpc_json_write_object(gen, v);
-			if (status != yajl_gen_status_ok)
-				return ((bool)false);
-
-			return ((bool)true);
+			/* Keep user keys apart from extension type keys */
+			if ((k[0] == '\\') || (k[0] == '$')) {
+				rpc_json_append_literal(out, "\"\\\\");
+				rpc_json_escape(out, k, strlen(k));
+				g_string_append_c(out, '"');
+			} else
+				rpc_json_write_string(out, k, strlen(k));
+
+			g_string_append_c(out, ':');
+			ret = rpc_json_write_object(out, v, depth + 1);
+			return ((bool)(ret == 0));
 		});
-		if (status != yajl_gen_status_ok)
-			return (status);
+		if (ret != 0)
+			return (ret);
 
-		return (yajl_gen_map_close(gen));
+		g_string_append_c(out, '}');
+		return (0);
 
 	case RPC_TYPE_ARRAY:
-		status = yajl_gen_array_open(gen);
-		if (status != yajl_gen_status_ok)
-			return (status);
+		if (depth >= RPC_JSON_MAX_DEPTH)
+			return (-1);
 
+		g_string_append_c(out, '[');
 		rpc_array_apply(object, ^(size_t idx __unused, rpc_object_t v) {
-			status = rpc_json_write_object(gen, v);
-			if (status != yajl_gen_status_ok)
-				return ((bool)false);
+			if (!first)
+				g_string_append_c(out, ',');
 
-			return ((bool)true);
+			first = false;
+			ret = rpc_json_write_object(out, v, depth + 1);
+			return ((bool)(ret == 0));
 		});
-		if (status != yajl_gen_status_ok)
-			return (status);
+		if (ret != 0)
+			return (ret);
 
-		return (yajl_gen_array_close(gen));
+		g_string_append_c(out, ']');
+		return (0);
 	}
 
-	return (yajl_gen_status_ok);
+	return (0);
 }
 
 int
 rpc_json_serialize(rpc_object_t obj, void **frame, size_t *size)
 {
-	yajl_gen gen = yajl_gen_alloc(NULL);
-	yajl_gen_status status;
 	GString *out_buffer;
 
 	out_buffer = g_string_new(NULL);
-	yajl_gen_config(gen, yajl_gen_print_callback,
-	    (yajl_print_t)g_string_append_len, (void *)out_buffer);
-
-	if ((status = rpc_json_write_object(gen, obj)) != yajl_gen_status_ok)
-		goto end;
+	if (rpc_json_write_object(out_buffer, obj, 0) != 0) {
+		g_string_free(out_buffer, true);
+		*frame = NULL;
+		rpc_set_last_error(EINVAL, "Object nested too deeply", NULL);
+		return (-1);
+	}
 
 	*size = out_buffer->len;
-
-end:	yajl_gen_free(gen);
 	*frame = g_string_free(out_buffer, false);
-	return (status);
+	return (0);
 }
 
 rpc_object_t
-rpc_json_deserialize(const void *frame, size_t size)
+rpc_json_yajl_deserialize(const void *frame, size_t size)
 {
 	yajl_handle handle;
 	struct parse_context ctx;
@@ -694,6 +789,17 @@ end:
 	return (ctx.result);
 }
 
+rpc_object_t
+rpc_json_deserialize(const void *frame, size_t size)
+{
+
+#if defined(JSON_FAST_PARSER)
+	return (rpc_json_fast_deserialize(frame, size));
+#else
+	return (rpc_json_yajl_deserialize(frame, size));
+#endif
+}
+
 static struct rpc_serializer json_serializer = {
 	.name = "json",
 	.serialize = &rpc_json_serialize,
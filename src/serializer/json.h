@@ -58,6 +58,12 @@ extern "C" {
 
 int rpc_json_serialize(rpc_object_t, void **, size_t *);
 rpc_object_t rpc_json_deserialize(const void *, size_t);
+rpc_object_t rpc_json_yajl_deserialize(const void *, size_t);
+rpc_object_t rpc_json_unpack_ext(rpc_object_t);
+
+#if defined(JSON_FAST_PARSER)
+rpc_object_t rpc_json_fast_deserialize(const void *, size_t);
+#endif
 
 #ifdef __cplusplus
 }
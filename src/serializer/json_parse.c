@@ -0,0 +1,690 @@
+/*
+ * Copyright 2015-2017 Two Pore Guys, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Two-stage JSON parser.
+ *
+ * The first stage makes a single pass over the input, validating strings
+ * and recording where every token starts. The second stage walks that
+ * index and builds the object tree without going back to the lexer, using
+ * an explicit stack so that deeply nested input can't exhaust the C stack.
+ * The result is the same as with the yajl based parser, including the
+ * extension types and escaped keys written by rpc_json_serialize().
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+#include <rpc/object.h>
+#include "../internal.h"
+#include "json.h"
+
+#define	RPC_JSON_NUMBER_BUF	64
+
+struct rpc_json_token
+{
+	uint32_t		rjt_pos;
+	uint32_t		rjt_len;
+	bool			rjt_escaped;
+};
+
+struct rpc_json_frame
+{
+	rpc_object_t		rjf_container;
+	char *			rjf_key;
+};
+
+typedef enum {
+	RPC_JSON_STATE_VALUE,
+	RPC_JSON_STATE_VALUE_OR_END,
+	RPC_JSON_STATE_KEY,
+	RPC_JSON_STATE_KEY_OR_END,
+	RPC_JSON_STATE_NEXT
+} rpc_json_state_t;
+
+static inline bool
+rpc_json_is_space(unsigned char c)
+{
+
+	return (c == ' ' || c == '\t' || c == '\n' || c == '\r' ||
+	    c == '\v' || c == '\f');
+}
+
+static inline bool
+rpc_json_is_structural(unsigned char c)
+{
+
+	return (c == '{' || c == '}' || c == '[' || c == ']' || c == ':' ||
+	    c == ',');
+}
+
+/*
+ * True if none of the eight bytes of a word ends or escapes a string,
+ * is a control character or starts a multibyte sequence.
+ */
+static inline bool
+rpc_json_word_is_plain(uint64_t word)
+{
+	const uint64_t ones = 0x0101010101010101ULL;
+	const uint64_t highs = 0x8080808080808080ULL;
+	uint64_t quote = word ^ (ones * '"');
+	uint64_t bslash = word ^ (ones * '\\');
+	uint64_t found;
+
+	found = (word - ones * 0x20) & ~word;
+	found |= (quote - ones) & ~quote;
+	found |= (bslash - ones) & ~bslash;
+	found |= word;
+	return ((found & highs) == 0);
+}
+
+/*
+ * Returns the length of a UTF-8 sequence, checked as loosely as yajl
+ * does, or 0 if it's malformed.
+ */
+static size_t
+rpc_json_utf8_len(const unsigned char *p, size_t avail)
+{
+	size_t len;
+	size_t i;
+
+	if ((p[0] >> 5) == 0x6)
+		len = 2;
+	else if ((p[0] >> 4) == 0xe)
+		len = 3;
+	else if ((p[0] >> 3) == 0x1e)
+		len = 4;
+	else
+		return (0);
+
+	if (len > avail)
+		return (0);
+
+	for (i = 1; i < len; i++) {
+		if ((p[i] >> 6) != 0x2)
+			return (0);
+	}
+
+	return (len);
+}
+
+static int
+rpc_json_scan_string(const unsigned char *buf, size_t size, size_t *posp,
+    bool *escapedp)
+{
+	size_t pos = *posp + 1;
+	uint64_t word;
+	size_t len;
+
+	*escapedp = false;
+	while (pos < size) {
+		if (size - pos >= sizeof(word)) {
+			memcpy(&word, buf + pos, sizeof(word));
+			if (rpc_json_word_is_plain(word)) {
+				pos += sizeof(word);
+				continue;
+			}
+		}
+
+		if (buf[pos] == '"') {
+			*posp = pos + 1;
+			return (0);
+		}
+
+		if (buf[pos] == '\\') {
+			*escapedp = true;
+			pos += 2;
+			continue;
+		}
+
+		if (buf[pos] < 0x20)
+			return (-1);
+
+		if (buf[pos] < 0x80) {
+			pos++;
+			continue;
+		}
+
+		len = rpc_json_utf8_len(buf + pos, size - pos);
+		if (len == 0)
+			return (-1);
+
+		pos += len;
+	}
+
+	return (-1);
+}
+
+/*
+ * Stage one: builds the token index.
+ */
+static GArray *
+rpc_json_index(const unsigned char *buf, size_t size)
+{
+	struct rpc_json_token tok;
+	GArray *tokens;
+	size_t pos = 0;
+	size_t start;
+
+	tokens = g_array_sized_new(false, false, sizeof(tok), 64);
+	while (pos < size) {
+		if (rpc_json_is_space(buf[pos])) {
+			pos++;
+			continue;
+		}
+
+		start = pos;
+		tok.rjt_escaped = false;
+
+		if (rpc_json_is_structural(buf[pos])) {
+			pos++;
+		} else if (buf[pos] == '"') {
+			if (rpc_json_scan_string(buf, size, &pos,
+			    &tok.rjt_escaped) != 0) {
+				g_array_free(tokens, true);
+				return (NULL);
+			}
+		} else {
+			while (pos < size && !rpc_json_is_space(buf[pos]) &&
+			    !rpc_json_is_structural(buf[pos]) &&
+			    buf[pos] != '"')
+				pos++;
+		}
+
+		tok.rjt_pos = (uint32_t)start;
+		tok.rjt_len = (uint32_t)(pos - start);
+		g_array_append_val(tokens, tok);
+	}
+
+	return (tokens);
+}
+
+static int
+rpc_json_hex_value(const unsigned char *p, uint32_t *valuep)
+{
+	uint32_t value = 0;
+	int digit;
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		digit = g_ascii_xdigit_value((gchar)p[i]);
+		if (digit < 0)
+			return (-1);
+
+		value = (value << 4) | (uint32_t)digit;
+	}
+
+	*valuep = value;
+	return (0);
+}
+
+/*
+ * Decodes escapes the way yajl does: a surrogate pair becomes a single
+ * character and a lone high surrogate is replaced with a question mark.
+ */
+static char *
+rpc_json_unescape(const unsigned char *str, size_t len, size_t *lenp)
+{
+	const unsigned char *end = str + len;
+	const unsigned char *run = str;
+	const unsigned char *p = str;
+	GString *out;
+	uint32_t codepoint;
+	uint32_t surrogate;
+	char utf8[6];
+
+	out = g_string_sized_new(len);
+	while (p < end) {
+		if (*p != '\\') {
+			p++;
+			continue;
+		}
+
+		g_string_append_len(out, (const char *)run, p - run);
+		if (++p >= end)
+			goto fail;
+
+		switch (*p) {
+		case '"':
+		case '\\':
+		case '/':
+			g_string_append_c(out, (gchar)*p);
+			break;
+
+		case 'b':
+			g_string_append_c(out, '\b');
+			break;
+
+		case 'f':
+			g_string_append_c(out, '\f');
+			break;
+
+		case 'n':
+			g_string_append_c(out, '\n');
+			break;
+
+		case 'r':
+			g_string_append_c(out, '\r');
+			break;
+
+		case 't':
+			g_string_append_c(out, '\t');
+			break;
+
+		case 'u':
+			if (end - p < 5 || rpc_json_hex_value(p + 1,
+			    &codepoint) != 0)
+				goto fail;
+
+			p += 4;
+			if ((codepoint & 0xfc00) == 0xd800) {
+				if (end - p < 7 || p[1] != '\\' || p[2] != 'u' ||
+				    rpc_json_hex_value(p + 3, &surrogate) != 0) {
+					g_string_append_c(out, '?');
+					break;
+				}
+
+				p += 6;
+				codepoint = 0x10000 + ((codepoint & 0x3ff) << 10) +
+				    (surrogate & 0x3ff);
+			}
+
+			g_string_append_len(out, utf8,
+			    g_unichar_to_utf8(codepoint, utf8));
+			break;
+
+		default:
+			goto fail;
+		}
+
+		run = ++p;
+	}
+
+	g_string_append_len(out, (const char *)run, p - run);
+	*lenp = out->len;
+	return (g_string_free(out, false));
+
+fail:
+	g_string_free(out, true);
+	return (NULL);
+}
+
+static rpc_object_t
+rpc_json_parse_string(const unsigned char *buf, struct rpc_json_token *tok)
+{
+	rpc_object_t result;
+	size_t len;
+	char *str;
+
+	if (!tok->rjt_escaped)
+		return (rpc_string_create_len(
+		    (const char *)buf + tok->rjt_pos + 1, tok->rjt_len - 2));
+
+	str = rpc_json_unescape(buf + tok->rjt_pos + 1, tok->rjt_len - 2,
+	    &len);
+	if (str == NULL)
+		return (NULL);
+
+	result = rpc_string_create_len(str, len);
+	g_free(str);
+	return (result);
+}
+
+/*
+ * Checks the JSON number grammar and tells whether it's an integer.
+ */
+static bool
+rpc_json_check_number(const unsigned char *p, size_t len, bool *integerp)
+{
+	const unsigned char *end = p + len;
+
+	*integerp = true;
+	if (p < end && *p == '-')
+		p++;
+
+	if (p == end)
+		return (false);
+
+	if (*p == '0')
+		p++;
+	else if (g_ascii_isdigit(*p)) {
+		while (p < end && g_ascii_isdigit(*p))
+			p++;
+	} else
+		return (false);
+
+	if (p < end && *p == '.') {
+		*integerp = false;
+		if (++p == end || !g_ascii_isdigit(*p))
+			return (false);
+
+		while (p < end && g_ascii_isdigit(*p))
+			p++;
+	}
+
+	if (p < end && (*p == 'e' || *p == 'E')) {
+		*integerp = false;
+		if (++p < end && (*p == '+' || *p == '-'))
+			p++;
+
+		if (p == end || !g_ascii_isdigit(*p))
+			return (false);
+
+		while (p < end && g_ascii_isdigit(*p))
+			p++;
+	}
+
+	return (p == end);
+}
+
+static rpc_object_t
+rpc_json_parse_number(const unsigned char *buf, struct rpc_json_token *tok)
+{
+	const unsigned char *p = buf + tok->rjt_pos;
+	char local[RPC_JSON_NUMBER_BUF];
+	char *copy = local;
+	uint64_t value = 0;
+	uint64_t limit;
+	bool negative;
+	bool integer;
+	double dvalue;
+	size_t i;
+
+	if (!rpc_json_check_number(p, tok->rjt_len, &integer))
+		return (NULL);
+
+	if (integer) {
+		negative = p[0] == '-';
+		limit = negative ? (uint64_t)INT64_MAX + 1 : INT64_MAX;
+		for (i = negative ? 1 : 0; i < tok->rjt_len; i++) {
+			if (value > (limit - (p[i] - '0')) / 10)
+				return (NULL);
+
+			value = value * 10 + (p[i] - '0');
+		}
+
+		return (rpc_int64_create(negative ?
+		    (int64_t)(0 - value) : (int64_t)value));
+	}
+
+	/* The input isn't NUL terminated, so strtod() needs a copy */
+	if (tok->rjt_len >= sizeof(local))
+		copy = g_malloc(tok->rjt_len + 1);
+
+	memcpy(copy, p, tok->rjt_len);
+	copy[tok->rjt_len] = '\0';
+	errno = 0;
+	dvalue = g_ascii_strtod(copy, NULL);
+	if (copy != local)
+		g_free(copy);
+
+	if (errno == ERANGE && isinf(dvalue))
+		return (NULL);
+
+	return (rpc_double_create(dvalue));
+}
+
+static rpc_object_t
+rpc_json_parse_scalar(const unsigned char *buf, struct rpc_json_token *tok)
+{
+	const char *p = (const char *)buf + tok->rjt_pos;
+
+	switch (*p) {
+	case '"':
+		return (rpc_json_parse_string(buf, tok));
+
+	case 't':
+		if (tok->rjt_len == 4 && !memcmp(p, "true", 4))
+			return (rpc_bool_create(true));
+
+		return (NULL);
+
+	case 'f':
+		if (tok->rjt_len == 5 && !memcmp(p, "false", 5))
+			return (rpc_bool_create(false));
+
+		return (NULL);
+
+	case 'n':
+		if (tok->rjt_len == 4 && !memcmp(p, "null", 4))
+			return (rpc_null_create());
+
+		return (NULL);
+
+	default:
+		return (rpc_json_parse_number(buf, tok));
+	}
+}
+
+static char *
+rpc_json_parse_key(const unsigned char *buf, struct rpc_json_token *tok)
+{
+	const unsigned char *p = buf + tok->rjt_pos;
+	char *key;
+	char *stripped;
+	size_t len;
+
+	if (p[0] != '"')
+		return (NULL);
+
+	if (tok->rjt_escaped)
+		key = rpc_json_unescape(p + 1, tok->rjt_len - 2, &len);
+	else
+		key = g_strndup((const char *)p + 1, tok->rjt_len - 2);
+
+	/* Keys starting with '$' or '\' are written with a '\' prefix */
+	if (key != NULL && key[0] == '\\') {
+		stripped = g_strdup(key + 1);
+		g_free(key);
+		key = stripped;
+	}
+
+	return (key);
+}
+
+/*
+ * Stage two: builds the object tree from the token index.
+ */
+static rpc_object_t
+rpc_json_build(const unsigned char *buf, GArray *tokens)
+{
+	rpc_json_state_t state = RPC_JSON_STATE_VALUE;
+	struct rpc_json_frame frame;
+	struct rpc_json_frame *top;
+	struct rpc_json_token *tok;
+	rpc_object_t root = NULL;
+	rpc_object_t value = NULL;
+	rpc_object_t unpacked;
+	GArray *stack;
+	guint i = 0;
+	char c;
+
+	stack = g_array_new(false, false, sizeof(frame));
+
+	for (;;) {
+		top = stack->len > 0 ? &g_array_index(stack,
+		    struct rpc_json_frame, stack->len - 1) : NULL;
+		tok = i < tokens->len ? &g_array_index(tokens,
+		    struct rpc_json_token, i) : NULL;
+		c = tok != NULL ? (char)buf[tok->rjt_pos] : '\0';
+
+		switch (state) {
+		case RPC_JSON_STATE_NEXT:
+			if (top == NULL) {
+				if (tok != NULL)
+					goto fail;
+
+				g_array_free(stack, true);
+				return (root);
+			}
+
+			if (tok == NULL)
+				goto fail;
+
+			i++;
+			if (c == ',') {
+				if (rpc_get_type(top->rjf_container) ==
+				    RPC_TYPE_DICTIONARY)
+					state = RPC_JSON_STATE_KEY;
+				else
+					state = RPC_JSON_STATE_VALUE;
+
+				continue;
+			}
+
+			if ((c == ']' && rpc_get_type(top->rjf_container) ==
+			    RPC_TYPE_ARRAY) || (c == '}' && rpc_get_type(
+			    top->rjf_container) == RPC_TYPE_DICTIONARY))
+				goto close;
+
+			goto fail;
+
+		case RPC_JSON_STATE_VALUE_OR_END:
+			if (c == ']') {
+				i++;
+				goto close;
+			}
+
+			state = RPC_JSON_STATE_VALUE;
+			continue;
+
+		case RPC_JSON_STATE_KEY_OR_END:
+			if (c == '}') {
+				i++;
+				goto close;
+			}
+
+			state = RPC_JSON_STATE_KEY;
+			continue;
+
+		case RPC_JSON_STATE_KEY:
+			if (tok == NULL || i + 1 >= tokens->len)
+				goto fail;
+
+			top->rjf_key = rpc_json_parse_key(buf, tok);
+			if (top->rjf_key == NULL)
+				goto fail;
+
+			tok = &g_array_index(tokens, struct rpc_json_token,
+			    i + 1);
+			if (buf[tok->rjt_pos] != ':')
+				goto fail;
+
+			i += 2;
+			state = RPC_JSON_STATE_VALUE;
+			continue;
+
+		case RPC_JSON_STATE_VALUE:
+			if (tok == NULL)
+				goto fail;
+
+			i++;
+			if (c == '{' || c == '[') {
+				frame.rjf_container = c == '{' ?
+				    rpc_dictionary_create() : rpc_array_create();
+				frame.rjf_key = NULL;
+				g_array_append_val(stack, frame);
+				state = c == '{' ? RPC_JSON_STATE_KEY_OR_END :
+				    RPC_JSON_STATE_VALUE_OR_END;
+				continue;
+			}
+
+			if (rpc_json_is_structural((unsigned char)c))
+				goto fail;
+
+			value = rpc_json_parse_scalar(buf, tok);
+			if (value == NULL)
+				goto fail;
+
+			goto attach;
+		}
+
+close:
+		value = top->rjf_container;
+		g_array_set_size(stack, stack->len - 1);
+		top = stack->len > 0 ? &g_array_index(stack,
+		    struct rpc_json_frame, stack->len - 1) : NULL;
+
+		if (rpc_get_type(value) == RPC_TYPE_DICTIONARY &&
+		    rpc_dictionary_get_count(value) == 1) {
+			unpacked = rpc_json_unpack_ext(value);
+			if (unpacked != NULL) {
+				rpc_release(value);
+				value = unpacked;
+			}
+		}
+
+attach:
+		state = RPC_JSON_STATE_NEXT;
+		if (top == NULL) {
+			root = value;
+			continue;
+		}
+
+		if (top->rjf_key != NULL) {
+			rpc_dictionary_steal_value(top->rjf_container,
+			    top->rjf_key, value);
+			g_free(top->rjf_key);
+			top->rjf_key = NULL;
+		} else
+			rpc_array_append_stolen_value(top->rjf_container,
+			    value);
+	}
+
+fail:
+	for (i = 0; i < stack->len; i++) {
+		top = &g_array_index(stack, struct rpc_json_frame, i);
+		rpc_release(top->rjf_container);
+		g_free(top->rjf_key);
+	}
+
+	g_array_free(stack, true);
+	rpc_release(root);
+	return (NULL);
+}
+
+rpc_object_t
+rpc_json_fast_deserialize(const void *frame, size_t size)
+{
+	GArray *tokens;
+	rpc_object_t result = NULL;
+
+	if (size <= UINT32_MAX) {
+		tokens = rpc_json_index(frame, size);
+		if (tokens != NULL) {
+			result = rpc_json_build(frame, tokens);
+			g_array_free(tokens, true);
+		}
+	}
+
+	if (result == NULL)
+		rpc_set_last_error(EINVAL, "Parse error", NULL);
+
+	return (result);
+}
@@ -26,26 +26,197 @@
  */
 
 #include <assert.h>
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
 #include <rpc/object.h>
+#include <rpc/serializer.h>
 #ifdef __APPLE__
 #include "../endian.h"
 #endif
 #include "../../contrib/mpack/mpack.h"
 #include "../linker_set.h"
 #include "../internal.h"
+#include "../bswap.h"
+#include "../slab.h"
 #include "msgpack.h"
 
-static void rpc_msgpack_write_error(mpack_writer_t *, rpc_object_t);
+#define	RPC_MSGPACK_PACKED_CHUNK	256
+
+struct rpc_msgpack_iov_ref
+{
+	size_t			offset;
+	const void *		ptr;
+	size_t			len;
+};
+
+struct rpc_msgpack_stream
+{
+	rpc_msgpack_chunk_t	chunk;
+	size_t			total;
+};
+
+struct rpc_msgpack_source
+{
+	rpc_msgpack_fill_t	fill;
+};
+
+struct rpc_msgpack_ext
+{
+	int			rme_tag;
+	char *			rme_type;
+	rpc_serializer_ext_encoder_t rme_encoder;
+	rpc_serializer_ext_decoder_t rme_decoder;
+};
+
+static void rpc_msgpack_count_flush(mpack_writer_t *, const char *, size_t);
+static void rpc_msgpack_stream_flush(mpack_writer_t *, const char *, size_t);
+static void rpc_msgpack_write_error(mpack_writer_t *, rpc_object_t, bool);
 static rpc_object_t rpc_msgpack_read_error(mpack_tree_t *);
-static int rpc_msgpack_write_object(mpack_writer_t *, rpc_object_t);
+static int rpc_msgpack_write_object(mpack_writer_t *, rpc_object_t, GArray *);
+static void rpc_msgpack_write_int64(mpack_writer_t *, int64_t);
+static void rpc_msgpack_write_uint64(mpack_writer_t *, uint64_t);
+static void rpc_msgpack_write_canonical_int64(mpack_writer_t *, int64_t);
+static void rpc_msgpack_write_canonical_uint64(mpack_writer_t *, uint64_t);
+static int rpc_msgpack_write_canonical(mpack_writer_t *, rpc_object_t);
+static int rpc_msgpack_key_cmp(const void *, const void *);
+static void rpc_msgpack_write_packed(mpack_writer_t *, rpc_object_t);
+static rpc_object_t rpc_msgpack_read_packed(mpack_node_t);
 #if defined(__linux__)
 static rpc_object_t rpc_msgpack_read_shmem(mpack_tree_t *);
 static void rpc_msgpack_write_shmem(mpack_writer_t *, rpc_object_t);
 #endif
-static rpc_object_t rpc_msgpack_read_object(mpack_node_t);
+static rpc_object_t rpc_msgpack_read_object(mpack_node_t, GBytes *);
+static size_t rpc_msgpack_stream_fill(mpack_reader_t *, char *, size_t);
+static const char *rpc_msgpack_stream_bytes(mpack_reader_t *, size_t, char **);
+static rpc_object_t rpc_msgpack_stream_read_object(mpack_reader_t *);
+static rpc_object_t rpc_msgpack_peek_value(mpack_reader_t *, const char *);
+static void rpc_msgpack_write_date(mpack_writer_t *, rpc_object_t);
+static rpc_object_t rpc_msgpack_read_date_ns(const char *, size_t);
+static bool rpc_msgpack_write_ext(mpack_writer_t *, rpc_object_t);
+static rpc_object_t rpc_msgpack_read_ext(int8_t, const char *, size_t);
+
+static GMutex rpc_msgpack_ext_mtx;
+static GHashTable *rpc_msgpack_ext_types = NULL;
+static struct rpc_msgpack_ext *rpc_msgpack_exts[RPC_SERIALIZER_EXT_MAX + 1];
+
+int
+rpc_serializer_register_ext(int tag, const char *type,
+    rpc_serializer_ext_encoder_t encoder, rpc_serializer_ext_decoder_t decoder)
+{
+	struct rpc_msgpack_ext *ext;
+	GHashTable *types;
+
+	if (tag < RPC_SERIALIZER_EXT_MIN || tag > RPC_SERIALIZER_EXT_MAX) {
+		rpc_set_last_errorf(EINVAL, "Extension tag %d out of range",
+		    tag);
+		return (-1);
+	}
+
+	g_mutex_lock(&rpc_msgpack_ext_mtx);
+	if (rpc_msgpack_exts[tag] != NULL || (rpc_msgpack_ext_types != NULL &&
+	    g_hash_table_contains(rpc_msgpack_ext_types, type))) {
+		g_mutex_unlock(&rpc_msgpack_ext_mtx);
+		rpc_set_last_errorf(EEXIST, "Extension %d (%s) already registered",
+		    tag, type);
+		return (-1);
+	}
+
+	ext = g_malloc0(sizeof(*ext));
+	ext->rme_tag = tag;
+	ext->rme_type = g_strdup(type);
+	ext->rme_encoder = Block_copy(encoder);
+	ext->rme_decoder = Block_copy(decoder);
+
+	/* Writers check the table pointer without locking */
+	types = rpc_msgpack_ext_types;
+	if (types == NULL)
+		types = g_hash_table_new(g_str_hash, g_str_equal);
+
+	g_hash_table_insert(types, ext->rme_type, ext);
+	rpc_msgpack_exts[tag] = ext;
+	g_atomic_pointer_set(&rpc_msgpack_ext_types, types);
+	g_mutex_unlock(&rpc_msgpack_ext_mtx);
+	return (0);
+}
+
+bool
+rpc_msgpack_ext_registered(const char *type)
+{
+	GHashTable *types;
+
+	types = g_atomic_pointer_get(&rpc_msgpack_ext_types);
+	return (types != NULL && g_hash_table_contains(types, type));
+}
+
+/*
+ * Whole seconds keep the original date extension, which older peers
+ * understand. Anything finer goes out as big endian nanoseconds.
+ */
+static void
+rpc_msgpack_write_date(mpack_writer_t *writer, rpc_object_t object)
+{
+	int64_t value = object->ro_value.rv_date;
+
+	if (value % RPC_DATE_NSEC_PER_SEC == 0) {
+		value /= RPC_DATE_NSEC_PER_SEC;
+		mpack_write_ext(writer, MSGPACK_EXTTYPE_DATE,
+		    (const char *)&value, sizeof(value));
+		return;
+	}
+
+	value = (int64_t)GUINT64_TO_BE((uint64_t)value);
+	mpack_write_ext(writer, MSGPACK_EXTTYPE_DATE_NS,
+	    (const char *)&value, sizeof(value));
+}
+
+static rpc_object_t
+rpc_msgpack_read_date_ns(const char *data, size_t len)
+{
+	uint64_t value = 0;
+
+	memcpy(&value, data, MIN(sizeof(value), len));
+	return (rpc_date_create_ns((int64_t)GUINT64_FROM_BE(value)));
+}
+
+static bool
+rpc_msgpack_write_ext(mpack_writer_t *writer, rpc_object_t object)
+{
+	struct rpc_msgpack_ext *ext;
+	char buf[RPC_SERIALIZER_EXT_MAX_SIZE];
+	ssize_t len;
+
+	ext = g_hash_table_lookup(rpc_msgpack_ext_types,
+	    object->ro_typei->canonical_form);
+	if (ext == NULL)
+		return (false);
+
+	len = ext->rme_encoder(object, buf, sizeof(buf));
+	if (len < 0 || (size_t)len > sizeof(buf))
+		return (false);
+
+	mpack_write_ext(writer, (int8_t)ext->rme_tag, buf, (uint32_t)len);
+	return (true);
+}
+
+static rpc_object_t
+rpc_msgpack_read_ext(int8_t tag, const char *data, size_t len)
+{
+	struct rpc_msgpack_ext *ext;
+	rpc_object_t result;
+
+	ext = tag >= RPC_SERIALIZER_EXT_MIN ? rpc_msgpack_exts[tag] : NULL;
+	if (ext == NULL)
+		return (rpc_null_create());
+
+	result = ext->rme_decoder(data, len);
+	return (result != NULL ? result : rpc_null_create());
+}
 
 static void
-rpc_msgpack_write_error(mpack_writer_t *writer, rpc_object_t error)
+rpc_msgpack_write_error(mpack_writer_t *writer, rpc_object_t error,
+    bool canonical)
 {
 	assert(rpc_get_type(error) == RPC_TYPE_ERROR);
 
@@ -57,12 +228,22 @@ rpc_msgpack_write_error(mpack_writer_t *writer, rpc_object_t error)
 
 	if (rpc_error_get_extra(error) != NULL) {
 		mpack_write_cstr(writer, MSGPACK_ERROR_EXTRA);
-		rpc_msgpack_write_object(writer, rpc_error_get_extra(error));
+		if (canonical)
+			rpc_msgpack_write_canonical(writer,
+			    rpc_error_get_extra(error));
+		else
+			rpc_msgpack_write_object(writer,
+			    rpc_error_get_extra(error), NULL);
 	}
 
 	if (rpc_error_get_stack(error) != NULL) {
 		mpack_write_cstr(writer, MSGPACK_ERROR_STACK);
-		rpc_msgpack_write_object(writer, rpc_error_get_stack(error));
+		if (canonical)
+			rpc_msgpack_write_canonical(writer,
+			    rpc_error_get_stack(error));
+		else
+			rpc_msgpack_write_object(writer,
+			    rpc_error_get_stack(error), NULL);
 	}
 
 	mpack_finish_map(writer);
@@ -84,9 +265,9 @@ rpc_msgpack_read_error(mpack_tree_t *tree)
 	msg = mpack_node_cstr_alloc(mpack_node_map_cstr(root,
 	    MSGPACK_ERROR_MESSAGE), 1024);
 	extra = rpc_msgpack_read_object(mpack_node_map_cstr(root,
-	    MSGPACK_ERROR_EXTRA));
+	    MSGPACK_ERROR_EXTRA), NULL);
 	stack = rpc_msgpack_read_object(mpack_node_map_cstr(root,
-	    MSGPACK_ERROR_STACK));
+	    MSGPACK_ERROR_STACK), NULL);
 	result = rpc_error_create_with_stack((int)code, msg,
 	    extra, stack);
 
@@ -100,19 +281,26 @@ rpc_msgpack_write_shmem(mpack_writer_t *writer, rpc_object_t shmem)
 {
 	assert(rpc_get_type(shmem) == RPC_TYPE_SHMEM);
 
-	mpack_start_map(writer, 3);
+	mpack_start_map(writer,
+	    shmem->ro_value.rv_shmem.rsb_region != 0 ? 4 : 3);
 	mpack_write_cstr(writer, MSGPACK_SHMEM_FD);
 	mpack_write_i64(writer, shmem->ro_value.rv_shmem.rsb_fd);
 	mpack_write_cstr(writer, MSGPACK_SHMEM_OFFSET);
 	mpack_write_u64(writer, shmem->ro_value.rv_shmem.rsb_offset);
 	mpack_write_cstr(writer, MSGPACK_SHMEM_LEN);
 	mpack_write_u64(writer, shmem->ro_value.rv_shmem.rsb_size);
+	if (shmem->ro_value.rv_shmem.rsb_region != 0) {
+		mpack_write_cstr(writer, MSGPACK_SHMEM_REGION);
+		mpack_write_i64(writer, shmem->ro_value.rv_shmem.rsb_region);
+	}
 }
 
 static rpc_object_t
 rpc_msgpack_read_shmem(mpack_tree_t *tree)
 {
 	mpack_node_t root;
+	mpack_node_t region;
+	rpc_object_t result;
 	int fd;
 	uint64_t offset, len;
 
@@ -120,17 +308,23 @@ rpc_msgpack_read_shmem(mpack_tree_t *tree)
 	fd = (int)mpack_node_i64(mpack_node_map_cstr(root, MSGPACK_SHMEM_FD));
 	offset = mpack_node_u64(mpack_node_map_cstr(root, MSGPACK_SHMEM_OFFSET));
 	len = mpack_node_u64(mpack_node_map_cstr(root, MSGPACK_SHMEM_LEN));
-	return (rpc_shmem_recreate(fd, (off_t)offset, (size_t)len));
+	region = mpack_node_map_cstr_optional(root, MSGPACK_SHMEM_REGION);
+	result = rpc_shmem_recreate(fd, (off_t)offset, (size_t)len);
+	if (mpack_node_type(region) != mpack_type_nil)
+		result->ro_value.rv_shmem.rsb_region = mpack_node_i64(region);
+
+	return (result);
 }
 
 #endif
-static int
-rpc_msgpack_write_object(mpack_writer_t *writer, rpc_object_t object)
+
+/*
+ * Integers always go out in their signed or unsigned 32 or 64-bit
+ * form, never packed smaller, so the peer reads back the same type.
+ */
+static void
+rpc_msgpack_write_int64(mpack_writer_t *writer, int64_t value)
 {
-	int64_t timestamp;
-	mpack_writer_t subwriter;
-	char *buffer;
-	size_t len;
 	struct {
 		uint8_t tag;
 		uint64_t value;
@@ -140,6 +334,272 @@ rpc_msgpack_write_object(mpack_writer_t *writer, rpc_object_t object)
 		uint32_t value;
 	} __attribute__((packed)) be_int32;
 
+	if (value > (1LL << 32)) {
+		be_int64.value = htobe64(value);
+		be_int64.tag = 0xd3;
+		mpack_write_object_bytes(writer, (const char *)&be_int64,
+		    sizeof(be_int64));
+	} else {
+		be_int32.value = htobe32(value);
+		be_int32.tag = 0xd2;
+		mpack_write_object_bytes(writer, (const char *)&be_int32,
+		    sizeof(be_int32));
+	}
+}
+
+static void
+rpc_msgpack_write_uint64(mpack_writer_t *writer, uint64_t value)
+{
+	struct {
+		uint8_t tag;
+		uint64_t value;
+	} __attribute__((packed)) be_int64;
+	struct {
+		uint8_t tag;
+		uint32_t value;
+	} __attribute__((packed)) be_int32;
+
+	if (value > (1ULL << 32)) {
+		be_int64.value = htobe64(value);
+		be_int64.tag = 0xcf;
+		mpack_write_object_bytes(writer, (const char *)&be_int64,
+		    sizeof(be_int64));
+	} else {
+		be_int32.value = htobe32(value);
+		be_int32.tag = 0xce;
+		mpack_write_object_bytes(writer, (const char *)&be_int32,
+		    sizeof(be_int32));
+	}
+}
+
+/*
+ * Canonical integers take the shortest encoding of their family:
+ * signed values never use positive fixint, which would read back as
+ * unsigned, so 0..127 still costs two bytes.
+ */
+static void
+rpc_msgpack_write_canonical_int64(mpack_writer_t *writer, int64_t value)
+{
+	uint8_t buf[9];
+	uint16_t be16;
+	uint32_t be32;
+	uint64_t be64;
+	size_t len;
+
+	if (value >= -32 && value < 0) {
+		buf[0] = (uint8_t)(int8_t)value;
+		len = 1;
+	} else if (value >= INT8_MIN && value <= INT8_MAX) {
+		buf[0] = 0xd0;
+		buf[1] = (uint8_t)(int8_t)value;
+		len = 2;
+	} else if (value >= INT16_MIN && value <= INT16_MAX) {
+		buf[0] = 0xd1;
+		be16 = htobe16((uint16_t)(int16_t)value);
+		memcpy(&buf[1], &be16, sizeof(be16));
+		len = 3;
+	} else if (value >= INT32_MIN && value <= INT32_MAX) {
+		buf[0] = 0xd2;
+		be32 = htobe32((uint32_t)(int32_t)value);
+		memcpy(&buf[1], &be32, sizeof(be32));
+		len = 5;
+	} else {
+		buf[0] = 0xd3;
+		be64 = htobe64((uint64_t)value);
+		memcpy(&buf[1], &be64, sizeof(be64));
+		len = 9;
+	}
+
+	mpack_write_object_bytes(writer, (const char *)buf, len);
+}
+
+static void
+rpc_msgpack_write_canonical_uint64(mpack_writer_t *writer, uint64_t value)
+{
+	uint8_t buf[9];
+	uint16_t be16;
+	uint32_t be32;
+	uint64_t be64;
+	size_t len;
+
+	if (value <= 0x7f) {
+		buf[0] = (uint8_t)value;
+		len = 1;
+	} else if (value <= UINT8_MAX) {
+		buf[0] = 0xcc;
+		buf[1] = (uint8_t)value;
+		len = 2;
+	} else if (value <= UINT16_MAX) {
+		buf[0] = 0xcd;
+		be16 = htobe16((uint16_t)value);
+		memcpy(&buf[1], &be16, sizeof(be16));
+		len = 3;
+	} else if (value <= UINT32_MAX) {
+		buf[0] = 0xce;
+		be32 = htobe32((uint32_t)value);
+		memcpy(&buf[1], &be32, sizeof(be32));
+		len = 5;
+	} else {
+		buf[0] = 0xcf;
+		be64 = htobe64(value);
+		memcpy(&buf[1], &be64, sizeof(be64));
+		len = 9;
+	}
+
+	mpack_write_object_bytes(writer, (const char *)buf, len);
+}
+
+/*
+ * Packed arrays are written as ordinary msgpack arrays, so peers see
+ * no difference, but encoded in one go: values are converted to big
+ * endian a chunk at a time by the vector kernel and only prefixed with
+ * their tags here. The result goes out as a single raw object.
+ */
+static void
+rpc_msgpack_write_packed(mpack_writer_t *writer, rpc_object_t array)
+{
+	struct rpc_packed_array *packed = array->ro_value.rv_packed;
+	uint64_t swapped[RPC_MSGPACK_PACKED_CHUNK];
+	uint8_t *buf;
+	uint8_t *p;
+	size_t count = packed->rpa_count;
+	size_t i;
+	size_t j;
+	size_t n;
+	uint16_t be16;
+	uint32_t be32;
+
+	buf = g_malloc(5 + count * 9);
+	p = buf;
+	if (count <= 15)
+		*p++ = (uint8_t)(0x90 | count);
+	else if (count <= 0xffff) {
+		*p++ = 0xdc;
+		be16 = htobe16((uint16_t)count);
+		memcpy(p, &be16, sizeof(be16));
+		p += sizeof(be16);
+	} else {
+		*p++ = 0xdd;
+		be32 = htobe32((uint32_t)count);
+		memcpy(p, &be32, sizeof(be32));
+		p += sizeof(be32);
+	}
+
+	for (i = 0; i < count; i += n) {
+		n = MIN(count - i, RPC_MSGPACK_PACKED_CHUNK);
+		rpc_bswap64_array(swapped, packed->rpa_uint64 + i, n);
+
+		/* Same tags and widths as rpc_msgpack_write_int64() & co. */
+		for (j = 0; j < n; j++) {
+			switch (packed->rpa_type) {
+			case RPC_TYPE_INT64:
+				if (packed->rpa_int64[i + j] > (1LL << 32))
+					*p++ = 0xd3;
+				else {
+					*p++ = 0xd2;
+					memcpy(p, (uint8_t *)&swapped[j] + 4, 4);
+					p += 4;
+					continue;
+				}
+				break;
+
+			case RPC_TYPE_UINT64:
+				if (packed->rpa_uint64[i + j] > (1ULL << 32))
+					*p++ = 0xcf;
+				else {
+					*p++ = 0xce;
+					memcpy(p, (uint8_t *)&swapped[j] + 4, 4);
+					p += 4;
+					continue;
+				}
+				break;
+
+			default:
+				*p++ = 0xcb;
+				break;
+			}
+
+			memcpy(p, &swapped[j], sizeof(uint64_t));
+			p += sizeof(uint64_t);
+		}
+	}
+
+	mpack_write_object_bytes(writer, (const char *)buf, (size_t)(p - buf));
+	g_free(buf);
+}
+
+/*
+ * Reads a long array of numbers of a single type into a packed array.
+ * Returns NULL if the array doesn't qualify.
+ */
+static rpc_object_t
+rpc_msgpack_read_packed(mpack_node_t node)
+{
+	rpc_object_t result;
+	mpack_type_t type;
+	size_t count;
+	size_t i;
+
+	count = mpack_node_array_length(node);
+	if (count < RPC_ARRAY_PACK_MIN)
+		return (NULL);
+
+	type = mpack_node_type(mpack_node_array_at(node, 0));
+	if (type != mpack_type_int && type != mpack_type_uint &&
+	    type != mpack_type_double)
+		return (NULL);
+
+	for (i = 1; i < count; i++) {
+		if (mpack_node_type(mpack_node_array_at(node,
+		    (uint32_t)i)) != type)
+			return (NULL);
+	}
+
+	switch (type) {
+	case mpack_type_int:
+		result = rpc_array_create_typed(RPC_TYPE_INT64, NULL, count);
+		for (i = 0; i < count; i++) {
+			result->ro_value.rv_packed->rpa_int64[i] = mpack_node_i64(
+			    mpack_node_array_at(node, (uint32_t)i));
+		}
+		break;
+
+	case mpack_type_uint:
+		result = rpc_array_create_typed(RPC_TYPE_UINT64, NULL, count);
+		for (i = 0; i < count; i++) {
+			result->ro_value.rv_packed->rpa_uint64[i] =
+			    mpack_node_u64(mpack_node_array_at(node,
+			    (uint32_t)i));
+		}
+		break;
+
+	default:
+		result = rpc_array_create_typed(RPC_TYPE_DOUBLE, NULL, count);
+		for (i = 0; i < count; i++) {
+			result->ro_value.rv_packed->rpa_double[i] =
+			    mpack_node_double(mpack_node_array_at(node,
+			    (uint32_t)i));
+		}
+		break;
+	}
+
+	return (result);
+}
+
+static int
+rpc_msgpack_write_object(mpack_writer_t *writer, rpc_object_t object,
+    GArray *refs)
+{
+	struct rpc_msgpack_iov_ref ref;
+	mpack_writer_t subwriter;
+	char *buffer;
+	size_t len;
+
+	if (object->ro_typei != NULL &&
+	    g_atomic_pointer_get(&rpc_msgpack_ext_types) != NULL &&
+	    rpc_msgpack_write_ext(writer, object))
+		return (0);
+
 	switch (object->ro_type) {
 	case RPC_TYPE_NULL:
 		mpack_write_nil(writer);
@@ -150,37 +610,15 @@ rpc_msgpack_write_object(mpack_writer_t *writer, rpc_object_t object)
 		break;
 
 	case RPC_TYPE_INT64:
-		if (object->ro_value.rv_i > (1LL << 32)) {
-			be_int64.value = htobe64(object->ro_value.rv_i);
-			be_int64.tag = 0xd3;
-			mpack_write_object_bytes(writer,
-			    (const char *)&be_int64, sizeof(be_int64));
-		} else {
-			be_int32.value = htobe32(object->ro_value.rv_i);
-			be_int32.tag = 0xd2;
-			mpack_write_object_bytes(writer,
-			    (const char *)&be_int32, sizeof(be_int32));
-		}
+		rpc_msgpack_write_int64(writer, object->ro_value.rv_i);
 		break;
 
 	case RPC_TYPE_UINT64:
-		if (object->ro_value.rv_ui > (1ULL << 32)) {
-			be_int64.value = htobe64(object->ro_value.rv_ui);
-			be_int64.tag = 0xcf;
-			mpack_write_object_bytes(writer,
-			    (const char *)&be_int64, sizeof(be_int64));
-		} else {
-			be_int32.value = htobe32(object->ro_value.rv_ui);
-			be_int32.tag = 0xce;
-			mpack_write_object_bytes(writer,
-			    (const char *)&be_int32, sizeof(be_int32));
-		}
+		rpc_msgpack_write_uint64(writer, object->ro_value.rv_ui);
 		break;
 
 	case RPC_TYPE_DATE:
-		timestamp = g_date_time_to_unix(object->ro_value.rv_datetime);
-		mpack_write_ext(writer, MSGPACK_EXTTYPE_DATE,
-		    (const char *)&timestamp, sizeof(int64_t));
+		rpc_msgpack_write_date(writer, object);
 		break;
 
 	case RPC_TYPE_DOUBLE:
@@ -188,12 +626,31 @@ rpc_msgpack_write_object(mpack_writer_t *writer, rpc_object_t object)
 		break;
 
 	case RPC_TYPE_STRING:
-		mpack_write_cstr(writer, object->ro_value.rv_str->str);
+		mpack_write_str(writer, rpc_string_get_string_ptr(object),
+		    (uint32_t)rpc_string_get_length(object));
 		break;
 
 	case RPC_TYPE_BINARY:
-		mpack_write_bin(writer, (char *)object->ro_value.rv_bin.rbv_ptr,
-		    (uint32_t)object->ro_value.rv_bin.rbv_length);
+		len = object->ro_value.rv_bin.rbv_length;
+		if (refs == NULL || len < MSGPACK_IOV_THRESHOLD) {
+			mpack_write_bin(writer,
+			    (char *)object->ro_value.rv_bin.rbv_ptr,
+			    (uint32_t)len);
+			break;
+		}
+
+		/*
+		 * Write only the bin header and remember where the payload
+		 * would go. The growable writer keeps one contiguous buffer,
+		 * so the offset stays valid across reallocations.
+		 */
+		mpack_start_bin(writer, (uint32_t)len);
+		mpack_writer_track_bytes(writer, len);
+		mpack_finish_bin(writer);
+		ref.offset = mpack_writer_buffer_used(writer);
+		ref.ptr = (const void *)object->ro_value.rv_bin.rbv_ptr;
+		ref.len = len;
+		g_array_append_val(refs, ref);
 		break;
 
 	case RPC_TYPE_FD:
@@ -214,7 +671,7 @@ rpc_msgpack_write_object(mpack_writer_t *writer, rpc_object_t object)
 
 	case RPC_TYPE_ERROR:
 		mpack_writer_init_growable(&subwriter, &buffer, &len);
-		rpc_msgpack_write_error(&subwriter, object);
+		rpc_msgpack_write_error(&subwriter, object, false);
 		mpack_writer_destroy(&subwriter);
 		mpack_write_ext(writer, MSGPACK_EXTTYPE_ERROR,
 		    (const char *)buffer, len);
@@ -224,16 +681,21 @@ rpc_msgpack_write_object(mpack_writer_t *writer, rpc_object_t object)
 		mpack_start_map(writer, (uint32_t)rpc_dictionary_get_count(object));
 		rpc_dictionary_apply(object, ^(const char *k, rpc_object_t v) {
 		    mpack_write_cstr(writer, k);
-		    rpc_msgpack_write_object(writer, v);
+		    rpc_msgpack_write_object(writer, v, refs);
 		    return ((bool)true);
 		});
 		mpack_finish_map(writer);
 		break;
 
 	case RPC_TYPE_ARRAY:
+		if (object->ro_value.rv_packed != NULL) {
+			rpc_msgpack_write_packed(writer, object);
+			break;
+		}
+
 		mpack_start_array(writer, (uint32_t)rpc_array_get_count(object));
 		rpc_array_apply(object, ^(size_t idx __unused, rpc_object_t v) {
-		    rpc_msgpack_write_object(writer, v);
+		    rpc_msgpack_write_object(writer, v, refs);
 		    return ((bool)true);
 		});
 		mpack_finish_array(writer);
@@ -243,8 +705,102 @@ rpc_msgpack_write_object(mpack_writer_t *writer, rpc_object_t object)
 	return (0);
 }
 
+static int
+rpc_msgpack_key_cmp(const void *a, const void *b)
+{
+
+	return (strcmp(*(const char *const *)a, *(const char *const *)b));
+}
+
+/*
+ * Same wire format as rpc_msgpack_write_object(), but the output only
+ * depends on the value: dictionary keys are sorted bytewise, integers
+ * take their shortest encoding and NaN is always the same quiet NaN.
+ * Packed arrays are written element by element, so the array kind
+ * doesn't show up in the output either.
+ */
+static int
+rpc_msgpack_write_canonical(mpack_writer_t *writer, rpc_object_t object)
+{
+	mpack_writer_t subwriter;
+	GPtrArray *keys;
+	char *buffer;
+	size_t len;
+	guint i;
+
+	if (object->ro_typei != NULL &&
+	    g_atomic_pointer_get(&rpc_msgpack_ext_types) != NULL &&
+	    rpc_msgpack_write_ext(writer, object))
+		return (0);
+
+	switch (object->ro_type) {
+	case RPC_TYPE_INT64:
+		rpc_msgpack_write_canonical_int64(writer,
+		    object->ro_value.rv_i);
+		break;
+
+	case RPC_TYPE_UINT64:
+		rpc_msgpack_write_canonical_uint64(writer,
+		    object->ro_value.rv_ui);
+		break;
+
+	case RPC_TYPE_DOUBLE:
+		if (isnan(object->ro_value.rv_d))
+			mpack_write_double(writer, NAN);
+		else
+			mpack_write_double(writer, object->ro_value.rv_d);
+		break;
+
+	case RPC_TYPE_ERROR:
+		mpack_writer_init_growable(&subwriter, &buffer, &len);
+		rpc_msgpack_write_error(&subwriter, object, true);
+		mpack_writer_destroy(&subwriter);
+		mpack_write_ext(writer, MSGPACK_EXTTYPE_ERROR,
+		    (const char *)buffer, len);
+		free(buffer);
+		break;
+
+	case RPC_TYPE_DICTIONARY:
+		keys = g_ptr_array_sized_new(
+		    (guint)rpc_dictionary_get_count(object));
+		rpc_dictionary_apply(object, ^(const char *k,
+		    rpc_object_t v __unused) {
+		    g_ptr_array_add(keys, (gpointer)k);
+		    return ((bool)true);
+		});
+		qsort(keys->pdata, keys->len, sizeof(gpointer),
+		    rpc_msgpack_key_cmp);
+
+		mpack_start_map(writer, keys->len);
+		for (i = 0; i < keys->len; i++) {
+			mpack_write_cstr(writer, g_ptr_array_index(keys, i));
+			rpc_msgpack_write_canonical(writer,
+			    rpc_dictionary_get_value(object,
+			    g_ptr_array_index(keys, i)));
+		}
+		mpack_finish_map(writer);
+		g_ptr_array_free(keys, true);
+		break;
+
+	case RPC_TYPE_ARRAY:
+		mpack_start_array(writer,
+		    (uint32_t)rpc_array_get_count(object));
+		rpc_array_apply(object, ^(size_t idx __unused, rpc_object_t v) {
+		    rpc_msgpack_write_canonical(writer, v);
+		    return ((bool)true);
+		});
+		mpack_finish_array(writer);
+		break;
+
+	default:
+		return (rpc_msgpack_write_object(writer, object, NULL));
+	}
+
+	return (0);
+}
+
 static rpc_object_t
-rpc_msgpack_read_object(mpack_node_t node)
+rpc_msgpack_read_object(mpack_node_t node, GBytes *backing)
 {
 	int *fd;
 	void *buffer;
@@ -252,6 +808,7 @@ rpc_msgpack_read_object(mpack_node_t node)
 	mpack_tree_t subtree;
 	__block size_t i;
 	__block char *cstr;
+	__block const char *atom;
 	__block mpack_node_t tmp;
 	__block rpc_object_t result;
 
@@ -270,21 +827,36 @@ rpc_msgpack_read_object(mpack_node_t node)
 		return (rpc_double_create(mpack_node_double(node)));
 
 	case mpack_type_str:
-		cstr = g_strndup(mpack_node_str(node), mpack_node_strlen(node));
-		result = rpc_string_create(cstr);
-		g_free(cstr);
-		return (result);
+		return (rpc_string_create_bytes(mpack_node_str(node),
+		    mpack_node_strlen(node)));
 
 	case mpack_type_bin:
+		if (backing != NULL &&
+		    mpack_node_data_len(node) >= MSGPACK_IOV_THRESHOLD) {
+			/*
+			 * Point straight into the received frame and keep
+			 * it alive for as long as the binary object lives.
+			 */
+			g_bytes_ref(backing);
+			return (rpc_data_create(mpack_node_data(node),
+			    mpack_node_data_len(node), ^(void *ptr __unused) {
+				g_bytes_unref(backing);
+			}));
+		}
+
 		buffer = g_memdup(mpack_node_data(node), mpack_node_data_len(node));
 		return (rpc_data_create(buffer, mpack_node_data_len(node),
 		    RPC_BINARY_DESTRUCTOR(g_free)));
 
 	case mpack_type_array:
+		result = rpc_msgpack_read_packed(node);
+		if (result != NULL)
+			return (result);
+
 		result = rpc_array_create();
 		for (i = 0; i < mpack_node_array_length(node); i++) {
 			rpc_array_append_stolen_value(result, rpc_msgpack_read_object(
-			    mpack_node_array_at(node, (uint32_t)i)));
+			    mpack_node_array_at(node, (uint32_t)i), backing));
 		}
 		return (result);
 
@@ -292,10 +864,20 @@ rpc_msgpack_read_object(mpack_node_t node)
 		result = rpc_dictionary_create();
 		for (i = 0; i < mpack_node_map_count(node); i++) {
 			tmp = mpack_node_map_key_at(node, (uint32_t)i);
+			atom = rpc_atom_lookup(mpack_node_str(tmp),
+			    mpack_node_strlen(tmp));
+			if (atom != NULL) {
+				rpc_dictionary_steal_value(result, atom,
+				    rpc_msgpack_read_object(
+				    mpack_node_map_value_at(node, (uint32_t)i),
+				    backing));
+				continue;
+			}
+
 			cstr = g_strndup(mpack_node_str(tmp), mpack_node_strlen(tmp));
 			rpc_dictionary_steal_value(result, cstr,
 			    rpc_msgpack_read_object(mpack_node_map_value_at(
-				node, (uint32_t)i)));
+				node, (uint32_t)i), backing));
 			g_free(cstr);
 		}
 		return (result);
@@ -306,6 +888,10 @@ rpc_msgpack_read_object(mpack_node_t node)
 			date = (int64_t *)mpack_node_data(node);
 			return (rpc_date_create(*date));
 
+		case MSGPACK_EXTTYPE_DATE_NS:
+			return (rpc_msgpack_read_date_ns(mpack_node_data(node),
+			    mpack_node_data_len(node)));
+
 		case MSGPACK_EXTTYPE_FD:
 			fd = (int *)mpack_node_data(node);
 			return (rpc_fd_create(*fd));
@@ -327,7 +913,8 @@ rpc_msgpack_read_object(mpack_node_t node)
 			return (result);
 
 		default:
-			return (rpc_null_create());
+			return (rpc_msgpack_read_ext(mpack_node_exttype(node),
+			    mpack_node_data(node), mpack_node_data_len(node)));
 		}
 
 	case mpack_type_nil:
@@ -336,17 +923,634 @@ rpc_msgpack_read_object(mpack_node_t node)
 	}
 }
 
+static size_t
+rpc_msgpack_stream_fill(mpack_reader_t *reader, char *buf, size_t len)
+{
+	struct rpc_msgpack_source *source = reader->context;
+	ssize_t ret;
+
+	ret = source->fill(buf, len);
+	if (ret <= 0) {
+		mpack_reader_flag_error(reader, mpack_error_io);
+		return (0);
+	}
+
+	return ((size_t)ret);
+}
+
+static const char *
+rpc_msgpack_stream_bytes(mpack_reader_t *reader, size_t len, char **alloc)
+{
+
+	/*
+	 * Short payloads are parsed straight out of the read buffer,
+	 * only payloads that don't fit in it get a heap copy. Readers
+	 * over a whole frame have it all in place.
+	 */
+	*alloc = NULL;
+	if (len == 0)
+		return ("");
+
+	if (len <= reader->size || reader->fill == NULL)
+		return (mpack_read_bytes_inplace(reader, len));
+
+	*alloc = mpack_read_bytes_alloc(reader, len);
+	return (*alloc);
+}
+
+static rpc_object_t
+rpc_msgpack_stream_read_object(mpack_reader_t *reader)
+{
+	mpack_tree_t subtree;
+	mpack_tag_t tag;
+	rpc_object_t result;
+	rpc_object_t item;
+	const char *data;
+	const char *atom;
+	char *alloc;
+	char *key;
+	int64_t date;
+	void *buffer;
+	uint32_t i;
+	int fd;
+
+	tag = mpack_read_tag(reader);
+	if (mpack_reader_error(reader) != mpack_ok)
+		return (NULL);
+
+	switch (tag.type) {
+	case mpack_type_int:
+		return (rpc_int64_create(tag.v.i));
+
+	case mpack_type_uint:
+		return (rpc_uint64_create(tag.v.u));
+
+	case mpack_type_bool:
+		return (rpc_bool_create(tag.v.b));
+
+	case mpack_type_float:
+		return (rpc_double_create(tag.v.f));
+
+	case mpack_type_double:
+		return (rpc_double_create(tag.v.d));
+
+	case mpack_type_str:
+		data = rpc_msgpack_stream_bytes(reader, tag.v.l, &alloc);
+		mpack_done_str(reader);
+		if (data == NULL)
+			return (NULL);
+
+		result = rpc_string_create_bytes(data, tag.v.l);
+		free(alloc);
+		return (result);
+
+	case mpack_type_bin:
+		buffer = tag.v.l > 0 ? mpack_read_bytes_alloc(reader, tag.v.l) : NULL;
+		mpack_done_bin(reader);
+		if (mpack_reader_error(reader) != mpack_ok) {
+			free(buffer);
+			return (NULL);
+		}
+
+		return (rpc_data_create(buffer, tag.v.l,
+		    RPC_BINARY_DESTRUCTOR(free)));
+
+	case mpack_type_array:
+		result = rpc_array_create();
+		for (i = 0; i < tag.v.n; i++) {
+			item = rpc_msgpack_stream_read_object(reader);
+			if (item == NULL)
+				break;
+
+			rpc_array_append_stolen_value(result, item);
+		}
+
+		mpack_done_array(reader);
+		return (result);
+
+	case mpack_type_map:
+		result = rpc_dictionary_create();
+		for (i = 0; i < tag.v.n; i++) {
+			tag = mpack_read_tag(reader);
+			if (tag.type != mpack_type_str) {
+				mpack_reader_flag_error(reader, mpack_error_type);
+				break;
+			}
+
+			data = rpc_msgpack_stream_bytes(reader, tag.v.l, &alloc);
+			mpack_done_str(reader);
+			if (data == NULL)
+				break;
+
+			/* In-place data is only valid until the next read */
+			atom = rpc_atom_lookup(data, tag.v.l);
+			key = atom != NULL ? NULL : g_strndup(data, tag.v.l);
+			free(alloc);
+
+			item = rpc_msgpack_stream_read_object(reader);
+			if (item != NULL) {
+				rpc_dictionary_steal_value(result,
+				    atom != NULL ? atom : key, item);
+			}
+
+			g_free(key);
+			if (item == NULL)
+				break;
+		}
+
+		mpack_done_map(reader);
+		return (result);
+
+	case mpack_type_ext:
+		data = rpc_msgpack_stream_bytes(reader, tag.v.l, &alloc);
+		mpack_done_ext(reader);
+		if (data == NULL)
+			return (NULL);
+
+		switch (tag.exttype) {
+		case MSGPACK_EXTTYPE_DATE:
+			memcpy(&date, data, MIN(sizeof(date), tag.v.l));
+			result = rpc_date_create(date);
+			break;
+
+		case MSGPACK_EXTTYPE_DATE_NS:
+			result = rpc_msgpack_read_date_ns(data, tag.v.l);
+			break;
+
+		case MSGPACK_EXTTYPE_FD:
+			memcpy(&fd, data, MIN(sizeof(fd), tag.v.l));
+			result = rpc_fd_create(fd);
+			break;
+
+#if defined(__linux__)
+		case MSGPACK_EXTTYPE_SHMEM:
+			mpack_tree_init(&subtree, data, tag.v.l);
+			result = rpc_msgpack_read_shmem(&subtree);
+			mpack_tree_destroy(&subtree);
+			break;
+#endif
+
+		case MSGPACK_EXTTYPE_ERROR:
+			mpack_tree_init(&subtree, data, tag.v.l);
+			result = rpc_msgpack_read_error(&subtree);
+			mpack_tree_destroy(&subtree);
+			break;
+
+		default:
+			result = rpc_msgpack_read_ext(tag.exttype, data,
+			    tag.v.l);
+			break;
+		}
+
+		free(alloc);
+		return (result);
+
+	case mpack_type_nil:
+	default:
+		return (rpc_null_create());
+	}
+}
+
+/*
+ * Reads the value at the reader's position and returns the part of
+ * it designated by path, dot separated keys and array indices. The
+ * rest is skipped over without building any object.
+ */
+static rpc_object_t
+rpc_msgpack_peek_value(mpack_reader_t *reader, const char *path)
+{
+	mpack_tag_t tag;
+	rpc_object_t result = NULL;
+	const char *next;
+	const char *data;
+	char *alloc;
+	char *end;
+	size_t len;
+	uint32_t count;
+	uint32_t index;
+	uint32_t i;
+	bool match;
+
+	if (*path == '\0')
+		return (rpc_msgpack_stream_read_object(reader));
+
+	len = strcspn(path, ".");
+	next = path[len] == '.' ? path + len + 1 : path + len;
+	tag = mpack_peek_tag(reader);
+	if (mpack_reader_error(reader) != mpack_ok)
+		return (NULL);
+
+	switch (tag.type) {
+	case mpack_type_map:
+		count = mpack_read_tag(reader).v.n;
+		for (i = 0; i < count; i++) {
+			tag = mpack_read_tag(reader);
+			if (tag.type != mpack_type_str) {
+				mpack_reader_flag_error(reader,
+				    mpack_error_type);
+				break;
+			}
+
+			data = rpc_msgpack_stream_bytes(reader, tag.v.l,
+			    &alloc);
+			mpack_done_str(reader);
+			if (data == NULL)
+				break;
+
+			match = tag.v.l == len && memcmp(data, path, len) == 0;
+			free(alloc);
+
+			if (match && result == NULL)
+				result = rpc_msgpack_peek_value(reader, next);
+			else
+				mpack_discard(reader);
+
+			if (mpack_reader_error(reader) != mpack_ok)
+				break;
+		}
+
+		mpack_done_map(reader);
+		break;
+
+	case mpack_type_array:
+		index = (uint32_t)strtoul(path, &end, 10);
+		match = len > 0 && end == path + len;
+		count = mpack_read_tag(reader).v.n;
+		for (i = 0; i < count; i++) {
+			if (match && i == index)
+				result = rpc_msgpack_peek_value(reader, next);
+			else
+				mpack_discard(reader);
+
+			if (mpack_reader_error(reader) != mpack_ok)
+				break;
+		}
+
+		mpack_done_array(reader);
+		break;
+
+	default:
+		mpack_discard(reader);
+		break;
+	}
+
+	if (result != NULL && mpack_reader_error(reader) != mpack_ok) {
+		rpc_release(result);
+		return (NULL);
+	}
+
+	return (result);
+}
+
+rpc_object_t
+rpc_msgpack_peek(const void *frame, size_t size, const char *path)
+{
+	mpack_reader_t reader;
+	rpc_object_t result;
+
+	mpack_reader_init_data(&reader, frame, size);
+	result = rpc_msgpack_peek_value(&reader, path);
+
+	if (mpack_reader_destroy(&reader) != mpack_ok) {
+		if (result != NULL)
+			rpc_release(result);
+
+		rpc_set_last_error(EINVAL, "Cannot parse frame", NULL);
+		return (NULL);
+	}
+
+	if (result == NULL)
+		rpc_set_last_errorf(ENOENT, "No value at %s", path);
+
+	return (result);
+}
+
+rpc_object_t
+rpc_msgpack_deserialize_envelope(const void *frame, size_t size,
+    const char *key, const void **raw, size_t *rawlen)
+{
+	mpack_reader_t reader;
+	mpack_tag_t tag;
+	rpc_object_t result;
+	rpc_object_t item;
+	const char *data;
+	const char *atom;
+	char *alloc;
+	char *name;
+	size_t keylen = strlen(key);
+	size_t start;
+	uint32_t count = 0;
+	uint32_t i;
+	bool match;
+
+	*raw = NULL;
+	*rawlen = 0;
+	result = rpc_dictionary_create();
+	mpack_reader_init_data(&reader, frame, size);
+
+	tag = mpack_read_tag(&reader);
+	if (tag.type == mpack_type_map)
+		count = tag.v.n;
+	else
+		mpack_reader_flag_error(&reader, mpack_error_type);
+
+	for (i = 0; i < count; i++) {
+		tag = mpack_read_tag(&reader);
+		if (tag.type != mpack_type_str) {
+			mpack_reader_flag_error(&reader, mpack_error_type);
+			break;
+		}
+
+		data = rpc_msgpack_stream_bytes(&reader, tag.v.l, &alloc);
+		mpack_done_str(&reader);
+		if (data == NULL)
+			break;
+
+		match = tag.v.l == keylen && memcmp(data, key, keylen) == 0;
+		atom = rpc_atom_lookup(data, tag.v.l);
+		name = atom != NULL ? NULL : g_strndup(data, tag.v.l);
+		free(alloc);
+
+		if (match) {
+			/* Left encoded, the reader only steps over it */
+			start = size - reader.left;
+			mpack_discard(&reader);
+			*raw = (const char *)frame + start;
+			*rawlen = size - reader.left - start;
+			g_free(name);
+			continue;
+		}
+
+		item = rpc_msgpack_stream_read_object(&reader);
+		if (item != NULL) {
+			rpc_dictionary_steal_value(result,
+			    atom != NULL ? atom : name, item);
+		}
+
+		g_free(name);
+		if (item == NULL)
+			break;
+	}
+
+	mpack_done_map(&reader);
+	if (mpack_reader_destroy(&reader) != mpack_ok) {
+		rpc_release(result);
+		*raw = NULL;
+		*rawlen = 0;
+		rpc_set_last_error(EINVAL, "Cannot parse frame", NULL);
+		return (NULL);
+	}
+
+	return (result);
+}
+
 int
 rpc_msgpack_serialize(rpc_object_t obj, void **frame, size_t *size)
 {
 	mpack_writer_t writer;
 
 	mpack_writer_init_growable(&writer, (char **)frame, size);
-	rpc_msgpack_write_object(&writer, obj);
+	rpc_msgpack_write_object(&writer, obj, NULL);
+	mpack_writer_destroy(&writer);
+	return (0);
+}
+
+int
+rpc_msgpack_serialize_canonical(rpc_object_t obj, void **frame, size_t *size)
+{
+	mpack_writer_t writer;
+
+	mpack_writer_init_growable(&writer, (char **)frame, size);
+	rpc_msgpack_write_canonical(&writer, obj);
 	mpack_writer_destroy(&writer);
 	return (0);
 }
 
+int
+rpc_msgpack_serialize_splice(rpc_object_t dict, const char *key,
+    const void *raw, size_t rawlen, void **frame, size_t *size)
+{
+	mpack_writer_t writer;
+	mpack_writer_t *w = &writer;
+
+	g_assert(rpc_get_type(dict) == RPC_TYPE_DICTIONARY);
+
+	mpack_writer_init_growable(&writer, (char **)frame, size);
+	mpack_start_map(&writer,
+	    (uint32_t)rpc_dictionary_get_count(dict) + 1);
+	rpc_dictionary_apply(dict, ^(const char *k, rpc_object_t v) {
+	    mpack_write_cstr(w, k);
+	    rpc_msgpack_write_object(w, v, NULL);
+	    return ((bool)true);
+	});
+	mpack_write_cstr(&writer, key);
+	mpack_write_object_bytes(&writer, raw, rawlen);
+	mpack_finish_map(&writer);
+
+	if (mpack_writer_destroy(&writer) != mpack_ok)
+		return (-1);
+
+	return (0);
+}
+
+/*
+ * Same as rpc_msgpack_serialize(), with @p hdr copied in front of the
+ * encoded object, in the same buffer.
+ */
+int
+rpc_msgpack_serialize_prefixed(rpc_object_t obj, const void *hdr,
+    size_t hdrlen, void **frame, size_t *size)
+{
+	mpack_writer_t writer;
+
+	mpack_writer_init_growable(&writer, (char **)frame, size);
+	mpack_write_object_bytes(&writer, hdr, hdrlen);
+	rpc_msgpack_write_object(&writer, obj, NULL);
+	if (mpack_writer_destroy(&writer) != mpack_ok)
+		return (-1);
+
+	return (0);
+}
+
+static void
+rpc_msgpack_count_flush(mpack_writer_t *writer, const char *buf, size_t len)
+{
+	struct rpc_msgpack_stream *stream = writer->context;
+
+	stream->total += len;
+}
+
+static void
+rpc_msgpack_stream_flush(mpack_writer_t *writer, const char *buf, size_t len)
+{
+	struct rpc_msgpack_stream *stream = writer->context;
+
+	if (len == 0)
+		return;
+
+	if (stream->chunk(buf, len) != 0) {
+		mpack_writer_flag_error(writer, mpack_error_io);
+		return;
+	}
+
+	stream->total += len;
+}
+
+/*
+ * Interleaves the serialized @p frame with the binaries it references
+ * and frees @p refs.
+ */
+static void
+rpc_msgpack_iov_build(void *frame, size_t size, GArray *refs,
+    struct iovec **iov, size_t *niov)
+{
+	struct rpc_msgpack_iov_ref *ref;
+	struct iovec *result;
+	size_t offset = 0;
+	size_t n = 0;
+	guint i;
+
+	result = g_malloc_n(refs->len * 2 + 1, sizeof(*result));
+
+	for (i = 0; i < refs->len; i++) {
+		ref = &g_array_index(refs, struct rpc_msgpack_iov_ref, i);
+		if (ref->offset > offset) {
+			result[n].iov_base = (char *)frame + offset;
+			result[n].iov_len = ref->offset - offset;
+			n++;
+		}
+
+		result[n].iov_base = (void *)ref->ptr;
+		result[n].iov_len = ref->len;
+		offset = ref->offset;
+		n++;
+	}
+
+	if (size > offset) {
+		result[n].iov_base = (char *)frame + offset;
+		result[n].iov_len = size - offset;
+		n++;
+	}
+
+	g_array_free(refs, true);
+	*iov = result;
+	*niov = n;
+}
+
+int
+rpc_msgpack_serialize_stream(rpc_object_t obj, void *buf, size_t bufsize,
+    rpc_msgpack_vector_t vector, rpc_msgpack_begin_t begin,
+    rpc_msgpack_chunk_t chunk)
+{
+	mpack_writer_t writer;
+	struct rpc_msgpack_stream stream = { .chunk = chunk, .total = 0 };
+	struct iovec *iov;
+	GArray *refs = NULL;
+	size_t used;
+	size_t niov;
+	int ret;
+
+	/*
+	 * First try to fit the whole frame in the caller's buffer. This
+	 * is the common case and costs a single pass. With a vector
+	 * callback, large binaries don't count against the buffer; they
+	 * are referenced in place like rpc_msgpack_serialize_iov() does.
+	 */
+	if (vector != NULL)
+		refs = g_array_new(false, false,
+		    sizeof(struct rpc_msgpack_iov_ref));
+
+	mpack_writer_init(&writer, buf, bufsize);
+	rpc_msgpack_write_object(&writer, obj, refs);
+	used = mpack_writer_buffer_used(&writer);
+
+	if (mpack_writer_destroy(&writer) == mpack_ok) {
+		if (vector != NULL) {
+			rpc_msgpack_iov_build(buf, used, refs, &iov, &niov);
+			ret = vector(iov, niov);
+			g_free(iov);
+			return (ret);
+		}
+
+		if (begin(used) != 0)
+			return (-1);
+
+		return (chunk(buf, used));
+	}
+
+	if (refs != NULL)
+		g_array_free(refs, true);
+
+	/*
+	 * The frame doesn't fit. Measure it with a pass that discards
+	 * its output, announce the length and then serialize it again,
+	 * flushing every time the buffer fills up. Binary data larger
+	 * than the buffer is handed to the chunk callback directly.
+	 */
+	mpack_writer_init(&writer, buf, bufsize);
+	mpack_writer_set_context(&writer, &stream);
+	mpack_writer_set_flush(&writer, rpc_msgpack_count_flush);
+	rpc_msgpack_write_object(&writer, obj, NULL);
+
+	if (mpack_writer_destroy(&writer) != mpack_ok) {
+		rpc_set_last_errorf(EINVAL, "Cannot serialize frame");
+		return (-1);
+	}
+
+	if (begin(stream.total) != 0)
+		return (-1);
+
+	stream.total = 0;
+	mpack_writer_init(&writer, buf, bufsize);
+	mpack_writer_set_context(&writer, &stream);
+	mpack_writer_set_flush(&writer, rpc_msgpack_stream_flush);
+	rpc_msgpack_write_object(&writer, obj, NULL);
+
+	if (mpack_writer_destroy(&writer) != mpack_ok)
+		return (-1);
+
+	return (0);
+}
+
+size_t
+rpc_msgpack_size(rpc_object_t obj)
+{
+	mpack_writer_t writer;
+	struct rpc_msgpack_stream stream = { .chunk = NULL, .total = 0 };
+	char buf[1024];
+
+	/* Same as the measuring pass above, for callers that only need it */
+	mpack_writer_init(&writer, buf, sizeof(buf));
+	mpack_writer_set_context(&writer, &stream);
+	mpack_writer_set_flush(&writer, rpc_msgpack_count_flush);
+	rpc_msgpack_write_object(&writer, obj, NULL);
+
+	if (mpack_writer_destroy(&writer) != mpack_ok)
+		return (0);
+
+	return (stream.total);
+}
+
+int
+rpc_msgpack_serialize_iov(rpc_object_t obj, void **frame, size_t *size,
+    struct iovec **iov, size_t *niov)
+{
+	mpack_writer_t writer;
+	GArray *refs;
+
+	refs = g_array_new(false, false, sizeof(struct rpc_msgpack_iov_ref));
+	mpack_writer_init_growable(&writer, (char **)frame, size);
+	rpc_msgpack_write_object(&writer, obj, refs);
+
+	if (mpack_writer_destroy(&writer) != mpack_ok) {
+		g_array_free(refs, true);
+		return (-1);
+	}
+
+	rpc_msgpack_iov_build(*frame, *size, refs, iov, niov);
+	return (0);
+}
+
 rpc_object_t
 rpc_msgpack_deserialize(const void *frame, size_t size)
 {
@@ -354,16 +1558,74 @@ rpc_msgpack_deserialize(const void *frame, size_t size)
 	rpc_object_t result;
 
 	mpack_tree_init(&tree, frame, size);
-	result = rpc_msgpack_read_object(mpack_tree_root(&tree));
+	if (size >= RPC_ARENA_MIN_FRAME)
+		rpc_arena_enter();
+
+	result = rpc_msgpack_read_object(mpack_tree_root(&tree), NULL);
+	if (size >= RPC_ARENA_MIN_FRAME)
+		rpc_arena_leave();
+
+	mpack_tree_destroy(&tree);
+
+	return (result);
+}
+
+rpc_object_t
+rpc_msgpack_deserialize_bytes(GBytes *frame)
+{
+	mpack_tree_t tree;
+	rpc_object_t result;
+	const void *data;
+	gsize size;
+
+	data = g_bytes_get_data(frame, &size);
+	mpack_tree_init(&tree, data, size);
+	if (size >= RPC_ARENA_MIN_FRAME)
+		rpc_arena_enter();
+
+	result = rpc_msgpack_read_object(mpack_tree_root(&tree), frame);
+	if (size >= RPC_ARENA_MIN_FRAME)
+		rpc_arena_leave();
+
 	mpack_tree_destroy(&tree);
 
 	return (result);
 }
 
+rpc_object_t
+rpc_msgpack_deserialize_stream(rpc_msgpack_fill_t fill, void *buf,
+    size_t bufsize)
+{
+	mpack_reader_t reader;
+	struct rpc_msgpack_source source = { .fill = fill };
+	rpc_object_t result;
+
+	mpack_reader_init(&reader, buf, bufsize, 0);
+	mpack_reader_set_context(&reader, &source);
+	mpack_reader_set_fill(&reader, rpc_msgpack_stream_fill);
+	result = rpc_msgpack_stream_read_object(&reader);
+
+	if (mpack_reader_destroy(&reader) != mpack_ok) {
+		if (result != NULL)
+			rpc_release(result);
+
+		return (NULL);
+	}
+
+	return (result);
+}
+
 static struct rpc_serializer msgpack_serializer = {
 	.name = "msgpack",
     	.serialize = &rpc_msgpack_serialize,
     	.deserialize = &rpc_msgpack_deserialize
 };
 
+static struct rpc_serializer msgpack_canonical_serializer = {
+	.name = "msgpack-canonical",
+	.serialize = &rpc_msgpack_serialize_canonical,
+	.deserialize = &rpc_msgpack_deserialize
+};
+
 DECLARE_SERIALIZER(msgpack_serializer);
+DECLARE_SERIALIZER(msgpack_canonical_serializer);
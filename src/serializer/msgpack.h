@@ -36,18 +36,52 @@ extern "C" {
 #define MSGPACK_EXTTYPE_FD	2
 #define MSGPACK_EXTTYPE_SHMEM	3
 #define MSGPACK_EXTTYPE_ERROR	4
+#define MSGPACK_EXTTYPE_DEFLATE	5
+#define MSGPACK_EXTTYPE_COMPRESSED	6
+#define MSGPACK_EXTTYPE_CHANNEL	7
+#define MSGPACK_EXTTYPE_DATE_NS	8
 
 #define	MSGPACK_SHMEM_FD	"fd"
 #define	MSGPACK_SHMEM_OFFSET	"offset"
 #define	MSGPACK_SHMEM_LEN	"len"
+#define	MSGPACK_SHMEM_REGION	"region"
+
+/*
+ * Binary leaves at least this large are referenced in place by
+ * rpc_msgpack_serialize_iov() instead of being copied into the frame,
+ * and are sliced out of the received frame by
+ * rpc_msgpack_deserialize_bytes() instead of being copied out of it.
+ */
+#define	MSGPACK_IOV_THRESHOLD	4096
 
 #define	MSGPACK_ERROR_CODE	"code"
 #define	MSGPACK_ERROR_MESSAGE	"message"
 #define	MSGPACK_ERROR_EXTRA	"extra"
 #define	MSGPACK_ERROR_STACK	"stack"
 
+typedef int (^rpc_msgpack_vector_t)(const struct iovec *, size_t);
+typedef int (^rpc_msgpack_begin_t)(size_t);
+typedef int (^rpc_msgpack_chunk_t)(const void *, size_t);
+typedef ssize_t (^rpc_msgpack_fill_t)(void *, size_t);
+
 int rpc_msgpack_serialize(rpc_object_t, void **, size_t *);
+int rpc_msgpack_serialize_canonical(rpc_object_t, void **, size_t *);
+int rpc_msgpack_serialize_splice(rpc_object_t, const char *, const void *,
+    size_t, void **, size_t *);
+int rpc_msgpack_serialize_prefixed(rpc_object_t, const void *, size_t,
+    void **, size_t *);
+int rpc_msgpack_serialize_stream(rpc_object_t, void *, size_t,
+    rpc_msgpack_vector_t, rpc_msgpack_begin_t, rpc_msgpack_chunk_t);
+int rpc_msgpack_serialize_iov(rpc_object_t, void **, size_t *,
+    struct iovec **, size_t *);
+size_t rpc_msgpack_size(rpc_object_t);
 rpc_object_t rpc_msgpack_deserialize(const void *, size_t);
+rpc_object_t rpc_msgpack_deserialize_bytes(GBytes *);
+rpc_object_t rpc_msgpack_deserialize_stream(rpc_msgpack_fill_t, void *, size_t);
+rpc_object_t rpc_msgpack_deserialize_envelope(const void *, size_t,
+    const char *, const void **, size_t *);
+rpc_object_t rpc_msgpack_peek(const void *, size_t, const char *);
+bool rpc_msgpack_ext_registered(const char *);
 
 #ifdef __cplusplus
 }
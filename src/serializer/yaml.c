@@ -219,8 +219,8 @@ rpc_yaml_read_scalar(yaml_event_t *event)
 
 	ret = rpc_string_create_len(value, len);
 done:
-	ret->ro_column = event->start_mark.column;
-	ret->ro_line = event->start_mark.line;
+	rpc_object_set_position(ret, event->start_mark.line,
+	    event->start_mark.column);
 	return (ret);
 }
 
@@ -552,17 +552,27 @@ done:	yaml_emitter_delete(&emitter);
 	return (status == 1 ? 0 : -1);
 }
 
-rpc_object_t
-rpc_yaml_deserialize(const void *frame, size_t size)
+/*
+ * Builds objects from parser events. Without a callback, returns the root
+ * of the first document. With one, hands over each top level mapping entry
+ * of every document as soon as its value is complete, or the whole root if
+ * it's not a plain mapping, and keeps going until the callback returns
+ * false or the stream ends.
+ */
+static int
+rpc_yaml_load(const void *frame, size_t size, rpc_yaml_entry_cb_t cb,
+    rpc_object_t *resultp)
 {
 	GQueue *containers = g_queue_new();
 	GQueue *keys = g_queue_new();
 	rpc_object_t current = NULL;
 	rpc_object_t container;
+	rpc_object_t stream_root = NULL;
 	yaml_parser_t parser;
 	yaml_event_t event;
 	bool done = false;
 	bool read_key = false;
+	int ret = -1;
 	char *key;
 	char *tag;
 
@@ -588,6 +598,10 @@ rpc_yaml_deserialize(const void *frame, size_t size)
 				}
 				g_queue_push_head(containers,
 				    rpc_dictionary_create());
+				if (cb != NULL &&
+				    g_queue_get_length(containers) == 1)
+					stream_root = g_queue_peek_head(
+					    containers);
 				goto done;
 
 			case YAML_MAPPING_END_EVENT:
@@ -619,6 +633,7 @@ rpc_yaml_deserialize(const void *frame, size_t size)
 
 			case YAML_STREAM_END_EVENT:
 				done = true;
+				ret = 0;
 				goto done;
 
 			default:
@@ -627,8 +642,35 @@ rpc_yaml_deserialize(const void *frame, size_t size)
 		}
 
 		container = g_queue_peek_head(containers);
-		if (container == NULL)
+		if (container == NULL && cb == NULL) {
+			ret = 0;
 			goto out;
+		}
+
+		if (container == NULL) {
+			/* Entries of a streamed root are gone already */
+			if (current != stream_root && !cb(NULL, current)) {
+				done = true;
+				ret = 0;
+			}
+
+			rpc_release(current);
+			stream_root = NULL;
+			goto done;
+		}
+
+		if (container == stream_root) {
+			key = g_queue_pop_head(keys);
+			if (!cb(key, current)) {
+				done = true;
+				ret = 0;
+			}
+
+			g_free(key);
+			rpc_release(current);
+			read_key = true;
+			goto done;
+		}
 
 		switch (rpc_get_type(container)) {
 		case RPC_TYPE_ARRAY:
@@ -653,8 +695,28 @@ done:
 out:
 	yaml_parser_delete(&parser);
 	g_queue_free_full(keys, g_free);
-	g_queue_free(containers);
-	return (current);
+	g_queue_free_full(containers, (GDestroyNotify)rpc_release_impl);
+
+	/* On errors, the last value belongs to one of the containers above */
+	*resultp = ret == 0 ? current : NULL;
+	return (ret);
+}
+
+rpc_object_t
+rpc_yaml_deserialize(const void *frame, size_t size)
+{
+	rpc_object_t result;
+
+	rpc_yaml_load(frame, size, NULL, &result);
+	return (result);
+}
+
+int
+rpc_yaml_load_entries(const void *frame, size_t size, rpc_yaml_entry_cb_t cb)
+{
+	rpc_object_t result;
+
+	return (rpc_yaml_load(frame, size, cb, &result));
 }
 
 static struct rpc_serializer yaml_serializer = {
@@ -52,8 +52,16 @@ extern "C" {
 #define YAML_SHMEM_FD		"fd"
 #endif
 
+/*
+ * Receives a top level mapping entry, or a whole document root with NULL
+ * key. The value is released once the callback returns, so it has to be
+ * retained to outlive it. Returning false stops the loader.
+ */
+typedef bool (^rpc_yaml_entry_cb_t)(const char *, rpc_object_t);
+
 int rpc_yaml_serialize(rpc_object_t, void **, size_t *);
 rpc_object_t rpc_yaml_deserialize(const void *, size_t);
+int rpc_yaml_load_entries(const void *, size_t, rpc_yaml_entry_cb_t);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,530 @@
+/*
+ * Copyright 2015-2017 Two Pore Guys, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <glib.h>
+#include <rpc/object.h>
+#include "internal.h"
+#include "slab.h"
+
+struct rpc_slab_thread
+{
+	struct rpc_slab *		rst_slab;
+	struct rpc_slab_magazine *	rst_loaded;
+	struct rpc_slab_magazine *	rst_previous;
+	uint64_t			rst_allocs;
+	uint64_t			rst_hits;
+	uint64_t			rst_frees;
+};
+
+static struct rpc_slab_thread *rpc_slab_get_thread(struct rpc_slab *);
+static void rpc_slab_thread_destroy(void *);
+static void rpc_slab_fold_stats(struct rpc_slab_thread *);
+static void rpc_slab_drain(struct rpc_slab *, struct rpc_slab_magazine *);
+static void rpc_arena_thread_destroy(void *);
+static inline void rpc_alloc_count(rpc_alloc_tag_t, int64_t, bool);
+
+struct rpc_arena_thread
+{
+	struct rpc_arena *		rat_current;
+	guint				rat_depth;
+};
+
+static GPrivate rpc_arena_thread = G_PRIVATE_INIT(rpc_arena_thread_destroy);
+
+#define	RPC_SLAB_INITIALIZER(_name, _type, _tag)		\
+	{								\
+		.rsl_name = (_name),					\
+		.rsl_size = sizeof(_type),				\
+		.rsl_tag = (_tag),					\
+		.rsl_thread = G_PRIVATE_INIT(rpc_slab_thread_destroy)	\
+	}
+
+struct rpc_slab rpc_object_slab = RPC_SLAB_INITIALIZER("rpc_object",
+    struct rpc_object, RPC_ALLOC_TAG_OBJECT);
+struct rpc_slab rpc_call_slab = RPC_SLAB_INITIALIZER("rpc_call",
+    struct rpc_call, RPC_ALLOC_TAG_CALL);
+
+struct rpc_alloc_counters
+{
+	_Atomic uint64_t		rac_allocs;
+	_Atomic uint64_t		rac_frees;
+	_Atomic int64_t			rac_bytes;
+};
+
+static struct rpc_allocator rpc_allocator;
+static bool rpc_allocator_custom;
+static struct rpc_alloc_counters rpc_alloc_counters[RPC_ALLOC_TAG_COUNT];
+
+static inline void
+rpc_alloc_count(rpc_alloc_tag_t tag, int64_t delta, bool alloc)
+{
+	struct rpc_alloc_counters *cnt = &rpc_alloc_counters[tag];
+
+	atomic_fetch_add_explicit(alloc ? &cnt->rac_allocs : &cnt->rac_frees,
+	    1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&cnt->rac_bytes, delta,
+	    memory_order_relaxed);
+}
+
+void *
+rpc_alloc(rpc_alloc_tag_t tag, size_t size)
+{
+	void *ret;
+
+	if (!rpc_allocator_custom)
+		ret = g_malloc(size);
+	else {
+		ret = rpc_allocator.ra_alloc(rpc_allocator.ra_arg, tag, size);
+		if (ret == NULL && size > 0) {
+			g_error("%s: failed to allocate %zu bytes", G_STRLOC,
+			    size);
+		}
+	}
+
+	rpc_alloc_count(tag, (int64_t)size, true);
+	return (ret);
+}
+
+void *
+rpc_alloc0(rpc_alloc_tag_t tag, size_t size)
+{
+	void *ret;
+
+	if (!rpc_allocator_custom) {
+		rpc_alloc_count(tag, (int64_t)size, true);
+		return (g_malloc0(size));
+	}
+
+	ret = rpc_alloc(tag, size);
+	memset(ret, 0, size);
+	return (ret);
+}
+
+void *
+rpc_realloc(rpc_alloc_tag_t tag, void *ptr, size_t oldsize, size_t size)
+{
+	void *ret;
+
+	if (ptr == NULL)
+		return (rpc_alloc(tag, size));
+
+	if (!rpc_allocator_custom)
+		ret = g_realloc(ptr, size);
+	else {
+		ret = rpc_allocator.ra_realloc(rpc_allocator.ra_arg, tag, ptr,
+		    oldsize, size);
+		if (ret == NULL && size > 0) {
+			g_error("%s: failed to allocate %zu bytes", G_STRLOC,
+			    size);
+		}
+	}
+
+	atomic_fetch_add_explicit(&rpc_alloc_counters[tag].rac_bytes,
+	    (int64_t)size - (int64_t)oldsize, memory_order_relaxed);
+	return (ret);
+}
+
+void
+rpc_free(rpc_alloc_tag_t tag, void *ptr, size_t size)
+{
+
+	if (ptr == NULL)
+		return;
+
+	rpc_alloc_count(tag, -(int64_t)size, false);
+	if (!rpc_allocator_custom) {
+		g_free(ptr);
+		return;
+	}
+
+	rpc_allocator.ra_free(rpc_allocator.ra_arg, tag, ptr, size);
+}
+
+static struct rpc_slab_thread *
+rpc_slab_get_thread(struct rpc_slab *slab)
+{
+	struct rpc_slab_thread *thr;
+
+	thr = g_private_get(&slab->rsl_thread);
+	if (thr != NULL)
+		return (thr);
+
+	thr = g_malloc0(sizeof(*thr));
+	thr->rst_slab = slab;
+	thr->rst_loaded = g_malloc0(sizeof(struct rpc_slab_magazine));
+	thr->rst_previous = g_malloc0(sizeof(struct rpc_slab_magazine));
+	g_private_set(&slab->rsl_thread, thr);
+	return (thr);
+}
+
+static void
+rpc_slab_fold_stats(struct rpc_slab_thread *thr)
+{
+	struct rpc_slab *slab = thr->rst_slab;
+
+	atomic_fetch_add_explicit(&slab->rsl_allocs, thr->rst_allocs,
+	    memory_order_relaxed);
+	atomic_fetch_add_explicit(&slab->rsl_hits, thr->rst_hits,
+	    memory_order_relaxed);
+	atomic_fetch_add_explicit(&slab->rsl_frees, thr->rst_frees,
+	    memory_order_relaxed);
+
+	thr->rst_allocs = 0;
+	thr->rst_hits = 0;
+	thr->rst_frees = 0;
+}
+
+static void
+rpc_slab_drain(struct rpc_slab *slab, struct rpc_slab_magazine *mag)
+{
+
+	while (mag->rsm_count > 0) {
+		rpc_free(slab->rsl_tag, mag->rsm_items[--mag->rsm_count],
+		    slab->rsl_size);
+	}
+}
+
+static void
+rpc_slab_thread_destroy(void *arg)
+{
+	struct rpc_slab_thread *thr = arg;
+	struct rpc_slab *slab = thr->rst_slab;
+	struct rpc_slab_magazine *mags[2] = {
+		thr->rst_loaded,
+		thr->rst_previous
+	};
+	struct rpc_slab_magazine *spare = NULL;
+	struct rpc_slab_magazine *mag;
+	int i;
+
+	rpc_slab_fold_stats(thr);
+
+	g_mutex_lock(&slab->rsl_mtx);
+	for (i = 0; i < 2; i++) {
+		if (mags[i]->rsm_count == RPC_SLAB_MAGAZINE_SIZE &&
+		    slab->rsl_nfull < RPC_SLAB_DEPOT_MAX) {
+			mags[i]->rsm_next = slab->rsl_full;
+			slab->rsl_full = mags[i];
+			slab->rsl_nfull++;
+			mags[i] = NULL;
+
+			/*
+			 * Once emptied, the donated magazine lands on the
+			 * empty list, so one already there can go.
+			 */
+			mag = slab->rsl_empty;
+			if (mag != NULL) {
+				slab->rsl_empty = mag->rsm_next;
+				slab->rsl_nempty--;
+				mag->rsm_next = spare;
+				spare = mag;
+			}
+		}
+	}
+	g_mutex_unlock(&slab->rsl_mtx);
+
+	for (i = 0; i < 2; i++) {
+		if (mags[i] == NULL)
+			continue;
+
+		rpc_slab_drain(slab, mags[i]);
+		g_free(mags[i]);
+	}
+
+	while ((mag = spare) != NULL) {
+		spare = mag->rsm_next;
+		g_free(mag);
+	}
+
+	g_free(thr);
+}
+
+void *
+rpc_slab_alloc(struct rpc_slab *slab)
+{
+	struct rpc_slab_thread *thr;
+	struct rpc_slab_magazine *mag;
+	struct rpc_slab_magazine *spare;
+	void *ret;
+
+	thr = rpc_slab_get_thread(slab);
+	thr->rst_allocs++;
+
+	if (thr->rst_loaded->rsm_count == 0) {
+		if (thr->rst_previous->rsm_count > 0) {
+			mag = thr->rst_loaded;
+			thr->rst_loaded = thr->rst_previous;
+			thr->rst_previous = mag;
+		} else {
+			/* Both magazines are empty, try the depot */
+			g_mutex_lock(&slab->rsl_mtx);
+			mag = slab->rsl_full;
+			spare = NULL;
+			if (mag != NULL) {
+				slab->rsl_full = mag->rsm_next;
+				slab->rsl_nfull--;
+				if (slab->rsl_nempty < RPC_SLAB_DEPOT_MAX) {
+					thr->rst_previous->rsm_next =
+					    slab->rsl_empty;
+					slab->rsl_empty = thr->rst_previous;
+					slab->rsl_nempty++;
+				} else
+					spare = thr->rst_previous;
+				thr->rst_previous = thr->rst_loaded;
+				thr->rst_loaded = mag;
+			}
+			g_mutex_unlock(&slab->rsl_mtx);
+			g_free(spare);
+			rpc_slab_fold_stats(thr);
+		}
+	}
+
+	if (thr->rst_loaded->rsm_count == 0) {
+		ret = rpc_alloc0(slab->rsl_tag, slab->rsl_size);
+	} else {
+		thr->rst_hits++;
+		ret = thr->rst_loaded->rsm_items[--thr->rst_loaded->rsm_count];
+		memset(ret, 0, slab->rsl_size);
+	}
+
+	if (thr->rst_allocs + thr->rst_frees >= RPC_SLAB_STATS_BATCH)
+		rpc_slab_fold_stats(thr);
+
+	return (ret);
+}
+
+void
+rpc_slab_free(struct rpc_slab *slab, void *ptr)
+{
+	struct rpc_slab_thread *thr;
+	struct rpc_slab_magazine *mag = NULL;
+	bool drain = false;
+
+	thr = rpc_slab_get_thread(slab);
+	thr->rst_frees++;
+
+	if (thr->rst_loaded->rsm_count == RPC_SLAB_MAGAZINE_SIZE) {
+		if (thr->rst_previous->rsm_count == 0) {
+			mag = thr->rst_loaded;
+			thr->rst_loaded = thr->rst_previous;
+			thr->rst_previous = mag;
+		} else {
+			/* Both magazines are full, hand one over to the depot */
+			g_mutex_lock(&slab->rsl_mtx);
+			if (slab->rsl_nfull < RPC_SLAB_DEPOT_MAX) {
+				thr->rst_previous->rsm_next = slab->rsl_full;
+				slab->rsl_full = thr->rst_previous;
+				slab->rsl_nfull++;
+
+				mag = slab->rsl_empty;
+				if (mag != NULL) {
+					slab->rsl_empty = mag->rsm_next;
+					slab->rsl_nempty--;
+				}
+			} else
+				drain = true;
+			g_mutex_unlock(&slab->rsl_mtx);
+
+			if (drain) {
+				mag = thr->rst_previous;
+				rpc_slab_drain(slab, mag);
+			}
+
+			if (mag == NULL)
+				mag = g_malloc0(sizeof(*mag));
+
+			thr->rst_previous = thr->rst_loaded;
+			thr->rst_loaded = mag;
+			rpc_slab_fold_stats(thr);
+		}
+	}
+
+	thr->rst_loaded->rsm_items[thr->rst_loaded->rsm_count++] = ptr;
+
+	if (thr->rst_allocs + thr->rst_frees >= RPC_SLAB_STATS_BATCH)
+		rpc_slab_fold_stats(thr);
+}
+
+static void
+rpc_arena_thread_destroy(void *arg)
+{
+	struct rpc_arena_thread *thr = arg;
+
+	if (thr->rat_current != NULL)
+		rpc_arena_release(thr->rat_current);
+
+	g_free(thr);
+}
+
+void
+rpc_arena_enter(void)
+{
+	struct rpc_arena_thread *thr;
+
+	thr = g_private_get(&rpc_arena_thread);
+	if (thr == NULL) {
+		thr = g_malloc0(sizeof(*thr));
+		g_private_set(&rpc_arena_thread, thr);
+	}
+
+	/* Nested scopes share the outermost one's chunks */
+	thr->rat_depth++;
+}
+
+void
+rpc_arena_leave(void)
+{
+	struct rpc_arena_thread *thr;
+
+	thr = g_private_get(&rpc_arena_thread);
+	g_assert(thr != NULL && thr->rat_depth > 0);
+
+	if (--thr->rat_depth > 0 || thr->rat_current == NULL)
+		return;
+
+	rpc_arena_release(thr->rat_current);
+	thr->rat_current = NULL;
+}
+
+void *
+rpc_arena_alloc(size_t size, struct rpc_arena **arenap)
+{
+	struct rpc_arena_thread *thr;
+	struct rpc_arena *arena;
+	void *ret;
+
+	thr = g_private_get(&rpc_arena_thread);
+	if (thr == NULL || thr->rat_depth == 0)
+		return (NULL);
+
+	size = (size + 15) & ~(size_t)15;
+	arena = thr->rat_current;
+	if (arena == NULL || arena->ra_used + size >
+	    RPC_ARENA_SIZE - sizeof(*arena)) {
+		if (arena != NULL)
+			rpc_arena_release(arena);
+
+		/* Fresh chunks are zeroed, like slab allocations */
+		arena = rpc_alloc0(RPC_ALLOC_TAG_OBJECT, RPC_ARENA_SIZE);
+		arena->ra_refcnt = 1;
+		thr->rat_current = arena;
+	}
+
+	ret = arena->ra_data + arena->ra_used;
+	arena->ra_used += size;
+	g_atomic_int_inc(&arena->ra_refcnt);
+	*arenap = arena;
+	return (ret);
+}
+
+void
+rpc_arena_release(struct rpc_arena *arena)
+{
+
+	if (g_atomic_int_dec_and_test(&arena->ra_refcnt))
+		rpc_free(RPC_ALLOC_TAG_OBJECT, arena, RPC_ARENA_SIZE);
+}
+
+int
+rpc_get_alloc_stats(rpc_alloc_cache_t cache, struct rpc_alloc_stats *stats)
+{
+	struct rpc_slab *slab;
+
+	switch (cache) {
+	case RPC_ALLOC_OBJECT:
+		slab = &rpc_object_slab;
+		break;
+
+	case RPC_ALLOC_CALL:
+		slab = &rpc_call_slab;
+		break;
+
+	default:
+		rpc_set_last_errorf(EINVAL, "Invalid allocator cache");
+		return (-1);
+	}
+
+	stats->ras_allocs = atomic_load_explicit(&slab->rsl_allocs,
+	    memory_order_relaxed);
+	stats->ras_hits = atomic_load_explicit(&slab->rsl_hits,
+	    memory_order_relaxed);
+	stats->ras_frees = atomic_load_explicit(&slab->rsl_frees,
+	    memory_order_relaxed);
+	return (0);
+}
+
+int
+rpc_set_allocator(const struct rpc_allocator *allocator)
+{
+	int i;
+
+	if (allocator != NULL && (allocator->ra_alloc == NULL ||
+	    allocator->ra_realloc == NULL || allocator->ra_free == NULL)) {
+		rpc_set_last_errorf(EINVAL, "Incomplete allocator");
+		return (-1);
+	}
+
+	/* Blocks from one allocator can't be handed to another */
+	for (i = 0; i < RPC_ALLOC_TAG_COUNT; i++) {
+		if (atomic_load(&rpc_alloc_counters[i].rac_allocs) > 0) {
+			rpc_set_last_errorf(EBUSY,
+			    "Allocator already in use");
+			return (-1);
+		}
+	}
+
+	if (allocator == NULL) {
+		rpc_allocator_custom = false;
+		return (0);
+	}
+
+	rpc_allocator = *allocator;
+	rpc_allocator_custom = true;
+	return (0);
+}
+
+int
+rpc_get_alloc_tag_stats(rpc_alloc_tag_t tag, struct rpc_alloc_tag_stats *stats)
+{
+	struct rpc_alloc_counters *cnt;
+
+	if ((unsigned)tag >= RPC_ALLOC_TAG_COUNT) {
+		rpc_set_last_errorf(EINVAL, "Invalid allocation tag");
+		return (-1);
+	}
+
+	cnt = &rpc_alloc_counters[tag];
+	stats->rats_allocs = atomic_load_explicit(&cnt->rac_allocs,
+	    memory_order_relaxed);
+	stats->rats_frees = atomic_load_explicit(&cnt->rac_frees,
+	    memory_order_relaxed);
+	stats->rats_bytes = atomic_load_explicit(&cnt->rac_bytes,
+	    memory_order_relaxed);
+	return (0);
+}
@@ -0,0 +1,111 @@
+/*
+ * Copyright 2015-2017 Two Pore Guys, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef LIBRPC_SLAB_H
+#define LIBRPC_SLAB_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <glib.h>
+#include <rpc/object.h>
+
+/*
+ * Tagged allocations. Every subsystem that holds a significant amount
+ * of memory allocates it through rpc_alloc() and friends, which keep
+ * per-tag counters and forward to the allocator installed with
+ * rpc_set_allocator(), or to g_malloc() by default. Callers pass the
+ * block size back on free.
+ */
+
+/*
+ * Magazine-based object cache. Each thread keeps two magazines of free
+ * objects per slab and allocates from them without taking any locks;
+ * only exchanging a whole magazine with the shared depot takes the slab
+ * mutex.
+ */
+#define	RPC_SLAB_MAGAZINE_SIZE	64
+#define	RPC_SLAB_DEPOT_MAX	32
+#define	RPC_SLAB_STATS_BATCH	256
+
+struct rpc_slab_magazine
+{
+	struct rpc_slab_magazine *	rsm_next;
+	size_t				rsm_count;
+	void *				rsm_items[RPC_SLAB_MAGAZINE_SIZE];
+};
+
+struct rpc_slab
+{
+	const char *			rsl_name;
+	size_t				rsl_size;
+	rpc_alloc_tag_t			rsl_tag;
+	GPrivate			rsl_thread;
+	GMutex				rsl_mtx;
+	struct rpc_slab_magazine *	rsl_full;
+	struct rpc_slab_magazine *	rsl_empty;
+	size_t				rsl_nfull;
+	size_t				rsl_nempty;
+	_Atomic uint64_t		rsl_allocs;
+	_Atomic uint64_t		rsl_hits;
+	_Atomic uint64_t		rsl_frees;
+};
+
+/*
+ * Frame arenas. While a thread has an arena scope open, the objects it
+ * creates are bump-allocated from a chunk of RPC_ARENA_SIZE bytes
+ * instead of the object slab. Every object holds a reference on its
+ * chunk and the scope holds one more, so the chunk is freed in one go
+ * once the scope is closed and the last of its objects is released.
+ * Objects that outlive the rest of their frame keep the chunk alive;
+ * it is never reused while any of them is.
+ */
+#define	RPC_ARENA_SIZE		(32 * 1024)
+#define	RPC_ARENA_MIN_FRAME	1024
+
+struct rpc_arena
+{
+	volatile gint			ra_refcnt;
+	size_t				ra_used;
+	char				ra_data[] __attribute__((aligned(16)));
+};
+
+extern struct rpc_slab rpc_object_slab;
+extern struct rpc_slab rpc_call_slab;
+
+void *rpc_alloc(rpc_alloc_tag_t tag, size_t size);
+void *rpc_alloc0(rpc_alloc_tag_t tag, size_t size);
+void *rpc_realloc(rpc_alloc_tag_t tag, void *ptr, size_t oldsize,
+    size_t size);
+void rpc_free(rpc_alloc_tag_t tag, void *ptr, size_t size);
+void *rpc_slab_alloc(struct rpc_slab *slab);
+void rpc_slab_free(struct rpc_slab *slab, void *ptr);
+void rpc_arena_enter(void);
+void rpc_arena_leave(void);
+void *rpc_arena_alloc(size_t size, struct rpc_arena **arenap);
+void rpc_arena_release(struct rpc_arena *arena);
+
+#endif /* LIBRPC_SLAB_H */
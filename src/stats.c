@@ -0,0 +1,415 @@
+/*
+ * Copyright 2015-2017 Two Pore Guys, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <string.h>
+#include <glib.h>
+#include <rpc/object.h>
+#include <rpc/service.h>
+#include <rpc/trace.h>
+#include "internal.h"
+#include "stats.h"
+
+/*
+ * Latencies are kept in microseconds, in log-linear buckets with three
+ * significant bits: every power of two is split into eight buckets, so
+ * a bucket is never more than 12.5% wide. Values past 2^37 us (about
+ * 38 hours) land in the last bucket.
+ */
+#define	RPC_STATS_SUB_BITS	3
+#define	RPC_STATS_SUB_COUNT	(1 << RPC_STATS_SUB_BITS)
+#define	RPC_STATS_MAX_MAGNITUDE	36
+#define	RPC_STATS_BUCKETS						\
+    ((RPC_STATS_MAX_MAGNITUDE - RPC_STATS_SUB_BITS + 2) * RPC_STATS_SUB_COUNT)
+
+struct rpc_stats_histogram
+{
+	uint64_t		rsh_count;
+	uint64_t		rsh_sum;
+	uint64_t		rsh_max;
+	uint64_t		rsh_buckets[RPC_STATS_BUCKETS];
+};
+
+struct rpc_stats_method
+{
+	char *			rsm_interface;
+	char *			rsm_method;
+	uint64_t		rsm_calls;
+	uint64_t		rsm_errors;
+	struct rpc_stats_histogram rsm_queue;
+	struct rpc_stats_histogram rsm_exec;
+};
+
+struct rpc_stats_stripe
+{
+	GMutex			rss_mtx;
+	GHashTable *		rss_methods;
+};
+
+struct rpc_stats
+{
+	guint			rst_nstripes;
+	struct rpc_stats_stripe *rst_stripes;
+};
+
+static guint rpc_stats_method_hash(gconstpointer);
+static gboolean rpc_stats_method_equal(gconstpointer, gconstpointer);
+static void rpc_stats_method_free(struct rpc_stats_method *);
+static GHashTable *rpc_stats_table_new(void);
+static guint rpc_stats_thread_slot(void);
+static guint rpc_stats_bucket(uint64_t);
+static uint64_t rpc_stats_bucket_value(guint);
+static void rpc_stats_histogram_add(struct rpc_stats_histogram *, gint64);
+static void rpc_stats_histogram_merge(struct rpc_stats_histogram *,
+    const struct rpc_stats_histogram *);
+static uint64_t rpc_stats_histogram_percentile(
+    const struct rpc_stats_histogram *, double);
+static rpc_object_t rpc_stats_histogram_to_object(
+    const struct rpc_stats_histogram *);
+static rpc_object_t rpc_stats_get_methods(void *, rpc_object_t);
+static rpc_object_t rpc_stats_reset_methods(void *, rpc_object_t);
+static rpc_object_t rpc_stats_get_trace(void *, rpc_object_t);
+
+const struct rpc_if_member rpc_stats_vtable[] = {
+	RPC_METHOD(get_methods, rpc_stats_get_methods),
+	RPC_METHOD(reset, rpc_stats_reset_methods),
+	RPC_METHOD(get_trace, rpc_stats_get_trace),
+	RPC_MEMBER_END
+};
+
+static volatile gint rpc_stats_next_slot = 0;
+static GPrivate rpc_stats_slot;
+
+static guint
+rpc_stats_method_hash(gconstpointer key)
+{
+	const struct rpc_stats_method *m = key;
+
+	return (g_str_hash(m->rsm_interface) * 31 + g_str_hash(m->rsm_method));
+}
+
+static gboolean
+rpc_stats_method_equal(gconstpointer a, gconstpointer b)
+{
+	const struct rpc_stats_method *ma = a;
+	const struct rpc_stats_method *mb = b;
+
+	return (strcmp(ma->rsm_method, mb->rsm_method) == 0 &&
+	    strcmp(ma->rsm_interface, mb->rsm_interface) == 0);
+}
+
+static void
+rpc_stats_method_free(struct rpc_stats_method *m)
+{
+
+	g_free(m->rsm_interface);
+	g_free(m->rsm_method);
+	g_free(m);
+}
+
+static GHashTable *
+rpc_stats_table_new(void)
+{
+
+	return (g_hash_table_new_full(rpc_stats_method_hash,
+	    rpc_stats_method_equal, NULL,
+	    (GDestroyNotify)rpc_stats_method_free));
+}
+
+/*
+ * Threads are numbered on first use, so a pool's workers spread evenly
+ * over the stripes.
+ */
+static guint
+rpc_stats_thread_slot(void)
+{
+	gpointer slot;
+
+	slot = g_private_get(&rpc_stats_slot);
+	if (slot == NULL) {
+		slot = GINT_TO_POINTER(
+		    g_atomic_int_add(&rpc_stats_next_slot, 1) + 1);
+		g_private_set(&rpc_stats_slot, slot);
+	}
+
+	return ((guint)GPOINTER_TO_INT(slot) - 1);
+}
+
+static guint
+rpc_stats_bucket(uint64_t value)
+{
+	guint msb;
+
+	value = MIN(value, (2ULL << RPC_STATS_MAX_MAGNITUDE) - 1);
+	if (value < RPC_STATS_SUB_COUNT)
+		return ((guint)value);
+
+	msb = 63 - (guint)__builtin_clzll(value);
+	return ((msb - RPC_STATS_SUB_BITS + 1) * RPC_STATS_SUB_COUNT +
+	    ((value >> (msb - RPC_STATS_SUB_BITS)) & (RPC_STATS_SUB_COUNT - 1)));
+}
+
+/* Smallest value falling into the given bucket */
+static uint64_t
+rpc_stats_bucket_value(guint idx)
+{
+	guint msb;
+
+	if (idx < RPC_STATS_SUB_COUNT)
+		return (idx);
+
+	msb = idx / RPC_STATS_SUB_COUNT + RPC_STATS_SUB_BITS - 1;
+	return ((uint64_t)(RPC_STATS_SUB_COUNT + idx % RPC_STATS_SUB_COUNT) <<
+	    (msb - RPC_STATS_SUB_BITS));
+}
+
+static void
+rpc_stats_histogram_add(struct rpc_stats_histogram *hist, gint64 value)
+{
+	uint64_t v = value > 0 ? (uint64_t)value : 0;
+
+	hist->rsh_count++;
+	hist->rsh_sum += v;
+	hist->rsh_max = MAX(hist->rsh_max, v);
+	hist->rsh_buckets[rpc_stats_bucket(v)]++;
+}
+
+static void
+rpc_stats_histogram_merge(struct rpc_stats_histogram *dst,
+    const struct rpc_stats_histogram *src)
+{
+	guint i;
+
+	dst->rsh_count += src->rsh_count;
+	dst->rsh_sum += src->rsh_sum;
+	dst->rsh_max = MAX(dst->rsh_max, src->rsh_max);
+	for (i = 0; i < RPC_STATS_BUCKETS; i++)
+		dst->rsh_buckets[i] += src->rsh_buckets[i];
+}
+
+/*
+ * Returns the highest value the bucket holding the given percentile
+ * could contain, capped by the largest value actually seen.
+ */
+static uint64_t
+rpc_stats_histogram_percentile(const struct rpc_stats_histogram *hist,
+    double pct)
+{
+	uint64_t target;
+	uint64_t seen = 0;
+	guint i;
+
+	if (hist->rsh_count == 0)
+		return (0);
+
+	target = (uint64_t)(pct / 100 * (double)hist->rsh_count + 0.5);
+	target = CLAMP(target, 1, hist->rsh_count);
+
+	for (i = 0; i < RPC_STATS_BUCKETS; i++) {
+		seen += hist->rsh_buckets[i];
+		if (seen >= target)
+			break;
+	}
+
+	if (i + 1 >= RPC_STATS_BUCKETS)
+		return (hist->rsh_max);
+
+	return (MIN(rpc_stats_bucket_value(i + 1) - 1, hist->rsh_max));
+}
+
+static rpc_object_t
+rpc_stats_histogram_to_object(const struct rpc_stats_histogram *hist)
+{
+
+	return (rpc_object_pack("{u,u,u,u,u,u,u}",
+	    "count", hist->rsh_count,
+	    "mean", hist->rsh_count > 0 ? hist->rsh_sum / hist->rsh_count : 0,
+	    "max", hist->rsh_max,
+	    "p50", rpc_stats_histogram_percentile(hist, 50),
+	    "p90", rpc_stats_histogram_percentile(hist, 90),
+	    "p99", rpc_stats_histogram_percentile(hist, 99),
+	    "p999", rpc_stats_histogram_percentile(hist, 99.9)));
+}
+
+struct rpc_stats *
+rpc_stats_new(void)
+{
+	struct rpc_stats *stats;
+	guint i;
+
+	stats = g_malloc0(sizeof(*stats));
+	stats->rst_nstripes = CLAMP(g_get_num_processors(), 1, 64);
+	stats->rst_stripes = g_malloc0_n(stats->rst_nstripes,
+	    sizeof(struct rpc_stats_stripe));
+
+	for (i = 0; i < stats->rst_nstripes; i++) {
+		g_mutex_init(&stats->rst_stripes[i].rss_mtx);
+		stats->rst_stripes[i].rss_methods = rpc_stats_table_new();
+	}
+
+	return (stats);
+}
+
+void
+rpc_stats_free(struct rpc_stats *stats)
+{
+	guint i;
+
+	if (stats == NULL)
+		return;
+
+	for (i = 0; i < stats->rst_nstripes; i++) {
+		g_hash_table_destroy(stats->rst_stripes[i].rss_methods);
+		g_mutex_clear(&stats->rst_stripes[i].rss_mtx);
+	}
+
+	g_free(stats->rst_stripes);
+	g_free(stats);
+}
+
+/*
+ * Accounts for a finished inbound call. Queueing time runs from its
+ * dispatch to the start of its method, execution time from there until
+ * the call is closed, which covers asynchronous and streaming responses.
+ */
+void
+rpc_stats_record_call(struct rpc_stats *stats, struct rpc_call *call,
+    gint64 now)
+{
+	struct rpc_stats_stripe *stripe;
+	struct rpc_stats_method *m;
+	struct rpc_stats_method key;
+
+	key.rsm_interface = (char *)(call->rc_interface != NULL ?
+	    call->rc_interface : RPC_DEFAULT_INTERFACE);
+	key.rsm_method = (char *)call->rc_method_name;
+	stripe = &stats->rst_stripes[rpc_stats_thread_slot() %
+	    stats->rst_nstripes];
+
+	g_mutex_lock(&stripe->rss_mtx);
+	m = g_hash_table_lookup(stripe->rss_methods, &key);
+	if (m == NULL) {
+		m = g_malloc0(sizeof(*m));
+		m->rsm_interface = g_strdup(key.rsm_interface);
+		m->rsm_method = g_strdup(key.rsm_method);
+		g_hash_table_add(stripe->rss_methods, m);
+	}
+
+	m->rsm_calls++;
+	if (call->rc_failed)
+		m->rsm_errors++;
+
+	if (call->rc_started != 0) {
+		rpc_stats_histogram_add(&m->rsm_queue,
+		    call->rc_started - call->rc_queued);
+		rpc_stats_histogram_add(&m->rsm_exec, now - call->rc_started);
+	}
+	g_mutex_unlock(&stripe->rss_mtx);
+}
+
+rpc_object_t
+rpc_stats_get(struct rpc_stats *stats)
+{
+	GHashTable *merged;
+	GHashTableIter iter;
+	struct rpc_stats_method *m;
+	struct rpc_stats_method *dst;
+	rpc_object_t result;
+	guint i;
+
+	merged = rpc_stats_table_new();
+
+	for (i = 0; i < stats->rst_nstripes; i++) {
+		g_mutex_lock(&stats->rst_stripes[i].rss_mtx);
+		g_hash_table_iter_init(&iter, stats->rst_stripes[i].rss_methods);
+		while (g_hash_table_iter_next(&iter, (gpointer *)&m, NULL)) {
+			dst = g_hash_table_lookup(merged, m);
+			if (dst == NULL) {
+				dst = g_malloc0(sizeof(*dst));
+				dst->rsm_interface = g_strdup(m->rsm_interface);
+				dst->rsm_method = g_strdup(m->rsm_method);
+				g_hash_table_add(merged, dst);
+			}
+
+			dst->rsm_calls += m->rsm_calls;
+			dst->rsm_errors += m->rsm_errors;
+			rpc_stats_histogram_merge(&dst->rsm_queue,
+			    &m->rsm_queue);
+			rpc_stats_histogram_merge(&dst->rsm_exec, &m->rsm_exec);
+		}
+		g_mutex_unlock(&stats->rst_stripes[i].rss_mtx);
+	}
+
+	result = rpc_array_create();
+	g_hash_table_iter_init(&iter, merged);
+	while (g_hash_table_iter_next(&iter, (gpointer *)&m, NULL)) {
+		rpc_array_append_stolen_value(result, rpc_object_pack(
+		    "{s,s,u,u,v,v}",
+		    "interface", m->rsm_interface,
+		    "method", m->rsm_method,
+		    "calls", m->rsm_calls,
+		    "errors", m->rsm_errors,
+		    "queue_usec", rpc_stats_histogram_to_object(&m->rsm_queue),
+		    "exec_usec", rpc_stats_histogram_to_object(&m->rsm_exec)));
+	}
+
+	g_hash_table_destroy(merged);
+	return (result);
+}
+
+void
+rpc_stats_reset(struct rpc_stats *stats)
+{
+	guint i;
+
+	for (i = 0; i < stats->rst_nstripes; i++) {
+		g_mutex_lock(&stats->rst_stripes[i].rss_mtx);
+		g_hash_table_remove_all(stats->rst_stripes[i].rss_methods);
+		g_mutex_unlock(&stats->rst_stripes[i].rss_mtx);
+	}
+}
+
+static rpc_object_t
+rpc_stats_get_methods(void *cookie, rpc_object_t args __unused)
+{
+
+	return (rpc_stats_get(rpc_function_get_context(cookie)->rcx_stats));
+}
+
+static rpc_object_t
+rpc_stats_reset_methods(void *cookie, rpc_object_t args __unused)
+{
+
+	rpc_stats_reset(rpc_function_get_context(cookie)->rcx_stats);
+	return (NULL);
+}
+
+static rpc_object_t
+rpc_stats_get_trace(void *cookie __unused, rpc_object_t args __unused)
+{
+
+	return (rpc_trace_dump());
+}
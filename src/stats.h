@@ -0,0 +1,51 @@
+/*
+ * Copyright 2015-2017 Two Pore Guys, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef LIBRPC_STATS_H
+#define LIBRPC_STATS_H
+
+#include <glib.h>
+#include <rpc/object.h>
+#include <rpc/service.h>
+
+/*
+ * Per-method call statistics of a context. Recording only takes the
+ * lock of the calling thread's stripe, readers merge all the stripes.
+ */
+struct rpc_stats;
+struct rpc_call;
+
+extern const struct rpc_if_member rpc_stats_vtable[];
+
+struct rpc_stats *rpc_stats_new(void);
+void rpc_stats_free(struct rpc_stats *stats);
+void rpc_stats_record_call(struct rpc_stats *stats, struct rpc_call *call,
+    gint64 now);
+rpc_object_t rpc_stats_get(struct rpc_stats *stats);
+void rpc_stats_reset(struct rpc_stats *stats);
+
+#endif /* LIBRPC_STATS_H */
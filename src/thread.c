@@ -0,0 +1,465 @@
+/*
+ * Copyright 2015-2017 Two Pore Guys, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <Block.h>
+#include <glib.h>
+#include <rpc/object.h>
+#include <rpc/thread.h>
+#include "internal.h"
+#include "thread.h"
+
+#define	RPC_THREAD_NAME_MAX	16
+#define	RPC_SPIN_PERIOD		100000
+#define	RPC_SPIN_BUDGET		10
+#define	RPC_SPIN_MISSES		8
+#define	RPC_SPIN_PROBE		16
+#if defined(__linux__)
+#define	RPC_THREAD_MAX_CPUS	CPU_SETSIZE
+#else
+#define	RPC_THREAD_MAX_CPUS	1024
+#endif
+
+struct rpc_thread_start
+{
+	rpc_thread_role_t	rts_role;
+	char *			rts_name;
+	GThreadFunc		rts_fn;
+	gpointer		rts_data;
+};
+
+/*
+ * Spin time is accounted per site over fixed windows. rss_misses counts
+ * the spins in a row that ended without the condition coming true.
+ */
+struct rpc_spin_site_state
+{
+	_Atomic guint		rss_usec;
+	_Atomic guint		rss_budget;
+	_Atomic gint64		rss_window;
+	_Atomic gint64		rss_spent;
+	_Atomic guint		rss_misses;
+	_Atomic guint		rss_skipped;
+	_Atomic guint		rss_spinning;
+};
+
+struct rpc_lock_site_state
+{
+	_Atomic uint64_t	rlss_acquisitions;
+	_Atomic uint64_t	rlss_contended;
+	_Atomic uint64_t	rlss_wait_time;
+};
+
+static gpointer rpc_thread_start(gpointer);
+static bool rpc_thread_parse_policy(const char *, int *);
+static void rpc_thread_apply(rpc_object_t, const char *);
+static inline void rpc_cpu_relax(void);
+
+static GMutex rpc_thread_mtx;
+static rpc_object_t rpc_thread_attrs[RPC_THREAD_NROLES];
+static rpc_thread_hook_t rpc_thread_hook;
+static GPrivate rpc_thread_entered;
+static struct rpc_spin_site_state rpc_spin_sites[RPC_SPIN_NSITES];
+static _Atomic guint rpc_spin_ncpus;
+static struct rpc_lock_site_state rpc_lock_sites[RPC_LOCK_NSITES];
+volatile gint rpc_lock_stats_on;
+
+static bool
+rpc_thread_parse_policy(const char *name, int *policy)
+{
+
+	if (g_strcmp0(name, "other") == 0)
+		*policy = SCHED_OTHER;
+	else if (g_strcmp0(name, "fifo") == 0)
+		*policy = SCHED_FIFO;
+	else if (g_strcmp0(name, "rr") == 0)
+		*policy = SCHED_RR;
+#if defined(__linux__)
+	else if (g_strcmp0(name, "batch") == 0)
+		*policy = SCHED_BATCH;
+	else if (g_strcmp0(name, "idle") == 0)
+		*policy = SCHED_IDLE;
+#endif
+	else
+		return (false);
+
+	return (true);
+}
+
+static void
+rpc_thread_apply(rpc_object_t attrs, const char *name)
+{
+	struct sched_param param = { 0 };
+	rpc_object_t value;
+	char buf[RPC_THREAD_NAME_MAX];
+	int policy;
+
+	value = rpc_dictionary_get_value(attrs, RPC_THREAD_NAME);
+	if (value != NULL)
+		name = rpc_string_get_string_ptr(value);
+
+	g_strlcpy(buf, name, sizeof(buf));
+#if defined(__APPLE__)
+	pthread_setname_np(buf);
+#else
+	pthread_setname_np(pthread_self(), buf);
+#endif
+
+#if defined(__linux__)
+	value = rpc_dictionary_get_value(attrs, RPC_THREAD_CPUS);
+	if (value != NULL) {
+		__block cpu_set_t set;
+
+		CPU_ZERO(&set);
+		rpc_array_apply(value, ^(size_t idx __unused, rpc_object_t v) {
+			CPU_SET((int)rpc_int64_get_value(v), &set);
+			return ((bool)true);
+		});
+
+		pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	}
+#endif
+
+	value = rpc_dictionary_get_value(attrs, RPC_THREAD_POLICY);
+	if (value != NULL &&
+	    rpc_thread_parse_policy(rpc_string_get_string_ptr(value), &policy)) {
+		param.sched_priority = (int)rpc_dictionary_get_int64(attrs,
+		    RPC_THREAD_PRIORITY);
+		pthread_setschedparam(pthread_self(), policy, &param);
+	}
+}
+
+static gpointer
+rpc_thread_start(gpointer arg)
+{
+	struct rpc_thread_start *start = arg;
+	GThreadFunc fn = start->rts_fn;
+	gpointer data = start->rts_data;
+
+	rpc_thread_enter(start->rts_role, start->rts_name);
+	g_free(start->rts_name);
+	g_free(start);
+	return (fn(data));
+}
+
+GThread *
+rpc_thread_new(rpc_thread_role_t role, const char *name, GThreadFunc fn,
+    gpointer data)
+{
+	struct rpc_thread_start *start;
+
+	start = g_malloc(sizeof(*start));
+	start->rts_role = role;
+	start->rts_name = g_strdup(name);
+	start->rts_fn = fn;
+	start->rts_data = data;
+	return (g_thread_new(name, rpc_thread_start, start));
+}
+
+void
+rpc_thread_enter(rpc_thread_role_t role, const char *name)
+{
+	rpc_thread_hook_t hook;
+	rpc_object_t attrs;
+
+	if (g_private_get(&rpc_thread_entered) != NULL)
+		return;
+
+	g_private_set(&rpc_thread_entered, GINT_TO_POINTER(1));
+	g_mutex_lock(&rpc_thread_mtx);
+	attrs = rpc_thread_attrs[role] ? rpc_retain(rpc_thread_attrs[role]) :
+	    NULL;
+	hook = rpc_thread_hook ? Block_copy(rpc_thread_hook) : NULL;
+	g_mutex_unlock(&rpc_thread_mtx);
+
+	if (attrs != NULL) {
+		rpc_thread_apply(attrs, name);
+		rpc_release(attrs);
+	}
+
+	if (hook != NULL) {
+		hook(role, name);
+		Block_release(hook);
+	}
+}
+
+int
+rpc_thread_set_attributes(rpc_thread_role_t role, rpc_object_t attrs)
+{
+	__block bool valid = true;
+	rpc_object_t value;
+	int policy;
+
+	if (role >= RPC_THREAD_NROLES) {
+		rpc_set_last_errorf(EINVAL, "Invalid thread role");
+		return (-1);
+	}
+
+	if (attrs != NULL) {
+		if (rpc_get_type(attrs) != RPC_TYPE_DICTIONARY) {
+			rpc_set_last_errorf(EINVAL,
+			    "Thread attributes must be a dictionary");
+			return (-1);
+		}
+
+		value = rpc_dictionary_get_value(attrs, RPC_THREAD_CPUS);
+		if (value != NULL && rpc_get_type(value) != RPC_TYPE_ARRAY)
+			valid = false;
+
+		if (value != NULL && valid) {
+			rpc_array_apply(value, ^(size_t idx __unused,
+			    rpc_object_t v) {
+				if (rpc_get_type(v) != RPC_TYPE_INT64 ||
+				    rpc_int64_get_value(v) < 0 ||
+				    rpc_int64_get_value(v) >= RPC_THREAD_MAX_CPUS) {
+					valid = false;
+					return ((bool)false);
+				}
+
+				return ((bool)true);
+			});
+		}
+
+		value = rpc_dictionary_get_value(attrs, RPC_THREAD_POLICY);
+		if (value != NULL && (rpc_get_type(value) != RPC_TYPE_STRING ||
+		    !rpc_thread_parse_policy(rpc_string_get_string_ptr(value),
+		    &policy)))
+			valid = false;
+
+		value = rpc_dictionary_get_value(attrs, RPC_THREAD_PRIORITY);
+		if (value != NULL && rpc_get_type(value) != RPC_TYPE_INT64)
+			valid = false;
+
+		value = rpc_dictionary_get_value(attrs, RPC_THREAD_NAME);
+		if (value != NULL && rpc_get_type(value) != RPC_TYPE_STRING)
+			valid = false;
+
+		if (!valid) {
+			rpc_set_last_errorf(EINVAL, "Invalid thread attributes");
+			return (-1);
+		}
+	}
+
+	g_mutex_lock(&rpc_thread_mtx);
+	if (rpc_thread_attrs[role] != NULL)
+		rpc_release(rpc_thread_attrs[role]);
+
+	rpc_thread_attrs[role] = attrs != NULL ? rpc_copy(attrs) : NULL;
+	g_mutex_unlock(&rpc_thread_mtx);
+	return (0);
+}
+
+void
+rpc_thread_set_hook(rpc_thread_hook_t hook)
+{
+
+	g_mutex_lock(&rpc_thread_mtx);
+	if (rpc_thread_hook != NULL)
+		Block_release(rpc_thread_hook);
+
+	rpc_thread_hook = hook != NULL ? Block_copy(hook) : NULL;
+	g_mutex_unlock(&rpc_thread_mtx);
+}
+
+int
+rpc_thread_set_spin(rpc_spin_site_t site, unsigned int usec,
+    unsigned int budget)
+{
+	struct rpc_spin_site_state *state;
+
+	if (site >= RPC_SPIN_NSITES) {
+		rpc_set_last_errorf(EINVAL, "Invalid spin site");
+		return (-1);
+	}
+
+	state = &rpc_spin_sites[site];
+	atomic_store(&rpc_spin_ncpus, g_get_num_processors());
+	atomic_store(&state->rss_budget, budget > 0 ? budget : RPC_SPIN_BUDGET);
+	atomic_store(&state->rss_misses, 0);
+	atomic_store(&state->rss_usec, usec);
+	return (0);
+}
+
+static inline void
+rpc_cpu_relax(void)
+{
+
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
+bool
+rpc_spin_enabled(rpc_spin_site_t site)
+{
+
+	return (atomic_load_explicit(&rpc_spin_sites[site].rss_usec,
+	    memory_order_relaxed) != 0);
+}
+
+bool
+rpc_spin_begin(struct rpc_spin *spin, rpc_spin_site_t site)
+{
+	struct rpc_spin_site_state *state = &rpc_spin_sites[site];
+	gint64 now;
+	gint64 window;
+	guint usec;
+
+	usec = atomic_load_explicit(&state->rss_usec, memory_order_relaxed);
+	if (usec == 0)
+		return (false);
+
+	/* Spinning doesn't pay off here lately, only probe once in a while */
+	if (atomic_load(&state->rss_misses) >= RPC_SPIN_MISSES &&
+	    atomic_fetch_add(&state->rss_skipped, 1) % RPC_SPIN_PROBE != 0)
+		return (false);
+
+	now = g_get_monotonic_time();
+	window = atomic_load(&state->rss_window);
+	if (now - window >= RPC_SPIN_PERIOD &&
+	    atomic_compare_exchange_strong(&state->rss_window, &window, now))
+		atomic_store(&state->rss_spent, 0);
+
+	if (atomic_load(&state->rss_spent) >= (gint64)RPC_SPIN_PERIOD *
+	    atomic_load(&state->rss_budget) / 100)
+		return (false);
+
+	/* Leave a CPU to whoever is going to wake us up */
+	if (atomic_fetch_add(&state->rss_spinning, 1) + 1 >=
+	    atomic_load(&rpc_spin_ncpus)) {
+		atomic_fetch_sub(&state->rss_spinning, 1);
+		return (false);
+	}
+
+	spin->rs_site = site;
+	spin->rs_start = now;
+	spin->rs_deadline = now + usec;
+	return (true);
+}
+
+bool
+rpc_spin_next(struct rpc_spin *spin)
+{
+
+	rpc_cpu_relax();
+	return (g_get_monotonic_time() < spin->rs_deadline);
+}
+
+void
+rpc_spin_end(struct rpc_spin *spin, bool hit)
+{
+	struct rpc_spin_site_state *state = &rpc_spin_sites[spin->rs_site];
+
+	atomic_fetch_add(&state->rss_spent,
+	    g_get_monotonic_time() - spin->rs_start);
+	atomic_fetch_sub(&state->rss_spinning, 1);
+
+	if (hit)
+		atomic_store(&state->rss_misses, 0);
+	else if (atomic_load(&state->rss_misses) < RPC_SPIN_MISSES)
+		atomic_fetch_add(&state->rss_misses, 1);
+}
+
+bool
+rpc_spin_wait(rpc_spin_site_t site, volatile gint *word, gint value)
+{
+	struct rpc_spin spin;
+	bool hit = false;
+
+	if (!rpc_spin_begin(&spin, site))
+		return (false);
+
+	do {
+		if (g_atomic_int_get(word) != value) {
+			hit = true;
+			break;
+		}
+	} while (rpc_spin_next(&spin));
+
+	rpc_spin_end(&spin, hit);
+	return (hit);
+}
+
+void
+rpc_lock_account(rpc_lock_site_t site, gint64 wait, bool contended)
+{
+	struct rpc_lock_site_state *state = &rpc_lock_sites[site];
+
+	atomic_fetch_add_explicit(&state->rlss_acquisitions, 1,
+	    memory_order_relaxed);
+
+	if (!contended)
+		return;
+
+	atomic_fetch_add_explicit(&state->rlss_contended, 1,
+	    memory_order_relaxed);
+	atomic_fetch_add_explicit(&state->rlss_wait_time, (uint64_t)wait,
+	    memory_order_relaxed);
+}
+
+void
+rpc_lock_stats_enable(bool enable)
+{
+
+	g_atomic_int_set(&rpc_lock_stats_on, enable);
+}
+
+int
+rpc_get_lock_stats(rpc_lock_site_t site, struct rpc_lock_stats *stats)
+{
+	struct rpc_lock_site_state *state;
+
+	if (site >= RPC_LOCK_NSITES) {
+		rpc_set_last_errorf(EINVAL, "Invalid lock site");
+		return (-1);
+	}
+
+	state = &rpc_lock_sites[site];
+	stats->rls_acquisitions = atomic_load(&state->rlss_acquisitions);
+	stats->rls_contended = atomic_load(&state->rlss_contended);
+	stats->rls_wait_time = atomic_load(&state->rlss_wait_time);
+	return (0);
+}
+
+void
+rpc_reset_lock_stats(void)
+{
+	guint i;
+
+	for (i = 0; i < RPC_LOCK_NSITES; i++) {
+		atomic_store(&rpc_lock_sites[i].rlss_acquisitions, 0);
+		atomic_store(&rpc_lock_sites[i].rlss_contended, 0);
+		atomic_store(&rpc_lock_sites[i].rlss_wait_time, 0);
+	}
+}
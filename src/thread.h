@@ -0,0 +1,137 @@
+/*
+ * Copyright 2015-2017 Two Pore Guys, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef LIBRPC_THREAD_INTERNAL_H
+#define LIBRPC_THREAD_INTERNAL_H
+
+#include <stdbool.h>
+#include <glib.h>
+#include <rpc/thread.h>
+
+/*
+ * Every thread the library starts goes through rpc_thread_new(), which
+ * applies the attributes configured for its role and runs the start
+ * hook before the thread function. Pool threads that GLib starts on
+ * our behalf call rpc_thread_enter() from their work function instead;
+ * it only does anything the first time on a given thread. GLib may
+ * hand an idle pool thread to another pool, in which case it keeps
+ * the attributes of the role it first ran for.
+ */
+GThread *rpc_thread_new(rpc_thread_role_t role, const char *name,
+    GThreadFunc fn, gpointer data);
+void rpc_thread_enter(rpc_thread_role_t role, const char *name);
+
+/*
+ * Spin-then-block support for the sites of rpc_thread_set_spin(). A
+ * waiter that rpc_spin_begin() lets spin polls its condition between
+ * calls to rpc_spin_next(), which returns false once the spin time is
+ * up, and reports whether the condition came true to rpc_spin_end().
+ * rpc_spin_wait() does all of that for a counter bumped by the waker.
+ */
+struct rpc_spin
+{
+	rpc_spin_site_t		rs_site;
+	gint64			rs_start;
+	gint64			rs_deadline;
+};
+
+bool rpc_spin_enabled(rpc_spin_site_t site);
+bool rpc_spin_begin(struct rpc_spin *spin, rpc_spin_site_t site);
+bool rpc_spin_next(struct rpc_spin *spin);
+void rpc_spin_end(struct rpc_spin *spin, bool hit);
+bool rpc_spin_wait(rpc_spin_site_t site, volatile gint *word, gint value);
+
+/*
+ * Lock wrappers for the sites of rpc_get_lock_stats(). With accounting
+ * off they only cost a load of rpc_lock_stats_on; with it on, a lock
+ * that can't be taken right away is timed while blocking on it.
+ */
+extern volatile gint rpc_lock_stats_on;
+
+void rpc_lock_account(rpc_lock_site_t site, gint64 wait, bool contended);
+
+static inline void
+rpc_mutex_lock(GMutex *mtx, rpc_lock_site_t site)
+{
+	gint64 start;
+
+	if (G_LIKELY(!g_atomic_int_get(&rpc_lock_stats_on))) {
+		g_mutex_lock(mtx);
+		return;
+	}
+
+	if (g_mutex_trylock(mtx)) {
+		rpc_lock_account(site, 0, false);
+		return;
+	}
+
+	start = g_get_monotonic_time();
+	g_mutex_lock(mtx);
+	rpc_lock_account(site, g_get_monotonic_time() - start, true);
+}
+
+static inline void
+rpc_rw_lock_reader_lock(GRWLock *lock, rpc_lock_site_t site)
+{
+	gint64 start;
+
+	if (G_LIKELY(!g_atomic_int_get(&rpc_lock_stats_on))) {
+		g_rw_lock_reader_lock(lock);
+		return;
+	}
+
+	if (g_rw_lock_reader_trylock(lock)) {
+		rpc_lock_account(site, 0, false);
+		return;
+	}
+
+	start = g_get_monotonic_time();
+	g_rw_lock_reader_lock(lock);
+	rpc_lock_account(site, g_get_monotonic_time() - start, true);
+}
+
+static inline void
+rpc_rw_lock_writer_lock(GRWLock *lock, rpc_lock_site_t site)
+{
+	gint64 start;
+
+	if (G_LIKELY(!g_atomic_int_get(&rpc_lock_stats_on))) {
+		g_rw_lock_writer_lock(lock);
+		return;
+	}
+
+	if (g_rw_lock_writer_trylock(lock)) {
+		rpc_lock_account(site, 0, false);
+		return;
+	}
+
+	start = g_get_monotonic_time();
+	g_rw_lock_writer_lock(lock);
+	rpc_lock_account(site, g_get_monotonic_time() - start, true);
+}
+
+#endif /* LIBRPC_THREAD_INTERNAL_H */
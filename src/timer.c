@@ -0,0 +1,314 @@
+/*
+ * Copyright 2015-2017 Two Pore Guys, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdbool.h>
+#include <glib.h>
+#include "thread.h"
+#include "timer.h"
+
+#define	RPC_TIMER_WHEEL_MASK	(RPC_TIMER_WHEEL_SLOTS - 1)
+#define	RPC_TIMER_WHEEL_SPAN	\
+	((gint64)1 << (RPC_TIMER_WHEEL_BITS * RPC_TIMER_WHEEL_LEVELS))
+
+struct rpc_timer_wheel
+{
+	GMutex			rtw_mtx;
+	GCond			rtw_cv;
+	GThread *		rtw_thread;
+	gint64			rtw_base;
+	gint64			rtw_now;
+	gint64			rtw_wakeup;
+	guint			rtw_count;
+	bool			rtw_stop;
+	GQueue			rtw_slots[RPC_TIMER_WHEEL_LEVELS]
+				    [RPC_TIMER_WHEEL_SLOTS];
+};
+
+static gint64 rpc_timer_wheel_ticks(struct rpc_timer_wheel *);
+static void rpc_timer_wheel_insert(struct rpc_timer_wheel *,
+    struct rpc_timer *);
+static void rpc_timer_wheel_cascade(struct rpc_timer_wheel *, GQueue *);
+static void rpc_timer_wheel_advance(struct rpc_timer_wheel *, gint64,
+    GQueue *);
+static gint64 rpc_timer_wheel_next(struct rpc_timer_wheel *);
+static gpointer rpc_timer_wheel_worker(gpointer);
+
+static gint64
+rpc_timer_wheel_ticks(struct rpc_timer_wheel *wheel)
+{
+
+	return ((g_get_monotonic_time() - wheel->rtw_base) / 1000);
+}
+
+/*
+ * Puts a timer into the finest level that covers its distance from
+ * the current tick. Called with the wheel mutex held.
+ */
+static void
+rpc_timer_wheel_insert(struct rpc_timer_wheel *wheel, struct rpc_timer *timer)
+{
+	gint64 delta;
+	guint level;
+	guint slot;
+
+	delta = timer->rt_expires - wheel->rtw_now;
+	if (delta < 1) {
+		timer->rt_expires = wheel->rtw_now + 1;
+		delta = 1;
+	}
+
+	if (delta >= RPC_TIMER_WHEEL_SPAN) {
+		timer->rt_expires = wheel->rtw_now + RPC_TIMER_WHEEL_SPAN - 1;
+		delta = RPC_TIMER_WHEEL_SPAN - 1;
+	}
+
+	for (level = 0; level < RPC_TIMER_WHEEL_LEVELS - 1; level++) {
+		if (delta < ((gint64)1 << (RPC_TIMER_WHEEL_BITS * (level + 1))))
+			break;
+	}
+
+	slot = (guint)(timer->rt_expires >> (RPC_TIMER_WHEEL_BITS * level)) &
+	    RPC_TIMER_WHEEL_MASK;
+	timer->rt_slot = &wheel->rtw_slots[level][slot];
+	g_queue_push_tail_link(timer->rt_slot, &timer->rt_link);
+}
+
+static void
+rpc_timer_wheel_cascade(struct rpc_timer_wheel *wheel, GQueue *slot)
+{
+	GList *link;
+
+	while ((link = g_queue_pop_head_link(slot)) != NULL)
+		rpc_timer_wheel_insert(wheel, link->data);
+}
+
+/*
+ * Moves the wheel up to @p target, collecting expired timers into
+ * @p expired. Called with the wheel mutex held.
+ */
+static void
+rpc_timer_wheel_advance(struct rpc_timer_wheel *wheel, gint64 target,
+    GQueue *expired)
+{
+	struct rpc_timer *timer;
+	GQueue *slot;
+	GList *link;
+	guint level;
+	guint idx;
+
+	while (wheel->rtw_now < target) {
+		if (wheel->rtw_count == 0) {
+			wheel->rtw_now = target;
+			break;
+		}
+
+		wheel->rtw_now++;
+
+		/* Refill the finer levels once they wrap around */
+		idx = (guint)wheel->rtw_now & RPC_TIMER_WHEEL_MASK;
+		for (level = 1; idx == 0 && level < RPC_TIMER_WHEEL_LEVELS;
+		    level++) {
+			idx = (guint)(wheel->rtw_now >>
+			    (RPC_TIMER_WHEEL_BITS * level)) &
+			    RPC_TIMER_WHEEL_MASK;
+			rpc_timer_wheel_cascade(wheel,
+			    &wheel->rtw_slots[level][idx]);
+		}
+
+		slot = &wheel->rtw_slots[0][wheel->rtw_now &
+		    RPC_TIMER_WHEEL_MASK];
+		while ((link = g_queue_pop_head_link(slot)) != NULL) {
+			timer = link->data;
+			timer->rt_slot = NULL;
+			timer->rt_state = RPC_TIMER_FIRED;
+			wheel->rtw_count--;
+			g_queue_push_tail_link(expired, link);
+		}
+	}
+}
+
+/*
+ * Returns the tick the worker has to wake up at: the nearest occupied
+ * slot of the finest level, or the next cascade if there is none.
+ */
+static gint64
+rpc_timer_wheel_next(struct rpc_timer_wheel *wheel)
+{
+	gint64 tick;
+
+	if (wheel->rtw_count == 0)
+		return (G_MAXINT64);
+
+	for (tick = wheel->rtw_now + 1;; tick++) {
+		if ((tick & RPC_TIMER_WHEEL_MASK) == 0)
+			return (tick);
+
+		if (!g_queue_is_empty(
+		    &wheel->rtw_slots[0][tick & RPC_TIMER_WHEEL_MASK]))
+			return (tick);
+	}
+}
+
+static gpointer
+rpc_timer_wheel_worker(gpointer arg)
+{
+	struct rpc_timer_wheel *wheel = arg;
+	struct rpc_timer *timer;
+	GQueue expired = G_QUEUE_INIT;
+	GList *link;
+	gint64 next;
+
+	g_mutex_lock(&wheel->rtw_mtx);
+	while (!wheel->rtw_stop) {
+		rpc_timer_wheel_advance(wheel, rpc_timer_wheel_ticks(wheel),
+		    &expired);
+
+		if (!g_queue_is_empty(&expired)) {
+			wheel->rtw_wakeup = 0;
+			g_mutex_unlock(&wheel->rtw_mtx);
+
+			/* The timer belongs to its function from now on */
+			while ((link = g_queue_pop_head_link(&expired)) != NULL) {
+				timer = link->data;
+				timer->rt_fn(timer->rt_arg);
+			}
+
+			g_mutex_lock(&wheel->rtw_mtx);
+			continue;
+		}
+
+		next = rpc_timer_wheel_next(wheel);
+		wheel->rtw_wakeup = next;
+		if (next == G_MAXINT64)
+			g_cond_wait(&wheel->rtw_cv, &wheel->rtw_mtx);
+		else
+			g_cond_wait_until(&wheel->rtw_cv, &wheel->rtw_mtx,
+			    wheel->rtw_base + next * 1000);
+
+		wheel->rtw_wakeup = 0;
+	}
+
+	g_mutex_unlock(&wheel->rtw_mtx);
+	return (NULL);
+}
+
+struct rpc_timer_wheel *
+rpc_timer_wheel_new(const char *name)
+{
+	struct rpc_timer_wheel *wheel;
+	guint i, j;
+
+	wheel = g_malloc0(sizeof(*wheel));
+	g_mutex_init(&wheel->rtw_mtx);
+	g_cond_init(&wheel->rtw_cv);
+	wheel->rtw_base = g_get_monotonic_time();
+
+	for (i = 0; i < RPC_TIMER_WHEEL_LEVELS; i++) {
+		for (j = 0; j < RPC_TIMER_WHEEL_SLOTS; j++)
+			g_queue_init(&wheel->rtw_slots[i][j]);
+	}
+
+	wheel->rtw_thread = rpc_thread_new(RPC_THREAD_TIMER, name,
+	    rpc_timer_wheel_worker, wheel);
+	return (wheel);
+}
+
+void
+rpc_timer_wheel_free(struct rpc_timer_wheel *wheel)
+{
+
+	g_mutex_lock(&wheel->rtw_mtx);
+	wheel->rtw_stop = true;
+	g_cond_signal(&wheel->rtw_cv);
+	g_mutex_unlock(&wheel->rtw_mtx);
+
+	g_thread_join(wheel->rtw_thread);
+	g_mutex_clear(&wheel->rtw_mtx);
+	g_cond_clear(&wheel->rtw_cv);
+	g_free(wheel);
+}
+
+void
+rpc_timer_arm(struct rpc_timer_wheel *wheel, struct rpc_timer *timer,
+    uint64_t msecs, rpc_timer_fn_t fn, void *arg)
+{
+
+	g_assert(timer->rt_state != RPC_TIMER_PENDING);
+
+	timer->rt_fn = fn;
+	timer->rt_arg = arg;
+	timer->rt_link.data = timer;
+	timer->rt_link.prev = NULL;
+	timer->rt_link.next = NULL;
+
+	g_mutex_lock(&wheel->rtw_mtx);
+	timer->rt_state = RPC_TIMER_PENDING;
+
+	/* An empty wheel may have skipped ahead lazily, catch up first */
+	if (wheel->rtw_count == 0)
+		wheel->rtw_now = MAX(wheel->rtw_now,
+		    rpc_timer_wheel_ticks(wheel));
+
+	timer->rt_expires = rpc_timer_wheel_ticks(wheel) +
+	    (gint64)MIN(msecs, (uint64_t)RPC_TIMER_WHEEL_SPAN);
+	rpc_timer_wheel_insert(wheel, timer);
+	wheel->rtw_count++;
+
+	/* Wake the worker up if it sleeps past the new deadline */
+	if (timer->rt_expires < wheel->rtw_wakeup)
+		g_cond_signal(&wheel->rtw_cv);
+
+	g_mutex_unlock(&wheel->rtw_mtx);
+}
+
+int
+rpc_timer_cancel(struct rpc_timer_wheel *wheel, struct rpc_timer *timer)
+{
+	int ret;
+
+	g_mutex_lock(&wheel->rtw_mtx);
+	switch (timer->rt_state) {
+	case RPC_TIMER_PENDING:
+		g_queue_unlink(timer->rt_slot, &timer->rt_link);
+		timer->rt_slot = NULL;
+		timer->rt_state = RPC_TIMER_IDLE;
+		wheel->rtw_count--;
+		ret = 1;
+		break;
+
+	case RPC_TIMER_FIRED:
+		ret = -1;
+		break;
+
+	default:
+		ret = 0;
+		break;
+	}
+
+	g_mutex_unlock(&wheel->rtw_mtx);
+	return (ret);
+}
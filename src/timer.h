@@ -0,0 +1,79 @@
+/*
+ * Copyright 2015-2017 Two Pore Guys, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef LIBRPC_TIMER_H
+#define LIBRPC_TIMER_H
+
+#include <stdint.h>
+#include <glib.h>
+
+/*
+ * Hierarchical timer wheel with millisecond ticks. Arming and
+ * cancelling a timer are O(1); timers further away than one wheel
+ * rotation sit in coarser levels and cascade down as time advances.
+ *
+ * A single thread per wheel sleeps until the nearest occupied slot and
+ * runs expired timer functions with no wheel lock held.
+ */
+#define	RPC_TIMER_WHEEL_BITS	8
+#define	RPC_TIMER_WHEEL_SLOTS	(1 << RPC_TIMER_WHEEL_BITS)
+#define	RPC_TIMER_WHEEL_LEVELS	4
+
+typedef void (*rpc_timer_fn_t)(void *arg);
+
+enum rpc_timer_state
+{
+	RPC_TIMER_IDLE = 0,
+	RPC_TIMER_PENDING,
+	RPC_TIMER_FIRED
+};
+
+struct rpc_timer
+{
+	GList			rt_link;
+	GQueue *		rt_slot;
+	gint64			rt_expires;
+	enum rpc_timer_state	rt_state;
+	rpc_timer_fn_t		rt_fn;
+	void *			rt_arg;
+};
+
+struct rpc_timer_wheel;
+
+/*
+ * rpc_timer_cancel() returns 1 if it disarmed a pending timer, 0 if the
+ * timer was not armed and -1 if it already expired, in which case its
+ * function runs or has run.
+ */
+
+struct rpc_timer_wheel *rpc_timer_wheel_new(const char *name);
+void rpc_timer_wheel_free(struct rpc_timer_wheel *wheel);
+void rpc_timer_arm(struct rpc_timer_wheel *wheel, struct rpc_timer *timer,
+    uint64_t msecs, rpc_timer_fn_t fn, void *arg);
+int rpc_timer_cancel(struct rpc_timer_wheel *wheel, struct rpc_timer *timer);
+
+#endif /* LIBRPC_TIMER_H */
@@ -0,0 +1,631 @@
+/*
+ * Copyright 2015-2017 Two Pore Guys, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <Block.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <glib.h>
+#include <rpc/object.h>
+#include <rpc/trace.h>
+#include "internal.h"
+
+#define	RPC_TRACE_MAX_RECORDS	(1u << 24)
+#define	RPC_TRACE_FLAG_SAMPLED	0x01
+
+struct rpc_trace_ring
+{
+	struct rpc_trace_ring *	rtb_next;
+	_Atomic uint64_t	rtb_head;
+	uint64_t		rtb_mask;
+	uint16_t		rtb_thread;
+	bool			rtb_owned;
+	struct rpc_trace_record	rtb_records[];
+};
+
+struct rpc_trace_thread
+{
+	struct rpc_trace_context rtl_ctx;
+	bool			rtl_formatted;
+	char			rtl_buf[RPC_TRACEPARENT_SIZE];
+};
+
+static const char *rpc_trace_frame_names[] = {
+	[RPC_TRACE_FRAME_UNKNOWN] = "unknown",
+	[RPC_TRACE_FRAME_CALL] = "rpc.call",
+	[RPC_TRACE_FRAME_CALL_BATCH] = "rpc.call_batch",
+	[RPC_TRACE_FRAME_RESPONSE] = "rpc.response",
+	[RPC_TRACE_FRAME_START_STREAM] = "rpc.start_stream",
+	[RPC_TRACE_FRAME_FRAGMENT] = "rpc.fragment",
+	[RPC_TRACE_FRAME_CONTINUE] = "rpc.continue",
+	[RPC_TRACE_FRAME_END] = "rpc.end",
+	[RPC_TRACE_FRAME_ABORT] = "rpc.abort",
+	[RPC_TRACE_FRAME_ERROR] = "rpc.error",
+	[RPC_TRACE_FRAME_EVENT] = "events.event",
+	[RPC_TRACE_FRAME_EVENT_BURST] = "events.event_burst",
+	[RPC_TRACE_FRAME_SUBSCRIBE] = "events.subscribe",
+	[RPC_TRACE_FRAME_UNSUBSCRIBE] = "events.unsubscribe"
+};
+
+static const char *rpc_trace_stage_names[] = {
+	[RPC_TRACE_STAGE_SEND] = "send",
+	[RPC_TRACE_STAGE_WRITE] = "write",
+	[RPC_TRACE_STAGE_READ] = "read",
+	[RPC_TRACE_STAGE_DISPATCH] = "dispatch"
+};
+
+static void rpc_trace_ring_release(gpointer);
+static struct rpc_trace_ring *rpc_trace_get_ring(void);
+static rpc_trace_frame_t rpc_trace_frame_type(rpc_object_t);
+static uint64_t rpc_trace_call_id(rpc_object_t);
+static void rpc_trace_put(struct rpc_trace_ring *, rpc_trace_stage_t,
+    rpc_connection_t, uint64_t, rpc_trace_frame_t, size_t);
+static gint rpc_trace_record_cmp(gconstpointer, gconstpointer);
+static bool rpc_trace_hex(const char *, size_t, uint64_t *);
+static bool rpc_trace_ctx_parse(const char *, struct rpc_trace_context *);
+static uint64_t rpc_trace_random_id(void);
+static struct rpc_trace_thread *rpc_trace_get_thread(bool);
+
+volatile gint rpc_trace_ring_enabled = 0;
+static volatile guint rpc_trace_ring_size = 0;
+static GMutex rpc_trace_mtx;
+static struct rpc_trace_ring *rpc_trace_rings = NULL;
+static uint16_t rpc_trace_nrings = 0;
+static GPrivate rpc_trace_current = G_PRIVATE_INIT(rpc_trace_ring_release);
+static GPrivate rpc_trace_thread_ctx = G_PRIVATE_INIT(g_free);
+static GMutex rpc_trace_span_mtx;
+static rpc_span_handler_t rpc_trace_span_handler = NULL;
+
+/*
+ * Rings outlive their threads, so entries of a thread that is gone
+ * still show up in dumps. A later thread takes the ring over.
+ */
+static void
+rpc_trace_ring_release(gpointer data)
+{
+	struct rpc_trace_ring *ring = data;
+
+	g_mutex_lock(&rpc_trace_mtx);
+	ring->rtb_owned = false;
+	g_mutex_unlock(&rpc_trace_mtx);
+}
+
+static struct rpc_trace_ring *
+rpc_trace_get_ring(void)
+{
+	struct rpc_trace_ring *ring;
+	guint size;
+
+	ring = g_private_get(&rpc_trace_current);
+	if (ring != NULL)
+		return (ring);
+
+	size = g_atomic_int_get(&rpc_trace_ring_size);
+	g_mutex_lock(&rpc_trace_mtx);
+	for (ring = rpc_trace_rings; ring != NULL; ring = ring->rtb_next) {
+		if (!ring->rtb_owned && ring->rtb_mask + 1 == size)
+			break;
+	}
+
+	if (ring == NULL) {
+		ring = g_malloc0(sizeof(*ring) +
+		    size * sizeof(struct rpc_trace_record));
+		ring->rtb_mask = size - 1;
+		ring->rtb_thread = rpc_trace_nrings++;
+		ring->rtb_next = rpc_trace_rings;
+		rpc_trace_rings = ring;
+	}
+
+	ring->rtb_owned = true;
+	g_mutex_unlock(&rpc_trace_mtx);
+	g_private_set(&rpc_trace_current, ring);
+	return (ring);
+}
+
+static rpc_trace_frame_t
+rpc_trace_frame_type(rpc_object_t frame)
+{
+	const char *namespace;
+	const char *name;
+	size_t len;
+	int i;
+
+	namespace = rpc_dictionary_get_string(frame, RPC_ATOM(NAMESPACE));
+	name = rpc_dictionary_get_string(frame, RPC_ATOM(NAME));
+	if (namespace == NULL || name == NULL)
+		return (RPC_TRACE_FRAME_UNKNOWN);
+
+	len = strlen(namespace);
+	for (i = RPC_TRACE_FRAME_CALL; i < RPC_TRACE_FRAME_COUNT; i++) {
+		if (strncmp(rpc_trace_frame_names[i], namespace, len) == 0 &&
+		    rpc_trace_frame_names[i][len] == '.' &&
+		    strcmp(rpc_trace_frame_names[i] + len + 1, name) == 0)
+			return ((rpc_trace_frame_t)i);
+	}
+
+	return (RPC_TRACE_FRAME_UNKNOWN);
+}
+
+static uint64_t
+rpc_trace_call_id(rpc_object_t id)
+{
+
+	switch (rpc_get_type(id)) {
+	case RPC_TYPE_UINT64:
+		return (rpc_uint64_get_value(id));
+
+	case RPC_TYPE_INT64:
+		return ((uint64_t)rpc_int64_get_value(id));
+
+	case RPC_TYPE_STRING:
+		return (g_str_hash(rpc_string_get_string_ptr(id)));
+
+	default:
+		return (0);
+	}
+}
+
+static void
+rpc_trace_put(struct rpc_trace_ring *ring, rpc_trace_stage_t stage,
+    rpc_connection_t conn, uint64_t call_id, rpc_trace_frame_t frame,
+    size_t size)
+{
+	struct rpc_trace_record *rec;
+	struct timespec ts;
+	uint64_t head;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	/* Only the owning thread writes, readers check the head after copying */
+	head = atomic_load_explicit(&ring->rtb_head, memory_order_relaxed);
+	rec = &ring->rtb_records[head & ring->rtb_mask];
+	rec->rtr_time = (uint64_t)ts.tv_sec * 1000000000ull +
+	    (uint64_t)ts.tv_nsec;
+	rec->rtr_conn = (uint64_t)(uintptr_t)conn;
+	rec->rtr_call_id = call_id;
+	rec->rtr_size = (uint32_t)MIN(size, UINT32_MAX);
+	rec->rtr_thread = ring->rtb_thread;
+	rec->rtr_stage = (uint8_t)stage;
+	rec->rtr_frame = (uint8_t)frame;
+	atomic_store_explicit(&ring->rtb_head, head + 1, memory_order_release);
+}
+
+void
+rpc_trace_frame(rpc_trace_stage_t stage, rpc_connection_t conn,
+    rpc_object_t frame, size_t size)
+{
+	rpc_object_t id;
+
+	if (rpc_get_type(frame) != RPC_TYPE_DICTIONARY) {
+		rpc_trace_put(rpc_trace_get_ring(), stage, conn, 0,
+		    RPC_TRACE_FRAME_UNKNOWN, size);
+		return;
+	}
+
+	id = rpc_dictionary_get_value(frame, RPC_ATOM(ID));
+	rpc_trace_put(rpc_trace_get_ring(), stage, conn,
+	    id != NULL ? rpc_trace_call_id(id) : 0,
+	    rpc_trace_frame_type(frame), size);
+}
+
+void
+rpc_trace_bytes(rpc_trace_stage_t stage, rpc_connection_t conn, size_t size)
+{
+
+	rpc_trace_put(rpc_trace_get_ring(), stage, conn, 0,
+	    RPC_TRACE_FRAME_UNKNOWN, size);
+}
+
+int
+rpc_trace_enable(size_t nrecords)
+{
+
+	if (nrecords == 0) {
+		rpc_set_last_error(EINVAL, "Ring size must not be 0", NULL);
+		return (-1);
+	}
+
+	nrecords = MIN(nrecords, RPC_TRACE_MAX_RECORDS);
+	g_atomic_int_set(&rpc_trace_ring_size,
+	    1u << g_bit_storage(nrecords - 1));
+	g_atomic_int_set(&rpc_trace_ring_enabled, 1);
+	return (0);
+}
+
+void
+rpc_trace_disable(void)
+{
+
+	g_atomic_int_set(&rpc_trace_ring_enabled, 0);
+}
+
+static gint
+rpc_trace_record_cmp(gconstpointer a, gconstpointer b)
+{
+	const struct rpc_trace_record *ra = a;
+	const struct rpc_trace_record *rb = b;
+
+	if (ra->rtr_time == rb->rtr_time)
+		return (0);
+
+	return (ra->rtr_time < rb->rtr_time ? -1 : 1);
+}
+
+rpc_object_t
+rpc_trace_dump(void)
+{
+	struct rpc_trace_header *header;
+	struct rpc_trace_record *records;
+	struct rpc_trace_ring *ring;
+	GArray *result;
+	uint64_t first;
+	uint64_t head;
+	uint64_t end;
+	uint64_t i;
+	guint start;
+
+	result = g_array_new(false, false, sizeof(struct rpc_trace_record));
+
+	g_mutex_lock(&rpc_trace_mtx);
+	for (ring = rpc_trace_rings; ring != NULL; ring = ring->rtb_next) {
+		end = atomic_load_explicit(&ring->rtb_head,
+		    memory_order_acquire);
+		first = end > ring->rtb_mask ? end - ring->rtb_mask - 1 : 0;
+		start = result->len;
+
+		for (i = first; i < end; i++) {
+			g_array_append_val(result,
+			    ring->rtb_records[i & ring->rtb_mask]);
+		}
+
+		/* Drop whatever the writer may have overwritten meanwhile */
+		head = atomic_load_explicit(&ring->rtb_head,
+		    memory_order_acquire);
+		if (head > ring->rtb_mask && head - ring->rtb_mask > first) {
+			g_array_remove_range(result, start,
+			    (guint)MIN(head - ring->rtb_mask - first,
+			    end - first));
+		}
+	}
+	g_mutex_unlock(&rpc_trace_mtx);
+
+	g_array_sort(result, rpc_trace_record_cmp);
+
+	header = g_malloc(sizeof(*header) +
+	    result->len * sizeof(struct rpc_trace_record));
+	header->rth_magic = RPC_TRACE_MAGIC;
+	header->rth_version = RPC_TRACE_VERSION;
+	header->rth_record_size = sizeof(struct rpc_trace_record);
+	header->rth_count = result->len;
+	records = (struct rpc_trace_record *)(header + 1);
+	memcpy(records, result->data,
+	    result->len * sizeof(struct rpc_trace_record));
+	g_array_free(result, true);
+
+	return (rpc_data_create(header, sizeof(*header) +
+	    header->rth_count * sizeof(struct rpc_trace_record),
+	    RPC_BINARY_DESTRUCTOR(g_free)));
+}
+
+const char *
+rpc_trace_stage_name(rpc_trace_stage_t stage)
+{
+
+	if (stage >= RPC_TRACE_STAGE_COUNT)
+		return ("unknown");
+
+	return (rpc_trace_stage_names[stage]);
+}
+
+const char *
+rpc_trace_frame_name(rpc_trace_frame_t frame)
+{
+
+	if (frame >= RPC_TRACE_FRAME_COUNT)
+		return (rpc_trace_frame_names[RPC_TRACE_FRAME_UNKNOWN]);
+
+	return (rpc_trace_frame_names[frame]);
+}
+
+static bool
+rpc_trace_hex(const char *str, size_t len, uint64_t *result)
+{
+	size_t i;
+	int digit;
+
+	*result = 0;
+	for (i = 0; i < len; i++) {
+		/* Upper case digits are not valid in a traceparent */
+		digit = g_ascii_xdigit_value(str[i]);
+		if (digit < 0 || g_ascii_isupper(str[i]))
+			return (false);
+
+		*result = (*result << 4) | (uint64_t)digit;
+	}
+
+	return (true);
+}
+
+/*
+ * Parses "version-traceid-parentid-flags". The parent ID ends up in
+ * rtc_span_id, as it is the span the context was taken from.
+ */
+static bool
+rpc_trace_ctx_parse(const char *str, struct rpc_trace_context *ctx)
+{
+	uint64_t version;
+	uint64_t flags;
+
+	if (str == NULL || strlen(str) < RPC_TRACEPARENT_SIZE - 1)
+		return (false);
+
+	if (str[2] != '-' || str[35] != '-' || str[52] != '-')
+		return (false);
+
+	if (!rpc_trace_hex(str, 2, &version) || version == 0xff)
+		return (false);
+
+	/* Later versions may append fields, version 00 may not */
+	if (str[55] != '\0' && (version == 0 || str[55] != '-'))
+		return (false);
+
+	if (!rpc_trace_hex(str + 3, 16, &ctx->rtc_trace_hi) ||
+	    !rpc_trace_hex(str + 19, 16, &ctx->rtc_trace_lo) ||
+	    !rpc_trace_hex(str + 36, 16, &ctx->rtc_span_id) ||
+	    !rpc_trace_hex(str + 53, 2, &flags))
+		return (false);
+
+	if ((ctx->rtc_trace_hi | ctx->rtc_trace_lo) == 0 ||
+	    ctx->rtc_span_id == 0)
+		return (false);
+
+	ctx->rtc_flags = (uint8_t)flags;
+	ctx->rtc_parent_id = 0;
+	ctx->rtc_valid = true;
+	return (true);
+}
+
+static uint64_t
+rpc_trace_random_id(void)
+{
+	uint64_t result;
+
+	do {
+		result = ((uint64_t)g_random_int() << 32) | g_random_int();
+	} while (result == 0);
+
+	return (result);
+}
+
+static struct rpc_trace_thread *
+rpc_trace_get_thread(bool create)
+{
+	struct rpc_trace_thread *thr;
+
+	thr = g_private_get(&rpc_trace_thread_ctx);
+	if (thr == NULL && create) {
+		thr = g_malloc0(sizeof(*thr));
+		g_private_set(&rpc_trace_thread_ctx, thr);
+	}
+
+	return (thr);
+}
+
+void
+rpc_trace_ctx_format(const struct rpc_trace_context *ctx, char *buf)
+{
+
+	g_snprintf(buf, RPC_TRACEPARENT_SIZE,
+	    "00-%016" PRIx64 "%016" PRIx64 "-%016" PRIx64 "-%02x",
+	    ctx->rtc_trace_hi, ctx->rtc_trace_lo, ctx->rtc_span_id,
+	    ctx->rtc_flags);
+}
+
+/*
+ * Picks up the caller's context from an inbound call. The call gets a
+ * span of its own, with the caller's span as the parent.
+ */
+void
+rpc_trace_ctx_accept(struct rpc_call *call, rpc_object_t args)
+{
+	const char *traceparent;
+
+	traceparent = rpc_dictionary_get_string(args, RPC_ATOM(TRACEPARENT));
+	if (traceparent == NULL ||
+	    !rpc_trace_ctx_parse(traceparent, &call->rc_trace))
+		return;
+
+	call->rc_trace.rtc_parent_id = call->rc_trace.rtc_span_id;
+	call->rc_trace.rtc_span_id = rpc_trace_random_id();
+}
+
+void
+rpc_trace_ctx_propagate(rpc_object_t payload)
+{
+	struct rpc_trace_thread *thr;
+
+	thr = rpc_trace_get_thread(false);
+	if (thr == NULL || !thr->rtl_ctx.rtc_valid)
+		return;
+
+	if (!thr->rtl_formatted) {
+		rpc_trace_ctx_format(&thr->rtl_ctx, thr->rtl_buf);
+		thr->rtl_formatted = true;
+	}
+
+	rpc_dictionary_set_string(payload, RPC_ATOM(TRACEPARENT),
+	    thr->rtl_buf);
+}
+
+/*
+ * Makes @p ctx the context of the calling thread, saving the previous
+ * one for rpc_trace_ctx_leave().
+ */
+void
+rpc_trace_ctx_enter(const struct rpc_trace_context *ctx,
+    struct rpc_trace_context *saved)
+{
+	struct rpc_trace_thread *thr;
+
+	thr = rpc_trace_get_thread(ctx->rtc_valid);
+	if (thr == NULL) {
+		saved->rtc_valid = false;
+		return;
+	}
+
+	*saved = thr->rtl_ctx;
+	thr->rtl_ctx = *ctx;
+	thr->rtl_formatted = false;
+}
+
+void
+rpc_trace_ctx_leave(const struct rpc_trace_context *saved)
+{
+	struct rpc_trace_thread *thr;
+
+	thr = rpc_trace_get_thread(false);
+	if (thr == NULL)
+		return;
+
+	thr->rtl_ctx = *saved;
+	thr->rtl_formatted = false;
+}
+
+void
+rpc_trace_export_span(struct rpc_call *call, gint64 now)
+{
+	rpc_span_handler_t handler;
+	struct rpc_span span;
+	char trace_id[33];
+	char span_id[17];
+	char parent_id[17];
+	gint64 queued;
+	gint64 started;
+
+	if ((call->rc_trace.rtc_flags & RPC_TRACE_FLAG_SAMPLED) == 0)
+		return;
+
+	g_mutex_lock(&rpc_trace_span_mtx);
+	handler = rpc_trace_span_handler != NULL ?
+	    Block_copy(rpc_trace_span_handler) : NULL;
+	g_mutex_unlock(&rpc_trace_span_mtx);
+
+	if (handler == NULL)
+		return;
+
+	queued = call->rc_queued != 0 ? call->rc_queued : now;
+	started = call->rc_started != 0 ? call->rc_started : now;
+
+	g_snprintf(trace_id, sizeof(trace_id), "%016" PRIx64 "%016" PRIx64,
+	    call->rc_trace.rtc_trace_hi, call->rc_trace.rtc_trace_lo);
+	g_snprintf(span_id, sizeof(span_id), "%016" PRIx64,
+	    call->rc_trace.rtc_span_id);
+	g_snprintf(parent_id, sizeof(parent_id), "%016" PRIx64,
+	    call->rc_trace.rtc_parent_id);
+
+	span.rsp_trace_id = trace_id;
+	span.rsp_span_id = span_id;
+	span.rsp_parent_id = parent_id;
+	span.rsp_path = call->rc_path;
+	span.rsp_interface = call->rc_interface;
+	span.rsp_method = call->rc_method_name;
+	span.rsp_start = g_get_real_time() - (now - queued);
+	span.rsp_queue_time = (uint64_t)MAX(started - queued, 0);
+	span.rsp_exec_time = (uint64_t)MAX(now - started, 0);
+	span.rsp_send_time = (uint64_t)MAX(call->rc_send_time, 0);
+	span.rsp_error = call->rc_failed;
+
+	handler(&span);
+	Block_release(handler);
+}
+
+int
+rpc_trace_context_set(const char *traceparent)
+{
+	struct rpc_trace_context ctx = { 0 };
+	struct rpc_trace_thread *thr;
+
+	if (traceparent != NULL && !rpc_trace_ctx_parse(traceparent, &ctx)) {
+		rpc_set_last_error(EINVAL, "Malformed traceparent", NULL);
+		return (-1);
+	}
+
+	thr = rpc_trace_get_thread(ctx.rtc_valid);
+	if (thr != NULL) {
+		thr->rtl_ctx = ctx;
+		thr->rtl_formatted = false;
+	}
+
+	return (0);
+}
+
+void
+rpc_trace_context_start(bool sampled)
+{
+	struct rpc_trace_thread *thr;
+
+	thr = rpc_trace_get_thread(true);
+	thr->rtl_ctx.rtc_trace_hi = rpc_trace_random_id();
+	thr->rtl_ctx.rtc_trace_lo = rpc_trace_random_id();
+	thr->rtl_ctx.rtc_span_id = rpc_trace_random_id();
+	thr->rtl_ctx.rtc_parent_id = 0;
+	thr->rtl_ctx.rtc_flags = sampled ? RPC_TRACE_FLAG_SAMPLED : 0;
+	thr->rtl_ctx.rtc_valid = true;
+	thr->rtl_formatted = false;
+}
+
+const char *
+rpc_trace_context_get(void)
+{
+	struct rpc_trace_thread *thr;
+
+	thr = rpc_trace_get_thread(false);
+	if (thr == NULL || !thr->rtl_ctx.rtc_valid)
+		return (NULL);
+
+	if (!thr->rtl_formatted) {
+		rpc_trace_ctx_format(&thr->rtl_ctx, thr->rtl_buf);
+		thr->rtl_formatted = true;
+	}
+
+	return (thr->rtl_buf);
+}
+
+void
+rpc_trace_set_span_handler(rpc_span_handler_t handler)
+{
+
+	g_mutex_lock(&rpc_trace_span_mtx);
+	if (rpc_trace_span_handler != NULL)
+		Block_release(rpc_trace_span_handler);
+
+	rpc_trace_span_handler = handler != NULL ? Block_copy(handler) : NULL;
+	g_mutex_unlock(&rpc_trace_span_mtx);
+}
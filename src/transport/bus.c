@@ -27,6 +27,7 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
@@ -36,6 +37,8 @@
 #include <sys/socket.h>
 #include <sys/poll.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
 #include <glib.h>
 #include <yuarel.h>
 #include <libudev.h>
@@ -47,9 +50,13 @@
 #include "../../kmod/librpc.h"
 
 #define	BUS_NL_MSGSIZE	16384
+#define	BUS_MAX_WINDOW	256
+#define	BUS_FRAG_SIZE	(BUS_NL_MSGSIZE - \
+    NLMSG_SPACE(sizeof(struct cn_msg) + sizeof(struct librpc_message)))
 
 struct bus_netlink;
 struct bus_connection;
+struct bus_ring;
 typedef void (*bus_netlink_cb_t)(void *, struct librpc_message *, void *,
     size_t);
 
@@ -65,13 +72,35 @@ static int bus_netlink_open(struct bus_netlink *);
 static int bus_netlink_close(struct bus_netlink *);
 static int bus_netlink_send(struct bus_netlink *, struct librpc_message *,
     const void *, size_t);
+static int bus_netlink_send_fragment(struct bus_netlink *,
+    struct librpc_message *, const void *, size_t);
 static int bus_netlink_recv(struct bus_netlink *);
+static void *bus_reassemble(struct bus_netlink *, struct librpc_message *,
+    size_t, size_t *);
+static void bus_fragments_free(void *);
 static int bus_lookup_address(const char *, uint32_t *);
 static void bus_process_message(void *, struct librpc_message *, void *, size_t);
+static void bus_process_batch(struct bus_connection *, struct librpc_message *,
+    const char *, size_t);
 static void *bus_reader(void *);
 static void bus_release(void *);
 static void bus_nack_all_locked(struct bus_netlink *bn);
+static void bus_ack_complete_locked(struct bus_netlink *, struct bus_ack *,
+    int);
+static void bus_ack_upto_locked(struct bus_netlink *, uint32_t);
 static void bus_process_departure(void *arg);
+static int bus_ring_open(struct bus_connection *);
+static void bus_ring_free(struct bus_ring *);
+static int bus_ring_send_msg(void *, const void *, size_t, const int *,
+    size_t);
+static int bus_ring_abort(void *);
+static int bus_ring_get_fd(void *);
+static void bus_ring_copy_in(struct librpc_ring_header *, uint64_t,
+    const void *, size_t);
+static void bus_ring_copy_out(struct librpc_ring_header *, uint64_t, void *,
+    size_t);
+static bool bus_ring_drain(struct bus_connection *);
+static void *bus_ring_reader(void *);
 
 static const struct rpc_bus_transport bus_transport_ops = {
 	.open = bus_open,
@@ -95,6 +124,14 @@ struct bus_ack
     	bool			ba_done;
     	int			ba_status;
 	uint32_t		ba_seq;
+	bool			ba_async;
+};
+
+struct bus_fragments
+{
+	char *			bf_data;
+	size_t			bf_total;
+	size_t			bf_done;
 };
 
 struct bus_netlink
@@ -107,6 +144,29 @@ struct bus_netlink
     	bus_netlink_cb_t	bn_callback;
     	void *			bn_arg;
 	bool			bn_departed;
+	guint			bn_window;
+	guint			bn_inflight;
+	GCond			bn_window_cv;
+	int			bn_status;
+	volatile gint		bn_msgid;
+	GHashTable *		bn_fragments;
+	uint64_t		bn_dropped;
+};
+
+/*
+ * Ring backend: requests and responses go through memory shared with the
+ * kernel module instead of netlink, see LIBRPC_RING_DEVICE.
+ */
+struct bus_ring
+{
+	int				br_fd;
+	int				br_wakefd;
+	void *				br_mem;
+	struct librpc_ring_header *	br_tx;
+	struct librpc_ring_header *	br_rx;
+	GMutex				br_tx_mtx;
+	GThread *			br_thread;
+	bool				br_orphaned;
 };
 
 struct bus_connection
@@ -115,6 +175,7 @@ struct bus_connection
     	uint32_t		bc_address;
     	struct bus_netlink	bc_bn;
     	struct rpc_connection *	bc_parent;
+	struct bus_ring *	bc_ring;
 };
 
 static void *
@@ -143,7 +204,7 @@ bus_close(void *arg)
 
 static int
 bus_connect(struct rpc_connection *rco, const char *uri_string,
-    rpc_object_t args __unused)
+    rpc_object_t args)
 {
 	g_autofree char *uri_copy = g_strdup(uri_string);
 	struct yuarel uri;
@@ -163,12 +224,33 @@ bus_connect(struct rpc_connection *rco, const char *uri_string,
 		return (-1);
 	}
 
+	if (args != NULL && rpc_get_type(args) == RPC_TYPE_DICTIONARY &&
+	    rpc_dictionary_get_bool(args, RPC_BUS_RING)) {
+		if (bus_ring_open(conn) != 0) {
+			g_free(conn);
+			return (-1);
+		}
+
+		rco->rco_send_msg = &bus_ring_send_msg;
+		rco->rco_abort = &bus_ring_abort;
+		rco->rco_get_fd = &bus_ring_get_fd;
+		rco->rco_arg = conn;
+		rco->rco_release = bus_release;
+		conn->bc_ring->br_thread = rpc_thread_new(RPC_THREAD_IO,
+		    "bus ring reader", &bus_ring_reader, conn);
+		return (0);
+	}
+
 	if (bus_netlink_open(&conn->bc_bn) != 0) {
 		rpc_set_last_error(EINVAL, "Cannot open device", NULL);
 		g_free(conn);
 		return (-1);
 	}
 
+	if (args != NULL && rpc_get_type(args) == RPC_TYPE_DICTIONARY)
+		conn->bc_bn.bn_window = (guint)MIN(rpc_dictionary_get_uint64(
+		    args, RPC_BUS_WINDOW), BUS_MAX_WINDOW);
+
 	conn->bc_bn.bn_callback = &bus_process_message;
 	conn->bc_bn.bn_arg = conn;
 	rco->rco_send_msg = &bus_send_msg;
@@ -327,7 +409,10 @@ bus_netlink_open(struct bus_netlink *bn)
 	}
 
 	g_mutex_init(&bn->bn_mtx);
+	g_cond_init(&bn->bn_window_cv);
 	bn->bn_ack = g_hash_table_new(NULL, NULL);
+	bn->bn_fragments = g_hash_table_new_full(NULL, NULL, NULL,
+	    bus_fragments_free);
 
 	sa.nl_family = AF_NETLINK;
 	sa.nl_groups = (uint32_t)-1;
@@ -340,7 +425,8 @@ bus_netlink_open(struct bus_netlink *bn)
 	setsockopt(bn->bn_sock, SOL_NETLINK, NETLINK_ADD_MEMBERSHIP, &group,
 	    sizeof(group));
 
-	bn->bn_thread = g_thread_new("bus reader", &bus_reader, bn);
+	bn->bn_thread = rpc_thread_new(RPC_THREAD_IO, "bus reader", &bus_reader,
+	    bn);
 	return (0);
 }
 
@@ -353,25 +439,77 @@ bus_netlink_close(struct bus_netlink *bn)
 	return (0);
 }
 
+/*
+ * Messages too large for a single connector message go out in fragments,
+ * which the other end puts back together, see struct librpc_message.
+ */
 static int
 bus_netlink_send(struct bus_netlink *bn, struct librpc_message *msg,
     const void *payload, size_t len)
 {
-	char buf[BUS_NL_MSGSIZE];
+	size_t offset = 0;
+	size_t chunk;
+	int ret;
+
+	if (len > LIBRPC_MAX_MESSAGE)
+		return (EMSGSIZE);
+
+	msg->id = (uint32_t)g_atomic_int_add(&bn->bn_msgid, 1);
+	msg->total = (uint32_t)len;
+
+	do {
+		chunk = MIN(len - offset, BUS_FRAG_SIZE);
+		msg->offset = (uint32_t)offset;
+		ret = bus_netlink_send_fragment(bn, msg, payload != NULL ?
+		    (const char *)payload + offset : NULL, chunk);
+		if (ret != 0)
+			return (ret);
+
+		offset += chunk;
+	} while (offset < len);
+
+	return (0);
+}
+
+static int
+bus_netlink_send_fragment(struct bus_netlink *bn, struct librpc_message *msg,
+    const void *payload, size_t len)
+{
+	static const char pad[NLMSG_ALIGNTO];
+	char buf[NLMSG_SPACE(sizeof(struct cn_msg) +
+	    sizeof(struct librpc_message))];
 	struct bus_ack ack;
+	struct bus_ack *pending = NULL;
 	struct nlmsghdr *nlh = (struct nlmsghdr *)buf;
 	struct cn_msg *cn = NLMSG_DATA(nlh);
+	struct iovec iov[3];
+	struct msghdr mh;
 	size_t size = NLMSG_SPACE(sizeof(*cn) + sizeof(*msg) + len);
+	size_t hdrlen = NLMSG_LENGTH(sizeof(*cn) + sizeof(*msg));
+	bool windowed = bn->bn_window > 1 && msg->opcode == LIBRPC_REQUEST;
+	int status;
 
 	g_mutex_lock(&bn->bn_mtx);
+	while (windowed && !bn->bn_departed &&
+	    bn->bn_inflight >= bn->bn_window)
+		g_cond_wait(&bn->bn_window_cv, &bn->bn_mtx);
+
 	if (bn->bn_departed) {
 		g_mutex_unlock(&bn->bn_mtx);
 		return(EIO);
 	}
 
+	/* A request sent earlier has failed; report it now */
+	if (windowed && bn->bn_status != 0) {
+		status = bn->bn_status;
+		bn->bn_status = 0;
+		g_mutex_unlock(&bn->bn_mtx);
+		return (status);
+	}
+
 	nlh->nlmsg_seq = bn->bn_seq++;
 	nlh->nlmsg_pid = (uint32_t)getpid();
-	nlh->nlmsg_len = (uint32_t)size;
+	nlh->nlmsg_len = (uint32_t)NLMSG_LENGTH(sizeof(*cn) + sizeof(*msg) + len);
 	nlh->nlmsg_type = NLMSG_DONE;
 	nlh->nlmsg_flags = NLM_F_REQUEST;
 
@@ -379,29 +517,56 @@ bus_netlink_send(struct bus_netlink *bn, struct librpc_message *msg,
 	cn->id.val = CN_LIBRPC_VAL;
 	cn->seq = nlh->nlmsg_seq;
 	cn->ack = 100;
-	cn->flags = 0;
+	cn->flags = windowed ? LIBRPC_CN_ACK_CUMULATIVE : 0;
 	cn->len = sizeof(struct librpc_message) + (uint16_t)len;
 	memcpy(cn->data, msg, sizeof(struct librpc_message));
 
-	if (payload != NULL)
-		memcpy(cn->data + sizeof(struct librpc_message), payload, len);
-
-
-	ack.ba_done = false;
-	ack.ba_status = 0;
-	ack.ba_seq = nlh->nlmsg_seq;
-	g_mutex_init(&ack.ba_mtx);
-	g_cond_init(&ack.ba_cv);
-	g_hash_table_insert(bn->bn_ack, GUINT_TO_POINTER(cn->seq), &ack);
+	/* The payload goes out straight from the caller's buffer */
+	iov[0] = (struct iovec){ .iov_base = buf, .iov_len = hdrlen };
+	iov[1] = (struct iovec){ .iov_base = (void *)payload, .iov_len = len };
+	iov[2] = (struct iovec){
+		.iov_base = (void *)pad,
+		.iov_len = size - hdrlen - len
+	};
+
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = iov;
+	mh.msg_iovlen = 3;
+
+	if (windowed) {
+		/* Completed, and freed, by the reader once acknowledged */
+		pending = g_malloc0(sizeof(*pending));
+		pending->ba_seq = nlh->nlmsg_seq;
+		pending->ba_async = true;
+		g_hash_table_insert(bn->bn_ack, GUINT_TO_POINTER(cn->seq),
+		    pending);
+		bn->bn_inflight++;
+	} else {
+		ack.ba_done = false;
+		ack.ba_status = 0;
+		ack.ba_seq = nlh->nlmsg_seq;
+		ack.ba_async = false;
+		g_mutex_init(&ack.ba_mtx);
+		g_cond_init(&ack.ba_cv);
+		g_hash_table_insert(bn->bn_ack, GUINT_TO_POINTER(cn->seq),
+		    &ack);
+	}
 
-	if (send(bn->bn_sock, buf, size, 0) != (ssize_t)size) {
+	if (sendmsg(bn->bn_sock, &mh, 0) != (ssize_t)size) {
 		g_hash_table_remove(bn->bn_ack, GUINT_TO_POINTER(cn->seq));
 		fprintf(stderr, "NL send failed %d\n", cn->seq);
+		if (pending != NULL) {
+			bn->bn_inflight--;
+			g_free(pending);
+		}
+
 		g_mutex_unlock(&bn->bn_mtx);
 		return (-1);
 	}
 
 	g_mutex_unlock(&bn->bn_mtx);
+	if (windowed)
+		return (0);
 	g_mutex_lock(&ack.ba_mtx);
 
 	while (!ack.ba_done)
@@ -419,15 +584,23 @@ bus_netlink_recv(struct bus_netlink *bn)
 	struct nlmsghdr *nlh = (struct nlmsghdr *)buf;
 	struct cn_msg *cn = NLMSG_DATA(nlh);
 	struct librpc_message *msg = (struct librpc_message *)(cn + 1);
-	struct librpc_message *out;
 	struct librpc_endpoint *endp;
 	struct rpc_bus_node node;
-	void *payload;
+	void *payload = NULL;
+	size_t len;
 	ssize_t msglen = 0;
 
 	msglen = recv(bn->bn_sock, buf, BUS_NL_MSGSIZE, 0);
 	nlh = (struct nlmsghdr *)buf;
 
+	/* The socket overran, so some broadcasts never made it here */
+	if (msglen < 0 && errno == ENOBUFS) {
+		bn->bn_dropped++;
+		debugf("bn %p overrun, %" PRIu64 " drops so far", bn,
+		    bn->bn_dropped);
+		return (0);
+	}
+
 	if (msglen <= 0) {
 		fprintf(stderr,
 		    "Received 0 length msg, bn = %p, terminating thread %lld\n",
@@ -451,10 +624,10 @@ bus_netlink_recv(struct bus_netlink *bn)
 			return (-1);
 
 		case NLMSG_DONE:
-			out = g_malloc(sizeof(*out));
-			payload = g_malloc(cn->len);
-			memcpy(out, msg, sizeof(struct librpc_message));
-			memcpy(payload, msg + 1, cn->len);
+			if (cn->len < sizeof(*msg))
+				return (0);
+
+			len = cn->len - sizeof(*msg);
 			break;
 
 		default:
@@ -499,22 +672,31 @@ bus_netlink_recv(struct bus_netlink *bn)
 		g_mutex_lock(&bn->bn_mtx);
 		ack = g_hash_table_lookup(bn->bn_ack, GUINT_TO_POINTER(cn->seq));
 		g_hash_table_remove(bn->bn_ack, GUINT_TO_POINTER(cn->seq));
+		if (ack != NULL)
+			bus_ack_complete_locked(bn, ack, msg->status);
 		g_mutex_unlock(&bn->bn_mtx);
+		break;
 
-		if (ack != NULL) {
-			g_mutex_lock(&ack->ba_mtx);
-			ack->ba_done = true;
-			ack->ba_status = msg->status;
-			g_cond_broadcast(&ack->ba_cv);
-			g_mutex_unlock(&ack->ba_mtx);
-		}
+	case LIBRPC_ACK_UPTO:
+		g_mutex_lock(&bn->bn_mtx);
+		bus_ack_upto_locked(bn, cn->seq);
+		g_mutex_unlock(&bn->bn_mtx);
 		break;
 
 	default:
-		if (bn->bn_callback != NULL) {
-			bn->bn_callback(bn->bn_arg, msg, payload,
-			    cn->len - sizeof(*cn));
-		}
+		if (bn->bn_callback == NULL)
+			break;
+
+		if (msg->total > len) {
+			/* Wait for the rest of the fragments */
+			payload = bus_reassemble(bn, msg, len, &len);
+			if (payload == NULL)
+				break;
+		} else
+			payload = g_memdup(msg + 1, (guint)len);
+
+		bn->bn_callback(bn->bn_arg, msg, payload, len);
+		g_free(payload);
 		break;
 	}
 
@@ -522,6 +704,72 @@ bus_netlink_recv(struct bus_netlink *bn)
 	return (0);
 }
 
+/*
+ * Collects a fragment. Returns the complete message, to be freed by the
+ * caller, once all fragments are in; NULL until then.
+ *
+ * The kernel sends fragments in order, so each one has to continue where
+ * the previous one ended. Repeats are ignored and anything out of order
+ * drops the message, which is only handed on once every byte was written.
+ */
+static void *
+bus_reassemble(struct bus_netlink *bn, struct librpc_message *msg,
+    size_t len, size_t *lenp)
+{
+	struct bus_fragments *frags;
+	void *data;
+
+	if (msg->total > LIBRPC_MAX_MESSAGE || msg->offset > msg->total ||
+	    len > msg->total - msg->offset) {
+		debugf("bogus fragment: id=%u, offset=%u, total=%u", msg->id,
+		    msg->offset, msg->total);
+		g_hash_table_remove(bn->bn_fragments,
+		    GUINT_TO_POINTER(msg->id));
+		return (NULL);
+	}
+
+	frags = g_hash_table_lookup(bn->bn_fragments,
+	    GUINT_TO_POINTER(msg->id));
+	if (frags == NULL || frags->bf_total != msg->total) {
+		frags = g_malloc0(sizeof(*frags));
+		frags->bf_data = g_malloc(msg->total);
+		frags->bf_total = msg->total;
+		g_hash_table_replace(bn->bn_fragments,
+		    GUINT_TO_POINTER(msg->id), frags);
+	}
+
+	if (msg->offset < frags->bf_done && msg->offset + len <= frags->bf_done)
+		return (NULL);
+
+	if (msg->offset != frags->bf_done) {
+		debugf("out of order fragment: id=%u, offset=%u, expected=%zu",
+		    msg->id, msg->offset, frags->bf_done);
+		g_hash_table_remove(bn->bn_fragments,
+		    GUINT_TO_POINTER(msg->id));
+		return (NULL);
+	}
+
+	memcpy(frags->bf_data + msg->offset, msg + 1, len);
+	frags->bf_done += len;
+	if (frags->bf_done < frags->bf_total)
+		return (NULL);
+
+	data = frags->bf_data;
+	*lenp = frags->bf_total;
+	frags->bf_data = NULL;
+	g_hash_table_remove(bn->bn_fragments, GUINT_TO_POINTER(msg->id));
+	return (data);
+}
+
+static void
+bus_fragments_free(void *arg)
+{
+	struct bus_fragments *frags = arg;
+
+	g_free(frags->bf_data);
+	g_free(frags);
+}
+
 static void
 bus_nack_all_locked(struct bus_netlink *bn)
 {
@@ -530,12 +778,61 @@ bus_nack_all_locked(struct bus_netlink *bn)
 
 	g_hash_table_iter_init(&iter, bn->bn_ack);
 	while (g_hash_table_iter_next(&iter, NULL, (gpointer)&ack)) {
-		g_mutex_lock(&ack->ba_mtx);
-		ack->ba_done = true;
-		ack->ba_status = EPIPE;
-		fprintf(stderr, "NAK Waking %d, status %d\n", ack->ba_seq, ack->ba_status);
-		g_cond_broadcast(&ack->ba_cv);
-		g_mutex_unlock(&ack->ba_mtx);
+		fprintf(stderr, "NAK Waking %d, status %d\n", ack->ba_seq, EPIPE);
+		if (ack->ba_async)
+			g_hash_table_iter_remove(&iter);
+
+		bus_ack_complete_locked(bn, ack, EPIPE);
+	}
+
+	/* Wake up senders waiting for room in the window */
+	g_cond_broadcast(&bn->bn_window_cv);
+}
+
+/*
+ * Completes an acknowledged request. Synchronous senders are woken up;
+ * windowed ones are long gone, so only a failure is kept, for the next
+ * send to report.
+ */
+static void
+bus_ack_complete_locked(struct bus_netlink *bn, struct bus_ack *ack,
+    int status)
+{
+
+	if (ack->ba_async) {
+		if (status != 0 && bn->bn_status == 0)
+			bn->bn_status = status;
+
+		bn->bn_inflight--;
+		g_cond_signal(&bn->bn_window_cv);
+		g_free(ack);
+		return;
+	}
+
+	g_mutex_lock(&ack->ba_mtx);
+	ack->ba_done = true;
+	ack->ba_status = status;
+	g_cond_broadcast(&ack->ba_cv);
+	g_mutex_unlock(&ack->ba_mtx);
+}
+
+/*
+ * Handles a cumulative ACK: every outstanding request up to and including
+ * @seq went through.
+ */
+static void
+bus_ack_upto_locked(struct bus_netlink *bn, uint32_t seq)
+{
+	GHashTableIter iter;
+	struct bus_ack *ack;
+
+	g_hash_table_iter_init(&iter, bn->bn_ack);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer)&ack)) {
+		if ((int32_t)(ack->ba_seq - seq) > 0)
+			continue;
+
+		g_hash_table_iter_remove(&iter);
+		bus_ack_complete_locked(bn, ack, 0);
 	}
 }
 
@@ -572,9 +869,329 @@ bus_process_message(void *arg, struct librpc_message *msg, void *payload,
 		conn->bc_parent->rco_recv_msg(conn->bc_parent, payload, len,
 		    NULL, 0);
 		break;
+
+	case LIBRPC_EVENT:
+		/* Events are broadcast, so skip those of other devices */
+		if (msg->address != conn->bc_address)
+			break;
+
+		conn->bc_parent->rco_recv_msg(conn->bc_parent, payload, len,
+		    NULL, 0);
+		break;
+
+	case LIBRPC_LOG:
+		if (msg->address != conn->bc_address)
+			break;
+
+		debugf("device %u: %.*s", msg->address, (int)len,
+		    (const char *)payload);
+		break;
+
+	case LIBRPC_BATCH:
+		if (msg->address != conn->bc_address)
+			break;
+
+		bus_process_batch(conn, msg, payload, len);
+		break;
+	}
+}
+
+/*
+ * Unpacks a batch of events and logs, see struct librpc_batch_record.
+ * Records the kernel had to drop are accounted, as are socket overruns.
+ */
+static void
+bus_process_batch(struct bus_connection *conn, struct librpc_message *msg,
+    const char *payload, size_t len)
+{
+	struct librpc_batch_record rec;
+	struct librpc_message inner;
+	size_t offset = 0;
+
+	if (msg->status > 0) {
+		conn->bc_bn.bn_dropped += (uint64_t)msg->status;
+		debugf("device %u dropped %d records, %" PRIu64 " so far",
+		    msg->address, msg->status, conn->bc_bn.bn_dropped);
+	}
+
+	while (len - offset >= sizeof(rec)) {
+		memcpy(&rec, payload + offset, sizeof(rec));
+		offset += sizeof(rec);
+		if (rec.len > len - offset) {
+			debugf("truncated batch record: len=%u", rec.len);
+			break;
+		}
+
+		if (rec.opcode == LIBRPC_EVENT || rec.opcode == LIBRPC_LOG) {
+			inner = *msg;
+			inner.opcode = rec.opcode;
+			inner.status = 0;
+			bus_process_message(conn, &inner,
+			    (void *)(payload + offset), rec.len);
+		}
+
+		offset += MIN(LIBRPC_BATCH_ALIGN(rec.len), len - offset);
 	}
 }
 
+static int
+bus_ring_open(struct bus_connection *conn)
+{
+	struct bus_ring *ring;
+
+	ring = g_malloc0(sizeof(*ring));
+	ring->br_wakefd = -1;
+	ring->br_mem = MAP_FAILED;
+	g_mutex_init(&ring->br_tx_mtx);
+	conn->bc_ring = ring;
+
+	ring->br_fd = open(LIBRPC_RING_DEVICE, O_RDWR | O_CLOEXEC);
+	if (ring->br_fd < 0) {
+		rpc_set_last_errorf(errno, "Cannot open %s: %s",
+		    LIBRPC_RING_DEVICE, strerror(errno));
+		goto fail;
+	}
+
+	if (ioctl(ring->br_fd, LIBRPC_IOC_BIND, &conn->bc_address) != 0) {
+		rpc_set_last_errorf(errno, "Cannot bind to device: %s",
+		    strerror(errno));
+		goto fail;
+	}
+
+	ring->br_mem = mmap(NULL, LIBRPC_RING_MAP_SIZE, PROT_READ | PROT_WRITE,
+	    MAP_SHARED, ring->br_fd, 0);
+	if (ring->br_mem == MAP_FAILED) {
+		rpc_set_last_errorf(errno, "Cannot map rings: %s",
+		    strerror(errno));
+		goto fail;
+	}
+
+	ring->br_wakefd = eventfd(0, EFD_CLOEXEC);
+	if (ring->br_wakefd < 0) {
+		rpc_set_last_errorf(errno, "Cannot create eventfd: %s",
+		    strerror(errno));
+		goto fail;
+	}
+
+	ring->br_tx = ring->br_mem;
+	ring->br_rx = (struct librpc_ring_header *)((char *)ring->br_mem +
+	    LIBRPC_RING_SPAN);
+	return (0);
+
+fail:
+	bus_ring_free(ring);
+	conn->bc_ring = NULL;
+	return (-1);
+}
+
+static void
+bus_ring_free(struct bus_ring *ring)
+{
+
+	if (ring->br_mem != MAP_FAILED)
+		munmap(ring->br_mem, LIBRPC_RING_MAP_SIZE);
+
+	if (ring->br_wakefd >= 0)
+		close(ring->br_wakefd);
+
+	if (ring->br_fd >= 0)
+		close(ring->br_fd);
+
+	g_mutex_clear(&ring->br_tx_mtx);
+	g_free(ring);
+}
+
+static void
+bus_ring_copy_in(struct librpc_ring_header *ring, uint64_t pos,
+    const void *buf, size_t len)
+{
+	char *data = (char *)(ring + 1);
+	size_t offset = (size_t)(pos % LIBRPC_RING_SIZE);
+	size_t chunk = MIN(len, LIBRPC_RING_SIZE - offset);
+
+	memcpy(data + offset, buf, chunk);
+	memcpy(data, (const char *)buf + chunk, len - chunk);
+}
+
+static void
+bus_ring_copy_out(struct librpc_ring_header *ring, uint64_t pos, void *buf,
+    size_t len)
+{
+	char *data = (char *)(ring + 1);
+	size_t offset = (size_t)(pos % LIBRPC_RING_SIZE);
+	size_t chunk = MIN(len, LIBRPC_RING_SIZE - offset);
+
+	memcpy(buf, data + offset, chunk);
+	memcpy((char *)buf + chunk, data, len - chunk);
+}
+
+static int
+bus_ring_send_msg(void *arg, const void *buf, size_t len,
+    const int *fds __unused, size_t nfds __unused)
+{
+	struct bus_connection *conn = arg;
+	struct librpc_ring_header *tx = conn->bc_ring->br_tx;
+	struct librpc_ring_record rec = {
+		.len = (uint32_t)len,
+		.opcode = LIBRPC_REQUEST,
+		.address = conn->bc_address
+	};
+	uint64_t head;
+	uint64_t tail;
+	int ret = 0;
+
+	if (len > LIBRPC_RING_MAX_RECORD)
+		return (EMSGSIZE);
+
+	g_mutex_lock(&conn->bc_ring->br_tx_mtx);
+	head = tx->head;
+	tail = __atomic_load_n(&tx->tail, __ATOMIC_ACQUIRE);
+	if (LIBRPC_RING_SIZE - (head - tail) < sizeof(rec) + len) {
+		/* The kernel empties the ring before the kick returns */
+		if (ioctl(conn->bc_ring->br_fd, LIBRPC_IOC_KICK) != 0) {
+			ret = errno;
+			goto done;
+		}
+
+		tail = __atomic_load_n(&tx->tail, __ATOMIC_ACQUIRE);
+		if (LIBRPC_RING_SIZE - (head - tail) < sizeof(rec) + len) {
+			ret = ENOBUFS;
+			goto done;
+		}
+	}
+
+	bus_ring_copy_in(tx, head, &rec, sizeof(rec));
+	bus_ring_copy_in(tx, head + sizeof(rec), buf, len);
+	__atomic_store_n(&tx->head, head + sizeof(rec) + len, __ATOMIC_RELEASE);
+
+	if (ioctl(conn->bc_ring->br_fd, LIBRPC_IOC_KICK) != 0)
+		ret = errno;
+
+done:
+	g_mutex_unlock(&conn->bc_ring->br_tx_mtx);
+	return (ret);
+}
+
+/*
+ * Hands everything in the RX ring over to the connection. Payloads are
+ * passed straight out of the ring unless they wrap around its end.
+ */
+static bool
+bus_ring_drain(struct bus_connection *conn)
+{
+	struct bus_ring *ring = conn->bc_ring;
+	struct librpc_ring_header *rx = ring->br_rx;
+	struct librpc_ring_record rec;
+	struct librpc_message msg;
+	uint64_t head;
+	uint64_t tail;
+	size_t offset;
+	void *payload;
+	void *copy;
+
+	tail = rx->tail;
+	head = __atomic_load_n(&rx->head, __ATOMIC_ACQUIRE);
+
+	while (head - tail >= sizeof(rec)) {
+		bus_ring_copy_out(rx, tail, &rec, sizeof(rec));
+		if (rec.len > LIBRPC_RING_MAX_RECORD ||
+		    head - tail - sizeof(rec) < rec.len)
+			return (false);
+
+		copy = NULL;
+		offset = (size_t)((tail + sizeof(rec)) % LIBRPC_RING_SIZE);
+		if (offset + rec.len <= LIBRPC_RING_SIZE)
+			payload = (char *)(rx + 1) + offset;
+		else {
+			copy = g_malloc(rec.len);
+			bus_ring_copy_out(rx, tail + sizeof(rec), copy,
+			    rec.len);
+			payload = copy;
+		}
+
+		msg.opcode = rec.opcode;
+		msg.address = rec.address;
+		msg.status = rec.status;
+		bus_process_message(conn, &msg, payload, rec.len);
+		g_free(copy);
+
+		tail += sizeof(rec) + rec.len;
+		__atomic_store_n(&rx->tail, tail, __ATOMIC_RELEASE);
+
+		if (ring->br_orphaned)
+			return (false);
+	}
+
+	return (true);
+}
+
+static void *
+bus_ring_reader(void *arg)
+{
+	struct bus_connection *conn = arg;
+	struct bus_ring *ring = conn->bc_ring;
+	struct pollfd pfd[2] = {
+		{ .fd = ring->br_fd, .events = POLLIN },
+		{ .fd = ring->br_wakefd, .events = POLLIN }
+	};
+
+	for (;;) {
+		if (poll(pfd, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+
+			break;
+		}
+
+		if (pfd[1].revents != 0)
+			return (NULL);
+
+		if (!bus_ring_drain(conn))
+			break;
+
+		if (pfd[0].revents & (POLLHUP | POLLERR))
+			break;
+	}
+
+	if (!ring->br_orphaned)
+		conn->bc_parent->rco_close(conn->bc_parent);
+
+	/* Aborted from this very thread; nobody is left to join us */
+	if (ring->br_orphaned) {
+		g_thread_unref(ring->br_thread);
+		bus_ring_free(ring);
+		g_free(conn);
+	}
+
+	return (NULL);
+}
+
+static int
+bus_ring_abort(void *arg)
+{
+	struct bus_connection *conn = arg;
+	struct bus_ring *ring = conn->bc_ring;
+
+	if (g_thread_self() == ring->br_thread) {
+		ring->br_orphaned = true;
+		return (0);
+	}
+
+	eventfd_write(ring->br_wakefd, 1);
+	g_thread_join(ring->br_thread);
+	bus_ring_free(ring);
+	g_free(conn);
+	return (0);
+}
+
+static int
+bus_ring_get_fd(void *arg)
+{
+	struct bus_connection *conn = arg;
+
+	return (conn->bc_ring->br_fd);
+}
+
 static void *
 bus_reader(void *arg)
 {
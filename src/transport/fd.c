@@ -25,8 +25,10 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <sys/uio.h>
 #include <glib.h>
 #include <yuarel.h>
 #include "../linker_set.h"
@@ -35,11 +37,18 @@
 static int fd_connect(struct rpc_connection *, const char *, rpc_object_t);
 static int fd_listen(struct rpc_server *, const char *, rpc_object_t);
 
+#define	FD_HEADER_SIZE	(4 * sizeof(uint32_t))
+#define	FD_RBUF_SIZE	(64 * 1024)
+
 struct fd_connection
 {
 	GThread *		thread;
 	struct rpc_connection *	parent;
 	int			fd;
+	char *			rbuf;
+	size_t			rbuf_size;
+	size_t			rbuf_off;
+	size_t			rbuf_len;
 };
 
 struct fd_server
@@ -56,12 +65,20 @@ static const struct rpc_transport fd_transport = {
 };
 
 static ssize_t
-xread(int fd, void *buf, size_t nbytes)
+xwritev(int fd, struct iovec *iov, int iovcnt)
 {
 	ssize_t ret, done = 0;
 
-	while (done < (ssize_t)nbytes) {
-		ret = read(fd, (buf + done), nbytes - done);
+	for (;;) {
+		while (iovcnt > 0 && iov->iov_len == 0) {
+			iov++;
+			iovcnt--;
+		}
+
+		if (iovcnt == 0)
+			break;
+
+		ret = writev(fd, iov, iovcnt);
 		if (ret == 0)
 			return (-1);
 
@@ -73,18 +90,65 @@ xread(int fd, void *buf, size_t nbytes)
 		}
 
 		done += ret;
+
+		/* Partial write: skip what went out and resume mid-iovec */
+		while (iovcnt > 0 && (size_t)ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + ret;
+			iov->iov_len -= (size_t)ret;
+		}
 	}
 
 	return (done);
 }
 
-static ssize_t
-xwrite(int fd, const void *buf, size_t nbytes)
+/*
+ * Makes sure at least `need` unconsumed bytes sit in the read buffer.
+ * Each read() asks for as much as the buffer can hold, so a burst of
+ * small frames is picked up by a single syscall. The buffer only grows
+ * past FD_RBUF_SIZE for frames that don't fit, and shrinks back once
+ * such a frame has been consumed.
+ */
+static int
+fd_fill(struct fd_connection *fdconn, size_t need)
 {
-	ssize_t ret, done = 0;
+	size_t avail = fdconn->rbuf_len - fdconn->rbuf_off;
+	size_t size;
+	ssize_t ret;
 
-	while (done < (ssize_t)nbytes) {
-		ret = write(fd, (buf + done), nbytes - done);
+	if (avail >= need)
+		return (0);
+
+	if (avail == 0) {
+		fdconn->rbuf_off = 0;
+		fdconn->rbuf_len = 0;
+	}
+
+	if (fdconn->rbuf_off + need > fdconn->rbuf_size) {
+		if (avail > 0) {
+			memmove(fdconn->rbuf, fdconn->rbuf + fdconn->rbuf_off,
+			    avail);
+		}
+
+		fdconn->rbuf_off = 0;
+		fdconn->rbuf_len = avail;
+	}
+
+	size = MAX(need, FD_RBUF_SIZE);
+	if (fdconn->rbuf_size < need || (fdconn->rbuf_size > size &&
+	    fdconn->rbuf_len == 0)) {
+		fdconn->rbuf = g_realloc(fdconn->rbuf, size);
+		fdconn->rbuf_size = size;
+	}
+
+	while (fdconn->rbuf_len - fdconn->rbuf_off < need) {
+		ret = read(fdconn->fd, fdconn->rbuf + fdconn->rbuf_len,
+		    fdconn->rbuf_size - fdconn->rbuf_len);
 		if (ret == 0)
 			return (-1);
 
@@ -95,33 +159,36 @@ xwrite(int fd, const void *buf, size_t nbytes)
 			return (-1);
 		}
 
-		done += ret;
+		fdconn->rbuf_len += (size_t)ret;
 	}
 
-	return (done);
+	return (0);
 }
 
+/*
+ * Returns a pointer into the read buffer; the frame stays valid until
+ * the next call.
+ */
 static int
-fd_recv_msg(struct fd_connection *fdconn, void **frame, size_t *size)
+fd_recv_msg(struct fd_connection *fdconn, const void **frame, size_t *size)
 {
 	uint32_t header[4];
 	size_t length;
 
-	if (xread(fdconn->fd, header, sizeof(header)) < 0)
+	if (fd_fill(fdconn, FD_HEADER_SIZE) != 0)
 		return (-1);
 
+	memcpy(header, fdconn->rbuf + fdconn->rbuf_off, sizeof(header));
 	if (header[0] != 0xdeadbeef)
 		return (-1);
 
 	length = header[1];
-	*frame = g_malloc(length);
-	*size = length;
-
-	if (xread(fdconn->fd, *frame, length) < 0) {
-		g_free(*frame);
+	if (fd_fill(fdconn, FD_HEADER_SIZE + length) != 0)
 		return (-1);
-	}
 
+	*frame = fdconn->rbuf + fdconn->rbuf_off + FD_HEADER_SIZE;
+	*size = length;
+	fdconn->rbuf_off += FD_HEADER_SIZE + length;
 	return (0);
 }
 
@@ -131,11 +198,12 @@ fd_send_msg(void *arg, const void *buf, size_t size, const int *fds __unused,
 {
 	struct fd_connection *fdconn = arg;
 	uint32_t header[4] = { 0xdeadbeef, (uint32_t)size, 0, 0 };
+	struct iovec iov[2] = {
+		{ .iov_base = header, .iov_len = sizeof(header) },
+		{ .iov_base = (void *)buf, .iov_len = size }
+	};
 
-	if (xwrite(fdconn->fd, header, sizeof(header)) < 0)
-		return (-1);
-
-	if (xwrite(fdconn->fd, buf, size) < 0)
+	if (xwritev(fdconn->fd, iov, 2) < 0)
 		return (-1);
 
 	return (0);
@@ -167,7 +235,7 @@ static void *
 fd_reader(void *arg)
 {
 	struct fd_connection *fdconn = arg;
-	void *frame;
+	const void *frame;
 	size_t len;
 
 	for (;;) {
@@ -175,14 +243,15 @@ fd_reader(void *arg)
 			break;
 
 		if (fdconn->parent->rco_recv_msg(fdconn->parent, frame, len,
-		    NULL, 0) != 0) {
-			g_free(frame);
+		    NULL, 0) != 0)
 			break;
-		}
-
-		g_free(frame);
 	}
 
+	g_free(fdconn->rbuf);
+	fdconn->rbuf = NULL;
+	fdconn->rbuf_size = 0;
+	fdconn->rbuf_off = 0;
+	fdconn->rbuf_len = 0;
 	fdconn->parent->rco_close(fdconn->parent);
 	return (NULL);
 }
@@ -223,7 +292,8 @@ fd_connect(struct rpc_connection *rco, const char *uri_string,
 	rco->rco_get_fd = fd_get_fd;
 	rco->rco_release = fd_release;
 	rco->rco_arg = fdconn;
-	fdconn->thread = g_thread_new("fd client", fd_reader, fdconn);
+	fdconn->thread = rpc_thread_new(RPC_THREAD_IO, "fd client", fd_reader,
+	    fdconn);
 
 	return (0);
 }
@@ -261,7 +331,8 @@ fd_listen(struct rpc_server *srv, const char *uri_string,
 	fdsrv->conn.parent->rco_get_fd = fd_get_fd;
 	fdsrv->conn.parent->rco_release = fd_release;
 	fdsrv->conn.parent->rco_arg = &fdsrv->conn;
-	fdsrv->conn.thread = g_thread_new("fd client", fd_reader, &fdsrv->conn);
+	fdsrv->conn.thread = rpc_thread_new(RPC_THREAD_IO, "fd client",
+	    fd_reader, &fdsrv->conn);
 
 	srv->rs_accept(srv, fdsrv->conn.parent);
 	return (0);
@@ -27,11 +27,16 @@
 
 #include <errno.h>
 #include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
 #include <glib.h>
 #include <libsoup/soup.h>
 #include <libusb.h>
 #include <yuarel.h>
 #include <rpc/object.h>
+#include <rpc/bus.h>
 #include "../internal.h"
 #include "../linker_set.h"
 
@@ -40,6 +45,12 @@
 #endif
 
 #define	LIBRPC_USB_VID		0xbeef
+#define	USB_BULK_MAX_TRANSFERS	32
+#define	USB_BULK_BUF_SIZE	(64 * 1024)
+#define	USB_BULK_TIMEOUT	5000
+#define	USB_LOG_RING_SIZE	(256 * 1024)
+#define	USB_LOG_CHUNK		(16 * 1024)
+#define	USB_LOG_INTERVAL	500
 
 struct usb_context;
 struct usb_connection;
@@ -65,6 +76,15 @@ static gboolean usb_send_msg_impl(void *);
 static gboolean usb_event_impl(void *);
 static void *usb_libusb_thread(void *);
 static void usb_release(void *);
+static int usb_bulk_setup(struct usb_connection *, unsigned int);
+static void usb_bulk_teardown(struct usb_connection *);
+static int usb_bulk_send_msg(void *, const void *, size_t, const int *,
+    size_t);
+static void usb_bulk_tx_done(struct libusb_transfer *);
+static void usb_bulk_rx_done(struct libusb_transfer *);
+static gboolean usb_bulk_close_impl(void *);
+static size_t usb_log_flush(struct usb_connection *);
+static void *usb_log_thread(void *);
 
 enum librpc_usb_opcode
 {
@@ -116,6 +136,12 @@ struct usb_send_state
 	size_t 				uss_len;
 };
 
+struct usb_bulk_send
+{
+	struct usb_connection *		ubs_conn;
+	bool				ubs_done;
+};
+
 struct usb_hotplug_state
 {
 	struct usb_context *		uss_ctx;
@@ -145,6 +171,23 @@ struct usb_connection
 	struct usb_thread_state		uc_state;
 	size_t 				uc_logsize;
 	int				uc_logfd;
+	/* Bulk transfer mode, see RPC_USB_TRANSFERS */
+	unsigned int			uc_bulk_depth;
+	int				uc_bulk_iface;
+	uint8_t				uc_bulk_in;
+	uint8_t				uc_bulk_out;
+	struct libusb_transfer **	uc_bulk_rx;
+	unsigned int			uc_bulk_rx_active;
+	unsigned int			uc_bulk_tx_active;
+	GByteArray *			uc_bulk_partial;
+	GCond				uc_bulk_cv;
+	bool				uc_bulk_closing;
+	/* Log streaming, see RPC_USB_LOG_STREAM */
+	GThread *			uc_log_thread;
+	int				uc_log_wakefd;
+	char *				uc_log_ring;
+	uint64_t			uc_log_head;
+	uint64_t			uc_log_tail;
 };
 
 struct rpc_bus_transport libusb_bus_ops = {
@@ -297,8 +340,8 @@ usb_open(GMainContext *main_context)
 
 	ctx->uc_devices = g_hash_table_new_full(g_int_hash, g_int_equal, NULL,
 	    (GDestroyNotify)usb_free_node);
-	ctx->uc_thread = g_thread_new("libusb worker", usb_libusb_thread,
-	    &ctx->uc_state);
+	ctx->uc_thread = rpc_thread_new(RPC_THREAD_IO, "libusb worker",
+	    usb_libusb_thread, &ctx->uc_state);
 	return (ctx);
 }
 
@@ -323,6 +366,8 @@ usb_connect(struct rpc_connection *rco, const char *uri_string,
 	struct yuarel uri;
 	struct usb_connection *conn;
 	struct librpc_usb_identification ident;
+	unsigned int transfers = 0;
+	bool log_stream = false;
 
 	if (yuarel_parse(&uri, uri_copy) != 0) {
 		rpc_set_last_errorf(EINVAL, "Cannot parse URI");
@@ -334,11 +379,20 @@ usb_connect(struct rpc_connection *rco, const char *uri_string,
 	g_mutex_init(&conn->uc_mtx);
 	libusb_init(&conn->uc_libusb);
 
-	rpc_object_unpack(args, "f", &conn->uc_logfd);
+	if (args != NULL && rpc_get_type(args) == RPC_TYPE_DICTIONARY) {
+		if (rpc_dictionary_has_key(args, RPC_USB_LOG_FD))
+			conn->uc_logfd = rpc_fd_get_value(
+			    rpc_dictionary_get_value(args, RPC_USB_LOG_FD));
+
+		transfers = (unsigned int)MIN(rpc_dictionary_get_uint64(args,
+		    RPC_USB_TRANSFERS), USB_BULK_MAX_TRANSFERS);
+		log_stream = rpc_dictionary_get_bool(args, RPC_USB_LOG_STREAM);
+	} else
+		rpc_object_unpack(args, "f", &conn->uc_logfd);
 
 	conn->uc_state.uts_libusb = conn->uc_libusb;
 	conn->uc_state.uts_exit = false;
-	conn->uc_libusb_thread = g_thread_new("libusb worker",
+	conn->uc_libusb_thread = rpc_thread_new(RPC_THREAD_IO, "libusb worker",
 	    usb_libusb_thread, &conn->uc_state);
 
 	if (uri.host != NULL)
@@ -359,14 +413,35 @@ usb_connect(struct rpc_connection *rco, const char *uri_string,
 		goto error;
 	}
 
-	conn->uc_event_source = g_timeout_source_new(500);
-	g_source_set_callback(conn->uc_event_source, usb_event_impl, conn,
-	    NULL);
-	g_source_attach(conn->uc_event_source, rco->rco_main_context);
+	conn->uc_rco = rco;
+	if (transfers > 0 && usb_bulk_setup(conn, transfers) != 0)
+		goto error;
 
 	conn->uc_logsize = ident.log_size;
-	conn->uc_rco = rco;
-	rco->rco_send_msg = usb_send_msg;
+	if (log_stream && conn->uc_logfd != -1) {
+		conn->uc_log_wakefd = eventfd(0, EFD_CLOEXEC);
+		if (conn->uc_log_wakefd < 0) {
+			rpc_set_last_errorf(errno, "Cannot create eventfd: %s",
+			    strerror(errno));
+			if (conn->uc_bulk_depth > 0)
+				usb_bulk_teardown(conn);
+
+			goto error;
+		}
+
+		/* The reader holds the connection until usb_abort() joins it */
+		conn->uc_log_ring = g_malloc(USB_LOG_RING_SIZE);
+		rpc_connection_retain(rco);
+		conn->uc_log_thread = rpc_thread_new(RPC_THREAD_IO,
+		    "libusb log reader", usb_log_thread, conn);
+	} else {
+		conn->uc_event_source = g_timeout_source_new(500);
+		g_source_set_callback(conn->uc_event_source, usb_event_impl,
+		    conn, NULL);
+		g_source_attach(conn->uc_event_source, rco->rco_main_context);
+	}
+
+	rco->rco_send_msg = transfers > 0 ? usb_bulk_send_msg : usb_send_msg;
 	rco->rco_abort = usb_abort;
 	rco->rco_get_fd = usb_get_fd;
 	rco->rco_arg = conn;
@@ -404,9 +479,21 @@ usb_abort(void *arg)
 {
 	struct usb_connection *conn = arg;
 
+	if (conn->uc_log_thread != NULL) {
+		eventfd_write(conn->uc_log_wakefd, 1);
+		g_thread_join(conn->uc_log_thread);
+		close(conn->uc_log_wakefd);
+		g_free(conn->uc_log_ring);
+		conn->uc_log_thread = NULL;
+	}
+
+	if (conn->uc_bulk_depth > 0)
+		usb_bulk_teardown(conn);
+
 	g_mutex_lock(&conn->uc_mtx);
 	conn->uc_state.uts_exit = true;
-	g_source_destroy(conn->uc_event_source);
+	if (conn->uc_event_source != NULL)
+		g_source_destroy(conn->uc_event_source);
 	g_mutex_unlock(&conn->uc_mtx);
 	libusb_close(conn->uc_handle);
 	libusb_exit(conn->uc_libusb);
@@ -703,12 +790,371 @@ disconnected:
 	return (false);
 }
 
+/*
+ * Writes out as much of the log ring as the log descriptor takes without
+ * blocking. A pipe that polls writable takes at least PIPE_BUF bytes, so
+ * writes never go beyond that. Returns the number of bytes left.
+ */
+static size_t
+usb_log_flush(struct usb_connection *conn)
+{
+	struct pollfd pfd = { .fd = conn->uc_logfd, .events = POLLOUT };
+	size_t offset;
+	size_t chunk;
+	ssize_t ret;
+
+	while (conn->uc_log_head != conn->uc_log_tail) {
+		if (poll(&pfd, 1, 0) != 1 || !(pfd.revents & POLLOUT))
+			break;
+
+		offset = (size_t)(conn->uc_log_tail % USB_LOG_RING_SIZE);
+		chunk = MIN((size_t)(conn->uc_log_head - conn->uc_log_tail),
+		    USB_LOG_RING_SIZE - offset);
+		ret = write(conn->uc_logfd, conn->uc_log_ring + offset,
+		    MIN(chunk, PIPE_BUF));
+		if (ret <= 0)
+			break;
+
+		conn->uc_log_tail += (size_t)ret;
+	}
+
+	return ((size_t)(conn->uc_log_head - conn->uc_log_tail));
+}
+
+static void *
+usb_log_thread(void *arg)
+{
+	struct usb_connection *conn = arg;
+	struct rpc_connection *rco = conn->uc_rco;
+	struct librpc_usb_log *log;
+	struct pollfd pfd[2];
+	size_t chunk = MAX(conn->uc_logsize, USB_LOG_CHUNK);
+	size_t pending;
+	size_t offset;
+	size_t len;
+	size_t n;
+	int timeout;
+	int ret;
+
+	chunk = MIN(chunk, UINT16_MAX - sizeof(*log));
+	log = g_malloc(sizeof(*log) + chunk);
+
+	for (;;) {
+		pending = usb_log_flush(conn);
+		len = 0;
+
+		/* Leave the device alone while there is no room for more */
+		if (USB_LOG_RING_SIZE - pending >= chunk) {
+			log->status = LIBRPC_USB_ERROR;
+			ret = usb_xfer(conn->uc_handle, LIBRPC_USB_READ_LOG, log,
+			    sizeof(*log) + chunk, 500);
+			if (ret < 1) {
+				rpc_connection_retain(rco);
+				g_main_context_invoke(rco->rco_main_context,
+				    usb_bulk_close_impl, rco);
+				break;
+			}
+
+			if (log->status == LIBRPC_USB_OK && ret > 1) {
+				len = (size_t)ret - 1;
+				offset = (size_t)(conn->uc_log_head %
+				    USB_LOG_RING_SIZE);
+				n = MIN(len, USB_LOG_RING_SIZE - offset);
+				memcpy(conn->uc_log_ring + offset, log->buffer, n);
+				memcpy(conn->uc_log_ring, log->buffer + n, len - n);
+				conn->uc_log_head += len;
+				pending += len;
+			}
+		}
+
+		/*
+		 * Come back right away while the device has more to give,
+		 * otherwise once the reader makes room or it is time to poll
+		 * the device again.
+		 */
+		timeout = len == chunk ? 0 : USB_LOG_INTERVAL;
+		pfd[0] = (struct pollfd){ .fd = conn->uc_log_wakefd,
+		    .events = POLLIN };
+		pfd[1] = (struct pollfd){ .fd = conn->uc_logfd,
+		    .events = pending > 0 ? POLLOUT : 0 };
+
+		if (poll(pfd, 2, timeout) < 0 && errno != EINTR)
+			break;
+
+		if (pfd[0].revents != 0)
+			break;
+	}
+
+	g_free(log);
+	rpc_connection_release(rco);
+	return (NULL);
+}
+
 static void
 usb_release(void *arg)
 {
 
 }
 
+/*
+ * Bulk transfer mode. Sends are submitted straight from the caller's
+ * buffer and the caller waits for its own transfer only, so up to
+ * uc_bulk_depth senders may have a transfer in flight at once. On the
+ * receiving side, uc_bulk_depth IN transfers are kept submitted at all
+ * times; their completion callbacks run on the libusb event thread.
+ */
+static int
+usb_bulk_setup(struct usb_connection *conn, unsigned int depth)
+{
+	struct libusb_config_descriptor *config;
+	const struct libusb_interface_descriptor *iface;
+	const struct libusb_endpoint_descriptor *ep;
+	struct libusb_transfer *xfer;
+	unsigned int i;
+	int ret;
+
+	if (libusb_get_active_config_descriptor(
+	    libusb_get_device(conn->uc_handle), &config) != 0) {
+		rpc_set_last_error(ENXIO, "Cannot read device configuration",
+		    NULL);
+		return (-1);
+	}
+
+	if (config->bNumInterfaces == 0 ||
+	    config->interface[0].num_altsetting == 0) {
+		libusb_free_config_descriptor(config);
+		rpc_set_last_error(ENXIO, "Device has no interfaces", NULL);
+		return (-1);
+	}
+
+	iface = &config->interface[0].altsetting[0];
+	for (i = 0; i < iface->bNumEndpoints; i++) {
+		ep = &iface->endpoint[i];
+		if ((ep->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK) !=
+		    LIBUSB_TRANSFER_TYPE_BULK)
+			continue;
+
+		if (ep->bEndpointAddress & LIBUSB_ENDPOINT_IN)
+			conn->uc_bulk_in = ep->bEndpointAddress;
+		else
+			conn->uc_bulk_out = ep->bEndpointAddress;
+	}
+
+	conn->uc_bulk_iface = iface->bInterfaceNumber;
+	libusb_free_config_descriptor(config);
+
+	if (conn->uc_bulk_in == 0 || conn->uc_bulk_out == 0) {
+		rpc_set_last_error(ENXIO, "Device has no bulk endpoints", NULL);
+		return (-1);
+	}
+
+	ret = libusb_claim_interface(conn->uc_handle, conn->uc_bulk_iface);
+	if (ret != 0) {
+		rpc_set_last_errorf(EBUSY, "Cannot claim interface: %s",
+		    libusb_error_name(ret));
+		return (-1);
+	}
+
+	g_cond_init(&conn->uc_bulk_cv);
+	conn->uc_bulk_depth = depth;
+	conn->uc_bulk_partial = g_byte_array_new();
+	conn->uc_bulk_rx = g_malloc0_n(depth, sizeof(*conn->uc_bulk_rx));
+
+	for (i = 0; i < depth; i++) {
+		xfer = libusb_alloc_transfer(0);
+		libusb_fill_bulk_transfer(xfer, conn->uc_handle,
+		    conn->uc_bulk_in, g_malloc(USB_BULK_BUF_SIZE),
+		    USB_BULK_BUF_SIZE, usb_bulk_rx_done, conn, 0);
+		xfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+		conn->uc_bulk_rx[i] = xfer;
+
+		g_mutex_lock(&conn->uc_mtx);
+		if (libusb_submit_transfer(xfer) == 0)
+			conn->uc_bulk_rx_active++;
+		g_mutex_unlock(&conn->uc_mtx);
+	}
+
+	if (conn->uc_bulk_rx_active == 0) {
+		usb_bulk_teardown(conn);
+		rpc_set_last_error(EIO, "Cannot submit bulk transfers", NULL);
+		return (-1);
+	}
+
+	return (0);
+}
+
+static void
+usb_bulk_teardown(struct usb_connection *conn)
+{
+	unsigned int i;
+
+	g_mutex_lock(&conn->uc_mtx);
+	conn->uc_bulk_closing = true;
+	g_cond_broadcast(&conn->uc_bulk_cv);
+
+	for (i = 0; i < conn->uc_bulk_depth; i++)
+		libusb_cancel_transfer(conn->uc_bulk_rx[i]);
+
+	/* Completion callbacks still run on the libusb thread */
+	while (conn->uc_bulk_rx_active > 0 || conn->uc_bulk_tx_active > 0)
+		g_cond_wait(&conn->uc_bulk_cv, &conn->uc_mtx);
+	g_mutex_unlock(&conn->uc_mtx);
+
+	for (i = 0; i < conn->uc_bulk_depth; i++)
+		libusb_free_transfer(conn->uc_bulk_rx[i]);
+
+	libusb_release_interface(conn->uc_handle, conn->uc_bulk_iface);
+	g_byte_array_unref(conn->uc_bulk_partial);
+	g_free(conn->uc_bulk_rx);
+	g_cond_clear(&conn->uc_bulk_cv);
+	conn->uc_bulk_depth = 0;
+}
+
+static int
+usb_bulk_send_msg(void *arg, const void *buf, size_t len,
+    const int *fds __unused, size_t nfds __unused)
+{
+	struct usb_connection *conn = arg;
+	struct usb_bulk_send send = { .ubs_conn = conn, .ubs_done = false };
+	struct libusb_transfer *xfer;
+	int status = LIBUSB_TRANSFER_ERROR;
+	int ret;
+
+	g_mutex_lock(&conn->uc_mtx);
+	while (!conn->uc_bulk_closing &&
+	    conn->uc_bulk_tx_active >= conn->uc_bulk_depth)
+		g_cond_wait(&conn->uc_bulk_cv, &conn->uc_mtx);
+
+	if (conn->uc_bulk_closing) {
+		g_mutex_unlock(&conn->uc_mtx);
+		return (-1);
+	}
+
+	conn->uc_bulk_tx_active++;
+	g_mutex_unlock(&conn->uc_mtx);
+
+	xfer = libusb_alloc_transfer(0);
+	libusb_fill_bulk_transfer(xfer, conn->uc_handle, conn->uc_bulk_out,
+	    (unsigned char *)buf, (int)len, usb_bulk_tx_done, &send,
+	    USB_BULK_TIMEOUT);
+	xfer->flags = LIBUSB_TRANSFER_ADD_ZERO_PACKET;
+	ret = libusb_submit_transfer(xfer);
+
+	g_mutex_lock(&conn->uc_mtx);
+	if (ret == 0) {
+		while (!send.ubs_done)
+			g_cond_wait(&conn->uc_bulk_cv, &conn->uc_mtx);
+
+		status = xfer->status;
+	}
+
+	conn->uc_bulk_tx_active--;
+	g_cond_broadcast(&conn->uc_bulk_cv);
+	g_mutex_unlock(&conn->uc_mtx);
+
+	libusb_free_transfer(xfer);
+	if (status != LIBUSB_TRANSFER_COMPLETED) {
+		debugf("bulk transfer failed, ret=%d, status=%d", ret, status);
+		return (-1);
+	}
+
+	return (0);
+}
+
+static void
+usb_bulk_tx_done(struct libusb_transfer *xfer)
+{
+	struct usb_bulk_send *send = xfer->user_data;
+	struct usb_connection *conn = send->ubs_conn;
+
+	g_mutex_lock(&conn->uc_mtx);
+	send->ubs_done = true;
+	g_cond_broadcast(&conn->uc_bulk_cv);
+	g_mutex_unlock(&conn->uc_mtx);
+}
+
+/*
+ * A message ends with a short (possibly zero length) packet; transfers
+ * that fill the whole buffer carry the beginning of a larger message.
+ */
+static void
+usb_bulk_rx_done(struct libusb_transfer *xfer)
+{
+	struct usb_connection *conn = xfer->user_data;
+	struct rpc_connection *rco = conn->uc_rco;
+	GByteArray *partial = conn->uc_bulk_partial;
+	size_t len = (size_t)xfer->actual_length;
+	bool closing;
+
+	switch (xfer->status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		if (len == USB_BULK_BUF_SIZE) {
+			g_byte_array_append(partial, xfer->buffer, (guint)len);
+			break;
+		}
+
+		if (partial->len > 0) {
+			g_byte_array_append(partial, xfer->buffer, (guint)len);
+			conn->uc_rco->rco_recv_msg(conn->uc_rco, partial->data,
+			    partial->len, NULL, 0);
+			g_byte_array_set_size(partial, 0);
+			break;
+		}
+
+		if (len > 0)
+			conn->uc_rco->rco_recv_msg(conn->uc_rco, xfer->buffer,
+			    len, NULL, 0);
+		break;
+
+	case LIBUSB_TRANSFER_TIMED_OUT:
+		break;
+
+	default:
+		goto gone;
+	}
+
+	g_mutex_lock(&conn->uc_mtx);
+	if (!conn->uc_bulk_closing && libusb_submit_transfer(xfer) == 0) {
+		g_mutex_unlock(&conn->uc_mtx);
+		return;
+	}
+	g_mutex_unlock(&conn->uc_mtx);
+
+gone:
+	/*
+	 * Teardown may go ahead as soon as rx_active drops, so the
+	 * connection is retained before that, for the close below.
+	 */
+	g_mutex_lock(&conn->uc_mtx);
+	closing = conn->uc_bulk_closing;
+	if (!closing)
+		rpc_connection_retain(rco);
+
+	conn->uc_bulk_rx_active--;
+	g_cond_broadcast(&conn->uc_bulk_cv);
+	g_mutex_unlock(&conn->uc_mtx);
+
+	if (closing)
+		return;
+
+	/* The device went away; close from outside of the libusb thread */
+	g_main_context_invoke(rco->rco_main_context, usb_bulk_close_impl,
+	    rco);
+}
+
+/*
+ * Takes over a reference to the connection.
+ */
+static gboolean
+usb_bulk_close_impl(void *arg)
+{
+	struct rpc_connection *rco = arg;
+
+	rco->rco_close(rco);
+	rpc_connection_release(rco);
+	return (false);
+}
+
 static void *
 usb_libusb_thread(void *arg)
 {
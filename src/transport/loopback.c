@@ -39,10 +39,17 @@ struct loopback_channel
     	struct rpc_server *		lc_srv;
 };
 
+/*
+ * ll_mtx serializes teardown only. Senders never take it: they announce
+ * themselves in ll_senders for the few instructions it takes to pick up
+ * and retain the peer connection, and teardown waits for that count to
+ * drain before unlinking or freeing either side.
+ */
 struct looplock
 {
 	int				ll_refcnt;
 	GMutex				ll_mtx;
+	volatile gint			ll_senders;
 };
 
 struct loopback
@@ -50,7 +57,7 @@ struct loopback
 	rpc_connection_t		lb_conn;
 	struct loopback *		lb_peer;
 	bool				lb_is_srv;
-	bool				lb_closed;
+	volatile gint			lb_closed;
         struct looplock *		lb_lock;
 };
 
@@ -64,6 +71,7 @@ static int loopback_send_msg(void *, const void *, size_t, const int *, size_t);
 static void loopback_release(void *);
 static int loopback_lock_free(struct loopback *);
 static bool loopback_supports_fd_passing(struct rpc_connection *);
+static void loopback_drain(struct looplock *);
 
 static GHashTable *loopback_channels = NULL;
 
@@ -186,18 +194,22 @@ loopback_send_msg(void *arg, const void *buf, size_t len __unused,
     const int *fds, size_t nfds)
 {
 	struct loopback *lb = arg;
+	struct loopback *peer;
+	struct looplock *lock = lb->lb_lock;
 	struct rpc_connection *peer_conn;
 	rpc_object_t obj = (void *)buf;
 	int ret;
 
-	g_mutex_lock(&lb->lb_lock->ll_mtx);
-	if (lb->lb_closed || lb->lb_peer == NULL || lb->lb_peer->lb_closed) {
-		g_mutex_unlock(&lb->lb_lock->ll_mtx);
+	g_atomic_int_inc(&lock->ll_senders);
+	peer = g_atomic_pointer_get(&lb->lb_peer);
+	if (g_atomic_int_get(&lb->lb_closed) || peer == NULL ||
+	    g_atomic_int_get(&peer->lb_closed)) {
+		g_atomic_int_add(&lock->ll_senders, -1);
 		return (-1);
 	}
-	peer_conn = lb->lb_peer->lb_conn;
+	peer_conn = peer->lb_conn;
 	rpc_connection_retain(peer_conn);
-	g_mutex_unlock(&lb->lb_lock->ll_mtx);
+	g_atomic_int_add(&lock->ll_senders, -1);
 
 	rpc_retain(obj);
 	ret = (peer_conn->rco_recv_msg(peer_conn, (const void *)obj, 0,
@@ -219,13 +231,17 @@ loopback_abort(void *arg)
 		return (0);
 
 	g_mutex_lock(&lb->lb_lock->ll_mtx);
-	g_assert(!lb->lb_closed);
-	if (lb->lb_closed) {
+	g_assert(!g_atomic_int_get(&lb->lb_closed));
+	if (g_atomic_int_get(&lb->lb_closed)) {
 		debugf("Abort called on %p, %p already closed",
 			lb, lb->lb_conn);
 		g_mutex_unlock(&lb->lb_lock->ll_mtx);
 		return (0);
 	}
+	/* New senders back off from here on; let in-flight ones finish */
+	g_atomic_int_set(&lb->lb_closed, true);
+	loopback_drain(lb->lb_lock);
+
 	if (lb->lb_peer) {
 		g_assert_nonnull(lb->lb_peer->lb_peer);
 		if (!lb->lb_is_srv) {
@@ -233,12 +249,11 @@ loopback_abort(void *arg)
 			peer = lb_peer->lb_conn;
 			rpc_connection_retain(peer);
 		}
-		lb->lb_peer->lb_peer = NULL;
-		lb->lb_peer = NULL;
+		g_atomic_pointer_set(&lb->lb_peer->lb_peer, NULL);
+		g_atomic_pointer_set(&lb->lb_peer, NULL);
 	}
 
 	conn = lb->lb_conn;
-	lb->lb_closed = true;
 	rpc_connection_retain(conn);
 
 	g_mutex_unlock(&lb->lb_lock->ll_mtx);
@@ -253,6 +268,14 @@ loopback_abort(void *arg)
 	return (0);
 }
 
+static void
+loopback_drain(struct looplock *lock)
+{
+
+	while (g_atomic_int_get(&lock->ll_senders) != 0)
+		g_thread_yield();
+}
+
 static int
 loopback_teardown(struct rpc_server *srv __unused)
 {
@@ -268,7 +291,7 @@ loopback_lock_free(struct loopback *lb)
 
 	g_mutex_lock(&lb->lb_lock->ll_mtx);
 
-	g_assert(lb->lb_closed);
+	g_assert(g_atomic_int_get(&lb->lb_closed));
 	g_assert_nonnull(lb->lb_lock);
 
 	if (lb->lb_lock->ll_refcnt == 1) {
@@ -290,8 +313,10 @@ loopback_release(void *arg)
 
 	if (lb == NULL)
 		return;
-	g_assert(lb->lb_closed);
+	g_assert(g_atomic_int_get(&lb->lb_closed));
 
+	/* A peer's sender may still be looking at us */
+	loopback_drain(lb->lb_lock);
 	loopback_lock_free(lb);
 	g_free(lb);
 }
@@ -0,0 +1,521 @@
+/*
+ * Copyright 2015-2017 Two Pore Guys, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Multiplexed transport: many logical connections to the same endpoint
+ * share one physical connection, opened with the regular transport for
+ * the part of the URI after "mux+". Frames of logical connections travel
+ * wrapped in a msgpack ext carrying their channel ID.
+ *
+ * Channels are opened implicitly by the first frame a client sends on
+ * them and closed by an empty frame. The server side also serves plain
+ * clients: their frames are not wrapped and land on channel 0. It closes
+ * channels opened past RPC_SERVER_MUX_MAX_CHANNELS right back.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <glib.h>
+#include "../linker_set.h"
+#include "../internal.h"
+#include "../serializer/msgpack.h"
+
+#define	MUX_PREFIX		"mux+"
+#define	MUX_HDR_SIZE		10
+#define	MUX_MAX_CHANNELS	1024
+
+struct mux_carrier;
+
+static int mux_connect(struct rpc_connection *, const char *, rpc_object_t);
+static int mux_listen(struct rpc_server *, const char *, rpc_object_t);
+static int mux_accept(struct rpc_server *, struct rpc_connection *);
+static bool mux_supports_fd_passing(struct rpc_connection *);
+static struct mux_carrier *mux_carrier_new(const char *,
+    struct rpc_connection *);
+static void mux_carrier_unref(struct mux_carrier *);
+static int mux_carrier_recv(struct mux_carrier *, const void *, size_t,
+    const int *, size_t);
+static void mux_carrier_closed(struct mux_carrier *);
+static void *mux_carrier_reap(void *);
+static struct mux_channel *mux_channel_new(struct mux_carrier *,
+    struct rpc_connection *, uint32_t);
+static int mux_send_msg(void *, const void *, size_t, const int *, size_t);
+static int mux_send_msgv(void *, const struct iovec *, size_t, const int *,
+    size_t);
+static int mux_abort(void *);
+static int mux_get_fd(void *);
+static void mux_release(void *);
+
+static const struct rpc_transport mux_transport = {
+	.name = "mux",
+	.schemas = {"mux+unix", "mux+tcp", NULL},
+	.connect = mux_connect,
+	.listen = mux_listen,
+	.is_fd_passing = mux_supports_fd_passing,
+	.flags = RPC_TRANSPORT_FD_PASSING | RPC_TRANSPORT_CREDENTIALS
+};
+
+struct mux_carrier
+{
+	char *				mc_uri;
+	rpc_client_t			mc_client;
+	struct rpc_connection *		mc_conn;
+	struct rpc_server *		mc_server;
+	GMutex				mc_mtx;
+	GHashTable *			mc_channels;
+	guint				mc_max_channels;
+	uint32_t			mc_next_id;
+	bool				mc_closed;
+	volatile gint			mc_refcnt;
+};
+
+struct mux_channel
+{
+	struct mux_carrier *		mx_carrier;
+	struct rpc_connection *		mx_parent;
+	uint32_t			mx_id;
+	bool				mx_closed;
+};
+
+/* Client side carriers, by inner URI */
+static GMutex mux_carriers_mtx;
+static GHashTable *mux_carriers;
+
+static int
+mux_connect(struct rpc_connection *rco, const char *uri, rpc_object_t args)
+{
+	struct mux_carrier *carrier;
+	const char *inner = uri + strlen(MUX_PREFIX);
+	rpc_client_t client;
+
+	g_mutex_lock(&mux_carriers_mtx);
+	if (mux_carriers == NULL)
+		mux_carriers = g_hash_table_new(g_str_hash, g_str_equal);
+
+	carrier = g_hash_table_lookup(mux_carriers, inner);
+	if (carrier == NULL) {
+		carrier = mux_carrier_new(inner, NULL);
+		client = rpc_client_create(carrier->mc_uri, args);
+		if (client == NULL) {
+			g_mutex_unlock(&mux_carriers_mtx);
+			mux_carrier_unref(carrier);
+			return (-1);
+		}
+
+		carrier->mc_client = client;
+		carrier->mc_conn = rpc_client_get_connection(client);
+		rpc_connection_set_raw_message_handler(carrier->mc_conn,
+		    ^(const void *msg, size_t len, const int *fds, size_t nfds) {
+			return (mux_carrier_recv(carrier, msg, len, fds, nfds));
+		});
+		rpc_connection_set_error_handler(carrier->mc_conn,
+		    ^(rpc_error_code_t code, rpc_object_t error __unused) {
+			if (code == RPC_CONNECTION_CLOSED)
+				mux_carrier_closed(carrier);
+		});
+
+		g_hash_table_insert(mux_carriers, carrier->mc_uri, carrier);
+	}
+
+	g_mutex_lock(&carrier->mc_mtx);
+	mux_channel_new(carrier, rco, ++carrier->mc_next_id);
+	g_mutex_unlock(&carrier->mc_mtx);
+	g_mutex_unlock(&mux_carriers_mtx);
+	return (0);
+}
+
+static int
+mux_listen(struct rpc_server *srv, const char *uri, rpc_object_t args)
+{
+	const struct rpc_transport *transport;
+	const char *inner = uri + strlen(MUX_PREFIX);
+	char *scheme;
+
+	scheme = g_uri_parse_scheme(inner);
+	transport = rpc_find_transport(scheme);
+	g_free(scheme);
+
+	if (transport == NULL || transport->listen == NULL ||
+	    transport == &mux_transport) {
+		srv->rs_error = rpc_error_create(ENXIO, "Transport not found",
+		    NULL);
+		return (-1);
+	}
+
+	/* Physical connections become carriers as they are accepted */
+	srv->rs_accept = mux_accept;
+	return (transport->listen(srv, inner, args));
+}
+
+static int
+mux_accept(struct rpc_server *srv, struct rpc_connection *rco)
+{
+	struct mux_carrier *carrier;
+
+	if (rpc_server_accept(srv, rco) != 0)
+		return (-1);
+
+	carrier = mux_carrier_new(NULL, rco);
+	carrier->mc_server = srv;
+	carrier->mc_max_channels = MUX_MAX_CHANNELS;
+	if (srv->rs_params != NULL &&
+	    rpc_get_type(srv->rs_params) == RPC_TYPE_DICTIONARY &&
+	    rpc_dictionary_get_uint64(srv->rs_params,
+	    RPC_SERVER_MUX_MAX_CHANNELS) > 0)
+		carrier->mc_max_channels = (guint)MIN(rpc_dictionary_get_uint64(
+		    srv->rs_params, RPC_SERVER_MUX_MAX_CHANNELS), G_MAXUINT);
+
+	rpc_connection_set_raw_message_handler(rco,
+	    ^(const void *msg, size_t len, const int *fds, size_t nfds) {
+		return (mux_carrier_recv(carrier, msg, len, fds, nfds));
+	});
+	rpc_connection_set_error_handler(rco,
+	    ^(rpc_error_code_t code, rpc_object_t error __unused) {
+		if (code == RPC_CONNECTION_CLOSED)
+			mux_carrier_closed(carrier);
+	});
+
+	return (0);
+}
+
+static bool
+mux_supports_fd_passing(struct rpc_connection *rco)
+{
+	struct mux_channel *channel = rco->rco_arg;
+
+	return (channel->mx_carrier->mc_conn->rco_supports_fd_passing);
+}
+
+static struct mux_carrier *
+mux_carrier_new(const char *uri, struct rpc_connection *rco)
+{
+	struct mux_carrier *carrier;
+
+	carrier = g_malloc0(sizeof(*carrier));
+	carrier->mc_uri = g_strdup(uri);
+	carrier->mc_conn = rco;
+	carrier->mc_channels = g_hash_table_new(NULL, NULL);
+	carrier->mc_refcnt = 1;
+	g_mutex_init(&carrier->mc_mtx);
+	return (carrier);
+}
+
+static void
+mux_carrier_unref(struct mux_carrier *carrier)
+{
+
+	if (!g_atomic_int_dec_and_test(&carrier->mc_refcnt))
+		return;
+
+	g_hash_table_destroy(carrier->mc_channels);
+	g_mutex_clear(&carrier->mc_mtx);
+	g_free(carrier->mc_uri);
+	g_free(carrier);
+}
+
+static int
+mux_carrier_recv(struct mux_carrier *carrier, const void *msg, size_t len,
+    const int *fds, size_t nfds)
+{
+	struct mux_channel *channel;
+	struct mux_channel refused;
+	struct rpc_connection *rco;
+	const uint8_t *data = msg;
+	uint32_t id = 0;
+
+	if (len >= MUX_HDR_SIZE && data[0] == 0xc9 &&
+	    data[5] == MSGPACK_EXTTYPE_CHANNEL) {
+		memcpy(&id, &data[6], sizeof(id));
+		id = GUINT32_FROM_BE(id);
+		data += MUX_HDR_SIZE;
+		len -= MUX_HDR_SIZE;
+	}
+
+	g_mutex_lock(&carrier->mc_mtx);
+	channel = g_hash_table_lookup(carrier->mc_channels,
+	    GUINT_TO_POINTER(id));
+
+	if (channel == NULL && len > 0 && carrier->mc_server != NULL &&
+	    !carrier->mc_closed) {
+		/* First frame on a new channel */
+		if (g_hash_table_size(carrier->mc_channels) >=
+		    carrier->mc_max_channels) {
+			g_mutex_unlock(&carrier->mc_mtx);
+			debugf("Refusing channel %u: %u channels open", id,
+			    carrier->mc_max_channels);
+
+			/* Close it back so the client doesn't wait on it */
+			refused = (struct mux_channel){
+				.mx_carrier = carrier,
+				.mx_id = id
+			};
+			if (id != 0)
+				mux_send_msg(&refused, NULL, 0, NULL, 0);
+
+			return (0);
+		}
+
+		rco = rpc_connection_alloc(carrier->mc_server);
+		if (rco == NULL) {
+			g_mutex_unlock(&carrier->mc_mtx);
+			return (-1);
+		}
+
+		channel = mux_channel_new(carrier, rco, id);
+		rco->rco_endpoint_address = g_strdup(
+		    carrier->mc_conn->rco_endpoint_address);
+		rco->rco_has_creds = carrier->mc_conn->rco_has_creds;
+		rco->rco_creds = carrier->mc_conn->rco_creds;
+		rco->rco_supports_fd_passing =
+		    carrier->mc_conn->rco_supports_fd_passing;
+
+		if (rpc_server_accept(carrier->mc_server, rco) != 0) {
+			g_mutex_unlock(&carrier->mc_mtx);
+			rpc_connection_close(rco);
+			return (0);
+		}
+	}
+
+	if (channel == NULL || channel->mx_closed) {
+		g_mutex_unlock(&carrier->mc_mtx);
+		return (0);
+	}
+
+	rco = channel->mx_parent;
+	rpc_connection_retain(rco);
+
+	/* The peer closed the channel, no need to tell it back */
+	if (len == 0) {
+		channel->mx_closed = true;
+		g_hash_table_remove(carrier->mc_channels, GUINT_TO_POINTER(id));
+	}
+	g_mutex_unlock(&carrier->mc_mtx);
+
+	/* A failing channel must not take the whole carrier down */
+	if (len == 0)
+		rco->rco_close(rco);
+	else
+		rco->rco_recv_msg(rco, data, len, (int *)fds, nfds);
+
+	rpc_connection_release(rco);
+	return (0);
+}
+
+/*
+ * The physical connection went away: close every channel over it. On
+ * the client side, the carrier is forgotten so that the next connection
+ * opens a new one, and its client is closed off-thread, as this may run
+ * on one of the threads being joined.
+ */
+static void
+mux_carrier_closed(struct mux_carrier *carrier)
+{
+	GHashTableIter iter;
+	GPtrArray *channels;
+	struct mux_channel *channel;
+	guint i;
+
+	if (carrier->mc_client != NULL) {
+		g_mutex_lock(&mux_carriers_mtx);
+		if (g_hash_table_lookup(mux_carriers, carrier->mc_uri) ==
+		    carrier)
+			g_hash_table_remove(mux_carriers, carrier->mc_uri);
+		g_mutex_unlock(&mux_carriers_mtx);
+	}
+
+	channels = g_ptr_array_new();
+	g_mutex_lock(&carrier->mc_mtx);
+	carrier->mc_closed = true;
+	g_hash_table_iter_init(&iter, carrier->mc_channels);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&channel)) {
+		rpc_connection_retain(channel->mx_parent);
+		g_ptr_array_add(channels, channel->mx_parent);
+	}
+	g_mutex_unlock(&carrier->mc_mtx);
+
+	for (i = 0; i < channels->len; i++) {
+		rpc_connection_t rco = g_ptr_array_index(channels, i);
+
+		rco->rco_close(rco);
+		rpc_connection_release(rco);
+	}
+
+	g_ptr_array_free(channels, true);
+
+	if (carrier->mc_client != NULL)
+		g_thread_unref(rpc_thread_new(RPC_THREAD_TIMER, "mux reaper",
+		    mux_carrier_reap, carrier));
+	else
+		mux_carrier_unref(carrier);
+}
+
+static void *
+mux_carrier_reap(void *arg)
+{
+	struct mux_carrier *carrier = arg;
+
+	rpc_client_close(carrier->mc_client);
+	mux_carrier_unref(carrier);
+	return (NULL);
+}
+
+/* Called with the carrier lock held */
+static struct mux_channel *
+mux_channel_new(struct mux_carrier *carrier, struct rpc_connection *rco,
+    uint32_t id)
+{
+	struct mux_channel *channel;
+
+	channel = g_malloc0(sizeof(*channel));
+	channel->mx_carrier = carrier;
+	channel->mx_parent = rco;
+	channel->mx_id = id;
+	g_atomic_int_inc(&carrier->mc_refcnt);
+	g_hash_table_insert(carrier->mc_channels, GUINT_TO_POINTER(id),
+	    channel);
+
+	rco->rco_send_msg = mux_send_msg;
+	rco->rco_send_msgv = mux_send_msgv;
+	rco->rco_abort = mux_abort;
+	rco->rco_get_fd = mux_get_fd;
+	rco->rco_release = mux_release;
+	rco->rco_arg = channel;
+	return (channel);
+}
+
+static int
+mux_send_msg(void *arg, const void *buf, size_t len, const int *fds,
+    size_t nfds)
+{
+	struct iovec iov;
+
+	iov.iov_base = (void *)buf;
+	iov.iov_len = len;
+	return (mux_send_msgv(arg, &iov, 1, fds, nfds));
+}
+
+static int
+mux_send_msgv(void *arg, const struct iovec *vec, size_t nvec,
+    const int *fds, size_t nfds)
+{
+	struct mux_channel *channel = arg;
+	struct mux_carrier *carrier = channel->mx_carrier;
+	struct rpc_connection *phys = carrier->mc_conn;
+	struct iovec *iov;
+	uint8_t header[MUX_HDR_SIZE];
+	uint32_t val;
+	size_t size = 0;
+	size_t i;
+	char *buf;
+	int ret;
+
+	if (carrier->mc_closed) {
+		rpc_set_last_errorf(ECONNRESET, "Connection closed");
+		return (-1);
+	}
+
+	for (i = 0; i < nvec; i++)
+		size += vec[i].iov_len;
+
+	iov = g_malloc_n(nvec + 1, sizeof(*iov));
+	iov[0] = (struct iovec){ .iov_base = header, .iov_len = sizeof(header) };
+	memcpy(&iov[1], vec, nvec * sizeof(*vec));
+
+	/* Channel 0 carries plain frames */
+	header[0] = 0xc9;
+	val = GUINT32_TO_BE((uint32_t)(size + sizeof(val)));
+	memcpy(&header[1], &val, sizeof(val));
+	header[5] = MSGPACK_EXTTYPE_CHANNEL;
+	val = GUINT32_TO_BE(channel->mx_id);
+	memcpy(&header[6], &val, sizeof(val));
+
+	g_mutex_lock(&phys->rco_send_mtx);
+	if (channel->mx_id == 0 && phys->rco_send_msgv != NULL)
+		ret = phys->rco_send_msgv(phys->rco_arg, iov + 1, nvec, fds,
+		    nfds);
+	else if (phys->rco_send_msgv != NULL)
+		ret = phys->rco_send_msgv(phys->rco_arg, iov, nvec + 1, fds,
+		    nfds);
+	else {
+		buf = g_malloc(sizeof(header) + size);
+		size = 0;
+		for (i = channel->mx_id == 0 ? 1 : 0; i <= nvec; i++) {
+			memcpy(buf + size, iov[i].iov_base, iov[i].iov_len);
+			size += iov[i].iov_len;
+		}
+
+		ret = phys->rco_send_msg(phys->rco_arg, buf, size, fds, nfds);
+		g_free(buf);
+	}
+	g_mutex_unlock(&phys->rco_send_mtx);
+
+	g_free(iov);
+	return (ret);
+}
+
+static int
+mux_abort(void *arg)
+{
+	struct mux_channel *channel = arg;
+	struct mux_carrier *carrier = channel->mx_carrier;
+	bool notify;
+
+	g_mutex_lock(&carrier->mc_mtx);
+	notify = !channel->mx_closed && !carrier->mc_closed &&
+	    channel->mx_id != 0;
+	if (!channel->mx_closed) {
+		channel->mx_closed = true;
+		g_hash_table_remove(carrier->mc_channels,
+		    GUINT_TO_POINTER(channel->mx_id));
+	}
+	g_mutex_unlock(&carrier->mc_mtx);
+
+	if (notify)
+		mux_send_msg(channel, NULL, 0, NULL, 0);
+
+	return (0);
+}
+
+static int
+mux_get_fd(void *arg)
+{
+	struct mux_channel *channel = arg;
+	struct rpc_connection *phys = channel->mx_carrier->mc_conn;
+
+	return (phys->rco_get_fd != NULL ? phys->rco_get_fd(phys->rco_arg) : -1);
+}
+
+static void
+mux_release(void *arg)
+{
+	struct mux_channel *channel = arg;
+
+	mux_carrier_unref(channel->mx_carrier);
+	g_free(channel);
+}
+
+DECLARE_TRANSPORT(mux_transport);
@@ -0,0 +1,907 @@
+/*
+ * Copyright 2015-2017 Two Pore Guys, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#define _GNU_SOURCE
+
+/*
+ * Shared memory transport.
+ *
+ * A shm:// connection is set up over an AF_UNIX socket: the client creates
+ * two memfd-backed rings (one per direction) plus a pair of eventfds for
+ * each ring and hands all of them to the server with SCM_RIGHTS. After the
+ * handshake frames are exchanged through the rings only; the socket is kept
+ * open to detect peer death and to carry file descriptors attached to
+ * a frame.
+ *
+ * Each ring is a single-producer, single-consumer byte stream. Producer and
+ * consumer spin briefly when the ring is full or empty, and only then park
+ * on the eventfd after advertising that they are waiting, so the peer does
+ * not pay for a wakeup syscall while the other side is busy.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include <glib.h>
+#include "../linker_set.h"
+#include "../internal.h"
+
+#define SHM_SCHEME		"shm://"
+#define SHM_RING_SIZE		(1024 * 1024)
+#define SHM_SPIN_COUNT		2000
+#define SHM_FRAME_MAGIC		0x73686d31
+#define SHM_HANDSHAKE_NFDS	6
+#define SHM_MAX_FDS		128
+#define SHM_CACHELINE		64
+#define SHM_MAX_FRAME		(256 * 1024 * 1024)
+#define SHM_HANDSHAKE_TIMEOUT	5
+#define SHM_SEALS		(F_SEAL_SHRINK | F_SEAL_GROW)
+
+struct shm_ring_header
+{
+	_Alignas(SHM_CACHELINE) uint64_t	head;
+	_Alignas(SHM_CACHELINE) uint64_t	tail;
+	_Alignas(SHM_CACHELINE) int		consumer_waiting;
+	int					producer_waiting;
+	uint64_t				size;
+};
+
+struct shm_ring
+{
+	struct shm_ring_header *	sr_hdr;
+	uint8_t *			sr_data;
+	uint64_t			sr_size;
+	size_t				sr_mapsize;
+	int				sr_data_efd;
+	int				sr_space_efd;
+};
+
+struct shm_frame_header
+{
+	uint32_t		magic;
+	uint32_t		length;
+	uint32_t		nfds;
+	uint32_t		reserved;
+};
+
+struct shm_connection
+{
+	struct rpc_connection *	sc_parent;
+	struct shm_ring		sc_tx;
+	struct shm_ring		sc_rx;
+	GMutex			sc_send_mtx;
+	GThread *		sc_reader;
+	int			sc_sock;
+	int			sc_closed;
+};
+
+struct shm_server
+{
+	struct rpc_server *	ss_server;
+	GThread *		ss_thread;
+	char *			ss_path;
+	int			ss_sock;
+	int			ss_closed;
+};
+
+static int shm_connect(struct rpc_connection *, const char *, rpc_object_t);
+static int shm_listen(struct rpc_server *, const char *, rpc_object_t);
+static int shm_ring_create(struct shm_ring *, int *);
+static int shm_ring_map(struct shm_ring *, int, int, int);
+static void shm_ring_unmap(struct shm_ring *);
+static bool shm_ring_wait(struct shm_connection *, int *, int, bool);
+static int shm_ring_write(struct shm_connection *, const void *, size_t);
+static int shm_ring_read(struct shm_connection *, void *, size_t);
+static int shm_send_fds(int, const int *, size_t);
+static int shm_recv_fds(int, int *, size_t);
+static void shm_close_fds(const int *, size_t);
+static int shm_send_msg(void *, const void *, size_t, const int *, size_t);
+static int shm_abort(void *);
+static int shm_get_fd(void *);
+static void shm_release(void *);
+static void *shm_reader(void *);
+static void *shm_accept_worker(void *);
+static int shm_teardown(struct rpc_server *);
+
+static const struct rpc_transport shm_transport = {
+	.name = "shm",
+	.schemas = {"shm", NULL},
+	.connect = shm_connect,
+	.listen = shm_listen,
+	.flags = RPC_TRANSPORT_FD_PASSING | RPC_TRANSPORT_CREDENTIALS
+};
+
+static const char *
+shm_parse_uri(const char *uri_string)
+{
+
+	if (!g_str_has_prefix(uri_string, SHM_SCHEME)) {
+		rpc_set_last_errorf(EINVAL, "Cannot parse URI");
+		return (NULL);
+	}
+
+	uri_string += strlen(SHM_SCHEME);
+	if (*uri_string == '\0' ||
+	    strlen(uri_string) >= sizeof(((struct sockaddr_un *)0)->sun_path)) {
+		rpc_set_last_errorf(EINVAL, "Invalid socket path");
+		return (NULL);
+	}
+
+	return (uri_string);
+}
+
+static int
+shm_ring_create(struct shm_ring *ring, int *fds)
+{
+	size_t mapsize = sizeof(struct shm_ring_header) + SHM_RING_SIZE;
+	int memfd;
+	int data_efd;
+	int space_efd;
+
+	memfd = memfd_create("librpc-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (memfd < 0)
+		return (-1);
+
+	/* Sealed, so neither side can pull the mapping from under the other */
+	if (ftruncate(memfd, (off_t)mapsize) != 0 ||
+	    fcntl(memfd, F_ADD_SEALS, SHM_SEALS | F_SEAL_SEAL) != 0) {
+		close(memfd);
+		return (-1);
+	}
+
+	data_efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	space_efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (data_efd < 0 || space_efd < 0) {
+		close(memfd);
+		if (data_efd >= 0)
+			close(data_efd);
+		if (space_efd >= 0)
+			close(space_efd);
+		return (-1);
+	}
+
+	if (shm_ring_map(ring, memfd, data_efd, space_efd) != 0) {
+		close(memfd);
+		close(data_efd);
+		close(space_efd);
+		return (-1);
+	}
+
+	ring->sr_hdr->size = SHM_RING_SIZE;
+	ring->sr_size = SHM_RING_SIZE;
+	fds[0] = memfd;
+	fds[1] = data_efd;
+	fds[2] = space_efd;
+	return (0);
+}
+
+static int
+shm_ring_map(struct shm_ring *ring, int memfd, int data_efd, int space_efd)
+{
+	struct stat st;
+	void *addr;
+	int seals;
+
+	/* A ring the peer could still resize would SIGBUS us */
+	seals = fcntl(memfd, F_GET_SEALS);
+	if (seals < 0 || (seals & SHM_SEALS) != SHM_SEALS) {
+		errno = EPERM;
+		return (-1);
+	}
+
+	if (fstat(memfd, &st) != 0)
+		return (-1);
+
+	if ((size_t)st.st_size <= sizeof(struct shm_ring_header)) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	addr = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE,
+	    MAP_SHARED, memfd, 0);
+	if (addr == MAP_FAILED)
+		return (-1);
+
+	ring->sr_hdr = addr;
+	ring->sr_data = (uint8_t *)addr + sizeof(struct shm_ring_header);
+	ring->sr_mapsize = (size_t)st.st_size;
+	ring->sr_size = ring->sr_mapsize - sizeof(struct shm_ring_header);
+	ring->sr_data_efd = data_efd;
+	ring->sr_space_efd = space_efd;
+	return (0);
+}
+
+static void
+shm_ring_unmap(struct shm_ring *ring)
+{
+
+	if (ring->sr_hdr != NULL)
+		munmap(ring->sr_hdr, ring->sr_mapsize);
+
+	if (ring->sr_data_efd >= 0)
+		close(ring->sr_data_efd);
+
+	if (ring->sr_space_efd >= 0)
+		close(ring->sr_space_efd);
+
+	ring->sr_hdr = NULL;
+	ring->sr_data_efd = -1;
+	ring->sr_space_efd = -1;
+}
+
+static void
+shm_ring_notify(int *waiting, int efd)
+{
+	uint64_t one = 1;
+
+	if (__atomic_load_n(waiting, __ATOMIC_SEQ_CST))
+		(void)write(efd, &one, sizeof(one));
+}
+
+/*
+ * Waits until the ring has room (producer) or data (consumer). Returns
+ * false if the connection went away in the meantime.
+ */
+static bool
+shm_ring_wait(struct shm_connection *conn, int *waiting, int efd,
+    bool producer)
+{
+	struct shm_ring *ring = producer ? &conn->sc_tx : &conn->sc_rx;
+	struct pollfd pfd[2];
+	uint64_t head;
+	uint64_t tail;
+	uint64_t value;
+	int i;
+
+	for (i = 0; i < SHM_SPIN_COUNT; i++) {
+		head = __atomic_load_n(&ring->sr_hdr->head, __ATOMIC_ACQUIRE);
+		tail = __atomic_load_n(&ring->sr_hdr->tail, __ATOMIC_ACQUIRE);
+		if (producer ? (head - tail < ring->sr_size) : (head != tail))
+			return (true);
+
+		if (g_atomic_int_get(&conn->sc_closed))
+			return (false);
+	}
+
+	__atomic_store_n(waiting, 1, __ATOMIC_SEQ_CST);
+	for (;;) {
+		head = __atomic_load_n(&ring->sr_hdr->head, __ATOMIC_SEQ_CST);
+		tail = __atomic_load_n(&ring->sr_hdr->tail, __ATOMIC_SEQ_CST);
+		if (producer ? (head - tail < ring->sr_size) : (head != tail))
+			break;
+
+		if (g_atomic_int_get(&conn->sc_closed))
+			break;
+
+		pfd[0].fd = efd;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = conn->sc_sock;
+		pfd[1].events = 0;
+		if (poll(pfd, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+
+			break;
+		}
+
+		if (pfd[0].revents & POLLIN)
+			(void)read(efd, &value, sizeof(value));
+
+		if (pfd[1].revents & (POLLHUP | POLLERR | POLLNVAL)) {
+			g_atomic_int_set(&conn->sc_closed, true);
+			break;
+		}
+	}
+
+	__atomic_store_n(waiting, 0, __ATOMIC_SEQ_CST);
+	return (!g_atomic_int_get(&conn->sc_closed));
+}
+
+/*
+ * Both ring indices live in memory the peer can write, so they are loaded
+ * once and checked against each other before we touch the data area. A
+ * ring claiming more than sr_size bytes in flight is treated as corrupt.
+ */
+static bool
+shm_ring_used(struct shm_ring *ring, uint64_t *headp, uint64_t *tailp,
+    size_t *usedp)
+{
+	uint64_t head;
+	uint64_t tail;
+
+	head = __atomic_load_n(&ring->sr_hdr->head, __ATOMIC_ACQUIRE);
+	tail = __atomic_load_n(&ring->sr_hdr->tail, __ATOMIC_ACQUIRE);
+	if (head - tail > ring->sr_size) {
+		debugf("corrupt shm ring %p: head %" PRIu64 ", tail %" PRIu64,
+		    ring, head, tail);
+		return (false);
+	}
+
+	*headp = head;
+	*tailp = tail;
+	*usedp = (size_t)(head - tail);
+	return (true);
+}
+
+static int
+shm_ring_write(struct shm_connection *conn, const void *buf, size_t len)
+{
+	struct shm_ring *ring = &conn->sc_tx;
+	struct shm_ring_header *hdr = ring->sr_hdr;
+	const uint8_t *src = buf;
+	uint64_t head;
+	uint64_t tail;
+	size_t avail;
+	size_t offset;
+	size_t chunk;
+	size_t used;
+	size_t n;
+
+	while (len > 0) {
+		if (!shm_ring_used(ring, &head, &tail, &used))
+			return (-1);
+
+		avail = ring->sr_size - used;
+		if (avail == 0) {
+			if (!shm_ring_wait(conn, &hdr->producer_waiting,
+			    ring->sr_space_efd, true))
+				return (-1);
+
+			continue;
+		}
+
+		n = MIN(avail, len);
+		offset = (size_t)(head % ring->sr_size);
+		chunk = MIN(n, ring->sr_size - offset);
+		memcpy(ring->sr_data + offset, src, chunk);
+		if (chunk < n)
+			memcpy(ring->sr_data, src + chunk, n - chunk);
+
+		__atomic_store_n(&hdr->head, head + n, __ATOMIC_SEQ_CST);
+		shm_ring_notify(&hdr->consumer_waiting, ring->sr_data_efd);
+		src += n;
+		len -= n;
+	}
+
+	return (0);
+}
+
+static int
+shm_ring_read(struct shm_connection *conn, void *buf, size_t len)
+{
+	struct shm_ring *ring = &conn->sc_rx;
+	struct shm_ring_header *hdr = ring->sr_hdr;
+	uint8_t *dst = buf;
+	uint64_t head;
+	uint64_t tail;
+	size_t avail;
+	size_t offset;
+	size_t chunk;
+	size_t n;
+
+	while (len > 0) {
+		if (!shm_ring_used(ring, &head, &tail, &avail))
+			return (-1);
+
+		if (avail == 0) {
+			if (!shm_ring_wait(conn, &hdr->consumer_waiting,
+			    ring->sr_data_efd, false))
+				return (-1);
+
+			continue;
+		}
+
+		n = MIN(avail, len);
+		offset = (size_t)(tail % ring->sr_size);
+		chunk = MIN(n, ring->sr_size - offset);
+		memcpy(dst, ring->sr_data + offset, chunk);
+		if (chunk < n)
+			memcpy(dst + chunk, ring->sr_data, n - chunk);
+
+		__atomic_store_n(&hdr->tail, tail + n, __ATOMIC_SEQ_CST);
+		shm_ring_notify(&hdr->producer_waiting, ring->sr_space_efd);
+		dst += n;
+		len -= n;
+	}
+
+	return (0);
+}
+
+static int
+shm_send_fds(int sock, const int *fds, size_t nfds)
+{
+	struct msghdr msg = { 0 };
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	uint32_t count = (uint32_t)nfds;
+	size_t cmsg_size = CMSG_SPACE(sizeof(int) * nfds);
+	g_autofree void *control = g_malloc0(cmsg_size);
+	ssize_t ret;
+
+	iov.iov_base = &count;
+	iov.iov_len = sizeof(count);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = cmsg_size;
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+
+	do
+		ret = sendmsg(sock, &msg, MSG_NOSIGNAL);
+	while (ret < 0 && errno == EINTR);
+
+	return (ret == (ssize_t)sizeof(count) ? 0 : -1);
+}
+
+static void
+shm_close_fds(const int *fds, size_t nfds)
+{
+	size_t i;
+
+	for (i = 0; i < nfds; i++)
+		close(fds[i]);
+}
+
+static int
+shm_recv_fds(int sock, int *fds, size_t nfds)
+{
+	struct msghdr msg = { 0 };
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	uint32_t count;
+	size_t cmsg_size = CMSG_SPACE(sizeof(int) * nfds);
+	g_autofree void *control = g_malloc0(cmsg_size);
+	ssize_t ret;
+
+	iov.iov_base = &count;
+	iov.iov_len = sizeof(count);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = cmsg_size;
+
+	do
+		ret = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+	while (ret < 0 && errno == EINTR);
+
+	if (ret < 0)
+		return (-1);
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (ret != (ssize_t)sizeof(count) || count != nfds ||
+	    (msg.msg_flags & MSG_CTRUNC) || cmsg == NULL ||
+	    cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+	    cmsg->cmsg_len != CMSG_LEN(sizeof(int) * nfds)) {
+		/* Whatever did arrive is ours now; don't leak it */
+		for (; cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if (cmsg->cmsg_level != SOL_SOCKET ||
+			    cmsg->cmsg_type != SCM_RIGHTS)
+				continue;
+
+			shm_close_fds((int *)(void *)CMSG_DATA(cmsg),
+			    (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+		}
+
+		return (-1);
+	}
+
+	memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * nfds);
+	return (0);
+}
+
+static int
+shm_send_msg(void *arg, const void *buf, size_t size, const int *fds,
+    size_t nfds)
+{
+	struct shm_connection *conn = arg;
+	struct shm_frame_header header = {
+		.magic = SHM_FRAME_MAGIC,
+		.length = (uint32_t)size,
+		.nfds = (uint32_t)nfds
+	};
+	int ret = -1;
+
+	if (size > SHM_MAX_FRAME || nfds > SHM_MAX_FDS) {
+		errno = EMSGSIZE;
+		return (-1);
+	}
+
+	g_mutex_lock(&conn->sc_send_mtx);
+	if (g_atomic_int_get(&conn->sc_closed))
+		goto done;
+
+	/*
+	 * Descriptors travel over the socket and must be queued before the
+	 * frame becomes visible in the ring, so the reader always finds them.
+	 */
+	if (nfds > 0 && shm_send_fds(conn->sc_sock, fds, nfds) != 0)
+		goto done;
+
+	if (shm_ring_write(conn, &header, sizeof(header)) != 0)
+		goto done;
+
+	if (shm_ring_write(conn, buf, size) != 0)
+		goto done;
+
+	ret = 0;
+done:
+	g_mutex_unlock(&conn->sc_send_mtx);
+	return (ret);
+}
+
+static int
+shm_abort(void *arg)
+{
+	struct shm_connection *conn = arg;
+	uint64_t one = 1;
+
+	g_atomic_int_set(&conn->sc_closed, true);
+	shutdown(conn->sc_sock, SHUT_RDWR);
+
+	/* Kick our own side out of the eventfd wait */
+	(void)write(conn->sc_rx.sr_data_efd, &one, sizeof(one));
+	(void)write(conn->sc_tx.sr_space_efd, &one, sizeof(one));
+	return (0);
+}
+
+static int
+shm_get_fd(void *arg)
+{
+	struct shm_connection *conn = arg;
+
+	return (conn->sc_sock);
+}
+
+static void
+shm_release(void *arg)
+{
+	struct shm_connection *conn = arg;
+
+	if (conn->sc_reader != NULL && conn->sc_reader != g_thread_self())
+		g_thread_join(conn->sc_reader);
+	else if (conn->sc_reader != NULL)
+		g_thread_unref(conn->sc_reader);
+
+	shm_ring_unmap(&conn->sc_tx);
+	shm_ring_unmap(&conn->sc_rx);
+	close(conn->sc_sock);
+	g_mutex_clear(&conn->sc_send_mtx);
+	g_free(conn);
+}
+
+static void *
+shm_reader(void *arg)
+{
+	struct shm_connection *conn = arg;
+	struct shm_frame_header header;
+	GBytes *bytes;
+	void *frame;
+	int fds[SHM_MAX_FDS];
+	int ret;
+
+	for (;;) {
+		if (shm_ring_read(conn, &header, sizeof(header)) != 0)
+			break;
+
+		if (header.magic != SHM_FRAME_MAGIC ||
+		    header.nfds > SHM_MAX_FDS ||
+		    header.length > SHM_MAX_FRAME) {
+			debugf("bad frame header on shm connection %p", conn);
+			break;
+		}
+
+		if (header.nfds > 0 &&
+		    shm_recv_fds(conn->sc_sock, fds, header.nfds) != 0)
+			break;
+
+		frame = g_try_malloc(header.length);
+		if (frame == NULL && header.length > 0) {
+			debugf("cannot allocate %u byte shm frame",
+			    header.length);
+			shm_close_fds(fds, header.nfds);
+			break;
+		}
+
+		if (shm_ring_read(conn, frame, header.length) != 0) {
+			shm_close_fds(fds, header.nfds);
+			g_free(frame);
+			break;
+		}
+
+		bytes = g_bytes_new_take(frame, header.length);
+		ret = conn->sc_parent->rco_recv_bytes(conn->sc_parent, bytes,
+		    header.nfds > 0 ? fds : NULL, header.nfds);
+		g_bytes_unref(bytes);
+
+		if (ret != 0)
+			break;
+	}
+
+	g_atomic_int_set(&conn->sc_closed, true);
+	conn->sc_parent->rco_close(conn->sc_parent);
+	return (NULL);
+}
+
+static struct shm_connection *
+shm_connection_new(struct rpc_connection *rco, int sock)
+{
+	struct shm_connection *conn;
+
+	conn = g_malloc0(sizeof(*conn));
+	conn->sc_parent = rco;
+	conn->sc_sock = sock;
+	conn->sc_tx.sr_data_efd = conn->sc_tx.sr_space_efd = -1;
+	conn->sc_rx.sr_data_efd = conn->sc_rx.sr_space_efd = -1;
+	g_mutex_init(&conn->sc_send_mtx);
+	return (conn);
+}
+
+static void
+shm_connection_start(struct shm_connection *conn)
+{
+	struct rpc_connection *rco = conn->sc_parent;
+
+	rco->rco_send_msg = shm_send_msg;
+	rco->rco_abort = shm_abort;
+	rco->rco_get_fd = shm_get_fd;
+	rco->rco_release = shm_release;
+	rco->rco_arg = conn;
+	conn->sc_reader = rpc_thread_new(RPC_THREAD_IO, "shm reader", shm_reader,
+	    conn);
+}
+
+static int
+shm_connect(struct rpc_connection *rco, const char *uri_string,
+    rpc_object_t params __unused)
+{
+	struct shm_connection *conn;
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	const char *path;
+	int fds[SHM_HANDSHAKE_NFDS];
+	int sock;
+	int ret;
+
+	path = shm_parse_uri(uri_string);
+	if (path == NULL)
+		return (-1);
+
+	sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock < 0) {
+		rpc_set_last_errorf(errno, "Cannot create socket: %s",
+		    strerror(errno));
+		return (-1);
+	}
+
+	g_strlcpy(addr.sun_path, path, sizeof(addr.sun_path));
+	if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+		rpc_set_last_errorf(errno, "Cannot connect to %s: %s", path,
+		    strerror(errno));
+		close(sock);
+		return (-1);
+	}
+
+	/* Client to server ring first, server to client ring second */
+	conn = shm_connection_new(rco, sock);
+	if (shm_ring_create(&conn->sc_tx, &fds[0]) != 0) {
+		rpc_set_last_errorf(errno, "Cannot create shared ring: %s",
+		    strerror(errno));
+		shm_release(conn);
+		return (-1);
+	}
+
+	if (shm_ring_create(&conn->sc_rx, &fds[3]) != 0) {
+		rpc_set_last_errorf(errno, "Cannot create shared ring: %s",
+		    strerror(errno));
+		close(fds[0]);
+		shm_release(conn);
+		return (-1);
+	}
+
+	ret = shm_send_fds(sock, fds, SHM_HANDSHAKE_NFDS);
+
+	/* Only the memfds are ours to close, eventfds stay with the rings */
+	close(fds[0]);
+	close(fds[3]);
+
+	if (ret != 0) {
+		rpc_set_last_errorf(errno, "Handshake failed: %s",
+		    strerror(errno));
+		shm_release(conn);
+		return (-1);
+	}
+
+	shm_connection_start(conn);
+	return (0);
+}
+
+static void
+shm_accept_one(struct shm_server *server, int sock)
+{
+	struct rpc_server *srv = server->ss_server;
+	struct shm_connection *conn;
+	struct rpc_connection *rco;
+	struct shm_ring rx = { .sr_data_efd = -1, .sr_space_efd = -1 };
+	struct shm_ring tx = { .sr_data_efd = -1, .sr_space_efd = -1 };
+	struct ucred cred;
+	struct timeval tv = { .tv_sec = SHM_HANDSHAKE_TIMEOUT };
+	socklen_t len = sizeof(cred);
+	int fds[SHM_HANDSHAKE_NFDS];
+	int i;
+
+	/* A client that never sends its rings mustn't hold up the others */
+	if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) != 0 ||
+	    shm_recv_fds(sock, fds, SHM_HANDSHAKE_NFDS) != 0) {
+		debugf("shm handshake failed");
+		close(sock);
+		return;
+	}
+
+	/* The socket only carries frame fds from now on */
+	tv.tv_sec = 0;
+	(void)setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	/* The client's tx ring is our rx ring and vice versa */
+	if (shm_ring_map(&rx, fds[0], fds[1], fds[2]) != 0 ||
+	    shm_ring_map(&tx, fds[3], fds[4], fds[5]) != 0) {
+		debugf("cannot map shm rings");
+		if (rx.sr_hdr != NULL)
+			munmap(rx.sr_hdr, rx.sr_mapsize);
+
+		for (i = 0; i < SHM_HANDSHAKE_NFDS; i++)
+			close(fds[i]);
+
+		close(sock);
+		return;
+	}
+
+	close(fds[0]);
+	close(fds[3]);
+
+	rco = rpc_connection_alloc(srv);
+	conn = shm_connection_new(rco, sock);
+	conn->sc_rx = rx;
+	conn->sc_tx = tx;
+
+	if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0) {
+		g_assert(rco->rco_set_creds != NULL);
+		rco->rco_set_creds(rco, cred.pid, cred.uid, cred.gid);
+	}
+
+	rco->rco_send_msg = shm_send_msg;
+	rco->rco_abort = shm_abort;
+	rco->rco_get_fd = shm_get_fd;
+	rco->rco_release = shm_release;
+	rco->rco_arg = conn;
+
+	if (srv->rs_accept(srv, rco) == 0)
+		conn->sc_reader = rpc_thread_new(RPC_THREAD_IO, "shm reader",
+		    shm_reader, conn);
+	else
+		rpc_connection_close(rco); /* will rco_abort, rco_release */
+}
+
+static void *
+shm_accept_worker(void *arg)
+{
+	struct shm_server *server = arg;
+	int sock;
+
+	for (;;) {
+		sock = accept4(server->ss_sock, NULL, NULL, SOCK_CLOEXEC);
+		if (sock < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+
+			if (g_atomic_int_get(&server->ss_closed))
+				break;
+
+			debugf("shm accept failed: %s", strerror(errno));
+			if (!server->ss_server->rs_valid(server->ss_server))
+				break;
+
+			continue;
+		}
+
+		shm_accept_one(server, sock);
+	}
+
+	return (NULL);
+}
+
+static int
+shm_teardown(struct rpc_server *srv)
+{
+	struct shm_server *server = srv->rs_arg;
+
+	g_atomic_int_set(&server->ss_closed, true);
+	shutdown(server->ss_sock, SHUT_RDWR);
+	g_thread_join(server->ss_thread);
+	close(server->ss_sock);
+	unlink(server->ss_path);
+	g_free(server->ss_path);
+	g_free(server);
+	return (0);
+}
+
+static int
+shm_listen(struct rpc_server *srv, const char *uri_string,
+    rpc_object_t params __unused)
+{
+	struct shm_server *server;
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	const char *path;
+	int sock;
+
+	path = shm_parse_uri(uri_string);
+	if (path == NULL)
+		return (-1);
+
+	sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock < 0) {
+		rpc_set_last_errorf(errno, "Cannot create socket: %s",
+		    strerror(errno));
+		return (-1);
+	}
+
+	g_strlcpy(addr.sun_path, path, sizeof(addr.sun_path));
+	unlink(path);
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+	    listen(sock, SOMAXCONN) != 0) {
+		rpc_set_last_errorf(errno, "Cannot listen on %s: %s", path,
+		    strerror(errno));
+		close(sock);
+		return (-1);
+	}
+
+	server = g_malloc0(sizeof(*server));
+	server->ss_server = srv;
+	server->ss_sock = sock;
+	server->ss_path = g_strdup(path);
+	srv->rs_teardown = shm_teardown;
+	srv->rs_arg = server;
+	server->ss_thread = rpc_thread_new(RPC_THREAD_SERVER, "shm listener",
+	    shm_accept_worker, server);
+
+	return (0);
+}
+
+DECLARE_TRANSPORT(shm_transport);
@@ -28,8 +28,22 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#ifndef _WIN32
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#endif
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#endif
+#if defined(LIBURING_SUPPORT)
+#include <liburing.h>
+#endif
 #include <gio/gio.h>
 #ifndef _WIN32
 #include <gio/gunixcredentialsmessage.h>
@@ -39,38 +53,223 @@
 #include <yuarel.h>
 #include "../linker_set.h"
 #include "../internal.h"
+#include "../slab.h"
+#include "../thread.h"
+#include "../serializer/msgpack.h"
+#if defined(KTLS_SUPPORT)
+#include "tls.h"
+#endif
 
 #define SC_ABORT_TIMEOUT 30
+#define	SOCKET_IO_MAX_THREADS	64
+#define	SOCKET_IO_EVENTS	64
+#define	SOCKET_IO_BUDGET	16
+#define	SOCKET_IO_MAX_FDS	128
+#define	SOCKET_RBUF_TRIM	(256 * 1024)
+#define	SOCKET_READAHEAD	(64 * 1024)
+#define	SOCKET_URING_ENTRIES	256
+#define	SOCKET_URING_BUFS	256
+#define	SOCKET_URING_BUF_SIZE	(16 * 1024)
+#define	SOCKET_MAX_SHARDS	64
+#define	SOCKET_SENDFILE_MIN	(64 * 1024)
+#define	SOCKET_SENDFILE_CHUNK	(1024 * 1024)
+
+#ifndef IOV_MAX
+#define	IOV_MAX			1024
+#endif
+
+struct socket_connection;
+struct socket_rbuf;
+struct socket_server;
+struct socket_shard;
 
 static GSocketAddress *socket_parse_uri(const char *);
 static int socket_connect(struct rpc_connection *, const char *, rpc_object_t);
 static int socket_listen(struct rpc_server *, const char *, rpc_object_t);
+static void socket_accept(GObject *, GAsyncResult *, void *);
+static struct rpc_connection *socket_serve(struct socket_shard *,
+    GSocketConnection *, bool, const void *, size_t);
+static void socket_accept_next(struct socket_shard *);
+#if defined(KTLS_SUPPORT)
+static void socket_tls_accept(struct socket_shard *, GSocketConnection *);
+static void *socket_tls_accept_thread(void *);
+static int socket_tls_connect(struct socket_connection *, const char *,
+    rpc_object_t);
+#endif
+static int socket_bind_shards(struct socket_server *, GSocketAddress *,
+    GError **);
+static int socket_shard_start(struct socket_server *, guint, GSocket *,
+    GError **);
+static void *socket_shard_worker(void *);
+static gboolean socket_shard_stop(gpointer);
+static void socket_stop_shards(struct socket_server *);
+static int socket_get_listen_fds(struct rpc_server *, int **, size_t *);
+static struct rpc_connection *socket_adopt(struct rpc_server *, int,
+    const void *, size_t);
 static int socket_send_msg(void *, const void *, size_t, const int *, size_t);
+static int socket_send_msgv(void *, const struct iovec *, size_t, const int *,
+    size_t);
+static int socket_send_begin(void *, size_t, const int *, size_t);
+static int socket_send_chunk(void *, const void *, size_t);
+static int socket_send_stream_hdr(struct socket_connection *,
+    GOutputVector *, size_t);
+static int socket_send_batch(void *, const struct iovec *, size_t);
+static int socket_send_vectors(struct socket_connection *, GOutputVector *,
+    size_t, size_t, GSocketControlMessage **, int);
+static int socket_make_cmsgs(struct socket_connection *, const int *, size_t,
+    GSocketControlMessage **);
+static int socket_set_options(struct socket_connection *, rpc_object_t,
+    GError **);
+static void socket_cork(struct socket_connection *, bool);
+static void socket_quickack(struct socket_connection *);
 static int socket_teardown(struct rpc_server *);
 static int socket_abort(void *);
 static int socket_get_fd(void *);
+static int socket_detach(void *, GBytes **);
 static void socket_release(void *);
+static int socket_recv_header(struct socket_connection *, size_t *, int **,
+    size_t *);
+static ssize_t socket_recv_raw(struct socket_connection *, void *, size_t);
+static ssize_t socket_recv_data(struct socket_connection *, void *, size_t);
+static void socket_recv_spin(struct socket_connection *);
+static int socket_recv_exact(struct socket_connection *, void *, size_t);
+static int socket_recv_stream(struct socket_connection *, size_t, int *,
+    size_t);
+static GBytes *socket_rbuf_recv(struct socket_connection *, size_t);
+static void socket_rbuf_unref(struct socket_rbuf *);
 static void *socket_reader(void *);
 static gboolean socket_abort_timeout(gpointer user_data);
 static bool socket_supports_fd_passing(struct rpc_connection *);
+#if defined(__linux__)
+struct socket_io_thread;
+static struct socket_io_thread *socket_io_assign(guint, bool);
+static int socket_io_attach(struct socket_connection *,
+    struct socket_io_thread *);
+static void *socket_io_worker(void *);
+static int socket_io_poll(struct socket_io_thread *, struct epoll_event *);
+static bool socket_io_read(struct socket_connection *);
+static void socket_io_detach(struct socket_connection *);
+static void socket_io_wait(struct socket_connection *);
+static bool socket_io_deliver(struct socket_connection *);
+static bool socket_io_stash_fds(struct socket_connection *, struct cmsghdr *);
+static void socket_io_close_fds(struct socket_connection *);
+#endif
+#if defined(LIBURING_SUPPORT)
+static int socket_uring_init(struct socket_io_thread *);
+static int socket_uring_arm(struct socket_connection *);
+static bool socket_uring_feed(struct socket_connection *, const char *,
+    size_t);
+static void socket_uring_complete(struct socket_io_thread *,
+    struct io_uring_cqe *, unsigned int *);
+static void *socket_uring_worker(void *);
+#endif
 
 static const struct rpc_transport socket_transport = {
 	.name = "socket",
+#if defined(KTLS_SUPPORT)
+	.schemas = {"unix", "tcp", "tls", "socket", NULL},
+#else
 	.schemas = {"unix", "tcp", "socket", NULL},
+#endif
 	.connect = socket_connect,
 	.listen = socket_listen,
 	.is_fd_passing = socket_supports_fd_passing,
 	.flags = RPC_TRANSPORT_FD_PASSING | RPC_TRANSPORT_CREDENTIALS
 };
 
+/*
+ * An accept loop. The first shard of a server accepts on the server main
+ * context; extra ones, see RPC_SERVER_ACCEPT_SHARDS, run a thread and a
+ * main context of their own.
+ */
+struct socket_shard
+{
+	struct socket_server *		ssh_server;
+	GSocket *			ssh_socket;
+	GSocketListener *		ssh_listener;
+	GCancellable *			ssh_cancellable;
+	bool				ssh_outstanding_accept;
+	GMainContext *			ssh_context;
+	GMainLoop *			ssh_loop;
+	GThread *			ssh_thread;
+};
+
 struct socket_server
 {
 	char *				ss_uri;
 	struct rpc_server *		ss_server;
-	GSocketListener *		ss_listener;
-	GCancellable *			ss_cancellable;
 	GMutex 				ss_mtx;
-	bool				ss_outstanding_accept;
+	struct socket_shard *		ss_shards;
+	guint				ss_nshards;
+	guint				ss_io_threads;
+	bool				ss_io_uring;
+#if defined(KTLS_SUPPORT)
+	/* tls:// servers: credentials and handshakes still running */
+	struct socket_tls *		ss_tls;
+	guint				ss_handshakes;
+	GCond				ss_handshake_cv;
+#endif
+};
+
+#if defined(__linux__)
+/*
+ * Event-driven mode: instead of a reader thread per connection, accepted
+ * sockets are spread over a small, process-wide pool of I/O threads, each
+ * multiplexing its share of connections with epoll. Sends stay blocking
+ * and happen on the caller's thread as before; only receiving moves.
+ */
+struct socket_io_thread
+{
+	GThread *			sit_thread;
+	int				sit_epfd;
+#if defined(LIBURING_SUPPORT)
+	/*
+	 * With io_uring, every connection has a multishot recvmsg armed
+	 * that picks buffers from sit_br, so one io_uring_enter() reaps
+	 * data for many connections. sit_mtx serializes the submission
+	 * queue, which accepting threads touch when arming.
+	 */
+	bool				sit_uring;
+	GMutex				sit_mtx;
+	struct io_uring			sit_ring;
+	struct io_uring_buf_ring *	sit_br;
+	char *				sit_bufs;
+#endif
+};
+
+static GMutex socket_io_mtx;
+static struct socket_io_thread socket_io_pool[2][SOCKET_IO_MAX_THREADS];
+static guint socket_io_nthreads[2];
+static volatile guint socket_io_next;
+static GPrivate socket_io_current;
+#endif
+
+/*
+ * Per-connection receive buffer, reused from frame to frame. Deserialized
+ * objects may keep pointing into a frame after dispatch, so the buffer is
+ * refcounted: the connection holds one reference and every GBytes handed
+ * out holds another. It is reused only once its GBytes has gone away;
+ * otherwise the connection leaves it to its remaining users and starts
+ * a new one.
+ */
+struct socket_rbuf
+{
+	void *				srb_data;
+	size_t				srb_size;
+	volatile gint			srb_refcnt;
+	volatile gint			srb_busy;
+};
+
+/*
+ * Descriptors that came in with a read, waiting for the frame they belong
+ * to. [sf_start, sf_end) is the range of the stream that read covered.
+ */
+struct socket_fdset
+{
+	uint64_t			sf_start;
+	uint64_t			sf_end;
+	int *				sf_fds;
+	size_t				sf_nfds;
 };
 
 struct socket_connection
@@ -80,11 +279,50 @@ struct socket_connection
 	GSocket *			sc_socket;
 	GThread *			sc_reader_thread;
 	struct rpc_connection *		sc_parent;
+	GMainContext *			sc_context;
 	GMutex 				sc_abort_mtx;
 	bool				sc_aborted;
 	GCancellable *			sc_cancellable;
 	GSource *			sc_abort_timeout;
+	GCond				sc_detach_cv;
+	bool				sc_detached;
+	bool				sc_reader_done;
 	bool				sc_creds_sent;
+	bool				sc_tcp;
+	bool				sc_quickack;
+	size_t				sc_stream_left;
+	uint32_t			sc_stream_hdr[4];
+	bool				sc_stream_hdr_pending;
+	const int *			sc_stream_fds;
+	size_t				sc_stream_nfds;
+	void *				sc_recv_buf;
+	struct socket_rbuf *		sc_rbuf;
+	char *				sc_ra_buf;
+	size_t				sc_ra_start;
+	size_t				sc_ra_end;
+	uint64_t			sc_rx_pos;
+	uint64_t			sc_rx_consumed;
+	GQueue				sc_rx_fds;
+#if defined(__linux__)
+	/* Event-driven receive state, see socket_io_read() */
+	struct socket_io_thread *	sc_io;
+	GMutex				sc_io_mtx;
+	GCond				sc_io_cv;
+	bool				sc_io_detached;
+	bool				sc_io_free_pending;
+	uint32_t			sc_io_header[4];
+	size_t				sc_io_header_done;
+	void *				sc_io_frame;
+	size_t				sc_io_frame_len;
+	size_t				sc_io_frame_done;
+	int				sc_io_fds[SOCKET_IO_MAX_FDS];
+	size_t				sc_io_nfds;
+#endif
+#if defined(LIBURING_SUPPORT)
+	struct msghdr			sc_uring_msg;
+	bool				sc_uring_closing;
+	bool				sc_uring_shut;
+#endif
 };
 
 static GSocketAddress *
@@ -111,7 +349,7 @@ socket_parse_uri(const char *uri_string)
 		return (NULL);
 	}
 
-	if (!g_strcmp0(uri.scheme, "tcp")) {
+	if (!g_strcmp0(uri.scheme, "tcp") || !g_strcmp0(uri.scheme, "tls")) {
 
 		resolver = g_resolver_get_default();
 		addresses = g_resolver_lookup_by_name(resolver, uri.host,
@@ -155,34 +393,61 @@ done:
 static void
 socket_accept(GObject *source __unused, GAsyncResult *result, void *data)
 {
-	struct socket_server *server = data;
-	struct socket_connection *conn = NULL;
-	char *remote_addr = NULL;
-	GError *err = NULL;
+	struct socket_shard *shard = data;
+	rpc_server_t srv = shard->ssh_server->ss_server;
 	GSocketConnection *gconn;
-	GSocketAddress *remote;
-	rpc_connection_t rco = NULL;
-	rpc_server_t srv = server->ss_server;
+	GError *err = NULL;
 
-	gconn = g_socket_listener_accept_finish(server->ss_listener, result,
+	gconn = g_socket_listener_accept_finish(shard->ssh_listener, result,
 	    NULL, &err);
 	if (err != NULL) {
 		debugf("accept failed");
 		g_error_free(err);
-		if (srv->rs_valid(srv))
-			goto done;
-
-		return;
+		if (!srv->rs_valid(srv))
+			return;
 	}
+#if defined(KTLS_SUPPORT)
+	else if (shard->ssh_server->ss_tls != NULL)
+		socket_tls_accept(shard, gconn);
+#endif
+	else if (socket_serve(shard, gconn, false, NULL, 0) == NULL) {
+		if (!srv->rs_valid(srv))
+			return;
+	}
+
+	/* Schedule next accept if server isn't closing */
+	socket_accept_next(shard);
+}
+
+/*
+ * Sets up a server connection for an accepted socket. For an @p adopted
+ * one, @p pending holds bytes the previous owner had already read off
+ * the socket, see socket_adopt(); a connection that has any is served
+ * by a reader thread, which starts by consuming them.
+ */
+static struct rpc_connection *
+socket_serve(struct socket_shard *shard, GSocketConnection *gconn,
+    bool adopted, const void *pending, size_t pending_len)
+{
+	struct socket_server *server = shard->ssh_server;
+	struct socket_connection *conn = NULL;
+	char *remote_addr = NULL;
+	GError *err = NULL;
+	GSocketAddress *remote;
+	rpc_connection_t rco = NULL;
+	rpc_server_t srv = server->ss_server;
+	bool evented = server->ss_io_threads > 0 && pending_len == 0;
+#if defined(__linux__)
+	GCredentials *creds;
+#endif
 
 #if defined(__linux__)
-	if (!g_socket_set_option(g_socket_connection_get_socket(gconn),
+	if (!evented &&
+	    !g_socket_set_option(g_socket_connection_get_socket(gconn),
 	    SOL_SOCKET, SO_PASSCRED, true, &err)) {
 		g_error_free(err);
-		if (srv->rs_valid(srv))
-			goto done;
-
-		return;
+		g_object_unref(gconn);
+		return (NULL);
 	}
 #endif
 
@@ -204,37 +469,338 @@ socket_accept(GObject *source __unused, GAsyncResult *result, void *data)
 	conn->sc_conn = gconn;
 	conn->sc_socket = g_object_ref(g_socket_connection_get_socket(gconn));
 	g_mutex_init(&conn->sc_abort_mtx);
+	g_cond_init(&conn->sc_detach_cv);
+
+	if (socket_set_options(conn, srv->rs_params, &err) != 0) {
+		debugf("cannot set socket options: %s", err->message);
+		g_error_free(err);
+		g_object_unref(conn->sc_socket);
+		g_object_unref(gconn);
+		g_mutex_clear(&conn->sc_abort_mtx);
+		g_free(conn);
+		g_free(remote_addr);
+		return (NULL);
+	}
+
+	if (pending_len > 0) {
+		g_assert(pending_len <= SOCKET_READAHEAD);
+		conn->sc_ra_buf = rpc_alloc(RPC_ALLOC_TAG_TRANSPORT,
+		    SOCKET_READAHEAD);
+		memcpy(conn->sc_ra_buf, pending, pending_len);
+		conn->sc_ra_end = pending_len;
+	}
 
 	rco = rpc_connection_alloc(srv);
 	rco->rco_send_msg = socket_send_msg;
+	rco->rco_send_msgv = socket_send_msgv;
+	rco->rco_send_begin = socket_send_begin;
+	rco->rco_send_chunk = socket_send_chunk;
+	rco->rco_send_batch = socket_send_batch;
 	rco->rco_get_fd = socket_get_fd;
+	rco->rco_detach = socket_detach;
 	rco->rco_arg = conn;
 	conn->sc_parent = rco;
 	rco->rco_release = socket_release;
 	rco->rco_abort = socket_abort;
 	rco->rco_endpoint_address = remote_addr;
+	if (shard->ssh_context != NULL) {
+		conn->sc_context = g_main_context_ref(shard->ssh_context);
+		rco->rco_main_context = conn->sc_context;
+	}
 
-	if (srv->rs_accept(srv, rco) == 0) {
-		conn->sc_cancellable = g_cancellable_new ();
-		conn->sc_reader_thread = g_thread_new("socket reader thread",
-		    socket_reader, (gpointer)conn);
-	} else {
+#if defined(__linux__)
+	if (evented) {
+		g_mutex_init(&conn->sc_io_mtx);
+		g_cond_init(&conn->sc_io_cv);
+		conn->sc_io = socket_io_assign(server->ss_io_threads,
+		    server->ss_io_uring);
+		conn->sc_io_detached = true; /* until attached */
+		if (conn->sc_io == NULL) {
+			rpc_connection_close(rco);
+			return (NULL);
+		}
+	}
+
+	/*
+	 * Evented connections have no reader to pick up SCM_CREDENTIALS,
+	 * and adopted ones already sent theirs to the previous owner;
+	 * ask the kernel.
+	 */
+	if (evented || adopted) {
+		creds = g_socket_get_credentials(conn->sc_socket, NULL);
+		if (creds != NULL) {
+			g_assert(rco->rco_set_creds != NULL);
+			rco->rco_set_creds(rco,
+			    g_credentials_get_unix_pid(creds, NULL),
+			    g_credentials_get_unix_user(creds, NULL),
+			    (gid_t)-1);
+			g_object_unref(creds);
+		}
+	}
+#endif
+
+	if (srv->rs_accept(srv, rco) != 0) {
 		rpc_connection_close(rco); /* will rco_abort, rco_release */
-		return;
+		return (NULL);
 	}
-done:
-	/* Schedule next accept if server isn't closing */
+
+	conn->sc_cancellable = g_cancellable_new ();
+#if defined(__linux__)
+	if (conn->sc_io != NULL) {
+		if (socket_io_attach(conn, conn->sc_io) != 0) {
+			rpc_connection_close(rco);
+			return (NULL);
+		}
+
+		return (rco);
+	}
+#endif
+	conn->sc_reader_thread = rpc_thread_new(RPC_THREAD_IO,
+	    "socket reader thread", socket_reader, (gpointer)conn);
+	return (rco);
+}
+
+/*
+ * Must run on the shard's main context (or with it pushed as the thread
+ * default), since that's where GIO delivers the result.
+ */
+static void
+socket_accept_next(struct socket_shard *shard)
+{
+	struct socket_server *server = shard->ssh_server;
+
+	g_mutex_lock(&server->ss_mtx);
+	g_cancellable_reset(shard->ssh_cancellable);
+	g_socket_listener_accept_async(shard->ssh_listener,
+	    shard->ssh_cancellable, &socket_accept, shard);
+	shard->ssh_outstanding_accept = true;
+	g_mutex_unlock(&server->ss_mtx);
+}
+
+#if defined(KTLS_SUPPORT)
+struct socket_tls_accept_arg
+{
+	struct socket_shard *		sta_shard;
+	GSocketConnection *		sta_gconn;
+};
+
+/*
+ * The handshake takes a few round trips, so it runs on a thread of its
+ * own rather than holding up the accept loop. socket_teardown() waits
+ * for these threads before freeing the credentials.
+ */
+static void
+socket_tls_accept(struct socket_shard *shard, GSocketConnection *gconn)
+{
+	struct socket_server *server = shard->ssh_server;
+	struct socket_tls_accept_arg *arg;
+	GThread *thread;
+
+	arg = g_malloc0(sizeof(*arg));
+	arg->sta_shard = shard;
+	arg->sta_gconn = gconn;
+
+	g_mutex_lock(&server->ss_mtx);
+	server->ss_handshakes++;
+	g_mutex_unlock(&server->ss_mtx);
+
+	thread = rpc_thread_new(RPC_THREAD_IO, "socket tls handshake",
+	    socket_tls_accept_thread, arg);
+	g_thread_unref(thread);
+}
+
+static void *
+socket_tls_accept_thread(void *data)
+{
+	struct socket_tls_accept_arg *arg = data;
+	struct socket_server *server = arg->sta_shard->ssh_server;
+	rpc_server_t srv = server->ss_server;
+
+	if (!srv->rs_valid(srv) || socket_tls_handshake(server->ss_tls,
+	    g_socket_connection_get_socket(arg->sta_gconn), NULL) != 0) {
+		debugf("TLS handshake failed");
+		g_object_unref(arg->sta_gconn);
+	} else
+		socket_serve(arg->sta_shard, arg->sta_gconn, false, NULL, 0);
+
 	g_mutex_lock(&server->ss_mtx);
-	g_cancellable_reset (server->ss_cancellable);
-	g_socket_listener_accept_async(server->ss_listener,
-	    server->ss_cancellable, &socket_accept, data);
-	server->ss_outstanding_accept = true;
+	if (--server->ss_handshakes == 0)
+		g_cond_broadcast(&server->ss_handshake_cv);
 	g_mutex_unlock(&server->ss_mtx);
+	g_free(arg);
+	return (NULL);
+}
+
+/*
+ * Client side of tls:// connections: verifies the server against the
+ * host name of the URI, see RPC_CONNECTION_TLS_VERIFY.
+ */
+static int
+socket_tls_connect(struct socket_connection *conn, const char *uri,
+    rpc_object_t params)
+{
+	struct socket_tls *tls;
+	struct yuarel parsed;
+	char *uri_copy;
+	int ret;
+
+	if (!g_str_has_prefix(uri, "tls://"))
+		return (0);
+
+	tls = socket_tls_new(params, false);
+	if (tls == NULL)
+		return (-1);
+
+	uri_copy = g_strdup(uri);
+	if (yuarel_parse(&parsed, uri_copy) != 0)
+		parsed.host = NULL;
+
+	ret = socket_tls_handshake(tls, conn->sc_socket, parsed.host);
+	g_free(uri_copy);
+	socket_tls_free(tls);
+	return (ret);
+}
+#endif
+
+/*
+ * Binds every accept shard to @p addr. With more than one, each shard
+ * gets its own socket with SO_REUSEPORT set, so the kernel balances new
+ * connections between them instead of waking every acceptor for each
+ * one. Later shards bind to the address the first one ended up with, in
+ * case an ephemeral port was requested.
+ */
+static int
+socket_bind_shards(struct socket_server *server, GSocketAddress *addr,
+    GError **err)
+{
+	GSocketAddress *bound;
+	GSocket *sock;
+	guint i;
+
+	bound = g_object_ref(addr);
+	for (i = 0; i < server->ss_nshards; i++) {
+		sock = g_socket_new(g_socket_address_get_family(bound),
+		    G_SOCKET_TYPE_STREAM, G_SOCKET_PROTOCOL_DEFAULT, err);
+		if (sock == NULL)
+			break;
+
+#if defined(SO_REUSEPORT)
+		if (server->ss_nshards > 1 && !g_socket_set_option(sock,
+		    SOL_SOCKET, SO_REUSEPORT, true, err)) {
+			g_object_unref(sock);
+			break;
+		}
+#endif
+
+		if (!g_socket_bind(sock, bound, true, err) ||
+		    !g_socket_listen(sock, err)) {
+			g_object_unref(sock);
+			break;
+		}
+
+		if (i == 0) {
+			g_object_unref(bound);
+			bound = g_socket_get_local_address(sock, err);
+			if (bound == NULL) {
+				g_object_unref(sock);
+				return (-1);
+			}
+		}
+
+		if (socket_shard_start(server, i, sock, err) != 0)
+			break;
+	}
+
+	g_object_unref(bound);
+	return (*err != NULL ? -1 : 0);
+}
+
+/*
+ * Hands @p sock, bound and listening, to shard @p index. The first
+ * shard accepts on the server main context once socket_listen() is
+ * done; any other starts accepting on a thread of its own right away.
+ */
+static int
+socket_shard_start(struct socket_server *server, guint index, GSocket *sock,
+    GError **err)
+{
+	struct socket_shard *shard = &server->ss_shards[index];
+
+	if (!g_socket_listener_add_socket(shard->ssh_listener, sock, NULL,
+	    err)) {
+		g_object_unref(sock);
+		return (-1);
+	}
+
+	shard->ssh_socket = sock;
+	if (index == 0)
+		return (0);
+
+	shard->ssh_context = g_main_context_new();
+	shard->ssh_loop = g_main_loop_new(shard->ssh_context, false);
+	g_main_context_push_thread_default(shard->ssh_context);
+	socket_accept_next(shard);
+	g_main_context_pop_thread_default(shard->ssh_context);
+
+	shard->ssh_thread = rpc_thread_new(RPC_THREAD_IO,
+	    "socket accept shard", socket_shard_worker, shard);
+	return (0);
+}
+
+static void *
+socket_shard_worker(void *arg)
+{
+	struct socket_shard *shard = arg;
+
+	g_main_context_push_thread_default(shard->ssh_context);
+	g_main_loop_run(shard->ssh_loop);
+	g_main_context_pop_thread_default(shard->ssh_context);
+	return (NULL);
+}
+
+static gboolean
+socket_shard_stop(gpointer user_data)
+{
+	struct socket_shard *shard = user_data;
+
+	g_main_loop_quit(shard->ssh_loop);
+	return (false);
+}
+
+/*
+ * Closes the listeners and stops the accept threads. Connections hold
+ * a reference to their shard's main context, so it outlives this.
+ */
+static void
+socket_stop_shards(struct socket_server *server)
+{
+	struct socket_shard *shard;
+	guint i;
+
+	for (i = 0; i < server->ss_nshards; i++) {
+		shard = &server->ss_shards[i];
+		g_mutex_lock(&server->ss_mtx);
+		if (shard->ssh_outstanding_accept)
+			g_cancellable_cancel(shard->ssh_cancellable);
+		g_socket_listener_close(shard->ssh_listener);
+		g_mutex_unlock(&server->ss_mtx);
+
+		if (shard->ssh_thread != NULL) {
+			g_main_context_invoke(shard->ssh_context,
+			    socket_shard_stop, shard);
+			g_thread_join(shard->ssh_thread);
+			g_main_loop_unref(shard->ssh_loop);
+			g_main_context_unref(shard->ssh_context);
+		}
+		g_object_unref(shard->ssh_listener);
+		if (shard->ssh_socket != NULL)
+			g_object_unref(shard->ssh_socket);
+	}
 }
 
 int
 socket_connect(struct rpc_connection *rco, const char *uri,
-    rpc_object_t args __unused)
+    rpc_object_t args)
 {
 	GError *err = NULL;
 	GSocket *sock = NULL;
@@ -286,18 +852,48 @@ socket_connect(struct rpc_connection *rco, const char *uri,
 	conn = g_malloc0(sizeof(*conn));
 	conn->sc_parent = rco;
 	conn->sc_uri = strdup(uri);
+	conn->sc_socket = sock;
 	g_mutex_init(&conn->sc_abort_mtx);
+	g_cond_init(&conn->sc_detach_cv);
+
+	if (socket_set_options(conn, args, &err) != 0) {
+		rpc_set_last_gerror(err);
+		g_error_free(err);
+		g_mutex_clear(&conn->sc_abort_mtx);
+		g_free(conn->sc_uri);
+		g_free(conn);
+		if (addr != NULL)
+			g_object_unref(addr);
+
+		g_object_unref(sock);
+		return (-1);
+	}
+
+#if defined(KTLS_SUPPORT)
+	if (addr != NULL && socket_tls_connect(conn, uri, args) != 0) {
+		g_mutex_clear(&conn->sc_abort_mtx);
+		g_free(conn->sc_uri);
+		g_free(conn);
+		g_object_unref(addr);
+		g_object_unref(sock);
+		return (-1);
+	}
+#endif
 
 	rco->rco_release = socket_release;
 	rco->rco_abort = socket_abort;
 	rco->rco_arg = conn;
 
-	conn->sc_socket = sock;
 	rco->rco_send_msg = socket_send_msg;
+	rco->rco_send_msgv = socket_send_msgv;
+	rco->rco_send_begin = socket_send_begin;
+	rco->rco_send_chunk = socket_send_chunk;
+	rco->rco_send_batch = socket_send_batch;
 	rco->rco_get_fd = socket_get_fd;
+	rco->rco_detach = socket_detach;
 	conn->sc_cancellable = g_cancellable_new ();
-	conn->sc_reader_thread = g_thread_new("socket reader thread",
-	    socket_reader, (gpointer)conn);
+	conn->sc_reader_thread = rpc_thread_new(RPC_THREAD_IO,
+	    "socket reader thread", socket_reader, (gpointer)conn);
 
 	g_object_unref(addr);
 	return (0);
@@ -311,16 +907,34 @@ socket_listen(struct rpc_server *srv, const char *uri,
 	GFile *file = NULL;
 	GUnixSocketAddress *uaddr;
 	GSocketAddress *addr = NULL;
-	GSocket *sock = NULL;
+	GSocket *sock;
 	struct socket_server *server;
+	rpc_object_t fds = NULL;
+	rpc_object_t fd;
 	mode_t unix_socket_mode = 0660;
+	guint io_threads = 0;
+	guint shards = 1;
+	guint i;
+	bool io_uring = false;
+#if defined(KTLS_SUPPORT)
+	struct socket_tls *tls = NULL;
+	rpc_object_t error;
+#endif
 
-	if (args != NULL && rpc_get_type(args) == RPC_TYPE_FD) {
-		sock = g_socket_new_from_fd(rpc_fd_get_value(args), &err);
-		if (sock == NULL) {
-			srv->rs_error = rpc_error_create(err->code,
-			    err->message, NULL);
-			g_error_free(err);
+	if (args != NULL && rpc_get_type(args) == RPC_TYPE_FD)
+		fds = args;
+	else if (args != NULL && rpc_get_type(args) == RPC_TYPE_DICTIONARY)
+		fds = rpc_dictionary_get_value(args, RPC_SERVER_LISTEN_FD);
+
+	if (fds != NULL) {
+		/* One inherited socket per accept shard */
+		if (rpc_get_type(fds) == RPC_TYPE_ARRAY)
+			shards = (guint)MIN(rpc_array_get_count(fds),
+			    SOCKET_MAX_SHARDS);
+
+		if (shards == 0) {
+			srv->rs_error = rpc_error_create(EINVAL,
+			    "No listening socket given", NULL);
 			return (-1);
 		}
 	} else {
@@ -333,14 +947,109 @@ socket_listen(struct rpc_server *srv, const char *uri,
 
 		if (args != NULL && rpc_get_type(args) == RPC_TYPE_INT64)
 			unix_socket_mode = (mode_t)rpc_int64_get_value(args);
+
+#if defined(KTLS_SUPPORT)
+		if (g_str_has_prefix(uri, "tls://")) {
+			tls = socket_tls_new(srv->rs_params, true);
+			if (tls == NULL) {
+				error = rpc_get_last_error();
+				srv->rs_error = rpc_error_create(
+				    rpc_error_get_code(error),
+				    rpc_error_get_message(error), NULL);
+				g_object_unref(addr);
+				return (-1);
+			}
+		}
+#endif
+
+		if (args != NULL &&
+		    rpc_get_type(args) == RPC_TYPE_DICTIONARY &&
+		    rpc_dictionary_has_key(args, RPC_SERVER_UNIX_MODE)) {
+			unix_socket_mode = (mode_t)rpc_dictionary_get_int64(
+			    args, RPC_SERVER_UNIX_MODE);
+		}
+	}
+
+	if (args != NULL && rpc_get_type(args) == RPC_TYPE_DICTIONARY &&
+	    !g_strcmp0(rpc_dictionary_get_string(args, RPC_SERVER_IO_MODEL),
+	    RPC_SERVER_IO_URING)) {
+#if defined(LIBURING_SUPPORT)
+		io_uring = true;
+#else
+		srv->rs_error = rpc_error_create(ENOTSUP,
+		    "librpc was built without io_uring support", NULL);
+		if (addr != NULL)
+			g_object_unref(addr);
+
+		return (-1);
+#endif
+	}
+
+	if (args != NULL && rpc_get_type(args) == RPC_TYPE_DICTIONARY &&
+	    (io_uring || !g_strcmp0(rpc_dictionary_get_string(args,
+	    RPC_SERVER_IO_MODEL), RPC_SERVER_IO_EPOLL))) {
+#if defined(__linux__)
+		io_threads = (guint)rpc_dictionary_get_uint64(args,
+		    RPC_SERVER_IO_THREADS);
+		if (io_threads == 0)
+			io_threads = MIN(g_get_num_processors(), 4);
+
+		io_threads = MIN(io_threads, SOCKET_IO_MAX_THREADS);
+#else
+		srv->rs_error = rpc_error_create(ENOTSUP,
+		    "epoll I/O model is not supported on this platform", NULL);
+		if (addr != NULL)
+			g_object_unref(addr);
+
+		return (-1);
+#endif
+	}
+
+	if (fds == NULL && args != NULL &&
+	    rpc_get_type(args) == RPC_TYPE_DICTIONARY &&
+	    rpc_dictionary_get_uint64(args, RPC_SERVER_ACCEPT_SHARDS) > 1) {
+#if defined(__linux__)
+		if (addr == NULL || !G_IS_INET_SOCKET_ADDRESS(addr)) {
+			srv->rs_error = rpc_error_create(EINVAL,
+			    "Accept shards need a TCP address", NULL);
+			if (addr != NULL)
+				g_object_unref(addr);
+
+			return (-1);
+		}
+
+		shards = (guint)MIN(rpc_dictionary_get_uint64(args,
+		    RPC_SERVER_ACCEPT_SHARDS), SOCKET_MAX_SHARDS);
+#else
+		srv->rs_error = rpc_error_create(ENOTSUP,
+		    "Accept shards are not supported on this platform", NULL);
+		if (addr != NULL)
+			g_object_unref(addr);
+
+		return (-1);
+#endif
 	}
 
 	server = g_malloc0(sizeof(*server));
 	server->ss_server = srv;
 	server->ss_uri = strdup(uri);
-	server->ss_listener = g_socket_listener_new();
+	server->ss_io_threads = io_threads;
+	server->ss_io_uring = io_uring;
+	server->ss_shards = g_new0(struct socket_shard, shards);
+	server->ss_nshards = shards;
+#if defined(KTLS_SUPPORT)
+	server->ss_tls = tls;
+	g_cond_init(&server->ss_handshake_cv);
+#endif
+	for (i = 0; i < shards; i++) {
+		server->ss_shards[i].ssh_server = server;
+		server->ss_shards[i].ssh_listener = g_socket_listener_new();
+		server->ss_shards[i].ssh_cancellable = g_cancellable_new();
+	}
 
 	srv->rs_teardown = socket_teardown;
+	srv->rs_get_listen_fds = socket_get_listen_fds;
+	srv->rs_adopt = socket_adopt;
 	srv->rs_arg = server;
 	g_mutex_init(&server->ss_mtx);
 
@@ -361,6 +1070,8 @@ socket_listen(struct rpc_server *srv, const char *uri,
 					    err->code, err->message, NULL);
 					g_object_unref(addr);
 					g_error_free(err);
+					socket_stop_shards(server);
+					g_free(server->ss_shards);
 					g_free(server->ss_uri);
 					g_free(server);
 					return (-1);
@@ -369,9 +1080,7 @@ socket_listen(struct rpc_server *srv, const char *uri,
 
 		}
 
-		g_socket_listener_add_address(server->ss_listener, addr,
-		    G_SOCKET_TYPE_STREAM, G_SOCKET_PROTOCOL_DEFAULT, NULL,
-		    NULL, &err);
+		socket_bind_shards(server, addr, &err);
 
 		if (file != NULL) {
 			chmod(g_file_get_path(file), unix_socket_mode);
@@ -381,51 +1090,304 @@ socket_listen(struct rpc_server *srv, const char *uri,
 		g_object_unref(addr);
 	}
 
-	if (sock != NULL)
-		g_socket_listener_add_socket(server->ss_listener, sock, NULL,
-		    &err);
+	for (i = 0; fds != NULL && i < shards && err == NULL; i++) {
+		fd = rpc_get_type(fds) == RPC_TYPE_ARRAY ?
+		    rpc_array_get_value(fds, i) : fds;
+		sock = g_socket_new_from_fd(rpc_fd_get_value(fd), &err);
+		if (sock != NULL)
+			socket_shard_start(server, i, sock, &err);
+	}
 
 	if (err != NULL) {
 		srv->rs_error = rpc_error_create(err->code, err->message, NULL);
 		g_error_free(err);
-		g_object_unref(server->ss_listener);
+		socket_stop_shards(server);
+#if defined(KTLS_SUPPORT)
+		socket_tls_free(server->ss_tls);
+#endif
+		g_free(server->ss_shards);
 		g_free(server->ss_uri);
 		g_free(server);
 		return (-1);
 	}
 
 	/* Schedule first accept */
-	server->ss_cancellable = g_cancellable_new();
-
-	g_mutex_lock(&server->ss_mtx);
-	g_socket_listener_accept_async(server->ss_listener,
-	    server->ss_cancellable, &socket_accept, server);
-	server->ss_outstanding_accept = true;
-	g_mutex_unlock(&server->ss_mtx);
-
+	socket_accept_next(&server->ss_shards[0]);
 	return (0);
 }
 
 static int
 socket_send_msg(void *arg, const void *buf, size_t size, const int *fds,
     size_t nfds)
+{
+	struct iovec iov;
+
+	iov.iov_base = (void *)buf;
+	iov.iov_len = size;
+	return (socket_send_msgv(arg, &iov, 1, fds, nfds));
+}
+
+static int
+socket_send_msgv(void *arg, const struct iovec *vec, size_t nvec,
+    const int *fds, size_t nfds)
+{
+	struct socket_connection *conn = arg;
+	GSocketControlMessage *cmsg[2] = { NULL };
+	GOutputVector *iov;
+	uint32_t header[4] = { 0xdeadbeef, 0, 0, 0 };
+	size_t size = 0;
+	int ncmsg;
+	int ret;
+	size_t i;
+
+	iov = rpc_alloc(RPC_ALLOC_TAG_TRANSPORT, (nvec + 1) * sizeof(*iov));
+	iov[0] = (GOutputVector){ .buffer = header, .size = sizeof(header) };
+
+	for (i = 0; i < nvec; i++) {
+		iov[i + 1] = (GOutputVector){
+			.buffer = vec[i].iov_base,
+			.size = vec[i].iov_len
+		};
+
+		size += vec[i].iov_len;
+	}
+
+	header[1] = (uint32_t)size;
+	debugf("sending frame: len=%zu, nvec=%zu, nfds=%zu", size, nvec, nfds);
+
+	ncmsg = socket_make_cmsgs(conn, fds, nfds, cmsg);
+	ret = socket_send_vectors(conn, iov, nvec + 1, size + sizeof(header),
+	    cmsg, ncmsg);
+
+	for (i = 0; i < (size_t)ncmsg; i++)
+		g_object_unref(cmsg[i]);
+
+	rpc_free(RPC_ALLOC_TAG_TRANSPORT, iov, (nvec + 1) * sizeof(*iov));
+	return (ret);
+}
+
+static int
+socket_send_begin(void *arg, size_t size, const int *fds, size_t nfds)
 {
 	struct socket_connection *conn = arg;
-	GError *err = NULL;
 	GSocketControlMessage *cmsg[2] = { NULL };
-	GOutputVector iov[2];
-	uint32_t header[4] = { 0xdeadbeef, (uint32_t)size, 0, 0 };
+	GOutputVector iov;
+	uint32_t header[4] = { 0xdeadbeef, 0, 0, 0 };
+	int ncmsg;
+	int ret;
+	int i;
+
+	header[1] = (uint32_t)size;
+	iov = (GOutputVector){ .buffer = header, .size = sizeof(header) };
+	debugf("streaming frame: len=%zu, nfds=%zu", size, nfds);
+
+	/*
+	 * The header goes out in the same sendmsg as the first chunk.
+	 * The fds stay with the caller until the frame has been sent.
+	 */
+	conn->sc_stream_left = size;
+	if (size > 0) {
+		memcpy(conn->sc_stream_hdr, header, sizeof(header));
+		conn->sc_stream_hdr_pending = true;
+		conn->sc_stream_fds = fds;
+		conn->sc_stream_nfds = nfds;
+		socket_cork(conn, true);
+		return (0);
+	}
+
+	ncmsg = socket_make_cmsgs(conn, fds, nfds, cmsg);
+	ret = socket_send_vectors(conn, &iov, 1, sizeof(header), cmsg, ncmsg);
+
+	for (i = 0; i < ncmsg; i++)
+		g_object_unref(cmsg[i]);
+
+	return (ret);
+}
+
+#if defined(__linux__)
+/*
+ * Sends a file-backed binary straight from the page cache. Returns 1
+ * when the kernel can't sendfile() to this socket so that the caller
+ * falls back to writing the mapping.
+ */
+static int
+socket_sendfile(struct socket_connection *conn, int fd, off_t offset,
+    size_t len)
+{
+	GError *err = NULL;
+	int sock = g_socket_get_fd(conn->sc_socket);
 	size_t done = 0;
-	ssize_t step;
-	size_t tmp;
-	int ncmsg = 0;
-	int ret = 0;
+	ssize_t ret;
+
+	while (done < len) {
+		ret = sendfile(sock, fd, &offset,
+		    MIN(len - done, SOCKET_SENDFILE_CHUNK));
+		if (ret > 0) {
+			done += (size_t)ret;
+			continue;
+		}
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+
+		if (ret < 0 && errno == EAGAIN) {
+			if (!g_socket_condition_wait(conn->sc_socket, G_IO_OUT,
+			    NULL, &err)) {
+				conn->sc_parent->rco_error =
+				    rpc_error_create_from_gerror(err);
+				g_error_free(err);
+				return (-1);
+			}
+
+			continue;
+		}
+
+		if (ret < 0 && done == 0 &&
+		    (errno == EINVAL || errno == ENOSYS))
+			return (1);
+
+		if (ret == 0) {
+			conn->sc_parent->rco_error = rpc_error_create(EIO,
+			    "File truncated while sending", NULL);
+			return (-1);
+		}
+
+		conn->sc_parent->rco_error = rpc_error_create(errno,
+		    strerror(errno), NULL);
+		return (-1);
+	}
+
+	return (0);
+}
+#endif
+
+/*
+ * Sends the header held back by socket_send_begin(), followed by @p len
+ * bytes from @p iov if there are any.
+ */
+static int
+socket_send_stream_hdr(struct socket_connection *conn, GOutputVector *iov,
+    size_t len)
+{
+	GSocketControlMessage *cmsg[2] = { NULL };
+	GOutputVector vec[2];
+	int ncmsg;
+	int ret;
 	int i;
 
-	debugf("sending frame: addr=%p, len=%zu, nfds=%zu", buf, size, nfds);
+	conn->sc_stream_hdr_pending = false;
+	vec[0] = (GOutputVector){
+		.buffer = conn->sc_stream_hdr,
+		.size = sizeof(conn->sc_stream_hdr)
+	};
+	if (len > 0)
+		vec[1] = *iov;
 
-	iov[0] = (GOutputVector){ .buffer = header, .size = sizeof(header) };
-	iov[1] = (GOutputVector){ .buffer = buf, .size = size };
+	ncmsg = socket_make_cmsgs(conn, conn->sc_stream_fds,
+	    conn->sc_stream_nfds, cmsg);
+	ret = socket_send_vectors(conn, vec, len > 0 ? 2 : 1,
+	    sizeof(conn->sc_stream_hdr) + len, cmsg, ncmsg);
+
+	for (i = 0; i < ncmsg; i++)
+		g_object_unref(cmsg[i]);
+
+	conn->sc_stream_fds = NULL;
+	conn->sc_stream_nfds = 0;
+
+	/* The rest of the frame isn't coming, don't hold back what follows */
+	if (ret != 0) {
+		conn->sc_stream_left = 0;
+		socket_cork(conn, false);
+	}
+
+	return (ret);
+}
+
+static int
+socket_send_chunk(void *arg, const void *buf, size_t len)
+{
+	struct socket_connection *conn = arg;
+	GOutputVector iov = { .buffer = buf, .size = len };
+	int ret = 1;
+#if defined(__linux__)
+	off_t offset;
+	int fd;
+
+	if (len >= SOCKET_SENDFILE_MIN &&
+	    rpc_data_file_range(buf, len, &fd, &offset)) {
+		ret = conn->sc_stream_hdr_pending ?
+		    socket_send_stream_hdr(conn, NULL, 0) : 0;
+		if (ret == 0)
+			ret = socket_sendfile(conn, fd, offset, len);
+	}
+#endif
+
+	if (ret > 0 && conn->sc_stream_hdr_pending)
+		ret = socket_send_stream_hdr(conn, &iov, len);
+	else if (ret > 0)
+		ret = socket_send_vectors(conn, &iov, 1, len, NULL, 0);
+	if (conn->sc_stream_left > 0) {
+		conn->sc_stream_left -= MIN(len, conn->sc_stream_left);
+		if (conn->sc_stream_left == 0 || ret != 0)
+			socket_cork(conn, false);
+	}
+
+	return (ret);
+}
+
+static int
+socket_send_batch(void *arg, const struct iovec *frames, size_t nframes)
+{
+	struct socket_connection *conn = arg;
+	GSocketControlMessage *cmsg[2] = { NULL };
+	GOutputVector *iov;
+	uint32_t (*headers)[4];
+	size_t size = 0;
+	int ncmsg;
+	int ret;
+	size_t i;
+
+	/* One 16-byte header in front of every frame, one sendmsg */
+	iov = rpc_alloc(RPC_ALLOC_TAG_TRANSPORT, nframes * 2 * sizeof(*iov));
+	headers = rpc_alloc0(RPC_ALLOC_TAG_TRANSPORT,
+	    nframes * sizeof(*headers));
+
+	for (i = 0; i < nframes; i++) {
+		headers[i][0] = 0xdeadbeef;
+		headers[i][1] = (uint32_t)frames[i].iov_len;
+		iov[i * 2] = (GOutputVector){
+			.buffer = headers[i],
+			.size = sizeof(headers[i])
+		};
+		iov[i * 2 + 1] = (GOutputVector){
+			.buffer = frames[i].iov_base,
+			.size = frames[i].iov_len
+		};
+
+		size += sizeof(headers[i]) + frames[i].iov_len;
+	}
+
+	debugf("sending batch: frames=%zu, len=%zu", nframes, size);
+
+	/* A batch that does not fit one sendmsg still leaves in full segments */
+	socket_cork(conn, true);
+	ncmsg = socket_make_cmsgs(conn, NULL, 0, cmsg);
+	ret = socket_send_vectors(conn, iov, nframes * 2, size, cmsg, ncmsg);
+	socket_cork(conn, false);
+
+	for (i = 0; i < (size_t)ncmsg; i++)
+		g_object_unref(cmsg[i]);
+
+	rpc_free(RPC_ALLOC_TAG_TRANSPORT, headers, nframes * sizeof(*headers));
+	rpc_free(RPC_ALLOC_TAG_TRANSPORT, iov, nframes * 2 * sizeof(*iov));
+	return (ret);
+}
+
+static int
+socket_make_cmsgs(struct socket_connection *conn, const int *fds, size_t nfds,
+    GSocketControlMessage **cmsg)
+{
+	int ncmsg = 0;
 
 #ifndef _WIN32
 	if (g_unix_credentials_message_is_supported()) {
@@ -440,57 +1402,150 @@ socket_send_msg(void *arg, const void *buf, size_t size, const int *fds,
 	}
 #endif
 
+	return (ncmsg);
+}
+
+/*
+ * Applies the socket tuning parameters, see RPC_CONNECTION_TCP_NODELAY and
+ * friends. TCP sockets get TCP_NODELAY unless asked otherwise: frames are
+ * complete messages, and waiting for the peer's delayed ACK only stalls
+ * request/response exchanges.
+ */
+static int
+socket_set_options(struct socket_connection *conn, rpc_object_t params,
+    GError **err)
+{
+	GSocket *sock = conn->sc_socket;
+	GSocketFamily family;
+	bool nodelay = true;
+	uint64_t value;
+
+	family = g_socket_get_family(sock);
+	conn->sc_tcp = (family == G_SOCKET_FAMILY_IPV4 ||
+	    family == G_SOCKET_FAMILY_IPV6) &&
+	    g_socket_get_socket_type(sock) == G_SOCKET_TYPE_STREAM;
+
+	if (params != NULL && rpc_get_type(params) != RPC_TYPE_DICTIONARY)
+		params = NULL;
+
+	if (params != NULL &&
+	    rpc_dictionary_has_key(params, RPC_CONNECTION_TCP_NODELAY))
+		nodelay = rpc_dictionary_get_bool(params,
+		    RPC_CONNECTION_TCP_NODELAY);
+
+	if (conn->sc_tcp &&
+	    !g_socket_set_option(sock, IPPROTO_TCP, TCP_NODELAY, nodelay, err))
+		return (-1);
+
+	if (params == NULL)
+		return (0);
+
+	value = rpc_dictionary_get_uint64(params, RPC_CONNECTION_SNDBUF);
+	if (value > 0 && !g_socket_set_option(sock, SOL_SOCKET, SO_SNDBUF,
+	    (gint)MIN(value, G_MAXINT), err))
+		return (-1);
+
+	value = rpc_dictionary_get_uint64(params, RPC_CONNECTION_RCVBUF);
+	if (value > 0 && !g_socket_set_option(sock, SOL_SOCKET, SO_RCVBUF,
+	    (gint)MIN(value, G_MAXINT), err))
+		return (-1);
+
+#if defined(__linux__)
+	conn->sc_quickack = conn->sc_tcp &&
+	    rpc_dictionary_get_bool(params, RPC_CONNECTION_TCP_QUICKACK);
+	socket_quickack(conn);
+
+#if defined(SO_BUSY_POLL)
+	value = rpc_dictionary_get_uint64(params, RPC_CONNECTION_BUSY_POLL);
+	if (value > 0 && !g_socket_set_option(sock, SOL_SOCKET, SO_BUSY_POLL,
+	    (gint)MIN(value, G_MAXINT), err))
+		return (-1);
+#endif
+#endif
+
+	return (0);
+}
+
+static void
+socket_cork(struct socket_connection *conn, bool on)
+{
+
+#if defined(__linux__)
+	if (conn->sc_tcp)
+		g_socket_set_option(conn->sc_socket, IPPROTO_TCP, TCP_CORK,
+		    on, NULL);
+#endif
+}
+
+/*
+ * The kernel drops back to delayed ACKs on its own, so quick ACK mode is
+ * re-armed after every read.
+ */
+static void
+socket_quickack(struct socket_connection *conn)
+{
+
+#if defined(__linux__)
+	if (conn->sc_quickack)
+		g_socket_set_option(conn->sc_socket, IPPROTO_TCP, TCP_QUICKACK,
+		    true, NULL);
+#endif
+}
+
+static int
+socket_send_vectors(struct socket_connection *conn, GOutputVector *iov,
+    size_t niov, size_t size, GSocketControlMessage **cmsg, int ncmsg)
+{
+	GError *err = NULL;
+	size_t done = 0;
+	size_t first = 0;
+	ssize_t step;
+	size_t tmp;
+
 	for (;;) {
-		step = g_socket_send_message(conn->sc_socket, NULL, iov, 2,
-		    cmsg, ncmsg, 0, NULL, &err);
+		/* Longer vectors fail with EINVAL, the rest goes next round */
+		step = g_socket_send_message(conn->sc_socket, NULL, &iov[first],
+		    (gint)MIN(niov - first, IOV_MAX), done == 0 ? cmsg : NULL,
+		    done == 0 ? ncmsg : 0, 0, NULL, &err);
 		if (err != NULL) {
 			conn->sc_parent->rco_error =
 			    rpc_error_create_from_gerror(err);
 			g_error_free(err);
-			ret = -1;
-			goto done;
+			return (-1);
 		}
 
 		if (step == 0) {
 			conn->sc_parent->rco_error = rpc_error_create(
 			    ECONNRESET, "Connection terminated", NULL);
-			ret = -1;
-			goto done;
+			return (-1);
 		}
 
 		done += step;
 
-		if (done == size + sizeof(header))
-			break;
+		if (done == size)
+			return (0);
 
-		for (i = 0; i < 2; i++) {
-			tmp = MIN((size_t)step, (size_t)iov[i].size);
-			iov[i].size -= tmp;
-			iov[i].buffer += tmp;
+		/* Skip over segments that went out completely */
+		for (; first < niov && step > 0; first++) {
+			tmp = MIN((size_t)step, iov[first].size);
+			iov[first].size -= tmp;
+			iov[first].buffer = (const char *)iov[first].buffer + tmp;
 			step -= tmp;
+
+			if (iov[first].size > 0)
+				break;
 		}
 	}
-
-done:
-	for (i = 0; i < ncmsg; i++)
-		g_object_unref(cmsg[i]);
-
-	return (ret);
 }
 
-static int
-socket_recv_msg(struct socket_connection *conn, void **frame, size_t *size,
-    int **fds, size_t *nfds)
+static ssize_t
+socket_recv_raw(struct socket_connection *conn, void *buf, size_t len)
 {
 	GError *err = NULL;
 	GSocketControlMessage **cmsg = NULL;
-	GInputVector iov[2];
-	uint32_t header[4];
+	GInputVector iov = { .buffer = buf, .size = len };
+	struct socket_fdset *set;
 	ssize_t step;
-	size_t length = 0;
-	size_t done = 0;
-	size_t tmp;
-	bool have_header = false;
 	int ncmsg = 0, i;
 	int nfds_i;
 #if defined(__linux__)
@@ -500,55 +1555,24 @@ socket_recv_msg(struct socket_connection *conn, void **frame, size_t *size,
 	GCredentials *cr;
 #endif
 
-	*nfds = 0;
-	iov[0] = (GInputVector){ .buffer = header, .size = sizeof(header) };
-	iov[1] = (GInputVector){ .buffer = NULL, .size = 0 };
-
-	for (;;) {
-		step = g_socket_receive_message(conn->sc_socket, NULL, iov, 2,
-		    have_header ? NULL : &cmsg, have_header ? NULL : &ncmsg,
-		    0, conn->sc_cancellable, &err);
-		if (err != NULL) {
-			conn->sc_parent->rco_error =
-			    rpc_error_create_from_gerror(err);
+	step = g_socket_receive_message(conn->sc_socket, NULL, &iov, 1,
+	    &cmsg, &ncmsg, 0, conn->sc_cancellable, &err);
+	if (err != NULL) {
+		/* Stopped by socket_detach(), not a transport failure */
+		if (conn->sc_detached) {
 			g_error_free(err);
 			return (-1);
 		}
 
+		conn->sc_parent->rco_error = rpc_error_create_from_gerror(err);
+		g_error_free(err);
+		return (-1);
+	}
 
-		if (step == 0) {
-			conn->sc_parent->rco_error = rpc_error_create(
-			    ECONNRESET, "Connection terminated", NULL);
-			return (-1);
-		}
-
-		done += step;
-
-		for (i = 0; i < 2; i++) {
-			tmp = MIN((size_t)step, (size_t)iov[i].size);
-			iov[i].size -= tmp;
-			iov[i].buffer += tmp;
-			step -= tmp;
-		}
-
-		if (!have_header && done >= sizeof(header)) {
-			/* First vector should be fully exhausted by now */
-			g_assert(iov[0].size == 0);
-
-			/* Now we have read enough to decode the header */
-			if (header[0] != 0xdeadbeef)
-				return (-1);
-
-			have_header = true;
-			length = header[1];
-			*size = length;
-			*frame = g_malloc(length);
-			iov[1].buffer = *frame + done - sizeof(header);
-			iov[1].size = length - done + sizeof(header);
-		}
-
-		if (done == length + sizeof(header))
-			break;
+	if (step == 0) {
+		conn->sc_parent->rco_error = rpc_error_create(ECONNRESET,
+		    "Connection terminated", NULL);
+		return (-1);
 	}
 
 #ifndef _WIN32
@@ -577,9 +1601,13 @@ socket_recv_msg(struct socket_connection *conn, void **frame, size_t *size,
 #endif
 
 		if (G_IS_UNIX_FD_MESSAGE(cmsg[i])) {
-			*fds = g_unix_fd_message_steal_fds(
+			set = g_malloc0(sizeof(*set));
+			set->sf_start = conn->sc_rx_pos;
+			set->sf_end = conn->sc_rx_pos + (size_t)step;
+			set->sf_fds = g_unix_fd_message_steal_fds(
 			    G_UNIX_FD_MESSAGE(cmsg[i]), &nfds_i);
-			*nfds = (size_t)nfds_i;
+			set->sf_nfds = (size_t)nfds_i;
+			g_queue_push_tail(&conn->sc_rx_fds, set);
 		}
 
 		g_object_unref(cmsg[i]);
@@ -589,65 +1617,318 @@ socket_recv_msg(struct socket_connection *conn, void **frame, size_t *size,
 	if (cmsg != NULL)
 		g_free(cmsg);
 
-	g_cancellable_reset(conn->sc_cancellable);
-	return (0);
+	socket_quickack(conn);
+	conn->sc_rx_pos += (size_t)step;
+	return (step);
 }
 
 static int
-socket_abort(void *arg)
+socket_recv_header(struct socket_connection *conn, size_t *size, int **fds,
+    size_t *nfds)
 {
-	struct socket_connection *conn = arg;
+	struct socket_fdset *set;
+	uint32_t header[4];
+	uint64_t end;
 
-	g_mutex_lock(&conn->sc_abort_mtx);
-	if (!conn->sc_aborted) {
-		conn->sc_aborted = true;
-		g_mutex_unlock(&conn->sc_abort_mtx);
+	*fds = NULL;
+	*nfds = 0;
 
-		g_socket_shutdown(conn->sc_socket, true, true, NULL);
-		g_socket_close(conn->sc_socket, NULL);
+	if (socket_recv_exact(conn, header, sizeof(header)) != 0)
+		return (-1);
+
+	if (header[0] != 0xdeadbeef)
+		return (-1);
+
+	*size = header[1];
+	end = conn->sc_rx_consumed + *size;
+
+	/*
+	 * The kernel never carries on past a message with descriptors
+	 * attached, so the descriptors of a read belong to the last frame
+	 * starting within it: the one whose successor starts at or after
+	 * the end of that read.
+	 */
+	set = g_queue_peek_head(&conn->sc_rx_fds);
+	if (set != NULL && set->sf_end <= end) {
+		g_queue_pop_head(&conn->sc_rx_fds);
+		*fds = set->sf_fds;
+		*nfds = set->sf_nfds;
+		g_free(set);
+	}
 
-		if (conn->sc_reader_thread) {
-			conn->sc_abort_timeout =
-			    g_timeout_source_new_seconds(SC_ABORT_TIMEOUT);
-			g_source_set_callback(conn->sc_abort_timeout,
-			    &socket_abort_timeout, conn, NULL);
-			g_source_attach(conn->sc_abort_timeout,
-			    conn->sc_parent->rco_main_context);
-			g_thread_join(conn->sc_reader_thread);
-			if (!g_source_is_destroyed(conn->sc_abort_timeout))
-				g_source_destroy(conn->sc_abort_timeout);
-		}
-	} else
-		g_mutex_unlock(&conn->sc_abort_mtx);
 	return (0);
 }
 
-static gboolean
-socket_abort_timeout(gpointer user_data)
+/*
+ * Reads go through a readahead buffer, so that a burst of small frames
+ * costs a single receive call instead of two per frame. Reads at least
+ * as large as the buffer go straight to the caller.
+ */
+/*
+ * Polls the socket for up to the spin time of RPC_SPIN_READER, so that
+ * the blocking receive that follows finds the data already there.
+ */
+static void
+socket_recv_spin(struct socket_connection *conn)
 {
-	struct socket_connection *conn = user_data;
+	struct rpc_spin spin;
+	bool hit = false;
 
-	if (g_source_is_destroyed(g_main_current_source()))
-		return (false);
+	if (!rpc_spin_begin(&spin, RPC_SPIN_READER))
+		return;
 
-	g_assert(g_main_current_source() == conn->sc_abort_timeout);
-	g_source_destroy(conn->sc_abort_timeout);
-	g_cancellable_cancel (conn->sc_cancellable);
-	return (false);
+	do {
+		if (g_socket_condition_check(conn->sc_socket,
+		    G_IO_IN | G_IO_HUP | G_IO_ERR) != 0) {
+			hit = true;
+			break;
+		}
+	} while (rpc_spin_next(&spin));
+
+	rpc_spin_end(&spin, hit);
 }
 
-static int
-socket_get_fd(void *arg)
+static ssize_t
+socket_recv_data(struct socket_connection *conn, void *buf, size_t len)
 {
-	struct socket_connection *conn = arg;
+	ssize_t step;
 
-	return (g_socket_get_fd(conn->sc_socket));
+	if (conn->sc_ra_start == conn->sc_ra_end) {
+		socket_recv_spin(conn);
+		if (len >= SOCKET_READAHEAD) {
+			step = socket_recv_raw(conn, buf, len);
+			if (step > 0)
+				conn->sc_rx_consumed += (size_t)step;
+
+			return (step);
+		}
+
+		if (conn->sc_ra_buf == NULL)
+			conn->sc_ra_buf = rpc_alloc(RPC_ALLOC_TAG_TRANSPORT,
+			    SOCKET_READAHEAD);
+
+		step = socket_recv_raw(conn, conn->sc_ra_buf, SOCKET_READAHEAD);
+		if (step < 0)
+			return (-1);
+
+		conn->sc_ra_start = 0;
+		conn->sc_ra_end = (size_t)step;
+	}
+
+	step = (ssize_t)MIN(len, conn->sc_ra_end - conn->sc_ra_start);
+	memcpy(buf, conn->sc_ra_buf + conn->sc_ra_start, (size_t)step);
+	conn->sc_ra_start += (size_t)step;
+	conn->sc_rx_consumed += (size_t)step;
+	return (step);
+}
+
+static int
+socket_recv_exact(struct socket_connection *conn, void *buf, size_t len)
+{
+	ssize_t step;
+	size_t done = 0;
+
+	while (done < len) {
+		step = socket_recv_data(conn, (char *)buf + done, len - done);
+		if (step < 0)
+			return (-1);
+
+		done += step;
+	}
+
+	return (0);
+}
+
+static int
+socket_recv_stream(struct socket_connection *conn, size_t size, int *fds,
+    size_t nfds)
+{
+	rpc_object_t frame;
+	__block size_t remaining = size;
+	ssize_t step;
+
+	if (conn->sc_recv_buf == NULL)
+		conn->sc_recv_buf = rpc_alloc(RPC_ALLOC_TAG_TRANSPORT,
+		    RPC_RECV_CHUNK_SIZE);
+
+	/*
+	 * Build the frame object while the bytes are arriving. The
+	 * reader never asks for more than what is left of this frame.
+	 */
+	frame = rpc_msgpack_deserialize_stream(^(void *buf, size_t len) {
+		ssize_t ret;
+
+		if (remaining == 0)
+			return ((ssize_t)0);
+
+		ret = socket_recv_data(conn, buf, MIN(len, remaining));
+		if (ret > 0)
+			remaining -= ret;
+
+		return (ret);
+	}, conn->sc_recv_buf, RPC_RECV_CHUNK_SIZE);
+
+	/* Skip whatever the parser left behind to stay in sync */
+	while (remaining > 0) {
+		step = socket_recv_data(conn, conn->sc_recv_buf,
+		    MIN(remaining, RPC_RECV_CHUNK_SIZE));
+		if (step < 0) {
+			if (frame != NULL)
+				rpc_release(frame);
+
+			return (-1);
+		}
+
+		remaining -= step;
+	}
+
+	g_cancellable_reset(conn->sc_cancellable);
+	return (conn->sc_parent->rco_recv_object(conn->sc_parent, frame, fds,
+	    nfds));
+}
+
+static int
+socket_abort(void *arg)
+{
+	struct socket_connection *conn = arg;
+
+	g_mutex_lock(&conn->sc_abort_mtx);
+	if (!conn->sc_aborted) {
+		conn->sc_aborted = true;
+		g_mutex_unlock(&conn->sc_abort_mtx);
+
+		/* A detached socket lives on in someone else's hands */
+		if (!conn->sc_detached)
+			g_socket_shutdown(conn->sc_socket, true, true, NULL);
+
+#if defined(__linux__)
+		if (conn->sc_io != NULL) {
+			/* The I/O thread sees the hangup and lets go of us */
+			socket_io_wait(conn);
+			return (0);
+		}
+#endif
+		g_socket_close(conn->sc_socket, NULL);
+
+		if (conn->sc_reader_thread) {
+			conn->sc_abort_timeout =
+			    g_timeout_source_new_seconds(SC_ABORT_TIMEOUT);
+			g_source_set_callback(conn->sc_abort_timeout,
+			    &socket_abort_timeout, conn, NULL);
+			g_source_attach(conn->sc_abort_timeout,
+			    conn->sc_parent->rco_main_context);
+			g_thread_join(conn->sc_reader_thread);
+			if (!g_source_is_destroyed(conn->sc_abort_timeout))
+				g_source_destroy(conn->sc_abort_timeout);
+		}
+	} else
+		g_mutex_unlock(&conn->sc_abort_mtx);
+	return (0);
+}
+
+static gboolean
+socket_abort_timeout(gpointer user_data)
+{
+	struct socket_connection *conn = user_data;
+
+	if (g_source_is_destroyed(g_main_current_source()))
+		return (false);
+
+	g_assert(g_main_current_source() == conn->sc_abort_timeout);
+	g_source_destroy(conn->sc_abort_timeout);
+	g_cancellable_cancel (conn->sc_cancellable);
+	return (false);
+}
+
+static int
+socket_get_fd(void *arg)
+{
+	struct socket_connection *conn = arg;
+
+	return (g_socket_get_fd(conn->sc_socket));
+}
+
+static int
+socket_detach(void *arg, GBytes **pending)
+{
+	struct socket_connection *conn = arg;
+	int fd;
+
+	/* The event-driven receive path has no thread to stop */
+	if (conn->sc_reader_thread == NULL) {
+		rpc_set_last_errorf(ENOTSUP,
+		    "Only reader thread connections can be detached");
+		return (-1);
+	}
+
+	g_mutex_lock(&conn->sc_abort_mtx);
+	if (conn->sc_aborted || conn->sc_reader_done) {
+		g_mutex_unlock(&conn->sc_abort_mtx);
+		rpc_set_last_error(ECONNRESET, "Connection closed", NULL);
+		return (-1);
+	}
+
+	/*
+	 * The reader resets the cancellable between frames, so keep
+	 * cancelling until it notices and stops.
+	 */
+	conn->sc_detached = true;
+	while (!conn->sc_reader_done) {
+		g_cancellable_cancel(conn->sc_cancellable);
+		g_cond_wait_until(&conn->sc_detach_cv, &conn->sc_abort_mtx,
+		    g_get_monotonic_time() + G_TIME_SPAN_MILLISECOND);
+	}
+	g_mutex_unlock(&conn->sc_abort_mtx);
+
+	g_thread_join(conn->sc_reader_thread);
+	conn->sc_reader_thread = NULL;
+
+	fd = fcntl(g_socket_get_fd(conn->sc_socket), F_DUPFD_CLOEXEC, 0);
+	if (fd < 0) {
+		rpc_set_last_errorf(errno, "Cannot duplicate socket: %s",
+		    strerror(errno));
+		return (-1);
+	}
+
+	*pending = NULL;
+	if (conn->sc_ra_end > conn->sc_ra_start) {
+		*pending = g_bytes_new(conn->sc_ra_buf + conn->sc_ra_start,
+		    conn->sc_ra_end - conn->sc_ra_start);
+		conn->sc_ra_start = conn->sc_ra_end;
+	}
+
+	return (fd);
 }
 
 static void
 socket_release(void *arg)
 {
 	struct socket_connection *conn = arg;
+	struct socket_fdset *set;
+	size_t j;
+
+#if defined(__linux__)
+	if (conn->sc_io != NULL) {
+		g_mutex_lock(&conn->sc_io_mtx);
+		if (!conn->sc_io_detached &&
+		    g_private_get(&socket_io_current) == conn->sc_io) {
+			/* Our own I/O thread frees us once it lets go */
+			conn->sc_io_free_pending = true;
+			g_mutex_unlock(&conn->sc_io_mtx);
+			g_socket_shutdown(conn->sc_socket, true, true, NULL);
+			return;
+		}
+		g_mutex_unlock(&conn->sc_io_mtx);
+
+		g_socket_shutdown(conn->sc_socket, true, true, NULL);
+		socket_io_wait(conn);
+		g_socket_close(conn->sc_socket, NULL);
+		socket_io_close_fds(conn);
+		g_free(conn->sc_io_frame);
+		g_cond_clear(&conn->sc_io_cv);
+		g_mutex_clear(&conn->sc_io_mtx);
+	}
+#endif
 
 	if (conn->sc_conn)
 		g_object_unref(conn->sc_conn);
@@ -658,6 +1939,23 @@ socket_release(void *arg)
 			g_source_destroy(conn->sc_abort_timeout);
 		g_source_unref(conn->sc_abort_timeout);
 	}
+	rpc_free(RPC_ALLOC_TAG_TRANSPORT, conn->sc_recv_buf,
+	    RPC_RECV_CHUNK_SIZE);
+	rpc_free(RPC_ALLOC_TAG_TRANSPORT, conn->sc_ra_buf, SOCKET_READAHEAD);
+	if (conn->sc_rbuf != NULL)
+		socket_rbuf_unref(conn->sc_rbuf);
+
+	while ((set = g_queue_pop_head(&conn->sc_rx_fds)) != NULL) {
+		for (j = 0; j < set->sf_nfds; j++)
+			close(set->sf_fds[j]);
+
+		g_free(set->sf_fds);
+		g_free(set);
+	}
+
+	if (conn->sc_context != NULL)
+		g_main_context_unref(conn->sc_context);
+
 	g_free(conn);
 }
 
@@ -666,40 +1964,769 @@ socket_teardown(struct rpc_server *srv)
 {
 	struct socket_server *socket_srv = srv->rs_arg;
 
+	socket_stop_shards(socket_srv);
+#if defined(KTLS_SUPPORT)
 	g_mutex_lock(&socket_srv->ss_mtx);
-	if (socket_srv->ss_outstanding_accept)
-            g_cancellable_cancel (socket_srv->ss_cancellable);
-	g_socket_listener_close(socket_srv->ss_listener);
-	g_object_unref(socket_srv->ss_listener);
+	while (socket_srv->ss_handshakes > 0)
+		g_cond_wait(&socket_srv->ss_handshake_cv, &socket_srv->ss_mtx);
 	g_mutex_unlock(&socket_srv->ss_mtx);
+	socket_tls_free(socket_srv->ss_tls);
+	socket_srv->ss_tls = NULL;
+#endif
+	return (0);
+}
+
+/*
+ * Duplicates the listening socket of every accept shard, in shard
+ * order, for rpc_server_handoff().
+ */
+static int
+socket_get_listen_fds(struct rpc_server *srv, int **fds, size_t *nfds)
+{
+	struct socket_server *socket_srv = srv->rs_arg;
+	guint i;
+	int fd;
+
+	*fds = g_new(int, socket_srv->ss_nshards);
+	*nfds = 0;
+
+	for (i = 0; i < socket_srv->ss_nshards; i++) {
+		fd = fcntl(g_socket_get_fd(socket_srv->ss_shards[i].ssh_socket),
+		    F_DUPFD_CLOEXEC, 0);
+		if (fd < 0) {
+			rpc_set_last_errorf(errno,
+			    "Cannot duplicate socket: %s", strerror(errno));
+			while (*nfds > 0)
+				close((*fds)[--(*nfds)]);
+
+			g_free(*fds);
+			*fds = NULL;
+			return (-1);
+		}
+
+		(*fds)[(*nfds)++] = fd;
+	}
 
 	return (0);
 }
 
+/*
+ * Takes over a connected socket another process detached with
+ * rpc_connection_detach(), along with the bytes it had read ahead.
+ */
+static struct rpc_connection *
+socket_adopt(struct rpc_server *srv, int fd, const void *pending,
+    size_t pending_len)
+{
+	struct socket_server *socket_srv = srv->rs_arg;
+	GSocketConnection *gconn;
+	GSocket *sock;
+	GError *err = NULL;
+
+	if (pending_len > SOCKET_READAHEAD) {
+		rpc_set_last_errorf(E2BIG, "Too many read-ahead bytes");
+		return (NULL);
+	}
+
+	sock = g_socket_new_from_fd(fd, &err);
+	if (sock == NULL) {
+		rpc_set_last_gerror(err);
+		g_error_free(err);
+		return (NULL);
+	}
+
+	gconn = g_socket_connection_factory_create_connection(sock);
+	g_object_unref(sock);
+	return (socket_serve(&socket_srv->ss_shards[0], gconn, true, pending,
+	    pending_len));
+}
+
+static void
+socket_rbuf_unref(struct socket_rbuf *rbuf)
+{
+
+	if (g_atomic_int_dec_and_test(&rbuf->srb_refcnt)) {
+		rpc_free(RPC_ALLOC_TAG_FRAME, rbuf->srb_data, rbuf->srb_size);
+		g_free(rbuf);
+	}
+}
+
+static void
+socket_rbuf_done(gpointer arg)
+{
+	struct socket_rbuf *rbuf = arg;
+
+	g_atomic_int_set(&rbuf->srb_busy, false);
+	socket_rbuf_unref(rbuf);
+}
+
+/*
+ * Receives a frame body of @p len bytes into the connection's receive
+ * buffer and returns it wrapped in a GBytes.
+ */
+static GBytes *
+socket_rbuf_recv(struct socket_connection *conn, size_t len)
+{
+	struct socket_rbuf *rbuf = conn->sc_rbuf;
+
+	if (rbuf != NULL && g_atomic_int_get(&rbuf->srb_busy)) {
+		/* Still referenced by the previous frame's objects */
+		socket_rbuf_unref(rbuf);
+		rbuf = NULL;
+	}
+
+	if (rbuf == NULL) {
+		rbuf = g_malloc0(sizeof(*rbuf));
+		rbuf->srb_refcnt = 1;
+		conn->sc_rbuf = rbuf;
+	}
+
+	/* Grow as needed; give memory back after an unusually large frame */
+	if (rbuf->srb_size < len || (rbuf->srb_size > SOCKET_RBUF_TRIM &&
+	    len < rbuf->srb_size / 4)) {
+		rpc_free(RPC_ALLOC_TAG_FRAME, rbuf->srb_data, rbuf->srb_size);
+		rbuf->srb_size = MAX(len, 1);
+		rbuf->srb_data = rpc_alloc(RPC_ALLOC_TAG_FRAME,
+		    rbuf->srb_size);
+	}
+
+	if (socket_recv_exact(conn, rbuf->srb_data, len) != 0)
+		return (NULL);
+
+	g_atomic_int_inc(&rbuf->srb_refcnt);
+	g_atomic_int_set(&rbuf->srb_busy, true);
+	return (g_bytes_new_with_free_func(rbuf->srb_data, len,
+	    socket_rbuf_done, rbuf));
+}
+
 static void *
 socket_reader(void *arg)
 {
 	struct socket_connection *conn = arg;
-	void *frame;
+	GBytes *bytes;
 	int *fds;
 	size_t len, nfds;
+	bool detached;
+	int ret;
 
 	for (;;) {
-		if (socket_recv_msg(conn, &frame, &len, &fds, &nfds) != 0)
+		if (socket_recv_header(conn, &len, &fds, &nfds) != 0)
 			break;
 
-		if (conn->sc_parent->rco_recv_msg(conn->sc_parent, frame, len,
-		    fds, nfds) != 0) {
-			g_free(frame);
+		/* Compressed frames can only be parsed once complete */
+		if (len > RPC_RECV_STREAM_MIN &&
+		    conn->sc_parent->rco_raw_handler == NULL &&
+		    conn->sc_parent->rco_compressor == NULL) {
+			if (socket_recv_stream(conn, len, fds, nfds) != 0)
+				break;
+
+			continue;
+		}
+
+		/*
+		 * Hand the frame over as a refcounted buffer, so large
+		 * binary leaves can point into it instead of being copied.
+		 */
+		bytes = socket_rbuf_recv(conn, len);
+		if (bytes == NULL)
+			break;
+
+		g_cancellable_reset(conn->sc_cancellable);
+		ret = conn->sc_parent->rco_recv_bytes(conn->sc_parent, bytes,
+		    fds, nfds);
+		g_bytes_unref(bytes);
+
+		if (ret != 0)
+			break;
+	}
+
+	g_mutex_lock(&conn->sc_abort_mtx);
+	detached = conn->sc_detached;
+	conn->sc_reader_done = true;
+	g_cond_broadcast(&conn->sc_detach_cv);
+	g_mutex_unlock(&conn->sc_abort_mtx);
+
+	/* Whoever detached us decides when the connection goes */
+	if (!detached)
+		conn->sc_parent->rco_close(conn->sc_parent);
+
+	return (NULL);
+}
+
+#if defined(__linux__)
+static inline bool
+socket_io_is_uring(struct socket_io_thread *io)
+{
+
+#if defined(LIBURING_SUPPORT)
+	return (io->sit_uring);
+#else
+	return (false);
+#endif
+}
+
+static struct socket_io_thread *
+socket_io_assign(guint nthreads, bool uring)
+{
+	struct socket_io_thread *pool = socket_io_pool[uring];
+	struct socket_io_thread *io;
+	guint idx;
+
+	g_mutex_lock(&socket_io_mtx);
+	while (socket_io_nthreads[uring] < nthreads) {
+		io = &pool[socket_io_nthreads[uring]];
+#if defined(LIBURING_SUPPORT)
+		if (uring && socket_uring_init(io) == 0) {
+			io->sit_thread = rpc_thread_new(RPC_THREAD_IO,
+			    "socket I/O thread", socket_uring_worker, io);
+			socket_io_nthreads[uring]++;
+			continue;
+		}
+#endif
+		/* No usable io_uring: this thread falls back to epoll */
+		io->sit_epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (io->sit_epfd < 0) {
+			g_mutex_unlock(&socket_io_mtx);
+			debugf("epoll_create1 failed: %s", strerror(errno));
+			return (NULL);
+		}
+
+		io->sit_thread = rpc_thread_new(RPC_THREAD_IO,
+		    "socket I/O thread", socket_io_worker, io);
+		socket_io_nthreads[uring]++;
+	}
+	g_mutex_unlock(&socket_io_mtx);
+
+	/* The pool is shared by all servers; spread over what this one asked */
+	idx = g_atomic_int_add(&socket_io_next, 1) % nthreads;
+	return (&pool[idx]);
+}
+
+static int
+socket_io_attach(struct socket_connection *conn, struct socket_io_thread *io)
+{
+	struct epoll_event ev = {
+		.events = EPOLLIN | EPOLLRDHUP,
+		.data.ptr = conn
+	};
+
+	conn->sc_io_detached = false;
+#if defined(LIBURING_SUPPORT)
+	if (io->sit_uring) {
+		if (socket_uring_arm(conn) != 0) {
+			conn->sc_io_detached = true;
+			return (-1);
+		}
+
+		return (0);
+	}
+#endif
+	if (epoll_ctl(io->sit_epfd, EPOLL_CTL_ADD,
+	    g_socket_get_fd(conn->sc_socket), &ev) != 0) {
+		debugf("epoll_ctl failed: %s", strerror(errno));
+		conn->sc_io_detached = true;
+		return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * Reads whatever is available without blocking, delivering complete
+ * frames as they are assembled. Returns false once the connection is
+ * gone. At most SOCKET_IO_BUDGET frames are handled per call so that
+ * one busy peer can't starve the others sharing the thread.
+ */
+static bool
+socket_io_read(struct socket_connection *conn)
+{
+	struct rpc_connection *parent = conn->sc_parent;
+	char control[CMSG_SPACE(sizeof(int) * SOCKET_IO_MAX_FDS)];
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	ssize_t ret;
+	int fd = g_socket_get_fd(conn->sc_socket);
+	int frames = 0;
+	bool ok;
+
+	while (frames < SOCKET_IO_BUDGET) {
+		if (conn->sc_io_header_done < sizeof(conn->sc_io_header)) {
+			/* Descriptors ride along with the frame header */
+			iov.iov_base = (char *)conn->sc_io_header +
+			    conn->sc_io_header_done;
+			iov.iov_len = sizeof(conn->sc_io_header) -
+			    conn->sc_io_header_done;
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_iov = &iov;
+			msg.msg_iovlen = 1;
+			msg.msg_control = control;
+			msg.msg_controllen = sizeof(control);
+
+			ret = recvmsg(fd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+			if (ret < 0 && (errno == EAGAIN || errno == EINTR))
+				return (true);
+
+			if (ret <= 0)
+				goto gone;
+
+			ok = (msg.msg_flags & MSG_CTRUNC) == 0;
+			for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+			    cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+				if (!socket_io_stash_fds(conn, cmsg))
+					ok = false;
+			}
+
+			if (!ok) {
+				socket_io_close_fds(conn);
+				parent->rco_error = rpc_error_create(EBADMSG,
+				    "Too many descriptors in a frame", NULL);
+				return (false);
+			}
+
+			conn->sc_io_header_done += (size_t)ret;
+			if (conn->sc_io_header_done < sizeof(conn->sc_io_header))
+				continue;
+
+			if (conn->sc_io_header[0] != 0xdeadbeef)
+				goto gone;
+
+			conn->sc_io_frame_len = conn->sc_io_header[1];
+			conn->sc_io_frame_done = 0;
+			conn->sc_io_frame = g_malloc(conn->sc_io_frame_len);
+		}
+
+		if (conn->sc_io_frame_done < conn->sc_io_frame_len) {
+			ret = recv(fd, (char *)conn->sc_io_frame +
+			    conn->sc_io_frame_done, conn->sc_io_frame_len -
+			    conn->sc_io_frame_done, MSG_DONTWAIT);
+			if (ret < 0 && (errno == EAGAIN || errno == EINTR))
+				return (true);
+
+			if (ret <= 0)
+				goto gone;
+
+			conn->sc_io_frame_done += (size_t)ret;
+			if (conn->sc_io_frame_done < conn->sc_io_frame_len)
+				continue;
+		}
+
+		if (!socket_io_deliver(conn))
+			return (false);
+
+		frames++;
+	}
+
+	return (true);
+
+gone:
+	if (ret == 0) {
+		parent->rco_error = rpc_error_create(ECONNRESET,
+		    "Connection terminated", NULL);
+	} else if (ret < 0)
+		parent->rco_error = rpc_error_create(errno, strerror(errno),
+		    NULL);
+
+	return (false);
+}
+
+/*
+ * Hands the frame assembled in sc_io_frame over to the connection.
+ */
+static bool
+socket_io_deliver(struct socket_connection *conn)
+{
+	struct rpc_connection *parent = conn->sc_parent;
+	GBytes *bytes;
+	size_t nfds;
+	int ret;
+
+	socket_quickack(conn);
+	bytes = g_bytes_new_take(conn->sc_io_frame, conn->sc_io_frame_len);
+	conn->sc_io_frame = NULL;
+	conn->sc_io_header_done = 0;
+	nfds = conn->sc_io_nfds;
+	conn->sc_io_nfds = 0;
+
+	ret = parent->rco_recv_bytes(parent, bytes,
+	    nfds > 0 ? conn->sc_io_fds : NULL, nfds);
+	g_bytes_unref(bytes);
+	return (ret == 0);
+}
+
+/*
+ * Adds the descriptors a control message carries to the ones pending for
+ * the next frame. Those that don't fit are closed and false is returned,
+ * as the frame can't be delivered without them.
+ */
+static bool
+socket_io_stash_fds(struct socket_connection *conn, struct cmsghdr *cmsg)
+{
+	size_t nfds;
+	size_t i;
+	int fd;
+
+	if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+		return (true);
+
+	nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+	if (nfds > SOCKET_IO_MAX_FDS - conn->sc_io_nfds) {
+		for (i = 0; i < nfds; i++) {
+			memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int),
+			    sizeof(int));
+			close(fd);
+		}
+
+		return (false);
+	}
+
+	memcpy(&conn->sc_io_fds[conn->sc_io_nfds], CMSG_DATA(cmsg),
+	    nfds * sizeof(int));
+	conn->sc_io_nfds += nfds;
+	return (true);
+}
+
+static void
+socket_io_close_fds(struct socket_connection *conn)
+{
+	size_t i;
+
+	for (i = 0; i < conn->sc_io_nfds; i++)
+		close(conn->sc_io_fds[i]);
+
+	conn->sc_io_nfds = 0;
+}
+
+static void
+socket_io_detach(struct socket_connection *conn)
+{
+	struct rpc_connection *parent = conn->sc_parent;
+	bool free_pending;
+
+	/* With io_uring, the terminal completion means the kernel let go */
+	if (!socket_io_is_uring(conn->sc_io)) {
+		epoll_ctl(conn->sc_io->sit_epfd, EPOLL_CTL_DEL,
+		    g_socket_get_fd(conn->sc_socket), NULL);
+	}
+
+	/* Same as the tail of socket_reader() */
+	parent->rco_close(parent);
+
+	/* Nothing is delivered past this point */
+	socket_io_close_fds(conn);
+	g_clear_pointer(&conn->sc_io_frame, g_free);
+
+	g_mutex_lock(&conn->sc_io_mtx);
+	conn->sc_io_detached = true;
+	free_pending = conn->sc_io_free_pending;
+	g_cond_broadcast(&conn->sc_io_cv);
+	g_mutex_unlock(&conn->sc_io_mtx);
+
+	if (free_pending)
+		socket_release(conn);
+}
+
+static void
+socket_io_wait(struct socket_connection *conn)
+{
+
+	/* Called from our own I/O thread, which detaches us on return */
+	if (g_private_get(&socket_io_current) == conn->sc_io)
+		return;
+
+	g_mutex_lock(&conn->sc_io_mtx);
+	while (!conn->sc_io_detached)
+		g_cond_wait(&conn->sc_io_cv, &conn->sc_io_mtx);
+	g_mutex_unlock(&conn->sc_io_mtx);
+}
+
+/*
+ * With RPC_SPIN_READER enabled, the descriptor is polled without blocking
+ * for a while before the thread goes to sleep in epoll_wait().
+ */
+static int
+socket_io_poll(struct socket_io_thread *io, struct epoll_event *events)
+{
+	struct rpc_spin spin;
+	int nev = 0;
+
+	if (rpc_spin_begin(&spin, RPC_SPIN_READER)) {
+		do {
+			nev = epoll_wait(io->sit_epfd, events,
+			    SOCKET_IO_EVENTS, 0);
+			if (nev != 0)
+				break;
+		} while (rpc_spin_next(&spin));
+
+		rpc_spin_end(&spin, nev > 0);
+		if (nev != 0)
+			return (nev);
+	}
+
+	return (epoll_wait(io->sit_epfd, events, SOCKET_IO_EVENTS, -1));
+}
+
+static void *
+socket_io_worker(void *arg)
+{
+	struct socket_io_thread *io = arg;
+	struct epoll_event events[SOCKET_IO_EVENTS];
+	struct socket_connection *conn;
+	int nev;
+	int i;
+
+	g_private_set(&socket_io_current, io);
+
+	for (;;) {
+		nev = socket_io_poll(io, events);
+		if (nev < 0) {
+			if (errno == EINTR)
+				continue;
+
+			debugf("epoll_wait failed: %s", strerror(errno));
+			break;
+		}
+
+		for (i = 0; i < nev; i++) {
+			conn = events[i].data.ptr;
+			if (!socket_io_read(conn))
+				socket_io_detach(conn);
+		}
+	}
+
+	return (NULL);
+}
+#endif
+
+#if defined(LIBURING_SUPPORT)
+static int
+socket_uring_init(struct socket_io_thread *io)
+{
+	unsigned int i;
+	int ret;
+
+	ret = io_uring_queue_init(SOCKET_URING_ENTRIES, &io->sit_ring, 0);
+	if (ret < 0) {
+		debugf("io_uring_queue_init failed: %s", strerror(-ret));
+		return (-1);
+	}
+
+	io->sit_br = io_uring_setup_buf_ring(&io->sit_ring, SOCKET_URING_BUFS,
+	    0, 0, &ret);
+	if (io->sit_br == NULL) {
+		debugf("io_uring_setup_buf_ring failed: %s", strerror(-ret));
+		io_uring_queue_exit(&io->sit_ring);
+		return (-1);
+	}
+
+	io->sit_bufs = g_malloc((size_t)SOCKET_URING_BUFS *
+	    SOCKET_URING_BUF_SIZE);
+	for (i = 0; i < SOCKET_URING_BUFS; i++) {
+		io_uring_buf_ring_add(io->sit_br,
+		    io->sit_bufs + (size_t)i * SOCKET_URING_BUF_SIZE,
+		    SOCKET_URING_BUF_SIZE, (unsigned short)i,
+		    io_uring_buf_ring_mask(SOCKET_URING_BUFS), (int)i);
+	}
+
+	io_uring_buf_ring_advance(io->sit_br, SOCKET_URING_BUFS);
+	g_mutex_init(&io->sit_mtx);
+	io->sit_uring = true;
+	return (0);
+}
+
+static int
+socket_uring_arm(struct socket_connection *conn)
+{
+	struct socket_io_thread *io = conn->sc_io;
+	struct io_uring_sqe *sqe;
+	int ret;
+
+	/* The kernel only reads the name and control lengths from this */
+	memset(&conn->sc_uring_msg, 0, sizeof(conn->sc_uring_msg));
+	conn->sc_uring_msg.msg_controllen =
+	    CMSG_SPACE(sizeof(int) * SOCKET_IO_MAX_FDS);
+
+	g_mutex_lock(&io->sit_mtx);
+	sqe = io_uring_get_sqe(&io->sit_ring);
+	if (sqe == NULL) {
+		io_uring_submit(&io->sit_ring);
+		sqe = io_uring_get_sqe(&io->sit_ring);
+	}
+
+	if (sqe == NULL) {
+		g_mutex_unlock(&io->sit_mtx);
+		return (-1);
+	}
+
+	io_uring_prep_recvmsg_multishot(sqe, g_socket_get_fd(conn->sc_socket),
+	    &conn->sc_uring_msg, MSG_CMSG_CLOEXEC);
+	sqe->flags |= IOSQE_BUFFER_SELECT;
+	sqe->buf_group = 0;
+	io_uring_sqe_set_data(sqe, conn);
+	ret = io_uring_submit(&io->sit_ring);
+	g_mutex_unlock(&io->sit_mtx);
+
+	return (ret < 0 ? -1 : 0);
+}
+
+/*
+ * Pushes received bytes through the same framing as socket_io_read().
+ */
+static bool
+socket_uring_feed(struct socket_connection *conn, const char *data,
+    size_t len)
+{
+	size_t n;
+
+	while (len > 0) {
+		if (conn->sc_io_header_done < sizeof(conn->sc_io_header)) {
+			n = MIN(len, sizeof(conn->sc_io_header) -
+			    conn->sc_io_header_done);
+			memcpy((char *)conn->sc_io_header +
+			    conn->sc_io_header_done, data, n);
+			conn->sc_io_header_done += n;
+			data += n;
+			len -= n;
+			if (conn->sc_io_header_done <
+			    sizeof(conn->sc_io_header))
+				break;
+
+			if (conn->sc_io_header[0] != 0xdeadbeef)
+				return (false);
+
+			conn->sc_io_frame_len = conn->sc_io_header[1];
+			conn->sc_io_frame_done = 0;
+			conn->sc_io_frame = g_malloc(conn->sc_io_frame_len);
+		}
+
+		n = MIN(len, conn->sc_io_frame_len - conn->sc_io_frame_done);
+		memcpy((char *)conn->sc_io_frame + conn->sc_io_frame_done,
+		    data, n);
+		conn->sc_io_frame_done += n;
+		data += n;
+		len -= n;
+
+		if (conn->sc_io_frame_done == conn->sc_io_frame_len &&
+		    !socket_io_deliver(conn))
+			return (false);
+	}
+
+	return (true);
+}
+
+static void
+socket_uring_complete(struct socket_io_thread *io, struct io_uring_cqe *cqe,
+    unsigned int *nbufs)
+{
+	struct socket_connection *conn = io_uring_cqe_get_data(cqe);
+	struct io_uring_recvmsg_out *out;
+	struct cmsghdr *cmsg;
+	unsigned int bid;
+	char *buf;
+	bool more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+	bool ok;
+
+	if (cqe->flags & IORING_CQE_F_BUFFER) {
+		bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		buf = io->sit_bufs + (size_t)bid * SOCKET_URING_BUF_SIZE;
+		out = io_uring_recvmsg_validate(buf, cqe->res,
+		    &conn->sc_uring_msg);
+
+		if (out == NULL || (cqe->res > 0 &&
+		    io_uring_recvmsg_payload_length(out, cqe->res,
+		    &conn->sc_uring_msg) == 0)) {
+			/* Orderly shutdown by the peer */
+			conn->sc_parent->rco_error = rpc_error_create(
+			    ECONNRESET, "Connection terminated", NULL);
+			conn->sc_uring_closing = true;
+		} else if (!conn->sc_uring_closing) {
+			ok = (out->flags & MSG_CTRUNC) == 0;
+			for (cmsg = io_uring_recvmsg_cmsg_firsthdr(out,
+			    &conn->sc_uring_msg); cmsg != NULL;
+			    cmsg = io_uring_recvmsg_cmsg_nexthdr(out,
+			    &conn->sc_uring_msg, cmsg)) {
+				if (!socket_io_stash_fds(conn, cmsg))
+					ok = false;
+			}
+
+			if (!ok) {
+				socket_io_close_fds(conn);
+				conn->sc_parent->rco_error = rpc_error_create(
+				    EBADMSG, "Too many descriptors in a frame",
+				    NULL);
+				conn->sc_uring_closing = true;
+			} else if (!socket_uring_feed(conn,
+			    io_uring_recvmsg_payload(out, &conn->sc_uring_msg),
+			    io_uring_recvmsg_payload_length(out, cqe->res,
+			    &conn->sc_uring_msg)))
+				conn->sc_uring_closing = true;
+		}
+
+		io_uring_buf_ring_add(io->sit_br, buf, SOCKET_URING_BUF_SIZE,
+		    (unsigned short)bid,
+		    io_uring_buf_ring_mask(SOCKET_URING_BUFS), (int)*nbufs);
+		(*nbufs)++;
+	} else if (cqe->res < 0 && cqe->res != -ENOBUFS) {
+		conn->sc_parent->rco_error = rpc_error_create(-cqe->res,
+		    strerror(-cqe->res), NULL);
+		conn->sc_uring_closing = true;
+	} else if (cqe->res == 0) {
+		conn->sc_parent->rco_error = rpc_error_create(ECONNRESET,
+		    "Connection terminated", NULL);
+		conn->sc_uring_closing = true;
+	}
+
+	if (more) {
+		/* We want out, but the kernel keeps the request armed */
+		if (conn->sc_uring_closing && !conn->sc_uring_shut) {
+			conn->sc_uring_shut = true;
+			shutdown(g_socket_get_fd(conn->sc_socket), SHUT_RDWR);
+		}
+
+		return;
+	}
+
+	/* Terminal completion: re-arm (e.g. after ENOBUFS) or let go */
+	if (conn->sc_uring_closing || socket_uring_arm(conn) != 0)
+		socket_io_detach(conn);
+}
+
+static void *
+socket_uring_worker(void *arg)
+{
+	struct socket_io_thread *io = arg;
+	struct io_uring_cqe *cqe;
+	unsigned int head;
+	unsigned int count;
+	unsigned int nbufs;
+	int ret;
+
+	g_private_set(&socket_io_current, io);
+
+	for (;;) {
+		ret = io_uring_wait_cqe(&io->sit_ring, &cqe);
+		if (ret == -EINTR)
+			continue;
+
+		if (ret < 0) {
+			debugf("io_uring_wait_cqe failed: %s", strerror(-ret));
 			break;
 		}
 
-		g_free(frame);
+		count = 0;
+		nbufs = 0;
+		io_uring_for_each_cqe(&io->sit_ring, head, cqe) {
+			socket_uring_complete(io, cqe, &nbufs);
+			count++;
+		}
+
+		io_uring_cq_advance(&io->sit_ring, count);
+		io_uring_buf_ring_advance(io->sit_br, (int)nbufs);
 	}
 
-	conn->sc_parent->rco_close(conn->sc_parent);
 	return (NULL);
 }
+#endif
 
 static bool
 socket_supports_fd_passing(struct rpc_connection *rpc_conn)
@@ -0,0 +1,374 @@
+/*
+ * Copyright 2015-2017 Two Pore Guys, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/tls.h>
+#include <gnutls/gnutls.h>
+#include <rpc/connection.h>
+#include "../internal.h"
+#include "tls.h"
+
+#ifndef SOL_TLS
+#define	SOL_TLS			282
+#endif
+
+#ifndef TCP_ULP
+#define	TCP_ULP			31
+#endif
+
+/* Handshake timeout, in seconds */
+#define	SOCKET_TLS_TIMEOUT	10
+
+/*
+ * Only ciphers the kernel can take over are negotiated, and session
+ * tickets are turned off: kTLS hands non-data records to userspace,
+ * where nobody would be left to process them.
+ */
+#define	SOCKET_TLS_PRIORITY						\
+	"NORMAL:-CIPHER-ALL:+AES-128-GCM:+AES-256-GCM:"			\
+	"-VERS-ALL:+VERS-TLS1.3:+VERS-TLS1.2"
+
+struct socket_tls
+{
+	gnutls_certificate_credentials_t	st_creds;
+	bool					st_server;
+	bool					st_verify;
+	bool					st_client_certs;
+};
+
+static ssize_t socket_tls_pull(gnutls_transport_ptr_t, void *, size_t);
+static ssize_t socket_tls_push(gnutls_transport_ptr_t, const void *, size_t);
+static int socket_tls_offload(gnutls_session_t, int);
+static int socket_tls_set_key(int, int, gnutls_session_t, bool);
+
+struct socket_tls *
+socket_tls_new(rpc_object_t params, bool server)
+{
+	struct socket_tls *tls;
+	const char *cert = NULL;
+	const char *key = NULL;
+	const char *ca = NULL;
+	int ret;
+
+	if (params != NULL && rpc_get_type(params) == RPC_TYPE_DICTIONARY) {
+		cert = rpc_dictionary_get_string(params,
+		    RPC_CONNECTION_TLS_CERT);
+		key = rpc_dictionary_get_string(params,
+		    RPC_CONNECTION_TLS_KEY);
+		ca = rpc_dictionary_get_string(params, RPC_CONNECTION_TLS_CA);
+	}
+
+	if (server && (cert == NULL || key == NULL)) {
+		rpc_set_last_errorf(EINVAL,
+		    "TLS server needs a certificate and a key");
+		return (NULL);
+	}
+
+	tls = g_malloc0(sizeof(*tls));
+	tls->st_server = server;
+	tls->st_verify = true;
+	tls->st_client_certs = server && ca != NULL;
+	if (params != NULL && rpc_get_type(params) == RPC_TYPE_DICTIONARY &&
+	    rpc_dictionary_has_key(params, RPC_CONNECTION_TLS_VERIFY))
+		tls->st_verify = rpc_dictionary_get_bool(params,
+		    RPC_CONNECTION_TLS_VERIFY);
+
+	ret = gnutls_certificate_allocate_credentials(&tls->st_creds);
+	if (ret < 0)
+		goto fail;
+
+	if (ca != NULL)
+		ret = gnutls_certificate_set_x509_trust_file(tls->st_creds, ca,
+		    GNUTLS_X509_FMT_PEM);
+	else if (!server)
+		ret = gnutls_certificate_set_x509_system_trust(tls->st_creds);
+
+	if (ret < 0)
+		goto fail;
+
+	if (cert != NULL && key != NULL) {
+		ret = gnutls_certificate_set_x509_key_file(tls->st_creds, cert,
+		    key, GNUTLS_X509_FMT_PEM);
+		if (ret < 0)
+			goto fail;
+	}
+
+	return (tls);
+
+fail:
+	rpc_set_last_errorf(EINVAL, "Cannot load TLS credentials: %s",
+	    gnutls_strerror(ret));
+	socket_tls_free(tls);
+	return (NULL);
+}
+
+void
+socket_tls_free(struct socket_tls *tls)
+{
+
+	if (tls == NULL)
+		return;
+
+	if (tls->st_creds != NULL)
+		gnutls_certificate_free_credentials(tls->st_creds);
+
+	g_free(tls);
+}
+
+/*
+ * Runs the handshake on @p sock and moves the session into the kernel.
+ * The socket is left in blocking mode with no timeout, as the rest of
+ * the transport expects. @p hostname, only used by clients, is checked
+ * against the server certificate unless verification was turned off.
+ */
+int
+socket_tls_handshake(struct socket_tls *tls, GSocket *sock,
+    const char *hostname)
+{
+	gnutls_session_t session;
+	gboolean blocking;
+	guint timeout;
+	int ret;
+
+	ret = gnutls_init(&session, (tls->st_server ? GNUTLS_SERVER :
+	    GNUTLS_CLIENT) | GNUTLS_NO_TICKETS);
+	if (ret < 0) {
+		rpc_set_last_errorf(ENOMEM, "Cannot create TLS session: %s",
+		    gnutls_strerror(ret));
+		return (-1);
+	}
+
+	ret = gnutls_priority_set_direct(session, SOCKET_TLS_PRIORITY, NULL);
+	if (ret == 0)
+		ret = gnutls_credentials_set(session, GNUTLS_CRD_CERTIFICATE,
+		    tls->st_creds);
+
+	if (ret == 0 && !tls->st_server && hostname != NULL)
+		ret = gnutls_server_name_set(session, GNUTLS_NAME_DNS,
+		    hostname, strlen(hostname));
+
+	if (ret < 0) {
+		rpc_set_last_errorf(EINVAL, "Cannot set up TLS session: %s",
+		    gnutls_strerror(ret));
+		gnutls_deinit(session);
+		return (-1);
+	}
+
+	if (tls->st_client_certs) {
+		gnutls_certificate_server_set_request(session,
+		    GNUTLS_CERT_REQUIRE);
+		gnutls_session_set_verify_cert(session, NULL, 0);
+	} else if (!tls->st_server && tls->st_verify)
+		gnutls_session_set_verify_cert(session, hostname, 0);
+
+	gnutls_transport_set_ptr(session, sock);
+	gnutls_transport_set_pull_function(session, socket_tls_pull);
+	gnutls_transport_set_push_function(session, socket_tls_push);
+
+	blocking = g_socket_get_blocking(sock);
+	timeout = g_socket_get_timeout(sock);
+	g_socket_set_blocking(sock, true);
+	g_socket_set_timeout(sock, SOCKET_TLS_TIMEOUT);
+
+	do
+		ret = gnutls_handshake(session);
+	while (ret < 0 && !gnutls_error_is_fatal(ret));
+
+	g_socket_set_timeout(sock, timeout);
+	g_socket_set_blocking(sock, blocking);
+
+	if (ret < 0) {
+		rpc_set_last_errorf(ECONNREFUSED, "TLS handshake failed: %s",
+		    gnutls_strerror(ret));
+		gnutls_deinit(session);
+		return (-1);
+	}
+
+	/*
+	 * Anything GnuTLS read past the handshake would be lost once the
+	 * kernel takes over. Peers only send data after the handshake
+	 * completes on their side, so this means a misbehaving peer.
+	 */
+	if (gnutls_record_check_pending(session) > 0) {
+		rpc_set_last_errorf(EPROTO,
+		    "Unexpected data during TLS handshake");
+		gnutls_deinit(session);
+		return (-1);
+	}
+
+	ret = socket_tls_offload(session, g_socket_get_fd(sock));
+	gnutls_deinit(session);
+	return (ret);
+}
+
+static ssize_t
+socket_tls_pull(gnutls_transport_ptr_t ptr, void *buf, size_t len)
+{
+	GSocket *sock = ptr;
+	GError *err = NULL;
+	gssize ret;
+
+	ret = g_socket_receive(sock, buf, len, NULL, &err);
+	if (ret < 0) {
+		errno = g_error_matches(err, G_IO_ERROR, G_IO_ERROR_TIMED_OUT)
+		    ? ETIMEDOUT : ECONNRESET;
+		g_error_free(err);
+		return (-1);
+	}
+
+	return (ret);
+}
+
+static ssize_t
+socket_tls_push(gnutls_transport_ptr_t ptr, const void *buf, size_t len)
+{
+	GSocket *sock = ptr;
+	GError *err = NULL;
+	gssize ret;
+
+	ret = g_socket_send(sock, buf, len, NULL, &err);
+	if (ret < 0) {
+		errno = g_error_matches(err, G_IO_ERROR, G_IO_ERROR_TIMED_OUT)
+		    ? ETIMEDOUT : ECONNRESET;
+		g_error_free(err);
+		return (-1);
+	}
+
+	return (ret);
+}
+
+static int
+socket_tls_offload(gnutls_session_t session, int fd)
+{
+	int version;
+
+	switch (gnutls_protocol_get_version(session)) {
+	case GNUTLS_TLS1_2:
+		version = TLS_1_2_VERSION;
+		break;
+
+	case GNUTLS_TLS1_3:
+		version = TLS_1_3_VERSION;
+		break;
+
+	default:
+		rpc_set_last_errorf(ENOTSUP,
+		    "TLS version not supported by kernel TLS");
+		return (-1);
+	}
+
+	if (setsockopt(fd, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) != 0) {
+		rpc_set_last_errorf(ENOTSUP, "Kernel TLS not available: %s",
+		    strerror(errno));
+		return (-1);
+	}
+
+	if (socket_tls_set_key(fd, version, session, false) != 0 ||
+	    socket_tls_set_key(fd, version, session, true) != 0)
+		return (-1);
+
+	return (0);
+}
+
+/*
+ * Loads the send (TLS_TX) or receive (TLS_RX) state of @p session into
+ * the kernel. TLS 1.2 GCM uses a 4-byte salt and sends the explicit
+ * nonce, which GnuTLS derives from the sequence number, with every
+ * record; TLS 1.3 splits its 12-byte IV into the salt and the nonce.
+ */
+static int
+socket_tls_set_key(int fd, int version, gnutls_session_t session, bool rx)
+{
+	struct tls12_crypto_info_aes_gcm_128 info128;
+	struct tls12_crypto_info_aes_gcm_256 info256;
+	gnutls_datum_t mac;
+	gnutls_datum_t iv;
+	gnutls_datum_t key;
+	unsigned char seq[8];
+	void *info;
+	socklen_t len;
+	int ret;
+
+	ret = gnutls_record_get_state(session, rx, &mac, &iv, &key, seq);
+	if (ret < 0) {
+		rpc_set_last_errorf(EINVAL, "Cannot get TLS state: %s",
+		    gnutls_strerror(ret));
+		return (-1);
+	}
+
+#define	SOCKET_TLS_FILL(_info, _cipher)					\
+	do {								\
+		memset(&(_info), 0, sizeof(_info));			\
+		(_info).info.version = (unsigned short)version;	\
+		(_info).info.cipher_type = (_cipher);			\
+		memcpy((_info).key, key.data, sizeof((_info).key));	\
+		memcpy((_info).salt, iv.data, sizeof((_info).salt));	\
+		if (version == TLS_1_3_VERSION)				\
+			memcpy((_info).iv, iv.data +			\
+			    sizeof((_info).salt), sizeof((_info).iv));	\
+		else							\
+			memcpy((_info).iv, seq, sizeof((_info).iv));	\
+		memcpy((_info).rec_seq, seq, sizeof((_info).rec_seq));	\
+	} while (0)
+
+	switch (gnutls_cipher_get(session)) {
+	case GNUTLS_CIPHER_AES_128_GCM:
+		SOCKET_TLS_FILL(info128, TLS_CIPHER_AES_GCM_128);
+		info = &info128;
+		len = sizeof(info128);
+		break;
+
+	case GNUTLS_CIPHER_AES_256_GCM:
+		SOCKET_TLS_FILL(info256, TLS_CIPHER_AES_GCM_256);
+		info = &info256;
+		len = sizeof(info256);
+		break;
+
+	default:
+		rpc_set_last_errorf(ENOTSUP,
+		    "Cipher not supported by kernel TLS");
+		return (-1);
+	}
+
+#undef SOCKET_TLS_FILL
+
+	ret = setsockopt(fd, SOL_TLS, rx ? TLS_RX : TLS_TX, info, len);
+	memset(&info128, 0, sizeof(info128));
+	memset(&info256, 0, sizeof(info256));
+	if (ret != 0) {
+		rpc_set_last_errorf(ENOTSUP, "Cannot enable kernel TLS: %s",
+		    strerror(errno));
+		return (-1);
+	}
+
+	return (0);
+}
@@ -0,0 +1,50 @@
+/*
+ * Copyright 2015-2017 Two Pore Guys, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef LIBRPC_TRANSPORT_TLS_H
+#define LIBRPC_TRANSPORT_TLS_H
+
+#include <stdbool.h>
+#include <gio/gio.h>
+#include <rpc/object.h>
+
+/*
+ * TLS for the socket transport. The handshake runs in userspace with
+ * GnuTLS; once it's done, the session keys are handed to the kernel
+ * (kTLS) and the GnuTLS session goes away. From then on the socket is
+ * used like any other TCP socket, so writev(), sendfile() and the
+ * event-driven receive paths keep working unchanged, with the kernel
+ * encrypting and decrypting records.
+ */
+struct socket_tls;
+
+struct socket_tls *socket_tls_new(rpc_object_t params, bool server);
+void socket_tls_free(struct socket_tls *tls);
+int socket_tls_handshake(struct socket_tls *tls, GSocket *sock,
+    const char *hostname);
+
+#endif /* LIBRPC_TRANSPORT_TLS_H */
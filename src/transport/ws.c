@@ -29,12 +29,17 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <unistd.h>
 #include <glib.h>
 #include <libsoup/soup.h>
 #include "../linker_set.h"
 #include "../internal.h"
+#include "../serializer/msgpack.h"
 
 #define	WS_MAX_MESSAGE_SIZE	(1024 * 2048) /* 2MB */
+#define	WS_PROTOCOL_DEFLATE	"librpc.deflate"
+#define	WS_DEFLATE_HDR_SIZE	6
+#define	WS_MAX_SHARDS		64
 
 static gboolean ws_do_connect(gpointer user_data);
 static int ws_connect(struct rpc_connection *, const char *, rpc_object_t);
@@ -55,6 +60,15 @@ static void ws_release(void *);
 static int ws_teardown(struct rpc_server *);
 static int ws_teardown_end(struct rpc_server *);
 static gboolean ws_done_waiting (gpointer user_data);
+static void ws_set_compression(struct ws_connection *, rpc_object_t);
+static GByteArray *ws_convert(GConverter *, const void *, size_t, size_t, size_t);
+static SoupServer *ws_soupserver_new(struct ws_server *);
+static int ws_start_shards(struct ws_server *, guint, GError **);
+static void *ws_shard_worker(void *);
+static gboolean ws_shard_stop(gpointer);
+static void ws_stop_shards(struct ws_server *);
+
+static const char *ws_protocols[] = { WS_PROTOCOL_DEFLATE, NULL };
 
 struct rpc_transport ws_transport = {
 	.name = "websocket",
@@ -80,6 +94,21 @@ struct ws_connection
 	bool				wc_aborted;
 	bool				wc_closed;
 	struct ws_server *		wc_server;
+	rpc_object_t			wc_params;
+	bool				wc_deflate;
+	size_t				wc_compress_threshold;
+};
+
+/*
+ * An extra I/O thread of a WebSocket server, with an HTTP server of its
+ * own. Connections it accepts stay on its main context.
+ */
+struct ws_shard
+{
+	SoupServer *			wsh_soupserver;
+	GMainContext *			wsh_context;
+	GMainLoop *			wsh_loop;
+	GThread *			wsh_thread;
 };
 
 struct ws_server
@@ -91,6 +120,8 @@ struct ws_server
 	GMutex				ws_mtx;
 	GCond				ws_cv;
 	GMutex				ws_abort_mtx;
+	struct ws_shard *		ws_shards;
+	guint				ws_nshards;
 };
 
 static gboolean
@@ -102,15 +133,15 @@ ws_do_connect(gpointer user_data)
 	conn->wc_session = soup_session_new_with_options(
 	    SOUP_SESSION_USE_THREAD_CONTEXT, TRUE, NULL);
 	msg = soup_message_new_from_uri(SOUP_METHOD_GET, conn->wc_uri);
-	soup_session_websocket_connect_async(conn->wc_session, msg, NULL, NULL,
-	    NULL, &ws_connect_done, conn);
+	soup_session_websocket_connect_async(conn->wc_session, msg, NULL,
+	    (char **)ws_protocols, NULL, &ws_connect_done, conn);
 
 	return (false);
 }
 
 static int
 ws_connect(struct rpc_connection *rco, const char *uri_string,
-    rpc_object_t args __unused)
+    rpc_object_t args)
 {
 	struct ws_connection *conn = NULL;
 
@@ -121,6 +152,7 @@ ws_connect(struct rpc_connection *rco, const char *uri_string,
 	g_cond_init(&conn->wc_abort_cv);
 	conn->wc_uri = soup_uri_new(uri_string);
 	conn->wc_parent = rco;
+	conn->wc_params = args;
 
 	g_main_context_invoke(rco->rco_main_context, ws_do_connect, conn);
 	g_mutex_lock(&conn->wc_mtx);
@@ -167,6 +199,8 @@ ws_connect_done(GObject *obj, GAsyncResult *res, gpointer user_data)
 
 	g_mutex_lock(&conn->wc_mtx);
 	conn->wc_ws = ws;
+	ws_set_compression(conn, conn->wc_params);
+	conn->wc_params = NULL;
 	g_signal_connect(conn->wc_ws, "closed", G_CALLBACK(ws_close), conn);
 	g_signal_connect(conn->wc_ws, "message", G_CALLBACK(ws_receive_message),
 	    conn);
@@ -182,9 +216,16 @@ ws_listen(struct rpc_server *srv, const char *uri_str,
 	GSocketAddress *addr = NULL;
 	SoupURI *uri;
 	struct ws_server *server;
+	guint threads = 1;
 	int fd = -1;
 	int ret = 0;
 
+	if (args != NULL && rpc_get_type(args) == RPC_TYPE_DICTIONARY) {
+		threads = (guint)rpc_dictionary_get_uint64(args,
+		    RPC_SERVER_IO_THREADS);
+		threads = CLAMP(threads, 1, WS_MAX_SHARDS);
+	}
+
 	uri = soup_uri_new(uri_str);
 	if (uri != NULL) {
 		if (args != NULL && rpc_get_type(args) == RPC_TYPE_FD)
@@ -214,18 +255,7 @@ ws_listen(struct rpc_server *srv, const char *uri_str,
 	srv->rs_threaded_teardown = true;
         srv->rs_arg = server;
 
-	server->ws_soupserver = soup_server_new(
-	    SOUP_SERVER_SERVER_HEADER, "librpc",
-	    NULL);
-
-	if (g_strcmp0(server->ws_uri->path, "/") != 0) {
-		soup_server_add_handler(server->ws_soupserver, "/",
-		    ws_process_banner, server, NULL);
-	}
-
-	soup_server_add_websocket_handler(server->ws_soupserver,
-	    server->ws_uri->path, NULL, NULL, ws_process_connection, server,
-	    NULL);
+	server->ws_soupserver = ws_soupserver_new(server);
 
 	if (addr != NULL)
 		soup_server_listen(server->ws_soupserver, addr, 0, &err);
@@ -233,6 +263,9 @@ ws_listen(struct rpc_server *srv, const char *uri_str,
 	if (fd != -1)
 		soup_server_listen_fd(server->ws_soupserver, fd, 0, &err);
 
+	if (err == NULL && threads > 1)
+		ws_start_shards(server, threads - 1, &err);
+
 	if (err != NULL) {
 		srv->rs_error = rpc_error_create(err->code, err->message, NULL);
 		g_error_free(err);
@@ -246,6 +279,115 @@ ws_listen(struct rpc_server *srv, const char *uri_str,
 	return (ret);
 }
 
+static SoupServer *
+ws_soupserver_new(struct ws_server *server)
+{
+	SoupServer *ss;
+
+	ss = soup_server_new(
+	    SOUP_SERVER_SERVER_HEADER, "librpc",
+	    NULL);
+
+	if (g_strcmp0(server->ws_uri->path, "/") != 0) {
+		soup_server_add_handler(ss, "/",
+		    ws_process_banner, server, NULL);
+	}
+
+	soup_server_add_websocket_handler(ss,
+	    server->ws_uri->path, NULL, (char **)ws_protocols,
+	    ws_process_connection, server, NULL);
+
+	return (ss);
+}
+
+/*
+ * Starts @p count extra I/O threads, each accepting connections off
+ * the listening socket of the main HTTP server. Whichever thread wins
+ * the race to accept owns the connection from then on.
+ */
+static int
+ws_start_shards(struct ws_server *server, guint count, GError **err)
+{
+	struct ws_shard *shard;
+	GSList *listeners;
+	int fd;
+
+	listeners = soup_server_get_listeners(server->ws_soupserver);
+	if (listeners == NULL)
+		return (0);
+
+	fd = g_socket_get_fd(listeners->data);
+	g_slist_free(listeners);
+
+	server->ws_shards = g_new0(struct ws_shard, count);
+	while (server->ws_nshards < count) {
+		shard = &server->ws_shards[server->ws_nshards];
+		shard->wsh_context = g_main_context_new();
+		shard->wsh_loop = g_main_loop_new(shard->wsh_context, false);
+		shard->wsh_soupserver = ws_soupserver_new(server);
+
+		/* Listeners attach to the thread-default main context */
+		g_main_context_push_thread_default(shard->wsh_context);
+		soup_server_listen_fd(shard->wsh_soupserver, dup(fd), 0, err);
+		g_main_context_pop_thread_default(shard->wsh_context);
+
+		if (*err != NULL) {
+			g_object_unref(shard->wsh_soupserver);
+			g_main_loop_unref(shard->wsh_loop);
+			g_main_context_unref(shard->wsh_context);
+			ws_stop_shards(server);
+			return (-1);
+		}
+
+		shard->wsh_thread = rpc_thread_new(RPC_THREAD_IO, "ws shard",
+		    ws_shard_worker, shard);
+		server->ws_nshards++;
+	}
+
+	return (0);
+}
+
+static void *
+ws_shard_worker(void *arg)
+{
+	struct ws_shard *shard = arg;
+
+	g_main_context_push_thread_default(shard->wsh_context);
+	g_main_loop_run(shard->wsh_loop);
+	g_main_context_pop_thread_default(shard->wsh_context);
+	return (NULL);
+}
+
+static gboolean
+ws_shard_stop(gpointer user_data)
+{
+	struct ws_shard *shard = user_data;
+
+	soup_server_disconnect(shard->wsh_soupserver);
+	g_main_loop_quit(shard->wsh_loop);
+	return (false);
+}
+
+static void
+ws_stop_shards(struct ws_server *server)
+{
+	struct ws_shard *shard;
+	guint i;
+
+	for (i = 0; i < server->ws_nshards; i++) {
+		shard = &server->ws_shards[i];
+		g_main_context_invoke(shard->wsh_context, ws_shard_stop, shard);
+		g_thread_join(shard->wsh_thread);
+		g_object_unref(shard->wsh_soupserver);
+		g_main_loop_unref(shard->wsh_loop);
+		g_main_context_unref(shard->wsh_context);
+	}
+
+	g_free(server->ws_shards);
+	server->ws_shards = NULL;
+	server->ws_nshards = 0;
+}
+
 static gboolean
 ws_done_waiting(gpointer user_data)
 {
@@ -287,6 +429,9 @@ ws_teardown_end(struct rpc_server *srv)
 		g_cond_wait(&server->ws_cv, &server->ws_mtx);
 	g_mutex_unlock(&server->ws_mtx);
 
+	/* All connections are closed by now, shard loops can go away */
+	ws_stop_shards(server);
+
 	soup_uri_free(server->ws_uri);
 	g_object_unref(server->ws_soupserver);
 
@@ -324,6 +469,7 @@ ws_process_connection(SoupServer *ss __unused,
 	conn = g_malloc0(sizeof(*conn));
 	conn->wc_ws = connection;
 	conn->wc_server = server;
+	ws_set_compression(conn, server->ws_server->rs_params);
 
 	g_mutex_init(&conn->wc_abort_mtx);
 	g_cond_init(&conn->wc_abort_cv);
@@ -348,17 +494,121 @@ ws_process_connection(SoupServer *ss __unused,
 	    G_CALLBACK(ws_receive_message), conn);
 }
 
+static void
+ws_set_compression(struct ws_connection *conn, rpc_object_t params)
+{
+	const char *protocol;
+
+	protocol = soup_websocket_connection_get_protocol(conn->wc_ws);
+	conn->wc_deflate = g_strcmp0(protocol, WS_PROTOCOL_DEFLATE) == 0;
+
+	if (params != NULL && rpc_get_type(params) == RPC_TYPE_DICTIONARY) {
+		conn->wc_compress_threshold = (size_t)rpc_dictionary_get_uint64(
+		    params, RPC_CONNECTION_WS_COMPRESS);
+	}
+}
+
+/*
+ * Runs the whole buffer through a (de)compressor, reserving @p reserve
+ * bytes in front of the output. Returns NULL on error or when the output
+ * would grow beyond @p limit bytes.
+ */
+static GByteArray *
+ws_convert(GConverter *converter, const void *buf, size_t len,
+    size_t reserve, size_t limit)
+{
+	GError *err = NULL;
+	GConverterResult result;
+	GByteArray *out;
+	gsize nread;
+	gsize nwritten;
+	size_t pos = reserve;
+
+	out = g_byte_array_sized_new((guint)(reserve + len));
+	g_byte_array_set_size(out, (guint)(reserve + MAX(len, 4096)));
+
+	for (;;) {
+		result = g_converter_convert(converter, buf, len,
+		    out->data + pos, out->len - pos, G_CONVERTER_INPUT_AT_END,
+		    &nread, &nwritten, &err);
+
+		if (result == G_CONVERTER_ERROR) {
+			if (!g_error_matches(err, G_IO_ERROR, G_IO_ERROR_NO_SPACE))
+				goto error;
+
+			g_clear_error(&err);
+		}
+
+		buf = (const uint8_t *)buf + nread;
+		len -= nread;
+		pos += nwritten;
+
+		if (result == G_CONVERTER_FINISHED)
+			break;
+
+		if (out->len - reserve >= limit)
+			goto error;
+
+		g_byte_array_set_size(out, out->len * 2);
+	}
+
+	if (pos - reserve > limit)
+		goto error;
+
+	g_byte_array_set_size(out, (guint)pos);
+	return (out);
+
+error:
+	if (err != NULL)
+		g_error_free(err);
+
+	g_byte_array_free(out, true);
+	return (NULL);
+}
+
 static void
 ws_receive_message(SoupWebsocketConnection *ws __unused,
     SoupWebsocketDataType type __unused, GBytes *message, gpointer user_data)
 {
 	struct ws_connection *conn = user_data;
-	const void *data;
+	GZlibDecompressor *decompressor;
+	GByteArray *inflated;
+	GBytes *frame;
+	const uint8_t *data;
 	size_t len;
 
 	data = g_bytes_get_data(message, &len);
 	debugf("received frame: addr=%p, len=%zu", data, len);
-	conn->wc_parent->rco_recv_msg(conn->wc_parent, data, len, NULL, 0);
+
+	/*
+	 * A compressed frame is wrapped in a msgpack ext, which can never
+	 * start a regular frame.
+	 */
+	if (conn->wc_deflate && len > WS_DEFLATE_HDR_SIZE && data[0] == 0xc9 &&
+	    data[5] == MSGPACK_EXTTYPE_DEFLATE) {
+		decompressor = g_zlib_decompressor_new(
+		    G_ZLIB_COMPRESSOR_FORMAT_RAW);
+		inflated = ws_convert(G_CONVERTER(decompressor),
+		    data + WS_DEFLATE_HDR_SIZE, len - WS_DEFLATE_HDR_SIZE, 0,
+		    WS_MAX_MESSAGE_SIZE);
+		g_object_unref(decompressor);
+
+		if (inflated == NULL) {
+			conn->wc_last_err = g_error_new(G_IO_ERROR,
+			    G_IO_ERROR_INVALID_DATA, "Invalid compressed frame");
+			soup_websocket_connection_close(conn->wc_ws,
+			    SOUP_WEBSOCKET_CLOSE_BAD_DATA, NULL);
+			return;
+		}
+
+		frame = g_byte_array_free_to_bytes(inflated);
+		conn->wc_parent->rco_recv_bytes(conn->wc_parent, frame, NULL, 0);
+		g_bytes_unref(frame);
+		return;
+	}
+
+	/* Binary leaves of the parsed message keep the frame referenced */
+	conn->wc_parent->rco_recv_bytes(conn->wc_parent, message, NULL, 0);
 }
 
 static void
@@ -403,10 +653,35 @@ ws_send_message(void *arg, const void *buf, size_t len,
     const int *fds __unused, size_t nfds __unused)
 {
 	struct ws_connection *conn = arg;
+	GZlibCompressor *compressor;
+	GByteArray *frame;
+	uint32_t size;
 
 	if (soup_websocket_connection_get_state(conn->wc_ws) != SOUP_WEBSOCKET_STATE_OPEN)
 		return (-1);
 
+	if (conn->wc_deflate && conn->wc_compress_threshold > 0 &&
+	    len >= conn->wc_compress_threshold && len > WS_DEFLATE_HDR_SIZE) {
+		/* Give up on frames that do not shrink */
+		compressor = g_zlib_compressor_new(G_ZLIB_COMPRESSOR_FORMAT_RAW,
+		    -1);
+		frame = ws_convert(G_CONVERTER(compressor), buf, len,
+		    WS_DEFLATE_HDR_SIZE, len - WS_DEFLATE_HDR_SIZE);
+		g_object_unref(compressor);
+
+		if (frame != NULL) {
+			/* ext 32 header */
+			size = GUINT32_TO_BE(frame->len - WS_DEFLATE_HDR_SIZE);
+			frame->data[0] = 0xc9;
+			memcpy(&frame->data[1], &size, sizeof(size));
+			frame->data[5] = MSGPACK_EXTTYPE_DEFLATE;
+			soup_websocket_connection_send_binary(conn->wc_ws,
+			    frame->data, frame->len);
+			g_byte_array_free(frame, true);
+			return (0);
+		}
+	}
+
 	soup_websocket_connection_send_binary(conn->wc_ws, buf, len);
 	return (0);
 }
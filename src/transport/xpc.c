@@ -25,6 +25,9 @@
  */
 
 #include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include <glib.h>
 #include <yuarel.h>
 #include <dispatch/dispatch.h>
@@ -36,11 +39,19 @@ static int xpc_connect(struct rpc_connection *, const char *, rpc_object_t);
 static int xpc_listen(struct rpc_server *, const char *, rpc_object_t);
 static xpc_object_t xpc_from_rpc(rpc_object_t);
 static rpc_object_t xpc_to_rpc(xpc_object_t);
+static xpc_object_t xpc_shmem_from_data(const void *, size_t);
+static rpc_object_t xpc_shmem_to_data(xpc_object_t);
 static int xpc_send_msg(void *, const void *, size_t, const int *, size_t);
 static int xpc_abort(void *);
 static void xpc_conn_release(void *);
 static bool xpc_supports_fd_passing(struct rpc_connection *);
 
+/*
+ * Binary values at least this large travel as an xpc_shmem region
+ * instead of being copied into the message.
+ */
+#define	XPC_SHMEM_MIN	(64 * 1024)
+
 struct xpc_server
 {
 	xpc_connection_t 	xpc_handle;
@@ -91,16 +102,26 @@ xpc_from_rpc(rpc_object_t obj)
 		return (xpc_bool_create(rpc_bool_get_value(obj)));
 
 	case RPC_TYPE_DATE:
-		return (xpc_date_create(rpc_date_get_value(obj)));
+		return (xpc_date_create(rpc_date_get_value_ns(obj)));
 
 	case RPC_TYPE_STRING:
 		return (xpc_string_create(rpc_string_get_string_ptr(obj)));
 
 	case RPC_TYPE_BINARY:
+		if (rpc_data_get_length(obj) >= XPC_SHMEM_MIN) {
+			ret = xpc_shmem_from_data(rpc_data_get_bytes_ptr(obj),
+			    rpc_data_get_length(obj));
+			if (ret != NULL)
+				return (ret);
+		}
+
 		return (xpc_data_create(
 		    rpc_data_get_bytes_ptr(obj),
 		    rpc_data_get_length(obj)));
 
+	case RPC_TYPE_FD:
+		return (xpc_fd_create(rpc_fd_get_value(obj)));
+
 	case RPC_TYPE_ARRAY:
 		ret = xpc_array_create(NULL, 0);
 		rpc_array_apply(obj, ^(size_t idx, rpc_object_t value) {
@@ -153,7 +174,6 @@ xpc_to_rpc(xpc_object_t obj)
 	rpc_object_t ret;
 	xpc_type_t type = xpc_get_type(obj);
 	const char *dtype;
-	void *blob;
 
 	if (obj == NULL)
 		return (NULL);
@@ -174,19 +194,23 @@ xpc_to_rpc(xpc_object_t obj)
 		return (rpc_bool_create(xpc_bool_get_value(obj)));
 
 	if (type == XPC_TYPE_DATE)
-		return (rpc_date_create(xpc_date_get_value(obj)));
+		return (rpc_date_create_ns(xpc_date_get_value(obj)));
 
 	if (type == XPC_TYPE_STRING)
 		return (rpc_string_create(xpc_string_get_string_ptr(obj)));
 
 	if (type == XPC_TYPE_DATA) {
-		blob = g_memdup(xpc_data_get_bytes_ptr(obj),
-		    (guint)xpc_data_get_length(obj));
-
-		return (rpc_data_create(blob, xpc_data_get_length(obj),
-		    ^(void *ptr) { g_free(ptr); }));
+		/* Point into the message itself, which we keep alive */
+		xpc_retain(obj);
+		return (rpc_data_create(xpc_data_get_bytes_ptr(obj),
+		    xpc_data_get_length(obj), ^(void *ptr __unused) {
+			xpc_release(obj);
+		}));
 	}
 
+	if (type == XPC_TYPE_FD)
+		return (rpc_fd_create(xpc_fd_dup(obj)));
+
 	if (type == XPC_TYPE_ARRAY) {
 		ret = rpc_array_create();
 		xpc_array_apply(obj, ^(size_t idx, xpc_object_t value) {
@@ -200,6 +224,9 @@ xpc_to_rpc(xpc_object_t obj)
 	if (type == XPC_TYPE_DICTIONARY) {
 		dtype = xpc_dictionary_get_string(obj, "$type");
 
+		if (g_strcmp0(dtype, "shmem") == 0)
+			return (xpc_shmem_to_data(obj));
+
 		if (g_strcmp0(dtype, "error") == 0) {
 			return (rpc_error_create_with_stack(
 			    (int)xpc_dictionary_get_int64(obj, "code"),
@@ -220,6 +247,63 @@ xpc_to_rpc(xpc_object_t obj)
 	g_assert_not_reached();
 }
 
+/*
+ * Copies the data once into a fresh anonymous region and wraps it in
+ * an xpc_shmem object, which the peer maps instead of receiving a copy.
+ * xpc_shmem_create() takes its own reference to the underlying memory,
+ * so our mapping can go away right after. The region is page-rounded,
+ * hence the real length travels alongside it.
+ */
+static xpc_object_t
+xpc_shmem_from_data(const void *bytes, size_t len)
+{
+	xpc_object_t ret;
+	xpc_object_t shmem;
+	size_t size;
+	void *addr;
+
+	size = (len + (size_t)getpagesize() - 1) &
+	    ~((size_t)getpagesize() - 1);
+	addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_ANON | MAP_SHARED,
+	    -1, 0);
+	if (addr == MAP_FAILED)
+		return (NULL);
+
+	memcpy(addr, bytes, len);
+	shmem = xpc_shmem_create(addr, size);
+	munmap(addr, size);
+	if (shmem == NULL)
+		return (NULL);
+
+	ret = xpc_dictionary_create(NULL, NULL, 0);
+	xpc_dictionary_set_string(ret, "$type", "shmem");
+	xpc_dictionary_set_uint64(ret, "length", len);
+	xpc_dictionary_set_value(ret, "region", shmem);
+	xpc_release(shmem);
+	return (ret);
+}
+
+static rpc_object_t
+xpc_shmem_to_data(xpc_object_t obj)
+{
+	xpc_object_t shmem;
+	size_t len, size;
+	void *addr = NULL;
+
+	shmem = xpc_dictionary_get_value(obj, "region");
+	len = (size_t)xpc_dictionary_get_uint64(obj, "length");
+	if (shmem == NULL || xpc_get_type(shmem) != XPC_TYPE_SHMEM)
+		return (rpc_null_create());
+
+	size = xpc_shmem_map(shmem, &addr);
+	if (size == 0 || addr == NULL || len > size)
+		return (rpc_null_create());
+
+	return (rpc_data_create(addr, len, ^(void *ptr) {
+		munmap(ptr, size);
+	}));
+}
+
 static int
 xpc_send_msg(void *arg, const void *buf, size_t size __unused,
     const int *fds __unused, size_t nfds __unused)
@@ -325,6 +409,7 @@ xpc_listen(struct rpc_server *conn, const char *uri_string,
 
 			rpc_object_t obj = xpc_to_rpc(msg);
 			xconn->conn->rco_recv_msg(xconn->conn, obj, 0, NULL, 0);
+			rpc_release(obj);
 		});
 
 		conn->rs_accept(conn, xconn->conn);
@@ -108,7 +108,7 @@ rpc_set_last_error(int code, const char *msg, rpc_object_t extra)
 {
 	rpc_object_t error;
 
-	error = rpc_error_create(code, msg, extra);
+	error = rpc_error_create_shared(code, msg, extra);
 	g_private_replace(&rpc_last_error, error);
 }
 
@@ -28,18 +28,73 @@
 #include "../linker_set.h"
 #include "../internal.h"
 
+static GHashTable *regex_cache;
+static GRWLock regex_cache_lock;
+
+/*
+ * Patterns come from the IDL and are few, so compiled expressions are
+ * kept for the lifetime of the process. G_REGEX_OPTIMIZE makes PCRE
+ * JIT-compile the pattern where it's supported.
+ */
+static GRegex *
+string_regex_get(const char *pattern, GError **error)
+{
+	static gsize init = 0;
+	GRegex *compiled;
+	GRegex *regex;
+
+	if (g_once_init_enter(&init)) {
+		regex_cache = g_hash_table_new_full(g_str_hash, g_str_equal,
+		    g_free, (GDestroyNotify)g_regex_unref);
+		g_once_init_leave(&init, 1);
+	}
+
+	g_rw_lock_reader_lock(&regex_cache_lock);
+	regex = g_hash_table_lookup(regex_cache, pattern);
+	g_rw_lock_reader_unlock(&regex_cache_lock);
+
+	if (regex != NULL)
+		return (regex);
+
+	compiled = g_regex_new(pattern, G_REGEX_OPTIMIZE, 0, error);
+	if (compiled == NULL)
+		return (NULL);
+
+	/* Someone else may have compiled it meanwhile; keep theirs */
+	g_rw_lock_writer_lock(&regex_cache_lock);
+	regex = g_hash_table_lookup(regex_cache, pattern);
+	if (regex == NULL) {
+		regex = compiled;
+		g_hash_table_insert(regex_cache, g_strdup(pattern), regex);
+	} else
+		g_regex_unref(compiled);
+
+	g_rw_lock_writer_unlock(&regex_cache_lock);
+	return (regex);
+}
+
 static bool
 validate_string_regex(rpc_object_t obj, rpc_object_t params,
     struct rpct_typei *typei __unused, struct rpct_error_context *errctx)
 {
+	GError *error = NULL;
+	GRegex *regex;
 	bool valid = true;
-	const char *pattern;
+	const char *pattern = NULL;
 	const char *str;
 
 	rpc_object_unpack(params, "{s}", "pattern", &pattern);
 	str = rpc_string_get_string_ptr(obj);
 
-	if (!g_regex_match_simple(pattern, str, 0, 0)) {
+	regex = string_regex_get(pattern != NULL ? pattern : "", &error);
+	if (regex == NULL) {
+		rpct_add_error(errctx, NULL, "Invalid pattern: %s",
+		    error->message);
+		g_error_free(error);
+		return (false);
+	}
+
+	if (!g_regex_match(regex, str, 0, NULL)) {
 		valid = false;
 		rpct_add_error(errctx, NULL, "String doesn't match");
 	}
@@ -0,0 +1,975 @@
+/*
+ * Copyright 2015-2017 Two Pore Guys, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <glib.h>
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+#include "thread.h"
+#include "workq.h"
+
+#define	RPC_WORKQ_CACHELINE	64
+#define	RPC_WORKQ_LANE_MASK	((guintptr)3)
+
+struct rpc_workq_job
+{
+	volatile gint		rwj_refcnt;
+	volatile gint		rwj_next;
+	volatile gint		rwj_done;
+	gint			rwj_ntasks;
+	rpc_workq_task_t	rwj_task;
+	GMutex			rwj_mtx;
+	GCond			rwj_cv;
+};
+
+struct rpc_workq_ring
+{
+	_Atomic guint		rwr_head;
+	char			rwr_pad[RPC_WORKQ_CACHELINE - sizeof(guint)];
+	_Atomic guint		rwr_tail;
+	void *			rwr_items[RPC_WORKQ_RING_SIZE];
+};
+
+struct rpc_workq_worker
+{
+	struct rpc_workq *	rww_parent;
+	struct rpc_workq_worker *rww_home;	/* whose deque we pop */
+	struct rpc_workq_ring *_Atomic rww_rings[RPC_WORKQ_MAX_PRODUCERS];
+	GThread *		rww_thread;
+	GMutex			rww_mtx;
+	GQueue			rww_lanes[RPC_WORKQ_NLANES];
+	guint			rww_credits[RPC_WORKQ_NLANES];
+	guint			rww_index;
+};
+
+/*
+ * Stands in for a worker blocked in a handler, see
+ * rpc_workq_block_begin().
+ */
+struct rpc_workq_spare
+{
+	struct rpc_workq *	rws_parent;
+	struct rpc_workq_worker *rws_home;
+	guint			rws_index;
+	volatile gint		rws_blocked;
+	volatile gint		rws_refcnt;
+};
+
+struct rpc_exec_tenant
+{
+	GMutex			rwt_mtx;
+	GCond			rwt_cv;
+	GQueue			rwt_lanes[RPC_WORKQ_NLANES];
+	guint			rwt_queued;
+	guint			rwt_running;
+	guint			rwt_weight;
+	guint			rwt_limit;
+	bool			rwt_busy;
+	bool			rwt_dead;
+	rpc_workq_fn_t		rwt_fn;
+	void *			rwt_arg;
+	volatile gint		rwt_refcnt;
+};
+
+struct rpc_workq
+{
+	struct rpc_workq_worker *rwq_workers;
+	guint			rwq_nworkers;
+	bool			rwq_pin;
+	bool			rwq_weighted;
+	guint			rwq_weights[RPC_WORKQ_NLANES];
+	rpc_workq_fn_t		rwq_fn;
+	void *			rwq_arg;
+	GMutex			rwq_mtx;
+	GCond			rwq_cv;
+	volatile gint		rwq_pending;
+	volatile gint		rwq_idle;
+	guint			rwq_nspares;
+	bool			rwq_stop;
+};
+
+static gpointer rpc_workq_worker(gpointer);
+static void *rpc_workq_take(struct rpc_workq_worker *,
+    struct rpc_workq_worker *, bool);
+static void *rpc_workq_pop(struct rpc_workq_worker *);
+static void *rpc_workq_steal(struct rpc_workq_worker *);
+static void rpc_workq_pin(guint);
+static void rpc_workq_worker_init(struct rpc_workq_worker *,
+    struct rpc_workq *, struct rpc_workq_worker *, guint);
+static gpointer rpc_workq_spare(gpointer);
+static void rpc_workq_spare_release(struct rpc_workq_spare *);
+static void rpc_workq_wake(struct rpc_workq *);
+static void rpc_workq_drain(struct rpc_workq_worker *);
+static bool rpc_workq_ring_put(struct rpc_workq_worker *, guint, void *,
+    guint *);
+static int rpc_workq_producer_id(void);
+static void rpc_workq_producer_exit(gpointer);
+static void rpc_workq_job_run(struct rpc_workq_job *);
+static void rpc_workq_job_release(struct rpc_workq_job *);
+static void rpc_workq_parallel_worker(void *, void *);
+static struct rpc_workq *rpc_exec_pool(void);
+static guint rpc_exec_share_locked(struct rpc_exec_tenant *);
+static void rpc_exec_idle_locked(struct rpc_exec_tenant *);
+static void rpc_exec_release(struct rpc_exec_tenant *);
+static void rpc_exec_worker(void *, void *);
+
+static GPrivate rpc_workq_producer = G_PRIVATE_INIT(rpc_workq_producer_exit);
+static GPrivate rpc_workq_current;
+static GMutex rpc_workq_producer_mtx;
+static guint32 rpc_workq_producer_ids;
+
+static GMutex rpc_exec_mtx;
+static struct rpc_workq *rpc_exec_wq;
+static guint rpc_exec_nworkers;
+static volatile gint rpc_exec_callbacks;
+static volatile gint rpc_exec_weight;
+
+/*
+ * Producer ids index the rings of each worker. They are handed back
+ * when the thread exits, and the next thread to get one carries on
+ * with whatever rings it left behind.
+ */
+static int
+rpc_workq_producer_id(void)
+{
+	gpointer value;
+	int id;
+
+	value = g_private_get(&rpc_workq_producer);
+	if (value != NULL)
+		return (GPOINTER_TO_INT(value) - 1);
+
+	g_mutex_lock(&rpc_workq_producer_mtx);
+	for (id = 0; id < RPC_WORKQ_MAX_PRODUCERS; id++) {
+		if ((rpc_workq_producer_ids & (1u << id)) == 0) {
+			rpc_workq_producer_ids |= (1u << id);
+			break;
+		}
+	}
+	g_mutex_unlock(&rpc_workq_producer_mtx);
+
+	if (id == RPC_WORKQ_MAX_PRODUCERS)
+		return (-1);
+
+	g_private_set(&rpc_workq_producer, GINT_TO_POINTER(id + 1));
+	return (id);
+}
+
+static void
+rpc_workq_producer_exit(gpointer value)
+{
+
+	g_mutex_lock(&rpc_workq_producer_mtx);
+	rpc_workq_producer_ids &= ~(1u << (GPOINTER_TO_INT(value) - 1));
+	g_mutex_unlock(&rpc_workq_producer_mtx);
+}
+
+static bool
+rpc_workq_ring_put(struct rpc_workq_worker *w, guint id, void *item,
+    guint *count)
+{
+	struct rpc_workq_ring *ring;
+	guint head;
+	guint tail;
+
+	ring = atomic_load_explicit(&w->rww_rings[id], memory_order_acquire);
+	if (ring == NULL) {
+		/* Only this producer ever installs this ring */
+		ring = g_malloc0(sizeof(*ring));
+		atomic_store_explicit(&w->rww_rings[id], ring,
+		    memory_order_release);
+	}
+
+	tail = atomic_load_explicit(&ring->rwr_tail, memory_order_relaxed);
+	head = atomic_load_explicit(&ring->rwr_head, memory_order_acquire);
+	if (tail - head == RPC_WORKQ_RING_SIZE)
+		return (false);
+
+	ring->rwr_items[tail % RPC_WORKQ_RING_SIZE] = item;
+	atomic_store_explicit(&ring->rwr_tail, tail + 1, memory_order_release);
+	*count = tail + 1;
+	return (true);
+}
+
+/*
+ * Moves everything producers left in the rings of @p w into its lanes.
+ * Called with the worker's mutex held, which makes the holder the one
+ * consumer of those rings.
+ */
+static void
+rpc_workq_drain(struct rpc_workq_worker *w)
+{
+	struct rpc_workq_ring *ring;
+	guintptr item;
+	guint head;
+	guint tail;
+	guint i;
+
+	for (i = 0; i < RPC_WORKQ_MAX_PRODUCERS; i++) {
+		ring = atomic_load_explicit(&w->rww_rings[i],
+		    memory_order_acquire);
+		if (ring == NULL)
+			continue;
+
+		head = atomic_load_explicit(&ring->rwr_head,
+		    memory_order_relaxed);
+		tail = atomic_load_explicit(&ring->rwr_tail,
+		    memory_order_acquire);
+		if (head == tail)
+			continue;
+
+		for (; head != tail; head++) {
+			item = (guintptr)ring->rwr_items[head %
+			    RPC_WORKQ_RING_SIZE];
+			g_queue_push_tail(
+			    &w->rww_lanes[item & RPC_WORKQ_LANE_MASK],
+			    (void *)(item & ~RPC_WORKQ_LANE_MASK));
+		}
+
+		atomic_store_explicit(&ring->rwr_head, tail,
+		    memory_order_release);
+	}
+}
+
+static void
+rpc_workq_wake(struct rpc_workq *wq)
+{
+
+	rpc_mutex_lock(&wq->rwq_mtx, RPC_LOCK_WORKQ);
+	g_cond_signal(&wq->rwq_cv);
+	g_mutex_unlock(&wq->rwq_mtx);
+}
+
+/*
+ * Takes an item from one of the lanes of @p victim, using the lane
+ * credits of @p self. Called with the victim's mutex held.
+ */
+static void *
+rpc_workq_take(struct rpc_workq_worker *self, struct rpc_workq_worker *victim,
+    bool tail)
+{
+	struct rpc_workq *wq = self->rww_parent;
+	GQueue *lane;
+	guint i;
+	guint busy = RPC_WORKQ_NLANES;
+
+	rpc_workq_drain(victim);
+	for (i = 0; i < RPC_WORKQ_NLANES; i++) {
+		lane = &victim->rww_lanes[i];
+		if (g_queue_is_empty(lane))
+			continue;
+
+		if (!wq->rwq_weighted)
+			goto found;
+
+		if (self->rww_credits[i] > 0) {
+			self->rww_credits[i]--;
+			goto found;
+		}
+
+		if (busy == RPC_WORKQ_NLANES)
+			busy = i;
+	}
+
+	if (busy == RPC_WORKQ_NLANES)
+		return (NULL);
+
+	/* Every busy lane used up its share, start a new round */
+	memcpy(self->rww_credits, wq->rwq_weights, sizeof(wq->rwq_weights));
+	i = busy;
+	lane = &victim->rww_lanes[i];
+	if (self->rww_credits[i] > 0)
+		self->rww_credits[i]--;
+
+found:
+	return (tail ? g_queue_pop_tail(lane) : g_queue_pop_head(lane));
+}
+
+static void *
+rpc_workq_pop(struct rpc_workq_worker *w)
+{
+	void *item;
+
+	/* Owner takes the oldest item, so calls keep their order */
+	g_mutex_lock(&w->rww_home->rww_mtx);
+	item = rpc_workq_take(w, w->rww_home, false);
+	g_mutex_unlock(&w->rww_home->rww_mtx);
+
+	if (item != NULL)
+		g_atomic_int_add(&w->rww_parent->rwq_pending, -1);
+
+	return (item);
+}
+
+static void *
+rpc_workq_steal(struct rpc_workq_worker *w)
+{
+	struct rpc_workq *wq = w->rww_parent;
+	struct rpc_workq_worker *victim;
+	void *item = NULL;
+	guint i;
+
+	for (i = 1; i < wq->rwq_nworkers && item == NULL; i++) {
+		if (g_atomic_int_get(&wq->rwq_pending) == 0)
+			break;
+
+		victim = &wq->rwq_workers[(w->rww_index + i) %
+		    wq->rwq_nworkers];
+
+		/* Thieves take from the other end, away from the owner */
+		g_mutex_lock(&victim->rww_mtx);
+		item = rpc_workq_take(w, victim, true);
+		g_mutex_unlock(&victim->rww_mtx);
+	}
+
+	if (item != NULL)
+		g_atomic_int_add(&wq->rwq_pending, -1);
+
+	return (item);
+}
+
+static void
+rpc_workq_pin(guint index)
+{
+#if defined(__linux__)
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(index % g_get_num_processors(), &set);
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+}
+
+static gpointer
+rpc_workq_worker(gpointer data)
+{
+	struct rpc_workq_worker *w = data;
+	struct rpc_workq *wq = w->rww_parent;
+	void *item;
+	bool stop;
+
+	if (wq->rwq_pin)
+		rpc_workq_pin(w->rww_index);
+
+	g_private_set(&rpc_workq_current, w);
+	for (;;) {
+		item = rpc_workq_pop(w);
+		if (item == NULL)
+			item = rpc_workq_steal(w);
+
+		if (item != NULL) {
+			/* Pass the wakeup on if we left work behind */
+			if (g_atomic_int_get(&wq->rwq_pending) > 0 &&
+			    g_atomic_int_get(&wq->rwq_idle) > 0)
+				rpc_workq_wake(wq);
+
+			wq->rwq_fn(item, wq->rwq_arg);
+			continue;
+		}
+
+		/*
+		 * A spinning worker doesn't count as idle, so producers
+		 * don't signal it; it watches rwq_pending instead.
+		 */
+		if (rpc_spin_wait(RPC_SPIN_DISPATCH, &wq->rwq_pending, 0))
+			continue;
+
+		/*
+		 * Producers only take rwq_mtx when somebody is idle, so
+		 * rwq_idle has to go up before rwq_pending is rechecked.
+		 */
+		rpc_mutex_lock(&wq->rwq_mtx, RPC_LOCK_WORKQ);
+		g_atomic_int_inc(&wq->rwq_idle);
+		while (g_atomic_int_get(&wq->rwq_pending) == 0 &&
+		    !wq->rwq_stop)
+			g_cond_wait(&wq->rwq_cv, &wq->rwq_mtx);
+
+		g_atomic_int_add(&wq->rwq_idle, -1);
+		stop = wq->rwq_stop && g_atomic_int_get(&wq->rwq_pending) == 0;
+		g_mutex_unlock(&wq->rwq_mtx);
+
+		if (stop)
+			break;
+	}
+
+	return (NULL);
+}
+
+/*
+ * Serves the deque of a blocked worker, and steals like it would, until
+ * the worker is back.
+ */
+static gpointer
+rpc_workq_spare(gpointer data)
+{
+	struct rpc_workq_spare *spare = data;
+	struct rpc_workq *wq = spare->rws_parent;
+	struct rpc_workq_worker self;
+	void *item;
+	bool stop = false;
+
+	rpc_workq_worker_init(&self, wq, spare->rws_home, spare->rws_index);
+	g_private_set(&rpc_workq_current, &self);
+
+	while (!stop && g_atomic_int_get(&spare->rws_blocked)) {
+		item = rpc_workq_pop(&self);
+		if (item == NULL)
+			item = rpc_workq_steal(&self);
+
+		if (item != NULL) {
+			if (g_atomic_int_get(&wq->rwq_pending) > 0 &&
+			    g_atomic_int_get(&wq->rwq_idle) > 0)
+				rpc_workq_wake(wq);
+
+			wq->rwq_fn(item, wq->rwq_arg);
+			continue;
+		}
+
+		rpc_mutex_lock(&wq->rwq_mtx, RPC_LOCK_WORKQ);
+		g_atomic_int_inc(&wq->rwq_idle);
+		while (g_atomic_int_get(&wq->rwq_pending) == 0 &&
+		    g_atomic_int_get(&spare->rws_blocked) && !wq->rwq_stop)
+			g_cond_wait(&wq->rwq_cv, &wq->rwq_mtx);
+
+		g_atomic_int_add(&wq->rwq_idle, -1);
+		stop = wq->rwq_stop && g_atomic_int_get(&wq->rwq_pending) == 0;
+		g_mutex_unlock(&wq->rwq_mtx);
+	}
+
+	g_private_set(&rpc_workq_current, NULL);
+	g_mutex_clear(&self.rww_mtx);
+
+	rpc_mutex_lock(&wq->rwq_mtx, RPC_LOCK_WORKQ);
+	wq->rwq_nspares--;
+	g_cond_broadcast(&wq->rwq_cv);
+	g_mutex_unlock(&wq->rwq_mtx);
+
+	rpc_workq_spare_release(spare);
+	return (NULL);
+}
+
+static void
+rpc_workq_spare_release(struct rpc_workq_spare *spare)
+{
+
+	if (g_atomic_int_dec_and_test(&spare->rws_refcnt))
+		g_free(spare);
+}
+
+void *
+rpc_workq_block_begin(void)
+{
+	struct rpc_workq_worker *w;
+	struct rpc_workq_spare *spare;
+	struct rpc_workq *wq;
+	GThread *thread;
+
+	w = g_private_get(&rpc_workq_current);
+	if (w == NULL)
+		return (NULL);
+
+	wq = w->rww_parent;
+	rpc_mutex_lock(&wq->rwq_mtx, RPC_LOCK_WORKQ);
+	if (wq->rwq_stop || wq->rwq_nspares >= RPC_WORKQ_MAX_SPARES) {
+		g_mutex_unlock(&wq->rwq_mtx);
+		return (NULL);
+	}
+
+	wq->rwq_nspares++;
+	g_mutex_unlock(&wq->rwq_mtx);
+
+	spare = g_malloc0(sizeof(*spare));
+	spare->rws_parent = wq;
+	spare->rws_home = w->rww_home;
+	spare->rws_index = w->rww_index;
+	spare->rws_blocked = 1;
+	spare->rws_refcnt = 2;
+	thread = rpc_thread_new(RPC_THREAD_WORKER, "rpc spare worker",
+	    rpc_workq_spare, spare);
+	g_thread_unref(thread);
+	return (spare);
+}
+
+void
+rpc_workq_block_end(void *cookie)
+{
+	struct rpc_workq_spare *spare = cookie;
+	struct rpc_workq *wq;
+
+	if (spare == NULL)
+		return;
+
+	/* The spare finishes what it's running, then goes away */
+	wq = spare->rws_parent;
+	g_atomic_int_set(&spare->rws_blocked, 0);
+	rpc_mutex_lock(&wq->rwq_mtx, RPC_LOCK_WORKQ);
+	g_cond_broadcast(&wq->rwq_cv);
+	g_mutex_unlock(&wq->rwq_mtx);
+	rpc_workq_spare_release(spare);
+}
+
+static void
+rpc_workq_worker_init(struct rpc_workq_worker *w, struct rpc_workq *wq,
+    struct rpc_workq_worker *home, guint index)
+{
+	guint lane;
+
+	memset(w, 0, sizeof(*w));
+	w->rww_parent = wq;
+	w->rww_home = home != NULL ? home : w;
+	w->rww_index = index;
+	g_mutex_init(&w->rww_mtx);
+	for (lane = 0; lane < RPC_WORKQ_NLANES; lane++) {
+		g_queue_init(&w->rww_lanes[lane]);
+		w->rww_credits[lane] = wq->rwq_weights[lane];
+	}
+}
+
+struct rpc_workq *
+rpc_workq_new(guint nworkers, bool pin, const guint *weights,
+    rpc_workq_fn_t fn, void *arg)
+{
+	struct rpc_workq *wq;
+	struct rpc_workq_worker *w;
+	guint i;
+	guint lane;
+
+	if (nworkers == 0)
+		nworkers = MAX(g_get_num_processors(), RPC_WORKQ_MIN_WORKERS);
+
+	wq = g_malloc0(sizeof(*wq));
+	wq->rwq_nworkers = MIN(nworkers, RPC_WORKQ_MAX_WORKERS);
+	wq->rwq_pin = pin;
+	wq->rwq_fn = fn;
+	wq->rwq_arg = arg;
+	wq->rwq_weighted = weights != NULL;
+	for (lane = 0; weights != NULL && lane < RPC_WORKQ_NLANES; lane++)
+		wq->rwq_weights[lane] = MAX(weights[lane], 1);
+
+	wq->rwq_workers = g_malloc0_n(wq->rwq_nworkers, sizeof(*w));
+	g_mutex_init(&wq->rwq_mtx);
+	g_cond_init(&wq->rwq_cv);
+
+	for (i = 0; i < wq->rwq_nworkers; i++)
+		rpc_workq_worker_init(&wq->rwq_workers[i], wq, NULL, i);
+
+	for (i = 0; i < wq->rwq_nworkers; i++) {
+		w = &wq->rwq_workers[i];
+		w->rww_thread = rpc_thread_new(RPC_THREAD_WORKER, "rpc worker",
+		    rpc_workq_worker, w);
+	}
+
+	return (wq);
+}
+
+void
+rpc_workq_push(struct rpc_workq *wq, guintptr affinity, guint lane,
+    void *item)
+{
+	struct rpc_workq_worker *w;
+	guint idx;
+	guint count = 0;
+	int id;
+
+	g_assert(((guintptr)item & RPC_WORKQ_LANE_MASK) == 0);
+	idx = (guint)((affinity >> 4) * 2654435761u) % wq->rwq_nworkers;
+	w = &wq->rwq_workers[idx];
+	lane = MIN(lane, RPC_WORKQ_NLANES - 1);
+	id = rpc_workq_producer_id();
+
+	/* Whatever is still in the rings was pushed first, so it goes first */
+	if (id < 0 || !rpc_workq_ring_put(w, (guint)id,
+	    (void *)((guintptr)item | lane), &count)) {
+		g_mutex_lock(&w->rww_mtx);
+		rpc_workq_drain(w);
+		g_queue_push_tail(&w->rww_lanes[lane], item);
+		g_mutex_unlock(&w->rww_mtx);
+	}
+
+	/* Busy workers hand the wakeup on, so most pushes can skip it */
+	if (g_atomic_int_add(&wq->rwq_pending, 1) != 0 && count != 0 &&
+	    count % RPC_WORKQ_WAKE_BATCH != 0)
+		return;
+
+	if (g_atomic_int_get(&wq->rwq_idle) == 0)
+		return;
+
+	rpc_workq_wake(wq);
+}
+
+void
+rpc_workq_free(struct rpc_workq *wq)
+{
+	struct rpc_workq_worker *w;
+	guint i;
+	guint j;
+
+	if (wq == NULL)
+		return;
+
+	/* Workers run whatever is still queued before they exit */
+	rpc_mutex_lock(&wq->rwq_mtx, RPC_LOCK_WORKQ);
+	wq->rwq_stop = true;
+	g_cond_broadcast(&wq->rwq_cv);
+	g_mutex_unlock(&wq->rwq_mtx);
+
+	for (i = 0; i < wq->rwq_nworkers; i++)
+		g_thread_join(wq->rwq_workers[i].rww_thread);
+
+	/* Spares still hold the worker deques */
+	rpc_mutex_lock(&wq->rwq_mtx, RPC_LOCK_WORKQ);
+	while (wq->rwq_nspares > 0)
+		g_cond_wait(&wq->rwq_cv, &wq->rwq_mtx);
+
+	g_mutex_unlock(&wq->rwq_mtx);
+
+	for (i = 0; i < wq->rwq_nworkers; i++) {
+		w = &wq->rwq_workers[i];
+		g_mutex_clear(&w->rww_mtx);
+		for (j = 0; j < RPC_WORKQ_MAX_PRODUCERS; j++)
+			g_free(atomic_load(&w->rww_rings[j]));
+	}
+
+	g_mutex_clear(&wq->rwq_mtx);
+	g_cond_clear(&wq->rwq_cv);
+	g_free(wq->rwq_workers);
+	g_free(wq);
+}
+
+static void
+rpc_workq_job_run(struct rpc_workq_job *job)
+{
+	gint i;
+
+	while ((i = g_atomic_int_add(&job->rwj_next, 1)) < job->rwj_ntasks) {
+		job->rwj_task((size_t)i);
+		if (g_atomic_int_add(&job->rwj_done, 1) + 1 < job->rwj_ntasks)
+			continue;
+
+		g_mutex_lock(&job->rwj_mtx);
+		g_cond_broadcast(&job->rwj_cv);
+		g_mutex_unlock(&job->rwj_mtx);
+	}
+}
+
+static void
+rpc_workq_job_release(struct rpc_workq_job *job)
+{
+
+	if (!g_atomic_int_dec_and_test(&job->rwj_refcnt))
+		return;
+
+	g_mutex_clear(&job->rwj_mtx);
+	g_cond_clear(&job->rwj_cv);
+	g_free(job);
+}
+
+static void
+rpc_workq_parallel_worker(void *item, void *arg)
+{
+	struct rpc_workq_job *job = item;
+
+	rpc_workq_job_run(job);
+	rpc_workq_job_release(job);
+}
+
+void
+rpc_workq_parallel(size_t ntasks, rpc_workq_task_t task)
+{
+	static struct rpc_workq *pool;
+	struct rpc_workq_job *job;
+	struct rpc_workq *wq;
+	guint i;
+	guint nhelpers;
+
+	g_assert(ntasks <= G_MAXINT);
+
+	if (ntasks < 2) {
+		if (ntasks == 1)
+			task(0);
+
+		return;
+	}
+
+	if (g_once_init_enter(&pool)) {
+		wq = rpc_workq_new(0, false, NULL, rpc_workq_parallel_worker,
+		    NULL);
+		g_once_init_leave(&pool, wq);
+	}
+
+	/*
+	 * The job lives on as long as any helper we pushed hasn't dequeued
+	 * it yet, but such a helper finds nothing left to claim, so the task
+	 * block itself is never run after this function returns.
+	 */
+	nhelpers = (guint)MIN(ntasks - 1, pool->rwq_nworkers);
+	job = g_malloc0(sizeof(*job));
+	job->rwj_refcnt = (gint)nhelpers + 1;
+	job->rwj_ntasks = (gint)ntasks;
+	job->rwj_task = task;
+	g_mutex_init(&job->rwj_mtx);
+	g_cond_init(&job->rwj_cv);
+
+	/* Affinity keys are hashed from bit 4 up */
+	for (i = 0; i < nhelpers; i++)
+		rpc_workq_push(pool, (guintptr)i << 4, 0, job);
+
+	rpc_workq_job_run(job);
+
+	g_mutex_lock(&job->rwj_mtx);
+	while (g_atomic_int_get(&job->rwj_done) < job->rwj_ntasks)
+		g_cond_wait(&job->rwj_cv, &job->rwj_mtx);
+	g_mutex_unlock(&job->rwj_mtx);
+
+	rpc_workq_job_release(job);
+}
+
+static struct rpc_workq *
+rpc_exec_pool(void)
+{
+	struct rpc_workq *wq;
+
+	wq = g_atomic_pointer_get(&rpc_exec_wq);
+	if (wq != NULL)
+		return (wq);
+
+	g_mutex_lock(&rpc_exec_mtx);
+	wq = rpc_exec_wq;
+	if (wq == NULL) {
+		wq = rpc_workq_new(rpc_exec_nworkers, false, NULL,
+		    rpc_exec_worker, NULL);
+		g_atomic_pointer_set(&rpc_exec_wq, wq);
+	}
+	g_mutex_unlock(&rpc_exec_mtx);
+	return (wq);
+}
+
+int
+rpc_exec_set_workers(guint nworkers)
+{
+	int ret = 0;
+
+	g_mutex_lock(&rpc_exec_mtx);
+	if (rpc_exec_wq != NULL)
+		ret = -1;
+	else
+		rpc_exec_nworkers = MIN(nworkers, RPC_WORKQ_MAX_WORKERS);
+	g_mutex_unlock(&rpc_exec_mtx);
+	return (ret);
+}
+
+void
+rpc_exec_set_share_callbacks(bool share)
+{
+
+	g_atomic_int_set(&rpc_exec_callbacks, share ? 1 : 0);
+}
+
+bool
+rpc_exec_get_share_callbacks(void)
+{
+
+	return (g_atomic_int_get(&rpc_exec_callbacks) != 0);
+}
+
+struct rpc_exec_tenant *
+rpc_exec_tenant_new(guint weight, guint limit, rpc_workq_fn_t fn, void *arg)
+{
+	struct rpc_exec_tenant *tenant;
+	guint lane;
+
+	tenant = g_malloc0(sizeof(*tenant));
+	g_mutex_init(&tenant->rwt_mtx);
+	g_cond_init(&tenant->rwt_cv);
+	for (lane = 0; lane < RPC_WORKQ_NLANES; lane++)
+		g_queue_init(&tenant->rwt_lanes[lane]);
+
+	tenant->rwt_weight = MAX(weight, 1);
+	tenant->rwt_limit = limit;
+	tenant->rwt_fn = fn;
+	tenant->rwt_arg = arg;
+	tenant->rwt_refcnt = 1;
+	return (tenant);
+}
+
+/*
+ * Workers the tenant may occupy right now, rounded up so that every
+ * tenant with work gets at least one.
+ */
+static guint
+rpc_exec_share_locked(struct rpc_exec_tenant *tenant)
+{
+	guint total;
+	guint share;
+
+	total = (guint)MAX(g_atomic_int_get(&rpc_exec_weight),
+	    (gint)tenant->rwt_weight);
+	share = (rpc_exec_pool()->rwq_nworkers * tenant->rwt_weight +
+	    total - 1) / total;
+	share = MAX(share, 1);
+	if (tenant->rwt_limit != 0)
+		share = MIN(share, tenant->rwt_limit);
+
+	return (share);
+}
+
+static void
+rpc_exec_idle_locked(struct rpc_exec_tenant *tenant)
+{
+
+	if (tenant->rwt_busy && tenant->rwt_queued == 0 &&
+	    tenant->rwt_running == 0) {
+		tenant->rwt_busy = false;
+		g_atomic_int_add(&rpc_exec_weight, -(gint)tenant->rwt_weight);
+		g_cond_broadcast(&tenant->rwt_cv);
+	}
+}
+
+static void
+rpc_exec_release(struct rpc_exec_tenant *tenant)
+{
+	guint lane;
+
+	if (!g_atomic_int_dec_and_test(&tenant->rwt_refcnt))
+		return;
+
+	for (lane = 0; lane < RPC_WORKQ_NLANES; lane++)
+		g_queue_clear(&tenant->rwt_lanes[lane]);
+
+	g_mutex_clear(&tenant->rwt_mtx);
+	g_cond_clear(&tenant->rwt_cv);
+	g_free(tenant);
+}
+
+bool
+rpc_exec_submit(struct rpc_exec_tenant *tenant, guintptr affinity,
+    guint lane, void *item)
+{
+	struct rpc_workq *wq;
+	bool start = false;
+
+	wq = rpc_exec_pool();
+	lane = MIN(lane, RPC_WORKQ_NLANES - 1);
+
+	g_mutex_lock(&tenant->rwt_mtx);
+	if (tenant->rwt_dead) {
+		g_mutex_unlock(&tenant->rwt_mtx);
+		return (false);
+	}
+
+	g_queue_push_tail(&tenant->rwt_lanes[lane], item);
+	tenant->rwt_queued++;
+	if (!tenant->rwt_busy) {
+		tenant->rwt_busy = true;
+		g_atomic_int_add(&rpc_exec_weight, (gint)tenant->rwt_weight);
+	}
+
+	if (tenant->rwt_running < rpc_exec_share_locked(tenant)) {
+		tenant->rwt_running++;
+		g_atomic_int_inc(&tenant->rwt_refcnt);
+		start = true;
+	}
+	g_mutex_unlock(&tenant->rwt_mtx);
+
+	/* Every pool item is a turn of the tenant at running its queue */
+	if (start)
+		rpc_workq_push(wq, affinity, lane, tenant);
+
+	return (true);
+}
+
+static void
+rpc_exec_worker(void *item, void *arg)
+{
+	struct rpc_exec_tenant *tenant = item;
+	void *work;
+	guint quantum;
+	guint lane;
+	guint n;
+	bool again;
+
+	quantum = RPC_EXEC_QUANTUM * tenant->rwt_weight;
+	for (n = 0;; n++) {
+		work = NULL;
+		g_mutex_lock(&tenant->rwt_mtx);
+		for (lane = 0; n < quantum && work == NULL &&
+		    lane < RPC_WORKQ_NLANES; lane++)
+			work = g_queue_pop_head(&tenant->rwt_lanes[lane]);
+
+		if (work == NULL)
+			break;
+
+		tenant->rwt_queued--;
+		g_mutex_unlock(&tenant->rwt_mtx);
+		tenant->rwt_fn(work, tenant->rwt_arg);
+	}
+
+	/* Still holding the tenant lock here */
+	again = tenant->rwt_queued > 0 && !tenant->rwt_dead;
+	if (!again) {
+		tenant->rwt_running--;
+		rpc_exec_idle_locked(tenant);
+	}
+	g_mutex_unlock(&tenant->rwt_mtx);
+
+	if (again) {
+		rpc_workq_push(rpc_exec_pool(), (guintptr)tenant, 0, tenant);
+		return;
+	}
+
+	rpc_exec_release(tenant);
+}
+
+void
+rpc_exec_tenant_free(struct rpc_exec_tenant *tenant, bool drain)
+{
+	guint lane;
+
+	if (tenant == NULL)
+		return;
+
+	g_mutex_lock(&tenant->rwt_mtx);
+	if (drain) {
+		while (tenant->rwt_queued > 0 || tenant->rwt_running > 0)
+			g_cond_wait(&tenant->rwt_cv, &tenant->rwt_mtx);
+	} else {
+		for (lane = 0; lane < RPC_WORKQ_NLANES; lane++)
+			g_queue_clear(&tenant->rwt_lanes[lane]);
+
+		tenant->rwt_queued = 0;
+		rpc_exec_idle_locked(tenant);
+	}
+
+	tenant->rwt_dead = true;
+	g_mutex_unlock(&tenant->rwt_mtx);
+	rpc_exec_release(tenant);
+}
@@ -0,0 +1,120 @@
+/*
+ * Copyright 2015-2017 Two Pore Guys, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef LIBRPC_WORKQ_H
+#define LIBRPC_WORKQ_H
+
+#include <stdbool.h>
+#include <glib.h>
+
+/*
+ * Fixed-size work-stealing thread pool. Every worker owns a deque;
+ * producers pick a worker by affinity key, so related items tend to
+ * run on the same thread, and idle workers steal from the others.
+ *
+ * Each deque is split into priority lanes, lane 0 being the most
+ * urgent. Without weights, lanes are served strictly in order. With
+ * weights, every busy lane gets that many items per round.
+ *
+ * Producers don't take the deque lock. Every producing thread has a
+ * single-producer ring into each worker, which is moved into the lanes
+ * in bulk by whoever next takes from that worker; only a full ring
+ * falls back to the locked path. Sleeping workers are woken when the
+ * queue goes from empty to busy and then once per RPC_WORKQ_WAKE_BATCH
+ * items, and a worker that finds more work queued wakes the next one.
+ * The lane travels in the low bits of the item pointer, so items must
+ * be at least 4-byte aligned.
+ */
+#define	RPC_WORKQ_MAX_WORKERS	64
+#define	RPC_WORKQ_MIN_WORKERS	4
+#define	RPC_WORKQ_NLANES	3
+#define	RPC_WORKQ_MAX_PRODUCERS	32
+#define	RPC_WORKQ_RING_SIZE	256
+#define	RPC_WORKQ_WAKE_BATCH	16
+#define	RPC_WORKQ_MAX_SPARES	256
+
+struct rpc_workq;
+
+typedef void (*rpc_workq_fn_t)(void *item, void *arg);
+
+struct rpc_workq *rpc_workq_new(guint nworkers, bool pin,
+    const guint *weights, rpc_workq_fn_t fn, void *arg);
+void rpc_workq_push(struct rpc_workq *wq, guintptr affinity, guint lane,
+    void *item);
+void rpc_workq_free(struct rpc_workq *wq);
+
+/*
+ * Brackets a wait inside an item handler that may only end once other
+ * items have run, such as a streaming call waiting for credits. While
+ * the worker is blocked, a spare thread serves its deque and steals
+ * like it would, so a fixed pool can't deadlock on its own handlers.
+ * Called from any other thread, rpc_workq_block_begin() returns NULL
+ * and rpc_workq_block_end() does nothing.
+ */
+void *rpc_workq_block_begin(void);
+void rpc_workq_block_end(void *cookie);
+
+/*
+ * Fork-join helper for data parallel loops: runs task(0) to
+ * task(ntasks - 1) on a process-wide pool and returns once all of them
+ * are done. The calling thread claims tasks as well, so nested use, or
+ * use from a thread of any pool, can't deadlock waiting for helpers.
+ */
+typedef void (^rpc_workq_task_t)(size_t index);
+
+void rpc_workq_parallel(size_t ntasks, rpc_workq_task_t task);
+
+/*
+ * Process-wide executor shared by contexts and connections that opt in,
+ * so the number of worker threads stays close to the number of CPUs
+ * however many of them a process has. Each user is a tenant with its
+ * own queue, served strictly by lane; the pool runs tenants, not items.
+ *
+ * A tenant gets up to as many workers at once as its weight's share of
+ * the weights of all tenants that currently have work, capped by its
+ * limit if it has one; a limit of 1 runs its items one at a time, in
+ * order. A worker runs at most RPC_EXEC_QUANTUM items per unit of weight
+ * before the tenant goes to the back of the line, so a busy tenant
+ * can't keep others waiting.
+ *
+ * rpc_exec_tenant_free() either waits for the queue to drain or drops
+ * whatever is still queued; items already running finish either way.
+ */
+#define	RPC_EXEC_QUANTUM	8
+
+struct rpc_exec_tenant;
+
+int rpc_exec_set_workers(guint nworkers);
+void rpc_exec_set_share_callbacks(bool share);
+bool rpc_exec_get_share_callbacks(void);
+struct rpc_exec_tenant *rpc_exec_tenant_new(guint weight, guint limit,
+    rpc_workq_fn_t fn, void *arg);
+bool rpc_exec_submit(struct rpc_exec_tenant *tenant, guintptr affinity,
+    guint lane, void *item);
+void rpc_exec_tenant_free(struct rpc_exec_tenant *tenant, bool drain);
+
+#endif /* LIBRPC_WORKQ_H */
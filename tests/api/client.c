@@ -189,8 +189,13 @@ typedef struct {
 	char *			str;
 	GRand *			rand;
 	GThreadPool *		workers;
+	GMutex			mtx;
+	GCond			cv;
+	bool			open;
 } client_fixture;
 
+#define	COALESCED	8
+
 struct work_item {
 	rpc_connection_t	conn;
 	rpc_call_t		call;
@@ -510,6 +515,206 @@ client_multi_streams_test(client_fixture *fixture, gconstpointer user_data)
 	rpc_context_unregister_member(fixture->ctx, NULL, "stream-me");
 }
 
+/*
+ * Registers "gate", which counts its calls and holds them until
+ * coalesce_open() lets them through.
+ */
+static void
+coalesce_set_up(client_fixture *fixture)
+{
+
+	fixture->count = 0;
+	fixture->open = false;
+	g_mutex_init(&fixture->mtx);
+	g_cond_init(&fixture->cv);
+	g_assert_cmpint(rpc_context_set_dispatch_workers(fixture->ctx, 4,
+	    false), ==, 0);
+
+	rpc_context_register_block(fixture->ctx, NULL, "gate", NULL,
+	    ^rpc_object_t (void *cookie __unused, rpc_object_t args) {
+		g_atomic_int_inc(&fixture->count);
+		g_mutex_lock(&fixture->mtx);
+		while (!fixture->open)
+			g_cond_wait(&fixture->cv, &fixture->mtx);
+		g_mutex_unlock(&fixture->mtx);
+
+		return (rpc_string_create_with_format("value %s",
+		    rpc_array_get_string(args, 0)));
+	});
+
+	rpc_server_resume(fixture->srv);
+}
+
+static void
+coalesce_tear_down(client_fixture *fixture)
+{
+
+	rpc_context_unregister_member(fixture->ctx, NULL, "gate");
+	g_cond_clear(&fixture->cv);
+	g_mutex_clear(&fixture->mtx);
+}
+
+static void
+coalesce_open(client_fixture *fixture)
+{
+
+	g_mutex_lock(&fixture->mtx);
+	fixture->open = true;
+	g_cond_broadcast(&fixture->cv);
+	g_mutex_unlock(&fixture->mtx);
+}
+
+static rpc_call_t
+coalesce_call(rpc_connection_t conn, const char *arg)
+{
+	rpc_call_t call;
+
+	call = rpc_connection_call(conn, NULL, NULL, "gate",
+	    rpc_object_pack("[s]", arg), NULL);
+	g_assert_nonnull(call);
+	return (call);
+}
+
+static void
+coalesce_wait_count(client_fixture *fixture, int count)
+{
+
+	while (g_atomic_int_get(&fixture->count) < count)
+		g_usleep(1000);
+}
+
+static void
+coalesce_check_done(rpc_call_t call, const char *expected)
+{
+
+	rpc_call_wait(call);
+	g_assert_cmpint(rpc_call_status(call), ==, RPC_CALL_DONE);
+	g_assert_cmpstr(rpc_string_get_string_ptr(rpc_call_result(call)), ==,
+	    expected);
+	g_assert_true(rpc_object_is_frozen(rpc_call_result(call)));
+}
+
+/*
+ * Identical calls made while the first one is running complete with its
+ * result without reaching the server, except for the one aborted on
+ * the way. Calls with other arguments, and calls made once the first
+ * one is done or coalescing is off, go out as usual.
+ */
+static void
+client_coalesce_test(client_fixture *fixture, gconstpointer user_data)
+{
+	rpc_client_t client;
+	rpc_connection_t conn;
+	rpc_call_t followers[COALESCED];
+	rpc_call_t leader;
+	rpc_call_t other;
+	rpc_call_t call;
+	int i;
+
+	coalesce_set_up(fixture);
+	client = rpc_client_create(uris_[fixture->iuri].cli, 0);
+	g_assert_nonnull(client);
+	conn = rpc_client_get_connection(client);
+	rpc_connection_set_coalescing(conn, true);
+
+	leader = coalesce_call(conn, "a");
+	coalesce_wait_count(fixture, 1);
+	for (i = 0; i < COALESCED; i++)
+		followers[i] = coalesce_call(conn, "a");
+
+	other = coalesce_call(conn, "b");
+	coalesce_wait_count(fixture, 2);
+
+	g_assert_cmpint(rpc_call_abort(followers[1]), ==, 0);
+	g_assert_cmpint(rpc_call_status(followers[1]), ==, RPC_CALL_ABORTED);
+	for (i = 0; i < COALESCED; i++) {
+		if (i != 1) {
+			g_assert_cmpint(rpc_call_status(followers[i]), ==,
+			    RPC_CALL_IN_PROGRESS);
+		}
+	}
+
+	coalesce_open(fixture);
+	coalesce_check_done(leader, "value a");
+	coalesce_check_done(other, "value b");
+	for (i = 0; i < COALESCED; i++) {
+		if (i == 1)
+			continue;
+
+		coalesce_check_done(followers[i], "value a");
+		g_assert_true(rpc_call_result(followers[i]) ==
+		    rpc_call_result(leader));
+	}
+
+	g_assert_cmpint(fixture->count, ==, 2);
+	for (i = 0; i < COALESCED; i++)
+		rpc_call_free(followers[i]);
+
+	rpc_call_free(other);
+	rpc_call_free(leader);
+
+	/* Nothing left in flight, so this one goes out */
+	call = coalesce_call(conn, "a");
+	coalesce_check_done(call, "value a");
+	rpc_call_free(call);
+	g_assert_cmpint(fixture->count, ==, 3);
+
+	rpc_connection_set_coalescing(conn, false);
+	for (i = 0; i < COALESCED; i++)
+		followers[i] = coalesce_call(conn, "a");
+
+	for (i = 0; i < COALESCED; i++) {
+		rpc_call_wait(followers[i]);
+		g_assert_cmpint(rpc_call_status(followers[i]), ==,
+		    RPC_CALL_DONE);
+		rpc_call_free(followers[i]);
+	}
+
+	g_assert_cmpint(fixture->count, ==, 3 + COALESCED);
+	rpc_client_close(client);
+	coalesce_tear_down(fixture);
+}
+
+/*
+ * Aborting the first of identical calls sends the others on their own,
+ * and each of them still gets an answer.
+ */
+static void
+client_coalesce_abort_test(client_fixture *fixture, gconstpointer user_data)
+{
+	rpc_client_t client;
+	rpc_connection_t conn;
+	rpc_call_t followers[COALESCED];
+	rpc_call_t leader;
+	int i;
+
+	coalesce_set_up(fixture);
+	client = rpc_client_create(uris_[fixture->iuri].cli, 0);
+	g_assert_nonnull(client);
+	conn = rpc_client_get_connection(client);
+	rpc_connection_set_coalescing(conn, true);
+
+	leader = coalesce_call(conn, "a");
+	coalesce_wait_count(fixture, 1);
+	for (i = 0; i < COALESCED; i++)
+		followers[i] = coalesce_call(conn, "a");
+
+	g_assert_cmpint(fixture->count, ==, 1);
+	g_assert_cmpint(rpc_call_abort(leader), ==, 0);
+	g_assert_cmpint(rpc_call_status(leader), ==, RPC_CALL_ABORTED);
+
+	coalesce_open(fixture);
+	for (i = 0; i < COALESCED; i++) {
+		coalesce_check_done(followers[i], "value a");
+		rpc_call_free(followers[i]);
+	}
+
+	g_assert_cmpint(fixture->count, ==, 1 + COALESCED);
+	rpc_call_free(leader);
+	rpc_client_close(client);
+	coalesce_tear_down(fixture);
+}
+
 static void
 client_test_single_set_up(client_fixture *fixture, gconstpointer user_data)
 {
@@ -557,6 +762,14 @@ client_test_register()
 	    client_test_single_set_up, client_multi_streams_test,
 	    client_test_tear_down);
 
+	g_test_add("/client/coalesce/followers", client_fixture, (void *)0,
+	    client_test_single_set_up, client_coalesce_test,
+	    client_test_tear_down);
+
+	g_test_add("/client/coalesce/abort", client_fixture, (void *)0,
+	    client_test_single_set_up, client_coalesce_abort_test,
+	    client_test_tear_down);
+
 }
 
 static struct librpc_test client = {
@@ -1433,7 +1433,17 @@ SCENARIO("RPC_DESCRIPTION_TEST", "Create a tree of RPC objects and print their d
 #include "../tests.h"
 #include "../../src/linker_set.h"
 #include <glib.h>
+#include <string.h>
+#include <rpc/object.h>
+#include <rpc/serializer.h>
+#include "../../src/internal.h"
 
+#define	SLAB_THREADS	8
+#define	SLAB_OBJECTS	10000
+#define	DICT_KEYS	1000
+#define	PACKED_COUNT	64
+#define	COW_THREADS	8
+#define	COW_ROUNDS	1000
 
 typedef struct {
 
@@ -1457,10 +1467,593 @@ object_test_tear_down(object_fixture *fixture, gconstpointer user_data)
 
 }
 
+static gpointer
+object_test_slab_thread(gpointer data)
+{
+	GPtrArray *objects = data;
+	rpc_object_t object;
+	guint round;
+	guint i;
+
+	/* The second round is served from the magazines of the first */
+	for (round = 0; round < 2; round++) {
+		for (i = 0; i < SLAB_OBJECTS; i++)
+			g_ptr_array_add(objects, rpc_int64_create(i));
+
+		for (i = 0; i < SLAB_OBJECTS; i++) {
+			object = g_ptr_array_index(objects, i);
+			g_assert_cmpint(rpc_int64_get_value(object), ==, i);
+		}
+
+		if (round == 0)
+			g_ptr_array_set_size(objects, 0);
+	}
+
+	return (NULL);
+}
+
+static void
+object_test_slab(void)
+{
+	struct rpc_alloc_stats before;
+	struct rpc_alloc_stats after;
+	GPtrArray *objects[SLAB_THREADS];
+	GThread *threads[SLAB_THREADS];
+	guint i;
+	guint j;
+
+	g_assert_cmpint(rpc_get_alloc_stats(RPC_ALLOC_OBJECT, &before), ==, 0);
+
+	for (i = 0; i < SLAB_THREADS; i++) {
+		objects[i] = g_ptr_array_new_with_free_func(
+		    (GDestroyNotify)rpc_release_impl);
+		threads[i] = g_thread_new("slab", object_test_slab_thread,
+		    objects[i]);
+	}
+
+	for (i = 0; i < SLAB_THREADS; i++)
+		g_thread_join(threads[i]);
+
+	/* Objects freed on another thread than the one they came from */
+	for (i = 0; i < SLAB_THREADS; i++) {
+		for (j = 0; j < SLAB_OBJECTS; j++)
+			g_assert_cmpint(rpc_int64_get_value(
+			    g_ptr_array_index(objects[i], j)), ==, j);
+
+		g_ptr_array_free(objects[i], true);
+	}
+
+	g_assert_cmpint(rpc_get_alloc_stats(RPC_ALLOC_OBJECT, &after), ==, 0);
+	g_assert_cmpuint(after.ras_allocs - before.ras_allocs, >=,
+	    2 * SLAB_THREADS * SLAB_OBJECTS);
+	g_assert_cmpuint(after.ras_hits, >, before.ras_hits);
+	g_assert_cmpint(rpc_get_alloc_stats((rpc_alloc_cache_t)-1, &after),
+	    ==, -1);
+}
+
+static void
+object_test_inline_strings(void)
+{
+	rpc_object_t objects[3];
+	rpc_object_t copy;
+	rpc_object_t loaded;
+	char buf[64 + 1];
+	void *frame;
+	size_t size;
+	size_t len;
+	guint i;
+
+	/* Either side of the inline limit, through every constructor */
+	for (len = 0; len < sizeof(buf) - 1; len++) {
+		for (i = 0; i < len; i++)
+			buf[i] = (char)('a' + (len + i) % 26);
+
+		buf[len] = '\0';
+		objects[0] = rpc_string_create(buf);
+		objects[1] = rpc_string_create_len(buf, len);
+		objects[2] = rpc_string_create_with_format("%s", buf);
+
+		for (i = 0; i < G_N_ELEMENTS(objects); i++) {
+			g_assert_cmpuint(rpc_string_get_length(objects[i]), ==,
+			    len);
+			g_assert_cmpstr(rpc_string_get_string_ptr(objects[i]),
+			    ==, buf);
+			g_assert_true(rpc_equal(objects[i], objects[0]));
+		}
+
+		/* The copy has to own its bytes once the original is gone */
+		copy = rpc_copy(objects[0]);
+		g_assert_true(copy != objects[0]);
+		for (i = 0; i < G_N_ELEMENTS(objects); i++)
+			rpc_release(objects[i]);
+
+		g_assert_cmpstr(rpc_string_get_string_ptr(copy), ==, buf);
+
+		g_assert_cmpint(rpc_serializer_dump("msgpack", copy, &frame,
+		    &size), ==, 0);
+		loaded = rpc_serializer_load("msgpack", frame, size);
+		g_assert_nonnull(loaded);
+		g_assert_cmpuint(rpc_string_get_length(loaded), ==, len);
+		g_assert_cmpstr(rpc_string_get_string_ptr(loaded), ==, buf);
+
+		g_free(frame);
+		rpc_release(loaded);
+		rpc_release(copy);
+	}
+
+	g_assert_cmpuint(len, >, RPC_INLINE_STRING_MAX);
+}
+
+/* Checks that @p dict holds the keys of @p order, in that order */
+static void
+object_test_dict_order(rpc_object_t dict, GPtrArray *order)
+{
+	__block guint next = 0;
+
+	g_assert_cmpuint(rpc_dictionary_get_count(dict), ==, order->len);
+	rpc_dictionary_apply(dict, ^(const char *key, rpc_object_t value) {
+		g_assert_cmpuint(next, <, order->len);
+		g_assert_cmpstr(key, ==, g_ptr_array_index(order, next));
+		g_assert_cmpstr(rpc_string_get_string_ptr(value), ==, key);
+		next++;
+		return ((bool)true);
+	});
+
+	g_assert_cmpuint(next, ==, order->len);
+}
+
+static void
+object_test_dict(gconstpointer user_data)
+{
+	guint nkeys = GPOINTER_TO_UINT(user_data);
+	rpc_object_t dict;
+	rpc_object_t reversed;
+	GPtrArray *order;
+	GPtrArray *keys;
+	char *key;
+	guint i;
+
+	dict = rpc_dictionary_create();
+	reversed = rpc_dictionary_create();
+	keys = g_ptr_array_new_with_free_func(g_free);
+	order = g_ptr_array_new();
+
+	for (i = 0; i < nkeys; i++) {
+		key = g_strdup_printf("key%u", i);
+		g_ptr_array_add(keys, key);
+		g_ptr_array_add(order, key);
+		rpc_dictionary_set_string(dict, key, key);
+	}
+
+	for (i = nkeys; i-- > 0;) {
+		key = g_ptr_array_index(keys, i);
+		rpc_dictionary_set_string(reversed, key, key);
+	}
+
+	object_test_dict_order(dict, order);
+	g_assert_true(rpc_equal(dict, reversed));
+
+	/* Overwriting keeps a key where it was */
+	for (i = 0; i < nkeys; i += 3) {
+		key = g_ptr_array_index(keys, i);
+		rpc_dictionary_set_int64(dict, key, i);
+		g_assert_cmpint(rpc_dictionary_get_int64(dict, key), ==, i);
+		rpc_dictionary_set_string(dict, key, key);
+	}
+
+	object_test_dict_order(dict, order);
+
+	/* Removed keys leave the others in order, and come back last */
+	g_ptr_array_set_size(order, 0);
+	for (i = 0; i < nkeys; i++) {
+		key = g_ptr_array_index(keys, i);
+		if (i % 2 == 0)
+			rpc_dictionary_remove_key(dict, key);
+		else
+			g_ptr_array_add(order, key);
+	}
+
+	for (i = 0; i < nkeys; i++) {
+		key = g_ptr_array_index(keys, i);
+		g_assert(rpc_dictionary_has_key(dict, key) == (i % 2 != 0));
+	}
+
+	object_test_dict_order(dict, order);
+	g_assert_false(rpc_equal(dict, reversed));
+
+	for (i = 0; i < nkeys; i += 2) {
+		key = g_ptr_array_index(keys, i);
+		rpc_dictionary_set_string(dict, key, key);
+		g_ptr_array_add(order, key);
+	}
+
+	object_test_dict_order(dict, order);
+	g_assert_true(rpc_equal(dict, reversed));
+
+	rpc_dictionary_remove_all(dict);
+	g_assert_cmpuint(rpc_dictionary_get_count(dict), ==, 0);
+	g_assert_false(rpc_dictionary_has_key(dict, "key1"));
+
+	rpc_release(dict);
+	rpc_release(reversed);
+	g_ptr_array_free(order, true);
+	g_ptr_array_free(keys, true);
+}
+
+/* Reads element @p index through the getter of @p type, as raw bits */
+static int64_t
+object_test_packed_get(rpc_object_t array, rpc_type_t type, size_t index)
+{
+	double d;
+	int64_t raw;
+
+	switch (type) {
+	case RPC_TYPE_INT64:
+		return (rpc_array_get_int64(array, index));
+
+	case RPC_TYPE_UINT64:
+		return ((int64_t)rpc_array_get_uint64(array, index));
+
+	default:
+		d = rpc_array_get_double(array, index);
+		memcpy(&raw, &d, sizeof(raw));
+		return (raw);
+	}
+}
+
+static void
+object_test_packed_set(rpc_object_t array, rpc_type_t type, size_t index,
+    int64_t raw)
+{
+	double d;
+
+	switch (type) {
+	case RPC_TYPE_INT64:
+		rpc_array_set_int64(array, index, raw);
+		break;
+
+	case RPC_TYPE_UINT64:
+		rpc_array_set_uint64(array, index, (uint64_t)raw);
+		break;
+
+	default:
+		memcpy(&d, &raw, sizeof(d));
+		rpc_array_set_double(array, index, d);
+		break;
+	}
+}
+
+/* Returns the buffer of a packed array, checking the other accessors */
+static void *
+object_test_packed_ptr(rpc_object_t array, rpc_type_t type)
+{
+	void *ptrs[3];
+
+	ptrs[0] = rpc_array_get_int64_ptr(array);
+	ptrs[1] = rpc_array_get_uint64_ptr(array);
+	ptrs[2] = rpc_array_get_double_ptr(array);
+	g_assert(ptrs[0] == NULL || type == RPC_TYPE_INT64);
+	g_assert(ptrs[1] == NULL || type == RPC_TYPE_UINT64);
+	g_assert(ptrs[2] == NULL || type == RPC_TYPE_DOUBLE);
+
+	switch (type) {
+	case RPC_TYPE_INT64:
+		return (ptrs[0]);
+
+	case RPC_TYPE_UINT64:
+		return (ptrs[1]);
+
+	default:
+		return (ptrs[2]);
+	}
+}
+
+static void
+object_test_packed(gconstpointer user_data)
+{
+	rpc_type_t type = (rpc_type_t)GPOINTER_TO_INT(user_data);
+	int64_t values[PACKED_COUNT];
+	rpc_object_t array;
+	rpc_object_t boxed;
+	rpc_object_t copy;
+	rpc_object_t loaded;
+	void *ptr;
+	__block size_t next;
+	void *frame;
+	size_t size;
+	double d;
+	size_t i;
+
+	for (i = 0; i < PACKED_COUNT; i++) {
+		switch (type) {
+		case RPC_TYPE_INT64:
+			values[i] = ((int64_t)i - PACKED_COUNT / 2) * 1000003;
+			break;
+
+		case RPC_TYPE_UINT64:
+			values[i] = (int64_t)(UINT64_MAX - i * 1000003);
+			break;
+
+		default:
+			d = (double)i * 0.25 - 3.0;
+			memcpy(&values[i], &d, sizeof(d));
+			break;
+		}
+	}
+
+	g_assert_null(rpc_array_create_typed(RPC_TYPE_STRING, NULL, 1));
+
+	array = rpc_array_create_typed(type, values, PACKED_COUNT);
+	g_assert_nonnull(array);
+	g_assert_cmpint(rpc_get_type(array), ==, RPC_TYPE_ARRAY);
+	g_assert_cmpint(rpc_array_get_packed_type(array), ==, type);
+	g_assert_cmpuint(rpc_array_get_count(array), ==, PACKED_COUNT);
+	ptr = object_test_packed_ptr(array, type);
+	g_assert_nonnull(ptr);
+	g_assert_cmpmem(ptr, sizeof(values), values, sizeof(values));
+
+	for (i = 0; i < PACKED_COUNT; i++) {
+		g_assert_cmpint(object_test_packed_get(array, type, i), ==,
+		    values[i]);
+	}
+
+	/* Setters of the same type write in place and append at the end */
+	object_test_packed_set(array, type, 0, values[PACKED_COUNT - 1]);
+	object_test_packed_set(array, type, PACKED_COUNT, values[0]);
+	rpc_array_remove_index(array, 0);
+	g_assert_cmpint(rpc_array_get_packed_type(array), ==, type);
+	g_assert_cmpuint(rpc_array_get_count(array), ==, PACKED_COUNT);
+	ptr = object_test_packed_ptr(array, type);
+	g_assert_cmpmem(ptr, sizeof(values) - sizeof(values[0]), &values[1],
+	    sizeof(values) - sizeof(values[0]));
+	g_assert_cmpint(object_test_packed_get(array, type, PACKED_COUNT - 1),
+	    ==, values[0]);
+	rpc_release(array);
+
+	array = rpc_array_create_typed(type, values, PACKED_COUNT);
+
+	next = 0;
+	g_assert_false(rpc_array_apply(array, ^(size_t idx, rpc_object_t v) {
+		g_assert_cmpuint(idx, ==, next);
+		g_assert_cmpint(rpc_get_type(v), ==, type);
+		next++;
+		return ((bool)true);
+	}));
+
+	g_assert_cmpuint(next, ==, PACKED_COUNT);
+	g_assert_cmpint(rpc_array_get_packed_type(array), ==, type);
+
+	/* The same values stored one object each compare equal */
+	boxed = rpc_array_create();
+	for (i = 0; i < PACKED_COUNT; i++)
+		object_test_packed_set(boxed, type, i, values[i]);
+
+	g_assert_cmpint(rpc_array_get_packed_type(boxed), ==, RPC_TYPE_NULL);
+	g_assert_true(rpc_equal(array, boxed));
+	g_assert_true(rpc_equal(boxed, array));
+
+	/* A copy has its own buffer */
+	copy = rpc_copy(array);
+	g_assert_cmpint(rpc_array_get_packed_type(copy), ==, type);
+	g_assert_true(rpc_equal(copy, array));
+	g_assert_true(object_test_packed_ptr(copy, type) !=
+	    object_test_packed_ptr(array, type));
+	object_test_packed_set(copy, type, 1, values[0]);
+	g_assert_cmpint(rpc_array_get_packed_type(copy), ==, type);
+	g_assert_false(rpc_equal(copy, array));
+	g_assert_cmpint(object_test_packed_get(array, type, 1), ==, values[1]);
+
+	/* A value of another type turns the copy into an ordinary array */
+	rpc_array_set_string(copy, 2, "two");
+	g_assert_cmpint(rpc_array_get_packed_type(copy), ==, RPC_TYPE_NULL);
+	g_assert_null(object_test_packed_ptr(copy, type));
+	g_assert_cmpuint(rpc_array_get_count(copy), ==, PACKED_COUNT);
+	g_assert_cmpstr(rpc_array_get_string(copy, 2), ==, "two");
+	g_assert_cmpint(object_test_packed_get(copy, type, 3), ==, values[3]);
+	rpc_release(copy);
+
+	/* Long arrays of one number type come back packed */
+	g_assert_cmpint(rpc_serializer_dump("msgpack", array, &frame, &size),
+	    ==, 0);
+	loaded = rpc_serializer_load("msgpack", frame, size);
+	g_assert_nonnull(loaded);
+	g_assert_cmpint(rpc_array_get_packed_type(loaded), ==, type);
+	g_assert_true(rpc_equal(loaded, array));
+	g_free(frame);
+
+	g_assert_cmpint(rpc_serializer_dump("msgpack", boxed, &frame, &size),
+	    ==, 0);
+	rpc_release(loaded);
+	loaded = rpc_serializer_load("msgpack", frame, size);
+	g_assert_nonnull(loaded);
+	g_assert_cmpint(rpc_array_get_packed_type(loaded), ==, type);
+	g_assert_true(rpc_equal(loaded, boxed));
+	g_free(frame);
+
+	/* Borrowing an element object converts the array for good */
+	g_assert_cmpint(rpc_get_type(rpc_array_get_value(array, 5)), ==, type);
+	g_assert_cmpint(rpc_array_get_packed_type(array), ==, RPC_TYPE_NULL);
+	g_assert_null(object_test_packed_ptr(array, type));
+	g_assert_true(rpc_equal(array, loaded));
+
+	rpc_release(loaded);
+	rpc_release(boxed);
+	rpc_release(array);
+
+	array = rpc_array_create_typed(type, NULL, 4);
+	g_assert_cmpuint(rpc_array_get_count(array), ==, 4);
+	g_assert_cmpint(rpc_array_get_packed_type(array), ==, type);
+	for (i = 0; i < 4; i++)
+		g_assert_cmpint(object_test_packed_get(array, type, i), ==, 0);
+
+	rpc_release(array);
+}
+
+/* Builds the same tree every time, mixing scalar and nested tables */
+static rpc_object_t
+object_test_cow_tree(void)
+{
+	rpc_object_t tree;
+	rpc_object_t flat;
+	rpc_object_t list;
+	rpc_object_t sub;
+	rpc_object_t inner;
+
+	flat = rpc_dictionary_create();
+	rpc_dictionary_set_int64(flat, "x", 1);
+	rpc_dictionary_set_int64(flat, "y", 2);
+
+	list = rpc_array_create();
+	rpc_array_set_int64(list, 0, 1);
+	rpc_array_set_string(list, 1, "two");
+	rpc_array_set_double(list, 2, 3.0);
+
+	inner = rpc_array_create();
+	rpc_array_set_bool(inner, 0, true);
+	rpc_array_set_string(inner, 1, "inner");
+
+	sub = rpc_dictionary_create();
+	rpc_dictionary_set_string(sub, "k", "v");
+	rpc_dictionary_steal_value(sub, "inner", inner);
+
+	tree = rpc_dictionary_create();
+	rpc_dictionary_set_int64(tree, "a", 1);
+	rpc_dictionary_set_string(tree, "s", "string");
+	rpc_dictionary_steal_value(tree, "flat", flat);
+	rpc_dictionary_steal_value(tree, "list", list);
+	rpc_dictionary_steal_value(tree, "sub", sub);
+	return (tree);
+}
+
+/* Writes to every level of a tree built by object_test_cow_tree() */
+static void
+object_test_cow_mutate(rpc_object_t tree)
+{
+	rpc_object_t sub;
+
+	rpc_dictionary_set_int64(tree, "a", 2);
+	rpc_dictionary_remove_key(tree, "s");
+	rpc_dictionary_set_int64(rpc_dictionary_get_value(tree, "flat"), "x",
+	    100);
+	rpc_dictionary_remove_key(rpc_dictionary_get_value(tree, "flat"), "y");
+	rpc_array_set_int64(rpc_dictionary_get_value(tree, "list"), 0, 10);
+	rpc_array_append_stolen_value(rpc_dictionary_get_value(tree, "list"),
+	    rpc_string_create("four"));
+
+	sub = rpc_dictionary_get_value(tree, "sub");
+	rpc_dictionary_set_string(sub, "k", "changed");
+	rpc_array_set_bool(rpc_dictionary_get_value(sub, "inner"), 0, false);
+	rpc_array_remove_index(rpc_dictionary_get_value(sub, "inner"), 1);
+}
+
+static gpointer
+object_test_cow_thread(gpointer data)
+{
+	rpc_object_t tree = data;
+	rpc_object_t copy;
+	guint i;
+
+	for (i = 0; i < COW_ROUNDS; i++) {
+		copy = rpc_copy(tree);
+		g_assert_true(rpc_equal(copy, tree));
+		object_test_cow_mutate(copy);
+		g_assert_false(rpc_equal(copy, tree));
+		rpc_release(copy);
+	}
+
+	return (NULL);
+}
+
+static void
+object_test_cow(void)
+{
+	GThread *threads[COW_THREADS];
+	rpc_object_t snapshot;
+	rpc_object_t mutated;
+	rpc_object_t tree;
+	rpc_object_t copy;
+	rpc_object_t second;
+	rpc_object_t list;
+	guint i;
+
+	snapshot = object_test_cow_tree();
+	mutated = object_test_cow_tree();
+	object_test_cow_mutate(mutated);
+	g_assert_false(rpc_equal(snapshot, mutated));
+
+	/* Writes to a copy stay out of the original */
+	tree = object_test_cow_tree();
+	copy = rpc_copy(tree);
+	g_assert_true(rpc_equal(copy, tree));
+	object_test_cow_mutate(copy);
+	g_assert_true(rpc_equal(copy, mutated));
+	g_assert_true(rpc_equal(tree, snapshot));
+	rpc_release(copy);
+
+	/* And writes to the original stay out of the copies */
+	copy = rpc_copy(tree);
+	second = rpc_copy(copy);
+	object_test_cow_mutate(tree);
+	g_assert_true(rpc_equal(tree, mutated));
+	g_assert_true(rpc_equal(copy, snapshot));
+	rpc_release(copy);
+	g_assert_true(rpc_equal(second, snapshot));
+	object_test_cow_mutate(second);
+	g_assert_true(rpc_equal(second, mutated));
+	rpc_release(second);
+	rpc_release(tree);
+
+	/* Wholesale writes on tables of scalars */
+	tree = object_test_cow_tree();
+	list = rpc_dictionary_get_value(tree, "list");
+	copy = rpc_copy(list);
+	rpc_array_sort(copy, ^(rpc_object_t o1, rpc_object_t o2) {
+		return ((int)rpc_get_type(o2) - (int)rpc_get_type(o1));
+	});
+	g_assert_cmpstr(rpc_array_get_string(copy, 0), ==, "two");
+	rpc_array_remove_all(copy);
+	g_assert_cmpuint(rpc_array_get_count(copy), ==, 0);
+	rpc_release(copy);
+
+	copy = rpc_copy(rpc_dictionary_get_value(tree, "flat"));
+	rpc_dictionary_remove_all(copy);
+	g_assert_cmpuint(rpc_dictionary_get_count(copy), ==, 0);
+	rpc_release(copy);
+	g_assert_true(rpc_equal(tree, snapshot));
+
+	/* Threads copying and writing while the original is only read */
+	for (i = 0; i < COW_THREADS; i++) {
+		threads[i] = g_thread_new("cow", object_test_cow_thread,
+		    tree);
+	}
+
+	for (i = 0; i < COW_THREADS; i++)
+		g_thread_join(threads[i]);
+
+	g_assert_true(rpc_equal(tree, snapshot));
+
+	rpc_release(tree);
+	rpc_release(mutated);
+	rpc_release(snapshot);
+}
+
 static void
 object_test_register()
 {
 
+	g_test_add_func("/object/slab/threads", object_test_slab);
+	g_test_add_func("/object/string/inline", object_test_inline_strings);
+	g_test_add_data_func("/object/dictionary/small", GUINT_TO_POINTER(5),
+	    object_test_dict);
+	g_test_add_data_func("/object/dictionary/large",
+	    GUINT_TO_POINTER(DICT_KEYS), object_test_dict);
+	g_test_add_func("/object/copy/isolation", object_test_cow);
+	g_test_add_data_func("/object/array/packed/int64",
+	    GINT_TO_POINTER(RPC_TYPE_INT64), object_test_packed);
+	g_test_add_data_func("/object/array/packed/uint64",
+	    GINT_TO_POINTER(RPC_TYPE_UINT64), object_test_packed);
+	g_test_add_data_func("/object/array/packed/double",
+	    GINT_TO_POINTER(RPC_TYPE_DOUBLE), object_test_packed);
 }
 
 static struct librpc_test object = {
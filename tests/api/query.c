@@ -28,7 +28,13 @@
 #include "../tests.h"
 #include "../../src/linker_set.h"
 #include <glib.h>
+#include <inttypes.h>
+#include <rpc/object.h>
+#include <rpc/query.h>
 
+#define	QUERY_ITEMS	200
+#define	QUERY_THREADS	4
+#define	QUERY_ROUNDS	100
 
 typedef struct {
 
@@ -52,10 +58,305 @@ query_test_tear_down(query_fixture *fixture, gconstpointer user_data)
 
 }
 
+struct query_thread
+{
+	rpc_object_t		data;
+	rpc_query_plan_t	plan;
+	guint			expected;
+};
+
+static rpc_object_t
+query_test_data(void)
+{
+	rpc_object_t data;
+	char *name;
+	char *tag;
+	int64_t i;
+
+	data = rpc_array_create();
+	for (i = 0; i < QUERY_ITEMS; i++) {
+		name = g_strdup_printf("name%" PRId64, i);
+		tag = g_strdup_printf("t%" PRId64, i % 3);
+		rpc_array_append_stolen_value(data, rpc_object_pack(
+		    "{id:i,name:s,group:i,nested:{v:i},tags:[s,s]}", i, name,
+		    i % 7, i % 10, tag, "all"));
+		g_free(name);
+		g_free(tag);
+	}
+
+	return (data);
+}
+
+/* Returns rule set @p index, compiled or run as is by the tests */
+static rpc_object_t
+query_test_rules(guint index)
+{
+	rpc_object_t rule;
+
+	switch (index) {
+	case 0:
+		return (rpc_object_pack("[[s,s,i],[s,s,i]]", "id", ">=",
+		    (int64_t)50, "id", "<", (int64_t)60));
+
+	case 1:
+		return (rpc_object_pack("[[s,[[s,s,i],[s,s,i]]]]", "or",
+		    "group", "=", (int64_t)3, "nested.v", "=", (int64_t)0));
+
+	case 2:
+		return (rpc_object_pack("[[s,s,s]]", "name", "~",
+		    "^name1[0-9]$"));
+
+	case 3:
+		return (rpc_object_pack("[[s,s,[s,s]]]", "tags.0", "in", "t1",
+		    "t2"));
+
+	case 4:
+		return (rpc_object_pack("[[s,[[s,s,i],[s,s,i]]]]", "nor",
+		    "group", "=", (int64_t)0, "id", "<=", (int64_t)100));
+
+	case 5:
+		return (rpc_object_pack("[[s,s,s]]", "name", "match",
+		    "name?5"));
+
+	case 6:
+		/* An empty logic list never matches */
+		rule = rpc_array_create();
+		rpc_array_append_stolen_value(rule, rpc_string_create("and"));
+		rpc_array_append_stolen_value(rule, rpc_array_create());
+		return (rpc_array_create_ex(&rule, 1, true));
+
+	case 7:
+		/* Neither does an invalid pattern or a malformed rule */
+		return (rpc_object_pack("[[s,s,s],[s,s]]", "name", "~", "(",
+		    "id", ">"));
+
+	default:
+		/* And an empty rule list matches everything */
+		return (rpc_array_create());
+	}
+}
+
+#define	QUERY_RULES	9
+
+static bool
+query_test_expected(guint index, int64_t id)
+{
+
+	switch (index) {
+	case 0:
+		return (id >= 50 && id < 60);
+
+	case 1:
+		return (id % 7 == 3 || id % 10 == 0);
+
+	case 2:
+		return (id >= 10 && id <= 19);
+
+	case 3:
+		return (id % 3 != 0);
+
+	case 4:
+		return (id % 7 != 0 && id > 100);
+
+	case 5:
+		return (id >= 15 && id <= 95 && id % 10 == 5);
+
+	case 6:
+	case 7:
+		return (false);
+
+	default:
+		return (true);
+	}
+}
+
+/* Drains @p iter into an array of ids */
+static GArray *
+query_test_collect(rpc_query_iter_t iter)
+{
+	rpc_object_t chunk;
+	GArray *ids;
+	int64_t id;
+	bool more;
+
+	g_assert_nonnull(iter);
+	ids = g_array_new(false, false, sizeof(int64_t));
+	do {
+		more = rpc_query_next(iter, &chunk);
+		if (chunk == NULL)
+			break;
+
+		id = rpc_dictionary_get_int64(chunk, "id");
+		g_array_append_val(ids, id);
+		rpc_release(chunk);
+	} while (more);
+
+	rpc_query_iter_free(iter);
+	return (ids);
+}
+
+static void
+query_test_cmp_ids(GArray *a, GArray *b)
+{
+
+	g_assert_cmpmem(a->data, a->len * sizeof(int64_t), b->data,
+	    b->len * sizeof(int64_t));
+}
+
+static void
+query_test_plan(gconstpointer user_data)
+{
+	guint index = GPOINTER_TO_UINT(user_data);
+	struct rpc_query_params params = { 0 };
+	rpc_query_plan_t plan;
+	rpc_object_t data;
+	rpc_object_t rules;
+	rpc_object_t item;
+	GArray *expected;
+	GArray *direct;
+	GArray *ids;
+	int64_t id;
+	guint i;
+
+	data = query_test_data();
+	rules = query_test_rules(index);
+	expected = g_array_new(false, false, sizeof(int64_t));
+	for (id = 0; id < QUERY_ITEMS; id++) {
+		if (query_test_expected(index, id))
+			g_array_append_val(expected, id);
+	}
+
+	direct = query_test_collect(rpc_query(data, NULL, rules));
+	query_test_cmp_ids(direct, expected);
+
+	/* The plan keeps nothing of the rules object */
+	plan = rpc_query_compile(rules);
+	rpc_release(rules);
+
+	/* The same plan, run repeatedly and element by element */
+	for (i = 0; i < 3; i++) {
+		ids = query_test_collect(rpc_query_plan_run(data, NULL, plan));
+		query_test_cmp_ids(ids, expected);
+		g_array_free(ids, true);
+	}
+
+	for (id = 0; id < QUERY_ITEMS; id++) {
+		item = rpc_array_get_value(data, (size_t)id);
+		if (query_test_expected(index, id)) {
+			g_assert_true(rpc_query_plan_apply(item, plan) == item);
+			rpc_release(item);
+		} else
+			g_assert_null(rpc_query_plan_apply(item, plan));
+	}
+
+	/* Params stay per run */
+	params.reverse = true;
+	ids = query_test_collect(rpc_query_plan_run(data, &params, plan));
+	g_assert_cmpuint(ids->len, ==, expected->len);
+	for (i = 0; i < ids->len; i++) {
+		g_assert_cmpint(g_array_index(ids, int64_t, i), ==,
+		    g_array_index(expected, int64_t, expected->len - i - 1));
+	}
+
+	g_array_free(ids, true);
+	params.reverse = false;
+	params.offset = 2;
+	params.limit = 3;
+	ids = query_test_collect(rpc_query_plan_run(data, &params, plan));
+	g_assert_cmpuint(ids->len, ==, MIN(3, MAX(expected->len, 2) - 2));
+	for (i = 0; i < ids->len; i++) {
+		g_assert_cmpint(g_array_index(ids, int64_t, i), ==,
+		    g_array_index(expected, int64_t, i + 2));
+	}
+
+	g_array_free(ids, true);
+	rpc_query_plan_free(plan);
+	g_array_free(direct, true);
+	g_array_free(expected, true);
+	rpc_release(data);
+}
+
+static gpointer
+query_test_plan_thread(gpointer data)
+{
+	struct query_thread *thread = data;
+	GArray *ids;
+	guint i;
+
+	for (i = 0; i < QUERY_ROUNDS; i++) {
+		ids = query_test_collect(rpc_query_plan_run(thread->data, NULL,
+		    thread->plan));
+		g_assert_cmpuint(ids->len, ==, thread->expected);
+		g_array_free(ids, true);
+	}
+
+	return (NULL);
+}
+
+static void
+query_test_plan_shared(void)
+{
+	struct query_thread thread;
+	GThread *threads[QUERY_THREADS];
+	rpc_query_iter_t iter;
+	rpc_object_t rules;
+	rpc_object_t other;
+	GArray *ids;
+	int64_t id;
+	guint i;
+
+	thread.data = query_test_data();
+	rules = query_test_rules(1);
+	thread.plan = rpc_query_compile(rules);
+	rpc_release(rules);
+
+	thread.expected = 0;
+	for (id = 0; id < QUERY_ITEMS; id++) {
+		if (query_test_expected(1, id))
+			thread.expected++;
+	}
+
+	/* One plan, evaluated by several threads at once */
+	for (i = 0; i < QUERY_THREADS; i++) {
+		threads[i] = g_thread_new("query", query_test_plan_thread,
+		    &thread);
+	}
+
+	for (i = 0; i < QUERY_THREADS; i++)
+		g_thread_join(threads[i]);
+
+	/* Over another array, outliving the caller's reference */
+	other = rpc_array_create();
+	for (id = 0; id < 10; id++) {
+		rpc_array_append_stolen_value(other, rpc_object_pack(
+		    "{id:i,group:i,nested:{v:i}}", id, (int64_t)3,
+		    (int64_t)1));
+	}
+
+	iter = rpc_query_plan_run(other, NULL, thread.plan);
+	rpc_query_plan_free(thread.plan);
+	ids = query_test_collect(iter);
+	g_assert_cmpuint(ids->len, ==, 10);
+
+	g_array_free(ids, true);
+	rpc_release(other);
+	rpc_release(thread.data);
+}
+
 static void
 query_test_register()
 {
+	guint i;
+	char *name;
+
+	for (i = 0; i < QUERY_RULES; i++) {
+		name = g_strdup_printf("/query/plan/rules/%u", i);
+		g_test_add_data_func(name, GUINT_TO_POINTER(i),
+		    query_test_plan);
+		g_free(name);
+	}
 
+	g_test_add_func("/query/plan/shared", query_test_plan_shared);
 }
 
 static struct librpc_test query = {
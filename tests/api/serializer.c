@@ -30,14 +30,26 @@
 #include <rpc/object.h>
 #include <rpc/serializer.h>
 #include "../../src/linker_set.h"
+#include "../../src/internal.h"
+#include "../../src/slab.h"
 #include "../tests.h"
 
+#define	ARENA_ITEMS	2000
+#define	ARENA_KEEP	97
+#define	ARENA_THREADS	4
+
 struct serializer_fixture
 {
 	rpc_object_t	object;
 	const char *	type;
 };
 
+struct serializer_frame
+{
+	void *		buf;
+	size_t		size;
+};
+
 static void
 serializer_test(struct serializer_fixture *fixture, gconstpointer user_data)
 {
@@ -132,6 +144,164 @@ serializer_test_shmem_set_up(struct serializer_fixture *fixture,
 }
 #endif
 
+static void
+serializer_test_canonical(void)
+{
+	rpc_object_t a;
+	rpc_object_t b;
+	void *buf_a;
+	void *buf_b;
+	size_t len_a;
+	size_t len_b;
+	char key[16];
+	int i;
+
+	a = rpc_dictionary_create();
+	b = rpc_dictionary_create();
+
+	for (i = 0; i < 64; i++) {
+		g_snprintf(key, sizeof(key), "key%d", i);
+		rpc_dictionary_set_int64(a, key, i - 32);
+		g_snprintf(key, sizeof(key), "key%d", 63 - i);
+		rpc_dictionary_set_int64(b, key, 31 - i);
+	}
+
+	g_assert(rpc_serializer_dump("msgpack-canonical", a, &buf_a,
+	    &len_a) == 0);
+	g_assert(rpc_serializer_dump("msgpack-canonical", b, &buf_b,
+	    &len_b) == 0);
+	g_assert_cmpmem(buf_a, len_a, buf_b, len_b);
+
+	g_free(buf_a);
+	g_free(buf_b);
+	rpc_release(a);
+	rpc_release(b);
+}
+
+/* Builds an array of @p count dictionaries, with short and long names */
+static rpc_object_t
+serializer_arena_source(int count)
+{
+	rpc_object_t result;
+	rpc_object_t item;
+	char *name;
+	int i;
+
+	result = rpc_array_create();
+	for (i = 0; i < count; i++) {
+		name = i % 2 == 0 ? g_strdup_printf("item%d", i) :
+		    g_strdup_printf("item %d, with a name too long to be stored "
+		    "inline in the string object", i);
+
+		item = rpc_dictionary_create();
+		rpc_dictionary_set_int64(item, "index", i);
+		rpc_dictionary_set_string(item, "name", name);
+		rpc_dictionary_set_bool(item, "odd", i % 2 != 0);
+		rpc_array_append_stolen_value(result, item);
+		g_free(name);
+	}
+
+	return (result);
+}
+
+static gpointer
+serializer_arena_thread(gpointer data)
+{
+	struct serializer_frame *frame = data;
+
+	return (rpc_serializer_load("msgpack", frame->buf, frame->size));
+}
+
+static void
+serializer_test_arena(void)
+{
+	struct serializer_frame frame;
+	rpc_object_t keep[ARENA_ITEMS / ARENA_KEEP + 1];
+	rpc_object_t source;
+	rpc_object_t loaded;
+	rpc_object_t small;
+	rpc_object_t item;
+	GThread *threads[ARENA_THREADS];
+	void *buf;
+	size_t size;
+	guint nkeep;
+	guint i;
+
+	source = serializer_arena_source(ARENA_ITEMS);
+	g_assert(rpc_serializer_dump("msgpack", source, &frame.buf,
+	    &frame.size) == 0);
+	g_assert_cmpuint(frame.size, >=, RPC_ARENA_MIN_FRAME);
+
+	loaded = rpc_serializer_load("msgpack", frame.buf, frame.size);
+	g_assert_nonnull(loaded);
+	g_assert_nonnull(loaded->ro_arena);
+	g_assert_true(rpc_equal(loaded, source));
+
+	/* Keep a few items, and a name, past the rest of their frame */
+	nkeep = 0;
+	for (i = 0; i < ARENA_ITEMS; i += ARENA_KEEP) {
+		item = rpc_array_get_value(loaded, i);
+		g_assert_nonnull(item->ro_arena);
+		keep[nkeep++] = rpc_retain(item);
+	}
+
+	item = rpc_dictionary_get_value(rpc_array_get_value(loaded, 1), "name");
+	rpc_retain(item);
+	rpc_release(loaded);
+
+	/* Churn through fresh frames to reuse whatever was freed */
+	for (i = 0; i < 8; i++) {
+		loaded = rpc_serializer_load("msgpack", frame.buf, frame.size);
+		g_assert_nonnull(loaded);
+		rpc_release(loaded);
+	}
+
+	for (i = 0; i < nkeep; i++) {
+		g_assert_true(rpc_equal(keep[i],
+		    rpc_array_get_value(source, i * ARENA_KEEP)));
+
+		/* Whatever gets added later comes from the object slab */
+		rpc_dictionary_set_string(keep[i], "added", "later");
+		g_assert_null(rpc_dictionary_get_value(keep[i],
+		    "added")->ro_arena);
+		g_assert_cmpstr(rpc_dictionary_get_string(keep[i], "added"),
+		    ==, "later");
+		rpc_release(keep[i]);
+	}
+
+	g_assert_cmpstr(rpc_string_get_string_ptr(item), ==,
+	    rpc_dictionary_get_string(rpc_array_get_value(source, 1), "name"));
+	rpc_release(item);
+
+	/* Frames decoded on other threads, released on this one */
+	for (i = 0; i < ARENA_THREADS; i++) {
+		threads[i] = g_thread_new("arena", serializer_arena_thread,
+		    &frame);
+	}
+
+	for (i = 0; i < ARENA_THREADS; i++) {
+		loaded = g_thread_join(threads[i]);
+		g_assert_nonnull(loaded);
+		g_assert_true(rpc_equal(loaded, source));
+		rpc_release(loaded);
+	}
+
+	/* Small frames don't open an arena */
+	small = serializer_arena_source(1);
+	g_assert(rpc_serializer_dump("msgpack", small, &buf, &size) == 0);
+	g_assert_cmpuint(size, <, RPC_ARENA_MIN_FRAME);
+	loaded = rpc_serializer_load("msgpack", buf, size);
+	g_assert_nonnull(loaded);
+	g_assert_null(loaded->ro_arena);
+	g_assert_true(rpc_equal(loaded, small));
+
+	g_free(buf);
+	g_free(frame.buf);
+	rpc_release(loaded);
+	rpc_release(small);
+	rpc_release(source);
+}
+
 static void
 serializer_test_tear_down(struct serializer_fixture *fixture,
     gconstpointer user_data)
@@ -163,6 +333,22 @@ serializer_test_register()
 	g_test_add("/serializer/msgpack/single", struct serializer_fixture,
 	    "msgpack", serializer_test_single_set_up, serializer_test,
 	    serializer_test_tear_down);
+	g_test_add_func("/serializer/msgpack/arena", serializer_test_arena);
+
+	g_test_add("/serializer/msgpack-canonical/dict",
+	    struct serializer_fixture, "msgpack-canonical",
+	    serializer_test_dict_set_up, serializer_test,
+	    serializer_test_tear_down);
+	g_test_add("/serializer/msgpack-canonical/array",
+	    struct serializer_fixture, "msgpack-canonical",
+	    serializer_test_array_set_up, serializer_test,
+	    serializer_test_tear_down);
+	g_test_add("/serializer/msgpack-canonical/single",
+	    struct serializer_fixture, "msgpack-canonical",
+	    serializer_test_single_set_up, serializer_test,
+	    serializer_test_tear_down);
+	g_test_add_func("/serializer/msgpack-canonical/deterministic",
+	    serializer_test_canonical);
 
 	g_test_add("/serializer/yaml/dict", struct serializer_fixture,
 	    "yaml", serializer_test_dict_set_up, serializer_test,
@@ -174,6 +360,16 @@ serializer_test_register()
 	    "yaml", serializer_test_single_set_up, serializer_test,
 	    serializer_test_tear_down);
 
+	g_test_add("/serializer/flat/dict", struct serializer_fixture,
+	    "flat", serializer_test_dict_set_up, serializer_test,
+	    serializer_test_tear_down);
+	g_test_add("/serializer/flat/array", struct serializer_fixture,
+	    "flat", serializer_test_array_set_up, serializer_test,
+	    serializer_test_tear_down);
+	g_test_add("/serializer/flat/single", struct serializer_fixture,
+	    "flat", serializer_test_single_set_up, serializer_test,
+	    serializer_test_tear_down);
+
 #if defined(__linux__)
 	g_test_add("/serializer/json/shmem", struct serializer_fixture,
 	    "json", serializer_test_shmem_set_up, serializer_test,
@@ -40,6 +40,12 @@
 
 #define THREADS 50
 #define STREAMS 50
+#define FRAGMENTS 100
+#define ORDERED_CALLS 200
+#define LOAD_THREADS 8
+#define LOAD_CALLS 200
+#define LOAD_PAUSES 10
+#define SESSION_EVENTS 20
 
 struct b {
 	char *	path;
@@ -102,6 +108,15 @@ typedef struct {
 	int		close;
 	int		abort;
 	bool		kill;
+	guint		limit;
+	GMutex		mtx;
+	GArray *	order;
+	volatile gint	inflight;
+	volatile gint	max_inflight;
+	rpc_object_t	params;
+	rpc_connection_t peer;
+	volatile int	disconnects;
+	volatile int	lost;
 } server_fixture;
 
 static void
@@ -227,6 +242,151 @@ server_test_stream_setup(server_fixture *fix, gconstpointer u_data)
 
 }
 
+static void
+server_test_dispatch_set_up(server_fixture *fixture, gconstpointer u_data)
+{
+	int res;
+
+	base = args[0];
+	valid_server_set_up(fixture, u_data);
+	res = rpc_context_set_dispatch_workers(fixture->ctx, 1, false);
+	g_assert_cmpint(res, ==, 0);
+
+	res = rpc_context_register_block(fixture->ctx, base.interface, "count",
+	    NULL, ^rpc_object_t (void *cookie, rpc_object_t args __unused) {
+		int64_t i;
+
+		rpc_function_start_stream(cookie);
+		for (i = 0; i < FRAGMENTS; i++) {
+			if (rpc_function_yield(cookie,
+			    rpc_int64_create(i)) != 0)
+				break;
+		}
+
+		rpc_function_end(cookie);
+		return (RPC_FUNCTION_STILL_RUNNING);
+	    });
+	g_assert(res == 0);
+}
+
+static void
+ordered_set_up(server_fixture *fixture, gconstpointer u_data, guint limit)
+{
+	int res;
+
+	base = args[0];
+	valid_server_set_up(fixture, u_data);
+	rpc_context_set_dispatch_workers(fixture->ctx, 8, false);
+	rpc_context_set_dispatch_limit(fixture->ctx, limit);
+	fixture->limit = limit;
+	fixture->order = g_array_new(false, false, sizeof(int64_t));
+	g_mutex_init(&fixture->mtx);
+
+	res = rpc_context_register_block(fixture->ctx, base.interface, "seq",
+	    NULL, ^rpc_object_t (void *cookie __unused, rpc_object_t args) {
+		int64_t seq = rpc_array_get_int64(args, 0);
+		gint now;
+		gint max;
+
+		now = g_atomic_int_add(&fixture->inflight, 1) + 1;
+		do {
+			max = g_atomic_int_get(&fixture->max_inflight);
+		} while (now > max && !g_atomic_int_compare_and_exchange(
+		    &fixture->max_inflight, max, now));
+
+		g_mutex_lock(&fixture->mtx);
+		g_array_append_val(fixture->order, seq);
+		g_mutex_unlock(&fixture->mtx);
+
+		g_usleep(200);
+		g_atomic_int_add(&fixture->inflight, -1);
+		return (rpc_int64_create(seq));
+	    });
+	g_assert(res == 0);
+}
+
+static void
+server_test_ordered_serial_set_up(server_fixture *fixture,
+    gconstpointer u_data)
+{
+
+	ordered_set_up(fixture, u_data, 1);
+}
+
+static void
+server_test_ordered_window_set_up(server_fixture *fixture,
+    gconstpointer u_data)
+{
+
+	ordered_set_up(fixture, u_data, 3);
+}
+
+static void
+session_set_up(server_fixture *fixture, gconstpointer u_data, uint64_t grace)
+{
+	int res;
+
+	base = args[0];
+	fixture->ctx = rpc_context_create();
+	fixture->iuri = (int)u_data;
+	fixture->iclose = 0;
+	fixture->order = g_array_new(false, false, sizeof(int64_t));
+	g_mutex_init(&fixture->mtx);
+
+	res = rpc_context_register_block(fixture->ctx, base.interface, "tick",
+	    NULL, ^rpc_object_t (void *cookie __unused, rpc_object_t args) {
+		rpc_object_t tick;
+		int64_t i;
+
+		for (i = rpc_array_get_int64(args, 0);
+		    i < rpc_array_get_int64(args, 1); i++) {
+			tick = rpc_int64_create(i);
+			rpc_server_broadcast_event(fixture->srv, NULL, NULL,
+			    "session.tick", tick);
+			rpc_release(tick);
+		}
+
+		return (rpc_null_create());
+	    });
+	g_assert(res == 0);
+
+	/* Hands the server end of the caller's connection to the test */
+	res = rpc_context_register_block(fixture->ctx, base.interface, "drop",
+	    NULL, ^rpc_object_t (void *cookie, rpc_object_t args __unused) {
+		fixture->peer = rpc_function_get_connection(cookie);
+		rpc_connection_retain(fixture->peer);
+		return (rpc_null_create());
+	    });
+	g_assert(res == 0);
+
+	/* The server only borrows its parameters */
+	fixture->params = rpc_object_pack("{u}", RPC_SERVER_SESSION_GRACE,
+	    grace);
+	fixture->srv = rpc_server_create_ex(uris[fixture->iuri].srv,
+	    fixture->ctx, fixture->params);
+	g_assert_nonnull(fixture->srv);
+	rpc_server_set_event_handler(fixture->srv,
+	    ^(rpc_connection_t conn __unused, rpc_server_event_t event) {
+		if (event == RPC_SERVER_CLIENT_DISCONNECT)
+			g_atomic_int_inc(&fixture->disconnects);
+	    });
+}
+
+static void
+server_test_session_set_up(server_fixture *fixture, gconstpointer u_data)
+{
+
+	session_set_up(fixture, u_data, 10000);
+}
+
+static void
+server_test_session_expire_set_up(server_fixture *fixture,
+    gconstpointer u_data)
+{
+
+	session_set_up(fixture, u_data, 100);
+}
+
 static void
 server_test_valid_server_set_up(server_fixture *fixture, gconstpointer u_data)
 {
@@ -269,6 +429,41 @@ server_test_stream_tear_down(server_fixture *fixture, gconstpointer user_data)
 	server_test_valid_server_tear_down(fixture, user_data);
 }
 
+static void
+server_test_dispatch_tear_down(server_fixture *fixture,
+    gconstpointer user_data)
+{
+
+	rpc_context_unregister_member(fixture->ctx, NULL, "count");
+	server_test_valid_server_tear_down(fixture, user_data);
+}
+
+static void
+server_test_ordered_tear_down(server_fixture *fixture,
+    gconstpointer user_data)
+{
+
+	rpc_context_unregister_member(fixture->ctx, NULL, "seq");
+	server_test_valid_server_tear_down(fixture, user_data);
+	g_array_free(fixture->order, true);
+	g_mutex_clear(&fixture->mtx);
+}
+
+static void
+server_test_session_tear_down(server_fixture *fixture,
+    gconstpointer user_data)
+{
+
+	rpc_server_close(fixture->srv);
+	server_wait(fixture->ctx, uris[fixture->iuri].srv);
+	rpc_context_unregister_member(fixture->ctx, NULL, "tick");
+	rpc_context_unregister_member(fixture->ctx, NULL, "drop");
+	rpc_context_free(fixture->ctx);
+	rpc_release(fixture->params);
+	g_array_free(fixture->order, true);
+	g_mutex_clear(&fixture->mtx);
+}
+
 static void
 server_test_basic_tear_down(server_fixture *fixture, gconstpointer user_data)
 {
@@ -614,6 +809,513 @@ server_test_nullables(server_fixture *fixture, gconstpointer user_data)
 	rpc_client_close(client);
 }
 
+static void
+server_test_call_slab(server_fixture *fixture, gconstpointer user_data)
+{
+	struct rpc_alloc_stats before;
+	struct rpc_alloc_stats after;
+	rpc_client_t client;
+	rpc_connection_t conn;
+	rpc_object_t result;
+	char *name;
+	char *expected;
+	int i;
+
+	rpc_server_resume(fixture->srv);
+	client = rpc_client_create(uris[fixture->iuri].cli, 0);
+	g_assert_nonnull(client);
+	conn = rpc_client_get_connection(client);
+
+	g_assert_cmpint(rpc_get_alloc_stats(RPC_ALLOC_CALL, &before), ==, 0);
+	for (i = 0; i < 1000; i++) {
+		name = g_strdup_printf("%d", i);
+		expected = g_strdup_printf("hello %d!", i);
+		result = rpc_connection_call_simple(conn, "hi", "[s]", name);
+		g_assert_nonnull(result);
+		g_assert(!rpc_is_error(result));
+		g_assert_cmpstr(rpc_string_get_string_ptr(result), ==,
+		    expected);
+		g_free(expected);
+		g_free(name);
+	}
+
+	rpc_client_close(client);
+	g_assert_cmpint(fixture->count, ==, 1000);
+
+	/* Both ends of every call come from the call cache */
+	g_assert_cmpint(rpc_get_alloc_stats(RPC_ALLOC_CALL, &after), ==, 0);
+	g_assert_cmpuint(after.ras_allocs, >, before.ras_allocs);
+}
+
+/*
+ * With a single worker, the stream handler sits on it waiting for
+ * credit while the client makes another call on the same connection
+ * before it takes the next fragment.
+ */
+static void
+server_test_dispatch_blocked(server_fixture *fixture,
+    gconstpointer user_data)
+{
+	rpc_client_t client;
+	rpc_connection_t conn;
+	rpc_object_t result;
+	rpc_call_t call;
+	int64_t n = 0;
+
+	rpc_server_resume(fixture->srv);
+	client = rpc_client_create(uris[fixture->iuri].cli, 0);
+	g_assert_nonnull(client);
+	conn = rpc_client_get_connection(client);
+
+	call = rpc_connection_call(conn, NULL, NULL, "count",
+	    rpc_array_create(), NULL);
+	g_assert_nonnull(call);
+
+	for (;;) {
+		rpc_call_wait(call);
+
+		switch (rpc_call_status(call)) {
+		case RPC_CALL_STREAM_START:
+			rpc_call_continue(call, false);
+			break;
+
+		case RPC_CALL_MORE_AVAILABLE:
+			result = rpc_call_result(call);
+			g_assert_cmpint(rpc_int64_get_value(result), ==, n);
+			if (n++ % 10 == 0) {
+				result = rpc_connection_call_simple(conn, "hi",
+				    "[s]", "world");
+				g_assert_nonnull(result);
+				g_assert_cmpstr(
+				    rpc_string_get_string_ptr(result), ==,
+				    "hello world!");
+			}
+
+			rpc_call_continue(call, false);
+			break;
+
+		case RPC_CALL_DONE:
+		case RPC_CALL_ENDED:
+			goto done;
+
+		default:
+			g_assert_not_reached();
+		}
+	}
+
+done:
+	g_assert_cmpint(n, ==, FRAGMENTS);
+	g_assert_cmpint(fixture->count, ==, FRAGMENTS / 10);
+	rpc_call_free(call);
+	rpc_client_close(client);
+}
+
+/*
+ * Fires all the calls at once and checks that the server never ran more
+ * than the limit of them together; with a limit of one they also have
+ * to run in the order they were sent.
+ */
+static void
+server_test_ordered(server_fixture *fixture, gconstpointer user_data)
+{
+	rpc_client_t client;
+	rpc_connection_t conn;
+	rpc_call_t calls[ORDERED_CALLS];
+	int64_t i;
+
+	rpc_server_resume(fixture->srv);
+	client = rpc_client_create(uris[fixture->iuri].cli, 0);
+	g_assert_nonnull(client);
+	conn = rpc_client_get_connection(client);
+
+	for (i = 0; i < ORDERED_CALLS; i++) {
+		calls[i] = rpc_connection_call(conn, NULL, NULL, "seq",
+		    rpc_object_pack("[i]", i), NULL);
+		g_assert_nonnull(calls[i]);
+	}
+
+	for (i = 0; i < ORDERED_CALLS; i++) {
+		rpc_call_wait(calls[i]);
+		g_assert_cmpint(rpc_call_status(calls[i]), ==, RPC_CALL_DONE);
+		g_assert_cmpint(rpc_int64_get_value(rpc_call_result(calls[i])),
+		    ==, i);
+		rpc_call_free(calls[i]);
+	}
+
+	rpc_client_close(client);
+
+	g_assert_cmpuint(fixture->order->len, ==, ORDERED_CALLS);
+	g_assert_cmpint(fixture->max_inflight, >=, 1);
+	g_assert_cmpint(fixture->max_inflight, <=, (gint)fixture->limit);
+	for (i = 0; fixture->limit == 1 && i < ORDERED_CALLS; i++)
+		g_assert_cmpint(g_array_index(fixture->order, int64_t, i), ==,
+		    i);
+}
+
+struct load_caller {
+	server_fixture *	fixture;
+	int			index;
+	int			calls;
+	volatile int		done;
+	int			failed;
+};
+
+/*
+ * Makes calls one after another until it has made caller->calls of
+ * them, or until the first one that fails if that is 0.
+ */
+static gpointer
+thread_load_func(gpointer data)
+{
+	struct load_caller *caller = data;
+	rpc_client_t client;
+	rpc_connection_t conn;
+	rpc_call_t call;
+	char *name;
+	char *expected;
+	int i;
+
+	client = rpc_client_create(uris[caller->fixture->iuri].cli, 0);
+	g_assert_nonnull(client);
+	conn = rpc_client_get_connection(client);
+
+	for (i = 0; caller->calls == 0 || i < caller->calls; i++) {
+		name = g_strdup_printf("%d.%d", caller->index, i);
+		call = rpc_connection_call(conn, NULL, NULL, "hi",
+		    rpc_object_pack("[s]", name), NULL);
+		if (call == NULL) {
+			g_free(name);
+			caller->failed++;
+			break;
+		}
+
+		rpc_call_wait(call);
+		if (rpc_call_status(call) != RPC_CALL_DONE) {
+			rpc_call_free(call);
+			g_free(name);
+			caller->failed++;
+			break;
+		}
+
+		expected = g_strdup_printf("hello %s!", name);
+		g_assert_cmpstr(rpc_string_get_string_ptr(
+		    rpc_call_result(call)), ==, expected);
+		g_atomic_int_inc(&caller->done);
+		rpc_call_free(call);
+		g_free(expected);
+		g_free(name);
+	}
+
+	rpc_client_close(client);
+	return (NULL);
+}
+
+static void
+load_start(server_fixture *fixture, struct load_caller *callers,
+    GThread **threads, int calls)
+{
+	int i;
+
+	for (i = 0; i < LOAD_THREADS; i++) {
+		callers[i].fixture = fixture;
+		callers[i].index = i;
+		callers[i].calls = calls;
+		callers[i].done = 0;
+		callers[i].failed = 0;
+		threads[i] = g_thread_new("load", thread_load_func,
+		    &callers[i]);
+	}
+}
+
+/*
+ * Pauses and resumes the server while clients keep calling. Nothing new
+ * runs while it's paused, and every call is answered once it resumes.
+ */
+static void
+server_test_pause_load(server_fixture *fixture, gconstpointer user_data)
+{
+	struct load_caller callers[LOAD_THREADS];
+	GThread *threads[LOAD_THREADS];
+	int held;
+	int i;
+
+	rpc_server_resume(fixture->srv);
+	load_start(fixture, callers, threads, LOAD_CALLS);
+
+	for (i = 0; i < LOAD_PAUSES; i++) {
+		g_usleep(5000);
+		rpc_server_pause(fixture->srv);
+
+		/* Calls handed to workers before the pause may still finish */
+		g_usleep(50000);
+		held = g_atomic_int_get(&fixture->count);
+		g_usleep(50000);
+		g_assert_cmpint(g_atomic_int_get(&fixture->count), ==, held);
+		rpc_server_resume(fixture->srv);
+	}
+
+	for (i = 0; i < LOAD_THREADS; i++) {
+		g_thread_join(threads[i]);
+		g_assert_cmpint(callers[i].failed, ==, 0);
+		g_assert_cmpint(callers[i].done, ==, LOAD_CALLS);
+	}
+
+	g_assert_cmpint(fixture->count, ==, LOAD_THREADS * LOAD_CALLS);
+}
+
+/*
+ * Closes a paused server with calls queued on it. Every caller gets
+ * its pending call failed instead of waiting forever.
+ */
+static void
+server_test_close_load(server_fixture *fixture, gconstpointer user_data)
+{
+	struct load_caller callers[LOAD_THREADS];
+	GThread *threads[LOAD_THREADS];
+	int done = 0;
+	int i;
+
+	rpc_server_resume(fixture->srv);
+	load_start(fixture, callers, threads, 0);
+
+	/* Every client has to be connected before the server goes away */
+	for (i = 0; i < LOAD_THREADS; i++) {
+		while (g_atomic_int_get(&callers[i].done) == 0)
+			g_usleep(1000);
+	}
+
+	rpc_server_pause(fixture->srv);
+	g_usleep(20000);
+	fixture->iclose = 1;
+	g_assert_cmpint(rpc_server_close(fixture->srv), ==, 0);
+
+	for (i = 0; i < LOAD_THREADS; i++) {
+		g_thread_join(threads[i]);
+		g_assert_cmpint(callers[i].failed, ==, 1);
+		done += callers[i].done;
+	}
+
+	g_assert_cmpint(fixture->count, >=, done);
+}
+
+/* Collects session.tick events, and counts lost ones */
+static void
+session_watch(server_fixture *fixture, rpc_connection_t conn, bool events)
+{
+
+	rpc_connection_set_error_handler(conn,
+	    ^(rpc_error_code_t code, rpc_object_t args __unused) {
+		if (code == RPC_EVENTS_LOST)
+			g_atomic_int_inc(&fixture->lost);
+	    });
+
+	if (!events)
+		return;
+
+	g_assert_nonnull(rpc_connection_register_event_handler(conn, NULL,
+	    NULL, "session.tick", ^(const char *path __unused,
+	    const char *interface __unused, const char *name __unused,
+	    rpc_object_t args) {
+		int64_t tick = rpc_int64_get_value(args);
+
+		g_mutex_lock(&fixture->mtx);
+		g_array_append_val(fixture->order, tick);
+		g_mutex_unlock(&fixture->mtx);
+	    }));
+}
+
+static guint
+session_events(server_fixture *fixture)
+{
+	guint len;
+
+	g_mutex_lock(&fixture->mtx);
+	len = fixture->order->len;
+	g_mutex_unlock(&fixture->mtx);
+	return (len);
+}
+
+static void
+session_wait_events(server_fixture *fixture, guint count)
+{
+	gint64 deadline = g_get_monotonic_time() + 10 * G_USEC_PER_SEC;
+
+	while (session_events(fixture) < count) {
+		g_assert_cmpint(g_get_monotonic_time(), <, deadline);
+		g_usleep(1000);
+	}
+}
+
+static void
+session_tick(rpc_connection_t conn, int64_t from, int64_t to)
+{
+	rpc_object_t result;
+
+	result = rpc_connection_call_simple(conn, "tick", "[i,i]", from, to);
+	g_assert_nonnull(result);
+	g_assert(!rpc_is_error(result));
+}
+
+/* Drops @p conn from the server side, the way a dead link would be */
+static void
+session_drop(server_fixture *fixture, rpc_connection_t conn)
+{
+	rpc_object_t result;
+	int disconnects = g_atomic_int_get(&fixture->disconnects);
+
+	result = rpc_connection_call_simple(conn, "drop", RPC_NULL_FORMAT);
+	g_assert_nonnull(result);
+	g_assert(!rpc_is_error(result));
+	g_assert_nonnull(fixture->peer);
+
+	rpc_connection_close(fixture->peer);
+	rpc_connection_release(fixture->peer);
+	fixture->peer = NULL;
+
+	while (g_atomic_int_get(&fixture->disconnects) == disconnects ||
+	    rpc_connection_is_open(conn))
+		g_usleep(1000);
+}
+
+static void
+session_check_order(server_fixture *fixture, int64_t skip_from,
+    int64_t skip_to, int64_t to)
+{
+	int64_t expected = 0;
+	guint i;
+
+	g_mutex_lock(&fixture->mtx);
+	for (i = 0; i < fixture->order->len; i++) {
+		if (expected == skip_from)
+			expected = skip_to;
+
+		g_assert_cmpint(g_array_index(fixture->order, int64_t, i), ==,
+		    expected);
+		expected++;
+	}
+	g_mutex_unlock(&fixture->mtx);
+
+	g_assert_cmpint(expected, ==, to);
+}
+
+/*
+ * Drops a subscribed client and broadcasts while it's away. The new
+ * connection taking its session over gets the missed events first, in
+ * order, and then live ones as before.
+ */
+static void
+server_test_session_resume(server_fixture *fixture, gconstpointer user_data)
+{
+	rpc_client_t client;
+	rpc_client_t second;
+	rpc_connection_t conn;
+	rpc_connection_t conn2;
+	rpc_object_t tick;
+	char *token;
+	int64_t i;
+
+	rpc_server_resume(fixture->srv);
+	client = rpc_client_create(uris[fixture->iuri].cli, 0);
+	g_assert_nonnull(client);
+	conn = rpc_client_get_connection(client);
+	session_watch(fixture, conn, true);
+
+	while ((token = rpc_connection_get_session(conn)) == NULL)
+		g_usleep(1000);
+
+	g_free(token);
+	session_tick(conn, 0, SESSION_EVENTS);
+	session_wait_events(fixture, SESSION_EVENTS);
+	session_drop(fixture, conn);
+
+	/* Missed while away, along with one nobody subscribed to */
+	for (i = SESSION_EVENTS; i < 2 * SESSION_EVENTS; i++) {
+		tick = rpc_int64_create(i);
+		rpc_server_broadcast_event(fixture->srv, NULL, NULL,
+		    "session.tick", tick);
+		rpc_release(tick);
+	}
+
+	tick = rpc_int64_create(-1);
+	rpc_server_broadcast_event(fixture->srv, NULL, NULL, "session.other",
+	    tick);
+	rpc_release(tick);
+
+	second = rpc_client_create(uris[fixture->iuri].cli, 0);
+	g_assert_nonnull(second);
+	conn2 = rpc_client_get_connection(second);
+	session_watch(fixture, conn2, false);
+	g_assert_cmpint(rpc_connection_resume_session(conn2, conn), ==, 0);
+	session_wait_events(fixture, 2 * SESSION_EVENTS);
+
+	session_tick(conn2, 2 * SESSION_EVENTS, 3 * SESSION_EVENTS);
+	session_wait_events(fixture, 3 * SESSION_EVENTS);
+	session_check_order(fixture, -1, -1, 3 * SESSION_EVENTS);
+	g_assert_cmpint(fixture->lost, ==, 0);
+
+	/* Subscriptions only get carried over to a fresh connection */
+	g_assert_cmpint(rpc_connection_resume_session(conn2, conn), ==, -1);
+
+	rpc_client_close(client);
+	rpc_client_close(second);
+}
+
+/*
+ * Same, but the client only comes back after its session expired. It
+ * hears that events were lost, subscribes again and gets live events.
+ */
+static void
+server_test_session_expire(server_fixture *fixture, gconstpointer user_data)
+{
+	rpc_client_t client;
+	rpc_client_t second;
+	rpc_connection_t conn;
+	rpc_connection_t conn2;
+	rpc_object_t tick;
+	char *token;
+	int64_t i;
+
+	rpc_server_resume(fixture->srv);
+	client = rpc_client_create(uris[fixture->iuri].cli, 0);
+	g_assert_nonnull(client);
+	conn = rpc_client_get_connection(client);
+	session_watch(fixture, conn, true);
+
+	while ((token = rpc_connection_get_session(conn)) == NULL)
+		g_usleep(1000);
+
+	g_free(token);
+	session_tick(conn, 0, SESSION_EVENTS);
+	session_wait_events(fixture, SESSION_EVENTS);
+	session_drop(fixture, conn);
+	g_usleep(500 * 1000);
+
+	for (i = SESSION_EVENTS; i < 2 * SESSION_EVENTS; i++) {
+		tick = rpc_int64_create(i);
+		rpc_server_broadcast_event(fixture->srv, NULL, NULL,
+		    "session.tick", tick);
+		rpc_release(tick);
+	}
+
+	second = rpc_client_create(uris[fixture->iuri].cli, 0);
+	g_assert_nonnull(second);
+	conn2 = rpc_client_get_connection(second);
+	session_watch(fixture, conn2, false);
+	g_assert_cmpint(rpc_connection_resume_session(conn2, conn), ==, 0);
+
+	while (g_atomic_int_get(&fixture->lost) == 0)
+		g_usleep(1000);
+
+	session_tick(conn2, 2 * SESSION_EVENTS, 3 * SESSION_EVENTS);
+	session_wait_events(fixture, 2 * SESSION_EVENTS);
+	session_check_order(fixture, SESSION_EVENTS, 2 * SESSION_EVENTS,
+	    3 * SESSION_EVENTS);
+	g_assert_cmpint(fixture->lost, ==, 1);
+
+	rpc_client_close(client);
+	rpc_client_close(second);
+}
+
 /*
 static void
 server_test(server_fixture *fixture, gconstpointer user_data)
@@ -713,6 +1415,54 @@ server_test_register()
 	g_test_add("/server/flush/loopback", server_fixture, (void *)LB_GOOD,
 	    server_test_valid_server_set_up, server_test_flush,
 	    server_test_valid_server_tear_down);
+
+	g_test_add("/server/calls/slab", server_fixture, (void *)LB_GOOD,
+	    server_test_valid_server_set_up, server_test_call_slab,
+	    server_test_valid_server_tear_down);
+
+	g_test_add("/server/dispatch/blocked", server_fixture, (void *)LB_GOOD,
+	    server_test_dispatch_set_up, server_test_dispatch_blocked,
+	    server_test_dispatch_tear_down);
+
+	g_test_add("/server/dispatch/blocked/tcp", server_fixture,
+	    (void *)TCP_GOOD, server_test_dispatch_set_up,
+	    server_test_dispatch_blocked, server_test_dispatch_tear_down);
+
+	g_test_add("/server/dispatch/ordered/serial", server_fixture,
+	    (void *)LB_GOOD, server_test_ordered_serial_set_up,
+	    server_test_ordered, server_test_ordered_tear_down);
+
+	g_test_add("/server/dispatch/ordered/window", server_fixture,
+	    (void *)TCP_GOOD, server_test_ordered_window_set_up,
+	    server_test_ordered, server_test_ordered_tear_down);
+
+	g_test_add("/server/dispatch/pause", server_fixture, (void *)LB_GOOD,
+	    server_test_valid_server_set_up, server_test_pause_load,
+	    server_test_valid_server_tear_down);
+
+	g_test_add("/server/dispatch/pause/tcp", server_fixture,
+	    (void *)TCP_GOOD, server_test_valid_server_set_up,
+	    server_test_pause_load, server_test_valid_server_tear_down);
+
+	g_test_add("/server/dispatch/close", server_fixture, (void *)LB_GOOD,
+	    server_test_valid_server_set_up, server_test_close_load,
+	    server_test_valid_server_tear_down);
+
+	g_test_add("/server/dispatch/close/tcp", server_fixture,
+	    (void *)TCP_GOOD, server_test_valid_server_set_up,
+	    server_test_close_load, server_test_valid_server_tear_down);
+
+	g_test_add("/server/session/resume", server_fixture, (void *)DS_GOOD,
+	    server_test_session_set_up, server_test_session_resume,
+	    server_test_session_tear_down);
+
+	g_test_add("/server/session/resume/tcp", server_fixture,
+	    (void *)TCP_GOOD, server_test_session_set_up,
+	    server_test_session_resume, server_test_session_tear_down);
+
+	g_test_add("/server/session/expire", server_fixture, (void *)DS_GOOD,
+	    server_test_session_expire_set_up, server_test_session_expire,
+	    server_test_session_tear_down);
 }
 
 static struct librpc_test server = {
@@ -0,0 +1,874 @@
+/*
+ * Copyright 2015-2017 Two Pore Guys, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Throughput/latency matrix benchmark.
+ *
+ * Starts an in-process server on every requested transport and runs
+ * the same set of scenarios against each of them:
+ *
+ * - latency: sequential small calls from a single client
+ * - throughput: small calls from 1, 4 and 16 concurrent clients
+ * - fanout: events delivered to 1, 4 and 16 subscribers
+ * - stream: streamed blobs consumed with various prefetch windows
+ *
+ * Results are emitted as a single JSON document, suitable for
+ * regression tracking.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <time.h>
+#include <pthread.h>
+#include <rpc/object.h>
+#include <rpc/connection.h>
+#include <rpc/client.h>
+#include <rpc/service.h>
+#include <rpc/server.h>
+#include <rpc/serializer.h>
+
+#define	BENCH_INTERFACE		"com.twoporeguys.librpc.Benchmark"
+#define	BENCH_EVENT		"tick"
+#define	BENCH_EVENT_TIMEOUT	(30 * 1000000000ULL)
+
+struct bench_transport
+{
+	const char *		bt_name;
+	const char *		bt_listen;
+	const char *		bt_connect;
+	const char *		bt_socket;
+};
+
+struct bench_worker
+{
+	pthread_t		bw_thread;
+	pthread_barrier_t *	bw_barrier;
+	rpc_client_t		bw_client;
+	uint64_t *		bw_samples;
+	size_t			bw_count;
+	size_t			bw_errors;
+};
+
+struct bench_subscriber
+{
+	rpc_client_t		bs_client;
+	void *			bs_cookie;
+	atomic_size_t		bs_received;
+	uint64_t *		bs_samples;
+	size_t			bs_nsamples;
+};
+
+static uint64_t bench_now(void);
+static int bench_compare(const void *, const void *);
+static uint64_t bench_percentile(const uint64_t *, size_t, double);
+static void bench_set_latency(rpc_object_t, uint64_t *, size_t);
+static rpc_object_t bench_result(const struct bench_transport *,
+    const char *);
+static rpc_client_t bench_connect(const struct bench_transport *);
+static int bench_ping(rpc_connection_t);
+static rpc_object_t benchmark_ping(void *, rpc_object_t);
+static rpc_object_t benchmark_stream(void *, rpc_object_t);
+static rpc_object_t benchmark_fanout(void *, rpc_object_t);
+static int bench_latency(const struct bench_transport *, rpc_object_t);
+static void *bench_worker_main(void *);
+static int bench_throughput(const struct bench_transport *, size_t,
+    rpc_object_t);
+static int bench_fanout(const struct bench_transport *, size_t,
+    rpc_object_t);
+static int bench_stream(const struct bench_transport *, size_t,
+    rpc_object_t);
+static void bench_run_transport(const struct bench_transport *,
+    rpc_context_t, rpc_object_t);
+void usage(const char *);
+int main(int, char * const []);
+
+static const struct bench_transport bench_transports[] = {
+	{
+		"unix",
+		"unix:///tmp/librpc-bench.sock",
+		"unix:///tmp/librpc-bench.sock",
+		"/tmp/librpc-bench.sock"
+	},
+	{
+		"tcp",
+		"tcp://0.0.0.0:5500",
+		"tcp://127.0.0.1:5500",
+		NULL
+	},
+	{
+		"ws",
+		"ws://0.0.0.0:6600/ws",
+		"ws://127.0.0.1:6600/ws",
+		NULL
+	},
+	{
+		"loopback",
+		"loopback://0",
+		"loopback://0",
+		NULL
+	},
+	{
+		"shm",
+		"shm:///tmp/librpc-bench-shm.sock",
+		"shm:///tmp/librpc-bench-shm.sock",
+		"/tmp/librpc-bench-shm.sock"
+	},
+	{ NULL, NULL, NULL, NULL }
+};
+
+static const size_t bench_clients[] = { 1, 4, 16 };
+static const size_t bench_subscribers[] = { 1, 4, 16 };
+static const size_t bench_prefetch[] = { 1, 8, 64, 256 };
+
+static size_t ncalls = 10000;
+static size_t nevents = 1000;
+static size_t ncycles = 10000;
+static size_t msgsize = 4096;
+static bool quiet = false;
+
+static const struct rpc_if_member benchmark_vtable[] = {
+	RPC_METHOD(ping, benchmark_ping),
+	RPC_METHOD(stream, benchmark_stream),
+	RPC_METHOD(fanout, benchmark_fanout),
+	RPC_MEMBER_END
+};
+
+static uint64_t
+bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec);
+}
+
+static int
+bench_compare(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return (x < y ? -1 : x > y);
+}
+
+static uint64_t
+bench_percentile(const uint64_t *samples, size_t n, double p)
+{
+	size_t rank;
+
+	if (n == 0)
+		return (0);
+
+	/* Nearest-rank percentile over an already sorted sample set */
+	rank = (size_t)(p * n + 0.999999);
+	if (rank == 0)
+		rank = 1;
+
+	if (rank > n)
+		rank = n;
+
+	return (samples[rank - 1]);
+}
+
+static void
+bench_set_latency(rpc_object_t result, uint64_t *samples, size_t n)
+{
+	uint64_t sum = 0;
+	size_t i;
+
+	qsort(samples, n, sizeof(*samples), bench_compare);
+	for (i = 0; i < n; i++)
+		sum += samples[i];
+
+	rpc_dictionary_set_uint64(result, "samples", n);
+	rpc_dictionary_set_double(result, "mean_us",
+	    n > 0 ? sum / 1000.0 / n : 0);
+	rpc_dictionary_set_double(result, "p50_us",
+	    bench_percentile(samples, n, 0.50) / 1000.0);
+	rpc_dictionary_set_double(result, "p99_us",
+	    bench_percentile(samples, n, 0.99) / 1000.0);
+	rpc_dictionary_set_double(result, "p999_us",
+	    bench_percentile(samples, n, 0.999) / 1000.0);
+	rpc_dictionary_set_double(result, "max_us",
+	    n > 0 ? samples[n - 1] / 1000.0 : 0);
+}
+
+static rpc_object_t
+bench_result(const struct bench_transport *transport, const char *scenario)
+{
+	rpc_object_t result;
+
+	result = rpc_dictionary_create();
+	rpc_dictionary_set_string(result, "transport", transport->bt_name);
+	rpc_dictionary_set_string(result, "scenario", scenario);
+	return (result);
+}
+
+static rpc_client_t
+bench_connect(const struct bench_transport *transport)
+{
+	rpc_client_t client;
+
+	client = rpc_client_create(transport->bt_connect, NULL);
+	if (client == NULL) {
+		fprintf(stderr, "%s: cannot connect: %s\n", transport->bt_name,
+		    rpc_error_get_message(rpc_get_last_error()));
+	}
+
+	return (client);
+}
+
+static int
+bench_ping(rpc_connection_t conn)
+{
+	rpc_object_t result;
+	int ret = 0;
+
+	result = rpc_connection_call_syncp(conn, "/", BENCH_INTERFACE, "ping",
+	    "[i]", (int64_t)0);
+	if (result == NULL || rpc_get_type(result) == RPC_TYPE_ERROR)
+		ret = -1;
+
+	if (result != NULL)
+		rpc_release(result);
+
+	return (ret);
+}
+
+static rpc_object_t
+benchmark_ping(void *cookie, rpc_object_t args)
+{
+
+	return (rpc_retain(args));
+}
+
+static rpc_object_t
+benchmark_stream(void *cookie, rpc_object_t args)
+{
+	rpc_object_t data;
+	int64_t cycles;
+	int64_t size;
+	void *buffer;
+
+	if (rpc_object_unpack(args, "[i,i]", &cycles, &size) < 2 || size < 0) {
+		rpc_function_error(cookie, EINVAL, "Invalid arguments passed");
+		return (NULL);
+	}
+
+	buffer = malloc((size_t)size);
+	memset(buffer, 0x55, (size_t)size);
+	data = rpc_data_create(buffer, (size_t)size,
+	    RPC_BINARY_DESTRUCTOR(free));
+
+	rpc_function_start_stream(cookie);
+	while (cycles--) {
+		if (rpc_function_yield(cookie, rpc_retain(data)) < 0)
+			break;
+	}
+
+	rpc_release(data);
+	return (NULL);
+}
+
+static rpc_object_t
+benchmark_fanout(void *cookie, rpc_object_t args)
+{
+	rpc_instance_t instance;
+	int64_t count;
+
+	if (rpc_object_unpack(args, "[i]", &count) < 1) {
+		rpc_function_error(cookie, EINVAL, "Invalid arguments passed");
+		return (NULL);
+	}
+
+	/* Each event carries its emission time, for delivery latency */
+	instance = rpc_function_get_instance(cookie);
+	while (count--) {
+		rpc_instance_emit_event(instance, BENCH_INTERFACE, BENCH_EVENT,
+		    rpc_uint64_create(bench_now()));
+	}
+
+	return (rpc_null_create());
+}
+
+static int
+bench_latency(const struct bench_transport *transport, rpc_object_t results)
+{
+	rpc_object_t result;
+	rpc_client_t client;
+	uint64_t *samples;
+	uint64_t start;
+	size_t errors = 0;
+	size_t n = 0;
+	size_t i;
+
+	client = bench_connect(transport);
+	if (client == NULL)
+		return (-1);
+
+	samples = calloc(ncalls, sizeof(*samples));
+	for (i = 0; i < ncalls; i++) {
+		start = bench_now();
+		if (bench_ping(rpc_client_get_connection(client)) != 0) {
+			errors++;
+			continue;
+		}
+
+		samples[n++] = bench_now() - start;
+	}
+
+	rpc_client_close(client);
+
+	result = bench_result(transport, "latency");
+	rpc_dictionary_set_uint64(result, "errors", errors);
+	bench_set_latency(result, samples, n);
+	rpc_array_append_stolen_value(results, result);
+	free(samples);
+	return (0);
+}
+
+static void *
+bench_worker_main(void *arg)
+{
+	struct bench_worker *worker = arg;
+	rpc_connection_t conn;
+	uint64_t start;
+	size_t i;
+
+	conn = rpc_client_get_connection(worker->bw_client);
+	pthread_barrier_wait(worker->bw_barrier);
+
+	for (i = 0; i < ncalls; i++) {
+		start = bench_now();
+		if (bench_ping(conn) != 0) {
+			worker->bw_errors++;
+			continue;
+		}
+
+		worker->bw_samples[worker->bw_count++] = bench_now() - start;
+	}
+
+	return (NULL);
+}
+
+static int
+bench_throughput(const struct bench_transport *transport, size_t nclients,
+    rpc_object_t results)
+{
+	struct bench_worker *workers;
+	pthread_barrier_t barrier;
+	rpc_object_t result;
+	uint64_t *samples;
+	uint64_t start;
+	uint64_t elapsed;
+	size_t started = 0;
+	size_t errors = 0;
+	size_t n = 0;
+	size_t i;
+	int ret = 0;
+
+	workers = calloc(nclients, sizeof(*workers));
+	for (i = 0; i < nclients; i++) {
+		workers[i].bw_client = bench_connect(transport);
+		if (workers[i].bw_client == NULL) {
+			ret = -1;
+			goto done;
+		}
+	}
+
+	/* Connections are set up up front, so only the calls are timed */
+	pthread_barrier_init(&barrier, NULL, (unsigned)nclients + 1);
+	for (i = 0; i < nclients; i++) {
+		workers[i].bw_barrier = &barrier;
+		workers[i].bw_samples = calloc(ncalls, sizeof(uint64_t));
+		pthread_create(&workers[i].bw_thread, NULL, bench_worker_main,
+		    &workers[i]);
+		started++;
+	}
+
+	pthread_barrier_wait(&barrier);
+	start = bench_now();
+
+	for (i = 0; i < started; i++)
+		pthread_join(workers[i].bw_thread, NULL);
+
+	elapsed = bench_now() - start;
+	pthread_barrier_destroy(&barrier);
+
+	samples = calloc(nclients * ncalls, sizeof(*samples));
+	for (i = 0; i < nclients; i++) {
+		memcpy(&samples[n], workers[i].bw_samples,
+		    workers[i].bw_count * sizeof(*samples));
+		n += workers[i].bw_count;
+		errors += workers[i].bw_errors;
+	}
+
+	result = bench_result(transport, "throughput");
+	rpc_dictionary_set_uint64(result, "clients", nclients);
+	rpc_dictionary_set_uint64(result, "calls", n);
+	rpc_dictionary_set_uint64(result, "errors", errors);
+	rpc_dictionary_set_double(result, "elapsed_s", elapsed / 1E9);
+	rpc_dictionary_set_double(result, "calls_per_s",
+	    elapsed > 0 ? n / (elapsed / 1E9) : 0);
+	bench_set_latency(result, samples, n);
+	rpc_array_append_stolen_value(results, result);
+	free(samples);
+
+done:
+	for (i = 0; i < nclients; i++) {
+		if (workers[i].bw_client != NULL)
+			rpc_client_close(workers[i].bw_client);
+
+		free(workers[i].bw_samples);
+	}
+
+	free(workers);
+	return (ret);
+}
+
+static int
+bench_fanout(const struct bench_transport *transport, size_t nsubscribers,
+    rpc_object_t results)
+{
+	struct bench_subscriber *subs;
+	rpc_object_t result;
+	rpc_object_t error;
+	rpc_client_t driver;
+	uint64_t *samples;
+	uint64_t start;
+	uint64_t elapsed;
+	size_t delivered;
+	size_t n = 0;
+	size_t i;
+	int ret = 0;
+
+	driver = bench_connect(transport);
+	if (driver == NULL)
+		return (-1);
+
+	subs = calloc(nsubscribers, sizeof(*subs));
+	for (i = 0; i < nsubscribers; i++) {
+		struct bench_subscriber *sub = &subs[i];
+
+		atomic_init(&sub->bs_received, 0);
+		sub->bs_nsamples = nevents;
+		sub->bs_samples = calloc(nevents, sizeof(uint64_t));
+		sub->bs_client = bench_connect(transport);
+		if (sub->bs_client == NULL) {
+			ret = -1;
+			goto done;
+		}
+
+		sub->bs_cookie = rpc_connection_register_event_handler(
+		    rpc_client_get_connection(sub->bs_client), "/",
+		    BENCH_INTERFACE, BENCH_EVENT,
+		    ^(const char *path, const char *interface, const char *name,
+		    rpc_object_t args) {
+			size_t idx;
+
+			idx = atomic_fetch_add(&sub->bs_received, 1);
+			if (idx < sub->bs_nsamples) {
+				sub->bs_samples[idx] = bench_now() -
+				    rpc_uint64_get_value(args);
+			}
+		});
+
+		/*
+		 * A round trip on the same connection makes sure the
+		 * subscription has reached the server before events flow.
+		 */
+		if (sub->bs_cookie == NULL ||
+		    bench_ping(rpc_client_get_connection(sub->bs_client)) != 0) {
+			ret = -1;
+			goto done;
+		}
+	}
+
+	start = bench_now();
+	result = rpc_connection_call_syncp(rpc_client_get_connection(driver),
+	    "/", BENCH_INTERFACE, "fanout", "[i]", (int64_t)nevents);
+	if (result == NULL || rpc_get_type(result) == RPC_TYPE_ERROR) {
+		error = result != NULL ? result : rpc_get_last_error();
+		fprintf(stderr, "%s: fanout failed: %s\n", transport->bt_name,
+		    error != NULL ? rpc_error_get_message(error) : "unknown");
+		if (result != NULL)
+			rpc_release(result);
+
+		ret = -1;
+		goto done;
+	}
+
+	rpc_release(result);
+
+	for (;;) {
+		delivered = 0;
+		for (i = 0; i < nsubscribers; i++)
+			delivered += atomic_load(&subs[i].bs_received);
+
+		if (delivered >= nevents * nsubscribers)
+			break;
+
+		if (bench_now() - start > BENCH_EVENT_TIMEOUT)
+			break;
+
+		usleep(100);
+	}
+
+	elapsed = bench_now() - start;
+
+	samples = calloc(nevents * nsubscribers, sizeof(*samples));
+	for (i = 0; i < nsubscribers; i++) {
+		size_t count = atomic_load(&subs[i].bs_received);
+
+		if (count > nevents)
+			count = nevents;
+
+		memcpy(&samples[n], subs[i].bs_samples,
+		    count * sizeof(*samples));
+		n += count;
+	}
+
+	result = bench_result(transport, "fanout");
+	rpc_dictionary_set_uint64(result, "subscribers", nsubscribers);
+	rpc_dictionary_set_uint64(result, "events", nevents);
+	rpc_dictionary_set_uint64(result, "delivered", delivered);
+	rpc_dictionary_set_double(result, "elapsed_s", elapsed / 1E9);
+	rpc_dictionary_set_double(result, "deliveries_per_s",
+	    elapsed > 0 ? delivered / (elapsed / 1E9) : 0);
+	bench_set_latency(result, samples, n);
+	rpc_array_append_stolen_value(results, result);
+	free(samples);
+
+done:
+	for (i = 0; i < nsubscribers; i++) {
+		if (subs[i].bs_client != NULL) {
+			if (subs[i].bs_cookie != NULL) {
+				rpc_connection_unregister_event_handler(
+				    rpc_client_get_connection(
+				    subs[i].bs_client), subs[i].bs_cookie);
+			}
+
+			rpc_client_close(subs[i].bs_client);
+		}
+
+		free(subs[i].bs_samples);
+	}
+
+	rpc_client_close(driver);
+	free(subs);
+	return (ret);
+}
+
+static int
+bench_stream(const struct bench_transport *transport, size_t prefetch,
+    rpc_object_t results)
+{
+	rpc_object_t result;
+	rpc_client_t client;
+	rpc_call_t call;
+	uint64_t *samples;
+	uint64_t start;
+	uint64_t last;
+	uint64_t now;
+	uint64_t elapsed;
+	size_t bytes = 0;
+	size_t n = 0;
+	int ret = 0;
+
+	client = bench_connect(transport);
+	if (client == NULL)
+		return (-1);
+
+	call = rpc_connection_call(rpc_client_get_connection(client), "/",
+	    BENCH_INTERFACE, "stream",
+	    rpc_object_pack("[i,i]", (int64_t)ncycles, (int64_t)msgsize), NULL);
+	if (call == NULL) {
+		fprintf(stderr, "%s: cannot start streaming: %s\n",
+		    transport->bt_name,
+		    rpc_error_get_message(rpc_get_last_error()));
+		rpc_client_close(client);
+		return (-1);
+	}
+
+	samples = calloc(ncycles, sizeof(*samples));
+	start = bench_now();
+	last = start;
+
+	rpc_call_set_prefetch(call, prefetch);
+	rpc_call_wait(call);
+
+	for (;;) {
+		switch (rpc_call_status(call)) {
+		case RPC_CALL_STREAM_START:
+			rpc_call_continue(call, true);
+			continue;
+
+		case RPC_CALL_MORE_AVAILABLE:
+			now = bench_now();
+			if (n < ncycles)
+				samples[n++] = now - last;
+
+			bytes += rpc_data_get_length(rpc_call_result(call));
+			last = bench_now();
+			rpc_call_continue(call, true);
+			continue;
+
+		case RPC_CALL_DONE:
+		case RPC_CALL_ENDED:
+			break;
+
+		case RPC_CALL_ERROR:
+			fprintf(stderr, "%s: stream failed: %s\n",
+			    transport->bt_name,
+			    rpc_error_get_message(rpc_call_result(call)));
+			ret = -1;
+			break;
+
+		default:
+			ret = -1;
+			break;
+		}
+
+		break;
+	}
+
+	elapsed = bench_now() - start;
+	rpc_call_free(call);
+	rpc_client_close(client);
+
+	if (ret == 0) {
+		result = bench_result(transport, "stream");
+		rpc_dictionary_set_uint64(result, "prefetch", prefetch);
+		rpc_dictionary_set_uint64(result, "msgsize", msgsize);
+		rpc_dictionary_set_uint64(result, "messages", n);
+		rpc_dictionary_set_uint64(result, "bytes", bytes);
+		rpc_dictionary_set_double(result, "elapsed_s", elapsed / 1E9);
+		rpc_dictionary_set_double(result, "messages_per_s",
+		    elapsed > 0 ? n / (elapsed / 1E9) : 0);
+		rpc_dictionary_set_double(result, "bytes_per_s",
+		    elapsed > 0 ? bytes / (elapsed / 1E9) : 0);
+		bench_set_latency(result, samples, n);
+		rpc_array_append_stolen_value(results, result);
+	}
+
+	free(samples);
+	return (ret);
+}
+
+static void
+bench_run_transport(const struct bench_transport *transport,
+    rpc_context_t context, rpc_object_t results)
+{
+	rpc_object_t result;
+	rpc_server_t server;
+	size_t i;
+
+	if (transport->bt_socket != NULL)
+		unlink(transport->bt_socket);
+
+	server = rpc_server_create(transport->bt_listen, context);
+	if (server == NULL) {
+		/* Transport not compiled in or address unavailable */
+		result = bench_result(transport, "setup");
+		rpc_dictionary_set_string(result, "error",
+		    rpc_error_get_message(rpc_get_last_error()));
+		rpc_array_append_stolen_value(results, result);
+		return;
+	}
+
+	rpc_server_resume(server);
+
+	if (!quiet)
+		fprintf(stderr, "%s: latency\n", transport->bt_name);
+
+	bench_latency(transport, results);
+
+	for (i = 0; i < sizeof(bench_clients) / sizeof(*bench_clients); i++) {
+		if (!quiet) {
+			fprintf(stderr, "%s: throughput, %zu clients\n",
+			    transport->bt_name, bench_clients[i]);
+		}
+
+		bench_throughput(transport, bench_clients[i], results);
+	}
+
+	for (i = 0; i < sizeof(bench_subscribers) /
+	    sizeof(*bench_subscribers); i++) {
+		if (!quiet) {
+			fprintf(stderr, "%s: fanout, %zu subscribers\n",
+			    transport->bt_name, bench_subscribers[i]);
+		}
+
+		bench_fanout(transport, bench_subscribers[i], results);
+	}
+
+	for (i = 0; i < sizeof(bench_prefetch) / sizeof(*bench_prefetch); i++) {
+		if (!quiet) {
+			fprintf(stderr, "%s: stream, prefetch %zu\n",
+			    transport->bt_name, bench_prefetch[i]);
+		}
+
+		bench_stream(transport, bench_prefetch[i], results);
+	}
+
+	rpc_server_close(server);
+
+	if (transport->bt_socket != NULL)
+		unlink(transport->bt_socket);
+}
+
+void
+usage(const char *argv0)
+{
+
+	fprintf(stderr, "Usage: %s [-t TRANSPORT]... [-n CALLS] [-e EVENTS] "
+	    "[-c CYCLES] [-s MSGSIZE] [-o FILE] [-q]\n", argv0);
+	fprintf(stderr, "       %s -h\n", argv0);
+	fprintf(stderr, "\nTransports: unix, tcp, ws, loopback, shm "
+	    "(default: all)\n");
+}
+
+int
+main(int argc, char * const argv[])
+{
+	const struct bench_transport *transport;
+	rpc_context_t context;
+	rpc_object_t report;
+	rpc_object_t results;
+	const char *output = NULL;
+	const char *selected[16];
+	size_t nselected = 0;
+	void *buf;
+	size_t len;
+	size_t i;
+	FILE *f = stdout;
+	int c;
+
+	for (;;) {
+		c = getopt(argc, argv, "t:n:e:c:s:o:qh");
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 't':
+			if (nselected < sizeof(selected) / sizeof(*selected))
+				selected[nselected++] = optarg;
+			break;
+
+		case 'n':
+			ncalls = (size_t)strtoull(optarg, NULL, 10);
+			break;
+
+		case 'e':
+			nevents = (size_t)strtoull(optarg, NULL, 10);
+			break;
+
+		case 'c':
+			ncycles = (size_t)strtoull(optarg, NULL, 10);
+			break;
+
+		case 's':
+			msgsize = (size_t)strtoull(optarg, NULL, 10);
+			break;
+
+		case 'o':
+			output = optarg;
+			break;
+
+		case 'q':
+			quiet = true;
+			break;
+
+		case 'h':
+			usage(argv[0]);
+			return (EXIT_SUCCESS);
+
+		default:
+			usage(argv[0]);
+			return (EXIT_FAILURE);
+		}
+	}
+
+	context = rpc_context_create();
+	rpc_instance_register_interface(rpc_context_get_root(context),
+	    BENCH_INTERFACE, benchmark_vtable, NULL);
+
+	results = rpc_array_create();
+
+	for (transport = bench_transports; transport->bt_name; transport++) {
+		if (nselected > 0) {
+			for (i = 0; i < nselected; i++) {
+				if (strcmp(selected[i], transport->bt_name) == 0)
+					break;
+			}
+
+			if (i == nselected)
+				continue;
+		}
+
+		bench_run_transport(transport, context, results);
+	}
+
+	report = rpc_dictionary_create();
+	rpc_dictionary_set_uint64(report, "version", 1);
+	rpc_dictionary_set_uint64(report, "calls", ncalls);
+	rpc_dictionary_set_uint64(report, "events", nevents);
+	rpc_dictionary_set_uint64(report, "cycles", ncycles);
+	rpc_dictionary_set_uint64(report, "msgsize", msgsize);
+	rpc_dictionary_steal_value(report, "results", results);
+
+	if (rpc_serializer_dump("json", report, &buf, &len) != 0) {
+		fprintf(stderr, "Cannot serialize results: %s\n",
+		    rpc_error_get_message(rpc_get_last_error()));
+		return (EXIT_FAILURE);
+	}
+
+	if (output != NULL) {
+		f = fopen(output, "w");
+		if (f == NULL) {
+			fprintf(stderr, "Cannot open %s: %s\n", output,
+			    strerror(errno));
+			return (EXIT_FAILURE);
+		}
+	}
+
+	fwrite(buf, 1, len, f);
+	fputc('\n', f);
+
+	if (f != stdout)
+		fclose(f);
+
+	free(buf);
+	rpc_release(report);
+	rpc_context_free(context);
+	return (EXIT_SUCCESS);
+}
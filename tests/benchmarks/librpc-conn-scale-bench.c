@@ -0,0 +1,505 @@
+/*
+ * Copyright 2015-2017 Two Pore Guys, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+/*
+ * Idle connection scaling benchmark.
+ *
+ * Forks a server and opens a growing number of idle unix domain
+ * connections to it, from 1 up to 100000 by default. After each step
+ * the connections are left alone for a while, then the server reports
+ * its resident memory, the CPU time it used while idle and the lock
+ * contention it saw, from which the cost of one idle connection is
+ * derived.
+ *
+ * The idle connections are plain sockets, so the benchmark process
+ * itself stays small; a single librpc client queries the server.
+ *
+ * Results are emitted as a single JSON document, suitable for
+ * regression tracking.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <rpc/object.h>
+#include <rpc/connection.h>
+#include <rpc/client.h>
+#include <rpc/service.h>
+#include <rpc/server.h>
+#include <rpc/serializer.h>
+#include <rpc/thread.h>
+
+#define	BENCH_INTERFACE		"com.twoporeguys.librpc.Benchmark"
+#define	BENCH_SOCKET		"/tmp/librpc-conn-scale-bench.sock"
+#define	BENCH_URI		"unix://" BENCH_SOCKET
+#define	BENCH_CONNECT_RETRIES	100
+
+static uint64_t bench_now(void);
+static uint64_t bench_rss(void);
+static uint64_t bench_cpu(void);
+static void bench_raise_nofile(size_t);
+static rpc_object_t bench_lock_stats(void);
+static rpc_object_t benchmark_stats(void *, rpc_object_t);
+static void bench_server(void) __attribute__((noreturn));
+static rpc_client_t bench_control(void);
+static int bench_open(void);
+static rpc_object_t bench_sample(rpc_client_t);
+static rpc_object_t bench_step(rpc_client_t, rpc_object_t, size_t,
+    uint64_t);
+void usage(const char *);
+int main(int, char * const []);
+
+static const char *bench_lock_names[RPC_LOCK_NSITES] = {
+	[RPC_LOCK_CONTEXT] = "context",
+	[RPC_LOCK_SERVER] = "server",
+	[RPC_LOCK_SERVER_CONNECTIONS] = "server_connections",
+	[RPC_LOCK_WORKQ] = "workq"
+};
+
+static size_t maxconns = 100000;
+static size_t settle = 2000;
+static bool quiet = false;
+
+static const struct rpc_if_member benchmark_vtable[] = {
+	RPC_METHOD(stats, benchmark_stats),
+	RPC_MEMBER_END
+};
+
+static uint64_t
+bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec);
+}
+
+static uint64_t
+bench_rss(void)
+{
+	unsigned long size;
+	unsigned long resident = 0;
+	FILE *f;
+
+	/* Resident set size, in pages, is the second field */
+	f = fopen("/proc/self/statm", "r");
+	if (f == NULL)
+		return (0);
+
+	if (fscanf(f, "%lu %lu", &size, &resident) != 2)
+		resident = 0;
+
+	fclose(f);
+	return ((uint64_t)resident * (uint64_t)sysconf(_SC_PAGESIZE));
+}
+
+static uint64_t
+bench_cpu(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ((uint64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000 +
+	    (uint64_t)(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec));
+}
+
+static void
+bench_raise_nofile(size_t count)
+{
+	struct rlimit rl;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) != 0)
+		return;
+
+	if (rl.rlim_cur >= count)
+		return;
+
+	rl.rlim_cur = rl.rlim_max == RLIM_INFINITY || rl.rlim_max > count ?
+	    (rlim_t)count : rl.rlim_max;
+	if (setrlimit(RLIMIT_NOFILE, &rl) != 0)
+		fprintf(stderr, "Cannot raise open files limit: %s\n",
+		    strerror(errno));
+}
+
+static rpc_object_t
+bench_lock_stats(void)
+{
+	struct rpc_lock_stats stats;
+	rpc_object_t result;
+	rpc_object_t site;
+	int i;
+
+	result = rpc_dictionary_create();
+	for (i = 0; i < RPC_LOCK_NSITES; i++) {
+		if (rpc_get_lock_stats((rpc_lock_site_t)i, &stats) != 0)
+			continue;
+
+		site = rpc_dictionary_create();
+		rpc_dictionary_set_uint64(site, "acquisitions",
+		    stats.rls_acquisitions);
+		rpc_dictionary_set_uint64(site, "contended",
+		    stats.rls_contended);
+		rpc_dictionary_set_uint64(site, "wait_us",
+		    stats.rls_wait_time);
+		rpc_dictionary_steal_value(result, bench_lock_names[i], site);
+	}
+
+	return (result);
+}
+
+static rpc_object_t
+benchmark_stats(void *cookie, rpc_object_t args)
+{
+	rpc_object_t result;
+
+	result = rpc_dictionary_create();
+	rpc_dictionary_set_uint64(result, "rss", bench_rss());
+	rpc_dictionary_set_uint64(result, "cpu_us", bench_cpu());
+	rpc_dictionary_steal_value(result, "locks", bench_lock_stats());
+	return (result);
+}
+
+static void
+bench_server(void)
+{
+	rpc_context_t context;
+	rpc_server_t server;
+
+	bench_raise_nofile(maxconns + 64);
+	rpc_lock_stats_enable(true);
+
+	context = rpc_context_create();
+	rpc_instance_register_interface(rpc_context_get_root(context),
+	    BENCH_INTERFACE, benchmark_vtable, NULL);
+
+	server = rpc_server_create(BENCH_URI, context);
+	if (server == NULL) {
+		fprintf(stderr, "Cannot listen on %s: %s\n", BENCH_URI,
+		    rpc_error_get_message(rpc_get_last_error()));
+		_exit(EXIT_FAILURE);
+	}
+
+	/* Runs until the benchmark kills it */
+	rpc_server_resume(server);
+	for (;;)
+		pause();
+}
+
+static rpc_client_t
+bench_control(void)
+{
+	rpc_client_t client;
+	int i;
+
+	/* The server may not be listening yet */
+	for (i = 0; i < BENCH_CONNECT_RETRIES; i++) {
+		client = rpc_client_create(BENCH_URI, NULL);
+		if (client != NULL)
+			return (client);
+
+		usleep(50000);
+	}
+
+	fprintf(stderr, "Cannot connect to %s: %s\n", BENCH_URI,
+	    rpc_error_get_message(rpc_get_last_error()));
+	return (NULL);
+}
+
+static int
+bench_open(void)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return (-1);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, BENCH_SOCKET, sizeof(addr.sun_path) - 1);
+
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+		close(fd);
+		return (-1);
+	}
+
+	return (fd);
+}
+
+static rpc_object_t
+bench_sample(rpc_client_t client)
+{
+	rpc_object_t result;
+
+	result = rpc_connection_call_syncp(rpc_client_get_connection(client),
+	    "/", BENCH_INTERFACE, "stats", "[]");
+	if (result != NULL && rpc_get_type(result) == RPC_TYPE_ERROR) {
+		rpc_release(result);
+		return (NULL);
+	}
+
+	return (result);
+}
+
+static rpc_object_t
+bench_step(rpc_client_t client, rpc_object_t baseline, size_t nconns,
+    uint64_t elapsed)
+{
+	rpc_object_t before;
+	rpc_object_t after;
+	rpc_object_t result;
+	uint64_t rss;
+	uint64_t base_rss;
+	uint64_t cpu;
+
+	/* CPU time is measured across the idle period only */
+	before = bench_sample(client);
+	usleep((useconds_t)(settle * 1000));
+	after = bench_sample(client);
+	if (before == NULL || after == NULL) {
+		if (before != NULL)
+			rpc_release(before);
+
+		if (after != NULL)
+			rpc_release(after);
+
+		return (NULL);
+	}
+
+	rss = rpc_dictionary_get_uint64(after, "rss");
+	base_rss = rpc_dictionary_get_uint64(baseline, "rss");
+	cpu = rpc_dictionary_get_uint64(after, "cpu_us") -
+	    rpc_dictionary_get_uint64(before, "cpu_us");
+
+	result = rpc_dictionary_create();
+	rpc_dictionary_set_string(result, "scenario", "idle");
+	rpc_dictionary_set_uint64(result, "connections", nconns);
+	rpc_dictionary_set_double(result, "connect_s", elapsed / 1e9);
+	rpc_dictionary_set_uint64(result, "rss", rss);
+	rpc_dictionary_set_double(result, "rss_per_conn",
+	    rss > base_rss ? (double)(rss - base_rss) / nconns : 0);
+	rpc_dictionary_set_double(result, "idle_cpu_pct",
+	    cpu * 100.0 / (settle * 1000.0));
+	rpc_dictionary_set_double(result, "idle_cpu_us_per_conn_s",
+	    cpu * 1000.0 / settle / nconns);
+	rpc_dictionary_set_value(result, "locks",
+	    rpc_dictionary_get_value(after, "locks"));
+
+	rpc_release(before);
+	rpc_release(after);
+	return (result);
+}
+
+void
+usage(const char *argv0)
+{
+
+	fprintf(stderr, "Usage: %s [-m MAXCONNS] [-w SETTLE_MS] [-o FILE] "
+	    "[-q]\n", argv0);
+	fprintf(stderr, "       %s -h\n", argv0);
+}
+
+int
+main(int argc, char * const argv[])
+{
+	rpc_client_t client;
+	rpc_object_t report;
+	rpc_object_t results;
+	rpc_object_t baseline;
+	rpc_object_t result;
+	const char *output = NULL;
+	uint64_t start;
+	size_t nconns = 0;
+	size_t step;
+	pid_t pid;
+	void *buf;
+	size_t len;
+	FILE *f = stdout;
+	int *fds;
+	int status;
+	int c;
+
+	for (;;) {
+		c = getopt(argc, argv, "m:w:o:qh");
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'm':
+			maxconns = (size_t)strtoull(optarg, NULL, 10);
+			break;
+
+		case 'w':
+			settle = (size_t)strtoull(optarg, NULL, 10);
+			break;
+
+		case 'o':
+			output = optarg;
+			break;
+
+		case 'q':
+			quiet = true;
+			break;
+
+		case 'h':
+			usage(argv[0]);
+			return (EXIT_SUCCESS);
+
+		default:
+			usage(argv[0]);
+			return (EXIT_FAILURE);
+		}
+	}
+
+	if (maxconns == 0 || settle == 0) {
+		usage(argv[0]);
+		return (EXIT_FAILURE);
+	}
+
+	unlink(BENCH_SOCKET);
+	pid = fork();
+	if (pid < 0) {
+		fprintf(stderr, "Cannot fork: %s\n", strerror(errno));
+		return (EXIT_FAILURE);
+	}
+
+	if (pid == 0)
+		bench_server();
+
+	bench_raise_nofile(maxconns + 64);
+	client = bench_control();
+	if (client == NULL) {
+		kill(pid, SIGTERM);
+		waitpid(pid, &status, 0);
+		return (EXIT_FAILURE);
+	}
+
+	/* Give the server time to settle before taking the baseline */
+	usleep((useconds_t)(settle * 1000));
+	baseline = bench_sample(client);
+	if (baseline == NULL) {
+		fprintf(stderr, "Cannot query the server: %s\n",
+		    rpc_error_get_message(rpc_get_last_error()));
+		kill(pid, SIGTERM);
+		waitpid(pid, &status, 0);
+		return (EXIT_FAILURE);
+	}
+
+	results = rpc_array_create();
+	fds = calloc(maxconns, sizeof(*fds));
+
+	for (step = 1; nconns < maxconns; step *= 10) {
+		if (step > maxconns)
+			step = maxconns;
+
+		if (!quiet)
+			fprintf(stderr, "idle: %zu connections\n", step);
+
+		start = bench_now();
+		for (; nconns < step; nconns++) {
+			fds[nconns] = bench_open();
+			if (fds[nconns] < 0)
+				break;
+		}
+
+		if (nconns < step) {
+			result = rpc_dictionary_create();
+			rpc_dictionary_set_string(result, "scenario", "idle");
+			rpc_dictionary_set_uint64(result, "connections", step);
+			rpc_dictionary_set_string(result, "error",
+			    strerror(errno));
+			rpc_array_append_stolen_value(results, result);
+			break;
+		}
+
+		result = bench_step(client, baseline, nconns,
+		    bench_now() - start);
+		if (result == NULL) {
+			fprintf(stderr, "Cannot query the server: %s\n",
+			    rpc_error_get_message(rpc_get_last_error()));
+			break;
+		}
+
+		rpc_array_append_stolen_value(results, result);
+	}
+
+	report = rpc_dictionary_create();
+	rpc_dictionary_set_uint64(report, "version", 1);
+	rpc_dictionary_set_uint64(report, "max_connections", maxconns);
+	rpc_dictionary_set_uint64(report, "settle_ms", settle);
+	rpc_dictionary_set_uint64(report, "baseline_rss",
+	    rpc_dictionary_get_uint64(baseline, "rss"));
+	rpc_dictionary_steal_value(report, "results", results);
+
+	rpc_client_close(client);
+	while (nconns > 0)
+		close(fds[--nconns]);
+
+	kill(pid, SIGTERM);
+	waitpid(pid, &status, 0);
+	unlink(BENCH_SOCKET);
+	free(fds);
+	rpc_release(baseline);
+
+	if (rpc_serializer_dump("json", report, &buf, &len) != 0) {
+		fprintf(stderr, "Cannot serialize results: %s\n",
+		    rpc_error_get_message(rpc_get_last_error()));
+		return (EXIT_FAILURE);
+	}
+
+	if (output != NULL) {
+		f = fopen(output, "w");
+		if (f == NULL) {
+			fprintf(stderr, "Cannot open %s: %s\n", output,
+			    strerror(errno));
+			return (EXIT_FAILURE);
+		}
+	}
+
+	fwrite(buf, 1, len, f);
+	fputc('\n', f);
+
+	if (f != stdout)
+		fclose(f);
+
+	free(buf);
+	rpc_release(report);
+	return (EXIT_SUCCESS);
+}
@@ -0,0 +1,400 @@
+/*
+ * Copyright 2015-2017 Two Pore Guys, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+/*
+ * Dispatch worker scaling benchmark.
+ *
+ * Runs the same fixed client load, a number of clients each with one
+ * call outstanding at a time, against servers with 1 up to 64 dispatch
+ * workers. Every call burns a configurable amount of CPU on the server
+ * side, so the numbers show how well calls spread over cores and how
+ * much the library's own locks get in the way.
+ *
+ * Lock contention is accounted for the whole process, and so includes
+ * the client side.
+ *
+ * Results are emitted as a single JSON document, suitable for
+ * regression tracking.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <time.h>
+#include <pthread.h>
+#include <rpc/object.h>
+#include <rpc/connection.h>
+#include <rpc/client.h>
+#include <rpc/service.h>
+#include <rpc/server.h>
+#include <rpc/serializer.h>
+#include <rpc/thread.h>
+
+#define	BENCH_INTERFACE		"com.twoporeguys.librpc.Benchmark"
+#define	BENCH_SOCKET		"/tmp/librpc-core-scale-bench.sock"
+#define	BENCH_URI		"unix://" BENCH_SOCKET
+
+struct bench_worker
+{
+	pthread_t		bw_thread;
+	pthread_barrier_t *	bw_barrier;
+	rpc_client_t		bw_client;
+	uint64_t		bw_deadline;
+	size_t			bw_count;
+	size_t			bw_errors;
+};
+
+static uint64_t bench_now(void);
+static rpc_object_t bench_lock_stats(void);
+static rpc_object_t benchmark_work(void *, rpc_object_t);
+static void *bench_worker_main(void *);
+static int bench_run(size_t, rpc_object_t);
+void usage(const char *);
+int main(int, char * const []);
+
+static const char *bench_lock_names[RPC_LOCK_NSITES] = {
+	[RPC_LOCK_CONTEXT] = "context",
+	[RPC_LOCK_SERVER] = "server",
+	[RPC_LOCK_SERVER_CONNECTIONS] = "server_connections",
+	[RPC_LOCK_WORKQ] = "workq"
+};
+
+static const size_t bench_workers[] = { 1, 2, 4, 8, 16, 32, 64 };
+
+static size_t nclients = 64;
+static size_t maxworkers = 64;
+static size_t duration = 5;
+static size_t worktime = 20;
+static bool pin = false;
+static bool quiet = false;
+
+static const struct rpc_if_member benchmark_vtable[] = {
+	RPC_METHOD(work, benchmark_work),
+	RPC_MEMBER_END
+};
+
+static uint64_t
+bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec);
+}
+
+static rpc_object_t
+bench_lock_stats(void)
+{
+	struct rpc_lock_stats stats;
+	rpc_object_t result;
+	rpc_object_t site;
+	int i;
+
+	result = rpc_dictionary_create();
+	for (i = 0; i < RPC_LOCK_NSITES; i++) {
+		if (rpc_get_lock_stats((rpc_lock_site_t)i, &stats) != 0)
+			continue;
+
+		site = rpc_dictionary_create();
+		rpc_dictionary_set_uint64(site, "acquisitions",
+		    stats.rls_acquisitions);
+		rpc_dictionary_set_uint64(site, "contended",
+		    stats.rls_contended);
+		rpc_dictionary_set_uint64(site, "wait_us",
+		    stats.rls_wait_time);
+		rpc_dictionary_steal_value(result, bench_lock_names[i], site);
+	}
+
+	return (result);
+}
+
+static rpc_object_t
+benchmark_work(void *cookie, rpc_object_t args)
+{
+	uint64_t deadline;
+	int64_t usec;
+
+	if (rpc_object_unpack(args, "[i]", &usec) < 1 || usec < 0) {
+		rpc_function_error(cookie, EINVAL, "Invalid arguments passed");
+		return (NULL);
+	}
+
+	/* Busy loop rather than sleep, so workers compete for cores */
+	deadline = bench_now() + (uint64_t)usec * 1000;
+	while (bench_now() < deadline)
+		;
+
+	return (rpc_null_create());
+}
+
+static void *
+bench_worker_main(void *arg)
+{
+	struct bench_worker *worker = arg;
+	rpc_connection_t conn;
+	rpc_object_t result;
+
+	conn = rpc_client_get_connection(worker->bw_client);
+	pthread_barrier_wait(worker->bw_barrier);
+
+	while (bench_now() < worker->bw_deadline) {
+		result = rpc_connection_call_syncp(conn, "/", BENCH_INTERFACE,
+		    "work", "[i]", (int64_t)worktime);
+		if (result == NULL || rpc_get_type(result) == RPC_TYPE_ERROR)
+			worker->bw_errors++;
+		else
+			worker->bw_count++;
+
+		if (result != NULL)
+			rpc_release(result);
+	}
+
+	return (NULL);
+}
+
+static int
+bench_run(size_t nworkers, rpc_object_t results)
+{
+	struct bench_worker *workers;
+	pthread_barrier_t barrier;
+	rpc_context_t context;
+	rpc_server_t server;
+	rpc_object_t result;
+	uint64_t deadline;
+	uint64_t start;
+	uint64_t elapsed;
+	size_t started = 0;
+	size_t errors = 0;
+	size_t calls = 0;
+	size_t i;
+	int ret = 0;
+
+	/* Dispatch workers are fixed once a context runs, so start anew */
+	unlink(BENCH_SOCKET);
+	context = rpc_context_create();
+	rpc_context_set_dispatch_workers(context, nworkers, pin);
+	rpc_instance_register_interface(rpc_context_get_root(context),
+	    BENCH_INTERFACE, benchmark_vtable, NULL);
+
+	result = rpc_dictionary_create();
+	rpc_dictionary_set_string(result, "scenario", "workers");
+	rpc_dictionary_set_uint64(result, "workers", nworkers);
+	rpc_dictionary_set_uint64(result, "clients", nclients);
+
+	server = rpc_server_create(BENCH_URI, context);
+	if (server == NULL) {
+		rpc_dictionary_set_string(result, "error",
+		    rpc_error_get_message(rpc_get_last_error()));
+		rpc_array_append_stolen_value(results, result);
+		rpc_context_free(context);
+		return (-1);
+	}
+
+	rpc_server_resume(server);
+
+	workers = calloc(nclients, sizeof(*workers));
+	for (i = 0; i < nclients; i++) {
+		workers[i].bw_client = rpc_client_create(BENCH_URI, NULL);
+		if (workers[i].bw_client == NULL) {
+			rpc_dictionary_set_string(result, "error",
+			    rpc_error_get_message(rpc_get_last_error()));
+			ret = -1;
+			goto done;
+		}
+	}
+
+	/* Only the calls themselves are accounted, not the setup */
+	pthread_barrier_init(&barrier, NULL, (unsigned)nclients + 1);
+	deadline = bench_now() + (uint64_t)duration * 1000000000ULL;
+	rpc_reset_lock_stats();
+	rpc_lock_stats_enable(true);
+
+	for (i = 0; i < nclients; i++) {
+		workers[i].bw_barrier = &barrier;
+		workers[i].bw_deadline = deadline;
+		pthread_create(&workers[i].bw_thread, NULL, bench_worker_main,
+		    &workers[i]);
+		started++;
+	}
+
+	pthread_barrier_wait(&barrier);
+	start = bench_now();
+
+	for (i = 0; i < started; i++) {
+		pthread_join(workers[i].bw_thread, NULL);
+		calls += workers[i].bw_count;
+		errors += workers[i].bw_errors;
+	}
+
+	elapsed = bench_now() - start;
+	rpc_lock_stats_enable(false);
+	pthread_barrier_destroy(&barrier);
+
+	rpc_dictionary_set_uint64(result, "calls", calls);
+	rpc_dictionary_set_uint64(result, "errors", errors);
+	rpc_dictionary_set_double(result, "elapsed_s", elapsed / 1e9);
+	rpc_dictionary_set_double(result, "calls_per_s",
+	    elapsed > 0 ? calls * 1e9 / elapsed : 0);
+	rpc_dictionary_steal_value(result, "locks", bench_lock_stats());
+
+done:
+	for (i = 0; i < nclients; i++) {
+		if (workers[i].bw_client != NULL)
+			rpc_client_close(workers[i].bw_client);
+	}
+
+	rpc_array_append_stolen_value(results, result);
+	rpc_server_close(server);
+	rpc_context_free(context);
+	unlink(BENCH_SOCKET);
+	free(workers);
+	return (ret);
+}
+
+void
+usage(const char *argv0)
+{
+
+	fprintf(stderr, "Usage: %s [-c CLIENTS] [-w MAXWORKERS] [-d SECONDS] "
+	    "[-u WORK_US] [-p] [-o FILE] [-q]\n", argv0);
+	fprintf(stderr, "       %s -h\n", argv0);
+}
+
+int
+main(int argc, char * const argv[])
+{
+	rpc_object_t report;
+	rpc_object_t results;
+	const char *output = NULL;
+	void *buf;
+	size_t len;
+	size_t i;
+	FILE *f = stdout;
+	int c;
+
+	for (;;) {
+		c = getopt(argc, argv, "c:w:d:u:po:qh");
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'c':
+			nclients = (size_t)strtoull(optarg, NULL, 10);
+			break;
+
+		case 'w':
+			maxworkers = (size_t)strtoull(optarg, NULL, 10);
+			break;
+
+		case 'd':
+			duration = (size_t)strtoull(optarg, NULL, 10);
+			break;
+
+		case 'u':
+			worktime = (size_t)strtoull(optarg, NULL, 10);
+			break;
+
+		case 'p':
+			pin = true;
+			break;
+
+		case 'o':
+			output = optarg;
+			break;
+
+		case 'q':
+			quiet = true;
+			break;
+
+		case 'h':
+			usage(argv[0]);
+			return (EXIT_SUCCESS);
+
+		default:
+			usage(argv[0]);
+			return (EXIT_FAILURE);
+		}
+	}
+
+	if (nclients == 0) {
+		usage(argv[0]);
+		return (EXIT_FAILURE);
+	}
+
+	results = rpc_array_create();
+
+	for (i = 0; i < sizeof(bench_workers) / sizeof(*bench_workers); i++) {
+		if (bench_workers[i] > maxworkers)
+			break;
+
+		if (!quiet) {
+			fprintf(stderr, "workers: %zu, %zu clients\n",
+			    bench_workers[i], nclients);
+		}
+
+		bench_run(bench_workers[i], results);
+	}
+
+	report = rpc_dictionary_create();
+	rpc_dictionary_set_uint64(report, "version", 1);
+	rpc_dictionary_set_uint64(report, "clients", nclients);
+	rpc_dictionary_set_uint64(report, "duration_s", duration);
+	rpc_dictionary_set_uint64(report, "work_us", worktime);
+	rpc_dictionary_set_uint64(report, "cpus", (uint64_t)sysconf(
+	    _SC_NPROCESSORS_ONLN));
+	rpc_dictionary_steal_value(report, "results", results);
+
+	if (rpc_serializer_dump("json", report, &buf, &len) != 0) {
+		fprintf(stderr, "Cannot serialize results: %s\n",
+		    rpc_error_get_message(rpc_get_last_error()));
+		return (EXIT_FAILURE);
+	}
+
+	if (output != NULL) {
+		f = fopen(output, "w");
+		if (f == NULL) {
+			fprintf(stderr, "Cannot open %s: %s\n", output,
+			    strerror(errno));
+			return (EXIT_FAILURE);
+		}
+	}
+
+	fwrite(buf, 1, len, f);
+	fputc('\n', f);
+
+	if (f != stdout)
+		fclose(f);
+
+	free(buf);
+	rpc_release(report);
+	return (EXIT_SUCCESS);
+}
@@ -0,0 +1,497 @@
+/*
+ * Copyright 2015-2017 Two Pore Guys, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Serialization microbenchmark.
+ *
+ * Times rpct_serialize()/rpct_deserialize() on their own, and
+ * rpc_serializer_dump()/rpc_serializer_load() for the msgpack and
+ * json serializers, over a set of representative object shapes.
+ * The serializer numbers include the typing pass, so the cost of the
+ * encoder itself is the difference between the two.
+ *
+ * On glibc, malloc() and friends are interposed to report the number
+ * of allocations per operation. Run with G_SLICE=always-malloc so
+ * that GSlice allocations are counted too.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <time.h>
+#include <rpc/object.h>
+#include <rpc/typing.h>
+#include <rpc/serializer.h>
+
+#define	BENCH_NAMESPACE		"com.twoporeguys.librpc.bench"
+#define	BENCH_WIDE_KEYS		256
+#define	BENCH_DEEP_LEVELS	32
+#define	BENCH_PACKED_ITEMS	4096
+#define	BENCH_STRUCT_ITEMS	64
+
+struct bench_shape
+{
+	const char *		bs_name;
+	rpc_object_t		(*bs_create)(void);
+};
+
+struct bench_op
+{
+	const char *		bo_name;
+	const char *		bo_serializer;
+	bool			bo_load;
+	bool			bo_typing;
+};
+
+static uint64_t bench_now(void);
+static rpc_object_t bench_small(void);
+static rpc_object_t bench_wide(void);
+static rpc_object_t bench_deep(void);
+static rpc_object_t bench_packed(void);
+static rpc_object_t bench_structs(void);
+static int bench_load_types(void);
+static int bench_once(const struct bench_op *, rpc_object_t, rpc_object_t,
+    const void *, size_t);
+static rpc_object_t bench_run(const struct bench_shape *,
+    const struct bench_op *, rpc_object_t);
+void usage(const char *);
+int main(int, char * const []);
+
+static atomic_uint_fast64_t bench_allocs;
+
+#if defined(__GLIBC__)
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+
+void *
+malloc(size_t size)
+{
+
+	atomic_fetch_add_explicit(&bench_allocs, 1, memory_order_relaxed);
+	return (__libc_malloc(size));
+}
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+
+	atomic_fetch_add_explicit(&bench_allocs, 1, memory_order_relaxed);
+	return (__libc_calloc(nmemb, size));
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+
+	atomic_fetch_add_explicit(&bench_allocs, 1, memory_order_relaxed);
+	return (__libc_realloc(ptr, size));
+}
+#endif
+
+static const char bench_idl[] =
+    "meta:\n"
+    "  version: 1\n"
+    "  namespace: " BENCH_NAMESPACE "\n"
+    "  description: Serialization benchmark types\n"
+    "\n"
+    "struct Sample:\n"
+    "  members:\n"
+    "    id:\n"
+    "      type: uint64\n"
+    "    name:\n"
+    "      type: string\n"
+    "    value:\n"
+    "      type: double\n"
+    "    valid:\n"
+    "      type: bool\n"
+    "    tags:\n"
+    "      type: array<string>\n";
+
+static const struct bench_shape bench_shapes[] = {
+	{ "small", bench_small },
+	{ "wide", bench_wide },
+	{ "deep", bench_deep },
+	{ "packed", bench_packed },
+	{ "structs", bench_structs },
+	{ NULL, NULL }
+};
+
+static const struct bench_op bench_ops[] = {
+	{ "rpct_serialize", NULL, false, true },
+	{ "rpct_deserialize", NULL, true, true },
+	{ "msgpack_dump", "msgpack", false, false },
+	{ "msgpack_load", "msgpack", true, false },
+	{ "json_dump", "json", false, false },
+	{ "json_load", "json", true, false },
+	{ NULL, NULL, false, false }
+};
+
+static double mintime = 0.5;
+static bool quiet = false;
+
+static uint64_t
+bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec);
+}
+
+static rpc_object_t
+bench_small(void)
+{
+
+	/* Shaped like a call frame envelope */
+	return (rpc_object_pack("{id:s,path:s,interface:s,method:s,args:[i,s,b]}",
+	    "6f2c1a52-1c84-4c3e-9a8e-3e5d2b7c9f01", "/",
+	    "com.twoporeguys.librpc.Benchmark", "ping",
+	    (int64_t)42, "hello", true));
+}
+
+static rpc_object_t
+bench_wide(void)
+{
+	rpc_object_t dict;
+	char key[32];
+	int i;
+
+	dict = rpc_dictionary_create();
+	for (i = 0; i < BENCH_WIDE_KEYS; i++) {
+		snprintf(key, sizeof(key), "key%d", i);
+		switch (i % 4) {
+		case 0:
+			rpc_dictionary_set_int64(dict, key, i);
+			break;
+
+		case 1:
+			rpc_dictionary_set_string(dict, key, "value");
+			break;
+
+		case 2:
+			rpc_dictionary_set_double(dict, key, i / 3.0);
+			break;
+
+		case 3:
+			rpc_dictionary_set_bool(dict, key, i % 2);
+			break;
+		}
+	}
+
+	return (dict);
+}
+
+static rpc_object_t
+bench_deep(void)
+{
+	rpc_object_t node;
+	rpc_object_t parent;
+	int i;
+
+	node = rpc_object_pack("{value:i}", (int64_t)0);
+	for (i = 1; i < BENCH_DEEP_LEVELS; i++) {
+		parent = rpc_object_pack("{value:i,name:s}", (int64_t)i, "node");
+		rpc_dictionary_steal_value(parent, "children",
+		    rpc_object_pack("[v]", node));
+		node = parent;
+	}
+
+	return (node);
+}
+
+static rpc_object_t
+bench_packed(void)
+{
+	rpc_object_t array;
+	int i;
+
+	array = rpc_array_create();
+	for (i = 0; i < BENCH_PACKED_ITEMS; i++)
+		rpc_array_append_stolen_value(array, rpc_int64_create(i));
+
+	return (array);
+}
+
+static rpc_object_t
+bench_structs(void)
+{
+	rpc_object_t array;
+	rpc_object_t item;
+	int i;
+
+	array = rpc_array_create();
+	for (i = 0; i < BENCH_STRUCT_ITEMS; i++) {
+		item = rpct_new(BENCH_NAMESPACE ".Sample", rpc_object_pack(
+		    "{id:u,name:s,value:d,valid:b,tags:[s,s]}",
+		    (uint64_t)i, "sample", i * 0.5, true, "a", "b"));
+		if (item == NULL) {
+			rpc_release(array);
+			return (NULL);
+		}
+
+		rpc_array_append_stolen_value(array, item);
+	}
+
+	return (array);
+}
+
+static int
+bench_load_types(void)
+{
+	rpc_object_t idl;
+	int ret;
+
+	idl = rpc_serializer_load("yaml", bench_idl, sizeof(bench_idl) - 1);
+	if (idl == NULL)
+		return (-1);
+
+	ret = rpct_read_idl("librpc-serialize-bench", idl);
+	rpc_release(idl);
+	if (ret != 0)
+		return (-1);
+
+	return (rpct_load_types_cached());
+}
+
+static int
+bench_once(const struct bench_op *op, rpc_object_t object,
+    rpc_object_t typed, const void *frame, size_t len)
+{
+	rpc_object_t result;
+	void *buf;
+	size_t size;
+
+	if (op->bo_typing) {
+		result = op->bo_load ? rpct_deserialize(typed) :
+		    rpct_serialize(object);
+		if (result == NULL)
+			return (-1);
+
+		rpc_release(result);
+		return (0);
+	}
+
+	if (op->bo_load) {
+		result = rpc_serializer_load(op->bo_serializer, frame, len);
+		if (result == NULL)
+			return (-1);
+
+		rpc_release(result);
+		return (0);
+	}
+
+	if (rpc_serializer_dump(op->bo_serializer, object, &buf, &size) != 0)
+		return (-1);
+
+	free(buf);
+	return (0);
+}
+
+static rpc_object_t
+bench_run(const struct bench_shape *shape, const struct bench_op *op,
+    rpc_object_t object)
+{
+	rpc_object_t result;
+	rpc_object_t typed;
+	void *frame = NULL;
+	size_t len = 0;
+	uint64_t start;
+	uint64_t elapsed;
+	uint64_t allocs;
+	uint64_t iters = 0;
+	uint64_t batch = 1;
+	uint64_t i;
+
+	typed = rpct_serialize(object);
+	if (typed == NULL)
+		goto error;
+
+	if (op->bo_serializer != NULL &&
+	    rpc_serializer_dump(op->bo_serializer, object, &frame, &len) != 0)
+		goto error;
+
+	/* Warm up caches and lazily loaded types */
+	if (bench_once(op, object, typed, frame, len) != 0)
+		goto error;
+
+	allocs = atomic_load(&bench_allocs);
+	start = bench_now();
+
+	/* Grow the batch until a run takes at least mintime seconds */
+	for (;;) {
+		for (i = 0; i < batch; i++) {
+			if (bench_once(op, object, typed, frame, len) != 0)
+				goto error;
+		}
+
+		iters += batch;
+		elapsed = bench_now() - start;
+		if (elapsed >= mintime * 1E9)
+			break;
+
+		batch *= 2;
+	}
+
+	allocs = atomic_load(&bench_allocs) - allocs;
+
+	result = rpc_dictionary_create();
+	rpc_dictionary_set_string(result, "shape", shape->bs_name);
+	rpc_dictionary_set_string(result, "op", op->bo_name);
+	rpc_dictionary_set_uint64(result, "iterations", iters);
+	rpc_dictionary_set_double(result, "ns_per_op", (double)elapsed / iters);
+	rpc_dictionary_set_double(result, "ops_per_s", iters / (elapsed / 1E9));
+	rpc_dictionary_set_double(result, "allocs_per_op",
+	    (double)allocs / iters);
+	if (op->bo_serializer != NULL)
+		rpc_dictionary_set_uint64(result, "encoded_bytes", len);
+
+	if (!quiet) {
+		printf("%-8s %-18s %12.1f ns/op %10.1f allocs/op", shape->bs_name,
+		    op->bo_name, (double)elapsed / iters, (double)allocs / iters);
+		if (op->bo_serializer != NULL)
+			printf(" %8zu bytes", len);
+
+		printf("\n");
+	}
+
+	free(frame);
+	rpc_release(typed);
+	return (result);
+
+error:
+	fprintf(stderr, "%s/%s failed: %s\n", shape->bs_name, op->bo_name,
+	    rpc_get_last_error() != NULL ?
+	    rpc_error_get_message(rpc_get_last_error()) : "unknown error");
+	free(frame);
+	if (typed != NULL)
+		rpc_release(typed);
+
+	return (NULL);
+}
+
+void
+usage(const char *argv0)
+{
+
+	fprintf(stderr, "Usage: %s [-t MINTIME] [-o FILE] [-q]\n", argv0);
+	fprintf(stderr, "       %s -h\n", argv0);
+}
+
+int
+main(int argc, char * const argv[])
+{
+	const struct bench_shape *shape;
+	const struct bench_op *op;
+	rpc_object_t object;
+	rpc_object_t result;
+	rpc_object_t results;
+	const char *output = NULL;
+	void *buf;
+	size_t len;
+	FILE *f;
+	int c;
+
+	for (;;) {
+		c = getopt(argc, argv, "t:o:qh");
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 't':
+			mintime = strtod(optarg, NULL);
+			break;
+
+		case 'o':
+			output = optarg;
+			break;
+
+		case 'q':
+			quiet = true;
+			break;
+
+		case 'h':
+			usage(argv[0]);
+			return (EXIT_SUCCESS);
+
+		default:
+			usage(argv[0]);
+			return (EXIT_FAILURE);
+		}
+	}
+
+	if (rpct_init(true) != 0 || bench_load_types() != 0) {
+		fprintf(stderr, "Cannot load benchmark types: %s\n",
+		    rpc_error_get_message(rpc_get_last_error()));
+		return (EXIT_FAILURE);
+	}
+
+	results = rpc_array_create();
+
+	for (shape = bench_shapes; shape->bs_name; shape++) {
+		object = shape->bs_create();
+		if (object == NULL) {
+			fprintf(stderr, "Cannot create %s: %s\n", shape->bs_name,
+			    rpc_error_get_message(rpc_get_last_error()));
+			continue;
+		}
+
+		for (op = bench_ops; op->bo_name; op++) {
+			result = bench_run(shape, op, object);
+			if (result != NULL)
+				rpc_array_append_stolen_value(results, result);
+		}
+
+		rpc_release(object);
+	}
+
+	if (output != NULL) {
+		if (rpc_serializer_dump("json", results, &buf, &len) != 0) {
+			fprintf(stderr, "Cannot serialize results: %s\n",
+			    rpc_error_get_message(rpc_get_last_error()));
+			return (EXIT_FAILURE);
+		}
+
+		f = fopen(output, "w");
+		if (f == NULL) {
+			fprintf(stderr, "Cannot open %s: %s\n", output,
+			    strerror(errno));
+			return (EXIT_FAILURE);
+		}
+
+		fwrite(buf, 1, len, f);
+		fputc('\n', f);
+		fclose(f);
+		free(buf);
+	}
+
+	rpc_release(results);
+	return (EXIT_SUCCESS);
+}
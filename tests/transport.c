@@ -28,12 +28,60 @@
 #include "tests.h"
 #include "../src/linker_set.h"
 #include <glib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <rpc/object.h>
+#include <rpc/connection.h>
+#include <rpc/client.h>
+#include <rpc/server.h>
+#include <rpc/service.h>
 
+#define	LARGE_PAYLOAD	(3 * 1024 * 1024)
+#define	CALL_THREADS	8
+#define	THREAD_CALLS	200
+#define	EVENTS		500
+#define	MUX_CLIENTS	8
+
+struct transport_uri
+{
+	const char *	srv;
+	const char *	cli;
+	bool		fds;
+};
+
+static const struct transport_uri loopback_uri = {
+	"loopback://35", "loopback://35", false
+};
+
+static const struct transport_uri mux_uri = {
+	"mux+unix://mux-test.sock", "mux+unix://mux-test.sock", true
+};
+
+#if defined(__linux__)
+static const struct transport_uri shm_uri = {
+	"shm://shm-test.sock", "shm://shm-test.sock", true
+};
+#endif
 
 typedef struct {
 
 } transport_fixture;
 
+typedef struct {
+	rpc_context_t			ctx;
+	rpc_server_t			srv;
+	const struct transport_uri *	uri;
+	volatile gint			events;
+} transport_server_fixture;
+
+struct transport_caller
+{
+	rpc_connection_t		conn;
+	int64_t				index;
+	const char *			uri;
+};
+
 static void
 transport_test(transport_fixture *fixture, gconstpointer user_data)
 {
@@ -52,10 +100,302 @@ transport_test_tear_down(transport_fixture *fixture, gconstpointer user_data)
 
 }
 
+static void
+transport_server_set_up(transport_server_fixture *fixture,
+    gconstpointer user_data)
+{
+	int res;
+
+	fixture->uri = user_data;
+	fixture->ctx = rpc_context_create();
+
+	res = rpc_context_register_block(fixture->ctx, NULL, "echo", NULL,
+	    ^(void *cookie __unused, rpc_object_t args) {
+		return (rpc_retain(args));
+	    });
+	g_assert_cmpint(res, ==, 0);
+
+	/* Writes a line to the descriptor it got, then closes it */
+	res = rpc_context_register_block(fixture->ctx, NULL, "write", NULL,
+	    ^(void *cookie, rpc_object_t args) {
+		const char *line;
+		int fd;
+
+		if (rpc_object_unpack(args, "[f,s]", &fd, &line) < 2) {
+			rpc_function_error(cookie, EINVAL, "Invalid arguments");
+			return ((rpc_object_t)NULL);
+		}
+
+		g_assert_cmpint(write(fd, line, strlen(line)), ==,
+		    strlen(line));
+		close(fd);
+		return (rpc_null_create());
+	    });
+	g_assert_cmpint(res, ==, 0);
+
+	res = rpc_context_register_block(fixture->ctx, NULL, "emit", NULL,
+	    ^(void *cookie __unused, rpc_object_t args) {
+		int64_t i;
+
+		for (i = 0; i < rpc_array_get_int64(args, 0); i++)
+			rpc_server_broadcast_event(fixture->srv, NULL, NULL,
+			    "transport.tick", rpc_int64_create(i));
+
+		return (rpc_null_create());
+	    });
+	g_assert_cmpint(res, ==, 0);
+
+	fixture->srv = rpc_server_create(fixture->uri->srv, fixture->ctx);
+	g_assert_nonnull(fixture->srv);
+	rpc_server_resume(fixture->srv);
+}
+
+static void
+transport_server_tear_down(transport_server_fixture *fixture,
+    gconstpointer user_data)
+{
+
+	rpc_server_close(fixture->srv);
+	rpc_context_unregister_member(fixture->ctx, NULL, "echo");
+	rpc_context_unregister_member(fixture->ctx, NULL, "write");
+	rpc_context_unregister_member(fixture->ctx, NULL, "emit");
+	rpc_context_free(fixture->ctx);
+}
+
+static rpc_object_t
+transport_payload(size_t size)
+{
+	guint8 *data;
+	size_t i;
+
+	data = g_malloc(size);
+	for (i = 0; i < size; i++)
+		data[i] = (guint8)(i * 31 + 7);
+
+	return (rpc_object_pack("{s,i,B,[d,u,b]}",
+	    "name", "payload",
+	    "size", (int64_t)size,
+	    "data", data, size, RPC_BINARY_DESTRUCTOR(g_free),
+	    "list", 3.5, (uint64_t)42, true));
+}
+
+static void
+transport_echo(rpc_connection_t conn, rpc_object_t payload)
+{
+	rpc_object_t result;
+	rpc_call_t call;
+
+	call = rpc_connection_call(conn, NULL, NULL, "echo",
+	    rpc_array_create_ex(&payload, 1, false), NULL);
+	g_assert_nonnull(call);
+	rpc_call_wait(call);
+	g_assert_cmpint(rpc_call_status(call), ==, RPC_CALL_DONE);
+
+	result = rpc_call_result(call);
+	g_assert_cmpuint(rpc_array_get_count(result), ==, 1);
+	g_assert_true(rpc_equal(rpc_array_get_value(result, 0), payload));
+	rpc_call_free(call);
+}
+
+static void
+transport_test_fds(rpc_connection_t conn)
+{
+	rpc_object_t result;
+	char buf[64];
+	ssize_t len;
+	size_t total = 0;
+	int fds[2];
+
+	g_assert_cmpint(pipe(fds), ==, 0);
+	result = rpc_connection_call_simple(conn, "write", "[f,s]", fds[1],
+	    "passed along\n");
+	g_assert_nonnull(result);
+	g_assert_false(rpc_is_error(result));
+	close(fds[1]);
+
+	/* EOF only comes once the server closed its copy too */
+	while ((len = read(fds[0], buf + total, sizeof(buf) - total)) > 0)
+		total += (size_t)len;
+
+	g_assert_cmpint(len, ==, 0);
+	g_assert_cmpuint(total, ==, strlen("passed along\n"));
+	g_assert_true(memcmp(buf, "passed along\n", total) == 0);
+	close(fds[0]);
+}
+
+/*
+ * Small frames, a frame bigger than the ring, which has to go through
+ * it in pieces, and descriptors passed next to a frame.
+ */
+static void
+transport_test_round_trip(transport_server_fixture *fixture,
+    gconstpointer user_data)
+{
+	rpc_client_t client;
+	rpc_connection_t conn;
+	rpc_object_t payload;
+	size_t sizes[] = { 0, 1, 4096, LARGE_PAYLOAD };
+	guint round;
+	guint i;
+
+	client = rpc_client_create(fixture->uri->cli, NULL);
+	g_assert_nonnull(client);
+	conn = rpc_client_get_connection(client);
+
+	for (round = 0; round < 3; round++) {
+		for (i = 0; i < G_N_ELEMENTS(sizes); i++) {
+			payload = transport_payload(sizes[i]);
+			transport_echo(conn, payload);
+			rpc_release(payload);
+		}
+
+		if (fixture->uri->fds)
+			transport_test_fds(conn);
+	}
+
+	rpc_client_close(client);
+}
+
+static gpointer
+transport_caller_thread(gpointer data)
+{
+	struct transport_caller *caller = data;
+	rpc_object_t payload;
+	int64_t i;
+
+	for (i = 0; i < THREAD_CALLS; i++) {
+		payload = rpc_object_pack("[i,i,s]", caller->index, i,
+		    "concurrent");
+		transport_echo(caller->conn, payload);
+		rpc_release(payload);
+	}
+
+	return (NULL);
+}
+
+/*
+ * Calls from several threads on one connection while the server sends
+ * events the other way; every reply has to match its request.
+ */
+static void
+transport_test_concurrent(transport_server_fixture *fixture,
+    gconstpointer user_data)
+{
+	struct transport_caller callers[CALL_THREADS];
+	GThread *threads[CALL_THREADS];
+	rpc_client_t client;
+	rpc_connection_t conn;
+	rpc_object_t result;
+	guint i;
+
+	client = rpc_client_create(fixture->uri->cli, NULL);
+	g_assert_nonnull(client);
+	conn = rpc_client_get_connection(client);
+
+	rpc_connection_register_event_handler(conn, NULL, NULL,
+	    "transport.tick", ^(const char *path __unused,
+	    const char *interface __unused, const char *name __unused,
+	    rpc_object_t args) {
+		g_assert_cmpint(rpc_int64_get_value(args), <, EVENTS);
+		g_atomic_int_inc(&fixture->events);
+	    });
+
+	for (i = 0; i < CALL_THREADS; i++) {
+		callers[i].conn = conn;
+		callers[i].index = i;
+		threads[i] = g_thread_new("caller", transport_caller_thread,
+		    &callers[i]);
+	}
+
+	result = rpc_connection_call_simple(conn, "emit", "[i]",
+	    (int64_t)EVENTS);
+	g_assert_nonnull(result);
+	g_assert_false(rpc_is_error(result));
+
+	for (i = 0; i < CALL_THREADS; i++)
+		g_thread_join(threads[i]);
+
+	for (i = 0; i < 10000 && g_atomic_int_get(&fixture->events) < EVENTS;
+	    i++)
+		g_usleep(1000);
+
+	g_assert_cmpint(g_atomic_int_get(&fixture->events), ==, EVENTS);
+	rpc_client_close(client);
+}
+
+static gpointer
+transport_mux_thread(gpointer data)
+{
+	struct transport_caller *caller = data;
+	rpc_client_t client;
+	rpc_object_t payload;
+	int64_t i;
+
+	client = rpc_client_create(caller->uri, NULL);
+	g_assert_nonnull(client);
+	caller->conn = rpc_client_get_connection(client);
+
+	/* The first client leaves early, the others carry on without it */
+	for (i = 0; i < (caller->index == 0 ? 10 : THREAD_CALLS); i++) {
+		payload = rpc_object_pack("[i,i,s]", caller->index, i,
+		    caller->uri);
+		transport_echo(caller->conn, payload);
+		rpc_release(payload);
+	}
+
+	rpc_client_close(client);
+	return (NULL);
+}
+
+/*
+ * Several clients share one physical connection, each on its own
+ * channel, while a plain client talks to the same server directly.
+ */
+static void
+transport_test_mux_channels(transport_server_fixture *fixture,
+    gconstpointer user_data)
+{
+	struct transport_caller callers[MUX_CLIENTS + 1];
+	GThread *threads[MUX_CLIENTS + 1];
+	guint i;
+
+	for (i = 0; i <= MUX_CLIENTS; i++) {
+		callers[i].index = i;
+		callers[i].uri = i < MUX_CLIENTS ? fixture->uri->cli :
+		    fixture->uri->cli + strlen("mux+");
+		threads[i] = g_thread_new("mux", transport_mux_thread,
+		    &callers[i]);
+	}
+
+	for (i = 0; i <= MUX_CLIENTS; i++)
+		g_thread_join(threads[i]);
+}
+
 static void
 transport_test_register()
 {
 
+	g_test_add("/transport/loopback/round-trip", transport_server_fixture,
+	    &loopback_uri, transport_server_set_up, transport_test_round_trip,
+	    transport_server_tear_down);
+
+	g_test_add("/transport/loopback/concurrent", transport_server_fixture,
+	    &loopback_uri, transport_server_set_up, transport_test_concurrent,
+	    transport_server_tear_down);
+
+	g_test_add("/transport/mux/round-trip", transport_server_fixture,
+	    &mux_uri, transport_server_set_up, transport_test_round_trip,
+	    transport_server_tear_down);
+
+	g_test_add("/transport/mux/channels", transport_server_fixture,
+	    &mux_uri, transport_server_set_up, transport_test_mux_channels,
+	    transport_server_tear_down);
+
+#if defined(__linux__)
+	g_test_add("/transport/shm/round-trip", transport_server_fixture,
+	    &shm_uri, transport_server_set_up, transport_test_round_trip,
+	    transport_server_tear_down);
+#endif
 }
 
 static struct librpc_test transport = {
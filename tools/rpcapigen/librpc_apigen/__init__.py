@@ -48,6 +48,45 @@ def generate_objc(typing):
     )
 
 
+C_BUILTINS = {
+    'bool': ('bool', 'bool'),
+    'int64': ('int64_t', 'int64'),
+    'uint64': ('uint64_t', 'uint64'),
+    'double': ('double', 'double'),
+    'string': ('char *', 'string'),
+}
+
+
+def c_name(name):
+    return name.replace('.', '_')
+
+
+def c_member(member, enums):
+    """Returns (kind, C type) of a struct member."""
+    canonical = member.type.canonical
+    if canonical in C_BUILTINS:
+        return C_BUILTINS[canonical][1], C_BUILTINS[canonical][0]
+
+    if canonical in enums:
+        return 'enum', 'enum {0}'.format(c_name(canonical))
+
+    return 'object', 'rpc_object_t'
+
+
+def generate_c(typing):
+    t = lookup.get_template('c.mako')
+    types = sorted(typing.types, key=lambda t: t.name)
+    enums = [t for t in types if t.is_enum]
+    structs = [t for t in types if t.is_struct and not t.generic]
+    return t.render(
+        enums=enums,
+        structs=structs,
+        enum_names={e.name for e in enums},
+        c_name=c_name,
+        c_member=c_member,
+    )
+
+
 def generate_file(name, contents):
     with open(name, 'w') as f:
         f.write(contents)
@@ -0,0 +1,158 @@
+/*
+ * THIS IS AN AUTOMATICALLY GENERATED FILE - EDITING IT IS FUTILE
+ *
+ * Every IDL struct and enum gets a plain C type and a pair of
+ * straight-line functions converting it to and from the object that
+ * goes on the wire, so callers don't build or walk trees by hand and
+ * nothing is looked up in the type system at run time.
+ */
+
+#ifndef RPCAPIGEN_C_H
+#define RPCAPIGEN_C_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <rpc/object.h>
+#include <rpc/typing.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+% for e in enums:
+<% name = c_name(e.name) %>\
+enum ${name}
+{
+% for m in e.members:
+	${name.upper()}_${m.name.upper()},
+% endfor
+};
+
+static const char *const ${name}_names[] = {
+% for m in e.members:
+	"${m.name}",
+% endfor
+	NULL
+};
+
+static inline rpc_object_t
+${name}_encode(enum ${name} value)
+{
+
+	return (rpc_object_pack("{s,s}",
+	    RPCT_TYPE_FIELD, "${e.name}",
+	    RPCT_VALUE_FIELD, ${name}_names[value]));
+}
+
+static inline int
+${name}_decode(rpc_object_t obj, enum ${name} *value)
+{
+	const char *str;
+	int i;
+
+	str = rpc_get_type(obj) == RPC_TYPE_DICTIONARY
+	    ? rpc_dictionary_get_string(obj, RPCT_VALUE_FIELD)
+	    : rpc_string_get_string_ptr(obj);
+
+	if (str == NULL)
+		return (-1);
+
+	for (i = 0; ${name}_names[i] != NULL; i++) {
+		if (strcmp(${name}_names[i], str) == 0) {
+			*value = (enum ${name})i;
+			return (0);
+		}
+	}
+
+	return (-1);
+}
+
+% endfor
+% for s in structs:
+<% name = c_name(s.name) %>\
+struct ${name}
+{
+% for m in s.members:
+	${c_member(m, enum_names)[1]} ${m.name};
+% endfor
+};
+
+static inline rpc_object_t
+${name}_encode(const struct ${name} *value)
+{
+	rpc_object_t obj;
+
+	obj = rpc_dictionary_create();
+	rpc_dictionary_set_string(obj, RPCT_TYPE_FIELD, "${s.name}");
+% for m in s.members:
+<% kind, ctype = c_member(m, enum_names) %>\
+% if kind == 'enum':
+	rpc_dictionary_steal_value(obj, "${m.name}",
+	    ${c_name(m.type.canonical)}_encode(value->${m.name}));
+% elif kind == 'object':
+	if (value->${m.name} != NULL)
+		rpc_dictionary_set_value(obj, "${m.name}", value->${m.name});
+% elif kind == 'string':
+	if (value->${m.name} != NULL)
+		rpc_dictionary_set_string(obj, "${m.name}", value->${m.name});
+% else:
+	rpc_dictionary_set_${kind}(obj, "${m.name}", value->${m.name});
+% endif
+% endfor
+	return (obj);
+}
+
+static inline int
+${name}_decode(rpc_object_t obj, struct ${name} *value)
+{
+	rpc_object_t v;
+
+	if (rpc_get_type(obj) != RPC_TYPE_DICTIONARY)
+		return (-1);
+
+	memset(value, 0, sizeof(*value));
+% for m in s.members:
+<% kind, ctype = c_member(m, enum_names) %>\
+	v = rpc_dictionary_get_value(obj, "${m.name}");
+% if kind == 'enum':
+	if (v != NULL && ${c_name(m.type.canonical)}_decode(v,
+	    &value->${m.name}) != 0)
+		return (-1);
+% elif kind == 'object':
+	value->${m.name} = v != NULL ? rpc_retain(v) : NULL;
+% elif kind == 'string':
+	if (v != NULL && rpc_string_get_string_ptr(v) != NULL)
+		value->${m.name} = strdup(rpc_string_get_string_ptr(v));
+% else:
+	if (v != NULL)
+		value->${m.name} = rpc_${kind}_get_value(v);
+% endif
+% endfor
+	return (0);
+}
+
+static inline void
+${name}_free(struct ${name} *value)
+{
+
+% for m in s.members:
+<% kind, ctype = c_member(m, enum_names) %>\
+% if kind == 'object':
+	if (value->${m.name} != NULL)
+		rpc_release(value->${m.name});
+% elif kind == 'string':
+	free(value->${m.name});
+% endif
+% endfor
+	memset(value, 0, sizeof(*value));
+}
+
+% endfor
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* RPCAPIGEN_C_H */
@@ -37,10 +37,17 @@ struct rpcd_service
 	const char *	name;
 	const char *	description;
 	const char *	uri;
+	char *		token;		/* Handed out with the direct URI */
+	bool		direct;		/* Clients may bypass rpcd */
 	bool		needs_activation;
+	GQueue		pool;		/* Idle backend clients */
+	GMutex		pool_mtx;
+	guint		pool_size;
+	bool		pool_refilling;
 };
 
 struct rpcd_service *rpcd_find_service(const char *name);
+const char *rpcd_get_broker_uri(void);
 int ws_start(int port);
 
 #endif /* RPCD_INTERNAL_H */
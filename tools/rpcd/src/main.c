@@ -25,9 +25,16 @@
  *
  */
 
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
+
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
 #include <signal.h>
 #include <syslog.h>
 #include <glib.h>
@@ -37,13 +44,25 @@
 #include <rpc/client.h>
 #include <rpc/server.h>
 #include <rpc/serializer.h>
+#include <rpc/rpcd.h>
 #include "internal.h"
 
 static rpc_object_t rpcd_register_service(void *, rpc_object_t);
 static rpc_object_t rpcd_service_connect(void *, rpc_object_t);
+static rpc_object_t rpcd_service_resolve(void *, rpc_object_t);
+static rpc_object_t rpcd_service_publish(void *, rpc_object_t);
+static char *rpcd_token_new(void);
+#if defined(__linux__)
+static int rpcd_service_splice(void *, rpc_connection_t, rpc_client_t);
+static void *rpcd_splice_worker(void *);
+#endif
 static rpc_object_t rpcd_service_unregister(void *, rpc_object_t);
 static rpc_object_t rpcd_service_get_name(void *);
 static rpc_object_t rpcd_service_get_description(void *);
+static void rpcd_service_pool_init(struct rpcd_service *, guint);
+static rpc_client_t rpcd_service_pool_take(struct rpcd_service *);
+static void rpcd_service_pool_refill(gpointer, gpointer);
+static void rpcd_service_pool_drain(struct rpcd_service *);
 
 static rpc_context_t rpcd_context;
 static int rpcd_nservers;
@@ -53,6 +72,7 @@ static int rpcd_log_level;
 static const char **rpcd_service_dirs;
 static const char **rpcd_listen;
 static gboolean rpcd_use_systemd;
+static GThreadPool *rpcd_pool_workers;
 
 static const GOptionEntry rpcd_options[] = {
 	{
@@ -89,6 +109,47 @@ static const GOptionEntry rpcd_options[] = {
 	{ }
 };
 
+/*
+ * Threads connecting pooled backend clients, see rpcd_service_pool_take().
+ */
+#define	RPCD_POOL_WORKERS	2
+
+/*
+ * How long clients may keep connecting to a service directly without
+ * asking rpcd again; unregistering tells them sooner.
+ */
+#define	RPCD_DIRECT_TTL		300
+#define	RPCD_TOKEN_BYTES	16
+
+/*
+ * Events published through rpcd reach subscribers in bursts of up to
+ * this many, delayed by at most RPCD_EVENT_LATENCY milliseconds.
+ */
+#define	RPCD_EVENT_BURST	64
+#define	RPCD_EVENT_LATENCY	2
+
+#if defined(__linux__)
+/*
+ * A client bridged to a service in the kernel: one thread per direction
+ * moves bytes between the two sockets with splice(2) through a pipe,
+ * so they never get copied into rpcd.
+ */
+struct rpcd_bridge
+{
+	int		fds[2];
+	volatile gint	refcnt;
+};
+
+struct rpcd_splice
+{
+	struct rpcd_bridge *bridge;
+	int		from;
+	int		to;
+};
+
+#define	RPCD_SPLICE_CHUNK	(64 * 1024)
+#endif
+
 static const struct rpc_if_member rpcd_vtable[] = {
 	RPC_METHOD(register_service, rpcd_register_service),
 	RPC_MEMBER_END
@@ -98,6 +159,8 @@ static const struct rpc_if_member rpcd_service_vtable[] = {
 	RPC_PROPERTY_RO(name, rpcd_service_get_name),
 	RPC_PROPERTY_RO(description, rpcd_service_get_description),
 	RPC_METHOD(connect, rpcd_service_connect),
+	RPC_METHOD(resolve, rpcd_service_resolve),
+	RPC_METHOD(publish, rpcd_service_publish),
 	RPC_METHOD(unregister, rpcd_service_unregister),
 	RPC_MEMBER_END
 };
@@ -109,6 +172,23 @@ rpcd_find_service(const char *name)
 	return (g_hash_table_lookup(rpcd_services, name));
 }
 
+/*
+ * WebSocket clients subscribing to published events are bridged to
+ * rpcd itself, through the first local socket it listens on.
+ */
+const char *
+rpcd_get_broker_uri(void)
+{
+	const char **uri;
+
+	for (uri = rpcd_listen; uri != NULL && *uri != NULL; uri++) {
+		if (g_str_has_prefix(*uri, "unix://"))
+			return (*uri);
+	}
+
+	return (RPCD_SOCKET_LOCATION);
+}
+
 static rpc_object_t
 rpcd_register_service(void *cookie, rpc_object_t args)
 {
@@ -127,6 +207,8 @@ rpcd_register_service(void *cookie, rpc_object_t args)
 	service->uri = g_strdup(uri);
 	service->name = g_strdup(name);
 	service->description = g_strdup(description);
+	service->token = rpcd_token_new();
+	service->direct = true;
 	service->instance = rpc_instance_new(service, "/%s", name);
 	if (service->instance == NULL) {
 		rpc_function_error_ex(cookie, rpc_get_last_error());
@@ -136,6 +218,7 @@ rpcd_register_service(void *cookie, rpc_object_t args)
 	rpc_instance_register_interface(service->instance,
 	    "com.twoporeguys.rpcd.Service", rpcd_service_vtable, service);
 
+	rpcd_service_pool_init(service, 0);
 	g_hash_table_insert(rpcd_services, g_strdup(service->name), service);
 	rpc_context_register_instance(rpcd_context, service->instance);
 
@@ -160,6 +243,99 @@ rpc_service_handle_error(void *arg, rpc_error_code_t code, rpc_object_t args)
 		rpc_connection_close(arg);
 }
 
+static char *
+rpcd_token_new(void)
+{
+	uint8_t bytes[RPCD_TOKEN_BYTES];
+	ssize_t ret = -1;
+	GString *token;
+	int fd;
+	int i;
+
+	fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+	if (fd >= 0) {
+		ret = read(fd, bytes, sizeof(bytes));
+		close(fd);
+	}
+
+	if (ret != (ssize_t)sizeof(bytes)) {
+		for (i = 0; i < RPCD_TOKEN_BYTES; i++)
+			bytes[i] = (uint8_t)g_random_int();
+	}
+
+	token = g_string_sized_new(RPCD_TOKEN_BYTES * 2);
+	for (i = 0; i < RPCD_TOKEN_BYTES; i++)
+		g_string_append_printf(token, "%02x", bytes[i]);
+
+	return (g_string_free(token, false));
+}
+
+static rpc_object_t
+rpcd_service_resolve(void *cookie, rpc_object_t args __unused)
+{
+	struct rpcd_service *service;
+
+	service = rpc_function_get_arg(cookie);
+	if (!service->direct || service->needs_activation) {
+		rpc_function_error(cookie, ENOTSUP,
+		    "Service has to be reached through rpcd");
+		return (NULL);
+	}
+
+	return (rpc_object_pack("{s,s,i}",
+	    "uri", service->uri,
+	    "token", service->token,
+	    "ttl", (int64_t)RPCD_DIRECT_TTL));
+}
+
+/*
+ * Re-emits events a service hands us from our own context, so that its
+ * subscribers share rpcd's subscription index and serialize-once
+ * delivery instead of the service fanning out to each of them. Event
+ * paths are relative to the service instance.
+ */
+static rpc_object_t
+rpcd_service_publish(void *cookie, rpc_object_t args)
+{
+	struct rpcd_service *service;
+	rpc_object_t events = NULL;
+	__block uint64_t count = 0;
+
+	service = rpc_function_get_arg(cookie);
+	if (rpc_object_unpack(args, "[v]", &events) < 1 ||
+	    rpc_get_type(events) != RPC_TYPE_ARRAY) {
+		rpc_function_error(cookie, EINVAL, "Invalid arguments passed");
+		return (NULL);
+	}
+
+	rpc_array_apply(events, ^(size_t idx __unused, rpc_object_t event) {
+		const char *path;
+		const char *name;
+		rpc_object_t payload;
+		char *fullpath;
+
+		name = rpc_dictionary_get_string(event, "name");
+		path = rpc_dictionary_get_string(event, "path");
+		if (name == NULL || (path != NULL && path[0] != '/'))
+			return ((bool)true);
+
+		payload = rpc_dictionary_get_value(event, "args");
+		payload = payload != NULL ?
+		    rpc_retain(payload) : rpc_null_create();
+
+		fullpath = g_strdup_printf("/%s%s", service->name,
+		    path != NULL ? path : "");
+		rpc_context_emit_event(rpcd_context, fullpath,
+		    rpc_dictionary_get_string(event, "interface"), name,
+		    payload);
+		g_free(fullpath);
+		count++;
+		return ((bool)true);
+	});
+
+	return (rpc_uint64_create(count));
+}
+
 static rpc_object_t
 rpcd_service_connect(void *cookie, rpc_object_t args __unused)
 {
@@ -170,7 +346,7 @@ rpcd_service_connect(void *cookie, rpc_object_t args __unused)
 	int fd;
 
 	service = rpc_function_get_arg(cookie);
-	client = rpc_client_create(service->uri, NULL);
+	client = rpcd_service_pool_take(service);
 	if (client == NULL) {
 		rpc_function_error_ex(cookie, rpc_get_last_error());
 		return (NULL);
@@ -184,6 +360,11 @@ rpcd_service_connect(void *cookie, rpc_object_t args __unused)
 		return (rpc_fd_create(fd));
 	}
 
+#if defined(__linux__)
+	if (rpcd_service_splice(cookie, this_conn, client) == 0)
+		return (RPC_FUNCTION_STILL_RUNNING);
+#endif
+
 	/* Set up bidirectional bridging */
 	rpc_connection_set_raw_message_handler(this_conn,
 	    RPC_RAW_HANDLER(rpcd_service_forward, conn));
@@ -200,6 +381,152 @@ rpcd_service_connect(void *cookie, rpc_object_t args __unused)
 	return (rpc_string_create("BRIDGED"));
 }
 
+#if defined(__linux__)
+static int
+rpcd_write_all(int fd, const void *buf, size_t len)
+{
+	ssize_t ret;
+	size_t done = 0;
+
+	while (done < len) {
+		ret = write(fd, (const char *)buf + done, len - done);
+		if (ret < 0 && errno == EINTR)
+			continue;
+
+		if (ret <= 0)
+			return (-1);
+
+		done += (size_t)ret;
+	}
+
+	return (0);
+}
+
+static int
+rpcd_service_splice(void *cookie, rpc_connection_t this_conn,
+    rpc_client_t client)
+{
+	struct rpcd_bridge *bridge;
+	struct rpcd_splice *dir;
+	void *cpending;
+	void *spending;
+	size_t cpending_len;
+	size_t spending_len;
+	int cfd;
+	int sfd;
+	int i;
+
+	/*
+	 * Only connections of the socket transport can be detached,
+	 * and only then are the frames on both sides framed alike.
+	 * Anything else keeps going through the raw message handlers.
+	 */
+	cfd = rpc_connection_detach(this_conn, &cpending, &cpending_len);
+	if (cfd < 0)
+		return (-1);
+
+	sfd = rpc_connection_detach(rpc_client_get_connection(client),
+	    &spending, &spending_len);
+	if (sfd < 0) {
+		rpc_function_error_ex(cookie, rpc_get_last_error());
+		rpc_client_close(client);
+		rpc_connection_close(this_conn);
+		close(cfd);
+		g_free(cpending);
+		return (0);
+	}
+
+	/* Both readers are stopped, so the response goes out last */
+	rpc_function_respond(cookie, rpc_string_create("BRIDGED"));
+	rpc_client_close(client);
+	rpc_connection_close(this_conn);
+
+	if (rpcd_write_all(sfd, cpending, cpending_len) != 0 ||
+	    rpcd_write_all(cfd, spending, spending_len) != 0) {
+		close(cfd);
+		close(sfd);
+		g_free(cpending);
+		g_free(spending);
+		return (0);
+	}
+
+	g_free(cpending);
+	g_free(spending);
+
+	bridge = g_malloc0(sizeof(*bridge));
+	bridge->fds[0] = cfd;
+	bridge->fds[1] = sfd;
+	bridge->refcnt = 2;
+
+	for (i = 0; i < 2; i++) {
+		dir = g_malloc0(sizeof(*dir));
+		dir->bridge = bridge;
+		dir->from = bridge->fds[i];
+		dir->to = bridge->fds[1 - i];
+		g_thread_unref(g_thread_new("rpcd splice", rpcd_splice_worker,
+		    dir));
+	}
+
+	syslog(LOG_DEBUG, "Bridging fd %d to fd %d in the kernel", cfd, sfd);
+	return (0);
+}
+
+static void *
+rpcd_splice_worker(void *arg)
+{
+	struct rpcd_splice *dir = arg;
+	struct rpcd_bridge *bridge = dir->bridge;
+	ssize_t ret;
+	ssize_t left;
+	int pipefd[2];
+
+	if (pipe2(pipefd, O_CLOEXEC) != 0) {
+		syslog(LOG_WARNING, "Cannot create splice pipe: %s",
+		    strerror(errno));
+		goto done;
+	}
+
+	for (;;) {
+		left = splice(dir->from, NULL, pipefd[1], NULL,
+		    RPCD_SPLICE_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE);
+		if (left < 0 && errno == EINTR)
+			continue;
+
+		if (left <= 0)
+			break;
+
+		while (left > 0) {
+			ret = splice(pipefd[0], NULL, dir->to, NULL,
+			    (size_t)left, SPLICE_F_MOVE | SPLICE_F_MORE);
+			if (ret < 0 && errno == EINTR)
+				continue;
+
+			if (ret <= 0)
+				goto out;
+
+			left -= ret;
+		}
+	}
+
+out:
+	close(pipefd[0]);
+	close(pipefd[1]);
+done:
+	/* Let the other direction run dry, then drop both sockets */
+	shutdown(dir->to, SHUT_WR);
+	shutdown(dir->from, SHUT_RD);
+
+	if (g_atomic_int_dec_and_test(&bridge->refcnt)) {
+		close(bridge->fds[0]);
+		close(bridge->fds[1]);
+		g_free(bridge);
+	}
+
+	g_free(dir);
+	return (NULL);
+}
+#endif
+
 static rpc_object_t
 rpcd_service_unregister(void *cookie, rpc_object_t args __unused)
 {
@@ -209,10 +536,106 @@ rpcd_service_unregister(void *cookie, rpc_object_t args __unused)
 	rpc_context_unregister_instance(rpcd_context,
 	    rpc_instance_get_path(service->instance));
 
+	/* Clients that cached the direct URI have to come back to us */
+	rpc_instance_emit_event(rpc_context_get_root(rpcd_context),
+	    "com.twoporeguys.rpcd.ServiceManager", "service_removed",
+	    rpc_object_pack("{s}", "name", service->name));
+
 	g_hash_table_remove(rpcd_services, service->name);
+	rpcd_service_pool_drain(service);
 	return (NULL);
 }
 
+static void
+rpcd_service_pool_init(struct rpcd_service *service, guint size)
+{
+
+	g_queue_init(&service->pool);
+	g_mutex_init(&service->pool_mtx);
+	service->pool_size = size;
+
+	if (size > 0) {
+		service->pool_refilling = true;
+		g_thread_pool_push(rpcd_pool_workers, service, NULL);
+	}
+}
+
+/*
+ * Hands out a pre-established backend connection if one is idle, which
+ * spares the caller the connect and the client's thread startup, and
+ * schedules a replacement. Falls back to connecting on the spot.
+ */
+static rpc_client_t
+rpcd_service_pool_take(struct rpcd_service *service)
+{
+	rpc_client_t client;
+
+	g_mutex_lock(&service->pool_mtx);
+	while ((client = g_queue_pop_head(&service->pool)) != NULL) {
+		/* The service may have restarted since */
+		if (rpc_connection_is_open(rpc_client_get_connection(client)))
+			break;
+
+		g_mutex_unlock(&service->pool_mtx);
+		rpc_client_close(client);
+		g_mutex_lock(&service->pool_mtx);
+	}
+
+	if (service->pool_size > 0 && !service->pool_refilling) {
+		service->pool_refilling = true;
+		g_thread_pool_push(rpcd_pool_workers, service, NULL);
+	}
+	g_mutex_unlock(&service->pool_mtx);
+
+	if (client != NULL)
+		return (client);
+
+	return (rpc_client_create(service->uri, NULL));
+}
+
+static void
+rpcd_service_pool_refill(gpointer data, gpointer user_data __unused)
+{
+	struct rpcd_service *service = data;
+	rpc_client_t client;
+	rpc_object_t error;
+
+	g_mutex_lock(&service->pool_mtx);
+	while (service->pool.length < service->pool_size) {
+		g_mutex_unlock(&service->pool_mtx);
+		client = rpc_client_create(service->uri, NULL);
+		if (client == NULL) {
+			/* Retried on the next take */
+			error = rpc_get_last_error();
+			syslog(LOG_WARNING, "Cannot pre-connect to %s: %s",
+			    service->name, rpc_error_get_message(error));
+			g_mutex_lock(&service->pool_mtx);
+			break;
+		}
+
+		g_mutex_lock(&service->pool_mtx);
+		g_queue_push_tail(&service->pool, client);
+	}
+
+	service->pool_refilling = false;
+	g_mutex_unlock(&service->pool_mtx);
+}
+
+static void
+rpcd_service_pool_drain(struct rpcd_service *service)
+{
+	rpc_client_t client;
+
+	g_mutex_lock(&service->pool_mtx);
+	service->pool_size = 0;
+	while ((client = g_queue_pop_head(&service->pool)) != NULL) {
+		g_mutex_unlock(&service->pool_mtx);
+		rpc_client_close(client);
+		g_mutex_lock(&service->pool_mtx);
+	}
+	g_mutex_unlock(&service->pool_mtx);
+}
+
 static rpc_object_t
 rpcd_service_get_name(void *cookie)
 {
@@ -240,6 +663,7 @@ rpcd_load_service(const char *path)
 	size_t len;
 	rpc_object_t error;
 	rpc_object_t descriptor;
+	int64_t pool;
 
 	syslog(LOG_NOTICE, "Loading service from %s", path);
 
@@ -267,6 +691,8 @@ rpcd_load_service(const char *path)
 	}
 
 	service->manifest = descriptor;
+	service->token = rpcd_token_new();
+	service->direct = rpc_dictionary_get_bool(descriptor, "direct");
 	service->instance = rpc_instance_new(service, "/%s", service->name);
 	if (service->instance == NULL) {
 		error = rpc_get_last_error();
@@ -279,6 +705,10 @@ rpcd_load_service(const char *path)
 	rpc_instance_register_interface(service->instance,
 	    "com.twoporeguys.rpcd.Service", rpcd_service_vtable, service);
 
+	/* Optional number of backend connections to keep ready */
+	pool = rpc_dictionary_get_int64(descriptor, "pool");
+	rpcd_service_pool_init(service, (guint)MAX(pool, 0));
+
 	g_hash_table_insert(rpcd_services, g_strdup(service->name), service);
 	rpc_context_register_instance(rpcd_context, service->instance);
 	return (0);
@@ -342,6 +772,10 @@ main(int argc, char *argv[])
 
 	rpcd_services = g_hash_table_new(g_str_hash, g_str_equal);
 	rpcd_context = rpc_context_create();
+	rpc_context_set_event_burst(rpcd_context, RPCD_EVENT_BURST,
+	    RPCD_EVENT_LATENCY);
+	rpcd_pool_workers = g_thread_pool_new(rpcd_service_pool_refill, NULL,
+	    RPCD_POOL_WORKERS, false, NULL);
 
 	if (rpcd_use_systemd) {
 		rpcd_nservers = rpc_server_socket_activate(rpcd_context,
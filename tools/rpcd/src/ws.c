@@ -26,6 +26,7 @@
  */
 
 #include <syslog.h>
+#include <unistd.h>
 #include <glib.h>
 #include <libsoup/soup.h>
 #include <rpc/object.h>
@@ -34,9 +35,13 @@
 #include <rpc/service.h>
 #include "internal.h"
 
+#define	WS_MAX_THREADS		4
+
 struct ws_server
 {
 	SoupServer *			server;
+	GMainContext *			context;
+	GMainLoop *			loop;
 };
 
 struct ws_connection
@@ -84,17 +89,26 @@ ws_process_connection(SoupServer *ss __unused,
     SoupClientContext *client __unused, gpointer user_data)
 {
 	struct ws_connection *wsconn;
-	struct rpcd_service *service;
-
-	service = rpcd_find_service(&path[1]);
-	if (service == NULL) {
-		soup_websocket_connection_close(connection,
-		    SOUP_WEBSOCKET_CLOSE_BAD_DATA, "Service not found");
-		return;
+	struct rpcd_service *service = NULL;
+	const char *uri;
+
+	/* The root path talks to rpcd itself, for brokered events */
+	if (path[1] == '\0')
+		uri = rpcd_get_broker_uri();
+	else {
+		service = rpcd_find_service(&path[1]);
+		if (service == NULL) {
+			soup_websocket_connection_close(connection,
+			    SOUP_WEBSOCKET_CLOSE_BAD_DATA,
+			    "Service not found");
+			return;
+		}
+
+		uri = service->uri;
 	}
 
 	wsconn = g_malloc0(sizeof(*wsconn));
-	wsconn->client = rpc_client_create(service->uri, NULL);
+	wsconn->client = rpc_client_create(uri, NULL);
 	wsconn->conn = rpc_client_get_connection(wsconn->client);
 	wsconn->ws_conn = connection;
 
@@ -115,8 +129,18 @@ ws_process_connection(SoupServer *ss __unused,
 	    G_CALLBACK(ws_receive_message), wsconn);
 }
 
-int
-ws_start(int fd)
+static void *
+ws_worker(void *arg)
+{
+	struct ws_server *server = arg;
+
+	g_main_context_push_thread_default(server->context);
+	g_main_loop_run(server->loop);
+	return (NULL);
+}
+
+static struct ws_server *
+ws_server_start(int fd, GMainContext *context)
 {
 	GError *err = NULL;
 	struct ws_server *server;
@@ -129,10 +153,59 @@ ws_start(int fd)
 	soup_server_add_websocket_handler(server->server, NULL, NULL, NULL,
 	    ws_process_connection, server, NULL);
 
-	if (!soup_server_listen_fd(server->server, fd, 0, &err)) {
+	/* The listener attaches to the thread-default main context */
+	if (context != NULL)
+		g_main_context_push_thread_default(context);
+
+	soup_server_listen_fd(server->server, fd, 0, &err);
+
+	if (context != NULL)
+		g_main_context_pop_thread_default(context);
+
+	if (err != NULL) {
 		g_object_unref(server->server);
 		syslog(LOG_EMERG, "Cannot listen on fd %d: %s", fd, err->message);
+		g_error_free(err);
+		g_free(server);
+		return (NULL);
+	}
+
+	server->context = context;
+	return (server);
+}
+
+/*
+ * Besides the main thread, up to WS_MAX_THREADS - 1 extra threads accept
+ * WebSocket connections off the same socket, each serving the ones it
+ * accepted on its own main context.
+ */
+int
+ws_start(int fd)
+{
+	struct ws_server *server;
+	GMainContext *context;
+	guint nthreads;
+	guint i;
+	int dupfd;
+
+	if (ws_server_start(fd, NULL) == NULL)
 		return (-1);
+
+	nthreads = MIN(g_get_num_processors(), WS_MAX_THREADS);
+	for (i = 1; i < nthreads; i++) {
+		dupfd = dup(fd);
+		if (dupfd < 0)
+			break;
+
+		context = g_main_context_new();
+		server = ws_server_start(dupfd, context);
+		if (server == NULL) {
+			g_main_context_unref(context);
+			break;
+		}
+
+		server->loop = g_main_loop_new(context, false);
+		g_thread_new("rpcd ws", ws_worker, server);
 	}
 
 	return (0);
@@ -25,18 +25,24 @@
  *
  */
 
+#include <errno.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdbool.h>
+#include <signal.h>
+#include <pthread.h>
 #include <glib.h>
 #include <rpc/object.h>
 #include <rpc/connection.h>
 #include <rpc/client.h>
+#include <rpc/server.h>
 #include <rpc/service.h>
 #include <rpc/serializer.h>
 #include <rpc/typing.h>
+#include <rpc/trace.h>
 
 #define USAGE_STRING							\
     "Available commands:\n"						\
@@ -45,7 +51,22 @@
     "  call PATH INTERFACE METHOD [ARGUMENTS]\n"			\
     "  get PATH INTERFACE PROPERTY\n"					\
     "  set PATH INTERFACE PROPERTY VALUE\n"				\
-    "  listen PATH\n"
+    "  listen PATH\n"							\
+    "  compile IDL-FILE...\n"						\
+    "  trace [DUMP-FILE]\n"						\
+    "  bench PATH INTERFACE METHOD [ARGUMENTS]\n"			\
+    "  record LISTEN-URI FILE\n"					\
+    "  replay FILE\n"							\
+    "\n"								\
+    "bench issues the call over --connections connections with up to\n"	\
+    "--inflight calls outstanding on each, for --duration seconds.\n"	\
+    "With --qps, calls are started on a fixed schedule and latency\n"	\
+    "counts from the scheduled time, so a stalled server can't hide\n"	\
+    "its own queueing delay.\n"						\
+    "\n"								\
+    "record proxies clients connecting to LISTEN-URI through to the\n"	\
+    "server, saving what they send until interrupted. replay sends\n"	\
+    "it to the server again at the recorded pace times --speed.\n"
 
 static int cmd_tree(int argc, char *argv[]);
 static int cmd_inspect(int argc, char *argv[]);
@@ -53,6 +74,11 @@ static int cmd_call(int argc, char *argv[]);
 static int cmd_get(int argc, char *argv[]);
 static int cmd_set(int argc, char *argv[]);
 static int cmd_listen(int argc, char *argv[]);
+static int cmd_compile(int argc, char *argv[]);
+static int cmd_trace(int argc, char *argv[]);
+static int cmd_bench(int argc, char *argv[]);
+static int cmd_record(int argc, char *argv[]);
+static int cmd_replay(int argc, char *argv[]);
 static void  usage(GOptionContext *);
 
 static const char *server;
@@ -60,6 +86,11 @@ static const char **idls;
 static char **args;
 static bool json;
 static bool yaml;
+static int bench_connections = 1;
+static int bench_inflight = 1;
+static double bench_qps;
+static int bench_duration = 10;
+static double replay_speed = 1;
 
 static struct {
 	const char *name;
@@ -71,6 +102,11 @@ static struct {
 	{ "get", cmd_get },
 	{ "set", cmd_set },
 	{ "listen", cmd_listen },
+	{ "compile", cmd_compile },
+	{ "trace", cmd_trace },
+	{ "bench", cmd_bench },
+	{ "record", cmd_record },
+	{ "replay", cmd_replay },
 	{ }
 };
 
@@ -79,6 +115,16 @@ static GOptionEntry options[] = {
 	{ "json", 'j', 0, G_OPTION_ARG_NONE, &json, "JSON output", NULL },
 	{ "yaml", 'y', 0, G_OPTION_ARG_NONE, &yaml, "YAML output", NULL },
 	{ "idl", 'i', 0, G_OPTION_ARG_STRING_ARRAY, &idls, "IDL files to load", NULL },
+	{ "connections", 'c', 0, G_OPTION_ARG_INT, &bench_connections,
+	    "bench: number of connections", "N" },
+	{ "inflight", 'n', 0, G_OPTION_ARG_INT, &bench_inflight,
+	    "bench: calls in flight per connection", "M" },
+	{ "qps", 'q', 0, G_OPTION_ARG_DOUBLE, &bench_qps,
+	    "bench: target calls per second, 0 for no limit", "QPS" },
+	{ "duration", 'd', 0, G_OPTION_ARG_INT, &bench_duration,
+	    "bench: seconds to run for", "SECONDS" },
+	{ "speed", 'x', 0, G_OPTION_ARG_DOUBLE, &replay_speed,
+	    "replay: pace multiplier, 0 to send as fast as possible", "X" },
 	{ G_OPTION_REMAINING, 0, 0, G_OPTION_ARG_STRING_ARRAY, &args, "", NULL },
 	{ }
 };
@@ -98,6 +144,7 @@ connect(void)
 		exit(1);
 	}
 
+	rpct_set_lazy_loading(true);
 	rpct_init(true);
 
 	if (idls != NULL) {
@@ -425,6 +472,826 @@ cmd_listen(int argc, char *argv[])
 	return (0);
 }
 
+static int
+cmd_compile(int argc, char *argv[])
+{
+	rpc_object_t error;
+	int i;
+	int ret = 0;
+
+	if (argc < 1) {
+		fprintf(stderr, "Not enough arguments provided\n");
+		return (1);
+	}
+
+	for (i = 0; i < argc; i++) {
+		if (rpct_compile_file(argv[i], NULL) != 0) {
+			error = rpc_get_last_error();
+			fprintf(stderr, "Cannot compile %s: %s\n", argv[i],
+			    rpc_error_get_message(error));
+			ret = 1;
+		}
+	}
+
+	return (ret);
+}
+
+/*
+ * Decodes a trace dump read from a file, or fetched from the server
+ * when no file is given.
+ */
+static int
+cmd_trace(int argc, char *argv[])
+{
+	GError *err = NULL;
+	rpc_connection_t conn;
+	rpc_object_t dump = NULL;
+	const struct rpc_trace_header *header;
+	const struct rpc_trace_record *rec;
+	const char *data;
+	gchar *contents = NULL;
+	gsize len;
+	uint64_t i;
+
+	if (argc > 0) {
+		if (!g_file_get_contents(argv[0], &contents, &len, &err)) {
+			fprintf(stderr, "Cannot read %s: %s\n", argv[0],
+			    err->message);
+			g_error_free(err);
+			return (1);
+		}
+
+		data = contents;
+	} else {
+		conn = connect();
+		dump = rpc_connection_call_syncp(conn, "/",
+		    RPC_STATS_INTERFACE, "get_trace", "[]");
+		if (dump == NULL || rpc_get_type(dump) != RPC_TYPE_BINARY) {
+			if (dump != NULL && rpc_is_error(dump))
+				output(dump);
+			else
+				fprintf(stderr, "Server returned no trace\n");
+
+			return (1);
+		}
+
+		/* Binary data may sit unaligned inside the received frame */
+		len = rpc_data_get_length(dump);
+		contents = g_malloc(len);
+		rpc_data_get_bytes(dump, contents, 0, len);
+		data = contents;
+		rpc_release(dump);
+	}
+
+	header = (const struct rpc_trace_header *)data;
+	if (len < sizeof(*header) || header->rth_magic != RPC_TRACE_MAGIC ||
+	    header->rth_version != RPC_TRACE_VERSION ||
+	    header->rth_record_size != sizeof(*rec) ||
+	    (len - sizeof(*header)) / sizeof(*rec) < header->rth_count) {
+		fprintf(stderr, "Not a valid trace dump\n");
+		g_free(contents);
+		return (1);
+	}
+
+	rec = (const struct rpc_trace_record *)(header + 1);
+	for (i = 0; i < header->rth_count; i++, rec++) {
+		printf("%" PRIu64 ".%09" PRIu64 " thread=%u conn=0x%" PRIx64
+		    " %-8s %-20s id=%" PRIu64 " size=%u\n",
+		    rec->rtr_time / 1000000000, rec->rtr_time % 1000000000,
+		    rec->rtr_thread, rec->rtr_conn,
+		    rpc_trace_stage_name(rec->rtr_stage),
+		    rpc_trace_frame_name(rec->rtr_frame),
+		    rec->rtr_call_id, rec->rtr_size);
+	}
+
+	g_free(contents);
+	return (0);
+}
+
+/*
+ * Latencies, in microseconds, go into log-linear buckets: each power
+ * of two is split into 2^BENCH_HIST_SUB_BITS buckets, which keeps the
+ * error under 12.5% at any scale.
+ */
+#define	BENCH_HIST_SUB_BITS	3
+#define	BENCH_HIST_BUCKETS	(64 << BENCH_HIST_SUB_BITS)
+
+struct bench_worker
+{
+	rpc_connection_t	bw_conn;
+	GThread *		bw_thread;
+	GMutex			bw_mtx;
+	GCond			bw_cv;
+	int			bw_inflight;
+	uint64_t		bw_calls;
+	uint64_t		bw_errors;
+	uint64_t		bw_max;
+	uint64_t		bw_hist[BENCH_HIST_BUCKETS];
+};
+
+static const char *bench_path;
+static const char *bench_interface;
+static const char *bench_method;
+static rpc_object_t bench_args;
+static int64_t bench_start;
+
+static unsigned int
+bench_bucket(uint64_t value)
+{
+	unsigned int msb;
+
+	if (value < (1 << BENCH_HIST_SUB_BITS))
+		return ((unsigned int)value);
+
+	msb = g_bit_storage(value) - 1;
+	return (((msb - BENCH_HIST_SUB_BITS + 1) << BENCH_HIST_SUB_BITS) |
+	    ((value >> (msb - BENCH_HIST_SUB_BITS)) &
+	    ((1 << BENCH_HIST_SUB_BITS) - 1)));
+}
+
+/* Smallest value that lands in a bucket */
+static uint64_t
+bench_bucket_value(unsigned int bucket)
+{
+	unsigned int shift = bucket >> BENCH_HIST_SUB_BITS;
+	uint64_t sub = bucket & ((1 << BENCH_HIST_SUB_BITS) - 1);
+
+	if (shift == 0)
+		return (sub);
+
+	return (((1 << BENCH_HIST_SUB_BITS) | sub) << (shift - 1));
+}
+
+static void
+bench_record(struct bench_worker *worker, int64_t start, bool error)
+{
+	uint64_t latency;
+
+	latency = (uint64_t)MAX(g_get_monotonic_time() - start, 0);
+
+	g_mutex_lock(&worker->bw_mtx);
+	worker->bw_calls++;
+	if (error)
+		worker->bw_errors++;
+
+	worker->bw_hist[bench_bucket(latency)]++;
+	worker->bw_max = MAX(worker->bw_max, latency);
+	worker->bw_inflight--;
+	g_cond_signal(&worker->bw_cv);
+	g_mutex_unlock(&worker->bw_mtx);
+}
+
+static void
+bench_await(struct bench_worker *worker, rpc_call_t call, int64_t start)
+{
+	int ret;
+
+	ret = rpc_call_await(call, NULL, ^(rpc_call_t c) {
+		rpc_call_status_t status = rpc_call_status(c);
+
+		/* A streaming call counts as done once fully drained */
+		if (status == RPC_CALL_STREAM_START ||
+		    status == RPC_CALL_MORE_AVAILABLE) {
+			if (rpc_call_continue(c, false) == 0) {
+				bench_await(worker, c, start);
+				return;
+			}
+
+			status = RPC_CALL_ERROR;
+		}
+
+		bench_record(worker, start, status == RPC_CALL_ERROR);
+		rpc_call_free(c);
+	});
+
+	if (ret != 0) {
+		bench_record(worker, start, true);
+		rpc_call_free(call);
+	}
+}
+
+static void *
+bench_run(void *arg)
+{
+	struct bench_worker *worker = arg;
+	rpc_call_t call;
+	int64_t interval = 0;
+	int64_t deadline;
+	int64_t start;
+	int64_t now;
+	uint64_t seq;
+
+	if (bench_qps > 0)
+		interval = (int64_t)(G_USEC_PER_SEC * bench_connections /
+		    bench_qps);
+
+	deadline = bench_start + (int64_t)bench_duration * G_USEC_PER_SEC;
+
+	for (seq = 0;; seq++) {
+		now = g_get_monotonic_time();
+		start = now;
+
+		/*
+		 * Open loop: every call has a slot on the schedule and its
+		 * latency counts from that slot, however late it goes out.
+		 */
+		if (interval > 0) {
+			start = bench_start + (int64_t)seq * interval;
+			if (start > now)
+				g_usleep((gulong)(start - now));
+		}
+
+		if (start >= deadline)
+			break;
+
+		g_mutex_lock(&worker->bw_mtx);
+		while (worker->bw_inflight >= bench_inflight)
+			g_cond_wait(&worker->bw_cv, &worker->bw_mtx);
+
+		worker->bw_inflight++;
+		g_mutex_unlock(&worker->bw_mtx);
+
+		if (interval == 0)
+			start = g_get_monotonic_time();
+
+		call = rpc_connection_call(worker->bw_conn, bench_path,
+		    bench_interface, bench_method, bench_args, NULL);
+		if (call == NULL) {
+			bench_record(worker, start, true);
+			continue;
+		}
+
+		bench_await(worker, call, start);
+	}
+
+	g_mutex_lock(&worker->bw_mtx);
+	while (worker->bw_inflight > 0)
+		g_cond_wait(&worker->bw_cv, &worker->bw_mtx);
+	g_mutex_unlock(&worker->bw_mtx);
+
+	return (NULL);
+}
+
+static uint64_t
+bench_percentile(const uint64_t *hist, uint64_t total, double pct)
+{
+	uint64_t rank;
+	uint64_t seen = 0;
+	unsigned int i;
+
+	rank = (uint64_t)(total * pct / 100);
+	for (i = 0; i < BENCH_HIST_BUCKETS - 1; i++) {
+		seen += hist[i];
+		if (seen > rank)
+			return (bench_bucket_value(i + 1) - 1);
+	}
+
+	return (bench_bucket_value(BENCH_HIST_BUCKETS - 1));
+}
+
+static void
+bench_report(struct bench_worker *workers, int nworkers, double elapsed)
+{
+	static const double pcts[] = { 50, 90, 99, 99.9, 99.99 };
+	uint64_t hist[BENCH_HIST_BUCKETS] = { 0 };
+	uint64_t octave;
+	uint64_t peak = 0;
+	uint64_t calls = 0;
+	uint64_t errors = 0;
+	uint64_t max = 0;
+	unsigned int i;
+	unsigned int j;
+	int k;
+
+	for (k = 0; k < nworkers; k++) {
+		calls += workers[k].bw_calls;
+		errors += workers[k].bw_errors;
+		max = MAX(max, workers[k].bw_max);
+		for (i = 0; i < BENCH_HIST_BUCKETS; i++)
+			hist[i] += workers[k].bw_hist[i];
+	}
+
+	printf("Calls:      %" PRIu64 " (%" PRIu64 " failed)\n", calls, errors);
+	printf("Elapsed:    %.3f s\n", elapsed);
+	printf("Throughput: %.1f calls/s\n", elapsed > 0 ? calls / elapsed : 0);
+
+	if (calls == 0)
+		return;
+
+	printf("Latency (us):\n");
+	for (i = 0; i < G_N_ELEMENTS(pcts); i++) {
+		printf("  p%-6g %" PRIu64 "\n", pcts[i],
+		    bench_percentile(hist, calls, pcts[i]));
+	}
+
+	printf("  max     %" PRIu64 "\n", max);
+	printf("Histogram (us):\n");
+
+	/* Printed one power of two per line */
+	for (i = 0; i < BENCH_HIST_BUCKETS; i += 1 << BENCH_HIST_SUB_BITS) {
+		for (j = 0, octave = 0; j < (1 << BENCH_HIST_SUB_BITS); j++)
+			octave += hist[i + j];
+
+		peak = MAX(peak, octave);
+	}
+
+	for (i = 0; i < BENCH_HIST_BUCKETS; i += 1 << BENCH_HIST_SUB_BITS) {
+		for (j = 0, octave = 0; j < (1 << BENCH_HIST_SUB_BITS); j++)
+			octave += hist[i + j];
+
+		if (octave == 0)
+			continue;
+
+		printf("  < %-10" PRIu64 " %10" PRIu64 " %.*s\n",
+		    bench_bucket_value(i + (1 << BENCH_HIST_SUB_BITS)), octave,
+		    (int)(octave * 50 / peak),
+		    "##################################################");
+	}
+}
+
+static int
+cmd_bench(int argc, char *argv[])
+{
+	struct bench_worker *workers;
+	rpc_client_t client;
+	rpc_object_t error;
+	int64_t end;
+	int i;
+
+	if (argc < 3) {
+		fprintf(stderr, "Not enough arguments provided\n");
+		return (1);
+	}
+
+	if (bench_connections < 1 || bench_inflight < 1 ||
+	    bench_duration < 1 || bench_qps < 0) {
+		fprintf(stderr, "Invalid benchmark parameters\n");
+		return (1);
+	}
+
+	bench_args = rpc_serializer_load("json", argc > 3 ? argv[3] : "[]",
+	    strlen(argc > 3 ? argv[3] : "[]"));
+	if (bench_args == NULL) {
+		error = rpc_get_last_error();
+		fprintf(stderr, "Cannot read input: %s\n",
+		    rpc_error_get_message(error));
+		return (1);
+	}
+
+	bench_path = argv[0];
+	bench_interface = argv[1];
+	bench_method = argv[2];
+	workers = g_malloc0_n((gsize)bench_connections, sizeof(*workers));
+
+	for (i = 0; i < bench_connections; i++) {
+		if (i == 0)
+			workers[i].bw_conn = connect();
+		else {
+			client = rpc_client_create(server, NULL);
+			if (client == NULL) {
+				error = rpc_get_last_error();
+				fprintf(stderr, "Cannot connect: %s\n",
+				    rpc_error_get_message(error));
+				exit(1);
+			}
+
+			workers[i].bw_conn = rpc_client_get_connection(client);
+		}
+
+		g_mutex_init(&workers[i].bw_mtx);
+		g_cond_init(&workers[i].bw_cv);
+	}
+
+	bench_start = g_get_monotonic_time();
+	for (i = 0; i < bench_connections; i++) {
+		workers[i].bw_thread = g_thread_new("bench", bench_run,
+		    &workers[i]);
+	}
+
+	for (i = 0; i < bench_connections; i++)
+		g_thread_join(workers[i].bw_thread);
+
+	end = g_get_monotonic_time();
+	bench_report(workers, bench_connections,
+	    (double)(end - bench_start) / G_USEC_PER_SEC);
+
+	rpc_release(bench_args);
+	g_free(workers);
+	return (0);
+}
+
+/*
+ * Recordings hold what clients sent, frame by frame: a header, then
+ * for every frame a record_entry followed by its bytes. Entries are
+ * not aligned and have to be copied out before use.
+ */
+#define	RECORD_MAGIC	0x52504352	/* "RPCR" */
+#define	RECORD_VERSION	1
+
+struct record_header
+{
+	uint32_t	rh_magic;
+	uint32_t	rh_version;
+};
+
+struct record_entry
+{
+	uint64_t	re_time;	/* usecs since the recording started */
+	uint32_t	re_conn;	/* sequence number of the client */
+	uint32_t	re_len;
+};
+
+struct replay_conn
+{
+	rpc_connection_t	rpl_conn;
+	GThread *		rpl_thread;
+	GArray *		rpl_frames;	/* offsets into the file */
+	GHashTable *		rpl_pending;	/* call id -> send time */
+	int64_t			rpl_lag;
+};
+
+static FILE *record_file;
+static GMutex record_mtx;
+static GHashTable *record_upstreams;
+static int64_t record_start;
+static uint32_t record_clients;
+static gchar *replay_data;
+static struct bench_worker replay_stats;
+
+static void
+record_frame(uint32_t client, const void *msg, size_t len)
+{
+	struct record_entry entry;
+
+	entry.re_conn = client;
+	entry.re_len = (uint32_t)len;
+
+	g_mutex_lock(&record_mtx);
+	entry.re_time = (uint64_t)(g_get_monotonic_time() - record_start);
+	if (fwrite(&entry, sizeof(entry), 1, record_file) != 1 ||
+	    fwrite(msg, len, 1, record_file) != 1)
+		fprintf(stderr, "Cannot write recording\n");
+	g_mutex_unlock(&record_mtx);
+}
+
+static void
+record_connect(rpc_connection_t conn)
+{
+	rpc_connection_t upstream_conn;
+	rpc_client_t upstream;
+	rpc_object_t error;
+	uint32_t client;
+
+	upstream = rpc_client_create(server, NULL);
+	if (upstream == NULL) {
+		error = rpc_get_last_error();
+		fprintf(stderr, "Cannot connect upstream: %s\n",
+		    rpc_error_get_message(error));
+		rpc_connection_close(conn);
+		return;
+	}
+
+	g_mutex_lock(&record_mtx);
+	client = record_clients++;
+	g_hash_table_insert(record_upstreams, conn, upstream);
+	g_mutex_unlock(&record_mtx);
+
+	/* Frames are passed through untouched, in both directions */
+	upstream_conn = rpc_client_get_connection(upstream);
+	rpc_connection_set_raw_message_handler(upstream_conn,
+	    ^(const void *msg, size_t len, const int *fds, size_t nfds) {
+		return (rpc_connection_send_raw_message(conn, msg, len, fds,
+		    nfds));
+	});
+
+	rpc_connection_set_raw_message_handler(conn,
+	    ^(const void *msg, size_t len, const int *fds, size_t nfds) {
+		record_frame(client, msg, len);
+		return (rpc_connection_send_raw_message(upstream_conn, msg,
+		    len, fds, nfds));
+	});
+}
+
+static void
+record_disconnect(rpc_connection_t conn)
+{
+	rpc_client_t upstream;
+
+	g_mutex_lock(&record_mtx);
+	upstream = g_hash_table_lookup(record_upstreams, conn);
+	g_hash_table_remove(record_upstreams, conn);
+	g_mutex_unlock(&record_mtx);
+
+	if (upstream != NULL)
+		rpc_client_close(upstream);
+}
+
+static int
+cmd_record(int argc, char *argv[])
+{
+	struct record_header header = { RECORD_MAGIC, RECORD_VERSION };
+	rpc_context_t context;
+	rpc_server_t srv;
+	rpc_object_t error;
+	sigset_t set;
+	int sig;
+
+	if (argc < 2) {
+		fprintf(stderr, "Not enough arguments provided\n");
+		return (1);
+	}
+
+	if (server == NULL)
+		server = getenv("LIBRPC_SERVER");
+
+	if (server == NULL) {
+		fprintf(stderr, "Server URI not provided\n");
+		return (1);
+	}
+
+	record_file = fopen(argv[1], "wb");
+	if (record_file == NULL) {
+		fprintf(stderr, "Cannot open %s: %s\n", argv[1],
+		    strerror(errno));
+		return (1);
+	}
+
+	if (fwrite(&header, sizeof(header), 1, record_file) != 1) {
+		fprintf(stderr, "Cannot write recording\n");
+		fclose(record_file);
+		return (1);
+	}
+
+	/* Blocked before any librpc thread exists, so they inherit it */
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	record_upstreams = g_hash_table_new(NULL, NULL);
+	record_start = g_get_monotonic_time();
+	context = rpc_context_create();
+	srv = rpc_server_create(argv[0], context);
+	if (srv == NULL) {
+		error = rpc_get_last_error();
+		fprintf(stderr, "Cannot listen on %s: %s\n", argv[0],
+		    rpc_error_get_message(error));
+		fclose(record_file);
+		return (1);
+	}
+
+	rpc_server_set_event_handler(srv,
+	    ^(rpc_connection_t conn, rpc_server_event_t event) {
+		if (event == RPC_SERVER_CLIENT_CONNECT)
+			record_connect(conn);
+		else if (event == RPC_SERVER_CLIENT_DISCONNECT)
+			record_disconnect(conn);
+	});
+
+	fprintf(stderr, "Recording, interrupt to stop\n");
+	sigwait(&set, &sig);
+
+	rpc_server_close(srv);
+	g_mutex_lock(&record_mtx);
+	fclose(record_file);
+	record_file = NULL;
+	fprintf(stderr, "Recorded traffic of %u clients\n", record_clients);
+	g_mutex_unlock(&record_mtx);
+	return (0);
+}
+
+/*
+ * Calls are matched with their responses by id to time them; frames
+ * that don't decode, like compressed ones, are sent but not timed.
+ */
+static const char *
+replay_frame_id(rpc_object_t frame, const char **name)
+{
+	rpc_object_t id;
+
+	if (frame == NULL || rpc_get_type(frame) != RPC_TYPE_DICTIONARY ||
+	    g_strcmp0(rpc_dictionary_get_string(frame, "namespace"), "rpc"))
+		return (NULL);
+
+	id = rpc_dictionary_get_value(frame, "id");
+	if (id == NULL || rpc_get_type(id) != RPC_TYPE_STRING)
+		return (NULL);
+
+	*name = rpc_dictionary_get_string(frame, "name");
+	return (rpc_string_get_string_ptr(id));
+}
+
+static int
+replay_response(struct replay_conn *rconn, const void *msg, size_t len)
+{
+	rpc_object_t frame;
+	const char *name = NULL;
+	const char *id;
+	gpointer start;
+
+	frame = rpc_serializer_load("msgpack", msg, len);
+	id = replay_frame_id(frame, &name);
+	if (id == NULL || (g_strcmp0(name, "response") &&
+	    g_strcmp0(name, "error") && g_strcmp0(name, "end"))) {
+		rpc_release(frame);
+		return (0);
+	}
+
+	g_mutex_lock(&replay_stats.bw_mtx);
+	start = g_hash_table_lookup(rconn->rpl_pending, id);
+	if (start != NULL)
+		g_hash_table_remove(rconn->rpl_pending, id);
+	g_mutex_unlock(&replay_stats.bw_mtx);
+
+	if (start != NULL)
+		bench_record(&replay_stats, GPOINTER_TO_SIZE(start),
+		    !g_strcmp0(name, "error"));
+
+	rpc_release(frame);
+	return (0);
+}
+
+static void *
+replay_run(void *arg)
+{
+	struct replay_conn *rconn = arg;
+	struct record_entry entry;
+	rpc_object_t frame;
+	const char *name;
+	const char *id;
+	const char *data;
+	int64_t due;
+	int64_t now;
+	guint i;
+
+	for (i = 0; i < rconn->rpl_frames->len; i++) {
+		data = replay_data + g_array_index(rconn->rpl_frames, gsize, i);
+		memcpy(&entry, data, sizeof(entry));
+		data += sizeof(entry);
+
+		now = g_get_monotonic_time();
+		if (replay_speed > 0) {
+			due = bench_start +
+			    (int64_t)(entry.re_time / replay_speed);
+			if (due > now)
+				g_usleep((gulong)(due - now));
+			else
+				rconn->rpl_lag = MAX(rconn->rpl_lag, now - due);
+		}
+
+		frame = rpc_serializer_load("msgpack", data, entry.re_len);
+		id = replay_frame_id(frame, &name);
+		if (id != NULL && !g_strcmp0(name, "call")) {
+			g_mutex_lock(&replay_stats.bw_mtx);
+			g_hash_table_insert(rconn->rpl_pending, g_strdup(id),
+			    GSIZE_TO_POINTER(g_get_monotonic_time()));
+			replay_stats.bw_inflight++;
+			g_mutex_unlock(&replay_stats.bw_mtx);
+		}
+
+		rpc_release(frame);
+		if (rpc_connection_send_raw_message(rconn->rpl_conn, data,
+		    entry.re_len, NULL, 0) != 0) {
+			fprintf(stderr, "Cannot send frame\n");
+			break;
+		}
+	}
+
+	return (NULL);
+}
+
+static int
+cmd_replay(int argc, char *argv[])
+{
+	GError *err = NULL;
+	GHashTable *conns;
+	GHashTableIter iter;
+	struct record_header header;
+	struct record_entry entry;
+	struct replay_conn *rconn;
+	rpc_client_t client;
+	rpc_object_t error;
+	gpointer value;
+	int64_t deadline;
+	int64_t lag = 0;
+	gsize offset;
+	gsize len;
+	uint64_t frames = 0;
+
+	if (argc < 1) {
+		fprintf(stderr, "Not enough arguments provided\n");
+		return (1);
+	}
+
+	if (replay_speed < 0) {
+		fprintf(stderr, "Invalid replay speed\n");
+		return (1);
+	}
+
+	if (!g_file_get_contents(argv[0], &replay_data, &len, &err)) {
+		fprintf(stderr, "Cannot read %s: %s\n", argv[0], err->message);
+		g_error_free(err);
+		return (1);
+	}
+
+	if (len >= sizeof(header))
+		memcpy(&header, replay_data, sizeof(header));
+
+	if (len < sizeof(header) || header.rh_magic != RECORD_MAGIC ||
+	    header.rh_version != RECORD_VERSION) {
+		fprintf(stderr, "Not a valid recording\n");
+		g_free(replay_data);
+		return (1);
+	}
+
+	/* Every recorded client gets a connection of its own */
+	conns = g_hash_table_new(NULL, NULL);
+	for (offset = sizeof(header); offset + sizeof(entry) <= len;
+	    offset += sizeof(entry) + entry.re_len) {
+		memcpy(&entry, replay_data + offset, sizeof(entry));
+		if (entry.re_len > len - offset - sizeof(entry))
+			break;
+
+		rconn = g_hash_table_lookup(conns,
+		    GUINT_TO_POINTER(entry.re_conn + 1));
+		if (rconn == NULL) {
+			rconn = g_malloc0(sizeof(*rconn));
+			rconn->rpl_frames = g_array_new(false, false,
+			    sizeof(gsize));
+			rconn->rpl_pending = g_hash_table_new_full(g_str_hash,
+			    g_str_equal, g_free, NULL);
+			g_hash_table_insert(conns,
+			    GUINT_TO_POINTER(entry.re_conn + 1), rconn);
+		}
+
+		g_array_append_val(rconn->rpl_frames, offset);
+		frames++;
+	}
+
+	if (server == NULL)
+		server = getenv("LIBRPC_SERVER");
+
+	if (server == NULL) {
+		fprintf(stderr, "Server URI not provided\n");
+		return (1);
+	}
+
+	g_mutex_init(&replay_stats.bw_mtx);
+	g_cond_init(&replay_stats.bw_cv);
+
+	g_hash_table_iter_init(&iter, conns);
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		rconn = value;
+		client = rpc_client_create(server, NULL);
+		if (client == NULL) {
+			error = rpc_get_last_error();
+			fprintf(stderr, "Cannot connect: %s\n",
+			    rpc_error_get_message(error));
+			return (1);
+		}
+
+		rconn->rpl_conn = rpc_client_get_connection(client);
+		rpc_connection_set_raw_message_handler(rconn->rpl_conn,
+		    ^(const void *msg, size_t mlen, const int *fds,
+		    size_t nfds) {
+			return (replay_response(rconn, msg, mlen));
+		});
+	}
+
+	bench_start = g_get_monotonic_time();
+	g_hash_table_iter_init(&iter, conns);
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		rconn = value;
+		rconn->rpl_thread = g_thread_new("replay", replay_run, rconn);
+	}
+
+	g_hash_table_iter_init(&iter, conns);
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		rconn = value;
+		g_thread_join(rconn->rpl_thread);
+		lag = MAX(lag, rconn->rpl_lag);
+	}
+
+	/* Give outstanding calls a while to come back */
+	deadline = g_get_monotonic_time() + 10 * G_USEC_PER_SEC;
+	g_mutex_lock(&replay_stats.bw_mtx);
+	while (replay_stats.bw_inflight > 0) {
+		if (!g_cond_wait_until(&replay_stats.bw_cv,
+		    &replay_stats.bw_mtx, deadline))
+			break;
+	}
+	g_mutex_unlock(&replay_stats.bw_mtx);
+
+	printf("Frames:     %" PRIu64 " over %u connections\n", frames,
+	    g_hash_table_size(conns));
+	printf("Unanswered: %d\n", replay_stats.bw_inflight);
+	printf("Max lag:    %" PRId64 " us behind schedule\n", lag);
+	bench_report(&replay_stats, 1,
+	    (double)(g_get_monotonic_time() - bench_start) / G_USEC_PER_SEC);
+
+	return (0);
+}
+
 static void
 usage(GOptionContext *context)
 {